@@ -0,0 +1,210 @@
+#!/bin/sh
+# run bench and ping modes on several nodes at once and merge the results
+#
+# usage: bench-nodes.sh [-s] [-b] [-w SECONDS] [-o REPORT] [-l LOGDIR] NODES
+#
+# Each line of the NODES file holds the SSH destination of a node
+# followed by the command to run there, relative to the tree:
+#
+#   pi@192.168.1.11 hybrid/hybrid-bench -n 100 -d 0002 0001 /dev/ttyUSB0 /dev/ttyUSB1
+#   pi@192.168.1.12 hybrid/hybrid-ping -e 0002 /dev/ttyUSB0 /dev/ttyUSB1
+#
+# Bench commands are the senders. They all start at the same wall
+# clock time (the clocks of the nodes must be synchronized, with NTP
+# for instance) and append their CSV summary to a file labelled with
+# the node. The other commands (echo peers, receivers) start first and
+# are stopped once every sender is done.
+#
+#   -s  copy the tree to the nodes and build it first
+#   -b  run each sender alone first, to measure the contention
+#   -w  seconds from the launch to the start (default: 10)
+#   -o  report file (default: bench-nodes.csv)
+#   -l  directory of the output of each node (default: bench-nodes.logs)
+#
+# The report has one row per sender and a TOTAL row with the aggregate
+# goodput, that is the bytes of all the senders over the longest run.
+# With -b each row also has the goodput of the sender alone and the
+# ratio of both.
+#
+# Set SSH and RSYNC to change the commands used to reach the nodes and
+# REMOTE_DIR to change the directory of the tree on the nodes.
+
+SSH=${SSH:-ssh}
+RSYNC=${RSYNC:-rsync}
+REMOTE_DIR=${REMOTE_DIR:-.}
+
+sync=
+baseline=
+wait=10
+report=bench-nodes.csv
+logdir=bench-nodes.logs
+
+usage()
+{
+	echo "usage: $0 [-s] [-b] [-w SECONDS] [-o REPORT] [-l LOGDIR] NODES" >&2
+	exit 1
+}
+
+while getopts sbw:o:l: opt
+do
+	case $opt in
+	s) sync=1 ;;
+	b) baseline=1 ;;
+	w) wait=$OPTARG ;;
+	o) report=$OPTARG ;;
+	l) logdir=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+shift $(($OPTIND - 1))
+[ $# -eq 1 ] || usage
+nodes=$1
+[ -r "$nodes" ] || { echo "$0: cannot read $nodes" >&2; exit 1; }
+
+mkdir -p "$logdir" || exit 1
+tmp=/tmp/bench-nodes.$$
+trap 'rm -f $tmp.*' EXIT
+
+# node lines without comments and blank lines
+grep -v '^[[:space:]]*\(#\|$\)' "$nodes" > $tmp.nodes
+
+# the tree is at the root of this script's repository
+tree=$(cd "$(dirname "$0")/../.." && pwd)
+
+if [ -n "$sync" ]
+then
+	for host in $(cut -d ' ' -f 1 $tmp.nodes | sort -u)
+	do
+		echo "Syncing $host..."
+		(cd "$tree" && $RSYNC -ahrR common g3-plc loramac hybrid "$host:$REMOTE_DIR/") || exit 1
+		$SSH "$host" "cd $REMOTE_DIR && make -C g3-plc && make -C loramac && make -C hybrid" \
+			> "$logdir/build-$host.log" 2>&1 || {
+			echo "$0: cannot build on $host (see $logdir/build-$host.log)" >&2
+			exit 1
+		}
+	done
+fi
+
+# run_node INDEX HOST START COMMAND...
+#   Run a command on a node at the START time (now when empty). The
+#   senders write their summary in a remote file named after INDEX.
+run_node()
+{
+	index=$1 host=$2 start=$3
+	shift 3
+	prog=$1
+	shift
+	case $prog in
+	*-bench) prog="$prog -o /tmp/bench-nodes.$index.csv -F csv -L $index:$host" ;;
+	esac
+
+	delay=
+	if [ -n "$start" ]
+	then
+		delay="sleep \$(awk -v s=$start -v n=\$(date +%s.%N) 'BEGIN { d = s - n; print (d > 0 ? d : 0) }');"
+	fi
+	$SSH "$host" "cd $REMOTE_DIR && $delay echo \$\$ > /tmp/bench-nodes.$index.pid && exec $prog $*"
+}
+
+# fetch_node INDEX HOST
+#   Print the summary of a sender and remove it from the node.
+fetch_node()
+{
+	$SSH "$2" "cat /tmp/bench-nodes.$1.csv; rm -f /tmp/bench-nodes.$1.csv /tmp/bench-nodes.$1.pid"
+}
+
+# start the other commands first
+index=0
+while read host prog args
+do
+	index=$(($index + 1))
+	case $prog in
+	*-bench) continue ;;
+	esac
+	echo "Starting $prog on $host"
+	run_node $index $host "" $prog $args < /dev/null > "$logdir/node-$index.log" 2>&1 &
+done < $tmp.nodes
+
+# each sender alone
+if [ -n "$baseline" ]
+then
+	sleep $wait
+	index=0
+	while read host prog args
+	do
+		index=$(($index + 1))
+		case $prog in
+		*-bench) ;;
+		*) continue ;;
+		esac
+		echo "Running $prog alone on $host"
+		run_node $index $host "" $prog $args < /dev/null > "$logdir/alone-$index.log" 2>&1
+		fetch_node $index $host < /dev/null | tail -n 1 | sed "s/^/$index,/" >> $tmp.alone
+	done < $tmp.nodes
+fi
+
+# every sender at once
+start=$(($(date +%s) + $wait))
+pids=
+index=0
+while read host prog args
+do
+	index=$(($index + 1))
+	case $prog in
+	*-bench) ;;
+	*) continue ;;
+	esac
+	echo "Starting $prog on $host at $(date -d @$start +%T)"
+	run_node $index $host $start $prog $args < /dev/null > "$logdir/node-$index.log" 2>&1 &
+	pids="$pids $!"
+done < $tmp.nodes
+[ -n "$pids" ] || { echo "$0: no bench command in $nodes" >&2; exit 1; }
+wait $pids
+
+# collect the summaries and stop the other commands
+index=0
+while read host prog args
+do
+	index=$(($index + 1))
+	case $prog in
+	*-bench)
+		fetch_node $index $host < /dev/null | tail -n 1 | sed "s/^/$index,/" >> $tmp.rows
+		;;
+	*)
+		$SSH "$host" "kill \$(cat /tmp/bench-nodes.$index.pid) && rm -f /tmp/bench-nodes.$index.pid" < /dev/null
+		;;
+	esac
+done < $tmp.nodes
+
+# fields of a row: index, label, frames, delivered, bytes, duration_us, fps, goodput_bps, success_ratio
+: >> $tmp.alone
+: >> $tmp.rows
+awk -F , -v baseline="$baseline" '
+	BEGIN {
+		printf "node,frames,delivered,bytes,duration_us,goodput_bps,success_ratio"
+		if(baseline)
+			printf ",alone_goodput_bps,goodput_ratio"
+		printf "\n"
+	}
+	FILENAME == ARGV[1] { alone[$1] = $8; next }
+	NF >= 9 {
+		gsub(/"/, "", $2)
+		printf "%s,%u,%u,%u,%u,%u,%.4f", $2, $3, $4, $5, $6, $8, $9
+		if(baseline)
+			printf ",%u,%.4f", alone[$1], alone[$1] ? $8 / alone[$1] : 0
+		printf "\n"
+		frames += $3; delivered += $4; bytes += $5
+		if($6 > duration)
+			duration = $6
+		goodput += $8; alone_goodput += alone[$1]
+	}
+	END {
+		printf "TOTAL,%u,%u,%u,%u,%u,%.4f", frames, delivered, bytes, duration,
+			duration ? bytes * 8 * 1000000 / duration : 0, frames ? delivered / frames : 0
+		if(baseline)
+			printf ",%u,%.4f", alone_goodput, alone_goodput ? goodput / alone_goodput : 0
+		printf "\n"
+	}' $tmp.alone $tmp.rows > "$report"
+
+cat "$report"
+exit 0
@@ -0,0 +1,260 @@
+#!/bin/sh
+# run the benchmarks of the three trees and compare them to a baseline
+#
+# usage: bench-suite.sh [-u] [-t PERCENT] [-r ROUNDS] [-b BASELINE] [-o RESULTS] [-l LOGDIR]
+#
+# The suite builds the trees and runs:
+#
+#   codec   the offline codec benchmarks of g3-plc and loramac
+#   netsim  LoRaMAC networks in virtual time (deterministic for a seed)
+#   sim     g3plc-bench, loramac-bench and hybrid-bench against a peer
+#           driver of the same tree through modem-sim
+#   replay  the captures recorded by the sim runs through the parsers
+#
+# Each result is a number that is either better lower (times, latency)
+# or better higher (rates, ratios). It is compared to the result of the
+# same name in the baseline and flagged when it is worse by more than
+# the threshold. The exit status is 1 when a result regressed, so the
+# suite can gate a change to any copy of the drivers.
+#
+# The baseline is only meaningful on the machine on which it was
+# recorded. Record it again there with -u after an intended change.
+#
+#   -u  write the results as the new baseline instead of comparing them
+#   -t  regression threshold in percent (default: 20)
+#   -r  rounds of the whole suite, the best result of each is kept
+#       to leave out the noise of the other processes (default: 3)
+#   -b  baseline file (default: bench-baseline.json next to this script)
+#   -o  results file (default: bench-results.json)
+#   -l  directory of the output of each run (default: bench-suite.logs)
+#
+# Set MAKE to change the command used to build the trees, SIM_FRAMES to
+# change the number of frames of the sim runs, PEER_WAIT to change the
+# seconds given to a peer driver to boot and REPLAY_PASSES to change the
+# number of times each capture is replayed.
+
+MAKE=${MAKE:-make}
+SIM_FRAMES=${SIM_FRAMES:-200}
+PEER_WAIT=${PEER_WAIT:-3}
+REPLAY_PASSES=${REPLAY_PASSES:-1000}
+
+update=
+threshold=20
+rounds=3
+baseline=$(cd "$(dirname "$0")" && pwd)/bench-baseline.json
+results=bench-results.json
+logdir=bench-suite.logs
+
+usage()
+{
+	echo "usage: $0 [-u] [-t PERCENT] [-r ROUNDS] [-b BASELINE] [-o RESULTS] [-l LOGDIR]" >&2
+	exit 1
+}
+
+while getopts ut:r:b:o:l: opt
+do
+	case $opt in
+	u) update=1 ;;
+	t) threshold=$OPTARG ;;
+	r) rounds=$OPTARG ;;
+	b) baseline=$OPTARG ;;
+	o) results=$OPTARG ;;
+	l) logdir=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+shift $(($OPTIND - 1))
+[ $# -eq 0 ] || usage
+[ -n "$update" ] || [ -r "$baseline" ] || { echo "$0: cannot read $baseline (record it with -u)" >&2; exit 1; }
+
+mkdir -p "$logdir" || exit 1
+logdir=$(cd "$logdir" && pwd)
+tmp=/tmp/bench-suite.$$
+mkdir -p $tmp || exit 1
+trap 'pkill -P $$ 2> /dev/null; rm -rf $tmp' EXIT
+
+# the tree is at the root of this script's repository
+tree=$(cd "$(dirname "$0")/../.." && pwd)
+
+echo "Building..."
+{
+	$MAKE -C "$tree/g3-plc" modem-sim g3plc-unix g3plc-bench test/bench-codec test/replay &&
+	$MAKE -C "$tree/loramac" loramac-unix loramac-bench test/bench-codec test/replay test/netsim &&
+	$MAKE -C "$tree/hybrid" hybrid-unix hybrid-bench
+} > "$logdir/build.log" 2>&1 || {
+	echo "$0: cannot build (see $logdir/build.log)" >&2
+	exit 1
+}
+
+# result NAME VALUE lower|higher
+#   Record a result, ignored when the run did not produce it.
+result()
+{
+	[ -n "$2" ] && echo "$1 $2 $3" >> $tmp.results
+}
+
+# codec TREE
+#   Time per byte of each codec benchmark of a tree.
+codec()
+{
+	echo "Running the $1 codec benchmarks"
+	"$tree/$1/test/bench-codec" > "$logdir/codec-$1.log" 2>&1
+	awk -v tree=$1 '$3 == "ns/byte" { print tree ".codec." $1, $2, "lower" }' \
+		"$logdir/codec-$1.log" >> $tmp.results
+}
+
+# netsim NAME OPTIONS...
+#   Delivery, latency and run time of a simulated LoRaMAC network.
+netsim()
+{
+	name=$1
+	shift
+	echo "Running the $name network"
+	"$tree/loramac/test/netsim" "$@" > "$logdir/netsim-$name.log" 2>&1
+	log="$logdir/netsim-$name.log"
+	result loramac.netsim.$name.delivered_pct \
+		"$(sed -n 's/.*delivered [0-9]* (\([0-9.]*\)%).*/\1/p' "$log")" higher
+	result loramac.netsim.$name.latency_avg_ms \
+		"$(sed -n 's/.*latency avg \([0-9.]*\) ms.*/\1/p' "$log")" lower
+	result loramac.netsim.$name.run_s \
+		"$(sed -n 's/.*simulated in \([0-9.]*\) s.*/\1/p' "$log")" lower
+}
+
+# sim TREE PEER BENCH OPTIONS DEVICES...
+#   Run the bench mode of a tree against the unix mode of the same tree
+#   on the other devices of the simulator and record the UART traffic
+#   of the sender when the tree can replay it. Both drivers take the OPTIONS. The devices are the
+#   media of the simulator, the sender is the node 0 and the peer the
+#   node 1.
+sim()
+{
+	name=$1 peer=$2 bench=$3 opts=$4
+	shift 4
+	echo "Running the $name sim"
+	peer_devs= bench_devs=
+	for dev in "$@"
+	do
+		bench_devs="$bench_devs $tmp/fs-${dev}0"
+		peer_devs="$peer_devs $tmp/fs-${dev}1"
+	done
+	capture=
+	[ -x "$tree/$name/test/replay" ] && capture="--capture $tmp/$name.pcapng"
+	mkdir -p $tmp/$name
+	(cd $tmp/$name && exec "$tree/$peer" $opts 0002 $peer_devs) > "$logdir/sim-$name-peer.log" 2>&1 &
+	pid=$!
+	sleep $PEER_WAIT
+	"$tree/$bench" $opts -n $SIM_FRAMES -d 0002 -F json -o $tmp/$name.json \
+		$capture 0001 $bench_devs > "$logdir/sim-$name.log" 2>&1
+	kill $pid 2> /dev/null
+	wait $pid 2> /dev/null
+	json=$(tail -n 1 $tmp/$name.json 2> /dev/null)
+	result $name.sim.success_ratio "$(echo "$json" | sed -n 's/.*"success_ratio":\([0-9.]*\).*/\1/p')" higher
+	result $name.sim.latency_p50_us "$(echo "$json" | sed -n 's/.*"p50":\([0-9.]*\).*/\1/p')" lower
+}
+
+# replay TREE
+#   Parse the capture of the sim run of a tree as fast as possible, as
+#   many times as REPLAY_PASSES since the capture is short.
+replay()
+{
+	[ -s $tmp/$1.pcapng ] || return
+	echo "Replaying the $1 capture"
+	log="$logdir/replay-$1.log"
+	"$tree/$1/test/replay" -n $REPLAY_PASSES $tmp/$1.pcapng > "$log" 2>&1
+	result $1.replay.frames "$(sed -n 's/.* bytes, \([0-9]*\) [a-z]* (.*/\1/p' "$log")" higher
+	result $1.replay.mb_per_s "$(sed -n 's/.*ms, \([0-9.]*\) MB\/s.*/\1/p' "$log")" higher
+}
+
+: > $tmp.results
+
+# the LoRa drivers wait for the SIFS before an ACK (2s by default),
+# the simulator does not need more than a few milliseconds
+lora="-s 10000 -t 50000"
+
+for round in $(seq $rounds)
+do
+	echo "Round $round of $rounds"
+
+	codec g3-plc
+	codec loramac
+
+	netsim ideal  -n 500 -d 14400
+	netsim loss   -n 200 -d 36000 -m loss:10
+	netsim range  -n 300 -d 1800 -m range:3000 -f 9 --backoff jitter --lbt
+
+	"$tree/g3-plc/modem-sim" -g 2 -l 2 -s 1 -p $tmp/fs > "$logdir/modem-sim.log" 2>&1 &
+	sim_pid=$!
+	sleep 1
+	sim g3-plc  g3-plc/g3plc-unix    g3-plc/g3plc-bench    ""      g3plc
+	sim loramac loramac/loramac-unix loramac/loramac-bench "$lora" lora
+	sim hybrid  hybrid/hybrid-unix   hybrid/hybrid-bench   "$lora" lora g3plc
+	kill $sim_pid 2> /dev/null
+	wait $sim_pid 2> /dev/null
+
+	replay g3-plc
+	replay loramac
+done
+
+# best value of each result over the rounds as a JSON object of
+# name: { value, better }, one per line in the order of the runs
+awk '
+	!($1 in best) { names[n++] = $1; best[$1] = $2; better[$1] = $3; next }
+	$3 == "lower" && $2 + 0 < best[$1] + 0 { best[$1] = $2 }
+	$3 == "higher" && $2 + 0 > best[$1] + 0 { best[$1] = $2 }
+	END {
+		print "{"
+		for(i = 0 ; i < n ; i++)
+			printf "  \"%s\": { \"value\": %s, \"better\": \"%s\" }%s\n",
+				names[i], best[names[i]], better[names[i]], (i < n - 1 ? "," : "")
+		print "}"
+	}' $tmp.results > "$results"
+
+if [ -n "$update" ]
+then
+	cp "$results" "$baseline" || exit 1
+	echo "Baseline written to $baseline"
+	exit 0
+fi
+
+# compare each result to the baseline, both files have their entries
+# on lines of their own as written above
+awk -v threshold=$threshold '
+	function entry(line, f) {
+		if(!match(line, /"[^"]*": \{ "value": [-0-9.e+]*, "better": "[a-z]*"/))
+			return 0
+		split(substr(line, RSTART, RLENGTH), f, "\"")
+		name = f[2]
+		value = f[5]
+		sub(/^: /, "", value)
+		sub(/,.*/, "", value)
+		better = f[8]
+		return 1
+	}
+	FILENAME == ARGV[1] {
+		if(entry($0))
+			base[name] = value
+		next
+	}
+	entry($0) {
+		if(!(name in base)) {
+			printf "%-44s %12s %12g %8s  new\n", name, "-", value, "-"
+			next
+		}
+		old = base[name] + 0
+		change = old ? (value - old) * 100 / old : 0
+		worse = better == "lower" ? change : -change
+		status = worse > threshold ? "REGRESSION" : "ok"
+		if(worse > threshold)
+			regressions++
+		printf "%-44s %12g %12g %+7.1f%%  %s\n", name, old, value, change, status
+		seen[name] = 1
+	}
+	END {
+		for(name in base)
+			if(!(name in seen)) {
+				printf "%-44s %12g %12s %8s  missing\n", name, base[name], "-", "-"
+				regressions++
+			}
+		printf "%u regressions beyond %s%%\n", regressions, threshold
+		exit regressions ? 1 : 0
+	}' "$baseline" "$results"
@@ -0,0 +1,299 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <pthread.h>
+#include <string.h>
+
+#include "admit.h"
+#include "xatoi.h"
+
+/* The transmit threads release the credits while the main
+   thread admits new messages, so the table has its own lock. */
+static pthread_mutex_t admit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Limits of the clients without a quota. */
+static unsigned int window;
+static unsigned long rate;
+static unsigned long long capacity; /* burst in tokens */
+
+static struct quota {
+  char addr[ADMIT_ADDR];
+  unsigned int window;
+  unsigned long rate;
+  unsigned long long capacity;
+} quotas[ADMIT_MAX_QUOTAS];
+static unsigned int nquotas;
+
+static struct client {
+  struct sockaddr_un addr;
+  int used;
+  unsigned int window;
+  unsigned long rate;
+  unsigned long long capacity;
+  unsigned long long tokens; /* available bytes scaled by 1000000 */
+  unsigned long stamp;       /* time of the last refill */
+  struct admit_stats stats;  /* inflight is the messages accepted but not completed */
+} clients[ADMIT_MAX_CLIENTS];
+
+void admit_init(unsigned int w, unsigned long r, unsigned long burst)
+{
+  window   = w;
+  rate     = r;
+  capacity = burst * 1000000ULL;
+}
+
+int admit_quota(const char *addr, unsigned int w, unsigned long r, unsigned long burst)
+{
+  struct quota *q;
+
+  if(nquotas == ADMIT_MAX_QUOTAS)
+    return -1;
+
+  q = &quotas[nquotas++];
+  strncpy(q->addr, addr, sizeof(q->addr) - 1);
+  q->window   = w;
+  q->rate     = r;
+  q->capacity = burst * 1000000ULL;
+
+  return 0;
+}
+
+int admit_parse_quota(const char *quota, unsigned long burst)
+{
+  char buf[ADMIT_ADDR + 32], *w, *r;
+  unsigned long rate;
+  unsigned int window;
+  int err;
+
+  if(strlen(quota) >= sizeof(buf))
+    return -1;
+  strcpy(buf, quota);
+
+  /* from the end since the address itself may have colons */
+  r = strrchr(buf, ':');
+  if(!r)
+    return -1;
+  *r++ = '\0';
+  w = strrchr(buf, ':');
+  if(!w || w == buf)
+    return -1;
+  *w++ = '\0';
+
+  window = xatou(w, &err);
+  if(err)
+    return -1;
+  rate = xatoul(r, &err);
+  if(err)
+    return -1;
+
+  return admit_quota(buf, window, rate, burst > rate ? burst : rate);
+}
+
+static const struct quota * find_quota(const struct sockaddr_un *addr)
+{
+  unsigned int i;
+
+  for(i = 0 ; i < nquotas ; i++)
+    if(!strncmp(quotas[i].addr, addr->sun_path, sizeof(quotas[i].addr)))
+      return &quotas[i];
+
+  return NULL;
+}
+
+static void refill(struct client *c, unsigned long now)
+{
+  unsigned long elapsed = now - c->stamp;
+
+  c->stamp = now;
+
+  /* avoid the overflow after a long pause */
+  if(elapsed >= (c->capacity - c->tokens) / c->rate + 1)
+    c->tokens = c->capacity;
+  else
+    c->tokens += (unsigned long long)elapsed * c->rate;
+  if(c->tokens > c->capacity)
+    c->tokens = c->capacity;
+}
+
+/* A client without message in flight and with a full bucket
+   is in the same state as a new one, its slot may be reused. */
+static int idle(struct client *c, unsigned long now)
+{
+  if(c->stats.inflight)
+    return 0;
+  if(c->rate)
+    refill(c, now);
+  return !c->rate || c->tokens == c->capacity;
+}
+
+static struct client * find_client(const struct sockaddr_un *addr)
+{
+  int i;
+
+  for(i = 0 ; i < ADMIT_MAX_CLIENTS ; i++)
+    if(clients[i].used && !strncmp(clients[i].addr.sun_path, addr->sun_path,
+                                   sizeof(addr->sun_path)))
+      return &clients[i];
+
+  return NULL;
+}
+
+static struct client * new_client(const struct sockaddr_un *addr, unsigned long now)
+{
+  const struct quota *q = find_quota(addr);
+  struct client *c = NULL;
+  int i;
+
+  for(i = 0 ; i < ADMIT_MAX_CLIENTS ; i++) {
+    if(!clients[i].used) {
+      c = &clients[i];
+      break;
+    }
+    if(idle(&clients[i], now) && (!c || (long)(clients[i].stamp - c->stamp) < 0))
+      c = &clients[i];
+  }
+
+  if(c) {
+    *c = (struct client){ .addr     = *addr,
+                          .used     = 1,
+                          .window   = q ? q->window : window,
+                          .rate     = q ? q->rate : rate,
+                          .capacity = q ? q->capacity : capacity,
+                          .stamp    = now };
+    c->tokens = c->capacity;
+    memcpy(c->stats.addr, addr->sun_path, sizeof(c->stats.addr));
+    c->stats.addr[sizeof(c->stats.addr) - 1] = '\0';
+    c->stats.window = c->window;
+    c->stats.rate   = c->rate;
+  }
+  return c;
+}
+
+int admit_request(const struct sockaddr_un *from, unsigned int size, unsigned long now)
+{
+  unsigned long long need = size * 1000000ULL;
+  const struct quota *q;
+  struct client *c;
+  int ret = 0;
+
+  pthread_mutex_lock(&admit_lock);
+  {
+    c = find_client(from);
+    if(!c)
+      c = new_client(from, now);
+
+    /* no slot left, only a client without limits goes through */
+    if(!c) {
+      q = find_quota(from);
+      if(q ? q->window || q->rate : window || rate)
+        ret = ADMIT_ERR_WINDOW;
+    }
+    else if(c->window && c->stats.inflight >= c->window) {
+      ret = ADMIT_ERR_WINDOW;
+      c->stats.rejected_window++;
+    }
+    else if(c->rate) {
+      refill(c, now);
+      if(c->tokens < need) {
+        ret = ADMIT_ERR_RATE;
+        c->stats.rejected_rate++;
+      }
+      else
+        c->tokens -= need;
+    }
+
+    if(c && !ret) {
+      c->stats.messages++;
+      c->stats.bytes += size;
+      if(++c->stats.inflight > c->stats.inflight_max)
+        c->stats.inflight_max = c->stats.inflight;
+    }
+  }
+  pthread_mutex_unlock(&admit_lock);
+
+  return ret;
+}
+
+static unsigned int credits(const struct client *c)
+{
+  unsigned int w = c ? c->window : window;
+  unsigned int left = w;
+
+  /* a client with a quota may have no window */
+  if(!w)
+    return ADMIT_MAX_WINDOW;
+  if(c)
+    left -= c->stats.inflight < w ? c->stats.inflight : w;
+  return left < ADMIT_MAX_WINDOW ? left : ADMIT_MAX_WINDOW;
+}
+
+unsigned int admit_release(const struct sockaddr_un *from, int status, unsigned long airtime)
+{
+  struct client *c;
+  unsigned int left;
+
+  pthread_mutex_lock(&admit_lock);
+  {
+    c = find_client(from);
+    if(c && c->stats.inflight) {
+      c->stats.inflight--;
+      if(status)
+        c->stats.failed++;
+      else
+        c->stats.sent++;
+      c->stats.airtime += airtime;
+    }
+    left = credits(c);
+  }
+  pthread_mutex_unlock(&admit_lock);
+
+  return left;
+}
+
+unsigned int admit_credits(const struct sockaddr_un *from)
+{
+  unsigned int left;
+
+  pthread_mutex_lock(&admit_lock);
+  left = credits(find_client(from));
+  pthread_mutex_unlock(&admit_lock);
+
+  return left;
+}
+
+int admit_read(unsigned int i, struct admit_stats *stats)
+{
+  int ret = -1;
+
+  if(i >= ADMIT_MAX_CLIENTS)
+    return -1;
+
+  pthread_mutex_lock(&admit_lock);
+  if(clients[i].used) {
+    *stats = clients[i].stats;
+    ret = 0;
+  }
+  pthread_mutex_unlock(&admit_lock);
+
+  return ret;
+}
@@ -0,0 +1,105 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _ADMIT_H_
+#define _ADMIT_H_
+
+#include <sys/types.h>
+#include <sys/un.h>
+#include <stdint.h>
+
+/* Admission control of the send messages of the Unix mode clients.
+   Each client, identified by its address, may have at most window
+   messages in flight, that is accepted but not completed yet, and
+   may send rate bytes per second on average with bursts of up to
+   burst bytes (token bucket). Either limit is disabled when null.
+   The messages over a limit are rejected at once rather than left
+   in the socket buffer, so that clients follow the link capacity.
+   A client may have limits of its own (see admit_quota()), so that
+   one application on a shared gateway cannot starve the others.
+
+   Each client also has statistics of what it sent (see admit_read()).
+   They restart when another client takes its slot, that is once it
+   has no message in flight and a full bucket while the table is full.
+   Without any limit a client that finds no slot is let through
+   without statistics. */
+#define ADMIT_MAX_CLIENTS 32
+#define ADMIT_MAX_QUOTAS  32
+#define ADMIT_ADDR        108 /* as sun_path */
+
+/* Maximum number of credits reported in a status message. */
+#define ADMIT_MAX_WINDOW 255
+
+/* Status reported for a rejected message,
+   above the status codes of the drivers. */
+#define ADMIT_ERR_WINDOW 0xfd /* no credit left or too many clients */
+#define ADMIT_ERR_RATE   0xfe /* over the rate limit */
+
+/* Statistics of a client. */
+struct admit_stats {
+  char          addr[ADMIT_ADDR];
+  unsigned int  window;          /* limits of the client, 0 when none */
+  unsigned long rate;
+  uint64_t      messages;        /* messages accepted */
+  uint64_t      bytes;           /* bytes of the messages accepted */
+  uint64_t      sent;            /* messages completed with success */
+  uint64_t      failed;          /* messages completed with an error or dropped */
+  uint64_t      rejected_window; /* messages rejected with ADMIT_ERR_WINDOW */
+  uint64_t      rejected_rate;   /* messages rejected with ADMIT_ERR_RATE */
+  uint64_t      airtime;         /* time on air in us (see admit_release()) */
+  unsigned int  inflight;        /* messages in flight */
+  unsigned int  inflight_max;    /* maximum of inflight */
+};
+
+/* Configure the limits. The burst must hold the largest message. */
+void admit_init(unsigned int window, unsigned long rate, unsigned long burst);
+
+/* Limits of the client bound to this address instead of the ones of
+   admit_init(), a null limit is disabled for this client. Return -1
+   when there are already ADMIT_MAX_QUOTAS clients with limits. */
+int admit_quota(const char *addr, unsigned int window, unsigned long rate, unsigned long burst);
+
+/* Parse a quota as ADDR:CREDITS:RATE and set it with this burst,
+   at least the rate when null. Return -1 when it is invalid. */
+int admit_parse_quota(const char *quota, unsigned long burst);
+
+/* Admit a message of size bytes at now (monotonic clock in us).
+   Return 0 when it is accepted, in which case it takes a credit
+   until admit_release(), or the status to report otherwise. */
+int admit_request(const struct sockaddr_un *from, unsigned int size, unsigned long now);
+
+/* Give back the credit of a message accepted from this client,
+   once it was sent (status 0) or not, and return the credits left.
+   The time on air of the message in us, when it is known, is added
+   to the statistics of the client. */
+unsigned int admit_release(const struct sockaddr_un *from, int status, unsigned long airtime);
+
+/* Return the credits left to this client. */
+unsigned int admit_credits(const struct sockaddr_un *from);
+
+/* Copy the statistics of the client in slot i (up to ADMIT_MAX_CLIENTS).
+   Return -1 when the slot is not used. */
+int admit_read(unsigned int i, struct admit_stats *stats);
+
+#endif /* _ADMIT_H_ */
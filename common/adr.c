@@ -0,0 +1,83 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "adr.h"
+
+void adr_init(struct adr *a, unsigned int sf_min, unsigned int sf_max)
+{
+  if(sf_max < sf_min)
+    sf_max = sf_min;
+
+  *a = (struct adr){ .sf_min = sf_min,
+                     .sf_max = sf_max,
+                     .sf     = sf_max };
+}
+
+static int adr_step(struct adr *a, int slower)
+{
+  unsigned int sf = a->sf;
+
+  a->frames  = 0;
+  a->retrans = 0;
+
+  if(slower) {
+    a->hold = ADR_HOLD;
+    if(sf < a->sf_max)
+      sf++;
+  }
+  else if(sf > a->sf_min)
+    sf--;
+
+  if(sf == a->sf)
+    return 0;
+  a->sf = sf;
+  return 1;
+}
+
+int adr_update(struct adr *a, unsigned int tries, int acked)
+{
+  unsigned int ratio;
+
+  if(!acked)
+    return adr_step(a, 1);
+
+  a->frames++;
+  a->retrans += tries ? tries - 1 : 0;
+  if(a->frames < ADR_PERIOD)
+    return 0;
+
+  ratio = a->retrans * 1000 / a->frames;
+  if(ratio > ADR_HIGH)
+    return adr_step(a, 1);
+
+  if(ratio >= ADR_LOW || a->hold) {
+    if(a->hold)
+      a->hold--;
+    a->frames  = 0;
+    a->retrans = 0;
+    return 0;
+  }
+
+  return adr_step(a, 0);
+}
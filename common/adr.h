@@ -0,0 +1,62 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _ADR_H_
+#define _ADR_H_
+
+/* Adaptive data rate. The spreading factor of a link is chosen
+   from its retransmission ratio: after each period of ADR_PERIOD
+   frames the link moves to the next faster SF when the frames were
+   retransmitted less than ADR_LOW times out of 1000 and to the next
+   slower SF above ADR_HIGH. A frame that was never acknowledged
+   falls back at once. Each step halves (or doubles) the time on air
+   so the link settles on the fastest SF it can sustain. This is
+   pure C, the caller provides the locking.
+
+   A link that just fell back waits for ADR_HOLD periods before it
+   tries the faster SF again so that a link at the edge does not
+   keep switching. */
+
+#define ADR_PERIOD 16
+#define ADR_LOW    63  /* about 1 in 16 */
+#define ADR_HIGH   250 /* 1 in 4 */
+#define ADR_HOLD   4
+
+struct adr {
+  unsigned int sf_min;  /* fastest SF */
+  unsigned int sf_max;  /* slowest SF */
+  unsigned int sf;      /* current SF */
+  unsigned int frames;  /* frames of the current period */
+  unsigned int retrans; /* retransmissions of those frames */
+  unsigned int hold;    /* periods left before moving faster */
+};
+
+/* Start on the slowest SF, which reaches the farthest. */
+void adr_init(struct adr *a, unsigned int sf_min, unsigned int sf_max);
+
+/* Account a frame sent tries times (from one) and whether it was
+   acknowledged in the end. Return 1 when the SF changed. */
+int adr_update(struct adr *a, unsigned int tries, int acked);
+
+#endif /* _ADR_H_ */
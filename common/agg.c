@@ -0,0 +1,82 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "agg.h"
+
+void agg_init(struct agg *a, void *buf, size_t max)
+{
+  *a = (struct agg){ .buf = buf,
+                     .max = max };
+}
+
+int agg_add(struct agg *a, const void *record, size_t size)
+{
+  unsigned char *p = a->buf + a->size;
+
+  if(size > AGG_MAX_RECORD || a->size + AGG_PREFIX_SIZE(size) + size > a->max)
+    return -1;
+
+  if(size < 0x80)
+    *p++ = size;
+  else {
+    *p++ = 0x80 | (size >> 8);
+    *p++ = size & 0xff;
+  }
+
+  memcpy(p, record, size);
+
+  a->size += AGG_PREFIX_SIZE(size) + size;
+  a->count++;
+
+  return 0;
+}
+
+int agg_split(const void *buf, size_t size,
+              void (*cb)(const void *record, size_t size, void *data), void *data)
+{
+  const unsigned char *p   = buf;
+  const unsigned char *end = p + size;
+  size_t len;
+  int count = 0;
+
+  while(p < end) {
+    len = *p++;
+    if(len & 0x80) {
+      if(p == end)
+        return -1;
+      len = (len & 0x7f) << 8 | *p++;
+    }
+
+    if(len > (size_t)(end - p))
+      return -1;
+
+    cb(p, len, data);
+    p += len;
+    count++;
+  }
+
+  return count;
+}
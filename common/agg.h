@@ -0,0 +1,60 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _AGG_H_
+#define _AGG_H_
+
+#include <stddef.h>
+
+/* Aggregation of several small messages into one frame.
+   Each message is stored as a record prefixed with its
+   length, on one byte below 0x80 or on two bytes in big
+   endian with the high bit set otherwise. */
+#define AGG_MAX_RECORD 0x7fff
+
+/* Size of the length prefix of a record. */
+#define AGG_PREFIX_SIZE(size) ((size) < 0x80 ? 1 : 2)
+
+struct agg {
+  unsigned char *buf;
+  size_t         size;  /* bytes used */
+  size_t         max;   /* capacity of the buffer */
+  unsigned int   count; /* number of records */
+};
+
+/* Start an empty aggregate in a buffer of max bytes. */
+void agg_init(struct agg *a, void *buf, size_t max);
+
+/* Append a record. Return 0 on success or -1
+   when the record does not fit in the aggregate. */
+int agg_add(struct agg *a, const void *record, size_t size);
+
+/* Call cb() for each record of an aggregate. Return the
+   number of records or -1 if the aggregate is malformed,
+   in which case the records before the error were already
+   passed to the callback. */
+int agg_split(const void *buf, size_t size,
+              void (*cb)(const void *record, size_t size, void *data), void *data);
+
+#endif /* _AGG_H_ */
@@ -0,0 +1,93 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <err.h>
+
+#include "attenuator.h"
+
+#define MAX_CMD_SIZE 64
+
+static void write_cmd(const struct attenuator *att, const char *cmd)
+{
+  size_t size = strlen(cmd);
+
+  if(write(att->fd, cmd, size) != (ssize_t)size)
+    err(EXIT_FAILURE, "cannot write to the attenuator");
+}
+
+void attenuator_open(struct attenuator *att, const char *dev)
+{
+  struct termios tty;
+
+  att->fd = open(dev, O_RDWR | O_NOCTTY | O_NDELAY);
+  if(att->fd < 0)
+    err(EXIT_FAILURE, "cannot open %s device", dev);
+
+  if(tcgetattr(att->fd, &tty) < 0)
+    err(EXIT_FAILURE, "cannot get %s attributes", dev);
+
+  cfsetospeed(&tty, B9600);
+  cfsetispeed(&tty, B9600);
+  tty.c_cflag |= CLOCAL | CREAD;
+  tty.c_cflag &= ~(PARENB | CSTOPB | CSIZE);
+  tty.c_cflag |= CS8 | CRTSCTS;
+  tty.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG);
+  tty.c_iflag &= ~(INPCK | ISTRIP | INLCR | ICRNL);
+  tty.c_iflag &= ~(IXON | IXOFF | IXANY); /* shut off xon/xoff ctrl */
+  tty.c_oflag &= ~OPOST;
+  tty.c_cc[VMIN]  = 255;
+  tty.c_cc[VTIME] = 4;
+
+  if(tcsetattr(att->fd, TCSAFLUSH, &tty) < 0)
+    err(EXIT_FAILURE, "cannot set %s attributes", dev);
+  fcntl(att->fd, F_SETFL, 0);
+
+  write_cmd(att, "onl\n");
+  write_cmd(att, "cac 0\n");
+}
+
+void attenuator_set(struct attenuator *att, unsigned int line, double db)
+{
+  char cmd[MAX_CMD_SIZE];
+
+  snprintf(cmd, sizeof(cmd), "ln %u\n", line);
+  write_cmd(att, cmd);
+
+  snprintf(cmd, sizeof(cmd), "wrt %u \rA %g\n", line, db);
+  write_cmd(att, cmd);
+
+  /* the next level must not overtake this one */
+  tcdrain(att->fd);
+}
+
+void attenuator_close(struct attenuator *att)
+{
+  close(att->fd);
+}
@@ -22,40 +22,25 @@
    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <stdlib.h>
-#include <getopt.h>
-#include <string.h>
+#ifndef _ATTENUATOR_H_
+#define _ATTENUATOR_H_
 
-#include "safe-call.h"
+/* Programmable attenuator on a serial port (9600 8N1 with RTS/CTS)
+   that sets the attenuation of the line between the modems of a
+   test bench. The port is opened and put online once, then each
+   level is a single command, so that a sweep does not reopen the
+   port for every step (see XP/tools/set-acc.c). */
+struct attenuator {
+  int fd;
+};
 
-int opts_len(const struct option *opts)
-{
-  int len = 0;
-  const struct option *o;
+/* Open the attenuator on dev and put it online. Exit on error. */
+void attenuator_open(struct attenuator *att, const char *dev);
 
-  for(o = opts ; o->name ; o++)
-    len++;
+/* Set the attenuation in dB of a line of the attenuator.
+   Exit on error. */
+void attenuator_set(struct attenuator *att, unsigned int line, double db);
 
-  return len;
-}
+void attenuator_close(struct attenuator *att);
 
-struct option * merge_opts(const struct option *a, const struct option *b)
-{
-  int len_a = opts_len(a);
-  int len_b = opts_len(b);
-  int len   = len_a + len_b; /* len without terminal zero struct */
-
-  /* allocate memory for the merged array
-     here we take into account the terminal
-     zero struct */
-  struct option *merged = xmalloc((len + 1) * sizeof(struct option));
-
-  /* terminal zero struct */
-  merged[len] = (struct option){ NULL, 0 , NULL, 0 };
-
-  /* merge arrays */
-  memcpy(merged,         a, len_a * sizeof(struct option));
-  memcpy(merged + len_a, b, len_b * sizeof(struct option));
-
-  return merged;
-}
+#endif /* _ATTENUATOR_H_ */
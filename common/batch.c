@@ -0,0 +1,197 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _GNU_SOURCE /* recvmmsg/sendmmsg */
+#endif /* __linux__ */
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include "safe-call.h"
+#include "batch.h"
+
+#define MSGS(b) ((struct mmsghdr *)(b)->msgs)
+
+void batch_init(struct batch *b, unsigned int size, size_t buf_size,
+                struct sockaddr_un *addr)
+{
+  unsigned int i;
+
+  *b = (struct batch){ .msgs     = xmalloc(size * sizeof(struct mmsghdr)),
+                       .iov      = xmalloc(size * sizeof(struct iovec)),
+                       .bufs     = xmalloc(size * buf_size),
+                       .refs     = xmalloc(size * sizeof(void *)),
+                       .buf_size = buf_size,
+                       .size     = size };
+
+  if(!addr)
+    b->names = xmalloc(size * sizeof(struct sockaddr_un));
+
+  for(i = 0 ; i < size ; i++) {
+    b->refs[i] = NULL;
+    b->iov[i]  = (struct iovec){ .iov_base = b->bufs + i * buf_size,
+                                 .iov_len  = buf_size };
+    MSGS(b)[i] = (struct mmsghdr){
+      .msg_hdr = { .msg_name    = addr ? addr : &b->names[i],
+                   .msg_namelen = sizeof(struct sockaddr_un),
+                   .msg_iov     = &b->iov[i],
+                   .msg_iovlen  = 1 }
+    };
+  }
+}
+
+/* Release the pooled buffers of the messages
+   and point them back to their own buffer. */
+static void release_refs(struct batch *b)
+{
+  unsigned int i;
+
+  for(i = 0 ; i < b->count ; i++) {
+    if(!b->refs[i])
+      continue;
+
+    pool_put(b->pool, b->refs[i]);
+    b->refs[i] = NULL;
+    b->iov[i].iov_base = batch_buf(b, i);
+  }
+}
+
+void batch_free(struct batch *b)
+{
+  release_refs(b);
+
+  free(b->msgs);
+  free(b->iov);
+  free(b->bufs);
+  free(b->refs);
+  free(b->names);
+}
+
+unsigned char * batch_buf(const struct batch *b, unsigned int i)
+{
+  return b->bufs + i * b->buf_size;
+}
+
+size_t batch_len(const struct batch *b, unsigned int i)
+{
+  return MSGS(b)[i].msg_len;
+}
+
+unsigned int batch_add(struct batch *b, size_t len)
+{
+  b->iov[b->count].iov_len = len;
+  return ++b->count;
+}
+
+unsigned int batch_add_to(struct batch *b, size_t len, struct sockaddr_un *addr)
+{
+  /* our own copy when we have them, the caller's
+     address may change before the batch is sent */
+  if(b->names) {
+    b->names[b->count] = *addr;
+    addr = &b->names[b->count];
+  }
+
+  MSGS(b)[b->count].msg_hdr.msg_name    = addr;
+  MSGS(b)[b->count].msg_hdr.msg_namelen = sizeof(struct sockaddr_un);
+
+  return batch_add(b, len);
+}
+
+unsigned int batch_add_ref(struct batch *b, struct pool *pool, void *buf,
+                           size_t len, struct sockaddr_un *addr)
+{
+  pool_hold(pool, buf);
+
+  b->pool = pool;
+  b->refs[b->count] = buf;
+  b->iov[b->count].iov_base = buf;
+
+  return batch_add_to(b, len, addr);
+}
+
+struct sockaddr_un * batch_addr(const struct batch *b, unsigned int i)
+{
+  return MSGS(b)[i].msg_hdr.msg_name;
+}
+
+int batch_recv(int sd, struct batch *b)
+{
+  unsigned int i;
+  int n;
+
+  for(i = 0 ; i < b->size ; i++)
+    MSGS(b)[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_un);
+
+  n = recvmmsg(sd, MSGS(b), b->size, MSG_WAITFORONE, NULL);
+
+  /* Source paths are not always null terminated. */
+  for(i = 0 ; b->names && n > 0 && i < (unsigned int)n ; i++) {
+    struct sockaddr_un *name = &b->names[i];
+    socklen_t len = MSGS(b)[i].msg_hdr.msg_namelen;
+
+    if(len <= offsetof(struct sockaddr_un, sun_path))
+      name->sun_path[0] = '\0';
+    else if(len < sizeof(struct sockaddr_un))
+      ((char *)name)[len] = '\0';
+    else
+      name->sun_path[sizeof(name->sun_path) - 1] = '\0';
+  }
+
+  b->count = n < 0 ? 0 : n;
+  return n;
+}
+
+unsigned int batch_send(int sd, struct batch *b, int flags,
+                        void (*drop)(const struct batch *b, unsigned int i, int error))
+{
+  unsigned int sent    = 0;
+  unsigned int dropped = 0;
+  int n;
+
+  /* On partial send we retry with the remaining messages.
+     When the first message fails we drop it and continue. */
+  while(sent < b->count) {
+    n = sendmmsg(sd, MSGS(b) + sent, b->count - sent, flags);
+    if(n < 0) {
+      if(drop)
+        drop(b, sent, errno);
+      dropped++;
+      n = 1;
+    }
+
+    sent += n;
+  }
+
+  release_refs(b);
+  b->count = 0;
+
+  return dropped;
+}
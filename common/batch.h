@@ -0,0 +1,96 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "pool.h"
+
+/* Batch of datagrams sent or received with a
+   single sendmmsg()/recvmmsg() system call.
+   Each message has its own buffer of buf_size bytes
+   or refers to a pooled buffer (see batch_add_ref()). */
+struct batch {
+  void          *msgs; /* message headers (see batch.c) */
+  struct iovec  *iov;
+  unsigned char *bufs;
+  void         **refs; /* pooled buffer of each message or NULL */
+  struct pool   *pool;
+  struct sockaddr_un *names; /* source addresses (receive batches) */
+  size_t         buf_size;
+  unsigned int   size;  /* number of messages */
+  unsigned int   count; /* number of messages used */
+};
+
+/* Allocate/release a batch of size messages. Messages are
+   sent to addr which may be NULL for receive batches, in
+   which case the source address of each received message
+   is recorded (see batch_addr()). */
+void batch_init(struct batch *b, unsigned int size, size_t buf_size,
+                struct sockaddr_un *addr);
+void batch_free(struct batch *b);
+
+/* Buffer and length of the i-th message. */
+unsigned char * batch_buf(const struct batch *b, unsigned int i);
+size_t batch_len(const struct batch *b, unsigned int i);
+
+/* Append a message of len bytes to the batch. The
+   message must have been written in batch_buf(b, b->count)
+   beforehand. The second variant sends the message to
+   another address than the one given at initialization.
+   The address is copied in the batch when it was initialized
+   without one, otherwise it must remain valid until sent.
+   Returns the number of messages used. */
+unsigned int batch_add(struct batch *b, size_t len);
+unsigned int batch_add_to(struct batch *b, size_t len, struct sockaddr_un *addr);
+
+/* Same as batch_add_to() but the message is sent from a pooled
+   buffer instead of being copied. The batch holds a reference on
+   the buffer until the message is sent. All the pooled buffers of
+   a batch must come from the same pool. */
+unsigned int batch_add_ref(struct batch *b, struct pool *pool, void *buf,
+                           size_t len, struct sockaddr_un *addr);
+
+/* Destination address of the i-th message, or its source
+   address for receive batches. The path of a source address
+   is empty when the sender socket is not bound. */
+struct sockaddr_un * batch_addr(const struct batch *b, unsigned int i);
+
+/* Wait for at least one message and receive as many as available
+   without blocking. Returns the number of messages received or a
+   negative value on error. */
+int batch_recv(int sd, struct batch *b);
+
+/* Send and release all messages of the batch with the given sendmsg()
+   flags. A message that cannot be sent is dropped and reported to the
+   drop callback (when not NULL) with the error, the remaining messages
+   are still sent. Returns the number of messages dropped. */
+unsigned int batch_send(int sd, struct batch *b, int flags,
+                        void (*drop)(const struct batch *b, unsigned int i, int error));
+
+#endif /* _BATCH_H_ */
@@ -0,0 +1,369 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _POSIX_C_SOURCE 200112L
+#endif /* __linux__ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+
+#include "safe-call.h"
+#include "prof.h"
+#include "capture.h"
+#include "txq.h"
+
+/* number of queued records (power of two) */
+#define CAPTURE_DEPTH 1024
+
+/* delay before buffered records are flushed to the file */
+#define CAPTURE_FLUSH 100000 /* us */
+
+/* stdio buffer of the file */
+#define CAPTURE_BUFFER 65536
+
+/* pcapng block types and options (see draft-ietf-opsawg-pcapng) */
+#define BLOCK_SHB      0x0a0d0d0a
+#define BLOCK_IDB      0x00000001
+#define BLOCK_EPB      0x00000006
+#define BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define LINKTYPE_USER0 147
+#define OPT_END        0
+#define OPT_IF_NAME    2
+#define OPT_IF_TSRESOL 9
+#define OPT_EPB_FLAGS  2
+#define EPB_INBOUND    1
+#define EPB_OUTBOUND   2
+
+#define PAD4(n) (((n) + 3) & ~3U)
+
+struct capture_item {
+  uint64_t      stamp;
+  uint8_t       link;
+  uint8_t       dir;
+  uint16_t      size;
+  unsigned char data[CAPTURE_MAX_RECORD];
+};
+
+static FILE *capture_fp;
+static char *capture_path;
+static unsigned long capture_size; /* bytes written to the file */
+static unsigned long rotate_size;
+static unsigned int rotate_keep;
+static unsigned int capture_links = ~0U;
+static struct txq capture_queue;
+static pthread_t writer_thread;
+static unsigned long drops;
+
+static uint64_t now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void put32(uint32_t v)
+{
+  fwrite(&v, sizeof(v), 1, capture_fp);
+}
+
+static void put16(uint16_t v)
+{
+  fwrite(&v, sizeof(v), 1, capture_fp);
+}
+
+/* Write an option with its value padded to 32 bits. */
+static void put_option(uint16_t code, const void *value, uint16_t size)
+{
+  static const unsigned char pad[4];
+
+  put16(code);
+  put16(size);
+  fwrite(value, 1, size, capture_fp);
+  fwrite(pad, 1, PAD4(size) - size, capture_fp);
+}
+
+static void write_header(void)
+{
+  static const char *names[CAPTURE_LINKS] = { "uart", "frame" };
+  uint8_t tsresol = 9; /* ns */
+  int i;
+
+  /* section header with an unspecified section length */
+  put32(BLOCK_SHB);
+  put32(28);
+  put32(BYTE_ORDER_MAGIC);
+  put16(1);
+  put16(0);
+  put32(0xffffffff);
+  put32(0xffffffff);
+  put32(28);
+
+  for(i = 0 ; i < CAPTURE_LINKS ; i++) {
+    uint32_t len = 20 + 4 + PAD4(strlen(names[i])) + 4 + 4 + 4;
+
+    put32(BLOCK_IDB);
+    put32(len);
+    put16(LINKTYPE_USER0 + i);
+    put16(0);
+    put32(0); /* no snap length */
+    put_option(OPT_IF_NAME, names[i], strlen(names[i]));
+    put_option(OPT_IF_TSRESOL, &tsresol, sizeof(tsresol));
+    put32(OPT_END);
+    put32(len);
+  }
+}
+
+static void write_record(const struct capture_item *item)
+{
+  uint32_t flags = item->dir == CAPTURE_RX ? EPB_INBOUND : EPB_OUTBOUND;
+  uint32_t len   = 28 + PAD4(item->size) + 8 + 4 + 4;
+
+  put32(BLOCK_EPB);
+  put32(len);
+  put32(item->link);
+  put32(item->stamp >> 32);
+  put32(item->stamp);
+  put32(item->size); /* captured length */
+  put32(item->size); /* original length */
+  fwrite(item->data, 1, item->size, capture_fp);
+  fwrite("\0\0\0", 1, PAD4(item->size) - item->size, capture_fp);
+  put_option(OPT_EPB_FLAGS, &flags, sizeof(flags));
+  put32(OPT_END);
+  put32(len);
+}
+
+static void open_file(void)
+{
+  capture_fp = fopen(capture_path, "wb");
+  if(!capture_fp)
+    err(EXIT_FAILURE, "cannot open capture %s", capture_path);
+  setvbuf(capture_fp, NULL, _IOFBF, CAPTURE_BUFFER);
+
+  write_header();
+  capture_size = ftell(capture_fp);
+}
+
+/* Shift PATH.1 ... PATH.N-1 to PATH.2 ... PATH.N, move PATH
+   to PATH.1 and start a new file at PATH. */
+static void rotate(void)
+{
+  size_t len = strlen(capture_path) + 16;
+  char from[len], to[len];
+  unsigned int i;
+
+  if(fclose(capture_fp))
+    warn("cannot write capture");
+
+  for(i = rotate_keep ; i > 1 ; i--) {
+    snprintf(from, len, "%s.%u", capture_path, i - 1);
+    snprintf(to, len, "%s.%u", capture_path, i);
+    rename(from, to);
+  }
+  snprintf(to, len, "%s.1", capture_path);
+  if(rename(capture_path, to) < 0)
+    warn("cannot rotate capture %s", capture_path);
+
+  open_file();
+}
+
+static void store(const struct capture_item *item)
+{
+  write_record(item);
+  capture_size += 28 + PAD4(item->size) + 8 + 4 + 4;
+  if(rotate_size && capture_size >= rotate_size)
+    rotate();
+}
+
+/* The records are queued as control items, an item queued as
+   bulk is only drained after them and stops the writer. The file
+   is flushed once idle and the writer then sleeps until the next
+   record. */
+static void * writer_thread_func(void *arg)
+{
+  static struct capture_item item;
+  int class, dirty = 0;
+
+  (void)arg;
+  prof_thread("capture");
+
+  do {
+    if(dirty)
+      class = txq_timedpop(&capture_queue, &item, CAPTURE_FLUSH);
+    else
+      class = txq_pop(&capture_queue, &item, 1);
+
+    if(class < 0) {
+      fflush(capture_fp);
+      dirty = 0;
+    }
+    else if(class == TXQ_CONTROL) {
+      store(&item);
+      dirty = 1;
+    }
+  } while(class != TXQ_BULK);
+
+  /* drain what was queued before the exit */
+  while((class = txq_pop(&capture_queue, &item, 0)) >= 0)
+    if(class == TXQ_CONTROL)
+      store(&item);
+
+  return NULL;
+}
+
+static void capture_close(void)
+{
+  static const struct capture_item stop;
+
+  if(txq_push(&capture_queue, TXQ_BULK, &stop, NULL) < 0)
+    errx(EXIT_FAILURE, "cannot stop capture thread");
+  pthread_join(writer_thread, NULL);
+
+  if(fclose(capture_fp))
+    warn("cannot write capture");
+
+  if(drops)
+    warnx("capture queue full, %lu records dropped", drops);
+}
+
+void capture_open(const char *path)
+{
+  if(capture_fp)
+    errx(EXIT_FAILURE, "capture already open");
+
+  capture_path = xstrdup(path);
+  open_file();
+
+  txq_init(&capture_queue, TXQ_STRICT, NULL, CAPTURE_DEPTH, sizeof(struct capture_item));
+
+  if(pthread_create(&writer_thread, NULL, writer_thread_func, NULL))
+    errx(EXIT_FAILURE, "cannot create capture thread");
+
+  atexit(capture_close);
+}
+
+void capture(enum capture_link link, enum capture_dir dir,
+             const void *buf, unsigned int size)
+{
+  struct capture_item item;
+  const unsigned char *b = buf;
+  unsigned int n;
+
+  if(!capture_fp || !(capture_links & (1U << link)))
+    return;
+
+  item.stamp = now();
+  item.link  = link;
+  item.dir   = dir;
+
+  do {
+    n = size < CAPTURE_MAX_RECORD ? size : CAPTURE_MAX_RECORD;
+
+    item.size = n;
+    memcpy(item.data, b, n);
+    if(txq_push(&capture_queue, TXQ_CONTROL, &item, NULL) < 0)
+      __atomic_fetch_add(&drops, 1, __ATOMIC_RELAXED);
+
+    b    += n;
+    size -= n;
+  } while(size);
+}
+
+void capture_rotate(unsigned long max_size, unsigned int keep)
+{
+  rotate_size = max_size;
+  rotate_keep = keep ? keep : 1;
+}
+
+void capture_select(unsigned int links)
+{
+  capture_links = links;
+}
+
+int capture_active(void)
+{
+  return capture_fp != NULL;
+}
+
+unsigned long capture_drops(void)
+{
+  return __atomic_load_n(&drops, __ATOMIC_RELAXED);
+}
+
+static int get32(FILE *fp, uint32_t *v)
+{
+  return fread(v, sizeof(*v), 1, fp) == 1 ? 0 : -1;
+}
+
+int capture_read(FILE *fp, struct capture_record *record)
+{
+  /* data and options of the records we write */
+  unsigned char block[CAPTURE_MAX_RECORD + 16];
+  uint32_t type, len, hdr[5];
+  uint32_t flags;
+  uint16_t code;
+
+  while(1) {
+    if(get32(fp, &type) < 0)
+      return feof(fp) ? 0 : -1;
+    if(get32(fp, &len) < 0 || len < 12 || len % 4)
+      return -1;
+
+    if(type != BLOCK_EPB) {
+      if(fseek(fp, len - 8, SEEK_CUR) < 0)
+        return -1;
+      continue;
+    }
+
+    /* interface, timestamp, captured and original lengths */
+    if(len < 32 || len - 28 > sizeof(block) ||
+       fread(hdr, sizeof(hdr), 1, fp) != 1 ||
+       fread(block, len - 28, 1, fp) != 1)
+      return -1;
+    if(hdr[0] >= CAPTURE_LINKS || hdr[3] > CAPTURE_MAX_RECORD ||
+       PAD4(hdr[3]) + 4 > len - 28)
+      return -1;
+
+    *record = (struct capture_record){ .stamp = (uint64_t)hdr[1] << 32 | hdr[2],
+                                       .link  = hdr[0],
+                                       .dir   = CAPTURE_RX,
+                                       .size  = hdr[3] };
+    memcpy(record->data, block, record->size);
+
+    /* the only option we write is the direction */
+    if(len - 28 - 4 >= PAD4(record->size) + 8) {
+      memcpy(&code, block + PAD4(record->size), sizeof(code));
+      memcpy(&flags, block + PAD4(record->size) + 4, sizeof(flags));
+      if(code == OPT_EPB_FLAGS && (flags & 3) == EPB_OUTBOUND)
+        record->dir = CAPTURE_TX;
+    }
+
+    return 1;
+  }
+}
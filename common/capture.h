@@ -0,0 +1,92 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Capture of the UART traffic to a pcapng file. The raw bytes
+   and the parsed frames are recorded on two interfaces with the
+   time of the monotonic clock (in ns). Producers copy the bytes
+   to a lock-free queue and never block, records are dropped when
+   the queue is full. A background thread writes the file so that
+   capturing barely changes the timing of the driver. */
+
+/* Interfaces of the capture file. */
+enum capture_link {
+  CAPTURE_UART,  /* raw bytes (LINKTYPE_USER0) */
+  CAPTURE_FRAME, /* parsed frames (LINKTYPE_USER1) */
+  CAPTURE_LINKS
+};
+
+enum capture_dir {
+  CAPTURE_RX,
+  CAPTURE_TX
+};
+
+/* Largest record, longer writes are split into several records. */
+#define CAPTURE_MAX_RECORD 512
+
+/* Create the capture file and start the writer thread.
+   The capture is flushed and closed on exit. Exit on error. */
+void capture_open(const char *path);
+
+/* Start a new file once the current one reaches max_size bytes,
+   the previous files are kept as PATH.1 (the newest) up to PATH.keep.
+   A max_size of 0 disables the rotation (the default). Must be called
+   before capture_open(). */
+void capture_rotate(unsigned long max_size, unsigned int keep);
+
+/* Only record the interfaces of the mask (1 << link), all of them
+   by default. The file still declares both interfaces. */
+void capture_select(unsigned int links);
+
+/* Record bytes on an interface. This is a no-op
+   when no capture file was opened. */
+void capture(enum capture_link link, enum capture_dir dir,
+             const void *buf, unsigned int size);
+
+/* Whether a capture file was opened. */
+int capture_active(void);
+
+/* Number of records dropped because the queue was full. */
+unsigned long capture_drops(void);
+
+/* A record read back from a capture file. */
+struct capture_record {
+  uint64_t         stamp; /* ns */
+  enum capture_link link;
+  enum capture_dir  dir;
+  unsigned int     size;
+  unsigned char    data[CAPTURE_MAX_RECORD];
+};
+
+/* Read the next record of a capture file written by capture_open().
+   Other blocks are skipped. Return 1 when a record was read, 0 at the
+   end of the file and -1 when the file is invalid. */
+int capture_read(FILE *fp, struct capture_record *record);
+
+#endif /* _CAPTURE_H_ */
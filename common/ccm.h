@@ -0,0 +1,70 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _CCM_H_
+#define _CCM_H_
+
+#include <stdint.h>
+
+/* AES-128 in CCM mode (RFC 3610) with a 13 bytes nonce, so
+   messages up to 64 kB, and an even MIC of 4 to 16 bytes. */
+#define AES_BLOCK_SIZE 16
+#define AES_KEY_SIZE   16
+#define CCM_NONCE_SIZE 13
+
+/* Expanded key schedule, computed once per key with aes_expand()
+   so that each message only costs its blocks. The round keys are
+   kept both as words for the table implementation and as bytes
+   for the ARMv8 crypto extensions. */
+struct aes_key {
+  uint32_t w[44];
+  uint8_t  b[176];
+};
+
+void aes_expand(struct aes_key *key, const uint8_t raw[AES_KEY_SIZE]);
+
+/* Encrypt a single block, in and out may be the same. This uses
+   the ARMv8 AES instructions when the CPU has them. */
+void aes_encrypt(const struct aes_key *key, const uint8_t in[AES_BLOCK_SIZE],
+                 uint8_t out[AES_BLOCK_SIZE]);
+
+/* Encrypt size bytes and authenticate them along with the
+   additional data. The output is the ciphertext followed by the
+   MIC, that is size + mic_size bytes. In and out may be the same. */
+void ccm_seal(const struct aes_key *key, const uint8_t nonce[CCM_NONCE_SIZE],
+              const void *aad, unsigned int aad_size,
+              const void *in, unsigned int size,
+              void *out, unsigned int mic_size);
+
+/* Decrypt size bytes of ciphertext followed by the MIC and check
+   them along with the additional data. The plaintext, size -
+   mic_size bytes, is written to out which may be the same as in.
+   Return 0 on success or -1 when the MIC does not match, out is
+   then cleared. */
+int ccm_open(const struct aes_key *key, const uint8_t nonce[CCM_NONCE_SIZE],
+             const void *aad, unsigned int aad_size,
+             const void *in, unsigned int size,
+             void *out, unsigned int mic_size);
+
+#endif /* _CCM_H_ */
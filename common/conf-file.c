@@ -0,0 +1,219 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <err.h>
+
+#include "conf-file.h"
+
+#define MAX_LINE 256
+
+struct args {
+  char **v;
+  int    n;
+  int    size;
+};
+
+static void push(struct args *a, char *s)
+{
+  if(a->n == a->size) {
+    a->size = a->size ? a->size * 2 : 16;
+    a->v    = realloc(a->v, a->size * sizeof(char *));
+    if(!a->v)
+      err(EXIT_FAILURE, "realloc");
+  }
+
+  a->v[a->n++] = s;
+}
+
+static char * dup_option(const char *s, unsigned int len)
+{
+  char *opt = malloc(len + 3);
+
+  if(!opt)
+    err(EXIT_FAILURE, "malloc");
+
+  opt[0] = '-';
+  opt[1] = '-';
+  memcpy(opt + 2, s, len);
+  opt[len + 2] = '\0';
+
+  return opt;
+}
+
+/* Path of the last file read by conf_file_args() */
+static const char *last_path;
+
+/* Split a line in place into the option name and its argument
+   (NULL when there is none). Return 0 for blank lines and comments. */
+static int split_line(char *s, char **name, char **arg)
+{
+  char *e, *v;
+
+  e = s + strlen(s);
+  while(e > s && isspace((unsigned char)e[-1]))
+    *--e = '\0';
+  while(isspace((unsigned char)*s))
+    s++;
+  if(*s == '\0' || *s == '#')
+    return 0;
+
+  /* option name up to the first space or '=' */
+  for(v = s ; *v && *v != '=' && !isspace((unsigned char)*v) ; v++);
+  e = v;
+
+  /* the argument, if any */
+  while(isspace((unsigned char)*v))
+    v++;
+  if(*v == '=')
+    v++;
+  while(isspace((unsigned char)*v))
+    v++;
+
+  *e    = '\0';
+  *name = s;
+  *arg  = *v ? v : NULL;
+  return 1;
+}
+
+static void read_file(struct args *a, const char *name, const char *path)
+{
+  char line[MAX_LINE];
+  unsigned int lineno = 0;
+  FILE *fp;
+
+  fp = fopen(path, "r");
+  if(!fp)
+    err(EXIT_FAILURE, "cannot open %s", path);
+
+  while(fgets(line, sizeof(line), fp)) {
+    char *e = line + strlen(line), *opt, *v;
+
+    lineno++;
+
+    if(e > line && e[-1] != '\n' && !feof(fp))
+      errx(EXIT_FAILURE, "%s:%u: line too long", path, lineno);
+    if(!split_line(line, &opt, &v))
+      continue;
+
+    if(!strcmp(opt, name))
+      errx(EXIT_FAILURE, "%s:%u: nested %s", path, lineno, name);
+    push(a, dup_option(opt, strlen(opt)));
+
+    if(v) {
+      v = strdup(v);
+      if(!v)
+        err(EXIT_FAILURE, "strdup");
+      push(a, v);
+    }
+  }
+
+  if(ferror(fp))
+    err(EXIT_FAILURE, "cannot read %s", path);
+  fclose(fp);
+  last_path = path;
+}
+
+int conf_file_read(const char *path,
+                   int (*fun)(const char *name, const char *arg, void *data),
+                   void *data)
+{
+  char line[MAX_LINE];
+  unsigned int lineno = 0;
+  int ret = 0;
+  FILE *fp;
+
+  fp = fopen(path, "r");
+  if(!fp) {
+    warn("cannot open %s", path);
+    return -1;
+  }
+
+  while(!ret && fgets(line, sizeof(line), fp)) {
+    char *e = line + strlen(line), *opt, *v;
+
+    lineno++;
+
+    if(e > line && e[-1] != '\n' && !feof(fp)) {
+      warnx("%s:%u: line too long", path, lineno);
+      ret = -1;
+    }
+    else if(split_line(line, &opt, &v))
+      ret = fun(opt, v, data);
+  }
+
+  if(!ret && ferror(fp)) {
+    warn("cannot read %s", path);
+    ret = -1;
+  }
+  fclose(fp);
+
+  return ret;
+}
+
+const char * conf_file_path(void)
+{
+  return last_path;
+}
+
+void conf_file_args(const char *name, int *argc, char ***argv)
+{
+  struct args a = { .v = NULL, .n = 0, .size = 0 };
+  unsigned int len = strlen(name);
+  int i;
+
+  for(i = 0 ; i < *argc ; i++) {
+    const char *arg = (*argv)[i];
+
+    /* stop at the end of the options */
+    if(i > 0 && !strcmp(arg, "--"))
+      break;
+
+    if(i == 0 || strncmp(arg, "--", 2) || strncmp(arg + 2, name, len)) {
+      push(&a, (*argv)[i]);
+      continue;
+    }
+
+    if(arg[len + 2] == '=')
+      read_file(&a, name, arg + len + 3);
+    else if(arg[len + 2] == '\0') {
+      if(++i == *argc)
+        errx(EXIT_FAILURE, "option '--%s' requires an argument", name);
+      read_file(&a, name, (*argv)[i]);
+    }
+    else
+      push(&a, (*argv)[i]);
+  }
+
+  /* remaining arguments */
+  for(; i < *argc ; i++)
+    push(&a, (*argv)[i]);
+  push(&a, NULL);
+
+  *argc = a.n - 1;
+  *argv = a.v;
+}
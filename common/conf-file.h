@@ -0,0 +1,52 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _CONF_FILE_H_
+#define _CONF_FILE_H_
+
+/* Options read from a configuration file. Each line of the file
+   is a long option without the leading dashes, optionally followed
+   by its argument after spaces or a '=' ("timeout 500000"). Blank
+   lines and lines starting with '#' are ignored. */
+
+/* Replace each --NAME FILE (or --NAME=FILE) in the arguments with
+   the options read from FILE, so that getopt_long() parses them in
+   place and the options given after it on the command line take
+   precedence. The arguments are reallocated and never freed.
+   Exit on error. */
+void conf_file_args(const char *name, int *argc, char ***argv);
+
+/* Path of the last file read by conf_file_args() or NULL. */
+const char * conf_file_path(void);
+
+/* Read the options of a file again (e.g. on SIGHUP) and call fun
+   with each option name and its argument (NULL when there is none).
+   Reading stops at the first non-zero value returned by fun, which
+   is then returned. Return -1 with a warning when the file cannot be
+   read and 0 otherwise. */
+int conf_file_read(const char *path,
+                   int (*fun)(const char *name, const char *arg, void *data),
+                   void *data);
+
+#endif /* _CONF_FILE_H_ */
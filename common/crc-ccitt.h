@@ -0,0 +1,78 @@
+/* Copyright (c) 2017, Aurélien Van Laere <aurelien.vanlaere@umons.ac.be>
+                       David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _CRC_CCITT_H_
+#define _CRC_CCITT_H_
+
+#include <stdint.h>
+
+#define CRC_CCITT_INIT 0xffff
+
+/* Compute the CRC-CCITT of a buffer starting from an initial CRC.
+   This uses the fastest portable implementation. */
+uint16_t crc_ccitt(const unsigned char *s,
+                   unsigned int len,
+                   uint16_t crc);
+
+/* A CRC that can be checkpointed after the bytes shared by many
+   buffers, such as a constant header, and rewound there for each
+   buffer so that only the bytes that change are scanned again. */
+struct crc_ccitt_ctx {
+  uint16_t crc;  /* running CRC */
+  uint16_t ckpt; /* CRC at the checkpoint */
+};
+
+static inline void crc_ccitt_start(struct crc_ccitt_ctx *ctx, uint16_t init)
+{
+  ctx->crc  = init;
+  ctx->ckpt = init;
+}
+
+static inline void crc_ccitt_update(struct crc_ccitt_ctx *ctx,
+                                    const unsigned char *s, unsigned int len)
+{
+  ctx->crc = crc_ccitt(s, len, ctx->crc);
+}
+
+static inline void crc_ccitt_checkpoint(struct crc_ccitt_ctx *ctx)
+{
+  ctx->ckpt = ctx->crc;
+}
+
+static inline void crc_ccitt_rewind(struct crc_ccitt_ctx *ctx)
+{
+  ctx->crc = ctx->ckpt;
+}
+
+/* Implementations exposed for testing.
+   All of them must produce the exact same result. */
+uint16_t crc_ccitt_bytewise(const unsigned char *s,
+                            unsigned int len,
+                            uint16_t crc);
+uint16_t crc_ccitt_slice4(const unsigned char *s,
+                          unsigned int len,
+                          uint16_t crc);
+
+#endif /* _CRC_CCITT_H_ */
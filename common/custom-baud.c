@@ -0,0 +1,58 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# include <asm/termbits.h>
+# include <sys/ioctl.h>
+#endif /* __linux__ */
+#include <errno.h>
+
+#include "custom-baud.h"
+
+#if defined(__linux__) && defined(BOTHER)
+int set_custom_baud(int fd, unsigned int speed)
+{
+  struct termios2 tty;
+
+  if(ioctl(fd, TCGETS2, &tty) < 0)
+    return -1;
+
+  /* same speed for both directions */
+  tty.c_cflag &= ~(CBAUD | CBAUD << IBSHIFT);
+  tty.c_cflag |= BOTHER | BOTHER << IBSHIFT;
+  tty.c_ispeed = speed;
+  tty.c_ospeed = speed;
+
+  return ioctl(fd, TCSETS2, &tty);
+}
+#else
+int set_custom_baud(int fd, unsigned int speed)
+{
+  (void)fd;
+  (void)speed;
+
+  errno = ENOTSUP;
+  return -1;
+}
+#endif /* __linux__ && BOTHER */
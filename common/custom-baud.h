@@ -22,11 +22,14 @@
    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <getopt.h>
+#ifndef _CUSTOM_BAUD_H_
+#define _CUSTOM_BAUD_H_
 
-/* Return the length of a null terminated options array. */
-int opts_len(const struct option *opts);
+/* Set an arbitrary speed on a serial line. This uses termios2
+   with BOTHER on Linux and fails on other systems. It is kept
+   apart from uart.c since the kernel termios2 definitions
+   cannot be included along with <termios.h>. Return 0 on
+   success or -1 on error. */
+int set_custom_baud(int fd, unsigned int speed);
 
-/* Merge two null terminated options array into a newly
-   allocated one. */
-struct option * merge_opts(const struct option *a, const struct option *b);
+#endif /* _CUSTOM_BAUD_H_ */
@@ -0,0 +1,165 @@
+/* File: dump.c
+
+   Copyright (C) 2013 David Hauweele <david@hauweele.net>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "dump.h"
+
+#define WORD_SZ  8
+#define DWORD_SZ (WORD_SZ << 1)
+
+/* lines are written in blocks of this size */
+#define BLOCK_SIZE 4096
+
+static const char hex_digits[] = "0123456789abcdef";
+
+unsigned int hex_dump_line(char *line, const unsigned char *data,
+                           unsigned int size, unsigned int offset)
+{
+  char *p = line;
+  unsigned int i, digits;
+
+  if(size > DWORD_SZ)
+    size = DWORD_SZ;
+
+  /* offset on four digits at least */
+  for(digits = 4 ; digits < 8 && offset >> (digits * 4) ; digits++);
+
+  *p++ = '$';
+  for(i = digits ; i-- ;)
+    *p++ = hex_digits[(offset >> (i * 4)) & 0xf];
+  *p++ = ':';
+  *p++ = ' ';
+
+  for(i = 0 ; i < DWORD_SZ ; i++) {
+    if(i == WORD_SZ)
+      *p++ = ' ';
+
+    if(i < size) {
+      *p++ = hex_digits[data[i] >> 4];
+      *p++ = hex_digits[data[i] & 0xf];
+    }
+    else {
+      *p++ = ' ';
+      *p++ = ' ';
+    }
+    *p++ = ' ';
+  }
+
+  *p++ = '|';
+  for(i = 0 ; i < DWORD_SZ ; i++) {
+    if(i >= size)
+      *p++ = ' ';
+    else if(isprint(data[i]))
+      *p++ = data[i];
+    else
+      *p++ = '.';
+  }
+  *p++ = '|';
+  *p++ = '\n';
+
+  return p - line;
+}
+
+size_t hex_dump_buf(char *buf, size_t buf_size, const unsigned char *data,
+                    unsigned int size, unsigned int offset)
+{
+  char line[HEX_DUMP_LINE];
+  size_t len = 0;
+  unsigned int i, n;
+
+  for(i = 0 ; i < size ; i += DWORD_SZ) {
+    n = hex_dump_line(line, data + i, size - i, offset + i);
+    if(len + n > buf_size)
+      break;
+
+    memcpy(buf + len, line, n);
+    len += n;
+  }
+
+  return len;
+}
+
+/* Render the dump in blocks of lines and pass each block to the writer. */
+static int dump_blocks(const unsigned char *data, unsigned int size, unsigned int offset,
+                       int (*write_block)(const char *block, size_t len, void *arg),
+                       void *arg)
+{
+  char block[BLOCK_SIZE];
+  size_t len = 0;
+  unsigned int i;
+
+  for(i = 0 ; i < size ; i += DWORD_SZ) {
+    if(len + HEX_DUMP_LINE > sizeof(block)) {
+      if(write_block(block, len, arg) < 0)
+        return -1;
+      len = 0;
+    }
+
+    len += hex_dump_line(block + len, data + i, size - i, offset + i);
+  }
+
+  if(len)
+    return write_block(block, len, arg);
+  return 0;
+}
+
+static int write_file(const char *block, size_t len, void *arg)
+{
+  return fwrite(block, 1, len, arg) == len ? 0 : -1;
+}
+
+static int write_fd(const char *block, size_t len, void *arg)
+{
+  int fd = *(int *)arg;
+
+  while(len) {
+    ssize_t n = write(fd, block, len);
+
+    if(n < 0) {
+      if(errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    block += n;
+    len   -= n;
+  }
+
+  return 0;
+}
+
+void hex_dump(const unsigned char *data, int size)
+{
+  hex_dump_offset(data, size, 0);
+}
+
+void hex_dump_offset(const unsigned char *data, int size, unsigned int offset)
+{
+  if(size <= 0)
+    return;
+  dump_blocks(data, size, offset, write_file, stdout);
+}
+
+int hex_dump_fd(int fd, const unsigned char *data, unsigned int size, unsigned int offset)
+{
+  return dump_blocks(data, size, offset, write_fd, &fd);
+}
@@ -0,0 +1,48 @@
+/* File: dump.h
+
+   Copyright (C) 2013 David Hauweele <david@hauweele.net>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program. If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef _DUMP_H_
+#define _DUMP_H_
+
+#include <stddef.h>
+
+/* Longest line of a dump (with 32-bit offsets). */
+#define HEX_DUMP_LINE 80
+
+/* Show an hexadecimal dump of the data. */
+void hex_dump(const unsigned char *data, int size);
+
+/* Same as hex_dump() for data found at offset
+   in a larger buffer that is dumped in parts. */
+void hex_dump_offset(const unsigned char *data, int size, unsigned int offset);
+
+/* Render the line of the dump for up to 16 bytes found at offset
+   into line (at least HEX_DUMP_LINE bytes) and return its length.
+   The line ends with a newline and is not NUL terminated. */
+unsigned int hex_dump_line(char *line, const unsigned char *data,
+                           unsigned int size, unsigned int offset);
+
+/* Render as many complete lines of the dump as fit
+   in the buffer and return the number of bytes used. */
+size_t hex_dump_buf(char *buf, size_t buf_size, const unsigned char *data,
+                    unsigned int size, unsigned int offset);
+
+/* Write the dump to a file descriptor.
+   Return 0 on success and -1 on error. */
+int hex_dump_fd(int fd, const unsigned char *data, unsigned int size, unsigned int offset);
+
+#endif /* _DUMP_H_ */
@@ -0,0 +1,150 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <limits.h>
+#include <stddef.h>
+
+#include "duty.h"
+
+/* EU868 sub-bands for non-specific short range devices
+   (ETSI EN 300 220-2). We do not use LBT/AFA so the duty
+   cycle limit applies to each of them. */
+static const struct duty_band bands[] = {
+  { "863.0-865.0 MHz", 863000000, 865000000, 1 },
+  { "865.0-868.0 MHz", 865000000, 868000000, 10 },
+  { "868.0-868.6 MHz", 868000000, 868600000, 10 },
+  { "868.7-869.2 MHz", 868700000, 869200000, 1 },
+  { "869.4-869.65 MHz", 869400000, 869650000, 100 },
+  { "869.7-870.0 MHz", 869700000, 870000000, 10 }
+};
+
+const struct duty_band * duty_band_lookup(unsigned long frequency)
+{
+  unsigned int i;
+
+  for(i = 0 ; i < sizeof(bands) / sizeof(bands[0]) ; i++)
+    if(frequency >= bands[i].low && frequency <= bands[i].high)
+      return &bands[i];
+  return NULL;
+}
+
+int duty_radio_check(const struct duty_radio *radio)
+{
+  /* SF6 only works with an implicit header */
+  if(radio->sf < 7 || radio->sf > 12)
+    return -1;
+  if(radio->cr < 1 || radio->cr > 4)
+    return -1;
+  if(!radio->bw)
+    return -1;
+  return 0;
+}
+
+/* See the Semtech SX1276 datasheet (section 4.1.1.7). */
+unsigned long duty_airtime(const struct duty_radio *radio, unsigned int size)
+{
+  unsigned long long tsym = (1000000000ULL << radio->sf) / radio->bw; /* ns */
+  int de  = tsym > 16000000ULL; /* low data rate optimization (symbols over 16ms) */
+  long num = 8L * size - 4L * radio->sf + 28 + (radio->crc ? 16 : 0);
+  long den = 4L * (radio->sf - 2 * de);
+  unsigned long long nsym = 8;
+
+  if(num > 0)
+    nsym += (num + den - 1) / den * (radio->cr + 4);
+
+  /* the preamble lasts preamble + 4.25 symbols */
+  return (((radio->preamble * 4ULL + 17) * tsym) / 4 + nsym * tsym + 999) / 1000;
+}
+
+void duty_init(struct duty *d, unsigned int permille, unsigned long now)
+{
+  d->permille = permille;
+  d->capacity = DUTY_WINDOW / 1000 * permille;
+  d->credit   = d->capacity;
+  d->frac     = 0;
+  d->stamp    = now;
+  d->airtime  = 0;
+}
+
+/* Credit after the refill since the last update. With a 32-bit clock
+   the refill after more than 71 minutes of silence is underestimated
+   which only makes us more conservative. */
+static long refill(const struct duty *d, unsigned long now, unsigned long *frac)
+{
+  unsigned long long units = (unsigned long long)(now - d->stamp) * d->permille + d->frac;
+  long long credit = d->credit + (long long)(units / 1000);
+
+  *frac = units % 1000;
+  if(credit >= (long long)d->capacity) {
+    credit = d->capacity;
+    *frac  = 0;
+  }
+
+  return credit;
+}
+
+void duty_charge(struct duty *d, unsigned long airtime, unsigned long now)
+{
+  long credit = refill(d, now, &d->frac);
+
+  /* We keep at most one window of debt. */
+  if(airtime > d->capacity || credit - (long)airtime < -(long)d->capacity)
+    credit = -(long)d->capacity;
+  else
+    credit -= airtime;
+
+  d->credit   = credit;
+  d->stamp    = now;
+  d->airtime += airtime;
+}
+
+unsigned long duty_delay(const struct duty *d, unsigned long airtime, unsigned long now)
+{
+  unsigned long frac;
+  unsigned long long missing, delay;
+  long credit;
+
+  if(!d->permille)
+    return 0;
+
+  if(airtime > d->capacity)
+    airtime = d->capacity;
+
+  credit = refill(d, now, &frac);
+  if(credit >= (long)airtime)
+    return 0;
+
+  /* time to refill the missing credit */
+  missing = ((long long)airtime - credit) * 1000ULL - frac;
+  delay   = (missing + d->permille - 1) / d->permille;
+
+  return delay > ULONG_MAX ? ULONG_MAX : delay;
+}
+
+long duty_credit(const struct duty *d, unsigned long now)
+{
+  unsigned long frac;
+
+  return refill(d, now, &frac);
+}
@@ -0,0 +1,94 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _DUTY_H_
+#define _DUTY_H_
+
+/* Time on air of LoRa frames and duty cycle accounting for the
+   EU868 sub-bands (ETSI EN 300 220). This is pure C, the caller
+   provides the clock and the locking.
+
+   The budget of a sub-band is a token bucket of time on air. It
+   refills at the duty cycle of the sub-band and holds at most
+   the time on air allowed over DUTY_WINDOW, so that bursts are
+   allowed as long as the average stays within the limit. */
+
+/* The duty cycle is averaged over one hour. */
+#define DUTY_WINDOW 3600000000UL /* us */
+
+/* LoRa modulation settings. */
+struct duty_radio {
+  unsigned int  sf;       /* spreading factor (6 to 12) */
+  unsigned long bw;       /* bandwidth in Hz */
+  unsigned int  cr;       /* coding rate 4/(4 + cr) (1 to 4) */
+  unsigned int  preamble; /* preamble length in symbols */
+  unsigned int  crc;      /* payload CRC enabled */
+};
+
+/* Default settings of the modules, SF7 on 125kHz with a 4/5 coding rate. */
+#define DUTY_RADIO_DEFAULT { .sf = 7, .bw = 125000, .cr = 1, .preamble = 8, .crc = 1 }
+
+/* A sub-band and its duty cycle. */
+struct duty_band {
+  const char   *name;
+  unsigned long low;      /* Hz */
+  unsigned long high;     /* Hz */
+  unsigned int  permille; /* duty cycle in 1/1000 */
+};
+
+/* Budget of a sub-band. */
+struct duty {
+  unsigned int  permille;
+  unsigned long capacity; /* us of time on air after a window of silence */
+  long          credit;   /* us of time on air left, negative once overdrawn */
+  unsigned long frac;     /* refill remainder (in 1/1000 us) */
+  unsigned long stamp;    /* clock of the last refill */
+  unsigned long airtime;  /* total us charged */
+};
+
+/* Return the EU868 sub-band of a frequency or NULL when there is none. */
+const struct duty_band * duty_band_lookup(unsigned long frequency);
+
+/* Check the modulation settings. Return 0 when they are valid. */
+int duty_radio_check(const struct duty_radio *radio);
+
+/* Time on air of a frame of size bytes in us (explicit header). */
+unsigned long duty_airtime(const struct duty_radio *radio, unsigned int size);
+
+/* Start with a full budget. */
+void duty_init(struct duty *d, unsigned int permille, unsigned long now);
+
+/* Account a transmission. Frames that cannot be deferred (such as
+   ACKs) are charged even when the budget is exhausted. */
+void duty_charge(struct duty *d, unsigned long airtime, unsigned long now);
+
+/* Delay in us until a transmission of airtime us fits in the budget
+   or 0 when it already does. Transmissions longer than the capacity
+   are allowed once the budget is full. */
+unsigned long duty_delay(const struct duty *d, unsigned long airtime, unsigned long now);
+
+/* Time on air left in us. This does not update the budget. */
+long duty_credit(const struct duty *d, unsigned long now);
+
+#endif /* _DUTY_H_ */
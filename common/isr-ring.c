@@ -0,0 +1,122 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+
+#include "isr-ring.h"
+
+/* The head is only written by the producer and the tail by the
+   consumer. Both indexes are published and read sequentially
+   consistent: the producer checks the tail after publishing the
+   head and the consumer checks the head after publishing the tail.
+   So either the producer sees that the ring was drained and rings
+   the doorbell, or the consumer sees the new bytes before it goes
+   to sleep. On a single core the interrupt handler cannot be
+   interleaved with the task anyway. */
+#define LOAD(v)     __atomic_load_n(&(v), __ATOMIC_SEQ_CST)
+#define STORE(v, x) __atomic_store_n(&(v), x, __ATOMIC_SEQ_CST)
+
+int isr_ring_init(struct isr_ring *r, unsigned char *buf, unsigned int size,
+                  void (*doorbell)(void *data), void *data)
+{
+  if(!size || (size & (size - 1)))
+    return -1;
+
+  *r = (struct isr_ring){ .buf      = buf,
+                          .size     = size,
+                          .doorbell = doorbell,
+                          .data     = data };
+  return 0;
+}
+
+/* Publish the bytes up to head and ring the
+   doorbell if the consumer had drained the ring. */
+static void publish(struct isr_ring *r, unsigned int head)
+{
+  unsigned int old = r->head;
+
+  STORE(r->head, head);
+  if(r->doorbell && LOAD(r->tail) == old)
+    r->doorbell(r->data);
+}
+
+int isr_ring_putc(struct isr_ring *r, unsigned char c)
+{
+  unsigned int head = r->head;
+
+  /* Indexes wrap around but their difference
+     is always the number of used bytes. */
+  if(head - LOAD(r->tail) == r->size) {
+    __atomic_add_fetch(&r->drops, 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+
+  r->buf[head & (r->size - 1)] = c;
+  publish(r, head + 1);
+  return 0;
+}
+
+unsigned int isr_ring_put(struct isr_ring *r, const unsigned char *buf, unsigned int size)
+{
+  unsigned int head = r->head;
+  unsigned int room = r->size - (head - LOAD(r->tail));
+  unsigned int i;
+
+  if(size > room) {
+    __atomic_add_fetch(&r->drops, size - room, __ATOMIC_RELAXED);
+    size = room;
+  }
+  if(!size)
+    return 0;
+
+  for(i = 0 ; i < size ; i++)
+    r->buf[(head + i) & (r->size - 1)] = buf[i];
+  publish(r, head + size);
+  return size;
+}
+
+unsigned int isr_ring_peek(struct isr_ring *r, const unsigned char **p)
+{
+  unsigned int tail   = r->tail;
+  unsigned int used   = LOAD(r->head) - tail;
+  unsigned int offset = tail & (r->size - 1);
+
+  /* only up to the end of the buffer,
+     the rest comes with the next peek */
+  if(used > r->size - offset)
+    used = r->size - offset;
+
+  *p = r->buf + offset;
+  return used;
+}
+
+void isr_ring_consume(struct isr_ring *r, unsigned int size)
+{
+  STORE(r->tail, r->tail + size);
+}
+
+unsigned long isr_ring_drops(struct isr_ring *r)
+{
+  return __atomic_load_n(&r->drops, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,81 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _ISR_RING_H_
+#define _ISR_RING_H_
+
+/* Single producer single consumer byte ring for the MCU ports.
+
+   The *_uart_putc() functions of the drivers parse frames and
+   call recv_frame() when one is complete, which may block and is
+   too much work for an interrupt handler. Instead the UART
+   interrupt handler only enqueues the received bytes with
+   isr_ring_putc() (or isr_ring_put() for a DMA block) and a task
+   drains the ring through the bulk deframers:
+
+     while((n = isr_ring_peek(&ring, &p))) {
+       g3plc_uart_feed(&plc, p, n);
+       isr_ring_consume(&ring, n);
+     }
+
+   Enqueuing never blocks, takes no lock and does not depend on
+   the C library, so the interrupt latency stays bounded. When
+   the ring is full the bytes are dropped and counted (the
+   deframers resynchronize on the next frame). The doorbell is
+   called from the producer when the ring goes from empty to not
+   empty, e.g. to give a semaphore or notify the task. So the task
+   has to drain the ring until it is empty before it waits again.
+   The buffer is provided by the caller, there is no allocation. */
+struct isr_ring {
+  unsigned char *buf;
+  unsigned int   size;  /* power of two */
+  unsigned int   head;  /* written by the producer */
+  unsigned int   tail;  /* written by the consumer */
+  unsigned long  drops; /* bytes dropped because the ring was full */
+  void (*doorbell)(void *data);
+  void *data;
+};
+
+/* Initialize a ring over a buffer of size bytes (a power of two).
+   The doorbell can be NULL when the task polls the ring.
+   Returns -1 when the size is not a power of two. */
+int isr_ring_init(struct isr_ring *r, unsigned char *buf, unsigned int size,
+                  void (*doorbell)(void *data), void *data);
+
+/* Producer side (interrupt handler). Enqueue a byte or a block
+   of bytes. The putc variant returns -1 when the byte was
+   dropped, the block variant the number of bytes enqueued. */
+int isr_ring_putc(struct isr_ring *r, unsigned char c);
+unsigned int isr_ring_put(struct isr_ring *r, const unsigned char *buf, unsigned int size);
+
+/* Consumer side (task). Point to the next contiguous bytes and
+   return their number (0 when the ring is empty). Those bytes
+   stay valid until they are released with isr_ring_consume(). */
+unsigned int isr_ring_peek(struct isr_ring *r, const unsigned char **p);
+void isr_ring_consume(struct isr_ring *r, unsigned int size);
+
+/* Number of bytes dropped so far. */
+unsigned long isr_ring_drops(struct isr_ring *r);
+
+#endif /* _ISR_RING_H_ */
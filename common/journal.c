@@ -0,0 +1,299 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _POSIX_C_SOURCE 200112L
+#endif /* __linux__ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "crc-ccitt.h"
+#include "journal.h"
+
+#define REC_SIZE(size) \
+  ((sizeof(struct journal_rec) + (size) + JOURNAL_ALIGN - 1) & ~(size_t)(JOURNAL_ALIGN - 1))
+
+static struct journal_rec * rec_at(const struct journal *j, size_t offset)
+{
+  return (struct journal_rec *)(j->map + offset);
+}
+
+static uint16_t rec_crc(uint16_t dst, const void *payload, unsigned int size)
+{
+  uint16_t crc = crc_ccitt((const unsigned char *)&dst, sizeof(dst), CRC_CCITT_INIT);
+
+  return crc_ccitt(payload, size, crc);
+}
+
+static unsigned char * map_file(int fd, size_t size)
+{
+  void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  return base == MAP_FAILED ? NULL : base;
+}
+
+/* Find the end of the journal and count the frames not done. */
+static void recover(struct journal *j)
+{
+  size_t offset = sizeof(struct journal_hdr);
+  struct journal_rec *rec;
+
+  j->head  = 0;
+  j->dead  = 0;
+  j->count = 0;
+
+  while(offset + sizeof(struct journal_rec) <= j->size) {
+    rec = rec_at(j, offset);
+
+    if(!rec->size)
+      break;
+
+    /* torn record, clear it so that it is not found again
+       after the records appended later */
+    if(offset + REC_SIZE(rec->size) > j->size ||
+       rec->crc != rec_crc(rec->dst, journal_payload(rec), rec->size)) {
+      memset(rec, 0, j->size - offset);
+      j->dirty = 1;
+      break;
+    }
+
+    if(rec->done)
+      j->dead += REC_SIZE(rec->size);
+    else {
+      if(!j->count)
+        j->head = offset;
+      j->count++;
+    }
+
+    offset += REC_SIZE(rec->size);
+  }
+
+  j->tail = offset;
+  if(!j->count)
+    j->head = j->tail;
+}
+
+int journal_open(struct journal *j, const char *path, size_t size)
+{
+  struct journal_hdr *hdr;
+  struct stat st;
+  int fd, e;
+
+  *j = (struct journal){ 0 };
+
+  fd = open(path, O_RDWR | O_CREAT, 0644);
+  if(fd < 0)
+    return -1;
+  if(fstat(fd, &st) < 0)
+    goto fail;
+
+  /* keep the frames of a larger journal */
+  if((size_t)st.st_size > size)
+    size = st.st_size;
+  else if(ftruncate(fd, size) < 0)
+    goto fail;
+
+  j->size = size;
+  j->map  = map_file(fd, size);
+  if(!j->map)
+    goto fail;
+  close(fd);
+
+  j->path = malloc(strlen(path) + 1);
+  if(!j->path) {
+    munmap(j->map, j->size);
+    return -1;
+  }
+  strcpy(j->path, path);
+
+  hdr = (struct journal_hdr *)j->map;
+  if(!st.st_size) {
+    hdr->magic   = JOURNAL_MAGIC;
+    hdr->version = JOURNAL_VERSION;
+    j->dirty     = 1;
+  }
+  else if(hdr->magic != JOURNAL_MAGIC || hdr->version != JOURNAL_VERSION) {
+    journal_close(j);
+    errno = EINVAL;
+    return -1;
+  }
+
+  recover(j);
+  return 0;
+
+fail:
+  e = errno;
+  close(fd);
+  errno = e;
+  return -1;
+}
+
+void journal_close(struct journal *j)
+{
+  munmap(j->map, j->size);
+  free(j->path);
+}
+
+int journal_append(struct journal *j, uint16_t dst,
+                   const void *payload, unsigned int size)
+{
+  struct journal_rec *rec;
+
+  /* keep room for the null size that ends the journal */
+  if(j->tail + REC_SIZE(size) + sizeof(struct journal_rec) > j->size) {
+    j->full = 1;
+    return -1;
+  }
+
+  rec = rec_at(j, j->tail);
+  rec->crc  = rec_crc(dst, payload, size);
+  rec->dst  = dst;
+  rec->done = 0;
+  memcpy(rec + 1, payload, size);
+  rec->size = size;
+
+  if(!j->count)
+    j->head = j->tail;
+  j->tail += REC_SIZE(size);
+  j->count++;
+  j->dirty = 1;
+
+  return 0;
+}
+
+struct journal_rec * journal_next(struct journal *j, const struct journal_rec *rec)
+{
+  size_t offset;
+
+  if(rec)
+    offset = (const unsigned char *)rec - j->map + REC_SIZE(rec->size);
+  else
+    offset = j->head;
+
+  for(; offset < j->tail ; offset += REC_SIZE(rec_at(j, offset)->size))
+    if(!rec_at(j, offset)->done)
+      return rec_at(j, offset);
+
+  return NULL;
+}
+
+void journal_done(struct journal *j, struct journal_rec *rec)
+{
+  size_t offset = (unsigned char *)rec - j->map;
+
+  rec->done = 1;
+  j->dead  += REC_SIZE(rec->size);
+  j->count--;
+  j->dirty  = 1;
+
+  /* skip the frames done at the head */
+  if(offset == j->head) {
+    rec = journal_next(j, rec);
+    j->head = rec ? (size_t)((unsigned char *)rec - j->map) : j->tail;
+  }
+}
+
+/* Rewrite the frames not done in a new file that replaces the
+   journal once it is on the disk. */
+static int compact(struct journal *j)
+{
+  struct journal_hdr *hdr;
+  struct journal_rec *rec;
+  unsigned char *map;
+  size_t offset = sizeof(struct journal_hdr);
+  char *tmp;
+  int fd, e;
+
+  tmp = malloc(strlen(j->path) + sizeof(".tmp"));
+  if(!tmp)
+    return -1;
+  sprintf(tmp, "%s.tmp", j->path);
+
+  fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0)
+    goto fail;
+  if(ftruncate(fd, j->size) < 0 || !(map = map_file(fd, j->size)))
+    goto fail_fd;
+
+  hdr = (struct journal_hdr *)map;
+  hdr->magic   = JOURNAL_MAGIC;
+  hdr->version = JOURNAL_VERSION;
+
+  for(rec = journal_next(j, NULL) ; rec ; rec = journal_next(j, rec)) {
+    memcpy(map + offset, rec, REC_SIZE(rec->size));
+    offset += REC_SIZE(rec->size);
+  }
+
+  if(msync(map, offset, MS_SYNC) < 0 || fsync(fd) < 0 || rename(tmp, j->path) < 0) {
+    munmap(map, j->size);
+    goto fail_fd;
+  }
+
+  close(fd);
+  free(tmp);
+
+  munmap(j->map, j->size);
+  j->map   = map;
+  j->head  = sizeof(struct journal_hdr);
+  j->tail  = offset;
+  j->dead  = 0;
+  j->dirty = 0;
+  j->full  = 0;
+
+  return 0;
+
+fail_fd:
+  e = errno;
+  close(fd);
+  unlink(tmp);
+  errno = e;
+fail:
+  e = errno;
+  free(tmp);
+  errno = e;
+  return -1;
+}
+
+int journal_sync(struct journal *j)
+{
+  if(j->dead && (j->full || j->dead >= j->size / 2))
+    return compact(j);
+
+  if(!j->dirty)
+    return 0;
+
+  /* only the pages written since the last sync are flushed */
+  if(msync(j->map, j->size, MS_SYNC) < 0)
+    return -1;
+
+  j->dirty = 0;
+  return 0;
+}
@@ -0,0 +1,105 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Append only journal of frames in a file mapped in memory.
+   Frames are appended at the tail and marked done in place once
+   they were sent. The file is rewritten without the done frames
+   when they fill half of it or when an append did not fit.
+
+   Appends only write to memory. The journal is written to the
+   disk by journal_sync(), once for all the frames appended since
+   the previous sync, so that a burst of frames costs a single
+   flush. A frame appended after the last sync may be lost if the
+   host crashes.
+
+   Each record is a header followed by the payload padded to
+   JOURNAL_ALIGN bytes. A null size ends the journal. A record
+   with an invalid CRC was torn by a crash, it is dropped with
+   the end of the journal on open. The journal is not locked. */
+#define JOURNAL_MAGIC   0x4a534d57 /* "WMSJ" */
+#define JOURNAL_VERSION 1
+#define JOURNAL_ALIGN   8
+
+struct journal_hdr {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t reserved;
+};
+
+struct journal_rec {
+  uint16_t size; /* payload size */
+  uint16_t crc;  /* CRC-CCITT of the destination and payload */
+  uint16_t dst;
+  uint8_t  done; /* set once the frame was sent */
+  uint8_t  reserved;
+};
+
+struct journal {
+  char *path;
+  unsigned char *map;
+  size_t size;
+  size_t head;        /* first record not done */
+  size_t tail;        /* end of the last record */
+  size_t dead;        /* bytes of the records done */
+  unsigned int count; /* records not done */
+  int dirty;          /* changed since the last sync */
+  int full;           /* an append did not fit */
+};
+
+/* Open the journal file or create it with this size in bytes and
+   recover the frames not done. An existing file keeps its size
+   when it is larger. Return 0 on success or -1 on error with errno
+   set, EINVAL when the file is not a journal of this version. */
+int journal_open(struct journal *j, const char *path, size_t size);
+void journal_close(struct journal *j);
+
+/* Append a frame. Return 0 on success or -1 when the journal is
+   full, in which case the next sync tries to make room. */
+int journal_append(struct journal *j, uint16_t dst,
+                   const void *payload, unsigned int size);
+
+/* Iterate over the frames not done, from the oldest. Pass NULL
+   for the first frame. Return NULL after the last one. The
+   records stay in place until the next sync. */
+struct journal_rec * journal_next(struct journal *j, const struct journal_rec *rec);
+
+static inline const void * journal_payload(const struct journal_rec *rec)
+{
+  return rec + 1;
+}
+
+/* Mark a frame as sent. */
+void journal_done(struct journal *j, struct journal_rec *rec);
+
+/* Flush the changes to the disk and compact the journal when
+   needed. Return 0 on success or -1 on error with errno set. */
+int journal_sync(struct journal *j);
+
+#endif /* _JOURNAL_H_ */
@@ -0,0 +1,191 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "jsonl.h"
+
+#define MAX_STR 64
+
+static const char hex[] = "0123456789abcdef";
+static const char base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* Separator and key of the next field. */
+static char * key(char *b, const char *k)
+{
+  size_t len = strlen(k);
+
+  if(b[-1] != '{')
+    *b++ = ',';
+  *b++ = '"';
+  memcpy(b, k, len);
+  b += len;
+  *b++ = '"';
+  *b++ = ':';
+
+  return b;
+}
+
+char * jsonl_begin(char *b)
+{
+  *b++ = '{';
+  return b;
+}
+
+char * jsonl_end(char *b)
+{
+  *b++ = '}';
+  *b++ = '\n';
+  return b;
+}
+
+char * jsonl_str(char *b, const char *k, const char *value)
+{
+  const unsigned char *s = (const unsigned char *)value;
+  unsigned int n;
+
+  b = key(b, k);
+  *b++ = '"';
+  for(n = 0 ; *s && n < MAX_STR ; s++, n++) {
+    if(*s == '"' || *s == '\\') {
+      *b++ = '\\';
+      *b++ = *s;
+    }
+    else if(*s < 0x20) {
+      memcpy(b, "\\u00", 4);
+      b[4] = hex[*s >> 4];
+      b[5] = hex[*s & 0xf];
+      b += 6;
+    }
+    else
+      *b++ = *s;
+  }
+  *b++ = '"';
+
+  return b;
+}
+
+static char * put_uint(char *b, uint64_t value)
+{
+  char digits[20], *d = digits + sizeof(digits);
+  size_t len;
+
+  do {
+    *--d = '0' + value % 10;
+    value /= 10;
+  } while(value);
+
+  len = digits + sizeof(digits) - d;
+  memcpy(b, d, len);
+
+  return b + len;
+}
+
+char * jsonl_uint(char *b, const char *k, uint64_t value)
+{
+  return put_uint(key(b, k), value);
+}
+
+char * jsonl_int(char *b, const char *k, int64_t value)
+{
+  b = key(b, k);
+  if(value >= 0)
+    return put_uint(b, value);
+
+  *b++ = '-';
+  return put_uint(b, -(uint64_t)value);
+}
+
+char * jsonl_addr(char *b, const char *k, uint16_t addr)
+{
+  static const char upper[] = "0123456789ABCDEF";
+
+  b = key(b, k);
+  b[0] = '"';
+  b[1] = upper[addr >> 12];
+  b[2] = upper[addr >> 8 & 0xf];
+  b[3] = upper[addr >> 4 & 0xf];
+  b[4] = upper[addr & 0xf];
+  b[5] = '"';
+
+  return b + 6;
+}
+
+static char * put_hex(char *b, const unsigned char *d, size_t size)
+{
+  for(; size ; size--, d++) {
+    *b++ = hex[*d >> 4];
+    *b++ = hex[*d & 0xf];
+  }
+
+  return b;
+}
+
+static char * put_base64(char *b, const unsigned char *d, size_t size)
+{
+  uint32_t v;
+
+  for(; size >= 3 ; size -= 3, d += 3) {
+    v = (uint32_t)d[0] << 16 | d[1] << 8 | d[2];
+    b[0] = base64[v >> 18];
+    b[1] = base64[v >> 12 & 0x3f];
+    b[2] = base64[v >> 6 & 0x3f];
+    b[3] = base64[v & 0x3f];
+    b += 4;
+  }
+
+  if(size) {
+    v = (uint32_t)d[0] << 16 | (size > 1 ? d[1] << 8 : 0);
+    b[0] = base64[v >> 18];
+    b[1] = base64[v >> 12 & 0x3f];
+    b[2] = size > 1 ? base64[v >> 6 & 0x3f] : '=';
+    b[3] = '=';
+    b += 4;
+  }
+
+  return b;
+}
+
+char * jsonl_bytes(char *b, const char *k, const void *data, size_t size,
+                   enum jsonl_bytes encoding)
+{
+  b = key(b, k);
+  *b++ = '"';
+  if(encoding == JSONL_BASE64)
+    b = put_base64(b, data, size);
+  else
+    b = put_hex(b, data, size);
+  *b++ = '"';
+
+  return b;
+}
+
+int jsonl_encoding(const char *name)
+{
+  if(!strcmp(name, "hex"))
+    return JSONL_HEX;
+  if(!strcmp(name, "base64"))
+    return JSONL_BASE64;
+  return -1;
+}
@@ -0,0 +1,81 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _JSONL_H_
+#define _JSONL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Newline-delimited JSON records written in place without
+   allocation nor stdio formatting, so that the records of the
+   received frames keep up with the full frame rate. A record is
+   built in a buffer of the caller from jsonl_begin() to
+   jsonl_end(), each function writes at b and returns the end of
+   what it wrote:
+
+     b = jsonl_begin(buf);
+     b = jsonl_str(b, "status", "success");
+     b = jsonl_end(b);
+     fwrite(buf, 1, b - buf, stdout);
+
+   Keys are written as is, they are expected to be literals that
+   need no escape. The buffer is sized by the caller with
+   JSONL_SIZE() for the payload of the record. */
+
+/* Fields other than the payload, keys and string values included. */
+#define JSONL_FIELDS_SIZE 512
+
+#define JSONL_HEX_SIZE(size)    (2 * (size))
+#define JSONL_BASE64_SIZE(size) (4 * (((size) + 2) / 3))
+
+/* Largest record with a payload of size bytes in either encoding. */
+#define JSONL_SIZE(size) (JSONL_FIELDS_SIZE + JSONL_HEX_SIZE(size))
+
+/* Encoding of the byte strings. */
+enum jsonl_bytes {
+  JSONL_HEX,
+  JSONL_BASE64
+};
+
+char * jsonl_begin(char *b);
+char * jsonl_end(char *b);
+
+/* The value is escaped, at most 64 bytes of it are written. */
+char * jsonl_str(char *b, const char *key, const char *value);
+char * jsonl_uint(char *b, const char *key, uint64_t value);
+char * jsonl_int(char *b, const char *key, int64_t value);
+
+/* Short address as a string of four hex digits as in the dumps. */
+char * jsonl_addr(char *b, const char *key, uint16_t addr);
+
+/* Bytes as a string in the encoding. */
+char * jsonl_bytes(char *b, const char *key, const void *data, size_t size,
+                   enum jsonl_bytes encoding);
+
+/* Parse the name of an encoding (hex or base64).
+   Return -1 when the name is unknown. */
+int jsonl_encoding(const char *name);
+
+#endif /* _JSONL_H_ */
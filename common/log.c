@@ -0,0 +1,297 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _POSIX_C_SOURCE 200112L
+#endif /* __linux__ */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+
+#include "dump.h"
+#include "prof.h"
+#include "txq.h"
+#include "log.h"
+
+/* number of queued items (power of two) */
+#define LOG_DEPTH 512
+
+/* Longest line, longer lines are truncated. Dumps are split in
+   parts of the same size which must be a multiple of 16 bytes
+   so that the lines of hex_dump() are aligned across parts. */
+#define LOG_ITEM_SIZE 256
+
+enum item_type {
+  ITEM_TEXT,
+  ITEM_DUMP,
+  ITEM_STOP
+};
+
+struct log_item {
+  uint8_t       type;
+  uint16_t      size;
+  unsigned int  offset; /* of a dump part */
+  unsigned char data[LOG_ITEM_SIZE];
+};
+
+static struct log_category_state {
+  unsigned long window;     /* second of the current window */
+  unsigned int  count;      /* messages in the window */
+  unsigned long suppressed; /* reported when the next window opens */
+  struct log_stats stats;
+} categories[LOG_CATEGORIES];
+
+static const char *category_names[LOG_CATEGORIES] = { "main", "rx", "tx" };
+
+static struct txq log_queue;
+static pthread_t writer_thread;
+static volatile int started;
+static enum log_level max_level = LOG_LVL_DEBUG;
+static unsigned int max_rate;
+
+static unsigned long now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+static void push(enum log_category cat, const struct log_item *item)
+{
+  if(txq_push(&log_queue, TXQ_CONTROL, item, NULL) < 0)
+    __atomic_fetch_add(&categories[cat].stats.overflow, 1, __ATOMIC_RELAXED);
+}
+
+static void push_text(enum log_category cat, const char *fmt, va_list ap)
+{
+  struct log_item item;
+  int n;
+
+  n = vsnprintf((char *)item.data, sizeof(item.data), fmt, ap);
+  if(n < 0)
+    return;
+
+  /* mark truncated lines */
+  if((unsigned int)n >= sizeof(item.data)) {
+    n = sizeof(item.data) - 1;
+    memcpy(item.data + n - 4, "...\n", 4);
+  }
+
+  item.type = ITEM_TEXT;
+  item.size = n;
+  push(cat, &item);
+}
+
+static void push_line(enum log_category cat, const char *fmt, ...)
+{
+  va_list ap;
+
+  va_start(ap, fmt);
+  push_text(cat, fmt, ap);
+  va_end(ap);
+}
+
+/* Check the rate limit of a category. The counters are reset once
+   per second by the first message that sees a new window and which
+   reports the messages suppressed in the previous one. Messages
+   racing with the reset may be counted in either window. */
+static int allow(enum log_category cat)
+{
+  struct log_category_state *c = &categories[cat];
+  unsigned long window, sec;
+
+  if(!max_rate)
+    return 1;
+
+  sec    = now();
+  window = __atomic_load_n(&c->window, __ATOMIC_RELAXED);
+  if(window != sec &&
+     __atomic_compare_exchange_n(&c->window, &window, sec, 0,
+                                 __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    unsigned long suppressed = __atomic_exchange_n(&c->suppressed, 0, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&c->count, 0, __ATOMIC_RELAXED);
+    if(suppressed)
+      push_line(cat, "log: %lu %s messages suppressed\n", suppressed, category_names[cat]);
+  }
+
+  if(__atomic_fetch_add(&c->count, 1, __ATOMIC_RELAXED) < max_rate)
+    return 1;
+
+  __atomic_fetch_add(&c->suppressed, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&c->stats.limited, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+static void write_item(const struct log_item *item)
+{
+  switch(item->type) {
+  case ITEM_TEXT:
+    fwrite(item->data, 1, item->size, stdout);
+    break;
+  case ITEM_DUMP:
+    hex_dump_offset(item->data, item->size, item->offset);
+    break;
+  case ITEM_STOP:
+    break;
+  }
+}
+
+/* The lines are queued as control items, an item queued
+   as bulk is only drained after them and stops the writer.
+   The writer thus sleeps until there is something to do. */
+static void * writer_thread_func(void *arg)
+{
+  static struct log_item item;
+  int class;
+
+  (void)arg;
+  prof_thread("log");
+
+  do {
+    class = txq_pop(&log_queue, &item, 1);
+
+    /* write what is queued and flush once the
+       queue is empty so that output stays interactive */
+    while(class == TXQ_CONTROL) {
+      write_item(&item);
+      class = txq_pop(&log_queue, &item, 0);
+    }
+
+    fflush(stdout);
+  } while(class != TXQ_BULK);
+
+  /* drain what was queued before the exit */
+  while(txq_pop(&log_queue, &item, 0) >= 0)
+    write_item(&item);
+  fflush(stdout);
+
+  return NULL;
+}
+
+static void log_close(void)
+{
+  static const struct log_item stop = { .type = ITEM_STOP };
+  unsigned long limited = 0, overflow = 0;
+  int i;
+
+  if(txq_push(&log_queue, TXQ_BULK, &stop, NULL) < 0)
+    errx(EXIT_FAILURE, "cannot stop log thread");
+  pthread_join(writer_thread, NULL);
+
+  for(i = 0 ; i < LOG_CATEGORIES ; i++) {
+    limited  += categories[i].stats.limited;
+    overflow += categories[i].stats.overflow;
+  }
+
+  if(overflow)
+    warnx("log queue full, %lu lines dropped", overflow);
+  if(limited)
+    warnx("log rate limit, %lu messages dropped", limited);
+}
+
+void log_init(enum log_level level, unsigned int rate)
+{
+  max_level = level;
+  max_rate  = rate;
+
+  txq_init(&log_queue, TXQ_STRICT, NULL, LOG_DEPTH, sizeof(struct log_item));
+
+  if(pthread_create(&writer_thread, NULL, writer_thread_func, NULL))
+    errx(EXIT_FAILURE, "cannot create log thread");
+
+  started = 1;
+  atexit(log_close);
+}
+
+void log_msg(enum log_category cat, enum log_level level, const char *fmt, ...)
+{
+  va_list ap;
+
+  if(level > max_level)
+    return;
+
+  va_start(ap, fmt);
+  if(!started)
+    vprintf(fmt, ap);
+  else if(allow(cat)) {
+    __atomic_fetch_add(&categories[cat].stats.logged, 1, __ATOMIC_RELAXED);
+    push_text(cat, fmt, ap);
+  }
+  va_end(ap);
+}
+
+void log_dump(enum log_category cat, enum log_level level, const char *head,
+              const void *buf, unsigned int size, const char *tail)
+{
+  struct log_item item;
+  const unsigned char *b = buf;
+  unsigned int offset;
+
+  if(level > max_level)
+    return;
+
+  if(!started) {
+    if(head)
+      fputs(head, stdout);
+    hex_dump(buf, size);
+    if(tail)
+      fputs(tail, stdout);
+    return;
+  }
+
+  if(!allow(cat))
+    return;
+  __atomic_fetch_add(&categories[cat].stats.logged, 1, __ATOMIC_RELAXED);
+
+  if(head)
+    push_line(cat, "%s", head);
+
+  item.type = ITEM_DUMP;
+  for(offset = 0 ; offset < size ; offset += LOG_ITEM_SIZE) {
+    item.size   = size - offset < LOG_ITEM_SIZE ? size - offset : LOG_ITEM_SIZE;
+    item.offset = offset;
+    memcpy(item.data, b + offset, item.size);
+    push(cat, &item);
+  }
+
+  if(tail)
+    push_line(cat, "%s", tail);
+}
+
+void log_stats(enum log_category cat, struct log_stats *stats)
+{
+  struct log_category_state *c = &categories[cat];
+
+  stats->logged   = __atomic_load_n(&c->stats.logged, __ATOMIC_RELAXED);
+  stats->limited  = __atomic_load_n(&c->stats.limited, __ATOMIC_RELAXED);
+  stats->overflow = __atomic_load_n(&c->stats.overflow, __ATOMIC_RELAXED);
+}
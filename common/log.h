@@ -0,0 +1,76 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _LOG_H_
+#define _LOG_H_
+
+/* Asynchronous logging. Messages are copied to a lock-free queue
+   and written to stdout by a background thread so that a slow
+   terminal or pipe never blocks the receive path. Hex dumps are
+   only formatted by the background thread. Each category is rate
+   limited and messages are dropped (and counted) rather than
+   blocking when the queue is full.
+
+   Until log_init() is called messages are printed directly. */
+
+enum log_level {
+  LOG_LVL_ERROR,
+  LOG_LVL_WARN,
+  LOG_LVL_INFO,
+  LOG_LVL_DEBUG
+};
+
+enum log_category {
+  LOG_CAT_MAIN,
+  LOG_CAT_RX,
+  LOG_CAT_TX,
+  LOG_CATEGORIES
+};
+
+/* Drop accounting. */
+struct log_stats {
+  unsigned long logged;   /* messages queued */
+  unsigned long limited;  /* messages dropped by the rate limit */
+  unsigned long overflow; /* lines or dump parts dropped because the queue was full */
+};
+
+/* Start the background thread. Messages above level are discarded
+   and each category is limited to rate messages per second (0 for
+   no limit). The queue is drained on exit. Exit on error. */
+void log_init(enum log_level level, unsigned int rate);
+
+/* Log a message. */
+void log_msg(enum log_category cat, enum log_level level, const char *fmt, ...)
+  __attribute__((format(printf, 3, 4)));
+
+/* Log a hex dump of size bytes between two optional lines of text (head
+   and tail may be NULL). This counts as a single message for the rate
+   limit and the bytes are only formatted by the background thread. */
+void log_dump(enum log_category cat, enum log_level level, const char *head,
+              const void *buf, unsigned int size, const char *tail);
+
+/* Copy the drop accounting of a category. */
+void log_stats(enum log_category cat, struct log_stats *stats);
+
+#endif /* _LOG_H_ */
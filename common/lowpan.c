@@ -0,0 +1,474 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lowpan.h"
+
+/* IPHC encoding (see RFC 6282 section 3.1) */
+#define IPHC_NH   0x04 /* next header compressed (first byte) */
+#define IPHC_CID  0x80 /* second byte */
+#define IPHC_SAC  0x40
+#define IPHC_M    0x08
+#define IPHC_DAC  0x04
+
+/* NHC encoding of the UDP header (see RFC 6282 section 4.3) */
+#define NHC_UDP      0xf0
+#define NHC_UDP_MASK 0xf8
+#define NHC_UDP_C    0x04 /* checksum elided */
+
+#define IPPROTO_UDP_NH 17
+
+/* largest compressed header (IPHC, TF, NH, HLIM, addresses and UDP) */
+#define IPHC_MAX_HDR (2 + 4 + 1 + 1 + 16 + 16 + 7)
+
+static int is_link_local(const unsigned char *addr)
+{
+  static const unsigned char prefix[8] = { 0xfe, 0x80 };
+  return !memcmp(addr, prefix, sizeof(prefix));
+}
+
+/* interface identifier derived from a short address */
+static int is_short_iid(const unsigned char *addr)
+{
+  static const unsigned char iid[6] = { 0x00, 0x00, 0x00, 0xff, 0xfe, 0x00 };
+  return !memcmp(addr + 8, iid, sizeof(iid));
+}
+
+static void set_short_iid(unsigned char *addr, uint16_t mac)
+{
+  addr[0]  = 0xfe;
+  addr[1]  = 0x80;
+  addr[11] = 0xff;
+  addr[12] = 0xfe;
+  addr[14] = mac >> 8;
+  addr[15] = mac & 0xff;
+}
+
+static unsigned int compress_unicast(unsigned char **p, const unsigned char *addr, uint16_t mac)
+{
+  if(!is_link_local(addr)) {
+    memcpy(*p, addr, 16);
+    *p += 16;
+    return 0;
+  }
+
+  if(is_short_iid(addr)) {
+    if(addr[14] == mac >> 8 && addr[15] == (mac & 0xff))
+      return 3; /* derived from the MAC address */
+
+    *(*p)++ = addr[14];
+    *(*p)++ = addr[15];
+    return 2;
+  }
+
+  memcpy(*p, addr + 8, 8);
+  *p += 8;
+  return 1;
+}
+
+static unsigned int compress_multicast(unsigned char **p, const unsigned char *addr)
+{
+  static const unsigned char zero[13];
+
+  if(addr[1] == 0x02 && !memcmp(addr + 2, zero, 13)) {
+    *(*p)++ = addr[15];     /* ff02::00XX */
+    return 3;
+  }
+  if(!memcmp(addr + 2, zero, 11)) {
+    *(*p)++ = addr[1];      /* ffXX::00XX:XXXX */
+    memcpy(*p, addr + 13, 3);
+    *p += 3;
+    return 2;
+  }
+  if(!memcmp(addr + 2, zero, 9)) {
+    *(*p)++ = addr[1];      /* ffXX::00XX:XXXX:XXXX */
+    memcpy(*p, addr + 11, 5);
+    *p += 5;
+    return 1;
+  }
+
+  memcpy(*p, addr, 16);
+  *p += 16;
+  return 0;
+}
+
+int lowpan_compress(void *buf, unsigned int buf_size,
+                    const void *packet, unsigned int size,
+                    uint16_t src, uint16_t dst,
+                    unsigned int *hdr_size)
+{
+  const unsigned char *ip = packet;
+  const unsigned char *udp = ip + LOWPAN_IPV6_HDR_SIZE;
+  unsigned char hdr[IPHC_MAX_HDR];
+  unsigned char *p = hdr + 2;
+  unsigned int tf, hlim, sam, dam, m = 0;
+  unsigned int tc, sport, dport;
+  unsigned long fl;
+  int nhc;
+
+  if(size < LOWPAN_IPV6_HDR_SIZE || ip[0] >> 4 != 6)
+    return -1;
+
+  /* The payload length is elided, packets with
+     trailing bytes or jumbograms are not compressed. */
+  if((unsigned int)(ip[4] << 8 | ip[5]) != size - LOWPAN_IPV6_HDR_SIZE)
+    return -1;
+
+  /* traffic class (DSCP, ECN) is carried as ECN, DSCP */
+  tc = (ip[0] << 4 | ip[1] >> 4) & 0xff;
+  tc = (tc & 0x3) << 6 | tc >> 2;
+  fl = (unsigned long)(ip[1] & 0x0f) << 16 | ip[2] << 8 | ip[3];
+
+  if(!tc && !fl)
+    tf = 3;
+  else if(!fl) {
+    tf = 2;
+    *p++ = tc;
+  }
+  else if(!(tc & 0x3f)) {
+    tf = 1;
+    *p++ = (tc & 0xc0) | fl >> 16;
+    *p++ = fl >> 8;
+    *p++ = fl;
+  }
+  else {
+    tf = 0;
+    *p++ = tc;
+    *p++ = fl >> 16;
+    *p++ = fl >> 8;
+    *p++ = fl;
+  }
+
+  /* UDP headers whose length matches the packet are compressed */
+  nhc = ip[6] == IPPROTO_UDP_NH &&
+        size >= LOWPAN_IPV6_HDR_SIZE + LOWPAN_UDP_HDR_SIZE &&
+        (unsigned int)(udp[4] << 8 | udp[5]) == size - LOWPAN_IPV6_HDR_SIZE;
+  if(!nhc)
+    *p++ = ip[6];
+
+  switch(ip[7]) {
+  case 1:
+    hlim = 1;
+    break;
+  case 64:
+    hlim = 2;
+    break;
+  case 255:
+    hlim = 3;
+    break;
+  default:
+    hlim = 0;
+    *p++ = ip[7];
+  }
+
+  sam = compress_unicast(&p, ip + 8, src);
+
+  if(ip[24] == 0xff) {
+    m   = IPHC_M;
+    dam = compress_multicast(&p, ip + 24);
+  }
+  else
+    dam = compress_unicast(&p, ip + 24, dst);
+
+  *hdr_size = LOWPAN_IPV6_HDR_SIZE;
+
+  if(nhc) {
+    sport = udp[0] << 8 | udp[1];
+    dport = udp[2] << 8 | udp[3];
+
+    if((sport & 0xfff0) == 0xf0b0 && (dport & 0xfff0) == 0xf0b0) {
+      *p++ = NHC_UDP | 3;
+      *p++ = (sport & 0xf) << 4 | (dport & 0xf);
+    }
+    else if((dport & 0xff00) == 0xf000) {
+      *p++ = NHC_UDP | 1;
+      *p++ = udp[0];
+      *p++ = udp[1];
+      *p++ = udp[3];
+    }
+    else if((sport & 0xff00) == 0xf000) {
+      *p++ = NHC_UDP | 2;
+      *p++ = udp[1];
+      *p++ = udp[2];
+      *p++ = udp[3];
+    }
+    else {
+      *p++ = NHC_UDP;
+      memcpy(p, udp, 4);
+      p += 4;
+    }
+
+    /* the checksum is always carried */
+    *p++ = udp[6];
+    *p++ = udp[7];
+
+    *hdr_size += LOWPAN_UDP_HDR_SIZE;
+  }
+
+  hdr[0] = LOWPAN_DISPATCH_IPHC | tf << 3 | (nhc ? IPHC_NH : 0) | hlim;
+  hdr[1] = sam << 4 | m | dam;
+
+  if((unsigned int)(p - hdr) > buf_size)
+    return -1;
+
+  memcpy(buf, hdr, p - hdr);
+  return p - hdr;
+}
+
+#define NEED(n) if(end - p < (n)) return -1
+
+static int decompress_unicast(unsigned char *addr, const unsigned char **pp,
+                              const unsigned char *end, unsigned int mode, uint16_t mac)
+{
+  const unsigned char *p = *pp;
+
+  memset(addr, 0, 16);
+
+  switch(mode) {
+  case 0:
+    NEED(16);
+    memcpy(addr, p, 16);
+    p += 16;
+    break;
+  case 1:
+    NEED(8);
+    addr[0] = 0xfe;
+    addr[1] = 0x80;
+    memcpy(addr + 8, p, 8);
+    p += 8;
+    break;
+  case 2:
+    NEED(2);
+    set_short_iid(addr, p[0] << 8 | p[1]);
+    p += 2;
+    break;
+  case 3:
+    set_short_iid(addr, mac);
+    break;
+  }
+
+  *pp = p;
+  return 0;
+}
+
+static int decompress_multicast(unsigned char *addr, const unsigned char **pp,
+                                const unsigned char *end, unsigned int mode)
+{
+  const unsigned char *p = *pp;
+
+  memset(addr, 0, 16);
+  addr[0] = 0xff;
+
+  switch(mode) {
+  case 0:
+    NEED(16);
+    memcpy(addr, p, 16);
+    p += 16;
+    break;
+  case 1:
+    NEED(6);
+    addr[1] = *p++;
+    memcpy(addr + 11, p, 5);
+    p += 5;
+    break;
+  case 2:
+    NEED(4);
+    addr[1] = *p++;
+    memcpy(addr + 13, p, 3);
+    p += 3;
+    break;
+  case 3:
+    NEED(1);
+    addr[1]  = 0x02;
+    addr[15] = *p++;
+    break;
+  }
+
+  *pp = p;
+  return 0;
+}
+
+int lowpan_decompress(void *buf, unsigned int buf_size,
+                      const void *frame, unsigned int size,
+                      uint16_t src, uint16_t dst,
+                      unsigned int datagram_size)
+{
+  const unsigned char *f   = frame;
+  const unsigned char *end = f + size;
+  const unsigned char *p   = f + 2;
+  unsigned char *ip  = buf;
+  unsigned char *udp = ip + LOWPAN_IPV6_HDR_SIZE;
+  unsigned int tc = 0, hdr_size = LOWPAN_IPV6_HDR_SIZE;
+  unsigned int rest, total, len;
+  unsigned long fl = 0;
+  int nhc;
+
+  if(size < 2 || !LOWPAN_IS_IPHC(f[0]) ||
+     buf_size < LOWPAN_IPV6_HDR_SIZE + LOWPAN_UDP_HDR_SIZE)
+    return -1;
+
+  /* stateful compression is not supported */
+  if(f[1] & (IPHC_CID | IPHC_SAC | IPHC_DAC))
+    return -1;
+
+  switch((f[0] >> 3) & 0x3) {
+  case 0:
+    NEED(4);
+    tc = p[0];
+    fl = (unsigned long)(p[1] & 0x0f) << 16 | p[2] << 8 | p[3];
+    p += 4;
+    break;
+  case 1:
+    NEED(3);
+    tc = p[0] & 0xc0;
+    fl = (unsigned long)(p[0] & 0x0f) << 16 | p[1] << 8 | p[2];
+    p += 3;
+    break;
+  case 2:
+    NEED(1);
+    tc = *p++;
+    break;
+  }
+
+  /* back to DSCP, ECN */
+  tc = (tc & 0x3f) << 2 | tc >> 6;
+
+  ip[0] = 0x60 | tc >> 4;
+  ip[1] = (tc & 0x0f) << 4 | fl >> 16;
+  ip[2] = fl >> 8;
+  ip[3] = fl;
+
+  nhc = f[0] & IPHC_NH;
+  if(nhc)
+    ip[6] = IPPROTO_UDP_NH;
+  else {
+    NEED(1);
+    ip[6] = *p++;
+  }
+
+  switch(f[0] & 0x3) {
+  case 0:
+    NEED(1);
+    ip[7] = *p++;
+    break;
+  case 1:
+    ip[7] = 1;
+    break;
+  case 2:
+    ip[7] = 64;
+    break;
+  case 3:
+    ip[7] = 255;
+    break;
+  }
+
+  if(decompress_unicast(ip + 8, &p, end, (f[1] >> 4) & 0x3, src) < 0)
+    return -1;
+
+  if(f[1] & IPHC_M) {
+    if(decompress_multicast(ip + 24, &p, end, f[1] & 0x3) < 0)
+      return -1;
+  }
+  else if(decompress_unicast(ip + 24, &p, end, f[1] & 0x3, dst) < 0)
+    return -1;
+
+  if(nhc) {
+    NEED(1);
+    if((*p & NHC_UDP_MASK) != NHC_UDP || *p & NHC_UDP_C)
+      return -1;
+
+    switch(*p++ & 0x3) {
+    case 0:
+      NEED(4);
+      memcpy(udp, p, 4);
+      p += 4;
+      break;
+    case 1:
+      NEED(3);
+      udp[0] = p[0];
+      udp[1] = p[1];
+      udp[2] = 0xf0;
+      udp[3] = p[2];
+      p += 3;
+      break;
+    case 2:
+      NEED(3);
+      udp[0] = 0xf0;
+      udp[1] = p[0];
+      udp[2] = p[1];
+      udp[3] = p[2];
+      p += 3;
+      break;
+    case 3:
+      NEED(1);
+      udp[0] = 0xf0;
+      udp[1] = 0xb0 | *p >> 4;
+      udp[2] = 0xf0;
+      udp[3] = 0xb0 | (*p & 0xf);
+      p++;
+      break;
+    }
+
+    NEED(2);
+    udp[6] = *p++;
+    udp[7] = *p++;
+
+    hdr_size += LOWPAN_UDP_HDR_SIZE;
+  }
+
+  rest  = end - p;
+  total = datagram_size ? datagram_size : hdr_size + rest;
+  if(hdr_size + rest > total || hdr_size + rest > buf_size)
+    return -1;
+
+  len = total - LOWPAN_IPV6_HDR_SIZE;
+  ip[4] = len >> 8;
+  ip[5] = len & 0xff;
+  if(nhc) {
+    udp[4] = len >> 8;
+    udp[5] = len & 0xff;
+  }
+
+  memcpy(ip + hdr_size, p, rest);
+
+  return hdr_size + rest;
+}
+
+int lowpan_next_hop(const void *packet, unsigned int size)
+{
+  const unsigned char *ip  = packet;
+  const unsigned char *dst = ip + 24;
+
+  if(size < LOWPAN_IPV6_HDR_SIZE || ip[0] >> 4 != 6)
+    return -1;
+
+  if(dst[0] == 0xff)
+    return LOWPAN_BROADCAST;
+  if(is_short_iid(dst))
+    return dst[14] << 8 | dst[15];
+
+  return -1;
+}
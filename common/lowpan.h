@@ -0,0 +1,91 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _LOWPAN_H_
+#define _LOWPAN_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* IPv6 over a 16-bit addressed link with the header
+   compression of RFC 6282 (IPHC) and the fragmentation
+   of RFC 4944. Only stateless compression is supported,
+   that is link-local unicast addresses and multicast
+   addresses. Other addresses are carried inline.
+
+   Link-local interface identifiers are derived from the
+   short MAC address as in RFC 4944 with a null PAN ID:
+     fe80::ff:fe00:XXXX */
+#define LOWPAN_IPV6_HDR_SIZE 40
+#define LOWPAN_UDP_HDR_SIZE  8
+
+/* the largest datagram_size of a fragment header */
+#define LOWPAN_MAX_DATAGRAM  2047
+
+#define LOWPAN_FRAG1_HDR_SIZE 4
+#define LOWPAN_FRAGN_HDR_SIZE 5
+
+/* MAC address to which multicast packets are sent */
+#define LOWPAN_BROADCAST 0xffff
+
+enum lowpan_dispatch {
+  LOWPAN_DISPATCH_IPV6  = 0x41, /* uncompressed IPv6 header */
+  LOWPAN_DISPATCH_IPHC  = 0x60, /* 011xxxxx */
+  LOWPAN_DISPATCH_FRAG1 = 0xc0, /* 11000xxx */
+  LOWPAN_DISPATCH_FRAGN = 0xe0  /* 11100xxx */
+};
+
+#define LOWPAN_IS_IPHC(d)  (((d) & 0xe0) == LOWPAN_DISPATCH_IPHC)
+#define LOWPAN_IS_FRAG1(d) (((d) & 0xf8) == LOWPAN_DISPATCH_FRAG1)
+#define LOWPAN_IS_FRAGN(d) (((d) & 0xf8) == LOWPAN_DISPATCH_FRAGN)
+
+/* Compress the headers of an IPv6 packet sent from src to dst
+   on the link. The compressed headers are written to buf which
+   can hold up to buf_size bytes and the number of bytes of the
+   packet they replace is written to hdr_size, the rest of the
+   packet follows as is. Return the size of the compressed headers
+   or -1 if the packet is not an IPv6 packet or buf is too short. */
+int lowpan_compress(void *buf, unsigned int buf_size,
+                    const void *packet, unsigned int size,
+                    uint16_t src, uint16_t dst,
+                    unsigned int *hdr_size);
+
+/* Decompress an IPHC frame received from src to dst into an IPv6
+   packet of at most buf_size bytes. The datagram size is the size
+   of the whole packet when the frame is only its first fragment,
+   otherwise zero. Return the size of the decompressed frame or -1
+   if it is malformed or buf is too short. */
+int lowpan_decompress(void *buf, unsigned int buf_size,
+                      const void *frame, unsigned int size,
+                      uint16_t src, uint16_t dst,
+                      unsigned int datagram_size);
+
+/* Return the MAC address of the next hop for an IPv6 packet.
+   Multicast packets are broadcast. Unicast packets go to the
+   short address in the destination interface identifier,
+   whatever the prefix. Return -1 when the destination has
+   no such identifier. */
+int lowpan_next_hop(const void *packet, unsigned int size);
+
+#endif /* _LOWPAN_H_ */
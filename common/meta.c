@@ -22,40 +22,36 @@
    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <stdlib.h>
-#include <getopt.h>
 #include <string.h>
 
-#include "safe-call.h"
+#include "meta.h"
 
-int opts_len(const struct option *opts)
+unsigned char * meta_put(unsigned char *b, enum meta_type type,
+                         const void *value, uint8_t length)
 {
-  int len = 0;
-  const struct option *o;
+  b[0] = type;
+  b[1] = length;
+  memcpy(b + META_TLV_SIZE, value, length);
 
-  for(o = opts ; o->name ; o++)
-    len++;
-
-  return len;
+  return b + META_TLV_SIZE + length;
 }
 
-struct option * merge_opts(const struct option *a, const struct option *b)
+const void * meta_find(const unsigned char *meta, size_t size,
+                       enum meta_type type, uint8_t *length)
 {
-  int len_a = opts_len(a);
-  int len_b = opts_len(b);
-  int len   = len_a + len_b; /* len without terminal zero struct */
-
-  /* allocate memory for the merged array
-     here we take into account the terminal
-     zero struct */
-  struct option *merged = xmalloc((len + 1) * sizeof(struct option));
+  const unsigned char *end = meta + size;
 
-  /* terminal zero struct */
-  merged[len] = (struct option){ NULL, 0 , NULL, 0 };
+  while(end - meta >= (ptrdiff_t)META_TLV_SIZE) {
+    const unsigned char *value = meta + META_TLV_SIZE;
 
-  /* merge arrays */
-  memcpy(merged,         a, len_a * sizeof(struct option));
-  memcpy(merged + len_a, b, len_b * sizeof(struct option));
+    if(end - value < meta[1])
+      return NULL; /* truncated */
+    if(meta[0] == type) {
+      *length = meta[1];
+      return value;
+    }
+    meta = value + meta[1];
+  }
 
-  return merged;
+  return NULL;
 }
@@ -0,0 +1,68 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _META_H_
+#define _META_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Extended record of a received frame for socket clients:
+     [version (u8)][status (u8)][src (u16)][dst (u16)]
+     [meta size (u16)][meta...][payload]
+   The metadata is a sequence of TLV entries:
+     [type (u8)][length (u8)][value]
+   Values are in host byte order like the other fields. Clients
+   skip the types they do not know, so new types only need a new
+   entry while a change of the fixed fields bumps the version. */
+#define META_VERSION  1
+#define META_HDR_SIZE (sizeof(uint8_t) * 2 + sizeof(uint16_t) * 3)
+#define META_TLV_SIZE (sizeof(uint8_t) * 2)
+
+/* largest metadata with one entry of each type */
+#define META_MAX_SIZE 64
+
+/* Metadata types, an entry is only present when known. */
+enum meta_type {
+  META_SOURCE     = 1, /* medium (u8, see hybrid_source) */
+  META_STAMP      = 2, /* CLOCK_MONOTONIC when received in us (u64) */
+  META_LQI        = 3, /* link quality of the frame (u8) */
+  META_TONEMAP    = 4, /* estimated tonemap (u32) */
+  META_SYMBOLS    = 5, /* modem symbol time (u32) */
+  META_MODULATION = 6, /* estimated modulation (u8) */
+  META_SEQNO      = 7, /* MAC sequence number (u8) */
+  META_SYNCTIME   = 8, /* network time when received in us (u64, see timesync.h) */
+};
+
+/* Append an entry at b and return the end of the entry. */
+unsigned char * meta_put(unsigned char *b, enum meta_type type,
+                         const void *value, uint8_t length);
+
+/* Find an entry in the metadata. Return a pointer to its value
+   and its length in length, or NULL when there is no such entry
+   or the metadata is truncated. */
+const void * meta_find(const unsigned char *meta, size_t size,
+                       enum meta_type type, uint8_t *length);
+
+#endif /* _META_H_ */
@@ -0,0 +1,130 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _POSIX_C_SOURCE 200112L
+#endif /* __linux__ */
+
+#include <sys/resource.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "metrics.h"
+
+int metrics_open(struct metrics *m, const char *path)
+{
+  int n;
+
+  m->path = path;
+  m->f    = NULL;
+  m->map  = NULL;
+  if(!path)
+    return 0;
+
+  n = snprintf(m->tmp, sizeof(m->tmp), "%s.tmp", path);
+  if(n < 0 || (size_t)n >= sizeof(m->tmp))
+    return -1;
+
+  m->f = fopen(m->tmp, "w");
+  if(!m->f)
+    return -1;
+  return 0;
+}
+
+void metrics_map(struct metrics *m, struct statmap *map)
+{
+  m->map = map;
+  statmap_begin(map);
+}
+
+void metrics_help(struct metrics *m, const char *name,
+                  const char *type, const char *help)
+{
+  if(!m->f)
+    return;
+
+  fprintf(m->f, "# HELP %s %s\n", name, help);
+  fprintf(m->f, "# TYPE %s %s\n", name, type);
+}
+
+void metrics_value(struct metrics *m, const char *name,
+                   const char *labels, unsigned long value)
+{
+  if(m->map)
+    statmap_value(m->map, name, labels, value);
+  if(!m->f)
+    return;
+
+  if(labels)
+    fprintf(m->f, "%s{%s} %lu\n", name, labels, value);
+  else
+    fprintf(m->f, "%s %lu\n", name, value);
+}
+
+void metrics_wakeups(struct metrics *m)
+{
+  static unsigned long last_count, last_time;
+  unsigned long count, now, rate = 0;
+  struct timespec ts;
+  struct rusage ru;
+
+  if(getrusage(RUSAGE_SELF, &ru) < 0)
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  count = ru.ru_nvcsw;
+  now   = ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+  if(last_time && now > last_time)
+    rate = (count - last_count) * 1000 / (now - last_time);
+  last_count = count;
+  last_time  = now;
+
+  metrics_help(m, "process_wakeups_total", "counter", "Wakeups of the threads of the process");
+  metrics_value(m, "process_wakeups_total", NULL, count);
+  metrics_help(m, "process_wakeups_per_second", "gauge", "Rate of process_wakeups_total since the previous sample");
+  metrics_value(m, "process_wakeups_per_second", NULL, rate);
+}
+
+int metrics_close(struct metrics *m)
+{
+  if(m->map)
+    statmap_end(m->map);
+  if(!m->f)
+    return 0;
+
+  /* the file is only replaced when it was completely written */
+  if(ferror(m->f)) {
+    fclose(m->f);
+    unlink(m->tmp);
+    return -1;
+  }
+
+  if(fclose(m->f) || rename(m->tmp, m->path)) {
+    unlink(m->tmp);
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,74 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdio.h>
+#include <limits.h>
+
+#include "statmap.h"
+
+/* Metrics are written in the Prometheus text format to a file
+   that is replaced atomically. So a collector (such as the
+   textfile collector of the node exporter) never reads a
+   partially written file. The same samples may also be
+   published to a live statistics file (see metrics_map()). */
+struct metrics {
+  FILE *f;
+  const char *path;
+  char tmp[PATH_MAX];
+  struct statmap *map;
+};
+
+/* Open the temporary file for a new set of metrics.
+   Without a path the samples only go to the statistics map.
+   Return -1 when the file cannot be created. */
+int metrics_open(struct metrics *m, const char *path);
+
+/* Also publish the samples of this set to a statistics
+   file. The map is updated in metrics_close(). */
+void metrics_map(struct metrics *m, struct statmap *map);
+
+/* Describe a metric, the type is "counter" or "gauge". */
+void metrics_help(struct metrics *m, const char *name,
+                  const char *type, const char *help);
+
+/* Write one sample of a metric. The labels are
+   written as is between braces unless NULL. */
+void metrics_value(struct metrics *m, const char *name,
+                   const char *labels, unsigned long value);
+
+/* Write the wakeups of the process (process_wakeups_total), that
+   is the voluntary context switches of all its threads: each sleep
+   on a descriptor, a lock or a deadline ends with one. Their rate
+   since the previous call is the process_wakeups_per_second gauge.
+   An idle process only wakes up to write its metrics. */
+void metrics_wakeups(struct metrics *m);
+
+/* Replace the metrics file with the new set.
+   Return -1 when the file cannot be replaced. */
+int metrics_close(struct metrics *m);
+
+#endif /* _METRICS_H_ */
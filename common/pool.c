@@ -0,0 +1,117 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "safe-call.h"
+#include "prof.h"
+#include "pool.h"
+
+#define INDEX(p, buf) (((unsigned char *)(buf) - (p)->bufs) / (p)->buf_size)
+
+void pool_init(struct pool *p, unsigned int count, size_t buf_size)
+{
+  unsigned int i;
+
+  *p = (struct pool){ .bufs     = xmalloc(count * buf_size),
+                      .buf_size = buf_size,
+                      .count    = count,
+                      .refs     = xmalloc(count * sizeof(unsigned int)),
+                      .free     = xmalloc(count * sizeof(unsigned int)),
+                      .nfree    = count };
+
+  /* the first buffers are taken first */
+  for(i = 0 ; i < count ; i++) {
+    p->refs[i] = 0;
+    p->free[i] = count - i - 1;
+  }
+
+  pthread_mutex_init(&p->lock, NULL);
+}
+
+void pool_free(struct pool *p)
+{
+  free(p->bufs);
+  free(p->refs);
+  free(p->free);
+  pthread_mutex_destroy(&p->lock);
+}
+
+void * pool_get(struct pool *p)
+{
+  void *buf = NULL;
+  unsigned int i;
+
+  pthread_mutex_lock(&p->lock);
+  {
+    if(p->nfree) {
+      i = p->free[--p->nfree];
+      p->refs[i] = 1;
+      buf = p->bufs + i * p->buf_size;
+    }
+    else
+      p->exhausted++;
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  if(buf)
+    prof_alloc(p->buf_size);
+  return buf;
+}
+
+void pool_hold(struct pool *p, void *buf)
+{
+  pthread_mutex_lock(&p->lock);
+  {
+    assert(p->refs[INDEX(p, buf)]);
+    p->refs[INDEX(p, buf)]++;
+  }
+  pthread_mutex_unlock(&p->lock);
+}
+
+void pool_put(struct pool *p, void *buf)
+{
+  unsigned int i = INDEX(p, buf);
+
+  pthread_mutex_lock(&p->lock);
+  {
+    assert(p->refs[i]);
+    if(!--p->refs[i])
+      p->free[p->nfree++] = i;
+  }
+  pthread_mutex_unlock(&p->lock);
+}
+
+unsigned int pool_used(struct pool *p)
+{
+  unsigned int used;
+
+  pthread_mutex_lock(&p->lock);
+  used = p->count - p->nfree;
+  pthread_mutex_unlock(&p->lock);
+
+  return used;
+}
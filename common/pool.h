@@ -0,0 +1,65 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <pthread.h>
+#include <stddef.h>
+
+/* Fixed pool of reference counted buffers of the same size.
+   The memory is allocated once so that the number of frames in
+   flight is bounded. A buffer can be shared by several consumers
+   (queues, subscribers, logs) which each hold a reference and it
+   returns to the pool when the last reference is released. */
+struct pool {
+  pthread_mutex_t lock;
+  unsigned char  *bufs;
+  size_t          buf_size;
+  unsigned int    count;     /* number of buffers */
+  unsigned int   *refs;      /* reference count of each buffer */
+  unsigned int   *free;      /* stack of free buffer indexes */
+  unsigned int    nfree;
+  unsigned long   exhausted; /* allocations that failed */
+};
+
+/* Allocate a pool of count buffers of buf_size bytes. */
+void pool_init(struct pool *p, unsigned int count, size_t buf_size);
+void pool_free(struct pool *p);
+
+/* Take a free buffer with a single reference. Return NULL
+   and count the failure when all buffers are in use. */
+void * pool_get(struct pool *p);
+
+/* Take another reference on a buffer of the pool. */
+void pool_hold(struct pool *p, void *buf);
+
+/* Release a reference, the buffer returns to
+   the pool when this was the last one. */
+void pool_put(struct pool *p, void *buf);
+
+/* Number of buffers in use. */
+unsigned int pool_used(struct pool *p);
+
+#endif /* _POOL_H_ */
@@ -0,0 +1,47 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PROBE_H_
+#define _PROBE_H_
+
+/* Static tracepoints on the hot paths of the drivers. They are
+   SystemTap SDT probes when <sys/sdt.h> was found at build time
+   (see HAVE_SDT in the Makefiles) and expand to nothing otherwise.
+   An SDT probe is a single nop until a tracer attaches to it, so
+   they are left in production builds. List them with:
+
+     bpftrace -l 'usdt:./loramac-unix:*'
+
+   The arguments are values that the driver already has at hand.
+   Latency arguments are stamps of the driver clock, which is
+   CLOCK_MONOTONIC in microseconds, so the latency at the probe is
+   (nsecs / 1000 - arg) in bpftrace. */
+#ifdef HAVE_SDT
+# include <sys/sdt.h>
+# define PROBE(provider, ...) STAP_PROBEV(provider, __VA_ARGS__)
+#else
+# define PROBE(provider, ...) do {} while(0)
+#endif /* HAVE_SDT */
+
+#endif /* _PROBE_H_ */
@@ -0,0 +1,157 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifdef __linux__
+# define _GNU_SOURCE /* syscall() */
+# include <sys/syscall.h>
+#endif /* __linux__ */
+
+#include <sys/resource.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#include "prof.h"
+
+static struct prof_slot {
+  const char   *role;
+  clockid_t     clock; /* CPU clock of the thread */
+  long          tid;   /* for procfs, 0 when unknown */
+  unsigned long allocs;
+  unsigned long bytes;
+} slots[PROF_THREADS + 1] = { { .role = "other" } };
+
+/* registered threads, their slots never change once published */
+static unsigned int count = 1;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+static void key_create(void)
+{
+  pthread_key_create(&key, NULL);
+}
+
+void prof_thread(const char *role)
+{
+  struct prof_slot *s;
+
+  pthread_once(&key_once, key_create);
+
+  pthread_mutex_lock(&lock);
+  if(count > PROF_THREADS) {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+  s = &slots[count];
+
+  *s = (struct prof_slot){ .role = role };
+  if(pthread_getcpuclockid(pthread_self(), &s->clock))
+    s->role = NULL;
+#ifdef __linux__
+  s->tid = syscall(SYS_gettid);
+#endif /* __linux__ */
+  __atomic_store_n(&count, count + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&lock);
+
+  pthread_setspecific(key, s);
+}
+
+void prof_alloc(size_t size)
+{
+  struct prof_slot *s;
+
+  pthread_once(&key_once, key_create);
+  s = pthread_getspecific(key);
+  if(!s)
+    s = &slots[0];
+
+  __atomic_add_fetch(&s->allocs, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&s->bytes, size, __ATOMIC_RELAXED);
+}
+
+/* Context switches of a thread from procfs, -1 when unknown. */
+static void switches(long tid, long *voluntary, long *involuntary)
+{
+  char path[64], line[128];
+  FILE *f;
+
+  *voluntary = *involuntary = -1;
+  if(!tid)
+    return;
+
+  snprintf(path, sizeof(path), "/proc/self/task/%ld/status", tid);
+  f = fopen(path, "r");
+  if(!f)
+    return;
+
+  while(fgets(line, sizeof(line), f)) {
+    if(!strncmp(line, "voluntary_ctxt_switches:", 24))
+      *voluntary = strtol(line + 24, NULL, 10);
+    else if(!strncmp(line, "nonvoluntary_ctxt_switches:", 27))
+      *involuntary = strtol(line + 27, NULL, 10);
+  }
+  fclose(f);
+}
+
+static unsigned long tv_us(const struct timeval *tv)
+{
+  return tv->tv_sec * 1000000UL + tv->tv_usec;
+}
+
+void prof_report(FILE *out)
+{
+  unsigned int i, n = __atomic_load_n(&count, __ATOMIC_ACQUIRE);
+  long voluntary, involuntary;
+  struct timespec ts;
+  struct rusage ru;
+
+  fprintf(out, "%-12s %7s %12s %10s %10s %10s %12s\n",
+          "role", "tid", "cpu_us", "voluntary", "involuntary", "allocs", "bytes");
+
+  for(i = 0 ; i < n ; i++) {
+    const struct prof_slot *s = &slots[i];
+    long cpu = -1;
+
+    if(i && !s->role)
+      continue;
+    if(i && !clock_gettime(s->clock, &ts))
+      cpu = ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+    switches(s->tid, &voluntary, &involuntary);
+
+    fprintf(out, "%-12s %7ld %12ld %10ld %10ld %10lu %12lu\n",
+            s->role, s->tid, cpu, voluntary, involuntary,
+            __atomic_load_n(&s->allocs, __ATOMIC_RELAXED),
+            __atomic_load_n(&s->bytes, __ATOMIC_RELAXED));
+  }
+
+  if(getrusage(RUSAGE_SELF, &ru) < 0)
+    return;
+  fprintf(out, "%-12s %7ld %12lu %10ld %10ld %10s %12s\n",
+          "process", (long)getpid(), tv_us(&ru.ru_utime) + tv_us(&ru.ru_stime),
+          ru.ru_nvcsw, ru.ru_nivcsw, "-", "-");
+}
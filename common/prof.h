@@ -0,0 +1,51 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _PROF_H_
+#define _PROF_H_
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* Self-profiling of the threads of the process, so that a busy
+   driver can tell where its time goes without a profiler. Each
+   thread registers itself with its role once it starts, the report
+   then shows for each thread its CPU time (thread CPU clock), its
+   voluntary and involuntary context switches (from procfs, Linux
+   only) and the allocations it made through the xmalloc() family
+   and the buffer pools (see pool.h). The allocations of the threads
+   which did not register are counted under "other". The threads
+   are expected to live as long as the process. */
+#define PROF_THREADS 32
+
+/* Register the calling thread with its role (a static string).
+   The threads past PROF_THREADS are counted as "other". */
+void prof_thread(const char *role);
+
+/* Count an allocation of size bytes by the calling thread. */
+void prof_alloc(size_t size);
+
+/* Print the report, one line per thread then the process total. */
+void prof_report(FILE *out);
+
+#endif /* _PROF_H_ */
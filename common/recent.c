@@ -0,0 +1,160 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "safe-call.h"
+#include "recent.h"
+
+/* A slot is the receive time and the size followed by the payload. */
+struct slot {
+  unsigned long stamp;
+  size_t        size;
+  unsigned char payload[];
+};
+
+#define SLOT(r, s, i) ((struct slot *)((r)->slots + \
+  (((s) - (r)->sources) * (r)->depth + (i)) * (r)->slot_size))
+
+/* Fibonacci hashing on the top bits. */
+static unsigned int hash(const struct recent *r, uint16_t addr)
+{
+  return (uint32_t)(addr * 2654435769U) >> r->shift;
+}
+
+void recent_init(struct recent *r, unsigned int sources, unsigned int depth, size_t max_payload)
+{
+  unsigned int n = RECENT_PROBES, bits = 2;
+
+  while(n < sources) {
+    n <<= 1;
+    bits++;
+  }
+
+  *r = (struct recent){ .nsources    = n,
+                        .shift       = 32 - bits,
+                        .depth       = depth ? depth : 1,
+                        .max_payload = max_payload,
+                        .slot_size   = (sizeof(struct slot) + max_payload + sizeof(long) - 1)
+                                       & ~(sizeof(long) - 1) };
+
+  r->sources = xmalloc(n * sizeof(struct recent_source));
+  r->slots   = xmalloc(n * r->depth * r->slot_size);
+  memset(r->sources, 0, n * sizeof(struct recent_source));
+
+  pthread_mutex_init(&r->lock, NULL);
+}
+
+void recent_free(struct recent *r)
+{
+  free(r->sources);
+  free(r->slots);
+  pthread_mutex_destroy(&r->lock);
+}
+
+/* Slot of a source in the table, NULL when it is not there. */
+static struct recent_source * lookup(struct recent *r, uint16_t addr)
+{
+  unsigned int h = hash(r, addr), i;
+
+  for(i = 0 ; i < RECENT_PROBES ; i++) {
+    struct recent_source *s = &r->sources[(h + i) & (r->nsources - 1)];
+
+    if(s->used && s->addr == addr)
+      return s;
+  }
+
+  return NULL;
+}
+
+void recent_put(struct recent *r, uint16_t src, const void *payload, size_t size,
+                unsigned long stamp)
+{
+  struct recent_source *s, *victim = NULL;
+  struct slot *slot;
+  unsigned int h, i;
+
+  if(size > r->max_payload)
+    size = r->max_payload;
+
+  pthread_mutex_lock(&r->lock);
+  {
+    s = lookup(r, src);
+    if(!s) {
+      /* a free slot or the least recently updated source */
+      h = hash(r, src);
+      for(i = 0 ; i < RECENT_PROBES ; i++) {
+        s = &r->sources[(h + i) & (r->nsources - 1)];
+        if(!s->used) {
+          victim = s;
+          break;
+        }
+        if(!victim || s->tick < victim->tick)
+          victim = s;
+      }
+
+      if(victim->used)
+        r->evictions++;
+      s  = victim;
+      *s = (struct recent_source){ .addr = src, .used = 1, .head = r->depth - 1 };
+    }
+
+    s->head = (s->head + 1) % r->depth;
+    if(s->count < r->depth)
+      s->count++;
+    s->tick = ++r->tick;
+
+    slot = SLOT(r, s, s->head);
+    slot->stamp = stamp;
+    slot->size  = size;
+    memcpy(slot->payload, payload, size);
+  }
+  pthread_mutex_unlock(&r->lock);
+}
+
+int recent_get(struct recent *r, uint16_t src, unsigned int nth,
+               void *buf, size_t size, unsigned long *stamp)
+{
+  const struct recent_source *s;
+  const struct slot *slot;
+  int ret = -1;
+
+  pthread_mutex_lock(&r->lock);
+  {
+    s = lookup(r, src);
+    if(s && nth < s->count) {
+      slot = SLOT(r, s, (s->head + r->depth - nth) % r->depth);
+      if(size > slot->size)
+        size = slot->size;
+      memcpy(buf, slot->payload, size);
+      *stamp = slot->stamp;
+      ret    = size;
+    }
+  }
+  pthread_mutex_unlock(&r->lock);
+
+  return ret;
+}
@@ -0,0 +1,80 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _RECENT_H_
+#define _RECENT_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Last payloads received from each source with their receive
+   time, so that the polls for the latest reading of a meter
+   are answered without any traffic on the media. The memory is
+   allocated once: the table holds a bounded number of sources,
+   each with a ring of the last depth payloads. A new source
+   takes the place of the least recently updated one among the
+   RECENT_PROBES slots of its hash, so a table with spare room
+   rarely evicts a source that is still sending. */
+#define RECENT_PROBES  4
+#define RECENT_SOURCES 256 /* default number of sources */
+
+struct recent_source {
+  uint16_t      addr;
+  uint8_t       used;
+  unsigned int  head;  /* slot of the newest payload */
+  unsigned int  count; /* payloads stored, up to depth */
+  unsigned long tick;  /* last update, for the eviction */
+};
+
+struct recent {
+  pthread_mutex_t       lock;
+  struct recent_source *sources;
+  unsigned char        *slots;
+  unsigned int          nsources; /* power of two */
+  unsigned int          shift;    /* of the hash */
+  unsigned int          depth;
+  size_t                max_payload;
+  size_t                slot_size;
+  unsigned long         tick;
+  unsigned long         evictions;
+};
+
+/* Allocate a cache of depth payloads of at most max_payload
+   bytes for sources rounded up to a power of two. */
+void recent_init(struct recent *r, unsigned int sources, unsigned int depth, size_t max_payload);
+void recent_free(struct recent *r);
+
+/* Store a payload received from a source at the given time,
+   longer payloads are truncated to max_payload. */
+void recent_put(struct recent *r, uint16_t src, const void *payload, size_t size,
+                unsigned long stamp);
+
+/* Copy the nth last payload of a source (0 is the newest) and
+   its receive time. Return the size of the payload, which is
+   truncated to the buffer, or -1 when there is none. */
+int recent_get(struct recent *r, uint16_t src, unsigned int nth,
+               void *buf, size_t size, unsigned long *stamp);
+
+#endif /* _RECENT_H_ */
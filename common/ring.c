@@ -0,0 +1,117 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _POSIX_C_SOURCE 200112L
+#endif /* __linux__ */
+
+#include <semaphore.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <err.h>
+
+#include "safe-call.h"
+#include "ring.h"
+
+/* The head is only written by the producer and the tail by
+   the consumer. Each side reads the other index with acquire
+   semantic and publishes its own with release semantic so that
+   the content of a slot is visible before its index. The slot
+   itself is only accessed by one side at a time. */
+#define LOAD(v)     __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define STORE(v, x) __atomic_store_n(&(v), x, __ATOMIC_RELEASE)
+
+#define SLOT(r, i) ((r)->slots + ((i) & ((r)->count - 1)) * (r)->slot_size)
+
+void ring_init(struct ring *r, unsigned int count, size_t slot_size)
+{
+  if(!count || (count & (count - 1)))
+    errx(EXIT_FAILURE, "ring size must be a power of two");
+
+  *r = (struct ring){ .slots     = xmalloc(count * slot_size),
+                      .slot_size = slot_size,
+                      .count     = count };
+
+  if(sem_init(&r->ready, 0, 0) < 0)
+    err(EXIT_FAILURE, "cannot initialize ring");
+}
+
+void * ring_reserve(struct ring *r)
+{
+  /* Indexes wrap around but their difference
+     is always the number of used slots. */
+  if(r->head - LOAD(r->tail) == r->count) {
+    __atomic_add_fetch(&r->drops, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  return SLOT(r, r->head);
+}
+
+void ring_commit(struct ring *r)
+{
+  STORE(r->head, r->head + 1);
+  sem_post(&r->ready);
+}
+
+void * ring_wait(struct ring *r)
+{
+  if(sem_wait(&r->ready) < 0)
+    err(EXIT_FAILURE, "cannot wait on ring");
+
+  return SLOT(r, r->tail);
+}
+
+void * ring_timedwait(struct ring *r, unsigned int timeout)
+{
+  struct timespec ts;
+
+  /* semaphores only wait on the realtime clock */
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec  += timeout / 1000000;
+  ts.tv_nsec += (timeout % 1000000) * 1000;
+  if(ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+
+  if(sem_timedwait(&r->ready, &ts) < 0) {
+    if(errno == ETIMEDOUT)
+      return NULL;
+    err(EXIT_FAILURE, "cannot wait on ring");
+  }
+
+  return SLOT(r, r->tail);
+}
+
+void ring_release(struct ring *r)
+{
+  STORE(r->tail, r->tail + 1);
+}
+
+unsigned long ring_drops(struct ring *r)
+{
+  return __atomic_load_n(&r->drops, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,67 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <semaphore.h>
+#include <stddef.h>
+
+/* Bounded single producer single consumer ring.
+   The producer never blocks nor takes a lock so that
+   it can be used from the UART input thread. When the
+   ring is full, the slot is dropped and counted. The
+   consumer blocks on a semaphore until a slot is ready. */
+struct ring {
+  unsigned char *slots;
+  size_t         slot_size;
+  unsigned int   count; /* number of slots (power of two) */
+  unsigned int   head;  /* next slot written by the producer */
+  unsigned int   tail;  /* next slot read by the consumer */
+  unsigned long  drops; /* slots dropped because the ring was full */
+  sem_t          ready;
+};
+
+/* Allocate a ring of count slots of slot_size bytes each.
+   The count must be a power of two. */
+void ring_init(struct ring *r, unsigned int count, size_t slot_size);
+
+/* Producer side. Reserve the next slot and fill it before
+   publishing it with ring_commit(). The reserve function
+   returns NULL and counts a drop when the ring is full. */
+void * ring_reserve(struct ring *r);
+void ring_commit(struct ring *r);
+
+/* Consumer side. Wait for the next slot and release
+   it with ring_release() once it has been processed.
+   The timed variant returns NULL when no slot is ready
+   after timeout us. */
+void * ring_wait(struct ring *r);
+void * ring_timedwait(struct ring *r, unsigned int timeout);
+void ring_release(struct ring *r);
+
+/* Number of slots dropped so far. */
+unsigned long ring_drops(struct ring *r);
+
+#endif /* _RING_H_ */
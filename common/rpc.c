@@ -0,0 +1,249 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _POSIX_C_SOURCE 200112L
+#endif /* __linux__ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "safe-call.h"
+#include "rpc.h"
+
+static unsigned long now_us(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000UL + now.tv_nsec / 1000;
+}
+
+static void put_header(uint8_t *header, uint8_t type, uint16_t id)
+{
+  header[0] = type;
+  header[1] = id >> 8;
+  header[2] = id;
+}
+
+static void expire(void *data);
+
+void rpc_init(struct rpc *r, unsigned int calls, struct ticker *ticker,
+              const struct rpc_config *conf)
+{
+  unsigned int i, n = 1, bits = 0;
+
+  while(n < calls && n < RPC_MAX_CALLS) {
+    n <<= 1;
+    bits++;
+  }
+
+  *r = (struct rpc){ .conf   = *conf,
+                     .ticker = ticker,
+                     .ncalls = n,
+                     .nfree  = n,
+                     .bits   = bits };
+
+  r->calls = xmalloc(n * sizeof(struct rpc_call));
+  r->free  = xmalloc(n * sizeof(uint16_t));
+  for(i = 0 ; i < n ; i++) {
+    r->calls[i] = (struct rpc_call){ .rpc = r, .id = i };
+    wheel_timer_init(&r->calls[i].timer, expire, &r->calls[i]);
+    r->free[i] = i;
+  }
+
+  pthread_mutex_init(&r->lock, NULL);
+}
+
+void rpc_free(struct rpc *r)
+{
+  unsigned int i;
+
+  for(i = 0 ; i < r->ncalls ; i++)
+    ticker_cancel(r->ticker, &r->calls[i].timer);
+  free(r->calls);
+  free(r->free);
+  pthread_mutex_destroy(&r->lock);
+}
+
+/* Call of an identifier while it is outstanding, NULL otherwise.
+   The lock must be held. */
+static struct rpc_call * lookup(struct rpc *r, uint16_t id)
+{
+  struct rpc_call *c = &r->calls[id & (r->ncalls - 1)];
+
+  if(!c->busy || c->id != id)
+    return NULL;
+  return c;
+}
+
+/* Give the slot of a call back at the end of the free list, the
+   next identifier on this slot is of the next generation. The
+   lock must be held. */
+static void release(struct rpc *r, struct rpc_call *c)
+{
+  c->busy = 0;
+  c->id  += r->ncalls;
+  r->free[(r->head + r->nfree) & (r->ncalls - 1)] = c - r->calls;
+  r->nfree++;
+}
+
+/* Timeout of a call. The slot may have been completed and taken
+   by a later call while this was already running, which is left
+   to its own deadline. */
+static void expire(void *data)
+{
+  struct rpc_call *c = data;
+  struct rpc *r = c->rpc;
+  rpc_done done;
+  void *cookie;
+
+  pthread_mutex_lock(&r->lock);
+  if(!c->busy || now_us() < c->deadline) {
+    pthread_mutex_unlock(&r->lock);
+    return;
+  }
+
+  done   = c->done;
+  cookie = c->cookie;
+  release(r, c);
+  r->timeouts++;
+  pthread_mutex_unlock(&r->lock);
+
+  done(cookie, RPC_TIMEOUT, NULL, 0);
+}
+
+int rpc_call(struct rpc *r, uint16_t dst, const void *payload, unsigned int size,
+             unsigned long timeout, rpc_done done, void *cookie)
+{
+  struct rpc_call *c;
+  uint8_t header[RPC_HEADER];
+  uint16_t id;
+  int status;
+
+  pthread_mutex_lock(&r->lock);
+  if(!r->nfree) {
+    pthread_mutex_unlock(&r->lock);
+    return RPC_FULL;
+  }
+
+  c = &r->calls[r->free[r->head]];
+  r->head = (r->head + 1) & (r->ncalls - 1);
+  r->nfree--;
+
+  c->busy     = 1;
+  c->dst      = dst;
+  c->done     = done;
+  c->cookie   = cookie;
+  c->deadline = now_us() + timeout;
+  id = c->id;
+
+  /* armed before the send, the response may be faster */
+  ticker_arm(r->ticker, &c->timer, timeout);
+  pthread_mutex_unlock(&r->lock);
+
+  put_header(header, RPC_REQUEST, id);
+  status = r->conf.send(dst, header, payload, size, id, r->conf.data);
+  if(!status)
+    return RPC_SUCCESS;
+
+  /* unless the timeout already completed it */
+  pthread_mutex_lock(&r->lock);
+  c = lookup(r, id);
+  if(!c) {
+    pthread_mutex_unlock(&r->lock);
+    return RPC_SUCCESS;
+  }
+  ticker_cancel(r->ticker, &c->timer);
+  release(r, c);
+  pthread_mutex_unlock(&r->lock);
+
+  return status;
+}
+
+int rpc_reply(struct rpc *r, uint16_t dst, uint16_t id, const void *payload, unsigned int size)
+{
+  uint8_t header[RPC_HEADER];
+
+  put_header(header, RPC_RESPONSE, id);
+  return r->conf.send(dst, header, payload, size, id, r->conf.data);
+}
+
+/* Complete an outstanding call, the lock must be held and
+   is released. */
+static void complete(struct rpc *r, struct rpc_call *c, int status,
+                     const void *payload, unsigned int size)
+{
+  rpc_done done   = c->done;
+  void    *cookie = c->cookie;
+
+  ticker_cancel(r->ticker, &c->timer);
+  release(r, c);
+  r->completed++;
+  pthread_mutex_unlock(&r->lock);
+
+  done(cookie, status, payload, size);
+}
+
+void rpc_fail(struct rpc *r, uint16_t id, int status)
+{
+  struct rpc_call *c;
+
+  pthread_mutex_lock(&r->lock);
+  c = lookup(r, id);
+  if(!c) {
+    pthread_mutex_unlock(&r->lock);
+    return;
+  }
+  complete(r, c, status, NULL, 0);
+}
+
+int rpc_input(struct rpc *r, uint16_t src, const void *msg, unsigned int size)
+{
+  const uint8_t *m = msg;
+  struct rpc_call *c;
+  uint16_t id;
+
+  if(size < RPC_HEADER || (m[0] != RPC_REQUEST && m[0] != RPC_RESPONSE))
+    return 0;
+  id = m[1] << 8 | m[2];
+
+  if(m[0] == RPC_REQUEST) {
+    if(r->conf.cb_request)
+      r->conf.cb_request(src, id, m + RPC_HEADER, size - RPC_HEADER, r->conf.data);
+    return 1;
+  }
+
+  pthread_mutex_lock(&r->lock);
+  c = lookup(r, id);
+  if(!c || c->dst != src) {
+    r->stale++;
+    pthread_mutex_unlock(&r->lock);
+    return 1;
+  }
+  complete(r, c, RPC_SUCCESS, m + RPC_HEADER, size - RPC_HEADER);
+  return 1;
+}
@@ -0,0 +1,133 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _RPC_H_
+#define _RPC_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "ticker.h"
+
+/* Request/response calls over the fire-and-forget messages of a
+   MAC layer. A request and its response carry a header with the
+   type and the identifier of the call, the response is matched on
+   the identifier and the source of the message so that many calls
+   may be outstanding at once towards any number of destinations.
+
+   Identifiers are the slot of the call in the table in the low
+   bits and a generation in the high bits, so a late response to a
+   call already completed is recognized and dropped. Each call has
+   its own timeout on a ticker (see ticker.h), the completion is
+   called exactly once either with the response, the timeout or
+   the failure of the send.
+
+   Header: [type u8][id u16] (network byte order) */
+
+#define RPC_HEADER   3
+#define RPC_REQUEST  0xd0
+#define RPC_RESPONSE 0xd1
+#define RPC_CALLS    256  /* default number of outstanding calls */
+#define RPC_MAX_CALLS 4096
+
+/* Status of a call other than the send status, which are
+   positive. These are also the values of libweremac (weremac.h). */
+enum rpc_status {
+  RPC_SUCCESS =  0,
+  RPC_FULL    = -1, /* too many outstanding calls */
+  RPC_TIMEOUT = -3  /* no response in time */
+};
+
+/* Completion of a call, the payload of the response is only
+   valid during the call and NULL unless the status is 0. */
+typedef void (*rpc_done)(void *cookie, int status, const void *payload, unsigned int size);
+
+struct rpc_call {
+  struct rpc        *rpc;
+  struct wheel_timer timer;
+  unsigned long      deadline; /* in us on the monotonic clock */
+  uint16_t           id;  /* generation and slot */
+  uint16_t           dst;
+  int                busy;
+  rpc_done           done;
+  void              *cookie;
+};
+
+struct rpc_config {
+  /* Send a message made of the header followed by the payload,
+     with the identifier of the call for requests. A non-zero
+     status completes the call at once, the send may also fail
+     later with rpc_fail(). */
+  int (*send)(uint16_t dst, const uint8_t *header, const void *payload,
+              unsigned int size, uint16_t id, void *data);
+
+  /* A request received from a source, to be answered with
+     rpc_reply() on the same identifier. This may be NULL. */
+  void (*cb_request)(uint16_t src, uint16_t id, const void *payload,
+                     unsigned int size, void *data);
+
+  void *data;
+};
+
+struct rpc {
+  pthread_mutex_t   lock;
+  struct rpc_config conf;
+  struct ticker    *ticker;
+  struct rpc_call  *calls;
+  uint16_t         *free;   /* FIFO of free slots, reused last */
+  unsigned int      head;
+  unsigned int      nfree;
+  unsigned int      ncalls; /* power of two */
+  unsigned int      bits;   /* of the slot in the identifier */
+
+  /* statistics */
+  unsigned long completed;
+  unsigned long timeouts;
+  unsigned long stale; /* responses to unknown calls */
+};
+
+/* Allocate a table of calls rounded up to a power of two
+   (at most RPC_MAX_CALLS) with the timeouts on a ticker. */
+void rpc_init(struct rpc *r, unsigned int calls, struct ticker *ticker,
+              const struct rpc_config *conf);
+void rpc_free(struct rpc *r);
+
+/* Send a request and call done() once the response arrived or
+   after timeout us. Return 0, otherwise RPC_FULL or the status of
+   a send which failed at once and done() is not called. */
+int rpc_call(struct rpc *r, uint16_t dst, const void *payload, unsigned int size,
+             unsigned long timeout, rpc_done done, void *cookie);
+
+/* Answer a request received from a source. */
+int rpc_reply(struct rpc *r, uint16_t dst, uint16_t id, const void *payload, unsigned int size);
+
+/* Complete a call whose request could not be sent. */
+void rpc_fail(struct rpc *r, uint16_t id, int status);
+
+/* Handle a received message. Return 1 when this is a request
+   or a response, otherwise the message is not for this layer
+   and 0 is returned. */
+int rpc_input(struct rpc *r, uint16_t src, const void *msg, unsigned int size);
+
+#endif /* _RPC_H_ */
@@ -0,0 +1,328 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _POSIX_C_SOURCE 200809L
+# include <linux/gpio.h>
+# include <sys/ioctl.h>
+#endif /* __linux__ */
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <err.h>
+
+#include "safe-call.h"
+#include "rpi-gpio.h"
+
+/* FIXME: This is Linux specific, isn't it?
+   We need a pragma to avoid compilation on
+   other OS. */
+
+/* The peripheral base depends on the SoC: 0x20000000 on the
+   BCM2835 (Pi 1 and Zero), 0x3f000000 on the BCM2836/7 (Pi 2
+   and 3) and 0xfe000000 on the BCM2711 (Pi 4). It is read from
+   the device tree like bcm_host_get_peripheral_address() does. */
+#define BCM2708_PERI_BASE 0x20000000
+#define GPIO_OFFSET       0x200000
+#define BLOCK_SIZE        4096
+
+#define GPIO_LINES 54
+
+static volatile uint32_t *gpio_reg;
+
+/* Character device backend (see rpi_gpio_use_chip()). */
+static const char *chip_path;
+static int chip_fd = -1;
+static int line_fds[GPIO_LINES];
+static unsigned int line_modes[GPIO_LINES];
+static unsigned int line_edges[GPIO_LINES]; /* the line reports its edges */
+
+static uint32_t read_be32(const unsigned char *p)
+{
+  return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static uint32_t peripheral_base(void)
+{
+  unsigned char ranges[12];
+  uint32_t base = 0;
+  FILE *fp;
+
+  fp = fopen("/proc/device-tree/soc/ranges", "rb");
+  if(!fp)
+    return BCM2708_PERI_BASE;
+
+  if(fread(ranges, 1, sizeof(ranges), fp) == sizeof(ranges)) {
+    base = read_be32(ranges + 4);
+    if(!base) /* 64-bit parent address on the BCM2711 */
+      base = read_be32(ranges + 8);
+  }
+  fclose(fp);
+
+  return base ? base : BCM2708_PERI_BASE;
+}
+
+static void mmap_init(void)
+{
+  off_t offset = 0;
+  int fd;
+
+  /* /dev/gpiomem only maps the GPIO block but does not need root */
+  fd = open("/dev/gpiomem", O_RDWR | O_SYNC);
+  if(fd < 0) {
+    fd     = xopen("/dev/mem", O_RDWR | O_SYNC, 0);
+    offset = peripheral_base() + GPIO_OFFSET;
+  }
+
+  gpio_reg = mmap(0, BLOCK_SIZE,
+                  PROT_READ | PROT_WRITE,
+                  MAP_SHARED,
+                  fd, offset);
+  if(gpio_reg == MAP_FAILED)
+    err(EXIT_FAILURE, "cannot mmap GPIO");
+  close(fd);
+}
+
+#if defined(__linux__) && defined(GPIO_V2_GET_LINE_IOCTL)
+static void chip_init(void)
+{
+  unsigned int i;
+
+  chip_fd = xopen(chip_path, O_RDWR | O_CLOEXEC, 0);
+  for(i = 0 ; i < GPIO_LINES ; i++)
+    line_fds[i] = -1;
+}
+
+static void chip_destroy(void)
+{
+  unsigned int i;
+
+  for(i = 0 ; i < GPIO_LINES ; i++) {
+    if(line_fds[i] >= 0)
+      close(line_fds[i]);
+    line_fds[i] = -1;
+  }
+  close(chip_fd);
+  chip_fd = -1;
+}
+
+/* Request the line again with its new direction. The inputs
+   report both edges when the chip supports it (see
+   rpi_gpio_wait()) and the outputs start high, which is the
+   idle level of the reset and CTS lines. */
+static void chip_set_mode(unsigned int gpio, unsigned int mode)
+{
+  struct gpio_v2_line_request req;
+
+  if(mode != RPI_GPIO_IN && mode != RPI_GPIO_OUT)
+    errx(EXIT_FAILURE, "GPIO %u: alternate functions need the mmap backend", gpio);
+
+  if(line_fds[gpio] >= 0)
+    close(line_fds[gpio]);
+  line_fds[gpio] = -1;
+
+  memset(&req, 0, sizeof(req));
+  req.offsets[0] = gpio;
+  req.num_lines  = 1;
+  strncpy(req.consumer, "weremac", sizeof(req.consumer) - 1);
+
+  if(mode == RPI_GPIO_OUT) {
+    req.config.flags     = GPIO_V2_LINE_FLAG_OUTPUT;
+    req.config.num_attrs = 1;
+    req.config.attrs[0]  = (struct gpio_v2_line_config_attribute){
+      .attr = { .id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES, .values = 1 },
+      .mask = 1 };
+  }
+  else {
+    req.config.flags = GPIO_V2_LINE_FLAG_INPUT |
+                       GPIO_V2_LINE_FLAG_EDGE_RISING |
+                       GPIO_V2_LINE_FLAG_EDGE_FALLING;
+    line_edges[gpio] = 1;
+    if(ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req) == 0)
+      goto done;
+    req.config.flags = GPIO_V2_LINE_FLAG_INPUT; /* no edge detection */
+  }
+
+  line_edges[gpio] = 0;
+  if(ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req) < 0)
+    err(EXIT_FAILURE, "cannot request GPIO %u on %s", gpio, chip_path);
+done:
+  line_fds[gpio]   = req.fd;
+  line_modes[gpio] = mode;
+}
+
+static void chip_write(unsigned int gpio, unsigned int value)
+{
+  struct gpio_v2_line_values v = { .bits = value, .mask = 1 };
+
+  if(line_fds[gpio] < 0 || line_modes[gpio] != RPI_GPIO_OUT)
+    errx(EXIT_FAILURE, "GPIO %u is not an output", gpio);
+  if(ioctl(line_fds[gpio], GPIO_V2_LINE_SET_VALUES_IOCTL, &v) < 0)
+    err(EXIT_FAILURE, "cannot set GPIO %u", gpio);
+}
+
+static int chip_read(unsigned int gpio)
+{
+  struct gpio_v2_line_values v = { .mask = 1 };
+
+  if(line_fds[gpio] < 0)
+    errx(EXIT_FAILURE, "GPIO %u is not configured", gpio);
+  if(ioctl(line_fds[gpio], GPIO_V2_LINE_GET_VALUES_IOCTL, &v) < 0)
+    err(EXIT_FAILURE, "cannot read GPIO %u", gpio);
+  return v.bits & 1;
+}
+
+/* Wait for an edge on an input line, return 0 on timeout
+   and -1 when the line does not report its edges. */
+static int chip_wait_edge(unsigned int gpio, int timeout)
+{
+  struct gpio_v2_line_event event;
+  struct pollfd pfd = { .fd = line_fds[gpio], .events = POLLIN };
+  int n;
+
+  if(!line_edges[gpio])
+    return -1;
+
+  n = poll(&pfd, 1, timeout);
+  if(n < 0)
+    err(EXIT_FAILURE, "cannot wait for GPIO %u", gpio);
+  if(n > 0 && read(line_fds[gpio], &event, sizeof(event)) < 0)
+    err(EXIT_FAILURE, "cannot read GPIO %u event", gpio);
+  return n;
+}
+#else
+static void chip_init(void)
+{
+  errx(EXIT_FAILURE, "GPIO character devices are not supported on this platform");
+}
+
+static void chip_destroy(void) {}
+static void chip_set_mode(unsigned int gpio, unsigned int mode) { (void)gpio; (void)mode; }
+static void chip_write(unsigned int gpio, unsigned int value) { (void)gpio; (void)value; }
+static int chip_read(unsigned int gpio) { (void)gpio; return 0; }
+static int chip_wait_edge(unsigned int gpio, int timeout) { (void)gpio; (void)timeout; return -1; }
+#endif /* __linux__ && GPIO_V2_GET_LINE_IOCTL */
+
+void rpi_gpio_use_chip(const char *path)
+{
+  chip_path = path;
+}
+
+void rpi_gpio_init(void)
+{
+  if(chip_path)
+    chip_init();
+  else
+    mmap_init();
+}
+
+void rpi_gpio_destroy(void)
+{
+  if(chip_path)
+    chip_destroy();
+  else
+    munmap((void *)gpio_reg, BLOCK_SIZE);
+}
+
+void rpi_gpio_set_mode(unsigned int gpio, unsigned int mode)
+{
+  int reg, shift;
+
+  if(chip_path) {
+    chip_set_mode(gpio, mode);
+    return;
+  }
+
+  reg   = gpio / 10;
+  shift = (gpio % 10) * 3;
+
+  gpio_reg[reg] = (gpio_reg[reg] & ~(7 << shift)) | /* clear pin conf */
+                  (mode << shift);                  /* apply mode */
+}
+
+void rpi_gpio_set(unsigned int gpio)
+{
+  if(chip_path)
+    chip_write(gpio, 1);
+  else
+    *(gpio_reg + 7)  = 1 << gpio;
+}
+
+void rpi_gpio_clr(unsigned int gpio)
+{
+  if(chip_path)
+    chip_write(gpio, 0);
+  else
+    *(gpio_reg + 10) = 1 << gpio;
+}
+
+int rpi_gpio_get(unsigned int gpio)
+{
+  if(chip_path)
+    return chip_read(gpio);
+  return *(gpio_reg + 13) & (1 << gpio);
+}
+
+static long elapsed_ms(const struct timespec *begin)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - begin->tv_sec) * 1000 + (now.tv_nsec - begin->tv_nsec) / 1000000;
+}
+
+int rpi_gpio_wait(unsigned int gpio, int level, unsigned int timeout)
+{
+  struct timespec begin, poll_delay = { 0, 100000 };
+  long left;
+
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  while(!rpi_gpio_get(gpio) != !level) {
+    left = (long)timeout - elapsed_ms(&begin);
+    if(left <= 0)
+      return 0;
+
+    /* sleep until the next edge when the
+       line reports them, otherwise poll */
+    if(!chip_path || chip_wait_edge(gpio, left) < 0)
+      nanosleep(&poll_delay, NULL);
+  }
+
+  return 1;
+}
+
+int rpi_gpio_check(unsigned int gpio)
+{
+  /* FIXME: not sure this is sufficient */
+  if(gpio <= 27)
+    return 1;
+  return 0;
+}
@@ -37,7 +37,16 @@ enum rpi_gpio_mode {
   RPI_GPIO_ALT5 = 0x2
 };
 
-/* Map GPIOs on the RPi */
+/* Use the GPIO character device at path (e.g. /dev/gpiochip0)
+   instead of mapping the registers. This must be called before
+   rpi_gpio_init(). It works on every model without root but only
+   supports the input and output modes. */
+void rpi_gpio_use_chip(const char *path);
+
+/* Map GPIOs on the RPi. The registers are mapped from /dev/gpiomem
+   when available, otherwise from /dev/mem at the peripheral base of
+   the model (read from the device tree). Open the character device
+   instead with rpi_gpio_use_chip(). */
 void rpi_gpio_init(void);
 
 /* Unmap GPIOs from the RPi */
@@ -58,5 +67,11 @@ void rpi_gpio_clr(unsigned int gpio);
 /* Get the state of a GPIO */
 int rpi_gpio_get(unsigned int gpio);
 
+/* Wait up to timeout ms until an input GPIO is at level (0 or 1),
+   e.g. for the ready or status pin of a modem. With the character
+   device it sleeps until the next edge, otherwise the GPIO is
+   polled every 100us. Returns 0 on timeout. */
+int rpi_gpio_wait(unsigned int gpio, int level, unsigned int timeout);
+
 /* Check that the GPIO number is valid */
 int rpi_gpio_check(unsigned int gpio);
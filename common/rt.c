@@ -0,0 +1,127 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _GNU_SOURCE /* pthread_attr_setaffinity_np() */
+#endif /* __linux__ */
+
+#include <sys/mman.h>
+#include <pthread.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <stdio.h>
+#include <err.h>
+
+#include "rt.h"
+
+static const char * const role_names[RT_NROLES] = {
+  [RT_RX]    = "rx",
+  [RT_TX]    = "tx",
+  [RT_TIMER] = "timer",
+  [RT_APP]   = "app"
+};
+
+static struct rt_conf {
+  int            tuned;
+  pthread_attr_t attr;
+} roles[RT_NROLES];
+
+static enum rt_role parse_role(const char *name, size_t len)
+{
+  int i;
+
+  for(i = 0 ; i < RT_NROLES ; i++)
+    if(strlen(role_names[i]) == len && !strncmp(name, role_names[i], len))
+      return i;
+
+  errx(EXIT_FAILURE, "unknown thread role '%.*s'", (int)len, name);
+}
+
+void rt_parse(const char *arg)
+{
+  const char *sep = strchr(arg, ':');
+  struct rt_conf *conf;
+  struct sched_param param = { 0 };
+  unsigned int stack = 0;
+  int prio, cpu = -1;
+  int n, err;
+
+  if(!sep)
+    errx(EXIT_FAILURE, "cannot parse thread tuning");
+  conf = &roles[parse_role(arg, sep - arg)];
+
+  n = sscanf(sep + 1, "%d:%d:%u", &prio, &cpu, &stack);
+  if(n < 1 || cpu < -1)
+    errx(EXIT_FAILURE, "cannot parse thread tuning");
+
+  if(conf->tuned)
+    pthread_attr_destroy(&conf->attr);
+  pthread_attr_init(&conf->attr);
+  conf->tuned = 1;
+
+  if(prio) {
+    if(prio < sched_get_priority_min(SCHED_FIFO) ||
+       prio > sched_get_priority_max(SCHED_FIFO))
+      errx(EXIT_FAILURE, "invalid SCHED_FIFO priority %d", prio);
+
+    param.sched_priority = prio;
+    err  = pthread_attr_setinheritsched(&conf->attr, PTHREAD_EXPLICIT_SCHED);
+    err |= pthread_attr_setschedpolicy(&conf->attr, SCHED_FIFO);
+    err |= pthread_attr_setschedparam(&conf->attr, &param);
+    if(err)
+      errx(EXIT_FAILURE, "cannot set thread priority");
+  }
+
+  if(cpu >= 0) {
+#ifdef __linux__
+    cpu_set_t set;
+
+    if(cpu >= CPU_SETSIZE)
+      errx(EXIT_FAILURE, "invalid CPU %d", cpu);
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if(pthread_attr_setaffinity_np(&conf->attr, sizeof(set), &set))
+      errx(EXIT_FAILURE, "cannot set thread affinity");
+#else
+    errx(EXIT_FAILURE, "thread affinity not supported");
+#endif /* __linux__ */
+  }
+
+  if(stack && pthread_attr_setstacksize(&conf->attr, stack * 1024UL))
+    errx(EXIT_FAILURE, "invalid stack size (min. %lu KiB)",
+         ((unsigned long)PTHREAD_STACK_MIN + 1023) / 1024);
+}
+
+const pthread_attr_t * rt_attr(enum rt_role role)
+{
+  return roles[role].tuned ? &roles[role].attr : NULL;
+}
+
+void rt_mlock(void)
+{
+  if(mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+    err(EXIT_FAILURE, "cannot lock memory");
+}
@@ -0,0 +1,53 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _RT_H_
+#define _RT_H_
+
+#include <pthread.h>
+
+/* Thread roles that can be tuned from the command line. */
+enum rt_role {
+  RT_RX,    /* UART input thread */
+  RT_TX,    /* output thread (reads the mode and sends) */
+  RT_TIMER, /* ACK timer thread */
+  RT_APP,   /* delivery of received frames to the mode */
+  RT_NROLES
+};
+
+/* Parse a ROLE:PRIO[:CPU[:STACK]] argument where ROLE is rx, tx,
+   timer or app, PRIO a SCHED_FIFO priority (0 keeps the default
+   policy), CPU the CPU the thread is pinned to (-1 for any) and
+   STACK the stack size in KiB. Exit on error. */
+void rt_parse(const char *arg);
+
+/* Attributes for a thread of the given role or NULL
+   when the role was not tuned. */
+const pthread_attr_t * rt_attr(enum rt_role role);
+
+/* Lock all current and future pages in memory
+   so that no thread faults on a page. Exit on error. */
+void rt_mlock(void);
+
+#endif /* _RT_H_ */
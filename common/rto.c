@@ -22,72 +22,60 @@
    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <sys/mman.h>
-#include <unistd.h>
-#include <stdlib.h>
-#include <stdint.h>
-#include <fcntl.h>
-#include <err.h>
+#include "rto.h"
 
-#include "safe-call.h"
-
-/* FIXME: This is Linux specific, isn't it?
-   We need a pragma to avoid compilation on
-   other OS. */
-
-#define BCM2708_PERI_BASE 0x20000000
-#define GPIO_BASE         (BCM2708_PERI_BASE + 0x200000)
-#define BLOCK_SIZE        4096
-
-static volatile uint32_t *gpio_reg;
-
-void rpi_gpio_init(void)
-{
-  int fd = xopen("/dev/mem", O_RDWR | O_SYNC, 0);
-  gpio_reg = mmap(0, BLOCK_SIZE,
-                  PROT_READ | PROT_WRITE,
-                  MAP_SHARED,
-                  fd, GPIO_BASE);
-  if(gpio_reg == MAP_FAILED)
-    err(EXIT_FAILURE, "cannot mmap GPIO");
-  close(fd);
-}
-
-void rpi_gpio_destroy(void)
-{
-  munmap((void *)gpio_reg, BLOCK_SIZE);
-}
-
-void rpi_gpio_set_mode(unsigned int gpio, unsigned int mode)
+static unsigned long clamp(const struct rto *r, unsigned long us)
 {
-  int reg, shift;
-
-  reg   = gpio / 10;
-  shift = (gpio % 10) * 3;
-
-  gpio_reg[reg] = (gpio_reg[reg] & ~(7 << shift)) | /* clear pin conf */
-                  (mode << shift);                  /* apply mode */
+  if(us < r->min)
+    return r->min;
+  if(us > r->max)
+    return r->max;
+  return us;
 }
 
-void rpi_gpio_set(unsigned int gpio)
+void rto_init(struct rto *r, unsigned long min, unsigned long max)
 {
-  *(gpio_reg + 7)  = 1 << gpio;
+  *r = (struct rto){ .min = min,
+                     .max = max < min ? min : max,
+                     .rto = max < min ? min : max };
 }
 
-void rpi_gpio_clr(unsigned int gpio)
+void rto_sample(struct rto *r, unsigned long rtt)
 {
-  *(gpio_reg + 10) = 1 << gpio;
+  long delta;
+
+  if(!r->srtt) {
+    /* first sample: srtt = rtt, rttvar = rtt / 2 */
+    r->srtt   = rtt << RTO_ALPHA;
+    r->rttvar = rtt << (RTO_BETA - 1);
+  }
+  else {
+    /* rttvar += (|srtt - rtt| - rttvar) / 4
+       srtt   += (rtt - srtt) / 8 */
+    delta = (long)rtt - (long)(r->srtt >> RTO_ALPHA);
+    if(delta < 0)
+      delta = -delta;
+    r->rttvar += delta - (long)(r->rttvar >> RTO_BETA);
+    r->srtt   += rtt - (long)(r->srtt >> RTO_ALPHA);
+  }
+
+  /* the srtt is never zero once sampled */
+  if(!r->srtt)
+    r->srtt = 1;
+
+  /* The variation is scaled by 4, so this is srtt + 4 * rttvar.
+     Like the clock granularity G of RFC 6298 the lower bound is
+     also the smallest margin over srtt, a steady link would end
+     up with no margin at all otherwise. */
+  r->rto = clamp(r, (r->srtt >> RTO_ALPHA) + (r->rttvar > r->min ? r->rttvar : r->min));
 }
 
-int rpi_gpio_get(unsigned int gpio)
+void rto_backoff(struct rto *r)
 {
-  return *(gpio_reg + 13) & (1 << gpio);
+  r->rto = clamp(r, r->rto * 2);
 }
 
-int rpi_gpio_check(unsigned int gpio)
+unsigned long rto_timeout(const struct rto *r)
 {
-  /* FIXME: not sure this is sufficient */
-  if(gpio <= 27)
-    return 1;
-  return 0;
+  return r->rto;
 }
@@ -0,0 +1,63 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _RTO_H_
+#define _RTO_H_
+
+/* Retransmission timeout estimation (Jacobson/Karels, RFC 6298).
+   The smoothed round-trip time and its variation are updated on
+   each sample and the timeout is srtt + 4 * rttvar within the
+   configured bounds. This is pure C, the caller provides the
+   clock and the locking.
+
+   Only unambiguous samples must be fed to the estimator, that is
+   round trips of frames which were not retransmitted (Karn). The
+   timeout starts at the upper bound until the first sample. */
+
+/* EWMA weights of a new sample as shifts (1/8 and 1/4). */
+#define RTO_ALPHA 3
+#define RTO_BETA  2
+
+struct rto {
+  unsigned long min;    /* lower bound in us */
+  unsigned long max;    /* upper bound in us */
+  unsigned long srtt;   /* smoothed RTT in 1/8 us, 0 before the first sample */
+  unsigned long rttvar; /* RTT variation in 1/4 us */
+  unsigned long rto;    /* current timeout in us */
+};
+
+/* Start without any sample, the timeout is the upper bound. */
+void rto_init(struct rto *r, unsigned long min, unsigned long max);
+
+/* Account a round-trip time in us. */
+void rto_sample(struct rto *r, unsigned long rtt);
+
+/* Double the timeout after a loss, up to the upper bound. The
+   next sample restarts from the smoothed estimate. */
+void rto_backoff(struct rto *r);
+
+/* Timeout in us for the next transmission. */
+unsigned long rto_timeout(const struct rto *r);
+
+#endif /* _RTO_H_ */
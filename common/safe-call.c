@@ -41,6 +41,7 @@
 #include <err.h>
 
 #include "safe-call.h"
+#include "prof.h"
 
 #define SAFE_CALL0(name, erron, msg, ret)       \
   ret x ## name () {                            \
@@ -81,11 +82,8 @@
 SAFE_CALL0(fork, < 0, "cannot fork", int)
 
 SAFE_CALL1(pipe, < 0, "cannot create pipe", int, int *)
-SAFE_CALL1(malloc, == NULL, "out of memory", void *, size_t)
 SAFE_CALL1(chdir, < 0, "cannot change directory", int, const char *)
-SAFE_CALL1(strdup, == NULL, "out of memory", char *, const char *)
 
-SAFE_CALL2(realloc, == NULL, "out of memory", void *, void *, size_t)
 SAFE_CALL2(stat, < 0, "IO stat error", int, const char *, struct stat *)
 SAFE_CALL2(dup2, < 0, "cannot duplicate file descriptors", int, int, int)
 SAFE_CALL2(getcwd, == NULL, "cannot get current working directory", char *,
@@ -111,3 +109,34 @@ SAFE_CALL4(send, < 0, "send error", ssize_t, int, const void *, size_t, int)
 SAFE_CALL4(recv, < 0, "recv error", ssize_t, int, void *, size_t, int)
 SAFE_CALL4(pthread_create, != 0, "cannot create thread", int,
            pthread_t *, const pthread_attr_t *, void *, void *)
+
+/* The allocations are counted for the profiler (see prof.h). */
+void * xmalloc(size_t size)
+{
+  void *ptr = malloc(size);
+
+  if(ptr == NULL)
+    err(EXIT_FAILURE, "out of memory");
+  prof_alloc(size);
+  return ptr;
+}
+
+void * xrealloc(void *ptr, size_t size)
+{
+  ptr = realloc(ptr, size);
+
+  if(ptr == NULL)
+    err(EXIT_FAILURE, "out of memory");
+  prof_alloc(size);
+  return ptr;
+}
+
+char * xstrdup(const char *s)
+{
+  char *t = strdup(s);
+
+  if(t == NULL)
+    err(EXIT_FAILURE, "out of memory");
+  prof_alloc(strlen(s) + 1);
+  return t;
+}
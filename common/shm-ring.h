@@ -0,0 +1,102 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SHM_RING_H_
+#define _SHM_RING_H_
+
+#include <stdint.h>
+
+/* Layout of the shared memory area exported by the shm mode.
+
+   The area starts with a shm_area header followed by two rings.
+   Each ring is a single producer single consumer ring of fixed
+   size slots. A slot starts with the length of the record
+   (u16) followed by the record itself:
+
+     rx ring (driver to application):
+       [status (u8)][src (u16)][dst (u16)][payload]
+     tx ring (application to driver):
+       [dst (u16)][payload]
+
+   The producer writes the slot at head and then increments head,
+   the consumer reads the slot at tail and then increments tail.
+   Indexes are free running (the slot is the index modulo the
+   number of slots) and must be accessed with acquire/release
+   semantic. The producer writes 1 to the ring eventfd after one
+   or more records have been published.
+
+   The application connects to the mode Unix stream socket and
+   receives the shared memory descriptor followed by the rx and
+   tx eventfd descriptors (SCM_RIGHTS). Only one application
+   should use the rings at a time.
+
+   Either side can write anything in the mapping, so each one
+   keeps the geometry of the rings and its own indexes in its
+   private memory (see shm_ring_view) and only trusts the index
+   of the other side once it is within count of its own. */
+
+#define SHM_RING_MAGIC   0x4d524853 /* "SHRM" */
+#define SHM_RING_VERSION 2
+
+/* The indexes written by each side and the rings are on cache
+   lines of their own, the offsets are multiples of this. */
+#define SHM_CACHE_LINE 64
+
+struct shm_ring {
+  uint32_t head;      /* next slot written by the producer */
+  uint8_t  head_pad[SHM_CACHE_LINE - sizeof(uint32_t)];
+  uint32_t tail;      /* next slot read by the consumer */
+  uint8_t  tail_pad[SHM_CACHE_LINE - sizeof(uint32_t)];
+  uint32_t count;     /* number of slots (power of two) */
+  uint32_t slot_size; /* size of a slot including the record length */
+  uint64_t drops;     /* records dropped because the ring was full */
+  uint8_t  pad[SHM_CACHE_LINE - 2 * sizeof(uint32_t) - sizeof(uint64_t)];
+};
+
+struct shm_area {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t rx_offset; /* offset of the rx shm_ring from the start of the area */
+  uint32_t tx_offset; /* offset of the tx shm_ring from the start of the area */
+};
+
+#define SHM_RING(area, offset) ((struct shm_ring *)((unsigned char *)(area) + (offset)))
+#define SHM_SLOT(ring, i) ((unsigned char *)((ring) + 1) + \
+                           ((i) & ((ring)->count - 1)) * (ring)->slot_size)
+
+/* A ring as seen by one side, with the geometry it was created
+   with and the index this side writes (the head of the ring it
+   produces or the tail of the ring it consumes). */
+struct shm_ring_view {
+  struct shm_ring *shared;
+  unsigned char   *slots;
+  uint32_t         count;
+  uint32_t         mask;
+  uint32_t         slot_size;
+  uint32_t         index;
+};
+
+#define SHM_VIEW_SLOT(view, i) ((view)->slots + ((i) & (view)->mask) * (view)->slot_size)
+
+#endif /* _SHM_RING_H_ */
@@ -0,0 +1,143 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _POSIX_C_SOURCE 200112L
+#endif /* __linux__ */
+
+#include <sys/mman.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "statmap.h"
+
+int statmap_open(struct statmap *s, const char *path, unsigned int max)
+{
+  void *base;
+  int fd;
+
+  s->size = sizeof(struct statmap_hdr) + max * sizeof(struct statmap_entry);
+
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0)
+    return -1;
+  if(ftruncate(fd, s->size) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  base = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(base == MAP_FAILED)
+    return -1;
+
+  s->hdr     = base;
+  s->entries = (struct statmap_entry *)(s->hdr + 1);
+  s->next    = 0;
+
+  s->hdr->version    = STATMAP_VERSION;
+  s->hdr->entry_size = sizeof(struct statmap_entry);
+  s->hdr->max        = max;
+
+  /* readers check the magic last */
+  __atomic_store_n(&s->hdr->magic, STATMAP_MAGIC, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+void statmap_close(struct statmap *s)
+{
+  munmap(s->hdr, s->size);
+}
+
+void statmap_begin(struct statmap *s)
+{
+  /* The odd sequence must be visible before any of the values. */
+  __atomic_store_n(&s->hdr->seq, s->hdr->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  s->next = 0;
+}
+
+void statmap_value(struct statmap *s, const char *name,
+                   const char *labels, unsigned long value)
+{
+  struct statmap_entry *e;
+  char buf[STATMAP_NAME_SIZE];
+
+  if(s->next >= s->hdr->max)
+    return;
+  e = &s->entries[s->next++];
+
+  if(labels)
+    snprintf(buf, sizeof(buf), "%s{%s}", name, labels);
+  else
+    snprintf(buf, sizeof(buf), "%s", name);
+
+  /* the names only change when the set changes */
+  if(strcmp(e->name, buf))
+    strcpy(e->name, buf);
+  __atomic_store_n(&e->value, value, __ATOMIC_RELAXED);
+}
+
+void statmap_end(struct statmap *s)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  s->hdr->count   = s->next;
+  s->hdr->updated = now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+  __atomic_store_n(&s->hdr->seq, s->hdr->seq + 1, __ATOMIC_RELEASE);
+}
+
+int statmap_read(const struct statmap_hdr *hdr,
+                 struct statmap_entry *entries, unsigned int max)
+{
+  const struct statmap_entry *src = (const struct statmap_entry *)(hdr + 1);
+  uint32_t seq;
+  unsigned int count;
+
+  if(__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != STATMAP_MAGIC ||
+     hdr->version != STATMAP_VERSION ||
+     hdr->entry_size != sizeof(struct statmap_entry))
+    return -1;
+
+  do {
+    while((seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE)) & 1);
+
+    count = hdr->count;
+    if(count > max)
+      count = max;
+    memcpy(entries, src, count * sizeof(struct statmap_entry));
+
+    /* the copy must complete before the sequence is checked again */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while(__atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) != seq);
+
+  return count;
+}
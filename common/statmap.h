@@ -0,0 +1,90 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _STATMAP_H_
+#define _STATMAP_H_
+
+#include <stdint.h>
+
+/* Live statistics published in a file that monitors map in
+   memory, so they may be read at any rate without waking the
+   driver. The file holds a header followed by an array of
+   named values. Each value is a metric sample named as in the
+   Prometheus text format (see metrics.h), that is the metric
+   name followed by its labels between braces.
+
+   The driver updates the whole set under a sequence lock. The
+   sequence is odd during an update and readers retry when it
+   changed while they copied the values (see statmap_read()). */
+#define STATMAP_MAGIC     0x54534d57 /* "WMST" */
+#define STATMAP_VERSION   1
+#define STATMAP_NAME_SIZE 88
+#define STATMAP_MAX       256 /* default number of entries */
+
+struct statmap_hdr {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t entry_size; /* sizeof(struct statmap_entry) */
+  uint32_t seq;        /* odd while updating */
+  uint32_t count;      /* entries of the last update */
+  uint32_t max;        /* entries in the file */
+  uint32_t reserved;
+  uint64_t updated;    /* CLOCK_MONOTONIC of the last update in us */
+};
+
+struct statmap_entry {
+  char     name[STATMAP_NAME_SIZE]; /* NUL terminated */
+  uint64_t value;
+};
+
+/* Writer side of a statistics file. */
+struct statmap {
+  struct statmap_hdr   *hdr;
+  struct statmap_entry *entries;
+  unsigned int next; /* entry of the next value */
+  unsigned long size;
+};
+
+/* Create the file with room for max entries and map it.
+   Return 0 on success or -1 on error with errno set. */
+int statmap_open(struct statmap *s, const char *path, unsigned int max);
+void statmap_close(struct statmap *s);
+
+/* Update the set of values. The values must be given in the
+   same order on each update so that the entries keep their
+   place. Values beyond the size of the file are dropped. */
+void statmap_begin(struct statmap *s);
+void statmap_value(struct statmap *s, const char *name,
+                   const char *labels, unsigned long value);
+void statmap_end(struct statmap *s);
+
+/* Copy a consistent set of at most max entries from a mapped
+   file into entries and return the number of entries copied,
+   or -1 when the file is not a statistics file of this version.
+   This only loads from memory and spins while an update is in
+   progress. */
+int statmap_read(const struct statmap_hdr *hdr,
+                 struct statmap_entry *entries, unsigned int max);
+
+#endif /* _STATMAP_H_ */
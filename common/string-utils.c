@@ -80,7 +80,7 @@ char * strcat_dup(const char *a, const char *b)
 {
   int len_a = strlen(a);
   int len_b = strlen(b);
-  int len   = MAX(len_a, len_b); /* len without terminal '\0' */
+  int len   = len_a + len_b; /* len without terminal '\0' */
 
   /* allocate memory for the concatenated string
      here we take into account the terminal '\0' */
@@ -0,0 +1,204 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+
+#include "string-utils.h"
+#include "subscribe.h"
+#include "batch.h"
+
+/* Clients are updated from the output thread on subscription
+   requests and read from the delivery thread when publishing
+   frames, so the table is protected with its own lock. The
+   batch has its own copy of the client addresses since it is
+   only sent later, once a client may be gone or replaced. A
+   dropped message finds its client by address, if still there. */
+static pthread_mutex_t sub_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct client {
+  unsigned int used;
+  unsigned int permanent;     /* default client */
+  struct sockaddr_un addr;
+  uint8_t  mask;
+  uint16_t src;
+  uint8_t  status;
+  uint8_t  source;
+  unsigned long drops;        /* frames dropped because the client was too slow */
+  unsigned long reported;     /* drops already reported */
+} clients[SUB_MAX_CLIENTS];
+
+static struct client * find_client(const struct sockaddr_un *addr)
+{
+  int i;
+
+  for(i = 0 ; i < SUB_MAX_CLIENTS ; i++)
+    if(clients[i].used && !strcmp(clients[i].addr.sun_path, addr->sun_path))
+      return &clients[i];
+  return NULL;
+}
+
+void sub_init(const char *path)
+{
+  pthread_mutex_lock(&sub_lock);
+  {
+    clients[0] = (struct client){ .used      = 1,
+                                  .permanent = 1,
+                                  .addr      = { .sun_family = AF_UNIX } };
+    xstrcpy(clients[0].addr.sun_path, path, sizeof(clients[0].addr.sun_path));
+  }
+  pthread_mutex_unlock(&sub_lock);
+}
+
+void sub_request(const void *msg, size_t size, const struct sockaddr_un *from)
+{
+  const unsigned char *m = msg;
+  struct client *client;
+  int i;
+
+  if(size != SUB_MSG_SIZE) {
+    warnx("invalid subscription message");
+    return;
+  }
+
+  pthread_mutex_lock(&sub_lock);
+  {
+    client = find_client(from);
+
+    switch(m[0]) {
+    case SUB_UNSUBSCRIBE:
+      if(client && !client->permanent)
+        client->used = 0;
+      break;
+    case SUB_SUBSCRIBE:
+      for(i = 0 ; !client && i < SUB_MAX_CLIENTS ; i++) {
+        if(!clients[i].used) {
+          client = &clients[i];
+          *client = (struct client){ .used = 1, .addr = *from };
+        }
+      }
+
+      if(!client) {
+        warnx("too many clients, cannot subscribe %s", from->sun_path);
+        break;
+      }
+
+      client->mask   = m[1];
+      client->src    = *(uint16_t *)(m + 2);
+      client->status = m[4];
+      client->source = m[5];
+      break;
+    default:
+      warnx("invalid subscription operation");
+    }
+  }
+  pthread_mutex_unlock(&sub_lock);
+}
+
+static int match(const struct client *client, uint16_t src, int status, int source)
+{
+  if((client->mask & SUB_SRC) && client->src != src)
+    return 0;
+  if((client->mask & SUB_STATUS) && client->status != status)
+    return 0;
+  if((client->mask & SUB_SOURCE) && client->source != source)
+    return 0;
+  return 1;
+}
+
+static void drop(const struct batch *b, unsigned int i, int error)
+{
+  struct client *client = find_client(batch_addr(b, i));
+
+  /* unsubscribed since */
+  if(!client)
+    return;
+
+  switch(error) {
+  case EAGAIN:
+  case ENOBUFS:
+    client->drops++;
+    break;
+  case ENOENT:
+  case ECONNREFUSED:
+    if(!client->permanent) {
+      warnx("client %s is gone, unsubscribed", client->addr.sun_path);
+      client->used = 0;
+      break;
+    }
+    /* fall through */
+  default:
+    errno = error;
+    warn("network error"); /* we don't fail on client error */
+  }
+}
+
+static void flush(int sd, struct batch *b)
+{
+  int i;
+
+  batch_send(sd, b, MSG_DONTWAIT, drop);
+
+  for(i = 0 ; i < SUB_MAX_CLIENTS ; i++) {
+    struct client *client = &clients[i];
+
+    if(client->used && client->drops != client->reported) {
+      warnx("client %s is too slow, %lu frames dropped",
+            client->addr.sun_path, client->drops);
+      client->reported = client->drops;
+    }
+  }
+}
+
+void sub_publish(int sd, struct batch *b, struct pool *pool,
+                 void *record, size_t size,
+                 uint16_t src, int status, int source)
+{
+  int i;
+
+  pthread_mutex_lock(&sub_lock);
+  {
+    for(i = 0 ; i < SUB_MAX_CLIENTS ; i++) {
+      struct client *client = &clients[i];
+
+      if(!client->used || !match(client, src, status, source))
+        continue;
+
+      if(batch_add_ref(b, pool, record, size, &client->addr) == b->size)
+        flush(sd, b);
+    }
+  }
+  pthread_mutex_unlock(&sub_lock);
+}
+
+void sub_flush(int sd, struct batch *b)
+{
+  pthread_mutex_lock(&sub_lock);
+  flush(sd, b);
+  pthread_mutex_unlock(&sub_lock);
+}
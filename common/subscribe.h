@@ -0,0 +1,89 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _SUBSCRIBE_H_
+#define _SUBSCRIBE_H_
+
+#include <sys/types.h>
+#include <sys/un.h>
+#include <stdint.h>
+
+#include "batch.h"
+
+/* Maximum number of subscribed clients. */
+#define SUB_MAX_CLIENTS 16
+
+/* Subscription filter flags. A client only receives the
+   frames that match all the fields enabled in its mask. */
+enum sub_mask {
+  SUB_SRC    = 0x1, /* source address */
+  SUB_STATUS = 0x2, /* receive status */
+  SUB_SOURCE = 0x4, /* medium (only with the hybrid layer) */
+};
+
+/* Subscription message format:
+     [op (u8)][mask (u8)][src (u16)][status (u8)][source (u8)]
+   The op is 1 to subscribe (or update the filter) and 0 to
+   unsubscribe. Requests are identified by the client address,
+   so the client must bind its socket to a path. A single byte
+   with the op 2 is not a subscription, it requests statistics
+   from the mode (see sub_request()). Likewise the op 3 asks the
+   mode for the last payloads received from a source:
+     [op (u8)][src (u16)][count (u8)]
+   and the op 4 for what the path to a destination can carry
+   (only with the hybrid layer):
+     [op (u8)][dst (u16)] */
+enum sub_op {
+  SUB_UNSUBSCRIBE,
+  SUB_SUBSCRIBE,
+  SUB_STATS,
+  SUB_LAST,
+  SUB_PATH
+};
+
+#define SUB_MSG_SIZE  (sizeof(uint8_t) * 2 + sizeof(uint16_t) + sizeof(uint8_t) * 2)
+#define SUB_LAST_SIZE (sizeof(uint8_t) + sizeof(uint16_t) + sizeof(uint8_t))
+#define SUB_PATH_SIZE (sizeof(uint8_t) + sizeof(uint16_t))
+
+/* Register the default client that receives all frames.
+   This client is never unsubscribed even when unreachable. */
+void sub_init(const char *path);
+
+/* Handle a subscription message received from a client. */
+void sub_request(const void *msg, size_t size, const struct sockaddr_un *from);
+
+/* Append a record to the batch for each client whose filter
+   matches the frame. The record is a buffer of the pool which
+   is shared by all the clients rather than copied for each of
+   them. The batch is sent when it is full. */
+void sub_publish(int sd, struct batch *b, struct pool *pool,
+                 void *record, size_t size,
+                 uint16_t src, int status, int source);
+
+/* Send the batch without blocking. Clients that cannot keep up
+   are reported and lose the frame, clients that are gone are
+   unsubscribed. */
+void sub_flush(int sd, struct batch *b);
+
+#endif /* _SUBSCRIBE_H_ */
@@ -0,0 +1,214 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _POSIX_C_SOURCE 200112L
+#endif /* __linux__ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <err.h>
+
+#ifdef __linux__
+# include <sys/timerfd.h>
+#endif /* __linux__ */
+
+#include "ticker.h"
+
+static unsigned long now_us(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000UL + now.tv_nsec / 1000;
+}
+
+static struct timespec to_timespec(unsigned long us)
+{
+  return (struct timespec){ .tv_sec  = us / 1000000,
+                            .tv_nsec = (us % 1000000) * 1000 };
+}
+
+/* Program the wakeup on the earliest deadline of the
+   wheel. The ticker lock must be held. */
+static void program(struct ticker *k)
+{
+  unsigned long next;
+
+  if(!wheel_next(&k->wheel, &next))
+    next = 0;
+  else if(!next)
+    next = 1; /* zero would disarm the timerfd */
+  k->armed = next;
+
+#ifdef __linux__
+  {
+    struct itimerspec its = { .it_value = to_timespec(next) };
+
+    if(timerfd_settime(k->fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+      err(EXIT_FAILURE, "cannot program ticker");
+  }
+#else
+  pthread_cond_signal(&k->cond);
+#endif /* __linux__ */
+}
+
+/* Sleep until the programmed wakeup. The ticker lock
+   must be held, it is released while sleeping. */
+static void sleep_tick(struct ticker *k)
+{
+#ifdef __linux__
+  uint64_t expirations;
+
+  pthread_mutex_unlock(&k->lock);
+  if(read(k->fd, &expirations, sizeof(expirations)) < 0 && errno != EINTR)
+    err(EXIT_FAILURE, "cannot read ticker");
+  pthread_mutex_lock(&k->lock);
+#else
+  if(!k->armed)
+    pthread_cond_wait(&k->cond, &k->lock);
+  else if(k->armed > now_us()) {
+    struct timespec deadline = to_timespec(k->armed);
+    pthread_cond_timedwait(&k->cond, &k->lock, &deadline);
+  }
+#endif /* __linux__ */
+}
+
+void ticker_init(struct ticker *k, unsigned long tick)
+{
+  pthread_condattr_t attr;
+
+  *k = (struct ticker){ .fd = -1 };
+
+  pthread_mutex_init(&k->lock, NULL);
+  pthread_condattr_init(&attr);
+  if(pthread_condattr_setclock(&attr, CLOCK_MONOTONIC))
+    errx(EXIT_FAILURE, "cannot use monotonic clock");
+  if(pthread_cond_init(&k->cond, &attr))
+    errx(EXIT_FAILURE, "cannot initialize ticker");
+  pthread_condattr_destroy(&attr);
+
+#ifdef __linux__
+  k->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if(k->fd < 0)
+    err(EXIT_FAILURE, "cannot create ticker");
+#endif /* __linux__ */
+
+  wheel_init(&k->wheel, tick, now_us());
+}
+
+void ticker_arm(struct ticker *k, struct wheel_timer *t, unsigned long delay)
+{
+  pthread_mutex_lock(&k->lock);
+  {
+    unsigned long deadline = now_us() + delay;
+
+    wheel_arm(&k->wheel, t, deadline);
+
+    /* only reprogram when the new deadline is earlier */
+    if(!k->armed || deadline < k->armed)
+      program(k);
+  }
+  pthread_mutex_unlock(&k->lock);
+}
+
+void ticker_cancel(struct ticker *k, struct wheel_timer *t)
+{
+  pthread_mutex_lock(&k->lock);
+  {
+    unsigned long next;
+
+    wheel_cancel(&k->wheel, t);
+
+    /* reprogram when the earliest deadline went away so
+       that the thread does not wake up for nothing */
+    if(k->armed && (!wheel_next(&k->wheel, &next) || next > k->armed))
+      program(k);
+  }
+  pthread_mutex_unlock(&k->lock);
+}
+
+static void record_late(struct ticker *k, const struct wheel_timer *t, unsigned long now)
+{
+  unsigned long deadline = t->expires * k->wheel.tick;
+  unsigned long late     = now > deadline ? now - deadline : 0;
+
+  k->expiries++;
+  k->late_sum += late;
+  if(late > k->late_max)
+    k->late_max = late;
+}
+
+void * ticker_loop(void *p)
+{
+  struct ticker *k = p;
+
+  pthread_mutex_lock(&k->lock);
+  while(1) {
+    struct wheel_timer *t;
+    unsigned long now;
+
+    sleep_tick(k);
+    k->wakeups++;
+
+    now = now_us();
+    while((t = wheel_expired(&k->wheel, now))) {
+      record_late(k, t, now);
+
+      pthread_mutex_unlock(&k->lock);
+      t->expire(t->data);
+      pthread_mutex_lock(&k->lock);
+    }
+
+    program(k);
+  }
+  pthread_mutex_unlock(&k->lock);
+
+  return NULL;
+}
+
+void ticker_jitter(struct ticker *k, unsigned long *expiries,
+                   unsigned long *late_sum, unsigned long *late_max)
+{
+  pthread_mutex_lock(&k->lock);
+  *expiries = k->expiries;
+  *late_sum = k->late_sum;
+  *late_max = k->late_max;
+  pthread_mutex_unlock(&k->lock);
+}
+
+unsigned long ticker_wakeups(struct ticker *k)
+{
+  unsigned long wakeups;
+
+  pthread_mutex_lock(&k->lock);
+  wakeups = k->wakeups;
+  pthread_mutex_unlock(&k->lock);
+
+  return wakeups;
+}
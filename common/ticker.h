@@ -0,0 +1,72 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TICKER_H_
+#define _TICKER_H_
+
+#include <pthread.h>
+
+#include "wheel.h"
+
+/* Thread driving a timer wheel (see wheel.h) on the monotonic
+   clock. On Linux the thread sleeps on a single timerfd which
+   is programmed on the earliest deadline, elsewhere it waits on
+   a condition. Callbacks run in the ticker thread without the
+   ticker lock so that they may arm and cancel timers. A timer
+   canceled while its callback is running still completes. */
+struct ticker {
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  int             fd;    /* timerfd or -1 */
+  unsigned long   armed; /* programmed wakeup in us, 0 when idle */
+  struct wheel    wheel;
+
+  /* lateness of the callbacks on their deadline */
+  unsigned long expiries;
+  unsigned long late_sum;
+  unsigned long late_max;
+
+  unsigned long wakeups; /* of the thread, with or without expiry */
+};
+
+/* Prepare a ticker with a resolution of tick us. */
+void ticker_init(struct ticker *k, unsigned long tick);
+
+/* Arm a timer delay us from now or disarm it. */
+void ticker_arm(struct ticker *k, struct wheel_timer *t, unsigned long delay);
+void ticker_cancel(struct ticker *k, struct wheel_timer *t);
+
+/* Thread function, the argument is the ticker. */
+void * ticker_loop(void *k);
+
+/* Copy the lateness statistics (see struct timer_jitter). */
+void ticker_jitter(struct ticker *k, unsigned long *expiries,
+                   unsigned long *late_sum, unsigned long *late_max);
+
+/* Number of times the thread woke up. A canceled timer
+   reprograms the wakeup so that it only wakes up on a
+   deadline (a lower bound for far timers, see wheel_next()). */
+unsigned long ticker_wakeups(struct ticker *k);
+
+#endif /* _TICKER_H_ */
@@ -27,7 +27,6 @@
 #include <time.h>
 #include <assert.h>
 
-#include "common.h"
 #include "time-substract.h"
 
 #define NSEC 1000000000LLU
@@ -63,7 +62,7 @@ uint64_t substract_nsec(struct timespec *begin, struct timespec *end)
   /* Substract first and check that everything goes correctly. */
   int n = timespec_substract(&diff, end, begin);
   assert(!n);
-  UNUSED(n);
+  (void)n;
 
   diff_nsec = (uint64_t)diff.tv_sec * NSEC + (uint64_t)diff.tv_nsec;
 
@@ -0,0 +1,72 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "xatoi.h"
+#include "txopt.h"
+
+int txopt_parse(const char *s)
+{
+  int opts = 0;
+
+  while(*s) {
+    size_t n = strcspn(s, ",");
+    unsigned int tries;
+    int err;
+
+    if(n == 6 && !strncmp(s, "no-ack", n))
+      opts |= TXOPT_NOACK;
+    else if(n == 3 && !strncmp(s, "ack", n))
+      opts |= TXOPT_ACK;
+    else if(n == 5 && !strncmp(s, "g3plc", n))
+      opts |= TXOPT_G3PLC;
+    else if(n == 4 && !strncmp(s, "lora", n))
+      opts |= TXOPT_LORA;
+    else if(n > 6 && !strncmp(s, "tries=", 6)) {
+      char num[4];
+
+      if(n - 6 >= sizeof(num))
+        return -1;
+      memcpy(num, s + 6, n - 6);
+      num[n - 6] = '\0';
+      tries = xatou(num, &err);
+      if(err || !tries || tries > TXOPT_TRIES)
+        return -1;
+      opts = (opts & ~TXOPT_TRIES) | tries;
+    }
+    else
+      return -1;
+
+    s += n;
+    if(*s)
+      s++;
+  }
+
+  /* contradictory options */
+  if((opts & TXOPT_NOACK && opts & TXOPT_ACK) ||
+     (opts & TXOPT_G3PLC && opts & TXOPT_LORA))
+    return -1;
+  return opts;
+}
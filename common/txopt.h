@@ -0,0 +1,43 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXOPT_H_
+#define _TXOPT_H_
+
+/* Options of a single send message of the unix mode (--tx-options).
+   They are packed in one byte which overrides the configuration of
+   the driver for this message only, so that loss tolerant and
+   critical traffic can share a daemon. An option that does not
+   apply to the driver is ignored. */
+#define TXOPT_NOACK 0x80 /* neither wait for an ACK nor retransmit */
+#define TXOPT_ACK   0x40 /* wait for an ACK even with --no-ack (G3-PLC) */
+#define TXOPT_G3PLC 0x20 /* only send on G3-PLC (hybrid) */
+#define TXOPT_LORA  0x10 /* only send on LoRa (hybrid) */
+#define TXOPT_TRIES 0x0f /* maximum number of transmissions, 0 for the configured one */
+
+/* Parse a comma separated list of options: no-ack, ack, g3plc,
+   lora and tries=N. Return the options byte or -1 on error. */
+int txopt_parse(const char *s);
+
+#endif /* _TXOPT_H_ */
@@ -0,0 +1,454 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _POSIX_C_SOURCE 200112L
+#endif /* __linux__ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+
+#include "safe-call.h"
+#include "txq.h"
+
+/* Each class is a bounded ring where every cell carries a sequence
+   number. A cell at position pos is free when its sequence is pos,
+   it holds an item once its sequence is pos + 1 and it is free
+   again for the next round (pos + depth) after it was dequeued.
+   Producers claim a position by advancing the head with a CAS,
+   fill the cell and publish it with its sequence. */
+#define IDX(q, i)     ((i) & ((q)->depth - 1))
+#define ITEM(q, f, i) ((f)->items + IDX(q, i) * (q)->item_size)
+#define SEQ(q, f, i)  __atomic_load_n(&(f)->seqs[IDX(q, i)], __ATOMIC_ACQUIRE)
+#define READY(q, f)   (SEQ(q, f, (f)->tail) == (f)->tail + 1)
+
+/* counters read by txq_stats() from other threads */
+#define STAT_GET(v)    __atomic_load_n(&(v), __ATOMIC_RELAXED)
+#define STAT_SET(v, x) __atomic_store_n(&(v), (x), __ATOMIC_RELAXED)
+
+/* Items taken from the FIFO of a class with fair queueing. The
+   items of each flow are linked in their queuing order. The flows
+   with items are in the round, the first one is served until its
+   deficit does not cover its next item, then it moves to the end
+   of the round with a new quantum. */
+struct txq_drr {
+  unsigned char *items;
+  unsigned long *stamps;
+  int           *next;  /* next item of the flow or of the free list */
+  int            free;
+  unsigned int   count;
+
+  struct txq_flow {
+    int           head;
+    int           tail;
+    unsigned long deficit;
+    int           served; /* got its quantum for this turn */
+  } flows[TXQ_FLOWS];
+
+  unsigned int round[TXQ_FLOWS];
+  unsigned int first;
+  unsigned int active;
+};
+
+#define DRR_ITEM(q, d, i) ((d)->items + (i) * (q)->item_size)
+
+static unsigned long now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void txq_init(struct txq *q, enum txq_policy policy, const unsigned int *weights,
+              unsigned int depth, size_t item_size)
+{
+  static const unsigned int default_weights[TXQ_CLASSES] = TXQ_DEFAULT_WEIGHTS;
+  pthread_condattr_t attr;
+  unsigned int j;
+  int i;
+
+  if(!depth || (depth & (depth - 1)))
+    errx(EXIT_FAILURE, "transmit queue depth must be a power of two");
+
+  if(!weights)
+    weights = default_weights;
+
+  *q = (struct txq){ .policy    = policy,
+                     .item_size = item_size,
+                     .depth     = depth };
+
+  for(i = 0 ; i < TXQ_CLASSES ; i++) {
+    if(!weights[i])
+      errx(EXIT_FAILURE, "invalid transmit queue weight");
+
+    q->fifos[i] = (struct txq_fifo){ .items  = xmalloc(depth * item_size),
+                                     .stamps = xmalloc(depth * sizeof(unsigned long)),
+                                     .seqs   = xmalloc(depth * sizeof(unsigned long)),
+                                     .weight = weights[i],
+                                     .credit = weights[i] };
+
+    for(j = 0 ; j < depth ; j++)
+      q->fifos[i].seqs[j] = j;
+  }
+
+  /* timed waits use the monotonic clock */
+  pthread_condattr_init(&attr);
+  if(pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) ||
+     pthread_cond_init(&q->ready, &attr))
+    errx(EXIT_FAILURE, "cannot initialize transmit queue");
+  pthread_condattr_destroy(&attr);
+
+  pthread_mutex_init(&q->lock, NULL);
+}
+
+void txq_fair(struct txq *q, unsigned int (*flow)(const void *item),
+              unsigned int (*cost)(const void *item), unsigned int quantum)
+{
+  unsigned int i, j;
+
+  q->flow    = flow;
+  q->cost    = cost;
+  q->quantum = quantum ? quantum : TXQ_DEFAULT_QUANTUM;
+
+  for(i = 0 ; i < TXQ_CLASSES ; i++) {
+    struct txq_drr *d = xmalloc(sizeof(struct txq_drr));
+
+    *d = (struct txq_drr){ .items  = xmalloc(q->depth * q->item_size),
+                           .stamps = xmalloc(q->depth * sizeof(unsigned long)),
+                           .next   = xmalloc(q->depth * sizeof(int)),
+                           .free   = 0 };
+
+    for(j = 0 ; j < q->depth ; j++)
+      d->next[j] = j + 1 < q->depth ? (int)(j + 1) : -1;
+    for(j = 0 ; j < TXQ_FLOWS ; j++)
+      d->flows[j] = (struct txq_flow){ .head = -1, .tail = -1 };
+
+    q->fifos[i].drr = d;
+  }
+}
+
+/* Slot of a flow (Fibonacci hashing, the
+   addresses of a PAN are often contiguous). */
+static unsigned int flow_slot(unsigned int flow)
+{
+  return (uint32_t)(flow * 2654435769u) >> (32 - TXQ_FLOW_BITS);
+}
+
+void txq_feedback(struct txq *q, unsigned int flow, int delivered)
+{
+  uint8_t *penalty = &q->penalty[flow_slot(flow)];
+  uint8_t p;
+
+  if(!q->flow)
+    return;
+
+  p = __atomic_load_n(penalty, __ATOMIC_RELAXED);
+  if(delivered)
+    p = 0;
+  else if(p < TXQ_MAX_PENALTY)
+    p++;
+  __atomic_store_n(penalty, p, __ATOMIC_RELAXED);
+}
+
+/* Wake the transmitter up if it is waiting for an item. The fence
+   pairs with the one in wait_class() so that either the producer
+   sees the transmitter waiting or the transmitter sees the item. */
+static void wakeup(struct txq *q)
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  if(!__atomic_load_n(&q->waiting, __ATOMIC_RELAXED))
+    return;
+
+  pthread_mutex_lock(&q->lock);
+  pthread_cond_signal(&q->ready);
+  pthread_mutex_unlock(&q->lock);
+}
+
+int txq_push(struct txq *q, enum txq_class class, const void *item,
+             unsigned long *token)
+{
+  struct txq_fifo *f = &q->fifos[class];
+  unsigned long pos = __atomic_load_n(&f->head, __ATOMIC_RELAXED);
+  long diff;
+
+  while(1) {
+    diff = (long)(SEQ(q, f, pos) - pos);
+
+    if(!diff) {
+      if(__atomic_compare_exchange_n(&f->head, &pos, pos + 1, 1,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+      /* pos was reloaded by the failed CAS */
+    }
+    else if(diff < 0) {
+      /* the cell is still used by the previous round */
+      __atomic_fetch_add(&f->stats.drops, 1, __ATOMIC_RELAXED);
+      return -1;
+    }
+    else
+      pos = __atomic_load_n(&f->head, __ATOMIC_RELAXED);
+  }
+
+  memcpy(ITEM(q, f, pos), item, q->item_size);
+  f->stamps[IDX(q, pos)] = now();
+  __atomic_store_n(&f->seqs[IDX(q, pos)], pos + 1, __ATOMIC_RELEASE);
+
+  wakeup(q);
+
+  if(token)
+    *token = pos;
+  return 0;
+}
+
+int txq_done(struct txq *q, enum txq_class class, unsigned long token)
+{
+  return (long)(__atomic_load_n(&q->fifos[class].done, __ATOMIC_ACQUIRE) - token) > 0;
+}
+
+void txq_complete(struct txq *q, enum txq_class class, unsigned int count)
+{
+  __atomic_fetch_add(&q->fifos[class].done, count, __ATOMIC_RELEASE);
+}
+
+/* Take the ready items of a class out of its FIFO while there is room
+   in its flows, so that the producers may queue more items meanwhile. */
+static void drr_fill(struct txq *q, struct txq_fifo *f)
+{
+  struct txq_drr *d = f->drr;
+  struct txq_flow *w;
+  unsigned int slot;
+  int i;
+
+  while(d->free >= 0 && READY(q, f)) {
+    i       = d->free;
+    d->free = d->next[i];
+
+    memcpy(DRR_ITEM(q, d, i), ITEM(q, f, f->tail), q->item_size);
+    d->stamps[i] = f->stamps[IDX(q, f->tail)];
+    d->next[i]   = -1;
+    __atomic_store_n(&f->seqs[IDX(q, f->tail)], f->tail + q->depth, __ATOMIC_RELEASE);
+    f->tail++;
+    d->count++;
+
+    slot = flow_slot(q->flow(DRR_ITEM(q, d, i)));
+    w    = &d->flows[slot];
+    if(w->tail >= 0)
+      d->next[w->tail] = i;
+    else {
+      w->head = i;
+      d->round[(d->first + d->active++) % TXQ_FLOWS] = slot;
+    }
+    w->tail = i;
+  }
+}
+
+/* Whether a class has an item ready. */
+static int class_ready(struct txq *q, struct txq_fifo *f)
+{
+  if(!f->drr)
+    return READY(q, f);
+
+  drr_fill(q, f);
+  return f->drr->count != 0;
+}
+
+/* Dequeue the next item of the round. A flow gets its quantum, reduced
+   by its penalty, once per turn. The round always ends since every
+   turn adds to the deficit of the flows that cannot send yet. */
+static int drr_next(struct txq *q, struct txq_drr *d)
+{
+  unsigned int slot, quantum;
+  struct txq_flow *w;
+  int i;
+
+  while(1) {
+    slot = d->round[d->first];
+    w    = &d->flows[slot];
+
+    if(!w->served) {
+      quantum     = q->quantum >> __atomic_load_n(&q->penalty[slot], __ATOMIC_RELAXED);
+      w->deficit += quantum ? quantum : 1;
+      w->served   = 1;
+    }
+
+    i = w->head;
+    if(q->cost(DRR_ITEM(q, d, i)) <= w->deficit)
+      break;
+
+    /* end of its turn */
+    w->served = 0;
+    d->round[(d->first + d->active) % TXQ_FLOWS] = slot;
+    d->first  = (d->first + 1) % TXQ_FLOWS;
+  }
+
+  w->deficit -= q->cost(DRR_ITEM(q, d, i));
+  w->head     = d->next[i];
+
+  /* a flow leaves the round once it is empty */
+  if(w->head < 0) {
+    w->tail    = -1;
+    w->deficit = 0;
+    w->served  = 0;
+    d->first   = (d->first + 1) % TXQ_FLOWS;
+    d->active--;
+  }
+
+  return i;
+}
+
+/* Select the next class to serve. With the weighted policy each
+   backlogged class may send up to its weight in items per round.
+   The round restarts when all the backlogged classes used their
+   credit. */
+static int next_class(struct txq *q)
+{
+  int i, round;
+
+  for(round = 0 ; round < 2 ; round++) {
+    for(i = 0 ; i < TXQ_CLASSES ; i++) {
+      struct txq_fifo *f = &q->fifos[i];
+
+      if(class_ready(q, f) && (q->policy == TXQ_STRICT || f->credit))
+        return i;
+    }
+
+    if(q->policy == TXQ_STRICT)
+      break;
+
+    for(i = 0 ; i < TXQ_CLASSES ; i++)
+      q->fifos[i].credit = q->fifos[i].weight;
+  }
+
+  return -1;
+}
+
+/* Wait until a class is ready or until the deadline when not NULL.
+   Return the class or -1 on timeout. */
+static int wait_class(struct txq *q, const struct timespec *ts)
+{
+  int class;
+
+  pthread_mutex_lock(&q->lock);
+  {
+    __atomic_store_n(&q->waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    while((class = next_class(q)) < 0) {
+      if(!ts)
+        pthread_cond_wait(&q->ready, &q->lock);
+      else if(pthread_cond_timedwait(&q->ready, &q->lock, ts)) {
+        class = next_class(q);
+        break;
+      }
+    }
+
+    __atomic_store_n(&q->waiting, 0, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&q->lock);
+
+  return class;
+}
+
+/* Dequeue an item of the selected class and free its cell. */
+static void dequeue(struct txq *q, int class, void *item)
+{
+  struct txq_fifo *f = &q->fifos[class];
+  struct txq_drr *d = f->drr;
+  unsigned long latency;
+  int i;
+
+  if(d) {
+    i = drr_next(q, d);
+    memcpy(item, DRR_ITEM(q, d, i), q->item_size);
+    latency    = now() - d->stamps[i];
+    d->next[i] = d->free;
+    d->free    = i;
+    d->count--;
+  }
+  else {
+    memcpy(item, ITEM(q, f, f->tail), q->item_size);
+    latency = now() - f->stamps[IDX(q, f->tail)];
+    __atomic_store_n(&f->seqs[IDX(q, f->tail)], f->tail + q->depth, __ATOMIC_RELEASE);
+    f->tail++;
+  }
+
+  if(f->credit)
+    f->credit--;
+
+  STAT_SET(f->stats.count, f->stats.count + 1);
+  STAT_SET(f->stats.total, f->stats.total + latency);
+  if(latency > f->stats.max)
+    STAT_SET(f->stats.max, latency);
+}
+
+int txq_pop(struct txq *q, void *item, int wait)
+{
+  int class = next_class(q);
+
+  if(class < 0 && wait)
+    class = wait_class(q, NULL);
+
+  if(class >= 0)
+    dequeue(q, class, item);
+
+  return class;
+}
+
+int txq_timedpop(struct txq *q, void *item, unsigned int timeout)
+{
+  struct timespec ts;
+  int class = next_class(q);
+
+  if(class < 0) {
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec  += timeout / 1000000;
+    ts.tv_nsec += (timeout % 1000000) * 1000;
+    if(ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+
+    class = wait_class(q, &ts);
+  }
+
+  if(class >= 0)
+    dequeue(q, class, item);
+
+  return class;
+}
+
+void txq_stats(struct txq *q, enum txq_class class, struct txq_stats *stats)
+{
+  const struct txq_stats *s = &q->fifos[class].stats;
+
+  *stats = (struct txq_stats){ .count = STAT_GET(s->count),
+                               .drops = STAT_GET(s->drops),
+                               .total = STAT_GET(s->total),
+                               .max   = STAT_GET(s->max) };
+}
@@ -0,0 +1,160 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TXQ_H_
+#define _TXQ_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Priority classes of transmitted frames,
+   from the most to the least urgent. */
+enum txq_class {
+  TXQ_ALARM,
+  TXQ_CONTROL,
+  TXQ_BULK,
+  TXQ_CLASSES
+};
+
+/* Order in which the classes are drained. */
+enum txq_policy {
+  TXQ_STRICT,  /* a class is only served when all higher classes are empty */
+  TXQ_WEIGHTED /* backlogged classes are served in proportion to their weight */
+};
+
+/* Per-class counters. The latency is the time spent in the
+   queue, that is until the frame is handed to the transmitter. */
+struct txq_stats {
+  unsigned long count; /* frames dequeued */
+  unsigned long drops; /* frames dropped because the class was full */
+  unsigned long total; /* accumulated latency in us */
+  unsigned long max;   /* maximum latency in us */
+};
+
+/* Fair queueing of the items of a class among their flows (see
+   txq_fair()). Flows are hashed in TXQ_FLOWS slots, the flows that
+   share a slot share its turn. A failing flow has its quantum
+   halved up to TXQ_MAX_PENALTY times (see txq_feedback()). */
+#define TXQ_FLOW_BITS       6
+#define TXQ_FLOWS           (1 << TXQ_FLOW_BITS)
+#define TXQ_DEFAULT_QUANTUM 1024
+#define TXQ_MAX_PENALTY     3
+
+struct txq_drr;
+
+/* Transmit scheduler. Each class is a bounded FIFO of fixed size
+   items. Any number of threads may queue frames without locking
+   while a single transmitter thread dequeues them in the order given
+   by the policy. The lock is only taken to put the transmitter to
+   sleep when the queue is empty and to wake it up. */
+struct txq {
+  pthread_mutex_t lock;
+  pthread_cond_t  ready;
+  int             waiting; /* the transmitter is about to sleep */
+
+  enum txq_policy policy;
+  size_t          item_size;
+  unsigned int    depth; /* number of items per class */
+
+  struct txq_fifo {
+    unsigned char *items;
+    unsigned long *stamps; /* queuing time in us */
+    unsigned long *seqs;   /* sequence of each cell, see txq_push() */
+    unsigned long  head;   /* next position claimed by producers */
+    unsigned long  tail;   /* next position dequeued */
+    unsigned long  done;   /* items completed by the transmitter */
+    unsigned int   weight;
+    unsigned int   credit; /* items left in the current round (weighted) */
+    struct txq_drr *drr;   /* items taken from the FIFO (fair queueing) */
+    struct txq_stats stats;
+  } fifos[TXQ_CLASSES];
+
+  /* fair queueing (see txq_fair()) */
+  unsigned int (*flow)(const void *item);
+  unsigned int (*cost)(const void *item);
+  unsigned int quantum;
+  uint8_t      penalty[TXQ_FLOWS];
+};
+
+/* Default weights, alarm frames are served
+   four times as often as bulk frames. */
+#define TXQ_DEFAULT_WEIGHTS { 4, 2, 1 }
+
+/* Allocate a scheduler of depth items of item_size bytes per class.
+   The depth must be a power of two.
+   The weights (one per class and not null) are only used by the
+   weighted policy and may be NULL for the default weights. */
+void txq_init(struct txq *q, enum txq_policy policy, const unsigned int *weights,
+              unsigned int depth, size_t item_size);
+
+/* Copy an item to the given class without blocking. Return 0 on
+   success or -1 when the class is full, in which case the item is
+   dropped. On success the completion token of the item is stored
+   in token when not NULL. */
+int txq_push(struct txq *q, enum txq_class class, const void *item,
+             unsigned long *token);
+
+/* Serve the flows of each class by deficit round-robin instead of
+   in FIFO order, so that the backlog of one flow does not hold the
+   others back. The flow of an item (e.g. its destination) and its
+   cost (e.g. its size in bytes) are given by these functions. In
+   each round a backlogged flow may dequeue items up to quantum
+   (TXQ_DEFAULT_QUANTUM when 0) in cost, its consecutive items can
+   thus still be sent together. The transmitter takes up to depth
+   items of each class out of its FIFO to sort them, so a class may
+   then hold up to twice its depth. This must be called before the
+   first item is dequeued. */
+void txq_fair(struct txq *q, unsigned int (*flow)(const void *item),
+              unsigned int (*cost)(const void *item), unsigned int quantum);
+
+/* Report whether the items of a flow were delivered (see txq_fair()).
+   Each failure halves the quantum of the flow in the next rounds and
+   a success restores it. This does nothing without fair queueing and
+   may be called from any thread. */
+void txq_feedback(struct txq *q, unsigned int flow, int delivered);
+
+/* Check whether the item queued with this token was completed.
+   With fair queueing the items are completed out of order, this
+   then only tells that as many items were completed. */
+int txq_done(struct txq *q, enum txq_class class, unsigned long token);
+
+/* Mark the next count items dequeued from this class as completed.
+   The transmitter calls this once the items were sent, items of the
+   same class are completed in the order they were dequeued. */
+void txq_complete(struct txq *q, enum txq_class class, unsigned int count);
+
+/* Dequeue the next item into the item buffer and return its
+   class. When no item is ready this function either waits for
+   one or returns -1 without waiting. Only one thread may
+   dequeue items. */
+int txq_pop(struct txq *q, void *item, int wait);
+
+/* Same as txq_pop() but wait at most timeout us for an item. */
+int txq_timedpop(struct txq *q, void *item, unsigned int timeout);
+
+/* Copy the counters of a class. */
+void txq_stats(struct txq *q, enum txq_class class, struct txq_stats *stats);
+
+#endif /* _TXQ_H_ */
@@ -0,0 +1,152 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _POSIX_C_SOURCE 200112L
+#endif /* __linux__ */
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <err.h>
+
+#include "string-utils.h"
+#include "safe-call.h"
+#include "uclient.h"
+
+static void set_path(struct sockaddr_un *addr, const char *path)
+{
+  *addr = (struct sockaddr_un){ .sun_family = AF_UNIX };
+  xstrcpy(addr->sun_path, path, sizeof(addr->sun_path));
+}
+
+void uclient_open(struct uclient *c, const char *path)
+{
+  char local[sizeof(c->local.sun_path)];
+  const char *tmp = getenv("TMPDIR");
+
+  snprintf(local, sizeof(local), "%s/weremac-client.%ld.sock",
+           tmp ? tmp : "/tmp", (long)getpid());
+
+  set_path(&c->driver, path);
+  set_path(&c->local, local);
+
+  c->sd = xsocket(AF_UNIX, SOCK_DGRAM, 0);
+  unlink(c->local.sun_path);
+  xbind(c->sd, (struct sockaddr *)&c->local, SUN_LEN(&c->local));
+}
+
+void uclient_close(struct uclient *c)
+{
+  close(c->sd);
+  unlink(c->local.sun_path);
+}
+
+static void send_to(struct uclient *c, const struct sockaddr_un *to,
+                    const void *msg, size_t size)
+{
+  if(sendto(c->sd, msg, size, 0, (const struct sockaddr *)to, sizeof(*to)) < 0)
+    err(EXIT_FAILURE, "cannot send to %s", to->sun_path);
+}
+
+/* Wait for a datagram up to timeout ms. */
+static ssize_t recv_timeout(struct uclient *c, void *buf, size_t size,
+                            unsigned int timeout)
+{
+  struct pollfd pfd = { .fd = c->sd, .events = POLLIN };
+  int n;
+
+  do
+    n = poll(&pfd, 1, timeout);
+  while(n < 0 && errno == EINTR);
+
+  if(n < 0)
+    err(EXIT_FAILURE, "poll");
+  if(!n)
+    return -1;
+
+  return recv(c->sd, buf, size, 0);
+}
+
+void uclient_send(struct uclient *c, int class, int opts, int id, uint16_t dst,
+                  const void *payload, size_t size)
+{
+  /* send message format:
+     [class (u8)][options (u8)][id (u16)][dst (u16)][payload] */
+  unsigned char *msg = xmalloc(size + sizeof(uint8_t) * 2 + sizeof(uint16_t) * 2);
+  unsigned char *b = msg;
+
+  if(class >= 0) {
+    *(uint8_t *)b = class; b += sizeof(uint8_t);
+  }
+  if(opts >= 0) {
+    *(uint8_t *)b = opts; b += sizeof(uint8_t);
+  }
+  if(id >= 0) {
+    *(uint16_t *)b = id; b += sizeof(uint16_t);
+  }
+  *(uint16_t *)b = dst; b += sizeof(uint16_t);
+  memcpy(b, payload, size);
+
+  send_to(c, &c->driver, msg, b - msg + size);
+  free(msg);
+}
+
+int uclient_status(struct uclient *c, uint16_t id, unsigned int timeout,
+                   int *status, unsigned int *tx)
+{
+  /* status message format:
+     [id (u16)][status (u8)][tx count (u8)] */
+  unsigned char msg[sizeof(uint16_t) + sizeof(uint8_t) * 2];
+  ssize_t n;
+
+  while((n = recv_timeout(c, msg, sizeof(msg), timeout)) >= 0) {
+    if(n != sizeof(msg) || *(uint16_t *)msg != id)
+      continue;
+
+    *status = msg[2];
+    *tx     = msg[3];
+    return 0;
+  }
+
+  return -1;
+}
+
+ssize_t uclient_query(struct uclient *c, const char *path,
+                      const void *msg, size_t size,
+                      void *reply, size_t reply_size, unsigned int timeout)
+{
+  struct sockaddr_un to;
+
+  set_path(&to, path);
+  send_to(c, &to, msg, size);
+
+  return recv_timeout(c, reply, reply_size, timeout);
+}
@@ -0,0 +1,67 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _UCLIENT_H_
+#define _UCLIENT_H_
+
+#include <sys/types.h>
+#include <sys/un.h>
+#include <stdint.h>
+
+/* Client side of the sockets of the unix mode (see unix-mode.c).
+   The driver runs as a long lived daemon which owns the modem and
+   clients only submit send messages and queries to it. The client
+   socket is bound to a temporary path so that the driver can send
+   status and query replies back to it. */
+struct uclient {
+  int sd;
+  struct sockaddr_un local;
+  struct sockaddr_un driver;
+};
+
+/* Open a client for the driver socket at path. Exit on error. */
+void uclient_open(struct uclient *c, const char *path);
+
+/* Close the client and remove its socket. */
+void uclient_close(struct uclient *c);
+
+/* Submit a send message. The class (see txq_class) is only prefixed
+   when not negative (--priority) and so are the options (see txopt.h,
+   --tx-options) and the ID (--tx-status). Exit on error. */
+void uclient_send(struct uclient *c, int class, int opts, int id, uint16_t dst,
+                  const void *payload, size_t size);
+
+/* Wait up to timeout ms for the status of the message with this ID.
+   Return 0 with the status and number of transmissions or -1 on
+   timeout. Replies for other IDs are ignored. */
+int uclient_status(struct uclient *c, uint16_t id, unsigned int timeout,
+                   int *status, unsigned int *tx);
+
+/* Send a query to the socket at path and wait up to timeout ms
+   for the reply. Return the size of the reply or -1 on timeout. */
+ssize_t uclient_query(struct uclient *c, const char *path,
+                      const void *msg, size_t size,
+                      void *reply, size_t reply_size, unsigned int timeout);
+
+#endif /* _UCLIENT_H_ */
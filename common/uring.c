@@ -0,0 +1,312 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _GNU_SOURCE /* syscall() */
+# include <linux/io_uring.h>
+# include <sys/syscall.h>
+# include <sys/mman.h>
+# include <unistd.h>
+#endif /* __linux__ */
+
+#include <string.h>
+#include <errno.h>
+
+#include "uring.h"
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+static int sys_enter(struct uring *u, unsigned int submit,
+                     unsigned int wait, unsigned int flags)
+{
+  __atomic_add_fetch(&u->enters, 1, __ATOMIC_RELAXED);
+  return syscall(__NR_io_uring_enter, u->fd, submit, wait, flags, NULL, 0);
+}
+
+int uring_init(struct uring *u, unsigned int entries)
+{
+  struct io_uring_params p;
+  unsigned char *sq, *cq;
+
+  memset(u, 0, sizeof(*u));
+  memset(&p, 0, sizeof(p));
+
+  u->fd = syscall(__NR_io_uring_setup, entries, &p);
+  if(u->fd < 0)
+    return -1;
+
+  u->sq_size   = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  u->cq_size   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  /* both rings may share a single mapping */
+  if(p.features & IORING_FEAT_SINGLE_MMAP) {
+    if(u->cq_size > u->sq_size)
+      u->sq_size = u->cq_size;
+    u->cq_size = 0;
+  }
+
+  u->sq_ring = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+  if(u->sq_ring == MAP_FAILED)
+    goto ERR_SQ;
+
+  u->cq_ring = u->sq_ring;
+  if(u->cq_size) {
+    u->cq_ring = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    if(u->cq_ring == MAP_FAILED)
+      goto ERR_CQ;
+  }
+
+  u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+  if(u->sqes == MAP_FAILED)
+    goto ERR_SQES;
+
+  sq = u->sq_ring;
+  u->sq_head    = (unsigned int *)(sq + p.sq_off.head);
+  u->sq_tail    = (unsigned int *)(sq + p.sq_off.tail);
+  u->sq_array   = (unsigned int *)(sq + p.sq_off.array);
+  u->sq_mask    = *(unsigned int *)(sq + p.sq_off.ring_mask);
+  u->sq_entries = p.sq_entries;
+
+  cq = u->cq_ring;
+  u->cq_head = (unsigned int *)(cq + p.cq_off.head);
+  u->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+  u->cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+  u->cqes    = cq + p.cq_off.cqes;
+
+  return 0;
+
+ERR_SQES:
+  if(u->cq_size)
+    munmap(u->cq_ring, u->cq_size);
+ERR_CQ:
+  munmap(u->sq_ring, u->sq_size);
+ERR_SQ:
+  close(u->fd);
+  return -1;
+}
+
+void uring_free(struct uring *u)
+{
+  munmap(u->sqes, u->sqes_size);
+  if(u->cq_size)
+    munmap(u->cq_ring, u->cq_size);
+  munmap(u->sq_ring, u->sq_size);
+  close(u->fd);
+}
+
+int uring_register_buffers(struct uring *u, const struct iovec *iov, unsigned int count)
+{
+  return syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, iov, count) < 0 ? -1 : 0;
+}
+
+/* Return the next free submission entry or NULL when the queue is full. */
+static struct io_uring_sqe * get_sqe(struct uring *u)
+{
+  unsigned int tail = *u->sq_tail + u->sq_pending;
+  struct io_uring_sqe *sqe;
+
+  if(tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries)
+    return NULL;
+
+  sqe = (struct io_uring_sqe *)u->sqes + (tail & u->sq_mask);
+  memset(sqe, 0, sizeof(*sqe));
+  u->sq_array[tail & u->sq_mask] = tail & u->sq_mask;
+  u->sq_pending++;
+
+  return sqe;
+}
+
+int uring_read(struct uring *u, int fd, void *buf, unsigned int size,
+               int index, uint64_t user)
+{
+  struct io_uring_sqe *sqe = get_sqe(u);
+
+  if(!sqe) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  sqe->opcode    = index < 0 ? IORING_OP_READ : IORING_OP_READ_FIXED;
+  sqe->fd        = fd;
+  sqe->addr      = (uintptr_t)buf;
+  sqe->len       = size;
+  sqe->off       = -1; /* current position (streams) */
+  sqe->buf_index = index < 0 ? 0 : index;
+  sqe->user_data = user;
+
+  return 0;
+}
+
+int uring_cancel(struct uring *u, uint64_t user)
+{
+  struct io_uring_sqe *sqe = get_sqe(u);
+
+  if(!sqe) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+  sqe->fd        = -1;
+  sqe->addr      = user;
+  sqe->user_data = URING_CANCEL;
+
+  return 0;
+}
+
+unsigned int uring_flush(struct uring *u)
+{
+  unsigned int n = u->sq_pending;
+
+  __atomic_store_n(u->sq_tail, *u->sq_tail + n, __ATOMIC_RELEASE);
+  u->sq_pending = 0;
+
+  return n;
+}
+
+int uring_submit(struct uring *u)
+{
+  unsigned int n = uring_flush(u);
+
+  if(!n)
+    return 0;
+  return sys_enter(u, n, 0, 0) < 0 ? -1 : 0;
+}
+
+int uring_peek(struct uring *u, struct uring_cqe *cqe)
+{
+  unsigned int head = *u->cq_head;
+  struct io_uring_cqe *c;
+
+  if(head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+    return 0;
+
+  c = (struct io_uring_cqe *)u->cqes + (head & u->cq_mask);
+  *cqe = (struct uring_cqe){ .user = c->user_data, .res = c->res };
+  __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+
+  return 1;
+}
+
+int uring_wait(struct uring *u, unsigned int submit, struct uring_cqe *cqe)
+{
+  if(uring_peek(u, cqe)) {
+    /* still submit the flushed requests */
+    if(submit && sys_enter(u, submit, 0, 0) < 0)
+      return -1;
+    return 0;
+  }
+
+  do {
+    if(sys_enter(u, submit, 1, IORING_ENTER_GETEVENTS) < 0)
+      return -1;
+    submit = 0;
+  } while(!uring_peek(u, cqe));
+
+  return 0;
+}
+#else
+int uring_init(struct uring *u, unsigned int entries)
+{
+  (void)u;
+  (void)entries;
+
+  errno = ENOSYS;
+  return -1;
+}
+
+void uring_free(struct uring *u)
+{
+  (void)u;
+}
+
+int uring_register_buffers(struct uring *u, const struct iovec *iov, unsigned int count)
+{
+  (void)u;
+  (void)iov;
+  (void)count;
+
+  errno = ENOSYS;
+  return -1;
+}
+
+int uring_read(struct uring *u, int fd, void *buf, unsigned int size,
+               int index, uint64_t user)
+{
+  (void)u;
+  (void)fd;
+  (void)buf;
+  (void)size;
+  (void)index;
+  (void)user;
+
+  errno = ENOSYS;
+  return -1;
+}
+
+int uring_cancel(struct uring *u, uint64_t user)
+{
+  (void)u;
+  (void)user;
+
+  errno = ENOSYS;
+  return -1;
+}
+
+unsigned int uring_flush(struct uring *u)
+{
+  (void)u;
+
+  return 0;
+}
+
+int uring_submit(struct uring *u)
+{
+  (void)u;
+
+  errno = ENOSYS;
+  return -1;
+}
+
+int uring_peek(struct uring *u, struct uring_cqe *cqe)
+{
+  (void)u;
+  (void)cqe;
+
+  return 0;
+}
+
+int uring_wait(struct uring *u, unsigned int submit, struct uring_cqe *cqe)
+{
+  (void)u;
+  (void)submit;
+  (void)cqe;
+
+  errno = ENOSYS;
+  return -1;
+}
+#endif /* __linux__ && __NR_io_uring_setup */
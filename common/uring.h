@@ -0,0 +1,116 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <sys/uio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Minimal io_uring instance on top of the raw system calls so
+   that we do not depend on liburing. The requests are queued
+   and flushed by any thread as long as the caller serializes
+   them, while a single thread reaps the completions. On systems
+   without io_uring uring_init() fails with ENOSYS and the caller
+   falls back to another backend. */
+struct uring {
+  int fd;
+
+  /* submission queue */
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_array;
+  unsigned int  sq_mask;
+  unsigned int  sq_entries;
+  unsigned int  sq_pending; /* queued but not submitted yet */
+  void         *sqes;
+
+  /* completion queue */
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int  cq_mask;
+  void         *cqes;
+
+  /* mapped rings */
+  void  *sq_ring;
+  void  *cq_ring;
+  size_t sq_size;
+  size_t cq_size;
+  size_t sqes_size;
+
+  unsigned long enters; /* io_uring_enter() calls */
+};
+
+/* A completed request. */
+struct uring_cqe {
+  uint64_t user; /* user data given on submission */
+  int      res;  /* result of the request or -errno */
+};
+
+/* Setup an instance with at least this number of submission
+   entries. Return 0 on success or -1 on error with errno set. */
+int uring_init(struct uring *u, unsigned int entries);
+void uring_free(struct uring *u);
+
+/* Register buffers for the fixed reads (see uring_read()).
+   Return 0 on success or -1 on error with errno set. */
+int uring_register_buffers(struct uring *u, const struct iovec *iov, unsigned int count);
+
+/* Queue a read into buf. With a non-negative index the buffer
+   must lie in the registered buffer of this index. The request
+   is only submitted with the next uring_submit() or uring_wait().
+   Return 0 on success or -1 when the submission queue is full. */
+int uring_read(struct uring *u, int fd, void *buf, unsigned int size,
+               int index, uint64_t user);
+
+/* User data of the completion of a cancellation. */
+#define URING_CANCEL UINT64_MAX
+
+/* Queue the cancellation of the requests with this user data.
+   Each canceled request completes with -ECANCELED unless it
+   completed in between. */
+int uring_cancel(struct uring *u, uint64_t user);
+
+/* Publish the queued requests to the kernel and return their
+   number. They are submitted by the next system call on the
+   instance (see uring_submit() and uring_wait()). */
+unsigned int uring_flush(struct uring *u);
+
+/* Flush and submit the queued requests.
+   Return 0 on success or -1 on error with errno set. */
+int uring_submit(struct uring *u);
+
+/* Pop a completion without any system call.
+   Return 1 when a completion was copied in cqe, 0 otherwise. */
+int uring_peek(struct uring *u, struct uring_cqe *cqe);
+
+/* Submit this number of flushed requests and wait for a
+   completion when none is available yet. This does not touch
+   the queued requests so that other threads may queue requests
+   meanwhile. Return 0 with the completion in cqe or -1 on error
+   with errno set (EINTR when interrupted). */
+int uring_wait(struct uring *u, unsigned int submit, struct uring_cqe *cqe);
+
+#endif /* _URING_H_ */
@@ -0,0 +1,187 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+
+#include "wheel.h"
+
+/* Range in ticks of the timers kept at a level. */
+#define LEVEL_RANGE(level) (1UL << (WHEEL_BITS * ((level) + 1)))
+#define LEVEL_INDEX(ticks, level) (((ticks) >> (WHEEL_BITS * (level))) & WHEEL_MASK)
+
+static void link_timer(struct wheel_timer **head, struct wheel_timer *t)
+{
+  t->next  = *head;
+  t->pprev = head;
+  if(*head)
+    (*head)->pprev = &t->next;
+  *head = t;
+}
+
+static void unlink_timer(struct wheel_timer *t)
+{
+  *t->pprev = t->next;
+  if(t->next)
+    t->next->pprev = t->pprev;
+  t->next  = NULL;
+  t->pprev = NULL;
+}
+
+static void place(struct wheel *w, struct wheel_timer *t)
+{
+  unsigned long delta = t->expires - w->now;
+  unsigned long ticks = t->expires;
+  int level = 0;
+
+  /* late timers go in the slot processed next */
+  if((long)delta < 0) {
+    delta = 0;
+    ticks = w->now;
+  }
+
+  while(level < WHEEL_LEVELS - 1 && delta >= LEVEL_RANGE(level))
+    level++;
+
+  /* park out of range timers in the last level,
+     they are placed again when this slot cascades */
+  if(delta >= LEVEL_RANGE(WHEEL_LEVELS - 1))
+    ticks = w->now + LEVEL_RANGE(WHEEL_LEVELS - 1) - 1;
+
+  link_timer(&w->slots[level][LEVEL_INDEX(ticks, level)], t);
+  t->level = level;
+  w->count[level]++;
+}
+
+/* Move the timers of a slot down to the lower levels. */
+static void cascade(struct wheel *w, int level, unsigned int index)
+{
+  struct wheel_timer *t = w->slots[level][index];
+
+  w->slots[level][index] = NULL;
+  while(t) {
+    struct wheel_timer *next = t->next;
+
+    w->count[level]--;
+    place(w, t);
+    t = next;
+  }
+}
+
+void wheel_init(struct wheel *w, unsigned long tick, unsigned long now)
+{
+  *w = (struct wheel){ .tick = tick ? tick : 1 };
+  w->now = now / w->tick;
+}
+
+void wheel_timer_init(struct wheel_timer *t, void (*expire)(void *data), void *data)
+{
+  *t = (struct wheel_timer){ .expire = expire,
+                             .data   = data,
+                             .level  = -1 };
+}
+
+void wheel_arm(struct wheel *w, struct wheel_timer *t, unsigned long deadline)
+{
+  wheel_cancel(w, t);
+
+  t->expires = (deadline + w->tick - 1) / w->tick;
+  place(w, t);
+}
+
+void wheel_cancel(struct wheel *w, struct wheel_timer *t)
+{
+  if(!t->pprev)
+    return;
+
+  if(t->level >= 0)
+    w->count[t->level]--;
+  unlink_timer(t);
+  t->level = -1;
+}
+
+struct wheel_timer * wheel_expired(struct wheel *w, unsigned long now)
+{
+  unsigned long target = now / w->tick;
+  struct wheel_timer *t;
+
+  while(!w->expired && (long)(target - w->now) >= 0) {
+    unsigned int index = w->now & WHEEL_MASK;
+    int level;
+
+    /* each time a level wraps, the next slot
+       of the level above is cascaded down */
+    for(level = 1 ; !index && level < WHEEL_LEVELS ; level++) {
+      index = LEVEL_INDEX(w->now, level);
+      cascade(w, level, index);
+    }
+    index = w->now & WHEEL_MASK;
+
+    t = w->slots[0][index];
+    if(t) {
+      w->slots[0][index] = NULL;
+      w->expired = t;
+      t->pprev   = &w->expired;
+
+      for(; t ; t = t->next) {
+        w->count[0]--;
+        t->level = -1;
+      }
+    }
+
+    w->now++;
+  }
+
+  t = w->expired;
+  if(t)
+    unlink_timer(t);
+  return t;
+}
+
+int wheel_next(const struct wheel *w, unsigned long *next)
+{
+  unsigned long upper = 0;
+  unsigned int j;
+  int level;
+
+  if(w->expired) {
+    *next = w->now * w->tick;
+    return 1;
+  }
+
+  for(level = 1 ; level < WHEEL_LEVELS ; level++)
+    upper += w->count[level];
+  if(!w->count[0] && !upper)
+    return 0;
+
+  /* the upper levels only cascade when the first level wraps */
+  for(j = 0 ; j < WHEEL_SIZE ; j++) {
+    unsigned int index = (w->now + j) & WHEEL_MASK;
+
+    if(w->slots[0][index] || (!index && upper))
+      break;
+  }
+
+  *next = (w->now + j) * w->tick;
+  return 1;
+}
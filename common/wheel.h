@@ -0,0 +1,94 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _WHEEL_H_
+#define _WHEEL_H_
+
+/* Hierarchical timer wheel. Timers are intrusive and kept in
+   doubly linked slot lists so that both arming and canceling
+   are O(1). Each level has WHEEL_SIZE slots of increasing
+   granularity, timers move down one level each time the level
+   below wraps (cascade). This is pure C, the caller provides
+   the clock and the locking (see ticker.h for a driver).
+
+   Deadlines are absolute times in us on the caller clock and
+   are rounded up to the wheel tick. Deadlines beyond the range
+   of the wheel are parked in the last level and cascaded again
+   until they are in range. */
+
+#define WHEEL_BITS   6
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+
+struct wheel_timer {
+  struct wheel_timer  *next;
+  struct wheel_timer **pprev;   /* NULL when the timer is not armed */
+  unsigned long        expires; /* deadline in ticks */
+  int                  level;   /* level or -1 once expired */
+
+  void (*expire)(void *data);
+  void *data;
+};
+
+struct wheel {
+  unsigned long tick;    /* duration of a tick in us */
+  unsigned long now;     /* next tick to process */
+  unsigned long count[WHEEL_LEVELS];
+
+  struct wheel_timer *slots[WHEEL_LEVELS][WHEEL_SIZE];
+  struct wheel_timer *expired; /* due but not run yet */
+};
+
+/* Start the wheel at now (us) with a resolution of tick us. */
+void wheel_init(struct wheel *w, unsigned long tick, unsigned long now);
+
+/* Prepare a timer which calls expire(data) on its deadline. */
+void wheel_timer_init(struct wheel_timer *t, void (*expire)(void *data), void *data);
+
+/* Arm or rearm a timer on an absolute deadline in us. A deadline
+   in the past expires on the next call to wheel_expired(). */
+void wheel_arm(struct wheel *w, struct wheel_timer *t, unsigned long deadline);
+
+/* Disarm a timer, this does nothing when it is not armed. */
+void wheel_cancel(struct wheel *w, struct wheel_timer *t);
+
+static inline int wheel_pending(const struct wheel_timer *t)
+{
+  return t->pprev != 0;
+}
+
+/* Advance the wheel up to now (us) and return the next expired
+   timer, already disarmed, or NULL when no timer is due. The
+   caller runs the callback itself so that it can drop its lock
+   and let the callback rearm timers. */
+struct wheel_timer * wheel_expired(struct wheel *w, unsigned long now);
+
+/* Earliest time in us at which the wheel may have a timer due.
+   This is a lower bound when timers wait in the upper levels
+   (the wheel must be advanced to cascade them). Return 0 when
+   the wheel is empty, 1 otherwise. */
+int wheel_next(const struct wheel *w, unsigned long *next);
+
+#endif /* _WHEEL_H_ */
@@ -0,0 +1,451 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _POSIX_C_SOURCE 200112L
+#endif /* __linux__ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <err.h>
+
+#include "time-substract.h"
+#include "g3-plc/g3plc-str.h"
+#include "scale.h"
+#include "xatoi.h"
+#include "mode.h"
+#include "help.h"
+#include "log.h"
+#include "common.h"
+
+/*
+  The bench mode sends a number of frames to the destination
+  and reports the throughput and the latency of each send.
+  Payload sizes cycle from the minimum to the maximum length
+  and frames are paced at the requested rate (back to back by
+  default). Each payload starts with the frame index.
+
+  With --output the summary is also appended to a file, either
+  as a CSV row (with a header when the file is empty) or as one
+  JSON object per line, so that runs with different firmwares or
+  bandplans can be compared. The label is copied as is in the
+  summary to identify the run.
+
+  The modem handles retransmissions itself, so the distribution
+  of the number of transmissions is not known in this driver.
+*/
+
+#define BENCH_MAX_TX 16 /* last bucket of the transmission distribution */
+
+enum bench_format {
+  BENCH_CSV,
+  BENCH_JSON
+};
+
+struct sample {
+  unsigned int  size;
+  int           status;
+  unsigned int  tx; /* number of transmissions (0 when unknown) */
+  unsigned long latency; /* us */
+};
+
+static unsigned int count = 100;
+static unsigned int min_length = 16;
+static unsigned int max_length = 16;
+static unsigned int rate; /* frames per second (0 is back to back) */
+static const char *output;
+static const char *label = "";
+static enum bench_format format = BENCH_CSV;
+
+static struct sample *samples;
+
+/* Summary of a run. Percentiles are computed on the
+   latency of the frames that were delivered. */
+static struct summary {
+  unsigned int  frames;
+  unsigned int  delivered;
+  unsigned long bytes;    /* payload bytes delivered */
+  uint64_t      duration; /* ns */
+  unsigned long p50, p95, p99, max;
+  unsigned long tx[BENCH_MAX_TX + 1];
+} summary;
+
+static void cb_recv(const struct g3plc_ind *ind,
+                    const void *payload, unsigned payload_size,
+                    int status, void *data)
+{
+  /* This mode only sends so we ignored received frames. */
+  UNUSED(ind);
+  UNUSED(payload);
+  UNUSED(payload_size);
+  UNUSED(status);
+  UNUSED(data);
+}
+
+static void init(const struct context *ctx, struct g3plc_config *g3plc)
+{
+  UNUSED(ctx);
+  g3plc->callbacks.cb_recv = cb_recv;
+
+  samples = malloc(count * sizeof(struct sample));
+  if(!samples)
+    err(EXIT_FAILURE, "cannot allocate samples");
+}
+
+static int bench_send(const struct context *ctx, const void *payload, unsigned int size,
+                      unsigned int *tx)
+{
+  *tx = 0;
+  return g3plc_send(ctx->plc, ctx->dst_mac, payload, size);
+}
+
+static const char * bench_send2str(int status)
+{
+  return g3plc_send2str(status);
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+  unsigned long x = *(const unsigned long *)a;
+  unsigned long y = *(const unsigned long *)b;
+
+  return (x > y) - (x < y);
+}
+
+static unsigned long percentile(const unsigned long *sorted, unsigned int n, unsigned int permille)
+{
+  unsigned int rank = ((unsigned long long)n * permille + 999) / 1000;
+
+  return sorted[rank ? rank - 1 : 0];
+}
+
+static void summarize(void)
+{
+  unsigned long *latencies;
+  unsigned int i, n = 0;
+
+  latencies = malloc((count ? count : 1) * sizeof(unsigned long));
+  if(!latencies)
+    err(EXIT_FAILURE, "cannot allocate latencies");
+
+  for(i = 0 ; i < summary.frames ; i++) {
+    const struct sample *s = &samples[i];
+
+    if(s->tx)
+      summary.tx[s->tx < BENCH_MAX_TX ? s->tx : BENCH_MAX_TX]++;
+
+    if(s->status != G3PLC_SND_SUCCESS)
+      continue;
+    summary.bytes += s->size;
+    latencies[n++] = s->latency;
+  }
+  summary.delivered = n;
+
+  if(n) {
+    qsort(latencies, n, sizeof(unsigned long), compare_latency);
+    summary.p50 = percentile(latencies, n, 500);
+    summary.p95 = percentile(latencies, n, 950);
+    summary.p99 = percentile(latencies, n, 990);
+    summary.max = latencies[n - 1];
+  }
+
+  free(latencies);
+}
+
+static double frames_per_second(void)
+{
+  return summary.duration ? summary.frames * 1e9 / summary.duration : 0;
+}
+
+static double goodput(void)
+{
+  /* in bits per second */
+  return summary.duration ? summary.bytes * 8e9 / summary.duration : 0;
+}
+
+static double success_ratio(void)
+{
+  return summary.frames ? (double)summary.delivered / summary.frames : 0;
+}
+
+static void display_summary(void)
+{
+  unsigned int i;
+
+  printf("FRAMES   : %u sent, %u delivered (%.1f%%)\n",
+         summary.frames, summary.delivered, success_ratio() * 100);
+  printf("DURATION : %s\n", scale_time(summary.duration));
+  printf("RATE     : %.2f frames/s\n", frames_per_second());
+  printf("GOODPUT  : %.0f bits/s\n", goodput());
+  printf("LATENCY  : p50 %s", scale_time(summary.p50 * 1000ULL));
+  printf(", p95 %s", scale_time(summary.p95 * 1000ULL));
+  printf(", p99 %s", scale_time(summary.p99 * 1000ULL));
+  printf(", max %s\n", scale_time(summary.max * 1000ULL));
+
+  for(i = 1 ; i <= BENCH_MAX_TX ; i++) {
+    char name[8];
+
+    if(!summary.tx[i])
+      continue;
+    snprintf(name, sizeof(name), "%u%s", i, i == BENCH_MAX_TX ? "+" : "");
+    printf("TX %-6s: %lu\n", name, summary.tx[i]);
+  }
+}
+
+/* Write the label with the quotes of the format. */
+static void write_label(FILE *fp)
+{
+  const char *s;
+
+  fputc('"', fp);
+  for(s = label ; *s ; s++) {
+    if(*s == '"')
+      fputs(format == BENCH_CSV ? "\"\"" : "\\\"", fp);
+    else if(*s == '\\' && format == BENCH_JSON)
+      fputs("\\\\", fp);
+    else
+      fputc(*s, fp);
+  }
+  fputc('"', fp);
+}
+
+static void write_csv(FILE *fp)
+{
+  unsigned int i;
+
+  /* header for a new file */
+  if(ftell(fp) == 0) {
+    fprintf(fp, "label,frames,delivered,bytes,duration_us,fps,goodput_bps,success_ratio,"
+                "p50_us,p95_us,p99_us,max_us");
+    for(i = 1 ; i <= BENCH_MAX_TX ; i++)
+      fprintf(fp, ",tx_%u", i);
+    fputc('\n', fp);
+  }
+
+  write_label(fp);
+  fprintf(fp, ",%u,%u,%lu,%llu,%.2f,%.0f,%.4f,%lu,%lu,%lu,%lu",
+          summary.frames, summary.delivered, summary.bytes,
+          (unsigned long long)(summary.duration / 1000),
+          frames_per_second(), goodput(), success_ratio(),
+          summary.p50, summary.p95, summary.p99, summary.max);
+  for(i = 1 ; i <= BENCH_MAX_TX ; i++)
+    fprintf(fp, ",%lu", summary.tx[i]);
+  fputc('\n', fp);
+}
+
+static void write_json(FILE *fp)
+{
+  unsigned int i;
+
+  fputs("{\"label\":", fp);
+  write_label(fp);
+  fprintf(fp, ",\"frames\":%u,\"delivered\":%u,\"bytes\":%lu,\"duration_us\":%llu,"
+              "\"fps\":%.2f,\"goodput_bps\":%.0f,\"success_ratio\":%.4f,"
+              "\"latency_us\":{\"p50\":%lu,\"p95\":%lu,\"p99\":%lu,\"max\":%lu},\"tx\":[",
+          summary.frames, summary.delivered, summary.bytes,
+          (unsigned long long)(summary.duration / 1000),
+          frames_per_second(), goodput(), success_ratio(),
+          summary.p50, summary.p95, summary.p99, summary.max);
+  for(i = 1 ; i <= BENCH_MAX_TX ; i++)
+    fprintf(fp, "%s%lu", i > 1 ? "," : "", summary.tx[i]);
+  fputs("]}\n", fp);
+}
+
+static void write_output(void)
+{
+  FILE *fp = fopen(output, "a");
+
+  if(!fp) {
+    warn("cannot open %s", output);
+    return;
+  }
+
+  if(format == BENCH_CSV)
+    write_csv(fp);
+  else
+    write_json(fp);
+
+  if(fclose(fp))
+    warn("cannot write %s", output);
+}
+
+static void next_deadline(struct timespec *ts, unsigned long period)
+{
+  ts->tv_sec  += period / 1000000000;
+  ts->tv_nsec += period % 1000000000;
+  if(ts->tv_nsec >= 1000000000) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
+}
+
+static void start(const struct context *ctx)
+{
+  unsigned char payload[G3PLC_MAX_PAYLOAD];
+  struct timespec run_begin, run_end, begin, end, deadline;
+  unsigned long period = rate ? 1000000000UL / rate : 0;
+  unsigned int i, j;
+
+  for(j = 0 ; j < max_length ; j++)
+    payload[j] = j;
+
+  clock_gettime(CLOCK_MONOTONIC, &run_begin);
+  deadline = run_begin;
+
+  for(i = 0 ; i < count ; i++) {
+    struct sample *s = &samples[i];
+
+    s->size = min_length + i % (max_length - min_length + 1);
+    memcpy(payload, &i, s->size < sizeof(i) ? s->size : sizeof(i));
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    s->status = bench_send(ctx, payload, s->size, &s->tx);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    s->latency = substract_nsec(&begin, &end) / 1000;
+    summary.frames++;
+
+    IF_VERBOSE(ctx, log_msg(LOG_CAT_MAIN, LOG_LVL_DEBUG,
+                            "#%u %u bytes: %s (%lu us)\n", i, s->size,
+                            bench_send2str(s->status), s->latency));
+
+    if(period) {
+      next_deadline(&deadline, period);
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &run_end);
+  summary.duration = substract_nsec(&run_begin, &run_end);
+
+  summarize();
+  putchar('\n');
+  display_summary();
+
+  if(output)
+    write_output();
+}
+
+static void destroy(const struct context *ctx)
+{
+  UNUSED(ctx);
+  free(samples);
+}
+
+static void parse_length(const char *arg)
+{
+  char *max = strchr(arg, ':');
+  int err;
+
+  if(max)
+    *max++ = '\0';
+
+  min_length = xatou(arg, &err);
+  if(err)
+    errx(EXIT_FAILURE, "cannot parse length");
+
+  max_length = min_length;
+  if(max) {
+    max_length = xatou(max, &err);
+    if(err)
+      errx(EXIT_FAILURE, "cannot parse maximum length");
+  }
+
+  if(!min_length || min_length > max_length || max_length > G3PLC_MAX_PAYLOAD)
+    errx(EXIT_FAILURE, "invalid length (1 to %u bytes)", (unsigned int)(G3PLC_MAX_PAYLOAD));
+}
+
+static int parse_option(const struct context *ctx, int c)
+{
+  int err;
+
+  UNUSED(ctx);
+
+  switch(c) {
+  case 'n':
+    count = xatou(optarg, &err);
+    if(err || !count)
+      errx(EXIT_FAILURE, "invalid number of frames");
+    return 1;
+  case 'l':
+    parse_length(optarg);
+    return 1;
+  case 'R':
+    rate = xatou(optarg, &err);
+    if(err)
+      errx(EXIT_FAILURE, "cannot parse rate");
+    return 1;
+  case 'o':
+    output = optarg;
+    return 1;
+  case 'F':
+    if(!strcmp(optarg, "csv"))
+      format = BENCH_CSV;
+    else if(!strcmp(optarg, "json"))
+      format = BENCH_JSON;
+    else
+      errx(EXIT_FAILURE, "unknown format (csv or json)");
+    return 1;
+  case 'L':
+    label = optarg;
+    return 1;
+  }
+
+  return 0;
+}
+
+struct option bench_opts[] = {
+  { "count", required_argument, NULL, 'n' },
+  { "length", required_argument, NULL, 'l' },
+  { "rate", required_argument, NULL, 'R' },
+  { "output", required_argument, NULL, 'o' },
+  { "format", required_argument, NULL, 'F' },
+  { "label", required_argument, NULL, 'L' },
+  { NULL, 0, NULL, 0 }
+};
+struct opt_help bench_messages[] = {
+  { 'n', "count",  "Number of frames to send (default: 100)" },
+  { 'l', "length", "Payload length MIN[:MAX] in bytes (default: 16)" },
+  { 'R', "rate",   "Frames per second (default: back to back)" },
+  { 'o', "output", "Append the summary to a file" },
+  { 'F', "format", "Summary format, csv or json (default: csv)" },
+  { 'L', "label",  "Label of the run in the summary" },
+  { 0, NULL, NULL }
+};
+
+struct iface_mode iface_mode = {
+  .name = "bench",
+  .description = "Measure the throughput and latency of a series of frames",
+
+  .optstring      = "n:l:R:o:F:L:",
+  .long_opts      = bench_opts,
+  .extra_messages = bench_messages,
+  .parse_option   = parse_option,
+
+  .init    = init,
+  .destroy = destroy,
+  .start   = start
+};
@@ -0,0 +1,245 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _XOPEN_SOURCE 600
+#endif /* __linux__ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <err.h>
+
+#include "g3-plc/g3plc-str.h"
+#include "subscribe.h"
+#include "uclient.h"
+#include "version.h"
+#include "xatoi.h"
+#include "help.h"
+#include "txopt.h"
+#include "txq.h"
+
+/*
+  Thin client of the unix mode. A g3plc-unix instance runs as a
+  long lived daemon which owns the modem, so the driver and the
+  modem are initialized once. The client submits a single send
+  message to its driver socket and optionally waits for the status
+  of the frame, or queries the latency of the driver. This is meant
+  for scripts which would otherwise run g3plc-send, and reset the
+  modem, for each frame.
+
+  The message format depends on the options of the daemon, so
+  --tx-status, --priority and --tx-options must match them.
+*/
+
+#define DEFAULT_TIMEOUT 10000 /* ms */
+#define MAX_MESSAGE     G3PLC_MAX_CMD
+
+static const char *driver_path = PACKAGE "-driver.sock";
+static const char *sub_path    = PACKAGE "-sub.sock";
+static unsigned int timeout    = DEFAULT_TIMEOUT;
+static int tx_status;
+static int class = -1;
+static int tx_opts = -1;
+static int stats;
+
+static void print_help(const char *name)
+{
+  struct opt_help messages[] = {
+    { 'h', "help",        "Show this help message" },
+    { 'V', "version",     "Show version information" },
+    { 'L', "driver-path", "Driver Unix socket path" },
+    { 'S', "sub-path",    "Subscription Unix socket path (with --stats)" },
+    { 's', "tx-status",   "Identify the message and wait for its status" },
+    { 'P', "priority",    "Priority class (alarm, control or bulk)" },
+    { 'o', "tx-options",  "Options of the message (no-ack, ack, g3plc, lora, tries=N)" },
+    { 't', "timeout",     "Time to wait for a reply in ms (default 10000)" },
+    { 'l', "stats",       "Display the latency of each stage of the driver" },
+    { 0, NULL, NULL }
+  };
+
+  help(name, "[OPTIONS] destination [message]", messages);
+}
+
+static int str2class(const char *s)
+{
+  if(!strcmp(s, "alarm"))
+    return TXQ_ALARM;
+  else if(!strcmp(s, "control"))
+    return TXQ_CONTROL;
+  else if(!strcmp(s, "bulk"))
+    return TXQ_BULK;
+
+  errx(EXIT_FAILURE, "invalid priority class");
+}
+
+static void parse_options(int argc, char *argv[])
+{
+  const char *name = basename(argv[0]);
+  int err;
+
+  struct option opts[] = {
+    { "help", no_argument, NULL, 'h' },
+    { "version", no_argument, NULL, 'V' },
+    { "driver-path", required_argument, NULL, 'L' },
+    { "sub-path", required_argument, NULL, 'S' },
+    { "tx-status", no_argument, NULL, 's' },
+    { "priority", required_argument, NULL, 'P' },
+    { "tx-options", required_argument, NULL, 'o' },
+    { "timeout", required_argument, NULL, 't' },
+    { "stats", no_argument, NULL, 'l' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  while(1) {
+    int c = getopt_long(argc, argv, "hVL:S:sP:o:t:l", opts, NULL);
+
+    if(c == -1)
+      break;
+
+    switch(c) {
+    case 'L':
+      driver_path = optarg;
+      break;
+    case 'S':
+      sub_path = optarg;
+      break;
+    case 's':
+      tx_status = 1;
+      break;
+    case 'P':
+      class = str2class(optarg);
+      break;
+    case 'o':
+      tx_opts = txopt_parse(optarg);
+      if(tx_opts < 0)
+        errx(EXIT_FAILURE, "invalid message options");
+      break;
+    case 't':
+      timeout = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse timeout");
+      break;
+    case 'l':
+      stats = 1;
+      break;
+    case 'V':
+      version(name);
+      exit(EXIT_SUCCESS);
+    case 'h':
+    default:
+      print_help(name);
+      exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  }
+}
+
+static int query_stats(struct uclient *c)
+{
+  char reply[4096];
+  uint8_t msg = SUB_STATS;
+  ssize_t n;
+
+  n = uclient_query(c, sub_path, &msg, sizeof(msg), reply, sizeof(reply), timeout);
+  if(n < 0) {
+    warnx("no reply from %s", sub_path);
+    return EXIT_FAILURE;
+  }
+
+  fwrite(reply, 1, n, stdout);
+  return EXIT_SUCCESS;
+}
+
+/* Read the message from stdin when it
+   is not given on the command line. */
+static size_t read_message(unsigned char *buf, size_t size)
+{
+  size_t n = fread(buf, 1, size, stdin);
+
+  if(ferror(stdin))
+    err(EXIT_FAILURE, "cannot read message");
+  if(!feof(stdin))
+    errx(EXIT_FAILURE, "message too long");
+  return n;
+}
+
+int main(int argc, char *argv[])
+{
+  static unsigned char buf[MAX_MESSAGE];
+  struct uclient c;
+  unsigned int tx;
+  uint16_t dst, id;
+  size_t size;
+  int status, ret = EXIT_SUCCESS;
+
+  parse_options(argc, argv);
+  argc -= optind;
+  argv += optind;
+
+  uclient_open(&c, driver_path);
+
+  if(stats) {
+    ret = query_stats(&c);
+    goto EXIT;
+  }
+
+  if(argc < 1 || argc > 2)
+    errx(EXIT_FAILURE, "usage: destination [message]");
+
+  dst = strtol(argv[0], NULL, 16);
+  if(argc == 2) {
+    size = strlen(argv[1]);
+    if(size > sizeof(buf))
+      errx(EXIT_FAILURE, "message too long");
+    memcpy(buf, argv[1], size);
+  }
+  else
+    size = read_message(buf, sizeof(buf));
+
+  id = getpid();
+  uclient_send(&c, class, tx_opts, tx_status ? id : -1, dst, buf, size);
+
+  if(!tx_status)
+    goto EXIT;
+
+  if(uclient_status(&c, id, timeout, &status, &tx) < 0) {
+    warnx("no status from %s", driver_path);
+    ret = EXIT_FAILURE;
+    goto EXIT;
+  }
+
+  printf("TX STATUS: %s (%d)\n", g3plc_send2str(status), status);
+  printf("TX COUNT : %d\n", tx);
+
+  if(status != G3PLC_SND_SUCCESS)
+    ret = EXIT_FAILURE;
+
+EXIT:
+  uclient_close(&c);
+  return ret;
+}
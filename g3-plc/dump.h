@@ -1,24 +0,0 @@
-/* File: dump.h
-
-   Copyright (C) 2013 David Hauweele <david@hauweele.net>
-
-   This program is free software: you can redistribute it and/or modify
-   it under the terms of the GNU General Public License as published by
-   the Free Software Foundation, either version 3 of the License, or
-   (at your option) any later version.
-
-   This program is distributed in the hope that it will be useful,
-   but WITHOUT ANY WARRANTY; without even the implied warranty of
-   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-   GNU General Public License for more details.
-
-   You should have received a copy of the GNU General Public License
-   along with this program. If not, see <http://www.gnu.org/licenses/>. */
-
-#ifndef _DUMP_H_
-#define _DUMP_H_
-
-/* Show an hexadecimal dump of the data. */
-void hex_dump(const unsigned char *data, int size);
-
-#endif /* _DUMP_H_ */
@@ -0,0 +1,148 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _POSIX_C_SOURCE 200112L
+#endif /* __linux__ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "string-utils.h"
+#include "safe-call.h"
+#include "prof.h"
+#include "batch.h"
+#include "ring.h"
+#include "export.h"
+
+/* number of queued records (power of two) */
+#define EXPORT_DEPTH 1024
+
+/* delay before a partial batch is sent */
+#define EXPORT_FLUSH 1000 /* us */
+
+#define EXPORT_SLOT (sizeof(struct export_record) + G3PLC_MAX_CMD)
+
+static struct ring export_ring;
+static struct batch export_batch;
+static struct sockaddr_un export_addr;
+static pthread_t export_thread;
+static int export_sd = -1;
+static unsigned long send_drops;
+
+static uint64_t now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void export_raw(const struct g3plc_cmd *cmd, unsigned int size, int status, void *data)
+{
+  struct export_record *record;
+
+  (void)data;
+
+  if(export_sd < 0)
+    return;
+
+  record = ring_reserve(&export_ring);
+  if(!record)
+    return;
+
+  if(size > G3PLC_MAX_CMD)
+    size = G3PLC_MAX_CMD;
+  *record = (struct export_record){ .stamp  = now(),
+                                    .size   = size,
+                                    .status = status,
+                                    .chan   = cmd->idc };
+  memcpy(record + 1, cmd, size);
+  ring_commit(&export_ring);
+}
+
+static void add_record(const struct export_record *record)
+{
+  size_t len = sizeof(*record) + record->size;
+
+  memcpy(batch_buf(&export_batch, export_batch.count), record, len);
+  batch_add(&export_batch, len);
+  ring_release(&export_ring);
+}
+
+static void drop(const struct batch *b, unsigned int i, int error)
+{
+  (void)b;
+  (void)i;
+  (void)error;
+
+  __atomic_add_fetch(&send_drops, 1, __ATOMIC_RELAXED);
+}
+
+static void * export_thread_func(void *arg)
+{
+  (void)arg;
+
+  prof_thread("export");
+
+  while(1) {
+    const struct export_record *record = ring_wait(&export_ring);
+
+    /* gather what follows the first record
+       until the batch is full or idle */
+    add_record(record);
+    while(export_batch.count < EXPORT_BATCH) {
+      record = ring_timedwait(&export_ring, EXPORT_FLUSH);
+      if(!record)
+        break;
+      add_record(record);
+    }
+
+    batch_send(export_sd, &export_batch, MSG_DONTWAIT, drop);
+  }
+
+  return NULL;
+}
+
+void export_open(const char *path)
+{
+  export_addr = (struct sockaddr_un){ .sun_family = AF_UNIX };
+  xstrcpy(export_addr.sun_path, path, sizeof(export_addr.sun_path));
+
+  ring_init(&export_ring, EXPORT_DEPTH, EXPORT_SLOT);
+  batch_init(&export_batch, EXPORT_BATCH, EXPORT_SLOT, &export_addr);
+  export_sd = xsocket(AF_UNIX, SOCK_DGRAM, 0);
+
+  xpthread_create(&export_thread, NULL, export_thread_func, NULL);
+}
+
+unsigned long export_drops(void)
+{
+  if(export_sd < 0)
+    return 0;
+  return ring_drops(&export_ring) + __atomic_load_n(&send_drops, __ATOMIC_RELAXED);
+}
@@ -22,72 +22,48 @@
    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <sys/mman.h>
-#include <unistd.h>
-#include <stdlib.h>
+#ifndef _EXPORT_H_
+#define _EXPORT_H_
+
 #include <stdint.h>
-#include <fcntl.h>
-#include <err.h>
-
-#include "safe-call.h"
-
-/* FIXME: This is Linux specific, isn't it?
-   We need a pragma to avoid compilation on
-   other OS. */
-
-#define BCM2708_PERI_BASE 0x20000000
-#define GPIO_BASE         (BCM2708_PERI_BASE + 0x200000)
-#define BLOCK_SIZE        4096
-
-static volatile uint32_t *gpio_reg;
-
-void rpi_gpio_init(void)
-{
-  int fd = xopen("/dev/mem", O_RDWR | O_SYNC, 0);
-  gpio_reg = mmap(0, BLOCK_SIZE,
-                  PROT_READ | PROT_WRITE,
-                  MAP_SHARED,
-                  fd, GPIO_BASE);
-  if(gpio_reg == MAP_FAILED)
-    err(EXIT_FAILURE, "cannot mmap GPIO");
-  close(fd);
-}
-
-void rpi_gpio_destroy(void)
-{
-  munmap((void *)gpio_reg, BLOCK_SIZE);
-}
-
-void rpi_gpio_set_mode(unsigned int gpio, unsigned int mode)
-{
-  int reg, shift;
-
-  reg   = gpio / 10;
-  shift = (gpio % 10) * 3;
-
-  gpio_reg[reg] = (gpio_reg[reg] & ~(7 << shift)) | /* clear pin conf */
-                  (mode << shift);                  /* apply mode */
-}
-
-void rpi_gpio_set(unsigned int gpio)
-{
-  *(gpio_reg + 7)  = 1 << gpio;
-}
-
-void rpi_gpio_clr(unsigned int gpio)
-{
-  *(gpio_reg + 10) = 1 << gpio;
-}
-
-int rpi_gpio_get(unsigned int gpio)
-{
-  return *(gpio_reg + 13) & (1 << gpio);
-}
-
-int rpi_gpio_check(unsigned int gpio)
-{
-  /* FIXME: not sure this is sufficient */
-  if(gpio <= 27)
-    return 1;
-  return 0;
-}
+
+#include "g3-plc/g3plc.h"
+
+/* Export of the raw commands received from the device to an
+   external dissector (see --export).
+
+   The raw callback of the driver copies each command to a lock-free
+   ring and never blocks. A background thread sends the records in
+   batches (one sendmmsg() for up to EXPORT_BATCH records) to a Unix
+   datagram socket bound to the export path by the subscriber. Each
+   datagram holds one record in host order:
+
+     [stamp (u64)][size (u16)][status (i8)][chan (u8)][reserved (u32)][command (size)]
+
+   The stamp is the monotonic clock (in ns) when the driver parsed the
+   command, the status its receive status (see g3plc_receive_status)
+   and the command starts with its header, in host order unless the
+   status is an invalid CRC or header. Records are
+   dropped when the ring is full or when the subscriber cannot keep up
+   (or is not there). */
+
+#define EXPORT_BATCH 32
+
+struct export_record {
+  uint64_t stamp;
+  uint16_t size;
+  int8_t   status;
+  uint8_t  chan;
+  uint32_t reserved;
+};
+
+/* Start exporting to the socket bound at path. Exit on error. */
+void export_open(const char *path);
+
+/* Raw callback of the driver (see g3plc_callbacks). */
+void export_raw(const struct g3plc_cmd *cmd, unsigned int size, int status, void *data);
+
+/* Number of records dropped so far. */
+unsigned long export_drops(void);
+
+#endif /* _EXPORT_H_ */
@@ -28,24 +28,17 @@
 
 #include <stdint.h>
 
+#include "g3plc-conf.h"
+
 /* Maximum size for a command packet.
 
-   We make the distinction between the command itself and
-   the command escaped with HDLC between frame delimiters.
-   The unescaped command can be appended with a CRC. */
-#define G3PLC_MAX_CMD        1024 /* FIXME: depends on aMaxMACPayloadSize */
-#define G3PLC_MAX_PACKED_CMD G3PLC_MAX_CMD * 2 /* HDLC */ + 2 /* frame delimiter */
-
-/* Receive and send command buffers.
-   Unpacked command (without HDLC and delimiters) are
-   assembled/parsed in these two buffers. */
-extern unsigned char snd_cmdbuf[];
-extern unsigned char rcv_cmdbuf[];
-
-/* Receive and send packed command buffers.
-   Packed command (with HDLC and delimiters) are
-   assembled/parsed in these two buffers. */
-extern unsigned char snd_cmdbuf_packed[];
-extern unsigned char rcv_cmdbuf_packed[];
+   We make the distinction between the command itself
+   (G3PLC_MAX_CMD, see g3plc-conf.h) and the command escaped
+   with HDLC between frame delimiters. The unescaped command
+   can be appended with a CRC. */
+#define G3PLC_MAX_PACKED_CMD ((G3PLC_MAX_CMD + 4 /* CRC */) * 2 /* HDLC */ + 2 /* frame delimiter */)
+
+/* The command buffers themselves are part of the driver
+   instance (see struct g3plc_ctx). */
 
 #endif /* _CMDBUF_H_ */
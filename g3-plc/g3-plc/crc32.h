@@ -28,8 +28,60 @@
 
 #include <stdint.h>
 
+/* Byte-at-a-time table (see crc32.c). */
+extern const uint32_t crc32_G3PLC_tbl[8][256];
+
+/* Update the CRC with a single byte.
+   This is meant for encoders that compute
+   the CRC while they process the data. */
+static inline uint32_t crc32_G3PLC_byte(uint32_t crc, unsigned char c)
+{
+  return (crc << 8) ^ crc32_G3PLC_tbl[0][(crc >> 24) ^ c];
+}
+
+/* Compute the G3PLC CRC32 of a buffer starting from an initial CRC.
+   This selects the fastest implementation available at runtime. */
 uint32_t crc32_G3PLC(const unsigned char *s,
                      unsigned long len,
                      uint32_t crc);
 
+/* A CRC that can be checkpointed after the bytes shared by many
+   buffers, such as a constant header, and rewound there for each
+   buffer so that only the bytes that change are scanned again. */
+struct crc32_G3PLC_ctx {
+  uint32_t crc;  /* running CRC */
+  uint32_t ckpt; /* CRC at the checkpoint */
+};
+
+static inline void crc32_G3PLC_start(struct crc32_G3PLC_ctx *ctx, uint32_t init)
+{
+  ctx->crc  = init;
+  ctx->ckpt = init;
+}
+
+static inline void crc32_G3PLC_update(struct crc32_G3PLC_ctx *ctx,
+                                      const unsigned char *s, unsigned long len)
+{
+  ctx->crc = crc32_G3PLC(s, len, ctx->crc);
+}
+
+static inline void crc32_G3PLC_checkpoint(struct crc32_G3PLC_ctx *ctx)
+{
+  ctx->ckpt = ctx->crc;
+}
+
+static inline void crc32_G3PLC_rewind(struct crc32_G3PLC_ctx *ctx)
+{
+  ctx->crc = ctx->ckpt;
+}
+
+/* Portable implementations, exposed for testing.
+   All of them must produce the exact same result. */
+uint32_t crc32_G3PLC_bytewise(const unsigned char *s,
+                              unsigned long len,
+                              uint32_t crc);
+uint32_t crc32_G3PLC_slice8(const unsigned char *s,
+                            unsigned long len,
+                            uint32_t crc);
+
 #endif /* _CRC32_H_ */
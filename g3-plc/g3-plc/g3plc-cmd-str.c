@@ -25,7 +25,7 @@
 #include <stdio.h>
 
 #include "g3plc-cmd.h"
-#include "../dump.h"
+#include "dump.h"
 
 const char * g3plc_type2str(enum g3plc_type type)
 {
@@ -378,6 +378,8 @@ const char * g3plc_attr2str(enum g3plc_attr attr)
     return "short address";
   case G3PLC_ATTR_RETRANS:
     return "max. retransmissions";
+  case G3PLC_ATTR_TMR_TTL:
+    return "tonemap response TTL";
   default:
     return "unknown attribute";
   }
@@ -445,27 +447,27 @@ static void hex_field(const char *name, unsigned int value)
   printf(" %s: 0x%02x\n", name, value);
 }
 
-static void print_status(const struct g3plc_cmd *cmd, unsigned int size)
+int g3plc_cmd_status(const struct g3plc_cmd *cmd, unsigned int size)
 {
-  unsigned int status;
+  /* we only find status in confirmations */
+  if(cmd->ida != G3PLC_IDA_CONFIRM)
+    return -1;
+
+  /* for some commands status is in second byte */
+  if((cmd->idp == G3PLC_IDP_UMAC && cmd->cmd == G3PLC_CMD_MCPS_DATA) || \
+     (cmd->idp == G3PLC_IDP_ADP  && cmd->cmd == G3PLC_CMD_ADPM_PATH_DISCOVERY))
+    return size < 2 ? -1 : cmd->data[1];
 
   /* we need at least one status byte */
-  if(size < 1)
-    return;
-  status = cmd->data[0];
+  return size < 1 ? -1 : cmd->data[0];
+}
 
-  /* we only find status in confirmations */
-  if(cmd->ida == G3PLC_IDA_CONFIRM) {
-    /* for some commands status is in second byte */
-    if((cmd->idp == G3PLC_IDP_UMAC && cmd->cmd == G3PLC_CMD_MCPS_DATA) || \
-       (cmd->idp == G3PLC_IDP_ADP  && cmd->cmd == G3PLC_CMD_ADPM_PATH_DISCOVERY)) {
-      if(size < 2)
-        return;
-      status = cmd->data[1];
-    }
+static void print_status(const struct g3plc_cmd *cmd, unsigned int size)
+{
+  int status = g3plc_cmd_status(cmd, size);
 
+  if(status >= 0)
     field("Status", g3plc_status2str(cmd->idp, status), status);
-  }
 }
 
 static void print_g3event_indication(const struct g3plc_cmd *cmd, unsigned int size)
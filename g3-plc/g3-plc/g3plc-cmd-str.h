@@ -36,6 +36,10 @@ const char * g3plc_attr2str(enum g3plc_attr attr);
 const char * g3plc_macstatus2str(enum g3plc_mac_status st);
 const char * g3plc_bandplan2str(enum g3plc_bandplan bp);
 
+/* Status of a confirm of data size bytes or -1 when the command
+   is not a confirm or too short. */
+int g3plc_cmd_status(const struct g3plc_cmd *cmd, unsigned int size);
+
 /* Display a command on stdout.
    The command must already (or still) be in host order (see hton_g3plc_cmd()).
    The size must be the size of the command (in host order) with its data. */
@@ -221,12 +221,23 @@ enum g3plc_bandplan {
   G3PLC_BP_FCC
 };
 
+/* Estimated modulation (see g3plc_ind_modulation()) */
+enum g3plc_modulation {
+  G3PLC_MOD_ROBUST,
+  G3PLC_MOD_BPSK,
+  G3PLC_MOD_QPSK,
+  G3PLC_MOD_8PSK,
+  G3PLC_MOD_16QAM
+};
+
 /* IB attributes */
 enum g3plc_attr {
   G3PLC_ATTR_PANID       = 0x0050, /* PAN ID */
   G3PLC_ATTR_PROMISCUOUS = 0x0051, /* promiscuous mode */
   G3PLC_ATTR_SHORTADDR   = 0x0053, /* short address */
-  G3PLC_ATTR_RETRANS     = 0x0059  /* max retransmissions */
+  G3PLC_ATTR_RETRANS     = 0x0059, /* max retransmissions */
+  G3PLC_ATTR_KEY_TABLE   = 0x0071, /* key table (16-byte key by index) */
+  G3PLC_ATTR_TMR_TTL     = 0x010f  /* tonemap response TTL (minutes) */
 };
 
 /* MAC status code */
@@ -283,6 +294,12 @@ enum g3plc_mac_status {
                                                 G3PLC_IDA_CONFIRM,      \
                                                 G3PLC_IDP_UMAC,         \
                                                 G3PLC_CMD_MLME_SET)
+#define G3PLC_MLME_GET_CONFIRM INLINE_G3PLC_CMD(0,                      \
+                                                G3PLC_TYPE_G3,          \
+                                                G3PLC_CHAN0,            \
+                                                G3PLC_IDA_CONFIRM,      \
+                                                G3PLC_IDP_UMAC,         \
+                                                G3PLC_CMD_MLME_GET)
 #define G3PLC_MLME_RESET_CONFIRM INLINE_G3PLC_CMD(0,                      \
                                                   G3PLC_TYPE_G3,          \
                                                   G3PLC_CHAN0,            \
@@ -301,6 +318,30 @@ enum g3plc_mac_status {
                                                     G3PLC_IDA_INDICATION, \
                                                     G3PLC_IDP_UMAC,       \
                                                     G3PLC_CMD_MCPS_DATA)
+#define G3PLC_G3_GETCONFIG_CONFIRM INLINE_G3PLC_CMD(0,                      \
+                                                    G3PLC_TYPE_G3,          \
+                                                    G3PLC_CHAN0,            \
+                                                    G3PLC_IDA_CONFIRM,      \
+                                                    G3PLC_IDP_G3CTR,        \
+                                                    G3PLC_CMD_G3_GETCONFIG)
+#define G3PLC_G3_EVENT_INDICATION INLINE_G3PLC_CMD(0,                    \
+                                                   G3PLC_TYPE_G3,        \
+                                                   G3PLC_CHAN0,          \
+                                                   G3PLC_IDA_INDICATION, \
+                                                   G3PLC_IDP_G3CTR,      \
+                                                   G3PLC_CMD_G3_EVENT)
+#define G3PLC_MLME_COMM_STATUS_INDICATION INLINE_G3PLC_CMD(0,                         \
+                                                           G3PLC_TYPE_G3,             \
+                                                           G3PLC_CHAN0,               \
+                                                           G3PLC_IDA_INDICATION,      \
+                                                           G3PLC_IDP_UMAC,            \
+                                                           G3PLC_CMD_MLME_COMM_STATUS)
+#define G3PLC_ADPM_NETWORK_LEAVE_INDICATION INLINE_G3PLC_CMD(0,                           \
+                                                             G3PLC_TYPE_G3,               \
+                                                             G3PLC_CHAN0,                 \
+                                                             G3PLC_IDA_INDICATION,        \
+                                                             G3PLC_IDP_ADP,               \
+                                                             G3PLC_CMD_ADPM_NETWORK_LEAVE)
 #define SYSTEM_CTRL_READY INLINE_G3PLC_CMD(0,                      \
                                            G3PLC_TYPE_SYSTEM,      \
                                            G3PLC_CHAN0,            \
@@ -0,0 +1,158 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _G3PLC_CONF_H_
+#define _G3PLC_CONF_H_
+
+/* Sizes of the static buffers and tables of the driver.
+
+   The driver never allocates, so these sizes are its whole RAM
+   footprint (see ram-report.sh). Each one can be overridden from
+   the command line (e.g. -DG3PLC_MAX_CMD=512). G3PLC_EMBEDDED
+   selects smaller defaults for microcontrollers such as the S7G2
+   (make PROFILE=embedded). With this profile each command must
+   still fit in G3PLC_MAX_CMD, so it needs at least the MAC
+   payload of the modem plus the data header. */
+
+#ifdef G3PLC_EMBEDDED
+# define G3PLC_CONF_PROFILE "embedded"
+#else
+# define G3PLC_CONF_PROFILE "default"
+#endif /* G3PLC_EMBEDDED */
+
+/* Maximum size of an unpacked command packet (without HDLC).
+   FIXME: depends on aMaxMACPayloadSize */
+#ifndef G3PLC_MAX_CMD
+# ifdef G3PLC_EMBEDDED
+#  define G3PLC_MAX_CMD 512
+# else
+#  define G3PLC_MAX_CMD 1024
+# endif
+#endif
+
+/* Concurrent confirmation waits, each with a G3PLC_MAX_CMD buffer. */
+#ifndef G3PLC_MAX_WAITERS
+# ifdef G3PLC_EMBEDDED
+#  define G3PLC_MAX_WAITERS 2
+# else
+#  define G3PLC_MAX_WAITERS 4
+# endif
+#endif
+
+/* Command handlers (power of two, see g3plc_register()). */
+#ifndef G3PLC_MAX_HANDLERS
+# ifdef G3PLC_EMBEDDED
+#  define G3PLC_MAX_HANDLERS 16
+# else
+#  define G3PLC_MAX_HANDLERS 32
+# endif
+#endif
+
+/* Cached PIB attributes and maximum size of each one. */
+#ifndef G3PLC_PIB_CACHE
+# ifdef G3PLC_EMBEDDED
+#  define G3PLC_PIB_CACHE 4
+# else
+#  define G3PLC_PIB_CACHE 16
+# endif
+#endif
+
+#ifndef G3PLC_PIB_MAX_SIZE
+# define G3PLC_PIB_MAX_SIZE 32
+#endif
+
+/* Destinations with an estimated confirm timeout. */
+#ifndef G3PLC_RTO_PEERS
+# ifdef G3PLC_EMBEDDED
+#  define G3PLC_RTO_PEERS 16
+# else
+#  define G3PLC_RTO_PEERS 64
+# endif
+#endif
+
+/* Neighbour statistics (power of two, see neigh.h). */
+#ifndef NEIGH_SIZE
+# ifdef G3PLC_EMBEDDED
+#  define NEIGH_SIZE 16
+# else
+#  define NEIGH_SIZE 64
+# endif
+#endif
+
+/* Precision of the latency histograms (see hist.h). Each
+   histogram takes (33 - HIST_SUB_BITS) << HIST_SUB_BITS counters. */
+#ifndef HIST_SUB_BITS
+# ifdef G3PLC_EMBEDDED
+#  define HIST_SUB_BITS 1
+# else
+#  define HIST_SUB_BITS 3
+# endif
+#endif
+
+/* Bytes read from the UART at once (on the stack of the reader). */
+#ifndef UART_BUFFER_SIZE
+# ifdef G3PLC_EMBEDDED
+#  define UART_BUFFER_SIZE 256
+# else
+#  define UART_BUFFER_SIZE 1024
+# endif
+#endif
+
+/* Bytes of the packed send buffer. Commands are escaped into it
+   and written to the UART each time it fills. The default profile
+   holds a whole command escaped at worst (twice its size), so that
+   each command is a single write. */
+#ifndef G3PLC_SND_CHUNK
+# ifdef G3PLC_EMBEDDED
+#  define G3PLC_SND_CHUNK 128
+# else
+#  define G3PLC_SND_CHUNK ((G3PLC_MAX_CMD + 4) * 2 + 2)
+# endif
+#endif
+
+#if G3PLC_MAX_CMD < 64
+# error "G3PLC_MAX_CMD cannot hold a data indication"
+#endif
+
+#if G3PLC_SND_CHUNK < 16
+# error "G3PLC_SND_CHUNK must hold at least 16 bytes"
+#endif
+
+#if G3PLC_MAX_WAITERS < 1
+# error "G3PLC_MAX_WAITERS must be at least 1"
+#endif
+
+#if G3PLC_MAX_HANDLERS & (G3PLC_MAX_HANDLERS - 1)
+# error "G3PLC_MAX_HANDLERS must be a power of two"
+#endif
+
+#if NEIGH_SIZE & (NEIGH_SIZE - 1)
+# error "NEIGH_SIZE must be a power of two"
+#endif
+
+#if HIST_SUB_BITS < 1 || HIST_SUB_BITS > 8
+# error "HIST_SUB_BITS must be between 1 and 8"
+#endif
+
+#endif /* _G3PLC_CONF_H_ */
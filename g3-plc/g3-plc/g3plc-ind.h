@@ -0,0 +1,159 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _G3PLC_IND_H_
+#define _G3PLC_IND_H_
+
+#include <stdint.h>
+
+/* View of a received MCPS-DATA indication.
+
+   The fields are decoded lazily from the indication itself so that
+   a caller only pays for the fields it reads. The view points into
+   the receive buffer of the driver and is only valid during the
+   receive callback, it must be copied along with the data to be kept.
+   The driver checked that the header and payload fit in the buffer.
+
+   Layout (network order):
+     [0]       source address mode
+     [1..2]    source PAN ID
+     [3..10]   source address
+     [11]      destination address mode
+     [12..13]  destination PAN ID
+     [14..21]  destination address
+     [22..23]  MSDU length
+     [24..]    MSDU
+   followed by an optional trailer that has the layout of the request:
+     [0]       link quality of the MPDU
+     [1]       DSN
+     [2..5]    timestamp in symbols
+     [6]       security level
+     [7]       key identification mode
+     [8..15]   key source
+     [16]      key index
+     [17]      QoS
+     [18]      estimated modulation
+     [19..]    estimated tonemap (up to 4 bytes) */
+struct g3plc_ind {
+  const unsigned char *data;
+  unsigned int         size;
+  unsigned long        stamp; /* clock when the first byte was read (see g3plc_config.clock) */
+};
+
+#define G3PLC_IND_HDR_SIZE     24
+#define G3PLC_IND_TRAILER_SIZE 19
+
+/* Byte order is resolved by the shifts themselves,
+   compilers turn them into a load and a byte swap. */
+static inline uint16_t g3plc_be16(const unsigned char *p)
+{
+  return (uint16_t)p[0] << 8 | p[1];
+}
+
+static inline uint32_t g3plc_be32(const unsigned char *p)
+{
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline uint64_t g3plc_be64(const unsigned char *p)
+{
+  return (uint64_t)g3plc_be32(p) << 32 | g3plc_be32(p + 4);
+}
+
+/* Header */
+static inline uint8_t g3plc_ind_src_mode(const struct g3plc_ind *ind) { return ind->data[0]; }
+static inline uint16_t g3plc_ind_src_pan(const struct g3plc_ind *ind) { return g3plc_be16(ind->data + 1); }
+static inline uint64_t g3plc_ind_src_addr(const struct g3plc_ind *ind) { return g3plc_be64(ind->data + 3); }
+static inline uint8_t g3plc_ind_dst_mode(const struct g3plc_ind *ind) { return ind->data[11]; }
+static inline uint16_t g3plc_ind_dst_pan(const struct g3plc_ind *ind) { return g3plc_be16(ind->data + 12); }
+static inline uint64_t g3plc_ind_dst_addr(const struct g3plc_ind *ind) { return g3plc_be64(ind->data + 14); }
+
+/* Short addresses are the low bits of the address. */
+static inline uint16_t g3plc_ind_src(const struct g3plc_ind *ind) { return g3plc_be16(ind->data + 9); }
+static inline uint16_t g3plc_ind_dst(const struct g3plc_ind *ind) { return g3plc_be16(ind->data + 20); }
+
+/* Payload */
+static inline unsigned int g3plc_ind_payload_size(const struct g3plc_ind *ind)
+{
+  return g3plc_be16(ind->data + 22);
+}
+
+static inline const unsigned char * g3plc_ind_payload(const struct g3plc_ind *ind)
+{
+  return ind->data + G3PLC_IND_HDR_SIZE;
+}
+
+/* Trailer, all its fields read as zero when it is missing or truncated. */
+static inline const unsigned char * g3plc_ind_trailer(const struct g3plc_ind *ind)
+{
+  unsigned int offset = G3PLC_IND_HDR_SIZE + g3plc_ind_payload_size(ind);
+
+  if(ind->size < offset + G3PLC_IND_TRAILER_SIZE)
+    return NULL;
+  return ind->data + offset;
+}
+
+static inline uint8_t g3plc_ind_u8(const struct g3plc_ind *ind, unsigned int i)
+{
+  const unsigned char *t = g3plc_ind_trailer(ind);
+  return t ? t[i] : 0;
+}
+
+static inline uint8_t g3plc_ind_lqi(const struct g3plc_ind *ind) { return g3plc_ind_u8(ind, 0); }
+static inline uint8_t g3plc_ind_seqno(const struct g3plc_ind *ind) { return g3plc_ind_u8(ind, 1); }
+static inline uint8_t g3plc_ind_sec_level(const struct g3plc_ind *ind) { return g3plc_ind_u8(ind, 6); }
+static inline uint8_t g3plc_ind_key_id_mode(const struct g3plc_ind *ind) { return g3plc_ind_u8(ind, 7); }
+static inline uint8_t g3plc_ind_key_index(const struct g3plc_ind *ind) { return g3plc_ind_u8(ind, 16); }
+static inline uint8_t g3plc_ind_qos(const struct g3plc_ind *ind) { return g3plc_ind_u8(ind, 17); }
+static inline uint8_t g3plc_ind_modulation(const struct g3plc_ind *ind) { return g3plc_ind_u8(ind, 18); }
+
+/* Symbol time of the modem, unlike the stamp this does not
+   include the UART transfer nor the processing of the modem. */
+static inline uint32_t g3plc_ind_time(const struct g3plc_ind *ind)
+{
+  const unsigned char *t = g3plc_ind_trailer(ind);
+  return t ? g3plc_be32(t + 2) : 0;
+}
+
+static inline uint64_t g3plc_ind_key_source(const struct g3plc_ind *ind)
+{
+  const unsigned char *t = g3plc_ind_trailer(ind);
+  return t ? g3plc_be64(t + 8) : 0;
+}
+
+static inline uint32_t g3plc_ind_tonemap(const struct g3plc_ind *ind)
+{
+  const unsigned char *t = g3plc_ind_trailer(ind);
+  const unsigned char *end = ind->data + ind->size;
+  uint32_t tonemap = 0;
+  unsigned int i;
+
+  if(!t)
+    return 0;
+  for(i = 0, t += G3PLC_IND_TRAILER_SIZE ; i < sizeof(uint32_t) && t < end ; i++, t++)
+    tonemap = tonemap << 8 | *t;
+  return tonemap;
+}
+
+#endif /* _G3PLC_IND_H_ */
@@ -34,6 +34,12 @@ const char * g3plc_flag2str(enum g3plc_flags flag)
     return "invalid";
   case G3PLC_NOACK:
     return "no ACK";
+  case G3PLC_PROMISC:
+    return "promiscuous";
+  case G3PLC_ADAPT:
+    return "tonemap adaptation";
+  case G3PLC_SECURE:
+    return "MAC security";
   default:
     return "unknown flag";
   }
@@ -52,6 +58,12 @@ const char * g3plc_init2str(enum g3plc_init_status status)
     return "start sequence error";
   case G3PLC_INIT_CMD_TIMEOUT:
     return "request confirmation timeout";
+  case G3PLC_INIT_FIRMWARE:
+    return "invalid firmware";
+  case G3PLC_INIT_ATTACH_CONFIG:
+    return "configuration mismatch";
+  case G3PLC_INIT_PENDING:
+    return "in progress";
   default:
     return "unknown init status";
   }
@@ -94,6 +106,8 @@ const char * g3plc_send2str(enum g3plc_send_status status)
     return "medium access failure";
   case G3PLC_SND_OOM:
     return "out of memory";
+  case G3PLC_SND_BUSY:
+    return "too many frames in flight";
   case G3PLC_SND_FAILURE:
     return "failure";
   default:
@@ -101,12 +115,44 @@ const char * g3plc_send2str(enum g3plc_send_status status)
   }
 }
 
+const char * g3plc_stage2str(enum g3plc_stage stage)
+{
+  switch(stage) {
+  case G3PLC_STAGE_UART:
+    return "uart";
+  case G3PLC_STAGE_CONFIRM:
+    return "confirm";
+  case G3PLC_STAGE_RECV:
+    return "recv";
+  default:
+    return "unknown stage";
+  }
+}
+
+const char * g3plc_link2str(enum g3plc_link link)
+{
+  switch(link) {
+  case G3PLC_LINK_UP:
+    return "up";
+  case G3PLC_LINK_DEGRADED:
+    return "degraded";
+  case G3PLC_LINK_DOWN:
+    return "down";
+  default:
+    return "unknown link state";
+  }
+}
+
 enum g3plc_flags g3plc_str2flag(const char *s)
 {
   if(!strcmp("invalid", s))
     return G3PLC_INVALID;
   else if(!strcmp("no-ack", s))
     return G3PLC_NOACK;
+  else if(!strcmp("promiscuous", s))
+    return G3PLC_PROMISC;
+  else if(!strcmp("adapt", s))
+    return G3PLC_ADAPT;
   return 0;
 }
 
@@ -33,6 +33,8 @@ const char * g3plc_flag2str(enum g3plc_flags flag);
 const char * g3plc_init2str(enum g3plc_init_status status);
 const char * g3plc_rcv2str(enum g3plc_receive_status status);
 const char * g3plc_send2str(enum g3plc_send_status status);
+const char * g3plc_stage2str(enum g3plc_stage stage);
+const char * g3plc_link2str(enum g3plc_link link);
 
 /* Select flags and status from strings. */
 enum g3plc_flags g3plc_str2flag(const char *s);
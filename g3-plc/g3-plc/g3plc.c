@@ -31,6 +31,8 @@
 #include "pack.h"
 #include "g3plc-cmd.h"
 #include "g3plc.h"
+#include "byteorder.h"
+#include "probe.h"
 
 #ifdef DEBUG
 # include <stdio.h>
@@ -40,11 +42,28 @@
 /* Maximum size of write during boot sequence segment upload. */
 #define BOOT_SEGMENT_CHUNK 8092
 
+/* The device requests segments with a 4-bit number
+   (see G3PLC_BOOT_SEGMENTS). */
+#define BOOT_INFO_SIZE    16
+#define BOOT_TABLE        0x10 /* offset of the firmware table */
+
 /* Check that callbacks are configured before calling them. */
-#define CB(cb, ...) if(g3plc_conf.callbacks.cb) g3plc_conf.callbacks.cb(__VA_ARGS__)
+#define CB(cb, ...) if(ctx->conf.callbacks.cb) ctx->conf.callbacks.cb(__VA_ARGS__)
+
+/* Lock shared state when the platform provides a lock. */
+#define LOCK()   if(ctx->conf.lock) ctx->conf.lock(ctx->conf.data)
+#define UNLOCK() if(ctx->conf.unlock) ctx->conf.unlock(ctx->conf.data)
+
+/* Serialize the users of the send command buffers
+   (see snd_lock in g3plc_config). */
+#define SND_LOCK()   if(ctx->conf.snd_lock) ctx->conf.snd_lock(ctx->conf.data)
+#define SND_UNLOCK() if(ctx->conf.snd_unlock) ctx->conf.snd_unlock(ctx->conf.data)
+
+/* Start of a timed stage when the platform provides a clock. */
+#define STAMP() (ctx->conf.clock ? ctx->conf.clock(ctx->conf.data) : 0)
 
 /* Boot progress. */
-#define BPRG() if(g3plc_conf.boot_progress) g3plc_conf.boot_progress()
+#define BPRG() if(ctx->conf.boot_progress) ctx->conf.boot_progress(ctx->conf.data)
 
 /* Check the return value of the function.
    Exit with its error when it is different than success. */
@@ -54,71 +73,78 @@
       return n;              \
   } while(0)
 
-/* Used in conjunction with the dissector
-   to synchronize request/confirm. */
-static uint32_t waited_cmd_literal;
-static unsigned char *waited_cmd_data;
+/* Speed that always worked, the result of the
+   negotiation starts from it (see g3plc_init()). */
+static const struct g3plc_baud default_baud = { .code = 0x84,
+                                                .boot = 460800,
+                                                .appl = 115200 };
 
-/* G3PLC configuration with platform dependent functions,
-   source mac address, callbacks and flags. */
-static struct g3plc_config g3plc_conf;
-
-/* Size of the received command packet.
-   Glue between uart_putc() and recv_frame(). */
-static unsigned int rcv_size;
-
-static uint64_t htonll(uint64_t v)
+static uint64_t htonll(struct g3plc_ctx *ctx, uint64_t v)
 {
-  return ((uint64_t)g3plc_conf.htonl(v & 0xffffffff) << 32) | g3plc_conf.htonl(v >> 32);
+  return BO_HTONLL(ctx->conf, v);
 }
 
-static uint64_t ntohll(uint64_t v)
+static uint64_t ntohll(struct g3plc_ctx *ctx, uint64_t v)
 {
-  return ((uint64_t)g3plc_conf.ntohl(v & 0xffffffff) << 32) | g3plc_conf.ntohl(v >> 32);
+  return BO_NTOHLL(ctx->conf, v);
 }
 
-static int g3_init_request(uint16_t neighbour,  /* number of neighbour table */
+static int send_command(struct g3plc_ctx *ctx, struct g3plc_cmd *cmd, unsigned int size,
+                        const void *payload, unsigned int payload_size);
+
+static int g3_init_request(struct g3plc_ctx *ctx, unsigned int chan,   /* G3 channel */
+                           uint16_t neighbour,  /* number of neighbour table */
                            uint16_t device,     /* number of device table */
                            uint16_t pan         /* max. number of PAN obtained with a scan */ )
 {
-  struct g3plc_cmd *cmd = (struct g3plc_cmd *)snd_cmdbuf;
+  struct g3plc_cmd *cmd = (struct g3plc_cmd *)ctx->snd_cmdbuf;
   unsigned char    *dat = cmd->data;
+  int status;
 
+  /* check values */
+  if(neighbour > G3PLC_MAX_TABLE)
+    return G3PLC_SND_INVALID_PARAM;
+  if(device > G3PLC_MAX_TABLE)
+    return G3PLC_SND_INVALID_PARAM;
+  if(pan < 1 || pan > 128)
+    return G3PLC_SND_INVALID_PARAM;
+
+  /* the command buffer is shared by the senders */
+  SND_LOCK();
   *cmd = (struct g3plc_cmd){
     .reserved = 0,
     .type     = G3PLC_TYPE_G3,
-    .idc      = G3PLC_CHAN0,
+    .idc      = chan,
     .ida      = G3PLC_IDA_REQUEST,
     .idp      = G3PLC_IDP_G3CTR,
     .cmd      = G3PLC_CMD_G3_INIT
   };
 
-  /* check values */
-  if(neighbour > 1536)
-    return G3PLC_SND_INVALID_PARAM;
-  if(device > 1536)
-    return G3PLC_SND_INVALID_PARAM;
-  if(pan < 1 || pan > 128)
-    return G3PLC_SND_INVALID_PARAM;
-
   *(uint8_t  *)dat = 0x03; dat += sizeof(uint8_t); /* g3mode */
-  *(uint16_t *)dat = g3plc_conf.htons(neighbour); dat += sizeof(uint16_t);
-  *(uint16_t *)dat = g3plc_conf.htons(device);    dat += sizeof(uint16_t);
-  *(uint16_t *)dat = g3plc_conf.htons(pan);       dat += sizeof(uint16_t);
+  *(uint16_t *)dat = BO_HTONS(ctx->conf, neighbour); dat += sizeof(uint16_t);
+  *(uint16_t *)dat = BO_HTONS(ctx->conf, device);    dat += sizeof(uint16_t);
+  *(uint16_t *)dat = BO_HTONS(ctx->conf, pan);       dat += sizeof(uint16_t);
+
+  status = send_command(ctx, cmd, dat - ctx->snd_cmdbuf, NULL, 0);
+  SND_UNLOCK();
 
-  return g3plc_command(cmd, dat - snd_cmdbuf);
+  return status;
 }
 
-static int g3_setconfig_request(uint8_t  bandplan, /* band plan */
-                                uint64_t extaddr   /* extended address */ )
+static int g3_setconfig_request(struct g3plc_ctx *ctx, unsigned int chan, /* G3 channel */
+                                uint8_t  bandplan,  /* band plan */
+                                uint64_t extaddr    /* extended address */ )
 {
-  struct g3plc_cmd *cmd = (struct g3plc_cmd *)snd_cmdbuf;
+  struct g3plc_cmd *cmd = (struct g3plc_cmd *)ctx->snd_cmdbuf;
   unsigned char    *dat = cmd->data;
+  int status;
 
+  /* the command buffer is shared by the senders */
+  SND_LOCK();
   *cmd = (struct g3plc_cmd){
     .reserved = 0,
     .type     = G3PLC_TYPE_G3,
-    .idc      = G3PLC_CHAN0,
+    .idc      = chan,
     .ida      = G3PLC_IDA_REQUEST,
     .idp      = G3PLC_IDP_G3CTR,
     .cmd      = G3PLC_CMD_G3_SETCONFIG
@@ -127,20 +153,27 @@ static int g3_setconfig_request(uint8_t  bandplan, /* band plan */
   *(uint8_t  *)dat = 0x03;            dat += sizeof(uint8_t);  /* g3mode */
   *(uint8_t  *)dat = bandplan;        dat += sizeof(uint8_t);
   *(uint32_t *)dat = 0;               dat += sizeof(uint32_t); /* reserved */
-  *(uint64_t *)dat = htonll(extaddr); dat += sizeof(uint64_t);
+  *(uint64_t *)dat = htonll(ctx, extaddr); dat += sizeof(uint64_t);
+
+  status = send_command(ctx, cmd, dat - ctx->snd_cmdbuf, NULL, 0);
+  SND_UNLOCK();
 
-  return g3plc_command(cmd, dat - snd_cmdbuf);
+  return status;
 }
 
-static int mlme_reset_request(uint8_t default_pib /* reset PIB to default (1) or not (0) */ )
+static int mlme_reset_request(struct g3plc_ctx *ctx, unsigned int chan,   /* G3 channel */
+                              uint8_t default_pib  /* reset PIB to default (1) or not (0) */ )
 {
-  struct g3plc_cmd *cmd = (struct g3plc_cmd *)snd_cmdbuf;
+  struct g3plc_cmd *cmd = (struct g3plc_cmd *)ctx->snd_cmdbuf;
   unsigned char    *dat = cmd->data;
+  int status;
 
+  /* the command buffer is shared by the senders */
+  SND_LOCK();
   *cmd = (struct g3plc_cmd){
     .reserved = 0,
     .type     = G3PLC_TYPE_G3,
-    .idc      = G3PLC_CHAN0,
+    .idc      = chan,
     .ida      = G3PLC_IDA_REQUEST,
     .idp      = G3PLC_IDP_UMAC,
     .cmd      = G3PLC_CMD_MLME_RESET
@@ -148,538 +181,2340 @@ static int mlme_reset_request(uint8_t default_pib /* reset PIB to default (1) or
 
   *(uint8_t *)dat = default_pib; dat += sizeof(uint8_t);
 
-  return g3plc_command(cmd, dat - snd_cmdbuf);
+  status = send_command(ctx, cmd, dat - ctx->snd_cmdbuf, NULL, 0);
+  SND_UNLOCK();
+
+  return status;
 }
 
-static int mlme_set_request(uint16_t attr_id,    /* PIB attribute ID */
+static int mlme_set_request(struct g3plc_ctx *ctx, unsigned int chan,   /* G3 channel */
+                            uint16_t attr_id,    /* PIB attribute ID */
                             uint16_t attr_idx,   /* index within the table for PIB attribute */
-                            unsigned char *attr, /* attribute value */
+                            const void *attr,    /* attribute value */
                             unsigned int size    /* attribute size */ )
 {
-  struct g3plc_cmd *cmd = (struct g3plc_cmd *)snd_cmdbuf;
+  struct g3plc_cmd *cmd = (struct g3plc_cmd *)ctx->snd_cmdbuf;
   unsigned char    *dat = cmd->data;
+  int status;
 
+  /* the command buffer is shared by the senders */
+  SND_LOCK();
   *cmd = (struct g3plc_cmd){
     .reserved = 0,
     .type     = G3PLC_TYPE_G3,
-    .idc      = G3PLC_CHAN0,
+    .idc      = chan,
     .ida      = G3PLC_IDA_REQUEST,
     .idp      = G3PLC_IDP_UMAC,
     .cmd      = G3PLC_CMD_MLME_SET
   };
 
-  *(uint16_t  *)dat = g3plc_conf.htons(attr_id);  dat += sizeof(uint16_t);
-  *(uint16_t  *)dat = g3plc_conf.htons(attr_idx); dat += sizeof(uint16_t);
+  *(uint16_t  *)dat = BO_HTONS(ctx->conf, attr_id);  dat += sizeof(uint16_t);
+  *(uint16_t  *)dat = BO_HTONS(ctx->conf, attr_idx); dat += sizeof(uint16_t);
 
   /* copy attribute value */
   memcpy(dat, attr, size);
   dat += size;
 
-  return g3plc_command(cmd, dat - snd_cmdbuf);
+  status = send_command(ctx, cmd, dat - ctx->snd_cmdbuf, NULL, 0);
+  SND_UNLOCK();
+
+  return status;
 }
 
-static int mlme_start_request(uint8_t pan /* PAN ID */ )
+static int mlme_get_request(struct g3plc_ctx *ctx, uint16_t attr_id,  /* PIB attribute ID */
+                            uint16_t attr_idx  /* index within the table for PIB attribute */ )
 {
-  struct g3plc_cmd *cmd = (struct g3plc_cmd *)snd_cmdbuf;
+  struct g3plc_cmd *cmd = (struct g3plc_cmd *)ctx->snd_cmdbuf;
   unsigned char    *dat = cmd->data;
+  int status;
 
+  /* the command buffer is shared by the senders */
+  SND_LOCK();
   *cmd = (struct g3plc_cmd){
     .reserved = 0,
     .type     = G3PLC_TYPE_G3,
     .idc      = G3PLC_CHAN0,
     .ida      = G3PLC_IDA_REQUEST,
     .idp      = G3PLC_IDP_UMAC,
-    .cmd      = G3PLC_CMD_MLME_START
+    .cmd      = G3PLC_CMD_MLME_GET
   };
 
-  *(uint16_t *)dat = g3plc_conf.htons(pan); dat += sizeof(uint16_t);
+  *(uint16_t  *)dat = BO_HTONS(ctx->conf, attr_id);  dat += sizeof(uint16_t);
+  *(uint16_t  *)dat = BO_HTONS(ctx->conf, attr_idx); dat += sizeof(uint16_t);
 
-  return g3plc_command(cmd, dat - snd_cmdbuf);
-}
+  status = send_command(ctx, cmd, dat - ctx->snd_cmdbuf, NULL, 0);
+  SND_UNLOCK();
 
-void g3plc_init(const struct g3plc_config *conf)
-{
-  g3plc_conf = *conf;
+  return status;
 }
 
-/* Execute a request and wait for confirmation.
-   Return from the function that called the macro
-   with an error if a problem occured. */
-#define xconfirm_(fun, confirm, ...) do {  \
-    const unsigned char *d;                      \
-    x_(fun, __VA_ARGS__);                        \
-    d = wait_for_cmd(confirm);                   \
-    if(!d)                                       \
-      return G3PLC_INIT_CMD_TIMEOUT;             \
-    free_cmd_data();                             \
-  } while(0)
-int g3plc_start(void)
+static int mlme_start_request(struct g3plc_ctx *ctx, unsigned int chan, /* G3 channel */
+                              uint16_t pan       /* PAN ID */ )
 {
-  uint16_t u16;
-  uint8_t  u8;
+  struct g3plc_cmd *cmd = (struct g3plc_cmd *)ctx->snd_cmdbuf;
+  unsigned char    *dat = cmd->data;
+  int status;
+
+  /* the command buffer is shared by the senders */
+  SND_LOCK();
+  *cmd = (struct g3plc_cmd){
+    .reserved = 0,
+    .type     = G3PLC_TYPE_G3,
+    .idc      = chan,
+    .ida      = G3PLC_IDA_REQUEST,
+    .idp      = G3PLC_IDP_UMAC,
+    .cmd      = G3PLC_CMD_MLME_START
+  };
 
-  /* init G3-PLC */
-  xconfirm_(g3_init_request,
-            G3PLC_G3_INIT_CONFIRM,
-            500 /* neighbour tables */,
-            500 /* device tables */,
-            1   /* pan in sc an */ );
-
-  /* set config */
-  xconfirm_(g3_setconfig_request,
-            G3PLC_G3_SETCONFIG_CONFIRM,
-            g3plc_conf.bandplan,
-            g3plc_conf.ext_address );
-
-  xconfirm_(mlme_reset_request,
-            G3PLC_MLME_RESET_CONFIRM,
-            1); /* MLME reset */
-
-  /* configure short address */
-  u16 = g3plc_conf.mac_address;
-  xconfirm_(mlme_set_request,
-            G3PLC_MLME_SET_CONFIRM,
-            G3PLC_ATTR_SHORTADDR,
-            0 /* attr idx */,
-            (unsigned char *)&u16,
-            sizeof(u16));
-
-  /* configure PAN ID */
-  u16 = g3plc_conf.pan_id;
-  xconfirm_(mlme_set_request,
-            G3PLC_MLME_SET_CONFIRM,
-            G3PLC_ATTR_PANID,
-            0 /* attr id x */,
-            (unsigned char *)&u16,
-            sizeof(u16));
-
-  /* configure max retrans */
-  u8 = g3plc_conf.retrans;
-  xconfirm_(mlme_set_request,
-            G3PLC_MLME_SET_CONFIRM,
-            G3PLC_ATTR_RETRANS,
-            0 /* attr idx */,
-            (unsigned char *)&u8,
-            sizeof(u8));
-
-  /* configure promiscuous mode */
-  if(g3plc_conf.flags & G3PLC_INVALID) {
-    u8 = 1; /* true */
-    xconfirm_(mlme_set_request,
-              G3PLC_MLME_SET_CONFIRM,
-              G3PLC_ATTR_PROMISCUOUS,
-              0 /* attr idx */,
-              (unsigned char *)&u8,
-              sizeof(u8));
-  }
-
-  /* start MLME */
-  xconfirm_(mlme_start_request,
-            G3PLC_MLME_START_CONFIRM,
-            g3plc_conf.pan_id);
+  *(uint16_t *)dat = BO_HTONS(ctx->conf, pan); dat += sizeof(uint16_t);
 
-  return G3PLC_INIT_SUCCESS;
+  status = send_command(ctx, cmd, dat - ctx->snd_cmdbuf, NULL, 0);
+  SND_UNLOCK();
+
+  return status;
 }
 
-int g3plc_command(struct g3plc_cmd *cmd, unsigned int size)
+static void init_handlers(struct g3plc_ctx *ctx);
+static void init_data_tmpl(struct g3plc_ctx *ctx, unsigned int chan);
+
+void g3plc_init(struct g3plc_ctx *ctx, const struct g3plc_config *conf)
 {
-  if(size < sizeof(struct g3plc_cmd))
-    return G3PLC_SND_INVALID_HDR;
+  unsigned int chan;
+
+  /* The image may have changed, nothing is kept from a previous run. */
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->conf         = *conf;
+  ctx->current_baud = &default_baud;
+  ctx->boot_sm.slot = -1;
+  neigh_init(&ctx->neighbours);
+
+  ctx->chans[G3PLC_CHAN0] = (struct g3plc_chan_conf){ .bandplan    = ctx->conf.bandplan,
+                                                      .pan_id      = ctx->conf.pan_id,
+                                                      .mac_address = ctx->conf.mac_address,
+                                                      .ext_address = ctx->conf.ext_address };
+  ctx->nchans = 1;
+  if(ctx->conf.chan1) {
+    ctx->chans[G3PLC_CHAN1] = *ctx->conf.chan1;
+    ctx->nchans = 2;
+  }
+  init_handlers(ctx);
+  for(chan = G3PLC_CHAN0 ; chan < ctx->nchans ; chan++)
+    init_data_tmpl(ctx, chan);
+
+  if(!ctx->conf.neighbour_table)
+    ctx->conf.neighbour_table = G3PLC_NEIGHBOUR_TABLE;
+  if(!ctx->conf.device_table)
+    ctx->conf.device_table = G3PLC_DEVICE_TABLE;
+  if(!ctx->conf.pan_scans)
+    ctx->conf.pan_scans = G3PLC_PAN_SCANS;
+
+  if(!ctx->conf.firmware) {
+    ctx->conf.firmware      = cpx_firmware;
+    ctx->conf.firmware_size = sizeof(cpx_firmware);
+  }
+}
 
-#ifdef VERBOSE_DEBUG
-  puts(">> SEND:");
-  g3plc_print_cmd(cmd, size);
-  putchar('\n');
-#endif
+/* Literal of a command on another channel. */
+static uint32_t chan_literal(uint32_t literal, unsigned int chan)
+{
+  union {
+    uint32_t         u32;
+    struct g3plc_cmd c;
+  } u = { .u32 = literal };
 
-  hton_g3plc_cmd(cmd);                                        /* network order */
-  append_crc(&g3plc_conf, (unsigned char *)cmd, &size);       /* apply CRC */
-  size = pack(snd_cmdbuf_packed, (unsigned char *)cmd, size); /* HDLC */
-  return g3plc_conf.uart_send(snd_cmdbuf_packed, size);       /* send command */
+  u.c.idc = chan;
+  return u.u32;
 }
 
-const unsigned char * wait_for_cmd(uint32_t cmd_literal)
+/* Reserve a slot for a command literal.
+   The slot must be reserved before the request is
+   sent so that we don't miss an early confirmation.
+   The payload is copied into the supplied buffer, or
+   into the slot buffer if NULL. In the later case the
+   slot is kept until free_cmd_data() is called.
+   Returns the slot index or -1 if no slot is free. */
+static int reserve_slot(struct g3plc_ctx *ctx, uint32_t cmd_literal, void *buf, unsigned int size)
 {
-  /* fail if previous wait was not freed correctly */
-  if(waited_cmd_data)
-    return NULL;
+  int i;
+
+  LOCK();
+  for(i = 0 ; i < G3PLC_MAX_WAITERS ; i++) {
+    struct g3plc_slot *slot = &ctx->cmd_slots[i];
 
-  waited_cmd_literal = cmd_literal;
+    if(slot->used)
+      continue;
 
-  g3plc_conf.start_timer(g3plc_conf.timeout);
-  g3plc_conf.wait_timer();
+    slot->used     = 1;
+    slot->done     = 0;
+    slot->literal  = cmd_literal;
+    slot->buf      = buf ? buf : slot->data;
+    slot->buf_size = buf ? size : G3PLC_MAX_CMD;
+    ctx->conf.arm_slot(i, ctx->conf.data);
+
+    UNLOCK();
+    return i;
+  }
+  UNLOCK();
 
-  return waited_cmd_data;
+  return -1;
 }
 
-void free_cmd_data(void)
+static void release_slot(struct g3plc_ctx *ctx, int i)
 {
-  free(waited_cmd_data);
-  waited_cmd_data    = NULL;
-  waited_cmd_literal = 0;
+  LOCK();
+  ctx->cmd_slots[i].used = 0;
+  UNLOCK();
 }
 
-int g3plc_send(uint16_t dst, const void *payload, unsigned int payload_size)
+/* Wait on a reserved slot.
+   The slot is released on timeout or when the
+   payload was copied into a caller buffer.
+   Returns the size of the received payload
+   or -1 on timeout. */
+static int wait_on_slot_us(struct g3plc_ctx *ctx, int i, unsigned int us)
 {
-  struct g3plc_cmd    *cmd = (struct g3plc_cmd *)snd_cmdbuf;
-  unsigned char       *dat = cmd->data;
-  const unsigned char *confirmation;
-  int status;
+  struct g3plc_slot *slot;
+  int size = -1;
 
-  *cmd = (struct g3plc_cmd){
-    .reserved = 0,
-    .type     = G3PLC_TYPE_G3,
-    .idc      = G3PLC_CHAN0,
-    .ida      = G3PLC_IDA_REQUEST,
-    .idp      = G3PLC_IDP_UMAC,
-    .cmd      = G3PLC_CMD_MCPS_DATA
-  };
+  if(i < 0)
+    return -1;
+  slot = &ctx->cmd_slots[i];
 
-  /* check payload length */
-  if(payload_size > G3PLC_MAX_PAYLOAD)
-    return G3PLC_SND_TOOLONG;
+  ctx->conf.wait_slot(i, us, ctx->conf.data);
 
-  /* assemble frame */
-  *(uint8_t *)dat = 0x02; dat += sizeof(uint8_t); /* src addr type (16-bit short addr) */
-  *(uint8_t *)dat = 0x02; dat += sizeof(uint8_t); /* dst addr type (16-bit short addr) */
+  LOCK();
+  if(slot->done)
+    size = slot->size;
+  if(!slot->done || slot->buf != slot->data)
+    slot->used = 0;
+  UNLOCK();
 
-  /* destination PAN ID */
-  *(uint16_t *)dat = g3plc_conf.htons(g3plc_conf.pan_id);
-  dat += sizeof(uint16_t);
+  return size;
+}
 
-  /* destination address */
-  memset(dat, 0, 8);
-  *(uint16_t *)dat = g3plc_conf.htons(dst); dat += 8;
+static int wait_on_slot(struct g3plc_ctx *ctx, int i)
+{
+  return wait_on_slot_us(ctx, i, ctx->conf.timeout);
+}
 
-  /* MSDU length */
-  *(uint16_t *)dat = g3plc_conf.htons(payload_size);
-  dat += sizeof(uint16_t);
+/* Return the confirm timeout estimator of a destination
+   or NULL when the timeout is fixed. Must be called with
+   the lock. */
+static struct rto * lookup_rto(struct g3plc_ctx *ctx, uint16_t dst)
+{
+  struct g3plc_rto_peer *peer = &ctx->rto_peers[dst % G3PLC_RTO_PEERS];
+
+  if(!ctx->conf.min_timeout || !ctx->conf.clock)
+    return NULL;
+
+  if(!peer->used || peer->addr != dst) {
+    peer->used = 1;
+    peer->addr = dst;
+    rto_init(&peer->rto, ctx->conf.min_timeout, ctx->conf.timeout);
+  }
 
-  *(uint8_t *)dat = 0x00; dat += sizeof(uint8_t); /* MSDU handle */
+  return &peer->rto;
+}
 
-  /* TX options */
-  *(uint8_t *)dat = g3plc_conf.flags & G3PLC_NOACK ? 0x00 : 0x01;
-  dat += sizeof(uint8_t);
+static unsigned int confirm_timeout(struct g3plc_ctx *ctx, uint16_t dst)
+{
+  unsigned int us = ctx->conf.timeout;
+  struct rto *rto;
 
-  /* security level
-     key identification mode
-     key source
-     key index
-     QoS */
-  memset(dat, 0, 12); dat += 12;
+  LOCK();
+  rto = lookup_rto(ctx, dst);
+  if(rto)
+    us = rto_timeout(rto);
+  UNLOCK();
 
-  /* copy payload */
-  memcpy(dat, payload, payload_size);
-  dat += payload_size;
+  return us;
+}
 
-  /* send command to device */
-  status = g3plc_command(cmd, dat - snd_cmdbuf);
-  if(status)
-    return status;
+/* The modem retransmits by itself so every
+   confirm is a sample of its own request. */
+static void confirm_update(struct g3plc_ctx *ctx, uint16_t dst, unsigned long begin, int confirmed)
+{
+  struct rto *rto;
+
+  LOCK();
+  rto = lookup_rto(ctx, dst);
+  if(rto && confirmed)
+    rto_sample(rto, ctx->conf.clock(ctx->conf.data) - begin);
+  else if(rto)
+    rto_backoff(rto);
+  UNLOCK();
+}
 
-  confirmation = wait_for_cmd(G3PLC_MCPS_DATA_CONFIRM);
-  if(!confirmation)
-    return G3PLC_SND_CONFIRM;
-  status = confirmation[1];
+/* Find an attribute in the cache, must be called with the lock. */
+static struct g3plc_pib_entry * lookup_pib(struct g3plc_ctx *ctx, uint16_t id, uint16_t idx)
+{
+  unsigned int i;
 
-  free_cmd_data();
+  for(i = 0 ; i < G3PLC_PIB_CACHE ; i++) {
+    struct g3plc_pib_entry *entry = &ctx->pib_cache[i];
 
-  switch(status) {
-  case R_G3MAC_STATUS_SUCCESS:
-    return G3PLC_SND_SUCCESS;
-  case R_G3MAC_STATUS_CHANNEL_ACCESS_FAILURE:
-    return G3PLC_SND_ACCESS;
-  case R_G3MAC_STATUS_FRAME_TOO_LONG:
-    return G3PLC_SND_TOOLONG;
-  case R_G3MAC_STATUS_INVALID_PARAMETER:
-    return G3PLC_SND_INVALID_PARAM;
-  case R_G3MAC_STATUS_OUT_OF_CAP:
-    return G3PLC_SND_OOM;
-  case R_G3MAC_STATUS_NO_ACK:
-    return G3PLC_SND_NOACK;
-  default:
-    return G3PLC_SND_FAILURE;
+    if(entry->used && entry->id == id && entry->idx == idx)
+      return entry;
   }
+
+  return NULL;
 }
 
-static int mcps_data_indication(const unsigned char *data,
-                                unsigned int size)
+static void invalidate_pib(struct g3plc_ctx *ctx, uint16_t id, uint16_t idx)
 {
-  static struct g3plc_data_hdr hdr;
-  const unsigned char *d = data;
-  const unsigned char *payload;
-  unsigned int len;
+  struct g3plc_pib_entry *entry;
 
-  memset(&hdr, 0, sizeof(struct g3plc_data_hdr));
+  LOCK();
+  entry = lookup_pib(ctx, id, idx);
+  if(entry)
+    entry->used = 0;
+  UNLOCK();
+}
 
-  if(size < 24)
-    return G3PLC_RCV_INVALID_HDR;
-  size -= 24;
+static void flush_pib(struct g3plc_ctx *ctx)
+{
+  LOCK();
+  memset(ctx->pib_cache, 0, sizeof(ctx->pib_cache));
+  UNLOCK();
+}
+
+int g3plc_get_attr(struct g3plc_ctx *ctx, uint16_t id, uint16_t idx, void *value, unsigned int *size)
+{
+  /* status, attribute ID and index followed by the value */
+  unsigned char buf[5 + G3PLC_PIB_MAX_SIZE];
+  struct g3plc_pib_entry *entry;
+  int slot;
+  int n;
 
-  /* source */
-  hdr.src_mode  = *(uint8_t *)d; d += sizeof(uint8_t);
-  hdr.src_pan   = g3plc_conf.ntohs(*(uint16_t *)d); d += sizeof(uint16_t);
-  hdr.src_addr  = ntohll(*(uint64_t *)d); d += sizeof(uint64_t);
+  LOCK();
+  entry = lookup_pib(ctx, id, idx);
+  if(entry) {
+    n = entry->size < *size ? entry->size : *size;
+    memcpy(value, entry->value, n);
+    *size = entry->size;
+    UNLOCK();
+    return G3PLC_INIT_SUCCESS;
+  }
+  UNLOCK();
 
-  /* destination */
-  hdr.dst_mode  = *(uint8_t *)d; d += sizeof(uint8_t);
-  hdr.dst_pan   = g3plc_conf.ntohs(*(uint16_t *)d); d += sizeof(uint16_t);
-  hdr.dst_addr  = ntohll(*(uint64_t *)d); d += sizeof(uint64_t);
+  slot = reserve_slot(ctx, G3PLC_MLME_GET_CONFIRM, buf, sizeof(buf));
+  if(slot < 0)
+    return G3PLC_INIT_CMD_TIMEOUT;
 
-  /* MSDU length */
-  len = g3plc_conf.ntohs(*(uint16_t *)d); d += sizeof(uint16_t);
+  n = mlme_get_request(ctx, id, idx);
+  if(n) {
+    release_slot(ctx, slot);
+    return n;
+  }
 
-  if(size < len)
-    return G3PLC_RCV_INVALID_HDR;
-  size -= len;
+  n = wait_on_slot(ctx, slot);
+  if(n < 0)
+    return G3PLC_INIT_CMD_TIMEOUT;
+  if(n < 5 || buf[0] != 0)
+    return G3PLC_INIT_START_ERROR;
+  n -= 5;
+  if(n > G3PLC_PIB_MAX_SIZE)
+    n = G3PLC_PIB_MAX_SIZE;
+
+  LOCK();
+  entry = &ctx->pib_cache[ctx->pib_next++ % G3PLC_PIB_CACHE];
+  *entry = (struct g3plc_pib_entry){ .used = 1,
+                                     .id   = id,
+                                     .idx  = idx,
+                                     .size = n };
+  memcpy(entry->value, buf + 5, n);
+  UNLOCK();
+
+  memcpy(value, buf + 5, (unsigned int)n < *size ? (unsigned int)n : *size);
+  *size = n;
 
-  payload = d;
+  return G3PLC_INIT_SUCCESS;
+}
 
-  /* remaining fields are ignored for now */
+/* Check a reserved slot without waiting.
+   Return 1 with the size of the received payload
+   when the slot is done or 0 otherwise. Like
+   wait_on_slot() the slot is released when the
+   payload was copied into a caller buffer. */
+static int poll_slot(struct g3plc_ctx *ctx, int i, int *size)
+{
+  struct g3plc_slot *slot = &ctx->cmd_slots[i];
+  int done;
+
+  LOCK();
+  done = slot->done;
+  if(done) {
+    *size = slot->size;
+    if(slot->buf != slot->data)
+      slot->used = 0;
+  }
+  UNLOCK();
 
-  /* call cb_recv */
-  CB(cb_recv, &hdr, payload, len, G3PLC_RCV_SUCCESS, g3plc_conf.data);
-  return G3PLC_RCV_SUCCESS;
+  return done;
 }
 
-int dissector(const struct g3plc_cmd *cmd, unsigned int size)
+/* Queue as many MLME-SET requests as we have free slots. All the
+   confirmations have the same literal, the dissector gives them to
+   the lowest slot first, that is in request order. The number of
+   requests sent is stored in count. */
+static int send_attrs(struct g3plc_ctx *ctx, unsigned int chan,
+                      const struct g3plc_pib *attrs, unsigned int nattrs,
+                      struct g3plc_cmd_wait *batch, unsigned int *count)
 {
-  uint32_t literal_cmd = LITERAL_G3PLC_CMD(*cmd);
+  unsigned int n;
+  int err = G3PLC_INIT_SUCCESS;
 
-  /* we are generally only interested in the command data size */
-  size -= sizeof(struct g3plc_cmd);
+  for(n = 0 ; n < G3PLC_MAX_WAITERS && n < nattrs ; n++) {
+    const struct g3plc_pib *attr = &attrs[n];
 
-  /* check for any waited confirmation/indication */
-  if(literal_cmd == waited_cmd_literal) {
-    waited_cmd_literal = 0;
+    if(attr->size > G3PLC_MAX_CMD - sizeof(struct g3plc_cmd) - 2 * sizeof(uint16_t)) {
+      err = G3PLC_INIT_START_ERROR;
+      break;
+    }
 
-    /* we always duplicate the data to avoid side effect */
-    waited_cmd_data = malloc(size);
-    memcpy(waited_cmd_data, cmd->data, size);
+    /* only the first channel is cached */
+    if(chan == G3PLC_CHAN0)
+      invalidate_pib(ctx, attr->id, attr->idx);
 
-    g3plc_conf.stop_timer();
-  }
+    batch[n] = (struct g3plc_cmd_wait){ .slot = -1 };
+    batch[n].slot = reserve_slot(ctx, chan_literal(G3PLC_MLME_SET_CONFIRM, chan),
+                                 batch[n].status, sizeof(batch[n].status));
+    if(batch[n].slot < 0)
+      break;
 
-  /* parse command packets */
-  if(literal_cmd == G3PLC_MCPS_DATA_INDICATION)
-    return mcps_data_indication(cmd->data, size);
+    err = mlme_set_request(ctx, chan, attr->id, attr->idx, attr->value, attr->size);
+    if(err) {
+      release_slot(ctx, batch[n].slot);
+      break;
+    }
+  }
+  if(!n && !err)
+    err = G3PLC_INIT_CMD_TIMEOUT; /* no free slot */
 
-  /* ignore anything else */
-  return G3PLC_RCV_IGNORED;
+  *count = n;
+  return err;
 }
 
-int g3plc_recv_frame(void)
+/* Status of a request once its confirmation was waited on. */
+static int wait_status(const struct g3plc_cmd_wait *wait, int size)
 {
-  struct g3plc_cmd *cmd = (struct g3plc_cmd *)rcv_cmdbuf;
-  unsigned int size = unpack(rcv_cmdbuf, rcv_cmdbuf_packed, rcv_size);
-  int ret, status = G3PLC_RCV_SUCCESS;
+  if(size < 0)
+    return G3PLC_INIT_CMD_TIMEOUT;
+  if(size >= 1 && wait->status[0])
+    return G3PLC_INIT_START_ERROR;
+  return G3PLC_INIT_SUCCESS;
+}
 
-  /* check that we at least have a valid command packet */
-  if(size < (sizeof(struct g3plc_cmd) + sizeof(uint32_t))) {
-    status = G3PLC_RCV_INVALID_HDR;
-    goto PARSING_COMPLETE;
+/* The start sequence is a state machine advanced on each
+   confirmation (see g3plc_start_resume()) so that it can
+   run from an event loop. Each state sends its requests
+   and waits for all of their confirmations. g3plc_start()
+   drives it with wait_slot(). */
+enum start_state {
+  START_IDLE,
+  START_INIT,       /* G3 INIT */
+  START_SETCONFIG,  /* G3 SETCONFIG */
+  START_RESET,      /* MLME-RESET */
+  START_ATTRS,      /* short address, PAN ID, max retrans and promiscuous mode */
+  START_USER_ATTRS, /* attributes from g3plc_config */
+  START_MLME        /* MLME-START */
+};
+
+/* Literal of the confirmation of each single request state. */
+static uint32_t start_confirm(struct g3plc_ctx *ctx, enum start_state state)
+{
+  struct g3plc_start_sm *sm = &ctx->start_sm;
+
+  switch(state) {
+  case START_INIT:
+    return chan_literal(G3PLC_G3_INIT_CONFIRM, sm->chan);
+  case START_SETCONFIG:
+    return chan_literal(G3PLC_G3_SETCONFIG_CONFIRM, sm->chan);
+  case START_RESET:
+    return chan_literal(G3PLC_MLME_RESET_CONFIRM, sm->chan);
+  default:
+    return chan_literal(G3PLC_MLME_START_CONFIRM, sm->chan);
   }
+}
 
-  /* extract and check CRC */
-  ret = extract_crc(&g3plc_conf, rcv_cmdbuf, &size);
-  if(!ret) {
-    status = G3PLC_RCV_INVALID_CRC;
-    goto PARSING_COMPLETE;
-  }
+/* Enter a state and send its requests. */
+static int start_enter(struct g3plc_ctx *ctx, enum start_state state)
+{
+  struct g3plc_start_sm *sm = &ctx->start_sm;
+  const struct g3plc_chan_conf *chan = &ctx->chans[sm->chan];
+  struct g3plc_cmd_wait *wait = &sm->waits[0];
+  int n;
 
-  /* convert command to host order */
-  ntoh_g3plc_cmd(cmd);
+  sm->state     = state;
+  sm->nwaits    = 0;
+  sm->confirmed = 0;
+  sm->err       = G3PLC_INIT_SUCCESS;
 
-PARSING_COMPLETE:
-  /* based on parsing status and iface_flags
-     we either return directly or pass the
-     command packet to the dissectors */
-  switch(status) {
-  case G3PLC_RCV_INVALID_CRC:
-  case G3PLC_RCV_INVALID_HDR:
-    if(!(g3plc_conf.flags & G3PLC_INVALID))
-      return status;
+  if(state == START_ATTRS || state == START_USER_ATTRS) {
+    n = send_attrs(ctx, sm->chan, sm->attrs + sm->next, sm->nattrs - sm->next,
+                   sm->waits, &sm->nwaits);
+    sm->next += sm->nwaits;
+    sm->err   = n;
+
+    if(!sm->nwaits) {
+      sm->state = START_IDLE;
+      return n;
+    }
+    return G3PLC_INIT_PENDING;
   }
 
-#ifdef VERBOSE_DEBUG
-  puts("<< RECV:");
-  g3plc_print_cmd(cmd, size);
-  putchar('\n');
-#endif
+  /* Use a discarded payload, only the
+     confirmation of the request matters. */
+  *wait = (struct g3plc_cmd_wait){ .slot = reserve_slot(ctx, start_confirm(ctx, state), wait->status, 0) };
+  if(wait->slot < 0) {
+    sm->state = START_IDLE;
+    return G3PLC_INIT_CMD_TIMEOUT;
+  }
 
-  CB(raw, cmd, size, status, g3plc_conf.data);
+  switch(state) {
+  case START_INIT:
+    n = g3_init_request(ctx, sm->chan,
+                        ctx->conf.neighbour_table,
+                        ctx->conf.device_table,
+                        ctx->conf.pan_scans);
+    break;
+  case START_SETCONFIG:
+    n = g3_setconfig_request(ctx, sm->chan, chan->bandplan, chan->ext_address);
+    break;
+  case START_RESET:
+    n = mlme_reset_request(ctx, sm->chan, 1); /* MLME reset */
+    break;
+  default:
+    n = mlme_start_request(ctx, sm->chan, chan->pan_id);
+    break;
+  }
 
-  if(status == G3PLC_RCV_SUCCESS)
-    status = dissector(cmd, size);
-  return status;
+  if(n) {
+    release_slot(ctx, wait->slot);
+    sm->state = START_IDLE;
+    return n;
+  }
+
+  sm->nwaits = 1;
+  return G3PLC_INIT_PENDING;
 }
 
-int g3plc_uart_putc(unsigned char c)
+/* Enter an attributes state, skipped when there is no attribute. */
+static int start_next(struct g3plc_ctx *ctx);
+static int start_chan(struct g3plc_ctx *ctx, unsigned int chan);
+static int start_attrs(struct g3plc_ctx *ctx, enum start_state state,
+                       const struct g3plc_pib *attrs, unsigned int nattrs)
 {
-  /* Just writing out the FSM of what the code
-     below actually does:
-
-      (out-of-frame):
-         0x7e -> write-to-buf; (in-frame)
-         _    -> ignore; (out-of-frame)
-      (in-frame):
-         0x7e -> write-to-buf; message-received; (out-of-frame)
-         _    -> write-to-buf; (in-frame)
-
-     We make the distinction between the two states
-     by checking whether we are at the beginning of the
-     receive buffer or not. */
-  static unsigned char *rcv_ptr = rcv_cmdbuf_packed;
+  struct g3plc_start_sm *sm = &ctx->start_sm;
 
-  if(rcv_ptr == rcv_cmdbuf_packed) {
-    /* state (out-of-frame) */
+  sm->attrs  = attrs;
+  sm->nattrs = nattrs;
+  sm->next   = 0;
 
-    if(c == 0x7e)
-      *rcv_ptr++ = c;      /* write-to-buf; state <- (in-frame) */
-    return G3PLC_RCV_CONT; /* ignore */
+  if(!nattrs) {
+    sm->state = state;
+    return start_next(ctx);
   }
-  else {
-    /* state (in-frame) */
 
-    *rcv_ptr++ = c; /* write-to-buf */
+  return start_enter(ctx, state);
+}
 
-    if(c == 0x7e) {
-      /* message-received
-         state <- (out-of-frame) */
-      rcv_size = rcv_ptr - rcv_cmdbuf_packed;
-      rcv_ptr  = rcv_cmdbuf_packed;
-      return g3plc_conf.recv_frame();
-    }
-    else
-      return G3PLC_RCV_CONT;
+/* All the requests of the current state are confirmed. */
+static int start_next(struct g3plc_ctx *ctx)
+{
+  struct g3plc_start_sm *sm = &ctx->start_sm;
+
+  switch(sm->state) {
+  case START_INIT:
+    return start_enter(ctx, START_SETCONFIG);
+  case START_SETCONFIG:
+    return start_enter(ctx, START_RESET);
+  case START_RESET:
+    if(sm->chan == G3PLC_CHAN0)
+      flush_pib(ctx);
+    return start_attrs(ctx, START_ATTRS, sm->builtin, sm->nbuiltin);
+  case START_ATTRS:
+    if(sm->next < sm->nattrs)
+      return start_enter(ctx, START_ATTRS);
+    return start_attrs(ctx, START_USER_ATTRS, ctx->conf.attrs, ctx->conf.nattrs);
+  case START_USER_ATTRS:
+    if(sm->next < sm->nattrs)
+      return start_enter(ctx, START_USER_ATTRS);
+    return start_enter(ctx, START_MLME);
+  case START_MLME:
+    if(sm->chan + 1 < ctx->nchans)
+      return start_chan(ctx, sm->chan + 1);
+    sm->state = START_IDLE;
+    return G3PLC_INIT_SUCCESS;
+  default:
+    return G3PLC_INIT_START_ERROR;
   }
 }
 
-/* Send a single byte through UART.
-   We use this during the boot sequence to signal the device. */
-#define xsend_byte(c) x_(send_byte, c)
-static int send_byte(unsigned char c)
+/* Start the sequence again on another channel. */
+static int start_chan(struct g3plc_ctx *ctx, unsigned int chan)
 {
-  return g3plc_conf.uart_send(&c, 1);
+  struct g3plc_start_sm *sm = &ctx->start_sm;
+
+  sm->chan      = chan;
+  sm->shortaddr = ctx->chans[chan].mac_address;
+  sm->pan_id    = ctx->chans[chan].pan_id;
+
+  return start_enter(ctx, START_INIT);
 }
 
-/* Wait for the reception of a specific character before continuation.
-   We use this during the boot sequence to wait for signals from the device. */
-#define xwait_for_byte(c) x_(wait_for_byte, c)
-static int wait_for_byte(unsigned char c)
+int g3plc_start_begin(struct g3plc_ctx *ctx)
 {
-  unsigned char buf;
-  int r = g3plc_conf.uart_read(&buf, 1);
-  if(r < 0)
-    return r;
-
-  if(buf == c)
-    return G3PLC_INIT_SUCCESS;
-  else
-    return G3PLC_INIT_BOOT_ERROR;
+  struct g3plc_start_sm *sm = &ctx->start_sm;
+
+  *sm = (struct g3plc_start_sm){ .retrans     = ctx->conf.retrans,
+                                 .promiscuous = ctx->conf.flags & G3PLC_PROMISC ? 1 : 0 };
+
+  sm->builtin[0] = (struct g3plc_pib){ G3PLC_ATTR_SHORTADDR, 0, &sm->shortaddr, sizeof(sm->shortaddr) };
+  sm->builtin[1] = (struct g3plc_pib){ G3PLC_ATTR_PANID,     0, &sm->pan_id,    sizeof(sm->pan_id) };
+  sm->builtin[2] = (struct g3plc_pib){ G3PLC_ATTR_RETRANS,   0, &sm->retrans,   sizeof(sm->retrans) };
+  sm->nbuiltin   = 3;
+  if(ctx->conf.flags & G3PLC_SECURE)
+    sm->builtin[sm->nbuiltin++] = (struct g3plc_pib){ G3PLC_ATTR_KEY_TABLE, ctx->conf.key_index,
+                                                      ctx->conf.gmk, sizeof(ctx->conf.gmk) };
+  if(sm->promiscuous)
+    sm->builtin[sm->nbuiltin++] = (struct g3plc_pib){ G3PLC_ATTR_PROMISCUOUS, 0, &sm->promiscuous,
+                                                      sizeof(sm->promiscuous) };
+
+  return start_chan(ctx, G3PLC_CHAN0);
 }
 
-/* Send a program segment to the device. */
-#define xsend_segment(segno) x_(send_segment, segno)
-static int send_segment(unsigned int segno)
+int g3plc_start_resume(struct g3plc_ctx *ctx)
 {
-  int n;
+  struct g3plc_start_sm *sm = &ctx->start_sm;
+  int size;
 
-  /* FIXME: Technically we need le32toh() and htole32() here.
-     But we know that the renesas platform and Linux on RPi are LE.
-     So we are OK. */
-  const uint8_t *frmw_tbl    = cpx_firmware + 0x10;         /* firmware table */
-  const uint8_t *info_tbl    = frmw_tbl + (segno << 4);     /* info table for this segment */
-  uint32_t       offset      = *(uint32_t *)info_tbl;       /* program offset address in table */
-  uint32_t       size        = *(uint32_t *)(info_tbl + 8); /* program size */
+  if(sm->state == START_IDLE)
+    return G3PLC_INIT_START_ERROR;
 
-  /* send segment info table */
-  n = g3plc_conf.uart_send(info_tbl + sizeof(uint32_t), 12);
-  if(n < 0)
-    return n;
-  BPRG();
+  /* match the confirmations in request order */
+  while(sm->confirmed < sm->nwaits &&
+        poll_slot(ctx, sm->waits[sm->confirmed].slot, &size)) {
+    int n = wait_status(&sm->waits[sm->confirmed], size);
 
-  /* send segment */
-  while(size) {
-    unsigned int write_size = size > BOOT_SEGMENT_CHUNK ? BOOT_SEGMENT_CHUNK : size;
+    if(n && !sm->err)
+      sm->err = n;
+    sm->confirmed++;
+    sm->progress++;
+  }
 
-    n = g3plc_conf.uart_send(frmw_tbl + offset, write_size);
-    if(n < 0)
-      return n;
-    BPRG();
+  if(sm->confirmed < sm->nwaits)
+    return G3PLC_INIT_PENDING;
 
-    offset += write_size;
-    size   -= write_size;
+  if(sm->err) {
+    sm->state = START_IDLE;
+    return sm->err;
   }
 
-  return 0;
+  return start_next(ctx);
 }
 
-#define xset_uart_speed(speed) do {         \
-  int n = g3plc_conf.set_uart_speed(speed); \
-  if(n < 0)                                 \
-    return n;                               \
-} while(0)
-int g3plc_reset(void)
+int g3plc_start_timeout(struct g3plc_ctx *ctx)
 {
-  const unsigned char *d;
-  int n;
+  struct g3plc_start_sm *sm = &ctx->start_sm;
+  unsigned int i;
 
-  if(g3plc_conf.boot_start)
-    g3plc_conf.boot_start();
+  if(sm->state == START_IDLE)
+    return G3PLC_INIT_START_ERROR;
 
-  /* speed for segment 0 */
-  xset_uart_speed(115200);
-  BPRG();
+  for(i = sm->confirmed ; i < sm->nwaits ; i++)
+    release_slot(ctx, sm->waits[i].slot);
+  sm->state = START_IDLE;
 
-  /* hardware reset */
-  g3plc_conf.reset_clear();
-  g3plc_conf.usleep(30000); /* sleep 30ms */
-  g3plc_conf.reset_set();
-  BPRG();
+  return G3PLC_INIT_CMD_TIMEOUT;
+}
 
-  xwait_for_byte(0x80); BPRG(); /* program transmission request */
-  xsend_segment(0);     BPRG(); /* send segment 0 */
+int g3plc_start(struct g3plc_ctx *ctx)
+{
+  struct g3plc_start_sm *sm = &ctx->start_sm;
+  int n = g3plc_start_begin(ctx);
 
-  /* switch to 1M/500k baudrate */
-  xwait_for_byte(0xa1);    BPRG(); /* baud rate change request */
-  xsend_byte(0xc1);        BPRG(); /* baud rate change command */
-  xsend_byte(0x84);        BPRG(); /* baud rate (boot 461k / appl. 115.2k) */
-  xwait_for_byte(0xcf);    BPRG(); /* baud rate change accept */
-  xset_uart_speed(460800); BPRG(); /* switch to boot baudrate */
-  xsend_byte(0xaa);        BPRG(); /* baud rate change response */
+  while(n == G3PLC_INIT_PENDING) {
+    unsigned long progress = sm->progress;
 
-  /* send remaining segments */
-  while(1) {
-    unsigned char buf;
-    unsigned int  segno;
+    ctx->conf.wait_slot(sm->waits[sm->confirmed].slot, ctx->conf.timeout, ctx->conf.data);
 
-    n = g3plc_conf.uart_read(&buf, 1);
-    if(n < 0)
-      return n;
-    BPRG();
+    n = g3plc_start_resume(ctx);
+    if(n == G3PLC_INIT_PENDING && progress == sm->progress)
+      n = g3plc_start_timeout(ctx);
+  }
 
-    segno = buf & 0x0f;
+  return n;
+}
 
-    if(buf == 0xb0)
-      break; /* boot completion */
-    else if((buf & 0xf0) == 0x80)
-      /* program transmission request for segment segno */
-      xsend_segment(segno);
-    else
-      return G3PLC_INIT_BOOT_ERROR;
-  }
+int g3plc_set_attrs(struct g3plc_ctx *ctx, const struct g3plc_pib *attrs, unsigned int nattrs)
+{
+  struct g3plc_cmd_wait batch[G3PLC_MAX_WAITERS];
+  unsigned int i, j, n;
+  int err;
 
-  /* Back to 115.2k, communications with
-     the CPX didn't work too well at 461k. */
-  xset_uart_speed(115200);
+  for(i = 0 ; i < nattrs ; i += n) {
+    err = send_attrs(ctx, G3PLC_CHAN0, attrs + i, nattrs - i, batch, &n);
 
-  d = wait_for_cmd(SYSTEM_CTRL_READY);
-  if(!d)
-    return G3PLC_INIT_BOOT_TIMEOUT;
+    /* match all confirmations of the batch */
+    for(j = 0 ; j < n ; j++) {
+      int status = wait_status(&batch[j], wait_on_slot(ctx, batch[j].slot));
+
+      if(status && !err)
+        err = status;
+    }
+
+    if(err)
+      return err;
+  }
 
-  if(g3plc_conf.boot_end)
-    g3plc_conf.boot_end();
+  return G3PLC_INIT_SUCCESS;
+}
+
+/* Whether an attribute differs from the one
+   with the same ID and index in a list. */
+static int attr_changed(const struct g3plc_pib *attr,
+                        const struct g3plc_pib *attrs, unsigned int nattrs)
+{
+  unsigned int i;
+
+  for(i = 0 ; i < nattrs ; i++) {
+    if(attrs[i].id != attr->id || attrs[i].idx != attr->idx)
+      continue;
+    return attrs[i].size != attr->size || memcmp(attrs[i].value, attr->value, attr->size);
+  }
+
+  return 1;
+}
+
+int g3plc_reconfigure(struct g3plc_ctx *ctx, const struct g3plc_config *conf)
+{
+  struct g3plc_pib changed[G3PLC_RECONF_ATTRS], previous[G3PLC_RECONF_ATTRS];
+  unsigned char values[G3PLC_RECONF_ATTRS][G3PLC_PIB_MAX_SIZE];
+  unsigned int size;
+  uint16_t shortaddr = conf->mac_address;
+  uint16_t pan_id    = conf->pan_id;
+  uint8_t  retrans   = conf->retrans;
+  uint8_t  promisc   = conf->flags & G3PLC_PROMISC ? 1 : 0;
+  unsigned int i, n = 0, nprev = 0;
+  int err;
+
+  /* same order as the start sequence (see g3plc_start_begin()) */
+  if(shortaddr != ctx->chans[G3PLC_CHAN0].mac_address)
+    changed[n++] = (struct g3plc_pib){ G3PLC_ATTR_SHORTADDR, 0, &shortaddr, sizeof(shortaddr) };
+  if(pan_id != ctx->chans[G3PLC_CHAN0].pan_id)
+    changed[n++] = (struct g3plc_pib){ G3PLC_ATTR_PANID, 0, &pan_id, sizeof(pan_id) };
+  if(conf->retrans != ctx->conf.retrans)
+    changed[n++] = (struct g3plc_pib){ G3PLC_ATTR_RETRANS, 0, &retrans, sizeof(retrans) };
+  if((conf->flags ^ ctx->conf.flags) & G3PLC_PROMISC)
+    changed[n++] = (struct g3plc_pib){ G3PLC_ATTR_PROMISCUOUS, 0, &promisc, sizeof(promisc) };
+
+  for(i = 0 ; i < conf->nattrs ; i++) {
+    if(!attr_changed(&conf->attrs[i], ctx->conf.attrs, ctx->conf.nattrs))
+      continue;
+    if(n == G3PLC_RECONF_ATTRS)
+      return G3PLC_INIT_START_ERROR;
+    changed[n++] = conf->attrs[i];
+  }
+
+  /* Read the current values first so that the modem is put back
+     as it was when one of them is refused. Those set before the
+     error and those of the batch that failed are all set again.
+     An attribute the modem refuses to read has no value to put
+     back, it was not set yet. */
+  for(i = 0 ; i < n ; i++) {
+    size = sizeof(values[i]);
+    err  = g3plc_get_attr(ctx, changed[i].id, changed[i].idx, values[i], &size);
+    if(err == G3PLC_INIT_START_ERROR)
+      continue;
+    if(err)
+      return err;
+    if(size > sizeof(values[i]))
+      size = sizeof(values[i]);
+    previous[nprev++] = (struct g3plc_pib){ changed[i].id, changed[i].idx, values[i], size };
+  }
+
+  err = g3plc_set_attrs(ctx, changed, n);
+  if(err) {
+    g3plc_set_attrs(ctx, previous, nprev);
+    return err;
+  }
+
+  /* the modem follows the new configuration, so does the driver */
+  LOCK();
+  if(conf->timeout != ctx->conf.timeout || conf->min_timeout != ctx->conf.min_timeout)
+    memset(ctx->rto_peers, 0, sizeof(ctx->rto_peers));
+  ctx->conf.timeout     = conf->timeout;
+  ctx->conf.min_timeout = conf->min_timeout;
+  ctx->conf.window      = conf->window;
+  ctx->conf.flags       = conf->flags;
+  ctx->conf.retrans     = conf->retrans;
+  ctx->conf.tmr_ttl     = conf->tmr_ttl;
+  ctx->conf.pan_id      = conf->pan_id;
+  ctx->conf.mac_address = conf->mac_address;
+  ctx->conf.attrs       = conf->attrs;
+  ctx->conf.nattrs      = conf->nattrs;
+  ctx->chans[G3PLC_CHAN0].pan_id      = pan_id;
+  ctx->chans[G3PLC_CHAN0].mac_address = shortaddr;
+  UNLOCK();
+
+  /* PAN ID and TX options of the data requests */
+  SND_LOCK();
+  init_data_tmpl(ctx, G3PLC_CHAN0);
+  SND_UNLOCK();
+
+  return G3PLC_INIT_SUCCESS;
+}
+
+/* Count the time elapsed since the start of a stage. */
+static void record_stage(struct g3plc_ctx *ctx, enum g3plc_stage stage, unsigned long begin)
+{
+  unsigned long now;
+
+  if(!ctx->conf.clock)
+    return;
+  now = ctx->conf.clock(ctx->conf.data);
+
+  LOCK();
+  hist_record(&ctx->stage_hists[stage], now - begin);
+  UNLOCK();
+}
+
+void g3plc_stats(const struct g3plc_ctx *ctx, enum g3plc_stage stage, struct hist *h)
+{
+  LOCK();
+  *h = ctx->stage_hists[stage];
+  UNLOCK();
+}
+
+void g3plc_counters(const struct g3plc_ctx *ctx, struct g3plc_counters *c)
+{
+  LOCK();
+  *c = ctx->counters;
+  UNLOCK();
+}
+
+static void copy_neighbour(const struct g3plc_ctx *ctx, unsigned int i, struct g3plc_neighbour *n)
+{
+  *n = (struct g3plc_neighbour){
+    .addr       = ctx->neighbours.addr[i],
+    .lqi        = ctx->neighbours.lqi[i],
+    .lqi_avg    = (ctx->neighbours.lqi_avg[i] + 0x80) >> 8,
+    .modulation = ctx->neighbours.modulation[i],
+    .tonemap    = ctx->neighbours.tonemap[i],
+    .frames     = ctx->neighbours.frames[i],
+    .stamp      = ctx->neighbours.stamp[i],
+    .chan       = ctx->neighbours.chan[i]
+  };
+}
+
+/* Channel, and so PAN, a destination was last heard on,
+   -1 when it was not heard or only one is configured. */
+static int route_chan(struct g3plc_ctx *ctx, uint16_t dst)
+{
+  int i, chan = -1;
+
+  if(ctx->nchans < 2)
+    return -1;
+
+  LOCK();
+  i = neigh_lookup(&ctx->neighbours, dst);
+  if(i >= 0)
+    chan = ctx->neighbours.chan[i];
+  UNLOCK();
+
+  return chan;
+}
+
+int g3plc_neighbour(const struct g3plc_ctx *ctx, uint16_t addr, struct g3plc_neighbour *n)
+{
+  int i;
+
+  LOCK();
+  i = neigh_lookup(&ctx->neighbours, addr);
+  if(i >= 0)
+    copy_neighbour(ctx, i, n);
+  UNLOCK();
+
+  return i >= 0 ? 0 : -1;
+}
+
+unsigned int g3plc_neighbours(const struct g3plc_ctx *ctx, struct g3plc_neighbour *n, unsigned int max)
+{
+  unsigned int i, count = 0;
+
+  LOCK();
+  for(i = 0 ; i < NEIGH_SIZE && count < max ; i++)
+    if(ctx->neighbours.addr[i] != NEIGH_UNUSED)
+      copy_neighbour(ctx, i, &n[count++]);
+  UNLOCK();
+
+  return count;
+}
+
+/* Lower the tonemap response TTL when the link to a destination
+   changed and set it back once the links are stable again. This
+   is called before each MCPS-DATA request without the lock. */
+static void adapt_link(struct g3plc_ctx *ctx, uint16_t dst)
+{
+  unsigned long now;
+  uint8_t ttl;
+  int i, lower, change = 0;
+
+  int adapt = ctx->conf.flags & G3PLC_ADAPT;
+
+  /* once G3PLC_ADAPT is cleared the TTL is still set back */
+  if((!adapt && !__atomic_load_n(&ctx->tmr_short, __ATOMIC_RELAXED)) || !ctx->conf.clock)
+    return;
+  now = ctx->conf.clock(ctx->conf.data);
+
+  LOCK();
+  i = adapt ? neigh_lookup(&ctx->neighbours, dst) : -1;
+  if(i >= 0 && ctx->neighbours.modulation[i] == G3PLC_MOD_ROBUST)
+    ctx->counters.tx_robust++;
+  if(i >= 0 && ctx->neighbours.changed[i]) {
+    ctx->neighbours.changed[i] = 0;
+    ctx->counters.tx_tmr++;
+    ctx->tmr_until = now + G3PLC_TMR_HOLD;
+    if(!ctx->tmr_short)
+      change = ctx->tmr_short = 1;
+  }
+  else if(ctx->tmr_short && (!adapt || (long)(now - ctx->tmr_until) > 0)) {
+    ctx->tmr_short = 0;
+    change    = 1;
+  }
+  lower = ctx->tmr_short;
+  UNLOCK();
+
+  if(!change)
+    return;
+
+  /* The frame is sent anyway. On failure the state is reverted,
+     the TTL is lowered on the next change or set back on the
+     next request. */
+  ttl = lower ? 1 : ctx->conf.tmr_ttl ? ctx->conf.tmr_ttl : G3PLC_TMR_TTL;
+  if(g3plc_set_attrs(ctx, &(struct g3plc_pib){ G3PLC_ATTR_TMR_TTL, 0, &ttl, sizeof(ttl) }, 1)) {
+    LOCK();
+    ctx->tmr_short = !lower;
+    UNLOCK();
+  }
+}
+
+/* Move the link to a state. It only gets worse on events
+   and goes back up on traffic. The callback is called
+   without the lock which must not be held. */
+static void set_link(struct g3plc_ctx *ctx, enum g3plc_link state)
+{
+  struct g3plc_link_state copy;
+  int changed;
+
+  /* fast path for the traffic on a healthy link */
+  if(state == G3PLC_LINK_UP &&
+     __atomic_load_n(&ctx->link.state, __ATOMIC_RELAXED) == G3PLC_LINK_UP)
+    return;
+
+  LOCK();
+  changed = state == G3PLC_LINK_UP ? ctx->link.state != state : state > ctx->link.state;
+  if(changed) {
+    __atomic_store_n(&ctx->link.state, state, __ATOMIC_RELAXED);
+    ctx->link.stamp = STAMP();
+  }
+  copy = ctx->link;
+  UNLOCK();
+
+  if(changed)
+    CB(cb_link, &copy, ctx->conf.data);
+}
+
+void g3plc_link(const struct g3plc_ctx *ctx, struct g3plc_link_state *l)
+{
+  LOCK();
+  *l = ctx->link;
+  UNLOCK();
+}
+
+/* Count the confirmation of an MCPS-DATA request. */
+static void count_confirm(struct g3plc_ctx *ctx, int status)
+{
+  LOCK();
+  if(status == G3PLC_SND_NOACK)
+    ctx->counters.tx_noack++;
+  else if(status != G3PLC_SND_SUCCESS)
+    ctx->counters.tx_failures++;
+  UNLOCK();
+
+  if(status == G3PLC_SND_SUCCESS)
+    set_link(ctx, G3PLC_LINK_UP);
+}
+
+/* Escape a command and its payload to the UART through the
+   packed send buffer, a chunk at a time when the buffer is
+   smaller than the packed command (see G3PLC_SND_CHUNK). */
+static int send_packed(struct g3plc_ctx *ctx, struct pack_stream *s,
+                       const unsigned char *src, unsigned int size,
+                       const unsigned char *payload, unsigned int payload_size)
+{
+  unsigned long begin;
+  int status;
+
+  begin  = STAMP();
+  pack_stream_crc(s, src, size);
+  pack_stream_crc(s, payload, payload_size);
+  status = pack_stream_end(s);                        /* send command */
+  record_stage(ctx, G3PLC_STAGE_UART, begin);
+
+  LOCK();
+  ctx->counters.tx_bytes   += s->bytes;
+  ctx->counters.tx_escapes += s->escapes;
+  UNLOCK();
+
+  return status;
+}
+
+/* Send a command with the send lock held. */
+static int send_command(struct g3plc_ctx *ctx, struct g3plc_cmd *cmd, unsigned int size,
+                        const void *payload, unsigned int payload_size)
+{
+  struct pack_stream s;
+
+  PROBE(g3plc, command, LITERAL_G3PLC_CMD(*cmd), size + payload_size);
+
+#ifdef VERBOSE_DEBUG
+  puts(">> SEND:");
+  g3plc_print_cmd(cmd, size);
+  putchar('\n');
+#endif
+
+  hton_g3plc_cmd(cmd);                                  /* network order */
+
+  pack_stream_begin(&s, ctx->snd_cmdbuf_packed, G3PLC_SND_CHUNK, ctx->conf.uart_send, ctx->conf.data);
+  return send_packed(ctx, &s, (unsigned char *)cmd, size,    /* CRC and HDLC */
+                     payload, payload_size);
+}
+
+int g3plc_command_payload(struct g3plc_ctx *ctx, struct g3plc_cmd *cmd, unsigned int size,
+                          const void *payload, unsigned int payload_size)
+{
+  int status;
+
+  if(size < sizeof(struct g3plc_cmd))
+    return G3PLC_SND_INVALID_HDR;
+
+  SND_LOCK();
+  status = send_command(ctx, cmd, size, payload, payload_size);
+  SND_UNLOCK();
+
+  return status;
+}
+
+int g3plc_command(struct g3plc_ctx *ctx, struct g3plc_cmd *cmd, unsigned int size)
+{
+  return g3plc_command_payload(ctx, cmd, size, NULL, 0);
+}
+
+const unsigned char * wait_for_cmd(struct g3plc_ctx *ctx, uint32_t cmd_literal)
+{
+  int i = reserve_slot(ctx, cmd_literal, NULL, 0);
+
+  if(wait_on_slot(ctx, i) < 0)
+    return NULL;
+  return ctx->cmd_slots[i].data;
+}
+
+int wait_for_cmd_into(struct g3plc_ctx *ctx, uint32_t cmd_literal, void *buf, unsigned int size)
+{
+  return wait_on_slot(ctx, reserve_slot(ctx, cmd_literal, buf, size));
+}
+
+int g3plc_command_confirm(struct g3plc_ctx *ctx, struct g3plc_cmd *cmd, unsigned int size,
+                          void *confirm, unsigned int *confirm_size)
+{
+  union {
+    uint32_t         u32;
+    struct g3plc_cmd c;
+  } u = { .c = *cmd };
+  int slot, n;
+
+  if(size < sizeof(struct g3plc_cmd) || cmd->ida != G3PLC_IDA_REQUEST)
+    return G3PLC_INIT_START_ERROR;
+
+  /* The confirm has the same header with another IDA. */
+  u.c.reserved = 0;
+  u.c.ida      = G3PLC_IDA_CONFIRM;
+  slot = reserve_slot(ctx, u.u32, confirm, *confirm_size);
+  if(slot < 0)
+    return G3PLC_INIT_CMD_TIMEOUT;
+
+  /* The PIB may change behind the cache. */
+  if(cmd->type == G3PLC_TYPE_G3 && cmd->idp == G3PLC_IDP_UMAC &&
+     (cmd->cmd == G3PLC_CMD_MLME_SET || cmd->cmd == G3PLC_CMD_MLME_RESET))
+    flush_pib(ctx);
+
+  if(g3plc_command(ctx, cmd, size)) {
+    release_slot(ctx, slot);
+    return G3PLC_INIT_START_ERROR;
+  }
+
+  n = wait_on_slot(ctx, slot);
+  if(n < 0)
+    return G3PLC_INIT_CMD_TIMEOUT;
+  *confirm_size = n;
+
+  return G3PLC_INIT_SUCCESS;
+}
+
+void free_cmd_data(struct g3plc_ctx *ctx, const unsigned char *data)
+{
+  int i;
+
+  if(!data)
+    return;
+
+  for(i = 0 ; i < G3PLC_MAX_WAITERS ; i++) {
+    if(data == ctx->cmd_slots[i].data) {
+      release_slot(ctx, i);
+      return;
+    }
+  }
+}
+
+/* The MCPS-DATA request header only changes with the destination,
+   the MSDU length and handle. The command header, address modes and
+   PAN ID of each channel are packed with their CRC by init_data_tmpl()
+   and the rest of the header is patched on each request. */
+static void init_data_tmpl(struct g3plc_ctx *ctx, unsigned int chan)
+{
+  struct g3plc_data_tmpl *tmpl = &ctx->data_tmpls[chan];
+  unsigned char prefix[G3PLC_DATA_PREFIX_SIZE];
+  struct g3plc_cmd *cmd = (struct g3plc_cmd *)prefix;
+  unsigned char    *dat = cmd->data;
+
+  *cmd = (struct g3plc_cmd){
+    .reserved = 0,
+    .type     = G3PLC_TYPE_G3,
+    .idc      = chan,
+    .ida      = G3PLC_IDA_REQUEST,
+    .idp      = G3PLC_IDP_UMAC,
+    .cmd      = G3PLC_CMD_MCPS_DATA
+  };
+  hton_g3plc_cmd(cmd);
+
+  *(uint8_t *)dat = 0x02; dat += sizeof(uint8_t); /* src addr type (16-bit short addr) */
+  *(uint8_t *)dat = 0x02; dat += sizeof(uint8_t); /* dst addr type (16-bit short addr) */
+
+  /* destination PAN ID */
+  *(uint16_t *)dat = BO_HTONS(ctx->conf, ctx->chans[chan].pan_id);
+
+  tmpl->packed_size = pack_crc_prefix(tmpl->packed, &tmpl->crc, prefix, sizeof(prefix));
+
+  /* destination address, MSDU length and handle are patched, so are
+     the TX options and QoS of a frame with its own options (see
+     g3plc_tx_opts), the key source is null and so are the security
+     level, key identification mode and key index without G3PLC_SECURE */
+  memset(tmpl->tail, 0, sizeof(tmpl->tail));
+  tmpl->tail[11] = ctx->conf.flags & G3PLC_NOACK ? 0x00 : 0x01; /* TX options */
+  if(ctx->conf.flags & G3PLC_SECURE) {
+    tmpl->tail[12] = 0x05; /* security level (ENC-MIC-32) */
+    tmpl->tail[13] = 0x01; /* key identification mode (key index) */
+    tmpl->tail[22] = ctx->conf.key_index;
+  }
+}
+
+/* Whether a frame is acknowledged (see g3plc_tx_opts). */
+static int tx_ack(struct g3plc_ctx *ctx, const struct g3plc_tx_opts *opts)
+{
+  if(opts && opts->ack != G3PLC_ACK_DEFAULT)
+    return opts->ack == G3PLC_ACK_ON;
+  return !(ctx->conf.flags & G3PLC_NOACK);
+}
+
+static int mcps_data_request(struct g3plc_ctx *ctx, unsigned int chan, uint16_t dst, const void *payload,
+                             unsigned int payload_size, uint8_t handle,
+                             const struct g3plc_tx_opts *opts)
+{
+  const struct g3plc_data_tmpl *tmpl = &ctx->data_tmpls[chan];
+  unsigned char tail[G3PLC_DATA_TAIL_SIZE];
+  struct pack_stream s;
+  int status;
+
+  /* check payload length */
+  if(payload_size > G3PLC_MAX_PAYLOAD)
+    return G3PLC_SND_TOOLONG;
+
+  /* patch the template */
+  memcpy(tail, tmpl->tail, sizeof(tail));
+  *(uint16_t *)tail       = BO_HTONS(ctx->conf, dst);          /* destination address */
+  *(uint16_t *)(tail + 8) = BO_HTONS(ctx->conf, payload_size); /* MSDU length */
+  tail[10]                = handle;                             /* MSDU handle */
+  if(opts) {
+    tail[11] = tx_ack(ctx, opts) ? 0x01 : 0x00; /* TX options */
+    tail[23] = opts->qos;                  /* QoS */
+  }
+
+  /* send command to device, the prefix is
+     already packed and the payload is appended */
+  SND_LOCK();
+  pack_stream_resume(&s, ctx->snd_cmdbuf_packed, G3PLC_SND_CHUNK, ctx->conf.uart_send, ctx->conf.data,
+                     tmpl->packed, tmpl->packed_size, tmpl->crc);
+  status = send_packed(ctx, &s, tail, sizeof(tail), payload, payload_size);
+  SND_UNLOCK();
+  if(!status) {
+    LOCK();
+    ctx->counters.tx_frames++;
+    UNLOCK();
+  }
+  count_confirm(ctx, status);
+
+  return status;
+}
+
+
+/* Convert the status of a MCPS-DATA confirm to a send status. */
+static int mcps_data_status(uint8_t status)
+{
+  switch(status) {
+  case R_G3MAC_STATUS_SUCCESS:
+    return G3PLC_SND_SUCCESS;
+  case R_G3MAC_STATUS_CHANNEL_ACCESS_FAILURE:
+    return G3PLC_SND_ACCESS;
+  case R_G3MAC_STATUS_FRAME_TOO_LONG:
+    return G3PLC_SND_TOOLONG;
+  case R_G3MAC_STATUS_INVALID_PARAMETER:
+    return G3PLC_SND_INVALID_PARAM;
+  case R_G3MAC_STATUS_OUT_OF_CAP:
+    return G3PLC_SND_OOM;
+  case R_G3MAC_STATUS_NO_ACK:
+    return G3PLC_SND_NOACK;
+  default:
+    return G3PLC_SND_FAILURE;
+  }
+}
+
+int g3plc_send(struct g3plc_ctx *ctx, uint16_t dst, const void *payload, unsigned int payload_size)
+{
+  return g3plc_send_opts(ctx, dst, payload, payload_size, NULL);
+}
+
+int g3plc_send_opts(struct g3plc_ctx *ctx, uint16_t dst, const void *payload, unsigned int payload_size,
+                    const struct g3plc_tx_opts *opts)
+{
+  unsigned char confirmation[2]; /* MSDU handle, status */
+  unsigned long begin;
+  unsigned int timeout;
+  int status, slot, chan;
+
+  /* the confirm timeouts are estimated with the configured ACKs */
+  int estimate = tx_ack(ctx, opts) == !(ctx->conf.flags & G3PLC_NOACK);
+
+  /* the PAN of the destination, the first one when unknown */
+  chan = route_chan(ctx, dst);
+  if(chan < 0)
+    chan = G3PLC_CHAN0;
+
+  slot = reserve_slot(ctx, chan_literal(G3PLC_MCPS_DATA_CONFIRM, chan), confirmation, sizeof(confirmation));
+  if(slot < 0)
+    return G3PLC_SND_BUSY;
+
+  adapt_link(ctx, dst);
+  timeout = confirm_timeout(ctx, dst);
+  begin   = STAMP();
+  status  = mcps_data_request(ctx, chan, dst, payload, payload_size, 0x00, opts);
+  if(status) {
+    release_slot(ctx, slot);
+    return status;
+  }
+
+  if(wait_on_slot_us(ctx, slot, timeout) < (int)sizeof(confirmation)) {
+    if(estimate)
+      confirm_update(ctx, dst, begin, 0);
+    return G3PLC_SND_CONFIRM;
+  }
+  status = confirmation[1];
+  if(estimate)
+    confirm_update(ctx, dst, begin, 1);
+
+  record_stage(ctx, G3PLC_STAGE_CONFIRM, begin);
+
+  status = mcps_data_status(status);
+  count_confirm(ctx, status);
+
+  return status;
+}
+
+#define HANDLE_ISSET(h) (ctx->snd_handles[(h) >> 3] &   (1 << ((h) & 7)))
+#define HANDLE_SET(h)   (ctx->snd_handles[(h) >> 3] |=  (1 << ((h) & 7)))
+#define HANDLE_CLR(h)   (ctx->snd_handles[(h) >> 3] &= ~(1 << ((h) & 7)))
+
+int g3plc_send_async(struct g3plc_ctx *ctx, uint16_t dst, const void *payload, unsigned int payload_size,
+                     uint8_t *handle)
+{
+  return g3plc_send_async_chan(ctx, G3PLC_CHAN_ANY, dst, payload, payload_size, handle);
+}
+
+int g3plc_send_async_chan(struct g3plc_ctx *ctx, int chan, uint16_t dst, const void *payload,
+                          unsigned int payload_size, uint8_t *handle)
+{
+  return g3plc_send_async_opts(ctx, chan, dst, payload, payload_size, NULL, handle);
+}
+
+int g3plc_send_async_opts(struct g3plc_ctx *ctx, int chan, uint16_t dst, const void *payload,
+                          unsigned int payload_size, const struct g3plc_tx_opts *opts, uint8_t *handle)
+{
+  unsigned int window = ctx->conf.window ? ctx->conf.window : 1;
+  uint8_t h;
+  int status;
+
+  if(window > 127)
+    window = 127; /* both channels share the handles */
+
+  if(chan != G3PLC_CHAN_ANY && (chan < 0 || (unsigned int)chan >= ctx->nchans))
+    return G3PLC_SND_INVALID_PARAM;
+
+  /* a destination goes to its PAN when it was heard */
+  if(chan == G3PLC_CHAN_ANY && dst != 0xffff) {
+    int route = route_chan(ctx, dst);
+
+    if(route >= 0)
+      chan = route;
+  }
+
+  LOCK();
+
+  /* otherwise balance on the least loaded channel, alternate on a tie */
+  if(chan == G3PLC_CHAN_ANY) {
+    if(ctx->nchans < 2)
+      chan = G3PLC_CHAN0;
+    else if(ctx->chan_inflight[G3PLC_CHAN0] != ctx->chan_inflight[G3PLC_CHAN1])
+      chan = ctx->chan_inflight[G3PLC_CHAN1] < ctx->chan_inflight[G3PLC_CHAN0] ? G3PLC_CHAN1 : G3PLC_CHAN0;
+    else
+      chan = !ctx->chan_last;
+    ctx->chan_last = chan;
+  }
+
+  if(ctx->chan_inflight[chan] >= window) {
+    UNLOCK();
+    return G3PLC_SND_BUSY;
+  }
+
+  /* find the next free handle (zero is reserved) */
+  h = ctx->snd_next_handle;
+  do {
+    h++;
+  } while(!h || HANDLE_ISSET(h));
+  ctx->snd_next_handle = h;
+
+  HANDLE_SET(h);
+  ctx->snd_inflight++;
+  ctx->chan_inflight[chan]++;
+  ctx->snd_chans[h]  = chan;
+  ctx->snd_stamps[h] = STAMP();
+
+  UNLOCK();
+
+  adapt_link(ctx, dst);
+  status = mcps_data_request(ctx, chan, dst, payload, payload_size, h, opts);
+  if(status) {
+    LOCK();
+    HANDLE_CLR(h);
+    ctx->snd_inflight--;
+    ctx->chan_inflight[chan]--;
+    UNLOCK();
+    return status;
+  }
+
+  if(handle)
+    *handle = h;
+  return G3PLC_SND_SUCCESS;
+}
+
+/* Confirmation for a pipelined frame. */
+static void mcps_data_confirm(struct g3plc_ctx *ctx, uint8_t handle, uint8_t status)
+{
+  unsigned long begin;
+  int result;
+
+  LOCK();
+
+  /* stale confirmation (flushed) */
+  if(!HANDLE_ISSET(handle)) {
+    UNLOCK();
+    return;
+  }
+
+  HANDLE_CLR(handle);
+  ctx->snd_inflight--;
+  ctx->chan_inflight[ctx->snd_chans[handle]]--;
+  begin = ctx->snd_stamps[handle];
+
+  UNLOCK();
+
+  record_stage(ctx, G3PLC_STAGE_CONFIRM, begin);
+
+  result = mcps_data_status(status);
+  count_confirm(ctx, result);
+
+  CB(cb_sent, handle, result, ctx->conf.data);
+}
+
+unsigned int g3plc_send_inflight(const struct g3plc_ctx *ctx)
+{
+  unsigned int n;
+
+  LOCK();
+  n = ctx->snd_inflight;
+  UNLOCK();
+
+  return n;
+}
+
+unsigned int g3plc_send_inflight_chan(const struct g3plc_ctx *ctx, unsigned int chan)
+{
+  unsigned int n = 0;
+
+  LOCK();
+  if(chan < ctx->nchans)
+    n = ctx->chan_inflight[chan];
+  UNLOCK();
+
+  return n;
+}
+
+void g3plc_send_flush(struct g3plc_ctx *ctx)
+{
+  unsigned int h;
+
+  for(h = 1 ; h < 256 ; h++) {
+    LOCK();
+    if(!HANDLE_ISSET(h)) {
+      UNLOCK();
+      continue;
+    }
+    HANDLE_CLR(h);
+    ctx->snd_inflight--;
+    ctx->chan_inflight[ctx->snd_chans[h]]--;
+    UNLOCK();
+
+    CB(cb_sent, h, G3PLC_SND_CONFIRM, ctx->conf.data);
+  }
+}
+
+static int mcps_data_indication(const struct g3plc_cmd *cmd,
+                                const unsigned char *data, unsigned int size,
+                                void *arg)
+{
+  struct g3plc_ctx *ctx = arg;
+  struct g3plc_ind ind = { .data = data, .size = size, .stamp = ctx->rcv_first };
+  unsigned int len;
+
+  if(size < G3PLC_IND_HDR_SIZE)
+    return G3PLC_RCV_INVALID_HDR;
+
+  /* MSDU length */
+  len = g3plc_ind_payload_size(&ind);
+  if(size - G3PLC_IND_HDR_SIZE < len)
+    return G3PLC_RCV_INVALID_HDR;
+
+  /* The modem already checked the MIC of secured frames,
+     the unsecured ones are forged or from another network. */
+  if(ctx->conf.flags & G3PLC_SECURE && !g3plc_ind_sec_level(&ind)) {
+    LOCK();
+    ctx->counters.rx_insecure++;
+    UNLOCK();
+    return G3PLC_RCV_IGNORED;
+  }
+
+  /* The trailer is decoded on demand by the accessors,
+     only the neighbour statistics are read here. */
+  LOCK();
+  ctx->counters.rx_frames++;
+  if(g3plc_ind_src_mode(&ind) == 0x02) /* 16-bit short addr */
+    neigh_update(&ctx->neighbours, g3plc_ind_src(&ind), cmd->idc, g3plc_ind_lqi(&ind),
+                 g3plc_ind_modulation(&ind), g3plc_ind_tonemap(&ind), ctx->rcv_stamp);
+  UNLOCK();
+
+  set_link(ctx, G3PLC_LINK_UP);
+
+  /* call cb_recv */
+  record_stage(ctx, G3PLC_STAGE_RECV, ctx->rcv_stamp);
+  CB(cb_recv, &ind, g3plc_ind_payload(&ind), len, G3PLC_RCV_SUCCESS, ctx->conf.data);
+  return G3PLC_RCV_SUCCESS;
+}
+
+static unsigned int hash_literal(uint32_t literal)
+{
+  union {
+    uint32_t         u32;
+    struct g3plc_cmd c;
+  } l = { .u32 = literal };
+
+  return (l.c.cmd * 31 + l.c.idp * 7 + l.c.ida) & (G3PLC_MAX_HANDLERS - 1);
+}
+
+/* Return the handler of a literal or NULL.
+   Must be called with the lock. */
+static struct g3plc_cmd_handler * lookup_handler(struct g3plc_ctx *ctx, uint32_t literal)
+{
+  unsigned int h = hash_literal(literal);
+  unsigned int i;
+
+  for(i = 0 ; i < G3PLC_MAX_HANDLERS ; i++) {
+    struct g3plc_cmd_handler *entry = &ctx->handlers[(h + i) & (G3PLC_MAX_HANDLERS - 1)];
+
+    if(!entry->handler)
+      break;
+    if(entry->literal == literal)
+      return entry;
+  }
+
+  return NULL;
+}
+
+int g3plc_register(struct g3plc_ctx *ctx, uint32_t literal, g3plc_handler handler, void *arg)
+{
+  unsigned int h = hash_literal(literal);
+  unsigned int i;
+  int ret = -1;
+
+  LOCK();
+  {
+    struct g3plc_cmd_handler *entry = lookup_handler(ctx, literal);
+
+    /* replace or take the first free entry of the chain */
+    for(i = 0 ; !entry && i < G3PLC_MAX_HANDLERS ; i++) {
+      struct g3plc_cmd_handler *e = &ctx->handlers[(h + i) & (G3PLC_MAX_HANDLERS - 1)];
+
+      if(!e->handler)
+        entry = e;
+    }
+
+    if(entry) {
+      *entry = (struct g3plc_cmd_handler){ .literal = literal,
+                                           .handler = handler,
+                                           .arg     = arg };
+      ret = 0;
+    }
+  }
+  UNLOCK();
+
+  return ret;
+}
+
+void g3plc_unregister(struct g3plc_ctx *ctx, uint32_t literal)
+{
+  LOCK();
+  {
+    struct g3plc_cmd_handler *entry = lookup_handler(ctx, literal);
+
+    if(entry) {
+      unsigned int i = entry - ctx->handlers;
+      unsigned int j = i;
+
+      /* Remove the entry and move back the following ones of
+         the chain so that the lookups never stop on a hole. */
+      entry->handler = NULL;
+      while(1) {
+        unsigned int k;
+
+        j = (j + 1) & (G3PLC_MAX_HANDLERS - 1);
+        if(!ctx->handlers[j].handler)
+          break;
+
+        /* keep the entry if its home is cyclically in (i, j] */
+        k = hash_literal(ctx->handlers[j].literal);
+        if(i <= j ? (i < k && k <= j) : (i < k || k <= j))
+          continue;
+
+        ctx->handlers[i] = ctx->handlers[j];
+        ctx->handlers[j].handler = NULL;
+        i = j;
+      }
+    }
+  }
+  UNLOCK();
+}
+
+/* The G3 controller reports an event with the command that
+   caused it. The data are the event code, the length of the
+   parameters and the command (IDA, IDP and ID). */
+static int g3_event_indication(const struct g3plc_cmd *cmd,
+                               const unsigned char *data, unsigned int size,
+                               void *arg)
+{
+  struct g3plc_ctx *ctx = arg;
+
+  (void)cmd;
+
+  if(size < 5)
+    return G3PLC_RCV_INVALID_HDR;
+
+  LOCK();
+  ctx->link.events++;
+  ctx->link.event     = data[0];
+  ctx->link.event_cmd = BO_NTOHS(ctx->conf, *(uint16_t *)(data + 3));
+  UNLOCK();
+
+  set_link(ctx, G3PLC_LINK_DEGRADED);
+  return G3PLC_RCV_SUCCESS;
+}
+
+/* Security and frame counter failures with a neighbour,
+   the link itself still works so we only count them. */
+static int mlme_comm_status_indication(const struct g3plc_cmd *cmd,
+                                       const unsigned char *data, unsigned int size,
+                                       void *arg)
+{
+  struct g3plc_ctx *ctx = arg;
+
+  (void)cmd;
+  (void)data;
+  (void)size;
+
+  LOCK();
+  ctx->link.comm_status++;
+  UNLOCK();
+
+  return G3PLC_RCV_SUCCESS;
+}
+
+static int adpm_network_leave_indication(const struct g3plc_cmd *cmd,
+                                         const unsigned char *data, unsigned int size,
+                                         void *arg)
+{
+  struct g3plc_ctx *ctx = arg;
+
+  (void)cmd;
+  (void)data;
+  (void)size;
+
+  LOCK();
+  ctx->link.leaves++;
+  UNLOCK();
+
+  set_link(ctx, G3PLC_LINK_DOWN);
+  return G3PLC_RCV_SUCCESS;
+}
+
+/* Clear the table and register the built-in handlers. */
+static void init_handlers(struct g3plc_ctx *ctx)
+{
+  unsigned int chan;
+
+  memset(ctx->handlers, 0, sizeof(ctx->handlers));
+  memset(&ctx->link, 0, sizeof(ctx->link));
+
+  for(chan = G3PLC_CHAN0 ; chan < ctx->nchans ; chan++) {
+    g3plc_register(ctx, chan_literal(G3PLC_MCPS_DATA_INDICATION, chan), mcps_data_indication, ctx);
+    g3plc_register(ctx, chan_literal(G3PLC_G3_EVENT_INDICATION, chan), g3_event_indication, ctx);
+    g3plc_register(ctx, chan_literal(G3PLC_MLME_COMM_STATUS_INDICATION, chan),
+                   mlme_comm_status_indication, ctx);
+    g3plc_register(ctx, chan_literal(G3PLC_ADPM_NETWORK_LEAVE_INDICATION, chan),
+                   adpm_network_leave_indication, ctx);
+  }
+}
+
+int dissector(struct g3plc_ctx *ctx, const struct g3plc_cmd *cmd, unsigned int size)
+{
+  uint32_t literal_cmd = LITERAL_G3PLC_CMD(*cmd);
+  struct g3plc_cmd_handler *handler, entry;
+  int i;
+
+  /* we are generally only interested in the command data size */
+  size -= sizeof(struct g3plc_cmd);
+
+  /* confirmation of a pipelined frame, the MSDU handle
+     tells us which frame and waiters are not concerned */
+  if(chan_literal(literal_cmd, G3PLC_CHAN0) == G3PLC_MCPS_DATA_CONFIRM &&
+     size >= 2 && cmd->data[0]) {
+    mcps_data_confirm(ctx, cmd->data[0], cmd->data[1]);
+    return G3PLC_RCV_SUCCESS;
+  }
+
+  /* check for any waited confirmation/indication */
+  LOCK();
+  for(i = 0 ; i < G3PLC_MAX_WAITERS ; i++) {
+    struct g3plc_slot *slot = &ctx->cmd_slots[i];
+
+    if(!slot->used || slot->done || slot->literal != literal_cmd)
+      continue;
+
+    /* we always duplicate the data to avoid side effect */
+    memcpy(slot->buf, cmd->data, size < slot->buf_size ? size : slot->buf_size);
+    slot->size = size;
+    slot->done = 1;
+
+    ctx->conf.signal_slot(i, ctx->conf.data);
+    break;
+  }
+  UNLOCK();
+
+  /* parse command packets, ignore anything else */
+  LOCK();
+  handler = lookup_handler(ctx, literal_cmd);
+  if(handler)
+    entry = *handler;
+  UNLOCK();
+
+  if(!handler)
+    return G3PLC_RCV_IGNORED;
+
+  PROBE(g3plc, dissect, literal_cmd, size, ctx->rcv_first);
+  return entry.handler(cmd, cmd->data, size, entry.arg);
+}
+
+/* The modem filters the destination unless promiscuous mode was
+   enabled, possibly with a user PIB attribute. Return 1 when the packed
+   command is an MCPS-DATA indication to a short address which is neither
+   ours on its channel nor broadcast. Only the command header and the
+   destination bytes are read, in network order. */
+static int prefilter(struct g3plc_ctx *ctx, const unsigned char *buf, unsigned int size)
+{
+  struct g3plc_ind ind = { .data = buf + sizeof(struct g3plc_cmd),
+                           .size = size - sizeof(struct g3plc_cmd) };
+  unsigned int chan = buf[2] >> 7;
+  uint16_t dst;
+
+  if(size < sizeof(struct g3plc_cmd) + G3PLC_IND_HDR_SIZE + sizeof(uint32_t))
+    return 0;
+  if(buf[1] != G3PLC_TYPE_G3 ||
+     (buf[2] & 0x7f) != (G3PLC_IDA_INDICATION << 4 | G3PLC_IDP_UMAC) ||
+     buf[3] != G3PLC_CMD_MCPS_DATA)
+    return 0;
+  if(g3plc_ind_dst_mode(&ind) != 0x02 || chan >= ctx->nchans) /* 16-bit short addr */
+    return 0;
+
+  dst = g3plc_ind_dst(&ind);
+  return dst != ctx->chans[chan].mac_address && dst != 0xffff;
+}
+
+int g3plc_recv_frame(struct g3plc_ctx *ctx)
+{
+  struct g3plc_cmd *cmd = (struct g3plc_cmd *)ctx->rcv_cmdbuf;
+  unsigned int size = ctx->rcv_size;
+  int ret, status = G3PLC_RCV_SUCCESS;
+
+  /* check that we at least have a valid command packet */
+  if(size < (sizeof(struct g3plc_cmd) + sizeof(uint32_t))) {
+    status = G3PLC_RCV_INVALID_HDR;
+    goto PARSING_COMPLETE;
+  }
+
+  /* drop the indications nobody wants before the CRC */
+  if(!(ctx->conf.flags & G3PLC_PROMISC) && prefilter(ctx, ctx->rcv_cmdbuf, size)) {
+    LOCK();
+    ctx->counters.rx_filtered++;
+    UNLOCK();
+    return G3PLC_RCV_IGNORED;
+  }
+
+  /* extract and check CRC */
+  ret = extract_crc(&ctx->conf, ctx->rcv_cmdbuf, &size);
+  if(!ret) {
+    status = G3PLC_RCV_INVALID_CRC;
+    goto PARSING_COMPLETE;
+  }
+
+  /* convert command to host order */
+  ntoh_g3plc_cmd(cmd);
+
+PARSING_COMPLETE:
+  if(status != G3PLC_RCV_SUCCESS) {
+    LOCK();
+    ctx->rcv_errors++;
+    if(status == G3PLC_RCV_INVALID_CRC)
+      ctx->counters.rx_crc++;
+    else
+      ctx->counters.rx_invalid++;
+    UNLOCK();
+  }
+
+  PROBE(g3plc, recv_frame, status, ctx->rcv_size, ctx->rcv_first);
+
+  /* based on parsing status and iface_flags
+     we either return directly or pass the
+     command packet to the dissectors */
+  switch(status) {
+  case G3PLC_RCV_INVALID_CRC:
+  case G3PLC_RCV_INVALID_HDR:
+    if(!(ctx->conf.flags & G3PLC_INVALID))
+      return status;
+  }
+
+#ifdef VERBOSE_DEBUG
+  puts("<< RECV:");
+  g3plc_print_cmd(cmd, size);
+  putchar('\n');
+#endif
+
+  CB(raw, cmd, size, status, ctx->conf.data);
+
+  if(status == G3PLC_RCV_SUCCESS)
+    status = dissector(ctx, cmd, size);
+  return status;
+}
+
+/* Unescape a run of in-frame bytes into the receive buffer.
+   The run must not contain any frame delimiter. Escaped runs
+   are found with memchr() so that unescaped bytes are copied
+   in bulk. An escape may be split across two runs. */
+static void rcv_unescape(struct g3plc_ctx *ctx, const unsigned char *src, const unsigned char *end)
+{
+  const unsigned char *rcv_end = ctx->rcv_cmdbuf + G3PLC_MAX_CMD;
+
+  while(src < end) {
+    const unsigned char *esc;
+    size_t n;
+
+    if(ctx->rcv_escaped) {
+      /* HDLC unescaping:
+          0x7d 0x5e -> 0x7e
+          0x7d 0x5d -> 0x7d */
+      if(ctx->rcv_ptr < rcv_end)
+        *ctx->rcv_ptr++ = *src ^ 0x20;
+      else
+        ctx->rcv_overflow = 1;
+      ctx->rcv_escaped = 0;
+      src++;
+      continue;
+    }
+
+    esc = memchr(src, 0x7d, end - src);
+    n   = (esc ? esc : end) - src;
+
+    if(n > (size_t)(rcv_end - ctx->rcv_ptr)) {
+      n = rcv_end - ctx->rcv_ptr;
+      ctx->rcv_overflow = 1;
+    }
+
+    memcpy(ctx->rcv_ptr, src, n);
+    ctx->rcv_ptr += n;
+
+    if(!esc)
+      return;
+
+    ctx->rcv_escaped = 1;
+    src = esc + 1;
+  }
+}
+
+int g3plc_uart_feed(struct g3plc_ctx *ctx, const unsigned char *buf, size_t size)
+{
+  /* Just writing out the FSM of what the code
+     below actually does:
+
+      (out-of-frame):
+         0x7e -> (in-frame)
+         _    -> ignore; (out-of-frame)
+      (in-frame):
+         0x7e -> message-received; (out-of-frame)
+         0x7d -> (escaped)
+         _    -> write-to-buf; (in-frame)
+      (escaped):
+         _    -> write-to-buf ^ 0x20; (in-frame)
+
+     Delimiters are searched with memchr() and each
+     run between them is unescaped directly into the
+     receive command buffer. */
+  const unsigned char *end = buf + size;
+  int status = G3PLC_RCV_CONT;
+
+  while(buf < end) {
+    const unsigned char *delim = memchr(buf, 0x7e, end - buf);
+
+    if(!ctx->rcv_ptr) {
+      /* state (out-of-frame) */
+
+      if(!delim)
+        break; /* ignore */
+
+      ctx->rcv_ptr      = ctx->rcv_cmdbuf; /* state <- (in-frame) */
+      ctx->rcv_escaped  = 0;
+      ctx->rcv_overflow = 0;
+      ctx->rcv_first    = STAMP(); /* the buffer was just read */
+      buf = delim + 1;
+      continue;
+    }
+
+    /* state (in-frame) */
+    rcv_unescape(ctx, buf, delim ? delim : end);
+
+    if(!delim)
+      break;
+    buf = delim + 1;
+
+    /* message-received
+       state <- (out-of-frame) */
+    ctx->rcv_size  = ctx->rcv_ptr - ctx->rcv_cmdbuf;
+    ctx->rcv_ptr   = NULL;
+    ctx->rcv_stamp = STAMP();
+
+    /* Oversized commands cannot be parsed, we report them
+       as an invalid header since there is no way to recover
+       the truncated command. */
+    if(ctx->rcv_overflow) {
+      ctx->rcv_size = 0;
+      status = G3PLC_RCV_INVALID_HDR;
+      continue;
+    }
+
+    status = ctx->conf.recv_frame(ctx);
+  }
+
+  return status;
+}
+
+int g3plc_uart_frame(struct g3plc_ctx *ctx, const unsigned char *buf, size_t size)
+{
+  ctx->rcv_ptr   = NULL; /* the byte stream starts over */
+  ctx->rcv_first = STAMP();
+  ctx->rcv_stamp = ctx->rcv_first;
+
+  /* same as an oversized frame of the byte stream */
+  if(size > G3PLC_MAX_CMD) {
+    ctx->rcv_size = 0;
+    return G3PLC_RCV_INVALID_HDR;
+  }
+
+  memcpy(ctx->rcv_cmdbuf, buf, size);
+  ctx->rcv_size = size;
+  return ctx->conf.recv_frame(ctx);
+}
+
+int g3plc_uart_putc(struct g3plc_ctx *ctx, unsigned char c)
+{
+  return g3plc_uart_feed(ctx, &c, 1);
+}
+
+/* Send a single byte through UART.
+   We use this during the boot sequence to signal the device. */
+#define xsend_byte(c) x_(send_byte, ctx, c)
+static int send_byte(struct g3plc_ctx *ctx, unsigned char c)
+{
+  return ctx->conf.uart_send(&c, 1, ctx->conf.data);
+}
+
+/* Find a segment in the firmware table.
+   Return NULL if it is outside of the image. */
+static const struct g3plc_boot_segment * lookup_segment(struct g3plc_ctx *ctx, unsigned int segno)
+{
+  struct g3plc_boot_segment *seg = &ctx->boot_segments[segno];
+  const uint8_t *image = ctx->conf.firmware;
+  unsigned long  image_size = ctx->conf.firmware_size;
+  unsigned long  info = BOOT_TABLE + segno * BOOT_INFO_SIZE;
+  uint32_t       offset, size;
+
+  if(seg->valid)
+    return seg;
+
+  if(info + BOOT_INFO_SIZE > image_size)
+    return NULL;
+
+  /* FIXME: Technically we need le32toh() and htole32() here.
+     But we know that the renesas platform and Linux on RPi are LE.
+     So we are OK. */
+  offset = *(uint32_t *)(image + info);     /* program offset address in table */
+  size   = *(uint32_t *)(image + info + 8); /* program size */
+
+  if(offset > image_size - BOOT_TABLE ||
+     size   > image_size - BOOT_TABLE - offset)
+    return NULL;
+
+  *seg = (struct g3plc_boot_segment){ .info  = image + info,
+                                      .data  = image + BOOT_TABLE + offset,
+                                      .size  = size,
+                                      .valid = 1 };
+  return seg;
+}
+
+/* Send a program segment to the device. */
+#define xsend_segment(segno) x_(send_segment, ctx, segno)
+static int send_segment(struct g3plc_ctx *ctx, unsigned int segno)
+{
+  const struct g3plc_boot_segment *seg = lookup_segment(ctx, segno);
+  const uint8_t *data;
+  uint32_t size;
+  int n;
+
+  if(!seg)
+    return G3PLC_INIT_FIRMWARE;
+
+  /* send segment info table */
+  n = ctx->conf.uart_send(seg->info + sizeof(uint32_t), BOOT_INFO_SIZE - sizeof(uint32_t), ctx->conf.data);
+  if(n < 0)
+    return n;
+  BPRG();
+
+  /* send segment */
+  for(data = seg->data, size = seg->size ; size ;) {
+    unsigned int write_size = size > BOOT_SEGMENT_CHUNK ? BOOT_SEGMENT_CHUNK : size;
+
+    n = ctx->conf.uart_send(data, write_size, ctx->conf.data);
+    if(n < 0)
+      return n;
+    BPRG();
+
+    data += write_size;
+    size -= write_size;
+  }
+
+  return 0;
+}
+
+/* Probe the device with a request that does not change its
+   state. The confirmation is CRC-checked by the receive path. */
+static int g3_getconfig_request(struct g3plc_ctx *ctx)
+{
+  struct g3plc_cmd *cmd = (struct g3plc_cmd *)ctx->snd_cmdbuf;
+  int status;
+
+  /* the command buffer is shared by the senders */
+  SND_LOCK();
+  *cmd = (struct g3plc_cmd){
+    .reserved = 0,
+    .type     = G3PLC_TYPE_G3,
+    .idc      = G3PLC_CHAN0,
+    .ida      = G3PLC_IDA_REQUEST,
+    .idp      = G3PLC_IDP_G3CTR,
+    .cmd      = G3PLC_CMD_G3_GETCONFIG
+  };
+
+  status = send_command(ctx, cmd, sizeof(struct g3plc_cmd), NULL, 0);
+  SND_UNLOCK();
+
+  return status;
+}
+
+/* The boot sequence is a state machine driven by the bytes
+   received from the device (see g3plc_reset_feed()) so that it
+   can run from an event loop. Each attempt starts over with a
+   hardware reset at the next speed. g3plc_reset() drives it
+   with uart_read(). */
+enum boot_state {
+  BOOT_IDLE,
+  BOOT_SEGMENT0,  /* wait for the program transmission request */
+  BOOT_BAUD_REQ,  /* wait for the baud rate change request */
+  BOOT_BAUD_ACK,  /* wait for the baud rate change accept */
+  BOOT_SEGMENTS,  /* wait for segment requests until boot completion */
+  BOOT_READY,     /* wait for the system ready indication */
+  BOOT_PROBE      /* wait for the confirmation of a speed probe */
+};
+
+/* Speeds are tried in order and the default one last. */
+static const struct g3plc_baud * attempt_baud(struct g3plc_ctx *ctx, unsigned int attempt)
+{
+  return attempt < ctx->conf.nbauds ? &ctx->conf.bauds[attempt] : &default_baud;
+}
+
+/* Execute a request (if any) and wait for its confirmation
+   during the boot sequence. The platform does not receive
+   frames yet, the bytes fed to the boot sequence go to the
+   receive path. An invalid frame fails immediately since it
+   is the sign of a wrong speed. */
+static int boot_expect(struct g3plc_ctx *ctx, enum boot_state state,
+                       int (*request)(struct g3plc_ctx *ctx), uint32_t confirm)
+{
+  struct g3plc_boot_sm *sm = &ctx->boot_sm;
+  int n = 0;
+
+  sm->slot = reserve_slot(ctx, confirm, &sm->confirm, 0);
+  if(sm->slot < 0)
+    return G3PLC_INIT_CMD_TIMEOUT;
+
+  LOCK();
+  sm->errors = ctx->rcv_errors;
+  UNLOCK();
+
+  if(request)
+    n = request(ctx);
+  if(n)
+    return n;
+
+  sm->state = state;
+  return G3PLC_INIT_PENDING;
+}
+
+#define xset_uart_speed(speed) do {                         \
+  int n = ctx->conf.set_uart_speed(speed, ctx->conf.data); \
+  if(n < 0)                                                \
+    return n;                                              \
+} while(0)
+static int boot_attempt(struct g3plc_ctx *ctx)
+{
+  struct g3plc_boot_sm *sm = &ctx->boot_sm;
+
+  sm->probes = 0;
+  sm->slot   = -1;
+
+  /* speed for segment 0 */
+  xset_uart_speed(115200);
+  BPRG();
+
+  /* hardware reset */
+  flush_pib(ctx);
+  ctx->conf.reset_clear(ctx->conf.data);
+  ctx->conf.usleep(ctx->conf.reset_pulse ? ctx->conf.reset_pulse : G3PLC_RESET_PULSE, ctx->conf.data);
+  ctx->conf.reset_set(ctx->conf.data);
+  BPRG();
+
+  sm->state = BOOT_SEGMENT0;
+  return G3PLC_INIT_PENDING;
+}
+
+/* Advance the current attempt with a byte from the device. */
+static int boot_step(struct g3plc_ctx *ctx, unsigned char c)
+{
+  struct g3plc_boot_sm *sm = &ctx->boot_sm;
+  const struct g3plc_baud *baud = attempt_baud(ctx, sm->attempt);
+  unsigned int probes;
+  int done, n = G3PLC_INIT_SUCCESS;
+
+  switch(sm->state) {
+  case BOOT_SEGMENT0:
+    if(c != 0x80)
+      return G3PLC_INIT_BOOT_ERROR;
+    BPRG();                  /* program transmission request */
+    xsend_segment(0); BPRG(); /* send segment 0 */
+
+    sm->state = BOOT_BAUD_REQ;
+    return G3PLC_INIT_PENDING;
+
+  case BOOT_BAUD_REQ:
+    /* switch to the boot baudrate */
+    if(c != 0xa1)
+      return G3PLC_INIT_BOOT_ERROR;
+    BPRG();                         /* baud rate change request */
+    xsend_byte(0xc1);       BPRG(); /* baud rate change command */
+    xsend_byte(baud->code); BPRG(); /* baud rate (boot / appl.) */
+
+    sm->state = BOOT_BAUD_ACK;
+    return G3PLC_INIT_PENDING;
+
+  case BOOT_BAUD_ACK:
+    if(c != 0xcf)
+      return G3PLC_INIT_BOOT_ERROR;
+    BPRG();                              /* baud rate change accept */
+    xset_uart_speed(baud->boot); BPRG(); /* switch to boot baudrate */
+    xsend_byte(0xaa);            BPRG(); /* baud rate change response */
+
+    sm->state = BOOT_SEGMENTS;
+    return G3PLC_INIT_PENDING;
+
+  case BOOT_SEGMENTS:
+    /* send remaining segments */
+    BPRG();
+    if(c == 0xb0) {
+      /* Boot completion. Communications with the CPX didn't work
+         too well at 461k, so the application speed is validated
+         before we keep it. */
+      xset_uart_speed(baud->appl);
+      return boot_expect(ctx, BOOT_READY, NULL, SYSTEM_CTRL_READY);
+    }
+    else if((c & 0xf0) == 0x80) {
+      /* program transmission request for segment segno */
+      xsend_segment(c & 0x0f);
+      return G3PLC_INIT_PENDING;
+    }
+    return G3PLC_INIT_BOOT_ERROR;
+
+  case BOOT_READY:
+  case BOOT_PROBE:
+    g3plc_uart_feed(ctx, &c, 1);
+
+    LOCK();
+    done = ctx->cmd_slots[sm->slot].done;
+    if(ctx->rcv_errors != sm->errors)
+      n = G3PLC_INIT_BOOT_ERROR;
+    UNLOCK();
+
+    if(!n && !done)
+      return G3PLC_INIT_PENDING;
+
+    release_slot(ctx, sm->slot);
+    sm->slot = -1;
+    if(n)
+      return n;
+
+    /* check that the application speed is stable */
+    if(sm->state == BOOT_PROBE)
+      sm->probes++;
+    probes = ctx->conf.baud_probes ? ctx->conf.baud_probes : G3PLC_BAUD_PROBES;
+    if(sm->probes >= probes)
+      return G3PLC_INIT_SUCCESS;
+
+    return boot_expect(ctx, BOOT_PROBE, g3_getconfig_request, G3PLC_G3_GETCONFIG_CONFIRM);
+
+  default:
+    return G3PLC_INIT_BOOT_ERROR;
+  }
+}
+
+/* Conclude the current attempt when it is over.
+   The next speed is tried after a failure. */
+static int boot_settle(struct g3plc_ctx *ctx, int n)
+{
+  struct g3plc_boot_sm *sm = &ctx->boot_sm;
+
+  while(n != G3PLC_INIT_PENDING) {
+    if(sm->slot >= 0) {
+      release_slot(ctx, sm->slot);
+      sm->slot = -1;
+    }
+
+    if(n == G3PLC_INIT_SUCCESS) {
+      sm->state = BOOT_IDLE;
+      ctx->current_baud  = attempt_baud(ctx, sm->attempt);
+
+      if(ctx->conf.boot_end)
+        ctx->conf.boot_end(ctx->conf.data);
+      break;
+    }
+
+    if(++sm->attempt > ctx->conf.nbauds) {
+      sm->state = BOOT_IDLE;
+      break;
+    }
+
+    n = boot_attempt(ctx);
+  }
+
+  return n;
+}
+
+int g3plc_reset_begin(struct g3plc_ctx *ctx)
+{
+  if(ctx->conf.boot_start)
+    ctx->conf.boot_start(ctx->conf.data);
+
+  /* Try the fastest speeds first and fall back on the default
+     one. Each attempt starts over with a hardware reset. */
+  ctx->boot_sm = (struct g3plc_boot_sm){ .slot = -1 };
+  return boot_settle(ctx, boot_attempt(ctx));
+}
+
+int g3plc_reset_feed(struct g3plc_ctx *ctx, const void *buf, unsigned int size)
+{
+  struct g3plc_boot_sm *sm = &ctx->boot_sm;
+  const unsigned char *c = buf;
+  unsigned int attempt = sm->attempt;
+  int n = G3PLC_INIT_PENDING;
+
+  if(sm->state == BOOT_IDLE)
+    return G3PLC_INIT_BOOT_ERROR;
+
+  /* the rest of the buffer is stale once the device is reset */
+  for(; size && attempt == sm->attempt && n == G3PLC_INIT_PENDING ; size--)
+    n = boot_settle(ctx, boot_step(ctx, *c++));
+
+  return n;
+}
+
+int g3plc_reset_abort(struct g3plc_ctx *ctx, int err)
+{
+  if(ctx->boot_sm.state == BOOT_IDLE)
+    return G3PLC_INIT_BOOT_ERROR;
+
+  return boot_settle(ctx, err ? err : G3PLC_INIT_BOOT_TIMEOUT);
+}
+
+int g3plc_reset(struct g3plc_ctx *ctx)
+{
+  int n = g3plc_reset_begin(ctx);
+
+  while(n == G3PLC_INIT_PENDING) {
+    unsigned char c = 0;
+    int r = ctx->conf.uart_read(&c, 1, ctx->conf.data);
+
+    n = r < 0 ? g3plc_reset_abort(ctx, r) : g3plc_reset_feed(ctx, &c, 1);
+  }
+
+  return n;
+}
+
+const struct g3plc_baud * g3plc_baud(const struct g3plc_ctx *ctx)
+{
+  return ctx->current_baud;
+}
+
+/* Compare a PIB attribute with its expected value. The value is
+   compared as it was sent with mlme_set_request(). */
+#define xcheck_attr(attr, value) x_(check_attr, ctx, attr, 0, &value, sizeof(value))
+static int check_attr(struct g3plc_ctx *ctx, uint16_t attr_id, uint16_t attr_idx,
+                      const void *value, unsigned int size)
+{
+  unsigned char buf[G3PLC_PIB_MAX_SIZE];
+  unsigned int buf_size = sizeof(buf);
+  int n;
+
+  /* too long to compare, configure it again */
+  if(size > sizeof(buf))
+    return G3PLC_INIT_ATTACH_CONFIG;
+
+  n = g3plc_get_attr(ctx, attr_id, attr_idx, buf, &buf_size);
+  if(n == G3PLC_INIT_START_ERROR)
+    return G3PLC_INIT_ATTACH_CONFIG; /* refused */
+  if(n)
+    return n;
+  if(buf_size != size || memcmp(buf, value, size))
+    return G3PLC_INIT_ATTACH_CONFIG;
+
+  return G3PLC_INIT_SUCCESS;
+}
+
+int g3plc_attach(struct g3plc_ctx *ctx)
+{
+  /* status, g3mode, bandplan, reserved and extended address */
+  unsigned char buf[3 + sizeof(uint32_t) + sizeof(uint64_t)];
+  const struct g3plc_baud *baud = NULL;
+  uint64_t extaddr;
+  unsigned int i;
+  uint16_t u16;
+  uint8_t  u8;
+  int n = -1;
+
+  /* The device answers at the application
+     speed it was flashed with, if it runs. */
+  for(i = 0 ; i <= ctx->conf.nbauds && n < 0 ; i++) {
+    int slot;
+
+    baud = i < ctx->conf.nbauds ? &ctx->conf.bauds[i] : &default_baud;
+    xset_uart_speed(baud->appl);
+
+    slot = reserve_slot(ctx, G3PLC_G3_GETCONFIG_CONFIRM, buf, sizeof(buf));
+    if(slot < 0)
+      return G3PLC_INIT_CMD_TIMEOUT;
+
+    n = g3_getconfig_request(ctx);
+    if(n) {
+      release_slot(ctx, slot);
+      return n;
+    }
+
+    n = wait_on_slot(ctx, slot);
+  }
+  if(n < 0)
+    return G3PLC_INIT_CMD_TIMEOUT;
+  ctx->current_baud = baud;
+
+  /* The G3 controller refuses the request until G3 INIT. */
+  if(n < (int)sizeof(buf) || buf[0] != 0)
+    return G3PLC_INIT_ATTACH_CONFIG;
+
+  memcpy(&extaddr, buf + 3 + sizeof(uint32_t), sizeof(extaddr));
+  if(buf[2] != ctx->conf.bandplan || ntohll(ctx, extaddr) != ctx->conf.ext_address)
+    return G3PLC_INIT_ATTACH_CONFIG;
+
+  u16 = ctx->conf.mac_address;
+  xcheck_attr(G3PLC_ATTR_SHORTADDR, u16);
+  u16 = ctx->conf.pan_id;
+  xcheck_attr(G3PLC_ATTR_PANID, u16);
+  u8 = ctx->conf.retrans;
+  xcheck_attr(G3PLC_ATTR_RETRANS, u8);
+  u8 = ctx->conf.flags & G3PLC_PROMISC ? 1 : 0;
+  xcheck_attr(G3PLC_ATTR_PROMISCUOUS, u8);
+
+  for(i = 0 ; i < ctx->conf.nattrs ; i++) {
+    const struct g3plc_pib *attr = &ctx->conf.attrs[i];
+    x_(check_attr, ctx, attr->id, attr->idx, attr->value, attr->size);
+  }
 
   return G3PLC_INIT_SUCCESS;
 }
@@ -31,19 +31,39 @@
 #define _G3PLC_H_
 
 #include <stdint.h>
+#include <stddef.h>
 
+#include "g3plc-conf.h"
 #include "g3plc-cmd.h"
 #include "cmdbuf.h"
+#include "hist.h"
+#include "neigh.h"
+#include "rto.h"
+#include "g3plc-ind.h"
 
 #define G3PLC_MAJOR 2
-#define G3PLC_MINOR 4
+#define G3PLC_MINOR 5
 
+/* The static buffers and tables are sized in g3plc-conf.h. */
+#define G3PLC_BAUD_PROBES   8  /* default number of probes to validate a baud rate */
+#define G3PLC_RESET_PULSE   30000 /* default low time of the reset pin in us */
+#define G3PLC_RECONF_ATTRS  20 /* attributes changed at once by g3plc_reconfigure() */
 #define G3PLC_DATA_HDR_SIZE 28 /* see G3-PLC Serial Command Spec. p51 */
 #define G3PLC_MAX_PAYLOAD   G3PLC_MAX_CMD - G3PLC_DATA_HDR_SIZE - sizeof(struct g3plc_cmd)
 
+#define G3PLC_MAX_TABLE       1536 /* maximum size of the neighbour and device tables */
+#define G3PLC_NEIGHBOUR_TABLE 500  /* default size of the neighbour table */
+#define G3PLC_DEVICE_TABLE    500  /* default size of the device table */
+#define G3PLC_PAN_SCANS       1    /* default number of PAN kept by a scan */
+#define G3PLC_TMR_TTL         2    /* default tonemap response TTL (minutes) */
+#define G3PLC_TMR_HOLD        60000000UL /* time the TTL is kept short after a link changed (us) */
+
 enum g3plc_flags {
   G3PLC_INVALID = 0x1, /* do not filter invalid packets (packet header, CRC) */
   G3PLC_NOACK   = 0x2, /* enable ACK communications */
+  G3PLC_PROMISC = 0x4, /* do not filter packets to another destination */
+  G3PLC_ADAPT   = 0x8, /* refresh the tonemap of destinations whose link changed */
+  G3PLC_SECURE  = 0x10, /* encrypt and authenticate frames with the GMK (see g3plc_config) */
 };
 
 /* Initialization status */
@@ -53,6 +73,29 @@ enum g3plc_init_status {
   G3PLC_INIT_BOOT_TIMEOUT,  /* timeout waiting for boot confirmation */
   G3PLC_INIT_START_ERROR,   /* error during start sequence (CPX3 configuration) */
   G3PLC_INIT_CMD_TIMEOUT,   /* timeout waiting for request confirmation */
+  G3PLC_INIT_FIRMWARE,      /* invalid segment table in the firmware */
+  G3PLC_INIT_ATTACH_CONFIG, /* running firmware not configured as expected */
+  G3PLC_INIT_PENDING,       /* sequence still in progress (see g3plc_reset_feed()) */
+};
+
+/* UART speeds selected during the boot sequence. The code is
+   sent to the bootloader with its baud rate change command and
+   selects both the speed used to upload the remaining segments
+   and the speed of the application. That is the code 0x84 for
+   boot at 461k and application at 115.2k (the default). */
+struct g3plc_baud {
+  uint8_t      code;
+  unsigned int boot; /* boot speed */
+  unsigned int appl; /* application speed */
+};
+
+/* MAC PIB attribute value (see g3plc_set_attrs()).
+   The value is sent as is, in host order. */
+struct g3plc_pib {
+  uint16_t     id;    /* PIB attribute ID */
+  uint16_t     idx;   /* index within the table for PIB attribute */
+  const void  *value; /* attribute value */
+  unsigned int size;  /* attribute size */
 };
 
 /* Status of a received frame/command */
@@ -74,32 +117,75 @@ enum g3plc_send_status {
   G3PLC_SND_CONFIRM,       /* cannot confirm transmission */
   G3PLC_SND_ACCESS,        /* did not transmit because of activity on the channel */
   G3PLC_SND_OOM,           /* out of memory in internal buffer */
+  G3PLC_SND_BUSY,          /* too many frames awaiting confirmation */
   G3PLC_SND_FAILURE,       /* (any other reason) */
 };
 
-/* Information about a received data frame */
-struct g3plc_data_hdr {
-  uint8_t  src_mode;    /* source address mode */
-  uint16_t src_pan;     /* source PAN ID */
-  uint64_t src_addr;    /* source short address */
+/* MCPS-DATA quality of service. High priority frames use the
+   high priority contention window of the modem, so they get
+   the channel before the normal ones queued on other nodes. */
+enum g3plc_qos {
+  G3PLC_QOS_NORMAL,
+  G3PLC_QOS_HIGH
+};
 
-  uint8_t  dst_mode;    /* destination address mode */
-  uint16_t dst_pan;     /* destination PAN ID */
-  uint64_t dst_addr;    /* destination short address */
+/* MAC acknowledgment of a frame */
+enum g3plc_ack {
+  G3PLC_ACK_DEFAULT, /* acknowledged unless G3PLC_NOACK */
+  G3PLC_ACK_ON,
+  G3PLC_ACK_OFF
+};
 
-  uint8_t  handle;      /* handle associated to MSDU */
-  uint8_t  seqno;       /* sequence number */
-  uint32_t time;        /* time, in symbols, at which the data were transmitted */
+/* Options of a single frame (see g3plc_send_opts()). A frame sent
+   without ACK is confirmed as soon as it left the modem, which is
+   meant for loss tolerant traffic. The maximum number of
+   retransmissions is a MAC attribute (see retrans), it cannot be
+   changed for a single frame. */
+struct g3plc_tx_opts {
+  enum g3plc_qos qos;
+  enum g3plc_ack ack;
+};
 
-  uint8_t  sec_level;   /* security level */
-  uint8_t  key_id_mode; /* key identification mode */
-  uint64_t key_source;  /* (not used) */
-  uint8_t  key_index;   /* key index */
-  uint8_t  QoS;         /* Quality of Service */
-  uint8_t  estimated;   /* ? */
-  uint32_t tonemap;     /* estimated tonemap */
+/* Link state derived from the indications of the device. The
+   state gets worse on each event until a frame is confirmed or
+   received again, which brings the link back up. */
+enum g3plc_link {
+  G3PLC_LINK_UP,       /* no event since the last frame */
+  G3PLC_LINK_DEGRADED, /* the G3 controller reported an event */
+  G3PLC_LINK_DOWN      /* the device left the network */
 };
 
+struct g3plc_link_state {
+  enum g3plc_link state;
+  unsigned long   events;      /* G3-EVENT indications */
+  unsigned long   comm_status; /* MLME-COMM-STATUS indications */
+  unsigned long   leaves;      /* ADPM-NETWORK-LEAVE indications */
+  uint8_t         event;       /* code of the last G3 event */
+  uint16_t        event_cmd;   /* IDA, IDP and command ID of the last G3 event */
+  unsigned long   stamp;       /* clock at the last change */
+};
+
+/* Configuration of the second G3 channel of the CPX
+   (see g3plc_config.chan1). The first channel uses
+   the fields of g3plc_config. Each channel runs a PAN
+   of its own, possibly a part of a PAN too large for a
+   single one. Frames to a destination go on the channel
+   it was last heard on and those to a destination not
+   heard yet go on the first one, or are balanced between
+   both when asynchronous. The short addresses must then
+   be unique across both PANs. */
+struct g3plc_chan_conf {
+  uint8_t  bandplan;    /* bandplan (see g3plc_bandplan) */
+  uint16_t pan_id;      /* PAN ID */
+  uint16_t mac_address; /* device short MAC address */
+  uint64_t ext_address; /* extended 64-bit address */
+};
+
+/* Let g3plc_send_async_chan() choose the channel. */
+#define G3PLC_CHAN_ANY -1
+
+struct g3plc_ctx;
+
 struct g3plc_config {
     struct g3plc_callbacks {
     /* The raw callback is called for each received command packet.
@@ -107,29 +193,49 @@ struct g3plc_config {
        This is useful for user that wants to implement their own dissector. */
     void (*raw)(const struct g3plc_cmd *cmd, unsigned int size, int status, void *data);
 
-    void (*cb_recv)(const struct g3plc_data_hdr *hdr,
+    /* Called for each MCPS-DATA indication. The indication view
+       and the payload point into the receive buffer and are only
+       valid during the call (see g3plc-ind.h). */
+    void (*cb_recv)(const struct g3plc_ind *ind,
                     const void *payload, unsigned payload_size,
                     int status, void *data);
+
+    /* Called when the confirmation for a frame sent with
+       g3plc_send_async() is received, the status is one of
+       g3plc_send_status. Also called with G3PLC_SND_CONFIRM
+       for each frame dropped by g3plc_send_flush(). */
+    void (*cb_sent)(uint8_t handle, int status, void *data);
+
+    /* Called from the receive path when the link state changes
+       (see g3plc_link()). The state is only valid during the call. */
+    void (*cb_link)(const struct g3plc_link_state *link, void *data);
   } callbacks;
 
-  /* The driver will use those functions to start, stop and wait
-     for timers. The stop function should also drop any wait in
-     place on the timer. */
-  void (*start_timer)(unsigned int us);
-  void (*stop_timer)(void);
-  void (*wait_timer)(void);
+  /* The driver will use those functions to wait for confirmations.
+     There are G3PLC_MAX_WAITERS slots which can be waited on from
+     different threads at once. The arm function resets the slot
+     before the request is sent. The wait function returns when
+     the slot is signaled or when the timeout (in us) expires,
+     whichever comes first. A signal sent after the slot has been
+     armed but before the wait has started must not be lost.
+     Like the other platform functions they receive the data
+     pointer of this configuration. */
+  void (*arm_slot)(unsigned int slot, void *data);
+  void (*wait_slot)(unsigned int slot, unsigned int us, void *data);
+  void (*signal_slot)(unsigned int slot, void *data);
 
   /* The driver will use the uart_send() function to write
      the resulting frame on the device's UART. This
      function should return a negative value in case of
-     error or 0 on success. */
-  int (*uart_send)(const void *buf, unsigned int size);
+     error or 0 on success, that is only once the whole
+     buffer was written (even after a short write). */
+  int (*uart_send)(const void *buf, unsigned int size, void *data);
 
   /* The g3plc_reset() function will use this to read
      from the device during the boot sequence. This
      function should return a negative value in case of
      error or 0 on success. */
-  int (*uart_read)(void *buf, unsigned int size);
+  int (*uart_read)(void *buf, unsigned int size, void *data);
 
   /* Change UART speed.
      This take an integer (not a speed_t type).
@@ -138,7 +244,7 @@ struct g3plc_config {
        - 500k
        - 115.2k
      and return a negative number on error. */
-  int (*set_uart_speed)(unsigned int speed);
+  int (*set_uart_speed)(unsigned int speed, void *data);
 
   /* The function g3plc_uart_putc() is generally called
      from an interrupt handler. Since we cannot parse
@@ -146,64 +252,564 @@ struct g3plc_config {
      a complete frame has been received. Control is then
      transferred to this function which can either directly
      be g3plc_recv_frame() or use semaphores to defer
-     outside of the interrupt context. */
-  int (*recv_frame)(void);
-
-  /* Clear/set the reset pin. */
-  void (*reset_clear)(void);
-  void (*reset_set)(void);
+     outside of the interrupt context. On a MCU, the
+     interrupt handler can rather only enqueue the bytes
+     in an isr_ring for a task to g3plc_uart_feed() them
+     (see common/isr-ring.h). */
+  int (*recv_frame)(struct g3plc_ctx *ctx);
+
+  /* Lock/unlock the state shared between the sender and
+     the receiver (pipelined frames). Both can be NULL if
+     the driver is used from a single thread. */
+  void (*lock)(void *data);
+  void (*unlock)(void *data);
+
+  /* Lock/unlock the packed command buffer, shared by the data
+     requests and the other commands which may be sent from
+     another thread (see g3plc_reconfigure()). It is held while
+     each command is written on the UART, and around lock(), so
+     it should sleep rather than spin. Both can be NULL if the
+     driver is used from a single thread. */
+  void (*snd_lock)(void *data);
+  void (*snd_unlock)(void *data);
+
+  /* Clear/set the reset pin. The pin is held low for
+     reset_pulse us (G3PLC_RESET_PULSE when 0). */
+  void (*reset_clear)(void *data);
+  void (*reset_set)(void *data);
+  unsigned int reset_pulse;
 
   /* Not all platform provide byte ordering functions
-     with the same names as POSIX. */
+     with the same names as POSIX. They are not used (and
+     may be NULL) when built with PLATFORM_ENDIAN. */
   uint16_t (*htons)(uint16_t v);
   uint32_t (*htonl)(uint32_t v);
   uint16_t (*ntohs)(uint16_t v);
   uint32_t (*ntohl)(uint32_t v);
 
   /* Microseconds sleep. */
-  void (*usleep)(unsigned long us);
+  void (*usleep)(unsigned long us, void *data);
+
+  /* Monotonic clock in microseconds used to time each
+     stage (see g3plc_stats()). No stage is timed when
+     this is NULL. */
+  unsigned long (*clock)(void *data);
+
+  /* Firmware flashed by g3plc_reset(). When this is NULL
+     we use the firmware compiled in from firmware.h. The
+     image is only read so it may be mapped from a file. */
+  const void   *firmware;
+  unsigned long firmware_size;
+
+  /* Speeds tried by g3plc_reset() in this order, the fastest first.
+     The default speed is always tried last. Each speed is validated
+     with baud_probes commands (G3PLC_BAUD_PROBES when 0), it is kept
+     when all of them are confirmed without any invalid frame. */
+  const struct g3plc_baud *bauds;
+  unsigned int nbauds;
+  unsigned int baud_probes;
 
   /* Signal progress in the boot sequence. */
-  void (*boot_start)(void);
-  void (*boot_progress)(void);
-  void (*boot_end)(void);
+  void (*boot_start)(void *data);
+  void (*boot_progress)(void *data);
+  void (*boot_end)(void *data);
 
   uint8_t bandplan;     /* bandplan (see g3plc_bandplan) */
   uint16_t pan_id;      /* PAN ID */
   uint16_t mac_address; /* device short MAC address */
   uint64_t ext_address; /* extended 64-bit address */
   unsigned int retrans; /* maximum number of retransmissions */
+
+  /* The modem picks the modulation and tonemap of each destination
+     from its last tonemap response, those are requested again once
+     they are older than the tonemap response TTL. With G3PLC_ADAPT,
+     the MCPS-DATA indications of a destination are watched and when
+     its estimated modulation or tonemap changed, the TTL is lowered
+     to one minute for G3PLC_TMR_HOLD so that the next frames request
+     a new response. Stable links keep their modulation, robust mode
+     is only used on the links that need it. The TTL is then set back
+     to tmr_ttl (G3PLC_TMR_TTL when 0). A clock is required. */
+  unsigned int tmr_ttl;
+
+  /* When not NULL, g3plc_start() also starts the second channel
+     (G3PLC_CHAN1) with this configuration after the first one.
+     The built-in and user attributes are set on both channels.
+     Only the first channel is checked by g3plc_attach() and
+     used by g3plc_send(). */
+  const struct g3plc_chan_conf *chan1;
   unsigned int timeout; /* request timeout in us */
+
+  /* Lower bound of the MCPS-DATA confirm timeout. When it is not zero
+     (and a clock is available) the timeout of each destination is
+     estimated from its previous confirms with timeout as the upper
+     bound. Other requests always wait for timeout. */
+  unsigned int min_timeout;
+
+  /* Sizes of the neighbour and device tables of the G3 controller
+     (up to G3PLC_MAX_TABLE entries) and number of PAN kept by a scan
+     (1 to 128). The defaults (G3PLC_NEIGHBOUR_TABLE, G3PLC_DEVICE_TABLE
+     and G3PLC_PAN_SCANS) are used when zero. Large networks need tables
+     larger than the number of nodes or the modem keeps evicting them. */
+  unsigned int neighbour_table;
+  unsigned int device_table;
+  unsigned int pan_scans;
+
+  unsigned int window;  /* maximum number of asynchronous frames in flight */
   unsigned long flags;  /* (see g3plc_flags) */
 
-  void *data; /* context data passed to user callbacks */
+  /* With G3PLC_SECURE, the group master key is written to the MAC
+     key table at key_index by g3plc_start() and every frame is sent
+     with the ENC-MIC-32 security level (AES-CCM* in the modem). The
+     modem drops the frames whose MIC does not match and the driver
+     drops the unsecured ones (see rx_insecure). The key schedule is
+     kept by the modem so it costs nothing on the host. */
+  uint8_t gmk[16];
+  uint8_t key_index;
+
+  /* Additional MAC PIB attributes set by g3plc_start()
+     after the ones above, in this order. */
+  const struct g3plc_pib *attrs;
+  unsigned int nattrs;
+
+  void *data; /* context data passed to user callbacks and platform functions */
+};
+
+/* Stages timed by the driver. The confirmation includes the
+   MAC acknowledgment and the retransmissions since they are
+   both handled by the modem. */
+enum g3plc_stage {
+  G3PLC_STAGE_UART,    /* write of a command to the UART */
+  G3PLC_STAGE_CONFIRM, /* MCPS-DATA request to its confirmation */
+  G3PLC_STAGE_RECV,    /* end of a received frame to cb_recv */
+  G3PLC_STAGE_MAX
 };
 
-/* Initialize the G3PLC driver (see g3plc_config). */
-void g3plc_init(const struct g3plc_config *conf);
+/* Frame counters (see g3plc_counters()) */
+struct g3plc_counters {
+  unsigned long tx_frames;   /* MCPS-DATA requests sent */
+  unsigned long tx_noack;    /* frames confirmed without acknowledgment */
+  unsigned long tx_failures; /* frames confirmed with another error */
+  unsigned long rx_frames;   /* MCPS-DATA indications */
+  unsigned long rx_crc;      /* commands with an invalid CRC */
+  unsigned long rx_invalid;  /* commands with an invalid header */
+  unsigned long rx_filtered; /* indications to another destination dropped before the CRC */
+  unsigned long tx_robust;   /* frames sent to a destination estimated in robust mode (G3PLC_ADAPT) */
+  unsigned long tx_tmr;      /* frames sent to a destination whose link changed (G3PLC_ADAPT) */
+  unsigned long rx_insecure; /* unsecured indications dropped (G3PLC_SECURE) */
+  unsigned long tx_bytes;    /* bytes of the commands sent, before HDLC */
+  unsigned long tx_escapes;  /* bytes of the commands sent that needed an HDLC escape */
+};
+
+/* Maximum number of neighbours kept (see g3plc_neighbours()) */
+#define G3PLC_MAX_NEIGHBOURS NEIGH_SIZE
+
+/* Statistics of a neighbour (see g3plc_neighbour()) */
+struct g3plc_neighbour {
+  uint16_t      addr;       /* short address */
+  uint8_t       lqi;        /* last link quality */
+  uint8_t       lqi_avg;    /* moving average of the link quality */
+  uint8_t       modulation; /* last estimated modulation */
+  uint32_t      tonemap;    /* last estimated tonemap */
+  unsigned long frames;     /* indications received */
+  unsigned long stamp;      /* clock at the last indication */
+  uint8_t       chan;       /* G3 channel it was last heard on (see g3plc_channel) */
+};
+
+/* Handler for a command received from the device. The data are the
+   command data (size bytes) and only valid during the call.
+   Return a receive status (see g3plc_receive_status). */
+typedef int (*g3plc_handler)(const struct g3plc_cmd *cmd,
+                             const unsigned char *data, unsigned int size,
+                             void *arg);
+
+/* Boot segments of the firmware table (4-bit segment number). */
+#define G3PLC_BOOT_SEGMENTS 16
+
+/* The MCPS-DATA request header only changes with the destination,
+   the MSDU length and handle. The prefix holds the command header,
+   the address modes and the PAN ID, the tail the rest of the header
+   (see init_data_tmpl()). */
+#define G3PLC_DATA_PREFIX_SIZE (sizeof(struct g3plc_cmd) + 4)
+#define G3PLC_DATA_TAIL_SIZE   (G3PLC_DATA_HDR_SIZE - 4)
+
+/* A request waiting for its confirmation. The status
+   of MLME-SET confirmations is copied in the buffer. */
+struct g3plc_cmd_wait {
+  int slot;
+  unsigned char status[5]; /* status, attribute ID and index */
+};
+
+/* Driver instance. All the state of the driver lives here so
+   that one process can drive as many devices as it needs, each
+   with its own command buffers. The platform dependent functions
+   receive the data pointer from the configuration to find their
+   own state. The fields are private, the structure is only public
+   so that it can be allocated statically. */
+struct g3plc_ctx {
+  /* G3PLC configuration with platform dependent functions,
+     source mac address, callbacks and flags. */
+  struct g3plc_config conf;
+
+  /* Receive and send command buffers. Unpacked commands
+     (without HDLC and delimiters) are assembled and parsed
+     in these two buffers. Packed commands are streamed to
+     the UART through the packed send buffer, a chunk at a
+     time (see pack_stream_begin()). The received commands
+     are unescaped on the fly directly into rcv_cmdbuf. */
+  unsigned char snd_cmdbuf[G3PLC_MAX_CMD];
+  unsigned char rcv_cmdbuf[G3PLC_MAX_CMD];
+  unsigned char snd_cmdbuf_packed[G3PLC_SND_CHUNK];
+
+  /* Used in conjunction with the dissector
+     to synchronize request/confirm. Each slot
+     is a pending request which is signaled
+     independently when its confirmation is
+     received. The payload is copied either in
+     the buffer provided by the waiter or in the
+     preallocated slot buffer so the dissector
+     never has to allocate. */
+  struct g3plc_slot {
+    unsigned int used;     /* slot reserved by a waiter */
+    unsigned int done;     /* waited command received */
+    uint32_t literal;      /* waited command literal */
+    unsigned char *buf;    /* where to copy the payload */
+    unsigned int buf_size; /* size of the payload buffer */
+    unsigned int size;     /* size of the received payload */
+    unsigned char data[G3PLC_MAX_CMD];
+  } cmd_slots[G3PLC_MAX_WAITERS];
+
+  /* MAC PIB attributes read with MLME-GET. Entries are replaced
+     round robin and invalidated when we set the attribute or when
+     the PIB is reset (flash or MLME reset). */
+  struct g3plc_pib_entry {
+    unsigned int used;
+    uint16_t     id;
+    uint16_t     idx;
+    unsigned int size;
+    unsigned char value[G3PLC_PIB_MAX_SIZE];
+  } pib_cache[G3PLC_PIB_CACHE];
+  unsigned int pib_next;
+
+  /* Outstanding asynchronous MCPS-DATA requests indexed by
+     MSDU handle. The handle 0x00 is reserved for synchronous
+     requests so that their confirmation is not mistaken for
+     the confirmation of a pipelined frame. */
+  uint8_t snd_handles[256 / 8];
+  unsigned int snd_inflight;
+  uint8_t snd_next_handle;
+
+  /* Configuration of each G3 channel in use (see g3plc_config.chan1)
+     with the channel of each asynchronous request and the number of
+     requests in flight on each channel. */
+  struct g3plc_chan_conf chans[2];
+  unsigned int nchans;
+  uint8_t snd_chans[256];
+  unsigned int chan_inflight[2];
+  unsigned int chan_last; /* channel of the last request when balanced */
+
+  /* Latency histograms of each stage (see g3plc_stats()) with
+     the start of the MCPS-DATA requests in flight, indexed by
+     MSDU handle, and the end of the last received frame. */
+  struct hist stage_hists[G3PLC_STAGE_MAX];
+  unsigned long snd_stamps[256];
+  unsigned long rcv_stamp;
+  unsigned long rcv_first; /* clock at the opening delimiter */
+
+  /* Frame counters (see g3plc_counters()) */
+  struct g3plc_counters counters;
+
+  /* Neighbour statistics (see g3plc_neighbour()) */
+  struct neigh_table neighbours;
+
+  /* Link state (see g3plc_link()) */
+  struct g3plc_link_state link;
+
+  /* Tonemap adaptation (see G3PLC_ADAPT) */
+  int           tmr_short; /* the TTL is lowered */
+  unsigned long tmr_until; /* clock when it is set back */
+
+  /* Confirm timeout of each destination (see min_timeout).
+     This is a direct-mapped table on the destination address,
+     an evicted destination starts again from the upper bound. */
+  struct g3plc_rto_peer {
+    uint16_t   addr;
+    uint8_t    used;
+    struct rto rto;
+  } rto_peers[G3PLC_RTO_PEERS];
+
+  /* The result of the speed negotiation and the
+     number of invalid frames received (to validate
+     the speed). */
+  const struct g3plc_baud *current_baud;
+  unsigned long rcv_errors;
+
+  /* Segments of the firmware as found in its table. Each entry is
+     checked against the size of the image the first time the device
+     requests it and kept for the next resets. */
+  struct g3plc_boot_segment {
+    const uint8_t *info; /* segment info table */
+    const uint8_t *data;
+    uint32_t       size;
+    int            valid;
+  } boot_segments[G3PLC_BOOT_SEGMENTS];
+
+  /* Receiver state, the command is unescaped directly
+     into the receive buffer while it is received.
+     Glue between uart_feed() and recv_frame(). */
+  unsigned int rcv_size;     /* size of the last received command */
+  unsigned char *rcv_ptr;    /* NULL when out-of-frame */
+  unsigned int rcv_escaped;  /* last byte was an escape (0x7d) */
+  unsigned int rcv_overflow; /* frame larger than receive buffer */
+
+  /* State of the start sequence (see g3plc_start_begin()). */
+  struct g3plc_start_sm {
+    int          state; /* see start_state */
+    unsigned int chan;  /* channel being started */
+
+    struct g3plc_cmd_wait waits[G3PLC_MAX_WAITERS];
+    unsigned int  nwaits;    /* requests sent in this state */
+    unsigned int  confirmed; /* requests confirmed in this state */
+    unsigned long progress;  /* requests confirmed since the beginning */
+    int           err;       /* first error in this state */
+
+    /* attributes of the current state */
+    const struct g3plc_pib *attrs;
+    unsigned int            nattrs;
+    unsigned int            next; /* first attribute not sent yet */
+
+    uint16_t shortaddr;
+    uint16_t pan_id;
+    uint8_t  retrans;
+    uint8_t  promiscuous;
+    struct g3plc_pib builtin[5];
+    unsigned int     nbuiltin;
+  } start_sm;
+
+  /* MCPS-DATA request header of each channel. The command header,
+     address modes and PAN ID are packed with their CRC and the rest
+     of the header is patched on each request. */
+  struct g3plc_data_tmpl {
+    unsigned char packed[2 * G3PLC_DATA_PREFIX_SIZE + 1]; /* delimiter and escaped prefix */
+    unsigned int  packed_size;
+    uint32_t      crc;                        /* CRC of the prefix */
+    unsigned char tail[G3PLC_DATA_TAIL_SIZE]; /* destination, length, handle, TX options and security */
+  } data_tmpls[2];
+
+  /* Command handlers (see g3plc_register()). The table is open
+     addressed with linear probing on a hash of the layer and the
+     command ID, which are the fields that differ between commands. */
+  struct g3plc_cmd_handler {
+    uint32_t      literal;
+    g3plc_handler handler; /* NULL when the entry is free */
+    void         *arg;
+  } handlers[G3PLC_MAX_HANDLERS];
+
+  /* State of the boot sequence (see g3plc_reset_begin()). */
+  struct g3plc_boot_sm {
+    int           state;   /* see boot_state */
+    unsigned int  attempt; /* index of the speed (see attempt_baud()) */
+    unsigned int  probes;  /* probes confirmed at this speed */
+    unsigned long errors;  /* receive errors before the confirmation */
+    int           slot;    /* slot of the confirmation or -1 */
+    unsigned char confirm; /* discarded payload */
+  } boot_sm;
+};
+
+/* Initialize the G3PLC driver (see g3plc_config).
+   The whole instance is cleared. */
+void g3plc_init(struct g3plc_ctx *ctx, const struct g3plc_config *conf);
 
 /* Flash the modem with the firmware.
-   Return 0 on success, for other error codes see g3plc_init_status. */
-int g3plc_reset(void);
+   Return 0 on success, for other error codes see g3plc_init_status.
+   The segment table of the firmware is checked on the first reset
+   and kept for the next ones until the driver is initialized again.
+   The device is flashed again at a lower speed when a speed does
+   not work (see bauds in g3plc_config). */
+int g3plc_reset(struct g3plc_ctx *ctx);
+
+/* Resumable boot sequence for an event loop. This is what g3plc_reset()
+   does without blocking on uart_read(). The begin function resets the
+   device and each byte read from the UART must then be fed to the boot
+   sequence instead of the receive path. The abort function fails the
+   current attempt (with G3PLC_INIT_BOOT_TIMEOUT when err is 0), for
+   instance when the device stays silent too long, and the next speed
+   is tried. They return G3PLC_INIT_PENDING until the boot sequence is
+   over and then its status like g3plc_reset(). */
+int g3plc_reset_begin(struct g3plc_ctx *ctx);
+int g3plc_reset_feed(struct g3plc_ctx *ctx, const void *buf, unsigned int size);
+int g3plc_reset_abort(struct g3plc_ctx *ctx, int err);
+
+/* UART speeds selected by the last successful g3plc_reset(). */
+const struct g3plc_baud * g3plc_baud(const struct g3plc_ctx *ctx);
+
+/* Copy the latency histogram of a stage in microseconds.
+   The histograms are cleared by g3plc_init(). */
+void g3plc_stats(const struct g3plc_ctx *ctx, enum g3plc_stage stage, struct hist *h);
+
+/* Copy the link state (see g3plc_link_state).
+   The state is cleared by g3plc_init(). */
+void g3plc_link(const struct g3plc_ctx *ctx, struct g3plc_link_state *link);
+
+/* Copy the frame counters.
+   The counters are cleared by g3plc_init(). */
+void g3plc_counters(const struct g3plc_ctx *ctx, struct g3plc_counters *counters);
+
+/* Copy the statistics of a neighbour heard in MCPS-DATA indications.
+   This does not need any UART traffic so it is cheap enough for
+   routing or medium selection. Only neighbours with a short source
+   address are kept and the least recently heard ones are evicted.
+   Return 0 on success or -1 when the neighbour is unknown.
+   The neighbours are cleared by g3plc_init(). */
+int g3plc_neighbour(const struct g3plc_ctx *ctx, uint16_t addr, struct g3plc_neighbour *n);
+
+/* Copy the statistics of up to max neighbours.
+   Return the number of neighbours copied. */
+unsigned int g3plc_neighbours(const struct g3plc_ctx *ctx, struct g3plc_neighbour *n, unsigned int max);
 
 /* Configure the CPX3 and start the MAC layer. */
-int g3plc_start(void);
+int g3plc_start(struct g3plc_ctx *ctx);
+
+/* Resumable start sequence for an event loop. This is what g3plc_start()
+   does without blocking on wait_slot(). The begin function sends the first
+   requests and the resume function must be called when a slot is signaled
+   (see signal_slot) to match the confirmations and send the next requests.
+   The timeout function fails the sequence when no confirmation arrived
+   within the configured timeout. Like g3plc_start() this needs the receive
+   path. They return G3PLC_INIT_PENDING until the start sequence is over
+   and then its status like g3plc_start(). */
+int g3plc_start_begin(struct g3plc_ctx *ctx);
+int g3plc_start_resume(struct g3plc_ctx *ctx);
+int g3plc_start_timeout(struct g3plc_ctx *ctx);
+
+/* Set MAC PIB attributes. The requests are sent back to back,
+   up to G3PLC_MAX_WAITERS at once, before their confirmations
+   are matched in order so that the whole batch costs about one
+   round trip.
+   Return 0 on success, G3PLC_INIT_START_ERROR when an attribute
+   is refused and for other error codes see g3plc_init_status. */
+int g3plc_set_attrs(struct g3plc_ctx *ctx, const struct g3plc_pib *attrs, unsigned int nattrs);
+
+/* Apply the tunables of a new configuration to the running driver,
+   without a reset nor a new start sequence. Only the attributes that
+   changed are set with MLME-SET: the short address, the PAN ID, the
+   retransmissions, the promiscuous mode and the attributes of the
+   list (compared by ID and index with the previous list). The driver
+   then takes the timeouts, the window and the flags. The other fields
+   (callbacks, firmware, bauds, tables, second channel...) are ignored.
+   The attribute list must stay valid like the configuration given to
+   g3plc_init(). Data requests may be sent meanwhile from another thread
+   but not other commands. The configuration applies all or nothing: the
+   current value of each changed attribute is read first and set back
+   when one of them is refused (an attribute that cannot be read was
+   never set and stays), and the driver only takes the new values once
+   the modem did.
+   Return 0 on success, G3PLC_INIT_START_ERROR when more than
+   G3PLC_RECONF_ATTRS attributes changed, or an error like
+   g3plc_set_attrs(). In that case the driver keeps its previous
+   configuration, so does the modem unless setting back the previous
+   values failed too. */
+int g3plc_reconfigure(struct g3plc_ctx *ctx, const struct g3plc_config *conf);
+
+/* Read a MAC PIB attribute with MLME-GET. The value is copied
+   into the buffer, truncated to its size, and size is updated
+   with the actual size of the attribute (up to G3PLC_PIB_MAX_SIZE).
+   Values are cached until the driver sets the attribute or the
+   PIB is reset so that the same read does not cost a round trip.
+   Return 0 on success, G3PLC_INIT_START_ERROR when the attribute
+   is refused and for other error codes see g3plc_init_status. */
+int g3plc_get_attr(struct g3plc_ctx *ctx, uint16_t id, uint16_t idx, void *value, unsigned int *size);
+
+/* Attach to a CPX3 that is already running, instead of g3plc_reset()
+   and g3plc_start(). The device is probed at the application speed
+   of each boot speed (see bauds in g3plc_config) and its configuration
+   compared with g3plc_config. Like g3plc_start() this needs the receive
+   path (see uart_putc).
+   Return 0 when the device can be used as is, G3PLC_INIT_ATTACH_CONFIG
+   when the firmware is running but g3plc_start() is still needed and
+   G3PLC_INIT_CMD_TIMEOUT when the device has to be flashed again. */
+int g3plc_attach(struct g3plc_ctx *ctx);
+
+/* Dispatch the commands with a literal (see LITERAL_G3PLC_CMD()) to a
+   handler. The lookup is a hashed table so the dissector handles any
+   number of commands in constant time. Commands are still matched to
+   waited confirmations first, then given to their handler, and those
+   without handler are ignored. Registering a literal again replaces
+   its handler. The MCPS-DATA indication handler is registered by
+   g3plc_init() which clears the table.
+   Return 0 on success or -1 when the table is full. */
+int g3plc_register(struct g3plc_ctx *ctx, uint32_t literal, g3plc_handler handler, void *arg);
+void g3plc_unregister(struct g3plc_ctx *ctx, uint32_t literal);
 
 /* Send a command to the G3PLC device.
-   The command before must be four bytes longer than actually announced
-   since the function will append a CRC to the supplied buffer. */
-int g3plc_command(struct g3plc_cmd *cmd, unsigned int size);
+   The CRC is computed while the command is packed,
+   so the supplied buffer is not modified beyond
+   conversion of its header to network order. */
+int g3plc_command(struct g3plc_ctx *ctx, struct g3plc_cmd *cmd, unsigned int size);
+
+/* Same as g3plc_command() but the payload is supplied as a separate segment
+   which is appended to the command without being copied into it first. */
+int g3plc_command_payload(struct g3plc_ctx *ctx, struct g3plc_cmd *cmd, unsigned int size,
+                          const void *payload, unsigned int payload_size);
+
+/* Send a request and wait for its confirm, which is the command with
+   the same type, channel, layer and ID. The confirm data are copied
+   into the buffer, truncated to its size, and confirm_size is updated
+   with the size received. The PIB cache is flushed by the MLME-SET and
+   MLME-RESET requests. This is meant for the commands the driver does
+   not wrap, like the management tools (see --control).
+   Return 0 on success, G3PLC_INIT_START_ERROR when the request cannot
+   be sent and G3PLC_INIT_CMD_TIMEOUT when it was not confirmed. */
+int g3plc_command_confirm(struct g3plc_ctx *ctx, struct g3plc_cmd *cmd, unsigned int size,
+                          void *confirm, unsigned int *confirm_size);
 
 /* Assemble and send a frame to the specified destination using G3PLC.
    When ACK is enabled, this function will block until the packet has
    been successfully transmitted. For the error see g3plc_send_status.
    If the tx pointer is not null, it is replaced with the number of
    transmissions necessary to succesfully send the packet. */
-int g3plc_send(uint16_t dst, const void *payload, unsigned int payload_size);
+int g3plc_send(struct g3plc_ctx *ctx, uint16_t dst, const void *payload, unsigned int payload_size);
+
+/* Same as g3plc_send() with the options of this frame, the
+   defaults (G3PLC_QOS_NORMAL and configured ACKs) when NULL. */
+int g3plc_send_opts(struct g3plc_ctx *ctx, uint16_t dst, const void *payload, unsigned int payload_size,
+                    const struct g3plc_tx_opts *opts);
+
+/* Assemble and send a frame without waiting for its confirmation.
+   Each frame gets its own MSDU handle, stored in handle when not null,
+   and its status is reported later through the cb_sent callback.
+   At most window frames can be in flight, past that this function
+   returns G3PLC_SND_BUSY. Since the command buffer is shared, this
+   must not be called concurrently with g3plc_send(). When the second
+   channel is configured the frames go to the PAN of their destination
+   or are balanced on both channels. */
+int g3plc_send_async(struct g3plc_ctx *ctx, uint16_t dst, const void *payload, unsigned int payload_size,
+                     uint8_t *handle);
+
+/* Same as g3plc_send_async() on a channel (see g3plc_channel). The
+   window applies to each channel. With G3PLC_CHAN_ANY the frame goes
+   to the PAN of its destination (see g3plc_chan_conf) or, when it
+   is unknown, to the configured channel with the fewest frames in
+   flight. */
+int g3plc_send_async_chan(struct g3plc_ctx *ctx, int chan, uint16_t dst, const void *payload,
+                          unsigned int payload_size, uint8_t *handle);
+
+/* Same as g3plc_send_async_chan() with the options of this frame. */
+int g3plc_send_async_opts(struct g3plc_ctx *ctx, int chan, uint16_t dst, const void *payload,
+                          unsigned int payload_size, const struct g3plc_tx_opts *opts, uint8_t *handle);
+
+/* Number of asynchronous frames awaiting confirmation. */
+unsigned int g3plc_send_inflight(const struct g3plc_ctx *ctx);
+
+/* Number of asynchronous frames awaiting confirmation on a channel. */
+unsigned int g3plc_send_inflight_chan(const struct g3plc_ctx *ctx, unsigned int chan);
+
+/* Forget about all asynchronous frames awaiting confirmation.
+   This is meant to be called when the confirmations timed out. */
+void g3plc_send_flush(struct g3plc_ctx *ctx);
 
 /* Start the processing of a frame. Can be called either automatically
    when a complete frame has been received or manually from another thread. */
-int g3plc_recv_frame(void);
+int g3plc_recv_frame(struct g3plc_ctx *ctx);
 
 /* Called by the platform dependent part of the driver when a character
    has been received on UART from the device. This function can block
@@ -211,21 +817,43 @@ int g3plc_recv_frame(void);
    if the receive callback itself is blocked. Note that this function
    is *NOT* reentrant. You have to wait for its completion until you
    can call it again. */
-int g3plc_uart_putc(unsigned char c);
+int g3plc_uart_putc(struct g3plc_ctx *ctx, unsigned char c);
+
+/* Same as g3plc_uart_putc() but for a whole buffer of received characters.
+   Frame delimiters are searched and commands unescaped in a single pass.
+   This is preferred when the platform can read from UART in bulk.
+   Call it as soon as the buffer was read, each indication is stamped
+   with the clock when its opening delimiter was fed (see g3plc_ind).
+   Returns the status of the last complete frame or G3PLC_RCV_CONT. */
+int g3plc_uart_feed(struct g3plc_ctx *ctx, const unsigned char *buf, size_t size);
+
+/* Same as g3plc_uart_feed() for a single command already framed and
+   unescaped by the platform, e.g. by a line discipline of the UART
+   that returns one frame per read (see uart_read_loop()). The frame
+   comes without its delimiters but with its CRC. Returns the status
+   of the frame. */
+int g3plc_uart_frame(struct g3plc_ctx *ctx, const unsigned char *buf, size_t size);
 
 /* Wait for command to be received by the CPX3.
    This can be used to wait for confirmations.
    The message must be specified as a command literal (see g3plc-cmd.h).
    This function returns the payload of the command that was just received.
    This payload *MUST* later be freed with free_cmd_data().
+   Up to G3PLC_MAX_WAITERS threads can wait at the same time.
    The wait will timeout if the message as not been received within
    the G3-PLC command timeout time specified in the driver configuration.
    If the call resulted in a timeout, this function returns NULL. */
-const unsigned char * wait_for_cmd(uint32_t cmd_literal);
+const unsigned char * wait_for_cmd(struct g3plc_ctx *ctx, uint32_t cmd_literal);
+
+/* Same as wait_for_cmd() but the payload is copied into a buffer provided
+   by the caller. Nothing has to be freed afterwards. Returns the size of
+   the received payload, which is truncated if larger than the buffer, or
+   -1 if the call resulted in a timeout. */
+int wait_for_cmd_into(struct g3plc_ctx *ctx, uint32_t cmd_literal, void *buf, unsigned int size);
 
 /* Free a command that has just been captured by wait_for_cmd().
    This can be called even if the command resulted in a timeout
-   in which case this call has no effect. */
-void free_cmd_data(void);
+   (NULL) in which case this call has no effect. */
+void free_cmd_data(struct g3plc_ctx *ctx, const unsigned char *data);
 
 #endif /* _G3PLC_H_ */
@@ -0,0 +1,81 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "hist.h"
+
+static unsigned int hist_bucket(unsigned long v)
+{
+  unsigned int msb;
+
+  if(v > 0xffffffffUL)
+    v = 0xffffffffUL;
+  if(v < HIST_SUB)
+    return v;
+
+  for(msb = HIST_SUB_BITS ; v >> (msb + 1) ; msb++);
+
+  return (msb - HIST_SUB_BITS + 1) * HIST_SUB + ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Largest value counted in a bucket. */
+static unsigned long hist_upper(unsigned int i)
+{
+  unsigned int shift;
+
+  if(i < HIST_SUB)
+    return i;
+
+  shift = i / HIST_SUB - 1;
+  return ((unsigned long)(HIST_SUB + i % HIST_SUB) << shift) + (1UL << shift) - 1;
+}
+
+void hist_record(struct hist *h, unsigned long v)
+{
+  h->buckets[hist_bucket(v)]++;
+  h->count++;
+  h->sum += v;
+  if(v > h->max)
+    h->max = v;
+}
+
+unsigned long hist_percentile(const struct hist *h, unsigned int permille)
+{
+  unsigned long long rank = ((unsigned long long)h->count * permille + 999) / 1000;
+  unsigned long long seen = 0;
+  unsigned int i;
+
+  if(!h->count)
+    return 0;
+  if(!rank)
+    rank = 1;
+
+  for(i = 0 ; i < HIST_BUCKETS ; i++) {
+    seen += h->buckets[i];
+    if(seen >= rank)
+      break;
+  }
+
+  /* the maximum is exact */
+  return i == HIST_BUCKETS || hist_upper(i) > h->max ? h->max : hist_upper(i);
+}
@@ -22,41 +22,35 @@
    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-/* FIXME: This is Linux specific, isn't it?
-   We need a pragma to avoid compilation on
-   other OS. */
-
-enum rpi_gpio_mode {
-  RPI_GPIO_IN   = 0x0,
-  RPI_GPIO_OUT  = 0x1,
-  RPI_GPIO_ALT0 = 0x4,
-  RPI_GPIO_ALT1 = 0x5,
-  RPI_GPIO_ALT2 = 0x6,
-  RPI_GPIO_ALT3 = 0x7,
-  RPI_GPIO_ALT4 = 0x3,
-  RPI_GPIO_ALT5 = 0x2
+#ifndef _HIST_H_
+#define _HIST_H_
+
+#include "g3plc-conf.h"
+
+/* Latency histogram with a constant relative precision. Values
+   below HIST_SUB are counted exactly, larger values fall in one
+   of HIST_SUB buckets for each power of two. So each bucket is
+   within 1/HIST_SUB (12.5%) of the values it counts while the
+   whole 32-bit range only takes HIST_BUCKETS counters. Recording
+   a value is a few shifts, so this can stay on the hot path.
+   HIST_SUB_BITS is set in g3plc-conf.h. */
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  ((32 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+  unsigned long count;
+  unsigned long max;
+  unsigned long long sum;
+  unsigned long buckets[HIST_BUCKETS];
 };
 
-/* Map GPIOs on the RPi */
-void rpi_gpio_init(void);
+/* Count a value. The histogram is not locked. */
+void hist_record(struct hist *h, unsigned long v);
 
-/* Unmap GPIOs from the RPi */
-void rpi_gpio_destroy(void);
+/* Value under which a given fraction of the recorded values
+   fall, in thousandths (500 for the median). This is the upper
+   bound of the bucket, so it overestimates by at most 12.5%.
+   Return 0 when the histogram is empty. */
+unsigned long hist_percentile(const struct hist *h, unsigned int permille);
 
-/* Configure the mode for the GPIO (see rpi_gpio_mode).
-   Note that contrary to some example that you can find
-   on the Internet, you can directly configure the desired
-   mode here. There is no need to configure as input beforehand. */
-void rpi_gpio_set_mode(unsigned int gpio, unsigned int mode);
-
-/* Set a GPIO */
-void rpi_gpio_set(unsigned int gpio);
-
-/* Clear a GPIO */
-void rpi_gpio_clr(unsigned int gpio);
-
-/* Get the state of a GPIO */
-int rpi_gpio_get(unsigned int gpio);
-
-/* Check that the GPIO number is valid */
-int rpi_gpio_check(unsigned int gpio);
+#endif /* _HIST_H_ */
@@ -0,0 +1,102 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "neigh.h"
+
+static unsigned int neigh_hash(uint16_t addr)
+{
+  /* Short addresses are often allocated in sequence,
+     the low bits are enough to spread them. */
+  return (addr ^ (addr >> 6)) & (NEIGH_SIZE - 1);
+}
+
+void neigh_init(struct neigh_table *t)
+{
+  unsigned int i;
+
+  for(i = 0 ; i < NEIGH_SIZE ; i++)
+    t->addr[i] = NEIGH_UNUSED;
+}
+
+int neigh_lookup(const struct neigh_table *t, uint16_t addr)
+{
+  unsigned int h = neigh_hash(addr);
+  unsigned int i;
+
+  for(i = 0 ; i < NEIGH_PROBE ; i++) {
+    unsigned int j = (h + i) & (NEIGH_SIZE - 1);
+
+    if(t->addr[j] == addr)
+      return j;
+  }
+
+  return -1;
+}
+
+/* Find the slot of a neighbour or the slot to reuse for it. */
+static unsigned int neigh_slot(const struct neigh_table *t, uint16_t addr, unsigned long now)
+{
+  unsigned int h = neigh_hash(addr);
+  unsigned int victim = h;
+  unsigned int i;
+
+  for(i = 0 ; i < NEIGH_PROBE ; i++) {
+    unsigned int j = (h + i) & (NEIGH_SIZE - 1);
+
+    if(t->addr[j] == addr || t->addr[j] == NEIGH_UNUSED)
+      return j;
+    if(now - t->stamp[j] > now - t->stamp[victim])
+      victim = j;
+  }
+
+  return victim;
+}
+
+void neigh_update(struct neigh_table *t, uint16_t addr, unsigned int chan,
+                  uint8_t lqi, uint8_t modulation, uint32_t tonemap,
+                  unsigned long now)
+{
+  unsigned int i = neigh_slot(t, addr, now);
+  int sample = lqi << 8;
+
+  if(t->addr[i] != addr) {
+    /* new neighbour, the average starts from the first sample */
+    t->addr[i]    = addr;
+    t->lqi_avg[i] = sample;
+    t->frames[i]  = 0;
+    t->changed[i] = 0;
+  }
+  else {
+    t->lqi_avg[i] += (sample - t->lqi_avg[i]) >> NEIGH_ALPHA;
+    if(t->modulation[i] != modulation || t->tonemap[i] != tonemap)
+      t->changed[i] = 1;
+  }
+
+  t->lqi[i]        = lqi;
+  t->modulation[i] = modulation;
+  t->tonemap[i]    = tonemap;
+  t->chan[i]       = chan;
+  t->frames[i]++;
+  t->stamp[i]      = now;
+}
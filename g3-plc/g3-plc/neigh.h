@@ -0,0 +1,69 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _NEIGH_H_
+#define _NEIGH_H_
+
+#include <stdint.h>
+
+#include "g3plc-conf.h"
+
+/* Neighbour statistics fed from the MCPS-DATA indications.
+   Neighbours are found by their short address with linear
+   probing over at most NEIGH_PROBE slots. When they are all
+   taken, the neighbour heard the longest ago is evicted. The
+   table is laid out as a struct of arrays so that a lookup
+   only scans the addresses and a scan over one statistic
+   stays within a few cache lines. NEIGH_SIZE (a power of two)
+   is set in g3plc-conf.h. */
+#define NEIGH_PROBE 4
+#define NEIGH_ALPHA 3  /* EWMA weight of a new sample (1/8) */
+
+#define NEIGH_UNUSED 0xffff /* the broadcast address is never a source */
+
+struct neigh_table {
+  uint16_t      addr[NEIGH_SIZE];       /* short address or NEIGH_UNUSED */
+  uint16_t      lqi_avg[NEIGH_SIZE];    /* EWMA of the link quality (8.8 fixed point) */
+  uint8_t       lqi[NEIGH_SIZE];        /* last link quality */
+  uint8_t       modulation[NEIGH_SIZE]; /* last estimated modulation */
+  uint32_t      tonemap[NEIGH_SIZE];    /* last estimated tonemap */
+  uint32_t      frames[NEIGH_SIZE];     /* indications received */
+  uint8_t       changed[NEIGH_SIZE];    /* modulation or tonemap changed (cleared by the user) */
+  uint8_t       chan[NEIGH_SIZE];       /* G3 channel, and so PAN, it was last heard on */
+  unsigned long stamp[NEIGH_SIZE];      /* clock at the last indication */
+};
+
+/* Clear the table. */
+void neigh_init(struct neigh_table *t);
+
+/* Account for an indication from a neighbour on a channel.
+   The table is not locked. */
+void neigh_update(struct neigh_table *t, uint16_t addr, unsigned int chan,
+                  uint8_t lqi, uint8_t modulation, uint32_t tonemap,
+                  unsigned long now);
+
+/* Return the slot of a neighbour or -1 when it is unknown. */
+int neigh_lookup(const struct neigh_table *t, uint16_t addr);
+
+#endif /* _NEIGH_H_ */
@@ -23,8 +23,100 @@
    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <string.h>
+
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#elif defined(__ARM_NEON)
+# include <arm_neon.h>
+#endif
+
 #include "g3plc.h"
 #include "crc32.h"
+#include "pack.h"
+
+/* Return the number of leading bytes that do not need to be escaped.
+   Most frames contain no delimiter at all, so we compare 16 bytes at
+   a time when SIMD is available and only fall back to the scalar loop
+   for the tail or to locate the escape inside a vector. */
+static inline unsigned int clean_run(const unsigned char *s, unsigned int size)
+{
+  unsigned int n = 0;
+
+#if defined(__SSE2__)
+  const __m128i flag = _mm_set1_epi8(0x7e);
+  const __m128i esc  = _mm_set1_epi8(0x7d);
+
+  while(size - n >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + n));
+    int mask  = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, flag),
+                                               _mm_cmpeq_epi8(v, esc)));
+
+    if(mask)
+      return n + __builtin_ctz(mask);
+
+    n += 16;
+  }
+#elif defined(__ARM_NEON)
+  const uint8x16_t flag = vdupq_n_u8(0x7e);
+  const uint8x16_t esc  = vdupq_n_u8(0x7d);
+
+  while(size - n >= 16) {
+    uint8x16_t v = vld1q_u8(s + n);
+    uint8x16_t m = vorrq_u8(vceqq_u8(v, flag), vceqq_u8(v, esc));
+    uint64x2_t w = vreinterpretq_u64_u8(m);
+
+    /* The scalar loop below finds where the escape is. */
+    if(vgetq_lane_u64(w, 0) | vgetq_lane_u64(w, 1))
+      break;
+
+    n += 16;
+  }
+#endif
+
+  while(n < size && s[n] != 0x7e && s[n] != 0x7d)
+    n++;
+
+  return n;
+}
+
+/* Return the number of leading bytes that are not an escape.
+   Same as clean_run() but for the receiving side where the
+   frame delimiters have already been removed. */
+static inline unsigned int escape_run(const unsigned char *s, unsigned int size)
+{
+  unsigned int n = 0;
+
+#if defined(__SSE2__)
+  const __m128i esc = _mm_set1_epi8(0x7d);
+
+  while(size - n >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + n));
+    int mask  = _mm_movemask_epi8(_mm_cmpeq_epi8(v, esc));
+
+    if(mask)
+      return n + __builtin_ctz(mask);
+
+    n += 16;
+  }
+#elif defined(__ARM_NEON)
+  const uint8x16_t esc = vdupq_n_u8(0x7d);
+
+  while(size - n >= 16) {
+    uint64x2_t w = vreinterpretq_u64_u8(vceqq_u8(vld1q_u8(s + n), esc));
+
+    if(vgetq_lane_u64(w, 0) | vgetq_lane_u64(w, 1))
+      break;
+
+    n += 16;
+  }
+#endif
+
+  while(n < size && s[n] != 0x7d)
+    n++;
+
+  return n;
+}
 
 void append_crc(const struct g3plc_config *g3plc, unsigned char *src, unsigned int *size)
 {
@@ -58,18 +150,19 @@ unsigned int pack(unsigned char *dst, const unsigned char *src, unsigned int siz
   /* HDLC escaping:
       0x7e -> 0x7d 0x5e
       0x7d -> 0x7d 0x5d */
-  while(size--) {
-    unsigned char c = *src++;
+  while(size) {
+    unsigned int n = clean_run(src, size);
+
+    /* copy clean runs in bulk */
+    memcpy(d, src, n);
+    d    += n;
+    src  += n;
+    size -= n;
 
-    switch(c) {
-    case 0x7e:
-    case 0x7d:
+    if(size) {
       *d++ = 0x7d;
-      *d++ = c ^ 0x20;
-      break;
-    default:
-      *d++ = c;
-      break;
+      *d++ = *src++ ^ 0x20;
+      size--;
     }
   }
 
@@ -78,33 +171,227 @@ unsigned int pack(unsigned char *dst, const unsigned char *src, unsigned int siz
   return (d - dst);
 }
 
-unsigned int unpack(unsigned char *dst, const unsigned char *src, unsigned int size)
+/* HDLC escape a single byte into the destination buffer. */
+static inline unsigned char * escape(unsigned char *d, unsigned char c)
+{
+  switch(c) {
+  case 0x7e:
+  case 0x7d:
+    *d++ = 0x7d;
+    *d++ = c ^ 0x20;
+    break;
+  default:
+    *d++ = c;
+    break;
+  }
+
+  return d;
+}
+
+/* HDLC escape a buffer and update the CRC on the way.
+   Clean runs go through the buffer CRC and memcpy(). */
+static unsigned char * escape_crc(unsigned char *d, uint32_t *crc,
+                                  const unsigned char *src, unsigned int size)
+{
+  while(size) {
+    unsigned int n = clean_run(src, size);
+
+    *crc = crc32_G3PLC(src, n, *crc);
+    memcpy(d, src, n);
+    d    += n;
+    src  += n;
+    size -= n;
+
+    if(size) {
+      unsigned char c = *src++;
+
+      *crc = crc32_G3PLC_byte(*crc, c);
+      *d++ = 0x7d;
+      *d++ = c ^ 0x20;
+      size--;
+    }
+  }
+
+  return d;
+}
+
+unsigned int pack_crc(unsigned char *dst,
+                      const unsigned char *src, unsigned int size,
+                      const unsigned char *payload, unsigned int payload_size)
+{
+  *dst = 0x7e; /* frame delimiter */
+
+  return pack_crc_resume(dst, 1, 0, src, size, payload, payload_size);
+}
+
+unsigned int pack_crc_prefix(unsigned char *dst, uint32_t *crc,
+                             const unsigned char *prefix, unsigned int size)
 {
   unsigned char *d = dst;
-  int n = size; /* We use a signed integer to avoid a buffer overflow.
-                   The negatives eat up an off by one in the while condition.
-                   It helps in the case 0x7e 0x7d 0x7e. */
-
-  /* skip frame delimiter */
-  src++;
-  n -= 2;
-
-  /* HDLC unescaping:
-      0x7d 0x5e -> 0x7e
-      0x7d 0x5d -> 0x7d */
-  while(n-- > 0) {
-    unsigned char c = *src++;
-
-    if(c == 0x7d) {
-      /* escaped character */
-      *d = *src++ ^ 0x20;
-      n--;
+
+  *crc = 0;
+  *d++ = 0x7e; /* frame delimiter */
+  d = escape_crc(d, crc, prefix, size);
+
+  return (d - dst);
+}
+
+unsigned int pack_crc_resume(unsigned char *dst, unsigned int packed, uint32_t crc,
+                             const unsigned char *src, unsigned int size,
+                             const unsigned char *payload, unsigned int payload_size)
+{
+  unsigned char *d = dst + packed;
+
+  /* HDLC escaping and CRC in a single pass
+     over the command and then the payload. */
+  d = escape_crc(d, &crc, src, size);
+  d = escape_crc(d, &crc, payload, payload_size);
+
+  /* All hail RFC1700! (network order is big endian) */
+  d = escape(d, crc >> 24);
+  d = escape(d, crc >> 16);
+  d = escape(d, crc >> 8);
+  d = escape(d, crc);
+
+  *d++ = 0x7e; /* frame delimiter */
+
+  return (d - dst);
+}
+
+/* Write the chunk buffer of a stream. */
+static void stream_flush(struct pack_stream *s)
+{
+  if(s->len && !s->status)
+    s->status = s->write(s->buf, s->len, s->data);
+  s->len = 0;
+}
+
+/* Copy bytes to a stream as they are, a chunk at a time. */
+static void stream_copy(struct pack_stream *s, const unsigned char *src, unsigned int size)
+{
+  while(size) {
+    unsigned int n = s->size - s->len;
+
+    if(!n) {
+      stream_flush(s);
+      n = s->size;
     }
-    else
-      *d = c;
+    if(n > size)
+      n = size;
 
-    d++;
+    memcpy(s->buf + s->len, src, n);
+    s->len += n;
+    src    += n;
+    size   -= n;
+  }
+}
+
+/* Same as escape_crc() through the chunk buffer of a stream.
+   The CRC itself is escaped with update cleared. */
+static void stream_escape(struct pack_stream *s, const unsigned char *src,
+                          unsigned int size, int update)
+{
+  s->bytes += size;
+
+  while(size) {
+    unsigned int n = clean_run(src, size);
+
+    if(update)
+      s->crc = crc32_G3PLC(src, n, s->crc);
+    stream_copy(s, src, n);
+    src  += n;
+    size -= n;
+
+    if(size) {
+      unsigned char esc[2] = { 0x7d, *src ^ 0x20 };
+
+      if(update)
+        s->crc = crc32_G3PLC_byte(s->crc, *src);
+      stream_copy(s, esc, sizeof(esc));
+      s->escapes++;
+      src++;
+      size--;
+    }
+  }
+}
+
+void pack_stream_begin(struct pack_stream *s, unsigned char *buf, unsigned int size,
+                       int (*write)(const void *buf, unsigned int size, void *data), void *data)
+{
+  static const unsigned char delimiter = 0x7e;
+
+  pack_stream_resume(s, buf, size, write, data, &delimiter, 1, 0);
+}
+
+void pack_stream_resume(struct pack_stream *s, unsigned char *buf, unsigned int size,
+                        int (*write)(const void *buf, unsigned int size, void *data), void *data,
+                        const unsigned char *packed, unsigned int packed_size, uint32_t crc)
+{
+  *s = (struct pack_stream){ .buf = buf, .size = size, .crc = crc, .write = write, .data = data };
+  stream_copy(s, packed, packed_size);
+}
+
+void pack_stream_crc(struct pack_stream *s, const unsigned char *src, unsigned int size)
+{
+  stream_escape(s, src, size, 1);
+}
+
+int pack_stream_end(struct pack_stream *s)
+{
+  /* All hail RFC1700! (network order is big endian) */
+  const unsigned char crc[4] = { s->crc >> 24, s->crc >> 16, s->crc >> 8, s->crc };
+  static const unsigned char delimiter = 0x7e;
+
+  stream_escape(s, crc, sizeof(crc), 0);
+  stream_copy(s, &delimiter, 1);
+  stream_flush(s);
+
+  return s->status;
+}
+
+/* HDLC unescaping:
+    0x7d 0x5e -> 0x7e
+    0x7d 0x5d -> 0x7d
+   The destination may overlap the source as long as it does not
+   start after it, since the output is never larger than the input.
+   Clean runs are moved in bulk. A trailing escape is dropped. */
+static unsigned int unescape(unsigned char *dst, const unsigned char *src, unsigned int size)
+{
+  unsigned char *d = dst;
+
+  while(size) {
+    unsigned int n = escape_run(src, size);
+
+    memmove(d, src, n);
+    d    += n;
+    src  += n;
+    size -= n;
+
+    if(size < 2)
+      break;
+
+    /* escaped character */
+    *d++  = src[1] ^ 0x20;
+    src  += 2;
+    size -= 2;
   }
 
   return (d - dst);
 }
+
+unsigned int unpack(unsigned char *dst, const unsigned char *src, unsigned int size)
+{
+  /* skip frame delimiters */
+  if(size < 2)
+    return 0;
+
+  return unescape(dst, src + 1, size - 2);
+}
+
+unsigned int unpack_inplace(unsigned char *buf, unsigned int size)
+{
+  if(size < 2)
+    return 0;
+
+  return unescape(buf, buf + 1, size - 2);
+}
@@ -40,8 +40,70 @@ int extract_crc(const struct g3plc_config *g3plc, const unsigned char *src, unsi
    Returns the size of the packed destination buffer. */
 unsigned int pack(unsigned char *dst, const unsigned char *src, unsigned int size);
 
+/* Same as append_crc() followed by pack() but in a single pass.
+   The payload is appended to the command without copying it first,
+   it may be NULL when the command has no separate payload.
+   Returns the size of the packed destination buffer. */
+unsigned int pack_crc(unsigned char *dst,
+                      const unsigned char *src, unsigned int size,
+                      const unsigned char *payload, unsigned int payload_size);
+
+/* Start pack_crc() with a prefix that is the same for many frames.
+   The prefix is packed into the destination buffer (with the opening
+   delimiter) and its CRC is stored in crc. Returns the packed size. */
+unsigned int pack_crc_prefix(unsigned char *dst, uint32_t *crc,
+                             const unsigned char *prefix, unsigned int size);
+
+/* Same as pack_crc() once the destination buffer already starts with
+   a prefix of packed bytes as returned by pack_crc_prefix() and crc
+   is the CRC of that prefix. Returns the size of the packed destination
+   buffer including the prefix. */
+unsigned int pack_crc_resume(unsigned char *dst, unsigned int packed, uint32_t crc,
+                             const unsigned char *src, unsigned int size,
+                             const unsigned char *payload, unsigned int payload_size);
+
+/* Streaming variant of pack_crc(). The command is escaped into a
+   chunk buffer that is written out each time it fills, so the buffer
+   does not have to hold a whole packed command escaped at worst (see
+   G3PLC_SND_CHUNK). The stream also counts the escaped bytes. */
+struct pack_stream {
+  unsigned char *buf;   /* chunk buffer */
+  unsigned int size;    /* size of the chunk buffer */
+  unsigned int len;     /* bytes pending in the chunk buffer */
+  uint32_t crc;         /* CRC of the bytes escaped so far */
+  int status;           /* first error of write() */
+  unsigned long bytes;  /* bytes escaped, before HDLC */
+  unsigned long escapes;/* bytes that needed an escape */
+  int (*write)(const void *buf, unsigned int size, void *data);
+  void *data;           /* passed to write() */
+};
+
+/* Start a frame with its opening delimiter in the chunk buffer. */
+void pack_stream_begin(struct pack_stream *s, unsigned char *buf, unsigned int size,
+                       int (*write)(const void *buf, unsigned int size, void *data), void *data);
+
+/* Same as pack_stream_begin() but the frame starts with a prefix
+   packed by pack_crc_prefix() whose CRC is crc. The prefix is not
+   counted in the bytes of the stream. */
+void pack_stream_resume(struct pack_stream *s, unsigned char *buf, unsigned int size,
+                        int (*write)(const void *buf, unsigned int size, void *data), void *data,
+                        const unsigned char *packed, unsigned int packed_size, uint32_t crc);
+
+/* Escape bytes into the frame and update its CRC. */
+void pack_stream_crc(struct pack_stream *s, const unsigned char *src, unsigned int size);
+
+/* Append the CRC and the closing delimiter and write what is left.
+   Returns 0 on success or the first error of write(), the frame is
+   not written any further after an error. */
+int pack_stream_end(struct pack_stream *s);
+
 /* Remove frame delimiters and unescape the buffer using HDLC, store the result in destination buffer.
    Returns the size of the unpacked destination buffer. */
 unsigned int unpack(unsigned char *dst, const unsigned char *src, unsigned int size);
 
+/* Same as unpack() but the command is unescaped in the packed buffer itself.
+   The unpacked command starts at the beginning of the buffer.
+   Returns the size of the unpacked command. */
+unsigned int unpack_inplace(unsigned char *buf, unsigned int size);
+
 #endif /* _PACK_H_ */
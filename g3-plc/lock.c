@@ -24,14 +24,31 @@
 
 #include <pthread.h>
 
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+#include "common.h"
 
-void lock(void)
+static pthread_mutex_t mutex     = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t snd_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void lock(void *data)
 {
+  UNUSED(data);
   pthread_mutex_lock(&mutex);
 }
 
-void unlock(void)
+void unlock(void *data)
 {
+  UNUSED(data);
   pthread_mutex_unlock(&mutex);
 }
+
+void snd_lock(void *data)
+{
+  UNUSED(data);
+  pthread_mutex_lock(&snd_mutex);
+}
+
+void snd_unlock(void *data)
+{
+  UNUSED(data);
+  pthread_mutex_unlock(&snd_mutex);
+}
@@ -25,8 +25,16 @@
 #ifndef _LOCK_H_
 #define _LOCK_H_
 
-/* Lock/unlock a critical section with a mutex */
-void lock(void);
-void unlock(void);
+/* Lock/unlock a critical section with a mutex.
+   The data argument is the G3-PLC context data,
+   these are the locks of the main modem (the
+   other modems have their own, see modems.h). */
+void lock(void *data);
+void unlock(void *data);
+
+/* Same for the packed command buffer of the driver
+   (see snd_lock in g3plc_config). */
+void snd_lock(void *data);
+void snd_unlock(void *data);
 
 #endif /* _LOCK_H_ */
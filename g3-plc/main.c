@@ -27,36 +27,53 @@
 # include <bsd/stdlib.h>
 #endif /* __linux__ */
 
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <string.h>
 #include <getopt.h>
-#include <signal.h>
 #include <err.h>
 
 #include "g3-plc/g3plc-str.h"
 #include "g3-plc/g3plc.h"
 #include "string-utils.h"
 #include "safe-call.h"
+#include "prof.h"
 #include "rpi-gpio.h"
 #include "version.h"
 #include "options.h"
+#include "metrics.h"
+#include "admit.h"
+#include "statmap.h"
+#include "capture.h"
+#include "conf-file.h"
+#include "log.h"
 #include "common.h"
 #include "xatoi.h"
 #include "timer.h"
+#include "rt.h"
+#include "reconf.h"
+#include "export.h"
+#include "ring.h"
 #include "lock.h"
 #include "uart.h"
+#include "modems.h"
 #include "mode.h"
 #include "help.h"
 #include "main.h"
 
+static struct g3plc_ctx plc;
+
 struct context ctx = {
   .verbose    = 0,
   .dst_mac    = 0xffff,
+  .plc        = &plc,
   .gpio_reset = -1,
 };
 
@@ -69,7 +86,7 @@ struct io_thread_data {
 
 /* IO threads used by the mode (write to modem),
    and the read loop (read for driver). */
-static pthread_t output_thread, input_thread;
+static pthread_t output_thread, input_thread, delivery_thread, metrics_thread;
 
 static void configure_gpio(const struct context *ctx)
 {
@@ -81,46 +98,374 @@ static void configure_gpio(const struct context *ctx)
   rpi_gpio_set(ctx->gpio_reset); /* set high for low pulse */
 }
 
-static void reset_clear(void)
+/* Without a reset line (e.g. the simulator) we
+   rely on the modem requesting its program. */
+static void reset_clear(void *data)
 {
-  rpi_gpio_clr(ctx.gpio_reset);
+  const struct context *ctx = data;
+
+  if(ctx->gpio_reset >= 0)
+    rpi_gpio_clr(ctx->gpio_reset);
 }
 
-static void reset_set(void)
+static void reset_set(void *data)
 {
-  rpi_gpio_set(ctx.gpio_reset);
+  const struct context *ctx = data;
+
+  if(ctx->gpio_reset >= 0)
+    rpi_gpio_set(ctx->gpio_reset);
 }
 
+/* Serial line flags (see uart_flags) */
+static unsigned int uart_flags;
+
 static void initialize_driver(const struct context *ctx,
                               const char *device, speed_t speed)
 {
   /* initialize serial */
-  serial_init(device, speed);
-  IF_VERBOSE(ctx, printf("Serial initialized!\n"));
+  serial_init(device, speed, uart_flags);
+  IF_VERBOSE(ctx, log_msg(LOG_CAT_MAIN, LOG_LVL_DEBUG, "Serial initialized!\n"));
 
   /* configure GPIO */
   configure_gpio(ctx);
 }
 
-/* We must block those signals otherwise
-   those might be selected when the SIGALRM
-   is raised by the timers instead of the
-   main thread where the handler is configured. */
-static void thread_block_signals()
+/* Received frames are queued by the UART input thread
+   and delivered to the mode from their own thread. This
+   way a slow mode never stalls the parsing of the UART. */
+#define RX_RING_SIZE 64
+
+/* The whole indication is kept so that the mode gets
+   the same view as if it was called from the driver. */
+struct rx_frame {
+  int           status;
+  unsigned long stamp;
+  unsigned int  size;
+  unsigned char data[G3PLC_MAX_CMD];
+};
+
+/* The ring has a single producer, the
+   other modems (see --modem) take turns on it. */
+static struct ring rx_ring;
+static pthread_mutex_t rx_producer = PTHREAD_MUTEX_INITIALIZER;
+static void (*mode_cb_recv)(const struct g3plc_ind *ind,
+                            const void *payload, unsigned payload_size,
+                            int status, void *data);
+
+static void queue_frame(const struct g3plc_ind *ind, int status)
+{
+  struct rx_frame *frame;
+
+  frame = ring_reserve(&rx_ring);
+  if(!frame)
+    return; /* dropped */
+
+  frame->status = status;
+  frame->stamp  = ind->stamp;
+  frame->size   = MIN(ind->size, sizeof(frame->data));
+  memcpy(frame->data, ind->data, frame->size);
+
+  ring_commit(&rx_ring);
+}
+
+static void queue_recv(const struct g3plc_ind *ind,
+                       const void *payload, unsigned payload_size,
+                       int status, void *data)
+{
+  UNUSED(payload);
+  UNUSED(payload_size);
+  UNUSED(data);
+
+  capture(CAPTURE_FRAME, CAPTURE_RX, ind->data, ind->size);
+
+  if(!modems_count()) {
+    queue_frame(ind, status);
+    return;
+  }
+
+  pthread_mutex_lock(&rx_producer);
+  queue_frame(ind, status);
+  pthread_mutex_unlock(&rx_producer);
+}
+
+static void * delivery_thread_func(void *p)
 {
-  sigset_t set;
+  const struct g3plc_config *g3plc = p;
+  unsigned long drops = 0;
+  int pending = 0;
 
-  sigemptyset(&set);
-  sigaddset(&set, SIGALRM);
+  prof_thread("delivery");
 
-  if(pthread_sigmask(SIG_BLOCK, &set, NULL))
-    err(EXIT_FAILURE, "cannot block signals");
+  while(1) {
+    struct rx_frame *frame;
+    struct g3plc_ind ind;
+
+    /* Give the mode a chance to flush the frames it
+       batched once no other frame arrived in time. */
+    if(pending) {
+      frame = ring_timedwait(&rx_ring, iface_mode.flush_timeout);
+      if(!frame) {
+        iface_mode.flush(&ctx);
+        pending = 0;
+        continue;
+      }
+    }
+    else
+      frame = ring_wait(&rx_ring);
+
+    ind = (struct g3plc_ind){ .data  = frame->data,
+                              .size  = frame->size,
+                              .stamp = frame->stamp };
+    mode_cb_recv(&ind,
+                 g3plc_ind_payload(&ind), g3plc_ind_payload_size(&ind),
+                 frame->status, g3plc->data);
+    ring_release(&rx_ring);
+    pending = iface_mode.flush != NULL;
+
+    if(ring_drops(&rx_ring) != drops) {
+      drops = ring_drops(&rx_ring);
+      warnx("receive queue full, %lu frames dropped", drops);
+    }
+  }
+
+  return NULL;
+}
+
+/* Metrics are written every METRICS_INTERVAL seconds
+   when a metrics file is given (see metrics.h). */
+#define METRICS_INTERVAL 10
+
+static const char *metrics_path;
+static const char *control_path;
+
+/* Live statistics are published every STATS_MAP_INTERVAL
+   milliseconds when a statistics file is given (see statmap.h). */
+#define STATS_MAP_INTERVAL 100
+
+static const char *stats_map_path;
+static struct statmap stats_map;
+static const struct g3plc_config *metrics_conf;
+
+/* Statistics of the Unix mode clients (see admit.h),
+   only known with limits or --client-stats. */
+static void write_clients(struct metrics *m)
+{
+  struct admit_stats c;
+  char labels[sizeof(c.addr) + 32];
+  unsigned int i;
+
+  metrics_help(m, "g3plc_client_messages_total", "counter", "Send messages accepted from each client");
+  metrics_help(m, "g3plc_client_bytes_total", "counter", "Bytes of the send messages accepted from each client");
+  metrics_help(m, "g3plc_client_completed_total", "counter", "Send messages of each client completed by outcome");
+  metrics_help(m, "g3plc_client_rejected_total", "counter", "Send messages of each client rejected by its limits");
+  metrics_help(m, "g3plc_client_inflight", "gauge", "Send messages of each client in flight");
+  metrics_help(m, "g3plc_client_inflight_max", "gauge", "Maximum of g3plc_client_inflight");
+  for(i = 0 ; i < ADMIT_MAX_CLIENTS ; i++) {
+    if(admit_read(i, &c) < 0)
+      continue;
+
+    snprintf(labels, sizeof(labels), "client=\"%s\"", c.addr);
+    metrics_value(m, "g3plc_client_messages_total", labels, c.messages);
+    metrics_value(m, "g3plc_client_bytes_total", labels, c.bytes);
+    metrics_value(m, "g3plc_client_inflight", labels, c.inflight);
+    metrics_value(m, "g3plc_client_inflight_max", labels, c.inflight_max);
+    snprintf(labels, sizeof(labels), "client=\"%s\",outcome=\"sent\"", c.addr);
+    metrics_value(m, "g3plc_client_completed_total", labels, c.sent);
+    snprintf(labels, sizeof(labels), "client=\"%s\",outcome=\"failed\"", c.addr);
+    metrics_value(m, "g3plc_client_completed_total", labels, c.failed);
+    snprintf(labels, sizeof(labels), "client=\"%s\",reason=\"credits\"", c.addr);
+    metrics_value(m, "g3plc_client_rejected_total", labels, c.rejected_window);
+    snprintf(labels, sizeof(labels), "client=\"%s\",reason=\"rate\"", c.addr);
+    metrics_value(m, "g3plc_client_rejected_total", labels, c.rejected_rate);
+  }
+}
+
+static void write_metrics(const char *path)
+{
+  static const char * const quantiles[] = { "0.5", "0.9", "0.99" };
+  static const unsigned int permilles[] = { 500, 900, 990 };
+  struct g3plc_neighbour neighbours[G3PLC_MAX_NEIGHBOURS];
+  struct g3plc_link_state link;
+  struct g3plc_counters c;
+  struct timer_jitter jitter;
+  struct uart_stats u;
+  struct metrics m;
+  struct hist h;
+  char labels[64];
+  unsigned int i, j, n;
+
+  if(metrics_open(&m, path) < 0) {
+    warn("cannot open %s", path);
+    return;
+  }
+  if(stats_map_path)
+    metrics_map(&m, &stats_map);
+
+  g3plc_counters(&plc, &c);
+  uart_stats(&u);
+
+  metrics_help(&m, "g3plc_tx_frames_total", "counter", "MCPS-DATA requests sent");
+  metrics_value(&m, "g3plc_tx_frames_total", NULL, c.tx_frames);
+  metrics_help(&m, "g3plc_tx_noack_total", "counter", "Frames confirmed without acknowledgment");
+  metrics_value(&m, "g3plc_tx_noack_total", NULL, c.tx_noack);
+  metrics_help(&m, "g3plc_tx_failures_total", "counter", "Frames confirmed with another error");
+  metrics_value(&m, "g3plc_tx_failures_total", NULL, c.tx_failures);
+  metrics_help(&m, "g3plc_tx_robust_total", "counter", "Frames sent to a destination estimated in robust mode");
+  metrics_value(&m, "g3plc_tx_robust_total", NULL, c.tx_robust);
+  metrics_help(&m, "g3plc_tx_tonemap_refresh_total", "counter", "Frames sent to a destination whose link changed");
+  metrics_value(&m, "g3plc_tx_tonemap_refresh_total", NULL, c.tx_tmr);
+  metrics_help(&m, "g3plc_tx_bytes_total", "counter", "Bytes of the commands sent, before HDLC");
+  metrics_value(&m, "g3plc_tx_bytes_total", NULL, c.tx_bytes);
+  metrics_help(&m, "g3plc_tx_escapes_total", "counter", "Bytes of the commands sent that needed an HDLC escape");
+  metrics_value(&m, "g3plc_tx_escapes_total", NULL, c.tx_escapes);
+  metrics_help(&m, "g3plc_rx_frames_total", "counter", "MCPS-DATA indications received");
+  metrics_value(&m, "g3plc_rx_frames_total", NULL, c.rx_frames);
+  metrics_help(&m, "g3plc_rx_crc_errors_total", "counter", "Commands received with an invalid CRC");
+  metrics_value(&m, "g3plc_rx_crc_errors_total", NULL, c.rx_crc);
+  metrics_help(&m, "g3plc_rx_invalid_total", "counter", "Commands received with an invalid header");
+  metrics_value(&m, "g3plc_rx_invalid_total", NULL, c.rx_invalid);
+  metrics_help(&m, "g3plc_rx_insecure_total", "counter", "Unsecured indications dropped");
+  metrics_value(&m, "g3plc_rx_insecure_total", NULL, c.rx_insecure);
+  metrics_help(&m, "g3plc_rx_filtered_total", "counter", "Indications to another destination dropped before the CRC");
+  metrics_value(&m, "g3plc_rx_filtered_total", NULL, c.rx_filtered);
+  metrics_help(&m, "g3plc_rx_dropped_total", "counter", "Frames dropped by the receive queue");
+  metrics_value(&m, "g3plc_rx_dropped_total", NULL, ring_drops(&rx_ring));
+  metrics_help(&m, "g3plc_export_dropped_total", "counter", "Raw commands dropped by the export");
+  metrics_value(&m, "g3plc_export_dropped_total", NULL, export_drops());
+
+  n = g3plc_neighbours(&plc, neighbours, sizeof(neighbours) / sizeof(neighbours[0]));
+  metrics_help(&m, "g3plc_neighbour_lqi", "gauge", "Moving average of the link quality of each neighbour");
+  for(i = 0 ; i < n ; i++) {
+    snprintf(labels, sizeof(labels), "addr=\"%04X\"", neighbours[i].addr);
+    metrics_value(&m, "g3plc_neighbour_lqi", labels, neighbours[i].lqi_avg);
+  }
+  metrics_help(&m, "g3plc_neighbours", "gauge", "Neighbours heard by the driver");
+  metrics_value(&m, "g3plc_neighbours", NULL, n);
+  metrics_help(&m, "g3plc_neighbour_table_size", "gauge", "Size of the G3 neighbour table");
+  metrics_value(&m, "g3plc_neighbour_table_size", NULL,
+                metrics_conf->neighbour_table ? metrics_conf->neighbour_table : G3PLC_NEIGHBOUR_TABLE);
+  metrics_help(&m, "g3plc_device_table_size", "gauge", "Size of the G3 device table");
+  metrics_value(&m, "g3plc_device_table_size", NULL,
+                metrics_conf->device_table ? metrics_conf->device_table : G3PLC_DEVICE_TABLE);
+  metrics_help(&m, "g3plc_neighbour_frames_total", "counter", "Indications received from each neighbour");
+  for(i = 0 ; i < n ; i++) {
+    snprintf(labels, sizeof(labels), "addr=\"%04X\"", neighbours[i].addr);
+    metrics_value(&m, "g3plc_neighbour_frames_total", labels, neighbours[i].frames);
+  }
+
+  metrics_help(&m, "uart_tx_bytes_total", "counter", "Bytes written to the UART");
+  metrics_value(&m, "uart_tx_bytes_total", NULL, u.tx_bytes);
+  metrics_help(&m, "uart_rx_bytes_total", "counter", "Bytes read from the UART");
+  metrics_value(&m, "uart_rx_bytes_total", NULL, u.rx_bytes);
+  metrics_help(&m, "uart_overruns_total", "counter", "Bytes lost by the serial driver");
+  metrics_value(&m, "uart_overruns_total", NULL, u.overruns);
+  metrics_help(&m, "uart_errors_total", "counter", "Bytes lost or damaged on the UART by cause");
+  metrics_value(&m, "uart_errors_total", "type=\"overrun\"", u.hw_overruns);
+  metrics_value(&m, "uart_errors_total", "type=\"buf_overrun\"", u.buf_overruns);
+  metrics_value(&m, "uart_errors_total", "type=\"frame\"", u.frame_errors);
+  metrics_value(&m, "uart_errors_total", "type=\"parity\"", u.parity_errors);
+  metrics_help(&m, "uart_tx_queue_bytes", "gauge", "Bytes still queued on the UART after the last frame");
+  metrics_value(&m, "uart_tx_queue_bytes", NULL, u.tx_queued);
+  metrics_help(&m, "uart_tx_queue_max_bytes", "gauge", "Maximum of uart_tx_queue_bytes");
+  metrics_value(&m, "uart_tx_queue_max_bytes", NULL, u.tx_queued_max);
+  metrics_help(&m, "uart_rx_queue_bytes", "gauge", "Bytes received on the UART but not read yet");
+  metrics_value(&m, "uart_rx_queue_bytes", NULL, u.rx_queued);
+  metrics_help(&m, "uart_rx_queue_max_bytes", "gauge", "Maximum of uart_rx_queue_bytes, also sampled after full reads");
+  metrics_value(&m, "uart_rx_queue_max_bytes", NULL, u.rx_queued_max);
+  metrics_help(&m, "uart_fifo_bytes", "gauge", "Hardware FIFO size reported by the serial driver");
+  metrics_value(&m, "uart_fifo_bytes", NULL, u.fifo_size);
+  metrics_help(&m, "uart_spin_us_total", "counter", "Time spent spinning on UART reads (see --busy-poll)");
+  metrics_value(&m, "uart_spin_us_total", NULL, u.spin_us);
+  metrics_help(&m, "uart_spin_sleeps_total", "counter", "Spins on UART reads that ran out of budget");
+  metrics_value(&m, "uart_spin_sleeps_total", NULL, u.spin_sleeps);
+
+  if(modems_count()) {
+    metrics_help(&m, "g3plc_modem_tx_frames_total", "counter", "MCPS-DATA requests sent by each other modem (see --modem)");
+    metrics_help(&m, "g3plc_modem_rx_frames_total", "counter", "MCPS-DATA indications received by each other modem");
+    metrics_help(&m, "g3plc_modem_tx_noack_total", "counter", "Frames of each other modem confirmed without acknowledgment");
+    for(i = 0 ; i < modems_count() ; i++) {
+      struct modem *modem = modems_get(i);
+
+      g3plc_counters(&modem->plc, &c);
+      snprintf(labels, sizeof(labels), "device=\"%s\"", modem->device);
+      metrics_value(&m, "g3plc_modem_tx_frames_total", labels, c.tx_frames);
+      metrics_value(&m, "g3plc_modem_rx_frames_total", labels, c.rx_frames);
+      metrics_value(&m, "g3plc_modem_tx_noack_total", labels, c.tx_noack);
+    }
+  }
+
+  g3plc_link(&plc, &link);
+  metrics_help(&m, "g3plc_link_state", "gauge", "Link state (0 up, 1 degraded, 2 down)");
+  metrics_value(&m, "g3plc_link_state", NULL, link.state);
+  metrics_help(&m, "g3plc_events_total", "counter", "G3-EVENT indications received");
+  metrics_value(&m, "g3plc_events_total", NULL, link.events);
+  metrics_help(&m, "g3plc_comm_status_total", "counter", "MLME-COMM-STATUS indications received");
+  metrics_value(&m, "g3plc_comm_status_total", NULL, link.comm_status);
+  metrics_help(&m, "g3plc_network_leaves_total", "counter", "ADPM-NETWORK-LEAVE indications received");
+  metrics_value(&m, "g3plc_network_leaves_total", NULL, link.leaves);
+
+  timer_jitter(&jitter);
+  metrics_help(&m, "timer_late_us", "summary", "Wakeup lateness of the threads on timer deadlines");
+  metrics_value(&m, "timer_late_us_sum", NULL, jitter.late_sum);
+  metrics_value(&m, "timer_late_us_count", NULL, jitter.expiries);
+  metrics_help(&m, "timer_late_max_us", "gauge", "Maximum of timer_late_us");
+  metrics_value(&m, "timer_late_max_us", NULL, jitter.late_max);
+
+  metrics_help(&m, "g3plc_stage_latency_us", "summary", "Latency of each driver stage in microseconds");
+  for(i = 0 ; i < G3PLC_STAGE_MAX ; i++) {
+    g3plc_stats(&plc, i, &h);
+
+    for(j = 0 ; j < sizeof(permilles) / sizeof(permilles[0]) ; j++) {
+      snprintf(labels, sizeof(labels), "stage=\"%s\",quantile=\"%s\"",
+               g3plc_stage2str(i), quantiles[j]);
+      metrics_value(&m, "g3plc_stage_latency_us", labels, hist_percentile(&h, permilles[j]));
+    }
+
+    snprintf(labels, sizeof(labels), "stage=\"%s\"", g3plc_stage2str(i));
+    metrics_value(&m, "g3plc_stage_latency_us_sum", labels, h.sum);
+    metrics_value(&m, "g3plc_stage_latency_us_count", labels, h.count);
+  }
+
+  write_clients(&m);
+
+  metrics_wakeups(&m);
+
+  if(metrics_close(&m) < 0)
+    warn("cannot write %s", path);
+}
+
+static void open_stats_map(void)
+{
+  if(statmap_open(&stats_map, stats_map_path, STATMAP_MAX) < 0)
+    err(EXIT_FAILURE, "cannot create %s", stats_map_path);
+}
+
+static void * metrics_thread_func(void *p)
+{
+  UNUSED(p);
+  unsigned int tick, ticks = stats_map_path ? METRICS_INTERVAL * 1000 / STATS_MAP_INTERVAL : 1;
+
+  prof_thread("metrics");
+
+  /* The metrics file is written on the first tick of each
+     interval, the statistics map is updated on every tick.
+     Without the map each tick is a whole interval. */
+  for(tick = 0 ; ; tick = (tick + 1) % ticks) {
+    write_metrics(tick ? NULL : metrics_path);
+    if(stats_map_path)
+      usleep(STATS_MAP_INTERVAL * 1000);
+    else
+      sleep(METRICS_INTERVAL);
+  }
+
+  return NULL;
 }
 
 static void * output_thread_func(void *p)
 {
   struct io_thread_data *data = (struct io_thread_data *)p;
 
+  prof_thread("output");
   data->mode->start(data->ctx);
 
   return NULL; /* FIXME: return with error code */
@@ -128,41 +473,194 @@ static void * output_thread_func(void *p)
 
 static void * input_thread_func(void *p)
 {
-  UNUSED(p);
-
-  thread_block_signals();
+  struct io_thread_data *data = (struct io_thread_data *)p;
 
-  uart_read_loop();
+  prof_thread("input");
+  uart_read_loop(data->ctx->plc);
 
   return NULL; /* FIXME: return with error code */
 }
 
-static void usleep_UL(unsigned long duration)
+static void usleep_UL(unsigned long duration, void *data)
 {
+  UNUSED(data);
   usleep(duration);
 }
 
-static void boot_start(void)
+static unsigned long plc_clock(void *data)
+{
+  UNUSED(data);
+  return clock_us();
+}
+
+static void boot_start(void *data)
 {
+  UNUSED(data);
   printf("\n");
 }
 
-static void boot_progress(void)
+static void boot_progress(void *data)
 {
   static char progress[] = "\\|/-";
   static unsigned int idx;
 
+  UNUSED(data);
+
   printf("\rBoot G3-PLC... [%c]", progress[idx]);
   fflush(stdout);
 
   idx = (idx + 1) % (sizeof(progress) - 1);
 }
 
-static void boot_end(void)
+static void boot_end(void *data)
 {
+  UNUSED(data);
   printf("\rBoot G3-PLC... done!\n");
 }
 
+/* Map the CPX firmware from a file instead of the compiled-in
+   one. The mapping is kept for the lifetime of the process so
+   that the driver can flash the device again. */
+static void map_firmware(struct g3plc_config *conf, const char *path)
+{
+  struct stat st;
+  void *image;
+  int fd;
+
+  fd = xopen(path, O_RDONLY, 0);
+  if(fstat(fd, &st) < 0)
+    err(EXIT_FAILURE, "cannot stat firmware");
+  if(st.st_size == 0)
+    errx(EXIT_FAILURE, "empty firmware");
+
+  image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(image == MAP_FAILED)
+    err(EXIT_FAILURE, "cannot map firmware");
+  close(fd);
+
+  conf->firmware      = image;
+  conf->firmware_size = st.st_size;
+}
+
+#define MAX_BOOT_BAUDS 8
+
+/* Add a candidate speed for the boot sequence.
+   The argument is the bootloader speed code followed
+   by the boot and application speeds (CODE:BOOT:APPL).
+   Candidates are tried in the order of the command line. */
+static void add_boot_baud(struct g3plc_config *conf, const char *arg)
+{
+  static struct g3plc_baud bauds[MAX_BOOT_BAUDS];
+  struct g3plc_baud *baud = &bauds[conf->nbauds];
+  int code;
+
+  if(conf->nbauds >= MAX_BOOT_BAUDS)
+    errx(EXIT_FAILURE, "too many boot speeds");
+  if(sscanf(arg, "%i:%u:%u", &code, &baud->boot, &baud->appl) != 3 ||
+     code < 0 || code > 0xff)
+    errx(EXIT_FAILURE, "cannot parse boot speed");
+  baud->code = code;
+
+  conf->bauds = bauds;
+  conf->nbauds++;
+}
+
+/* Configure the second G3 channel from its short
+   MAC address and optional PAN ID in hexadecimal
+   (MAC[:PAN]). The PAN ID defaults to the one of
+   the first channel, so is the bandplan. */
+static void set_chan1(struct g3plc_config *conf, const char *arg)
+{
+  static struct g3plc_chan_conf chan1;
+  unsigned long mac, pan = conf->pan_id;
+  char *end;
+
+  mac = strtoul(arg, &end, 16);
+  if(*end == ':')
+    pan = strtoul(end + 1, &end, 16);
+  if(end == arg || *end || mac > 0xffff || pan > 0xffff)
+    errx(EXIT_FAILURE, "cannot parse second channel");
+
+  chan1 = (struct g3plc_chan_conf){ .bandplan    = conf->bandplan,
+                                    .pan_id      = pan,
+                                    .mac_address = mac,
+                                    .ext_address = conf->ext_address };
+  conf->chan1 = &chan1;
+}
+
+#define MAX_ATTRS      16
+#define MAX_ATTR_SIZE  16
+
+/* Add a MAC PIB attribute set when the modem starts.
+   The argument is the attribute ID and optional index
+   followed by its value in hexadecimal (ID[:IDX]=HEX).
+   The value bytes are sent in the order given. */
+static void add_attr(struct g3plc_config *conf, const char *arg)
+{
+  static unsigned char values[MAX_ATTRS][MAX_ATTR_SIZE];
+  static struct g3plc_pib attrs[MAX_ATTRS];
+  struct g3plc_pib *attr = &attrs[conf->nattrs];
+  unsigned char *value    = values[conf->nattrs];
+  unsigned int id, idx = 0;
+  unsigned int size = 0;
+  char *end;
+
+  if(conf->nattrs >= MAX_ATTRS)
+    errx(EXIT_FAILURE, "too many PIB attributes");
+
+  id = strtoul(arg, &end, 0);
+  if(*end == ':')
+    idx = strtoul(end + 1, &end, 0);
+  if(end == arg || *end++ != '=' || id > 0xffff || idx > 0xffff)
+    errx(EXIT_FAILURE, "cannot parse PIB attribute");
+
+  while(*end) {
+    unsigned int byte;
+
+    if(size >= MAX_ATTR_SIZE || sscanf(end, "%2x", &byte) != 1 || !end[1])
+      errx(EXIT_FAILURE, "cannot parse PIB attribute value");
+    value[size++] = byte;
+    end += 2;
+  }
+  if(!size)
+    errx(EXIT_FAILURE, "empty PIB attribute value");
+
+  *attr = (struct g3plc_pib){ .id    = id,
+                               .idx   = idx,
+                               .value = value,
+                               .size  = size };
+  conf->attrs = attrs;
+  conf->nattrs++;
+}
+
+/* Parse the group master key HEX[:INDEX] (see G3PLC_SECURE). */
+static void set_gmk(struct g3plc_config *conf, const char *arg)
+{
+  unsigned int size = 0, idx = 0;
+  const char *p = arg;
+  char *end;
+
+  while(*p && *p != ':') {
+    unsigned int byte;
+
+    if(size >= sizeof(conf->gmk) || sscanf(p, "%2x", &byte) != 1 || !p[1] || p[1] == ':')
+      errx(EXIT_FAILURE, "cannot parse GMK");
+    conf->gmk[size++] = byte;
+    p += 2;
+  }
+  if(size != sizeof(conf->gmk))
+    errx(EXIT_FAILURE, "the GMK must have %zu bytes", sizeof(conf->gmk));
+
+  if(*p == ':') {
+    idx = strtoul(p + 1, &end, 0);
+    if(end == p + 1 || *end || idx > 0xff)
+      errx(EXIT_FAILURE, "cannot parse GMK index");
+  }
+
+  conf->key_index = idx;
+  conf->flags    |= G3PLC_SECURE;
+}
+
 /* Display a summary of the MAC layer configuration. */
 static void display_summary(const struct iface_mode *mode,
                             const struct g3plc_config *conf,
@@ -172,6 +670,7 @@ static void display_summary(const struct iface_mode *mode,
                             const char *speed)
 {
   unsigned long flag;
+  unsigned int i;
 
   printf(PACKAGE_VERSION "\n");
   printf("Using %s mode on %s @%s bauds.\n", mode->name, dev, speed);
@@ -180,11 +679,29 @@ static void display_summary(const struct iface_mode *mode,
     printf("  - RESET: %d\n", ctx->gpio_reset);
   }
   printf(" iface (source) MAC address: %04X\n", conf->mac_address);
+  if(conf->chan1)
+    printf(" second channel MAC address: %04X (PAN %04X)\n",
+           conf->chan1->mac_address, conf->chan1->pan_id);
   printf(" destination MAC address   : %04X\n", dst_mac);
   printf(" CMD timeout               : %d us\n", conf->timeout);
+  if(conf->min_timeout)
+    printf(" Min. confirm timeout      : %d us (adaptive)\n", conf->min_timeout);
   printf(" Max. retransmissions      : %d tries\n", conf->retrans);
+  if(conf->flags & G3PLC_ADAPT)
+    printf(" Tonemap response TTL      : %u min (1 min after a link change)\n",
+           conf->tmr_ttl ? conf->tmr_ttl : G3PLC_TMR_TTL);
+  if(conf->neighbour_table || conf->device_table || conf->pan_scans)
+    printf(" G3 tables                 : %u neighbours, %u devices, %u PAN\n",
+           conf->neighbour_table ? conf->neighbour_table : G3PLC_NEIGHBOUR_TABLE,
+           conf->device_table ? conf->device_table : G3PLC_DEVICE_TABLE,
+           conf->pan_scans ? conf->pan_scans : G3PLC_PAN_SCANS);
+  for(i = 0 ; i < modems_count() ; i++)
+    printf(" modem                     : %s (%u nodes)\n",
+           modems_get(i)->device, modems_get(i)->count);
+  if(conf->flags & G3PLC_SECURE)
+    printf(" GMK index                 : %u (ENC-MIC-32)\n", conf->key_index);
   printf(" flags                     : 0x%08lx\n", conf->flags);
-  for(flag = 0x1 ; flag <= G3PLC_NOACK ; flag <<= 1) {
+  for(flag = 0x1 ; flag <= G3PLC_SECURE ; flag <<= 1) {
     if(conf->flags & flag)
       printf("  - %s\n", g3plc_flag2str(flag));
   }
@@ -201,12 +718,42 @@ static void print_help(const char *name, const char *mode_name,
     { 0,   "commit",          "Display commit information" }
 #endif /* COMMIT */
     { 'i', "invalid",         "Do not filter invalid packets (packet header, CRC)" },
+    { 'p', "promiscuous",     "Do not filter packets to another destination" },
     { 'a', "no-ack",          "Do not answer nor expect ACKs" },
+    { 0,   "adapt",           "Request new tonemaps from the destinations whose link changed" },
     { 't', "timeout",         "ACK timeout in microseconds (default 4s)" },
+    { 0,   "min-timeout",     "Estimate the confirm timeout of each destination from this lower bound in microseconds" },
     { 'r', "retransmissions", "Maximum number of retransmissions (default 3)" },
+    { 0,   "tmr-ttl",         "Tonemap response TTL in minutes on stable links with --adapt (default 2)" },
     { 'B', "baud",            "Specify the baud rate (default 9600)" },
     { 'd', "destination",     "Destination MAC (hex. short address, default to broadcast)" },
     { 0,   "reset",           "RESET RPi GPIO" },
+    { 0,   "reset-pulse",     "Low time of the RESET GPIO in microseconds (default 30000)" },
+    { 0,   "gpio-chip",       "Drive the GPIOs through a character device (e.g. /dev/gpiochip0)" },
+    { 0,   "firmware",        "Load the CPX firmware from a file" },
+    { 0,   "pib",             "Set a MAC PIB attribute ID[:IDX]=HEX on start" },
+    { 0,   "gmk",             "Encrypt and authenticate frames with a 16-byte group master key HEX[:IDX]" },
+    { 0,   "neighbour-table", "Size of the G3 neighbour table (default 500, up to 1536)" },
+    { 0,   "device-table",    "Size of the G3 device table (default 500, up to 1536)" },
+    { 0,   "pan-scans",       "Maximum number of PAN kept by a scan (default 1, up to 128)" },
+    { 0,   "config",          "Read options from a file (one long option per line), reloaded on SIGHUP" },
+    { 0,   "control",         "Change the tunables at runtime through a Unix socket" },
+    { 0,   "chan1",           "Also start the second G3 channel as MAC[:PAN] (hex.)" },
+    { 0,   "modem",           "Drive another G3-PLC modem DEVICE:ADDR[,ADDR...] for these nodes" },
+    { 0,   "warm",            "Attach to a running G3-PLC without flashing it again" },
+    { 0,   "boot-baud",       "Try CODE:BOOT:APPL speeds before the default one" },
+    { 0,   "drain",           "Wait for each frame to leave the UART before arming timers" },
+    { 0,   "low-latency",     "Do not let the serial driver delay received bytes" },
+    { 0,   "busy-poll",       "Spin on the UART for N microseconds before sleeping (default 0, off)" },
+    { 0,   "ldisc",           "Read one frame per read() from the tty line discipline N (see uart.h)" },
+    { 0,   "rtscts",          "Enable RTS/CTS flow control (higher baud rates)" },
+    { 0,   "rt",              "Tune a thread ROLE:PRIO[:CPU[:STACK]] (rx/tx/app, SCHED_FIFO, KiB)" },
+    { 0,   "mlock",           "Lock the process memory" },
+    { 0,   "capture",         "Record the UART traffic to a pcapng file" },
+    { 0,   "export",          "Stream the raw received commands to a Unix datagram socket" },
+    { 0,   "log-rate",        "Limit each log category to N messages per second" },
+    { 0,   "metrics",         "Write Prometheus metrics to a file every 10s" },
+    { 0,   "stats-map",       "Publish live statistics in a file to map (e.g. next to the driver socket in /run)" },
     { 0, NULL, NULL }
   };
 
@@ -218,6 +765,16 @@ static void print_help(const char *name, const char *mode_name,
   }
 }
 
+/* Report the changes of the link state reported by the device. */
+static void link_changed(const struct g3plc_link_state *link, void *data)
+{
+  UNUSED(data);
+
+  log_msg(LOG_CAT_MAIN, link->state == G3PLC_LINK_UP ? LOG_LVL_INFO : LOG_LVL_WARN,
+          "Link %s (event 0x%02x on 0x%04x)\n",
+          g3plc_link2str(link->state), link->event, link->event_cmd);
+}
+
 int main(int argc, char *argv[])
 {
   const char *prog_name;
@@ -226,15 +783,20 @@ int main(int argc, char *argv[])
   struct g3plc_config g3plc = {
     .callbacks = {
       .raw     = NULL,
-      .cb_recv = NULL
+      .cb_recv = NULL,
+      .cb_link = link_changed
     },
 
     .uart_send      = uart_send,
     .uart_read      = uart_read,
     .set_uart_speed = set_uart_speed,
-    .start_timer    = start_timer,
-    .stop_timer     = stop_timer,
-    .wait_timer     = wait_timer,
+    .arm_slot       = slot_arm,
+    .wait_slot      = slot_wait,
+    .signal_slot    = slot_signal,
+    .lock           = lock,
+    .unlock         = unlock,
+    .snd_lock       = snd_lock,
+    .snd_unlock     = snd_unlock,
     .reset_clear    = reset_clear,
     .reset_set      = reset_set,
     .htons          = htons,
@@ -242,6 +804,7 @@ int main(int argc, char *argv[])
     .htonl          = htonl,
     .ntohl          = ntohl,
     .usleep         = usleep_UL,
+    .clock          = plc_clock,
     .boot_start     = boot_start,
     .boot_progress  = boot_progress,
     .boot_end       = boot_end,
@@ -251,6 +814,7 @@ int main(int argc, char *argv[])
     .ext_address    = 0,                  /* FIXME: option */
     .retrans        = 5,
     .timeout        = 1000000,  /* 1 second */
+    .window         = 8,
     .flags          = 0,
     .data           = &ctx
   };
@@ -260,12 +824,42 @@ int main(int argc, char *argv[])
     .config = &g3plc
   };
   speed_t speed    = B9600;
+  unsigned int log_rate = 0;
   int exit_status  = EXIT_FAILURE;
   int err;
 
   enum opt {
     OPT_COMMIT = 0x100,
     OPT_RESET,
+    OPT_RESET_PULSE,
+    OPT_GPIO_CHIP,
+    OPT_FIRMWARE,
+    OPT_BOOT_BAUD,
+    OPT_WARM,
+    OPT_PIB,
+    OPT_METRICS,
+    OPT_STATS_MAP,
+    OPT_DRAIN,
+    OPT_LOW_LATENCY,
+    OPT_BUSY_POLL,
+    OPT_LDISC,
+    OPT_RTSCTS,
+    OPT_RT,
+    OPT_MLOCK,
+    OPT_CAPTURE,
+    OPT_EXPORT,
+    OPT_LOG_RATE,
+    OPT_MIN_TIMEOUT,
+    OPT_NEIGHBOUR_TABLE,
+    OPT_DEVICE_TABLE,
+    OPT_PAN_SCANS,
+    OPT_CONFIG,
+    OPT_CONTROL,
+    OPT_CHAN1,
+    OPT_MODEM,
+    OPT_ADAPT,
+    OPT_TMR_TTL,
+    OPT_GMK
   };
 
   /* Common options used by all modes. */
@@ -279,15 +873,46 @@ int main(int argc, char *argv[])
 
     /* flags */
     { "invalid", no_argument, NULL, 'i' },
+    { "promiscuous", no_argument, NULL, 'p' },
     { "no-ack", no_argument, NULL, 'a' },
+    { "adapt", no_argument, NULL, OPT_ADAPT },
 
     { "timeout", required_argument, NULL, 't' },
+    { "min-timeout", required_argument, NULL, OPT_MIN_TIMEOUT },
     { "retransmissions", required_argument, NULL, 'r' },
+    { "tmr-ttl", required_argument, NULL, OPT_TMR_TTL },
     { "baud", required_argument, NULL, 'B' },
     { "destination", required_argument, NULL, 'd' },
 
     /* GPIO configuration */
     { "reset", required_argument, NULL, OPT_RESET },
+    { "reset-pulse", required_argument, NULL, OPT_RESET_PULSE },
+    { "gpio-chip", required_argument, NULL, OPT_GPIO_CHIP },
+
+    { "firmware", required_argument, NULL, OPT_FIRMWARE },
+    { "boot-baud", required_argument, NULL, OPT_BOOT_BAUD },
+    { "warm", no_argument, NULL, OPT_WARM },
+    { "pib", required_argument, NULL, OPT_PIB },
+    { "gmk", required_argument, NULL, OPT_GMK },
+    { "neighbour-table", required_argument, NULL, OPT_NEIGHBOUR_TABLE },
+    { "device-table", required_argument, NULL, OPT_DEVICE_TABLE },
+    { "pan-scans", required_argument, NULL, OPT_PAN_SCANS },
+    { "config", required_argument, NULL, OPT_CONFIG },
+    { "control", required_argument, NULL, OPT_CONTROL },
+    { "chan1", required_argument, NULL, OPT_CHAN1 },
+    { "modem", required_argument, NULL, OPT_MODEM },
+    { "drain", no_argument, NULL, OPT_DRAIN },
+    { "low-latency", no_argument, NULL, OPT_LOW_LATENCY },
+    { "busy-poll", required_argument, NULL, OPT_BUSY_POLL },
+    { "ldisc", required_argument, NULL, OPT_LDISC },
+    { "rtscts", no_argument, NULL, OPT_RTSCTS },
+    { "rt", required_argument, NULL, OPT_RT },
+    { "mlock", no_argument, NULL, OPT_MLOCK },
+    { "capture", required_argument, NULL, OPT_CAPTURE },
+    { "export", required_argument, NULL, OPT_EXPORT },
+    { "log-rate", required_argument, NULL, OPT_LOG_RATE },
+    { "metrics", required_argument, NULL, OPT_METRICS },
+    { "stats-map", required_argument, NULL, OPT_STATS_MAP },
     { NULL, 0, NULL, 0 }
   };
 
@@ -295,10 +920,15 @@ int main(int argc, char *argv[])
      structure are merged from both
      the common options and the mode
      (stdio, ping, ...) options. */
-  char * optstring_merged    = strcat_dup("hVviat:r:B:d:", iface_mode.optstring);
+  char * optstring_merged    = strcat_dup("hVvipat:r:B:d:", iface_mode.optstring);
   struct option *opts_merged = merge_opts(common_opts, iface_mode.long_opts);
 
   prog_name = basename(argv[0]);
+  prof_thread("main");
+
+  /* The options of the configuration files are parsed in place,
+     the options that follow them on the command line win. */
+  conf_file_args("config", &argc, &argv);
 
   while(1) {
     int c = getopt_long(argc, argv, optstring_merged, opts_merged, NULL);
@@ -318,12 +948,122 @@ int main(int argc, char *argv[])
       else if(!rpi_gpio_check(ctx.gpio_reset))
         errx(EXIT_FAILURE, "invalid RESET GPIO number");
       break;
+    case OPT_RESET_PULSE:
+      g3plc.reset_pulse = xatou(optarg, &err);
+      if(err || !g3plc.reset_pulse)
+        errx(EXIT_FAILURE, "cannot parse reset pulse");
+      break;
+    case OPT_GPIO_CHIP:
+      rpi_gpio_use_chip(optarg);
+      break;
+    case OPT_FIRMWARE:
+      map_firmware(&g3plc, optarg);
+      break;
+    case OPT_BOOT_BAUD:
+      add_boot_baud(&g3plc, optarg);
+      break;
+    case OPT_WARM:
+      ctx.warm = 1;
+      break;
+    case OPT_PIB:
+      add_attr(&g3plc, optarg);
+      break;
+    case OPT_GMK:
+      set_gmk(&g3plc, optarg);
+      break;
+    case OPT_NEIGHBOUR_TABLE:
+      g3plc.neighbour_table = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse neighbour table size");
+      if(g3plc.neighbour_table < 1 || g3plc.neighbour_table > G3PLC_MAX_TABLE)
+        errx(EXIT_FAILURE, "invalid neighbour table size");
+      break;
+    case OPT_DEVICE_TABLE:
+      g3plc.device_table = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse device table size");
+      if(g3plc.device_table < 1 || g3plc.device_table > G3PLC_MAX_TABLE)
+        errx(EXIT_FAILURE, "invalid device table size");
+      break;
+    case OPT_PAN_SCANS:
+      g3plc.pan_scans = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse PAN scans value");
+      if(g3plc.pan_scans < 1 || g3plc.pan_scans > 128)
+        errx(EXIT_FAILURE, "invalid number of PAN scans");
+      break;
+    case OPT_CHAN1:
+      set_chan1(&g3plc, optarg);
+      break;
+    case OPT_MODEM:
+      modems_add(optarg);
+      break;
+    case OPT_CONFIG:
+      /* already replaced by conf_file_args() */
+      break;
+    case OPT_CONTROL:
+      control_path = optarg;
+      break;
+    case OPT_ADAPT:
+      g3plc.flags |= G3PLC_ADAPT;
+      break;
+    case OPT_TMR_TTL:
+      g3plc.tmr_ttl = xatou(optarg, &err);
+      if(err || !g3plc.tmr_ttl || g3plc.tmr_ttl > 255)
+        errx(EXIT_FAILURE, "cannot parse tonemap response TTL");
+      break;
+    case OPT_METRICS:
+      metrics_path = optarg;
+      break;
+    case OPT_STATS_MAP:
+      stats_map_path = optarg;
+      break;
+    case OPT_DRAIN:
+      set_uart_drain(1);
+      break;
+    case OPT_BUSY_POLL:
+      set_uart_busy_poll(xatou(optarg, &err));
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse busy poll budget");
+      break;
+    case OPT_LDISC:
+      set_uart_ldisc(xatou(optarg, &err));
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse line discipline");
+      break;
+    case OPT_LOW_LATENCY:
+      uart_flags |= UART_LOW_LATENCY;
+      break;
+    case OPT_RTSCTS:
+      uart_flags |= UART_RTSCTS;
+      break;
+    case OPT_RT:
+      rt_parse(optarg);
+      break;
+    case OPT_MLOCK:
+      rt_mlock();
+      break;
+    case OPT_CAPTURE:
+      capture_open(optarg);
+      break;
+    case OPT_EXPORT:
+      export_open(optarg);
+      g3plc.callbacks.raw = export_raw;
+      break;
+    case OPT_LOG_RATE:
+      log_rate = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse log rate value");
+      break;
     case 'v':
       ctx.verbose = 1;
       break;
     case 'i':
       g3plc.flags |= G3PLC_INVALID;
       break;
+    case 'p':
+      g3plc.flags |= G3PLC_PROMISC;
+      break;
     case 'a':
       g3plc.flags |= G3PLC_NOACK;
       break;
@@ -336,6 +1076,11 @@ int main(int argc, char *argv[])
       if(err)
         errx(EXIT_FAILURE, "cannot parse timeout value");
       break;
+    case OPT_MIN_TIMEOUT:
+      g3plc.min_timeout = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse minimum timeout value");
+      break;
     case 'r':
       g3plc.retrans = xatou(optarg, &err);
       if(err)
@@ -386,41 +1131,90 @@ int main(int argc, char *argv[])
                                    device,
                                    speed_str));
 
+  /* From now on the verbose messages and the
+     dumps go through the logging thread. */
+  log_init(ctx.verbose ? LOG_LVL_DEBUG : LOG_LVL_INFO, log_rate);
+
   initialize_driver(&ctx, device, speed);
   iface_mode.init(&ctx, &g3plc);
 
-  /* Block the SIGALRM signal so that it is
-     not received by the main thread when
-     a timer is triggered. */
-  thread_block_signals();
+  /* Interpose the receive queue between
+     the driver and the mode callback. */
+  if(g3plc.callbacks.cb_recv) {
+    ring_init(&rx_ring, RX_RING_SIZE, sizeof(struct rx_frame));
+    mode_cb_recv            = g3plc.callbacks.cb_recv;
+    g3plc.callbacks.cb_recv   = queue_recv;
+    xpthread_create(&delivery_thread, rt_attr(RT_APP), delivery_thread_func, &g3plc);
+  }
 
   /* Initialize and configure G3-PLC driver.
      The interface mode still has to configure
      the g3plc configuration structure. That
      is why we initialize the MAC layer after
      the mode. */
-  g3plc_init(&g3plc);
+  g3plc_init(&plc, &g3plc);
+
+  /* Attach to a running modem. The read loop has to be started
+     for the probes and is stopped again when the modem has to be
+     flashed since the boot sequence reads the UART itself. */
+  err = G3PLC_INIT_CMD_TIMEOUT;
+  if(ctx.warm) {
+    xpthread_create(&input_thread, rt_attr(RT_RX), input_thread_func, &io_thread_data);
+    err = g3plc_attach(&plc);
+    if(err == G3PLC_INIT_CMD_TIMEOUT) {
+      pthread_cancel(input_thread);
+      pthread_join(input_thread, NULL);
+    }
+    IF_VERBOSE(&ctx, log_msg(LOG_CAT_MAIN, LOG_LVL_DEBUG,
+                             "Warm attach: %s\n", g3plc_init2str(err)));
+  }
 
-  /* Reset the modem. */
-  err = g3plc_reset();
-  if(err < 0)
-    errx(EXIT_FAILURE, "cannot reset G3-PLC: %s", g3plc_init2str(err));
+  if(err == G3PLC_INIT_CMD_TIMEOUT) {
+    /* Reset the modem. */
+    err = g3plc_reset(&plc);
+    if(err)
+      errx(EXIT_FAILURE, "cannot reset G3-PLC: %s", g3plc_init2str(err));
+    IF_VERBOSE(&ctx, log_msg(LOG_CAT_MAIN, LOG_LVL_DEBUG,
+                             "Booted @%u bauds.\n", g3plc_baud(&plc)->boot));
 
-  /* Start the threads that will handle the IO
-     with the G3-PLC layer. That is:
-       - The input thread that read new messages from UART.
-       - The output thread that send message according to iface_mode. */
-  thread_block_signals();
-  xpthread_create(&input_thread, NULL, input_thread_func, &io_thread_data);
+    /* Start the threads that will handle the IO
+       with the G3-PLC layer. That is:
+         - The input thread that read new messages from UART.
+         - The output thread that send message according to iface_mode.
+       The delivery thread that pass received frames to iface_mode is
+       already started. */
+    xpthread_create(&input_thread, rt_attr(RT_RX), input_thread_func, &io_thread_data);
+    err = G3PLC_INIT_ATTACH_CONFIG;
+  }
+  IF_VERBOSE(&ctx, log_msg(LOG_CAT_MAIN, LOG_LVL_DEBUG,
+                           "Application @%u bauds.\n", g3plc_baud(&plc)->appl));
 
   /* The read loop has just been started in the IO threads.
      We can receive message so we can configure and start the modem. */
-  err = g3plc_start();
-  if(err < 0)
-    errx(EXIT_FAILURE, "cannot start G3-PLC: %s", g3plc_init2str(err));
+  if(err == G3PLC_INIT_ATTACH_CONFIG) {
+    err = g3plc_start(&plc);
+    if(err < 0)
+      errx(EXIT_FAILURE, "cannot start G3-PLC: %s", g3plc_init2str(err));
+  }
+  else if(err)
+    errx(EXIT_FAILURE, "cannot attach G3-PLC: %s", g3plc_init2str(err));
+
+  /* The other modems once the main one is up. */
+  modems_init(&g3plc, speed, uart_flags);
+  modems_start(rt_attr(RT_RX));
+
+  metrics_conf = &g3plc;
+  if(stats_map_path)
+    open_stats_map();
+  if(metrics_path || stats_map_path)
+    xpthread_create(&metrics_thread, NULL, metrics_thread_func, NULL);
+
+  /* Tunables changed at runtime. */
+  if(conf_file_path() || control_path)
+    reconf_start(&plc, &g3plc, &ctx.dst_mac, conf_file_path(), control_path);
 
   /* The output thread starts the mode. */
-  xpthread_create(&output_thread, NULL, output_thread_func, &io_thread_data);
+  xpthread_create(&output_thread, rt_attr(RT_TX), output_thread_func, &io_thread_data);
   pthread_join(output_thread, NULL);
 
   /* IO threads returned, this is the end.
@@ -27,6 +27,8 @@
 
 #include <stdint.h>
 
+#include "g3-plc/g3plc.h"
+
 #define IF_VERBOSE(ctx, x) if((ctx)->verbose) x;
 
 /* The context is created by the command line parser and
@@ -34,8 +36,12 @@
    selected by the command line. */
 struct context {
   int verbose;
+  int warm; /* attach to a running modem */
   uint16_t dst_mac;
 
+  /* G3-PLC instance driven by the modes */
+  struct g3plc_ctx *plc;
+
   /* GPIO (negative means disabled) */
   int gpio_reset;
 };
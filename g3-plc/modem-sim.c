@@ -0,0 +1,1278 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _XOPEN_SOURCE 600
+#endif /* __linux__ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <time.h>
+#include <libgen.h>
+#include <errno.h>
+#include <err.h>
+#include <arpa/inet.h>
+
+#include "g3-plc/g3plc.h"
+#include "g3-plc/g3plc-cmd.h"
+#include "g3-plc/pack.h"
+#include "version.h"
+#include "xatoi.h"
+#include "help.h"
+
+/*
+  Modem simulator, for load tests without hardware.
+
+  Each simulated modem is a pseudo-terminal on which one of the
+  drivers runs as it would on a real UART. The G3-PLC modems
+  implement the boot sequence (the firmware is read and
+  discarded), the management requests used by the driver
+  (G3 INIT, SETCONFIG, GETCONFIG and the MLME requests) and the
+  MCPS-DATA service. The LoRa modules are transparent, frames
+  are delimited with their size byte as the LoRaMAC driver does.
+
+  Frames go through a simulated medium, one per technology,
+  with a bandwidth shared by all the modems, a propagation delay
+  and a probability of loss for each receiver. G3-PLC unicast
+  frames are retransmitted by the simulated MAC up to the
+  maxRetries attribute before the confirm reports NO ACK. By
+  default the medium is perfect, so the drivers run at full speed.
+
+  A modem reboots when the driver closes its UART, unless --warm
+  is given in which case it keeps its state so that the driver
+  can attach to it again.
+
+  Faults are injected at run time through the datagram socket
+  given with --control, one command per datagram:
+
+    reset NODE                  the modem reboots and requests its
+                                program once the driver is quiet
+    drop NODE PERCENT MS        UART bytes are lost both ways
+    corrupt NODE PERCENT MS     frames to the driver get a bit flipped
+    outage g3plc|lora MS        the medium delivers nothing
+
+  Nodes are named as in the log (g3plc0, lora1...).
+*/
+
+#define SIM_G3PLC_MAX_FRAME 2048 /* unescaped command with CRC */
+#define SIM_LORA_MAX_FRAME  0x3f /* LORAMAC_MAX_FRAME */
+#define SIM_LORA_NOACK      0x80 /* LORAMAC_SIZE_NOACK */
+#define SIM_MAX_PIB         32   /* PIB attributes stored by a G3-PLC modem */
+#define SIM_PIB_MAX_SIZE    64
+#define SIM_BOOT_DELAY      100000000ULL /* 100ms from the open to the boot request */
+#define SIM_HUP_POLL        10 /* ms between checks of closed terminals */
+#define SIM_BOOT_QUIET      500000000ULL  /* silence before a reset modem requests its program */
+#define SIM_BOOT_REPEAT     1000000000ULL /* request again when the driver does not answer */
+#define SIM_CONTROL_SIZE    128
+
+#define MCPS_REQUEST_HDR 28 /* header of MCPS-DATA.request before the MSDU */
+
+enum medium {
+  MEDIUM_G3PLC,
+  MEDIUM_LORA,
+  MEDIUM_MAX
+};
+
+enum boot_state {
+  BOOT_CLOSED,    /* nothing opened the terminal */
+  BOOT_OPENED,    /* waiting to send the program transmission request */
+  BOOT_INFO,      /* segment information table */
+  BOOT_DATA,      /* segment data */
+  BOOT_BAUD_CMD,  /* baud rate change command */
+  BOOT_BAUD_CODE, /* baud rate */
+  BOOT_BAUD_ACK,  /* baud rate change response */
+  BOOT_RUNNING,   /* application */
+  BOOT_RESET      /* reset by a fault, waiting for the driver to be quiet */
+};
+
+struct pib {
+  int used;
+  uint16_t id, idx;
+  unsigned int size;
+  unsigned char value[SIM_PIB_MAX_SIZE];
+};
+
+/* The CPX has two independent G3 channels (see g3plc_cmd.idc). */
+struct channel {
+  int initialized;
+  int started;
+  unsigned char bandplan;
+  unsigned char extaddr[8]; /* network order */
+  struct pib pib[SIM_MAX_PIB];
+};
+
+struct node {
+  enum medium medium;
+  unsigned int id;
+  int fd;                /* pseudo-terminal master */
+  char path[64];         /* slave */
+  char link[PATH_MAX];   /* symbolic link to the slave (if any) */
+
+  int closed;            /* no process on the slave */
+  uint64_t opened;       /* when the slave was opened (ns) */
+  uint64_t heard;        /* last byte from the driver (ns) */
+  uint64_t asked;        /* last program transmission request (ns) */
+
+  /* faults (see --control) */
+  double   drop, corrupt;
+  uint64_t drop_until, corrupt_until;
+
+  /* receive buffer */
+  unsigned char buf[SIM_G3PLC_MAX_FRAME];
+  unsigned int size;
+  int in_frame, escaped, overflow; /* HDLC */
+
+  /* G3-PLC modem */
+  enum boot_state boot;
+  int reset_boot;        /* booting after a reset fault */
+  unsigned long boot_left;
+  struct channel chans[2];
+  struct channel *chan; /* channel of the request being parsed */
+};
+
+struct event {
+  uint64_t due;
+  struct node *node;
+  unsigned int size;
+  struct event *next;
+  unsigned char data[];
+};
+
+static struct medium_stats {
+  uint64_t busy; /* end of the last frame on the medium */
+  uint64_t outage; /* nothing is delivered until then */
+  unsigned long frames;
+  unsigned long delivered;
+  unsigned long lost;
+} media[MEDIUM_MAX];
+
+static const char *medium_names[] = { "g3plc", "lora" };
+
+static struct node *nodes;
+static unsigned int nnodes;
+static struct event *events;
+
+static unsigned int g3plc_count = 2;
+static unsigned int lora_count;
+static double loss;              /* probability */
+static uint64_t delay;           /* ns */
+static unsigned long bandwidth;  /* bits per second (0 is unlimited) */
+static const char *prefix;
+static const char *control_path;
+static int control_fd = -1;
+static int warm;
+static int verbose;
+
+static volatile sig_atomic_t stopped;
+
+/* Only the byte ordering is needed to pack and unpack commands. */
+static const struct g3plc_config g3plc_conf = {
+  .htons = htons,
+  .htonl = htonl,
+  .ntohs = ntohs,
+  .ntohl = ntohl
+};
+
+static uint64_t now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int chance(double p)
+{
+  return p > 0 && rand() < p * ((double)RAND_MAX + 1);
+}
+
+static int lost(enum medium medium)
+{
+  return media[medium].outage > now() || chance(loss);
+}
+
+/* Reserve the medium for a frame and
+   return the time at which it is received. */
+static uint64_t transmit(enum medium medium, unsigned int size)
+{
+  struct medium_stats *m = &media[medium];
+  uint64_t t = now();
+
+  if(m->busy > t)
+    t = m->busy;
+  if(bandwidth)
+    t += size * 8000000000ULL / bandwidth;
+  m->busy = t;
+  m->frames++;
+
+  return t + delay;
+}
+
+/* Queue bytes to be written on a terminal at the due time.
+   Events with the same due time keep their order. */
+static void schedule(struct node *node, uint64_t due, const void *data, unsigned int size)
+{
+  struct event *e = malloc(sizeof(struct event) + size);
+  struct event **p;
+
+  if(!e)
+    err(EXIT_FAILURE, "cannot allocate event");
+
+  *e = (struct event){ .due = due, .node = node, .size = size };
+  memcpy(e->data, data, size);
+
+  for(p = &events ; *p && (*p)->due <= due ; p = &(*p)->next);
+  e->next = *p;
+  *p = e;
+}
+
+/* A reboot loses what the modem was about to send. */
+static void drop_events(struct node *node)
+{
+  struct event **p = &events;
+
+  while(*p) {
+    struct event *e = *p;
+
+    if(e->node == node) {
+      *p = e->next;
+      free(e);
+    }
+    else
+      p = &e->next;
+  }
+}
+
+/* UART faults on bytes written to the driver, in place.
+   Return the number of bytes left. */
+static unsigned int impair(struct node *node, unsigned char *data, unsigned int size, uint64_t t)
+{
+  /* the size byte of LoRa frames and the HDLC delimiters are spared
+     so that only the CRC of the driver catches the corruption */
+  unsigned int trailer = node->medium == MEDIUM_G3PLC;
+  unsigned int i, n;
+
+  if(t < node->corrupt_until && size > 1 + trailer && chance(node->corrupt)) {
+    unsigned char c;
+
+    i = 1 + rand() % (size - 1 - trailer);
+    c = data[i] ^ 0x40;
+    if(c == 0x7e || c == 0x7d)
+      c = data[i] ^ 0x01;
+    data[i] = c;
+  }
+
+  if(t >= node->drop_until)
+    return size;
+
+  for(i = 0, n = 0 ; i < size ; i++) {
+    if(!chance(node->drop))
+      data[n++] = data[i];
+  }
+  return n;
+}
+
+static void write_node(struct node *node, const void *data, unsigned int size)
+{
+  const unsigned char *b = data;
+  ssize_t n;
+
+  /* a driver started later must not read an old frame */
+  if(node->closed)
+    return;
+
+  while(size) {
+    n = write(node->fd, b, size);
+    if(n < 0) {
+      if(errno == EINTR)
+        continue;
+      /* we don't fail on client error */
+      warn("cannot write to %s", node->path);
+      return;
+    }
+    b    += n;
+    size -= n;
+  }
+}
+
+static void send_byte(struct node *node, unsigned char c)
+{
+  schedule(node, now(), &c, 1);
+}
+
+/* Pack a command for the driver. */
+static void send_cmd(struct node *node, uint64_t due,
+                     unsigned int type, unsigned int idc, unsigned int ida,
+                     unsigned int idp, unsigned int id,
+                     const void *data, unsigned int size)
+{
+  unsigned char packed[2 * SIM_G3PLC_MAX_FRAME + 2];
+  struct g3plc_cmd cmd = { 0, type, idc, ida, idp, id };
+
+  hton_g3plc_cmd(&cmd);
+  schedule(node, due, packed,
+           pack_crc(packed, (const unsigned char *)&cmd, sizeof(cmd), data, size));
+}
+
+static void confirm(struct node *node, const struct g3plc_cmd *req,
+                    const void *data, unsigned int size)
+{
+  send_cmd(node, now(), req->type, req->idc, G3PLC_IDA_CONFIRM, req->idp, req->cmd, data, size);
+}
+
+static void confirm_status(struct node *node, const struct g3plc_cmd *req, unsigned char status)
+{
+  confirm(node, req, &status, sizeof(status));
+}
+
+static struct pib * lookup_pib(struct channel *chan, uint16_t id, uint16_t idx)
+{
+  unsigned int i;
+
+  for(i = 0 ; i < SIM_MAX_PIB ; i++) {
+    struct pib *p = &chan->pib[i];
+
+    if(p->used && p->id == id && p->idx == idx)
+      return p;
+  }
+
+  return NULL;
+}
+
+static unsigned int pib_value(struct channel *chan, uint16_t id, unsigned int def)
+{
+  const struct pib *p = lookup_pib(chan, id, 0);
+  uint16_t u16;
+
+  if(!p)
+    return def;
+
+  /* attributes are sent in host order by the driver */
+  if(p->size == sizeof(uint8_t))
+    return p->value[0];
+  memcpy(&u16, p->value, sizeof(u16));
+  return u16;
+}
+
+static void reset_modem(struct node *node)
+{
+  memset(node->chans, 0, sizeof(node->chans));
+  node->chan = &node->chans[G3PLC_CHAN0];
+}
+
+/* Without a reset line the driver only notices the reboot
+   when the modem stops answering, and it reads the program
+   request from its boot sequence once it gave up on the
+   application. The request waits for the UART to be quiet. */
+static void reboot_modem(struct node *node)
+{
+  reset_modem(node);
+  drop_events(node);
+  node->boot     = BOOT_RESET;
+  node->heard    = now();
+  node->size     = 0;
+  node->in_frame = 0;
+}
+
+static void mlme_set(struct node *node, const struct g3plc_cmd *req,
+                     const unsigned char *data, unsigned int size)
+{
+  unsigned char rep[5];
+  uint16_t id, idx;
+  struct pib *p;
+  unsigned int i;
+
+  if(size < 4) {
+    confirm_status(node, req, G3PLC_MAC_INVALID_PARAMETER);
+    return;
+  }
+
+  memcpy(&id, data, sizeof(id));
+  memcpy(&idx, data + 2, sizeof(idx));
+  memcpy(rep + 1, data, 4); /* attribute ID and index */
+  id  = ntohs(id);
+  idx = ntohs(idx);
+
+  p = lookup_pib(node->chan, id, idx);
+  for(i = 0 ; !p && i < SIM_MAX_PIB ; i++)
+    if(!node->chan->pib[i].used)
+      p = &node->chan->pib[i];
+
+  rep[0] = G3PLC_MAC_SUCCESS;
+  if(!p || size - 4 > SIM_PIB_MAX_SIZE)
+    rep[0] = G3PLC_MAC_INVALID_PARAMETER;
+  else {
+    *p = (struct pib){ .used = 1, .id = id, .idx = idx, .size = size - 4 };
+    memcpy(p->value, data + 4, size - 4);
+  }
+
+  confirm(node, req, rep, sizeof(rep));
+}
+
+static void mlme_get(struct node *node, const struct g3plc_cmd *req,
+                     const unsigned char *data, unsigned int size)
+{
+  unsigned char rep[5 + SIM_PIB_MAX_SIZE];
+  const struct pib *p = NULL;
+  uint16_t id, idx;
+
+  if(size >= 4) {
+    memcpy(&id, data, sizeof(id));
+    memcpy(&idx, data + 2, sizeof(idx));
+    p = lookup_pib(node->chan, ntohs(id), ntohs(idx));
+    memcpy(rep + 1, data, 4);
+  }
+
+  if(!p) {
+    confirm_status(node, req, G3PLC_MAC_UNSUPPORTED_ATTRIBUTE);
+    return;
+  }
+
+  rep[0] = G3PLC_MAC_SUCCESS;
+  memcpy(rep + 5, p->value, p->size);
+  confirm(node, req, rep, 5 + p->size);
+}
+
+static void g3_getconfig(struct node *node, const struct g3plc_cmd *req)
+{
+  /* status, g3mode, bandplan, reserved and extended address */
+  unsigned char rep[3 + sizeof(uint32_t) + 8] = { 0 };
+
+  rep[0] = node->chan->initialized ? G3PLC_G3_SUCCESS : G3PLC_G3_UNINITIALIZED_STATE;
+  rep[1] = 0x03;
+  rep[2] = node->chan->bandplan;
+  memcpy(rep + 3 + sizeof(uint32_t), node->chan->extaddr, 8);
+
+  confirm(node, req, rep, sizeof(rep));
+}
+
+static void g3_setconfig(struct node *node, const struct g3plc_cmd *req,
+                         const unsigned char *data, unsigned int size)
+{
+  /* g3mode, bandplan, reserved and extended address */
+  if(size < 2 + sizeof(uint32_t) + 8) {
+    confirm_status(node, req, G3PLC_G3_INVALID_PARAMETER);
+    return;
+  }
+
+  node->chan->bandplan = data[1];
+  memcpy(node->chan->extaddr, data + 2 + sizeof(uint32_t), 8);
+  confirm_status(node, req, G3PLC_G3_SUCCESS);
+}
+
+/* Whether two channels have the same key at an index of their key
+   table, as the MIC of a secured frame only matches in that case. */
+static int same_key(struct channel *a, struct channel *b, uint8_t idx)
+{
+  const struct pib *ka = lookup_pib(a, G3PLC_ATTR_KEY_TABLE, idx);
+  const struct pib *kb = lookup_pib(b, G3PLC_ATTR_KEY_TABLE, idx);
+
+  return ka && kb && ka->size == kb->size && !memcmp(ka->value, kb->value, ka->size);
+}
+
+/* Deliver an MSDU to the modems of the PAN it is addressed to on
+   the same channel. Return the number of modems that received it. */
+static unsigned int deliver(struct node *src, unsigned int idc, uint16_t dst, uint16_t pan,
+                            const unsigned char *msdu, unsigned int len, uint64_t due,
+                            uint8_t sec_level, uint8_t key_id_mode, uint8_t key_index)
+{
+  unsigned char ind[24 + G3PLC_MAX_PAYLOAD + 22];
+  uint16_t saddr = pib_value(&src->chans[idc], G3PLC_ATTR_SHORTADDR, 0xffff);
+  unsigned char *d = ind;
+  unsigned int i, received = 0;
+  uint16_t u16;
+  int addressed;
+
+  /* source */
+  *d++ = 0x02;
+  u16 = htons(pan);   memcpy(d, &u16, 2); d += 2;
+  memset(d, 0, 8);
+  u16 = htons(saddr); memcpy(d + 6, &u16, 2); d += 8;
+
+  /* destination */
+  *d++ = 0x02;
+  u16 = htons(pan);   memcpy(d, &u16, 2); d += 2;
+  memset(d, 0, 8);
+  u16 = htons(dst);   memcpy(d + 6, &u16, 2); d += 8;
+
+  /* MSDU */
+  u16 = htons(len);   memcpy(d, &u16, 2); d += 2;
+  memcpy(d, msdu, len);
+  d += len;
+
+  /* Trailer, the link quality follows the loss probability
+     and the tonemap has all six CENELEC-A bands. The DSN,
+     timestamp and key source are left null, the other
+     security fields are the ones of the request. */
+  *d++ = 255 * (1 - loss);
+  memset(d, 0, 17);
+  d[5]  = sec_level;
+  d[6]  = key_id_mode;
+  d[15] = key_index;
+  d += 17;
+  *d++ = 0x00; /* estimated modulation */
+  *d++ = 0x00; /* tonemap */
+  *d++ = 0x00;
+  *d++ = 0x3f;
+
+  for(i = 0 ; i < nnodes ; i++) {
+    struct node *n = &nodes[i];
+    struct channel *c = &n->chans[idc];
+
+    if(n == src || n->medium != MEDIUM_G3PLC || !c->started)
+      continue;
+    /* in promiscuous mode the modem hears all the frames,
+       only the addressed ones acknowledge */
+    addressed = pib_value(c, G3PLC_ATTR_PANID, 0xffff) == pan &&
+                (dst == 0xffff || pib_value(c, G3PLC_ATTR_SHORTADDR, 0xffff) == dst);
+    if(!addressed && !pib_value(c, G3PLC_ATTR_PROMISCUOUS, 0))
+      continue;
+    /* the modem drops secured frames whose MIC does not match */
+    if(sec_level && !same_key(&src->chans[idc], c, key_index))
+      continue;
+
+    if(lost(MEDIUM_G3PLC)) {
+      media[MEDIUM_G3PLC].lost++;
+      continue;
+    }
+
+    send_cmd(n, due, G3PLC_TYPE_G3, idc, G3PLC_IDA_INDICATION, G3PLC_IDP_UMAC,
+             G3PLC_CMD_MCPS_DATA, ind, d - ind);
+    media[MEDIUM_G3PLC].delivered++;
+    received += addressed;
+  }
+
+  return received;
+}
+
+static void mcps_data(struct node *node, const struct g3plc_cmd *req,
+                      const unsigned char *data, unsigned int size)
+{
+  unsigned int attempts = 1 + pib_value(node->chan, G3PLC_ATTR_RETRANS, 0);
+  unsigned char rep[2];
+  uint16_t dst, pan, len, u16;
+  uint64_t due = now();
+  int ack;
+
+  if(size < MCPS_REQUEST_HDR) {
+    confirm_status(node, req, R_G3MAC_STATUS_INVALID_PARAMETER);
+    return;
+  }
+
+  /* The G3-PLC driver puts the short address at the start of
+     the address field and the hybrid one at the end (as in the
+     indications), the rest of the field is null. */
+  memcpy(&pan, data + 2, 2);
+  memcpy(&dst, data + 4, 2);
+  memcpy(&u16, data + 10, 2);
+  memcpy(&len, data + 12, 2);
+  pan = ntohs(pan);
+  dst = ntohs(dst) | ntohs(u16);
+  len = ntohs(len);
+  ack = data[15] & 0x01 && dst != 0xffff;
+
+  rep[0] = data[14]; /* MSDU handle */
+  rep[1] = R_G3MAC_STATUS_SUCCESS;
+
+  if(len != size - MCPS_REQUEST_HDR)
+    rep[1] = R_G3MAC_STATUS_INVALID_PARAMETER;
+  else if(!node->chan->started)
+    rep[1] = R_G3MAC_STATUS_INVALID_PARAMETER;
+  else {
+    /* a frame is sent again until one receiver gets it */
+    do {
+      due = transmit(MEDIUM_G3PLC, size);
+      if(deliver(node, req->idc, dst, pan, data + MCPS_REQUEST_HDR, len, due,
+                 data[16], data[17], data[26]) || !ack)
+        break;
+    } while(--attempts);
+
+    if(!attempts)
+      rep[1] = R_G3MAC_STATUS_NO_ACK;
+  }
+
+  if(verbose)
+    printf("g3plc%u: MCPS-DATA on channel %u to %04X, %u bytes: %02X\n",
+           node->id, req->idc, dst, len, rep[1]);
+
+  send_cmd(node, due + delay, req->type, req->idc, G3PLC_IDA_CONFIRM, req->idp, req->cmd,
+           rep, sizeof(rep));
+}
+
+/* Parse a command received from the driver. */
+static void g3plc_request(struct node *node)
+{
+  struct g3plc_cmd *cmd = (struct g3plc_cmd *)node->buf;
+  unsigned int size = node->size;
+  const unsigned char *data;
+
+  if(size < sizeof(struct g3plc_cmd) + sizeof(uint32_t) ||
+     !extract_crc(&g3plc_conf, node->buf, &size)) {
+    if(verbose)
+      printf("g3plc%u: invalid command\n", node->id);
+    return;
+  }
+
+  ntoh_g3plc_cmd(cmd);
+  data  = cmd->data;
+  size -= sizeof(struct g3plc_cmd);
+
+  if(cmd->ida != G3PLC_IDA_REQUEST || cmd->type != G3PLC_TYPE_G3)
+    return;
+  node->chan = &node->chans[cmd->idc];
+
+  switch(cmd->idp << 8 | cmd->cmd) {
+  case G3PLC_IDP_G3CTR << 8 | G3PLC_CMD_G3_INIT:
+    node->chan->initialized = 1;
+    confirm_status(node, cmd, G3PLC_G3_SUCCESS);
+    break;
+  case G3PLC_IDP_G3CTR << 8 | G3PLC_CMD_G3_SETCONFIG:
+    g3_setconfig(node, cmd, data, size);
+    break;
+  case G3PLC_IDP_G3CTR << 8 | G3PLC_CMD_G3_GETCONFIG:
+    g3_getconfig(node, cmd);
+    break;
+  case G3PLC_IDP_UMAC << 8 | G3PLC_CMD_MLME_RESET:
+    memset(node->chan->pib, 0, sizeof(node->chan->pib));
+    node->chan->started = 0;
+    confirm_status(node, cmd, G3PLC_MAC_SUCCESS);
+    break;
+  case G3PLC_IDP_UMAC << 8 | G3PLC_CMD_MLME_SET:
+    mlme_set(node, cmd, data, size);
+    break;
+  case G3PLC_IDP_UMAC << 8 | G3PLC_CMD_MLME_GET:
+    mlme_get(node, cmd, data, size);
+    break;
+  case G3PLC_IDP_UMAC << 8 | G3PLC_CMD_MLME_START:
+    node->chan->started = 1;
+    confirm_status(node, cmd, G3PLC_MAC_SUCCESS);
+    break;
+  case G3PLC_IDP_UMAC << 8 | G3PLC_CMD_MCPS_DATA:
+    mcps_data(node, cmd, data, size);
+    break;
+  default:
+    if(verbose)
+      printf("g3plc%u: unsupported command %X:%02X\n", node->id, cmd->idp, cmd->cmd);
+    confirm_status(node, cmd, G3PLC_G3_INVALID_REQUEST);
+  }
+}
+
+/* HDLC unescaping of the commands sent by the driver. */
+static void g3plc_feed(struct node *node, unsigned char c)
+{
+  if(c == 0x7e) {
+    if(node->in_frame && node->size && !node->overflow)
+      g3plc_request(node);
+    node->in_frame = 1;
+    node->escaped  = 0;
+    node->overflow = 0;
+    node->size     = 0;
+    return;
+  }
+
+  if(!node->in_frame)
+    return;
+
+  if(c == 0x7d) {
+    node->escaped = 1;
+    return;
+  }
+  if(node->escaped) {
+    c ^= 0x20;
+    node->escaped = 0;
+  }
+
+  if(node->size == sizeof(node->buf))
+    node->overflow = 1;
+  else
+    node->buf[node->size++] = c;
+}
+
+/* Boot sequence of the CPX as seen from the driver.
+   Only the first segment is requested. */
+static void g3plc_boot(struct node *node, unsigned char c)
+{
+  struct g3plc_cmd ready = { 0, G3PLC_TYPE_SYSTEM, G3PLC_CHAN0, G3PLC_IDA_REQUEST,
+                             G3PLC_IDP_G3CTR, G3PLC_CMD_G3_SETCONFIG }; /* SYSTEM_CTRL_READY */
+  uint32_t size;
+
+  switch(node->boot) {
+  case BOOT_INFO:
+    /* after a reset the driver may still be sending commands,
+       the request is sent again once it is quiet */
+    if(node->reset_boot && !node->size && c == 0x7e) {
+      node->boot = BOOT_RESET;
+      return;
+    }
+    /* segment information table without the program offset */
+    node->buf[node->size++] = c;
+    if(node->size < 12)
+      return;
+    memcpy(&size, node->buf + 4, sizeof(size)); /* little endian */
+    node->boot_left = size;
+    node->boot = BOOT_DATA;
+    if(node->boot_left)
+      return;
+    break;
+  case BOOT_DATA:
+    if(--node->boot_left)
+      return;
+    break;
+  case BOOT_BAUD_CMD:
+    if(c == 0xc1)
+      node->boot = BOOT_BAUD_CODE;
+    return;
+  case BOOT_BAUD_CODE:
+    send_byte(node, 0xcf); /* baud rate change accept */
+    node->boot = BOOT_BAUD_ACK;
+    return;
+  case BOOT_BAUD_ACK:
+    if(c != 0xaa)
+      return;
+    send_byte(node, 0xb0); /* boot completion */
+    send_cmd(node, now() + 10000000, ready.type, ready.idc, ready.ida, ready.idp, ready.cmd, NULL, 0);
+    node->boot = BOOT_RUNNING;
+    node->size = 0;
+    node->in_frame = 0;
+    node->reset_boot = 0;
+    if(verbose)
+      printf("g3plc%u: booted\n", node->id);
+    return;
+  default:
+    return;
+  }
+
+  /* end of segment 0 */
+  send_byte(node, 0xa1); /* baud rate change request */
+  node->boot = BOOT_BAUD_CMD;
+}
+
+/* LoRa frames are sent to all the other modules. */
+static void lora_feed(struct node *node, unsigned char c)
+{
+  uint64_t due;
+  unsigned int i;
+
+  node->buf[node->size++] = c;
+
+  /* drop invalid sizes to resynchronize */
+  if(node->size == 1 && (!(c & ~SIM_LORA_NOACK) || (c & ~SIM_LORA_NOACK) > SIM_LORA_MAX_FRAME)) {
+    node->size = 0;
+    return;
+  }
+  if(node->size < 1U + (node->buf[0] & ~SIM_LORA_NOACK))
+    return;
+
+  due = transmit(MEDIUM_LORA, node->size);
+
+  for(i = 0 ; i < nnodes ; i++) {
+    struct node *n = &nodes[i];
+
+    if(n == node || n->medium != MEDIUM_LORA || n->closed)
+      continue;
+
+    if(lost(MEDIUM_LORA)) {
+      media[MEDIUM_LORA].lost++;
+      continue;
+    }
+
+    schedule(n, due, node->buf, node->size);
+    media[MEDIUM_LORA].delivered++;
+  }
+
+  if(verbose)
+    printf("lora%u: frame of %u bytes\n", node->id, node->size);
+
+  node->size = 0;
+}
+
+static void read_node(struct node *node)
+{
+  unsigned char buf[4096];
+  ssize_t n, i;
+
+  n = read(node->fd, buf, sizeof(buf));
+  if(n <= 0)
+    return;
+  node->heard = now();
+
+  for(i = 0 ; i < n ; i++) {
+    if(node->heard < node->drop_until && chance(node->drop))
+      continue;
+
+    if(node->medium == MEDIUM_LORA)
+      lora_feed(node, buf[i]);
+    else if(node->boot == BOOT_RUNNING)
+      g3plc_feed(node, buf[i]);
+    else
+      g3plc_boot(node, buf[i]);
+  }
+}
+
+static void node_opened(struct node *node)
+{
+  node->closed = 0;
+  node->opened = now();
+  node->size   = 0;
+  node->in_frame = 0;
+
+  if(verbose)
+    printf("%s%u: opened\n", medium_names[node->medium], node->id);
+
+  if(node->medium == MEDIUM_G3PLC && node->boot != BOOT_RUNNING)
+    node->boot = BOOT_OPENED;
+}
+
+static void node_closed(struct node *node)
+{
+  node->closed = 1;
+
+  if(verbose)
+    printf("%s%u: closed\n", medium_names[node->medium], node->id);
+
+  if(node->medium == MEDIUM_G3PLC && !warm) {
+    node->boot = BOOT_CLOSED;
+    node->reset_boot = 0;
+    reset_modem(node);
+  }
+}
+
+static void open_node(struct node *node, enum medium medium, unsigned int id)
+{
+  struct termios tty;
+  int slave;
+
+  *node = (struct node){ .medium = medium, .id = id, .closed = 1 };
+
+  node->fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if(node->fd < 0 || grantpt(node->fd) < 0 || unlockpt(node->fd) < 0)
+    err(EXIT_FAILURE, "cannot create pseudo-terminal");
+  snprintf(node->path, sizeof(node->path), "%s", ptsname(node->fd));
+
+  /* The drivers configure the terminal themselves,
+     but nothing should be echoed before they do. */
+  slave = open(node->path, O_RDWR | O_NOCTTY);
+  if(slave < 0)
+    err(EXIT_FAILURE, "cannot open %s", node->path);
+  if(tcgetattr(slave, &tty) < 0)
+    err(EXIT_FAILURE, "cannot configure %s", node->path);
+  cfmakeraw(&tty);
+  tcsetattr(slave, TCSANOW, &tty);
+  close(slave);
+
+  if(prefix) {
+    snprintf(node->link, sizeof(node->link), "%s-%s%u", prefix, medium_names[medium], id);
+    unlink(node->link);
+    if(symlink(node->path, node->link) < 0)
+      err(EXIT_FAILURE, "cannot link %s", node->link);
+  }
+
+  /* A warm modem runs since the start. */
+  node->boot = BOOT_CLOSED;
+  if(medium == MEDIUM_G3PLC && warm)
+    node->boot = BOOT_RUNNING;
+
+  printf("%s%u: %s\n", medium_names[medium], id, node->link[0] ? node->link : node->path);
+}
+
+/* Check whether the terminal of a node was opened or closed. */
+static void check_hup(struct node *node)
+{
+  struct pollfd pfd = { .fd = node->fd, .events = POLLIN };
+  int hup = poll(&pfd, 1, 0) > 0 && pfd.revents & POLLHUP;
+
+  if(hup && !node->closed)
+    node_closed(node);
+  else if(!hup && node->closed)
+    node_opened(node);
+}
+
+static void request_program(struct node *node, uint64_t t)
+{
+  write_node(node, "\x80", 1); /* program transmission request */
+  node->boot  = BOOT_INFO;
+  node->size  = 0;
+  node->asked = t;
+}
+
+static void run_timers(void)
+{
+  uint64_t t = now();
+  unsigned int i;
+
+  for(i = 0 ; i < nnodes ; i++) {
+    struct node *n = &nodes[i];
+
+    if(n->boot == BOOT_OPENED && t >= n->opened + SIM_BOOT_DELAY)
+      request_program(n, t);
+    else if(n->boot == BOOT_RESET && t >= n->heard + SIM_BOOT_QUIET) {
+      n->reset_boot = 1;
+      request_program(n, t);
+    }
+    /* the driver may have read the request as noise
+       while it was still waiting for a confirm */
+    else if(n->boot == BOOT_INFO && n->reset_boot && !n->size && t >= n->asked + SIM_BOOT_REPEAT)
+      request_program(n, t);
+  }
+
+  while(events && events->due <= t) {
+    struct event *e = events;
+
+    events = e->next;
+    write_node(e->node, e->data, impair(e->node, e->data, e->size, t));
+    free(e);
+  }
+}
+
+static int next_timeout(void)
+{
+  uint64_t t = now();
+  int timeout = -1;
+  unsigned int i;
+
+  for(i = 0 ; i < nnodes ; i++) {
+    if(nodes[i].closed || nodes[i].boot == BOOT_OPENED ||
+       nodes[i].boot == BOOT_RESET || nodes[i].reset_boot)
+      timeout = SIM_HUP_POLL;
+  }
+
+  if(events) {
+    int ms = events->due > t ? (events->due - t + 999999) / 1000000 : 0;
+
+    if(timeout < 0 || ms < timeout)
+      timeout = ms;
+  }
+
+  return timeout;
+}
+
+static struct node * find_node(const char *name)
+{
+  unsigned int i;
+  char n[16];
+
+  for(i = 0 ; i < nnodes ; i++) {
+    snprintf(n, sizeof(n), "%s%u", medium_names[nodes[i].medium], nodes[i].id);
+    if(!strcmp(n, name))
+      return &nodes[i];
+  }
+
+  return NULL;
+}
+
+/* Apply a fault received on the control socket. */
+static void control(void)
+{
+  char buf[SIM_CONTROL_SIZE], name[16];
+  struct node *node = NULL;
+  unsigned int ms, i;
+  double percent;
+  uint64_t t = now();
+  ssize_t n;
+
+  n = recv(control_fd, buf, sizeof(buf) - 1, 0);
+  if(n <= 0)
+    return;
+  buf[n] = '\0';
+  buf[strcspn(buf, "\r\n")] = '\0';
+
+  if(sscanf(buf, "outage %15s %u", name, &ms) == 2) {
+    for(i = 0 ; i < MEDIUM_MAX && strcmp(medium_names[i], name) ; i++);
+    if(i == MEDIUM_MAX) {
+      warnx("unknown medium: %s", name);
+      return;
+    }
+    media[i].outage = t + ms * 1000000ULL;
+  }
+  else if(sscanf(buf, "%*s %15s", name) == 1 && !(node = find_node(name))) {
+    warnx("unknown node: %s", name);
+    return;
+  }
+  else if(sscanf(buf, "reset %15s", name) == 1) {
+    if(node->medium != MEDIUM_G3PLC) {
+      warnx("%s has no firmware to reset", name);
+      return;
+    }
+    reboot_modem(node);
+  }
+  else if(sscanf(buf, "drop %15s %lf %u", name, &percent, &ms) == 3) {
+    node->drop       = percent / 100;
+    node->drop_until = t + ms * 1000000ULL;
+  }
+  else if(sscanf(buf, "corrupt %15s %lf %u", name, &percent, &ms) == 3) {
+    node->corrupt       = percent / 100;
+    node->corrupt_until = t + ms * 1000000ULL;
+  }
+  else {
+    warnx("invalid fault: %s", buf);
+    return;
+  }
+
+  printf("fault: %s\n", buf);
+}
+
+static void open_control(void)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+  if(strlen(control_path) >= sizeof(addr.sun_path))
+    errx(EXIT_FAILURE, "control socket path too long");
+  strcpy(addr.sun_path, control_path);
+
+  control_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if(control_fd < 0)
+    err(EXIT_FAILURE, "cannot create control socket");
+  unlink(control_path);
+  if(bind(control_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    err(EXIT_FAILURE, "cannot bind %s", control_path);
+
+  printf("control: %s\n", control_path);
+}
+
+static void sig_stop(int signum)
+{
+  (void)signum;
+  stopped = 1;
+}
+
+static void run(void)
+{
+  struct pollfd *pfds = malloc((nnodes + 1) * sizeof(struct pollfd));
+  struct node **polled = malloc(nnodes * sizeof(struct node *));
+  unsigned int i, n;
+
+  if(!pfds || !polled)
+    err(EXIT_FAILURE, "cannot allocate poll set");
+
+  while(!stopped) {
+    /* closed terminals always wake poll() up */
+    for(i = 0, n = 0 ; i < nnodes ; i++) {
+      check_hup(&nodes[i]);
+      if(nodes[i].closed)
+        continue;
+      pfds[n]   = (struct pollfd){ .fd = nodes[i].fd, .events = POLLIN };
+      polled[n] = &nodes[i];
+      n++;
+    }
+    /* the control socket comes last */
+    pfds[n] = (struct pollfd){ .fd = control_fd, .events = POLLIN };
+
+    if(poll(pfds, n + 1, next_timeout()) < 0) {
+      if(errno == EINTR)
+        continue;
+      err(EXIT_FAILURE, "cannot poll");
+    }
+
+    for(i = 0 ; i < n ; i++) {
+      if(pfds[i].revents & POLLHUP)
+        node_closed(polled[i]);
+      else if(pfds[i].revents & POLLIN)
+        read_node(polled[i]);
+    }
+    if(pfds[n].revents & POLLIN)
+      control();
+
+    run_timers();
+  }
+
+  free(pfds);
+  free(polled);
+}
+
+static void print_stats(void)
+{
+  unsigned int i;
+
+  for(i = 0 ; i < MEDIUM_MAX ; i++) {
+    const struct medium_stats *m = &media[i];
+
+    if(!m->frames)
+      continue;
+    printf("%-6s: %lu frames, %lu delivered, %lu lost\n",
+           medium_names[i], m->frames, m->delivered, m->lost);
+  }
+}
+
+static void print_help(const char *name)
+{
+  struct opt_help messages[] = {
+    { 'h', "help",      "Show this help message" },
+    { 'V', "version",   "Show version information" },
+    { 'v', "verbose",   "Log frames and modem events" },
+    { 'g', "g3plc",     "Number of G3-PLC modems (default 2)" },
+    { 'l', "lora",      "Number of LoRa modules (default 0)" },
+    { 'L', "loss",      "Loss probability of a frame for each receiver in percent" },
+    { 'D', "delay",     "Propagation delay in microseconds" },
+    { 'b', "bandwidth", "Bandwidth of each medium in bits/s (default unlimited)" },
+    { 'w', "warm",      "Modems keep their state when the UART is closed" },
+    { 'p', "prefix",    "Create symbolic links PREFIX-g3plcN and PREFIX-loraN" },
+    { 's', "seed",      "Seed of the loss generator" },
+    { 'c', "control",   "Datagram socket on which to receive the faults to inject" },
+    { 0, NULL, NULL }
+  };
+
+  help(name, "[OPTIONS]", messages);
+}
+
+static void parse_options(int argc, char *argv[])
+{
+  const char *name = basename(argv[0]);
+  char *end;
+  int err;
+
+  struct option opts[] = {
+    { "help", no_argument, NULL, 'h' },
+    { "version", no_argument, NULL, 'V' },
+    { "verbose", no_argument, NULL, 'v' },
+    { "g3plc", required_argument, NULL, 'g' },
+    { "lora", required_argument, NULL, 'l' },
+    { "loss", required_argument, NULL, 'L' },
+    { "delay", required_argument, NULL, 'D' },
+    { "bandwidth", required_argument, NULL, 'b' },
+    { "warm", no_argument, NULL, 'w' },
+    { "prefix", required_argument, NULL, 'p' },
+    { "seed", required_argument, NULL, 's' },
+    { "control", required_argument, NULL, 'c' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  while(1) {
+    int c = getopt_long(argc, argv, "hVvg:l:L:D:b:wp:s:c:", opts, NULL);
+
+    if(c == -1)
+      break;
+
+    switch(c) {
+    case 'g':
+      g3plc_count = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "invalid number of G3-PLC modems");
+      break;
+    case 'l':
+      lora_count = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "invalid number of LoRa modules");
+      break;
+    case 'L':
+      loss = strtod(optarg, &end) / 100;
+      if(*end || loss < 0 || loss > 1)
+        errx(EXIT_FAILURE, "invalid loss (0 to 100%%)");
+      break;
+    case 'D':
+      delay = xatou(optarg, &err) * 1000ULL;
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse delay");
+      break;
+    case 'b':
+      bandwidth = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse bandwidth");
+      break;
+    case 'w':
+      warm = 1;
+      break;
+    case 'p':
+      prefix = optarg;
+      break;
+    case 'c':
+      control_path = optarg;
+      break;
+    case 's':
+      srand(xatou(optarg, &err));
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse seed");
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    case 'V':
+      version(name);
+      exit(EXIT_SUCCESS);
+    case 'h':
+    default:
+      print_help(name);
+      exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  struct sigaction act = { .sa_handler = sig_stop };
+  unsigned int i;
+
+  parse_options(argc, argv);
+
+  /* the logs are generally redirected in CI */
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  nnodes = g3plc_count + lora_count;
+  if(!nnodes)
+    errx(EXIT_FAILURE, "no modem to simulate");
+
+  nodes = malloc(nnodes * sizeof(struct node));
+  if(!nodes)
+    err(EXIT_FAILURE, "cannot allocate modems");
+
+  for(i = 0 ; i < g3plc_count ; i++)
+    open_node(&nodes[i], MEDIUM_G3PLC, i);
+  for(i = 0 ; i < lora_count ; i++)
+    open_node(&nodes[g3plc_count + i], MEDIUM_LORA, i);
+
+  if(control_path)
+    open_control();
+
+  sigemptyset(&act.sa_mask);
+  sigaction(SIGINT, &act, NULL);
+  sigaction(SIGTERM, &act, NULL);
+
+  run();
+
+  print_stats();
+
+  if(control_fd >= 0) {
+    close(control_fd);
+    unlink(control_path);
+  }
+
+  for(i = 0 ; i < nnodes ; i++) {
+    if(nodes[i].link[0])
+      unlink(nodes[i].link);
+    close(nodes[i].fd);
+  }
+  free(nodes);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,229 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#include "g3-plc/g3plc-str.h"
+#include "common.h"
+#include "modems.h"
+
+static struct modem modems[MODEMS_MAX];
+static unsigned int nmodems;
+
+void modems_add(const char *arg)
+{
+  struct modem *m;
+  char *s, *addr, *end;
+  long v;
+
+  if(nmodems == MODEMS_MAX)
+    errx(EXIT_FAILURE, "too many modems (max %u)", MODEMS_MAX + 1);
+  m = &modems[nmodems];
+
+  s = strdup(arg);
+  end = strrchr(s, ':');
+  if(!end || end == s)
+    errx(EXIT_FAILURE, "modem expects DEVICE:ADDR[,ADDR...]");
+  *end++ = '\0';
+  m->device = s;
+
+  for(addr = strtok(end, ",") ; addr ; addr = strtok(NULL, ",")) {
+    v = strtol(addr, &end, 16);
+    if(*end || v < 0 || v >= 0xffff)
+      errx(EXIT_FAILURE, "invalid node address '%s'", addr);
+    if(m->count == MODEMS_MAX_NODES)
+      errx(EXIT_FAILURE, "too many nodes on %s (max %u)", m->device, MODEMS_MAX_NODES);
+    m->nodes[m->count++] = v;
+  }
+  if(!m->count)
+    errx(EXIT_FAILURE, "no node on %s", m->device);
+
+  nmodems++;
+}
+
+unsigned int modems_count(void)
+{
+  return nmodems;
+}
+
+struct modem * modems_get(unsigned int index)
+{
+  return &modems[index];
+}
+
+/* Platform callbacks of a modem, the data is the modem. */
+static int modem_send(const void *buf, unsigned int size, void *data)
+{
+  struct modem *m = data;
+  return uart_write(&m->uart, buf, size);
+}
+
+static int modem_read(void *buf, unsigned int size, void *data)
+{
+  struct modem *m = data;
+  return uart_line_read(&m->uart, buf, size);
+}
+
+static int modem_set_speed(unsigned int speed, void *data)
+{
+  struct modem *m = data;
+  return uart_set_speed(&m->uart, speed);
+}
+
+static void modem_arm_slot(unsigned int slot, void *data)
+{
+  struct modem *m = data;
+  slots_arm(&m->slots, slot);
+}
+
+static void modem_wait_slot(unsigned int slot, unsigned int us, void *data)
+{
+  struct modem *m = data;
+  slots_wait(&m->slots, slot, us);
+}
+
+static void modem_signal_slot(unsigned int slot, void *data)
+{
+  struct modem *m = data;
+  slots_signal(&m->slots, slot);
+}
+
+static void modem_lock(void *data)
+{
+  struct modem *m = data;
+  pthread_mutex_lock(&m->lock);
+}
+
+static void modem_unlock(void *data)
+{
+  struct modem *m = data;
+  pthread_mutex_unlock(&m->lock);
+}
+
+static void modem_snd_lock(void *data)
+{
+  struct modem *m = data;
+  pthread_mutex_lock(&m->snd_lock);
+}
+
+static void modem_snd_unlock(void *data)
+{
+  struct modem *m = data;
+  pthread_mutex_unlock(&m->snd_lock);
+}
+
+/* Without a reset line we rely on the
+   modem requesting its program. */
+static void modem_reset(void *data)
+{
+  UNUSED(data);
+}
+
+void modems_init(const struct g3plc_config *conf, speed_t speed, unsigned int uart_flags)
+{
+  unsigned int i;
+
+  for(i = 0 ; i < nmodems ; i++) {
+    struct modem *m = &modems[i];
+
+    uart_open(&m->uart, m->device, speed, uart_flags);
+    slots_init(&m->slots);
+    pthread_mutex_init(&m->lock, NULL);
+    pthread_mutex_init(&m->snd_lock, NULL);
+
+    /* Same settings as the main modem. The asynchronous sends
+       and their confirmations stay on the main modem, so is
+       the export of the raw commands. */
+    m->conf = *conf;
+    m->conf.callbacks.raw     = NULL;
+    m->conf.callbacks.cb_sent = NULL;
+    m->conf.chan1          = NULL;
+    m->conf.uart_send      = modem_send;
+    m->conf.uart_read      = modem_read;
+    m->conf.set_uart_speed = modem_set_speed;
+    m->conf.arm_slot       = modem_arm_slot;
+    m->conf.wait_slot      = modem_wait_slot;
+    m->conf.signal_slot    = modem_signal_slot;
+    m->conf.lock           = modem_lock;
+    m->conf.unlock         = modem_unlock;
+    m->conf.snd_lock       = modem_snd_lock;
+    m->conf.snd_unlock     = modem_snd_unlock;
+    m->conf.reset_clear    = modem_reset;
+    m->conf.reset_set      = modem_reset;
+    m->conf.boot_start     = NULL;
+    m->conf.boot_progress  = NULL;
+    m->conf.boot_end       = NULL;
+    m->conf.data           = m;
+
+    g3plc_init(&m->plc, &m->conf);
+  }
+}
+
+static void * modem_read_func(void *p)
+{
+  struct modem *m = p;
+
+  uart_loop(&m->uart, &m->plc);
+
+  return NULL;
+}
+
+void modems_start(const pthread_attr_t *attr)
+{
+  pthread_t thread;
+  unsigned int i;
+  int err;
+
+  for(i = 0 ; i < nmodems ; i++) {
+    struct modem *m = &modems[i];
+
+    /* The boot sequence reads the UART itself,
+       the read thread only starts after it. */
+    err = g3plc_reset(&m->plc);
+    if(err)
+      errx(EXIT_FAILURE, "cannot reset G3-PLC on %s: %s", m->device, g3plc_init2str(err));
+
+    if(pthread_create(&thread, attr, modem_read_func, m))
+      errx(EXIT_FAILURE, "cannot create threads");
+
+    err = g3plc_start(&m->plc);
+    if(err < 0)
+      errx(EXIT_FAILURE, "cannot start G3-PLC on %s: %s", m->device, g3plc_init2str(err));
+  }
+}
+
+struct g3plc_ctx * modems_plc(struct g3plc_ctx *main, uint16_t dst)
+{
+  unsigned int i, j;
+
+  for(i = 0 ; i < nmodems ; i++)
+    for(j = 0 ; j < modems[i].count ; j++)
+      if(modems[i].nodes[j] == dst)
+        return &modems[i].plc;
+
+  return main;
+}
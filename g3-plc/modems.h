@@ -0,0 +1,83 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MODEMS_H_
+#define _MODEMS_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "g3-plc/g3plc.h"
+#include "timer.h"
+#include "uart.h"
+
+/* Maximum number of modems besides the main one. */
+#define MODEMS_MAX 7
+
+/* Maximum number of nodes assigned to a modem. */
+#define MODEMS_MAX_NODES 64
+
+/* The tool may drive other G3-PLC modems, each on its own UART
+   (e.g. on another segment of the network). Each modem has its own
+   driver instance, confirmation slots and locks so that they send
+   and receive in parallel. The nodes are assigned to a modem which
+   carries the frames to them, the other nodes go through the main
+   modem. The modems share the configuration of the main one except
+   for the second channel, the reset line and the raw callback. */
+struct modem {
+  const char *device;
+
+  struct g3plc_ctx    plc;
+  struct g3plc_config conf;
+  struct uart         uart;
+  struct slots        slots;
+  pthread_mutex_t     lock;
+  pthread_mutex_t     snd_lock;
+
+  uint16_t     nodes[MODEMS_MAX_NODES];
+  unsigned int count;
+};
+
+/* Add a modem from DEVICE:ADDR[,ADDR...] with the hexadecimal
+   addresses of its nodes. Exit on error. */
+void modems_add(const char *arg);
+
+/* Number of modems besides the main one. */
+unsigned int modems_count(void);
+
+/* Modem at this index (below modems_count()). */
+struct modem * modems_get(unsigned int index);
+
+/* Open the lines and initialize the instances with a copy of the
+   configuration of the main modem. Exit on error. */
+void modems_init(const struct g3plc_config *conf, speed_t speed, unsigned int uart_flags);
+
+/* Boot and start each modem with its read thread. Exit on error. */
+void modems_start(const pthread_attr_t *attr);
+
+/* Instance that carries the frames to this destination,
+   the main one when the node is not assigned. */
+struct g3plc_ctx * modems_plc(struct g3plc_ctx *main, uint16_t dst);
+
+#endif /* _MODEMS_H_ */
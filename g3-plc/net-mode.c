@@ -0,0 +1,521 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _POSIX_C_SOURCE 200112L
+#endif /* __linux__ */
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <err.h>
+
+#include "g3-plc/g3plc-str.h"
+#include "g3-plc/g3plc.h"
+#include "safe-call.h"
+#include "common.h"
+#include "xatoi.h"
+#include "mode.h"
+#include "main.h"
+#include "log.h"
+#include "help.h"
+
+/*
+  The network mode relays frames to a remote collector over
+  UDP (default) or TCP, so that no relay process is needed
+  on the gateway.
+
+  Received frames are packed into batches. A batch is sent when
+  the next record would not fit, when no other frame arrived
+  within the flush interval or when its first record has waited
+  that long. All the integers are in network byte order:
+
+    batch : [seq (u32)][record][record]...
+    record: [size (u16)][status (u8)][src (u16)][dst (u16)][payload]
+
+  The size of a record counts the bytes that follow it. The
+  sequence number is the one of the first record and each
+  record has the next one. A gap tells the collector how many
+  frames were lost, either in the network or because the batch
+  could not be sent. With UDP each batch is a datagram. With
+  TCP each batch is prefixed with its size (u16).
+
+  The collector sends frames the same way, in datagrams or on
+  the TCP stream, as records of the form:
+
+    [size (u16)][dst (u16)][payload]
+
+  With TCP the collector is connected again when the connection
+  is lost or when the collector cannot keep up with the batches,
+  frames received meanwhile are dropped.
+*/
+
+#define DEFAULT_PORT           "7040"
+#define DEFAULT_BATCH_SIZE     1400 /* fits in an Ethernet frame */
+#define DEFAULT_FLUSH_INTERVAL 100000
+
+#define SEQ_SIZE    sizeof(uint32_t)
+#define LEN_SIZE    sizeof(uint16_t)
+#define RECORD_HDR  (sizeof(uint16_t) * 3 + sizeof(uint8_t))
+#define MIN_BATCH   (SEQ_SIZE + RECORD_HDR + G3PLC_MAX_PAYLOAD)
+#define MAX_BATCH   65507 /* largest UDP payload */
+
+/* delay between two connection attempts (s) */
+#define RECONNECT_DELAY 1
+
+/* a TCP batch not sent within this delay resets the connection (s) */
+#define SEND_TIMEOUT 1
+
+#define IN_SIZE (MAX_BATCH + G3PLC_MAX_PAYLOAD)
+
+enum opt {
+  OPT_HOST = 0x200, /* after common options */
+  OPT_PORT,
+  OPT_TCP,
+  OPT_BATCH_SIZE,
+  OPT_FLUSH_INTERVAL
+};
+
+static const char *host;
+static const char *port = DEFAULT_PORT;
+static int use_tcp;
+static unsigned int batch_max = DEFAULT_BATCH_SIZE;
+static unsigned int flush_interval = DEFAULT_FLUSH_INTERVAL;
+
+/* The socket is replaced by the start thread on reconnection
+   while the delivery thread sends batches on it. */
+static int sd = -1;
+static pthread_mutex_t sd_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Batch being built by the delivery thread. The TCP length
+   prefix is reserved at the beginning of the buffer. */
+static unsigned char *out_buf;
+static unsigned int out_size;
+static unsigned int out_count;
+static uint32_t out_seq;
+static uint32_t next_seq;
+static struct timespec out_stamp; /* first record */
+
+/* Data received from the collector. */
+static unsigned char in_buf[IN_SIZE];
+static unsigned int in_size;
+
+static unsigned long batches;
+static unsigned long records;
+static unsigned long dropped;
+
+struct option net_opts[] = {
+  { "host", required_argument, NULL, OPT_HOST },
+  { "port", required_argument, NULL, OPT_PORT },
+  { "tcp", no_argument, NULL, OPT_TCP },
+  { "batch-size", required_argument, NULL, OPT_BATCH_SIZE },
+  { "flush-interval", required_argument, NULL, OPT_FLUSH_INTERVAL },
+  { NULL, 0, NULL, 0 }
+};
+struct opt_help net_messages[] = {
+  { 0, "host", "Collector host name or address" },
+  { 0, "port", "Collector port (default " DEFAULT_PORT ")" },
+  { 0, "tcp", "Connect to the collector with TCP instead of UDP" },
+  { 0, "batch-size", "Largest batch in bytes (default 1400)" },
+  { 0, "flush-interval", "Delay in microseconds before a batch is sent (default 100000)" },
+  { 0, NULL, NULL }
+};
+
+static void put_u16(unsigned char *b, uint16_t v)
+{
+  b[0] = v >> 8;
+  b[1] = v & 0xff;
+}
+
+static void put_u32(unsigned char *b, uint32_t v)
+{
+  put_u16(b, v >> 16);
+  put_u16(b + 2, v & 0xffff);
+}
+
+static uint16_t get_u16(const unsigned char *b)
+{
+  return b[0] << 8 | b[1];
+}
+
+static unsigned long elapsed(const struct timespec *begin)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec - begin->tv_sec) * 1000000 + (ts.tv_nsec - begin->tv_nsec) / 1000;
+}
+
+static int connect_collector(void)
+{
+  static int warned; /* only report the first failed attempt */
+  struct addrinfo hints = { .ai_family   = AF_UNSPEC,
+                            .ai_socktype = use_tcp ? SOCK_STREAM : SOCK_DGRAM };
+  struct timeval timeout = { .tv_sec = SEND_TIMEOUT };
+  struct addrinfo *res, *ai;
+  int one = 1;
+  int fd = -1;
+  int ret;
+
+  ret = getaddrinfo(host, port, &hints, &res);
+  if(ret) {
+    if(!warned++)
+      warnx("cannot resolve %s: %s", host, gai_strerror(ret));
+    return -1;
+  }
+
+  for(ai = res ; ai ; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if(fd < 0)
+      continue;
+
+    /* a connected UDP socket only receives from the collector */
+    if(!connect(fd, ai->ai_addr, ai->ai_addrlen))
+      break;
+
+    close(fd);
+    fd = -1;
+  }
+
+  freeaddrinfo(res);
+
+  if(fd < 0) {
+    if(!warned++)
+      warn("cannot connect to %s:%s", host, port);
+    return -1;
+  }
+
+  warned = 0;
+
+  if(use_tcp) {
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  }
+
+  return fd;
+}
+
+/* Shut the TCP connection down. The start thread then
+   wakes up, closes the socket and connects again. */
+static void disconnect(void)
+{
+  shutdown(sd, SHUT_RDWR);
+  sd = -1;
+}
+
+static void send_batch(void)
+{
+  const unsigned char *b = out_buf + LEN_SIZE;
+  size_t size = out_size - LEN_SIZE;
+  ssize_t n;
+
+  if(!out_count)
+    return;
+
+  pthread_mutex_lock(&sd_lock);
+
+  if(sd < 0)
+    goto DROP;
+
+  if(use_tcp) {
+    put_u16(out_buf, size);
+    b     = out_buf;
+    size += LEN_SIZE;
+  }
+
+  /* A partial write breaks the framing of the stream, so the
+     connection is dropped rather than waiting for the collector. */
+  n = send(sd, b, size, use_tcp ? MSG_NOSIGNAL : MSG_DONTWAIT);
+  if(n == (ssize_t)size) {
+    batches++;
+    records += out_count;
+    goto EXIT;
+  }
+
+  if(n < 0 && !use_tcp && errno == ECONNREFUSED)
+    goto DROP; /* the collector is not listening yet */
+
+  warn("cannot send batch");
+  if(use_tcp)
+    disconnect();
+
+DROP:
+  dropped += out_count;
+EXIT:
+  pthread_mutex_unlock(&sd_lock);
+
+  out_size  = LEN_SIZE + SEQ_SIZE;
+  out_count = 0;
+}
+
+static void flush(const struct context *ctx)
+{
+  UNUSED(ctx);
+
+  send_batch();
+}
+
+static void cb_recv(const struct g3plc_ind *ind,
+                    const void *payload, unsigned payload_size,
+                    int status, void *data)
+{
+  unsigned int len = RECORD_HDR + payload_size;
+  unsigned char *b;
+
+  UNUSED(data);
+
+  if(out_size + len > LEN_SIZE + batch_max)
+    send_batch();
+
+  if(!out_count) {
+    out_seq = next_seq;
+    put_u32(out_buf + LEN_SIZE, out_seq);
+    clock_gettime(CLOCK_MONOTONIC, &out_stamp);
+  }
+
+  b = out_buf + out_size;
+  put_u16(b, len - sizeof(uint16_t));
+  b[2] = status;
+  put_u16(b + 3, g3plc_ind_src(ind));
+  put_u16(b + 5, g3plc_ind_dst(ind));
+  memcpy(b + RECORD_HDR, payload, payload_size);
+
+  out_size += len;
+  out_count++;
+  next_seq++;
+
+  /* the flush timeout is not reached under a steady flow */
+  if(elapsed(&out_stamp) >= flush_interval)
+    send_batch();
+}
+
+static void init(const struct context *ctx, struct g3plc_config *g3plc)
+{
+  if(!host)
+    errx(EXIT_FAILURE, "no collector specified (see --host)");
+
+  /* configure the G3-PLC layer */
+  g3plc->callbacks.cb_recv = cb_recv;
+
+  iface_mode.flush_timeout = flush_interval;
+
+  out_buf  = xmalloc(LEN_SIZE + batch_max);
+  out_size = LEN_SIZE + SEQ_SIZE;
+
+  /* UDP never fails here, TCP is retried by the start thread */
+  sd = connect_collector();
+  if(sd < 0 && !use_tcp)
+    exit(EXIT_FAILURE);
+
+  IF_VERBOSE(ctx, log_msg(LOG_CAT_MAIN, LOG_LVL_DEBUG, "Relaying to %s:%s (%s)\n",
+                          host, port, use_tcp ? "TCP" : "UDP"));
+}
+
+/* Send the complete records of the input buffer and
+   return the number of bytes they used. */
+static unsigned int handle_records(const struct context *ctx,
+                                   const unsigned char *buf, unsigned int size)
+{
+  unsigned int used = 0, len;
+  uint16_t dst;
+  int ret;
+
+  while(size - used >= LEN_SIZE) {
+    len = get_u16(buf + used);
+    if(size - used - LEN_SIZE < len)
+      break; /* wait for the rest of the record */
+
+    if(len < sizeof(uint16_t) || len - sizeof(uint16_t) > G3PLC_MAX_PAYLOAD) {
+      warnx("invalid record from collector");
+      return size; /* drop the buffer */
+    }
+
+    dst = get_u16(buf + used + LEN_SIZE);
+
+    IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG, "Sending %d bytes to %04X\n",
+                            len - (int)sizeof(uint16_t), dst));
+    ret = g3plc_send(ctx->plc, dst, buf + used + LEN_SIZE + sizeof(uint16_t), len - sizeof(uint16_t));
+    IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG,
+                            "TX STATUS: %s (%d)\n", g3plc_send2str(ret), ret));
+
+    used += LEN_SIZE + len;
+  }
+
+  return used;
+}
+
+static void start(const struct context *ctx)
+{
+  struct pollfd fds = { .events = POLLIN };
+  unsigned int used;
+  ssize_t n;
+  int fd, cur;
+
+  pthread_mutex_lock(&sd_lock);
+  fd = sd;
+  pthread_mutex_unlock(&sd_lock);
+
+  while(1) {
+    /* the delivery thread shut the connection down */
+    pthread_mutex_lock(&sd_lock);
+    cur = sd;
+    pthread_mutex_unlock(&sd_lock);
+
+    if(cur != fd) {
+      close(fd);
+      fd = -1;
+    }
+
+    if(fd < 0) {
+      sleep(RECONNECT_DELAY);
+
+      fd = connect_collector();
+      if(fd < 0)
+        continue;
+
+      IF_VERBOSE(ctx, log_msg(LOG_CAT_MAIN, LOG_LVL_DEBUG, "Connected to %s:%s\n", host, port));
+
+      pthread_mutex_lock(&sd_lock);
+      sd = fd;
+      pthread_mutex_unlock(&sd_lock);
+
+      in_size = 0;
+    }
+
+    fds.fd = fd;
+    if(poll(&fds, 1, RECONNECT_DELAY * 1000) < 0) {
+      if(errno != EINTR)
+        err(EXIT_FAILURE, "poll");
+      continue;
+    }
+
+    if(!(fds.revents & (POLLIN | POLLHUP | POLLERR)))
+      continue;
+
+    n = recv(fd, in_buf + in_size, sizeof(in_buf) - in_size, MSG_DONTWAIT);
+    if(n < 0 && (errno == EAGAIN || errno == EINTR))
+      continue;
+
+    if(n <= 0 && use_tcp) {
+      if(n < 0)
+        warn("collector connection lost");
+      else
+        warnx("collector closed the connection");
+
+      pthread_mutex_lock(&sd_lock);
+      if(sd == fd)
+        disconnect();
+      pthread_mutex_unlock(&sd_lock);
+
+      close(fd);
+      fd = -1;
+      continue;
+    }
+
+    if(n < 0) {
+      if(errno != ECONNREFUSED)
+        warn("network error"); /* we don't fail on collector error */
+      continue;
+    }
+
+    /* each datagram holds complete records */
+    if(!use_tcp) {
+      handle_records(ctx, in_buf, n);
+      continue;
+    }
+
+    in_size += n;
+    used = handle_records(ctx, in_buf, in_size);
+    memmove(in_buf, in_buf + used, in_size - used);
+    in_size -= used;
+  }
+}
+
+static void destroy(const struct context *ctx)
+{
+  IF_VERBOSE(ctx, log_msg(LOG_CAT_MAIN, LOG_LVL_DEBUG,
+                          "Relayed %lu records in %lu batches, %lu dropped\n",
+                          records, batches, dropped));
+
+  if(sd >= 0)
+    close(sd);
+  free(out_buf);
+}
+
+static int parse_option(const struct context *ctx, int c)
+{
+  int err;
+
+  UNUSED(ctx);
+
+  switch(c) {
+  case OPT_HOST:
+    host = optarg;
+    return 1;
+  case OPT_PORT:
+    port = optarg;
+    return 1;
+  case OPT_TCP:
+    use_tcp = 1;
+    return 1;
+  case OPT_BATCH_SIZE:
+    batch_max = xatou(optarg, &err);
+    if(err || batch_max < MIN_BATCH || batch_max > MAX_BATCH)
+      errx(EXIT_FAILURE, "invalid batch size (between %d and %d)", (int)MIN_BATCH, MAX_BATCH);
+    return 1;
+  case OPT_FLUSH_INTERVAL:
+    flush_interval = xatou(optarg, &err);
+    if(err)
+      errx(EXIT_FAILURE, "cannot parse flush interval");
+    return 1;
+  }
+
+  return 0;
+}
+
+struct iface_mode iface_mode = {
+  .name = "net",
+  .description = "Relay frames to a remote collector over UDP or TCP",
+
+  .optstring      = "",
+  .long_opts      = net_opts,
+  .extra_messages = net_messages,
+  .parse_option   = parse_option,
+
+  .init    = init,
+  .destroy = destroy,
+  .start   = start,
+  .flush   = flush
+};
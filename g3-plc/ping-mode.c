@@ -0,0 +1,440 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _POSIX_C_SOURCE 200112L
+#endif /* __linux__ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
+#include <math.h>
+#include <unistd.h>
+#include <time.h>
+#include <err.h>
+
+#include "g3-plc/g3plc-str.h"
+#include "ping-mode.h"
+#include "scale.h"
+#include "xatoi.h"
+#include "help.h"
+#include "log.h"
+#include "common.h"
+
+/*
+  The ping mode sends probes to the destination and measures
+  the round trip time of the replies. Each probe carries its
+  type, a sequence number and the time at which it was sent,
+  taken on the monotonic clock of the pinger. The responder
+  only changes the type and echoes the payload back from the
+  receive callback, so the clocks of both nodes do not need to
+  be synchronized.
+
+  Every instance answers requests. With --echo the instance
+  only answers and never sends probes. Probes are sent every
+  interval or, in flood mode, as soon as the previous reply was
+  received (or the wait timed out). With a count of zero the
+  pinger runs until it is interrupted.
+
+  The summary reports the RTT, the loss and the number of
+  duplicated and reordered replies (received after a reply with
+  a higher sequence number).
+*/
+
+#define PING_MEDIA 1
+
+struct ping_stats {
+  unsigned int received;
+  unsigned int duplicates;
+  unsigned int reordered;
+
+  seqno_t highest; /* highest sequence number received */
+  unsigned long min, max; /* us */
+  double sum, sum2;
+
+  unsigned char seen[(1 << (8 * sizeof(seqno_t))) / 8];
+};
+
+static unsigned int count;
+static unsigned int size = PING_HDR_SIZE;
+static unsigned int interval = 1000; /* ms */
+static unsigned int wait = 5000; /* ms */
+static int flood;
+static int echo;
+
+static volatile sig_atomic_t stopped;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  replied;
+static struct ping_stats stats[PING_MEDIA];
+static unsigned int errors; /* probes the driver could not send */
+
+static const char * medium2str(int medium)
+{
+  UNUSED(medium);
+  return "G3-PLC";
+}
+
+static void now(struct timeval *tv)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  tv->tv_sec  = ts.tv_sec;
+  tv->tv_usec = ts.tv_nsec / 1000;
+}
+
+static unsigned long elapsed(const struct timeval *begin)
+{
+  struct timeval end;
+
+  now(&end);
+  return (end.tv_sec - begin->tv_sec) * 1000000UL + end.tv_usec - begin->tv_usec;
+}
+
+static int ping_send(const struct context *ctx, uint16_t dst, const void *payload, unsigned int size)
+{
+  UNUSED(ctx);
+  return g3plc_send(ctx->plc, dst, payload, size);
+}
+
+static const char * ping_send2str(int status)
+{
+  return g3plc_send2str(status);
+}
+
+static void recv_reply(uint16_t src, const unsigned char *payload, unsigned int payload_size,
+                       int medium)
+{
+  struct ping_stats *s = &stats[medium];
+  struct timeval sent;
+  unsigned long rtt;
+  seqno_t seqno;
+  int dup;
+
+  memcpy(&seqno, payload + sizeof(uint8_t), sizeof(seqno_t));
+  memcpy(&sent, payload + sizeof(uint8_t) + sizeof(seqno_t), sizeof(struct timeval));
+  rtt = elapsed(&sent);
+
+  pthread_mutex_lock(&lock);
+
+  dup = s->seen[seqno / 8] & (1 << seqno % 8);
+  s->seen[seqno / 8] |= 1 << seqno % 8;
+
+  if(dup)
+    s->duplicates++;
+  else {
+    /* serial number arithmetic so that the comparison
+       holds when the sequence number wraps */
+    if(s->received && (seqno_t)(s->highest - seqno) < (1 << (8 * sizeof(seqno_t) - 1)))
+      s->reordered++;
+    else
+      s->highest = seqno;
+
+    if(!s->received || rtt < s->min)
+      s->min = rtt;
+    if(rtt > s->max)
+      s->max = rtt;
+    s->sum  += rtt;
+    s->sum2 += (double)rtt * rtt;
+    s->received++;
+  }
+
+  pthread_cond_broadcast(&replied);
+  pthread_mutex_unlock(&lock);
+
+  if(!flood)
+    printf("%u bytes from %04X (%s): seq=%u time=%s%s\n", payload_size, src,
+           medium2str(medium), seqno, scale_time(rtt * 1000ULL), dup ? " (DUP!)" : "");
+}
+
+static void cb_recv(const struct g3plc_ind *ind,
+                    const void *payload, unsigned payload_size,
+                    int status, void *data)
+{
+  const struct context *ctx = data;
+  unsigned char reply[G3PLC_MAX_PAYLOAD];
+  uint16_t src = g3plc_ind_src(ind);
+  int ret;
+
+  if(status != G3PLC_RCV_SUCCESS || payload_size < PING_HDR_SIZE)
+    return;
+
+  switch(*(const unsigned char *)payload) {
+  case PING_REQUEST:
+    memcpy(reply, payload, payload_size);
+    *reply = PING_REPLY;
+    ret = ping_send(ctx, src, reply, payload_size);
+    if(ret != G3PLC_SND_SUCCESS)
+      /* we don't fail on client error */
+      warnx("cannot echo to %04X: %s", src, ping_send2str(ret));
+    break;
+  case PING_REPLY:
+    if(!echo)
+      recv_reply(src, payload, payload_size, 0);
+    break;
+  }
+}
+
+static void sig_stop(int signum)
+{
+  UNUSED(signum);
+  stopped = 1;
+}
+
+static void init(const struct context *ctx, struct g3plc_config *g3plc)
+{
+  pthread_condattr_t attr;
+  struct sigaction act = { .sa_handler = sig_stop };
+
+  UNUSED(ctx);
+  g3plc->callbacks.cb_recv = cb_recv;
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&replied, &attr);
+  pthread_condattr_destroy(&attr);
+
+  /* no SA_RESTART so that sleeps are interrupted */
+  sigemptyset(&act.sa_mask);
+  if(sigaction(SIGINT, &act, NULL) < 0)
+    err(EXIT_FAILURE, "cannot install signal handler");
+}
+
+static void add_ms(struct timespec *ts, unsigned int ms)
+{
+  ts->tv_sec  += ms / 1000;
+  ts->tv_nsec += (ms % 1000) * 1000000L;
+  if(ts->tv_nsec >= 1000000000) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
+}
+
+static unsigned int received(void)
+{
+  unsigned int i, n = 0;
+
+  for(i = 0 ; i < PING_MEDIA ; i++)
+    n += stats[i].received;
+  return n;
+}
+
+/* Wait until the number of replies reaches
+   the target or until the deadline. */
+static void wait_replies(unsigned int target, const struct timespec *deadline)
+{
+  pthread_mutex_lock(&lock);
+  while(!stopped && received() < target)
+    if(pthread_cond_timedwait(&replied, &lock, deadline))
+      break;
+  pthread_mutex_unlock(&lock);
+}
+
+static void display_summary(unsigned int probes)
+{
+  unsigned int i, n;
+
+  pthread_mutex_lock(&lock);
+
+  n = received();
+  printf("\n%u probes sent, %u replies, %.1f%% loss", probes, n,
+         probes ? (probes - (n < probes ? n : probes)) * 100. / probes : 0);
+  if(errors)
+    printf(", %u send errors", errors);
+  putchar('\n');
+
+  for(i = 0 ; i < PING_MEDIA ; i++) {
+    const struct ping_stats *s = &stats[i];
+    double avg, mdev;
+
+    if(!s->received)
+      continue;
+
+    avg  = s->sum / s->received;
+    mdev = sqrt(s->sum2 / s->received - avg * avg);
+
+    printf("%-6s: %u replies, %u duplicates, %u reordered\n",
+           medium2str(i), s->received, s->duplicates, s->reordered);
+    printf("%-6s: rtt min %s", medium2str(i), scale_time(s->min * 1000ULL));
+    printf(", avg %s", scale_time(avg * 1000));
+    printf(", max %s", scale_time(s->max * 1000ULL));
+    printf(", mdev %s\n", scale_time(mdev * 1000));
+  }
+
+  pthread_mutex_unlock(&lock);
+}
+
+static void start(const struct context *ctx)
+{
+  unsigned char probe[G3PLC_MAX_PAYLOAD];
+  struct timespec deadline;
+  unsigned int i, probes = 0;
+  seqno_t seqno = 0;
+
+  if(echo) {
+    /* replies are sent from the receive callback */
+    while(!stopped)
+      pause();
+    return;
+  }
+
+  for(i = PING_HDR_SIZE ; i < size ; i++)
+    probe[i] = i;
+  *probe = PING_REQUEST;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+  while(!stopped && (!count || probes < count)) {
+    struct timeval sent;
+    unsigned int base;
+    int ret;
+
+    /* forget the previous use of this
+       sequence number when it wraps */
+    pthread_mutex_lock(&lock);
+    for(i = 0 ; i < PING_MEDIA ; i++)
+      stats[i].seen[seqno / 8] &= ~(1 << seqno % 8);
+    base = received();
+    pthread_mutex_unlock(&lock);
+
+    now(&sent);
+    memcpy(probe + sizeof(uint8_t), &seqno, sizeof(seqno_t));
+    memcpy(probe + sizeof(uint8_t) + sizeof(seqno_t), &sent, sizeof(struct timeval));
+
+    ret = ping_send(ctx, ctx->dst_mac, probe, size);
+    probes++;
+    seqno++;
+
+    if(ret != G3PLC_SND_SUCCESS) {
+      pthread_mutex_lock(&lock);
+      errors++;
+      pthread_mutex_unlock(&lock);
+      IF_VERBOSE(ctx, log_msg(LOG_CAT_MAIN, LOG_LVL_DEBUG,
+                              "seq=%u: %s\n", (seqno_t)(seqno - 1), ping_send2str(ret)));
+    }
+
+    if(flood) {
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      add_ms(&deadline, wait);
+      wait_replies(base + 1, &deadline);
+    }
+    else {
+      add_ms(&deadline, interval);
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+    }
+  }
+
+  /* last replies */
+  if(!stopped) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    add_ms(&deadline, wait);
+    wait_replies(probes, &deadline);
+  }
+
+  display_summary(probes);
+}
+
+static void destroy(const struct context *ctx)
+{
+  UNUSED(ctx);
+  pthread_cond_destroy(&replied);
+}
+
+static int parse_option(const struct context *ctx, int c)
+{
+  int err;
+
+  UNUSED(ctx);
+
+  switch(c) {
+  case 'c':
+    count = xatou(optarg, &err);
+    if(err)
+      errx(EXIT_FAILURE, "cannot parse count");
+    return 1;
+  case 'l':
+    size = xatou(optarg, &err);
+    if(err)
+      errx(EXIT_FAILURE, "cannot parse size");
+    if(size < PING_HDR_SIZE || size > G3PLC_MAX_PAYLOAD)
+      errx(EXIT_FAILURE, "invalid size (%u to %u bytes)",
+           (unsigned int)(PING_HDR_SIZE), (unsigned int)(G3PLC_MAX_PAYLOAD));
+    return 1;
+  case 'I':
+    interval = xatou(optarg, &err);
+    if(err)
+      errx(EXIT_FAILURE, "cannot parse interval");
+    return 1;
+  case 'W':
+    wait = xatou(optarg, &err);
+    if(err)
+      errx(EXIT_FAILURE, "cannot parse wait");
+    return 1;
+  case 'F':
+    flood = 1;
+    return 1;
+  case 'e':
+    echo = 1;
+    return 1;
+  }
+
+  return 0;
+}
+
+struct option ping_opts[] = {
+  { "count", required_argument, NULL, 'c' },
+  { "size", required_argument, NULL, 'l' },
+  { "interval", required_argument, NULL, 'I' },
+  { "wait", required_argument, NULL, 'W' },
+  { "flood", no_argument, NULL, 'F' },
+  { "echo", no_argument, NULL, 'e' },
+  { NULL, 0, NULL, 0 }
+};
+struct opt_help ping_messages[] = {
+  { 'c', "count",    "Number of probes (default: until interrupted)" },
+  { 'l', "size",     "Payload size in bytes (default: header only)" },
+  { 'I', "interval", "Interval between probes in ms (default: 1000)" },
+  { 'W', "wait",     "Time to wait for a reply in ms (default: 5000)" },
+  { 'F', "flood",    "Send the next probe as soon as a reply is received" },
+  { 'e', "echo",     "Only answer probes" },
+  { 0, NULL, NULL }
+};
+
+struct iface_mode iface_mode = {
+  .name = "ping",
+  .description = "Measure the round trip time to the destination",
+
+  .optstring      = "c:l:I:W:Fe",
+  .long_opts      = ping_opts,
+  .extra_messages = ping_messages,
+  .parse_option   = parse_option,
+
+  .init    = init,
+  .destroy = destroy,
+  .start   = start
+};
@@ -22,11 +22,24 @@
    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#include <getopt.h>
+#ifndef _PING_MODE_H_
+#define _PING_MODE_H_
 
-/* Return the length of a null terminated options array. */
-int opts_len(const struct option *opts);
+#include <sys/time.h>
 
-/* Merge two null terminated options array into a newly
-   allocated one. */
-struct option * merge_opts(const struct option *a, const struct option *b);
+#include "mode.h"
+
+/* The sequence number size may change.
+   The timevalue on the other hand will
+   always be defined by its structure */
+typedef unsigned short seqno_t;
+
+#define PING_HDR_SIZE sizeof(uint8_t) + sizeof(seqno_t) + sizeof(struct timeval) /* type, seqno, timeval */
+
+/* Type of a probe (first byte of the payload). */
+enum ping_type {
+  PING_REQUEST = 0x08,
+  PING_REPLY   = 0x00
+};
+
+#endif /* _PING_MODE_H_ */
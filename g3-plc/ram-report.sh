@@ -0,0 +1,45 @@
+#!/bin/sh
+# print the static RAM footprint of the driver objects
+# usage: ram-report.sh PROFILE OBJECT...
+#
+# The data and bss symbols of each object are summed and the
+# largest ones are listed. The driver does not allocate, so this
+# is all the RAM it needs besides the stacks (see g3plc-conf.h).
+profile=$1
+shift
+
+echo "RAM footprint ($profile profile)"
+for obj in "$@"
+do
+	nm -S -t d "$obj" 2>/dev/null | sed "s|^|$obj |"
+done | awk '
+	NF == 5 && $4 ~ /^[bBdDC]$/ {
+		size = $3 + 0
+		if($4 ~ /[dD]/)
+			data[$1] += size
+		else
+			bss[$1] += size
+		objs[$1] = 1
+		syms[$1 " " $5] = size
+	}
+	END {
+		for(o in objs) {
+			printf "  %-24s data %6u bss %6u\n", o, data[o], bss[o]
+			total_data += data[o]; total_bss += bss[o]
+		}
+		printf "  %-24s data %6u bss %6u (%u bytes)\n", "TOTAL", total_data, total_bss,
+			total_data + total_bss
+		print "Largest symbols"
+		for(n = 0 ; n < 8 ; n++) {
+			best = ""
+			for(s in syms)
+				if(best == "" || syms[s] > syms[best])
+					best = s
+			if(best == "" || !syms[best])
+				break
+			split(best, f, " ")
+			printf "  %-24s %-20s %6u\n", f[1], f[2], syms[best]
+			delete syms[best]
+		}
+	}'
+exit 0
@@ -0,0 +1,566 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _POSIX_C_SOURCE 200809L
+#endif /* __linux__ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <err.h>
+
+#include "g3-plc/g3plc-cmd-str.h"
+#include "g3-plc/g3plc-str.h"
+#include "string-utils.h"
+#include "conf-file.h"
+#include "safe-call.h"
+#include "prof.h"
+#include "xatoi.h"
+#include "log.h"
+#include "lock.h"
+#include "reconf.h"
+
+#define MAX_LINE      256
+#define MAX_ATTRS     16
+#define MAX_ATTR_SIZE 16
+#define MAX_ERROR     96
+
+#define TUNABLE_FLAGS (G3PLC_PROMISC | G3PLC_NOACK | G3PLC_INVALID | G3PLC_ADAPT)
+
+/* The driver keeps a pointer to the list of attributes, so each
+   staged list is built in the list the driver does not use. */
+static struct attr_list {
+  struct g3plc_pib attrs[MAX_ATTRS];
+  unsigned char    values[MAX_ATTRS][MAX_ATTR_SIZE];
+} lists[2];
+static unsigned int next_list;
+
+struct stage {
+  struct g3plc_config conf;
+  uint16_t            dst_mac;
+  struct attr_list   *list;
+  char                error[MAX_ERROR];
+};
+
+static struct g3plc_ctx *running_plc;
+static struct g3plc_config *running;
+static uint16_t *running_dst;
+static const char *reload_path;
+static int bell[2]; /* SIGHUP to the thread */
+static int control_sd = -1;
+static pthread_t reconf_thread;
+
+/* Copy an attribute into the staged list. */
+static void stage_attr(struct stage *s, unsigned int i, const struct g3plc_pib *attr)
+{
+  memcpy(s->list->values[i], attr->value, attr->size);
+  s->list->attrs[i] = (struct g3plc_pib){ .id    = attr->id,
+                                          .idx   = attr->idx,
+                                          .value = s->list->values[i],
+                                          .size  = attr->size };
+}
+
+static void stage_begin(struct stage *s)
+{
+  unsigned int i;
+
+  lock(NULL);
+  s->conf    = *running;
+  s->dst_mac = *running_dst;
+  unlock(NULL);
+  s->list    = &lists[next_list];
+  for(i = 0 ; i < s->conf.nattrs ; i++)
+    stage_attr(s, i, &s->conf.attrs[i]);
+  s->conf.attrs = s->list->attrs;
+  s->error[0]   = '\0';
+}
+
+static int stage_error(struct stage *s, const char *msg)
+{
+  snprintf(s->error, sizeof(s->error), "%s", msg);
+  return -1;
+}
+
+/* Parse hexadecimal bytes into a buffer.
+   Return the number of bytes or -1 on error. */
+static int parse_hex(unsigned char *buf, unsigned int size, const char *s)
+{
+  unsigned int n = 0;
+
+  while(*s) {
+    unsigned int byte;
+
+    if(n >= size || !s[1] || sscanf(s, "%2x", &byte) != 1)
+      return -1;
+    buf[n++] = byte;
+    s += 2;
+  }
+
+  return n;
+}
+
+/* Same syntax as --pib ID[:IDX]=HEX. */
+static int stage_pib(struct stage *s, const char *arg)
+{
+  struct g3plc_pib attr;
+  unsigned char value[MAX_ATTR_SIZE];
+  unsigned int id, idx = 0, i;
+  char *end;
+  int n;
+
+  if(!arg)
+    return stage_error(s, "pib needs ID[:IDX]=HEX");
+  id = strtoul(arg, &end, 0);
+  if(*end == ':')
+    idx = strtoul(end + 1, &end, 0);
+  if(end == arg || *end++ != '=' || id > 0xffff || idx > 0xffff)
+    return stage_error(s, "cannot parse PIB attribute");
+
+  n = parse_hex(value, MAX_ATTR_SIZE, end);
+  if(n <= 0)
+    return stage_error(s, "cannot parse PIB attribute value");
+  attr = (struct g3plc_pib){ .id = id, .idx = idx, .value = value, .size = n };
+
+  for(i = 0 ; i < s->conf.nattrs ; i++)
+    if(s->conf.attrs[i].id == id && s->conf.attrs[i].idx == idx)
+      break;
+  if(i == MAX_ATTRS)
+    return stage_error(s, "too many PIB attributes");
+
+  stage_attr(s, i, &attr);
+  if(i == s->conf.nattrs)
+    s->conf.nattrs++;
+  return 0;
+}
+
+/* A flag is set without argument (configuration file) or with on/off. */
+static int stage_flag(struct stage *s, unsigned long flag, const char *arg)
+{
+  if(!arg || !strcmp(arg, "on"))
+    s->conf.flags |= flag;
+  else if(!strcmp(arg, "off"))
+    s->conf.flags &= ~flag;
+  else
+    return stage_error(s, "flags take on or off");
+  return 0;
+}
+
+static int stage_uint(struct stage *s, unsigned int *v, const char *arg, unsigned int min)
+{
+  unsigned int n;
+  int err;
+
+  if(!arg)
+    return stage_error(s, "missing value");
+  n = xatou(arg, &err);
+  if(err || n < min)
+    return stage_error(s, "invalid value");
+  *v = n;
+  return 0;
+}
+
+/* Stage a tunable. Return 1 when the option is not a tunable. */
+static int stage_option(struct stage *s, const char *name, const char *arg)
+{
+  if(!strcmp(name, "timeout"))
+    return stage_uint(s, &s->conf.timeout, arg, 1);
+  if(!strcmp(name, "min-timeout"))
+    return stage_uint(s, &s->conf.min_timeout, arg, 0);
+  if(!strcmp(name, "retransmissions"))
+    return stage_uint(s, &s->conf.retrans, arg, 1);
+  if(!strcmp(name, "tmr-ttl"))
+    return stage_uint(s, &s->conf.tmr_ttl, arg, 1);
+  if(!strcmp(name, "destination")) {
+    unsigned long dst;
+    char *end;
+
+    if(!arg)
+      return stage_error(s, "missing destination");
+    dst = strtoul(arg, &end, 16);
+    if(end == arg || *end || dst > 0xffff)
+      return stage_error(s, "invalid destination");
+    s->dst_mac = dst;
+    return 0;
+  }
+  if(!strcmp(name, "promiscuous"))
+    return stage_flag(s, G3PLC_PROMISC, arg);
+  if(!strcmp(name, "no-ack"))
+    return stage_flag(s, G3PLC_NOACK, arg);
+  if(!strcmp(name, "invalid"))
+    return stage_flag(s, G3PLC_INVALID, arg);
+  if(!strcmp(name, "adapt"))
+    return stage_flag(s, G3PLC_ADAPT, arg);
+  if(!strcmp(name, "pib"))
+    return stage_pib(s, arg);
+
+  return 1;
+}
+
+static int stage_commit(struct stage *s)
+{
+  int err = g3plc_reconfigure(running_plc, &s->conf);
+
+  if(err) {
+    snprintf(s->error, sizeof(s->error), "%s", g3plc_init2str(err));
+    return -1;
+  }
+
+  /* the tunables and the destination change together */
+  lock(NULL);
+  running->timeout     = s->conf.timeout;
+  running->min_timeout = s->conf.min_timeout;
+  running->retrans     = s->conf.retrans;
+  running->tmr_ttl     = s->conf.tmr_ttl;
+  running->flags       = s->conf.flags;
+  running->attrs       = s->conf.attrs;
+  running->nattrs      = s->conf.nattrs;
+  __atomic_store_n(running_dst, s->dst_mac, __ATOMIC_RELAXED);
+  unlock(NULL);
+  next_list ^= 1;
+
+  return 0;
+}
+
+static int reload_option(const char *name, const char *arg, void *data)
+{
+  struct stage *s = data;
+  int n = stage_option(s, name, arg);
+
+  if(n > 0)
+    return 0; /* needs a restart */
+  if(n < 0)
+    log_msg(LOG_CAT_MAIN, LOG_LVL_WARN, "%s: %s: %s\n", reload_path, name, s->error);
+  return n;
+}
+
+static int reload(struct stage *s)
+{
+  stage_begin(s);
+
+  /* the flags and attributes are those of the file */
+  s->conf.flags &= ~TUNABLE_FLAGS;
+  s->conf.nattrs = 0;
+
+  if(conf_file_read(reload_path, reload_option, s)) {
+    if(!s->error[0])
+      stage_error(s, "cannot read the configuration file");
+    return -1;
+  }
+
+  return stage_commit(s);
+}
+
+static void show(FILE *out)
+{
+  struct g3plc_config conf;
+  uint16_t dst_mac;
+  unsigned int i, j;
+
+  /* printed from a copy, the client may be slow */
+  lock(NULL);
+  conf    = *running;
+  dst_mac = *running_dst;
+  unlock(NULL);
+
+  fprintf(out, "timeout %u\n", conf.timeout);
+  fprintf(out, "min-timeout %u\n", conf.min_timeout);
+  fprintf(out, "retransmissions %u\n", conf.retrans);
+  fprintf(out, "destination %04X\n", dst_mac);
+  fprintf(out, "promiscuous %s\n", conf.flags & G3PLC_PROMISC ? "on" : "off");
+  fprintf(out, "no-ack %s\n", conf.flags & G3PLC_NOACK ? "on" : "off");
+  fprintf(out, "invalid %s\n", conf.flags & G3PLC_INVALID ? "on" : "off");
+  fprintf(out, "adapt %s\n", conf.flags & G3PLC_ADAPT ? "on" : "off");
+  fprintf(out, "tmr-ttl %u\n", conf.tmr_ttl ? conf.tmr_ttl : G3PLC_TMR_TTL);
+  for(i = 0 ; i < conf.nattrs ; i++) {
+    const struct g3plc_pib *attr = &conf.attrs[i];
+
+    fprintf(out, "pib 0x%04x:%u=", attr->id, attr->idx);
+    for(j = 0 ; j < attr->size ; j++)
+      fprintf(out, "%02x", ((const unsigned char *)attr->value)[j]);
+    fputc('\n', out);
+  }
+}
+
+/* Layers of the raw commands, the system block is on the controller. */
+static const struct layer {
+  const char   *name;
+  unsigned int  type;
+  unsigned int  idp;
+} layers[] = {
+  { "system",  G3PLC_TYPE_SYSTEM, G3PLC_IDP_G3CTR },
+  { "control", G3PLC_TYPE_G3,     G3PLC_IDP_G3CTR },
+  { "umac",    G3PLC_TYPE_G3,     G3PLC_IDP_UMAC },
+  { "adp",     G3PLC_TYPE_G3,     G3PLC_IDP_ADP },
+  { "eap",     G3PLC_TYPE_G3,     G3PLC_IDP_EAP },
+  { NULL }
+};
+
+/* Send a raw request LAYER[:CHAN] ID [HEX] and print its confirm. */
+static int raw_command(FILE *out, struct stage *s, char *layer, const char *id, const char *hex)
+{
+  unsigned char req[G3PLC_MAX_CMD], conf[G3PLC_MAX_CMD];
+  struct g3plc_cmd *cmd = (struct g3plc_cmd *)req;
+  const struct layer *l;
+  unsigned int chan = G3PLC_CHAN0, conf_size = sizeof(conf), cmd_id;
+  char *p, *end;
+  int n = 0, status;
+
+  if(!layer || !id)
+    return stage_error(s, "cmd needs LAYER[:CHAN] ID [HEX]");
+
+  p = strchr(layer, ':');
+  if(p) {
+    *p++ = '\0';
+    chan = strtoul(p, &end, 0);
+    if(*end || chan > G3PLC_CHAN1)
+      return stage_error(s, "invalid channel");
+  }
+  for(l = layers ; l->name ; l++)
+    if(!strcmp(l->name, layer))
+      break;
+  if(!l->name)
+    return stage_error(s, "unknown layer");
+
+  cmd_id = strtoul(id, &end, 0);
+  if(*end || cmd_id > 0xff)
+    return stage_error(s, "invalid command ID");
+
+  if(hex) {
+    n = parse_hex(cmd->data, sizeof(req) - sizeof(struct g3plc_cmd), hex);
+    if(n < 0)
+      return stage_error(s, "cannot parse command data");
+  }
+
+  *cmd = (struct g3plc_cmd){
+    .reserved = 0,
+    .type     = l->type,
+    .idc      = chan,
+    .ida      = G3PLC_IDA_REQUEST,
+    .idp      = l->idp,
+    .cmd      = cmd_id
+  };
+  status = g3plc_command_confirm(running_plc, cmd, sizeof(struct g3plc_cmd) + n, conf, &conf_size);
+  if(status) {
+    snprintf(s->error, sizeof(s->error), "%s", g3plc_init2str(status));
+    return -1;
+  }
+
+  /* the request header was converted to network order */
+  *cmd = (struct g3plc_cmd){
+    .reserved = 0,
+    .type     = l->type,
+    .idc      = chan,
+    .ida      = G3PLC_IDA_CONFIRM,
+    .idp      = l->idp,
+    .cmd      = cmd_id
+  };
+  if(conf_size > sizeof(conf))
+    conf_size = sizeof(conf);
+  memcpy(cmd->data, conf, conf_size);
+
+  fprintf(out, "confirm %s (0x%02x)\n", g3plc_cmdID2str(l->idp, cmd_id), cmd_id);
+  status = g3plc_cmd_status(cmd, conf_size);
+  if(status >= 0)
+    fprintf(out, "status %s (0x%02x)\n", g3plc_status2str(l->idp, status), status);
+  fputs("data ", out);
+  for(n = 0 ; (unsigned int)n < conf_size ; n++)
+    fprintf(out, "%02x", conf[n]);
+  fputc('\n', out);
+
+  return 0;
+}
+
+/* Parse the commands of a client until it leaves. */
+static void serve(int fd)
+{
+  char line[MAX_LINE];
+  struct stage s;
+  int staged = 0;
+  FILE *in, *out;
+
+  in  = fdopen(fd, "r");
+  out = fdopen(dup(fd), "w");
+  if(!in || !out) {
+    warn("cannot open control connection");
+    if(in)
+      fclose(in);
+    else
+      close(fd);
+    return;
+  }
+
+  while(fgets(line, sizeof(line), in)) {
+    char *cmd = strtok(line, " \t\r\n");
+    char *name, *arg;
+    int n = 0;
+
+    if(!cmd)
+      continue;
+
+    if(!strcmp(cmd, "set")) {
+      name = strtok(NULL, " \t\r\n");
+      arg  = strtok(NULL, " \t\r\n");
+      if(!staged) {
+        stage_begin(&s);
+        staged = 1;
+      }
+      if(!name)
+        n = stage_error(&s, "set needs a name");
+      else if((n = stage_option(&s, name, arg)) > 0)
+        n = stage_error(&s, "not a tunable");
+    }
+    else if(!strcmp(cmd, "commit")) {
+      if(staged) {
+        n = stage_commit(&s);
+        if(!n)
+          log_msg(LOG_CAT_MAIN, LOG_LVL_INFO, "Tunables changed from the control socket\n");
+      }
+      staged = 0;
+    }
+    else if(!strcmp(cmd, "abort"))
+      staged = 0;
+    else if(!strcmp(cmd, "reload")) {
+      staged = 0;
+      if(!reload_path)
+        n = stage_error(&s, "no configuration file");
+      else
+        n = reload(&s);
+    }
+    else if(!strcmp(cmd, "show"))
+      show(out);
+    else if(!strcmp(cmd, "profile"))
+      prof_report(out);
+    else if(!strcmp(cmd, "cmd")) {
+      name = strtok(NULL, " \t\r\n");
+      arg  = strtok(NULL, " \t\r\n");
+      n = raw_command(out, &s, name, arg, strtok(NULL, " \t\r\n"));
+    }
+    else
+      n = stage_error(&s, "unknown command");
+
+    if(n)
+      fprintf(out, "error: %s\n", s.error);
+    else
+      fputs("ok\n", out);
+    fflush(out);
+  }
+
+  fclose(in);
+  fclose(out);
+}
+
+static void hangup(int sig)
+{
+  (void)sig;
+  if(write(bell[1], "", 1) < 0) {
+    /* the thread is already notified */
+  }
+}
+
+static void * reconf_thread_func(void *p)
+{
+  struct pollfd fds[2] = { { .fd = bell[0], .events = POLLIN },
+                           { .fd = control_sd, .events = POLLIN } };
+  (void)p;
+
+  prof_thread("reconf");
+
+  while(1) {
+    struct stage s;
+    char c;
+
+    if(poll(fds, control_sd < 0 ? 1 : 2, -1) < 0)
+      continue; /* interrupted by SIGHUP */
+
+    if(fds[0].revents & POLLIN) {
+      while(read(bell[0], &c, 1) > 0);
+
+      if(reload(&s))
+        log_msg(LOG_CAT_MAIN, LOG_LVL_WARN, "Cannot reload %s: %s\n", reload_path, s.error);
+      else
+        log_msg(LOG_CAT_MAIN, LOG_LVL_INFO, "Reloaded %s\n", reload_path);
+    }
+
+    if(control_sd >= 0 && fds[1].revents & POLLIN) {
+      int fd = accept(control_sd, NULL, NULL);
+
+      if(fd >= 0)
+        serve(fd);
+    }
+  }
+
+  return NULL;
+}
+
+static void exit_clean(void)
+{
+  struct sockaddr_un addr;
+  socklen_t len = sizeof(addr);
+
+  if(!getsockname(control_sd, (struct sockaddr *)&addr, &len))
+    unlink(addr.sun_path);
+}
+
+void reconf_start(struct g3plc_ctx *plc, struct g3plc_config *conf, uint16_t *dst_mac,
+                  const char *config_path, const char *control_path)
+{
+  running_plc = plc;
+  running     = conf;
+  running_dst = dst_mac;
+  reload_path = config_path;
+
+  if(pipe(bell) < 0)
+    err(EXIT_FAILURE, "cannot create pipe");
+  fcntl(bell[0], F_SETFL, O_NONBLOCK);
+  fcntl(bell[1], F_SETFL, O_NONBLOCK);
+
+  if(config_path) {
+    struct sigaction sa = { .sa_handler = hangup, .sa_flags = SA_RESTART };
+
+    sigemptyset(&sa.sa_mask);
+    if(sigaction(SIGHUP, &sa, NULL) < 0)
+      err(EXIT_FAILURE, "cannot catch SIGHUP");
+  }
+
+  if(control_path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    control_sd = xsocket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(control_path);
+    xstrcpy(addr.sun_path, control_path, sizeof(addr.sun_path));
+    xbind(control_sd, (struct sockaddr *)&addr, SUN_LEN(&addr));
+    xlisten(control_sd, 4);
+    atexit(exit_clean);
+  }
+
+  xpthread_create(&reconf_thread, NULL, reconf_thread_func, NULL);
+}
@@ -0,0 +1,71 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _RECONF_H_
+#define _RECONF_H_
+
+#include <stdint.h>
+
+#include "g3-plc/g3plc.h"
+
+/* Runtime reconfiguration of the driver (see --control).
+
+   The tunables are applied without restarting the driver nor
+   the modem, which keeps its firmware and its state: only the
+   attributes that changed are set (see g3plc_reconfigure()).
+
+   On SIGHUP the configuration file (see --config) is read again.
+   Its timeout, min-timeout, retransmissions and destination are
+   applied over the current values. Its flags (promiscuous, no-ack,
+   invalid) and PIB attributes replace the current ones. The other
+   options need a restart and are ignored.
+
+   The control socket is a Unix stream socket taking one command
+   per line, each answered by "ok" or "error: REASON":
+
+     set NAME [VALUE]  stage a tunable, named like the long option
+                       (flags take on or off, pib replaces the
+                       attribute with the same ID and index)
+     commit            apply the staged tunables at once
+     abort             drop the staged tunables
+     reload            read the configuration file again
+     show              print the current tunables before "ok"
+     profile           print the CPU time, context switches and
+                       allocations of each thread before "ok"
+     cmd LAYER[:CHAN] ID [HEX]
+                       send a raw request to a layer (system, control,
+                       umac, adp or eap) and print its confirm, status
+                       and data before "ok"
+
+   The tunables staged by a client are dropped when it leaves. */
+
+/* Start the reconfiguration thread of the instance plc with the
+   configuration given to the driver, which is updated with the
+   applied tunables under lock(), and the destination of the mode.
+   The control socket is created at control_path (if not NULL) and
+   config_path is read on SIGHUP (if not NULL). */
+void reconf_start(struct g3plc_ctx *plc, struct g3plc_config *conf, uint16_t *dst_mac,
+                  const char *config_path, const char *control_path);
+
+#endif /* _RECONF_H_ */
@@ -31,24 +31,41 @@
 #include <string.h>
 #include <getopt.h>
 #include <time.h>
+#include <err.h>
 
 #include "time-substract.h"
 #include "g3-plc/g3plc-str.h"
 #include "scale.h"
+#include "xatoi.h"
 #include "mode.h"
 #include "help.h"
 #include "dump.h"
 #include "common.h"
 
+/* The message is sent count times, in bursts of burst messages sent
+   back to back. The bursts start every interval, or at the pace of
+   the target rate. A burst that is late starts right away, so the
+   rate is never exceeded but may not be reached when the link is
+   slower. With more than one message the status and the timing of
+   the sends are aggregated. */
+
+#define STATUS_MAX (G3PLC_SND_FAILURE + 1)
+
 static int display_time;
 static const char *message = "Hello World!";
+static unsigned char payload[G3PLC_MAX_PAYLOAD];
+static unsigned int payload_size;
+static unsigned int count = 1;
+static unsigned int burst = 1;
+static unsigned int interval;  /* ms */
+static unsigned int rate;      /* messages per second */
 
-static void cb_recv(const struct g3plc_data_hdr *hdr,
+static void cb_recv(const struct g3plc_ind *ind,
                     const void *payload, unsigned payload_size,
                     int status, void *data)
 {
   /* This mode only sends so we ignored received frames. */
-  UNUSED(hdr);
+  UNUSED(ind);
   UNUSED(payload);
   UNUSED(payload_size);
   UNUSED(status);
@@ -59,18 +76,62 @@ static void init(const struct context *ctx, struct g3plc_config *g3plc)
 {
   UNUSED(ctx);
   g3plc->callbacks.cb_recv = cb_recv;
+
+  if(!payload_size) {
+    payload_size = strlen(message);
+    if(payload_size > sizeof(payload))
+      errx(EXIT_FAILURE, "message too long (max. %zu bytes)", sizeof(payload));
+    memcpy(payload, message, payload_size);
+  }
 }
 
-static void start(const struct context *ctx)
+static void load_payload(const char *path)
+{
+  FILE *fp = fopen(path, "rb");
+
+  if(!fp)
+    err(EXIT_FAILURE, "cannot open %s", path);
+
+  payload_size = fread(payload, 1, sizeof(payload), fp);
+  if(ferror(fp))
+    err(EXIT_FAILURE, "cannot read %s", path);
+  if(fgetc(fp) != EOF)
+    errx(EXIT_FAILURE, "%s is too long (max. %zu bytes)", path, sizeof(payload));
+
+  fclose(fp);
+}
+
+/* Payload of size bytes counting up from zero. */
+static void generate_payload(unsigned int size)
+{
+  unsigned int i;
+
+  if(size > sizeof(payload))
+    errx(EXIT_FAILURE, "payload too long (max. %zu bytes)", sizeof(payload));
+
+  for(i = 0 ; i < size ; i++)
+    payload[i] = i;
+  payload_size = size;
+}
+
+static void add_ns(struct timespec *ts, uint64_t ns)
+{
+  ts->tv_sec  += ns / 1000000000;
+  ts->tv_nsec += ns % 1000000000;
+  if(ts->tv_nsec >= 1000000000) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
+}
+
+static void start_single(const struct context *ctx)
 {
   struct timespec begin, end;
   uint64_t nsec;
   int ret;
 
-  UNUSED(ctx);
-
   clock_gettime(CLOCK_MONOTONIC, &begin);
-  ret = g3plc_send(ctx->dst_mac, message, strlen(message));
+  ret = g3plc_send(ctx->plc, ctx->dst_mac, payload, payload_size);
   clock_gettime(CLOCK_MONOTONIC, &end);
 
   nsec = substract_nsec(&begin, &end);
@@ -81,6 +142,66 @@ static void start(const struct context *ctx)
   printf("TX STATUS: %s (%d)\n", g3plc_send2str(ret), ret);
 }
 
+static void start(const struct context *ctx)
+{
+  struct timespec first, begin, end, next;
+  unsigned int statuses[STATUS_MAX] = { 0 };
+  uint64_t nsec, min = UINT64_MAX, max = 0, sum = 0, total, period = 0;
+  unsigned int i, sent = 0;
+  int ret;
+
+  if(count == 1) {
+    start_single(ctx);
+    return;
+  }
+
+  if(rate)
+    period = burst * 1000000000ULL / rate;
+  else if(interval)
+    period = interval * 1000000ULL;
+
+  clock_gettime(CLOCK_MONOTONIC, &first);
+  next = first;
+
+  while(sent < count) {
+    for(i = 0 ; i < burst && sent < count ; i++, sent++) {
+      clock_gettime(CLOCK_MONOTONIC, &begin);
+      ret = g3plc_send(ctx->plc, ctx->dst_mac, payload, payload_size);
+      clock_gettime(CLOCK_MONOTONIC, &end);
+
+      nsec = substract_nsec(&begin, &end);
+      min  = nsec < min ? nsec : min;
+      max  = nsec > max ? nsec : max;
+      sum += nsec;
+
+      statuses[ret < STATUS_MAX ? ret : G3PLC_SND_FAILURE]++;
+      IF_VERBOSE(ctx, printf("#%u: %s (%d) in %s\n", sent, g3plc_send2str(ret), ret, scale_time(nsec)));
+    }
+
+    /* the last period counts toward the rate */
+    if(period) {
+      add_ns(&next, period);
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  total = substract_nsec(&first, &end);
+
+  putchar('\n');
+  printf("SENT     : %u messages of %u bytes\n", sent, payload_size);
+  printf("TIME     : %s\n", scale_time(total));
+  printf("SEND MIN : %s\n", scale_time(min));
+  printf("SEND AVG : %s\n", scale_time(sum / sent));
+  printf("SEND MAX : %s\n", scale_time(max));
+  printf("RATE     : %.2f messages/s, %.0f bytes/s\n",
+         sent * 1e9 / (total ? total : 1),
+         statuses[G3PLC_SND_SUCCESS] * payload_size * 1e9 / (total ? total : 1));
+  for(i = 0 ; i < STATUS_MAX ; i++)
+    if(statuses[i])
+      printf("TX STATUS: %s (%d): %u\n", g3plc_send2str(i), i, statuses[i]);
+}
+
 static void destroy(const struct context *ctx)
 {
   UNUSED(ctx);
@@ -88,6 +209,9 @@ static void destroy(const struct context *ctx)
 
 static int parse_option(const struct context *ctx, int c)
 {
+  unsigned int size;
+  int err;
+
   UNUSED(ctx);
 
   switch(c) {
@@ -97,6 +221,35 @@ static int parse_option(const struct context *ctx, int c)
   case 'm':
     message = optarg;
     return 1;
+  case 'n':
+    count = xatou(optarg, &err);
+    if(err || !count)
+      errx(EXIT_FAILURE, "cannot parse count");
+    return 1;
+  case 'b':
+    burst = xatou(optarg, &err);
+    if(err || !burst)
+      errx(EXIT_FAILURE, "cannot parse burst size");
+    return 1;
+  case 'I':
+    interval = xatou(optarg, &err);
+    if(err)
+      errx(EXIT_FAILURE, "cannot parse interval");
+    return 1;
+  case 'R':
+    rate = xatou(optarg, &err);
+    if(err || !rate)
+      errx(EXIT_FAILURE, "cannot parse rate");
+    return 1;
+  case 'F':
+    load_payload(optarg);
+    return 1;
+  case 'l':
+    size = xatou(optarg, &err);
+    if(err)
+      errx(EXIT_FAILURE, "cannot parse size");
+    generate_payload(size);
+    return 1;
   }
 
   return 0;
@@ -105,19 +258,31 @@ static int parse_option(const struct context *ctx, int c)
 struct option send_opts[] = {
   { "time", no_argument, NULL, 'T' },
   { "message", required_argument, NULL, 'm' },
+  { "count", required_argument, NULL, 'n' },
+  { "burst", required_argument, NULL, 'b' },
+  { "interval", required_argument, NULL, 'I' },
+  { "rate", required_argument, NULL, 'R' },
+  { "file", required_argument, NULL, 'F' },
+  { "size", required_argument, NULL, 'l' },
   { NULL, 0, NULL, 0 }
 };
 struct opt_help send_messages[] = {
-  { 'T', "time",    "Display the time necessary to send the message (including retransmissions)" },
-  { 'm', "message", "Message to be send (default: \"Hello World!\")"},
+  { 'T', "time",     "Display the time necessary to send the message (including retransmissions)" },
+  { 'm', "message",  "Message to be send (default: \"Hello World!\")"},
+  { 'n', "count",    "Number of messages to send and report on as a whole (default: 1)" },
+  { 'b', "burst",    "Messages sent back to back each interval (default: 1)" },
+  { 'I', "interval", "Interval between the bursts in ms (default: none)" },
+  { 'R', "rate",     "Target rate in messages per second (instead of the interval)" },
+  { 'F', "file",     "Send the content of a file instead of the message" },
+  { 'l', "size",     "Send a generated payload of this size instead of the message" },
   { 0, NULL, NULL }
 };
 
 struct iface_mode iface_mode = {
   .name = "send",
-  .description = "Send a single frame",
+  .description = "Send a frame, or several with --count",
 
-  .optstring      = "Tm:",
+  .optstring      = "Tm:n:b:I:R:F:l:",
   .long_opts      = send_opts,
   .extra_messages = send_messages,
   .parse_option   = parse_option,
@@ -0,0 +1,372 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <err.h>
+
+#include "safe-call.h"
+#include "string-utils.h"
+#include "g3-plc/g3plc-str.h"
+#include "g3-plc/g3plc.h"
+#include "shm-ring.h"
+#include "version.h"
+#include "common.h"
+#include "xatoi.h"
+#include "mode.h"
+#include "main.h"
+#include "log.h"
+#include "help.h"
+
+/*
+  The shm mode exchanges frames with the application through two
+  rings in shared memory (see shm-ring.h for the layout). This avoids
+  a copy and a system call for each frame compared to the Unix mode.
+  The application retrieves the shared memory and the eventfd used
+  for wakeups from a Unix stream socket.
+*/
+
+#define BUF_SIZE G3PLC_MAX_CMD
+
+/* default number of slots in each ring */
+#define DEFAULT_SLOTS 256
+
+enum opt {
+  OPT_SLOTS = 0x200 /* after common options */
+};
+
+static int sd = -1;
+static int rx_efd = -1;
+static int tx_efd = -1;
+static int shm_fd = -1;
+static int rx_pending;
+static size_t area_size;
+static struct shm_area *area;
+static struct shm_ring_view rx_ring;
+static struct shm_ring_view tx_ring;
+static unsigned int slots = DEFAULT_SLOTS;
+static const char *socket_driver_path = PACKAGE "-shm.sock";
+
+#define LOAD(v)     __atomic_load_n(&(v), __ATOMIC_ACQUIRE)
+#define STORE(v, x) __atomic_store_n(&(v), x, __ATOMIC_RELEASE)
+
+struct option shm_opts[] = {
+  { "driver-path", required_argument, NULL, 'L' },
+  { "slots", required_argument, NULL, OPT_SLOTS },
+  { NULL, 0, NULL, 0 }
+};
+struct opt_help shm_messages[] = {
+  { 'L', "driver-path", "Driver Unix socket path" },
+  { 0,   "slots", "Number of slots in each ring (default 256)" },
+  { 0, NULL, NULL }
+};
+
+static void exit_clean(void)
+{
+  unlink(socket_driver_path);
+}
+
+static void cb_recv(const struct g3plc_ind *ind,
+                    const void *payload, unsigned payload_size,
+                    int status, void *data)
+{
+  /* recv record format:
+     [status (u8)][src (u16)][dst (u16)][payload] */
+  size_t len = payload_size + sizeof(uint8_t) + sizeof(uint16_t) * 2;
+  unsigned char *b;
+
+  UNUSED(data);
+
+  if(len + sizeof(uint16_t) > rx_ring.slot_size) {
+    warnx("frame too large");
+    return;
+  }
+
+  /* full, or the application wrote a tail
+     that is not within the ring */
+  if(rx_ring.index - LOAD(rx_ring.shared->tail) >= rx_ring.count) {
+    __atomic_add_fetch(&rx_ring.shared->drops, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  b = SHM_VIEW_SLOT(&rx_ring, rx_ring.index);
+
+  *(uint16_t *)b = len;           b += sizeof(uint16_t);
+  *(uint8_t  *)b = status;        b += sizeof(uint8_t);
+  *(uint16_t *)b = g3plc_ind_src(ind); b += sizeof(uint16_t);
+  *(uint16_t *)b = g3plc_ind_dst(ind); b += sizeof(uint16_t);
+
+  memcpy(b, payload, payload_size);
+
+  STORE(rx_ring.shared->head, ++rx_ring.index);
+  rx_pending = 1;
+}
+
+/* Wake up the application once for all
+   the records published since the last flush. */
+static void flush(const struct context *ctx)
+{
+  uint64_t one = 1;
+
+  UNUSED(ctx);
+
+  if(!rx_pending)
+    return;
+
+  if(write(rx_efd, &one, sizeof(one)) != sizeof(one))
+    warn("cannot wake up application");
+  rx_pending = 0;
+}
+
+static void shm_ring_init(struct shm_ring_view *view, struct shm_ring *ring, size_t slot_size)
+{
+  *ring = (struct shm_ring){ .count     = slots,
+                             .slot_size = slot_size };
+  *view = (struct shm_ring_view){ .shared    = ring,
+                                  .slots     = (unsigned char *)(ring + 1),
+                                  .count     = slots,
+                                  .mask      = slots - 1,
+                                  .slot_size = slot_size };
+}
+
+static void init(const struct context *ctx, struct g3plc_config *g3plc)
+{
+  struct sockaddr_un s_addr = { .sun_family = AF_UNIX };
+  char shm_name[64];
+  size_t slot_size, ring_size;
+
+  /* configure the G3-PLC layer */
+  g3plc->callbacks.cb_recv = cb_recv;
+
+  if(!slots || (slots & (slots - 1)))
+    errx(EXIT_FAILURE, "number of slots must be a power of two");
+
+  /* Each slot starts with the record length. We keep the
+     slots aligned on 64 bits and the rings on cache lines. */
+  slot_size = (sizeof(uint16_t) + BUF_SIZE + 7) & ~7;
+  ring_size = (sizeof(struct shm_ring) + slots * slot_size + SHM_CACHE_LINE - 1) &
+              ~(SHM_CACHE_LINE - 1);
+  area_size = SHM_CACHE_LINE + 2 * ring_size;
+
+  /* The shared memory is only referenced by its descriptor,
+     so we can unlink the name right after its creation. */
+  snprintf(shm_name, sizeof(shm_name), "/" PACKAGE "-%d", getpid());
+  shm_fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if(shm_fd < 0)
+    err(EXIT_FAILURE, "cannot create shared memory");
+  shm_unlink(shm_name);
+
+  if(ftruncate(shm_fd, area_size) < 0)
+    err(EXIT_FAILURE, "cannot allocate shared memory");
+
+  area = mmap(NULL, area_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  if(area == MAP_FAILED)
+    err(EXIT_FAILURE, "cannot map shared memory");
+
+  *area = (struct shm_area){ .magic     = SHM_RING_MAGIC,
+                             .version   = SHM_RING_VERSION,
+                             .rx_offset = SHM_CACHE_LINE,
+                             .tx_offset = SHM_CACHE_LINE + ring_size };
+  shm_ring_init(&rx_ring, SHM_RING(area, SHM_CACHE_LINE), slot_size);
+  shm_ring_init(&tx_ring, SHM_RING(area, SHM_CACHE_LINE + ring_size), slot_size);
+
+  /* wakeups */
+  rx_efd = eventfd(0, EFD_CLOEXEC);
+  tx_efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if(rx_efd < 0 || tx_efd < 0)
+    err(EXIT_FAILURE, "cannot create eventfd");
+
+  /* create socket */
+  sd = xsocket(AF_UNIX, SOCK_STREAM, 0);
+
+  /* bind to the specified unix socket */
+  unlink(socket_driver_path);
+  xstrcpy(s_addr.sun_path, socket_driver_path, sizeof(s_addr.sun_path));
+  xbind(sd, (struct sockaddr *)&s_addr, SUN_LEN(&s_addr));
+  xlisten(sd, 4);
+
+  /* now we may register the exit function */
+  atexit(exit_clean);
+
+  IF_VERBOSE(ctx, log_msg(LOG_CAT_MAIN, LOG_LVL_DEBUG, "Socket created at %s\n", socket_driver_path));
+}
+
+/* Pass the shared memory and eventfd descriptors to a new application. */
+static void send_descriptors(int client)
+{
+  int fds[3] = { shm_fd, rx_efd, tx_efd };
+  unsigned char version = SHM_RING_VERSION;
+  union {
+    struct cmsghdr hdr;
+    unsigned char  buf[CMSG_SPACE(sizeof(fds))];
+  } control;
+  struct iovec iov = { .iov_base = &version, .iov_len = sizeof(version) };
+  struct msghdr msg = { .msg_iov        = &iov,
+                        .msg_iovlen     = 1,
+                        .msg_control    = control.buf,
+                        .msg_controllen = sizeof(control.buf) };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type  = SCM_RIGHTS;
+  cmsg->cmsg_len   = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  if(sendmsg(client, &msg, 0) < 0)
+    warn("cannot send descriptors"); /* we don't fail on client error */
+}
+
+/* Send all records published by the application. */
+static void drain_tx(const struct context *ctx)
+{
+  /* send record format:
+     [dst (u16)][payload] */
+  uint32_t head;
+
+  while((head = LOAD(tx_ring.shared->head)) != tx_ring.index) {
+    const unsigned char *b = SHM_VIEW_SLOT(&tx_ring, tx_ring.index);
+    unsigned int len = *(uint16_t *)b;
+    uint16_t dst;
+    int ret;
+
+    b += sizeof(uint16_t);
+
+    /* the records up to a head that is not
+       within the ring cannot be trusted */
+    if(head - tx_ring.index > tx_ring.count) {
+      warnx("invalid ring head, records dropped");
+      STORE(tx_ring.shared->tail, tx_ring.index = head);
+      return;
+    }
+
+    if(len + sizeof(uint16_t) > tx_ring.slot_size)
+      warnx("record too large");
+    else if(len <= sizeof(uint16_t))
+      warnx("message too short");
+    else {
+      dst = *(uint16_t *)b;
+
+      IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG,
+                              "Sending %d bytes to %04X\n",
+                              len - (int)sizeof(uint16_t), dst));
+      ret = g3plc_send(ctx->plc, dst,
+                       b   + sizeof(uint16_t),
+                       len - sizeof(uint16_t));
+      IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG,
+                              "TX STATUS: %s (%d)\n", g3plc_send2str(ret), ret));
+      IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG, "---------\n"));
+    }
+
+    STORE(tx_ring.shared->tail, ++tx_ring.index);
+  }
+}
+
+static void start(const struct context *ctx)
+{
+  struct pollfd fds[2] = { { .fd = sd,     .events = POLLIN },
+                           { .fd = tx_efd, .events = POLLIN } };
+  uint64_t count;
+  int client;
+
+  while(1) {
+    if(poll(fds, 2, -1) < 0) {
+      warn("poll error");
+      continue;
+    }
+
+    if(fds[0].revents & POLLIN) {
+      client = accept(sd, NULL, NULL);
+      if(client < 0)
+        warn("cannot accept application");
+      else {
+        send_descriptors(client);
+        close(client);
+      }
+    }
+
+    if(fds[1].revents & POLLIN) {
+      /* reset the eventfd counter before draining
+         so that we don't miss a wakeup */
+      if(read(tx_efd, &count, sizeof(count)) < 0)
+        warn("cannot read eventfd");
+      drain_tx(ctx);
+    }
+  }
+}
+
+static void destroy(const struct context *ctx)
+{
+  UNUSED(ctx);
+
+  munmap(area, area_size);
+  close(shm_fd);
+  close(rx_efd);
+  close(tx_efd);
+  exit_clean();
+}
+
+static int parse_option(const struct context *ctx, int c)
+{
+  int err;
+
+  UNUSED(ctx);
+
+  switch(c) {
+  case 'L':
+    socket_driver_path = optarg;
+    return 1;
+  case OPT_SLOTS:
+    slots = xatou(optarg, &err);
+    if(err)
+      errx(EXIT_FAILURE, "cannot parse number of slots");
+    return 1;
+  }
+
+  return 0;
+}
+
+struct iface_mode iface_mode = {
+  .name = "shm",
+  .description = "Read and write frame on rings in shared memory",
+
+  .optstring      = "L:",
+  .long_opts      = shm_opts,
+  .extra_messages = shm_messages,
+  .parse_option   = parse_option,
+
+  .init    = init,
+  .destroy = destroy,
+  .start   = start,
+  .flush   = flush
+};
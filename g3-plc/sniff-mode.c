@@ -0,0 +1,175 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <err.h>
+
+#include "g3-plc/g3plc-str.h"
+#include "g3-plc/g3plc.h"
+#include "capture.h"
+#include "help.h"
+#include "main.h"
+#include "xatoi.h"
+#include "log.h"
+#include "common.h"
+#include "mode.h"
+
+/* Passive sniffer. The modem is promiscuous, lets invalid frames
+   through and never answers with ACKs, and the mode never sends.
+   Everything is written to a rotated capture file (see capture.h)
+   from the receive path, the mode only counts the frames. */
+
+#define DEFAULT_OUTPUT "sniff.pcapng"
+#define DEFAULT_KEEP   10
+
+static const char *output = DEFAULT_OUTPUT;
+static unsigned long rotate_size;
+static unsigned int keep = DEFAULT_KEEP;
+static unsigned int links = ~0U;
+static volatile sig_atomic_t stopped;
+
+static unsigned long frames;
+static unsigned long invalid;
+
+static void cb_recv(const struct g3plc_ind *ind,
+                    const void *payload, unsigned payload_size,
+                    int status, void *data)
+{
+  UNUSED(ind);
+  UNUSED(payload);
+  UNUSED(payload_size);
+  UNUSED(data);
+
+  /* the frame was already captured by the receive path */
+  frames++;
+  if(status == G3PLC_RCV_INVALID_CRC || status == G3PLC_RCV_INVALID_HDR)
+    invalid++;
+}
+
+static void sig_stop(int signum)
+{
+  UNUSED(signum);
+  stopped = 1;
+}
+
+static void init(const struct context *ctx, struct g3plc_config *g3plc)
+{
+  struct sigaction act = { .sa_handler = sig_stop };
+
+  UNUSED(ctx);
+  g3plc->callbacks.cb_recv = cb_recv;
+  g3plc->flags |= G3PLC_PROMISC | G3PLC_INVALID | G3PLC_NOACK;
+
+  capture_select(links);
+  capture_rotate(rotate_size, keep);
+  capture_open(output);
+
+  /* no SA_RESTART so that the sleep is interrupted */
+  sigemptyset(&act.sa_mask);
+  if(sigaction(SIGINT, &act, NULL) < 0 ||
+     sigaction(SIGTERM, &act, NULL) < 0)
+    err(EXIT_FAILURE, "cannot install signal handler");
+}
+
+static void start(const struct context *ctx)
+{
+  while(!stopped) {
+    sleep(1);
+    IF_VERBOSE(ctx, log_msg(LOG_CAT_MAIN, LOG_LVL_DEBUG,
+                            "Sniffed %lu frames (%lu invalid, %lu dropped)\n",
+                            frames, invalid, capture_drops()));
+  }
+
+  printf("%lu frames sniffed, %lu invalid, %lu records dropped\n",
+         frames, invalid, capture_drops());
+}
+
+static void destroy(const struct context *ctx)
+{
+  UNUSED(ctx);
+}
+
+static int parse_option(const struct context *ctx, int c)
+{
+  int err;
+
+  UNUSED(ctx);
+
+  switch(c) {
+  case 'o':
+    output = optarg;
+    return 1;
+  case 'R':
+    rotate_size = xatou(optarg, &err) * 1024UL * 1024UL;
+    if(err)
+      errx(EXIT_FAILURE, "invalid rotation size");
+    return 1;
+  case 'k':
+    keep = xatou(optarg, &err);
+    if(err || !keep)
+      errx(EXIT_FAILURE, "invalid number of files");
+    return 1;
+  case 'F':
+    links = 1U << CAPTURE_FRAME;
+    return 1;
+  }
+
+  return 0; /* option unknown by this module,
+               can be be parsed by next module */
+}
+
+struct option sniff_opts[] = {
+  { "output", required_argument, NULL, 'o' },
+  { "rotate", required_argument, NULL, 'R' },
+  { "keep", required_argument, NULL, 'k' },
+  { "frames-only", no_argument, NULL, 'F' },
+  { NULL, 0, NULL, 0 }
+};
+
+struct opt_help sniff_messages[] = {
+  { 'o', "output", "Capture file (default: " DEFAULT_OUTPUT ")" },
+  { 'R', "rotate", "Start a new capture file every N MiB (default: never)" },
+  { 'k', "keep", "Number of rotated capture files kept (default: 10)" },
+  { 'F', "frames-only", "Only capture the frames, not the UART bytes" },
+  { 0, NULL, NULL }
+};
+
+struct iface_mode iface_mode = {
+  .name        = "sniff",
+  .description = "Capture every frame on the medium without transmitting",
+
+  .optstring      = "o:R:k:F",
+  .long_opts      = sniff_opts,
+  .extra_messages = sniff_messages,
+  .parse_option   = parse_option,
+
+  .init    = init,
+  .destroy = destroy,
+  .start   = start
+};
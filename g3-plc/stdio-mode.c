@@ -22,42 +22,140 @@
    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <getopt.h>
-#include <errno.h>
 #include <err.h>
 
 #include "g3-plc/g3plc-str.h"
 #include "g3-plc/g3plc.h"
 #include "help.h"
 #include "main.h"
-#include "dump.h"
+#include "xatoi.h"
+#include "jsonl.h"
+#include "log.h"
 #include "common.h"
 #include "mode.h"
 
 #define PROMPT   "input> "
 #define BUF_SIZE G3PLC_MAX_PAYLOAD
 
+/* With --json each received frame and each send status is a
+   JSON object on its own line (see jsonl.h) instead of a dump:
+     {"event":"recv","medium":"g3plc","src":"0001","dst":"0002",
+      "status":"success","code":0,"stamp_us":...,"lqi":...,
+      "seqno":...,"modulation":...,"tonemap":...,"size":...,
+      "payload":"..."}
+     {"event":"sent","dst":"0002","status":"success","code":0}
+   The prompt is not shown. The records are buffered and written
+   out once no other frame arrived within FLUSH_TIMEOUT us. */
+#define FLUSH_TIMEOUT 10000
+
+static unsigned int sample = 1;
+static int json;
+static enum jsonl_bytes encoding;
+
+/* Records are written by the delivery thread and the main thread. */
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+static char output_buf[1 << 16];
+
+static void put_json(const char *record, size_t size, int sync)
+{
+  pthread_mutex_lock(&output_lock);
+  {
+    fwrite(record, 1, size, stdout);
+    if(sync)
+      fflush(stdout);
+  }
+  pthread_mutex_unlock(&output_lock);
+}
+
+static void recv_json(const struct g3plc_ind *ind,
+                      const void *payload, unsigned payload_size,
+                      int status)
+{
+  static char record[JSONL_SIZE(G3PLC_MAX_PAYLOAD)];
+  char *b = record;
+
+  if(payload_size > G3PLC_MAX_PAYLOAD)
+    payload_size = G3PLC_MAX_PAYLOAD;
+
+  b = jsonl_begin(b);
+  b = jsonl_str(b, "event", "recv");
+  b = jsonl_str(b, "medium", "g3plc");
+  b = jsonl_addr(b, "src", g3plc_ind_src(ind));
+  b = jsonl_addr(b, "dst", g3plc_ind_dst(ind));
+  b = jsonl_str(b, "status", g3plc_rcv2str(status));
+  b = jsonl_int(b, "code", status);
+  b = jsonl_uint(b, "stamp_us", ind->stamp);
+  b = jsonl_uint(b, "lqi", g3plc_ind_lqi(ind));
+  b = jsonl_uint(b, "seqno", g3plc_ind_seqno(ind));
+  b = jsonl_uint(b, "modulation", g3plc_ind_modulation(ind));
+  b = jsonl_uint(b, "tonemap", g3plc_ind_tonemap(ind));
+  b = jsonl_uint(b, "size", payload_size);
+  b = jsonl_bytes(b, "payload", payload, payload_size, encoding);
+  b = jsonl_end(b);
+
+  put_json(record, b - record, 0);
+}
+
+static void sent_json(uint16_t dst, int status)
+{
+  char record[JSONL_FIELDS_SIZE];
+  char *b = record;
 
-static void cb_recv(const struct g3plc_data_hdr *hdr,
+  b = jsonl_begin(b);
+  b = jsonl_str(b, "event", "sent");
+  b = jsonl_addr(b, "dst", dst);
+  b = jsonl_str(b, "status", g3plc_send2str(status));
+  b = jsonl_int(b, "code", status);
+  b = jsonl_end(b);
+
+  put_json(record, b - record, 1);
+}
+
+static void cb_recv(const struct g3plc_ind *ind,
                     const void *payload, unsigned payload_size,
                     int status, void *data)
 {
+  static unsigned long received;
+  char head[32], tail[64];
+
   UNUSED(data);
 
-  putchar('\n');
-  printf("FROM %04X TO %04X:\n", (uint16_t)hdr->src_addr, (uint16_t)hdr->dst_addr);
-  hex_dump(payload, payload_size);
-  printf("RX STATUS: %s (%d)\n", g3plc_rcv2str(status), status);
+  /* only dump one frame out of sample */
+  if(received++ % sample)
+    return;
+
+  if(json) {
+    recv_json(ind, payload, payload_size, status);
+    return;
+  }
+
+  snprintf(head, sizeof(head), "\nFROM %04X TO %04X:\n", g3plc_ind_src(ind), g3plc_ind_dst(ind));
+  snprintf(tail, sizeof(tail), "RX STATUS: %s (%d)\n", g3plc_rcv2str(status), status);
+  log_dump(LOG_CAT_RX, LOG_LVL_INFO, head, payload, payload_size, tail);
 }
 
 static void init(const struct context  *ctx, struct g3plc_config *g3plc)
 {
   UNUSED(ctx);
   g3plc->callbacks.cb_recv = cb_recv;
+
+  if(json)
+    setvbuf(stdout, output_buf, _IOFBF, sizeof(output_buf));
+}
+
+static void flush(const struct context *ctx)
+{
+  UNUSED(ctx);
+
+  pthread_mutex_lock(&output_lock);
+  fflush(stdout);
+  pthread_mutex_unlock(&output_lock);
 }
 
 static void start(const struct context *ctx)
@@ -66,20 +164,11 @@ static void start(const struct context *ctx)
   char buf[BUF_SIZE];
 
   while(1) {
-    printf(PROMPT);
-
-    /* Interruption often occurs on stdin because
-       we use the timers a lot. So we *have* to
-       handle syscall interruptions. */
-  RESTART:
-    if(!fgets(buf, sizeof(buf), stdin)) {
-      switch(errno) {
-      case EINTR:
-        goto RESTART;
-      default:
-        errx(EXIT_FAILURE, "cannot read from stdin");
-      }
-    }
+    if(!json)
+      printf(PROMPT);
+
+    if(!fgets(buf, sizeof(buf), stdin))
+      errx(EXIT_FAILURE, "cannot read from stdin");
 
     /* strip newline */
     strtok(buf, "\n");
@@ -89,7 +178,11 @@ static void start(const struct context *ctx)
     else if(!strcmp(buf, "exit"))
       return;
 
-    ret = g3plc_send(ctx->dst_mac, buf, strlen(buf));
+    ret = g3plc_send(ctx->plc, ctx->dst_mac, buf, strlen(buf));
+    if(json) {
+      sent_json(ctx->dst_mac, ret);
+      continue;
+    }
     printf("TX STATUS: %s (%d)\n", g3plc_send2str(ret), ret);
   }
 }
@@ -101,22 +194,53 @@ static void destroy(const struct context *ctx)
 
 static int parse_option(const struct context *ctx, int c)
 {
+  int err;
+
   UNUSED(ctx);
-  UNUSED(c);
+
+  switch(c) {
+  case 'n':
+    sample = xatou(optarg, &err);
+    if(err || !sample)
+      errx(EXIT_FAILURE, "invalid sample rate");
+    return 1;
+  case 'j':
+    json = 1;
+    iface_mode.flush         = flush;
+    iface_mode.flush_timeout = FLUSH_TIMEOUT;
+    return 1;
+  case 'e':
+    if((err = jsonl_encoding(optarg)) < 0)
+      errx(EXIT_FAILURE, "unknown encoding (hex or base64)");
+    encoding = err;
+    return 1;
+  }
 
   return 0; /* option unknown by this module,
                can be be parsed by next module */
 }
 
-struct option stdio_opts[]       = { { NULL, 0, NULL, 0 } };
+struct option stdio_opts[] = {
+  { "sample", required_argument, NULL, 'n' },
+  { "json", no_argument, NULL, 'j' },
+  { "encoding", required_argument, NULL, 'e' },
+  { NULL, 0, NULL, 0 }
+};
+
+struct opt_help stdio_messages[] = {
+  { 'n', "sample", "Only dump one received frame out of N (default: all)" },
+  { 'j', "json", "Write received frames and send statuses as JSON lines" },
+  { 'e', "encoding", "Encoding of the payloads in JSON, hex or base64 (default: hex)" },
+  { 0, NULL, NULL }
+};
 
 struct iface_mode iface_mode = {
   .name        = "stdio",
   .description = "Read output frame and print received frames on stdio",
 
-  .optstring      = "",
+  .optstring      = "n:je:",
   .long_opts      = stdio_opts,
-  .extra_messages = NULL,
+  .extra_messages = stdio_messages,
   .parse_option   = parse_option,
 
   .init    = init,
@@ -0,0 +1,260 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _POSIX_C_SOURCE 200112L
+#endif /* __linux__ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "g3plc.h"
+#include "g3plc-cmd.h"
+#include "crc32.h"
+#include "crc-ccitt.h"
+#include "pack.h"
+
+/* Measure the codec hot paths over synthetic corpora and
+   report the time spent per byte. Each benchmark is repeated
+   until it ran for at least BENCH_TIME so that the result is
+   stable enough to compare encoders or their variants.
+
+   The corpora are random bytes, where about one byte out of
+   16 is a frame delimiter or an escape, and MCPS-DATA.indication
+   frames as received from the modem. The MCPS-DATA.request frames
+   sent by the driver are also checked against a frame assembled
+   field by field. */
+
+#define BENCH_TIME  200000000ULL /* 200ms */
+#define CORPUS_SIZE 65536
+#define FRAME_SIZE  200 /* MSDU of the indication frames */
+
+static unsigned char corpus[CORPUS_SIZE];
+static unsigned char packed[2 * CORPUS_SIZE + 2];
+static unsigned char unpacked[2 * CORPUS_SIZE + 2];
+static unsigned int packed_size;
+static unsigned char stream[CORPUS_SIZE * 2];
+static unsigned int stream_size;
+
+static struct g3plc_ctx plc;
+static unsigned int indications;
+static unsigned char sent[G3PLC_MAX_PACKED_CMD];
+static unsigned int sent_size;
+static volatile uint32_t sink;
+
+static uint64_t now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Run a benchmark that processes size bytes per iteration.
+   Sizes are counted on the decoded side for unpack(). */
+static void bench(const char *name, void (*f)(void), unsigned long size)
+{
+  uint64_t begin, elapsed;
+  unsigned long runs = 0;
+
+  f(); /* warm up */
+
+  begin = now();
+  do {
+    f();
+    runs++;
+    elapsed = now() - begin;
+  } while(elapsed < BENCH_TIME);
+
+  printf("%-24s %8.3f ns/byte %10.1f MB/s\n", name,
+         (double)elapsed / runs / size,
+         (double)size * runs * 1000 / elapsed);
+}
+
+static void bench_pack(void)
+{
+  sink ^= pack(packed, corpus, CORPUS_SIZE);
+}
+
+static void bench_unpack(void)
+{
+  sink ^= unpack(unpacked, packed, packed_size);
+}
+
+static void bench_crc32(void)
+{
+  sink ^= crc32_G3PLC(corpus, CORPUS_SIZE, 0);
+}
+
+static void bench_crc32_bytewise(void)
+{
+  sink ^= crc32_G3PLC_bytewise(corpus, CORPUS_SIZE, 0);
+}
+
+static void bench_crc32_slice8(void)
+{
+  sink ^= crc32_G3PLC_slice8(corpus, CORPUS_SIZE, 0);
+}
+
+static void bench_crc_ccitt(void)
+{
+  sink ^= crc_ccitt(corpus, CORPUS_SIZE, 0xffff);
+}
+
+static void bench_indication(void)
+{
+  g3plc_uart_feed(&plc, stream, stream_size);
+}
+
+static void bench_request(void)
+{
+  if(g3plc_send_async(&plc, 0x1234, corpus, FRAME_SIZE, NULL) == G3PLC_SND_BUSY)
+    g3plc_send_flush(&plc);
+}
+
+static int uart_send(const void *buf, unsigned int size, void *data)
+{
+  (void)data;
+
+  memcpy(sent, buf, size);
+  sent_size = size;
+  return 0;
+}
+
+/* Compare the request sent with the given handle
+   to the same request assembled field by field. */
+static int check_request(uint8_t handle)
+{
+  unsigned char frame[sizeof(struct g3plc_cmd) + G3PLC_DATA_HDR_SIZE];
+  unsigned char expected[G3PLC_MAX_PACKED_CMD];
+  struct g3plc_cmd *cmd = (struct g3plc_cmd *)frame;
+  unsigned char *d = cmd->data;
+  uint16_t u16;
+
+  memset(frame, 0, sizeof(frame));
+  *cmd = (struct g3plc_cmd){ 0, G3PLC_TYPE_G3, G3PLC_CHAN0, G3PLC_IDA_REQUEST,
+                             G3PLC_IDP_UMAC, G3PLC_CMD_MCPS_DATA };
+  hton_g3plc_cmd(cmd);
+
+  d[0] = 0x02;
+  d[1] = 0x02;
+  u16 = htons(0x7d7e); memcpy(d + 2, &u16, 2);  /* PAN ID (escaped) */
+  u16 = htons(0x1234); memcpy(d + 4, &u16, 2);
+  u16 = htons(FRAME_SIZE); memcpy(d + 12, &u16, 2);
+  d[14] = handle;
+  d[15] = 0x01; /* ACK */
+
+  return sent_size == pack_crc(expected, frame, sizeof(frame), corpus, FRAME_SIZE) &&
+         !memcmp(sent, expected, sent_size);
+}
+
+static void cb_recv(const struct g3plc_ind *ind,
+                    const void *payload, unsigned payload_size,
+                    int status, void *data)
+{
+  (void)ind;
+  (void)payload;
+  (void)payload_size;
+  (void)status;
+  (void)data;
+
+  indications++;
+}
+
+/* Fill the stream with MCPS-DATA.indication
+   frames packed as the modem would send them. */
+static void build_stream(void)
+{
+  unsigned char frame[sizeof(struct g3plc_cmd) + 24 + FRAME_SIZE];
+  struct g3plc_cmd *cmd = (struct g3plc_cmd *)frame;
+  unsigned char *d = cmd->data;
+  uint16_t len = htons(FRAME_SIZE);
+
+  memset(frame, 0, sizeof(frame));
+  *cmd = (struct g3plc_cmd){ 0, G3PLC_TYPE_G3, G3PLC_CHAN0, G3PLC_IDA_INDICATION,
+                             G3PLC_IDP_UMAC, G3PLC_CMD_MCPS_DATA };
+  hton_g3plc_cmd(cmd);
+
+  /* addresses are left to zero, only the MSDU length matters */
+  memcpy(d + 22, &len, sizeof(len));
+  memcpy(d + 24, corpus, FRAME_SIZE);
+
+  while(stream_size + 2 * sizeof(frame) + 10 < sizeof(stream))
+    stream_size += pack_crc(stream + stream_size, frame, sizeof(frame), NULL, 0);
+}
+
+int main(void)
+{
+  struct g3plc_config g3plc = {
+    .recv_frame = g3plc_recv_frame,
+    .htons      = htons,
+    .ntohs      = ntohs,
+    .htonl      = htonl,
+    .ntohl      = ntohl,
+    .uart_send  = uart_send,
+    .callbacks  = { .cb_recv = cb_recv },
+    .pan_id     = 0x7d7e,
+    .window     = 127
+  };
+  unsigned int i;
+  uint8_t handle;
+
+  srand(0);
+  for(i = 0 ; i < CORPUS_SIZE ; i++) {
+    corpus[i] = rand();
+    if(!(rand() % 16))
+      corpus[i] = rand() % 2 ? 0x7e : 0x7d;
+  }
+
+  g3plc_init(&plc, &g3plc);
+  build_stream();
+  packed_size = pack(packed, corpus, CORPUS_SIZE);
+
+  bench("pack", bench_pack, CORPUS_SIZE);
+  bench("unpack", bench_unpack, CORPUS_SIZE);
+  bench("crc32_G3PLC", bench_crc32, CORPUS_SIZE);
+  bench("crc32_G3PLC_bytewise", bench_crc32_bytewise, CORPUS_SIZE);
+  bench("crc32_G3PLC_slice8", bench_crc32_slice8, CORPUS_SIZE);
+  bench("crc_ccitt", bench_crc_ccitt, CORPUS_SIZE);
+
+  if(g3plc_send_async(&plc, 0x1234, corpus, FRAME_SIZE, &handle) || !check_request(handle)) {
+    printf("unexpected MCPS-DATA request\n");
+    return 1;
+  }
+  g3plc_send_flush(&plc);
+  bench("mcps_data_request", bench_request, FRAME_SIZE);
+
+  indications = 0;
+  bench("mcps_data_indication", bench_indication, stream_size);
+  if(!indications) {
+    printf("no indication parsed\n");
+    return 1;
+  }
+
+  return 0;
+}
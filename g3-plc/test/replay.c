@@ -0,0 +1,172 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _POSIX_C_SOURCE 200112L
+#endif /* __linux__ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <err.h>
+#include <arpa/inet.h>
+
+#include "g3plc.h"
+#include "capture.h"
+
+/* Replay the UART bytes received in a capture file (see --capture)
+   through the G3-PLC parser, either as fast as possible or with the
+   recorded timing (-r), and report the number of commands parsed.
+   This reproduces a bug seen on the line without the modem. */
+
+static unsigned long commands, errors, indications;
+
+static uint64_t now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t)
+{
+  struct timespec ts;
+  uint64_t n = now();
+
+  if(t <= n)
+    return;
+  t -= n;
+
+  ts.tv_sec  = t / 1000000000ULL;
+  ts.tv_nsec = t % 1000000000ULL;
+  nanosleep(&ts, NULL);
+}
+
+static void raw(const struct g3plc_cmd *cmd, unsigned int size, int status, void *data)
+{
+  (void)cmd;
+  (void)size;
+  (void)data;
+
+  if(status != G3PLC_RCV_SUCCESS)
+    errors++;
+  commands++;
+}
+
+static void cb_recv(const struct g3plc_ind *ind,
+                    const void *payload, unsigned payload_size,
+                    int status, void *data)
+{
+  (void)ind;
+  (void)payload;
+  (void)payload_size;
+  (void)status;
+  (void)data;
+
+  indications++;
+}
+
+int main(int argc, char *argv[])
+{
+  struct g3plc_config g3plc = {
+    .recv_frame = g3plc_recv_frame,
+    .htons      = htons,
+    .ntohs      = ntohs,
+    .htonl      = htonl,
+    .ntohl      = ntohl,
+    .flags      = G3PLC_INVALID | G3PLC_PROMISC,
+    .callbacks  = { .raw = raw, .cb_recv = cb_recv }
+  };
+  static struct g3plc_ctx plc;
+  struct capture_record record;
+  uint64_t begin, pass_begin, first = 0, elapsed;
+  unsigned long records = 0, bytes = 0, passes = 1, pass;
+  int realtime = 0;
+  int ret = 0, c;
+  FILE *fp;
+
+  while((c = getopt(argc, argv, "rn:")) != -1) {
+    switch(c) {
+    case 'r':
+      realtime = 1;
+      break;
+    case 'n':
+      passes = strtoul(optarg, NULL, 10);
+      if(!passes)
+        errx(EXIT_FAILURE, "invalid number of passes");
+      break;
+    default:
+      errx(EXIT_FAILURE, "usage: %s [-r] [-n PASSES] capture", argv[0]);
+    }
+  }
+
+  if(optind != argc - 1)
+    errx(EXIT_FAILURE, "usage: %s [-r] [-n PASSES] capture", argv[0]);
+
+  fp = fopen(argv[optind], "rb");
+  if(!fp)
+    err(EXIT_FAILURE, "cannot open %s", argv[optind]);
+
+  g3plc_init(&plc, &g3plc);
+
+  /* Short captures are fed several times to time the parser
+     over more than a few microseconds. */
+  begin = now();
+  for(pass = 0 ; pass < passes && ret >= 0 ; pass++) {
+    unsigned long pass_records = 0;
+
+    rewind(fp);
+    pass_begin = now();
+    while((ret = capture_read(fp, &record)) > 0) {
+      if(record.link != CAPTURE_UART || record.dir != CAPTURE_RX)
+        continue;
+
+      if(!pass_records++)
+        first = record.stamp;
+      if(realtime)
+        sleep_until(pass_begin + record.stamp - first);
+
+      g3plc_uart_feed(&plc, record.data, record.size);
+
+      records++;
+      bytes += record.size;
+    }
+  }
+  elapsed = now() - begin;
+
+  if(ret < 0)
+    errx(EXIT_FAILURE, "%s: invalid capture file", argv[optind]);
+  fclose(fp);
+
+  printf("%lu records, %lu bytes, %lu commands (%lu invalid), %lu indications\n",
+         records, bytes, commands, errors, indications);
+  printf("%.3f ms, %.1f MB/s\n", (double)elapsed / 1000000,
+         elapsed ? (double)bytes * 1000 / elapsed : 0.);
+
+  return 0;
+}
@@ -1,5 +1,4 @@
-/* Copyright (c) 2017, Aurélien Van Laere <aurelien.vanlaere@umons.ac.be>
-                       David Hauweele <david@hauweele.net>
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
    All rights reserved.
 
    Redistribution and use in source and binary forms, with or without
@@ -23,15 +22,37 @@
    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#ifndef _CRC_CCITT_H_
-#define _CRC_CCITT_H_
+#include <stdio.h>
+#include <string.h>
 
-#include <stdint.h>
+#include "dump.h"
+#include "agg.h"
 
-#define CRC_CCITT_INIT 0xffff
+void print_record(const void *record, size_t size, void *data)
+{
+  (void)data;
 
-uint16_t crc_ccitt(const unsigned char *s,
-                   unsigned int len,
-                   uint16_t crc);
+  printf("Record:\n");
+  hex_dump(record, size);
+}
 
-#endif /* _CRC_CCITT_H_ */
+int main(int argc, char *argv[])
+{
+  unsigned char buf[1024];
+  struct agg a;
+  int i;
+
+  agg_init(&a, buf, sizeof(buf));
+
+  for(i = 1 ; i < argc ; i++)
+    if(agg_add(&a, argv[i], strlen(argv[i])) < 0)
+      printf("Cannot add %s\n", argv[i]);
+
+  printf("Aggregate (%u records):\n", a.count);
+  hex_dump(buf, a.size);
+
+  printf("----------\n");
+  printf("Split: %d\n", agg_split(buf, a.size, print_record, NULL));
+
+  return 0;
+}
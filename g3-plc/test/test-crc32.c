@@ -22,41 +22,42 @@
    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-/* FIXME: This is Linux specific, isn't it?
-   We need a pragma to avoid compilation on
-   other OS. */
-
-enum rpi_gpio_mode {
-  RPI_GPIO_IN   = 0x0,
-  RPI_GPIO_OUT  = 0x1,
-  RPI_GPIO_ALT0 = 0x4,
-  RPI_GPIO_ALT1 = 0x5,
-  RPI_GPIO_ALT2 = 0x6,
-  RPI_GPIO_ALT3 = 0x7,
-  RPI_GPIO_ALT4 = 0x3,
-  RPI_GPIO_ALT5 = 0x2
-};
-
-/* Map GPIOs on the RPi */
-void rpi_gpio_init(void);
-
-/* Unmap GPIOs from the RPi */
-void rpi_gpio_destroy(void);
-
-/* Configure the mode for the GPIO (see rpi_gpio_mode).
-   Note that contrary to some example that you can find
-   on the Internet, you can directly configure the desired
-   mode here. There is no need to configure as input beforehand. */
-void rpi_gpio_set_mode(unsigned int gpio, unsigned int mode);
-
-/* Set a GPIO */
-void rpi_gpio_set(unsigned int gpio);
-
-/* Clear a GPIO */
-void rpi_gpio_clr(unsigned int gpio);
-
-/* Get the state of a GPIO */
-int rpi_gpio_get(unsigned int gpio);
-
-/* Check that the GPIO number is valid */
-int rpi_gpio_check(unsigned int gpio);
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "crc32.h"
+
+#define BUFFER_SIZE 1024
+
+/* Compare the optimized CRC32 implementations against the
+   byte-at-a-time table on every length and alignment. */
+int main(int argc, char *argv[])
+{
+  unsigned char buf[BUFFER_SIZE + 8];
+  unsigned int len, off, i;
+  int fail = 0;
+
+  srand(0);
+  for(i = 0 ; i < sizeof(buf) ; i++)
+    buf[i] = rand();
+
+  for(off = 0 ; off < 8 ; off++) {
+    for(len = 0 ; len <= BUFFER_SIZE ; len++) {
+      uint32_t init     = rand();
+      uint32_t expected = crc32_G3PLC_bytewise(buf + off, len, init);
+      uint32_t slice8   = crc32_G3PLC_slice8(buf + off, len, init);
+      uint32_t best     = crc32_G3PLC(buf + off, len, init);
+
+      if(slice8 != expected || best != expected) {
+        printf("off=%u len=%u expected %08X slice8 %08X best %08X\n",
+               off, len, expected, slice8, best);
+        fail = 1;
+      }
+    }
+  }
+
+  printf("%s\n", fail ? "FAIL" : "OK");
+
+  return fail;
+}
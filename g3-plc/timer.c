@@ -23,90 +23,250 @@
  */
 
 #ifdef __linux__
-# define _POSIX_C_SOURCE 199506L
+# define _POSIX_C_SOURCE 200112L
 #endif /* __linux__ */
 
 #include <stdlib.h>
-#include <string.h>
-#include <signal.h>
 #include <pthread.h>
-#include <sys/time.h>
+#include <time.h>
+#include <errno.h>
 #include <err.h>
 
 #include "common.h"
 #include "timer.h"
 
-static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t   cond = PTHREAD_COND_INITIALIZER;
-static struct itimerval timer;
+/* Timers are implemented with a condition waiting on the
+   monotonic clock. There is no signal involved so each
+   timer is independent and does not interrupt syscalls
+   in other threads. The default timer is used by the
+   start/wait/stop functions for layers that only need one. */
+static struct timer default_timer;
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
 
-void timer_expired(int signum)
+/* Lateness of the wakeups on a deadline (see timer_jitter()). */
+static struct timer_jitter jitter;
+static pthread_mutex_t jitter_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void record_late(const struct timespec *deadline)
+{
+  struct timespec now;
+  long late;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  late = (now.tv_sec - deadline->tv_sec) * 1000000L + (now.tv_nsec - deadline->tv_nsec) / 1000;
+  if(late < 0)
+    late = 0;
+
+  pthread_mutex_lock(&jitter_lock);
+  {
+    jitter.expiries++;
+    jitter.late_sum += late;
+    if((unsigned long)late > jitter.late_max)
+      jitter.late_max = late;
+  }
+  pthread_mutex_unlock(&jitter_lock);
+}
+
+void timer_jitter(struct timer_jitter *j)
+{
+  pthread_mutex_lock(&jitter_lock);
+  *j = jitter;
+  pthread_mutex_unlock(&jitter_lock);
+}
+
+static void deadline_after(struct timespec *ts, unsigned int us)
 {
-  UNUSED(signum);
+  clock_gettime(CLOCK_MONOTONIC, ts);
 
-  stop_timer();
+  ts->tv_sec  += us / 1000000;
+  ts->tv_nsec += (us % 1000000) * 1000;
+  if(ts->tv_nsec >= 1000000000) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
 }
 
-static void setup_signal(void)
+static void init_cond(pthread_cond_t *cond)
 {
-  struct sigaction sa;
-  sigset_t set;
+  pthread_condattr_t attr;
 
-  /* unblock SIGALRM */
-  sigemptyset(&set);
-  sigaddset(&set, SIGALRM);
+  pthread_condattr_init(&attr);
+  if(pthread_condattr_setclock(&attr, CLOCK_MONOTONIC))
+    errx(EXIT_FAILURE, "cannot use monotonic clock");
 
-  if(pthread_sigmask(SIG_UNBLOCK, &set, NULL))
-    err(EXIT_FAILURE, "cannot unblock signal");
+  if(pthread_cond_init(cond, &attr))
+    errx(EXIT_FAILURE, "cannot initialize timer");
 
-  /* configure handler */
-  memset(&sa, 0, sizeof(sa));
-  sa.sa_handler = &timer_expired;
-  sigaction(SIGALRM, &sa, NULL);
+  pthread_condattr_destroy(&attr);
 }
 
-static void block_signal(void)
+void timer_init(struct timer *t)
 {
-  sigset_t set;
+  pthread_mutex_init(&t->lock, NULL);
+  init_cond(&t->cond);
+  t->armed = 0;
+}
 
-  /* block SIGALRM */
-  sigemptyset(&set);
-  sigaddset(&set, SIGALRM);
+static void init_default_timer(void)
+{
+  timer_init(&default_timer);
 }
 
-void start_timer(unsigned int timeout)
+void timer_start(struct timer *t, unsigned int timeout)
 {
   /* one shot timer */
-  pthread_mutex_lock(&lock);
+  pthread_mutex_lock(&t->lock);
+  {
+    deadline_after(&t->deadline, timeout);
+    t->armed = 1;
+  }
+  pthread_mutex_unlock(&t->lock);
+}
+
+void timer_wait(struct timer *t)
+{
+  pthread_mutex_lock(&t->lock);
   {
-    setup_signal();
+    int ret = 0;
 
-    timer.it_value = (struct timeval){ .tv_sec  = timeout / 1000000,
-                                       .tv_usec = timeout % 1000000 };
-    setitimer(ITIMER_REAL, &timer, NULL);
+    /* Loop on the predicate to handle spurious wakeups.
+       The timer is disarmed either when it is stopped
+       or when the deadline has been reached. */
+    while(t->armed && ret != ETIMEDOUT)
+      ret = pthread_cond_timedwait(&t->cond, &t->lock, &t->deadline);
+    if(ret == ETIMEDOUT)
+      record_late(&t->deadline);
+    t->armed = 0;
   }
-  pthread_mutex_unlock(&lock);
+  pthread_mutex_unlock(&t->lock);
 }
 
-void wait_timer(void)
+void timer_stop(struct timer *t)
 {
-  pthread_mutex_lock(&lock);
+  /* stop and unlock */
+  pthread_mutex_lock(&t->lock);
   {
-    if(timer.it_value.tv_sec || timer.it_value.tv_usec)
-      pthread_cond_wait(&cond, &lock);
+    t->armed = 0;
+    pthread_cond_broadcast(&t->cond);
   }
-  pthread_mutex_unlock(&lock);
+  pthread_mutex_unlock(&t->lock);
+}
+
+void start_timer(unsigned int timeout)
+{
+  pthread_once(&default_once, init_default_timer);
+  timer_start(&default_timer, timeout);
+}
+
+void wait_timer(void)
+{
+  pthread_once(&default_once, init_default_timer);
+  timer_wait(&default_timer);
 }
 
 void stop_timer(void)
 {
-  /* stop and unlock */
-  pthread_mutex_lock(&lock);
+  pthread_once(&default_once, init_default_timer);
+  timer_stop(&default_timer);
+}
+
+unsigned long clock_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/* Confirmation slots are independent from the timer above.
+   Each slot has its own condition with a predicate so that
+   a signal received before the wait is not lost. The default
+   slots are used by the slot_*() functions for the main modem. */
+static struct slots default_slots;
+static pthread_once_t slot_once = PTHREAD_ONCE_INIT;
+
+void slots_init(struct slots *s)
+{
+  int i;
+
+  pthread_mutex_init(&s->lock, NULL);
+  for(i = 0 ; i < MAX_SLOTS ; i++) {
+    init_cond(&s->slot[i].cond);
+    s->slot[i].signaled = 0;
+  }
+}
+
+static void init_default_slots(void)
+{
+  slots_init(&default_slots);
+}
+
+static struct slot * get_slot(struct slots *s, unsigned int slot)
+{
+  if(slot >= MAX_SLOTS)
+    errx(EXIT_FAILURE, "invalid slot %u", slot);
+
+  return &s->slot[slot];
+}
+
+void slots_arm(struct slots *s, unsigned int slot)
+{
+  struct slot *t = get_slot(s, slot);
+
+  pthread_mutex_lock(&s->lock);
+  t->signaled = 0;
+  pthread_mutex_unlock(&s->lock);
+}
+
+void slots_wait(struct slots *s, unsigned int slot, unsigned int timeout)
+{
+  struct slot *t = get_slot(s, slot);
+  struct timespec deadline;
+  int ret = 0;
+
+  deadline_after(&deadline, timeout);
+
+  pthread_mutex_lock(&s->lock);
   {
-    block_signal();
+    while(!t->signaled && ret != ETIMEDOUT)
+      ret = pthread_cond_timedwait(&t->cond, &s->lock, &deadline);
+    if(ret == ETIMEDOUT)
+      record_late(&deadline);
+    t->signaled = 0;
+  }
+  pthread_mutex_unlock(&s->lock);
+}
+
+void slots_signal(struct slots *s, unsigned int slot)
+{
+  struct slot *t = get_slot(s, slot);
 
-    timer.it_value.tv_usec = 0;
-    pthread_cond_signal(&cond);
+  pthread_mutex_lock(&s->lock);
+  {
+    t->signaled = 1;
+    pthread_cond_signal(&t->cond);
   }
-  pthread_mutex_unlock(&lock);
+  pthread_mutex_unlock(&s->lock);
+}
+
+void slot_arm(unsigned int slot, void *data)
+{
+  UNUSED(data);
+  pthread_once(&slot_once, init_default_slots);
+  slots_arm(&default_slots, slot);
+}
+
+void slot_wait(unsigned int slot, unsigned int timeout, void *data)
+{
+  UNUSED(data);
+  pthread_once(&slot_once, init_default_slots);
+  slots_wait(&default_slots, slot, timeout);
+}
+
+void slot_signal(unsigned int slot, void *data)
+{
+  UNUSED(data);
+  pthread_once(&slot_once, init_default_slots);
+  slots_signal(&default_slots, slot);
 }
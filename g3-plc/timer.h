@@ -25,11 +25,71 @@
 #ifndef _TIMER_H_
 #define _TIMER_H_
 
-/* Start/wait/stop the timer.
+#include <pthread.h>
+#include <time.h>
+
+/* One shot timer on the monotonic clock.
+   A timer must be initialized with timer_init() before use. */
+struct timer {
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  struct timespec deadline;
+  int armed;
+};
+
+/* Start/wait/stop a timer.
    The stop function drops any pending wait.
    Duration are given in microseconds. */
+void timer_init(struct timer *t);
+void timer_start(struct timer *t, unsigned int timeout);
+void timer_wait(struct timer *t);
+void timer_stop(struct timer *t);
+
+/* Start/wait/stop the default timer. */
 void start_timer(unsigned int timeout);
 void wait_timer(void);
 void stop_timer(void);
 
+/* Lateness of the threads woken up on a timer deadline. This
+   is the scheduling jitter of the threads waiting on timers. */
+struct timer_jitter {
+  unsigned long expiries; /* deadlines reached */
+  unsigned long late_sum; /* total lateness in microseconds */
+  unsigned long late_max; /* maximum lateness in microseconds */
+};
+
+void timer_jitter(struct timer_jitter *jitter);
+
+/* Monotonic clock in microseconds. */
+unsigned long clock_us(void);
+
+/* Maximum number of slots. */
+#define MAX_SLOTS 8
+
+/* Confirmation slots of a G3-PLC instance, initialized with
+   slots_init() before use. */
+struct slots {
+  pthread_mutex_t lock;
+  struct slot {
+    pthread_cond_t cond;
+    int signaled;
+  } slot[MAX_SLOTS];
+};
+
+/* Arm/wait/signal a slot.
+   Each slot can be waited on independently from another thread.
+   The wait function returns when the slot has been signaled since
+   it was armed or when the timeout (in microseconds) expires.
+   The slot_*() functions use the default slots and ignore the
+   data argument (the G3-PLC context data), the slots_*() variants
+   are for the other modems of the tool (see --modem). */
+void slots_init(struct slots *s);
+void slots_arm(struct slots *s, unsigned int slot);
+void slots_wait(struct slots *s, unsigned int slot, unsigned int timeout);
+void slots_signal(struct slots *s, unsigned int slot);
+
+void slot_arm(unsigned int slot, void *data);
+void slot_wait(unsigned int slot, unsigned int timeout, void *data);
+void slot_signal(unsigned int slot, void *data);
+
 #endif /* _TIMER_H_ */
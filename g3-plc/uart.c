@@ -22,27 +22,42 @@
    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/ioctl.h>
 #include <stdlib.h>
 #include <termios.h>
+#include <pthread.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
 #include <errno.h>
 #include <err.h>
 
+#include "custom-baud.h"
+#include "capture.h"
 #include "xatoi.h"
+#include "common.h"
 #include "uart.h"
 #include "g3-plc/g3plc.h"
+#include "g3-plc/pack.h"
 
-static int fd;
-static struct termios tty = {
-  .c_cflag = (CS8 | CLOCAL | CREAD) & ~CRTSCTS,
-  .c_iflag = IGNPAR,
-  .c_oflag = 0,
-  .c_lflag = 0,
-  .c_cc[VMIN]  = 1,
-  .c_cc[VTIME] = 0,
-};
+#ifdef __linux__
+# include <linux/serial.h>
+#endif /* __linux__ */
 
+/* Line driven through uart_send() and the other functions of the
+   default instance. */
+static struct uart default_uart;
+
+/* Wait for the output queue to drain after each frame. */
+static int drain;
+
+/* Busy poll budget in microseconds (0 to block on read). */
+static unsigned long spin_budget;
+
+/* Line discipline of the read loop, 0 for the framer in user space
+   (see set_uart_ldisc()). Cleared when a line refused it. */
+static int ldisc;
 
 static speed_t int2baud(int speed)
 {
@@ -50,7 +65,13 @@ static speed_t int2baud(int speed)
     int     intval;
     speed_t baud;
   } *b, bauds[] = {
+#ifdef B1000000
+    { 1000000, B1000000 },
+#endif
     { 921600, B921600 },
+#ifdef B500000
+    { 500000, B500000 },
+#endif
     { 460800, B460800 },
     { 230400, B230400 },
     { 115200, B115200 },
@@ -94,42 +115,104 @@ ERR:
   errx(EXIT_FAILURE, "unrecognized speed");
 }
 
-int set_uart_speed(unsigned int speed)
+int uart_set_speed(struct uart *u, unsigned int speed)
 {
   int r;
   speed_t baudrate = int2baud(speed);
 
-  if(baudrate == B0)
+  /* the bytes already written go out at the previous speed */
+  if(tcdrain(u->fd) < 0)
     return -1;
 
-  tcgetattr(fd, &tty);
-  r = cfsetspeed(&tty, baudrate);
-  tcsetattr(fd, TCSANOW, &tty);
-  tcflush(fd, TCOFLUSH);
+  /* rates without a Bxxx constant */
+  if(baudrate == B0) {
+    r = set_custom_baud(u->fd, speed);
+    tcgetattr(u->fd, &u->tty);
+    tcflush(u->fd, TCOFLUSH);
+    return r < 0 ? r : 0;
+  }
+
+  tcgetattr(u->fd, &u->tty);
+  r = cfsetspeed(&u->tty, baudrate);
+  tcsetattr(u->fd, TCSANOW, &u->tty);
+  tcflush(u->fd, TCOFLUSH);
 
   if(r < 0)
     return r;
   return 0;
 }
 
+int set_uart_speed(unsigned int speed, void *data)
+{
+  UNUSED(data);
+  return uart_set_speed(&default_uart, speed);
+}
+
 
-void serial_init(const char *path, speed_t speed)
+/* Ask the serial driver to push the received bytes to the tty layer
+   right away. USB adapters (FTDI, PL2303) otherwise hold them for up
+   to 16ms which is enough to miss an ACK. We also keep the size of
+   the hardware FIFO reported by the driver. */
+static void serial_driver_init(struct uart *u, unsigned int flags)
 {
-  fd = open(path, O_RDWR | O_NOCTTY);
-  if(fd < 0)
-    err(EXIT_FAILURE, "cannot open serial port");
+#ifdef TIOCGSERIAL
+  struct serial_struct serial;
+
+  if(ioctl(u->fd, TIOCGSERIAL, &serial) < 0) {
+    if(flags & UART_LOW_LATENCY)
+      warn("cannot set low latency mode");
+    return;
+  }
+
+  u->fifo_size = serial.xmit_fifo_size;
+
+  if(flags & UART_LOW_LATENCY) {
+    serial.flags |= ASYNC_LOW_LATENCY;
+    if(ioctl(u->fd, TIOCSSERIAL, &serial) < 0)
+      warn("cannot set low latency mode");
+  }
+#else
+  if(flags & UART_LOW_LATENCY)
+    warnx("low latency mode not supported");
+#endif /* TIOCGSERIAL */
+}
+
+void uart_open(struct uart *u, const char *path, speed_t speed, unsigned int flags)
+{
+  *u = (struct uart){
+    .fd  = open(path, O_RDWR | O_NOCTTY),
+    .tty = {
+      .c_cflag = (CS8 | CLOCAL | CREAD) & ~CRTSCTS,
+      .c_iflag = IGNPAR,
+      .c_oflag = 0,
+      .c_lflag = 0,
+      .c_cc[VMIN]  = 1,
+      .c_cc[VTIME] = 0,
+    }
+  };
+  if(u->fd < 0)
+    err(EXIT_FAILURE, "cannot open serial port %s", path);
 
   /* initial checks */
-  if(!isatty(fd))
-    err(EXIT_FAILURE, "invalid serial port");
+  if(!isatty(u->fd))
+    err(EXIT_FAILURE, "invalid serial port %s", path);
 
   /* we only setup the speed if requested */
   if(speed != B0)
-    cfsetspeed(&tty, speed);
+    cfsetspeed(&u->tty, speed);
+
+  if(flags & UART_RTSCTS)
+    u->tty.c_cflag |= CRTSCTS;
 
-  if(tcsetattr(fd, TCSANOW, &tty) < 0)
+  /* We keep VMIN to 1 even in low latency mode. The framer
+     is a byte-stream scanner for the 0x7e delimiters and the
+     boot loader answers with single bytes. */
+
+  if(tcsetattr(u->fd, TCSANOW, &u->tty) < 0)
     err(EXIT_FAILURE, "cannot set tty attributes");
 
+  serial_driver_init(u, flags);
+
   /* Some operating systems (eg Linux) bufferise the UART input
      even when the file descriptor is not opened. This may be
      useful in a lot of ca ses. However we may lay with incomplete
@@ -138,35 +221,248 @@ void serial_init(const char *path, speed_t speed)
      to wait a bit before actually flushing. Otherwise the flush
      command would have no effect. */
   usleep(500);
-  tcflush(fd, TCIOFLUSH);
+  tcflush(u->fd, TCIOFLUSH);
 }
 
-int uart_send(const void *buf, unsigned int size)
+void serial_init(const char *path, speed_t speed, unsigned int flags)
 {
-  int r = write(fd, buf, size);
+  uart_open(&default_uart, path, speed, flags);
+}
 
-  if(r < 0)
-    return r;
+/* Wait until the line accepts more bytes. This only
+   happens when the line is non-blocking (eg a pty). */
+static int wait_output(const struct uart *u)
+{
+  struct pollfd pfd = { .fd = u->fd, .events = POLLOUT };
+  int r;
+
+  do
+    r = poll(&pfd, 1, -1);
+  while(r < 0 && errno == EINTR);
+
+  return r < 0 ? r : 0;
+}
+
+/* Return true when a failed write may be retried. */
+static int write_again(const struct uart *u)
+{
+  if(errno == EINTR)
+    return 1;
+  if(errno == EAGAIN || errno == EWOULDBLOCK)
+    return wait_output(u) == 0;
   return 0;
 }
 
-int uart_read(void *buf, unsigned int size)
+/* Called once a whole frame was written. We sample the depth of
+   the output queue and wait for it to drain when requested so
+   that the caller arms its timers at the end of transmission. */
+static int end_frame(struct uart *u)
 {
-  int r = read(fd, buf, size);
+#ifdef TIOCOUTQ
+  int queued;
+
+  if(!ioctl(u->fd, TIOCOUTQ, &queued)) {
+    u->tx_queued = queued;
+    if(u->tx_queued > u->tx_queued_max)
+      u->tx_queued_max = u->tx_queued;
+  }
+#endif /* TIOCOUTQ */
+
+  if(!drain)
+    return 0;
+
+  while(tcdrain(u->fd) < 0)
+    if(errno != EINTR)
+      return -1;
+  return 0;
+}
+
+int uart_write(struct uart *u, const void *buf, unsigned int size)
+{
+  const unsigned char *b = buf;
+  ssize_t r;
+
+  /* A write may be short when interrupted or when the
+     output queue is full, so we loop until everything
+     was written. */
+  capture(CAPTURE_UART, CAPTURE_TX, buf, size);
+
+  while(size) {
+    r = write(u->fd, b, size);
+    if(r < 0) {
+      if(write_again(u))
+        continue;
+      return r;
+    }
+
+    b    += r;
+    size -= r;
+    u->tx_bytes += r;
+  }
+
+  return end_frame(u);
+}
+
+int uart_send(const void *buf, unsigned int size, void *data)
+{
+  UNUSED(data);
+  return uart_write(&default_uart, buf, size);
+}
+
+void set_uart_drain(int enable)
+{
+  drain = enable;
+}
+
+int uart_line_read(struct uart *u, void *buf, unsigned int size)
+{
+  int r = read(u->fd, buf, size);
 
   if(r < 0)
     return r;
+  u->rx_bytes += r;
+  capture(CAPTURE_UART, CAPTURE_RX, buf, r);
   return 0;
 }
 
-void uart_read_loop(void)
+int uart_read(void *buf, unsigned int size, void *data)
+{
+  UNUSED(data);
+  return uart_line_read(&default_uart, buf, size);
+}
+
+void set_uart_busy_poll(unsigned long us)
+{
+  spin_budget = us;
+}
+
+static unsigned long long elapsed_ns(const struct timespec *begin)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - begin->tv_sec) * 1000000000ULL + now.tv_nsec - begin->tv_nsec;
+}
+
+/* Spin on a non-blocking read until some bytes arrive. Once the
+   line stayed idle for the whole budget we sleep in poll() until
+   the next byte and spin again from there. */
+static ssize_t read_spin(struct uart *u, void *buf, size_t size)
+{
+  struct pollfd pfd = { .fd = u->fd, .events = POLLIN };
+  struct timespec begin;
+  unsigned long long ns;
+  ssize_t r;
+
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  while(1) {
+    r = read(u->fd, buf, size);
+    if(r > 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+      break;
+
+    ns = elapsed_ns(&begin);
+    if(ns < spin_budget * 1000)
+      continue;
+
+    /* idle, sleep until the next byte */
+    u->spin_ns += ns;
+    u->spin_sleeps++;
+    if(poll(&pfd, 1, -1) < 0 && errno != EINTR)
+      return -1;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+  }
+
+  u->spin_ns += elapsed_ns(&begin);
+  return r;
+}
+
+static void sample_rx_queue(struct uart *u)
+{
+  int queued;
+
+  if(!ioctl(u->fd, FIONREAD, &queued) && (unsigned int)queued > u->rx_queued_max)
+    u->rx_queued_max = queued;
+}
+
+void set_uart_ldisc(int disc)
+{
+  ldisc = disc;
+}
+
+#ifdef TIOCSETD
+/* The boot sequence reads the bytes of the loader from the
+   tty itself, so the line goes back to N_TTY when the read
+   loop is cancelled (see the warm attach in main.c). */
+static void restore_line_discipline(void *p)
+{
+  const struct uart *u = p;
+  int disc = N_TTY;
+
+  if(ioctl(u->fd, TIOCSETD, &disc) < 0)
+    warn("cannot restore line discipline");
+}
+#endif /* TIOCSETD */
+
+/* Read one frame per read() from the line discipline. The frames
+   are packed again for the capture so that it holds the same byte
+   stream as without the line discipline. */
+static void read_frames(struct uart *u, struct g3plc_ctx *plc)
+{
+  unsigned char buf[G3PLC_MAX_CMD + 1]; /* one more to tell the oversized ones */
+  unsigned char packed[2 * sizeof(buf) + 2];
+
+  while(1) {
+    ssize_t size = spin_budget ? read_spin(u, buf, sizeof(buf)) :
+                                 read(u->fd, buf, sizeof(buf));
+    if(size <= 0) {
+      if(errno == EINTR)
+        /* signal caught */
+        continue;
+      err(EXIT_FAILURE, "cannot read");
+    }
+
+    u->rx_bytes += size;
+    if(capture_active())
+      capture(CAPTURE_UART, CAPTURE_RX, packed, pack(packed, buf, size));
+
+    g3plc_uart_frame(plc, buf, size);
+  }
+}
+
+void uart_loop(struct uart *u, struct g3plc_ctx *plc)
 {
   unsigned char buf[UART_BUFFER_SIZE];
+  int disc = ldisc;
+
+  if(spin_budget) {
+    int flags = fcntl(u->fd, F_GETFL);
+
+    if(flags < 0 || fcntl(u->fd, F_SETFL, flags | O_NONBLOCK) < 0)
+      err(EXIT_FAILURE, "cannot set non-blocking line");
+  }
+
+#ifdef TIOCSETD
+  if(disc && ioctl(u->fd, TIOCSETD, &disc) < 0) {
+    warn("cannot set line discipline %d, framing in user space", disc);
+    disc = 0;
+  }
+
+  if(disc) {
+    pthread_cleanup_push(restore_line_discipline, u);
+    read_frames(u, plc);
+    pthread_cleanup_pop(1);
+  }
+#else
+  if(disc) {
+    warnx("line disciplines not supported, framing in user space");
+    disc = 0;
+  }
+#endif /* TIOCSETD */
 
   /* loop for messages */
   while(1) {
-    int i;
-    ssize_t size = read(fd, buf, UART_BUFFER_SIZE);
+    ssize_t size = spin_budget ? read_spin(u, buf, UART_BUFFER_SIZE) :
+                                 read(u->fd, buf, UART_BUFFER_SIZE);
     if(size <= 0) {
       if(errno == EINTR)
         /* signal caught */
@@ -174,8 +470,56 @@ void uart_read_loop(void)
       err(EXIT_FAILURE, "cannot read");
     }
 
+    u->rx_bytes += size;
+    capture(CAPTURE_UART, CAPTURE_RX, buf, size);
+
+    /* a full read means that we are falling behind */
+    if(size == UART_BUFFER_SIZE)
+      sample_rx_queue(u);
+
     /* flush buffer */
-    for(i = 0 ; i < size ; i++)
-      g3plc_uart_putc(buf[i]);
+    g3plc_uart_feed(plc, buf, size);
   }
 }
+
+void uart_read_loop(struct g3plc_ctx *plc)
+{
+  uart_loop(&default_uart, plc);
+}
+
+void uart_line_stats(const struct uart *u, struct uart_stats *stats)
+{
+#ifdef TIOCGICOUNT
+  struct serial_icounter_struct icount;
+#endif /* TIOCGICOUNT */
+  int queued;
+
+  *stats = (struct uart_stats){ .tx_bytes      = u->tx_bytes,
+                                .rx_bytes      = u->rx_bytes,
+                                .tx_queued     = u->tx_queued,
+                                .tx_queued_max = u->tx_queued_max,
+                                .fifo_size     = u->fifo_size,
+                                .spin_us       = u->spin_ns / 1000,
+                                .spin_sleeps   = u->spin_sleeps };
+
+  if(!ioctl(u->fd, FIONREAD, &queued))
+    stats->rx_queued = queued;
+  stats->rx_queued_max = u->rx_queued_max;
+  if(stats->rx_queued > stats->rx_queued_max)
+    stats->rx_queued_max = stats->rx_queued;
+
+#ifdef TIOCGICOUNT
+  if(!ioctl(u->fd, TIOCGICOUNT, &icount)) {
+    stats->hw_overruns   = icount.overrun;
+    stats->buf_overruns  = icount.buf_overrun;
+    stats->frame_errors  = icount.frame;
+    stats->parity_errors = icount.parity;
+    stats->overruns      = icount.overrun + icount.buf_overrun;
+  }
+#endif /* TIOCGICOUNT */
+}
+
+void uart_stats(struct uart_stats *stats)
+{
+  uart_line_stats(&default_uart, stats);
+}
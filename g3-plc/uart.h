@@ -28,26 +28,121 @@
 #include <sys/types.h>
 #include <termios.h>
 
-#define UART_BUFFER_SIZE 1024
+#include "g3-plc/g3plc-conf.h" /* UART_BUFFER_SIZE */
+#include "g3-plc/g3plc.h"
+
+/* UART statistics (see uart_stats()) */
+struct uart_stats {
+  unsigned long tx_bytes;
+  unsigned long rx_bytes;
+  unsigned long overruns;      /* bytes lost by the serial driver */
+  unsigned long hw_overruns;   /* bytes lost by the UART itself */
+  unsigned long buf_overruns;  /* bytes lost because the tty buffer was full */
+  unsigned long frame_errors;  /* bytes received with a framing error */
+  unsigned long parity_errors; /* bytes received with a parity error */
+  unsigned int  tx_queued;     /* output queue depth after the last frame */
+  unsigned int  tx_queued_max; /* maximum of tx_queued */
+  unsigned int  rx_queued;     /* bytes received but not read yet */
+  unsigned int  rx_queued_max; /* maximum of rx_queued after a full read */
+  unsigned int  fifo_size;     /* hardware FIFO size (0 when unknown) */
+  unsigned long spin_us;       /* time spent spinning on reads (see set_uart_busy_poll()) */
+  unsigned long spin_sleeps;   /* spins that ran out of budget and slept */
+};
+
+/* Serial line flags (see serial_init()) */
+enum uart_flags {
+  UART_LOW_LATENCY = 1 << 0, /* do not delay the received bytes */
+  UART_RTSCTS      = 1 << 1, /* hardware flow control */
+};
+
+/* A serial line. Each counter is only updated by one thread (the
+   senders under the driver lock, the read loop) so they are read
+   without any lock. Most callers only drive the default line with
+   serial_init() and the functions that follow, the uart_*() variants
+   on a line are for the other modems of the tool (see --modem). */
+struct uart {
+  int fd;
+  struct termios tty;
+
+  unsigned long tx_bytes;
+  unsigned long rx_bytes;
+
+  /* Output queue depth after the last frame and its maximum
+     (only known with TIOCOUTQ). Updated by the senders. */
+  unsigned int tx_queued;
+  unsigned int tx_queued_max;
+
+  /* Hardware FIFO size reported by the serial driver. */
+  unsigned int fifo_size;
+
+  /* Deepest input queue seen after a read that filled the
+     whole buffer. Only updated by the read thread. */
+  unsigned int rx_queued_max;
+
+  /* Time spent spinning (see set_uart_busy_poll()). */
+  unsigned long long spin_ns;
+  unsigned long      spin_sleeps;
+};
 
 /* Convert a string to a serial speed. */
 speed_t baud(const char *arg);
 
 /* Open and setup the serial line and return a file descriptor to the serial
    line. The line will be left untouched if the speed is B0. Otherwise it will
-   use a default configuration for the line (8N1). */
-void serial_init(const char *path, speed_t speed);
+   use a default configuration for the line (8N1). The flags select the low
+   latency profile and hardware flow control (see uart_flags). */
+void serial_init(const char *path, speed_t speed, unsigned int flags);
+void uart_open(struct uart *u, const char *path, speed_t speed, unsigned int flags);
 
-/* Send a message over the configured UART stream. */
-int uart_send(const void *buf, unsigned int size);
+/* Send a message over the configured UART stream.
+   The data argument is the G3-PLC context data. */
+int uart_send(const void *buf, unsigned int size, void *data);
+int uart_write(struct uart *u, const void *buf, unsigned int size);
 
 /* Read a message from the configured UART stream. */
-int uart_read(void *buf, unsigned int size);
+int uart_read(void *buf, unsigned int size, void *data);
+int uart_line_read(struct uart *u, void *buf, unsigned int size);
 
-/* Start the UART read loop. */
-void uart_read_loop(void);
+/* Start the UART read loop, the received bytes go to plc. */
+void uart_read_loop(struct g3plc_ctx *plc);
+void uart_loop(struct uart *u, struct g3plc_ctx *plc);
 
 /* Change UART baudrate. */
-int set_uart_speed(unsigned int speed);
+int set_uart_speed(unsigned int speed, void *data);
+int uart_set_speed(struct uart *u, unsigned int speed);
+
+/* Wait for the output queue to drain after each frame so that
+   uart_send() only returns once the frame left the UART. The
+   timers armed after it then start at the end of transmission. */
+void set_uart_drain(int enable);
+
+/* Spin on non-blocking reads in the read loop instead of sleeping
+   in read() until the line stayed idle for the budget in
+   microseconds (0 to disable). This trades a whole CPU for the
+   wakeup latency of each frame, so the read thread should run
+   on an isolated core (see --rt). */
+void set_uart_busy_poll(unsigned long us);
+
+/* Read the line through the line discipline disc (see tty_ioctl(4))
+   in the read loop instead of the framer in user space (0, the
+   default). Each read() must then return one whole command without
+   its delimiters and unescaped (see g3plc_uart_frame()), so the
+   wakeups and the scanning of the byte stream are left to the
+   kernel. N_HDLC only does so for serial drivers that deliver
+   whole frames (synchronous HDLC), a UART needs a discipline that
+   deframes 0x7e/0x7d. The boot sequence still reads the raw bytes,
+   the line only switches to disc once the read loop starts and
+   goes back to N_TTY when it is cancelled. When a line refuses
+   the discipline its read loop keeps the framer in user space.
+   The received bytes are then counted once unescaped. */
+void set_uart_ldisc(int disc);
+
+/* Copy the UART statistics. The overruns and the line errors are
+   only known on Linux and only for serial ports that report them.
+   Bytes lost with an empty receive queue point to interference on
+   the line while overruns with a deep queue point to a read thread
+   that does not get enough CPU. */
+void uart_stats(struct uart_stats *stats);
+void uart_line_stats(const struct uart *u, struct uart_stats *stats);
 
 #endif /* _UART_H_ */
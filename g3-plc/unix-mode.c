@@ -22,23 +22,46 @@
    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifdef __linux__
+# define _POSIX_C_SOURCE 200112L
+#endif /* __linux__ */
+
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <semaphore.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <getopt.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
 #include <err.h>
 
 #include "g3-plc/g3plc-str.h"
 #include "g3-plc/g3plc.h"
 #include "safe-call.h"
+#include "prof.h"
+#include "scale.h"
 #include "string-utils.h"
+#include "subscribe.h"
+#include "admit.h"
+#include "batch.h"
+#include "pool.h"
+#include "txopt.h"
+#include "txq.h"
+#include "agg.h"
 #include "version.h"
 #include "common.h"
+#include "xatoi.h"
+#include "timer.h"
+#include "modems.h"
 #include "mode.h"
 #include "main.h"
+#include "log.h"
 #include "help.h"
 
 /*
@@ -47,23 +70,234 @@
   successful transmission. The message format for incoming
   and outgoing messages is specified below (see cb_recv() and
   start()).
+
+  Datagrams are read and written in batches with recvmmsg()
+  and sendmmsg(). Received frames are pushed to the application
+  when the batch is full or when no other frame was received
+  within the flush timeout.
+
+  Other applications may subscribe to received frames with
+  the message format given in subscribe.h on the subscription
+  socket. The application socket is always subscribed to all
+  frames.
+
+  With --tx-status each send message is prefixed with an ID
+  chosen by the application and frames are sent without waiting
+  for their confirmation (see g3plc_send_async()), so that the
+  modem always has frames to transmit. The status of each frame
+  is reported to the sender address once it is confirmed (see
+  send_status()). The sender socket must be bound to a path.
+
+  With --priority each send message is also prefixed with its
+  priority class (see txq_class) and queued to a transmit
+  thread. Urgent frames then overtake the queued bulk frames,
+  either strictly or according to the class weights with
+  --weighted. Alarms are also sent with the high priority
+  QoS of the modem (see g3plc_qos).
+
+  With --fair the requests of each class are also served by deficit
+  round-robin among their destinations (see txq_fair()), so that
+  the backlog of one destination does not hold the others back. A
+  destination that does not acknowledge its frames gets a smaller
+  share until it answers again.
+
+  With --tx-options each send message is also prefixed with its
+  options (see txopt.h), after the class. A loss tolerant message
+  is sent without ACK and a critical one with an ACK even with
+  --no-ack, so that both share a daemon. The retransmissions are
+  a MAC attribute of the modem, TXOPT_TRIES is ignored.
+
+  With --aggregate the queued messages for the same destination
+  are packed into one frame (see agg.h), waiting up to the hold
+  time for each next message. Received frames are split back
+  into messages, so both ends must use this option.
+
+  With --credits each client may have at most this number of send
+  messages in flight and with --rate-limit each client may only
+  send this number of bytes per second (see admit.h). Messages
+  over a limit are rejected at once, with ADMIT_ERR_WINDOW or
+  ADMIT_ERR_RATE as their status. With --credits the status
+  messages also carry the credits left to the client, which
+  may send that many messages before the next status. The
+  credits need --tx-status.
+
+  With --client-quota a client, given by the address its socket
+  is bound to, has limits of its own instead: ADDR:CREDITS:RATE
+  where a null limit is disabled for this client. Its bursts are
+  the larger of --burst and its rate. With --client-stats or any
+  of the limits the messages, bytes, outcomes and messages in
+  flight of each client are counted (see admit_read()) and
+  written with the metrics.
+
+  With --modem the frames to the nodes of another modem go through
+  it. The sends with --tx-status always go through the main modem
+  since the handles of their confirmations are those of its driver.
+
+  With --timestamps each recv message also carries the clock
+  when the first byte of the frame was read from the UART and
+  the symbol time reported by the modem (see g3plc_ind), so that
+  clients can measure latencies and order frames.
+
+  A client can send the single byte SUB_STATS on the subscription
+  socket to get the latency of each stage of the driver (see
+  g3plc_stats()). The reply is a text datagram with one line per
+  stage: the number of samples and the 50th, 90th and 99th
+  percentiles with the maximum.
 */
 
 #define BUF_SIZE G3PLC_MAX_CMD
 
+/* default number of datagrams per batch */
+#define DEFAULT_BATCH 16
+
+/* number of queued transmit requests per class (power of two) */
+#define TX_QUEUE_DEPTH 64
+
+/* maximum number of requests sent in one frame */
+#define TX_MAX_SENDERS 256
+
+enum opt {
+  OPT_BATCH = 0x200, /* after common options */
+  OPT_FLUSH_TIMEOUT,
+  OPT_SUB_PATH,
+  OPT_TX_STATUS,
+  OPT_TX_OPTIONS,
+  OPT_PRIORITY,
+  OPT_WEIGHTED,
+  OPT_FAIR,
+  OPT_AGGREGATE,
+  OPT_HOLD_TIME,
+  OPT_TIMESTAMPS,
+  OPT_CREDITS,
+  OPT_RATE_LIMIT,
+  OPT_BURST,
+  OPT_CLIENT_QUOTA,
+  OPT_CLIENT_STATS
+};
+
+/* A send message, possibly waiting for the transmit thread. */
+struct tx_request {
+  struct sockaddr_un from;
+  enum txq_class class;
+  uint8_t opts; /* see txopt.h */
+  uint16_t id;
+  uint16_t dst;
+  unsigned int size;
+  unsigned char payload[BUF_SIZE];
+};
+
+/* Sender of a request being transmitted. */
+struct tx_sender {
+  struct sockaddr_un from;
+  uint16_t id;
+};
+
+/* Source of a received aggregate. */
+struct rx_info {
+  const struct g3plc_ind *ind;
+  int status;
+};
+
+/* Frames sent asynchronously awaiting their confirmation,
+   indexed by MSDU handle. The confirmation may arrive before
+   g3plc_send_async() returns the handle, in which case its
+   status is kept until the frame is registered. */
+enum tx_state {
+  TX_FREE,
+  TX_WAITING,  /* waiting for the confirmation */
+  TX_CONFIRMED /* confirmed before registration */
+};
+
+struct tx_pending {
+  enum tx_state state;
+  int status;
+  unsigned int count;         /* number of senders */
+  struct tx_sender *senders;  /* senders of the frame (allocated) */
+  uint16_t dst;               /* destination of the frame (see --fair) */
+};
+
 static int sd;
+static int sub_sd;
 static const char *socket_driver_path = PACKAGE "-driver.sock";
 static const char *socket_app_path = PACKAGE "-app.sock";
-static struct sockaddr_un client;
+static const char *socket_sub_path = PACKAGE "-sub.sock";
+
+/* Batches of incoming (from the application)
+   and outgoing (to the application) datagrams. */
+static unsigned int batch_size = DEFAULT_BATCH;
+static struct batch in_batch;
+static struct batch out_batch;
+static struct pool  rec_pool;
+
+/* Asynchronous and prioritized transmit requests. */
+static int tx_status;
+static int tx_priority;
+static int tx_options;
+static enum txq_policy tx_policy = TXQ_STRICT;
+static int tx_fair;
+static struct txq tx_queue;
+static pthread_t tx_thread;
+
+/* Frame being built by the transmit thread. */
+static int aggregate;
+static unsigned int hold_time;
+static int timestamps;
+static unsigned char tx_buf[G3PLC_MAX_PAYLOAD];
+static struct tx_sender tx_senders[TX_MAX_SENDERS];
+static unsigned int tx_timeout;
+static struct tx_pending tx_pending[256];
+static pthread_mutex_t tx_lock = PTHREAD_MUTEX_INITIALIZER;
+static sem_t tx_confirm; /* posted on each confirmation */
+
+/* Admission control of the clients (see admit.h). */
+static int admission;
+static unsigned int credits;
+static unsigned long rate_limit;
+static unsigned long burst;
+static const char *quotas[ADMIT_MAX_QUOTAS];
+static unsigned int nquotas;
+static int client_stats;
 
 struct option unix_opts[] = {
   { "driver-path", required_argument, NULL, 'L' },
   { "app-path", required_argument, NULL, 'R' },
+  { "batch", required_argument, NULL, OPT_BATCH },
+  { "flush-timeout", required_argument, NULL, OPT_FLUSH_TIMEOUT },
+  { "sub-path", required_argument, NULL, OPT_SUB_PATH },
+  { "tx-status", no_argument, NULL, OPT_TX_STATUS },
+  { "tx-options", no_argument, NULL, OPT_TX_OPTIONS },
+  { "priority", no_argument, NULL, OPT_PRIORITY },
+  { "weighted", no_argument, NULL, OPT_WEIGHTED },
+  { "fair", no_argument, NULL, OPT_FAIR },
+  { "aggregate", no_argument, NULL, OPT_AGGREGATE },
+  { "hold-time", required_argument, NULL, OPT_HOLD_TIME },
+  { "timestamps", no_argument, NULL, OPT_TIMESTAMPS },
+  { "credits", required_argument, NULL, OPT_CREDITS },
+  { "rate-limit", required_argument, NULL, OPT_RATE_LIMIT },
+  { "burst", required_argument, NULL, OPT_BURST },
+  { "client-quota", required_argument, NULL, OPT_CLIENT_QUOTA },
+  { "client-stats", no_argument, NULL, OPT_CLIENT_STATS },
   { NULL, 0, NULL, 0 }
 };
 struct opt_help unix_messages[] = {
   { 'L', "driver-path", "Driver Unix socket path" },
   { 'R', "app-path", "Application Unix socket path" },
+  { 0,   "batch", "Number of datagrams per batch (default 16)" },
+  { 0,   "flush-timeout", "Delay in microseconds before a partial batch is sent (default 0)" },
+  { 0,   "sub-path", "Subscription Unix socket path" },
+  { 0,   "tx-status", "Identify send messages and report their status" },
+  { 0,   "tx-options", "Prefix send messages with their ACK options" },
+  { 0,   "priority", "Prefix send messages with their priority class" },
+  { 0,   "weighted", "Serve priority classes by weight instead of strictly" },
+  { 0,   "fair", "Share each priority class among the destinations" },
+  { 0,   "aggregate", "Pack small messages to the same destination in one frame" },
+  { 0,   "hold-time", "Delay in microseconds to wait for more messages to send (default 0)" },
+  { 0,   "timestamps", "Prefix recv messages with the receive and symbol times" },
+  { 0,   "credits", "Send messages in flight allowed to each client (up to 255)" },
+  { 0,   "rate-limit", "Bytes per second allowed to each client" },
+  { 0,   "burst", "Bytes a client may send at once within its rate (default one second)" },
+  { 0,   "client-quota", "Limits of one client as ADDR:CREDITS:RATE (repeatable)" },
+  { 0,   "client-stats", "Count the messages of each client without limits" },
   { 0, NULL, NULL }
 };
 
@@ -71,39 +305,450 @@ static void exit_clean(void)
 {
   unlink(socket_driver_path);
   unlink(socket_app_path);
+  unlink(socket_sub_path);
 }
 
-static void cb_recv(const struct g3plc_data_hdr *hdr,
-                    const void *payload, unsigned payload_size,
-                    int status, void *data)
+static void flush(const struct context *ctx)
 {
-  UNUSED(data);
+  UNUSED(ctx);
 
+  sub_flush(sd, &out_batch);
+}
+
+static void publish(const struct g3plc_ind *ind,
+                    const void *payload, unsigned payload_size,
+                    int status)
+{
   /* recv message format:
-     [status (u8)][src (u16)][dst (u16)][payload] */
-  unsigned char buf[BUF_SIZE];
-  unsigned char *b = buf;
-  size_t  len = payload_size + sizeof(uint8_t) + sizeof(uint16_t) * 2;
-  ssize_t n;
+     [status (u8)][src (u16)][dst (u16)][payload]
+     with --timestamps:
+     [status (u8)][src (u16)][dst (u16)][stamp us (u64)][symbols (u32)][payload]
+     The stamp is CLOCK_MONOTONIC when the first byte was read. */
+  unsigned char *record, *b;
+  size_t len = payload_size + sizeof(uint8_t) + sizeof(uint16_t) * 2;
+  uint64_t stamp;
+  uint32_t symbols;
+
+  if(timestamps)
+    len += sizeof(uint64_t) + sizeof(uint32_t);
+
+  if(len > BUF_SIZE) {
+    warnx("frame too large");
+    return;
+  }
+
+  b = record = pool_get(&rec_pool);
+  if(!record) {
+    warnx("out of record buffers, frame dropped");
+    return;
+  }
 
   *(uint8_t  *)b = status;        b += sizeof(uint8_t);
-  *(uint16_t *)b = hdr->src_addr; b += sizeof(uint16_t);
-  *(uint16_t *)b = hdr->dst_addr; b += sizeof(uint16_t);
+  *(uint16_t *)b = g3plc_ind_src(ind); b += sizeof(uint16_t);
+  *(uint16_t *)b = g3plc_ind_dst(ind); b += sizeof(uint16_t);
+
+  if(timestamps) {
+    stamp   = ind->stamp;
+    symbols = g3plc_ind_time(ind);
+    memcpy(b, &stamp, sizeof(stamp));     b += sizeof(uint64_t);
+    memcpy(b, &symbols, sizeof(symbols)); b += sizeof(uint32_t);
+  }
 
   memcpy(b, payload, payload_size);
 
-  n = sendto(sd, buf, len, 0, (struct sockaddr *)&client, sizeof(struct sockaddr_un));
-  if(n != (ssize_t)len)
+  sub_publish(sd, &out_batch, &rec_pool, record, len, g3plc_ind_src(ind), status, 0);
+  pool_put(&rec_pool, record);
+}
+
+static void publish_record(const void *record, size_t size, void *data)
+{
+  const struct rx_info *info = data;
+
+  publish(info->ind, record, size, info->status);
+}
+
+static void cb_recv(const struct g3plc_ind *ind,
+                    const void *payload, unsigned payload_size,
+                    int status, void *data)
+{
+  struct rx_info info = { .ind    = ind,
+                          .status = status };
+
+  UNUSED(data);
+
+  /* frames with errors are passed as is */
+  if(!aggregate || status != G3PLC_RCV_SUCCESS) {
+    publish(ind, payload, payload_size, status);
+    return;
+  }
+
+  if(agg_split(payload, payload_size, publish_record, &info) < 0)
+    warnx("invalid aggregate");
+}
+
+static void send_status(const struct sockaddr_un *to, uint16_t id, int status)
+{
+  /* status message format:
+     [id (u16)][status (u8)][tx count (u8)][credits (u8)]
+     The modem does not report the number
+     of transmissions so the count is zero.
+     The credits are only present with --credits. */
+  unsigned char msg[sizeof(uint16_t) + sizeof(uint8_t) * 3];
+  unsigned char *b = msg;
+
+  if(!to->sun_path[0]) {
+    warnx("unbound client, cannot report status");
+    return;
+  }
+
+  *(uint16_t *)b = id;     b += sizeof(uint16_t);
+  *(uint8_t  *)b = status; b += sizeof(uint8_t);
+  *(uint8_t  *)b = 0;      b += sizeof(uint8_t);
+  if(credits) {
+    *(uint8_t *)b = admit_credits(to); b += sizeof(uint8_t);
+  }
+
+  if(sendto(sd, msg, b - msg, MSG_DONTWAIT, (struct sockaddr *)to, sizeof(*to)) < 0)
     warn("network error"); /* we don't fail on client error */
 }
 
+/* Give back the credits of the senders of a frame. The modem
+   does not report its retransmissions, no time on air is known. */
+static void release(const struct tx_sender *senders, unsigned int count, int status)
+{
+  unsigned int i;
+
+  for(i = 0 ; admission && i < count ; i++)
+    admit_release(&senders[i].from, status, 0);
+}
+
+static void report(const struct tx_sender *senders, unsigned int count, int status)
+{
+  unsigned int i;
+
+  release(senders, count, status);
+  for(i = 0 ; i < count ; i++)
+    send_status(&senders[i].from, senders[i].id, status);
+}
+
+static void cb_sent(uint8_t handle, int status, void *data)
+{
+  const struct context *ctx = data;
+  struct tx_pending *pending = &tx_pending[handle];
+  struct tx_pending done;
+
+  pthread_mutex_lock(&tx_lock);
+  {
+    done = *pending;
+
+    if(pending->state == TX_WAITING)
+      pending->state = TX_FREE;
+    else {
+      pending->state  = TX_CONFIRMED;
+      pending->status = status;
+    }
+  }
+  pthread_mutex_unlock(&tx_lock);
+
+  IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG,
+                          "TX STATUS: %s (%d) for handle %d\n",
+                          g3plc_send2str(status), status, handle));
+
+  if(done.state == TX_WAITING) {
+    txq_feedback(&tx_queue, done.dst, status == G3PLC_SND_SUCCESS);
+    report(done.senders, done.count, status);
+    free(done.senders);
+  }
+
+  sem_post(&tx_confirm);
+}
+
+static int wait_confirm(void)
+{
+  struct timespec ts;
+
+  /* semaphores only wait on the realtime clock */
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec  += tx_timeout / 1000000;
+  ts.tv_nsec += (tx_timeout % 1000000) * 1000;
+  if(ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+
+  if(sem_timedwait(&tx_confirm, &ts) < 0) {
+    if(errno == ETIMEDOUT)
+      return 0;
+    if(errno != EINTR)
+      err(EXIT_FAILURE, "cannot wait for confirmation");
+  }
+
+  return 1;
+}
+
+/* Options of the frame of a request. The alarms also get the
+   channel first on air. The number of transmissions is a MAC
+   attribute so TXOPT_TRIES does not apply. */
+static struct g3plc_tx_opts frame_opts(enum txq_class class, uint8_t opts)
+{
+  struct g3plc_tx_opts o = { .qos = class == TXQ_ALARM ? G3PLC_QOS_HIGH : G3PLC_QOS_NORMAL };
+
+  if(opts & TXOPT_NOACK)
+    o.ack = G3PLC_ACK_OFF;
+  else if(opts & TXOPT_ACK)
+    o.ack = G3PLC_ACK_ON;
+  return o;
+}
+
+static void send_frame(const struct context *ctx, uint16_t dst,
+                       const void *payload, unsigned int size,
+                       enum txq_class class, uint8_t opts,
+                       const struct tx_sender *senders, unsigned int count)
+{
+  struct g3plc_tx_opts o = frame_opts(class, opts);
+  struct tx_pending *pending;
+  uint8_t handle;
+  int ret;
+
+  IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG,
+                          "Sending %d bytes to %04X (%d messages)\n",
+                          size, dst, count));
+
+  if(!tx_status) {
+    ret = g3plc_send_opts(modems_plc(ctx->plc, dst), dst, payload, size, &o);
+    IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG,
+                            "TX STATUS: %s (%d)\n", g3plc_send2str(ret), ret));
+    IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG, "---------\n"));
+    txq_feedback(&tx_queue, dst, ret == G3PLC_SND_SUCCESS);
+    release(senders, count, ret);
+    return;
+  }
+
+  /* When too many frames are in flight we wait for one of them to be
+     confirmed. Confirmations that never came are eventually dropped. */
+  while((ret = g3plc_send_async_opts(ctx->plc, G3PLC_CHAN_ANY, dst, payload, size,
+                                     &o, &handle)) == G3PLC_SND_BUSY) {
+    if(!wait_confirm()) {
+      warnx("confirmation timeout");
+      g3plc_send_flush(ctx->plc);
+    }
+  }
+
+  if(ret) {
+    IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG,
+                            "TX STATUS: %s (%d)\n", g3plc_send2str(ret), ret));
+    report(senders, count, ret);
+    return;
+  }
+
+  pending = &tx_pending[handle];
+
+  pthread_mutex_lock(&tx_lock);
+  {
+    if(pending->state == TX_CONFIRMED) {
+      pending->state = TX_FREE;
+      ret = pending->status;
+    }
+    else {
+      *pending = (struct tx_pending){ .state   = TX_WAITING,
+                                      .count   = count,
+                                      .senders = xmalloc(count * sizeof(struct tx_sender)),
+                                      .dst     = dst };
+      memcpy(pending->senders, senders, count * sizeof(struct tx_sender));
+      ret = -1;
+    }
+  }
+  pthread_mutex_unlock(&tx_lock);
+
+  if(ret >= 0) {
+    txq_feedback(&tx_queue, dst, ret == G3PLC_SND_SUCCESS);
+    report(senders, count, ret);
+  }
+}
+
+/* Flow and cost of a request (see --fair). */
+static unsigned int request_flow(const void *item)
+{
+  return ((const struct tx_request *)item)->dst;
+}
+
+static unsigned int request_cost(const void *item)
+{
+  return ((const struct tx_request *)item)->size;
+}
+
+static void send_request(const struct context *ctx, const struct tx_request *req)
+{
+  struct tx_sender sender = { .from = req->from,
+                              .id   = req->id };
+
+  send_frame(ctx, req->dst, req->payload, req->size, req->class, req->opts, &sender, 1);
+}
+
+static void * tx_thread_func(void *arg)
+{
+  const struct context *ctx = arg;
+  static struct tx_request req;
+  enum txq_class class;
+  unsigned int count;
+  struct agg frame;
+  uint16_t dst;
+  uint8_t opts;
+  int carry = 0;
+
+  prof_thread("tx");
+
+  while(1) {
+    /* Wait for a request unless one was left over from the
+       previous frame. With aggregation the next requests of
+       the same class and destination are packed in the same
+       frame, waiting up to the hold time for each of them. */
+    if(!carry)
+      txq_pop(&tx_queue, &req, 1);
+    carry = 0;
+
+    if(!aggregate) {
+      send_request(ctx, &req);
+      txq_complete(&tx_queue, req.class, 1);
+      continue;
+    }
+
+    dst   = req.dst;
+    class = req.class;
+    opts  = req.opts;
+
+    agg_init(&frame, tx_buf, sizeof(tx_buf));
+    agg_add(&frame, req.payload, req.size); /* checked when queued */
+    tx_senders[0] = (struct tx_sender){ .from = req.from,
+                                        .id   = req.id };
+    count = 1;
+
+    while(count < TX_MAX_SENDERS && txq_timedpop(&tx_queue, &req, hold_time) >= 0) {
+      if(req.dst != dst || req.class != class || req.opts != opts ||
+         agg_add(&frame, req.payload, req.size) < 0) {
+        carry = 1;
+        break;
+      }
+
+      tx_senders[count++] = (struct tx_sender){ .from = req.from,
+                                                .id   = req.id };
+    }
+
+    send_frame(ctx, dst, frame.buf, frame.size, class, opts, tx_senders, count);
+    txq_complete(&tx_queue, class, count);
+  }
+
+  return NULL;
+}
+
+static void queue_request(const struct context *ctx, const unsigned char *buf,
+                          unsigned int size, const struct sockaddr_un *from)
+{
+  static struct tx_request req;
+  unsigned int hdr_size = sizeof(uint16_t);
+
+  /* queued send message format:
+     [class (u8)][options (u8)][id (u16)][dst (u16)][payload]
+     The class is only present with --priority, the
+     options with --tx-options and the ID with --tx-status. */
+  if(tx_priority)
+    hdr_size += sizeof(uint8_t);
+  if(tx_options)
+    hdr_size += sizeof(uint8_t);
+  if(tx_status)
+    hdr_size += sizeof(uint16_t);
+
+  if(size <= hdr_size) {
+    warnx("message too short");
+    return;
+  }
+
+  req = (struct tx_request){ .from  = *from,
+                             .class = TXQ_CONTROL };
+
+  if(tx_priority) {
+    if(*buf >= TXQ_CLASSES) {
+      warnx("invalid priority class");
+      return;
+    }
+    req.class = *(uint8_t *)buf; buf += sizeof(uint8_t);
+  }
+  if(tx_options) {
+    req.opts = *(uint8_t *)buf; buf += sizeof(uint8_t);
+  }
+  if(tx_status) {
+    req.id = *(uint16_t *)buf; buf += sizeof(uint16_t);
+  }
+  req.dst  = *(uint16_t *)buf; buf += sizeof(uint16_t);
+  req.size = size - hdr_size;
+  memcpy(req.payload, buf, req.size);
+
+  /* a single message must fit in a frame */
+  if(aggregate && req.size + AGG_PREFIX_SIZE(req.size) > G3PLC_MAX_PAYLOAD) {
+    if(tx_status)
+      send_status(from, req.id, G3PLC_SND_TOOLONG);
+    else
+      warnx("message too long");
+    return;
+  }
+
+  if(admission) {
+    int ret = admit_request(from, req.size, clock_us());
+
+    if(ret) {
+      if(tx_status)
+        send_status(from, req.id, ret);
+      else
+        warnx("%s, frame dropped", ret == ADMIT_ERR_RATE ? "rate limit exceeded" : "no credit left");
+      return;
+    }
+  }
+
+  /* without priority, fairness nor aggregation the frame is sent right away */
+  if(!tx_priority && !tx_fair && !aggregate) {
+    send_request(ctx, &req);
+    return;
+  }
+
+  IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG,
+                          "Queuing %d bytes to %04X (ID %04X, class %d)\n",
+                          req.size, req.dst, req.id, req.class));
+
+  if(txq_push(&tx_queue, req.class, &req, NULL) < 0) {
+    if(admission)
+      admit_release(from, G3PLC_SND_BUSY, 0);
+    if(tx_status)
+      send_status(from, req.id, G3PLC_SND_BUSY);
+    else
+      warnx("transmit queue full, frame dropped");
+  }
+}
+
 static void init(const struct context *ctx, struct g3plc_config *g3plc)
 {
   struct sockaddr_un s_addr = { .sun_family = AF_UNIX };
+  unsigned int i;
 
   /* configure the G3-PLC layer */
   g3plc->callbacks.cb_recv = cb_recv;
 
+  if(credits && !tx_status)
+    errx(EXIT_FAILURE, "--credits needs --tx-status");
+  for(i = 0 ; i < nquotas ; i++)
+    if(admit_parse_quota(quotas[i], burst ? burst : G3PLC_MAX_PAYLOAD) < 0)
+      errx(EXIT_FAILURE, "invalid client quota '%s'", quotas[i]);
+  admission = credits || rate_limit || nquotas || client_stats;
+  if(!burst)
+    burst = rate_limit > G3PLC_MAX_PAYLOAD ? rate_limit : G3PLC_MAX_PAYLOAD;
+  admit_init(credits, rate_limit, burst);
+  if(tx_status) {
+    g3plc->callbacks.cb_sent = cb_sent;
+    tx_timeout = g3plc->timeout;
+
+    if(sem_init(&tx_confirm, 0, 0) < 0)
+      err(EXIT_FAILURE, "cannot initialize semaphore");
+  }
+
   /* create socket */
   sd = xsocket(AF_UNIX, SOCK_DGRAM, 0);
 
@@ -112,57 +757,190 @@ static void init(const struct context *ctx, struct g3plc_config *g3plc)
   xstrcpy(s_addr.sun_path, socket_driver_path, sizeof(s_addr.sun_path));
   xbind(sd, (struct sockaddr *)&s_addr, SUN_LEN(&s_addr));
 
-  /* prepare client address */
-  client.sun_family = AF_UNIX;
-  xstrcpy(client.sun_path, socket_app_path, sizeof(s_addr.sun_path));
+  /* create and bind the subscription socket */
+  sub_sd = xsocket(AF_UNIX, SOCK_DGRAM, 0);
+  unlink(socket_sub_path);
+  xstrcpy(s_addr.sun_path, socket_sub_path, sizeof(s_addr.sun_path));
+  xbind(sub_sd, (struct sockaddr *)&s_addr, SUN_LEN(&s_addr));
+
+  /* the application is always subscribed */
+  sub_init(socket_app_path);
+
+  /* prepare batches */
+  batch_init(&in_batch, batch_size, BUF_SIZE, NULL);
+  batch_init(&out_batch, batch_size, BUF_SIZE, NULL);
+
+  /* Records are shared by the subscribers. The batch holds at
+     most one reference per message and is sent once full, so
+     one more buffer is enough for the record being built. */
+  pool_init(&rec_pool, batch_size + 1, BUF_SIZE);
 
   /* now we may register the exit function */
   atexit(exit_clean);
 
-  IF_VERBOSE(ctx, printf("Socket created at %s", socket_driver_path));
+  IF_VERBOSE(ctx, log_msg(LOG_CAT_MAIN, LOG_LVL_DEBUG, "Socket created at %s\n", socket_driver_path));
+  IF_VERBOSE(ctx, log_msg(LOG_CAT_MAIN, LOG_LVL_DEBUG,
+                          "Subscription socket created at %s\n", socket_sub_path));
+}
+
+/* Percentile of a stage in microseconds as a scaled string.
+   The result of scale_time() is copied since it uses a
+   static buffer. */
+static const char * stage_percentile(char *buf, size_t size,
+                                     const struct hist *h, unsigned int permille)
+{
+  snprintf(buf, size, "%s", scale_time((uint64_t)hist_percentile(h, permille) * 1000));
+  return buf;
+}
+
+static void send_stats(const struct context *ctx, const struct sockaddr_un *to)
+{
+  char reply[512], p50[32], p90[32], p99[32], max[32];
+  struct hist h;
+  size_t len = 0;
+  int i;
+
+  for(i = 0 ; i < G3PLC_STAGE_MAX ; i++) {
+    int n;
+
+    g3plc_stats(ctx->plc, i, &h);
+    n = snprintf(reply + len, sizeof(reply) - len,
+                 "%s: %lu samples, p50 %s, p90 %s, p99 %s, max %s\n",
+                 g3plc_stage2str(i), h.count,
+                 stage_percentile(p50, sizeof(p50), &h, 500),
+                 stage_percentile(p90, sizeof(p90), &h, 900),
+                 stage_percentile(p99, sizeof(p99), &h, 990),
+                 stage_percentile(max, sizeof(max), &h, 1000));
+    if(n < 0 || (size_t)n >= sizeof(reply) - len)
+      break;
+    len += n;
+  }
+
+  if(sendto(sub_sd, reply, len, MSG_DONTWAIT,
+            (const struct sockaddr *)to, sizeof(*to)) < 0)
+    warn("network error"); /* we don't fail on client error */
+}
+
+static void handle_subscription(const struct context *ctx)
+{
+  unsigned char msg[SUB_MSG_SIZE + 1];
+  struct sockaddr_un from;
+  socklen_t from_len = sizeof(from);
+  ssize_t n;
+
+  n = recvfrom(sub_sd, msg, sizeof(msg), 0, (struct sockaddr *)&from, &from_len);
+  if(n < 0) {
+    warn("network error");
+    return; /* we don't fail on client error */
+  }
+
+  if(from_len <= offsetof(struct sockaddr_un, sun_path)) {
+    warnx("unbound subscription client");
+    return;
+  }
+  ((char *)&from)[from_len < sizeof(from) ? from_len : sizeof(from) - 1] = '\0';
+
+  if(n == 1 && msg[0] == SUB_STATS) {
+    send_stats(ctx, &from);
+    return;
+  }
+
+  sub_request(msg, n, &from);
 }
 
 static void start(const struct context *ctx)
 {
   /* send message format:
      [dst (u16)][payload] */
-  unsigned char buf[BUF_SIZE];
   uint16_t dst;
-  int n, ret;
+  struct pollfd fds[] = { { .fd = sd,     .events = POLLIN },
+                          { .fd = sub_sd, .events = POLLIN } };
+  int i, n, ret;
+
+  if(tx_priority || tx_fair || aggregate) {
+    txq_init(&tx_queue, tx_policy, NULL, TX_QUEUE_DEPTH, sizeof(struct tx_request));
+    if(tx_fair)
+      txq_fair(&tx_queue, request_flow, request_cost, 0);
+
+    ret = pthread_create(&tx_thread, NULL, tx_thread_func, (void *)ctx);
+    if(ret)
+      errx(EXIT_FAILURE, "cannot create transmit thread");
+  }
 
   while(1) {
-    n = recv(sd, buf, BUF_SIZE, 0);
+    if(poll(fds, 2, -1) < 0) {
+      if(errno != EINTR)
+        err(EXIT_FAILURE, "poll");
+      continue;
+    }
+
+    if(fds[1].revents & POLLIN)
+      handle_subscription(ctx);
+
+    if(!(fds[0].revents & POLLIN))
+      continue;
+
+    n = batch_recv(sd, &in_batch);
     if(n < 0) {
       warn("network error");
       continue; /* we don't fail on client error */
     }
 
-    if(n <= (int)sizeof(uint16_t)) {
-      warnx("message too short");
+    if(tx_status || tx_priority || tx_options || aggregate || admission) {
+      for(i = 0 ; i < n ; i++)
+        queue_request(ctx, batch_buf(&in_batch, i), batch_len(&in_batch, i),
+                      batch_addr(&in_batch, i));
       continue;
     }
 
-    dst = *(uint16_t *)buf;
+    for(i = 0 ; i < n ; i++) {
+      const unsigned char *buf = batch_buf(&in_batch, i);
+      int size = batch_len(&in_batch, i);
+
+      if(size <= (int)sizeof(uint16_t)) {
+        warnx("message too short");
+        continue;
+      }
+
+      dst = *(uint16_t *)buf;
 
-    IF_VERBOSE(ctx, printf("Sending %d bytes to %04X\n",
-                           n - (int)sizeof(uint16_t), dst));
-    ret = g3plc_send(dst,
-                     buf + sizeof(uint16_t),
-                     n   - sizeof(uint16_t));
-    IF_VERBOSE(ctx, printf("TX STATUS: %s (%d)\n", g3plc_send2str(ret), ret));
-    IF_VERBOSE(ctx, printf("---------\n"));
+      IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG,
+                              "Sending %d bytes to %04X\n",
+                              size - (int)sizeof(uint16_t), dst));
+      ret = g3plc_send(modems_plc(ctx->plc, dst), dst,
+                       buf + sizeof(uint16_t),
+                       size - sizeof(uint16_t));
+      IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG,
+                              "TX STATUS: %s (%d)\n", g3plc_send2str(ret), ret));
+      IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG, "---------\n"));
+    }
   }
 }
 
 static void destroy(const struct context *ctx)
 {
-  UNUSED(ctx);
+  struct txq_stats stats;
+  int i;
+
+  for(i = 0 ; (tx_priority || tx_fair || aggregate) && i < TXQ_CLASSES ; i++) {
+    txq_stats(&tx_queue, i, &stats);
+    IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG,
+                            "CLASS %d: %lu frames, %lu dropped, latency %lu us avg, %lu us max\n",
+                            i, stats.count, stats.drops,
+                            stats.count ? stats.total / stats.count : 0, stats.max));
+  }
 
+  batch_free(&in_batch);
+  batch_free(&out_batch);
+  pool_free(&rec_pool);
+  close(sub_sd);
   exit_clean();
 }
 
 static int parse_option(const struct context *ctx, int c)
 {
+  int err;
+
   UNUSED(ctx);
 
   switch(c) {
@@ -172,6 +950,68 @@ static int parse_option(const struct context *ctx, int c)
   case 'R':
     socket_app_path = optarg;
     return 1;
+  case OPT_SUB_PATH:
+    socket_sub_path = optarg;
+    return 1;
+  case OPT_TX_STATUS:
+    tx_status = 1;
+    return 1;
+  case OPT_TX_OPTIONS:
+    tx_options = 1;
+    return 1;
+  case OPT_PRIORITY:
+    tx_priority = 1;
+    return 1;
+  case OPT_WEIGHTED:
+    tx_policy = TXQ_WEIGHTED;
+    return 1;
+  case OPT_FAIR:
+    tx_fair = 1;
+    return 1;
+  case OPT_AGGREGATE:
+    aggregate = 1;
+    return 1;
+  case OPT_TIMESTAMPS:
+    timestamps = 1;
+    return 1;
+  case OPT_CREDITS:
+    credits = xatou(optarg, &err);
+    if(err || !credits || credits > ADMIT_MAX_WINDOW)
+      errx(EXIT_FAILURE, "invalid credits");
+    return 1;
+  case OPT_RATE_LIMIT:
+    rate_limit = xatou(optarg, &err);
+    if(err || !rate_limit)
+      errx(EXIT_FAILURE, "invalid rate limit");
+    return 1;
+  case OPT_BURST:
+    burst = xatou(optarg, &err);
+    if(err || burst < G3PLC_MAX_PAYLOAD)
+      errx(EXIT_FAILURE, "invalid burst (at least %lu bytes)", (unsigned long)G3PLC_MAX_PAYLOAD);
+    return 1;
+  case OPT_CLIENT_QUOTA:
+    if(nquotas == ADMIT_MAX_QUOTAS)
+      errx(EXIT_FAILURE, "too many client quotas (up to %d)", ADMIT_MAX_QUOTAS);
+    quotas[nquotas++] = optarg;
+    return 1;
+  case OPT_CLIENT_STATS:
+    client_stats = 1;
+    return 1;
+  case OPT_HOLD_TIME:
+    hold_time = xatou(optarg, &err);
+    if(err)
+      errx(EXIT_FAILURE, "cannot parse hold time");
+    return 1;
+  case OPT_BATCH:
+    batch_size = xatou(optarg, &err);
+    if(err || !batch_size)
+      errx(EXIT_FAILURE, "invalid batch size");
+    return 1;
+  case OPT_FLUSH_TIMEOUT:
+    iface_mode.flush_timeout = xatou(optarg, &err);
+    if(err)
+      errx(EXIT_FAILURE, "cannot parse flush timeout");
+    return 1;
   }
 
   return 0;
@@ -188,5 +1028,6 @@ struct iface_mode iface_mode = {
 
   .init    = init,
   .destroy = destroy,
-  .start   = start
+  .start   = start,
+  .flush   = flush
 };
@@ -0,0 +1,102 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "string-utils.h"
+#include "account.h"
+
+static struct account {
+  char          name[ACCOUNT_NAME];
+  unsigned long airtime[2];
+} accounts[ACCOUNT_MAX] = { { .name = "driver" } };
+
+/* accounts open, their names never change once published */
+static unsigned int count = 1;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+static void key_create(void)
+{
+  pthread_key_create(&key, NULL);
+}
+
+unsigned int account_lookup(const char *name)
+{
+  unsigned int i, n = __atomic_load_n(&count, __ATOMIC_ACQUIRE);
+
+  for(i = 1 ; i < n ; i++)
+    if(!strncmp(accounts[i].name, name, ACCOUNT_NAME))
+      return i;
+
+  pthread_mutex_lock(&lock);
+  {
+    /* another thread may have opened it meanwhile */
+    for(n = count ; i < n ; i++)
+      if(!strncmp(accounts[i].name, name, ACCOUNT_NAME))
+        break;
+
+    if(i == n) {
+      if(n < ACCOUNT_MAX) {
+        xstrcpy(accounts[n].name, name, ACCOUNT_NAME);
+        __atomic_store_n(&count, n + 1, __ATOMIC_RELEASE);
+      }
+      else
+        i = 0;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+
+  return i;
+}
+
+void account_set(unsigned int account)
+{
+  pthread_once(&key_once, key_create);
+  pthread_setspecific(key, (void *)(uintptr_t)account);
+}
+
+unsigned int account_get(void)
+{
+  pthread_once(&key_once, key_create);
+  return (uintptr_t)pthread_getspecific(key);
+}
+
+void account_charge(int medium, unsigned long airtime)
+{
+  __atomic_add_fetch(&accounts[account_get()].airtime[medium], airtime, __ATOMIC_RELAXED);
+}
+
+const char * account_read(unsigned int account, unsigned long us[2])
+{
+  if(account >= __atomic_load_n(&count, __ATOMIC_ACQUIRE))
+    return NULL;
+
+  us[0] = __atomic_load_n(&accounts[account].airtime[0], __ATOMIC_RELAXED);
+  us[1] = __atomic_load_n(&accounts[account].airtime[1], __ATOMIC_RELAXED);
+  return accounts[account].name;
+}
@@ -0,0 +1,52 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _ACCOUNT_H_
+#define _ACCOUNT_H_
+
+/* Time on air billed to the clients of the driver (see charge in
+   hybrid_config). A thread sends on behalf of one account at a time
+   and the threads of a race on behalf of the thread that started it.
+   Account 0 is the driver itself (keepalives, forwarded messages,
+   answers of the transport) and takes the clients that came after
+   the first ACCOUNT_MAX - 1 ones. */
+#define ACCOUNT_MAX  32
+#define ACCOUNT_NAME 108 /* as sun_path */
+
+/* Account of this name (e.g. the address of a client),
+   opened on its first use. */
+unsigned int account_lookup(const char *name);
+
+/* Send on behalf of this account from this thread. */
+void account_set(unsigned int account);
+unsigned int account_get(void);
+
+/* Bill time on air in us on a medium (see hybrid_source)
+   to the account of this thread. */
+void account_charge(int medium, unsigned long airtime);
+
+/* Copy the time on air billed to an account on each medium and
+   return its name, or NULL when the account is not open. */
+const char * account_read(unsigned int account, unsigned long us[2]);
+
+#endif /* _ACCOUNT_H_ */
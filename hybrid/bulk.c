@@ -0,0 +1,633 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <err.h>
+
+#include "g3plc/g3plc.h"
+#include "hybrid/hybrid.h"
+#include "standby.h"
+#include "bulk.h"
+#include "timer.h"
+
+#define HDR_SIZE   (2 + sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint8_t))
+#define DATA_SIZE  (HDR_SIZE + sizeof(uint16_t) + BULK_BLOCK)
+#define POLL_SIZE  (HDR_SIZE + sizeof(uint8_t) + sizeof(uint32_t))
+#define NACK_SIZE  (HDR_SIZE + 2 * sizeof(uint16_t) + BULK_NACK_BITS / 8)
+#define BOOT_CHECK 100000 /* us */
+
+#define BIT(map, i) ((map)[(i) / 8] & 1 << (i) % 8)
+#define SET(map, i) ((map)[(i) / 8] |= 1 << (i) % 8)
+#define COUNT(counter) __atomic_add_fetch(&stats.counter, 1, __ATOMIC_RELAXED)
+
+enum role {
+  ROLE_NONE,
+  ROLE_SOURCE,
+  ROLE_NODE
+};
+
+/* A distribution, the one sent by the source or one received. */
+struct session {
+  uint16_t       src, id;
+  uint32_t       size;
+  unsigned int   fec, blocks, groups;
+  unsigned char *data;    /* the blocks then the parity blocks */
+  unsigned char *have;    /* the blocks received, those missed on the source */
+  unsigned int   missing;
+  unsigned long  used;    /* last heard */
+  unsigned long  window;  /* of the source in us */
+  unsigned long  nack_at;
+  int            active;
+  int            nack_due;
+  int            save;    /* complete, to write */
+  int            done;
+};
+
+static int role;
+static uint16_t address;
+static const char *directory;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond;
+static struct bulk_stats stats;
+static struct session source;
+static struct session sessions[BULK_SESSIONS];
+
+static unsigned char * put16(unsigned char *b, uint16_t v)
+{
+  b[0] = v >> 8;
+  b[1] = v;
+  return b + 2;
+}
+
+static unsigned char * put32(unsigned char *b, uint32_t v)
+{
+  b[0] = v >> 24;
+  b[1] = v >> 16;
+  b[2] = v >> 8;
+  b[3] = v;
+  return b + 4;
+}
+
+static uint16_t get16(const unsigned char *b)
+{
+  return b[0] << 8 | b[1];
+}
+
+static uint32_t get32(const unsigned char *b)
+{
+  return (uint32_t)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+}
+
+static unsigned char * header(unsigned char *d, uint8_t kind, const struct session *s)
+{
+  d[0] = BULK_TYPE;
+  d[1] = kind;
+  d    = put32(put16(d + 2, s->id), s->size);
+  d[0] = s->fec;
+  return d + 1;
+}
+
+/* Bytes of a block, the last data block is shorter. */
+static unsigned int block_size(const struct session *s, unsigned int block)
+{
+  if(block + 1 == s->blocks && s->size % BULK_BLOCK)
+    return s->size % BULK_BLOCK;
+  return BULK_BLOCK;
+}
+
+/* End of the data blocks of a group. */
+static unsigned int group_end(const struct session *s, unsigned int group)
+{
+  unsigned int end = (group + 1) * s->fec;
+
+  return end < s->blocks ? end : s->blocks;
+}
+
+static int setup(struct session *s, uint32_t size, unsigned int fec)
+{
+  s->size    = size;
+  s->fec     = fec;
+  s->blocks  = (size + BULK_BLOCK - 1) / BULK_BLOCK;
+  s->groups  = fec ? (s->blocks + fec - 1) / fec : 0;
+  s->missing = s->blocks;
+  s->data    = calloc(s->blocks + s->groups, BULK_BLOCK);
+  s->have    = calloc((s->blocks + s->groups + 7) / 8, 1);
+
+  if(!s->data || !s->have) {
+    free(s->data);
+    free(s->have);
+    s->data = s->have = NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+static void xor_block(unsigned char *d, const unsigned char *b)
+{
+  unsigned int i;
+
+  for(i = 0 ; i < BULK_BLOCK ; i++)
+    d[i] ^= b[i];
+}
+
+/* The parity block of a group, from the blocks padded with zeroes. */
+static void parity(struct session *s, unsigned int group)
+{
+  unsigned char *p = s->data + (s->blocks + group) * BULK_BLOCK;
+  unsigned int b;
+
+  memset(p, 0, BULK_BLOCK);
+  for(b = group * s->fec ; b < group_end(s, group) ; b++)
+    xor_block(p, s->data + b * BULK_BLOCK);
+}
+
+/* Rebuild the only block missed in a group from its parity. */
+static void recover(struct session *s, unsigned int group)
+{
+  unsigned int b, lost = 0, missed = 0;
+  unsigned char *d;
+
+  if(!BIT(s->have, s->blocks + group))
+    return;
+  for(b = group * s->fec ; b < group_end(s, group) ; b++)
+    if(!BIT(s->have, b)) {
+      missed = b;
+      if(lost++)
+        return;
+    }
+  if(!lost)
+    return;
+
+  d = s->data + missed * BULK_BLOCK;
+  memcpy(d, s->data + (s->blocks + group) * BULK_BLOCK, BULK_BLOCK);
+  for(b = group * s->fec ; b < group_end(s, group) ; b++)
+    if(b != missed)
+      xor_block(d, s->data + b * BULK_BLOCK);
+
+  SET(s->have, missed);
+  s->missing--;
+  COUNT(repairs);
+}
+
+/* The session of a distribution heard from a source, a new one in
+   a free slot or in the one heard the longest ago. */
+static struct session * find(uint16_t src, const unsigned char *h)
+{
+  struct session *s, *old = sessions;
+  uint16_t id       = get16(h);
+  uint32_t size     = get32(h + sizeof(uint16_t));
+  unsigned int fec  = h[sizeof(uint16_t) + sizeof(uint32_t)];
+
+  for(s = sessions ; s < sessions + BULK_SESSIONS ; s++) {
+    if(s->active && s->src == src && s->id == id) {
+      if(s->size != size || s->fec != fec)
+        return NULL;
+      s->used = clock_us();
+      return s;
+    }
+    if(!s->active || (old->active && (long)(s->used - old->used) < 0))
+      old = s;
+  }
+
+  /* the last one is still written by the thread */
+  if(!size || size > BULK_MAX_SIZE || fec > BULK_MAX_FEC || old->save)
+    return NULL;
+
+  free(old->data);
+  free(old->have);
+  memset(old, 0, sizeof(*old));
+  if(setup(old, size, fec))
+    return NULL;
+  old->src    = src;
+  old->id     = id;
+  old->used   = clock_us();
+  old->active = 1;
+
+  return old;
+}
+
+static void receive_block(struct session *s, const unsigned char *b, unsigned int size)
+{
+  unsigned int block = get16(b), len;
+
+  if(s->done || block >= s->blocks + s->groups || BIT(s->have, block))
+    return;
+  len = block < s->blocks ? block_size(s, block) : BULK_BLOCK;
+  if(size < len)
+    return;
+
+  memcpy(s->data + block * BULK_BLOCK, b + sizeof(uint16_t), len);
+  SET(s->have, block);
+  if(block < s->blocks)
+    s->missing--;
+  COUNT(blocks);
+
+  if(s->fec)
+    recover(s, block < s->blocks ? block / s->fec : block - s->blocks);
+
+  if(!s->missing) {
+    s->done     = 1;
+    s->save     = 1;
+    s->nack_due = 0;
+    pthread_cond_signal(&cond);
+  }
+}
+
+static void receive_poll(struct session *s, const unsigned char *b)
+{
+  COUNT(polls);
+  if(s->done)
+    return;
+
+  /* the nodes answer one at a time within half the window */
+  s->window   = get32(b + sizeof(uint8_t)) * 1000UL;
+  s->nack_at  = clock_us() + (address * 0x9e3779b1UL & 0xffffffff) % (s->window / 2 + 1);
+  s->nack_due = 1;
+  pthread_cond_signal(&cond);
+}
+
+static void receive_nack(const unsigned char *b, unsigned int size)
+{
+  unsigned int first = get16(b), count = get16(b + sizeof(uint16_t)), i;
+
+  b += 2 * sizeof(uint16_t);
+  if(count > BULK_NACK_BITS || first + count > source.blocks || size < (count + 7) / 8)
+    return;
+
+  for(i = 0 ; i < count ; i++)
+    if(BIT(b, i))
+      SET(source.have, first + i);
+  COUNT(nacks);
+}
+
+int bulk_input(uint16_t src, const void *msg, unsigned int size)
+{
+  const unsigned char *m = msg;
+  struct session *s;
+
+  if(!role || size < HDR_SIZE || m[0] != BULK_TYPE)
+    return 0;
+
+  pthread_mutex_lock(&lock);
+  switch(m[1]) {
+  case BULK_DATA:
+    if(role == ROLE_NODE && size >= HDR_SIZE + sizeof(uint16_t) && (s = find(src, m + 2)))
+      receive_block(s, m + HDR_SIZE, size - HDR_SIZE - sizeof(uint16_t));
+    break;
+  case BULK_POLL:
+    if(role == ROLE_NODE && size >= POLL_SIZE && (s = find(src, m + 2)))
+      receive_poll(s, m + HDR_SIZE);
+    break;
+  case BULK_NACK:
+    if(role == ROLE_SOURCE && size >= HDR_SIZE + 2 * sizeof(uint16_t) &&
+       get16(m + 2) == source.id && get32(m + 2 + sizeof(uint16_t)) == source.size)
+      receive_nack(m + HDR_SIZE, size - HDR_SIZE - 2 * sizeof(uint16_t));
+    break;
+  }
+  pthread_mutex_unlock(&lock);
+
+  return 1;
+}
+
+/* Send a message on both media, return whether one took it. */
+static int broadcast(const void *d, unsigned int size)
+{
+  int sent = 0;
+
+  if(hybrid_g3plc_ready() && !hybrid_send_only(HYBRID_SOURCE_G3PLC, 0xffff, d, size, 0))
+    sent = 1;
+  if(!hybrid_send_only(HYBRID_SOURCE_LORA, 0xffff, d, size, 0))
+    sent = 1;
+
+  return sent;
+}
+
+static int send_block(unsigned int block)
+{
+  unsigned char d[DATA_SIZE];
+  unsigned int len = block < source.blocks ? block_size(&source, block) : BULK_BLOCK;
+
+  memcpy(put16(header(d, BULK_DATA, &source), block), source.data + block * BULK_BLOCK, len);
+  if(!broadcast(d, HDR_SIZE + sizeof(uint16_t) + len))
+    return 0;
+  COUNT(blocks);
+  return 1;
+}
+
+static void * source_thread(void *p)
+{
+  unsigned char d[POLL_SIZE], *missed, *q;
+  unsigned long start = clock_us();
+  unsigned int b, round, sent;
+  size_t map = (source.blocks + 7) / 8;
+
+  (void)p;
+
+  missed = malloc(map);
+  if(!missed)
+    errx(EXIT_FAILURE, "cannot allocate the distribution");
+
+  while(!hybrid_g3plc_ready() && clock_us() - start < BULK_BOOT_WAIT)
+    usleep(BOOT_CHECK);
+  /* the active gateway distributes (see standby.h) */
+  while(standby_passive())
+    usleep(BOOT_CHECK);
+
+  for(b = 0 ; b < source.blocks ; b++) {
+    send_block(b);
+    if(source.fec && ((b + 1) % source.fec == 0 || b + 1 == source.blocks))
+      send_block(source.blocks + b / source.fec);
+  }
+
+  for(round = 1 ; round <= BULK_ROUNDS ; round++) {
+    pthread_mutex_lock(&lock);
+    memset(source.have, 0, map);
+    pthread_mutex_unlock(&lock);
+
+    q    = header(d, BULK_POLL, &source);
+    q[0] = round;
+    put32(q + 1, source.window / 1000);
+    broadcast(d, sizeof(d));
+    COUNT(polls);
+
+    usleep(source.window);
+
+    pthread_mutex_lock(&lock);
+    memcpy(missed, source.have, map);
+    pthread_mutex_unlock(&lock);
+
+    __atomic_store_n(&stats.rounds, round, __ATOMIC_RELAXED);
+    for(b = 0, sent = 0 ; b < source.blocks ; b++)
+      if(BIT(missed, b)) {
+        send_block(b);
+        COUNT(repairs);
+        sent++;
+      }
+    if(!sent)
+      break;
+  }
+
+  COUNT(complete);
+  free(missed);
+
+  return NULL;
+}
+
+/* NACK of the blocks missed from the first one. */
+static unsigned int nack(const struct session *s, unsigned char *d)
+{
+  unsigned char *q = header(d, BULK_NACK, s);
+  unsigned int first, count, i;
+
+  for(first = 0 ; first < s->blocks && BIT(s->have, first) ; first++);
+  if(first == s->blocks)
+    return 0;
+  count = s->blocks - first;
+  if(count > BULK_NACK_BITS)
+    count = BULK_NACK_BITS;
+
+  q = put16(put16(q, first), count);
+  memset(q, 0, (count + 7) / 8);
+  for(i = 0 ; i < count ; i++)
+    if(!BIT(s->have, first + i))
+      SET(q, i);
+
+  return q - d + (count + 7) / 8;
+}
+
+static void save(uint16_t src, uint16_t id, const unsigned char *data, uint32_t size)
+{
+  char path[PATH_MAX], part[PATH_MAX + 8];
+  uint32_t done;
+  ssize_t n;
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/%04x-%04x", directory, src, id);
+  snprintf(part, sizeof(part), "%s.part", path);
+
+  fd = open(part, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd < 0) {
+    warn("cannot open %s", part);
+    return;
+  }
+
+  for(done = 0 ; done < size ; done += n) {
+    n = write(fd, data + done, size - done);
+    if(n < 0) {
+      warn("cannot write %s", part);
+      close(fd);
+      unlink(part);
+      return;
+    }
+  }
+
+  if(close(fd) || rename(part, path)) {
+    warn("cannot write %s", path);
+    unlink(part);
+    return;
+  }
+
+  COUNT(complete);
+}
+
+static void wait_until(unsigned long at)
+{
+  unsigned long now = clock_us();
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  at        -= now;
+  ts.tv_sec += at / 1000000;
+  ts.tv_nsec += (at % 1000000) * 1000;
+  if(ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+  pthread_cond_timedwait(&cond, &lock, &ts);
+}
+
+/* The session with a file to write or a NACK to send,
+   NULL after waiting for one. */
+static struct session * next_due(void)
+{
+  struct session *s, *next = NULL;
+  unsigned long now = clock_us();
+
+  for(s = sessions ; s < sessions + BULK_SESSIONS ; s++) {
+    if(!s->active)
+      continue;
+    if(s->save)
+      return s;
+    if(s->nack_due && (!next || (long)(s->nack_at - next->nack_at) < 0))
+      next = s;
+  }
+
+  if(!next)
+    pthread_cond_wait(&cond, &lock);
+  else if((long)(now - next->nack_at) < 0)
+    wait_until(next->nack_at);
+  else
+    return next;
+  return NULL;
+}
+
+static void * node_thread(void *p)
+{
+  unsigned char d[NACK_SIZE], *data;
+  struct session *s;
+  unsigned int n;
+  uint32_t size;
+  uint16_t src, id;
+
+  (void)p;
+
+  while(1) {
+    pthread_mutex_lock(&lock);
+    while(!(s = next_due()));
+
+    src = s->src;
+    if(s->save) {
+      /* keep the session so that it is not received again */
+      id      = s->id;
+      size    = s->size;
+      data    = s->data;
+      s->data = NULL;
+      free(s->have);
+      s->have = NULL;
+      pthread_mutex_unlock(&lock);
+
+      save(src, id, data, size);
+      free(data);
+
+      pthread_mutex_lock(&lock);
+      s->save = 0;
+      pthread_mutex_unlock(&lock);
+      continue;
+    }
+
+    s->nack_due = 0;
+    n = nack(s, d);
+    pthread_mutex_unlock(&lock);
+
+    if(n && !hybrid_send(src, d, n))
+      COUNT(nacks);
+  }
+
+  return NULL;
+}
+
+static void init(int r, uint16_t addr)
+{
+  pthread_condattr_t attr;
+
+  pthread_condattr_init(&attr);
+  if(pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) ||
+     pthread_cond_init(&cond, &attr))
+    errx(EXIT_FAILURE, "cannot initialize the bulk distribution");
+  pthread_condattr_destroy(&attr);
+
+  role    = r;
+  address = addr;
+}
+
+void bulk_source(uint16_t addr, const char *path, unsigned int fec, unsigned long window)
+{
+  struct stat st;
+  unsigned int group;
+  size_t done;
+  ssize_t n;
+  int fd;
+
+  if(fec > BULK_MAX_FEC)
+    errx(EXIT_FAILURE, "FEC expects a parity block every 1 to %d blocks", BULK_MAX_FEC);
+
+  fd = open(path, O_RDONLY);
+  if(fd < 0)
+    err(EXIT_FAILURE, "cannot open %s", path);
+  if(fstat(fd, &st))
+    err(EXIT_FAILURE, "cannot stat %s", path);
+  if(st.st_size <= 0 || (unsigned long)st.st_size > BULK_MAX_SIZE)
+    errx(EXIT_FAILURE, "%s: distribution expects 1 to %lu bytes", path, BULK_MAX_SIZE);
+
+  if(setup(&source, st.st_size, fec))
+    errx(EXIT_FAILURE, "cannot allocate the distribution");
+  for(done = 0 ; done < source.size ; done += n) {
+    n = read(fd, source.data + done, source.size - done);
+    if(n < 0)
+      err(EXIT_FAILURE, "cannot read %s", path);
+    if(!n)
+      errx(EXIT_FAILURE, "%s: truncated", path);
+  }
+  close(fd);
+
+  for(group = 0 ; group < source.groups ; group++)
+    parity(&source, group);
+
+  init(ROLE_SOURCE, addr);
+  source.src    = addr;
+  source.id     = clock_us() ^ time(NULL) ^ getpid();
+  source.window = window ? window : BULK_WINDOW;
+  source.active = 1;
+}
+
+void bulk_receive(uint16_t addr, const char *dir)
+{
+  if(access(dir, W_OK | X_OK))
+    err(EXIT_FAILURE, "cannot write in %s", dir);
+
+  init(ROLE_NODE, addr);
+  directory = dir;
+}
+
+void bulk_start(void)
+{
+  pthread_t thread;
+
+  if(!role)
+    return;
+  if(pthread_create(&thread, NULL, role == ROLE_SOURCE ? source_thread : node_thread, NULL))
+    errx(EXIT_FAILURE, "cannot create the bulk distribution thread");
+  pthread_detach(thread);
+}
+
+int bulk_enabled(void)
+{
+  return role != ROLE_NONE;
+}
+
+void bulk_stats(struct bulk_stats *s)
+{
+  pthread_mutex_lock(&lock);
+  *s = stats;
+  pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,111 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _BULK_H_
+#define _BULK_H_
+
+#include <stdint.h>
+
+/* Distribution of a file (e.g. a firmware image) to all the nodes
+   at once with broadcasts repaired from their NACKs.
+
+   The source broadcasts the file in numbered blocks of BULK_BLOCK
+   bytes on G3-PLC and on LoRa, which only takes them while its
+   duty cycle allows (see HYBRID_DUTY). The source waits for G3-PLC
+   up to BULK_BOOT_WAIT and the passive standby does not distribute
+   (see standby.h). With FEC a parity block, the XOR of the blocks
+   of a group of fec blocks, follows each group so that a node
+   rebuilds one block missed in a group without asking. The source
+   then polls the nodes. A node that misses blocks answers with a
+   NACK, the bitmap of the BULK_NACK_BITS blocks from the first one
+   it misses, after a delay of its own within half the window so
+   that the nodes do not all answer at once. Once the window is
+   over the source broadcasts again the blocks missed by any node
+   and polls again, at most BULK_ROUNDS times. A complete node stays
+   silent, a round without any NACK ends the distribution. The time
+   of a distribution thus grows with the blocks lost, not with the
+   number of nodes.
+
+   A node follows at most BULK_SESSIONS distributions and writes
+   each complete file in its directory as <source>-<id> (hex.). A
+   poll tells the size, so a node which missed all the blocks asks
+   for them as well. Broadcasts are not forwarded (see HYBRID_ROUTE),
+   the nodes must be neighbours of the source.
+
+   Messages (network byte order), both ends need the service:
+     [type (u8)][kind (u8)][id (u16)][size (u32)][fec (u8)] then
+     [block (u16)]<data...>                        (BULK_DATA)
+     [round (u8)][window in ms (u32)]              (BULK_POLL)
+     [first (u16)][count (u16)]<bitmap...>         (BULK_NACK)
+   The parity block of a group g is the block number blocks + g,
+   the last data block is padded with zeroes. */
+
+#define BULK_TYPE      0xd3      /* after the one of timesync.h */
+#define BULK_BLOCK     128
+#define BULK_NACK_BITS 512
+#define BULK_ROUNDS    16
+#define BULK_SESSIONS  4
+#define BULK_MAX_FEC   32
+#define BULK_WINDOW    5000000UL /* us */
+#define BULK_BOOT_WAIT 30000000UL /* us for G3-PLC before LoRa alone */
+#define BULK_MAX_SIZE  (0x7fffUL * BULK_BLOCK) /* parity blocks included */
+
+enum bulk_kind {
+  BULK_DATA = 1,
+  BULK_POLL,
+  BULK_NACK
+};
+
+struct bulk_stats {
+  unsigned long blocks;    /* sent or received */
+  unsigned long repairs;   /* blocks sent again or rebuilt from the parity */
+  unsigned long polls;     /* sent or received */
+  unsigned long nacks;     /* sent or received */
+  unsigned long rounds;    /* of the last distribution */
+  unsigned long complete;  /* distributions ended (source) or files written (node) */
+};
+
+/* Distribute this file once the driver is initialized, with a parity
+   block every fec blocks (none when 0) and a NACK window of window us
+   (BULK_WINDOW when 0). Exit on error. */
+void bulk_source(uint16_t address, const char *path, unsigned int fec, unsigned long window);
+
+/* Receive the distributions in this directory. Exit on error. */
+void bulk_receive(uint16_t address, const char *dir);
+
+/* Start the thread of the service once the driver is initialized,
+   it sends the blocks and the polls on the source and the NACKs on
+   a node. Exit on error. */
+void bulk_start(void);
+
+/* Handle a received message. Return 1 when it is a message of the
+   service, otherwise it is not for this layer and 0 is returned. */
+int bulk_input(uint16_t src, const void *msg, unsigned int size);
+
+/* Whether the service is enabled. */
+int bulk_enabled(void);
+
+void bulk_stats(struct bulk_stats *stats);
+
+#endif /* _BULK_H_ */
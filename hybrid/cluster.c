@@ -0,0 +1,396 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "g3plc/g3plc.h"
+#include "hybrid/hybrid.h"
+#include "xatoi.h"
+#include "common.h"
+#include "cluster.h"
+#include "timer.h"
+
+#define DGRAM_SIZE 11
+
+struct claim {
+  uint32_t      key;
+  uint8_t       gateway;
+  uint8_t       used;
+  unsigned long stamp;
+};
+
+/* Gateway that hears a meter best. */
+struct owner {
+  uint16_t      src;
+  uint8_t       used;
+  uint8_t       gateway;
+  unsigned int  score; /* medium and quality (see score()) */
+  unsigned long stamp;
+};
+
+struct peer {
+  uint8_t       id;
+  uint8_t       used;
+  unsigned long load;
+  unsigned long stamp;
+};
+
+static int enabled;
+static int sd;
+static struct sockaddr_in group_addr;
+static uint8_t self;
+static unsigned long window; /* us */
+static unsigned long self_load;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct claim claims[CLUSTER_CLAIMS];
+static struct owner owners[CLUSTER_METERS];
+static struct peer  peers[CLUSTER_PEERS];
+static struct cluster_stats stats;
+
+/* FNV-1a of the source and the payload. */
+static uint32_t claim_key(uint16_t src, const void *payload, unsigned int size)
+{
+  const unsigned char *p = payload;
+  uint32_t h = 2166136261U;
+  unsigned int i;
+
+  h = (h ^ (src >> 8)) * 16777619U;
+  h = (h ^ (src & 0xff)) * 16777619U;
+  for(i = 0 ; i < size ; i++)
+    h = (h ^ p[i]) * 16777619U;
+  return h;
+}
+
+/* G3-PLC first, then the LQI. */
+static unsigned int score(int medium, uint8_t quality)
+{
+  return (medium == HYBRID_SOURCE_G3PLC) << 8 | quality;
+}
+
+static unsigned long load_of(uint8_t gateway, unsigned long now)
+{
+  unsigned int i;
+
+  if(gateway == self)
+    return self_load;
+  for(i = 0 ; i < CLUSTER_PEERS ; i++)
+    if(peers[i].used && peers[i].id == gateway &&
+       now - peers[i].stamp < CLUSTER_EXPIRY * 1000000UL)
+      return peers[i].load;
+  return 0;
+}
+
+/* Whether a gateway hearing with this score takes the meter
+   from its owner. The lock must be held. */
+static int better(const struct owner *o, uint8_t gateway, unsigned int s, unsigned long now)
+{
+  unsigned long load, owner_load;
+
+  if(now - o->stamp >= CLUSTER_EXPIRY * 1000000UL || gateway == o->gateway)
+    return 1;
+  if(s != o->score)
+    return s > o->score;
+
+  load       = load_of(gateway, now);
+  owner_load = load_of(o->gateway, now);
+  if(load != owner_load)
+    return load < owner_load;
+  return gateway < o->gateway;
+}
+
+/* Slot of a meter, Fibonacci hashing on the top bits. */
+static struct owner * owner_slot(uint16_t src)
+{
+  return &owners[(uint32_t)(src * 2654435769U) >> (32 - __builtin_ctz(CLUSTER_METERS))];
+}
+
+/* The lock must be held. */
+static void heard(uint16_t src, uint8_t gateway, unsigned int s, unsigned long now)
+{
+  struct owner *o = owner_slot(src);
+
+  if(!o->used || o->src != src) {
+    *o = (struct owner){ .src = src, .used = 1, .gateway = gateway, .score = s, .stamp = now };
+    return;
+  }
+
+  if(better(o, gateway, s, now)) {
+    o->gateway = gateway;
+    o->score   = s;
+    o->stamp   = now;
+  }
+  else if(gateway == o->gateway)
+    o->stamp = now;
+}
+
+/* Claim of a key by another gateway within the window, NULL
+   otherwise. The lock must be held. */
+static struct claim * claimed(uint32_t key, unsigned long now)
+{
+  struct claim *c = &claims[key & (CLUSTER_CLAIMS - 1)];
+
+  if(c->used && c->key == key && now - c->stamp < window)
+    return c;
+  return NULL;
+}
+
+static void claim(uint32_t key, uint8_t gateway, unsigned long now)
+{
+  claims[key & (CLUSTER_CLAIMS - 1)] = (struct claim){ .key = key, .gateway = gateway,
+                                                      .used = 1, .stamp = now };
+}
+
+static void announce(uint8_t type, uint16_t src, int medium, uint8_t quality, uint32_t value)
+{
+  unsigned char d[DGRAM_SIZE] = { CLUSTER_MAGIC, type, self, medium, quality };
+  unsigned int size = DGRAM_SIZE;
+
+  if(type == CLUSTER_LOAD) {
+    d[5] = value >> 24;
+    d[6] = value >> 16;
+    d[7] = value >> 8;
+    d[8] = value;
+    size = 9;
+  }
+  else {
+    d[5]  = src >> 8;
+    d[6]  = src;
+    d[7]  = value >> 24;
+    d[8]  = value >> 16;
+    d[9]  = value >> 8;
+    d[10] = value;
+  }
+
+  /* best effort, the cluster degrades to independent gateways */
+  sendto(sd, d, size, 0, (struct sockaddr *)&group_addr, sizeof(group_addr));
+}
+
+int cluster_accept(uint16_t src, const void *payload, unsigned int size,
+                   int medium, uint8_t quality)
+{
+  unsigned long now = clock_us();
+  uint32_t key;
+  struct claim *c;
+  int dup;
+
+  if(!enabled)
+    return 1;
+
+  key = claim_key(src, payload, size);
+
+  pthread_mutex_lock(&lock);
+  c   = claimed(key, now);
+  dup = c && c->gateway != self;
+  if(dup)
+    stats.duplicates++;
+  else {
+    claim(key, self, now);
+    stats.claims++;
+  }
+  heard(src, self, score(medium, quality), now);
+  pthread_mutex_unlock(&lock);
+
+  announce(dup ? CLUSTER_HEARD : CLUSTER_CLAIM, src, medium, quality, key);
+  return !dup;
+}
+
+int cluster_owner(uint16_t src)
+{
+  const struct owner *o = owner_slot(src);
+  unsigned long now = clock_us();
+  int r;
+
+  if(!enabled)
+    return 1;
+
+  pthread_mutex_lock(&lock);
+  r = !o->used || o->src != src || o->gateway == self ||
+      now - o->stamp >= CLUSTER_EXPIRY * 1000000UL;
+  pthread_mutex_unlock(&lock);
+
+  return r;
+}
+
+int cluster_enabled(void)
+{
+  return enabled;
+}
+
+static void peer_load(uint8_t id, unsigned long load, unsigned long now)
+{
+  struct peer *p, *slot = NULL;
+
+  for(p = peers ; p < peers + CLUSTER_PEERS ; p++) {
+    if(p->used && p->id == id) {
+      slot = p;
+      break;
+    }
+    if(!slot && (!p->used || now - p->stamp >= CLUSTER_EXPIRY * 1000000UL))
+      slot = p;
+  }
+  if(slot)
+    *slot = (struct peer){ .id = id, .used = 1, .load = load, .stamp = now };
+}
+
+static void * receive_thread_func(void *arg)
+{
+  unsigned char d[DGRAM_SIZE];
+  unsigned long now;
+  uint16_t src;
+  uint32_t value;
+  ssize_t n;
+
+  UNUSED(arg);
+
+  while(1) {
+    n = recv(sd, d, sizeof(d), 0);
+    if(n < 9 || d[0] != CLUSTER_MAGIC || d[2] == self)
+      continue;
+
+    now = clock_us();
+    pthread_mutex_lock(&lock);
+    switch(d[1]) {
+    case CLUSTER_CLAIM:
+    case CLUSTER_HEARD:
+      if(n < DGRAM_SIZE)
+        break;
+      src   = d[5] << 8 | d[6];
+      value = (uint32_t)d[7] << 24 | d[8] << 16 | d[9] << 8 | d[10];
+      if(d[1] == CLUSTER_CLAIM && !claimed(value, now))
+        claim(value, d[2], now);
+      heard(src, d[2], score(d[3], d[4]), now);
+      break;
+    case CLUSTER_LOAD:
+      value = (uint32_t)d[5] << 24 | d[6] << 16 | d[7] << 8 | d[8];
+      peer_load(d[2], value, now);
+      break;
+    }
+    pthread_mutex_unlock(&lock);
+  }
+
+  return NULL;
+}
+
+/* Frames per second through both media. */
+static unsigned long frames(void)
+{
+  struct hybrid_counters c;
+
+  hybrid_counters(&c);
+  return c.tx_g3plc + c.tx_lora + c.rx_g3plc + c.rx_lora;
+}
+
+static void * announce_thread_func(void *arg)
+{
+  unsigned long last = frames(), now;
+
+  UNUSED(arg);
+
+  while(1) {
+    sleep(CLUSTER_ANNOUNCE);
+
+    now = frames();
+    pthread_mutex_lock(&lock);
+    self_load = (now - last) / CLUSTER_ANNOUNCE;
+    pthread_mutex_unlock(&lock);
+    last = now;
+
+    announce(CLUSTER_LOAD, 0, 0, 0, self_load);
+  }
+
+  return NULL;
+}
+
+void cluster_open(const char *group, unsigned int id, unsigned long window_ms)
+{
+  char *s = strdup(group), *port;
+  struct ip_mreq mreq = { .imr_interface.s_addr = htonl(INADDR_ANY) };
+  struct sockaddr_in bind_addr = { .sin_family = AF_INET,
+                                   .sin_addr.s_addr = htonl(INADDR_ANY) };
+  pthread_t receive_thread, announce_thread;
+  int one = 1, bad;
+
+  if(id > 255)
+    errx(EXIT_FAILURE, "cluster gateway identifier expects 0 to 255");
+
+  group_addr = (struct sockaddr_in){ .sin_family = AF_INET,
+                                     .sin_port   = htons(CLUSTER_PORT) };
+  port = strchr(s, ':');
+  if(port) {
+    *port++ = '\0';
+    group_addr.sin_port = htons(xatou(port, &bad));
+    if(bad)
+      errx(EXIT_FAILURE, "invalid cluster port");
+  }
+  if(inet_pton(AF_INET, s, &group_addr.sin_addr) != 1 ||
+     !IN_MULTICAST(ntohl(group_addr.sin_addr.s_addr)))
+    errx(EXIT_FAILURE, "cluster expects an IPv4 multicast GROUP[:PORT]");
+  free(s);
+
+  sd = socket(AF_INET, SOCK_DGRAM, 0);
+  if(sd < 0)
+    err(EXIT_FAILURE, "cannot create cluster socket");
+  setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  bind_addr.sin_port = group_addr.sin_port;
+  if(bind(sd, (struct sockaddr *)&bind_addr, sizeof(bind_addr)) < 0)
+    err(EXIT_FAILURE, "cannot bind cluster socket");
+
+  mreq.imr_multiaddr = group_addr.sin_addr;
+  if(setsockopt(sd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+    err(EXIT_FAILURE, "cannot join cluster group");
+
+  self    = id;
+  window  = window_ms * 1000;
+  enabled = 1;
+
+  if(pthread_create(&receive_thread, NULL, receive_thread_func, NULL) ||
+     pthread_create(&announce_thread, NULL, announce_thread_func, NULL))
+    errx(EXIT_FAILURE, "cannot create cluster threads");
+}
+
+void cluster_stats(struct cluster_stats *s)
+{
+  unsigned long now = clock_us();
+  unsigned int i;
+
+  pthread_mutex_lock(&lock);
+  *s = stats;
+  s->owned = 0;
+  s->peers = 0;
+  for(i = 0 ; i < CLUSTER_METERS ; i++)
+    s->owned += owners[i].used && owners[i].gateway == self &&
+                now - owners[i].stamp < CLUSTER_EXPIRY * 1000000UL;
+  for(i = 0 ; i < CLUSTER_PEERS ; i++)
+    s->peers += peers[i].used && now - peers[i].stamp < CLUSTER_EXPIRY * 1000000UL;
+  pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,90 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _CLUSTER_H_
+#define _CLUSTER_H_
+
+#include <stdint.h>
+
+/* Gateways that hear the same meters share their state over UDP
+   multicast so that the cluster delivers and answers once.
+
+   Each message delivered by a gateway is claimed with a hash of
+   its source and payload. A gateway drops the messages already
+   claimed by another one within the window, the collector then
+   gets a single copy, unless both gateways received it within the
+   latency of the multicast.
+
+   The claims and the copies dropped tell how well each gateway
+   hears a meter (medium and LQI). The gateway that hears it best
+   owns the meter and is the one that polls and answers it, ties
+   go to the least loaded gateway then to the lowest identifier.
+   The load of each gateway (frames per second) is announced every
+   CLUSTER_ANNOUNCE seconds.
+
+   Datagrams (network byte order):
+     [magic (u8)][type (u8)][gateway (u8)][medium (u8)][quality (u8)]
+     [src (u16)][key (u32)]  (CLUSTER_CLAIM and CLUSTER_HEARD)
+     [load (u32)]            (CLUSTER_LOAD instead of src and key) */
+
+#define CLUSTER_MAGIC    0x57
+#define CLUSTER_PORT     4870
+#define CLUSTER_WINDOW   2000    /* ms a claim is kept (default) */
+#define CLUSTER_CLAIMS   1024    /* claims table (power of two) */
+#define CLUSTER_METERS   1024    /* owners table (power of two) */
+#define CLUSTER_PEERS    16
+#define CLUSTER_ANNOUNCE 1       /* s */
+#define CLUSTER_EXPIRY   600     /* s an owner or a peer is kept */
+
+enum cluster_type {
+  CLUSTER_CLAIM = 1, /* delivered this message */
+  CLUSTER_HEARD,     /* dropped this copy */
+  CLUSTER_LOAD
+};
+
+struct cluster_stats {
+  unsigned long claims;     /* messages claimed */
+  unsigned long duplicates; /* copies dropped */
+  unsigned long owned;      /* meters owned */
+  unsigned int  peers;      /* gateways heard from */
+};
+
+/* Join the group ("GROUP[:PORT]") as the gateway id (0 to 255)
+   with claims kept window ms. Exit on error. */
+void cluster_open(const char *group, unsigned int id, unsigned long window);
+
+/* Whether a message received on a medium with the given link
+   quality (LQI, 0 on LoRa) is delivered by this gateway. */
+int cluster_accept(uint16_t src, const void *payload, unsigned int size,
+                   int medium, uint8_t quality);
+
+/* Whether this gateway owns a meter, or nobody does yet. */
+int cluster_owner(uint16_t src);
+
+/* Whether the cluster is enabled. */
+int cluster_enabled(void);
+
+void cluster_stats(struct cluster_stats *stats);
+
+#endif /* _CLUSTER_H_ */
@@ -0,0 +1,318 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/epoll.h>
+#include <semaphore.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+
+#include "safe-call.h"
+#include "uring.h"
+#include "event.h"
+
+/* With epoll the handler for each descriptor is stored in the
+   data pointer of the epoll event itself so we don't have to
+   lookup the descriptor when it is ready. With io_uring the
+   handlers live in a static table so that their read buffers
+   are registered once. The index of the handler is then the
+   user data of its read request and the index of its buffer. */
+struct handler {
+  int      fd;
+  event_cb cb;
+  event_gone_cb gone;
+  void    *data;
+
+  /* io_uring only */
+  int      used;
+  int      closing; /* event_del() waits for the last read */
+  sem_t    closed;
+
+  unsigned char buf[EVENT_BUFFER_SIZE];
+};
+
+static enum event_backend backend;
+static struct handler handlers[EVENT_MAX_FDS];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct event_stats stats;
+
+static int epfd = -1;
+static struct uring ring; /* requests are queued with the lock */
+
+static int setup_uring(void)
+{
+  struct iovec iov[EVENT_MAX_FDS];
+  int i;
+
+  if(uring_init(&ring, EVENT_MAX_FDS * 2) < 0)
+    return -1;
+
+  for(i = 0 ; i < EVENT_MAX_FDS ; i++)
+    iov[i] = (struct iovec){ .iov_base = handlers[i].buf,
+                             .iov_len  = EVENT_BUFFER_SIZE };
+  if(uring_register_buffers(&ring, iov, EVENT_MAX_FDS) < 0) {
+    uring_free(&ring);
+    return -1;
+  }
+
+  return 0;
+}
+
+enum event_backend event_init(enum event_backend want)
+{
+  int i;
+
+  for(i = 0 ; i < EVENT_MAX_FDS ; i++)
+    sem_init(&handlers[i].closed, 0, 0);
+
+  backend = want;
+  if(backend == EVENT_URING && setup_uring() < 0) {
+    warn("cannot setup io_uring, falling back to epoll");
+    backend = EVENT_EPOLL;
+  }
+
+  if(backend == EVENT_EPOLL) {
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(epfd < 0)
+      err(EXIT_FAILURE, "cannot create event loop");
+  }
+
+  return backend;
+}
+
+/* Queue the next read of a handler. Must be called with the lock. */
+static void queue_read(struct handler *h)
+{
+  if(uring_read(&ring, h->fd, h->buf, EVENT_BUFFER_SIZE, h - handlers, h - handlers) < 0)
+    errx(EXIT_FAILURE, "io_uring submission queue full");
+}
+
+void event_add_hotplug(int fd, event_cb cb, event_gone_cb gone, void *data)
+{
+  struct handler *h;
+
+  if(backend == EVENT_EPOLL) {
+    struct epoll_event ev = { .events = EPOLLIN };
+
+    h = xmalloc(sizeof(struct handler));
+    *h = (struct handler){ .fd = fd, .cb = cb, .gone = gone, .data = data };
+    ev.data.ptr = h;
+
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+      err(EXIT_FAILURE, "cannot register event");
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+  for(h = handlers ; h->used ; h++)
+    if(h == handlers + EVENT_MAX_FDS - 1)
+      errx(EXIT_FAILURE, "too many events");
+
+  h->fd      = fd;
+  h->cb      = cb;
+  h->gone    = gone;
+  h->data    = data;
+  h->used    = 1;
+  h->closing = 0;
+
+  queue_read(h);
+  if(uring_submit(&ring) < 0)
+    err(EXIT_FAILURE, "cannot register event");
+  pthread_mutex_unlock(&lock);
+}
+
+void event_add(int fd, event_cb cb, void *data)
+{
+  event_add_hotplug(fd, cb, NULL, data);
+}
+
+void event_del(int fd)
+{
+  struct handler *h;
+
+  if(backend == EVENT_EPOLL) {
+    /* The handler is leaked here. We only unregister
+       descriptors on exit and we cannot easily tell
+       whether a dispatch is still referencing it. */
+    if(epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) < 0)
+      warn("cannot unregister event");
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+  for(h = handlers ; h < handlers + EVENT_MAX_FDS ; h++)
+    if(h->used && !h->closing && h->fd == fd)
+      break;
+  if(h == handlers + EVENT_MAX_FDS) {
+    pthread_mutex_unlock(&lock);
+    warnx("cannot unregister event");
+    return;
+  }
+
+  /* Cancel the read in flight and wait for its completion
+     so that the caller may read the descriptor itself. */
+  h->closing = 1;
+  if(uring_cancel(&ring, h - handlers) < 0 || uring_submit(&ring) < 0)
+    err(EXIT_FAILURE, "cannot unregister event");
+  pthread_mutex_unlock(&lock);
+
+  while(sem_wait(&h->closed) < 0)
+    if(errno != EINTR)
+      err(EXIT_FAILURE, "cannot unregister event");
+}
+
+static void dispatch(struct handler *h, int size)
+{
+  __atomic_add_fetch(&stats.reads, 1, __ATOMIC_RELAXED);
+  h->cb(h->fd, h->buf, size, h->data);
+}
+
+/* Unregister a descriptor that cannot be read from the loop
+   and pass it to its gone callback. With epoll the handler is
+   not referenced anymore once it is out of the epoll set. */
+static void epoll_gone(struct handler *h, int error)
+{
+  if(epoll_ctl(epfd, EPOLL_CTL_DEL, h->fd, NULL) < 0)
+    warn("cannot unregister event");
+  h->gone(h->fd, error, h->data);
+  free(h);
+}
+
+static void epoll_loop(void)
+{
+  struct epoll_event events[EVENT_MAX_READY];
+
+  while(1) {
+    int i, n = epoll_wait(epfd, events, EVENT_MAX_READY, -1);
+    __atomic_add_fetch(&stats.syscalls, 1, __ATOMIC_RELAXED);
+    if(n < 0) {
+      if(errno == EINTR)
+        /* signal caught */
+        continue;
+      err(EXIT_FAILURE, "cannot wait for events");
+    }
+
+    for(i = 0 ; i < n ; i++) {
+      struct handler *h = events[i].data.ptr;
+      ssize_t size = read(h->fd, h->buf, EVENT_BUFFER_SIZE);
+
+      __atomic_add_fetch(&stats.syscalls, 1, __ATOMIC_RELAXED);
+      if(size < 0 && (errno == EINTR || errno == EAGAIN))
+        /* signal caught or spurious wake-up */
+        continue;
+      if(size <= 0) {
+        if(h->gone) {
+          epoll_gone(h, size ? errno : EIO);
+          continue;
+        }
+        if(!size)
+          errx(EXIT_FAILURE, "cannot read: end of file");
+        err(EXIT_FAILURE, "cannot read");
+      }
+
+      dispatch(h, size);
+    }
+  }
+}
+
+static void complete(const struct uring_cqe *cqe)
+{
+  struct handler *h;
+
+  if(cqe->user == URING_CANCEL)
+    return;
+  h = &handlers[cqe->user];
+
+  if(cqe->res > 0)
+    dispatch(h, cqe->res);
+  else if(h->gone && !h->closing &&
+          (cqe->res == 0 || (cqe->res != -EINTR && cqe->res != -EAGAIN && cqe->res != -ECANCELED))) {
+    /* the read is not queued again, the slot is free */
+    pthread_mutex_lock(&lock);
+    h->used = 0;
+    pthread_mutex_unlock(&lock);
+    h->gone(h->fd, cqe->res ? -cqe->res : EIO, h->data);
+    return;
+  }
+  else if(cqe->res == 0)
+    errx(EXIT_FAILURE, "cannot read: end of file");
+  else if(cqe->res != -EINTR && cqe->res != -EAGAIN && cqe->res != -ECANCELED)
+    errx(EXIT_FAILURE, "cannot read: %s", strerror(-cqe->res));
+
+  /* The next read is only submitted with the
+     next wait, along with the other handlers. */
+  pthread_mutex_lock(&lock);
+  if(h->closing) {
+    h->used = 0;
+    pthread_mutex_unlock(&lock);
+    sem_post(&h->closed);
+    return;
+  }
+  queue_read(h);
+  pthread_mutex_unlock(&lock);
+}
+
+static void uring_loop(void)
+{
+  while(1) {
+    struct uring_cqe cqe;
+    unsigned int n;
+
+    pthread_mutex_lock(&lock);
+    n = uring_flush(&ring);
+    pthread_mutex_unlock(&lock);
+
+    if(uring_wait(&ring, n, &cqe) < 0) {
+      if(errno == EINTR)
+        /* signal caught */
+        continue;
+      err(EXIT_FAILURE, "cannot wait for events");
+    }
+
+    /* reap all the completions of this wake-up */
+    do
+      complete(&cqe);
+    while(uring_peek(&ring, &cqe));
+  }
+}
+
+void event_loop(void)
+{
+  if(backend == EVENT_URING)
+    uring_loop();
+  else
+    epoll_loop();
+}
+
+void event_stats(struct event_stats *s)
+{
+  s->syscalls = __atomic_load_n(&stats.syscalls, __ATOMIC_RELAXED);
+  s->reads    = __atomic_load_n(&stats.reads, __ATOMIC_RELAXED);
+
+  if(backend == EVENT_URING)
+    s->syscalls = __atomic_load_n(&ring.enters, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,85 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _EVENT_H_
+#define _EVENT_H_
+
+/* Maximum number of ready file descriptors
+   dispatched on each wake-up of the loop. */
+#define EVENT_MAX_READY 16
+
+/* Maximum number of descriptors registered at once
+   and size of the read buffer of each descriptor. */
+#define EVENT_MAX_FDS     4
+#define EVENT_BUFFER_SIZE 1024
+
+/* Backends of the event loop (see event_init()). */
+enum event_backend {
+  EVENT_EPOLL, /* read() each descriptor that epoll reports ready */
+  EVENT_URING, /* keep an io_uring read in flight on each descriptor */
+};
+
+/* Statistics of the event loop (see event_stats()) */
+struct event_stats {
+  unsigned long syscalls; /* waits and reads of the loop */
+  unsigned long reads;    /* reads dispatched to the callbacks */
+};
+
+/* Called by the event loop each time the registered file
+   descriptor was read. The buffer is only valid during the
+   call. */
+typedef void (*event_cb)(int fd, const unsigned char *buf, unsigned int size, void *data);
+
+/* Called by the event loop when a descriptor registered with
+   event_add_hotplug() cannot be read anymore (end of file or an
+   error other than EINTR/EAGAIN, e.g. a USB adapter unplugged).
+   The descriptor is already unregistered. */
+typedef void (*event_gone_cb)(int fd, int error, void *data);
+
+/* Create the event loop. This must be called before any file
+   descriptor is registered. When io_uring is not available the
+   loop falls back to epoll. Return the backend in use. */
+enum event_backend event_init(enum event_backend backend);
+
+/* Register/unregister a file descriptor in the event loop.
+   The callback is executed from the event loop thread each
+   time some bytes were read from the descriptor. Once
+   event_del() returns the loop does not read the descriptor
+   anymore. */
+void event_add(int fd, event_cb cb, void *data);
+void event_del(int fd);
+
+/* Same as event_add() but a descriptor that cannot be read
+   anymore is given to the gone callback instead of exiting,
+   it may be registered again once it works (see hotplug.h). */
+void event_add_hotplug(int fd, event_cb cb, event_gone_cb gone, void *data);
+
+/* Wait for events and dispatch them to their callbacks.
+   This function never returns. */
+void event_loop(void);
+
+/* Copy the statistics of the event loop. */
+void event_stats(struct event_stats *stats);
+
+#endif /* _EVENT_H_ */
@@ -0,0 +1,665 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _POSIX_C_SOURCE 200112L
+#endif /* __linux__ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <err.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "hybrid/hybrid.h"
+#include "ping-mode.h"
+#include "xatoi.h"
+#include "mode.h"
+#include "help.h"
+#include "common.h"
+
+/*
+  The fault mode measures how the stack recovers from faults
+  injected on a schedule. Ping requests (see ping-mode.h) are
+  sent every interval to an instance of hybrid-ping --echo and
+  each fault is injected at its time, through the control
+  socket of the modem simulator (see modem-sim --control) or
+  locally for the slow client:
+
+    AT:reset:NODE               a G3-PLC modem reboots
+    AT:drop:NODE:PERCENT:MS     UART bytes are lost
+    AT:corrupt:NODE:PERCENT:MS  frames to the driver are corrupted
+    AT:outage:MEDIUM:MS         the medium delivers nothing
+    AT:slow:MS                  the receive callback blocks, as a
+                                socket client that stops reading
+
+  AT is in seconds from the start. For each fault, until the
+  next one, the report gives the following times in ms from the
+  injection and the probes lost:
+
+    detect    first send that failed or left G3-PLC, or G3-PLC
+              declared down by the breaker
+    failover  first probe answered through the other medium
+    restart   from G3-PLC declared down to the modem restarted
+              by the platform (g3plc_reset() and configuration)
+    recover   first probe answered on G3-PLC after the detection
+    lost      probes without a reply at the end of the run
+
+  The simulator has no reset line, so a modem that is still
+  running ignores g3plc_reset(). With --modem the mode resets
+  the simulated modem when G3-PLC is declared down, as the GPIO
+  would, otherwise only the reset fault can be recovered from.
+
+  A fault that the stack did not notice, such as a LoRa outage
+  while G3-PLC carries the traffic, has neither detection nor
+  recovery. The first row is the run before the first fault.
+  The G3-PLC state is sampled every FAULT_TICK so the restart
+  times have that resolution. With --output the rows are also
+  appended to a file as in the bench mode.
+*/
+
+#define FAULT_MAX   32
+#define FAULT_DOWNS 64 /* G3-PLC restarts tracked */
+#define FAULT_TAIL  30 /* seconds after the last fault by default */
+#define FAULT_TICK  10 /* ms between the checks of the G3-PLC state */
+#define FAULT_NONE  -1 /* not observed */
+
+enum fault_format {
+  FAULT_CSV,
+  FAULT_JSON
+};
+
+struct fault {
+  uint64_t     at;       /* ns from the start, as scheduled */
+  uint64_t     injected; /* ns from the start */
+  char         spec[64]; /* as given */
+  char         cmd[64];  /* simulator command (empty for a local fault) */
+  unsigned int slow;     /* ms */
+};
+
+struct probe {
+  uint64_t sent, done; /* ns from the start */
+  uint64_t replied;    /* ns from the start, 0 without a reply */
+  int      status;
+  int      primary;    /* went through G3-PLC alone */
+  int      diverted;   /* fell back or went through LoRa */
+};
+
+struct result {
+  long detect, failover, restart, recover; /* ms, FAULT_NONE when not observed */
+  unsigned int probes, lost;
+};
+
+static struct fault faults[FAULT_MAX];
+static unsigned int nfaults;
+static const char *control_path;
+static int control_fd = -1;
+static const char *modem; /* simulated modem of this instance */
+
+static unsigned int interval = 100; /* ms */
+static unsigned int wait = 2000;    /* ms */
+static unsigned int duration;       /* s (0 is after the last fault) */
+static const char *output;
+static const char *label = "";
+static enum fault_format format = FAULT_CSV;
+
+static struct timespec begin;
+static struct probe *probes;
+static unsigned int max_probes;
+static unsigned int nprobes; /* probes sent, read by the receive thread */
+
+/* G3-PLC down and up again (0 when not yet) */
+static uint64_t down_at[FAULT_DOWNS], up_at[FAULT_DOWNS];
+static unsigned int ndowns;
+
+static uint64_t slow_until; /* ns from the start */
+
+static volatile sig_atomic_t stopped;
+
+static uint64_t elapsed(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec - begin.tv_sec) * 1000000000ULL + ts.tv_nsec - begin.tv_nsec;
+}
+
+static void sleep_ns(uint64_t ns)
+{
+  struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+
+  nanosleep(&ts, NULL);
+}
+
+static void cb_recv(uint16_t src, uint16_t dst,
+                    const void *payload, unsigned int payload_size,
+                    int status, int source, void *data)
+{
+  uint64_t now = elapsed(), until;
+  seqno_t seqno;
+
+  UNUSED(src);
+  UNUSED(dst);
+  UNUSED(source);
+  UNUSED(data);
+
+  /* a slow client holds the receive path */
+  until = __atomic_load_n(&slow_until, __ATOMIC_RELAXED);
+  if(now < until) {
+    sleep_ns(until - now);
+    now = elapsed();
+  }
+
+  if(status || payload_size < PING_HDR_SIZE ||
+     *(const unsigned char *)payload != PING_REPLY)
+    return;
+
+  memcpy(&seqno, (const unsigned char *)payload + sizeof(uint8_t), sizeof(seqno_t));
+  if(seqno >= __atomic_load_n(&nprobes, __ATOMIC_ACQUIRE))
+    return;
+
+  /* duplicates keep the first reply */
+  if(!__atomic_load_n(&probes[seqno].replied, __ATOMIC_RELAXED))
+    __atomic_store_n(&probes[seqno].replied, now, __ATOMIC_RELAXED);
+}
+
+static void sig_stop(int signum)
+{
+  UNUSED(signum);
+  stopped = 1;
+}
+
+static void init(const struct context *ctx, struct hybrid_config *hybrid)
+{
+  struct sigaction act = { .sa_handler = sig_stop };
+  unsigned int i, last = 0;
+
+  UNUSED(ctx);
+  hybrid->cb_recv = cb_recv;
+
+  for(i = 0 ; i < nfaults ; i++) {
+    if(faults[i].cmd[0] && !control_path)
+      errx(EXIT_FAILURE, "%s needs the control socket of the simulator", faults[i].spec);
+    if(faults[i].at / 1000000000 > last)
+      last = faults[i].at / 1000000000;
+  }
+  if(!duration)
+    duration = last + FAULT_TAIL;
+
+  /* the sequence number of the probes does not wrap */
+  max_probes = duration * 1000ULL / interval + 1;
+  if(max_probes > 1U << (8 * sizeof(seqno_t)))
+    errx(EXIT_FAILURE, "too many probes, increase the interval");
+  probes = calloc(max_probes, sizeof(struct probe));
+  if(!probes)
+    err(EXIT_FAILURE, "cannot allocate probes");
+
+  if(modem && !control_path)
+    errx(EXIT_FAILURE, "the modem is reset through the control socket of the simulator");
+  if(control_path) {
+    control_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if(control_fd < 0)
+      err(EXIT_FAILURE, "cannot create control socket");
+  }
+
+  sigemptyset(&act.sa_mask);
+  if(sigaction(SIGINT, &act, NULL) < 0)
+    err(EXIT_FAILURE, "cannot install signal handler");
+}
+
+static void send_control(const char *cmd)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+  strncpy(addr.sun_path, control_path, sizeof(addr.sun_path) - 1);
+  if(sendto(control_fd, cmd, strlen(cmd), 0, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    /* we don't fail on simulator error */
+    warn("cannot send '%s' to the simulator", cmd);
+}
+
+static void inject(const struct context *ctx, struct fault *f)
+{
+  f->injected = elapsed();
+  IF_VERBOSE(ctx, printf("%.3f s: %s\n", f->injected / 1e9, f->spec));
+
+  if(f->cmd[0])
+    send_control(f->cmd);
+  else
+    __atomic_store_n(&slow_until, f->injected + f->slow * 1000000ULL, __ATOMIC_RELAXED);
+}
+
+/* What the reset line does on the hardware (see --modem). */
+static void reset_modem(void)
+{
+  char cmd[64];
+
+  snprintf(cmd, sizeof(cmd), "reset %s", modem);
+  send_control(cmd);
+}
+
+static void send_probe(const struct context *ctx, unsigned int i)
+{
+  unsigned char payload[PING_HDR_SIZE];
+  struct hybrid_counters before, after;
+  struct probe *p = &probes[i];
+  seqno_t seqno = i;
+  struct timespec ts;
+  struct timeval tv;
+
+  /* same layout as hybrid-ping so that its echo answers */
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  tv.tv_sec  = ts.tv_sec;
+  tv.tv_usec = ts.tv_nsec / 1000;
+  payload[0] = PING_REQUEST;
+  memcpy(payload + sizeof(uint8_t), &seqno, sizeof(seqno_t));
+  memcpy(payload + sizeof(uint8_t) + sizeof(seqno_t), &tv, sizeof(struct timeval));
+
+  __atomic_store_n(&nprobes, i + 1, __ATOMIC_RELEASE);
+
+  hybrid_counters(&before);
+  p->sent   = elapsed();
+  p->status = hybrid_send(ctx->dst_mac, payload, sizeof(payload));
+  p->done   = elapsed();
+  hybrid_counters(&after);
+
+  p->diverted = after.fallbacks != before.fallbacks || after.tx_lora != before.tx_lora;
+  p->primary  = !p->status && !p->diverted && after.tx_g3plc != before.tx_g3plc;
+
+  IF_VERBOSE(ctx, printf("#%u: %s%s\n", i, p->status ? "failed" : "sent",
+                         p->diverted ? " (diverted)" : ""));
+}
+
+static long to_ms(uint64_t ns)
+{
+  return ns / 1000000;
+}
+
+/* Results of the window from the injection of a fault (of the
+   start for the first row) to the next injection. */
+static void analyze(int k, struct result *r)
+{
+  uint64_t t0 = k < 0 ? 0 : faults[k].injected;
+  uint64_t t1 = (unsigned int)(k + 1) < nfaults ? faults[k + 1].injected : UINT64_MAX;
+  uint64_t detected = UINT64_MAX;
+  unsigned int i;
+
+  *r = (struct result){ FAULT_NONE, FAULT_NONE, FAULT_NONE, FAULT_NONE, 0, 0 };
+
+  for(i = 0 ; i < ndowns ; i++) {
+    if(down_at[i] < t0 || down_at[i] >= t1)
+      continue;
+    detected = down_at[i];
+    if(up_at[i])
+      r->restart = to_ms(up_at[i] - down_at[i]);
+    break;
+  }
+
+  for(i = 0 ; i < nprobes ; i++) {
+    const struct probe *p = &probes[i];
+
+    if(p->sent < t0 || p->sent >= t1)
+      continue;
+
+    r->probes++;
+    if(!p->replied)
+      r->lost++;
+    if((p->status || p->diverted) && p->done < detected)
+      detected = p->done;
+    if(r->failover == FAULT_NONE && !p->status && p->diverted && p->replied)
+      r->failover = to_ms(p->done - t0);
+  }
+
+  if(k < 0 || detected == UINT64_MAX)
+    return;
+  r->detect = to_ms(detected - t0);
+
+  for(i = 0 ; i < nprobes ; i++) {
+    const struct probe *p = &probes[i];
+
+    if(p->sent >= detected && p->sent < t1 && p->primary && p->replied) {
+      r->recover = to_ms(p->done - t0);
+      break;
+    }
+  }
+}
+
+static const char * ms2str(long ms, char *buf, size_t size)
+{
+  if(ms == FAULT_NONE)
+    return "-";
+  snprintf(buf, size, "%ld", ms);
+  return buf;
+}
+
+static void display_row(const char *name, uint64_t at, const struct result *r)
+{
+  char d[16], f[16], s[16], c[16];
+
+  printf("%-32s %8.1f %8s %8s %8s %8s %5u/%u\n", name, at / 1e9,
+         ms2str(r->detect, d, sizeof(d)), ms2str(r->failover, f, sizeof(f)),
+         ms2str(r->restart, s, sizeof(s)), ms2str(r->recover, c, sizeof(c)),
+         r->lost, r->probes);
+}
+
+/* Write a string with the quotes of the format. */
+static void write_string(FILE *fp, const char *str)
+{
+  const char *s;
+
+  fputc('"', fp);
+  for(s = str ; *s ; s++) {
+    if(*s == '"')
+      fputs(format == FAULT_CSV ? "\"\"" : "\\\"", fp);
+    else if(*s == '\\' && format == FAULT_JSON)
+      fputs("\\\\", fp);
+    else
+      fputc(*s, fp);
+  }
+  fputc('"', fp);
+}
+
+static void write_ms(FILE *fp, const char *key, long ms)
+{
+  if(format == FAULT_CSV) {
+    if(ms == FAULT_NONE)
+      fputc(',', fp);
+    else
+      fprintf(fp, ",%ld", ms);
+  }
+  else if(ms == FAULT_NONE)
+    fprintf(fp, ",\"%s_ms\":null", key);
+  else
+    fprintf(fp, ",\"%s_ms\":%ld", key, ms);
+}
+
+static void write_row(FILE *fp, const char *name, uint64_t at, const struct result *r)
+{
+  if(format == FAULT_CSV) {
+    if(ftell(fp) == 0)
+      fputs("label,fault,at_s,detect_ms,failover_ms,restart_ms,recover_ms,lost,probes\n", fp);
+    write_string(fp, label);
+    fputc(',', fp);
+    write_string(fp, name);
+    fprintf(fp, ",%.3f", at / 1e9);
+  }
+  else {
+    fputs("{\"label\":", fp);
+    write_string(fp, label);
+    fputs(",\"fault\":", fp);
+    write_string(fp, name);
+    fprintf(fp, ",\"at_s\":%.3f", at / 1e9);
+  }
+
+  write_ms(fp, "detect", r->detect);
+  write_ms(fp, "failover", r->failover);
+  write_ms(fp, "restart", r->restart);
+  write_ms(fp, "recover", r->recover);
+
+  if(format == FAULT_CSV)
+    fprintf(fp, ",%u,%u\n", r->lost, r->probes);
+  else
+    fprintf(fp, ",\"lost\":%u,\"probes\":%u}\n", r->lost, r->probes);
+}
+
+static void report(void)
+{
+  struct result r;
+  FILE *fp = NULL;
+  int k;
+
+  if(output) {
+    fp = fopen(output, "a");
+    if(!fp)
+      warn("cannot open %s", output);
+  }
+
+  printf("\n%-32s %8s %8s %8s %8s %8s %s\n", "FAULT", "AT (s)",
+         "DETECT", "FAILOVER", "RESTART", "RECOVER", "LOST");
+
+  for(k = -1 ; k < (int)nfaults ; k++) {
+    const char *name = k < 0 ? "none" : faults[k].spec;
+    uint64_t at = k < 0 ? 0 : faults[k].injected;
+
+    /* not reached when interrupted */
+    if(k >= 0 && !faults[k].injected)
+      break;
+
+    analyze(k, &r);
+    display_row(name, at, &r);
+    if(fp)
+      write_row(fp, name, at, &r);
+  }
+
+  if(fp && fclose(fp))
+    warn("cannot write %s", output);
+}
+
+static void start(const struct context *ctx)
+{
+  uint64_t end = duration * 1000000000ULL, next = 0, t;
+  unsigned int f = 0;
+  int ready = 1;
+
+  /* the first probes would go through LoRa meanwhile */
+  if(!hybrid_g3plc_ready()) {
+    printf("Waiting for G3-PLC...\n");
+    while(!hybrid_g3plc_ready() && !stopped)
+      sleep(1);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+
+  while(!stopped && (t = elapsed()) < end) {
+    if(hybrid_g3plc_ready() != ready) {
+      ready = !ready;
+      if(!ready && modem)
+        reset_modem();
+      if(!ready && ndowns < FAULT_DOWNS)
+        down_at[ndowns++] = t;
+      else if(ready && ndowns && !up_at[ndowns - 1])
+        up_at[ndowns - 1] = t;
+    }
+
+    while(f < nfaults && faults[f].at <= t)
+      inject(ctx, &faults[f++]);
+
+    if(t >= next && nprobes < max_probes) {
+      send_probe(ctx, nprobes);
+
+      /* a send that blocked does not cause a burst */
+      next += interval * 1000000ULL;
+      if(next < elapsed())
+        next = elapsed();
+      continue;
+    }
+
+    sleep_ns(next > t && next - t < FAULT_TICK * 1000000ULL ? next - t : FAULT_TICK * 1000000ULL);
+  }
+
+  /* the last replies */
+  if(!stopped)
+    sleep_ns(wait * 1000000ULL);
+
+  report();
+}
+
+static void destroy(const struct context *ctx)
+{
+  UNUSED(ctx);
+  if(control_fd >= 0)
+    close(control_fd);
+  free(probes);
+}
+
+static int compare_fault(const void *a, const void *b)
+{
+  const struct fault *x = a, *y = b;
+
+  return (x->at > y->at) - (x->at < y->at);
+}
+
+/* AT:KIND[:ARGS] into a simulator command or a local fault. */
+static void parse_fault(const char *arg)
+{
+  struct fault *f = &faults[nfaults];
+  unsigned int args, i;
+  char *kind, *end;
+  double at;
+
+  if(nfaults == FAULT_MAX)
+    errx(EXIT_FAILURE, "too many faults (at most %u)", FAULT_MAX);
+  if(strlen(arg) >= sizeof(f->spec))
+    errx(EXIT_FAILURE, "fault too long: %s", arg);
+  strcpy(f->spec, arg);
+
+  at = strtod(arg, &end);
+  if(end == arg || *end != ':' || at < 0)
+    errx(EXIT_FAILURE, "fault expects AT:KIND[:ARGS]: %s", arg);
+  f->at = at * 1e9;
+
+  kind = end + 1;
+  for(args = 0, end = kind ; *end ; end++)
+    args += *end == ':';
+
+  if(!strncmp(kind, "slow:", 5)) {
+    int err;
+
+    f->slow = xatou(kind + 5, &err);
+    if(err)
+      errx(EXIT_FAILURE, "slow expects a duration in ms: %s", arg);
+  }
+  else if((!strncmp(kind, "reset:", 6) && args == 1) ||
+          (!strncmp(kind, "drop:", 5) && args == 3) ||
+          (!strncmp(kind, "corrupt:", 8) && args == 3) ||
+          (!strncmp(kind, "outage:", 7) && args == 2)) {
+    /* the simulator takes the arguments separated by spaces */
+    strcpy(f->cmd, kind);
+    for(i = 0 ; f->cmd[i] ; i++) {
+      if(f->cmd[i] == ':')
+        f->cmd[i] = ' ';
+    }
+  }
+  else
+    errx(EXIT_FAILURE, "unknown fault: %s", arg);
+
+  nfaults++;
+
+  /* the windows of the report follow the schedule */
+  qsort(faults, nfaults, sizeof(struct fault), compare_fault);
+}
+
+static int parse_option(const struct context *ctx, int c)
+{
+  int err;
+
+  UNUSED(ctx);
+
+  switch(c) {
+  case 'C':
+    control_path = optarg;
+    return 1;
+  case 'f':
+    parse_fault(optarg);
+    return 1;
+  case 'M':
+    modem = optarg;
+    return 1;
+  case 'I':
+    interval = xatou(optarg, &err);
+    if(err || !interval)
+      errx(EXIT_FAILURE, "invalid interval");
+    return 1;
+  case 'w':
+    wait = xatou(optarg, &err);
+    if(err)
+      errx(EXIT_FAILURE, "cannot parse wait");
+    return 1;
+  case 'D':
+    duration = xatou(optarg, &err);
+    if(err)
+      errx(EXIT_FAILURE, "cannot parse duration");
+    return 1;
+  case 'o':
+    output = optarg;
+    return 1;
+  case 'F':
+    if(!strcmp(optarg, "csv"))
+      format = FAULT_CSV;
+    else if(!strcmp(optarg, "json"))
+      format = FAULT_JSON;
+    else
+      errx(EXIT_FAILURE, "unknown format (csv or json)");
+    return 1;
+  case 'L':
+    label = optarg;
+    return 1;
+  }
+
+  return 0;
+}
+
+struct option fault_opts[] = {
+  { "control", required_argument, NULL, 'C' },
+  { "fault", required_argument, NULL, 'f' },
+  { "modem", required_argument, NULL, 'M' },
+  { "interval", required_argument, NULL, 'I' },
+  { "wait", required_argument, NULL, 'w' },
+  { "duration", required_argument, NULL, 'D' },
+  { "output", required_argument, NULL, 'o' },
+  { "format", required_argument, NULL, 'F' },
+  { "label", required_argument, NULL, 'L' },
+  { NULL, 0, NULL, 0 }
+};
+struct opt_help fault_messages[] = {
+  { 'C', "control",  "Control socket of the modem simulator" },
+  { 'f', "fault",    "Fault to inject AT:KIND[:ARGS] (repeatable, see the mode description)" },
+  { 'M', "modem",    "Simulated modem to reset when G3-PLC is down (e.g. g3plc0)" },
+  { 'I', "interval", "Interval between the probes in ms (default: 100)" },
+  { 'w', "wait",     "Wait for the last replies in ms (default: 2000)" },
+  { 'D', "duration", "Duration of the run in seconds (default: 30 after the last fault)" },
+  { 'o', "output",   "Append the report to a file" },
+  { 'F', "format",   "Report format, csv or json (default: csv)" },
+  { 'L', "label",    "Label of the run in the report" },
+  { 0, NULL, NULL }
+};
+
+struct iface_mode iface_mode = {
+  .name = "fault",
+  .description = "Inject faults on a schedule and measure the recovery",
+
+  .optstring      = "C:f:M:I:w:D:o:F:L:",
+  .long_opts      = fault_opts,
+  .extra_messages = fault_messages,
+  .parse_option   = parse_option,
+
+  .init    = init,
+  .destroy = destroy,
+  .start   = start
+};
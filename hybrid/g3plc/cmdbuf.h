@@ -34,18 +34,12 @@
    the command escaped with HDLC between frame delimiters.
    The unescaped command can be appended with a CRC. */
 #define G3PLC_MAX_CMD        1024 /* FIXME: depends on aMaxMACPayloadSize */
-#define G3PLC_MAX_PACKED_CMD G3PLC_MAX_CMD * 2 /* HDLC */ + 2 /* frame delimiter */
-
-/* Receive and send command buffers.
-   Unpacked command (without HDLC and delimiters) are
-   assembled/parsed in these two buffers. */
-extern unsigned char snd_cmdbuf[];
-extern unsigned char rcv_cmdbuf[];
-
-/* Receive and send packed command buffers.
-   Packed command (with HDLC and delimiters) are
-   assembled/parsed in these two buffers. */
-extern unsigned char snd_cmdbuf_packed[];
-extern unsigned char rcv_cmdbuf_packed[];
+#define G3PLC_MAX_PACKED_CMD ((G3PLC_MAX_CMD + 4 /* CRC */) * 2 /* HDLC */ + 2 /* frame delimiter */)
+
+/* The command buffers are in the context of each instance
+   (see g3plc_ctx). Unpacked commands (without HDLC and
+   delimiters) are assembled in the send buffer, packed
+   commands (with HDLC and delimiters) in the two packed
+   buffers. Received commands are unescaped in place. */
 
 #endif /* _CMDBUF_H_ */
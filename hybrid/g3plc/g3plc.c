@@ -27,19 +27,22 @@
 #include <string.h>
 
 #include "firmware.h"
-#include "cmdbuf.h"
 #include "pack.h"
 #include "g3plc-cmd.h"
 #include "g3plc.h"
+#include "probe.h"
 
 /* Maximum size of write during boot sequence segment upload. */
 #define BOOT_SEGMENT_CHUNK 8092
 
 /* Check that callbacks are configured before calling them. */
-#define CB(cb, ...) if(g3plc_conf.callbacks.cb) g3plc_conf.callbacks.cb(__VA_ARGS__)
+#define CB(cb, ...) if(ctx->conf.callbacks.cb) ctx->conf.callbacks.cb(__VA_ARGS__)
 
 /* Boot progress. */
-#define BPRG() if(g3plc_conf.boot_progress) g3plc_conf.boot_progress()
+#define BPRG() if(ctx->conf.boot_progress) ctx->conf.boot_progress(ctx->conf.data)
+
+/* Step of a data frame. */
+#define TRACE(event, arg) if(ctx->conf.trace) ctx->conf.trace(event, arg, ctx->conf.data)
 
 /* Check the return value of the function.
    Exit with its error when it is different than success. */
@@ -49,34 +52,22 @@
       return n;              \
   } while(0)
 
-/* Used in conjunction with the dissector
-   to synchronize request/confirm. */
-static uint32_t waited_cmd_literal;
-static unsigned char *waited_cmd_data;
-
-/* G3PLC configuration with platform dependent functions,
-   source mac address, callbacks and flags. */
-static struct g3plc_config g3plc_conf;
-
-/* Size of the received command packet.
-   Glue between uart_putc() and recv_frame(). */
-static unsigned int rcv_size;
-
-static uint64_t htonll(uint64_t v)
+static uint64_t htonll(const struct g3plc_ctx *ctx, uint64_t v)
 {
-  return ((uint64_t)g3plc_conf.htonl(v & 0xffffffff) << 32) | g3plc_conf.htonl(v >> 32);
+  return ((uint64_t)ctx->conf.htonl(v & 0xffffffff) << 32) | ctx->conf.htonl(v >> 32);
 }
 
-static uint64_t ntohll(uint64_t v)
+static uint64_t ntohll(const struct g3plc_ctx *ctx, uint64_t v)
 {
-  return ((uint64_t)g3plc_conf.ntohl(v & 0xffffffff) << 32) | g3plc_conf.ntohl(v >> 32);
+  return ((uint64_t)ctx->conf.ntohl(v & 0xffffffff) << 32) | ctx->conf.ntohl(v >> 32);
 }
 
-static int g3_init_request(uint16_t neighbour,  /* number of neighbour table */
+static int g3_init_request(struct g3plc_ctx *ctx,
+                           uint16_t neighbour,  /* number of neighbour table */
                            uint16_t device,     /* number of device table */
                            uint16_t pan         /* max. number of PAN obtained with a scan */ )
 {
-  struct g3plc_cmd *cmd = (struct g3plc_cmd *)snd_cmdbuf;
+  struct g3plc_cmd *cmd = (struct g3plc_cmd *)ctx->snd_cmdbuf;
   unsigned char    *dat = cmd->data;
 
   *cmd = (struct g3plc_cmd){
@@ -97,17 +88,18 @@ static int g3_init_request(uint16_t neighbour,  /* number of neighbour table */
     return G3PLC_SND_INVALID_PARAM;
 
   *(uint8_t  *)dat = 0x03; dat += sizeof(uint8_t); /* g3mode */
-  *(uint16_t *)dat = g3plc_conf.htons(neighbour); dat += sizeof(uint16_t);
-  *(uint16_t *)dat = g3plc_conf.htons(device);    dat += sizeof(uint16_t);
-  *(uint16_t *)dat = g3plc_conf.htons(pan);       dat += sizeof(uint16_t);
+  *(uint16_t *)dat = ctx->conf.htons(neighbour); dat += sizeof(uint16_t);
+  *(uint16_t *)dat = ctx->conf.htons(device);    dat += sizeof(uint16_t);
+  *(uint16_t *)dat = ctx->conf.htons(pan);       dat += sizeof(uint16_t);
 
-  return g3plc_command(cmd, dat - snd_cmdbuf);
+  return g3plc_command(ctx, cmd, dat - ctx->snd_cmdbuf);
 }
 
-static int g3_setconfig_request(uint8_t  bandplan, /* band plan */
+static int g3_setconfig_request(struct g3plc_ctx *ctx,
+                                uint8_t  bandplan, /* band plan */
                                 uint64_t extaddr   /* extended address */ )
 {
-  struct g3plc_cmd *cmd = (struct g3plc_cmd *)snd_cmdbuf;
+  struct g3plc_cmd *cmd = (struct g3plc_cmd *)ctx->snd_cmdbuf;
   unsigned char    *dat = cmd->data;
 
   *cmd = (struct g3plc_cmd){
@@ -122,14 +114,15 @@ static int g3_setconfig_request(uint8_t  bandplan, /* band plan */
   *(uint8_t  *)dat = 0x03;            dat += sizeof(uint8_t);  /* g3mode */
   *(uint8_t  *)dat = bandplan;        dat += sizeof(uint8_t);
   *(uint32_t *)dat = 0;               dat += sizeof(uint32_t); /* reserved */
-  *(uint64_t *)dat = htonll(extaddr); dat += sizeof(uint64_t);
+  *(uint64_t *)dat = htonll(ctx, extaddr); dat += sizeof(uint64_t);
 
-  return g3plc_command(cmd, dat - snd_cmdbuf);
+  return g3plc_command(ctx, cmd, dat - ctx->snd_cmdbuf);
 }
 
-static int mlme_reset_request(uint8_t default_pib /* reset PIB to default (1) or not (0) */ )
+static int mlme_reset_request(struct g3plc_ctx *ctx,
+                              uint8_t default_pib /* reset PIB to default (1) or not (0) */ )
 {
-  struct g3plc_cmd *cmd = (struct g3plc_cmd *)snd_cmdbuf;
+  struct g3plc_cmd *cmd = (struct g3plc_cmd *)ctx->snd_cmdbuf;
   unsigned char    *dat = cmd->data;
 
   *cmd = (struct g3plc_cmd){
@@ -143,15 +136,16 @@ static int mlme_reset_request(uint8_t default_pib /* reset PIB to default (1) or
 
   *(uint8_t *)dat = default_pib; dat += sizeof(uint8_t);
 
-  return g3plc_command(cmd, dat - snd_cmdbuf);
+  return g3plc_command(ctx, cmd, dat - ctx->snd_cmdbuf);
 }
 
-static int mlme_set_request(uint16_t attr_id,    /* PIB attribute ID */
+static int mlme_set_request(struct g3plc_ctx *ctx,
+                            uint16_t attr_id,    /* PIB attribute ID */
                             uint16_t attr_idx,   /* index within the table for PIB attribute */
                             unsigned char *attr, /* attribute value */
                             unsigned int size    /* attribute size */ )
 {
-  struct g3plc_cmd *cmd = (struct g3plc_cmd *)snd_cmdbuf;
+  struct g3plc_cmd *cmd = (struct g3plc_cmd *)ctx->snd_cmdbuf;
   unsigned char    *dat = cmd->data;
 
   *cmd = (struct g3plc_cmd){
@@ -163,19 +157,20 @@ static int mlme_set_request(uint16_t attr_id,    /* PIB attribute ID */
     .cmd      = G3PLC_CMD_MLME_SET
   };
 
-  *(uint16_t  *)dat = g3plc_conf.htons(attr_id);  dat += sizeof(uint16_t);
-  *(uint16_t  *)dat = g3plc_conf.htons(attr_idx); dat += sizeof(uint16_t);
+  *(uint16_t  *)dat = ctx->conf.htons(attr_id);  dat += sizeof(uint16_t);
+  *(uint16_t  *)dat = ctx->conf.htons(attr_idx); dat += sizeof(uint16_t);
 
   /* copy attribute value */
   memcpy(dat, attr, size);
   dat += size;
 
-  return g3plc_command(cmd, dat - snd_cmdbuf);
+  return g3plc_command(ctx, cmd, dat - ctx->snd_cmdbuf);
 }
 
-static int mlme_start_request(uint8_t pan /* PAN ID */ )
+static int mlme_start_request(struct g3plc_ctx *ctx,
+                              uint8_t pan /* PAN ID */ )
 {
-  struct g3plc_cmd *cmd = (struct g3plc_cmd *)snd_cmdbuf;
+  struct g3plc_cmd *cmd = (struct g3plc_cmd *)ctx->snd_cmdbuf;
   unsigned char    *dat = cmd->data;
 
   *cmd = (struct g3plc_cmd){
@@ -187,105 +182,138 @@ static int mlme_start_request(uint8_t pan /* PAN ID */ )
     .cmd      = G3PLC_CMD_MLME_START
   };
 
-  *(uint16_t *)dat = g3plc_conf.htons(pan); dat += sizeof(uint16_t);
+  *(uint16_t *)dat = ctx->conf.htons(pan); dat += sizeof(uint16_t);
 
-  return g3plc_command(cmd, dat - snd_cmdbuf);
+  return g3plc_command(ctx, cmd, dat - ctx->snd_cmdbuf);
 }
 
-int g3plc_init(const struct g3plc_config *conf)
+int g3plc_init(struct g3plc_ctx *ctx, const struct g3plc_config *conf)
 {
   int n;
   uint16_t u16;
   uint8_t  u8;
 
-  g3plc_conf = *conf;
+  ctx->conf = *conf;
 
-  n = g3plc_reset();
+  n = g3plc_reset(ctx);
   if(n)
     return n;
 
   /* init G3-PLC */
-  x_(n, g3_init_request,
+  x_(n, g3_init_request, ctx,
      500 /* neighbour tables */,
      500 /* device tables */,
      1   /* pan in scan */ );
 
   /* set config */
-  x_(n, g3_setconfig_request,
-     g3plc_conf.bandplan,
-     g3plc_conf.ext_address );
+  x_(n, g3_setconfig_request, ctx,
+     ctx->conf.bandplan,
+     ctx->conf.ext_address );
 
-  x_(n, mlme_reset_request, 1); /* MLME reset */
+  x_(n, mlme_reset_request, ctx, 1); /* MLME reset */
 
   /* configure short address */
-  u16 = g3plc_conf.mac_address;
-  x_(n, mlme_set_request,
+  u16 = ctx->conf.mac_address;
+  x_(n, mlme_set_request, ctx,
      G3PLC_ATTR_SHORTADDR,
      0 /* attr idx */,
      (unsigned char *)&u16,
      sizeof(u16));
 
   /* configure PAN ID */
-  u16 = g3plc_conf.pan_id;
-  x_(n, mlme_set_request,
+  u16 = ctx->conf.pan_id;
+  x_(n, mlme_set_request, ctx,
      G3PLC_ATTR_PANID,
      0 /* attr idx */,
      (unsigned char *)&u16,
      sizeof(u16));
 
   /* configure max retrans */
-  u8 = g3plc_conf.retrans;
-  x_(n, mlme_set_request,
+  u8 = ctx->conf.retrans;
+  x_(n, mlme_set_request, ctx,
      G3PLC_ATTR_RETRANS,
      0 /* attr idx */,
      (unsigned char *)&u8,
      sizeof(u8));
 
   /* start MLME */
-  x_(n, mlme_start_request, g3plc_conf.pan_id);
+  x_(n, mlme_start_request, ctx, ctx->conf.pan_id);
 
   return G3PLC_INIT_SUCCESS;
 }
 
-int g3plc_command(struct g3plc_cmd *cmd, unsigned int size)
+int g3plc_command(struct g3plc_ctx *ctx, struct g3plc_cmd *cmd, unsigned int size)
 {
   if(size < sizeof(struct g3plc_cmd))
     return G3PLC_SND_INVALID_HDR;
 
+  PROBE(g3plc, command, LITERAL_G3PLC_CMD(*cmd), size);
+
   hton_g3plc_cmd(cmd);                                        /* network order */
-  append_crc(&g3plc_conf, (unsigned char *)cmd, &size);       /* apply CRC */
-  size = pack(snd_cmdbuf_packed, (unsigned char *)cmd, size); /* HDLC */
-  return g3plc_conf.uart_send(snd_cmdbuf_packed, size);       /* send command */
+  append_crc(&ctx->conf, (unsigned char *)cmd, &size);       /* apply CRC */
+  size = pack(ctx->snd_cmdbuf_packed, (unsigned char *)cmd, size); /* HDLC */
+  return ctx->conf.uart_send(ctx->snd_cmdbuf_packed, size, ctx->conf.data);       /* send command */
 }
 
-const unsigned char * wait_for_cmd(uint32_t cmd_literal)
+int g3plc_commandv(struct g3plc_ctx *ctx, struct g3plc_cmd *cmd, unsigned int size,
+                   const struct g3plc_seg *segs, unsigned int count)
+{
+  if(size < sizeof(struct g3plc_cmd))
+    return G3PLC_SND_INVALID_HDR;
+
+  PROBE(g3plc, command, LITERAL_G3PLC_CMD(*cmd), size);
+
+  hton_g3plc_cmd(cmd); /* network order */
+
+  /* apply CRC and HDLC */
+  size = packv(&ctx->conf, ctx->snd_cmdbuf_packed, (unsigned char *)cmd, size, segs, count);
+  return ctx->conf.uart_send(ctx->snd_cmdbuf_packed, size, ctx->conf.data); /* send command */
+}
+
+/* Expect a command from the device before the request it answers
+   is sent, the answer may come before wait_for_cmd() otherwise.
+   The timer is armed first so that the answer stops it. */
+static int expect_cmd(struct g3plc_ctx *ctx, uint32_t cmd_literal)
 {
   /* fail if previous wait was not freed correctly */
-  if(waited_cmd_data)
-    return NULL;
+  if(ctx->waited_cmd_data)
+    return -1;
 
-  waited_cmd_literal = cmd_literal;
+  ctx->conf.start_timer(ctx->conf.timeout, ctx->conf.data);
+  ctx->waited_cmd_literal = cmd_literal;
 
-  g3plc_conf.start_timer(g3plc_conf.timeout);
-  g3plc_conf.wait_timer();
+  return 0;
+}
 
-  return waited_cmd_data;
+static const unsigned char * wait_for_cmd(struct g3plc_ctx *ctx)
+{
+  ctx->conf.wait_timer(ctx->conf.data);
+
+  return ctx->waited_cmd_data;
 }
 
-void free_cmd_data(void)
+static void free_cmd_data(struct g3plc_ctx *ctx)
 {
-  free(waited_cmd_data);
-  waited_cmd_data    = NULL;
-  waited_cmd_literal = 0;
+  ctx->waited_cmd_data    = NULL;
+  ctx->waited_cmd_literal = 0;
 }
 
-int g3plc_send(uint16_t dst, const void *payload, unsigned int payload_size)
+/* The source is in extended mode when the device has no short address
+   or when the destination is, it could not answer to our short one. */
+static int send_frame(struct g3plc_ctx *ctx, uint8_t dst_mode, uint64_t dst,
+                      const struct g3plc_seg *segs, unsigned int count)
 {
-  struct g3plc_cmd    *cmd = (struct g3plc_cmd *)snd_cmdbuf;
+  struct g3plc_cmd    *cmd = (struct g3plc_cmd *)ctx->snd_cmdbuf;
   unsigned char       *dat = cmd->data;
   const unsigned char *confirmation;
+  unsigned int payload_size = 0;
+  unsigned int i;
+  uint8_t src_mode;
   int status;
 
+  for(i = 0 ; i < count ; i++)
+    payload_size += segs[i].size;
+
   *cmd = (struct g3plc_cmd){
     .reserved = 0,
     .type     = G3PLC_TYPE_G3,
@@ -300,25 +328,27 @@ int g3plc_send(uint16_t dst, const void *payload, unsigned int payload_size)
     return G3PLC_SND_TOOLONG;
 
   /* assemble frame */
-  *(uint8_t *)dat = 0x02; dat += sizeof(uint8_t); /* src addr type (16-bit short addr) */
-  *(uint8_t *)dat = 0x02; dat += sizeof(uint8_t); /* dst addr type (16-bit short addr) */
+  src_mode = dst_mode == G3PLC_ADDR_EXT || ctx->conf.mac_address == G3PLC_NO_SHORT ?
+             G3PLC_ADDR_EXT : G3PLC_ADDR_SHORT;
+  *(uint8_t *)dat = src_mode; dat += sizeof(uint8_t); /* src addr type */
+  *(uint8_t *)dat = dst_mode; dat += sizeof(uint8_t); /* dst addr type */
 
   /* destination PAN ID */
-  *(uint16_t *)dat = g3plc_conf.htons(g3plc_conf.pan_id);
+  *(uint16_t *)dat = ctx->conf.htons(ctx->conf.pan_id);
   dat += sizeof(uint16_t);
 
-  /* destination address */
-  memset(dat, 0, 8 - sizeof(uint16_t));     dat += 8 - sizeof(uint16_t);
-  *(uint16_t *)dat = g3plc_conf.htons(dst); dat += sizeof(uint16_t);
+  /* destination address, a short one is in the low bits */
+  *(uint32_t *)dat = ctx->conf.htonl(dst >> 32); dat += sizeof(uint32_t);
+  *(uint32_t *)dat = ctx->conf.htonl(dst);       dat += sizeof(uint32_t);
 
   /* MSDU length */
-  *(uint16_t *)dat = g3plc_conf.htons(payload_size);
+  *(uint16_t *)dat = ctx->conf.htons(payload_size);
   dat += sizeof(uint16_t);
 
   *(uint8_t *)dat = 0x00; dat += sizeof(uint8_t); /* MSDU handle */
 
   /* TX options */
-  *(uint8_t *)dat = g3plc_conf.flags & G3PLC_NOACK ? 0x00 : 0x01;
+  *(uint8_t *)dat = ctx->conf.flags & G3PLC_NOACK ? 0x00 : 0x01;
   dat += sizeof(uint8_t);
 
   /* security level
@@ -328,19 +358,27 @@ int g3plc_send(uint16_t dst, const void *payload, unsigned int payload_size)
      QoS */
   memset(dat, 0, 12); dat += 12;
 
-  /* copy payload */
-  memcpy(dat, payload, payload_size);
-  dat += payload_size;
-
-  /* send command to device */
-  x_(status, g3plc_command, cmd, dat - snd_cmdbuf);
+  /* send command to device, the payload is packed
+     from the segments without a copy in the send buffer */
+  if(expect_cmd(ctx, G3PLC_MCPS_DATA_CONFIRM))
+    return G3PLC_SND_CONFIRM;
+  status = g3plc_commandv(ctx, cmd, dat - ctx->snd_cmdbuf, segs, count);
+  if(status < 0) {
+    free_cmd_data(ctx);
+    return status;
+  }
+  TRACE(G3PLC_TRACE_REQUEST, payload_size);
 
-  confirmation = wait_for_cmd(G3PLC_MCPS_DATA_CONFIRM);
-  if(!confirmation)
+  confirmation = wait_for_cmd(ctx);
+  if(!confirmation) {
+    free_cmd_data(ctx);
+    TRACE(G3PLC_TRACE_CONFIRM, -1);
     return G3PLC_SND_CONFIRM;
+  }
   status = confirmation[1];
+  TRACE(G3PLC_TRACE_CONFIRM, status);
 
-  free_cmd_data();
+  free_cmd_data(ctx);
 
   switch(status) {
   case R_G3MAC_STATUS_SUCCESS:
@@ -360,10 +398,43 @@ int g3plc_send(uint16_t dst, const void *payload, unsigned int payload_size)
   }
 }
 
-static int mcps_data_indication(const unsigned char *data,
+int g3plc_sendv(struct g3plc_ctx *ctx, uint16_t dst, const struct g3plc_seg *segs, unsigned int count)
+{
+  return send_frame(ctx, G3PLC_ADDR_SHORT, dst, segs, count);
+}
+
+int g3plc_sendv_ext(struct g3plc_ctx *ctx, uint64_t dst, const struct g3plc_seg *segs, unsigned int count)
+{
+  return send_frame(ctx, G3PLC_ADDR_EXT, dst, segs, count);
+}
+
+int g3plc_send(struct g3plc_ctx *ctx, uint16_t dst, const void *payload, unsigned int payload_size)
+{
+  struct g3plc_seg seg = { .base = payload, .size = payload_size };
+
+  return g3plc_sendv(ctx, dst, &seg, 1);
+}
+
+int g3plc_set_retrans(struct g3plc_ctx *ctx, unsigned int retrans)
+{
+  uint8_t u8 = retrans;
+  int n;
+
+  x_(n, mlme_set_request, ctx,
+     G3PLC_ATTR_RETRANS,
+     0 /* attr idx */,
+     (unsigned char *)&u8,
+     sizeof(u8));
+
+  ctx->conf.retrans = retrans;
+  return 0;
+}
+
+static int mcps_data_indication(struct g3plc_ctx *ctx,
+                                const unsigned char *data,
                                 unsigned int size)
 {
-  static struct g3plc_data_hdr hdr;
+  struct g3plc_data_hdr hdr;
   const unsigned char *d = data;
   const unsigned char *payload;
   unsigned int len;
@@ -376,31 +447,50 @@ static int mcps_data_indication(const unsigned char *data,
 
   /* source */
   hdr.src_mode  = *(uint8_t *)d; d += sizeof(uint8_t);
-  hdr.src_pan   = g3plc_conf.ntohs(*(uint16_t *)d); d += sizeof(uint16_t);
-  hdr.src_addr  = ntohll(*(uint64_t *)d); d += sizeof(uint64_t);
+  hdr.src_pan   = ctx->conf.ntohs(*(uint16_t *)d); d += sizeof(uint16_t);
+  hdr.src_addr  = ntohll(ctx, *(uint64_t *)d); d += sizeof(uint64_t);
 
   /* destination */
   hdr.dst_mode  = *(uint8_t *)d; d += sizeof(uint8_t);
-  hdr.dst_pan   = g3plc_conf.ntohs(*(uint16_t *)d); d += sizeof(uint16_t);
-  hdr.dst_addr  = ntohll(*(uint64_t *)d); d += sizeof(uint64_t);
+  hdr.dst_pan   = ctx->conf.ntohs(*(uint16_t *)d); d += sizeof(uint16_t);
+  hdr.dst_addr  = ntohll(ctx, *(uint64_t *)d); d += sizeof(uint64_t);
 
   /* MSDU length */
-  len = g3plc_conf.ntohs(*(uint16_t *)d); d += sizeof(uint16_t);
+  len = ctx->conf.ntohs(*(uint16_t *)d); d += sizeof(uint16_t);
 
   if(size < len)
     return G3PLC_RCV_INVALID_HDR;
   size -= len;
 
   payload = d;
-
-  /* remaining fields are ignored for now */
+  d += len;
+
+  /* The trailer is optional, the fields are left
+     to zero when the modem does not send it. */
+  if(size >= 19) {
+    unsigned int i;
+
+    hdr.lqi         = *(uint8_t *)d; d += sizeof(uint8_t);
+    hdr.seqno       = *(uint8_t *)d; d += sizeof(uint8_t);
+    hdr.time        = ctx->conf.ntohl(*(uint32_t *)d); d += sizeof(uint32_t);
+    hdr.sec_level   = *(uint8_t *)d; d += sizeof(uint8_t);
+    hdr.key_id_mode = *(uint8_t *)d; d += sizeof(uint8_t);
+    hdr.key_source  = ntohll(ctx, *(uint64_t *)d); d += sizeof(uint64_t);
+    hdr.key_index   = *(uint8_t *)d; d += sizeof(uint8_t);
+    hdr.QoS         = *(uint8_t *)d; d += sizeof(uint8_t);
+    hdr.estimated   = *(uint8_t *)d; d += sizeof(uint8_t);
+
+    /* tonemap (up to 4 bytes) */
+    for(i = 19 ; i < size && i < 19 + sizeof(uint32_t) ; i++, d++)
+      hdr.tonemap = hdr.tonemap << 8 | *d;
+  }
 
   /* call cb_recv */
-  CB(cb_recv, &hdr, payload, len, G3PLC_RCV_SUCCESS, g3plc_conf.data);
+  CB(cb_recv, &hdr, payload, len, G3PLC_RCV_SUCCESS, ctx->conf.data);
   return G3PLC_RCV_SUCCESS;
 }
 
-int dissector(const struct g3plc_cmd *cmd, unsigned int size)
+static int dissector(struct g3plc_ctx *ctx, const struct g3plc_cmd *cmd, unsigned int size)
 {
   uint32_t literal_cmd = LITERAL_G3PLC_CMD(*cmd);
 
@@ -408,38 +498,42 @@ int dissector(const struct g3plc_cmd *cmd, unsigned int size)
   size -= sizeof(struct g3plc_cmd);
 
   /* check for any waited confirmation/indication */
-  if(literal_cmd == waited_cmd_literal) {
-    waited_cmd_literal = 0;
+  if(literal_cmd == ctx->waited_cmd_literal) {
+    ctx->waited_cmd_literal = 0;
 
     /* we always duplicate the data to avoid side effect */
-    waited_cmd_data = malloc(size);
-    memcpy(waited_cmd_data, cmd->data, size);
+    memcpy(ctx->waited_cmd_buf, cmd->data, size < G3PLC_MAX_CMD ? size : G3PLC_MAX_CMD);
+    ctx->waited_cmd_data = ctx->waited_cmd_buf;
 
-    g3plc_conf.stop_timer();
+    ctx->conf.stop_timer(ctx->conf.data);
   }
 
-  /* parse command packets */
-  if(literal_cmd ==  G3PLC_MCPS_DATA_INDICATION)
-    return mcps_data_indication(cmd->data, size);
+  /* parse command packets, the hybrid driver does not stamp them */
+  if(literal_cmd ==  G3PLC_MCPS_DATA_INDICATION) {
+    PROBE(g3plc, dissect, literal_cmd, size, 0);
+    return mcps_data_indication(ctx, cmd->data, size);
+  }
 
   /* ignore anything else */
   return G3PLC_RCV_IGNORED;
 }
 
-int g3plc_recv_frame(void)
+int g3plc_recv_frame(struct g3plc_ctx *ctx)
 {
-  struct g3plc_cmd *cmd = (struct g3plc_cmd *)rcv_cmdbuf;
-  unsigned int size = unpack(rcv_cmdbuf, rcv_cmdbuf_packed, rcv_size);
+  struct g3plc_cmd *cmd = (struct g3plc_cmd *)ctx->rcv_cmdbuf_packed;
+  unsigned int size = unpack_inplace(ctx->rcv_cmdbuf_packed, ctx->rcv_size);
   int ret, status = G3PLC_RCV_SUCCESS;
 
-  /* check that we at least have a valid command packet */
-  if(size < (sizeof(struct g3plc_cmd) + sizeof(uint32_t))) {
+  /* check that we at least have a valid command packet
+     and that it fits in a command with its CRC */
+  if(size < (sizeof(struct g3plc_cmd) + sizeof(uint32_t)) ||
+     size > G3PLC_MAX_CMD + sizeof(uint32_t)) {
     status = G3PLC_RCV_INVALID_HDR;
     goto PARSING_COMPLETE;
   }
 
   /* extract and check CRC */
-  ret = extract_crc(&g3plc_conf, rcv_cmdbuf, &size);
+  ret = extract_crc(&ctx->conf, ctx->rcv_cmdbuf_packed, &size);
   if(!ret) {
     status = G3PLC_RCV_INVALID_CRC;
     goto PARSING_COMPLETE;
@@ -449,24 +543,26 @@ int g3plc_recv_frame(void)
   ntoh_g3plc_cmd(cmd);
 
 PARSING_COMPLETE:
+  PROBE(g3plc, recv_frame, status, ctx->rcv_size, 0);
+
   /* based on parsing status and iface_flags
      we either return directly or pass the
      command packet to the dissectors */
   switch(status) {
   case G3PLC_RCV_INVALID_CRC:
   case G3PLC_RCV_INVALID_HDR:
-    if(!(g3plc_conf.flags & G3PLC_INVALID))
+    if(!(ctx->conf.flags & G3PLC_INVALID))
       return status;
   }
 
-  CB(raw, cmd, size, status, g3plc_conf.data);
+  CB(raw, cmd, size, status, ctx->conf.data);
 
   if(status == G3PLC_RCV_SUCCESS)
-    status = dissector(cmd, size);
+    status = dissector(ctx, cmd, size);
   return status;
 }
 
-int g3plc_uart_putc(unsigned char c)
+int g3plc_uart_putc(struct g3plc_ctx *ctx, unsigned char c)
 {
   /* Just writing out the FSM of what the code
      below actually does:
@@ -481,26 +577,38 @@ int g3plc_uart_putc(unsigned char c)
      We make the distinction between the two states
      by checking whether we are at the beginning of the
      receive buffer or not. */
-  static unsigned char *rcv_ptr = rcv_cmdbuf_packed;
+  unsigned char *buf = ctx->rcv_cmdbuf_packed;
 
-  if(rcv_ptr == rcv_cmdbuf_packed) {
+  if(!ctx->rcv_pos) {
     /* state (out-of-frame) */
 
-    if(c == 0x7e)
-      *rcv_ptr++ = c;      /* write-to-buf; state <- (in-frame) */
+    if(c == 0x7e) {
+      buf[ctx->rcv_pos++] = c; /* write-to-buf; state <- (in-frame) */
+      ctx->rcv_overflow   = 0;
+    }
     return G3PLC_RCV_CONT; /* ignore */
   }
   else {
     /* state (in-frame) */
 
-    *rcv_ptr++ = c; /* write-to-buf */
+    /* Keep the last byte for the closing delimiter.
+       Oversized frames are dropped once complete. */
+    if(c == 0x7e || ctx->rcv_pos < G3PLC_MAX_PACKED_CMD - 1)
+      buf[ctx->rcv_pos++] = c; /* write-to-buf */
+    else
+      ctx->rcv_overflow = 1;
 
     if(c == 0x7e) {
       /* message-received
          state <- (out-of-frame) */
-      rcv_size = rcv_ptr - rcv_cmdbuf_packed;
-      rcv_ptr  = rcv_cmdbuf_packed;
-      return g3plc_conf.recv_frame();
+      ctx->rcv_size = ctx->rcv_pos;
+      ctx->rcv_pos  = 0;
+
+      /* There is no way to recover the truncated
+         command, we report it as an invalid header. */
+      if(ctx->rcv_overflow)
+        return G3PLC_RCV_INVALID_HDR;
+      return ctx->conf.recv_frame(ctx);
     }
     else
       return G3PLC_RCV_CONT;
@@ -509,31 +617,75 @@ int g3plc_uart_putc(unsigned char c)
 
 /* Send a single byte through UART.
    We use this during the boot sequence to signal the device. */
-#define xsend_byte(n, c) x_(n, send_byte, c)
-static int send_byte(unsigned char c)
+#define xsend_byte(n, c) x_(n, send_byte, ctx, c)
+static int send_byte(struct g3plc_ctx *ctx, unsigned char c)
+{
+  return ctx->conf.uart_send(&c, 1, ctx->conf.data);
+}
+
+/* Take a retry from the budget of the reset. */
+static int boot_retry(struct g3plc_ctx *ctx)
+{
+  if(!ctx->boot_budget)
+    return G3PLC_INIT_BOOT_ERROR;
+  ctx->boot_budget--;
+  __atomic_add_fetch(&ctx->boot_retries, 1, __ATOMIC_RELAXED);
+  return G3PLC_INIT_SUCCESS;
+}
+
+unsigned long g3plc_boot_retries(const struct g3plc_ctx *ctx)
 {
-  return g3plc_conf.uart_send(&c, 1);
+  return __atomic_load_n(&ctx->boot_retries, __ATOMIC_RELAXED);
+}
+
+static int send_segment(struct g3plc_ctx *ctx, unsigned int segno);
+
+/* Send a segment, again when it could not be written out. The
+   device then takes the start of the copy as the missing end of
+   the first one and asks for the segment once more. */
+#define xresend_segment(n, segno) x_(n, resend_segment, ctx, segno)
+static int resend_segment(struct g3plc_ctx *ctx, unsigned int segno)
+{
+  int n;
+
+  while((n = send_segment(ctx, segno)) < 0) {
+    if(boot_retry(ctx))
+      return n;
+  }
+  return n;
 }
 
 /* Wait for the reception of a specific character before continuation.
-   We use this during the boot sequence to wait for signals from the device. */
-#define xwait_for_byte(n, c) x_(n, wait_for_byte, c)
-static int wait_for_byte(unsigned char c)
+   We use this during the boot sequence to wait for signals from the device.
+   Stray bytes are skipped and a new request for the last segment sent
+   (segno, or -1 for none) is answered, within the budget of the reset. */
+#define xwait_for_byte(n, c, segno) x_(n, wait_for_byte, ctx, c, segno)
+static int wait_for_byte(struct g3plc_ctx *ctx, unsigned char c, int segno)
 {
   unsigned char buf;
-  int r = g3plc_conf.uart_read(&buf, 1);
-  if(r < 0)
-    return r;
+  int r;
 
-  if(buf == c)
-    return G3PLC_INIT_SUCCESS;
-  else
-    return G3PLC_INIT_BOOT_ERROR;
+  while(1) {
+    r = ctx->conf.uart_read(&buf, 1, ctx->conf.data);
+    if(r < 0)
+      return r;
+    if(buf == c)
+      return G3PLC_INIT_SUCCESS;
+
+    r = boot_retry(ctx);
+    if(r)
+      return r;
+    if(segno >= 0 && buf == (0x80 | segno)) {
+      r = resend_segment(ctx, segno);
+      if(r)
+        return r;
+    }
+  }
 }
 
 /* Send a program segment to the device. */
-#define xsend_segment(n, segno) x_(n, send_segment, segno)
-static int send_segment(unsigned int segno)
+#define xsend_segment(n, segno) x_(n, send_segment, ctx, segno)
+static int send_segment(struct g3plc_ctx *ctx, unsigned int segno)
 {
   int n;
 
@@ -546,7 +698,7 @@ static int send_segment(unsigned int segno)
   uint32_t       size        = *(uint32_t *)(info_tbl + 8); /* program size */
 
   /* send segment info table */
-  n = g3plc_conf.uart_send(info_tbl + sizeof(uint32_t), 12);
+  n = ctx->conf.uart_send(info_tbl + sizeof(uint32_t), 12, ctx->conf.data);
   if(n < 0)
     return n;
   BPRG();
@@ -555,7 +707,7 @@ static int send_segment(unsigned int segno)
   while(size) {
     unsigned int write_size = size > BOOT_SEGMENT_CHUNK ? BOOT_SEGMENT_CHUNK : size;
 
-    n = g3plc_conf.uart_send(frmw_tbl + offset, write_size);
+    n = ctx->conf.uart_send(frmw_tbl + offset, write_size, ctx->conf.data);
     if(n < 0)
       return n;
     BPRG();
@@ -567,45 +719,46 @@ static int send_segment(unsigned int segno)
   return 0;
 }
 
-#define xset_uart_speed(n, speed) do {  \
-  n = g3plc_conf.set_uart_speed(speed); \
-  if(n < 0)                             \
-    return n;                           \
+#define xset_uart_speed(n, speed) do {                  \
+  n = ctx->conf.set_uart_speed(speed, ctx->conf.data); \
+  if(n < 0)                                            \
+    return n;                                          \
 } while(0)
-int g3plc_reset(void)
+int g3plc_reset(struct g3plc_ctx *ctx)
 {
-  int n;
+  int n, last;
 
-  if(g3plc_conf.boot_start)
-    g3plc_conf.boot_start();
+  if(ctx->conf.boot_start)
+    ctx->conf.boot_start(ctx->conf.data);
+  ctx->boot_budget = G3PLC_BOOT_RETRIES;
 
   /* speed for segment 0 */
   xset_uart_speed(n, 115200);
   BPRG();
 
   /* hardware reset */
-  g3plc_conf.reset_clear();
-  g3plc_conf.usleep(30000); /* sleep 30ms */
-  g3plc_conf.reset_set();
+  ctx->conf.reset_clear(ctx->conf.data);
+  ctx->conf.usleep(ctx->conf.reset_pulse ? ctx->conf.reset_pulse : G3PLC_RESET_PULSE, ctx->conf.data);
+  ctx->conf.reset_set(ctx->conf.data);
   BPRG();
 
-  xwait_for_byte(n, 0x80); BPRG(); /* program transmission request */
-  xsend_segment(n, 0);     BPRG(); /* send segment 0 */
+  xwait_for_byte(n, 0x80, -1); BPRG(); /* program transmission request */
+  xresend_segment(n, 0);       BPRG(); /* send segment 0 */
 
   /* switch to 1M/500k baudrate */
-  xwait_for_byte(n, 0xa1);    BPRG(); /* baud rate change request */
+  xwait_for_byte(n, 0xa1, 0); BPRG(); /* baud rate change request */
   xsend_byte(n, 0xc1);        BPRG(); /* baud rate change command */
   xsend_byte(n, 0x84);        BPRG(); /* baud rate (boot 461k / appl. 115.2k) */
-  xwait_for_byte(n, 0xcf);    BPRG(); /* baud rate change accept */
+  xwait_for_byte(n, 0xcf, -1); BPRG(); /* baud rate change accept */
   xset_uart_speed(n, 460800); BPRG(); /* switch to boot baudrate */
   xsend_byte(n, 0xaa);        BPRG(); /* baud rate change response */
 
   /* send remaining segments */
-  while(1) {
+  for(last = -1 ;;) {
     unsigned char buf;
-    unsigned int  segno;
+    int segno;
 
-    n = g3plc_conf.uart_read(&buf, 1);
+    n = ctx->conf.uart_read(&buf, 1, ctx->conf.data);
     if(n < 0)
       return n;
     BPRG();
@@ -614,19 +767,24 @@ int g3plc_reset(void)
 
     if(buf == 0xb0)
       break; /* boot completion */
-    else if((buf & 0xf0) == 0x80)
-      /* program transmission request for segment segno */
-      xsend_segment(n, segno);
+    else if((buf & 0xf0) == 0x80) {
+      /* program transmission request for segment segno,
+         the same one again when it failed its check */
+      if(segno == last)
+        x_(n, boot_retry, ctx);
+      xresend_segment(n, segno);
+      last = segno;
+    }
     else
-      return G3PLC_INIT_BOOT_ERROR;
+      x_(n, boot_retry, ctx); /* stray byte */
   }
 
   /* Back to 115.2k, communications with
      the CPX didn't work too well at 461k. */
   xset_uart_speed(n, 115200);
 
-  if(g3plc_conf.boot_end)
-    g3plc_conf.boot_end();
+  if(ctx->conf.boot_end)
+    ctx->conf.boot_end(ctx->conf.data);
 
   return G3PLC_INIT_SUCCESS;
 }
@@ -36,9 +36,17 @@
 #include "cmdbuf.h"
 
 #define G3PLC_MAJOR 2
-#define G3PLC_MINOR 3
+#define G3PLC_MINOR 5
 
 #define G3PLC_DATA_HDR_SIZE 28 /* see G3-PLC Serial Command Spec. p51 */
+#define G3PLC_RESET_PULSE   30000 /* default low time of the reset pin in us */
+
+/* The boot sequence recovers from a damaged segment on its own: the
+   device asks again for a segment that failed its check, and a
+   segment that could not be written out is sent again at once. A
+   stray byte from the device is skipped. Each of those takes one of
+   the G3PLC_BOOT_RETRIES of a reset, after which the reset fails. */
+#define G3PLC_BOOT_RETRIES 8
 #define G3PLC_MAX_PAYLOAD   G3PLC_MAX_CMD - G3PLC_DATA_HDR_SIZE - sizeof(struct g3plc_cmd)
 
 enum g3plc_flags {
@@ -74,17 +82,28 @@ enum g3plc_send_status {
   G3PLC_SND_FAILURE,       /* (any other reason) */
 };
 
+/* Address modes of a data frame */
+enum g3plc_addr_mode {
+  G3PLC_ADDR_SHORT = 0x02, /* 16-bit short address */
+  G3PLC_ADDR_EXT   = 0x03, /* 64-bit extended address */
+};
+
+/* Short address of a device that did not get one yet,
+   it sends and receives with its extended address. */
+#define G3PLC_NO_SHORT 0xfffe
+
 /* Information about a received data frame */
 struct g3plc_data_hdr {
-  uint8_t  src_mode;    /* source address mode */
+  uint8_t  src_mode;    /* source address mode (see g3plc_addr_mode) */
   uint16_t src_pan;     /* source PAN ID */
-  uint64_t src_addr;    /* source short address */
+  uint64_t src_addr;    /* source short or extended address */
 
-  uint8_t  dst_mode;    /* destination address mode */
+  uint8_t  dst_mode;    /* destination address mode (see g3plc_addr_mode) */
   uint16_t dst_pan;     /* destination PAN ID */
-  uint64_t dst_addr;    /* destination short address */
+  uint64_t dst_addr;    /* destination short or extended address */
 
   uint8_t  handle;      /* handle associated to MSDU */
+  uint8_t  lqi;         /* link quality of the MPDU */
   uint8_t  seqno;       /* sequence number */
   uint32_t time;        /* time, in symbols, at which the data were transmitted */
 
@@ -93,10 +112,18 @@ struct g3plc_data_hdr {
   uint64_t key_source;  /* (not used) */
   uint8_t  key_index;   /* key index */
   uint8_t  QoS;         /* Quality of Service */
-  uint8_t  estimated;   /* ? */
+  uint8_t  estimated;   /* estimated modulation */
   uint32_t tonemap;     /* estimated tonemap */
 };
 
+/* Steps of a sent data frame (see trace in g3plc_config) */
+enum g3plc_trace {
+  G3PLC_TRACE_REQUEST, /* MCPS-DATA request written, arg is the payload size */
+  G3PLC_TRACE_CONFIRM  /* confirm received, arg is its status or -1 on timeout */
+};
+
+struct g3plc_ctx;
+
 struct g3plc_config {
     struct g3plc_callbacks {
     /* The raw callback is called for each received command packet.
@@ -111,22 +138,23 @@ struct g3plc_config {
 
   /* The driver will use those functions to start, stop and wait
      for timers. The stop function should also drop any wait in
-     place on the timer. */
-  void (*start_timer)(unsigned int us);
-  void (*stop_timer)(void);
-  void (*wait_timer)(void);
+     place on the timer. Like the other platform functions they
+     receive the data pointer of this configuration. */
+  void (*start_timer)(unsigned int us, void *data);
+  void (*stop_timer)(void *data);
+  void (*wait_timer)(void *data);
 
   /* The driver will use the uart_send() function to write
      the resulting frame on the device's UART. This
      function should return a negative value in case of
      error or 0 on success. */
-  int (*uart_send)(const void *buf, unsigned int size);
+  int (*uart_send)(const void *buf, unsigned int size, void *data);
 
   /* The g3plc_reset() function will use this to read
      from the device during the boot sequence. This
      function should return a negative value in case of
      error or 0 on success. */
-  int (*uart_read)(void *buf, unsigned int size);
+  int (*uart_read)(void *buf, unsigned int size, void *data);
 
   /* Change UART speed.
      This take an integer (not a speed_t type).
@@ -135,7 +163,7 @@ struct g3plc_config {
        - 500k
        - 115.2k
      and return a negative number on error. */
-  int (*set_uart_speed)(unsigned int speed);
+  int (*set_uart_speed)(unsigned int speed, void *data);
 
   /* The function g3plc_uart_putc() is generally called
      from an interrupt handler. Since we cannot parse
@@ -144,11 +172,13 @@ struct g3plc_config {
      transferred to this function which can either directly
      be g3plc_recv_frame() or use semaphores to defer
      outside of the interrupt context. */
-  int (*recv_frame)(void);
+  int (*recv_frame)(struct g3plc_ctx *ctx);
 
-  /* Clear/set the reset pin. */
-  void (*reset_clear)(void);
-  void (*reset_set)(void);
+  /* Clear/set the reset pin. The pin is held low for
+     reset_pulse us (G3PLC_RESET_PULSE when 0). */
+  void (*reset_clear)(void *data);
+  void (*reset_set)(void *data);
+  unsigned int reset_pulse;
 
   /* Not all platform provide byte ordering functions
      with the same names as POSIX. */
@@ -158,16 +188,20 @@ struct g3plc_config {
   uint32_t (*ntohl)(uint32_t v);
 
   /* Microseconds sleep. */
-  void (*usleep)(unsigned long us);
+  void (*usleep)(unsigned long us, void *data);
 
   /* Signal progress in the boot sequence. */
-  void (*boot_start)(void);
-  void (*boot_progress)(void);
-  void (*boot_end)(void);
+  void (*boot_start)(void *data);
+  void (*boot_progress)(void *data);
+  void (*boot_end)(void *data);
+
+  /* Called in the sending thread at each step of a data
+     frame (see g3plc_trace) with its argument. May be NULL. */
+  void (*trace)(int event, int arg, void *data);
 
   uint8_t bandplan;     /* bandplan (see g3plc_bandplan) */
   uint16_t pan_id;      /* PAN ID */
-  uint16_t mac_address; /* device short MAC address */
+  uint16_t mac_address; /* device short MAC address (G3PLC_NO_SHORT for none) */
   uint64_t ext_address; /* extended 64-bit address */
   unsigned int retrans; /* maximum number of retransmissions */
   unsigned int timeout; /* request timeout in us */
@@ -176,25 +210,85 @@ struct g3plc_config {
   void *data; /* context data passed to user callbacks */
 };
 
+/* State of a driver instance. The structure is only public so
+   that it can be allocated statically, the fields are private.
+   It must be zeroed before the first g3plc_init() and each
+   instance drives its own device. */
+struct g3plc_ctx {
+  /* configuration with platform dependent functions,
+     source mac address, callbacks and flags */
+  struct g3plc_config conf;
+
+  /* Used in conjunction with the dissector
+     to synchronize request/confirm. The payload
+     is copied in a buffer of the instance so
+     the dissector never has to allocate. */
+  uint32_t       waited_cmd_literal;
+  unsigned char *waited_cmd_data;
+  unsigned char  waited_cmd_buf[G3PLC_MAX_CMD];
+
+  /* command buffers (see cmdbuf.h) */
+  unsigned char snd_cmdbuf[G3PLC_MAX_CMD];
+  unsigned char snd_cmdbuf_packed[G3PLC_MAX_PACKED_CMD];
+  unsigned char rcv_cmdbuf_packed[G3PLC_MAX_PACKED_CMD];
+
+  /* Position in the received command packet and its size,
+     glue between uart_putc() and recv_frame(). */
+  unsigned int rcv_pos;
+  unsigned int rcv_size;
+  int          rcv_overflow;
+
+  /* retries left to the current reset and spent by all of them */
+  unsigned int  boot_budget;
+  unsigned long boot_retries;
+};
+
 /* Initialize the G3PLC driver (see g3plc_config).
    Return 0 on success, for other errror codes see g3plc_init_status. */
-int g3plc_init(const struct g3plc_config *conf);
+int g3plc_init(struct g3plc_ctx *ctx, const struct g3plc_config *conf);
 
 /* Send a command to the G3PLC device.
    The command before must be four bytes longer than actually announced
    since the function will append a CRC to the supplied buffer. */
-int g3plc_command(struct g3plc_cmd *cmd, unsigned int size);
+int g3plc_command(struct g3plc_ctx *ctx, struct g3plc_cmd *cmd, unsigned int size);
+
+/* A piece of a payload (see g3plc_sendv()). */
+struct g3plc_seg {
+  const void  *base;
+  unsigned int size;
+};
+
+/* Same as g3plc_command() for a command of size bytes followed
+   by count segments, the command buffer does not need room for
+   the CRC. The segments are escaped straight in the packed buffer. */
+int g3plc_commandv(struct g3plc_ctx *ctx, struct g3plc_cmd *cmd, unsigned int size,
+                   const struct g3plc_seg *segs, unsigned int count);
 
 /* Assemble and send a frame to the specified destination using G3PLC.
    When ACK is enabled, this function will block until the packet has
    been successfully transmitted. For the error see g3plc_send_status.
    If the tx pointer is not null, it is replaced with the number of
    transmissions necessary to succesfully send the packet. */
-int g3plc_send(uint16_t dst, const void *payload, unsigned int payload_size);
+int g3plc_send(struct g3plc_ctx *ctx, uint16_t dst, const void *payload, unsigned int payload_size);
+
+/* Same as g3plc_send() for a payload made of count segments one
+   after the other, without assembling them first. */
+int g3plc_sendv(struct g3plc_ctx *ctx, uint16_t dst, const struct g3plc_seg *segs, unsigned int count);
+
+/* Same as g3plc_sendv() to the extended address of the destination,
+   for a device that has no short address or whose short address is
+   not known. The frame also carries our own extended address so
+   that the destination can answer the same way. */
+int g3plc_sendv_ext(struct g3plc_ctx *ctx, uint64_t dst, const struct g3plc_seg *segs, unsigned int count);
+
+/* Change the maximum number of retransmissions of the modem
+   (G3PLC_ATTR_RETRANS) for the next frames. This must not be
+   called while a frame is being sent. */
+int g3plc_set_retrans(struct g3plc_ctx *ctx, unsigned int retrans);
 
 /* Start the processing of a frame. Can be called either automatically
    when a complete frame has been received or manually from another thread. */
-int g3plc_recv_frame(void);
+int g3plc_recv_frame(struct g3plc_ctx *ctx);
 
 /* Called by the platform dependent part of the driver when a character
    has been received on UART from the device. This function can block
@@ -202,9 +296,12 @@ int g3plc_recv_frame(void);
    if the receive callback itself is blocked. Note that this function
    is *NOT* reentrant. You have to wait for its completion until you
    can call it again. */
-int g3plc_uart_putc(unsigned char c);
+int g3plc_uart_putc(struct g3plc_ctx *ctx, unsigned char c);
+
+/* Reset the modem and upload the firmware (see G3PLC_BOOT_RETRIES). */
+int g3plc_reset(struct g3plc_ctx *ctx);
 
-/* Reset the modem. */
-int g3plc_reset(void);
+/* Retries spent by the resets so far (see G3PLC_BOOT_RETRIES). */
+unsigned long g3plc_boot_retries(const struct g3plc_ctx *ctx);
 
 #endif /* _G3PLC_H_ */
@@ -23,9 +23,100 @@
    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <string.h>
+
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#elif defined(__ARM_NEON)
+# include <arm_neon.h>
+#endif
+
 #include "g3plc.h"
 #include "crc32.h"
 
+/* Return the number of leading bytes that do not need to be escaped.
+   Most frames contain no delimiter at all, so we compare 16 bytes at
+   a time when SIMD is available and only fall back to the scalar loop
+   for the tail or to locate the escape inside a vector. */
+static inline unsigned int clean_run(const unsigned char *s, unsigned int size)
+{
+  unsigned int n = 0;
+
+#if defined(__SSE2__)
+  const __m128i flag = _mm_set1_epi8(0x7e);
+  const __m128i esc  = _mm_set1_epi8(0x7d);
+
+  while(size - n >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + n));
+    int mask  = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, flag),
+                                               _mm_cmpeq_epi8(v, esc)));
+
+    if(mask)
+      return n + __builtin_ctz(mask);
+
+    n += 16;
+  }
+#elif defined(__ARM_NEON)
+  const uint8x16_t flag = vdupq_n_u8(0x7e);
+  const uint8x16_t esc  = vdupq_n_u8(0x7d);
+
+  while(size - n >= 16) {
+    uint8x16_t v = vld1q_u8(s + n);
+    uint8x16_t m = vorrq_u8(vceqq_u8(v, flag), vceqq_u8(v, esc));
+    uint64x2_t w = vreinterpretq_u64_u8(m);
+
+    /* The scalar loop below finds where the escape is. */
+    if(vgetq_lane_u64(w, 0) | vgetq_lane_u64(w, 1))
+      break;
+
+    n += 16;
+  }
+#endif
+
+  while(n < size && s[n] != 0x7e && s[n] != 0x7d)
+    n++;
+
+  return n;
+}
+
+/* Return the number of leading bytes that are not an escape.
+   Same as clean_run() but for the receiving side where the
+   frame delimiters have already been removed. */
+static inline unsigned int escape_run(const unsigned char *s, unsigned int size)
+{
+  unsigned int n = 0;
+
+#if defined(__SSE2__)
+  const __m128i esc = _mm_set1_epi8(0x7d);
+
+  while(size - n >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + n));
+    int mask  = _mm_movemask_epi8(_mm_cmpeq_epi8(v, esc));
+
+    if(mask)
+      return n + __builtin_ctz(mask);
+
+    n += 16;
+  }
+#elif defined(__ARM_NEON)
+  const uint8x16_t esc = vdupq_n_u8(0x7d);
+
+  while(size - n >= 16) {
+    uint64x2_t w = vreinterpretq_u64_u8(vceqq_u8(vld1q_u8(s + n), esc));
+
+    if(vgetq_lane_u64(w, 0) | vgetq_lane_u64(w, 1))
+      break;
+
+    n += 16;
+  }
+#endif
+
+  while(n < size && s[n] != 0x7d)
+    n++;
+
+  return n;
+}
+
 void append_crc(const struct g3plc_config *g3plc, unsigned char *src, unsigned int *size)
 {
   uint32_t crc = crc32_G3PLC(src, *size, 0);
@@ -49,62 +140,109 @@ int extract_crc(const struct g3plc_config *g3plc, const unsigned char *src, unsi
   return crc_found == crc_expected;
 }
 
+/* HDLC escaping:
+    0x7e -> 0x7d 0x5e
+    0x7d -> 0x7d 0x5d
+   Return the end of the escaped bytes. */
+static unsigned char * escape(unsigned char *d, const unsigned char *src, unsigned int size)
+{
+  while(size) {
+    unsigned int n = clean_run(src, size);
+
+    /* copy clean runs in bulk */
+    memcpy(d, src, n);
+    d    += n;
+    src  += n;
+    size -= n;
+
+    if(size) {
+      *d++ = 0x7d;
+      *d++ = *src++ ^ 0x20;
+      size--;
+    }
+  }
+
+  return d;
+}
+
 unsigned int pack(unsigned char *dst, const unsigned char *src, unsigned int size)
 {
   unsigned char *d = dst;
 
-  *d++ = 0x7e; /* frame delimiter */
+  *d++ = 0x7e;                /* frame delimiter */
+  d    = escape(d, src, size);
+  *d++ = 0x7e;                /* frame delimiter */
 
-  /* HDLC escaping:
-      0x7e -> 0x7d 0x5e
-      0x7d -> 0x7d 0x5d */
-  while(size--) {
-    unsigned char c = *src++;
+  return (d - dst);
+}
 
-    switch(c) {
-    case 0x7e:
-    case 0x7d:
-      *d++ = 0x7d;
-      *d++ = c ^ 0x20;
-      break;
-    default:
-      *d++ = c;
-      break;
-    }
+unsigned int packv(const struct g3plc_config *g3plc, unsigned char *dst,
+                   const unsigned char *src, unsigned int size,
+                   const struct g3plc_seg *segs, unsigned int count)
+{
+  unsigned char *d = dst;
+  uint32_t crc = crc32_G3PLC(src, size, 0);
+  unsigned int i;
+
+  *d++ = 0x7e; /* frame delimiter */
+  d    = escape(d, src, size);
+
+  for(i = 0 ; i < count ; i++) {
+    crc = crc32_G3PLC(segs[i].base, segs[i].size, crc);
+    d   = escape(d, segs[i].base, segs[i].size);
   }
 
+  /* network order (see append_crc()) */
+  crc  = g3plc->htonl(crc);
+  d    = escape(d, (const unsigned char *)&crc, sizeof(uint32_t));
   *d++ = 0x7e; /* frame delimiter */
 
   return (d - dst);
 }
 
-unsigned int unpack(unsigned char *dst, const unsigned char *src, unsigned int size)
+/* HDLC unescaping:
+    0x7d 0x5e -> 0x7e
+    0x7d 0x5d -> 0x7d
+   The destination may overlap the source as long as it does not
+   start after it, since the output is never larger than the input.
+   Clean runs are moved in bulk. A trailing escape is dropped. */
+static unsigned int unescape(unsigned char *dst, const unsigned char *src, unsigned int size)
 {
   unsigned char *d = dst;
-  int n = size; /* We use a signed integer to avoid a buffer overflow.
-                   The negatives eat up an off by one in the while condition.
-                   It helps in the case 0x7e 0x7d 0x7e. */
-
-  /* skip frame delimiter */
-  src++;
-  n -= 2;
-
-  /* HDLC unescaping:
-      0x7d 0x5e -> 0x7e
-      0x7d 0x5d -> 0x7d */
-  while(n-- > 0) {
-    unsigned char c = *src++;
-
-    if(c == 0x7d) {
-      /* escaped character */
-      *d = *src++ ^ 0x20;
-      n--;
-    }
-    else
-      *d = c;
 
-    d++;
+  while(size) {
+    unsigned int n = escape_run(src, size);
+
+    memmove(d, src, n);
+    d    += n;
+    src  += n;
+    size -= n;
+
+    if(size < 2)
+      break;
+
+    /* escaped character */
+    *d++  = src[1] ^ 0x20;
+    src  += 2;
+    size -= 2;
   }
 
   return (d - dst);
 }
+
+unsigned int unpack(unsigned char *dst, const unsigned char *src, unsigned int size)
+{
+  /* skip frame delimiters */
+  if(size < 2)
+    return 0;
+
+  return unescape(dst, src + 1, size - 2);
+}
+
+unsigned int unpack_inplace(unsigned char *buf, unsigned int size)
+{
+  if(size < 2)
+    return 0;
+
+  return unescape(buf, buf + 1, size - 2);
+}
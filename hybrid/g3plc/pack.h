@@ -40,8 +40,20 @@ int extract_crc(const struct g3plc_config *g3plc, const unsigned char *src, unsi
    Returns the size of the packed destination buffer. */
 unsigned int pack(unsigned char *dst, const unsigned char *src, unsigned int size);
 
+/* Same as append_crc() then pack() for a command made of size bytes
+   of src followed by count segments. Neither src nor the segments
+   are modified, the CRC is computed over all of them in turn. */
+unsigned int packv(const struct g3plc_config *g3plc, unsigned char *dst,
+                   const unsigned char *src, unsigned int size,
+                   const struct g3plc_seg *segs, unsigned int count);
+
 /* Remove frame delimiters and unescape the buffer using HDLC, store the result in destination buffer.
    Returns the size of the unpacked destination buffer. */
 unsigned int unpack(unsigned char *dst, const unsigned char *src, unsigned int size);
 
+/* Same as unpack() but the command is unescaped in the packed buffer itself.
+   The unpacked command starts at the beginning of the buffer.
+   Returns the size of the unpacked command. */
+unsigned int unpack_inplace(unsigned char *buf, unsigned int size);
+
 #endif /* _PACK_H_ */
@@ -0,0 +1,223 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/inotify.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <poll.h>
+#include <err.h>
+
+#include "hotplug.h"
+#include "uart.h"
+
+static struct device {
+  int                   fd;
+  const char           *path;
+  char                  dir[PATH_MAX];
+  const struct termios *tty;
+  hotplug_cb            attached;
+  void                 *data;
+  int                   lost;
+  int                   wd; /* inotify watch of the directory, -1 for none */
+  struct hotplug_stats  stats;
+} devices[HOTPLUG_MAX_DEVICES];
+static unsigned int ndevices;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int ifd = -1;
+
+static struct device * find(int fd)
+{
+  unsigned int i;
+
+  for(i = 0 ; i < ndevices ; i++)
+    if(devices[i].fd == fd)
+      return &devices[i];
+  return NULL;
+}
+
+static int any_lost(void)
+{
+  unsigned int i;
+
+  for(i = 0 ; i < ndevices ; i++)
+    if(devices[i].lost)
+      return 1;
+  return 0;
+}
+
+void hotplug_watch(int fd, const char *path, const struct termios *tty,
+                   hotplug_cb attached, void *data)
+{
+  struct device *d;
+  const char *slash = strrchr(path, '/');
+
+  if(ndevices == HOTPLUG_MAX_DEVICES)
+    errx(EXIT_FAILURE, "too many hotplug devices");
+  d = &devices[ndevices++];
+
+  *d = (struct device){ .fd       = fd,
+                        .path     = path,
+                        .tty      = tty,
+                        .attached = attached,
+                        .data     = data,
+                        .wd       = -1,
+                        .stats    = { .attached = 1 } };
+
+  if(!slash)
+    strcpy(d->dir, ".");
+  else if(slash == path)
+    strcpy(d->dir, "/");
+  else
+    snprintf(d->dir, sizeof(d->dir), "%.*s", (int)(slash - path), path);
+}
+
+void hotplug_lost(int fd)
+{
+  struct device *d;
+
+  pthread_mutex_lock(&lock);
+  d = find(fd);
+  if(d && !d->lost) {
+    d->lost           = 1;
+    d->stats.attached = 0;
+    d->stats.detaches++;
+    pthread_cond_signal(&cond);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+/* Open the lost lines whose device is back, the callbacks are
+   called without the lock. Watch the directories of the others. */
+static void attach(void)
+{
+  struct device *back[HOTPLUG_MAX_DEVICES];
+  unsigned int i, n = 0;
+
+  pthread_mutex_lock(&lock);
+  for(i = 0 ; i < ndevices ; i++) {
+    struct device *d = &devices[i];
+
+    if(!d->lost)
+      continue;
+
+    if(!serial_reopen(d->fd, d->tty, d->path)) {
+      d->lost           = 0;
+      d->stats.attached = 1;
+      d->stats.attaches++;
+      back[n++] = d;
+    }
+    else if(d->wd < 0)
+      d->wd = inotify_add_watch(ifd, d->dir, IN_CREATE | IN_ATTRIB | IN_MOVED_TO);
+  }
+  pthread_mutex_unlock(&lock);
+
+  for(i = 0 ; i < n ; i++)
+    back[i]->attached(back[i]->fd, back[i]->data);
+}
+
+/* Any change in a watched directory may be a device coming back.
+   A directory removed drops its watch, it is watched again once
+   it exists. */
+static void drain_events(void)
+{
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  unsigned int i;
+  ssize_t n;
+
+  n = read(ifd, buf, sizeof(buf));
+  if(n < 0) {
+    if(errno == EINTR || errno == EAGAIN)
+      return;
+    err(EXIT_FAILURE, "cannot read inotify events");
+  }
+
+  pthread_mutex_lock(&lock);
+  for(ev = (void *)buf ; (char *)ev < buf + n ; ev = (void *)((char *)(ev + 1) + ev->len)) {
+    if(!(ev->mask & IN_IGNORED))
+      continue;
+    for(i = 0 ; i < ndevices ; i++)
+      if(devices[i].wd == ev->wd)
+        devices[i].wd = -1;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+static void * hotplug_thread(void *p)
+{
+  struct pollfd pfd = { .fd = ifd, .events = POLLIN };
+
+  (void)p;
+
+  while(1) {
+    pthread_mutex_lock(&lock);
+    while(!any_lost())
+      pthread_cond_wait(&cond, &lock);
+    pthread_mutex_unlock(&lock);
+
+    attach();
+
+    if(poll(&pfd, 1, HOTPLUG_RETRY) > 0)
+      drain_events();
+  }
+
+  return NULL;
+}
+
+void hotplug_start(void)
+{
+  pthread_t thread;
+
+  if(!ndevices)
+    return;
+
+  ifd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+  if(ifd < 0)
+    err(EXIT_FAILURE, "cannot watch the serial devices");
+  if(pthread_create(&thread, NULL, hotplug_thread, NULL))
+    errx(EXIT_FAILURE, "cannot create the hotplug thread");
+  pthread_detach(thread);
+}
+
+int hotplug_enabled(void)
+{
+  return ndevices != 0;
+}
+
+void hotplug_stats(int fd, struct hotplug_stats *stats)
+{
+  struct device *d;
+
+  pthread_mutex_lock(&lock);
+  d = find(fd);
+  *stats = d ? d->stats : (struct hotplug_stats){ 0 };
+  pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,80 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _HOTPLUG_H_
+#define _HOTPLUG_H_
+
+#include <termios.h>
+
+/* Serial lines that survive their USB adapter being unplugged.
+
+   A line that cannot be read anymore is given to hotplug_lost()
+   by the event loop (see event_add_hotplug()). Its descriptor
+   stays open on the dead line so that the writes fail at once
+   and the hybrid layer tries the other medium meanwhile. The
+   hotplug thread watches the directory of its path with inotify
+   (/dev or /dev/serial/by-id...) and every HOTPLUG_RETRY ms in
+   case that directory is gone too. Once the device is back it is
+   opened again on the same descriptor with the attributes it had
+   (see serial_reopen()) and the attached callback is called from
+   the hotplug thread to register it in the event loop again.
+
+   Nothing is reset on the way: a LoRa module is transparent and
+   a G3-PLC modem that stayed powered keeps its program and its
+   state, the attach is warm. A modem that lost them stops
+   confirming and its breaker restarts it (see g3plc_recover). */
+
+#define HOTPLUG_RETRY       1000 /* ms */
+#define HOTPLUG_MAX_DEVICES 4
+
+/* Statistics of a watched line (see hotplug_stats()) */
+struct hotplug_stats {
+  unsigned long detaches;
+  unsigned long attaches;
+  int           attached;
+};
+
+typedef void (*hotplug_cb)(int fd, void *data);
+
+/* Watch the line of a descriptor opened with serial_init() on this
+   path with these attributes, which are read at each attach. The
+   path and the attributes must outlive the driver. */
+void hotplug_watch(int fd, const char *path, const struct termios *tty,
+                   hotplug_cb attached, void *data);
+
+/* The line of a watched descriptor was lost, open it again once its
+   device is back. This may be called from any thread. */
+void hotplug_lost(int fd);
+
+/* Start the hotplug thread once the lines are watched.
+   Exit on error. */
+void hotplug_start(void);
+
+/* Whether a line is watched. */
+int hotplug_enabled(void);
+
+/* Copy the statistics of a watched line, zero when it is not. */
+void hotplug_stats(int fd, struct hotplug_stats *stats);
+
+#endif /* _HOTPLUG_H_ */
@@ -0,0 +1,167 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "frag.h"
+
+#define BIT_ISSET(b, i) ((b)[(i) >> 3] &  (1 << ((i) & 7)))
+#define BIT_SET(b, i)   ((b)[(i) >> 3] |= (1 << ((i) & 7)))
+
+unsigned int frag_count(unsigned int frag_size, unsigned int size)
+{
+  unsigned int count = size ? (size + frag_size - 1) / frag_size : 1;
+
+  if(size > FRAG_MAX_SIZE || count > FRAG_MAX_COUNT)
+    return 0;
+  return count;
+}
+
+unsigned int frag_header(void *buf, unsigned int frag_size, uint8_t tag, unsigned int index,
+                         unsigned int size)
+{
+  unsigned char *p = buf;
+  unsigned int offset = index * frag_size;
+  unsigned int len = size - offset < frag_size ? size - offset : frag_size;
+
+  p[0] = tag;
+  p[1] = index | (offset + len == size ? FRAG_LAST : 0);
+
+  return len;
+}
+
+unsigned int frag_build(void *buf, unsigned int frag_size, uint8_t tag, unsigned int index,
+                        const void *payload, unsigned int size)
+{
+  unsigned char *p = buf;
+  unsigned int len = frag_header(buf, frag_size, tag, index, size);
+
+  memcpy(p + FRAG_HDR_SIZE, (const unsigned char *)payload + index * frag_size, len);
+
+  return FRAG_HDR_SIZE + len;
+}
+
+void frag_init(struct frag_pool *pool, unsigned int frag_size, unsigned long timeout)
+{
+  memset(pool, 0, sizeof(struct frag_pool));
+
+  pool->frag_size = frag_size;
+  pool->timeout   = timeout;
+}
+
+/* Find the buffer of a message or allocate a new one. We
+   reuse the first free or expired buffer, otherwise the
+   oldest one is dropped. */
+static struct frag_buffer * lookup(struct frag_pool *pool, uint16_t src, uint8_t tag,
+                                   unsigned long now)
+{
+  struct frag_buffer *victim = NULL;
+  struct frag_buffer *oldest = NULL;
+  unsigned int i;
+
+  for(i = 0 ; i < FRAG_POOL_SIZE ; i++) {
+    struct frag_buffer *b = &pool->buffers[i];
+    int live = b->used && now - b->stamp < pool->timeout;
+
+    if(live && b->src == src && b->tag == tag)
+      return b;
+    else if(!live) {
+      if(!victim)
+        victim = b;
+    }
+    else if(!oldest || now - b->stamp > now - oldest->stamp)
+      oldest = b;
+  }
+
+  if(!victim)
+    victim = oldest;
+
+  victim->used     = 1;
+  victim->stamp    = now;
+  victim->src      = src;
+  victim->tag      = tag;
+  victim->count    = 0;
+  victim->received = 0;
+  victim->size     = 0;
+  memset(victim->bitmap, 0, sizeof(victim->bitmap));
+
+  return victim;
+}
+
+int frag_input(struct frag_pool *pool, uint16_t src, const void *frag, unsigned int size,
+               unsigned long now, const void **msg, unsigned int *msg_size)
+{
+  const unsigned char *p = frag;
+  struct frag_buffer *b;
+  unsigned int index, last, len, offset;
+  uint8_t tag;
+
+  if(size < FRAG_HDR_SIZE)
+    return FRAG_INVALID;
+
+  tag   = p[0];
+  index = p[1] & ~FRAG_LAST;
+  last  = p[1] & FRAG_LAST;
+  len   = size - FRAG_HDR_SIZE;
+  p    += FRAG_HDR_SIZE;
+
+  /* All fragments but the last are full. */
+  offset = index * pool->frag_size;
+  if((!last && len != pool->frag_size) || len > pool->frag_size ||
+     offset + len > FRAG_MAX_SIZE)
+    return FRAG_INVALID;
+
+  /* Unfragmented messages do not need a buffer. */
+  if(last && !index) {
+    *msg      = p;
+    *msg_size = len;
+    return FRAG_COMPLETE;
+  }
+
+  b = lookup(pool, src, tag, now);
+  b->stamp = now;
+
+  if(BIT_ISSET(b->bitmap, index))
+    return FRAG_PENDING; /* duplicate */
+
+  if(last) {
+    if(b->count) /* another last fragment */
+      return FRAG_INVALID;
+    b->count = index + 1;
+    b->size  = offset + len;
+  }
+  else if(b->count && index >= b->count)
+    return FRAG_INVALID;
+
+  BIT_SET(b->bitmap, index);
+  memcpy(b->buf + offset, p, len);
+
+  if(++b->received != b->count)
+    return FRAG_PENDING;
+
+  b->used   = 0;
+  *msg      = b->buf;
+  *msg_size = b->size;
+  return FRAG_COMPLETE;
+}
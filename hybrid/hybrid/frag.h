@@ -0,0 +1,106 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Fragmentation and reassembly of messages larger than a frame.
+   This is platform independent and does not depend on the MAC
+   layer either, it's just standard ISO C. */
+
+#ifndef _FRAG_H_
+#define _FRAG_H_
+
+#include <stdint.h>
+
+/*
+   Fragment format:
+     [tag (8)][last (1)][index (7)]<payload...>
+
+   All the fragments of a message have the same tag. The tag is
+   incremented for each message sent. Each fragment but the last
+   one carries exactly frag_size bytes of payload, so the receiver
+   knows where each fragment goes even when they are received out
+   of order. A message that fits in one frame is a single fragment
+   with the last bit set and index zero.
+*/
+#define FRAG_HDR_SIZE  (sizeof(uint8_t) * 2)
+#define FRAG_LAST      0x80
+#define FRAG_MAX_COUNT 128
+
+/* Maximum size of a reassembled message. */
+#define FRAG_MAX_SIZE  1024
+
+/* Number of messages that can be reassembled at once.
+   When all buffers are in use the oldest one is dropped. */
+#define FRAG_POOL_SIZE 4
+
+/* Status of a received fragment */
+enum frag_status {
+  FRAG_COMPLETE, /* the message is complete */
+  FRAG_PENDING,  /* more fragments are expected */
+  FRAG_INVALID,  /* invalid fragment header or size */
+};
+
+/* Reassembly buffers. A buffer expires when no
+   fragment of its message was received for timeout us. */
+struct frag_pool {
+  unsigned int  frag_size;
+  unsigned long timeout;
+
+  struct frag_buffer {
+    unsigned int  used;
+    unsigned long stamp;    /* last fragment received */
+    uint16_t      src;
+    uint8_t       tag;
+    unsigned int  count;    /* number of fragments (0 until the last one) */
+    unsigned int  received; /* number of different fragments received */
+    unsigned int  size;     /* message size (known with the last fragment) */
+    uint8_t       bitmap[FRAG_MAX_COUNT / 8];
+    unsigned char buf[FRAG_MAX_SIZE];
+  } buffers[FRAG_POOL_SIZE];
+};
+
+/* Number of fragments of frag_size bytes necessary for a message.
+   Return 0 if the message is too large to be fragmented. */
+unsigned int frag_count(unsigned int frag_size, unsigned int size);
+
+/* Write the fragment index of a message in buf which must be able to
+   contain FRAG_HDR_SIZE + frag_size bytes. Return the fragment size. */
+unsigned int frag_build(void *buf, unsigned int frag_size, uint8_t tag, unsigned int index,
+                        const void *payload, unsigned int size);
+
+/* Same as frag_build() but only write the header in buf which must be
+   able to contain FRAG_HDR_SIZE bytes. Return the size of the payload
+   of the fragment, which starts at index * frag_size in the message. */
+unsigned int frag_header(void *buf, unsigned int frag_size, uint8_t tag, unsigned int index,
+                         unsigned int size);
+
+/* Initialize the reassembly buffers. */
+void frag_init(struct frag_pool *pool, unsigned int frag_size, unsigned long timeout);
+
+/* Process a fragment received from src at the time now (in us). When
+   the message is complete, msg and msg_size are replaced with the
+   reassembled message which is valid until the next call. */
+int frag_input(struct frag_pool *pool, uint16_t src, const void *frag, unsigned int size,
+               unsigned long now, const void **msg, unsigned int *msg_size);
+
+#endif /* _FRAG_H_ */
@@ -33,8 +33,80 @@ const char * hybrid_flag2str(enum hybrid_flags flag)
     return "invalid";
   case HYBRID_NOACK:
     return "no ACK";
+  case HYBRID_RACE:
+    return "race";
+  case HYBRID_ADAPTIVE:
+    return "adaptive";
+  case HYBRID_COMPRESS:
+    return "compression";
+  case HYBRID_DUTY:
+    return "duty cycle";
+  case HYBRID_DEDUP:
+    return "deduplication";
+  case HYBRID_BALANCE:
+    return "load balancing";
+  case HYBRID_ROUTE:
+    return "routing";
+  case HYBRID_CACHE:
+    return "medium cache";
+  case HYBRID_TUNE:
+    return "retransmission tuning";
+  case HYBRID_TRANSPORT:
+    return "end-to-end transport";
+  case HYBRID_DELTA:
+    return "delta coding";
+  case HYBRID_DIVERSITY:
+    return "reception diversity";
+  case HYBRID_ORDER:
+    return "in-order delivery";
   default:
     return "unknown flag";
   }
 }
 
+const char * hybrid_source2str(enum hybrid_source source)
+{
+  switch(source) {
+  case HYBRID_SOURCE_LORA:
+    return "lora";
+  case HYBRID_SOURCE_G3PLC:
+    return "g3plc";
+  default:
+    return "unknown medium";
+  }
+}
+
+/* The status is an int as it may be one of the HYBRID_ERR_* codes. */
+const char * hybrid_snd2str(int status)
+{
+  switch(status) {
+  case HYBRID_SND_SUCCESS:
+    return "success";
+  case HYBRID_SND_TOOLONG:
+    return "payload too long";
+  case HYBRID_SND_NOACK:
+    return "no ACK";
+  case HYBRID_SND_OOM:
+    return "out of memory";
+  case HYBRID_SND_DUTY:
+    return "duty cycle exhausted";
+  case HYBRID_SND_EXPIRED:
+    return "deadline passed";
+  case HYBRID_ERR_LORA:
+    return "LoRa error";
+  case HYBRID_ERR_G3PLC:
+    return "G3-PLC error";
+  default:
+    return "unknown status";
+  }
+}
+
+int hybrid_str2source(const char *s)
+{
+  if(!strcmp("lora", s))
+    return HYBRID_SOURCE_LORA;
+  else if(!strcmp("g3plc", s))
+    return HYBRID_SOURCE_G3PLC;
+  return -1;
+}
+
@@ -28,5 +28,10 @@
 #include "hybrid.h"
 
 const char * hybrid_flag2str(enum hybrid_flags flag);
+const char * hybrid_source2str(enum hybrid_source source);
+const char * hybrid_snd2str(int status);
+
+/* Return -1 when the medium is unknown. */
+int hybrid_str2source(const char *s);
 
 #endif /* _HYBRID_STR_H_ */
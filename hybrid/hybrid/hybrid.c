@@ -23,12 +23,19 @@
  */
 
 #include <stdlib.h>
+#include <limits.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "lora/loramac.h"
 #include "g3plc/g3plc.h"
+#include "frag.h"
+#include "probe.h"
 #include "hybrid.h"
 
+/* Payload of each LoRa fragment but the last. */
+#define LORA_FRAG_SIZE ((LORAMAC_MAX_PAYLOAD) - FRAG_HDR_SIZE)
+
 /* child layers error code */
 int lora_errno;
 int g3plc_errno;
@@ -53,163 +60,3539 @@ int g3plc_errno;
 static struct hybrid_config  hybrid;
 static struct loramac_config lora;
 static struct g3plc_config   g3plc;
+static struct g3plc_ctx      g3plc_ctx;
+
+/* The LoRaMAC instance of the main module and of the other
+   modules (see hybrid_lora_module), the main one has none. */
+static struct lora_radio {
+  struct loramac_ctx               mac;
+  const struct hybrid_lora_module *module;
+} lora_radios[HYBRID_MAX_LORA_MODULES + 1];
+static unsigned int lora_nradios; /* with the main one */
 
 /* Initialization status */
 enum hybrid_init_status {
   HYBRID_INIT_SUCCESS,
+  HYBRID_INIT_DUTY,         /* no duty cycle for this frequency */
+  HYBRID_INIT_MODULES,      /* too many LoRa modules */
 };
 
-/* Status of a sent frame/command */
-enum hybrid_send_status {
-  HYBRID_SND_SUCCESS,
-  HYBRID_SND_TOOLONG,       /* payload too long */
-  HYBRID_SND_NOACK,         /* maximum number of retransmissions reached */
+/* A message being sent, as the segments of the caller behind the
+   headers of this layer (see hybrid_sendv()). Each header is a
+   segment of its own so that the payload is only copied once, in
+   the frame of the MAC layer. A fragment or transport segment is a
+   slice of these segments behind its header. */
+#define TXMSG_SEGS (HYBRID_MAX_SEGS + 6)
+struct txmsg {
+  struct hybrid_seg seg[TXMSG_SEGS];
+  unsigned int count;
+  unsigned int size;
+  uint64_t ext; /* extended address of the destination on G3-PLC, 0 for none */
+  int probe;    /* keepalive, not a sample of the throughput (see hybrid_probe()) */
 };
 
-void hybrid_lora_recv(uint16_t src, uint16_t dst,
-                     const void *payload, unsigned int payload_size,
-                     int status, void *data)
+/* A frame sent on both media at once. Each medium
+   gets the same copy of the numbered message. */
+struct race_frame {
+  uint16_t dst;
+  unsigned int size;
+  unsigned long deadline;
+  unsigned char payload[HYBRID_MAX_PAYLOAD];
+};
+
+/* Tag of the last message sent on LoRa and
+   reassembly of the messages received on LoRa. */
+static uint8_t lora_frag_tag;
+static struct frag_pool lora_frags;
+
+/* Compression statistics and the buffer of the last message
+   decompressed from LoRa (see HYBRID_COMPRESS and HYBRID_DELTA). */
+static struct hybrid_codec_stats codec_stats;
+
+/* Frame counters. Both media may send concurrently
+   so they are updated atomically without a lock. */
+static struct hybrid_counters counters;
+#define COUNT(counter) __atomic_add_fetch(&counters.counter, 1, __ATOMIC_RELAXED)
+
+/* Step of the message being sent (see trace in hybrid_config). */
+#define TRACE(event, arg) if(hybrid.trace) hybrid.trace(event, arg, hybrid.data)
+
+/* Duty cycle budget of the LoRa sub-band (see HYBRID_DUTY). */
+static struct duty lora_duty;
+
+/* Confirms of the current window and retransmissions
+   of the modem (see HYBRID_TUNE). Only the G3-PLC
+   send path updates them. */
+static struct {
+  unsigned int frames;
+  unsigned int noacks;
+  unsigned int retrans;
+} tune;
+
+static unsigned char lora_msgbuf[HYBRID_MAX_PAYLOAD];
+
+/* Reference of the deltas of a peer (see HYBRID_DELTA). */
+struct delta_ref {
+  uint16_t      addr;
+  uint8_t       valid;
+  uint8_t       size;
+  unsigned char buf[HYBRID_DELTA_MAX];
+};
+
+/* References of the destinations. The messages in flight to a
+   destination are counted, its reference is only kept when there
+   was a single one since the receiver may have gotten them in any
+   order. Only the message alone in flight writes the reference so
+   it is read without the LoRa lock that protects the rest. */
+static struct delta_tx {
+  struct delta_ref ref;
+  unsigned int     pending; /* messages in flight */
+  uint8_t          mixed;   /* several messages were in flight */
+  unsigned int     since;   /* deltas since the last full message */
+} delta_tx[HYBRID_DELTA_PEERS];
+
+/* References of the origins by address, the least recently learned
+   one is evicted for a new origin. A delta on another reference is
+   refused before its ACK (see delta_accept()), which is how the origin
+   learns about an eviction or a restart. Only the LoRa receive path
+   uses them. */
+static struct delta_rx {
+  struct delta_ref ref;
+  unsigned long    stamp; /* when the reference was learned */
+} delta_rx[HYBRID_DELTA_PEERS];
+
+/* FNV-1a of the reference folded on 16 bits. */
+static uint16_t delta_check(const struct delta_ref *ref)
 {
-  hybrid.cb_recv(src, dst, payload, payload_size, status,
-                 HYBRID_SOURCE_LORA, hybrid.data);
+  uint32_t h = 2166136261u ^ ref->size;
+  unsigned int i;
+
+  for(i = 0 ; i < ref->size ; i++)
+    h = (h ^ ref->buf[i]) * 16777619u;
+
+  return h ^ h >> 16;
 }
 
-void hybrid_g3plc_recv(const struct g3plc_data_hdr *hdr,
-                       const void *payload, unsigned payload_size,
-                       int status, void *data)
+/* Write the runs of the message against the reference. Return the
+   size of the result or 0 when it does not fit in max bytes. A
+   single byte equal to the reference is cheaper as part of a run
+   of the message than as a run of its own. */
+static unsigned int delta_encode(const struct delta_ref *ref, const unsigned char *in,
+                                 unsigned int size, unsigned char *out, unsigned int max)
 {
-  hybrid.cb_recv(hdr->src_addr, hdr->dst_addr,
-                 payload, payload_size,
-                 status, HYBRID_SOURCE_G3PLC, hybrid.data);
+  unsigned int i = 0, j, n = 0, copy, count;
+
+  while(i < size) {
+    for(copy = 0 ; copy < 0xff && i < size && i < ref->size && in[i] == ref->buf[i] ; copy++)
+      i++;
+    for(count = 0 ; count < 0xff && i + count < size ; count++) {
+      j = i + count;
+      if(j + 1 < size && j + 1 < ref->size &&
+         in[j] == ref->buf[j] && in[j + 1] == ref->buf[j + 1])
+        break;
+    }
+
+    if(n + 2 + count > max)
+      return 0;
+    out[n++] = copy;
+    out[n++] = count;
+    memcpy(out + n, in + i, count);
+    n += count;
+    i += count;
+  }
+
+  return n;
 }
 
-int hybrid_init(const struct hybrid_config *conf)
+/* Rebuild the message from its runs. Return its size or
+   a negative value when the runs are invalid. */
+static int delta_decode(const struct delta_ref *ref, const unsigned char *in,
+                        unsigned int size, unsigned char *out, unsigned int max)
 {
-  int n;
+  unsigned int i = 0, n = 0, copy, count;
 
-  hybrid = *conf;
+  while(i < size) {
+    if(size - i < 2)
+      return -1;
+    copy  = in[i++];
+    count = in[i++];
+    if(n + copy > ref->size || count > size - i || n + copy + count > max)
+      return -1;
 
-  /* derive child MAC layers from hybrid configuration */
-  lora = (struct loramac_config){
-    .uart_send   = conf->uart_lora_send,
-    .cb_recv     = hybrid_lora_recv,
-    .start_timer = conf->start_timer,
-    .stop_timer  = conf->stop_timer,
-    .wait_timer  = conf->wait_timer,
-    .lock        = conf->lock,
-    .unlock      = conf->unlock,
-    .htons       = conf->htons,
-    .ntohs       = conf->ntohs,
-    .recv_frame  = conf->lora_recv_frame,
-    .seqno       = conf->lora.seqno,
-    .mac_address = conf->mac_address,
-    .retrans     = conf->lora.retrans,
-    .timeout     = conf->lora.timeout,
-    .sifs        = conf->lora.sifs,
-    .flags       = 0,
-    .data        = conf->data
-  };
-  g3plc = (struct g3plc_config){
-    .callbacks = (struct g3plc_callbacks){
-      .raw = NULL,
-      .cb_recv = hybrid_g3plc_recv
-    },
+    memcpy(out + n, ref->buf + n, copy);
+    n += copy;
+    memcpy(out + n, in + i, count);
+    n += count;
+    i += count;
+  }
 
-    .start_timer    = conf->start_timer,
-    .stop_timer     = conf->stop_timer,
-    .wait_timer     = conf->wait_timer,
-    .uart_send      = conf->uart_g3plc_send,
-    .uart_read      = conf->uart_g3plc_read,
-    .set_uart_speed = conf->set_uart_g3plc_speed,
-    .recv_frame     = conf->g3plc_recv_frame,
-    .reset_clear    = conf->reset_clear,
-    .reset_set      = conf->reset_set,
-    .htons          = conf->htons,
-    .htonl          = conf->htonl,
-    .ntohs          = conf->ntohs,
-    .ntohl          = conf->ntohl,
-    .usleep         = conf->usleep,
-    .boot_start     = conf->g3plc_boot_start,
-    .boot_progress  = conf->g3plc_boot_progress,
-    .boot_end       = conf->g3plc_boot_end,
-    .bandplan       = conf->g3plc.bandplan,
-    .pan_id         = conf->g3plc.pan_id,
-    .mac_address    = conf->mac_address,
-    .ext_address    = conf->g3plc.ext_address,
-    .retrans        = conf->g3plc.retrans,
-    .timeout        = conf->g3plc.timeout,
-    .flags          = 0,
-    .data           = conf->data
-  };
+  return n;
+}
 
-  if(conf->flags & HYBRID_INVALID) {
-    lora.flags  |= LORAMAC_INVALID;
-    g3plc.flags |= G3PLC_INVALID;
+/* Count a message in flight to the destination and tell whether it
+   may be a delta of the reference. Return NULL for a broadcast or
+   when the slot is in use by another destination. */
+static struct delta_tx * delta_begin(uint16_t dst, int *usable)
+{
+  struct delta_tx *tx = &delta_tx[dst % HYBRID_DELTA_PEERS];
+  unsigned int resync = __atomic_load_n(&hybrid.lora.resync, __ATOMIC_RELAXED);
+
+  if(!resync)
+    resync = HYBRID_DELTA_RESYNC;
+
+  *usable = 0;
+  if(dst == 0xffff)
+    return NULL;
+
+  hybrid.lora_lock();
+  if(tx->ref.addr != dst && tx->pending)
+    tx = NULL;
+  else {
+    if(tx->ref.addr != dst)
+      *tx = (struct delta_tx){ .ref.addr = dst };
+    if(tx->pending)
+      tx->mixed = 1;
+    *usable = tx->ref.valid && !tx->pending && tx->since < resync;
+    tx->pending++;
   }
-  if(conf->flags & HYBRID_NOACK) {
-    lora.flags  |= LORAMAC_NOACK;
-    g3plc.flags |= G3PLC_NOACK;
+  hybrid.lora_unlock();
+
+  return tx;
+}
+
+/* The message is no longer in flight. Once acknowledged it is the
+   reference of the destination, as it is for the receiver. */
+static void delta_end(struct delta_tx *tx, const void *payload, unsigned int size,
+                      int delta, int acked)
+{
+  if(!tx)
+    return;
+
+  hybrid.lora_lock();
+  if(!acked || tx->mixed)
+    tx->ref.valid = 0;
+  else if(size <= HYBRID_DELTA_MAX) {
+    memcpy(tx->ref.buf, payload, size);
+    tx->ref.size  = size;
+    tx->ref.valid = 1;
+    tx->since     = delta ? tx->since + 1 : 0;
   }
+  if(!--tx->pending)
+    tx->mixed = 0;
+  hybrid.lora_unlock();
+}
 
-  /* init child layers */
-  xLORA_(n, loramac_init, &lora);
-  xG3PLC_(n, g3plc_init, &g3plc);
+/* Find the reference of an origin. Return NULL when there is none. */
+static struct delta_rx * delta_find(uint16_t src)
+{
+  unsigned int i;
 
-  return HYBRID_INIT_SUCCESS;
+  for(i = 0 ; i < HYBRID_DELTA_PEERS ; i++)
+    if(delta_rx[i].ref.valid && delta_rx[i].ref.addr == src)
+      return &delta_rx[i];
+  return NULL;
 }
 
-static int hybrid_lora_send(uint16_t dst, const void *payload, unsigned int payload_size)
+/* A unicast message received from LoRa is the reference of its origin. */
+static void delta_learn(uint16_t src, const void *payload, unsigned int size)
 {
-  int r;
+  struct delta_rx *rx = delta_find(src);
+  unsigned int i;
 
-  r = loramac_send(dst, payload, payload_size, NULL);
-  switch(r) {
-  case LORAMAC_SND_SUCCESS:
-    return HYBRID_SND_SUCCESS; /* finally! */
-  case LORAMAC_SND_NOACK: /* nothing we can do... */
-    return HYBRID_SND_NOACK;
+  /* the sender keeps its reference too */
+  if(size > HYBRID_DELTA_MAX)
+    return;
+
+  /* a free slot or the least recently learned one */
+  if(!rx) {
+    rx = &delta_rx[0];
+    for(i = 0 ; i < HYBRID_DELTA_PEERS && rx->ref.valid ; i++)
+      if(!delta_rx[i].ref.valid ||
+         (long)(delta_rx[i].stamp - rx->stamp) < 0)
+        rx = &delta_rx[i];
+  }
+
+  memcpy(rx->ref.buf, payload, size);
+  rx->ref.addr  = src;
+  rx->ref.size  = size;
+  rx->ref.valid = 1;
+  rx->stamp     = hybrid.clock();
+}
+
+/* Tell whether a delta is on the reference of its origin. */
+static int delta_known(uint16_t src, const unsigned char *b)
+{
+  const struct delta_rx *rx = delta_find(src);
+
+  if(rx && delta_check(&rx->ref) == (b[1] << 8 | b[2]))
+    return 1;
+
+  hybrid.lora_lock();
+  codec_stats.delta_misses++;
+  hybrid.lora_unlock();
+  return 0;
+}
+
+/* A LoRa frame is refused before its ACK when it is the first fragment
+   of a delta on another reference than ours. Its origin then gives up
+   on the message, drops its reference and sends the next one in full. */
+static int delta_accept(uint16_t src, uint16_t dst, const void *payload, unsigned int payload_size,
+                        void *data)
+{
+  const unsigned char *p = payload;
+
+  (void)dst;
+  (void)data;
+
+  if(!(hybrid.flags & HYBRID_DELTA) ||
+     payload_size < FRAG_HDR_SIZE + HYBRID_CODEC_HDR_SIZE + HYBRID_DELTA_HDR_SIZE ||
+     p[1] & ~FRAG_LAST || p[FRAG_HDR_SIZE] != HYBRID_CODEC_DELTA)
+    return 1;
+  return delta_known(src, p + FRAG_HDR_SIZE);
+}
+
+/* Write the message in buf with its compression header. It is only
+   compressed, or sent as a delta of the reference of the destination
+   (see delta_begin()), when this makes it smaller. Return the size of
+   the result or 0 when it does not fit in max bytes. */
+static unsigned int encode(uint16_t dst, void *buf, unsigned int max, const void *payload,
+                           unsigned int payload_size, struct delta_tx **tx)
+{
+  unsigned char *b = buf;
+  unsigned char delta[HYBRID_DELTA_MAX];
+  unsigned long begin = hybrid.clock();
+  unsigned int limit = payload_size < max ? payload_size : max;
+  unsigned int size = 0, n = 0;
+  int compressed, usable = 0;
+  uint16_t check;
+
+  /* smaller than the message alone, not only with its header */
+  if(hybrid.flags & HYBRID_COMPRESS && limit > HYBRID_CODEC_HDR_SIZE)
+    size = hybrid.compress(payload, payload_size, b + HYBRID_CODEC_HDR_SIZE,
+                           limit - HYBRID_CODEC_HDR_SIZE);
+  compressed = size != 0;
+
+  if(compressed) {
+    b[0]  = HYBRID_CODEC_COMPRESS;
+    size += HYBRID_CODEC_HDR_SIZE;
+  }
+  else if(payload_size + HYBRID_CODEC_HDR_SIZE <= max) {
+    b[0] = HYBRID_CODEC_NONE;
+    memcpy(b + HYBRID_CODEC_HDR_SIZE, payload, payload_size);
+    size = payload_size + HYBRID_CODEC_HDR_SIZE;
+  }
+
+  /* then smaller than that as a delta */
+  *tx = hybrid.flags & HYBRID_DELTA ? delta_begin(dst, &usable) : NULL;
+  limit = size ? size - 1 : max;
+  if(usable && payload_size <= HYBRID_DELTA_MAX &&
+     limit > HYBRID_CODEC_HDR_SIZE + HYBRID_DELTA_HDR_SIZE) {
+    limit -= HYBRID_CODEC_HDR_SIZE + HYBRID_DELTA_HDR_SIZE;
+    n = delta_encode(&(*tx)->ref, payload, payload_size, delta,
+                     limit < sizeof(delta) ? limit : sizeof(delta));
+  }
+
+  if(n) {
+    check      = delta_check(&(*tx)->ref);
+    compressed = 0;
+    b[0] = HYBRID_CODEC_DELTA;
+    b[1] = check >> 8;
+    b[2] = check;
+    memcpy(b + HYBRID_CODEC_HDR_SIZE + HYBRID_DELTA_HDR_SIZE, delta, n);
+    size = n + HYBRID_CODEC_HDR_SIZE + HYBRID_DELTA_HDR_SIZE;
+  }
+
+  hybrid.lora_lock();
+  codec_stats.messages++;
+  codec_stats.compressed  += compressed;
+  codec_stats.deltas      += n != 0;
+  codec_stats.bytes_in    += payload_size;
+  codec_stats.bytes_out   += size;
+  codec_stats.compress_us += hybrid.clock() - begin;
+  hybrid.lora_unlock();
+
+  return size;
+}
+
+/* Strip the compression header and decompress the message when
+   necessary. Return false if the message is invalid. */
+static int decode(uint16_t src, const void **payload, unsigned int *payload_size)
+{
+  const unsigned char *b = *payload;
+  const struct delta_rx *rx;
+  unsigned long begin;
+  int size;
+
+  if(*payload_size < HYBRID_CODEC_HDR_SIZE)
+    return 0;
+
+  switch(b[0]) {
+  case HYBRID_CODEC_NONE:
+    *payload       = b + HYBRID_CODEC_HDR_SIZE;
+    *payload_size -= HYBRID_CODEC_HDR_SIZE;
+    return 1;
+  case HYBRID_CODEC_COMPRESS:
+    if(!(hybrid.flags & HYBRID_COMPRESS))
+      return 0;
+    begin = hybrid.clock();
+    size  = hybrid.decompress(b + HYBRID_CODEC_HDR_SIZE,
+                              *payload_size - HYBRID_CODEC_HDR_SIZE,
+                              lora_msgbuf, sizeof(lora_msgbuf));
+
+    hybrid.lora_lock();
+    codec_stats.decompress_us += hybrid.clock() - begin;
+    hybrid.lora_unlock();
+
+    if(size < 0)
+      return 0;
+    *payload      = lora_msgbuf;
+    *payload_size = size;
+    return 1;
+  case HYBRID_CODEC_DELTA:
+    if(!(hybrid.flags & HYBRID_DELTA) ||
+       *payload_size < HYBRID_CODEC_HDR_SIZE + HYBRID_DELTA_HDR_SIZE)
+      return 0;
+
+    /* not the reference of the sender, wait for the next full message,
+       this is only left to decode without ACK (see delta_accept()) */
+    if(!delta_known(src, b))
+      return 0;
+
+    rx   = delta_find(src);
+    size = delta_decode(&rx->ref, b + HYBRID_CODEC_HDR_SIZE + HYBRID_DELTA_HDR_SIZE,
+                        *payload_size - HYBRID_CODEC_HDR_SIZE - HYBRID_DELTA_HDR_SIZE,
+                        lora_msgbuf, sizeof(lora_msgbuf));
+    if(size < 0)
+      return 0;
+    *payload      = lora_msgbuf;
+    *payload_size = size;
+    return 1;
   default:
-    lora_errno = r;
-    return HYBRID_ERR_LORA;
+    return 0;
   }
 }
 
-int hybrid_send(uint16_t dst, const void *payload, unsigned int payload_size)
+void hybrid_codec_stats(struct hybrid_codec_stats *stats)
 {
-  int r;
+  hybrid.lora_lock();
+  *stats = codec_stats;
+  hybrid.lora_unlock();
+}
 
-  if(payload_size > HYBRID_MAX_PAYLOAD)
-    return HYBRID_SND_TOOLONG;
+void hybrid_counters(struct hybrid_counters *c)
+{
+  c->tx_g3plc  = __atomic_load_n(&counters.tx_g3plc, __ATOMIC_RELAXED);
+  c->tx_lora   = __atomic_load_n(&counters.tx_lora, __ATOMIC_RELAXED);
+  c->fallbacks = __atomic_load_n(&counters.fallbacks, __ATOMIC_RELAXED);
+  c->rx_g3plc  = __atomic_load_n(&counters.rx_g3plc, __ATOMIC_RELAXED);
+  c->rx_lora   = __atomic_load_n(&counters.rx_lora, __ATOMIC_RELAXED);
+  c->rx_dups   = __atomic_load_n(&counters.rx_dups, __ATOMIC_RELAXED);
+  c->g3plc_downs = __atomic_load_n(&counters.g3plc_downs, __ATOMIC_RELAXED);
+  c->g3plc_starved = __atomic_load_n(&counters.g3plc_starved, __ATOMIC_RELAXED);
+  c->forwarded = __atomic_load_n(&counters.forwarded, __ATOMIC_RELAXED);
+  c->fwd_drops = __atomic_load_n(&counters.fwd_drops, __ATOMIC_RELAXED);
+  c->cache_lora = __atomic_load_n(&counters.cache_lora, __ATOMIC_RELAXED);
+  c->access_retries = __atomic_load_n(&counters.access_retries, __ATOMIC_RELAXED);
+  c->retrans_tunes = __atomic_load_n(&counters.retrans_tunes, __ATOMIC_RELAXED);
+  c->g3plc_retrans = __atomic_load_n(&tune.retrans, __ATOMIC_RELAXED);
+  c->tx_segments  = __atomic_load_n(&counters.tx_segments, __ATOMIC_RELAXED);
+  c->seg_resent   = __atomic_load_n(&counters.seg_resent, __ATOMIC_RELAXED);
+  c->seg_switches = __atomic_load_n(&counters.seg_switches, __ATOMIC_RELAXED);
+  c->rx_segments  = __atomic_load_n(&counters.rx_segments, __ATOMIC_RELAXED);
+  c->rx_transfers = __atomic_load_n(&counters.rx_transfers, __ATOMIC_RELAXED);
+  c->tx_probes    = __atomic_load_n(&counters.tx_probes, __ATOMIC_RELAXED);
+  c->rx_probes    = __atomic_load_n(&counters.rx_probes, __ATOMIC_RELAXED);
+  c->airtime[HYBRID_SOURCE_LORA]  = __atomic_load_n(&counters.airtime[HYBRID_SOURCE_LORA], __ATOMIC_RELAXED);
+  c->airtime[HYBRID_SOURCE_G3PLC] = __atomic_load_n(&counters.airtime[HYBRID_SOURCE_G3PLC], __ATOMIC_RELAXED);
+  c->rx_held      = __atomic_load_n(&counters.rx_held, __ATOMIC_RELAXED);
+  c->rx_skipped   = __atomic_load_n(&counters.rx_skipped, __ATOMIC_RELAXED);
+  c->rx_late      = __atomic_load_n(&counters.rx_late, __ATOMIC_RELAXED);
+  c->order_depth  = __atomic_load_n(&counters.order_depth, __ATOMIC_RELAXED);
+  c->order_depth_max   = __atomic_load_n(&counters.order_depth_max, __ATOMIC_RELAXED);
+  c->order_hold_us     = __atomic_load_n(&counters.order_hold_us, __ATOMIC_RELAXED);
+  c->order_hold_max_us = __atomic_load_n(&counters.order_hold_max_us, __ATOMIC_RELAXED);
+}
 
-  r = g3plc_send(dst, payload, payload_size);
-  switch(r) {
-  case G3PLC_SND_SUCCESS:
-    return HYBRID_SND_SUCCESS; /* great! */
-  case G3PLC_SND_NOACK:
-  case G3PLC_SND_ACCESS: /* let's try LoRa instead */
-    return hybrid_lora_send(dst, payload, payload_size);
+/* Set once G3-PLC is booted and started, until
+   then all the traffic goes through LoRa. */
+static int g3plc_ready;
+
+/* Confirm timeouts in a row on G3-PLC. */
+static unsigned int g3plc_timeouts;
+
+/* State of the generator of the access backoffs. */
+static uint32_t backoff_seed;
+
+/* Sequence number of the messages we originate (see HYBRID_DEDUP). */
+static uint8_t tx_seqno;
+
+/* Next order number of each destination (see HYBRID_ORDER), the
+   broadcasts have their own. A destination that takes the slot of
+   another one starts over from 0. The senders share the table, it
+   has a spinlock. */
+static struct order_dst {
+  uint16_t dst;
+  uint8_t  valid;
+  uint8_t  next;
+} order_dsts[HYBRID_ORDER_PEERS];
+static char order_dst_busy;
+
+/* Order numbers run from 1 to 255, 0 only starts them. */
+static uint8_t order_succ(uint8_t n)
+{
+  return n == 255 ? 1 : n + 1;
+}
+
+static uint8_t order_number(uint16_t dst)
+{
+  struct order_dst *d = &order_dsts[dst % HYBRID_ORDER_PEERS];
+  uint8_t n;
+
+  while(__atomic_test_and_set(&order_dst_busy, __ATOMIC_ACQUIRE));
+  if(!d->valid || d->dst != dst)
+    *d = (struct order_dst){ .dst = dst, .valid = 1 };
+  n       = d->next;
+  d->next = order_succ(n);
+  __atomic_clear(&order_dst_busy, __ATOMIC_RELEASE);
+
+  return n;
+}
+
+/* Throughput of each medium in bytes per second, an exponentially
+   weighted moving average over the messages delivered (see
+   hybrid_balance()). Zero until the first one. */
+static unsigned long rates[2];
+
+/* Bulk bytes assigned to each medium by hybrid_balance(). */
+static unsigned long balance_bytes[2];
+static char balance_busy;
+
+/* Recent sequence numbers received from each origin. The bit i of
+   seen is set when last - i was received, bit 0 is last itself. */
+static struct dedup_peer {
+  uint16_t      src;
+  uint8_t       valid;
+  uint8_t       last;
+  uint32_t      seen;
+  unsigned long stamp;
+} dedup_peers[HYBRID_DEDUP_PEERS];
+
+/* Both receive paths check the table. The LoRa lock is held
+   for the whole SIFS before an ACK so it would stall G3-PLC,
+   instead the table has a spinlock for its few instructions. */
+static char dedup_busy;
+
+/* Slot of an origin in its set (see HYBRID_DEDUP_WAYS), NULL when
+   it has none unless evict is set. Then an origin without a slot
+   gets a free or expired one, or the least recently heard one. */
+static struct dedup_peer * dedup_slot(uint16_t src, unsigned long now, int evict)
+{
+  struct dedup_peer *set = &dedup_peers[src % (HYBRID_DEDUP_PEERS / HYBRID_DEDUP_WAYS) *
+                                        HYBRID_DEDUP_WAYS];
+  struct dedup_peer *oldest = set;
+  unsigned int i;
+
+  for(i = 0 ; i < HYBRID_DEDUP_WAYS ; i++)
+    if(set[i].valid && set[i].src == src)
+      return &set[i];
+  if(!evict)
+    return NULL;
+
+  for(i = 0 ; i < HYBRID_DEDUP_WAYS ; i++) {
+    if(!set[i].valid || now - set[i].stamp > HYBRID_DEDUP_EXPIRY)
+      return &set[i];
+    if((long)(set[i].stamp - oldest->stamp) < 0)
+      oldest = &set[i];
+  }
+  return oldest;
+}
+
+/* Check if a message has already been received from either
+   medium and remember it. A sequence number too far from the
+   window cannot be told apart, most likely the origin restarted,
+   so the window starts over from it. */
+static int dedup_duplicate(uint16_t src, uint8_t seqno)
+{
+  struct dedup_peer *peer;
+  unsigned long now = hybrid.clock();
+  uint8_t ahead, behind;
+  int dup = 0;
+
+  while(__atomic_test_and_set(&dedup_busy, __ATOMIC_ACQUIRE));
+  peer   = dedup_slot(src, now, 1);
+  ahead  = seqno - peer->last;
+  behind = peer->last - seqno;
+  if(!peer->valid || peer->src != src || now - peer->stamp > HYBRID_DEDUP_EXPIRY ||
+     (ahead >= HYBRID_DEDUP_WINDOW && behind >= HYBRID_DEDUP_WINDOW))
+    *peer = (struct dedup_peer){ .src = src, .valid = 1, .last = seqno, .seen = 1 };
+  else if(ahead && ahead < HYBRID_DEDUP_WINDOW) {
+    peer->seen = peer->seen << ahead | 1;
+    peer->last = seqno;
+  }
+  else {
+    dup = (peer->seen >> behind) & 1;
+    peer->seen |= 1UL << behind;
+  }
+  peer->stamp = now;
+  __atomic_clear(&dedup_busy, __ATOMIC_RELEASE);
+
+  return dup;
+}
+
+/* Check if a good message came from an origin in the last us
+   (see HYBRID_DIVERSITY). */
+static int dedup_recent(uint16_t src, unsigned long us)
+{
+  unsigned long now = hybrid.clock();
+  const struct dedup_peer *peer;
+  int recent;
+
+  while(__atomic_test_and_set(&dedup_busy, __ATOMIC_ACQUIRE));
+  peer   = dedup_slot(src, now, 0);
+  recent = peer && now - peer->stamp < us;
+  __atomic_clear(&dedup_busy, __ATOMIC_RELEASE);
+
+  return recent;
+}
+
+unsigned int hybrid_dedup_export(struct hybrid_dedup *peers, unsigned int max)
+{
+  const struct dedup_peer *peer;
+  unsigned long now = hybrid.clock();
+  unsigned int n = 0;
+
+  while(__atomic_test_and_set(&dedup_busy, __ATOMIC_ACQUIRE));
+  for(peer = dedup_peers ; peer < dedup_peers + HYBRID_DEDUP_PEERS && n < max ; peer++) {
+    if(!peer->valid || now - peer->stamp > HYBRID_DEDUP_EXPIRY)
+      continue;
+
+    peers[n++] = (struct hybrid_dedup){ .src  = peer->src,
+                                        .last = peer->last,
+                                        .seen = peer->seen };
+  }
+  __atomic_clear(&dedup_busy, __ATOMIC_RELEASE);
+
+  return n;
+}
+
+void hybrid_dedup_merge(const struct hybrid_dedup *merged)
+{
+  struct dedup_peer *peer;
+  unsigned long now = hybrid.clock();
+  uint8_t ahead, behind;
+
+  while(__atomic_test_and_set(&dedup_busy, __ATOMIC_ACQUIRE));
+  peer   = dedup_slot(merged->src, now, 1);
+  ahead  = merged->last - peer->last;
+  behind = peer->last - merged->last;
+  if(!peer->valid || peer->src != merged->src || now - peer->stamp > HYBRID_DEDUP_EXPIRY ||
+     (ahead >= HYBRID_DEDUP_WINDOW && behind >= HYBRID_DEDUP_WINDOW))
+    *peer = (struct dedup_peer){ .src   = merged->src,
+                                 .valid = 1,
+                                 .last  = merged->last,
+                                 .seen  = merged->seen };
+  else if(ahead && ahead < HYBRID_DEDUP_WINDOW) {
+    peer->seen = peer->seen << ahead | merged->seen;
+    peer->last = merged->last;
+  }
+  else
+    peer->seen |= merged->seen << behind;
+  peer->stamp = now;
+  __atomic_clear(&dedup_busy, __ATOMIC_RELEASE);
+}
+
+/* Strip the sequence header and drop copies. Frames with
+   errors are passed as is. Return false if the frame must
+   be dropped. */
+static int dedup_recv(uint16_t src, int status, const void **payload, unsigned int *payload_size)
+{
+  const uint8_t *p = *payload;
+
+  if(status != LORAMAC_RCV_SUCCESS) /* same value as G3PLC_RCV_SUCCESS */
+    return 1;
+  if(*payload_size < HYBRID_SEQ_HDR_SIZE)
+    return hybrid.flags & HYBRID_INVALID;
+
+  if(dedup_duplicate(src, p[0])) {
+    COUNT(rx_dups);
+    return 0;
+  }
+
+  *payload       = p + HYBRID_SEQ_HDR_SIZE;
+  *payload_size -= HYBRID_SEQ_HDR_SIZE;
+  return 1;
+}
+
+/* Short addresses of the extended ones (see HYBRID_EXT_PEERS). The
+   G3-PLC receive path learns them while the senders look them up,
+   the cache has a spinlock. A free slot has a null address. */
+static struct ext_entry {
+  uint64_t      ext;
+  uint16_t      addr;
+  unsigned long used;
+} ext_cache[HYBRID_EXT_PEERS];
+static char ext_busy;
+
+/* Fibonacci hashing, the high bits of the product are the best mixed. */
+static unsigned int ext_slot(uint64_t ext)
+{
+  return (uint32_t)((ext * 0x9e3779b97f4a7c15ULL) >> 32) % HYBRID_EXT_PEERS;
+}
+
+/* Short address of an extended one, HYBRID_NO_SHORT when unknown. */
+static uint16_t ext_lookup(uint64_t ext)
+{
+  unsigned int slot = ext_slot(ext), i;
+  uint16_t addr = HYBRID_NO_SHORT;
+  struct ext_entry *entry;
+
+  while(__atomic_test_and_set(&ext_busy, __ATOMIC_ACQUIRE));
+  for(i = 0 ; i < HYBRID_EXT_PROBES ; i++) {
+    entry = &ext_cache[(slot + i) % HYBRID_EXT_PEERS];
+    if(entry->ext == ext) {
+      entry->used = hybrid.clock();
+      addr        = entry->addr;
+      break;
+    }
+  }
+  __atomic_clear(&ext_busy, __ATOMIC_RELEASE);
+
+  return addr;
+}
+
+static void ext_learn(uint64_t ext, uint16_t addr)
+{
+  unsigned int slot = ext_slot(ext), i;
+  unsigned long now = hybrid.clock();
+  struct ext_entry *entry, *lru = NULL;
+
+  if(!ext || addr == HYBRID_NO_SHORT || addr == 0xffff)
+    return;
+
+  while(__atomic_test_and_set(&ext_busy, __ATOMIC_ACQUIRE));
+  for(i = 0 ; i < HYBRID_EXT_PROBES ; i++) {
+    entry = &ext_cache[(slot + i) % HYBRID_EXT_PEERS];
+    if(entry->ext == ext) {
+      lru = entry;
+      break;
+    }
+    if(!lru || (lru->ext && (!entry->ext || now - entry->used > now - lru->used)))
+      lru = entry;
+  }
+  *lru = (struct ext_entry){ .ext = ext, .addr = addr, .used = now };
+  __atomic_clear(&ext_busy, __ATOMIC_RELEASE);
+}
+
+/* Strip the route header of a message to us or to everyone and hand
+   the others to the platform for their next hop (see HYBRID_ROUTE).
+   Frames with errors are passed as is. Return false if the frame
+   must not be delivered. */
+static int route_recv(uint16_t *src, uint16_t *dst, int status, uint8_t *hops,
+                      const void **payload, unsigned int *payload_size)
+{
+  const uint8_t *p = *payload;
+  unsigned char msg[HYBRID_MAX_PAYLOAD];
+  uint16_t to;
+
+  if(status != LORAMAC_RCV_SUCCESS) /* same value as G3PLC_RCV_SUCCESS */
+    return 1;
+  if(*payload_size < HYBRID_ROUTE_HDR_SIZE || *payload_size > HYBRID_MAX_PAYLOAD)
+    return hybrid.flags & HYBRID_INVALID;
+
+  /* a message to no short address came to our extended one */
+  to = p[0] << 8 | p[1];
+  if(to != hybrid.mac_address && to != 0xffff && to != HYBRID_NO_SHORT) {
+    if(!hybrid.forward || p[4] >= HYBRID_MAX_HOPS) {
+      COUNT(fwd_drops);
+      return 0;
+    }
+
+    memcpy(msg, p, *payload_size);
+    msg[4]++;
+    hybrid.forward(msg, *payload_size, hybrid.data);
+    return 0;
+  }
+
+  *src           = p[2] << 8 | p[3];
+  *dst           = to;
+  *hops          = p[4];
+  *payload       = p + HYBRID_ROUTE_HDR_SIZE;
+  *payload_size -= HYBRID_ROUTE_HDR_SIZE;
+  return 1;
+}
+
+/* Segments in reassembly from each origin (see HYBRID_TRANSPORT).
+   The bit i of got is set when segment i was received. A transfer
+   stays once delivered so that the segments sent again are only
+   acknowledged. */
+static struct xport_peer {
+  uint16_t      src;
+  uint8_t       valid;
+  uint8_t       xfer;
+  uint8_t       count;
+  uint8_t       delivered;
+  uint32_t      got;
+  unsigned int  size;
+  unsigned long stamp;
+  unsigned char msg[HYBRID_MAX_PAYLOAD];
+} xport_peers[HYBRID_TRANSPORT_PEERS];
+static char xport_busy;
+
+/* Transfers waiting for their acknowledgements. The bit i
+   of acked is set when the destination has segment i. */
+static struct xport_tx {
+  char     busy;
+  uint16_t dst;
+  uint8_t  xfer;
+  uint32_t acked;
+  unsigned int answers;
+} xport_txs[HYBRID_TRANSPORT_PEERS];
+static uint8_t xport_xfer;
+
+/* Record the answer of a destination to its transfer. */
+static void xport_ack(uint16_t src, const uint8_t *p)
+{
+  struct xport_tx *tx;
+  uint32_t acked;
+
+  if(p[2] > HYBRID_MAX_SEGMENTS)
+    return;
+  acked = ((1UL << p[2]) - 1) | (uint32_t)p[3] << (p[2] + 1);
+
+  for(tx = xport_txs ; tx < xport_txs + HYBRID_TRANSPORT_PEERS ; tx++) {
+    if(!__atomic_load_n(&tx->busy, __ATOMIC_ACQUIRE) || tx->dst != src || tx->xfer != p[1])
+      continue;
+    __atomic_or_fetch(&tx->acked, acked, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&tx->answers, 1, __ATOMIC_RELEASE);
+  }
+}
+
+/* Store a segment and answer its poll. When it completes the
+   transfer the message is copied in msg. Return its size or
+   zero when there is nothing to deliver. */
+static unsigned int xport_segment(uint16_t src, const uint8_t *p, unsigned int size,
+                                  unsigned char *msg)
+{
+  struct xport_peer *peer = &xport_peers[src % HYBRID_TRANSPORT_PEERS];
+  unsigned int index = p[2], count = p[3], offset = index * HYBRID_SEGMENT_SIZE;
+  unsigned int len = size - HYBRID_SEGMENT_HDR_SIZE, done = 0;
+  unsigned long now = hybrid.clock();
+  uint8_t ack[HYBRID_XPORT_ACK_SIZE];
+  int answer = p[0] & HYBRID_XPORT_POLL;
+
+  if(!count || count > HYBRID_MAX_SEGMENTS || index >= count || len > HYBRID_SEGMENT_SIZE ||
+     (index < count - 1 && len != HYBRID_SEGMENT_SIZE) || offset + len > HYBRID_MAX_PAYLOAD)
+    return 0;
+
+  while(__atomic_test_and_set(&xport_busy, __ATOMIC_ACQUIRE));
+  if(!peer->valid || peer->src != src || peer->xfer != p[1] || peer->count != count ||
+     now - peer->stamp > HYBRID_TRANSPORT_EXPIRY)
+    *peer = (struct xport_peer){ .src = src, .valid = 1, .xfer = p[1], .count = count };
+
+  memcpy(peer->msg + offset, p + HYBRID_SEGMENT_HDR_SIZE, len);
+  if(index == count - 1)
+    peer->size = offset + len;
+  peer->got  |= 1UL << index;
+  peer->stamp = now;
+
+  if(peer->got == (1UL << count) - 1 && !peer->delivered) {
+    peer->delivered = 1;
+    memcpy(msg, peer->msg, peer->size);
+    done   = peer->size;
+    answer = 1;
+  }
+
+  ack[0] = HYBRID_XPORT_ACK;
+  ack[1] = peer->xfer;
+  for(ack[2] = 0 ; ack[2] < count && peer->got >> ack[2] & 1 ; ack[2]++);
+  ack[3] = peer->got >> (ack[2] + 1);
+  __atomic_clear(&xport_busy, __ATOMIC_RELEASE);
+
+  if(answer)
+    hybrid.reply(src, ack, sizeof(ack), hybrid.data);
+  return done;
+}
+
+/* Strip the transport header, keep the answers and the segments
+   and deliver the transfers once complete in msg. Frames with
+   errors are passed as is. Return false if the frame must not
+   be delivered. */
+static int xport_recv(uint16_t src, int status, const void **payload, unsigned int *payload_size,
+                      unsigned char *msg)
+{
+  const uint8_t *p = *payload;
+
+  if(status != LORAMAC_RCV_SUCCESS) /* same value as G3PLC_RCV_SUCCESS */
+    return 1;
+  if(*payload_size < HYBRID_XPORT_HDR_SIZE)
+    return hybrid.flags & HYBRID_INVALID;
+
+  switch(p[0] & ~HYBRID_XPORT_POLL) {
+  case HYBRID_XPORT_PLAIN:
+    *payload       = p + HYBRID_XPORT_HDR_SIZE;
+    *payload_size -= HYBRID_XPORT_HDR_SIZE;
+    return 1;
+  case HYBRID_XPORT_ACK:
+    if(*payload_size >= HYBRID_XPORT_ACK_SIZE)
+      xport_ack(src, p);
+    return 0;
+  case HYBRID_XPORT_SEGMENT:
+    if(*payload_size < HYBRID_SEGMENT_HDR_SIZE)
+      return 0;
+    COUNT(rx_segments);
+    *payload_size = xport_segment(src, p, *payload_size, msg);
+    if(!*payload_size)
+      return 0;
+    COUNT(rx_transfers);
+    *payload = msg;
+    return 1;
   default:
-    g3plc_errno = r;
-    return HYBRID_ERR_G3PLC;
+    return hybrid.flags & HYBRID_INVALID;
   }
 }
 
-int hybrid_lora_recv_frame(void)
+/* Messages batched for cb_recv_batch. The payloads are copied
+   since the buffers of the media are reused by the next frame.
+   Both media and hybrid_recv_flush() may add to the batch or
+   deliver it from their own thread.
+
+   There are two batches: one is filled while the other one is
+   delivered, so that a medium does not wait for the callback to
+   queue its message. The batch being filled is swapped under
+   batch_busy and delivered out of it, batch_delivering keeps
+   the batches delivered one at a time. A batch is only swapped
+   by the holder of batch_delivering, which is then done with
+   the previous one. */
+static struct batch {
+  struct hybrid_frame frames[HYBRID_MAX_BATCH];
+  unsigned char       bufs[HYBRID_MAX_BATCH][HYBRID_MAX_PAYLOAD];
+  unsigned int        count;
+  unsigned long       first; /* clock at the first message */
+} batches[2];
+static unsigned int  batch_fill;  /* batch being filled */
+static unsigned long batch_swaps; /* identifies the batch being filled */
+static unsigned int  batch_max;
+static char batch_busy;
+static char batch_delivering;
+
+/* Deliver the batch being filled when it is still the one
+   of this swap (a full one), or with no swap when it expired.
+   An expired batch is left to a delivery in progress. */
+static void batch_deliver(const unsigned long *swap)
 {
-  return loramac_recv_frame();
+  struct batch *b, *out = NULL;
+
+  if(!swap) {
+    if(__atomic_test_and_set(&batch_delivering, __ATOMIC_ACQUIRE))
+      return;
+  }
+  else
+    while(__atomic_test_and_set(&batch_delivering, __ATOMIC_ACQUIRE));
+
+  while(__atomic_test_and_set(&batch_busy, __ATOMIC_ACQUIRE));
+  b = &batches[batch_fill];
+  if(b->count && (swap ? *swap == batch_swaps : hybrid.clock() - b->first >= hybrid.batch_us)) {
+    out = b;
+    batch_fill ^= 1;
+    batch_swaps++;
+    batches[batch_fill].count = 0;
+  }
+  __atomic_clear(&batch_busy, __ATOMIC_RELEASE);
+
+  if(out)
+    hybrid.cb_recv_batch(out->frames, out->count, hybrid.data);
+  __atomic_clear(&batch_delivering, __ATOMIC_RELEASE);
 }
 
-int hybrid_g3plc_recv_frame(void)
+static void batch_push(uint16_t src, uint16_t dst,
+                       const void *payload, unsigned int payload_size,
+                       int status, const struct hybrid_meta *meta)
 {
-  return g3plc_recv_frame();
+  unsigned long now = hybrid.clock();
+  unsigned long swap;
+  struct batch *b;
+  int full;
+
+  if(payload_size > HYBRID_MAX_PAYLOAD)
+    payload_size = HYBRID_MAX_PAYLOAD;
+
+  while(1) {
+    while(__atomic_test_and_set(&batch_busy, __ATOMIC_ACQUIRE));
+    b    = &batches[batch_fill];
+    swap = batch_swaps;
+    if(b->count < batch_max)
+      break;
+
+    /* full but not swapped yet, the other medium delivers it */
+    __atomic_clear(&batch_busy, __ATOMIC_RELEASE);
+    batch_deliver(&swap);
+  }
+
+  if(!b->count)
+    b->first = now;
+  memcpy(b->bufs[b->count], payload, payload_size);
+  b->frames[b->count] = (struct hybrid_frame){ .src     = src,
+                                               .dst     = dst,
+                                               .status  = status,
+                                               .meta    = *meta,
+                                               .payload = b->bufs[b->count],
+                                               .size    = payload_size };
+
+  full = ++b->count == batch_max || now - b->first >= hybrid.batch_us;
+  __atomic_clear(&batch_busy, __ATOMIC_RELEASE);
+
+  if(full)
+    batch_deliver(&swap);
 }
 
-int hybrid_lora_uart_putc(unsigned char c)
+static void pass_up(uint16_t src, uint16_t dst,
+                    const void *payload, unsigned int payload_size,
+                    int status, const struct hybrid_meta *meta)
 {
-  return loramac_uart_putc(c);
+  if(hybrid.cb_recv_batch)
+    batch_push(src, dst, payload, payload_size, status, meta);
+  else if(hybrid.cb_recv_meta)
+    hybrid.cb_recv_meta(src, dst, payload, payload_size, status, meta, hybrid.data);
+  else
+    hybrid.cb_recv(src, dst, payload, payload_size, status, meta->source, hybrid.data);
 }
 
-int hybrid_g3plc_uart_putc(unsigned char c)
+/* Damaged copies waiting for a good one (see HYBRID_DIVERSITY).
+   Both media and hybrid_recv_flush() go through the slots, they
+   have a spinlock. The copies are delivered outside of it. */
+static struct div_hold {
+  uint16_t           src;
+  uint16_t           dst;
+  uint8_t            valid;
+  int                status;
+  struct hybrid_meta meta;
+  unsigned int       size;
+  unsigned char      payload[HYBRID_MAX_PAYLOAD];
+} div_holds[HYBRID_DIVERSITY_HOLDS];
+static char div_busy;
+
+/* Hold a damaged copy, return false when all the slots are taken. */
+static int diversity_hold(uint16_t src, uint16_t dst,
+                          const void *payload, unsigned int payload_size,
+                          int status, const struct hybrid_meta *meta)
+{
+  struct div_hold *h;
+  int held = 0;
+
+  if(payload_size > HYBRID_MAX_PAYLOAD)
+    payload_size = HYBRID_MAX_PAYLOAD;
+
+  while(__atomic_test_and_set(&div_busy, __ATOMIC_ACQUIRE));
+  for(h = div_holds ; h < div_holds + HYBRID_DIVERSITY_HOLDS ; h++) {
+    if(h->valid)
+      continue;
+
+    h->src    = src;
+    h->dst    = dst;
+    h->valid  = 1;
+    h->status = status;
+    h->meta   = *meta;
+    h->size   = payload_size;
+    memcpy(h->payload, payload, payload_size);
+    held = 1;
+    break;
+  }
+  __atomic_clear(&div_busy, __ATOMIC_RELEASE);
+
+  return held;
+}
+
+/* Drop the damaged copies from an origin of which a good copy
+   was just received. */
+static void diversity_replace(uint16_t src)
+{
+  struct div_hold *h;
+
+  while(__atomic_test_and_set(&div_busy, __ATOMIC_ACQUIRE));
+  for(h = div_holds ; h < div_holds + HYBRID_DIVERSITY_HOLDS ; h++) {
+    if(h->valid && h->src == src) {
+      h->valid = 0;
+      COUNT(rx_replaced);
+    }
+  }
+  __atomic_clear(&div_busy, __ATOMIC_RELEASE);
+}
+
+static unsigned long diversity_window(void)
+{
+  return hybrid.diversity_us ? hybrid.diversity_us : HYBRID_DIVERSITY_WINDOW;
+}
+
+/* Deliver the damaged copies for which no good one came in time. */
+static void diversity_release(void)
+{
+  unsigned long window = diversity_window();
+  struct div_hold *h, due;
+
+  for(h = div_holds ; h < div_holds + HYBRID_DIVERSITY_HOLDS ; h++) {
+    /* unlocked peek, the slot is checked again below */
+    if(!__atomic_load_n(&h->valid, __ATOMIC_RELAXED))
+      continue;
+
+    while(__atomic_test_and_set(&div_busy, __ATOMIC_ACQUIRE));
+    due.valid = h->valid && hybrid.clock() - h->meta.stamp >= window;
+    if(due.valid) {
+      due      = *h;
+      h->valid = 0;
+    }
+    __atomic_clear(&div_busy, __ATOMIC_RELEASE);
+
+    if(due.valid)
+      pass_up(due.src, due.dst, due.payload, due.size, due.status, &due.meta);
+  }
+}
+
+static void deliver(uint16_t src, uint16_t dst,
+                    const void *payload, unsigned int payload_size,
+                    int status, const struct hybrid_meta *meta)
+{
+  /* keepalive, the MAC layer already acknowledged it */
+  if(!payload_size && !status) {
+    COUNT(rx_probes);
+    return;
+  }
+
+  if(hybrid.accept && !hybrid.accept(src, payload, payload_size, status, meta, hybrid.data))
+    return;
+
+  if(hybrid.flags & HYBRID_DIVERSITY) {
+    diversity_release();
+    if(status == LORAMAC_RCV_SUCCESS) /* same value as G3PLC_RCV_SUCCESS */
+      diversity_replace(src);
+    else if(dedup_recent(src, diversity_window())) {
+      /* the good copy came first */
+      COUNT(rx_replaced);
+      return;
+    }
+    else if(diversity_hold(src, dst, payload, payload_size, status, meta))
+      return;
+  }
+
+  pass_up(src, dst, payload, payload_size, status, meta);
+}
+
+/* Strip the transport header, count and deliver a message that got
+   through its sequence number and, with HYBRID_ORDER, its order. */
+static void recv_message(uint16_t src, uint16_t dst,
+                         const void *payload, unsigned int payload_size,
+                         int status, const struct hybrid_meta *meta)
+{
+  unsigned char msg[HYBRID_MAX_PAYLOAD];
+
+  if(hybrid.flags & HYBRID_TRANSPORT &&
+     !xport_recv(src, status, &payload, &payload_size, msg))
+    return;
+
+  if(meta->source == HYBRID_SOURCE_LORA)
+    COUNT(rx_lora);
+  else
+    COUNT(rx_g3plc);
+  deliver(src, dst, payload, payload_size, status, meta);
+}
+
+/* Order of the messages of each origin (see HYBRID_ORDER), its
+   broadcasts apart. The epoch changes each time the numbers start
+   over, the messages held from before are then handed on first. A
+   message that starts them over while others are held is held from
+   the last epoch. */
+static struct order_stream {
+  uint16_t      src;
+  uint8_t       valid;
+  uint8_t       group; /* broadcasts */
+  uint8_t       next;  /* number handed on next, 0 before the first one */
+  uint8_t       epoch;
+  unsigned long stamp;
+} order_streams[HYBRID_ORDER_PEERS];
+
+/* Messages waiting for the ones before them, in a pool shared by
+   the streams. A free slot has no stream. */
+static struct order_hold {
+  struct order_stream *stream;
+  uint8_t            epoch;
+  uint8_t            order;
+  unsigned long      held; /* clock() when held */
+  uint16_t           src;
+  uint16_t           dst;
+  int                status;
+  struct hybrid_meta meta;
+  unsigned int       size;
+  unsigned char      payload[HYBRID_MAX_PAYLOAD];
+} order_holds[HYBRID_ORDER_HOLDS];
+
+/* Both media and hybrid_recv_flush() go through the streams and the
+   pool, they have a spinlock. The messages are handed on outside of
+   it by a single thread at a time, the one draining the pool, so that
+   no other thread passes it meanwhile. */
+static char order_busy;
+static int  order_draining;
+static unsigned int order_held;
+
+static void order_lock(void)
+{
+  while(__atomic_test_and_set(&order_busy, __ATOMIC_ACQUIRE));
+}
+
+static void order_unlock(void)
+{
+  __atomic_clear(&order_busy, __ATOMIC_RELEASE);
+}
+
+static unsigned long order_wait(void)
+{
+  return hybrid.order_us ? hybrid.order_us : HYBRID_ORDER_WAIT;
+}
+
+/* Distance from next to n, the numbers wrap from 255 to 1. */
+static unsigned int order_ahead(uint8_t n, uint8_t next)
+{
+  return (n + 255 - next) % 255;
+}
+
+static struct order_stream * order_lookup(uint16_t src, int group)
+{
+  struct order_stream *s = &order_streams[(src * 2 + group) % HYBRID_ORDER_PEERS];
+  unsigned long now = hybrid.clock();
+
+  if(!s->valid || s->src != src || s->group != group || now - s->stamp > HYBRID_DEDUP_EXPIRY)
+    *s = (struct order_stream){ .src   = src,
+                                .valid = 1,
+                                .group = group,
+                                .epoch = s->epoch + 1 };
+  s->stamp = now;
+
+  return s;
+}
+
+/* A held message of a stream that started over goes at once. */
+static int order_stale(const struct order_hold *h)
+{
+  return h->stream->src != h->src || h->stream->epoch != h->epoch;
+}
+
+static int order_ready(const struct order_hold *h)
+{
+  return h->stream && (order_stale(h) || h->order == h->stream->next);
+}
+
+/* Whether messages of a stream are held, those of its last epoch
+   included. */
+static int order_pending(const struct order_stream *s)
+{
+  const struct order_hold *h;
+
+  for(h = order_holds ; h < order_holds + HYBRID_ORDER_HOLDS ; h++)
+    if(h->stream == s)
+      return 1;
+  return 0;
+}
+
+static struct order_hold * order_slot(void)
+{
+  struct order_hold *h;
+
+  for(h = order_holds ; h < order_holds + HYBRID_ORDER_HOLDS ; h++)
+    if(!h->stream)
+      return h;
+  return NULL;
+}
+
+static void order_hold(struct order_hold *h, struct order_stream *s, uint8_t order,
+                       uint16_t src, uint16_t dst, const void *payload, unsigned int payload_size,
+                       int status, const struct hybrid_meta *meta)
+{
+  if(payload_size > HYBRID_MAX_PAYLOAD)
+    payload_size = HYBRID_MAX_PAYLOAD;
+
+  *h = (struct order_hold){ .stream = s,
+                            .epoch  = s->epoch,
+                            .order  = order,
+                            .held   = hybrid.clock(),
+                            .src    = src,
+                            .dst    = dst,
+                            .status = status,
+                            .meta   = *meta,
+                            .size   = payload_size };
+  memcpy(h->payload, payload, payload_size);
+
+  COUNT(rx_held);
+  order_held++;
+  __atomic_store_n(&counters.order_depth, order_held, __ATOMIC_RELAXED);
+  if(order_held > counters.order_depth_max)
+    __atomic_store_n(&counters.order_depth_max, order_held, __ATOMIC_RELAXED);
+}
+
+/* Skip the messages missing before the first one held on the stream
+   of h, so that it is the next one. */
+static void order_skip(const struct order_hold *h)
+{
+  struct order_stream *s = h->stream;
+  const struct order_hold *first = h, *o;
+
+  for(o = order_holds ; o < order_holds + HYBRID_ORDER_HOLDS ; o++)
+    if(o->stream == s && !order_stale(o) &&
+       order_ahead(o->order, s->next) < order_ahead(first->order, s->next))
+      first = o;
+
+  __atomic_add_fetch(&counters.rx_skipped, order_ahead(first->order, s->next), __ATOMIC_RELAXED);
+  s->next = first->order;
+}
+
+/* Move the oldest held message that may be handed on to due and free
+   its slot. When none may, the oldest one skips the messages missing
+   on its stream once it waited order_us, or at once when forced.
+   Return false when no message was moved. */
+static int order_take(struct order_hold *due, int force)
+{
+  unsigned long now = hybrid.clock(), hold_us;
+  struct order_hold *h, *ready = NULL, *oldest = NULL;
+
+  for(h = order_holds ; h < order_holds + HYBRID_ORDER_HOLDS ; h++) {
+    if(!h->stream)
+      continue;
+    if(order_ready(h) && (!ready || now - h->held > now - ready->held))
+      ready = h;
+    if(!oldest || now - h->held > now - oldest->held)
+      oldest = h;
+  }
+
+  if(!ready) {
+    if(!oldest || (!force && now - oldest->held < order_wait()))
+      return 0;
+    order_skip(oldest);
+    for(ready = order_holds ; !order_ready(ready) ; ready++);
+  }
+
+  if(!order_stale(ready))
+    ready->stream->next = order_succ(ready->order);
+  *due          = *ready;
+  ready->stream = NULL;
+  order_held--;
+  __atomic_store_n(&counters.order_depth, order_held, __ATOMIC_RELAXED);
+
+  hold_us = now - due->held;
+  __atomic_add_fetch(&counters.order_hold_us, hold_us, __ATOMIC_RELAXED);
+  if(hold_us > counters.order_hold_max_us)
+    __atomic_store_n(&counters.order_hold_max_us, hold_us, __ATOMIC_RELAXED);
+  return 1;
+}
+
+/* Hand on the held messages that may be, called with the lock
+   taken by the draining thread. Release both. */
+static void order_drain(int force)
+{
+  struct order_hold due;
+
+  while(order_take(&due, force)) {
+    order_unlock();
+    recv_message(due.src, due.dst, due.payload, due.size, due.status, &due.meta);
+    order_lock();
+    force = 0;
+  }
+
+  order_draining = 0;
+  order_unlock();
+}
+
+/* Hand on a message in the order of its origin. The next message
+   goes at once unless others of its stream are held or another
+   thread hands on messages, it is then held as the others. */
+static void order_recv(uint16_t src, uint16_t dst,
+                       const void *payload, unsigned int payload_size,
+                       int status, const struct hybrid_meta *meta)
+{
+  const uint8_t *p = payload;
+  struct order_stream *s;
+  struct order_hold *h;
+  unsigned int ahead;
+  uint8_t order;
+  int restart;
+
+  if(status != LORAMAC_RCV_SUCCESS) { /* same value as G3PLC_RCV_SUCCESS */
+    recv_message(src, dst, payload, payload_size, status, meta);
+    return;
+  }
+  if(payload_size < HYBRID_ORDER_HDR_SIZE) {
+    if(hybrid.flags & HYBRID_INVALID)
+      recv_message(src, dst, payload, payload_size, status, meta);
+    return;
+  }
+
+  order         = p[0];
+  payload       = p + HYBRID_ORDER_HDR_SIZE;
+  payload_size -= HYBRID_ORDER_HDR_SIZE;
+
+  order_lock();
+  while(1) {
+    s     = order_lookup(src, dst == 0xffff);
+    ahead = order_ahead(order, s->next);
+
+    /* the numbers start over from a message too far ahead, the
+       half of the numbers behind the next one came too late */
+    restart = !order || !s->next || (ahead >= HYBRID_ORDER_WINDOW && ahead < 128);
+
+    if(!restart) {
+      for(h = order_holds ; h < order_holds + HYBRID_ORDER_HOLDS ; h++)
+        if(h->stream == s && !order_stale(h) && h->order == order)
+          break;
+      /* skipped or handed on already, or a copy is held */
+      if(ahead >= 128 || h < order_holds + HYBRID_ORDER_HOLDS) {
+        order_unlock();
+        COUNT(rx_late);
+        return;
+      }
+    }
+
+    if((restart || !ahead) && !order_draining && !order_pending(s)) {
+      if(restart)
+        s->epoch++;
+      s->next        = order_succ(order);
+      order_draining = 1;
+      order_unlock();
+
+      recv_message(src, dst, payload, payload_size, status, meta);
+      order_lock();
+      order_drain(0);
+      return;
+    }
+
+    if((h = order_slot()))
+      break;
+
+    /* the oldest message gives way to this one */
+    if(!order_draining) {
+      order_draining = 1;
+      order_drain(1);
+    }
+    else
+      order_unlock();
+    order_lock();
+  }
+
+  /* held from the last epoch so that it goes before the next ones */
+  if(restart) {
+    s->epoch++;
+    s->next = order_succ(order);
+  }
+  order_hold(h, s, order, src, dst, payload, payload_size, status, meta);
+  if(restart)
+    h->epoch--;
+
+  if(order_draining) {
+    order_unlock();
+    return;
+  }
+  order_draining = 1;
+  order_drain(0);
+}
+
+/* Hand on the messages that waited for too long. */
+static void order_release(void)
+{
+  order_lock();
+  if(order_draining || !order_held) {
+    order_unlock();
+    return;
+  }
+
+  order_draining = 1;
+  order_drain(0);
+}
+
+void hybrid_recv_flush(void)
+{
+  if(hybrid.flags & HYBRID_ORDER)
+    order_release();
+  if(hybrid.flags & HYBRID_DIVERSITY)
+    diversity_release();
+  if(!hybrid.cb_recv_batch)
+    return;
+
+  batch_deliver(NULL);
+}
+
+/* Link statistics for each destination.
+   The score of each medium is an exponentially weighted
+   moving average of its recent success, from zero (always
+   failed) to HYBRID_SCORE_MAX. The score of the medium that
+   was not used drifts back to the initial value so that it
+   gets another chance once the conditions changed. The scores
+   are kept with HYBRID_SCORE_FRAC fractional bits so that the
+   small steps of the averages are not lost to the division. */
+#define HYBRID_SCORE_MAX   256
+#define HYBRID_SCORE_G3PLC 192 /* initial score, G3-PLC is preferred */
+#define HYBRID_SCORE_LORA  128
+#define HYBRID_SCORE_ALPHA 8   /* EWMA weight of a new sample (1/8) */
+#define HYBRID_SCORE_DRIFT 32  /* drift of the unused medium (1/32) */
+#define HYBRID_SCORE_FRAC  8   /* fractional bits of a score */
+
+static struct link_stats {
+  uint16_t      addr;
+  uint8_t       valid;
+  int           g3plc;
+  int           lora;
+  unsigned long heard[2]; /* clock() of the last outcome on each medium */
+  unsigned long airtime[2]; /* us on air charged on each medium */
+  uint8_t       modulation; /* last estimated on G3-PLC (see HYBRID_PLC_OVERHEAD) */
+  uint32_t      tonemap;
+} links[HYBRID_LINK_PEERS];
+
+static struct link_stats * link_lookup(uint16_t dst)
+{
+  struct link_stats *link = &links[dst % HYBRID_LINK_PEERS];
+
+  if(!link->valid || link->addr != dst)
+    *link = (struct link_stats){ .addr  = dst,
+                                 .valid = 1,
+                                 .g3plc = HYBRID_SCORE_G3PLC << HYBRID_SCORE_FRAC,
+                                 .lora  = HYBRID_SCORE_LORA << HYBRID_SCORE_FRAC };
+
+  return link;
+}
+
+/* The link statistics of a destination if there are some. */
+static struct link_stats * link_find(uint16_t addr)
+{
+  struct link_stats *link = &links[addr % HYBRID_LINK_PEERS];
+
+  return link->valid && link->addr == addr ? link : NULL;
+}
+
+/* Outcome of a frame to a neighbour, so that the links which
+   carry traffic are not probed (see hybrid_probe()). */
+static void link_heard(uint16_t dst, int medium)
+{
+  if(dst != 0xffff)
+    link_lookup(dst)->heard[medium] = hybrid.clock();
+}
+
+/* A good copy from a neighbour proves the medium it came on
+   (see HYBRID_DIVERSITY), even when it is dropped as a copy. */
+static void diversity_heard(uint16_t src, int status, uint8_t hops, int medium)
+{
+  struct link_stats *link;
+
+  if(hybrid.flags & HYBRID_DIVERSITY && status == LORAMAC_RCV_SUCCESS && !hops &&
+     (link = link_find(src)))
+    link->heard[medium] = hybrid.clock();
+}
+
+void hybrid_lora_recv(uint16_t src, uint16_t dst,
+                     const void *payload, unsigned int payload_size,
+                     int status, void *data)
+{
+  struct hybrid_meta meta;
+  uint8_t hops = 0;
+
+  /* the upper layer only receives complete messages */
+  if(status == LORAMAC_RCV_SUCCESS) {
+    switch(frag_input(&lora_frags, src, payload, payload_size, hybrid.clock(),
+                      &payload, &payload_size)) {
+    case FRAG_PENDING:
+      return;
+    case FRAG_INVALID:
+      if(!(hybrid.flags & HYBRID_INVALID))
+        return;
+      status = LORAMAC_RCV_INVALID_HDR;
+    }
+  }
+
+  /* then decompress complete messages */
+  if(hybrid.flags & (HYBRID_COMPRESS | HYBRID_DELTA) && status == LORAMAC_RCV_SUCCESS &&
+     !decode(src, &payload, &payload_size)) {
+    if(!(hybrid.flags & HYBRID_INVALID))
+      return;
+    status = LORAMAC_RCV_INVALID_HDR;
+  }
+  if(hybrid.flags & HYBRID_DELTA && status == LORAMAC_RCV_SUCCESS && dst != 0xffff)
+    delta_learn(src, payload, payload_size);
+
+  if(hybrid.flags & HYBRID_ROUTE &&
+     !route_recv(&src, &dst, status, &hops, &payload, &payload_size))
+    return;
+  diversity_heard(src, status, hops, HYBRID_SOURCE_LORA);
+  if(hybrid.flags & HYBRID_DEDUP && !dedup_recv(src, status, &payload, &payload_size))
+    return;
+
+  meta = (struct hybrid_meta){ .source = HYBRID_SOURCE_LORA,
+                               .stamp  = hybrid.clock(),
+                               .hops   = hops };
+  if(hybrid.flags & HYBRID_ORDER)
+    order_recv(src, dst, payload, payload_size, status, &meta);
+  else
+    recv_message(src, dst, payload, payload_size, status, &meta);
+}
+
+void hybrid_g3plc_recv(const struct g3plc_data_hdr *hdr,
+                       const void *payload, unsigned payload_size,
+                       int status, void *data)
+{
+  uint64_t src_ext = hdr->src_mode == G3PLC_ADDR_EXT ? hdr->src_addr : 0;
+  uint16_t src = src_ext ? ext_lookup(src_ext) : hdr->src_addr;
+  uint16_t dst = hdr->dst_mode == G3PLC_ADDR_EXT ? hybrid.mac_address : hdr->dst_addr;
+  struct link_stats *link;
+  struct hybrid_meta meta;
+  uint8_t hops = 0;
+
+  /* the modulation estimated on the frames of a neighbour
+     times those sent to it (see HYBRID_PLC_OVERHEAD) */
+  if(status == G3PLC_RCV_SUCCESS && hdr->src_mode != G3PLC_ADDR_EXT &&
+     (link = link_find(hdr->src_addr))) {
+    link->modulation = hdr->estimated;
+    link->tonemap    = hdr->tonemap;
+  }
+
+  if(hybrid.flags & HYBRID_ROUTE &&
+     !route_recv(&src, &dst, status, &hops, &payload, &payload_size))
+    return;
+  /* the origin of a message that was not forwarded sent it */
+  if(hybrid.flags & HYBRID_ROUTE && src_ext && !hops && status == G3PLC_RCV_SUCCESS)
+    ext_learn(src_ext, src);
+  diversity_heard(src, status, hops, HYBRID_SOURCE_G3PLC);
+  if(hybrid.flags & HYBRID_DEDUP && !dedup_recv(src, status, &payload, &payload_size))
+    return;
+
+  meta = (struct hybrid_meta){ .source     = HYBRID_SOURCE_G3PLC,
+                               .hops       = hops,
+                               .stamp      = hybrid.clock(),
+                               .lqi        = hdr->lqi,
+                               .seqno      = hdr->seqno,
+                               .modulation = hdr->estimated,
+                               .symbols    = hdr->time,
+                               .tonemap    = hdr->tonemap,
+                               .src_ext    = src_ext };
+  if(hybrid.flags & HYBRID_ORDER)
+    order_recv(src, dst, payload, payload_size, status, &meta);
+  else
+    recv_message(src, dst, payload, payload_size, status, &meta);
+}
+
+/* Steps of the frames of each MAC layer, traced as steps of the
+   message they carry (see hybrid_trace). */
+static void trace_g3plc(int event, int arg, void *data)
+{
+  hybrid.trace(HYBRID_TRACE_G3PLC_REQUEST + event, arg, data);
+}
+
+static void trace_lora(int event, int arg, void *data)
+{
+  (void)data;
+  hybrid.trace(HYBRID_TRACE_LORA_ATTEMPT + event, arg, hybrid.data);
+}
+
+/* The LoRaMAC instances pass their radio to the platform, the
+   main module uses the functions of hybrid_config and the other
+   ones those of their module with its data pointer. */
+static int lora_uart_send(const void *buf, unsigned int size, void *data)
+{
+  const struct hybrid_lora_module *m = ((struct lora_radio *)data)->module;
+  return m ? m->uart_send(buf, size, m->data) : hybrid.uart_lora_send(buf, size);
+}
+
+static void lora_start_timer(unsigned int us, void *data)
+{
+  const struct hybrid_lora_module *m = ((struct lora_radio *)data)->module;
+  if(m)
+    m->start_timer(us, m->data);
+  else
+    hybrid.lora_start_timer(us);
+}
+
+static void lora_stop_timer(void *data)
+{
+  const struct hybrid_lora_module *m = ((struct lora_radio *)data)->module;
+  if(m)
+    m->stop_timer(m->data);
+  else
+    hybrid.lora_stop_timer();
+}
+
+static void lora_wait_timer(void *data)
+{
+  const struct hybrid_lora_module *m = ((struct lora_radio *)data)->module;
+  if(m)
+    m->wait_timer(m->data);
+  else
+    hybrid.lora_wait_timer();
+}
+
+static void lora_mac_lock(void *data)
+{
+  const struct hybrid_lora_module *m = ((struct lora_radio *)data)->module;
+  if(m)
+    m->lock(m->data);
+  else
+    hybrid.lora_lock();
+}
+
+static void lora_mac_unlock(void *data)
+{
+  const struct hybrid_lora_module *m = ((struct lora_radio *)data)->module;
+  if(m)
+    m->unlock(m->data);
+  else
+    hybrid.lora_unlock();
+}
+
+/* The frames of the other modules are parsed as soon as they
+   are complete, by the thread that feeds their UART. */
+static int lora_recv_frame_cb(struct loramac_ctx *ctx)
+{
+  if(ctx == &lora_radios[0].mac)
+    return hybrid.lora_recv_frame();
+  return loramac_recv_frame(ctx);
+}
+
+/* Instance that carries the frames to this destination,
+   the main one when no module serves the node. */
+static struct loramac_ctx * lora_mac(uint16_t dst)
+{
+  unsigned int i, j;
+
+  for(i = 1 ; i < lora_nradios ; i++)
+    for(j = 0 ; j < lora_radios[i].module->count ; j++)
+      if(lora_radios[i].module->nodes[j] == dst)
+        return &lora_radios[i].mac;
+
+  return &lora_radios[0].mac;
+}
+
+/* The G3-PLC driver passes its data pointer to the platform,
+   this layer drives a single modem through its own platform. */
+static void g3plc_start_timer(unsigned int us, void *data)
+{
+  (void)data;
+  hybrid.g3plc_start_timer(us);
+}
+
+static void g3plc_stop_timer(void *data)
+{
+  (void)data;
+  hybrid.g3plc_stop_timer();
+}
+
+static void g3plc_wait_timer(void *data)
+{
+  (void)data;
+  hybrid.g3plc_wait_timer();
+}
+
+static int g3plc_uart_send(const void *buf, unsigned int size, void *data)
+{
+  (void)data;
+  return hybrid.uart_g3plc_send(buf, size);
+}
+
+static int g3plc_uart_read(void *buf, unsigned int size, void *data)
+{
+  (void)data;
+  return hybrid.uart_g3plc_read(buf, size);
+}
+
+static int g3plc_set_uart_speed(unsigned int speed, void *data)
+{
+  (void)data;
+  return hybrid.set_uart_g3plc_speed(speed);
+}
+
+static int g3plc_recv_frame_cb(struct g3plc_ctx *ctx)
+{
+  (void)ctx;
+  return hybrid.g3plc_recv_frame();
+}
+
+static void g3plc_reset_clear(void *data)
+{
+  (void)data;
+  hybrid.reset_clear();
+}
+
+static void g3plc_reset_set(void *data)
+{
+  (void)data;
+  hybrid.reset_set();
+}
+
+static void g3plc_usleep(unsigned long us, void *data)
+{
+  (void)data;
+  hybrid.usleep(us);
+}
+
+static void g3plc_boot_start(void *data)
+{
+  (void)data;
+  if(hybrid.g3plc_boot_start)
+    hybrid.g3plc_boot_start();
+}
+
+static void g3plc_boot_progress(void *data)
+{
+  (void)data;
+  if(hybrid.g3plc_boot_progress)
+    hybrid.g3plc_boot_progress();
+}
+
+static void g3plc_boot_end(void *data)
+{
+  (void)data;
+  if(hybrid.g3plc_boot_end)
+    hybrid.g3plc_boot_end();
+}
+
+int hybrid_init(const struct hybrid_config *conf)
+{
+  unsigned int i;
+  int n;
+
+  hybrid = *conf;
+
+  /* racing requires concurrency from the platform,
+     the receiver tells the copies from their number */
+  if(conf->flags & HYBRID_RACE && !conf->race)
+    hybrid.flags &= ~HYBRID_RACE;
+  if(hybrid.flags & (HYBRID_RACE | HYBRID_DIVERSITY | HYBRID_ORDER))
+    hybrid.flags |= HYBRID_DEDUP;
+  /* the answers to the segments go from another thread */
+  if(conf->flags & HYBRID_TRANSPORT && !conf->reply)
+    hybrid.flags &= ~HYBRID_TRANSPORT;
+  memset(xport_peers, 0, sizeof(xport_peers));
+  xport_xfer = conf->lora.seqno;
+  tx_seqno = conf->lora.seqno;
+  backoff_seed = ((uint32_t)conf->clock() ^ conf->mac_address << 16) | 1; /* never zero */
+  memset(dedup_peers, 0, sizeof(dedup_peers));
+  memset(div_holds, 0, sizeof(div_holds));
+  memset(order_dsts, 0, sizeof(order_dsts));
+  memset(order_streams, 0, sizeof(order_streams));
+  memset(order_holds, 0, sizeof(order_holds));
+  order_held = 0;
+  memset(ext_cache, 0, sizeof(ext_cache));
+  memset(rates, 0, sizeof(rates));
+  memset(balance_bytes, 0, sizeof(balance_bytes));
+  batches[0].count = 0;
+  batches[1].count = 0;
+  batch_max   = conf->batch_frames && conf->batch_frames < HYBRID_MAX_BATCH ?
+                conf->batch_frames : HYBRID_MAX_BATCH;
+
+  /* compression requires the functions from the platform */
+  if(conf->flags & HYBRID_COMPRESS && (!conf->compress || !conf->decompress))
+    hybrid.flags &= ~HYBRID_COMPRESS;
+  memset(&codec_stats, 0, sizeof(codec_stats));
+  memset(delta_tx, 0, sizeof(delta_tx));
+  memset(delta_rx, 0, sizeof(delta_rx));
+
+  /* the budget of the sub-band starts full */
+  if(conf->flags & HYBRID_DUTY) {
+    const struct duty_band *band = duty_band_lookup(conf->lora.frequency);
+
+    if(!band || duty_radio_check(&conf->lora.radio))
+      return HYBRID_INIT_DUTY;
+    duty_init(&lora_duty, band->permille, conf->clock());
+  }
+
+  if(conf->lora_module_count > HYBRID_MAX_LORA_MODULES)
+    return HYBRID_INIT_MODULES;
+
+  /* derive child MAC layers from hybrid configuration */
+  lora = (struct loramac_config){
+    .uart_send   = lora_uart_send,
+    .cb_recv     = hybrid_lora_recv,
+    .cb_accept   = delta_accept,
+    .start_timer = lora_start_timer,
+    .stop_timer  = lora_stop_timer,
+    .wait_timer  = lora_wait_timer,
+    .lock        = lora_mac_lock,
+    .unlock      = lora_mac_unlock,
+    .htons       = conf->htons,
+    .ntohs       = conf->ntohs,
+    .recv_frame  = lora_recv_frame_cb,
+    .clock       = conf->clock,
+    .trace       = conf->trace ? trace_lora : NULL,
+    .seqno       = conf->lora.seqno,
+    .state       = conf->lora.state,
+    .mac_address = conf->mac_address,
+    .retrans     = conf->lora.retrans,
+    .timeout     = conf->lora.timeout,
+    .sifs        = conf->lora.sifs,
+    .flags       = 0,
+    .data        = &lora_radios[0]
+  };
+  g3plc = (struct g3plc_config){
+    .callbacks = (struct g3plc_callbacks){
+      .raw = NULL,
+      .cb_recv = hybrid_g3plc_recv
+    },
+
+    .start_timer    = g3plc_start_timer,
+    .stop_timer     = g3plc_stop_timer,
+    .wait_timer     = g3plc_wait_timer,
+    .uart_send      = g3plc_uart_send,
+    .uart_read      = g3plc_uart_read,
+    .set_uart_speed = g3plc_set_uart_speed,
+    .recv_frame     = g3plc_recv_frame_cb,
+    .reset_clear    = g3plc_reset_clear,
+    .reset_set      = g3plc_reset_set,
+    .reset_pulse    = conf->reset_pulse,
+    .htons          = conf->htons,
+    .htonl          = conf->htonl,
+    .ntohs          = conf->ntohs,
+    .ntohl          = conf->ntohl,
+    .usleep         = g3plc_usleep,
+    .boot_start     = g3plc_boot_start,
+    .boot_progress  = g3plc_boot_progress,
+    .boot_end       = g3plc_boot_end,
+    .trace          = conf->trace ? trace_g3plc : NULL,
+    .bandplan       = conf->g3plc.bandplan,
+    .pan_id         = conf->g3plc.pan_id,
+    .mac_address    = conf->mac_address,
+    .ext_address    = conf->g3plc.ext_address,
+    .retrans        = conf->g3plc.retrans,
+    .timeout        = conf->g3plc.timeout,
+    .flags          = 0,
+    .data           = conf->data
+  };
+
+  if(conf->flags & HYBRID_INVALID) {
+    lora.flags  |= LORAMAC_INVALID;
+    g3plc.flags |= G3PLC_INVALID;
+  }
+  if(conf->flags & HYBRID_NOACK) {
+    lora.flags  |= LORAMAC_NOACK;
+    g3plc.flags |= G3PLC_NOACK;
+  }
+
+  /* An incomplete message expires after
+     all retransmissions of a fragment. */
+  frag_init(&lora_frags, LORA_FRAG_SIZE,
+            (conf->lora.retrans + 1) * (unsigned long)conf->lora.timeout);
+
+  /* Only LoRa is brought up here, G3-PLC takes the
+     whole firmware upload (see hybrid_g3plc_start()). */
+  __atomic_store_n(&g3plc_ready, 0, __ATOMIC_RELAXED);
+  lora_radios[0].module = NULL;
+  xLORA_(n, loramac_init, &lora_radios[0].mac, &lora);
+
+  /* the other modules have the settings of the main one,
+     only the main one resumes the state */
+  for(i = 0 ; i < conf->lora_module_count ; i++) {
+    struct loramac_config c = lora;
+
+    c.state = NULL;
+    c.data  = &lora_radios[i + 1];
+    lora_radios[i + 1].module = &conf->lora_modules[i];
+    xLORA_(n, loramac_init, &lora_radios[i + 1].mac, &c);
+  }
+  lora_nradios = conf->lora_module_count + 1;
+
+  return HYBRID_INIT_SUCCESS;
+}
+
+int hybrid_reconfigure(const struct hybrid_config *conf)
+{
+  unsigned int i;
+  int n;
+
+  /* LoRaMAC is the only part that may refuse the new values,
+     those of the main module are valid for the other ones */
+  if(conf->lora.sifs != hybrid.lora.sifs || conf->lora.timeout != hybrid.lora.timeout) {
+    xLORA_(n, loramac_set_timing, &lora_radios[0].mac, conf->lora.sifs, conf->lora.timeout);
+    for(i = 1 ; i < lora_nradios ; i++)
+      loramac_set_timing(&lora_radios[i].mac, conf->lora.sifs, conf->lora.timeout);
+  }
+
+  hybrid.lora_lock();
+  hybrid.lora.sifs    = conf->lora.sifs;
+  hybrid.lora.timeout = conf->lora.timeout;
+  __atomic_store_n(&hybrid.lora.resync, conf->lora.resync, __ATOMIC_RELAXED);
+  hybrid.lora_unlock();
+
+  return HYBRID_INIT_SUCCESS;
+}
+
+int hybrid_g3plc_start(void)
+{
+  int n;
+
+  /* a frame may still wait for its confirm,
+     the modem starts over with the configured retransmissions */
+  hybrid.g3plc_lock();
+  n = g3plc_init(&g3plc_ctx, &g3plc);
+  tune.frames  = 0;
+  tune.noacks  = 0;
+  __atomic_store_n(&tune.retrans, g3plc.retrans, __ATOMIC_RELAXED);
+  hybrid.g3plc_unlock();
+  if(n) {
+    g3plc_errno = n;
+    return HYBRID_ERR_G3PLC;
+  }
+
+  /* publish the configuration before the medium is used */
+  __atomic_store_n(&g3plc_timeouts, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&g3plc_ready, 1, __ATOMIC_RELEASE);
+
+  return HYBRID_INIT_SUCCESS;
+}
+
+int hybrid_g3plc_ready(void)
+{
+  return __atomic_load_n(&g3plc_ready, __ATOMIC_ACQUIRE);
+}
+
+/* Medium that last delivered to each destination (see HYBRID_CACHE).
+   The bit of a medium is set in failed when it did not deliver the
+   last time it was tried, at clock() failed_at. Each send looks the
+   destination up so the entry used least recently is replaced. The
+   media may send concurrently so the cache has a spinlock. */
+static struct cache_entry {
+  uint16_t      addr;
+  uint8_t       valid;
+  uint8_t       failed;
+  int           medium;  /* last medium that delivered, -1 for none */
+  unsigned long latency; /* time it took in us */
+  unsigned long failed_at[2];
+  unsigned long used;
+} cache[HYBRID_CACHE_PEERS];
+static char cache_busy;
+
+/* Entry of a destination, the cache lock must be held. */
+static struct cache_entry * cache_lookup(uint16_t dst, unsigned long now)
+{
+  struct cache_entry *entry, *lru = &cache[0];
+
+  for(entry = cache ; entry < cache + HYBRID_CACHE_PEERS ; entry++) {
+    if(entry->valid && entry->addr == dst)
+      goto FOUND;
+    if(!entry->valid || (lru->valid && now - entry->used > now - lru->used))
+      lru = entry;
+  }
+
+  entry  = lru;
+  *entry = (struct cache_entry){ .addr = dst, .valid = 1, .medium = -1 };
+FOUND:
+  entry->used = now;
+  return entry;
+}
+
+static int cache_failed(const struct cache_entry *entry, int medium, unsigned long now)
+{
+  return entry->failed & (1 << medium) &&
+         now - entry->failed_at[medium] < HYBRID_CACHE_EXPIRY;
+}
+
+/* Medium of an entry to try first, the cache lock must be held. */
+static int cache_medium(const struct cache_entry *entry, unsigned long deadline,
+                        unsigned long now)
+{
+  int g3plc_bad, lora_bad;
+
+  lora_bad  = cache_failed(entry, HYBRID_SOURCE_LORA, now);
+  g3plc_bad = cache_failed(entry, HYBRID_SOURCE_G3PLC, now) ||
+              (deadline && entry->medium == HYBRID_SOURCE_G3PLC &&
+               (long)(deadline - now - entry->latency) <= 0);
+  if(g3plc_bad && !lora_bad)
+    return HYBRID_SOURCE_LORA;
+  if(g3plc_bad && entry->medium >= 0)
+    return entry->medium;
+  return HYBRID_SOURCE_G3PLC; /* the usual order */
+}
+
+/* Medium to try first for a destination. */
+static int cache_first(uint16_t dst, unsigned long deadline)
+{
+  unsigned long now = hybrid.clock();
+  int medium;
+
+  while(__atomic_test_and_set(&cache_busy, __ATOMIC_ACQUIRE));
+  medium = cache_medium(cache_lookup(dst, now), deadline, now);
+  __atomic_clear(&cache_busy, __ATOMIC_RELEASE);
+
+  if(medium == HYBRID_SOURCE_LORA)
+    COUNT(cache_lora);
+  return medium;
+}
+
+/* Remember whether a medium delivered a message sent at begin. */
+static void cache_update(uint16_t dst, int medium, int delivered, unsigned long begin)
+{
+  unsigned long now = hybrid.clock();
+  struct cache_entry *entry;
+
+  if(!(hybrid.flags & HYBRID_CACHE) || dst == 0xffff)
+    return;
+
+  while(__atomic_test_and_set(&cache_busy, __ATOMIC_ACQUIRE));
+  entry = cache_lookup(dst, now);
+  if(delivered) {
+    entry->medium   = medium;
+    entry->latency  = now - begin;
+    entry->failed  &= ~(1 << medium);
+  }
+  else {
+    entry->failed           |= 1 << medium;
+    entry->failed_at[medium] = now;
+  }
+  __atomic_clear(&cache_busy, __ATOMIC_RELEASE);
+}
+
+static void score_sample(int *score, int sample)
+{
+  *score += ((sample << HYBRID_SCORE_FRAC) - *score) / HYBRID_SCORE_ALPHA;
+}
+
+static void score_drift(int *score, int init)
+{
+  *score += ((init << HYBRID_SCORE_FRAC) - *score) / HYBRID_SCORE_DRIFT;
+}
+
+/* Time on air of a LoRa message of size bytes once fragmented.
+   Each frame goes on air with its length byte. */
+static unsigned long lora_airtime(unsigned int size)
+{
+  unsigned int count = frag_count(LORA_FRAG_SIZE, size);
+  unsigned int last  = size - (count - 1) * LORA_FRAG_SIZE;
+
+  return (count - 1) * duty_airtime(&hybrid.lora.radio, 1 + LORAMAC_MAX_FRAME) +
+         duty_airtime(&hybrid.lora.radio, 1 + LORAMAC_HDR_SIZE + FRAG_HDR_SIZE + last);
+}
+
+/* Check if the LoRa budget cannot afford a message without deferring it.
+   The compression header and the race header are not accounted. */
+static int lora_saturated(unsigned int size)
+{
+  int r;
+
+  if(!(hybrid.flags & HYBRID_DUTY) || !frag_count(LORA_FRAG_SIZE, size))
+    return 0;
+
+  hybrid.lora_lock();
+  r = duty_delay(&lora_duty, lora_airtime(size), hybrid.clock()) != 0;
+  hybrid.lora_unlock();
+
+  return r;
+}
+
+static void lora_charge(unsigned long airtime)
+{
+  if(!(hybrid.flags & HYBRID_DUTY))
+    return;
+
+  hybrid.lora_lock();
+  duty_charge(&lora_duty, airtime, hybrid.clock());
+  hybrid.lora_unlock();
+}
+
+/* G3-PLC band plans (see g3plc_bandplan): symbol with its cyclic
+   prefix and preamble in us, symbols of the frame control header,
+   carriers and carriers per bit of the tonemap. */
+static const struct plc_band {
+  unsigned int symbol;
+  unsigned int preamble;
+  unsigned int fch;
+  unsigned int carriers;
+  unsigned int group;
+} plc_bands[] = {
+  [G3PLC_BP_CENELEC_A] = { 695, 6080, 13, 36, 6 },
+  [G3PLC_BP_CENELEC_B] = { 695, 6080, 12, 16, 4 },
+  [G3PLC_BP_ARIB]      = { 238, 2027, 12, 54, 3 },
+  [G3PLC_BP_FCC]       = { 238, 2027, 12, 72, 3 }
+};
+
+/* Estimated time on air of a G3-PLC frame of size bytes to a
+   destination (see HYBRID_PLC_OVERHEAD). The modulation counts
+   the bits of each carrier, robust mode is one bit sent four
+   times. */
+static unsigned long g3plc_airtime(const struct link_stats *link, unsigned int size)
+{
+  unsigned int bandplan = hybrid.g3plc.bandplan;
+  const struct plc_band *band = &plc_bands[bandplan < sizeof(plc_bands) / sizeof(plc_bands[0]) ? bandplan : 0];
+  unsigned int mod = link && link->modulation <= 4 ? link->modulation : 0;
+  unsigned int carriers = link ? __builtin_popcount(link->tonemap) * band->group : 0;
+  unsigned long bits = 2 * (8UL * (size + HYBRID_PLC_OVERHEAD) + 6); /* with the tail */
+  unsigned long per_symbol;
+
+  if(!carriers || carriers > band->carriers)
+    carriers = band->carriers;
+  per_symbol = mod ? carriers * mod : carriers / 4;
+
+  return band->preamble + (band->fch + (bits + per_symbol - 1) / per_symbol) * band->symbol;
+}
+
+/* Charge the time on air of a frame to its medium, its destination
+   (unless it was only sent to an extended address) and through the
+   platform to its sender (see charge in hybrid_config). */
+static void charge(int medium, uint16_t dst, unsigned long airtime)
+{
+  if(!airtime)
+    return;
+
+  __atomic_add_fetch(&counters.airtime[medium], airtime, __ATOMIC_RELAXED);
+  if(dst != HYBRID_NO_SHORT)
+    __atomic_add_fetch(&link_lookup(dst)->airtime[medium], airtime, __ATOMIC_RELAXED);
+  if(hybrid.charge)
+    hybrid.charge(medium, dst, airtime, hybrid.data);
+}
+
+long hybrid_lora_budget(void)
+{
+  long credit;
+
+  if(!(hybrid.flags & HYBRID_DUTY))
+    return LONG_MAX;
+
+  hybrid.lora_lock();
+  credit = duty_credit(&lora_duty, hybrid.clock());
+  hybrid.lora_unlock();
+
+  return credit;
+}
+
+static void rate_sample(int medium, unsigned int size, unsigned long begin)
+{
+  unsigned long us   = hybrid.clock() - begin;
+  unsigned long rate = size * 1000000UL / (us ? us : 1);
+  unsigned long old  = __atomic_load_n(&rates[medium], __ATOMIC_RELAXED);
+
+  if(old)
+    rate = old + ((long)rate - (long)old) / HYBRID_SCORE_ALPHA;
+  __atomic_store_n(&rates[medium], rate, __ATOMIC_RELAXED);
+}
+
+/* Check whether the deadline passed, a null deadline never expires. */
+static void txmsg_init(struct txmsg *m, const void *payload, unsigned int size)
+{
+  m->seg[0] = (struct hybrid_seg){ .base = payload, .size = size };
+  m->count  = 1;
+  m->size   = size;
+  m->ext    = 0;
+  m->probe  = 0;
+}
+
+/* The message of the caller, false with too many segments. */
+static int txmsg_segs(struct txmsg *m, const struct hybrid_seg *segs, unsigned int count)
+{
+  unsigned int i;
+
+  if(count > HYBRID_MAX_SEGS)
+    return 0;
+
+  *m = (struct txmsg){ .count = count, .size = 0 };
+  for(i = 0 ; i < count ; i++) {
+    m->seg[i]  = segs[i];
+    m->size   += segs[i].size;
+  }
+  return 1;
+}
+
+static void txmsg_prepend(struct txmsg *m, const void *hdr, unsigned int size)
+{
+  memmove(m->seg + 1, m->seg, m->count * sizeof(struct hybrid_seg));
+  m->seg[0] = (struct hybrid_seg){ .base = hdr, .size = size };
+  m->count++;
+  m->size += size;
+}
+
+/* Append len bytes of src from offset to dst. */
+static void txmsg_slice(struct txmsg *dst, const struct txmsg *src,
+                        unsigned int offset, unsigned int len)
+{
+  const struct hybrid_seg *seg;
+  unsigned int n;
+
+  for(seg = src->seg ; len && seg < src->seg + src->count ; seg++) {
+    if(offset >= seg->size) {
+      offset -= seg->size;
+      continue;
+    }
+
+    n = seg->size - offset < len ? seg->size - offset : len;
+    dst->seg[dst->count++] = (struct hybrid_seg){ .base = (const uint8_t *)seg->base + offset,
+                                                  .size = n };
+    dst->size += n;
+    len       -= n;
+    offset     = 0;
+  }
+}
+
+/* Assemble the message in buf (HYBRID_MAX_PAYLOAD bytes). */
+static void txmsg_gather(unsigned char *buf, const struct txmsg *m)
+{
+  unsigned int i;
+
+  for(i = 0 ; i < m->count ; i++) {
+    memcpy(buf, m->seg[i].base, m->seg[i].size);
+    buf += m->seg[i].size;
+  }
+}
+
+/* The message as a single buffer, assembled
+   in buf unless it is one already. */
+static const void * txmsg_flat(const struct txmsg *m, unsigned char *buf)
+{
+  if(m->count == 1)
+    return m->seg[0].base;
+
+  txmsg_gather(buf, m);
+  return buf;
+}
+
+static int expired(unsigned long deadline)
+{
+  return deadline && (long)(hybrid.clock() - deadline) >= 0;
+}
+
+/* Check whether a message may still be delivered on this medium
+   before the deadline. This uses the measured throughput of the
+   medium or, until then, the time on air of LoRa. */
+static int in_time(int medium, unsigned int size, unsigned long deadline)
+{
+  unsigned long rate = __atomic_load_n(&rates[medium], __ATOMIC_RELAXED);
+  unsigned long need = 0;
+
+  if(!deadline)
+    return 1;
+
+  if(rate)
+    need = size * 1000000UL / rate;
+  else if(medium == HYBRID_SOURCE_LORA && hybrid.lora.radio.bw &&
+          frag_count(LORA_FRAG_SIZE, size))
+    need = lora_airtime(size);
+
+  return (long)(deadline - hybrid.clock() - need) > 0;
+}
+
+static int hybrid_lora_send(uint16_t dst, const struct txmsg *m,
+                            struct link_stats *link, unsigned long deadline)
+{
+  unsigned char msg[HYBRID_CODEC_HDR_SIZE + HYBRID_MAX_PAYLOAD];
+  unsigned char flat[HYBRID_MAX_PAYLOAD];
+  unsigned char hdr[FRAG_HDR_SIZE];
+  struct loramac_seg segs[TXMSG_SEGS];
+  struct txmsg coded, frag;
+  struct delta_tx *ref = NULL;
+  const void *plain = NULL;
+  unsigned int count, i, j, len, tx, total = 0;
+  unsigned long begin = hybrid.clock(), air, airtime = 0;
+  unsigned int bytes = m->size;
+  int r = LORAMAC_SND_SUCCESS;
+  uint8_t tag;
+
+  if(hybrid.flags & (HYBRID_COMPRESS | HYBRID_DELTA)) {
+    plain = txmsg_flat(m, flat);
+    txmsg_init(&coded, msg, encode(dst, msg, sizeof(msg), plain, m->size, &ref));
+    coded.probe = m->probe;
+    m = &coded;
+  }
+
+  count = frag_count(LORA_FRAG_SIZE, m->size);
+  if(!count) {
+    delta_end(ref, plain, bytes, 0, 0);
+    return HYBRID_SND_TOOLONG;
+  }
+
+  hybrid.lora_lock();
+  tag = lora_frag_tag++;
+  hybrid.lora_unlock();
+
+  COUNT(tx_lora);
+
+  /* stop at the first fragment that could not be delivered */
+  for(i = 0 ; i < count && r == LORAMAC_SND_SUCCESS ; i++) {
+    len = frag_header(hdr, LORA_FRAG_SIZE, tag, i, m->size);
+    txmsg_init(&frag, hdr, FRAG_HDR_SIZE);
+    txmsg_slice(&frag, m, i * LORA_FRAG_SIZE, len);
+    for(j = 0 ; j < frag.count ; j++)
+      segs[j] = (struct loramac_seg){ .base = frag.seg[j].base, .size = frag.seg[j].size };
+
+    tx     = 0;
+    r      = loramac_sendv_until(lora_mac(dst), dst, segs, frag.count, &tx, deadline);
+    total += tx;
+
+    /* broadcasts go through every module */
+    for(j = 1 ; dst == 0xffff && j < lora_nradios ; j++)
+      loramac_sendv_until(&lora_radios[j].mac, dst, segs, frag.count, NULL, deadline);
+    if(hybrid.lora.radio.bw) {
+      air      = tx * duty_airtime(&hybrid.lora.radio, 1 + LORAMAC_HDR_SIZE + frag.size);
+      airtime += air;
+      lora_charge(air);
+    }
+  }
+  charge(HYBRID_SOURCE_LORA, dst, airtime);
+  delta_end(ref, plain, bytes, ref && msg[0] == HYBRID_CODEC_DELTA, r == LORAMAC_SND_SUCCESS);
+
+  switch(r) {
+  case LORAMAC_SND_SUCCESS:
+    if(!m->probe)
+      rate_sample(HYBRID_SOURCE_LORA, bytes, begin);
+    cache_update(dst, HYBRID_SOURCE_LORA, 1, begin);
+    link_heard(dst, HYBRID_SOURCE_LORA);
+
+    /* each retransmission lowers the quality of the link */
+    if(link)
+      score_sample(&link->lora, HYBRID_SCORE_MAX * count / (total ? total : count));
+    return HYBRID_SND_SUCCESS; /* finally! */
+  case LORAMAC_SND_NOACK: /* nothing we can do... */
+    cache_update(dst, HYBRID_SOURCE_LORA, 0, begin);
+    link_heard(dst, HYBRID_SOURCE_LORA);
+    if(link)
+      score_sample(&link->lora, 0);
+    return HYBRID_SND_NOACK;
+  case LORAMAC_SND_EXPIRED:
+    return HYBRID_SND_EXPIRED;
+  default:
+    lora_errno = r;
+    return HYBRID_ERR_LORA;
+  }
+}
+
+/* A modem that stopped answering costs a full timeout on each
+   frame. After a few timeouts in a row the breaker trips and
+   G3-PLC is skipped like during the boot, until the platform
+   has restarted it (see g3plc_recover). A timeout while the
+   UART was losing bytes says nothing about the modem. */
+static void g3plc_health(int r, unsigned long lost)
+{
+  if(r != G3PLC_SND_CONFIRM) {
+    __atomic_store_n(&g3plc_timeouts, 0, __ATOMIC_RELAXED);
+    return;
+  }
+
+  if(hybrid.g3plc_lost && hybrid.g3plc_lost() != lost) {
+    COUNT(g3plc_starved);
+    return;
+  }
+
+  if(!hybrid.g3plc.breaker ||
+     __atomic_add_fetch(&g3plc_timeouts, 1, __ATOMIC_RELAXED) != hybrid.g3plc.breaker)
+    return;
+
+  __atomic_store_n(&g3plc_ready, 0, __ATOMIC_RELEASE);
+  COUNT(g3plc_downs);
+  if(hybrid.g3plc_recover)
+    hybrid.g3plc_recover(hybrid.data);
+}
+
+/* Random backoff up to window us (xorshift32). Concurrent
+   senders may draw the same value, which does no harm. */
+static unsigned long backoff(unsigned long window)
+{
+  uint32_t x = __atomic_load_n(&backoff_seed, __ATOMIC_RELAXED);
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  __atomic_store_n(&backoff_seed, x, __ATOMIC_RELAXED);
+  return x % window;
+}
+
+/* Count the confirm of a frame and move the retransmissions of the
+   modem at the end of each window (see HYBRID_TUNE). This runs in the
+   send path with the G3-PLC lock held so that the attribute is not set
+   during a send. */
+static void tune_retrans(int r)
+{
+  unsigned int retrans = tune.retrans;
+
+  if(!(hybrid.flags & HYBRID_TUNE) || (r != G3PLC_SND_SUCCESS && r != G3PLC_SND_NOACK))
+    return;
+
+  tune.frames++;
+  tune.noacks += r == G3PLC_SND_NOACK;
+  if(tune.frames < HYBRID_TUNE_WINDOW)
+    return;
+
+  if(tune.noacks * 100 >= HYBRID_TUNE_NOISY * tune.frames && retrans < hybrid.g3plc.retrans_max)
+    retrans++;
+  else if(!tune.noacks && retrans > hybrid.g3plc.retrans_min)
+    retrans--;
+  tune.frames = 0;
+  tune.noacks = 0;
+
+  if(retrans == tune.retrans || g3plc_set_retrans(&g3plc_ctx, retrans))
+    return;
+
+  __atomic_store_n(&tune.retrans, retrans, __ATOMIC_RELAXED);
+  COUNT(retrans_tunes);
+  PROBE(hybrid, retrans, retrans);
+}
+
+/* Send on G3-PLC again while the channel is busy, after a random
+   backoff, as long as the access budget and the deadline allow it.
+   Brief PLC congestion then does not push the frame on LoRa. */
+static int g3plc_send_access(uint16_t dst, const struct txmsg *m,
+                             unsigned long begin, unsigned long deadline)
+{
+  unsigned long window = HYBRID_ACCESS_BACKOFF;
+  struct g3plc_seg segs[TXMSG_SEGS];
+  unsigned long lost, wait;
+  unsigned int i;
+  int r;
+
+  for(i = 0 ; i < m->count ; i++)
+    segs[i] = (struct g3plc_seg){ .base = m->seg[i].base, .size = m->seg[i].size };
+
+  while(1) {
+    hybrid.g3plc_lock();
+    lost = hybrid.g3plc_lost ? hybrid.g3plc_lost() : 0;
+    r    = m->ext ? g3plc_sendv_ext(&g3plc_ctx, m->ext, segs, m->count) :
+                   g3plc_sendv(&g3plc_ctx, dst, segs, m->count);
+    g3plc_health(r, lost);
+    tune_retrans(r);
+    hybrid.g3plc_unlock();
+    if(r != G3PLC_SND_ACCESS)
+      return r;
+
+    wait = backoff(window);
+    if(hybrid.clock() - begin + wait >= hybrid.g3plc.access_budget)
+      return r;
+    if(deadline && (long)(deadline - hybrid.clock() - wait) <= 0)
+      return r;
+
+    hybrid.usleep(wait);
+    COUNT(access_retries);
+    if(window < HYBRID_ACCESS_BACKOFF_MAX)
+      window <<= 1;
+  }
+}
+
+/* Charge a G3-PLC frame for the transmissions its confirm implies
+   (see HYBRID_PLC_OVERHEAD). A frame that was not confirmed in time
+   is charged once, the other failures did not reach the channel. */
+static void g3plc_charge(int r, uint16_t dst, const struct txmsg *m)
+{
+  unsigned long airtime = g3plc_airtime(m->ext ? NULL : link_find(dst), m->size);
+
+  switch(r) {
+  case G3PLC_SND_SUCCESS:
+  case G3PLC_SND_CONFIRM:
+    break;
+  case G3PLC_SND_NOACK:
+    airtime *= 1 + __atomic_load_n(&tune.retrans, __ATOMIC_RELAXED);
+    break;
+  default:
+    return;
+  }
+
+  charge(HYBRID_SOURCE_G3PLC, m->ext ? HYBRID_NO_SHORT : dst, airtime);
+}
+
+/* The modem retransmits the frame itself, so the deadline is
+   only checked before, and between the attempts on a busy
+   channel (see g3plc_send_access()). */
+static int hybrid_g3plc_send(uint16_t dst, const struct txmsg *m,
+                             struct link_stats *link, unsigned long deadline)
+{
+  unsigned long begin = hybrid.clock();
+  int r;
+
+  if(expired(deadline))
+    return HYBRID_SND_EXPIRED;
+
+  COUNT(tx_g3plc);
+
+  r = g3plc_send_access(dst, m, begin, deadline);
+  g3plc_charge(r, dst, m);
+  switch(r) {
+  case G3PLC_SND_SUCCESS:
+    if(!m->probe)
+      rate_sample(HYBRID_SOURCE_G3PLC, m->size, begin);
+    cache_update(dst, HYBRID_SOURCE_G3PLC, 1, begin);
+    link_heard(dst, HYBRID_SOURCE_G3PLC);
+    if(link)
+      score_sample(&link->g3plc, HYBRID_SCORE_MAX);
+    return HYBRID_SND_SUCCESS; /* great! */
+  case G3PLC_SND_NOACK:
+  case G3PLC_SND_ACCESS:
+    cache_update(dst, HYBRID_SOURCE_G3PLC, 0, begin);
+    link_heard(dst, HYBRID_SOURCE_G3PLC);
+    if(link)
+      score_sample(&link->g3plc, 0);
+    return HYBRID_SND_NOACK;
+  default:
+    g3plc_errno = r;
+    return HYBRID_ERR_G3PLC;
+  }
+}
+
+static int race_g3plc(void *data)
+{
+  const struct race_frame *frame = data;
+  struct txmsg m;
+
+  txmsg_init(&m, frame->payload, frame->size);
+  return hybrid_g3plc_send(frame->dst, &m, NULL, frame->deadline);
+}
+
+static int race_lora(void *data)
+{
+  const struct race_frame *frame = data;
+  struct txmsg m;
+
+  txmsg_init(&m, frame->payload, frame->size);
+  return hybrid_lora_send(frame->dst, &m, NULL, frame->deadline);
+}
+
+static void race_done(void *data)
+{
+  free(data);
+}
+
+/* Send on both media at once and return on the first success.
+   When both fail we report the LoRa status like the fallback. */
+static int hybrid_race_send(uint16_t dst, const struct txmsg *m, unsigned long deadline)
+{
+  struct race_frame *frame;
+  int r;
+
+  /* the frame is freed by the slowest medium */
+  frame = malloc(sizeof(struct race_frame));
+  if(!frame)
+    return HYBRID_SND_OOM;
+
+  frame->dst      = dst;
+  frame->size     = m->size;
+  frame->deadline = deadline;
+  txmsg_gather(frame->payload, m);
+
+  /* nothing to race with while G3-PLC is booting */
+  if(!hybrid_g3plc_ready()) {
+    r = lora_saturated(frame->size) ? HYBRID_SND_DUTY : race_lora(frame);
+    free(frame);
+    return r;
+  }
+
+  /* do not race when LoRa cannot afford it */
+  if(lora_saturated(frame->size)) {
+    r = race_g3plc(frame);
+    free(frame);
+    return r;
+  }
+
+  return hybrid.race(race_g3plc, race_lora, race_done, frame);
+}
+
+/* Try the medium most likely to succeed first, falling back
+   to the other one when it could not deliver the frame. */
+static int hybrid_adaptive_send(uint16_t dst, const struct txmsg *m, unsigned long deadline)
+{
+  struct link_stats *link = link_lookup(dst);
+  int r;
+
+  /* leave the scores alone, this says nothing about the link */
+  if(lora_saturated(m->size))
+    return hybrid_g3plc_send(dst, m, link, deadline);
+
+  if(link->lora > link->g3plc) {
+    score_drift(&link->g3plc, HYBRID_SCORE_G3PLC);
+
+    r = hybrid_lora_send(dst, m, link, deadline);
+    if(r != HYBRID_SND_NOACK)
+      return r;
+    if(!in_time(HYBRID_SOURCE_G3PLC, m->size, deadline))
+      return HYBRID_SND_EXPIRED;
+
+    COUNT(fallbacks);
+    PROBE(hybrid, fallback, dst, HYBRID_SOURCE_G3PLC, m->size);
+    TRACE(HYBRID_TRACE_FALLBACK, HYBRID_SOURCE_G3PLC);
+    return hybrid_g3plc_send(dst, m, link, deadline);
+  }
+
+  score_drift(&link->lora, HYBRID_SCORE_LORA);
+
+  r = hybrid_g3plc_send(dst, m, link, deadline);
+  if(r != HYBRID_SND_NOACK)
+    return r;
+  if(!in_time(HYBRID_SOURCE_LORA, m->size, deadline))
+    return HYBRID_SND_EXPIRED;
+
+  COUNT(fallbacks);
+  PROBE(hybrid, fallback, dst, HYBRID_SOURCE_LORA, m->size);
+  TRACE(HYBRID_TRACE_FALLBACK, HYBRID_SOURCE_LORA);
+  return hybrid_lora_send(dst, m, link, deadline);
+}
+
+/* Prefix the message with the next sequence number in hdr (see
+   HYBRID_DEDUP) so that its copies on either medium carry the same
+   number. Return false when it does not fit in a frame. */
+static int number(unsigned char *hdr, struct txmsg *m)
+{
+  if(m->size > HYBRID_MAX_PAYLOAD)
+    return 0;
+  if(!(hybrid.flags & HYBRID_DEDUP))
+    return 1;
+  if(m->size > HYBRID_MAX_PAYLOAD - HYBRID_SEQ_HDR_SIZE)
+    return 0;
+
+  hdr[0] = __atomic_fetch_add(&tx_seqno, 1, __ATOMIC_RELAXED);
+  txmsg_prepend(m, hdr, HYBRID_SEQ_HDR_SIZE);
+  return 1;
+}
+
+/* Prefix the message with the next order number of the destination
+   in hdr (see HYBRID_ORDER), left to the caller without one. Return
+   false when it does not fit in a frame. */
+static int order_header(unsigned char *hdr, const uint16_t *dst, struct txmsg *m)
+{
+  if(!(hybrid.flags & HYBRID_ORDER))
+    return 1;
+  if(m->size > HYBRID_MAX_PAYLOAD - HYBRID_ORDER_HDR_SIZE)
+    return 0;
+
+  hdr[0] = dst ? order_number(*dst) : 0;
+  txmsg_prepend(m, hdr, HYBRID_ORDER_HDR_SIZE);
+  return 1;
+}
+
+/* Send on G3-PLC and fall back to LoRa, or the other way
+   around. LoRa is skipped when it cannot afford the frame
+   and the fallback when it cannot deliver it in time. The
+   link scores are only updated for routes (see route_send()).
+   With only no other medium than this one is used. */
+static int send_first(int medium, int only, uint16_t dst, const struct txmsg *m,
+                      struct link_stats *link, unsigned long deadline)
+{
+  int r;
+
+  if(only && medium == HYBRID_SOURCE_LORA)
+    return lora_saturated(m->size) ? HYBRID_SND_DUTY :
+      hybrid_lora_send(dst, m, link, deadline);
+  if(only)
+    return hybrid_g3plc_ready() ? hybrid_g3plc_send(dst, m, link, deadline) :
+      HYBRID_SND_NOACK;
+
+  /* LoRa carries the traffic while G3-PLC is booting */
+  if(!hybrid_g3plc_ready()) {
+    if(lora_saturated(m->size))
+      return HYBRID_SND_DUTY;
+    return hybrid_lora_send(dst, m, link, deadline);
+  }
+
+  if(medium == HYBRID_SOURCE_LORA && !lora_saturated(m->size)) {
+    r = hybrid_lora_send(dst, m, link, deadline);
+    if(r != HYBRID_SND_NOACK)
+      return r;
+    if(!in_time(HYBRID_SOURCE_G3PLC, m->size, deadline))
+      return HYBRID_SND_EXPIRED;
+
+    COUNT(fallbacks);
+    PROBE(hybrid, fallback, dst, HYBRID_SOURCE_G3PLC, m->size);
+    TRACE(HYBRID_TRACE_FALLBACK, HYBRID_SOURCE_G3PLC);
+    return hybrid_g3plc_send(dst, m, link, deadline);
+  }
+
+  r = hybrid_g3plc_send(dst, m, link, deadline);
+  if(r != HYBRID_SND_NOACK)
+    return r;
+
+  if(lora_saturated(m->size))
+    return HYBRID_SND_DUTY;
+  if(!in_time(HYBRID_SOURCE_LORA, m->size, deadline))
+    return HYBRID_SND_EXPIRED;
+
+  COUNT(fallbacks);
+  PROBE(hybrid, fallback, dst, HYBRID_SOURCE_LORA, m->size);
+  TRACE(HYBRID_TRACE_FALLBACK, HYBRID_SOURCE_LORA);
+  return hybrid_lora_send(dst, m, link, deadline); /* let's try LoRa instead */
+}
+
+int hybrid_send(uint16_t dst, const void *payload, unsigned int payload_size)
+{
+  return hybrid_send_until(-1, dst, payload, payload_size, 0);
+}
+
+int hybrid_sendv(uint16_t dst, const struct hybrid_seg *segs, unsigned int count)
+{
+  return hybrid_sendv_until(-1, dst, segs, count, 0);
+}
+
+int hybrid_send_medium(int medium, uint16_t dst, const void *payload, unsigned int payload_size)
+{
+  return hybrid_send_until(medium, dst, payload, payload_size, 0);
+}
+
+/* Send a message to a neighbour on the media chosen by the flags,
+   or on this medium first (only) when it is not negative. */
+static int dispatch(int medium, int only, uint16_t dst, const struct txmsg *m,
+                    struct link_stats *link, unsigned long deadline)
+{
+  if(medium >= 0)
+    return send_first(medium, only, dst, m, link, deadline);
+
+  if(hybrid.flags & HYBRID_RACE)
+    return hybrid_race_send(dst, m, deadline);
+
+  if(hybrid.flags & HYBRID_ADAPTIVE && dst != 0xffff && hybrid_g3plc_ready())
+    return hybrid_adaptive_send(dst, m, deadline);
+
+  if(hybrid.flags & HYBRID_CACHE && dst != 0xffff && hybrid_g3plc_ready())
+    return send_first(cache_first(dst, deadline), 0, dst, m, link, deadline);
+
+  return send_first(HYBRID_SOURCE_G3PLC, 0, dst, m, link, deadline);
+}
+
+/* Prefix the message with its route header in hdr (see HYBRID_ROUTE).
+   Return false when it does not fit in a frame. */
+static int route_header(unsigned char *hdr, uint16_t dst, struct txmsg *m)
+{
+  if(m->size > HYBRID_MAX_PAYLOAD - HYBRID_ROUTE_HDR_SIZE)
+    return 0;
+
+  hdr[0] = dst >> 8;
+  hdr[1] = dst & 0xff;
+  hdr[2] = hybrid.mac_address >> 8;
+  hdr[3] = hybrid.mac_address & 0xff;
+  hdr[4] = 0;
+  txmsg_prepend(m, hdr, HYBRID_ROUTE_HDR_SIZE);
+  return 1;
+}
+
+/* Score of the next hop of a route on its medium, or on
+   the best medium when the route leaves the choice open. */
+static int route_score(const struct hybrid_route *route)
+{
+  const struct link_stats *link = link_lookup(route->next_hop);
+
+  switch(route->medium) {
+  case HYBRID_SOURCE_LORA:
+    return link->lora;
+  case HYBRID_SOURCE_G3PLC:
+    return link->g3plc;
+  default:
+    return link->lora > link->g3plc ? link->lora : link->g3plc;
+  }
+}
+
+/* Route to a destination with the best next hop,
+   NULL when the destination is a neighbour. */
+static const struct hybrid_route * route_lookup(uint16_t dst)
+{
+  const struct hybrid_route *best = NULL;
+  int score, best_score = -1;
+  unsigned int i;
+
+  for(i = 0 ; i < hybrid.route_count ; i++) {
+    if(hybrid.routes[i].dst != dst)
+      continue;
+
+    score = route_score(&hybrid.routes[i]);
+    if(score > best_score) {
+      best       = &hybrid.routes[i];
+      best_score = score;
+    }
+  }
+
+  return best;
+}
+
+/* Send a message with its route header to the next hop of its
+   destination, on the medium of the route when it has one unless
+   the medium is the only one allowed. The link scores of the next
+   hop follow what it delivers so that the routes can be compared. */
+static int route_send(int medium, int only, uint16_t dst, const struct txmsg *m,
+                      unsigned long deadline)
+{
+  const struct hybrid_route *route = route_lookup(dst);
+
+  if(!route || dst == 0xffff)
+    return dispatch(medium, only, dst, m, NULL, deadline);
+
+  if(route->medium >= 0 && !only)
+    medium = route->medium;
+  return dispatch(medium, only, route->next_hop, m, link_lookup(route->next_hop), deadline);
+}
+
+/* Medium that dispatch() would try first, without taking a slot in
+   the tables for a destination they do not know. */
+static int path_medium(uint16_t dst, unsigned int size)
+{
+  const struct link_stats *link;
+  const struct cache_entry *entry;
+  unsigned long now = hybrid.clock();
+  int medium = HYBRID_SOURCE_G3PLC;
+
+  if(!hybrid_g3plc_ready())
+    return lora_saturated(size) ? -1 : HYBRID_SOURCE_LORA;
+  if(lora_saturated(size) || dst == 0xffff || hybrid.flags & HYBRID_RACE)
+    return HYBRID_SOURCE_G3PLC;
+
+  if(hybrid.flags & HYBRID_ADAPTIVE) {
+    link = link_find(dst);
+    return link && link->lora > link->g3plc ? HYBRID_SOURCE_LORA : HYBRID_SOURCE_G3PLC;
+  }
+
+  if(hybrid.flags & HYBRID_CACHE) {
+    while(__atomic_test_and_set(&cache_busy, __ATOMIC_ACQUIRE));
+    for(entry = cache ; entry < cache + HYBRID_CACHE_PEERS ; entry++)
+      if(entry->valid && entry->addr == dst) {
+        medium = cache_medium(entry, 0, now);
+        break;
+      }
+    __atomic_clear(&cache_busy, __ATOMIC_RELEASE);
+  }
+
+  return medium;
+}
+
+void hybrid_path(uint16_t dst, struct hybrid_path *path)
+{
+  const struct hybrid_route *route = NULL;
+  unsigned int overhead = 0, codec = 0;
+  unsigned long air;
+  int medium;
+
+  if(hybrid.flags & HYBRID_DEDUP)
+    overhead += HYBRID_SEQ_HDR_SIZE;
+  if(hybrid.flags & HYBRID_ORDER)
+    overhead += HYBRID_ORDER_HDR_SIZE;
+  if(hybrid.flags & HYBRID_ROUTE)
+    overhead += HYBRID_ROUTE_HDR_SIZE;
+  if(hybrid.flags & HYBRID_TRANSPORT)
+    overhead += HYBRID_XPORT_HDR_SIZE;
+  if(hybrid.flags & (HYBRID_COMPRESS | HYBRID_DELTA))
+    codec = HYBRID_CODEC_HDR_SIZE;
+
+  path->frame[HYBRID_SOURCE_G3PLC] = HYBRID_MAX_PAYLOAD - overhead;
+  path->frame[HYBRID_SOURCE_LORA]  = LORA_FRAG_SIZE - overhead - codec;
+  path->max_message = HYBRID_MAX_PAYLOAD - overhead;
+
+  /* the larger unicast messages are segmented (see xport_send()) */
+  if(hybrid.flags & HYBRID_TRANSPORT && dst != 0xffff) {
+    if(path->frame[HYBRID_SOURCE_G3PLC] > HYBRID_SEGMENT_SIZE)
+      path->frame[HYBRID_SOURCE_G3PLC] = HYBRID_SEGMENT_SIZE;
+    if(path->frame[HYBRID_SOURCE_LORA] > HYBRID_SEGMENT_SIZE)
+      path->frame[HYBRID_SOURCE_LORA] = HYBRID_SEGMENT_SIZE;
+    path->max_message = HYBRID_SEGMENT_SIZE * HYBRID_MAX_SEGMENTS;
+    if(path->max_message > HYBRID_MAX_PAYLOAD)
+      path->max_message = HYBRID_MAX_PAYLOAD;
+  }
+
+  path->next_hop = dst;
+  if(hybrid.flags & HYBRID_ROUTE && dst != 0xffff && (route = route_lookup(dst)))
+    path->next_hop = route->next_hop;
+
+  medium = path_medium(path->next_hop, path->frame[HYBRID_SOURCE_LORA] + overhead);
+  if(route && route->medium >= 0 && medium >= 0)
+    medium = route->medium;
+  path->medium = medium;
+
+  path->goodput[HYBRID_SOURCE_G3PLC] = __atomic_load_n(&rates[HYBRID_SOURCE_G3PLC], __ATOMIC_RELAXED);
+  if(!path->goodput[HYBRID_SOURCE_G3PLC]) {
+    air = g3plc_airtime(link_find(path->next_hop), path->frame[HYBRID_SOURCE_G3PLC] + overhead);
+    path->goodput[HYBRID_SOURCE_G3PLC] = path->frame[HYBRID_SOURCE_G3PLC] * 1000000UL / air;
+  }
+
+  path->goodput[HYBRID_SOURCE_LORA] = __atomic_load_n(&rates[HYBRID_SOURCE_LORA], __ATOMIC_RELAXED);
+  air = hybrid.lora.radio.bw ? lora_airtime(path->frame[HYBRID_SOURCE_LORA] + overhead + codec) : 0;
+  if(!path->goodput[HYBRID_SOURCE_LORA] && air)
+    path->goodput[HYBRID_SOURCE_LORA] = path->frame[HYBRID_SOURCE_LORA] * 1000000UL / air;
+  /* the duty cycle lets LoRa on air this share of the time at most */
+  if(hybrid.flags & HYBRID_DUTY && air &&
+     path->goodput[HYBRID_SOURCE_LORA] > path->frame[HYBRID_SOURCE_LORA] * 1000UL * lora_duty.permille / air)
+    path->goodput[HYBRID_SOURCE_LORA] = path->frame[HYBRID_SOURCE_LORA] * 1000UL * lora_duty.permille / air;
+
+  path->lora_budget = hybrid_lora_budget();
+}
+
+static int send_msg(int medium, int only, uint16_t dst, const struct txmsg *msg,
+                    unsigned long deadline)
+{
+  unsigned char ordered[HYBRID_ORDER_HDR_SIZE];
+  unsigned char seq[HYBRID_SEQ_HDR_SIZE];
+  unsigned char routed[HYBRID_ROUTE_HDR_SIZE];
+  struct txmsg m = *msg;
+
+  if(!order_header(ordered, &dst, &m) || !number(seq, &m))
+    return HYBRID_SND_TOOLONG;
+
+  if(hybrid.flags & HYBRID_ROUTE) {
+    if(!route_header(routed, dst, &m))
+      return HYBRID_SND_TOOLONG;
+    return route_send(medium, only, dst, &m, deadline);
+  }
+
+  return dispatch(medium, only, dst, &m, NULL, deadline);
+}
+
+/* Prefix the message with the plain transport header in hdr (see
+   HYBRID_TRANSPORT). Return false when it does not fit in a frame. */
+static int plain(unsigned char *hdr, struct txmsg *m)
+{
+  if(!(hybrid.flags & HYBRID_TRANSPORT))
+    return 1;
+  if(m->size > HYBRID_MAX_PAYLOAD - HYBRID_XPORT_HDR_SIZE)
+    return 0;
+
+  hdr[0] = HYBRID_XPORT_PLAIN;
+  txmsg_prepend(m, hdr, HYBRID_XPORT_HDR_SIZE);
+  return 1;
+}
+
+static int send_plain(int medium, int only, uint16_t dst, const struct txmsg *msg,
+                      unsigned long deadline)
+{
+  unsigned char hdr[HYBRID_XPORT_HDR_SIZE];
+  struct txmsg m = *msg;
+
+  if(!plain(hdr, &m))
+    return HYBRID_SND_TOOLONG;
+  return send_msg(medium, only, dst, &m, deadline);
+}
+
+static unsigned int popcount(uint32_t v)
+{
+  unsigned int n;
+
+  for(n = 0 ; v ; v &= v - 1, n++);
+  return n;
+}
+
+/* Wait for an answer after this many, until the timeout or the
+   deadline. Return false when none came. */
+static int xport_wait(struct xport_tx *tx, unsigned int answers, unsigned long deadline)
+{
+  unsigned long begin = hybrid.clock();
+
+  while(__atomic_load_n(&tx->answers, __ATOMIC_ACQUIRE) == answers) {
+    if(hybrid.clock() - begin >= HYBRID_TRANSPORT_TIMEOUT || expired(deadline))
+      return 0;
+    hybrid.usleep(HYBRID_TRANSPORT_POLL);
+  }
+
+  return 1;
+}
+
+/* Send the unacknowledged segments of a transfer, a window at a
+   time, each window followed by a poll of the destination. A
+   segment that could not be sent or a poll left unanswered moves
+   the rest of the transfer to the other medium, unless it must
+   stay on this one. */
+static int xport_send(struct xport_tx *tx, int medium, int only, uint16_t dst,
+                      const struct txmsg *m, unsigned long deadline)
+{
+  unsigned char hdr[HYBRID_SEGMENT_HDR_SIZE];
+  unsigned int count = (m->size + HYBRID_SEGMENT_SIZE - 1) / HYBRID_SEGMENT_SIZE;
+  struct txmsg seg;
+  uint32_t all = (1UL << count) - 1, sent = 0, acked;
+  unsigned int i, last, len, window, answers, stalled = 0, progress = 0;
+  int r = HYBRID_SND_NOACK;
+
+  while((acked = __atomic_load_n(&tx->acked, __ATOMIC_RELAXED)) != all) {
+    if(popcount(acked) > progress) {
+      progress = popcount(acked);
+      stalled  = 0;
+    }
+    else if(stalled++ >= HYBRID_TRANSPORT_RETRIES)
+      return r;
+    if(expired(deadline))
+      return HYBRID_SND_EXPIRED;
+
+    /* the last segment of the window polls */
+    for(i = 0, window = 0, last = 0 ; i < count && window < HYBRID_TRANSPORT_WINDOW ; i++) {
+      if(!(acked >> i & 1)) {
+        last = i;
+        window++;
+      }
+    }
+
+    answers = __atomic_load_n(&tx->answers, __ATOMIC_ACQUIRE);
+    for(i = 0, r = HYBRID_SND_SUCCESS ; i <= last && r == HYBRID_SND_SUCCESS ; i++) {
+      if(acked >> i & 1)
+        continue;
+
+      len    = i < count - 1 ? HYBRID_SEGMENT_SIZE : m->size - i * HYBRID_SEGMENT_SIZE;
+      hdr[0] = HYBRID_XPORT_SEGMENT | (i == last ? HYBRID_XPORT_POLL : 0);
+      hdr[1] = tx->xfer;
+      hdr[2] = i;
+      hdr[3] = count;
+      txmsg_init(&seg, hdr, HYBRID_SEGMENT_HDR_SIZE);
+      txmsg_slice(&seg, m, i * HYBRID_SEGMENT_SIZE, len);
+
+      if(sent >> i & 1)
+        COUNT(seg_resent);
+      COUNT(tx_segments);
+      sent |= 1UL << i;
+      r = send_msg(medium, only, dst, &seg, deadline);
+    }
+
+    switch(r) {
+    case HYBRID_SND_SUCCESS:
+      if(xport_wait(tx, answers, deadline))
+        continue;
+      r = HYBRID_SND_NOACK;
+      break;
+    case HYBRID_SND_TOOLONG:
+    case HYBRID_SND_OOM:
+    case HYBRID_SND_EXPIRED:
+      return r;
+    default: /* lost on this medium, or its layer failed */
+      break;
+    }
+
+    /* resume from there on the other medium */
+    if(!only) {
+      medium = medium == HYBRID_SOURCE_LORA ? HYBRID_SOURCE_G3PLC : HYBRID_SOURCE_LORA;
+      COUNT(seg_switches);
+      PROBE(hybrid, fallback, dst, medium, m->size);
+      TRACE(HYBRID_TRACE_FALLBACK, medium);
+    }
+  }
+
+  return HYBRID_SND_SUCCESS;
+}
+
+/* Segment a long message (see HYBRID_TRANSPORT), or send it
+   plain when it fits in a segment, goes to everyone or when
+   all transfers are already waiting for their answers. */
+static int transfer(int medium, int only, uint16_t dst, const struct txmsg *m,
+                    unsigned long deadline)
+{
+  struct xport_tx *tx;
+  int r;
+
+  if(!(hybrid.flags & HYBRID_TRANSPORT) || dst == 0xffff || m->size <= HYBRID_SEGMENT_SIZE)
+    return send_plain(medium, only, dst, m, deadline);
+  if(m->size > HYBRID_SEGMENT_SIZE * HYBRID_MAX_SEGMENTS || m->size > HYBRID_MAX_PAYLOAD)
+    return HYBRID_SND_TOOLONG;
+
+  for(tx = xport_txs ; tx < xport_txs + HYBRID_TRANSPORT_PEERS ; tx++) {
+    if(!__atomic_test_and_set(&tx->busy, __ATOMIC_ACQUIRE))
+      break;
+  }
+  if(tx == xport_txs + HYBRID_TRANSPORT_PEERS)
+    return send_plain(medium, only, dst, m, deadline);
+
+  tx->dst     = dst;
+  tx->xfer    = __atomic_fetch_add(&xport_xfer, 1, __ATOMIC_RELAXED);
+  tx->acked   = 0;
+  tx->answers = 0;
+  r = xport_send(tx, medium, only, dst, m, deadline);
+  __atomic_clear(&tx->busy, __ATOMIC_RELEASE);
+
+  return r;
+}
+
+int hybrid_send_until(int medium, uint16_t dst, const void *payload, unsigned int payload_size,
+                      unsigned long deadline)
+{
+  struct txmsg m;
+
+  txmsg_init(&m, payload, payload_size);
+  return transfer(medium, 0, dst, &m, deadline);
+}
+
+int hybrid_send_only(int medium, uint16_t dst, const void *payload, unsigned int payload_size,
+                     unsigned long deadline)
+{
+  struct txmsg m;
+
+  txmsg_init(&m, payload, payload_size);
+  return transfer(medium, 1, dst, &m, deadline);
+}
+
+int hybrid_sendv_until(int medium, uint16_t dst, const struct hybrid_seg *segs, unsigned int count,
+                       unsigned long deadline)
+{
+  struct txmsg m;
+
+  if(!txmsg_segs(&m, segs, count))
+    return HYBRID_SND_TOOLONG;
+  return transfer(medium, 0, dst, &m, deadline);
+}
+
+int hybrid_send_ext(uint64_t dst, const void *payload, unsigned int payload_size)
+{
+  struct hybrid_seg seg = { .base = payload, .size = payload_size };
+
+  return hybrid_sendv_ext(dst, &seg, 1);
+}
+
+/* A destination we do not know the short address of still gets
+   the route header, to no short address and from our own so that
+   it learns ours. */
+int hybrid_sendv_ext(uint64_t dst, const struct hybrid_seg *segs, unsigned int count)
+{
+  uint16_t addr = ext_lookup(dst);
+  struct txmsg m;
+
+  if(addr != HYBRID_NO_SHORT)
+    return hybrid_sendv(addr, segs, count);
+
+  if(!txmsg_segs(&m, segs, count))
+    return HYBRID_SND_TOOLONG;
+  m.ext = dst;
+  return send_plain(HYBRID_SOURCE_G3PLC, 1, HYBRID_NO_SHORT, &m, 0);
+}
+
+int hybrid_reply(uint16_t dst, const void *msg, unsigned int size)
+{
+  struct txmsg m;
+
+  txmsg_init(&m, msg, size);
+  return send_msg(-1, 0, dst, &m, 0);
+}
+
+int hybrid_forward(const void *msg, unsigned int size)
+{
+  const uint8_t *p = msg;
+  struct txmsg m;
+
+  if(size < HYBRID_ROUTE_HDR_SIZE || size > HYBRID_MAX_PAYLOAD)
+    return HYBRID_SND_TOOLONG;
+
+  COUNT(forwarded);
+  PROBE(hybrid, forward, p[0] << 8 | p[1], p[2] << 8 | p[3], p[4]);
+  txmsg_init(&m, msg, size);
+  return route_send(-1, 0, p[0] << 8 | p[1], &m, 0);
+}
+
+/* Destinations of hybrid_send_many() shared by a worker on each
+   medium. The workers take the next destination in turn, so the
+   faster medium reaches more of them. The second pass sends the
+   messages that a medium could not deliver again on the other
+   one. G3-PLC cannot send two frames at once, that is why each
+   worker sticks to its own medium. Each worker has its own copy
+   of the message to patch the route header. */
+struct fanout {
+  const uint16_t *dsts;
+  int            *status;
+  unsigned int    count;
+  unsigned int    next;
+  int             fallback;
+  unsigned int    size;
+  unsigned char   msg[2][HYBRID_MAX_PAYLOAD];
+  uint8_t        *order;    /* order number of each destination (see HYBRID_ORDER) */
+  uint8_t         medium[]; /* medium of the first pass */
+};
+
+static int fanout_send(struct fanout *f, int medium, unsigned int i)
+{
+  const struct hybrid_route *route;
+  unsigned char *msg = f->msg[medium];
+  uint16_t dst = f->dsts[i];
+  struct txmsg m;
+
+  if(hybrid.flags & HYBRID_ORDER)
+    msg[hybrid.flags & HYBRID_ROUTE ? HYBRID_ROUTE_HDR_SIZE + HYBRID_SEQ_HDR_SIZE :
+                                      HYBRID_SEQ_HDR_SIZE] = f->order[i];
+
+  if(hybrid.flags & HYBRID_ROUTE) {
+    msg[0] = dst >> 8;
+    msg[1] = dst & 0xff;
+
+    route = route_lookup(dst);
+    if(route && dst != 0xffff)
+      dst = route->next_hop;
+  }
+
+  txmsg_init(&m, msg, f->size);
+  if(medium == HYBRID_SOURCE_LORA)
+    return hybrid_lora_send(dst, &m, NULL, 0);
+  return hybrid_g3plc_send(dst, &m, NULL, 0);
+}
+
+static int fanout_worker(struct fanout *f, int medium)
+{
+  int other = medium == HYBRID_SOURCE_LORA ? HYBRID_SOURCE_G3PLC : HYBRID_SOURCE_LORA;
+  unsigned int i;
+
+  if(f->fallback) {
+    for(i = 0 ; i < f->count ; i++) {
+      if(f->status[i] != HYBRID_SND_NOACK || f->medium[i] != other)
+        continue;
+      if(medium == HYBRID_SOURCE_LORA && lora_saturated(f->size))
+        break;
+
+      COUNT(fallbacks);
+      PROBE(hybrid, fallback, f->dsts[i], medium, f->size);
+      TRACE(HYBRID_TRACE_FALLBACK, medium);
+      f->status[i] = fanout_send(f, medium, i);
+    }
+  }
+  else {
+    while(!(medium == HYBRID_SOURCE_LORA && lora_saturated(f->size))) {
+      i = __atomic_fetch_add(&f->next, 1, __ATOMIC_RELAXED);
+      if(i >= f->count)
+        break;
+
+      f->medium[i] = medium;
+      f->status[i] = fanout_send(f, medium, i);
+    }
+  }
+
+  return -1; /* never a success, so race() waits for both */
+}
+
+static int fanout_g3plc(void *data)
+{
+  return fanout_worker(data, HYBRID_SOURCE_G3PLC);
+}
+
+static int fanout_lora(void *data)
+{
+  return fanout_worker(data, HYBRID_SOURCE_LORA);
+}
+
+/* The fanout is freed by hybrid_send_many() once race() returned. */
+static void fanout_done(void *data)
+{
+  (void)data;
+}
+
+static void fanout_pass(struct fanout *f)
+{
+  if(!hybrid_g3plc_ready()) {
+    fanout_lora(f);
+    return;
+  }
+
+  if(hybrid.race) {
+    hybrid.race(fanout_g3plc, fanout_lora, fanout_done, f);
+    return;
+  }
+
+  fanout_g3plc(f);
+  fanout_lora(f);
+}
+
+static void fanout_status(int *status, unsigned int count, int r)
+{
+  unsigned int i;
+
+  for(i = 0 ; i < count ; i++)
+    status[i] = r;
+}
+
+/* Whether a medium may carry a keepalive, LoRa only
+   with most of its duty cycle budget left. */
+static int probe_allowed(int medium)
+{
+  int r;
+
+  if(medium == HYBRID_SOURCE_G3PLC)
+    return hybrid_g3plc_ready();
+  if(!(hybrid.flags & HYBRID_DUTY))
+    return 1;
+
+  hybrid.lora_lock();
+  r = duty_credit(&lora_duty, hybrid.clock()) >=
+      (long)(lora_duty.capacity / 100 * HYBRID_PROBE_RESERVE);
+  hybrid.lora_unlock();
+
+  return r;
+}
+
+unsigned int hybrid_airtime(struct hybrid_airtime *dsts, unsigned int max)
+{
+  const struct link_stats *link;
+  unsigned int n = 0;
+
+  for(link = links ; link < links + HYBRID_LINK_PEERS && n < max ; link++) {
+    if(!link->valid || !(link->airtime[HYBRID_SOURCE_LORA] | link->airtime[HYBRID_SOURCE_G3PLC]))
+      continue;
+
+    dsts[n].addr = link->addr;
+    dsts[n].us[HYBRID_SOURCE_LORA]  = __atomic_load_n(&link->airtime[HYBRID_SOURCE_LORA], __ATOMIC_RELAXED);
+    dsts[n].us[HYBRID_SOURCE_G3PLC] = __atomic_load_n(&link->airtime[HYBRID_SOURCE_G3PLC], __ATOMIC_RELAXED);
+    n++;
+  }
+
+  return n;
+}
+
+int hybrid_probe(unsigned long age, unsigned long *busy)
+{
+  unsigned char seq[HYBRID_SEQ_HDR_SIZE];
+  unsigned char ordered[HYBRID_ORDER_HDR_SIZE];
+  unsigned char xport[HYBRID_XPORT_HDR_SIZE];
+  unsigned char routed[HYBRID_ROUTE_HDR_SIZE];
+  unsigned long now = hybrid.clock(), idle, oldest = 0, begin, next = age;
+  struct link_stats *link, *stale = NULL;
+  struct txmsg m;
+  int medium, stale_medium = 0, r;
+
+  for(link = links ; link < links + HYBRID_LINK_PEERS ; link++) {
+    if(!link->valid || link->addr == 0xffff)
+      continue;
+
+    for(medium = HYBRID_SOURCE_LORA ; medium <= HYBRID_SOURCE_G3PLC ; medium++) {
+      idle = now - link->heard[medium];
+      if(idle < age) {
+        if(age - idle < next)
+          next = age - idle;
+        continue;
+      }
+      if(idle <= oldest)
+        continue;
+      if(!probe_allowed(medium)) {
+        next = 0;
+        continue;
+      }
+      oldest       = idle;
+      stale        = link;
+      stale_medium = medium;
+    }
+  }
+  if(!stale) {
+    *busy = next;
+    return -1;
+  }
+
+  /* an empty message with the headers the receiver expects */
+  txmsg_init(&m, NULL, 0);
+  m.probe = 1;
+  plain(xport, &m);
+  order_header(ordered, &stale->addr, &m);
+  number(seq, &m);
+  if(hybrid.flags & HYBRID_ROUTE)
+    route_header(routed, stale->addr, &m);
+
+  COUNT(tx_probes);
+  begin = hybrid.clock();
+  r     = send_first(stale_medium, 1, stale->addr, &m, stale, 0);
+
+  /* not probed again before age even when it was not sent */
+  stale->heard[stale_medium] = hybrid.clock();
+  *busy = stale_medium == HYBRID_SOURCE_LORA ? lora_airtime(m.size) : hybrid.clock() - begin;
+
+  return r;
+}
+
+int hybrid_send_many(const uint16_t *dsts, unsigned int count,
+                     const void *payload, unsigned int payload_size, int *status)
+{
+  unsigned char prefixed[HYBRID_XPORT_HDR_SIZE];
+  unsigned char ordered[HYBRID_ORDER_HDR_SIZE];
+  unsigned char seq[HYBRID_SEQ_HDR_SIZE];
+  unsigned char routed[HYBRID_ROUTE_HDR_SIZE];
+  unsigned int i, delivered = 0;
+  struct fanout *f;
+  struct txmsg m;
+
+  /* each destination gets its own order number (see fanout_send()) */
+  txmsg_init(&m, payload, payload_size);
+  if(!plain(prefixed, &m) || !order_header(ordered, NULL, &m) || !number(seq, &m) ||
+     (hybrid.flags & HYBRID_ROUTE && !route_header(routed, 0xffff, &m))) {
+    fanout_status(status, count, HYBRID_SND_TOOLONG);
+    return 0;
+  }
+
+  f = malloc(sizeof(struct fanout) + 2 * count);
+  if(!f) {
+    fanout_status(status, count, HYBRID_SND_OOM);
+    return 0;
+  }
+
+  /* left to the destinations that LoRa could not afford */
+  fanout_status(status, count, HYBRID_SND_DUTY);
+
+  *f = (struct fanout){ .dsts   = dsts,
+                        .status = status,
+                        .count  = count,
+                        .size   = m.size,
+                        .order  = f->medium + count };
+  if(hybrid.flags & HYBRID_ORDER)
+    for(i = 0 ; i < count ; i++)
+      f->order[i] = order_number(dsts[i]);
+  txmsg_gather(f->msg[HYBRID_SOURCE_LORA], &m);
+  txmsg_gather(f->msg[HYBRID_SOURCE_G3PLC], &m);
+
+  fanout_pass(f);
+  f->fallback = 1;
+  fanout_pass(f);
+  free(f);
+
+  for(i = 0 ; i < count ; i++)
+    delivered += status[i] == HYBRID_SND_SUCCESS;
+  return delivered;
+}
+
+/* Share of the bulk bytes sent on LoRa in permille. Unless
+   configured, this is the measured throughput of LoRa over
+   the sum of both, with a floor so that each medium keeps
+   being measured. */
+static unsigned int balance_share(void)
+{
+  unsigned long lora = __atomic_load_n(&rates[HYBRID_SOURCE_LORA], __ATOMIC_RELAXED);
+  unsigned long g3   = __atomic_load_n(&rates[HYBRID_SOURCE_G3PLC], __ATOMIC_RELAXED);
+  unsigned int share;
+
+  if(hybrid.lora.share)
+    return hybrid.lora.share;
+  if(!lora || !g3)
+    return HYBRID_SHARE_MIN; /* nothing measured yet */
+
+  share = lora * 1000 / (lora + g3);
+  if(share < HYBRID_SHARE_MIN)
+    share = HYBRID_SHARE_MIN;
+  else if(share > 1000 - HYBRID_SHARE_MIN)
+    share = 1000 - HYBRID_SHARE_MIN;
+  return share;
+}
+
+int hybrid_balance(unsigned int payload_size)
+{
+  unsigned long total;
+  unsigned int share;
+  int medium;
+
+  if(!(hybrid.flags & HYBRID_BALANCE) || !hybrid_g3plc_ready())
+    return HYBRID_SOURCE_G3PLC; /* the usual order, see send_first() */
+  if(lora_saturated(payload_size))
+    return HYBRID_SOURCE_G3PLC;
+
+  share = balance_share();
+
+  /* the medium furthest behind its share of the bytes */
+  while(__atomic_test_and_set(&balance_busy, __ATOMIC_ACQUIRE));
+  total  = balance_bytes[HYBRID_SOURCE_LORA] + balance_bytes[HYBRID_SOURCE_G3PLC];
+  medium = balance_bytes[HYBRID_SOURCE_LORA] * 1000 < total * share ?
+           HYBRID_SOURCE_LORA : HYBRID_SOURCE_G3PLC;
+  balance_bytes[medium] += payload_size;
+
+  /* forget the old traffic so that a new share applies soon */
+  if(total > HYBRID_BALANCE_SPAN) {
+    balance_bytes[HYBRID_SOURCE_LORA]  /= 2;
+    balance_bytes[HYBRID_SOURCE_G3PLC] /= 2;
+  }
+  __atomic_clear(&balance_busy, __ATOMIC_RELEASE);
+
+  return medium;
+}
+
+int hybrid_lora_recv_frame(void)
+{
+  return loramac_recv_frame(&lora_radios[0].mac);
+}
+
+int hybrid_g3plc_recv_frame(void)
+{
+  return g3plc_recv_frame(&g3plc_ctx);
+}
+
+int hybrid_lora_uart_putc(unsigned char c)
+{
+  return loramac_uart_putc(&lora_radios[0].mac, c);
+}
+
+int hybrid_lora_module_uart_putc(unsigned int module, unsigned char c)
+{
+  return loramac_uart_putc(&lora_radios[module + 1].mac, c);
+}
+
+int hybrid_g3plc_uart_putc(unsigned char c)
+{
+  return g3plc_uart_putc(&g3plc_ctx, c);
+}
+
+unsigned long hybrid_g3plc_boot_retries(void)
+{
+  return g3plc_boot_retries(&g3plc_ctx);
+}
+
+int hybrid_lora_resumed(void)
 {
-  return g3plc_uart_putc(c);
+  return loramac_resumed(&lora_radios[0].mac);
 }
@@ -31,10 +31,222 @@
 
 #include <stdint.h>
 
+#include "duty.h"
+
+struct loramac_state; /* see lora/loramac.h */
+
 #define HYBRID_MAJOR 1
-#define HYBRID_MINOR 4
+#define HYBRID_MINOR 12
+
+/* We accept as much as G3-PLC can carry in one frame.
+   On LoRa each message is fragmented in as many frames
+   as necessary (see frag.h). Since 1.5 every LoRa frame
+   carries a fragment header, even for short messages. */
+#define HYBRID_MAX_PAYLOAD (G3PLC_MAX_PAYLOAD)
+
+/* With HYBRID_DEDUP (implied by HYBRID_RACE and HYBRID_DIVERSITY)
+   each message starts with a sequence number of its origin, the
+   same on both media whether it was raced or sent again after a
+   fallback:
+     [seqno (8)]<message...>
+   The receiver remembers the last HYBRID_DEDUP_WINDOW sequence
+   numbers of each origin and drops the copies. The state of an
+   origin expires after HYBRID_DEDUP_EXPIRY so that its restart
+   with another initial sequence number is not mistaken for
+   copies. Origins share a table of HYBRID_DEDUP_PEERS slots in sets
+   of HYBRID_DEDUP_WAYS, an origin takes the slot of the one least
+   recently heard in its set only when the set is full. */
+#define HYBRID_SEQ_HDR_SIZE  1
+#define HYBRID_DEDUP_PEERS   64
+#define HYBRID_DEDUP_WAYS    4
+#define HYBRID_DEDUP_WINDOW  32
+#define HYBRID_DEDUP_EXPIRY  60000000UL /* 1 minute */
+
+/* A gateway may drive other LoRa modules besides the main one, each
+   on its own UART and configured out of band on its own channel.
+   Each module has its own LoRaMAC instance with the settings of the
+   main one and serves the nodes listed here: the unicasts to them go
+   through it, the other ones through the main module and broadcasts
+   through every module. What the modules receive goes up as from a
+   single LoRa interface, so the platform feeds their UART from the
+   thread that feeds the main one (see hybrid_lora_module_uart_putc()).
+   The functions are those of the main module in hybrid_config and
+   receive the data pointer of the module. */
+#define HYBRID_MAX_LORA_MODULES 7
+
+struct hybrid_lora_module {
+  const uint16_t *nodes; /* nodes served by the module */
+  unsigned int    count;
+
+  int  (*uart_send)(const void *buf, unsigned int size, void *data);
+  void (*start_timer)(unsigned int us, void *data);
+  void (*stop_timer)(void *data);
+  void (*wait_timer)(void *data);
+  void (*lock)(void *data);
+  void (*unlock)(void *data);
+
+  void *data;
+};
+
+/* With HYBRID_DIVERSITY (implies HYBRID_DEDUP) the receiver keeps
+   the best copy of a message heard on both media. A copy that
+   failed its checks (passed up with HYBRID_INVALID) is dropped when
+   a good copy from the same origin came on either medium in the
+   last diversity_us. Otherwise it is held for diversity_us, a good
+   copy meanwhile takes its place, and delivered once the window is
+   over. Good copies are all the same, the first one is delivered
+   at once and every copy refreshes the link of its medium to the
+   origin (see hybrid_probe()), so a copy dropped as such still
+   proves its medium. At most HYBRID_DIVERSITY_HOLDS copies
+   are held, the others are delivered at once. */
+#define HYBRID_DIVERSITY_WINDOW 200000 /* us, default diversity_us */
+#define HYBRID_DIVERSITY_HOLDS  4
+
+/* With HYBRID_ORDER (implies HYBRID_DEDUP) each message starts with
+   an order header after the sequence number of HYBRID_DEDUP:
+     [order (8)]<message...>
+   The order numbers run from 1 to 255 for each destination, the
+   broadcasts have their own, so that a receiver does not see the
+   messages sent to others as gaps. The first message of a destination
+   is numbered 0 and starts its numbers over, as does a receiver that
+   has not heard from the origin for HYBRID_DEDUP_EXPIRY. The receiver
+   hands on the messages of each origin in order. A message ahead of
+   the next one is held for order_us, up to HYBRID_ORDER_WINDOW ahead,
+   and the missing ones are skipped once it waited that long. A
+   message up to 127 behind the next one is a late copy or came after
+   it was skipped and is dropped, one further ahead than the window
+   starts the numbers over.
+   At most HYBRID_ORDER_HOLDS messages are held, the oldest one is
+   handed on when they are all taken. The origins share a table of
+   HYBRID_ORDER_PEERS slots on each side. All nodes must use the
+   flag. */
+#define HYBRID_ORDER_HDR_SIZE 1
+#define HYBRID_ORDER_WAIT     1000000 /* us, default order_us */
+#define HYBRID_ORDER_WINDOW   32
+#define HYBRID_ORDER_HOLDS    16
+#define HYBRID_ORDER_PEERS    64
+
+/* With HYBRID_BALANCE the bulk bytes are split between the
+   media by the share of LoRa (see lora.share). The share never
+   goes below HYBRID_SHARE_MIN permille for either medium so
+   that both keep being measured. The split follows the last
+   HYBRID_BALANCE_SPAN bytes or so. */
+#define HYBRID_SHARE_MIN    20
+#define HYBRID_BALANCE_SPAN (1UL << 20)
 
-#define HYBRID_MAX_PAYLOAD LORAMAC_MAX_PAYLOAD
+/* With HYBRID_ROUTE each message starts with a route header
+   before the sequence number of HYBRID_DEDUP:
+     [dst (16)][origin (16)][hops (8)]<message...>
+   The frames go from hop to hop, each node forwards the messages
+   to other destinations to the next hop of its route table (see
+   hybrid_route) and the destination delivers them as coming from
+   their origin. The hops are counted so that a message caught in
+   a routing loop is dropped after HYBRID_MAX_HOPS. Broadcasts are
+   not forwarded. All nodes must use the flag. */
+#define HYBRID_ROUTE_HDR_SIZE 5
+#define HYBRID_MAX_HOPS       8
+
+/* With HYBRID_CACHE the sends that leave the choice of the medium
+   to the driver remember each destination. They start on LoRa when
+   G3-PLC did not deliver to it within HYBRID_CACHE_EXPIRY or, with
+   a deadline, when G3-PLC took longer than the time left the last
+   time it delivered. When both media failed the last medium that
+   delivered goes first. The other medium is still used as a
+   fallback. The HYBRID_CACHE_PEERS most recently used destinations
+   are kept. */
+#define HYBRID_CACHE_PEERS  32
+#define HYBRID_CACHE_EXPIRY 60000000UL /* 1 minute */
+
+/* A G3-PLC frame that did not get the channel (G3PLC_SND_ACCESS)
+   is sent again on G3-PLC after a random backoff, within the access
+   budget (see g3plc_opt), before falling back to LoRa. The backoff
+   is drawn up to a window of HYBRID_ACCESS_BACKOFF that doubles on
+   each attempt up to HYBRID_ACCESS_BACKOFF_MAX. */
+#define HYBRID_ACCESS_BACKOFF     10000UL /* 10 ms */
+#define HYBRID_ACCESS_BACKOFF_MAX 160000UL
+
+/* With HYBRID_TUNE the G3-PLC confirms are counted over windows of
+   HYBRID_TUNE_WINDOW frames. A window with HYBRID_TUNE_NOISY percent
+   of NOACK or more adds a retransmission, the modem then gets noisy
+   frames through, and a window without NOACK removes one so that a
+   destination that is gone fails over to LoRa sooner. The number
+   stays within retrans_min and retrans_max (see g3plc_opt). */
+#define HYBRID_TUNE_WINDOW 32
+#define HYBRID_TUNE_NOISY  20
+
+/* With HYBRID_TRANSPORT each message starts with a transport
+   header after the sequence number of HYBRID_DEDUP:
+     [type (8)]<message...>
+   Unicast messages longer than HYBRID_SEGMENT_SIZE are split in
+   segments of that size, up to HYBRID_MAX_SEGMENTS, each sent as a
+   message of its own:
+     [type (8)][transfer (8)][index (8)][count (8)]<segment...>
+   The sender keeps up to HYBRID_TRANSPORT_WINDOW segments without
+   an end-to-end acknowledgement in flight and polls the receiver
+   with the last one (HYBRID_XPORT_POLL in the type). The receiver
+   answers with the segments it has:
+     [type (8)][transfer (8)][cumulative (8)][sack (8)]
+   where cumulative is the number of segments received in order and
+   bit i of sack is set when segment cumulative + 1 + i was received.
+   The sender only sends the missing segments again. When a segment
+   cannot be sent or the answer does not come within
+   HYBRID_TRANSPORT_TIMEOUT the transfer resumes on the other medium
+   from there, and gives up after HYBRID_TRANSPORT_RETRIES rounds in a
+   row without progress. The receiver reassembles the transfers of
+   HYBRID_TRANSPORT_PEERS origins at once, a transfer expires after
+   HYBRID_TRANSPORT_EXPIRY. All nodes must use the flag. */
+#define HYBRID_XPORT_HDR_SIZE    1
+#define HYBRID_SEGMENT_HDR_SIZE  4
+#define HYBRID_XPORT_ACK_SIZE    4
+#define HYBRID_SEGMENT_SIZE      128
+#define HYBRID_MAX_SEGMENTS      8
+#define HYBRID_TRANSPORT_WINDOW  4
+#define HYBRID_TRANSPORT_RETRIES 4
+#define HYBRID_TRANSPORT_PEERS   8
+#define HYBRID_TRANSPORT_TIMEOUT 5000000UL  /* 5 seconds */
+#define HYBRID_TRANSPORT_EXPIRY  60000000UL /* 1 minute */
+#define HYBRID_TRANSPORT_POLL    5000UL     /* 5 ms between checks for the answer */
+enum hybrid_xport_type {
+  HYBRID_XPORT_PLAIN,   /* whole message */
+  HYBRID_XPORT_SEGMENT, /* segment of a transfer */
+  HYBRID_XPORT_ACK,     /* segments received so far */
+  HYBRID_XPORT_POLL = 0x80 /* answer requested (segments only) */
+};
+
+/* Size of the per-destination link statistics table
+   used to select the medium (see HYBRID_ADAPTIVE). */
+#define HYBRID_LINK_PEERS 64
+
+/* Time on air of the frames sent, retransmissions included (see
+   hybrid_airtime()). LoRa frames are timed from the radio settings
+   (see duty_airtime()). A G3-PLC frame is estimated from the band
+   plan and from the modulation and tonemap last estimated on the
+   destination, robust on all the carriers until then: the preamble,
+   the frame control header, then the MAC header and the Reed-Solomon
+   parity (HYBRID_PLC_OVERHEAD bytes) with the payload, coded at half
+   rate and repeated four times in robust mode. The modem does not
+   report its retransmissions, a frame is charged once when it is
+   acknowledged and for all the retransmissions when it is not, not
+   at all when the channel was busy. */
+#define HYBRID_PLC_OVERHEAD 32
+
+/* Percent of the LoRa duty cycle budget that must be left
+   for a keepalive to go on LoRa (see hybrid_probe()). */
+#define HYBRID_PROBE_RESERVE 50
+
+/* G3-PLC frames may carry the extended address of a device instead
+   of its short one, the device may not have a short address yet
+   (HYBRID_NO_SHORT). Such a message is delivered from HYBRID_NO_SHORT
+   unless the short address of its origin is known, the extended one
+   is in the meta data either way. The short address of an extended
+   one is learned from the messages that carry both, those sent in
+   extended mode with a route header straight from their origin (see
+   HYBRID_ROUTE). The cache keeps HYBRID_EXT_PEERS addresses in a
+   hash table, an address is looked for in HYBRID_EXT_PROBES slots
+   from its own and replaces the one used least recently there. */
+#define HYBRID_NO_SHORT   0xfffe
+#define HYBRID_EXT_PEERS  64
+#define HYBRID_EXT_PROBES 4
 
 /* Specifies that an error happened in one of the
    child layers. The child layer error is written
@@ -45,6 +257,16 @@
 #define HYBRID_ERR_LORA  0x1000
 #define HYBRID_ERR_G3PLC 0x1001
 
+/* Status of a sent frame/command */
+enum hybrid_send_status {
+  HYBRID_SND_SUCCESS,
+  HYBRID_SND_TOOLONG,       /* payload too long */
+  HYBRID_SND_NOACK,         /* maximum number of retransmissions reached */
+  HYBRID_SND_OOM,           /* cannot allocate frame */
+  HYBRID_SND_DUTY,          /* LoRa duty cycle exhausted */
+  HYBRID_SND_EXPIRED,       /* deadline passed or cannot be met by the fallback */
+};
+
 /* When one of the child layers result in an error,
    this error is reported in one of the two variables.
    The error code returned by the hybrid layer specifies
@@ -53,8 +275,98 @@ extern int lora_errno;
 extern int g3plc_errno;
 
 enum hybrid_flags {
-  HYBRID_INVALID = 0x1, /* do not filter invalid packets (packet header, CRC) */
-  HYBRID_NOACK   = 0x2, /* enable ACK communications */
+  HYBRID_INVALID  = 0x1, /* do not filter invalid packets (packet header, CRC) */
+  HYBRID_NOACK    = 0x2, /* enable ACK communications */
+  HYBRID_RACE     = 0x4, /* send on both media at once, first success wins */
+  HYBRID_ADAPTIVE = 0x8, /* try the medium most likely to succeed first */
+  HYBRID_COMPRESS = 0x10, /* compress LoRa messages when they shrink */
+  HYBRID_DUTY     = 0x20, /* keep LoRa within its duty cycle, use G3-PLC instead */
+  HYBRID_DEDUP    = 0x40, /* number messages and drop their copies from either medium */
+  HYBRID_BALANCE  = 0x80, /* split bulk traffic across both media (see hybrid_balance()) */
+  HYBRID_ROUTE    = 0x100, /* forward messages to other nodes along routes (see hybrid_route) */
+  HYBRID_CACHE    = 0x200, /* start on the medium that last delivered to the destination */
+  HYBRID_TUNE     = 0x400, /* tune the G3-PLC retransmissions to the NOACK rate */
+  HYBRID_TRANSPORT = 0x800, /* segment long messages with end-to-end ACK (see HYBRID_SEGMENT_SIZE) */
+  HYBRID_DELTA    = 0x1000, /* send LoRa messages as deltas of the previous one (see HYBRID_CODEC_DELTA) */
+  HYBRID_DIVERSITY = 0x2000, /* prefer a good copy from either medium to a damaged one */
+  HYBRID_ORDER    = 0x4000, /* hand on the messages of each origin in order (see HYBRID_ORDER_WAIT) */
+};
+
+/* With HYBRID_COMPRESS or HYBRID_DELTA each LoRa message, before
+   fragmentation, starts with a compression header (see hybrid_codec):
+     [codec (8)]<message...> */
+#define HYBRID_CODEC_HDR_SIZE sizeof(uint8_t)
+enum hybrid_codec {
+  HYBRID_CODEC_NONE,     /* the message did not shrink */
+  HYBRID_CODEC_COMPRESS, /* compressed with the compress function */
+  HYBRID_CODEC_DELTA     /* delta of the reference (see HYBRID_DELTA_MAX) */
+};
+
+/* With HYBRID_DELTA the last unicast message acknowledged by each
+   destination on LoRa, up to HYBRID_DELTA_MAX bytes, is the reference
+   of the next one on both ends. A message is then sent as its
+   difference to the reference when that is the smallest encoding:
+     [codec (8)][check (16)]{[copy (8)][count (8)]<count bytes...>}...
+   where each run copies the next bytes from the reference then
+   appends count bytes of the message. The check of the reference
+   lets the receiver refuse a delta of another reference than its own
+   before the ACK of its first fragment, so that the message is not
+   acknowledged. The sender drops its reference when a message was not
+   acknowledged, or when several went to the destination at once, and
+   sends a full message every resync deltas (see lora_opt) so that a
+   receiver that lost its reference without ACK gets a new one. The
+   sender has HYBRID_DELTA_PEERS slots by destination, the receiver
+   keeps the references of the HYBRID_DELTA_PEERS last origins. All
+   nodes must use the flag. */
+#define HYBRID_DELTA_HDR_SIZE 2
+#define HYBRID_DELTA_MAX      128
+#define HYBRID_DELTA_PEERS    64
+#define HYBRID_DELTA_RESYNC   16
+
+/* Compression statistics (see hybrid_codec_stats()) */
+struct hybrid_codec_stats {
+  unsigned long messages;      /* messages sent on LoRa */
+  unsigned long compressed;    /* messages sent compressed */
+  unsigned long bytes_in;      /* bytes before compression */
+  unsigned long bytes_out;     /* bytes sent (with the header) */
+  unsigned long compress_us;   /* time spent compressing */
+  unsigned long decompress_us; /* time spent decompressing */
+  unsigned long deltas;        /* messages sent as deltas (see HYBRID_DELTA) */
+  unsigned long delta_misses;  /* deltas received without their reference */
+};
+
+/* Frame counters (see hybrid_counters()) */
+struct hybrid_counters {
+  unsigned long tx_g3plc;  /* frames sent on G3-PLC */
+  unsigned long tx_lora;   /* messages sent on LoRa */
+  unsigned long fallbacks; /* frames sent again on the other medium */
+  unsigned long rx_g3plc;  /* frames received from G3-PLC */
+  unsigned long rx_lora;   /* messages received from LoRa */
+  unsigned long rx_dups;   /* copies dropped (see HYBRID_DEDUP) */
+  unsigned long rx_replaced; /* damaged copies replaced by a good one (see HYBRID_DIVERSITY) */
+  unsigned long g3plc_downs; /* G3-PLC declared down (see breaker in g3plc_opt) */
+  unsigned long g3plc_starved; /* confirm timeouts blamed on the UART (see g3plc_lost) */
+  unsigned long forwarded;     /* messages forwarded to their next hop (see HYBRID_ROUTE) */
+  unsigned long fwd_drops;     /* messages to forward dropped (hop limit, no forward function) */
+  unsigned long cache_lora;    /* sends started on LoRa instead of G3-PLC (see HYBRID_CACHE) */
+  unsigned long access_retries; /* G3-PLC frames sent again after a busy channel */
+  unsigned long retrans_tunes;  /* changes of the G3-PLC retransmissions (see HYBRID_TUNE) */
+  unsigned long g3plc_retrans;  /* current G3-PLC retransmissions, not a counter */
+  unsigned long tx_segments;    /* segments sent (see HYBRID_TRANSPORT) */
+  unsigned long seg_resent;     /* segments sent again after a loss */
+  unsigned long seg_switches;   /* transfers resumed on the other medium */
+  unsigned long rx_segments;    /* segments received */
+  unsigned long rx_transfers;   /* transfers reassembled and delivered */
+  unsigned long tx_probes;      /* keepalives sent (see hybrid_probe()) */
+  unsigned long rx_probes;      /* keepalives received */
+  unsigned long airtime[2];     /* us on air on each medium (see hybrid_airtime()) */
+  unsigned long rx_held;        /* messages held for their predecessors (see HYBRID_ORDER) */
+  unsigned long rx_skipped;     /* missing messages skipped after the hold time */
+  unsigned long rx_late;        /* messages dropped as late copies or after being skipped */
+  unsigned long order_depth;    /* messages held now, not a counter */
+  unsigned long order_depth_max; /* most messages held at once */
+  unsigned long order_hold_us;  /* total time the messages were held */
+  unsigned long order_hold_max_us; /* longest time a message was held */
 };
 
 enum hybrid_source {
@@ -62,6 +374,82 @@ enum hybrid_source {
   HYBRID_SOURCE_G3PLC, /* packet received from G3PLC */
 };
 
+/* Sequence numbers received from an origin (see HYBRID_DEDUP),
+   the bit i of seen is set when last - i was received. */
+struct hybrid_dedup {
+  uint16_t src;
+  uint8_t  last;
+  uint32_t seen;
+};
+
+/* Time on air charged to a destination (see hybrid_airtime()). */
+struct hybrid_airtime {
+  uint16_t      addr;
+  unsigned long us[2]; /* on each medium (see hybrid_source) */
+};
+
+/* What the path to a destination can carry (see hybrid_path()).
+   The sizes are of the application payload. */
+struct hybrid_path {
+  int           medium;     /* tried first (see hybrid_source), -1 when none can send */
+  uint16_t      next_hop;   /* the destination itself unless routed (see HYBRID_ROUTE) */
+  unsigned int  max_message; /* largest message, segmented or not */
+  unsigned int  frame[2];   /* largest message in a single frame of each medium */
+  unsigned long goodput[2]; /* bytes per second on each medium */
+  long          lora_budget; /* see hybrid_lora_budget() */
+};
+
+/* Link metadata of a received message. The fields that the
+   medium does not provide are left to zero. */
+struct hybrid_meta {
+  int           source;     /* medium (see hybrid_source) */
+  unsigned long stamp;      /* clock() when the message was complete */
+  uint8_t       lqi;        /* link quality (G3-PLC only) */
+  uint8_t       seqno;      /* MAC sequence number (G3-PLC only) */
+  uint8_t       modulation; /* estimated modulation (G3-PLC only) */
+  uint32_t      symbols;    /* modem symbol time (G3-PLC only) */
+  uint32_t      tonemap;    /* estimated tonemap (G3-PLC only) */
+  uint8_t       hops;       /* nodes that forwarded the message (see HYBRID_ROUTE) */
+  uint64_t      src_ext;    /* extended address of the sender, 0 for its short one (G3-PLC only) */
+};
+
+/* Received message of a batch (see cb_recv_batch). */
+struct hybrid_frame {
+  uint16_t           src;
+  uint16_t           dst;
+  int                status;
+  struct hybrid_meta meta; /* medium, timestamp and link */
+  const void        *payload;
+  unsigned int       size;
+};
+
+/* Largest number of messages in a batch (see cb_recv_batch). */
+#define HYBRID_MAX_BATCH 32
+
+/* Route to a destination that is not a neighbour (see HYBRID_ROUTE).
+   Messages to dst go through next_hop, on this medium first (see
+   hybrid_source) or on the medium chosen as for any frame when
+   negative. A destination may have several routes, the next hop
+   with the best link score then carries the message. The scores
+   are updated by each message sent through a route, so a next
+   hop that stops delivering hands over to the other routes. */
+struct hybrid_route {
+  uint16_t dst;
+  uint16_t next_hop;
+  int      medium;
+};
+
+/* Steps of a message being sent (see trace in hybrid_config). The
+   first ones are those of each frame on a medium, with the argument
+   of the MAC layer (see g3plc_trace and loramac_trace). */
+enum hybrid_trace {
+  HYBRID_TRACE_G3PLC_REQUEST, /* arg is the payload size */
+  HYBRID_TRACE_G3PLC_CONFIRM, /* arg is the MAC status or -1 on timeout */
+  HYBRID_TRACE_LORA_ATTEMPT,  /* arg is the retransmission */
+  HYBRID_TRACE_LORA_ACK,      /* arg is whether the ACK came */
+  HYBRID_TRACE_FALLBACK       /* sent again, arg is the other medium (see hybrid_source) */
+};
+
 struct hybrid_config {
   /* The driver will call cb_recv() when a frame has been
      received (frames may be filtered according to the
@@ -74,12 +462,36 @@ struct hybrid_config {
                   const void *payload, unsigned int payload_size,
                   int status, int source, void *data);
 
-    /* The driver will use those functions to start, stop and wait
+  /* Same as cb_recv() with the link metadata of the message.
+     When defined this is called instead of cb_recv(). */
+  void (*cb_recv_meta)(uint16_t src, uint16_t dst,
+                       const void *payload, unsigned int payload_size,
+                       int status, const struct hybrid_meta *meta, void *data);
+
+  /* When defined this is called instead of both with the messages
+     received since the previous call, so that the consumer pays
+     its I/O and locking once per burst. A batch is delivered once
+     it has batch_frames messages (HYBRID_MAX_BATCH when zero or
+     larger) or once its first message is batch_us old. The age
+     is checked on each message and by hybrid_recv_flush(), which
+     the platform calls when it is done reading the UART and
+     periodically. The payloads are copied in the batch and are
+     only valid during the call. Batches are delivered one at a
+     time, the callback must not call hybrid_recv_flush(). */
+  void (*cb_recv_batch)(const struct hybrid_frame *frames, unsigned int count, void *data);
+  unsigned int batch_frames;
+  unsigned int batch_us;
+
+  /* The driver will use those functions to start, stop and wait
      for timers. The stop function should also drop any wait in
-     place on the timer. */
-  void (*start_timer)(unsigned int us);
-  void (*stop_timer)(void);
-  void (*wait_timer)(void);
+     place on the timer. Each medium has its own timer so that
+     a wait on one of them does not hold up the other. */
+  void (*lora_start_timer)(unsigned int us);
+  void (*lora_stop_timer)(void);
+  void (*lora_wait_timer)(void);
+  void (*g3plc_start_timer)(unsigned int us);
+  void (*g3plc_stop_timer)(void);
+  void (*g3plc_wait_timer)(void);
 
   /* The driver will use the uart_send() function to write
      the resulting frame on the device's UART. This
@@ -94,16 +506,21 @@ struct hybrid_config {
      error or 0 on success. */
   int (*uart_g3plc_read)(void *buf, unsigned int size);
 
-  /* We only send one packet at a time. We are forced to do
-     this unless we can start multiple referenced timers
-     within the same period. So until then we lock/unlock
-     the send function to ensure this behavior. We also lock
-     the receive function that also uses the timer to send
-     its ACK in response to the received packet. Note that
-     we use the same lock for sending and receiving since we
-     don't generally send and receive at the same time. */
-  void (*lock)(void);
-  void (*unlock)(void);
+  /* The LoRa MAC layer only sends one packet at a time.
+     It locks the send function and the receive function
+     that uses its timer to send the ACK in response to
+     the received packet. This lock is only used by LoRa
+     so that G3-PLC may transmit at the same time. */
+  void (*lora_lock)(void);
+  void (*lora_unlock)(void);
+
+  /* The G3-PLC layer builds each request in a single command
+     buffer and waits for one confirm at a time. This lock
+     serializes the frames of the threads that send on G3-PLC
+     (the mode, the race and fanout threads, the forwarding
+     and the probes) and the configuration of the modem. */
+  void (*g3plc_lock)(void);
+  void (*g3plc_unlock)(void);
 
   /* Change UART speed.
      This take an integer (not a speed_t type).
@@ -120,13 +537,23 @@ struct hybrid_config {
      a complete frame has been received. Control is then
      transferred to this function which can either directly
      be hybrid_recv_frame() or use semaphores to defer
-     outside of the interrupt context. */
+     outside of the interrupt context. On a MCU, the
+     interrupt handler can rather only enqueue the bytes
+     in an isr_ring, one per UART, for a task to feed them
+     to *_uart_putc() (see common/isr-ring.h). */
   int (*lora_recv_frame)(void);
   int (*g3plc_recv_frame)(void);
 
-  /* Clear/set the reset pin. */
+  /* Other LoRa modules (see hybrid_lora_module), the array
+     must stay valid. May be NULL when lora_module_count is 0. */
+  const struct hybrid_lora_module *lora_modules;
+  unsigned int lora_module_count;
+
+  /* Clear/set the reset pin. The pin is held low for
+     reset_pulse us (G3PLC_RESET_PULSE when 0). */
   void (*reset_clear)(void);
   void (*reset_set)(void);
+  unsigned int reset_pulse;
 
   /* Not all platform provide byte ordering functions
      with the same names as POSIX. */
@@ -138,11 +565,84 @@ struct hybrid_config {
   /* Microseconds sleep. */
   void (*usleep)(unsigned long us);
 
+  /* Monotonic clock in microseconds. This is used to expire
+     the LoRa messages which are not completely received.
+     The clock may wrap around. */
+  unsigned long (*clock)(void);
+
+  /* Compression stage of the LoRa path (see HYBRID_COMPRESS).
+     The compress function returns the size of the compressed
+     message or 0 when it would exceed max bytes. The decompress
+     function returns the size of the original message or a
+     negative value when it is invalid. */
+  unsigned int (*compress)(const void *in, unsigned int size, void *out, unsigned int max);
+  int (*decompress)(const void *in, unsigned int size, void *out, unsigned int max);
+
+  /* Run both send functions concurrently (see HYBRID_RACE).
+     This should return zero as soon as one of them returned
+     zero or, when both failed, the status of the second one.
+     The done function must be called once both returned. */
+  int (*race)(int (*a)(void *), int (*b)(void *),
+              void (*done)(void *), void *data);
+
   /* Signal progress in the G3-PLC boot sequence. */
   void (*g3plc_boot_start)(void);
   void (*g3plc_boot_progress)(void);
   void (*g3plc_boot_end)(void);
 
+  /* Called when G3-PLC is declared down after breaker consecutive
+     confirm timeouts (see g3plc_opt). The platform should restart
+     the modem with hybrid_g3plc_start() outside of the send path,
+     LoRa carries the traffic meanwhile. May be NULL. */
+  void (*g3plc_recover)(void *data);
+
+  /* Bytes lost or damaged so far on the G3-PLC UART. A confirm
+     timeout during which this grew is blamed on the host and
+     does not count toward the breaker. May be NULL. */
+  unsigned long (*g3plc_lost)(void);
+
+  /* Called in the thread that sent a frame with its time on air
+     in us, retransmissions included (see HYBRID_PLC_OVERHEAD),
+     so that the platform bills it to the sender. The race and the
+     fanout run in the threads of the race function. May be NULL. */
+  void (*charge)(int medium, uint16_t dst, unsigned long airtime, void *data);
+
+  /* Called at each step of a message being sent (see hybrid_trace)
+     in the thread that takes it, which includes the threads of the
+     race function, so that the platform may follow one message
+     through both MAC layers. May be NULL. */
+  void (*trace)(int event, int arg, void *data);
+
+  /* Route table (see HYBRID_ROUTE), the destinations without a
+     route are neighbours. The forward function queues a message
+     to another destination received with its route header, the
+     platform then passes it to hybrid_forward() from another
+     thread since the receive path cannot send. This way the
+     application never sees the messages it relays. Without the
+     function those messages are dropped. */
+  const struct hybrid_route *routes;
+  unsigned int               route_count;
+  void (*forward)(const void *msg, unsigned int size, void *data);
+
+  /* The reply function queues the answer of the receive path to a
+     segment (see HYBRID_TRANSPORT), the platform then passes it to
+     hybrid_reply() from another thread. The transport requires it. */
+  void (*reply)(uint16_t dst, const void *msg, unsigned int size, void *data);
+
+  /* The accept function is called with each complete message
+     before it is delivered, a zero return drops it (e.g. a copy
+     already delivered by another gateway). This may be NULL. */
+  int (*accept)(uint16_t src, const void *payload, unsigned int size,
+                int status, const struct hybrid_meta *meta, void *data);
+
+  /* Time in us a damaged copy waits for a good one with
+     HYBRID_DIVERSITY (HYBRID_DIVERSITY_WINDOW when zero). */
+  unsigned int diversity_us;
+
+  /* Time in us a message waits for the ones before it with
+     HYBRID_ORDER (HYBRID_ORDER_WAIT when zero). */
+  unsigned int order_us;
+
   /* LoRaMAC options */
   struct lora_opt {
     /* Initial sequence number.
@@ -151,9 +651,31 @@ struct hybrid_config {
        ACK e  nabled do not result in frames being filtered
        as retran  smissions by the receiver (see ACK FIFO). */
     uint8_t seqno;
+
+    /* LoRaMAC state to resume from, the sequence number above
+       is only used when it is new (see loramac_state). May be
+       NULL. */
+    struct loramac_state *state;
+
     unsigned int  retrans; /* maximum number of retransmissions */
     unsigned int  timeout; /* ACK timeout in us */
     unsigned int  sifs;    /* Short Inter Frame Spacing time in us */
+
+    /* Duty cycle of the LoRa channel (see HYBRID_DUTY).
+       Each fragment is charged for the time on air of all its
+       transmissions. When the budget of the sub-band cannot
+       afford a message it goes through G3-PLC alone. */
+    struct duty_radio radio;
+    unsigned long frequency; /* channel frequency in Hz */
+
+    /* Share of the bulk bytes sent on LoRa in permille (see
+       HYBRID_BALANCE). Zero follows the throughput measured
+       on each medium. */
+    unsigned int share;
+
+    /* Deltas sent between full messages (see HYBRID_DELTA),
+       zero is HYBRID_DELTA_RESYNC. */
+    unsigned int resync;
   } lora;
 
   /* G3-PLC options */
@@ -162,11 +684,15 @@ struct hybrid_config {
     uint16_t pan_id;      /* PAN ID */
     uint64_t ext_address; /* extended 64-bit address */
     unsigned int retrans; /* maximum number of retransmissions */
+    unsigned int retrans_min; /* bounds of the retransmissions (see HYBRID_TUNE) */
+    unsigned int retrans_max;
     unsigned int timeout; /* request timeout in us */
+    unsigned int breaker; /* confirm timeouts in a row before G3-PLC is down (0 disables) */
+    unsigned int access_budget; /* time in us to retry a busy channel (0 disables) */
   } g3plc;
 
   unsigned long flags;   /* (see hybrid_flags) */
-  uint16_t mac_address;  /* device short MAC address */
+  uint16_t mac_address;  /* device short MAC address (HYBRID_NO_SHORT for none) */
   void *data;            /* context data passed to user callbacks */
 };
 
@@ -174,6 +700,28 @@ struct hybrid_config {
    Return 0 on success, for other errror codes see hybrid_init_status. */
 int hybrid_init(const struct hybrid_config *conf);
 
+/* Apply the tunables of a new configuration to the running driver:
+   the LoRa SIFS and ACK timeout (see loramac_set_timing()) and the
+   deltas between full messages (see HYBRID_DELTA). The other fields
+   are ignored. Nothing changes when LoRaMAC refuses the new timing.
+   The expiry of the fragments keeps the value of the initialization,
+   so that it still covers senders with the former timeout.
+   Return 0 on success or HYBRID_ERR_LORA (see lora_errno). */
+int hybrid_reconfigure(const struct hybrid_config *conf);
+
+/* Boot and start the G3-PLC modem. This takes the whole firmware
+   upload so hybrid_init() only brings LoRa up and this may be called
+   from another thread. Until it succeeds, hybrid_send() only uses
+   LoRa. The G3-PLC UART must not be fed to the receive path before
+   this returns since the boot sequence reads it. This is called
+   again with the same configuration to restart a modem that was
+   declared down (see g3plc_recover).
+   Return 0 on success or HYBRID_ERR_G3PLC (see g3plc_errno). */
+int hybrid_g3plc_start(void);
+
+/* True once hybrid_g3plc_start() succeeded. */
+int hybrid_g3plc_ready(void);
+
 /* Assemble and send a frame to the specified destination using HYBRID.
    When ACK is enabled, this function will block until the packet has
    been successfully transmitted. For the error see hybrid_send_status.
@@ -181,6 +729,150 @@ int hybrid_init(const struct hybrid_config *conf);
    transmissions necessary to succesfully send the packet. */
 int hybrid_send(uint16_t dst, const void *payload, unsigned int payload_size);
 
+/* Same as hybrid_send() but try this medium (see hybrid_source)
+   first, even when racing or with HYBRID_ADAPTIVE. The other
+   medium is still used as a fallback. */
+int hybrid_send_medium(int medium, uint16_t dst, const void *payload, unsigned int payload_size);
+
+/* Same as hybrid_send_medium(), or hybrid_send() when the medium is
+   negative, but give up with HYBRID_SND_EXPIRED once the deadline
+   passed (see clock in hybrid_config). LoRa stops retransmitting
+   at the deadline, G3-PLC retransmits on its own so the frame is
+   only dropped before it is handed to the modem. The fallback is
+   skipped when the other medium cannot deliver the frame in time
+   at its measured throughput. A null deadline never expires.
+   With HYBRID_TRANSPORT a long message is segmented and this blocks
+   until the destination acknowledged all of them. */
+int hybrid_send_until(int medium, uint16_t dst, const void *payload, unsigned int payload_size,
+                      unsigned long deadline);
+
+/* Same as hybrid_send_until() but only on this medium, without the
+   fallback, for the traffic that must stay on one medium. This is
+   HYBRID_SND_NOACK while G3-PLC is not ready and HYBRID_SND_DUTY
+   when LoRa cannot afford the frame. */
+int hybrid_send_only(int medium, uint16_t dst, const void *payload, unsigned int payload_size,
+                     unsigned long deadline);
+
+/* A piece of a message (see hybrid_sendv()). */
+struct hybrid_seg {
+  const void  *base;
+  unsigned int size;
+};
+
+/* Largest number of segments of a message. */
+#define HYBRID_MAX_SEGS 8
+
+/* Same as hybrid_send() and hybrid_send_until() for a message made
+   of count segments one after the other, e.g. a fixed header and a
+   body. The headers of the hybrid layer are added as segments of
+   their own and the MAC layers copy the segments straight in their
+   frames, so the message is never assembled in between. Compression
+   and HYBRID_RACE still need the whole message and assemble it once.
+   More than HYBRID_MAX_SEGS segments is HYBRID_SND_TOOLONG. */
+int hybrid_sendv(uint16_t dst, const struct hybrid_seg *segs, unsigned int count);
+int hybrid_sendv_until(int medium, uint16_t dst, const struct hybrid_seg *segs, unsigned int count,
+                       unsigned long deadline);
+
+/* Same as hybrid_send() and hybrid_sendv() to the extended address
+   of a destination (see HYBRID_EXT_PEERS). When its short address
+   is known the message goes as any other, otherwise it is sent on
+   G3-PLC only to the extended address, not segmented by the transport
+   nor forwarded, so the destination must be a G3-PLC neighbour. */
+int hybrid_send_ext(uint64_t dst, const void *payload, unsigned int payload_size);
+int hybrid_sendv_ext(uint64_t dst, const struct hybrid_seg *segs, unsigned int count);
+
+/* Send a message queued by the forward function (see HYBRID_ROUTE)
+   to the next hop of its destination. For the status see
+   hybrid_send_status. */
+int hybrid_forward(const void *msg, unsigned int size);
+
+/* Send a message queued by the reply function (see HYBRID_TRANSPORT)
+   back to its destination. For the status see hybrid_send_status. */
+int hybrid_reply(uint16_t dst, const void *msg, unsigned int size);
+
+/* Send the same message to count destinations, with a worker on
+   each medium so that G3-PLC and LoRa deliver it concurrently (see
+   race in hybrid_config). The message is numbered and its headers
+   are built once. The destinations that one medium could not
+   reach are tried again on the other one. The flags that choose
+   the medium (HYBRID_RACE, HYBRID_ADAPTIVE, HYBRID_CACHE) do not
+   apply. The status of each destination (see hybrid_send_status)
+   is written in the status array. Return the number of
+   destinations the message was delivered to. */
+int hybrid_send_many(const uint16_t *dsts, unsigned int count,
+                     const void *payload, unsigned int payload_size, int *status);
+
+/* Choose the medium of the next bulk message (see HYBRID_BALANCE).
+   Without the flag, when G3-PLC is not ready or when LoRa cannot
+   afford the message this is G3-PLC, the usual first medium. For
+   the bandwidths to add up the messages chosen for each medium
+   must be sent concurrently with hybrid_send_medium(). */
+int hybrid_balance(unsigned int payload_size);
+
+/* Copy the compression statistics (see HYBRID_COMPRESS).
+   The compression ratio is bytes_out over bytes_in. */
+void hybrid_codec_stats(struct hybrid_codec_stats *stats);
+
+/* Copy the frame counters. Raced frames are counted
+   on both media but never as a fallback. */
+void hybrid_counters(struct hybrid_counters *counters);
+
+/* Copy the time on air charged to each destination of the table of
+   link statistics (see HYBRID_LINK_PEERS), up to max of them. The
+   total of a destination restarts when another one takes its slot,
+   the counters keep the total of each medium. Return the number of
+   destinations copied. */
+unsigned int hybrid_airtime(struct hybrid_airtime *dsts, unsigned int max);
+
+/* Copy the sequence numbers received from each origin which has not
+   expired (see HYBRID_DEDUP), up to max of them, so that another
+   gateway can take over without delivering the copies again (see
+   hybrid_dedup_merge()). Return the number of origins copied. */
+unsigned int hybrid_dedup_export(struct hybrid_dedup *peers, unsigned int max);
+
+/* Add the sequence numbers received by another gateway from an
+   origin to those received here (see hybrid_dedup_export()). */
+void hybrid_dedup_merge(const struct hybrid_dedup *peer);
+
+/* Send a keepalive on the link of the table of link statistics
+   (see HYBRID_LINK_PEERS) which went the longest without any frame,
+   once it is at least age us old on its medium. Every frame sent
+   to a neighbour refreshes its link on that medium, so the real
+   traffic stands for the keepalives and only idle links are
+   probed. A keepalive is an empty message: the MAC layer
+   acknowledges it, the score and the medium cache take the outcome
+   as any other frame and the receiver drops it. G3-PLC is only
+   probed once ready and LoRa while HYBRID_PROBE_RESERVE percent of
+   its budget is left. The time the medium was busy in us (time on
+   air for LoRa) is written to busy so that the caller keeps the
+   keepalives within a share of the channel. Return the send status
+   or -1 when no link is stale, busy is then the time in us until
+   the next link turns stale or 0 when a stale link waits for its
+   medium. */
+int hybrid_probe(unsigned long age, unsigned long *busy);
+
+/* Time on air left in us in the LoRa duty cycle budget,
+   negative when overdrawn or LONG_MAX without HYBRID_DUTY. */
+long hybrid_lora_budget(void);
+
+/* Describe the path of the next message to a destination without
+   sending anything: the medium the flags would try first, the next
+   hop, the sizes that fit after the headers of the flags and the
+   goodput of each medium. The goodput is the throughput measured
+   on the medium (see hybrid_balance()) or until the first message
+   the time on air of a full frame, capped by the duty cycle on
+   LoRa (see HYBRID_DUTY). */
+void hybrid_path(uint16_t dst, struct hybrid_path *path);
+
+/* Deliver the partial batch once its first message is batch_us
+   old (see cb_recv_batch), the damaged copies held for longer
+   than diversity_us (see HYBRID_DIVERSITY) and the messages that
+   waited order_us for the ones before them (see HYBRID_ORDER).
+   This does nothing without any of them. Since it delivers as
+   the receive path does, it must be called from the thread that
+   feeds the UART. */
+void hybrid_recv_flush(void);
+
 /* Start the processing of a frame. Can be called either automatically
    when a complete frame has been received or manually from another thread. */
 int hybrid_lora_recv_frame(void);
@@ -189,10 +881,22 @@ int hybrid_g3plc_recv_frame(void);
 /* Called by the platform dependent part of the driver when a character
    has been received on UART from the device. This function can block
    when a full frame has been received. It may also block indefinitely
-   if the receive callback itself is blocked. Note that this function
+   if the receive callback itself is blocked (the Linux platform queues
+   received frames to avoid this, see main.c). Note that this function
    is *NOT* reentrant. You have to wait for its completion until you
    can call it again. */
 int hybrid_lora_uart_putc(unsigned char c);
 int hybrid_g3plc_uart_putc(unsigned char c);
 
+/* Same as hybrid_lora_uart_putc() for the module at this index
+   in lora_modules. */
+int hybrid_lora_module_uart_putc(unsigned int module, unsigned char c);
+
+/* Return non-zero when hybrid_init() resumed the LoRaMAC state
+   of a previous instance (see lora.state). */
+int hybrid_lora_resumed(void);
+
+/* Retries spent by the G3-PLC resets so far (see G3PLC_BOOT_RETRIES). */
+unsigned long hybrid_g3plc_boot_retries(void);
+
 #endif /* _HYBRID_H_ */
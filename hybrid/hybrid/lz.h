@@ -0,0 +1,67 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Lossless compression of small messages (LZSS). This is
+   platform independent, it's just standard ISO C. */
+
+#ifndef _LZ_H_
+#define _LZ_H_
+
+/*
+   Compressed format:
+     {[flags (8)]<item...8>...}
+
+   Each flag byte is followed by up to eight items, the low bit of
+   the flags for the first one. A clear bit is a literal byte and a
+   set bit a match on two bytes, in big endian:
+     [length - LZ_MIN_MATCH (4)][offset - 1 (12)]
+
+   The match copies length bytes starting offset bytes behind the
+   current position. The history before the first byte is the
+   static dictionary shared by both ends, so that even the first
+   message can reference the strings common to all our messages.
+*/
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (LZ_MIN_MATCH + 0xf)
+#define LZ_WINDOW    0x1000
+
+/* Only the end of a larger dictionary is reachable. */
+#define LZ_MAX_DICT  LZ_WINDOW
+
+struct lz_dict {
+  const unsigned char *buf;
+  unsigned int         size;
+};
+
+/* Compress size bytes from in into out. Return the compressed
+   size or 0 when it would be larger than max bytes. */
+unsigned int lz_compress(const struct lz_dict *dict, const void *in, unsigned int size,
+                         void *out, unsigned int max);
+
+/* Decompress size bytes from in into out. Return the original
+   size or -1 when the input is malformed or larger than max. */
+int lz_decompress(const struct lz_dict *dict, const void *in, unsigned int size,
+                  void *out, unsigned int max);
+
+#endif /* _LZ_H_ */
@@ -0,0 +1,483 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <err.h>
+
+#include "lora/loramac-str.h"
+#include "g3plc/g3plc-str.h"
+#include "hybrid/hybrid-str.h"
+#include "hybrid/hybrid.h"
+#include "weremac.h"
+#include "common.h"
+#include "ring.h"
+#include "recent.h"
+#include "ticker.h"
+#include "rpc.h"
+#include "timesync.h"
+#include "timer.h"
+#include "xatoi.h"
+#include "mode.h"
+#include "main.h"
+#include "help.h"
+
+/*
+  The library mode runs the driver of the hybrid programs in the
+  caller's process (see weremac.h). weremac_open() starts main()
+  from its own thread with the options of the configuration,
+  which returns from weremac_open() once this mode is started.
+
+  The output thread of the driver is the sender of the messages
+  queued with weremac_send_async(), the synchronous sends go
+  straight to the hybrid layer from the caller's thread. Received
+  messages are batched by the hybrid layer (see cb_recv_batch)
+  and only converted here, without another copy.
+
+  With the --recent option the last messages of each source are
+  also kept for weremac_last() (see recent.h).
+
+  With the --rpc option the requests and responses of weremac_call()
+  are queued as the asynchronous messages with their header in front
+  (see rpc.h) and the received ones are taken out of the batches
+  before cb_recv(). The timeouts of the calls run on a ticker thread.
+*/
+
+#define TX_RING_SIZE 64
+#define RPC_TICK     1000 /* us */
+
+enum opt {
+  OPT_RECENT = 0x200, /* after common options */
+  OPT_RECENT_SOURCES,
+  OPT_RPC
+};
+
+struct tx_req {
+  int           stop; /* last request (see weremac_close()) */
+  uint16_t      dst;
+  void         *cookie;
+  int           call;   /* request of this call identifier or -1 */
+  unsigned int  header; /* size of the RPC header, 0 otherwise */
+  uint8_t       rpc[RPC_HEADER];
+  unsigned int  size;
+  unsigned char payload[HYBRID_MAX_PAYLOAD];
+};
+
+static struct weremac {
+  struct weremac_config conf;
+  char   **argv;
+  int      opened;
+  int      started;
+  int      closed;
+  sem_t    ready;
+  pthread_t thread;
+
+  /* the ring has a single producer */
+  struct ring     tx_ring;
+  pthread_mutex_t tx_lock;
+
+  /* last messages of each source (see weremac_last()) */
+  unsigned int  recent_depth;
+  unsigned int  recent_sources;
+  struct recent recent;
+
+  /* outstanding calls (see weremac_call()) */
+  unsigned int  rpc_calls;
+  struct rpc    rpc;
+  struct ticker ticker;
+  pthread_t     ticker_thread;
+  void        (*cb_request)(uint16_t src, uint16_t id, const void *payload,
+                            unsigned int size, void *data);
+  void         *request_data;
+} instance = { .recent_sources = RECENT_SOURCES };
+
+static int queue(struct weremac *w, uint16_t dst, const uint8_t *header, int call,
+                 const void *payload, unsigned int size, void *cookie, int stop);
+
+static void cb_recv_batch(const struct hybrid_frame *frames, unsigned int count, void *data)
+{
+  struct weremac *w = data;
+  struct weremac_msg msgs[HYBRID_MAX_BATCH];
+  unsigned int i, n = 0;
+
+  if(__atomic_load_n(&w->closed, __ATOMIC_ACQUIRE))
+    return;
+
+  for(i = 0 ; i < count ; i++) {
+    const struct hybrid_frame *f = &frames[i];
+
+    if(w->rpc_calls && !f->status && rpc_input(&w->rpc, f->src, f->payload, f->size))
+      continue;
+
+    msgs[n] = (struct weremac_msg){ .src     = f->src,
+                                    .dst     = f->dst,
+                                    .status  = f->status,
+                                    .medium  = f->meta.source == HYBRID_SOURCE_LORA ? WEREMAC_LORA : WEREMAC_G3PLC,
+                                    .lqi     = f->meta.lqi,
+                                    .stamp   = f->meta.stamp,
+                                    .payload = f->payload,
+                                    .size    = f->size < WEREMAC_MAX_MESSAGE ? f->size : WEREMAC_MAX_MESSAGE };
+
+    if(w->recent_depth && !f->status)
+      recent_put(&w->recent, f->src, f->payload, msgs[n].size, f->meta.stamp);
+    n++;
+  }
+
+  if(n)
+    w->conf.cb_recv(msgs, n, w->conf.data);
+}
+
+static int rpc_send(uint16_t dst, const uint8_t *header, const void *payload,
+                    unsigned int size, uint16_t id, void *data)
+{
+  struct weremac *w = data;
+
+  if(size + RPC_HEADER > HYBRID_MAX_PAYLOAD)
+    return HYBRID_SND_TOOLONG;
+  return queue(w, dst, header, header[0] == RPC_REQUEST ? id : -1, payload, size, NULL, 0);
+}
+
+static void rpc_request(uint16_t src, uint16_t id, const void *payload,
+                        unsigned int size, void *data)
+{
+  struct weremac *w = data;
+  void (*cb)(uint16_t, uint16_t, const void *, unsigned int, void *);
+
+  cb = __atomic_load_n(&w->cb_request, __ATOMIC_ACQUIRE);
+  if(cb)
+    cb(src, id, payload, size, w->request_data);
+}
+
+static void init(const struct context *ctx, struct hybrid_config *hybrid)
+{
+  UNUSED(ctx);
+
+  hybrid->cb_recv_batch = cb_recv_batch;
+  hybrid->batch_frames  = WEREMAC_MAX_BATCH;
+  hybrid->batch_us      = instance.conf.batch_timeout;
+  hybrid->data          = &instance;
+
+  if(instance.recent_depth)
+    recent_init(&instance.recent, instance.recent_sources, instance.recent_depth,
+                WEREMAC_MAX_MESSAGE);
+
+  if(instance.rpc_calls) {
+    struct rpc_config rpc = { .send       = rpc_send,
+                              .cb_request = rpc_request,
+                              .data       = &instance };
+
+    ticker_init(&instance.ticker, RPC_TICK);
+    rpc_init(&instance.rpc, instance.rpc_calls, &instance.ticker, &rpc);
+    if(pthread_create(&instance.ticker_thread, NULL, ticker_loop, &instance.ticker))
+      errx(EXIT_FAILURE, "cannot create ticker thread");
+  }
+}
+
+/* Send the queued messages until weremac_close(). */
+static void start(const struct context *ctx)
+{
+  struct weremac *w = &instance;
+
+  UNUSED(ctx);
+
+  __atomic_store_n(&w->started, 1, __ATOMIC_RELEASE);
+  sem_post(&w->ready);
+
+  while(1) {
+    struct tx_req *req = ring_wait(&w->tx_ring);
+    int status;
+
+    if(req->stop) {
+      ring_release(&w->tx_ring);
+      return;
+    }
+
+    if(req->header) {
+      struct hybrid_seg segs[] = { { req->rpc, req->header },
+                                   { req->payload, req->size } };
+
+      status = hybrid_sendv(req->dst, segs, 2);
+      if(status && req->call >= 0)
+        rpc_fail(&w->rpc, req->call, status);
+    }
+    else {
+      status = hybrid_send(req->dst, req->payload, req->size);
+      if(w->conf.cb_sent)
+        w->conf.cb_sent(req->cookie, status, w->conf.data);
+    }
+    ring_release(&w->tx_ring);
+  }
+}
+
+static void destroy(const struct context *ctx)
+{
+  UNUSED(ctx);
+}
+
+static int parse_option(const struct context *ctx, int c)
+{
+  int err;
+
+  UNUSED(ctx);
+
+  switch(c) {
+  case OPT_RECENT:
+    instance.recent_depth = xatou(optarg, &err);
+    if(err || !instance.recent_depth)
+      errx(EXIT_FAILURE, "invalid number of recent messages");
+    return 1;
+  case OPT_RECENT_SOURCES:
+    instance.recent_sources = xatou(optarg, &err);
+    if(err || !instance.recent_sources)
+      errx(EXIT_FAILURE, "invalid number of recent sources");
+    return 1;
+  case OPT_RPC:
+    instance.rpc_calls = xatou(optarg, &err);
+    if(err || !instance.rpc_calls || instance.rpc_calls > RPC_MAX_CALLS)
+      errx(EXIT_FAILURE, "invalid number of outstanding calls");
+    return 1;
+  }
+
+  return 0; /* option unknown by this module,
+               can be be parsed by next module */
+}
+
+static void * driver_thread_func(void *p)
+{
+  struct weremac *w = p;
+  int argc = 0;
+
+  while(w->argv[argc])
+    argc++;
+  weremac_run(argc, w->argv);
+
+  /* main() returned before the mode was started (help) */
+  sem_post(&w->ready);
+  return NULL;
+}
+
+struct weremac * weremac_open(const struct weremac_config *conf)
+{
+  struct weremac *w = &instance;
+  char addr[sizeof("FFFF")];
+  unsigned int i, n = 0;
+
+  if(!conf->cb_recv || !conf->lora_dev || !conf->g3plc_dev)
+    return NULL;
+  if(__atomic_exchange_n(&w->opened, 1, __ATOMIC_ACQ_REL))
+    return NULL;
+
+  /* weremac ...options ADDR LORA G3PLC */
+  while(conf->options && conf->options[n])
+    n++;
+  w->argv = malloc((n + 5) * sizeof(char *));
+  if(!w->argv)
+    return NULL;
+  snprintf(addr, sizeof(addr), "%04X", conf->address);
+  w->argv[0] = strdup("weremac");
+  for(i = 0 ; i < n ; i++)
+    w->argv[i + 1] = strdup(conf->options[i]);
+  w->argv[n + 1] = strdup(addr);
+  w->argv[n + 2] = strdup(conf->lora_dev);
+  w->argv[n + 3] = strdup(conf->g3plc_dev);
+  w->argv[n + 4] = NULL;
+
+  w->conf = *conf;
+  ring_init(&w->tx_ring, TX_RING_SIZE, sizeof(struct tx_req));
+  pthread_mutex_init(&w->tx_lock, NULL);
+  sem_init(&w->ready, 0, 0);
+
+  if(pthread_create(&w->thread, NULL, driver_thread_func, w))
+    return NULL;
+  sem_wait(&w->ready);
+
+  if(!__atomic_load_n(&w->started, __ATOMIC_ACQUIRE))
+    return NULL;
+  return w;
+}
+
+static int queue(struct weremac *w, uint16_t dst, const uint8_t *header, int call,
+                 const void *payload, unsigned int size, void *cookie, int stop)
+{
+  struct tx_req *req;
+
+  pthread_mutex_lock(&w->tx_lock);
+  req = ring_reserve(&w->tx_ring);
+  if(!req) {
+    pthread_mutex_unlock(&w->tx_lock);
+    return WEREMAC_BUSY;
+  }
+
+  req->stop   = stop;
+  req->dst    = dst;
+  req->cookie = cookie;
+  req->call   = call;
+  req->header = header ? RPC_HEADER : 0;
+  req->size   = size;
+  if(header)
+    memcpy(req->rpc, header, RPC_HEADER);
+  if(size)
+    memcpy(req->payload, payload, size);
+  ring_commit(&w->tx_ring);
+  pthread_mutex_unlock(&w->tx_lock);
+
+  return WEREMAC_SUCCESS;
+}
+
+void weremac_close(struct weremac *w)
+{
+  unsigned int i;
+
+  if(__atomic_load_n(&w->closed, __ATOMIC_ACQUIRE))
+    return;
+
+  /* the queued messages are sent before the stop */
+  while(queue(w, 0, NULL, -1, NULL, 0, NULL, 1) == WEREMAC_BUSY)
+    usleep(1000);
+  pthread_join(w->thread, NULL);
+  __atomic_store_n(&w->closed, 1, __ATOMIC_RELEASE);
+
+  for(i = 0 ; w->argv[i] ; i++)
+    free(w->argv[i]);
+  free(w->argv);
+  w->argv = NULL;
+}
+
+int weremac_send(struct weremac *w, uint16_t dst, const void *payload, unsigned int size)
+{
+  if(__atomic_load_n(&w->closed, __ATOMIC_ACQUIRE))
+    return WEREMAC_CLOSED;
+  return hybrid_send(dst, payload, size);
+}
+
+int weremac_send_async(struct weremac *w, uint16_t dst, const void *payload,
+                       unsigned int size, void *cookie)
+{
+  if(__atomic_load_n(&w->closed, __ATOMIC_ACQUIRE))
+    return WEREMAC_CLOSED;
+  if(size > HYBRID_MAX_PAYLOAD)
+    return HYBRID_SND_TOOLONG;
+  return queue(w, dst, NULL, -1, payload, size, cookie, 0);
+}
+
+int weremac_last(struct weremac *w, uint16_t src, unsigned int nth,
+                 void *buf, unsigned int size, unsigned long *stamp)
+{
+  if(!w->recent_depth)
+    return -1;
+  return recent_get(&w->recent, src, nth, buf, size, stamp);
+}
+
+int weremac_call(struct weremac *w, uint16_t dst, const void *payload, unsigned int size,
+                 unsigned long timeout, weremac_done done, void *cookie)
+{
+  if(__atomic_load_n(&w->closed, __ATOMIC_ACQUIRE))
+    return WEREMAC_CLOSED;
+  if(!w->rpc_calls)
+    return WEREMAC_DISABLED;
+
+  return rpc_call(&w->rpc, dst, payload, size, timeout, done, cookie);
+}
+
+void weremac_serve(struct weremac *w,
+                   void (*cb_request)(uint16_t src, uint16_t id, const void *payload,
+                                      unsigned int size, void *data),
+                   void *data)
+{
+  w->request_data = data;
+  __atomic_store_n(&w->cb_request, cb_request, __ATOMIC_RELEASE);
+}
+
+int weremac_reply(struct weremac *w, uint16_t dst, uint16_t id,
+                  const void *payload, unsigned int size)
+{
+  if(__atomic_load_n(&w->closed, __ATOMIC_ACQUIRE))
+    return WEREMAC_CLOSED;
+  if(!w->rpc_calls)
+    return WEREMAC_DISABLED;
+  return rpc_reply(&w->rpc, dst, id, payload, size);
+}
+
+int weremac_time(const struct weremac *w, unsigned long stamp, uint64_t *us)
+{
+  UNUSED(w);
+  return timesync_time(stamp ? stamp : clock_us(), us) ? WEREMAC_UNSYNCED : WEREMAC_SUCCESS;
+}
+
+int weremac_ready(const struct weremac *w)
+{
+  UNUSED(w);
+  return hybrid_g3plc_ready();
+}
+
+const char * weremac_strerror(int status)
+{
+  switch(status) {
+  case WEREMAC_BUSY:
+    return "queue full";
+  case WEREMAC_CLOSED:
+    return "closed";
+  case WEREMAC_TIMEOUT:
+    return "no response";
+  case WEREMAC_DISABLED:
+    return "not enabled";
+  case WEREMAC_UNSYNCED:
+    return "not synchronized";
+  default:
+    return hybrid_snd2str(status);
+  }
+}
+
+struct option lib_opts[] = {
+  { "recent", required_argument, NULL, OPT_RECENT },
+  { "recent-sources", required_argument, NULL, OPT_RECENT_SOURCES },
+  { "rpc", required_argument, NULL, OPT_RPC },
+  { NULL, 0, NULL, 0 }
+};
+struct opt_help lib_messages[] = {
+  { 0, "recent", "Keep this number of last messages of each source (see weremac_last())" },
+  { 0, "recent-sources", "Number of sources kept with --recent (default 256)" },
+  { 0, "rpc", "Enable weremac_call() with this number of outstanding calls (at most 4096)" },
+  { 0, NULL, NULL }
+};
+
+struct iface_mode iface_mode = {
+  .name        = "lib",
+  .description = "Drive the hybrid device from the process linked with libweremac",
+
+  .optstring      = "",
+  .long_opts      = lib_opts,
+  .extra_messages = lib_messages,
+  .parse_option   = parse_option,
+
+  .init    = init,
+  .destroy = destroy,
+  .start   = start
+};
@@ -25,6 +25,7 @@
 #include <pthread.h>
 
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g3plc_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 void lock(void)
 {
@@ -35,3 +36,13 @@ void unlock(void)
 {
   pthread_mutex_unlock(&mutex);
 }
+
+void g3plc_lock(void)
+{
+  pthread_mutex_lock(&g3plc_mutex);
+}
+
+void g3plc_unlock(void)
+{
+  pthread_mutex_unlock(&g3plc_mutex);
+}
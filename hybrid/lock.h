@@ -29,4 +29,8 @@
 void lock(void);
 void unlock(void);
 
+/* Same with another mutex for the G3-PLC requests */
+void g3plc_lock(void);
+void g3plc_unlock(void);
+
 #endif /* _LOCK_H_ */
@@ -30,8 +30,19 @@
 
 #define CRC_CCITT_INIT 0xffff
 
+/* Compute the CRC-CCITT of a buffer starting from an initial CRC.
+   This uses the fastest portable implementation. */
 uint16_t crc_ccitt(const unsigned char *s,
                    unsigned int len,
                    uint16_t crc);
 
+/* Implementations exposed for testing.
+   All of them must produce the exact same result. */
+uint16_t crc_ccitt_bytewise(const unsigned char *s,
+                            unsigned int len,
+                            uint16_t crc);
+uint16_t crc_ccitt_slice4(const unsigned char *s,
+                          unsigned int len,
+                          uint16_t crc);
+
 #endif /* _CRC_CCITT_H_ */
@@ -73,6 +73,8 @@ const char * loramac_rcv2str(enum loramac_receive_status status)
     return "invalid destination";
   case LORAMAC_RCV_BROADCAST:
     return "broadcast frame";
+  case LORAMAC_RCV_REFUSED:
+    return "refused frame";
   default:
     return "unknown receive status";
   }
@@ -87,6 +89,8 @@ const char * loramac_send2str(enum loramac_send_status status)
     return "too long";
   case LORAMAC_SND_NOACK:
     return "max retransmit";
+  case LORAMAC_SND_EXPIRED:
+    return "expired";
   default:
     return "unknown send status";
   }
@@ -132,6 +136,8 @@ enum loramac_receive_status loramac_str2rcv(const char *s)
     return LORAMAC_RCV_DESTINATION;
   else if(!strcmp("broadcast", s))
     return LORAMAC_RCV_BROADCAST;
+  else if(!strcmp("refused", s))
+    return LORAMAC_RCV_REFUSED;
   return 0;
 }
 
@@ -143,5 +149,7 @@ enum loramac_send_status loramac_str2send(const char *s)
     return LORAMAC_SND_TOOLONG;
   else if(!strcmp("no-ack", s))
     return LORAMAC_SND_NOACK;
+  else if(!strcmp("expired", s))
+    return LORAMAC_SND_EXPIRED;
   return 0;
 }
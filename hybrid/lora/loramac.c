@@ -31,41 +31,39 @@
 
 #include "loramac.h"
 #include "crc-ccitt.h"
+#include "probe.h"
 
-/* LoRaMAC configuration with platform dependent functions,
-   source mac address and flags. */
-static struct loramac_config mac_conf;
-
-/* Sender internal state */
-static uint8_t seqno;
-static uint8_t last_ack_seqno;
-static unsigned int wait_ack;
-
-/* receive and send packetbuf [sz][frame...] */
-static unsigned char snd_pktbuf[LORAMAC_MAX_FRAME + 1];
-static unsigned char rcv_pktbuf[LORAMAC_MAX_FRAME + 1];
-
-/* Receiver ACK FIFO.
-   We keep the seqno of the last ACK for the last n senders.
-   We can use this to avoid displaying frames duplicated
-   because of retransmissions. It is allocated once and we
-   can ensure that it is large enough for the configured
-   value of timeout and SIFS. */
-static int oldest; /* index of oldest element in FIFO */
-static int newest; /* index of newest element in FIFO */
-static int ack_fifo_size; /* size of the FIFO */
-static struct last_ack {
-  uint16_t sender : 16;
-  uint8_t  seqno  : 8;
-} *ack_fifo;
+/* Step of a sent frame. */
+#define TRACE(event, arg) if(ctx->conf.trace) ctx->conf.trace(event, arg, ctx->conf.data)
+
+/* CRC of the state after the check. The FIFO is taken field
+   by field since the padding of the entries is not stored. */
+static uint16_t state_check(const struct loramac_state *state)
+{
+  uint16_t crc;
+  unsigned int i;
+
+  crc = crc_ccitt(&state->seqno, 4 * sizeof(uint8_t), CRC_CCITT_INIT);
+  for(i = 0 ; i < state->size ; i++) {
+    crc = crc_ccitt((const unsigned char *)&state->ack_fifo[i].sender, sizeof(uint16_t), crc);
+    crc = crc_ccitt(&state->ack_fifo[i].seqno, sizeof(uint8_t), crc);
+  }
+  return crc;
+}
+
+/* Write the check once the state has been updated. */
+static void seal_state(struct loramac_state *state)
+{
+  state->check = state_check(state);
+}
 
 /* Search the ACK FIFO for a sender.
    Returns -1 if it wasn't found. */
-static int ack_fifo_search(uint16_t sender)
+static int ack_fifo_search(const struct loramac_state *state, uint16_t sender)
 {
   int i;
-  for(i = 0 ; i < ack_fifo_size ; i++)
-    if(ack_fifo[i].sender != 0xffff && ack_fifo[i].sender == sender)
+  for(i = 0 ; i < state->size ; i++)
+    if(state->ack_fifo[i].sender != 0xffff && state->ack_fifo[i].sender == sender)
       return i;
   return -1;
 }
@@ -74,33 +72,59 @@ static int ack_fifo_search(uint16_t sender)
    This does not check if the sender is already present.
    If the queue is full, it always removes the oldest
    element and insert this one in place. */
-static void ack_fifo_insert(uint16_t sender, uint8_t seqno)
+static void ack_fifo_insert(struct loramac_state *state, uint16_t sender, uint8_t seqno)
 {
-  if((newest + 1) % ack_fifo_size == oldest) {
+  if((state->newest + 1) % state->size == state->oldest) {
     /* queue is full */
-    ack_fifo[oldest] = (struct last_ack){ .sender = sender,
-                                          .seqno  = seqno };
-    oldest = (oldest + 1) % ack_fifo_size;
+    state->ack_fifo[state->oldest] = (struct loramac_last_ack){ .sender = sender,
+                                                                .seqno  = seqno };
+    state->oldest = (state->oldest + 1) % state->size;
   }
   else {
     /* room available */
-    newest = (newest + 1) % ack_fifo_size;
-    ack_fifo[newest] = (struct last_ack){ .sender = sender,
-                                          .seqno  = seqno };
+    state->newest = (state->newest + 1) % state->size;
+    state->ack_fifo[state->newest] = (struct loramac_last_ack){ .sender = sender,
+                                                                .seqno  = seqno };
   }
+  seal_state(state);
 }
 
-int loramac_init(const struct loramac_config *conf)
+/* Initialize all sender to 0xffff.
+   We know that a sender will never
+   have 0xffff as its source address
+   since this is the broadcast address.
+
+   Note that we also initialize the seqno to 0.
+   Otherwise an attacker might use this to snoop
+   around into uninitialized memory. */
+static void reset_ack_fifo(struct loramac_state *state, unsigned int size)
 {
-  int i;
+  unsigned int i;
+
+  state->size   = size;
+  state->oldest = 0;
+  state->newest = 0;
+  for(i = 0 ; i < size ; i++)
+    state->ack_fifo[i] = (struct loramac_last_ack){ .sender = 0xffff,
+                                                    .seqno  = 0 };
+  seal_state(state);
+}
+
+int loramac_init(struct loramac_ctx *ctx, const struct loramac_config *conf)
+{
+  struct loramac_state *state;
+  unsigned int size;
+  int valid;
 
-  mac_conf = *conf;
-  seqno    = mac_conf.seqno;
+  ctx->conf     = *conf;
+  ctx->state    = state = conf->state ? conf->state : &ctx->own_state;
+  ctx->rcv_pos  = 0;
+  ctx->wait_ack = 0;
 
   /* SIFS is the time until the receiver can send its ACK.
      So if timeout is lower than this value, ACKs will never
      be received in time by the sender. */
-  if(mac_conf.timeout < mac_conf.sifs)
+  if(ctx->conf.timeout < ctx->conf.sifs)
     return LORAMAC_INIT_TIMEVAL;
 
   /* The optimal ACK FIFO size on node 0 is for all node i:
@@ -109,111 +133,177 @@ int loramac_init(const struct loramac_config *conf)
        max_i(timeout_i) = timeout_0
      Generally this value is really low since timeout is
      only slightly larger than SIFS. */
-  ack_fifo_size = mac_conf.timeout / mac_conf.sifs + 1;
-  if(ack_fifo_size > LORAMAC_MAX_ACK_FIFO)
+  size = ctx->conf.timeout / ctx->conf.sifs + 1;
+  if(size > LORAMAC_MAX_ACK_FIFO)
     return LORAMAC_INIT_ACK_FIFO;
 
-  ack_fifo = malloc(sizeof(struct last_ack) * ack_fifo_size);
-  if(!ack_fifo)
-    return LORAMAC_INIT_OOM;
+  /* Resume from the state of the previous instance. The
+     sequence number goes on from the last frame sent so
+     that the receivers do not drop the next ones, and the
+     retransmissions already received are still dropped.
+     A state with indices out of the FIFO or a wrong check
+     was torn or written by something else, so it starts
+     over from the configured sequence number. A valid state
+     with another FIFO size (the SIFS or timeout changed)
+     keeps its sequence number but not its FIFO. */
+  valid = state->magic == LORAMAC_STATE_MAGIC && state->size <= LORAMAC_MAX_ACK_FIFO &&
+          state->oldest < state->size && state->newest < state->size &&
+          state->check == state_check(state);
+  if(valid && state->size == size) {
+    ctx->resumed = 1;
+    return LORAMAC_INIT_SUCCESS;
+  }
+  ctx->resumed = 0;
+  state->magic = 0;
+  if(!valid)
+    state->seqno = ctx->conf.seqno;
+  reset_ack_fifo(state, size);
+  state->magic = LORAMAC_STATE_MAGIC;
 
-  /* Initialize all sender to 0xffff.
-     We know that a sender will never
-     have 0xffff as its source address
-     since this is the broadcast address.
+  return LORAMAC_INIT_SUCCESS;
+}
 
-     Note that we also initialize the seqno to 0.
-     Otherwise an attacker might use this to snoop
-     around into uninitialized memory. */
-  for(i = 0 ; i < ack_fifo_size ; i++)
-    ack_fifo[i] = (struct last_ack){ .sender = 0xffff,
-                                     .seqno  = 0 };
+int loramac_set_timing(struct loramac_ctx *ctx, unsigned int sifs, unsigned int timeout)
+{
+  unsigned int size;
+
+  if(!sifs || timeout < sifs)
+    return LORAMAC_INIT_TIMEVAL;
+  size = timeout / sifs + 1;
+  if(size > LORAMAC_MAX_ACK_FIFO)
+    return LORAMAC_INIT_ACK_FIFO;
+
+  /* The ACK FIFO restarts when it changes size, so a
+     retransmission received just before may go through. */
+  ctx->conf.lock(ctx->conf.data);
+  {
+    ctx->conf.sifs    = sifs;
+    ctx->conf.timeout = timeout;
+    if(size != ctx->state->size)
+      reset_ack_fifo(ctx->state, size);
+  }
+  ctx->conf.unlock(ctx->conf.data);
 
   return LORAMAC_INIT_SUCCESS;
 }
 
-#define COPY_U16(crc, buf, v) do {                \
-    *(uint16_t *)buf = mac_conf.htons(v);         \
-    crc  = crc_ccitt(buf, sizeof(uint16_t), crc); \
-    buf += sizeof(uint16_t);                      \
-  } while(0)
-
-#define COPY_U8(crc, buf, v) do {               \
-    *(uint8_t *)buf = v;                        \
-    crc = crc_ccitt(buf, sizeof(uint8_t), crc); \
-    buf++;                                      \
-  } while(0)
+int loramac_resumed(const struct loramac_ctx *ctx)
+{
+  return ctx->resumed;
+}
 
-static int send_ack(uint16_t src, uint8_t seqno)
+static int send_ack(struct loramac_ctx *ctx, uint16_t src, uint8_t seqno)
 {
-  unsigned char *buf = snd_pktbuf;
+  unsigned char *buf = ctx->snd_pktbuf;
 
-  *(uint8_t  *)buf = LORAMAC_ACK_SIZE;    buf += sizeof(uint8_t);
-  *(uint16_t *)buf = mac_conf.htons(src); buf += sizeof(uint16_t);
+  *(uint8_t  *)buf = LORAMAC_ACK_SIZE;     buf += sizeof(uint8_t);
+  *(uint16_t *)buf = ctx->conf.htons(src); buf += sizeof(uint16_t);
   *(uint8_t  *)buf = seqno;
 
   /* send packet */
-  return mac_conf.uart_send(snd_pktbuf, snd_pktbuf[0] + 1);
+  return ctx->conf.uart_send(ctx->snd_pktbuf, ctx->snd_pktbuf[0] + 1, ctx->conf.data);
 }
 
-static int loramac_send_helper(uint16_t dst, const void *payload, unsigned int payload_size)
+/* Build the frame in the packet buffer. This is done once
+   per loramac_send(), retransmissions write the same frame. */
+static int build_frame(struct loramac_ctx *ctx, uint16_t dst,
+                       const struct loramac_seg *segs, unsigned int count)
 {
-  unsigned char *buf = snd_pktbuf + 1;
-  uint16_t crc = CRC_CCITT_INIT;
-  int ret;
+  unsigned char *buf = ctx->snd_pktbuf + 1;
+  unsigned int payload_size = 0;
+  unsigned int i;
+  uint16_t crc;
+
+  for(i = 0 ; i < count ; i++)
+    payload_size += segs[i].size;
+  if(payload_size > LORAMAC_MAX_PAYLOAD)
+    return LORAMAC_SND_TOOLONG;
 
   /* copy header */
-  COPY_U16(crc, buf, mac_conf.mac_address);
-  COPY_U16(crc, buf, dst);
-  COPY_U8(crc, buf, seqno);
+  *(uint16_t *)buf = ctx->conf.htons(ctx->conf.mac_address); buf += sizeof(uint16_t);
+  *(uint16_t *)buf = ctx->conf.htons(dst);                    buf += sizeof(uint16_t);
+  *(uint8_t  *)buf = ctx->state->seqno;                       buf += sizeof(uint8_t);
 
   /* copy payload */
-  if(payload_size > LORAMAC_MAX_PAYLOAD)
-    return LORAMAC_SND_TOOLONG;
-  memcpy(buf, payload, payload_size);
-  crc  = crc_ccitt(buf, payload_size, crc);
-  buf += payload_size;
+  for(i = 0 ; i < count ; i++) {
+    memcpy(buf, segs[i].base, segs[i].size);
+    buf += segs[i].size;
+  }
+
+  /* CRC over the whole header and payload at once */
+  crc = crc_ccitt(ctx->snd_pktbuf + 1, buf - (ctx->snd_pktbuf + 1), CRC_CCITT_INIT);
 
   /* copy CRC */
-  *(uint16_t *)buf = mac_conf.htons(crc);
+  *(uint16_t *)buf = ctx->conf.htons(crc);
 
   /* copy frame size */
-  snd_pktbuf[0] = LORAMAC_HDR_SIZE + payload_size;
+  ctx->snd_pktbuf[0] = LORAMAC_HDR_SIZE + payload_size;
+
+  return LORAMAC_SND_SUCCESS;
+}
+
+static int loramac_send_helper(struct loramac_ctx *ctx, uint16_t dst, unsigned int retransmission)
+{
+  int ret;
+
+  PROBE(loramac, send_attempt, dst, ctx->state->seqno, retransmission == 0);
 
   /* send packet */
-  ret = mac_conf.uart_send(snd_pktbuf, snd_pktbuf[0] + 1);
+  ret = ctx->conf.uart_send(ctx->snd_pktbuf, ctx->snd_pktbuf[0] + 1, ctx->conf.data);
   if(ret < 0)
     return ret;
+  TRACE(LORAMAC_TRACE_ATTEMPT, retransmission);
 
   /* If we disabled ACK, we are done here.
      Otherwise we need to wait and check
      the last received ACK. */
-  if(mac_conf.flags & LORAMAC_NOACK)
+  if(ctx->conf.flags & LORAMAC_NOACK)
     return LORAMAC_SND_SUCCESS;
 
-  wait_ack = 1;
-  mac_conf.start_timer(mac_conf.timeout);
-  mac_conf.wait_timer();
+  ctx->wait_ack = 1;
+  ctx->conf.start_timer(ctx->conf.timeout, ctx->conf.data);
+  ctx->conf.wait_timer(ctx->conf.data);
+
+  /* the hybrid driver does not stamp the frames */
+  PROBE(loramac, ack_wait, dst, ctx->state->seqno, ctx->last_ack_seqno == ctx->state->seqno, 0);
+  TRACE(LORAMAC_TRACE_ACK, ctx->last_ack_seqno == ctx->state->seqno);
 
-  if(last_ack_seqno != seqno)
+  if(ctx->last_ack_seqno != ctx->state->seqno)
     return LORAMAC_SND_NOACK;
   return LORAMAC_SND_SUCCESS;
 }
 
-int loramac_send(uint16_t dst, const void *payload, unsigned int payload_size, unsigned int *tx)
+static int expired(const struct loramac_ctx *ctx, unsigned long deadline)
+{
+  return deadline && (long)(ctx->conf.clock() - deadline) >= 0;
+}
+
+int loramac_sendv_until(struct loramac_ctx *ctx, uint16_t dst,
+                        const struct loramac_seg *segs, unsigned int count,
+                        unsigned int *tx, unsigned long deadline)
 {
   int ret = LORAMAC_SND_NOACK;
-  unsigned int retransmission;
+  unsigned int retransmission = 0;
 
   /* We lock the packet buffer when sending a packet.
      This will lock for the complete transmission
      (including ACK and retransmissions). */
-  mac_conf.lock();
+  ctx->conf.lock(ctx->conf.data);
   {
-    seqno++; /* Use same sequence number for retransmitted frames. */
+    ctx->state->seqno++; /* Use same sequence number for retransmitted frames. */
+    seal_state(ctx->state);
 
-    for(retransmission = 0 ; retransmission < mac_conf.retrans ; retransmission++) {
-      ret = loramac_send_helper(dst, payload, payload_size);
+    ret = build_frame(ctx, dst, segs, count);
+    if(ret != LORAMAC_SND_SUCCESS)
+      goto EXIT;
+
+    for(retransmission = 0 ; retransmission < ctx->conf.retrans ; retransmission++) {
+      if(expired(ctx, deadline)) {
+        ret = LORAMAC_SND_EXPIRED;
+        break;
+      }
+
+      ret = loramac_send_helper(ctx, dst, retransmission);
 
       if(ret == LORAMAC_SND_SUCCESS) {
         retransmission++; /* update for tx count */
@@ -221,7 +311,8 @@ int loramac_send(uint16_t dst, const void *payload, unsigned int payload_size, u
       }
     }
   }
-  mac_conf.unlock();
+EXIT:
+  ctx->conf.unlock(ctx->conf.data);
 
   if(tx)
     *tx = retransmission;
@@ -229,19 +320,32 @@ int loramac_send(uint16_t dst, const void *payload, unsigned int payload_size, u
   return ret;
 }
 
-#define READ_U16(status, buf, dst) do {         \
-    buf -= sizeof(uint16_t);                    \
-    if(buf <= rcv_pktbuf) {                     \
-      status = LORAMAC_RCV_INVALID_HDR;         \
-      goto PARSING_COMPLETED;                   \
-    }                                           \
-    else                                        \
-      dst = mac_conf.ntohs(*(uint16_t *)buf);   \
+int loramac_send_until(struct loramac_ctx *ctx, uint16_t dst, const void *payload,
+                       unsigned int payload_size, unsigned int *tx, unsigned long deadline)
+{
+  struct loramac_seg seg = { .base = payload, .size = payload_size };
+
+  return loramac_sendv_until(ctx, dst, &seg, 1, tx, deadline);
+}
+
+int loramac_send(struct loramac_ctx *ctx, uint16_t dst, const void *payload, unsigned int payload_size, unsigned int *tx)
+{
+  return loramac_send_until(ctx, dst, payload, payload_size, tx, 0);
+}
+
+#define READ_U16(status, buf, dst) do {          \
+    buf -= sizeof(uint16_t);                     \
+    if(buf <= ctx->rcv_pktbuf) {                 \
+      status = LORAMAC_RCV_INVALID_HDR;          \
+      goto PARSING_COMPLETED;                    \
+    }                                            \
+    else                                         \
+      dst = ctx->conf.ntohs(*(uint16_t *)buf);   \
   } while(0)
 
 #define READ_U8(status, buf, dst) do {           \
     buf -= sizeof(uint8_t);                      \
-    if(buf <= rcv_pktbuf) {                      \
+    if(buf <= ctx->rcv_pktbuf) {                 \
       status = LORAMAC_RCV_INVALID_HDR;          \
       goto PARSING_COMPLETED;                    \
     }                                            \
@@ -249,9 +353,9 @@ int loramac_send(uint16_t dst, const void *payload, unsigned int payload_size, u
       dst = *(uint8_t *)buf;                     \
   } while(0)
 
-static int recv_ack(void)
+static int recv_ack(struct loramac_ctx *ctx)
 {
-  unsigned char *buf = rcv_pktbuf + LORAMAC_ACK_SIZE + 1;
+  unsigned char *buf = ctx->rcv_pktbuf + LORAMAC_ACK_SIZE + 1;
   uint8_t seqno;
   uint16_t src_mac;
   int status = LORAMAC_RCV_SUCCESS;
@@ -266,29 +370,42 @@ PARSING_COMPLETED:
        is already fixed when we parse ACK. */
     return status;
 
-  if(wait_ack && \
-     src_mac == mac_conf.mac_address) {
-    last_ack_seqno = seqno;
-    wait_ack = 0;
-    mac_conf.stop_timer();
+  PROBE(loramac, recv_ack, src_mac, seqno, ctx->wait_ack, 0);
+
+  if(ctx->wait_ack && \
+     src_mac == ctx->conf.mac_address) {
+    ctx->last_ack_seqno = seqno;
+    ctx->wait_ack = 0;
+    ctx->conf.stop_timer(ctx->conf.data);
   }
 
   return status;
 }
 
-static int recv_data(unsigned int size)
+static int recv_data(struct loramac_ctx *ctx, unsigned int size)
 {
-  unsigned char *buf = rcv_pktbuf + size + 1;
+  unsigned char *buf = ctx->rcv_pktbuf + size + 1;
   uint16_t expected_crc = CRC_CCITT_INIT;
   uint16_t frame_crc;
   uint16_t dst_mac = 0x0000; /* invalid address */
   uint16_t src_mac = 0x0000; /* invalid address */
-  uint8_t  seqno;
+  uint8_t  seqno = 0;
   int status = LORAMAC_RCV_SUCCESS;
+  int duplicate = 0;
   int i;
 
+  /* Frames to another destination are dropped before the CRC,
+     the destination is the second field after the size byte. */
+  if(!(ctx->conf.flags & LORAMAC_PROMISCUOUS) && size >= LORAMAC_HDR_SIZE) {
+    dst_mac = ctx->conf.ntohs(*(uint16_t *)(ctx->rcv_pktbuf + 1 + sizeof(uint16_t)));
+    if(dst_mac != ctx->conf.mac_address && dst_mac != 0xffff) {
+      status = LORAMAC_RCV_DESTINATION;
+      goto PARSING_COMPLETED;
+    }
+  }
+
   /* for CRC we skip the size (first byte) and frame CRC (last two bytes) */
-  expected_crc = crc_ccitt(rcv_pktbuf + 1, size - 2, expected_crc);
+  expected_crc = crc_ccitt(ctx->rcv_pktbuf + 1, size - 2, expected_crc);
 
   /* parse CRC */
   READ_U16(status, buf, frame_crc);
@@ -298,12 +415,12 @@ static int recv_data(unsigned int size)
   }
 
   /* parse header [src_mac][dst_mac][seqno] */
-  buf = rcv_pktbuf + sizeof(uint16_t) * 2 + sizeof(uint8_t) + 1;
+  buf = ctx->rcv_pktbuf + sizeof(uint16_t) * 2 + sizeof(uint8_t) + 1;
   READ_U8(status, buf, seqno);
   READ_U16(status, buf, dst_mac);
   READ_U16(status, buf, src_mac);
 
-  if(dst_mac != mac_conf.mac_address && \
+  if(dst_mac != ctx->conf.mac_address && \
      dst_mac != 0xffff) {
     /* wrong destination */
     status = LORAMAC_RCV_DESTINATION;
@@ -311,88 +428,109 @@ static int recv_data(unsigned int size)
   }
 
 PARSING_COMPLETED:
+  /* the filtering below depends on the flags only */
+  PROBE(loramac, recv_data, src_mac, dst_mac, seqno, status, 0, 0);
+
   /* based on parsing status and iface_flags
      we either return directly or pass the
      frame to the upper layer */
   switch(status) {
   case LORAMAC_RCV_INVALID_CRC:
   case LORAMAC_RCV_INVALID_HDR:
-    if(!(mac_conf.flags & LORAMAC_INVALID))
+    if(!(ctx->conf.flags & LORAMAC_INVALID))
       return status;
   case LORAMAC_RCV_DESTINATION:
-    if(!(mac_conf.flags & LORAMAC_PROMISCUOUS))
+    if(!(ctx->conf.flags & LORAMAC_PROMISCUOUS))
       return status;
   case LORAMAC_RCV_BROADCAST:
-    if(mac_conf.flags & LORAMAC_NOBROADCAST)
+    if(ctx->conf.flags & LORAMAC_NOBROADCAST)
       return LORAMAC_RCV_BROADCAST;
   }
 
   /* send ACK when enabled */
-  if(!(mac_conf.flags & LORAMAC_NOACK) && \
+  if(!(ctx->conf.flags & LORAMAC_NOACK) && \
      status == LORAMAC_RCV_SUCCESS) {
+    /* Check for retransmissions first, a frame that was delivered
+       is ACKed again as it is, without asking the upper layer. */
+    i = ack_fifo_search(ctx->state, src_mac);
+    duplicate = i >= 0 && seqno == ctx->state->ack_fifo[i].seqno;
+
+    /* unless the upper layer cannot use the frame */
+    if(!duplicate && ctx->conf.cb_accept &&
+       !ctx->conf.cb_accept(src_mac, dst_mac,
+                            ctx->rcv_pktbuf + sizeof(uint16_t) * 2 + sizeof(uint8_t) + 1,
+                            size - LORAMAC_HDR_SIZE, ctx->conf.data))
+      return LORAMAC_RCV_REFUSED;
+
     /* We have to wait before sending the ACK,
        otherwise the message is not sent correctly.
        Note that we don't use usleep and that the
        SIFS time can be quite large (>500ms). */
-    mac_conf.lock();
+    ctx->conf.lock(ctx->conf.data);
     {
-      mac_conf.start_timer(mac_conf.sifs);
-      mac_conf.wait_timer();
-      send_ack(src_mac, seqno);
+      ctx->conf.start_timer(ctx->conf.sifs, ctx->conf.data);
+      ctx->conf.wait_timer(ctx->conf.data);
+      send_ack(ctx, src_mac, seqno);
+
+      /* This stays under the lock since the
+         sender also writes the check of the state. */
+      if(i < 0)
+        ack_fifo_insert(ctx->state, src_mac, seqno);
+      else if(!duplicate) {
+        /* update seqno */
+        ctx->state->ack_fifo[i].seqno = seqno;
+        seal_state(ctx->state);
+      }
     }
-    mac_conf.unlock();
-
-    /* check for retransmissions */
-    i = ack_fifo_search(src_mac);
-    if(i < 0)
-      ack_fifo_insert(src_mac, seqno);
-    else if(seqno == ack_fifo[i].seqno)
-      /* skip retransmission */
+    ctx->conf.unlock(ctx->conf.data);
+
+    if(duplicate)
       goto EXIT;
-    else
-      /* update seqno */
-      ack_fifo[i].seqno = seqno;
   }
 
   /* send frame to upper layer */
-  mac_conf.cb_recv(src_mac, dst_mac,
-                   rcv_pktbuf + sizeof(uint16_t) * 2 + sizeof(uint8_t) + 1,
-                   size - LORAMAC_HDR_SIZE,
-                   status, mac_conf.data);
+  ctx->conf.cb_recv(src_mac, dst_mac,
+                    ctx->rcv_pktbuf + sizeof(uint16_t) * 2 + sizeof(uint8_t) + 1,
+                    size - LORAMAC_HDR_SIZE,
+                    status, ctx->conf.data);
 
 EXIT:
   return status;
 }
 
-int loramac_recv_frame(void)
+int loramac_recv_frame(struct loramac_ctx *ctx)
 {
-  int size = rcv_pktbuf[0];
+  int size = ctx->rcv_pktbuf[0];
 
   if(size == LORAMAC_ACK_SIZE)
-    return recv_ack();
+    return recv_ack(ctx);
   else
-    return recv_data(size);
+    return recv_data(ctx, size);
 }
 
-int loramac_uart_putc(unsigned char c)
+int loramac_uart_putc(struct loramac_ctx *ctx, unsigned char c)
 {
-  static unsigned char *rcv_ptr = rcv_pktbuf;
-  static uint8_t size;
   int status = LORAMAC_RCV_CONT; /* need more data */
 
-  if(rcv_ptr == rcv_pktbuf)
+  if(ctx->rcv_pos == 0)
     /* first byte (size) */
-    size = c + 1;
+    ctx->rcv_left = c + 1;
 
-  *rcv_ptr++ = c;
-  size--;
+  /* the bytes of a frame larger than the buffer are dropped */
+  if(ctx->rcv_pos < sizeof(ctx->rcv_pktbuf))
+    ctx->rcv_pktbuf[ctx->rcv_pos] = c;
+  ctx->rcv_pos++;
+  ctx->rcv_left--;
 
-  if(size == 0) {
+  if(ctx->rcv_left == 0) {
     /* full frame received */
-    status = mac_conf.recv_frame();
+    if(ctx->rcv_pos <= sizeof(ctx->rcv_pktbuf))
+      status = ctx->conf.recv_frame(ctx);
+    else
+      status = LORAMAC_RCV_INVALID_HDR;
 
     /* reset pktbuf */
-    rcv_ptr = rcv_pktbuf;
+    ctx->rcv_pos = 0;
   }
 
   return status;
@@ -32,7 +32,7 @@
 #include <stdint.h>
 
 #define LORAMAC_MAJOR       3
-#define LORAMAC_MINOR       7
+#define LORAMAC_MINOR       8
 
 /* We limit the frame size to 63 bytes. After reading the code
    on the LoRaMAC module, a larger frame would result in a buffer
@@ -48,6 +48,28 @@
    send a frame to the receiver during one timeout. */
 #define LORAMAC_MAX_ACK_FIFO 32
 
+/* State of the driver that outlives it (see state in loramac_config),
+   the last sequence number sent and the receiver ACK FIFO. The driver
+   updates it in place as it sends and receives, so that a state in a
+   mapped file is saved by the stores alone. The magic is only set
+   once the state is complete, and the check is a CRC-CCITT over the
+   fields that follow it, written after each update, so that a state
+   torn by a crash is not resumed. The layout changes with the magic. */
+#define LORAMAC_STATE_MAGIC 0x4c4d5302 /* "LMS" 2 */
+
+struct loramac_state {
+  uint32_t magic;
+  uint16_t check;  /* CRC-CCITT of the state below */
+  uint8_t  seqno;  /* last sequence number sent */
+  uint8_t  size;   /* entries of the ACK FIFO */
+  uint8_t  oldest; /* index of the oldest entry */
+  uint8_t  newest; /* index of the newest entry */
+  struct loramac_last_ack {
+    uint16_t sender;
+    uint8_t  seqno;
+  } ack_fifo[LORAMAC_MAX_ACK_FIFO];
+};
+
 /*
    LoRaMAC data frame format:
      [src_mac (16)][dst_mac (16)][seqno (8)]<payload...>[crc-ccitt(16)]
@@ -80,21 +102,31 @@ enum loramac_receive_status {
   LORAMAC_RCV_INVALID_HDR, /* invalid header */
   LORAMAC_RCV_DESTINATION, /* not destinated to this interface */
   LORAMAC_RCV_BROADCAST,   /* broadcast message ignored */
+  LORAMAC_RCV_REFUSED,     /* refused by the upper layer, not acknowledged */
 };
 
 /* Status of a sent frame */
 enum loramac_send_status {
   LORAMAC_SND_SUCCESS,
   LORAMAC_SND_TOOLONG, /* payload too long */
-  LORAMAC_SND_NOACK    /* maximum number of retransmissions reached */
+  LORAMAC_SND_NOACK,   /* maximum number of retransmissions reached */
+  LORAMAC_SND_EXPIRED  /* deadline passed before the frame was delivered */
 };
 
+/* Steps of a sent frame (see trace in loramac_config) */
+enum loramac_trace {
+  LORAMAC_TRACE_ATTEMPT, /* frame written on the UART, arg is the retransmission */
+  LORAMAC_TRACE_ACK      /* ACK timer expired, arg is whether the ACK came */
+};
+
+struct loramac_ctx;
+
 struct loramac_config {
   /* The driver will use the uart_send() function to write
      the resulting frame on the device's UART. This
      functions should return a negative value in case of
      error or 0 on success. */
-  int  (*uart_send)(const void *buf, unsigned int size);
+  int  (*uart_send)(const void *buf, unsigned int size, void *data);
 
   /* The driver will call cb_recv() when a frame has been
      received (frames may be filtered according to the
@@ -106,12 +138,23 @@ struct loramac_config {
                   const void *payload, unsigned int payload_size,
                   int status, void *data);
 
+  /* The driver will call cb_accept() with a valid frame to
+     this interface before its ACK. When it returns zero the
+     frame is dropped without an ACK, so that the sender
+     retransmits it then gives up. A retransmission of a frame
+     already acknowledged is acknowledged again without this
+     call. Unused without ACK. May be NULL. */
+  int (*cb_accept)(uint16_t src, uint16_t dst,
+                   const void *payload, unsigned int payload_size,
+                   void *data);
+
   /* The driver will use those functions to start, stop and wait
      for the ACK timer. The stop function should also drop any wait in
-     place on the timer. */
-  void (*start_timer)(unsigned int us);
-  void (*stop_timer)(void);
-  void (*wait_timer)(void);
+     place on the timer. Like the other platform functions they
+     receive the data pointer of this configuration. */
+  void (*start_timer)(unsigned int us, void *data);
+  void (*stop_timer)(void *data);
+  void (*wait_timer)(void *data);
 
   /* We only send one packet at a time. We are forced to do
      this unless we can start multiple referenced timers
@@ -121,8 +164,8 @@ struct loramac_config {
      its ACK in response to the received packet. Note that
      we use the same lock for sending and receiving since we
      don't generally send and receive at the same time. */
-  void (*lock)(void);
-  void (*unlock)(void);
+  void (*lock)(void *data);
+  void (*unlock)(void *data);
 
   /* Not all platform provide byte ordering functions
      with the same names as POSIX. */
@@ -136,7 +179,16 @@ struct loramac_config {
      transferred to this function which can either directly
      be loramac_recv_frame() or use semaphores to defer
      outside of the interrupt context. */
-  int (*recv_frame)(void);
+  int (*recv_frame)(struct loramac_ctx *ctx);
+
+  /* Monotonic clock in microseconds used to check the deadline
+     of a frame (see loramac_send_until()). The clock may wrap
+     around. May be NULL when no deadline is given. */
+  unsigned long (*clock)(void);
+
+  /* Called in the sending thread at each step of a frame (see
+     loramac_trace) with its argument. May be NULL. */
+  void (*trace)(int event, int arg, void *data);
 
   /* Initial sequence number.
      This can be randomized so that multiple instances
@@ -145,6 +197,12 @@ struct loramac_config {
      as retransmissions by the receiver (see ACK FIFO). */
   uint8_t seqno;
 
+  /* State of a previous instance to resume from, updated in place
+     (see loramac_state). The initial sequence number above is only
+     used when the state is new, the ACK FIFO is only kept when its
+     size did not change. May be NULL. */
+  struct loramac_state *state;
+
   uint16_t mac_address;  /* device short MAC address */
   unsigned int  retrans; /* maximum number of retransmissions */
   unsigned int  timeout; /* ACK timeout in us */
@@ -154,9 +212,51 @@ struct loramac_config {
   void *data; /* context data passed to user callbacks */
 };
 
+/* State of a driver instance. The structure is only public so
+   that it can be allocated statically, the fields are private.
+   Each instance drives its own module. */
+struct loramac_ctx {
+  /* LoRaMAC configuration with platform dependent functions,
+     source mac address and flags. */
+  struct loramac_config conf;
+
+  /* Sender internal state, the sequence number
+     of the last frame sent is in the state. */
+  uint8_t      last_ack_seqno;
+  unsigned int wait_ack;
+
+  /* receive and send packetbuf [sz][frame...] */
+  unsigned char snd_pktbuf[LORAMAC_MAX_FRAME + 1];
+  unsigned char rcv_pktbuf[LORAMAC_MAX_FRAME + 1];
+
+  /* Position in the received frame and bytes left,
+     glue between uart_putc() and recv_frame(). */
+  unsigned int rcv_pos;
+  unsigned int rcv_left;
+
+  /* State of the driver (see loramac_state), ours unless the
+     platform keeps it. The receiver ACK FIFO in the state keeps
+     the seqno of the last ACK for the last n senders, so that
+     the frames duplicated by retransmissions are dropped. */
+  struct loramac_state  own_state;
+  struct loramac_state *state;
+  int resumed; /* the state was resumed by loramac_init() */
+};
+
 /* Initialize the LoRaMAC driver (see loramac_config).
    Return 0 on success, for other error codes see loramac_init_status. */
-int loramac_init(const struct loramac_config *conf);
+int loramac_init(struct loramac_ctx *ctx, const struct loramac_config *conf);
+
+/* Return non-zero when the last loramac_init() resumed the state of
+   a previous instance, zero when it started over with a new one. */
+int loramac_resumed(const struct loramac_ctx *ctx);
+
+/* Change the SIFS and the ACK timeout of the running driver, both in us.
+   The timeout cannot be lower than SIFS and the ACK FIFO they call for
+   cannot be larger than LORAMAC_MAX_ACK_FIFO. The ACK FIFO starts over
+   when its size changes. Returns 0 on success, for other error codes
+   see loramac_init_status. */
+int loramac_set_timing(struct loramac_ctx *ctx, unsigned int sifs, unsigned int timeout);
 
 /* Assemble and send a frame to the specified destination using LoRaMAC.
    The broadcast address is 0xffff. When ACK is enabled, this function
@@ -164,11 +264,31 @@ int loramac_init(const struct loramac_config *conf);
    the error returned see loramac_send_status. If the tx pointer is not
    null, it is replaced with the number of transmissions necessary to
    succesfully send the packet. */
-int loramac_send(uint16_t dst, const void *payload, unsigned int payload_size, unsigned int *tx);
+int loramac_send(struct loramac_ctx *ctx, uint16_t dst, const void *payload, unsigned int payload_size, unsigned int *tx);
+
+/* Same as loramac_send() but give up with LORAMAC_SND_EXPIRED when
+   the deadline (see clock) passed before the next transmission. This
+   is also checked once the send lock is acquired. A null deadline
+   never expires. */
+int loramac_send_until(struct loramac_ctx *ctx, uint16_t dst, const void *payload,
+                       unsigned int payload_size, unsigned int *tx, unsigned long deadline);
+
+/* A piece of a payload (see loramac_sendv_until()). */
+struct loramac_seg {
+  const void  *base;
+  unsigned int size;
+};
+
+/* Same as loramac_send_until() for a payload made of count
+   segments one after the other. They are copied straight in
+   the frame, the caller does not have to assemble them. */
+int loramac_sendv_until(struct loramac_ctx *ctx, uint16_t dst,
+                        const struct loramac_seg *segs, unsigned int count,
+                        unsigned int *tx, unsigned long deadline);
 
 /* Start the processing of a frame. Can be called either automatically
    when a complete frame has been received or manually from another thread. */
-int loramac_recv_frame(void);
+int loramac_recv_frame(struct loramac_ctx *ctx);
 
 /* Called by the platform dependent part of the driver when a character
    has been received on UART from the device. This function can block
@@ -176,6 +296,6 @@ int loramac_recv_frame(void);
    if the receive callback itself is blocked. Note that this function
    is *NOT* reentrant. You have to wait for its completion until you
    can call it again. */
-int loramac_uart_putc(unsigned char c);
+int loramac_uart_putc(struct loramac_ctx *ctx, unsigned char c);
 
 #endif /* _LORAMAC_H_ */
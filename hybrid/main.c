@@ -26,28 +26,51 @@
 # include <bsd/stdlib.h>
 #endif /* __linux__ */
 
+#include <sys/mman.h>
+#include <sys/timerfd.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <string.h>
 #include <getopt.h>
-#include <signal.h>
+#include <errno.h>
 #include <err.h>
 
 #include "hybrid/hybrid.h"
 #include "hybrid/hybrid-str.h"
+#include "hybrid/lz.h"
 #include "g3plc/g3plc.h"
+#include "g3plc/g3plc-str.h"
+#include "lora/loramac.h"
+#include "lora/loramac-str.h"
 #include "string-utils.h"
 #include "rpi-gpio.h"
 #include "version.h"
 #include "options.h"
+#include "metrics.h"
+#include "admit.h"
+#include "statmap.h"
 #include "common.h"
 #include "xatoi.h"
 #include "timer.h"
+#include "ring.h"
+#include "race.h"
+#include "account.h"
+#include "trace.h"
+#include "cluster.h"
+#include "standby.h"
+#include "timesync.h"
+#include "bulk.h"
+#include "hotplug.h"
+#include "modules.h"
+#include "event.h"
 #include "lock.h"
+#include "reconf.h"
 #include "uart.h"
 #include "mode.h"
 #include "help.h"
@@ -76,14 +99,18 @@ static void configure_gpio(const struct context *ctx)
   rpi_gpio_set(ctx->gpio_reset); /* set high for low pulse */
 }
 
+/* Without a reset line (e.g. the simulator) we
+   rely on the modem requesting its program. */
 static void reset_clear(void)
 {
-  rpi_gpio_clr(ctx.gpio_reset);
+  if(ctx.gpio_reset >= 0)
+    rpi_gpio_clr(ctx.gpio_reset);
 }
 
 static void reset_set(void)
 {
-  rpi_gpio_set(ctx.gpio_reset);
+  if(ctx.gpio_reset >= 0)
+    rpi_gpio_set(ctx.gpio_reset);
 }
 
 static void initialize_driver(struct context *ctx,
@@ -99,19 +126,163 @@ static void initialize_driver(struct context *ctx,
   configure_gpio(ctx);
 }
 
-/* We must block those signals otherwise
-   those might be selected when the SIGALRM
-   is raised by the timers instead of the
-   main thread where the handler is configured. */
-static void thread_block_signals()
+/* Received frames are queued by the UART input thread
+   and delivered to the mode from their own thread. This
+   way a slow mode never stalls the parsing of the UART. */
+#define RX_RING_SIZE 64
+
+struct rx_frame {
+  uint16_t      src;
+  uint16_t      dst;
+  int           status;
+  struct hybrid_meta meta;
+  unsigned int  size;
+  unsigned char payload[G3PLC_MAX_CMD];
+};
+
+static struct ring rx_ring;
+static void (*mode_cb_recv)(uint16_t src, uint16_t dst,
+                            const void *payload, unsigned int payload_size,
+                            int status, int source, void *data);
+static void (*mode_cb_recv_meta)(uint16_t src, uint16_t dst,
+                                 const void *payload, unsigned int payload_size,
+                                 int status, const struct hybrid_meta *meta, void *data);
+
+static void queue_recv(uint16_t src, uint16_t dst,
+                       const void *payload, unsigned int payload_size,
+                       int status, const struct hybrid_meta *meta, void *data)
+{
+  struct rx_frame *frame = ring_reserve(&rx_ring);
+
+  UNUSED(data);
+
+  if(!frame)
+    return; /* dropped */
+  if(payload_size > sizeof(frame->payload))
+    payload_size = sizeof(frame->payload);
+
+  frame->src    = src;
+  frame->dst    = dst;
+  frame->status = status;
+  frame->meta   = *meta;
+  frame->size   = payload_size;
+  memcpy(frame->payload, payload, payload_size);
+
+  ring_commit(&rx_ring);
+}
+
+static void * delivery_thread_func(void *p)
+{
+  const struct context       *ctx    = ((struct io_thread_data *)p)->ctx;
+  const struct hybrid_config *hybrid = ((struct io_thread_data *)p)->config;
+  unsigned long drops = 0;
+  int pending = 0;
+
+  while(1) {
+    struct rx_frame *frame;
+
+    /* Give the mode a chance to flush the frames it
+       batched once no other frame arrived in time. */
+    if(pending) {
+      frame = ring_timedwait(&rx_ring, iface_mode.flush_timeout);
+      if(!frame) {
+        iface_mode.flush(ctx);
+        pending = 0;
+        continue;
+      }
+    }
+    else
+      frame = ring_wait(&rx_ring);
+
+    if(mode_cb_recv_meta)
+      mode_cb_recv_meta(frame->src, frame->dst,
+                        frame->payload, frame->size,
+                        frame->status, &frame->meta, hybrid->data);
+    else
+      mode_cb_recv(frame->src, frame->dst,
+                   frame->payload, frame->size,
+                   frame->status, frame->meta.source, hybrid->data);
+    ring_release(&rx_ring);
+    pending = iface_mode.flush != NULL;
+
+    if(ring_drops(&rx_ring) != drops) {
+      drops = ring_drops(&rx_ring);
+      warnx("receive queue full, %lu frames dropped", drops);
+    }
+  }
+
+  return NULL;
+}
+
+/* Messages for other nodes are sent again from their own thread
+   as the driver cannot send from the UART input thread that waits
+   for the confirms. They never reach the mode (see --route). The
+   answers to the segments of a transfer take the same way (see
+   --transport). */
+#define FWD_RING_SIZE 16
+#define MAX_ROUTES    64
+
+struct fwd_msg {
+  int           reply;
+  uint16_t      dst;
+  unsigned int  size;
+  unsigned char msg[HYBRID_MAX_PAYLOAD];
+};
+
+static struct ring fwd_ring;
+static struct hybrid_route routes[MAX_ROUTES];
+
+static void queue_forward(const void *msg, unsigned int size, void *data)
+{
+  struct fwd_msg *fwd = ring_reserve(&fwd_ring);
+
+  UNUSED(data);
+
+  if(!fwd)
+    return; /* dropped */
+
+  fwd->reply = 0;
+  fwd->size  = size;
+  memcpy(fwd->msg, msg, size);
+
+  ring_commit(&fwd_ring);
+}
+
+static void queue_reply(uint16_t dst, const void *msg, unsigned int size, void *data)
 {
-  sigset_t set;
+  struct fwd_msg *fwd = ring_reserve(&fwd_ring);
+
+  UNUSED(data);
+
+  if(!fwd)
+    return; /* dropped, the sender polls again */
+
+  fwd->reply = 1;
+  fwd->dst   = dst;
+  fwd->size  = size;
+  memcpy(fwd->msg, msg, size);
+
+  ring_commit(&fwd_ring);
+}
+
+/* The relayed frames are sent concurrently with the frames of the
+   mode, the G3-PLC and LoRa locks of hybrid_config serialize the
+   requests of both threads on each medium. */
+static void * forward_thread_func(void *p)
+{
+  UNUSED(p);
+
+  while(1) {
+    struct fwd_msg *fwd = ring_wait(&fwd_ring);
 
-  sigemptyset(&set);
-  sigaddset(&set, SIGALRM);
+    if(fwd->reply)
+      hybrid_reply(fwd->dst, fwd->msg, fwd->size);
+    else
+      hybrid_forward(fwd->msg, fwd->size);
+    ring_release(&fwd_ring);
+  }
 
-  if(pthread_sigmask(SIG_BLOCK, &set, NULL))
-    err(EXIT_FAILURE, "cannot block signals");
+  return NULL;
 }
 
 static void * output_thread_func(void *p)
@@ -123,32 +294,714 @@ static void * output_thread_func(void *p)
   return NULL; /* FIXME: return with error code */
 }
 
-static void * input_thread_lora_func(void *p)
+static void lora_uart_ready(int fd, const unsigned char *buf, unsigned int size, void *data)
 {
-  UNUSED(p);
+  UNUSED(data);
 
-  thread_block_signals();
+  uart_feed(fd, buf, size, hybrid_lora_uart_putc);
+  hybrid_recv_flush();
+}
 
-  uart_read_loop(ctx.lora_uart_fd, hybrid_lora_uart_putc);
+static void g3plc_uart_ready(int fd, const unsigned char *buf, unsigned int size, void *data)
+{
+  UNUSED(data);
 
-  return NULL; /* FIXME: return with error code */
+  uart_feed(fd, buf, size, hybrid_g3plc_uart_putc);
+  hybrid_recv_flush();
 }
 
-static void * input_thread_g3plc_func(void *p)
+/* With --hotplug an unplugged UART leaves the event loop and the
+   other medium keeps running until it is back (see hotplug.h). */
+static void lora_uart_gone(int fd, int error, void *data)
 {
-  UNUSED(p);
+  UNUSED(data);
+
+  warnx("LoRa UART lost (%s), waiting for the device", strerror(error));
+  hotplug_lost(fd);
+}
+
+static void lora_uart_attached(int fd, void *data)
+{
+  UNUSED(data);
+
+  warnx("LoRa UART is back");
+  event_add_hotplug(fd, lora_uart_ready, lora_uart_gone, NULL);
+}
+
+/* The G3-PLC UART is read by the event loop once the modem is up
+   and by the boot sequence in between (see g3plc_boot_thread_func),
+   a line that is back only returns to the loop when it had left it
+   on its own. */
+static pthread_mutex_t g3plc_loop_lock = PTHREAD_MUTEX_INITIALIZER;
+static int g3plc_in_loop;
+
+static void g3plc_uart_gone(int fd, int error, void *data);
+
+static void g3plc_loop_add(int fd)
+{
+  pthread_mutex_lock(&g3plc_loop_lock);
+  if(!g3plc_in_loop)
+    event_add_hotplug(fd, g3plc_uart_ready, hotplug_enabled() ? g3plc_uart_gone : NULL, NULL);
+  g3plc_in_loop = 1;
+  pthread_mutex_unlock(&g3plc_loop_lock);
+}
+
+static void g3plc_loop_del(int fd)
+{
+  pthread_mutex_lock(&g3plc_loop_lock);
+  if(g3plc_in_loop)
+    event_del(fd);
+  g3plc_in_loop = 0;
+  pthread_mutex_unlock(&g3plc_loop_lock);
+}
+
+static void g3plc_uart_gone(int fd, int error, void *data)
+{
+  UNUSED(data);
+
+  pthread_mutex_lock(&g3plc_loop_lock);
+  g3plc_in_loop = 0;
+  pthread_mutex_unlock(&g3plc_loop_lock);
+
+  warnx("G3-PLC UART lost (%s), waiting for the device", strerror(error));
+  hotplug_lost(fd);
+}
+
+/* Warm attach, a modem that lost its program stops confirming
+   and it is restarted as any modem that does not answer. */
+static void g3plc_uart_attached(int fd, void *data)
+{
+  UNUSED(data);
+
+  warnx("G3-PLC UART is back");
+  if(hybrid_g3plc_ready())
+    g3plc_loop_add(fd);
+}
+
+/* The partial batches, the damaged copies held for a good one
+   and the messages held for the ones before them are also flushed
+   when no frame arrives (see cb_recv_batch, diversity_us and
+   order_us in hybrid_config). This stays on the input thread since
+   the released messages go to the receive ring, which only has
+   one producer. Return the period in us, -1U for none. */
+static unsigned int flush_period(const struct hybrid_config *hybrid)
+{
+  unsigned int us = hybrid->cb_recv_batch && hybrid->batch_us ? hybrid->batch_us : -1U;
+
+  if(hybrid->flags & HYBRID_DIVERSITY) {
+    unsigned int window = hybrid->diversity_us ? hybrid->diversity_us : HYBRID_DIVERSITY_WINDOW;
+
+    /* delivered at most half a window late */
+    if(window / 2 < us)
+      us = window / 2;
+  }
+  if(hybrid->flags & HYBRID_ORDER) {
+    unsigned int wait = hybrid->order_us ? hybrid->order_us : HYBRID_ORDER_WAIT;
+
+    if(wait / 2 < us)
+      us = wait / 2;
+  }
+
+  /* zero would disarm the timer */
+  return us ? us : 1;
+}
 
-  thread_block_signals();
+static void flush_timer_ready(int fd, const unsigned char *buf, unsigned int size, void *data)
+{
+  UNUSED(fd);
+  UNUSED(buf);
+  UNUSED(size);
+  UNUSED(data);
+
+  hybrid_recv_flush();
+}
+
+static void start_flush_timer(unsigned int us)
+{
+  struct itimerspec its;
+  int fd;
+
+  its.it_value.tv_sec  = us / 1000000;
+  its.it_value.tv_nsec = us % 1000000 * 1000;
+  its.it_interval      = its.it_value;
+
+  fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if(fd < 0)
+    err(EXIT_FAILURE, "cannot create the flush timer");
+  if(timerfd_settime(fd, 0, &its, NULL) < 0)
+    err(EXIT_FAILURE, "cannot arm the flush timer");
+  event_add(fd, flush_timer_ready, NULL);
+}
+
+/* Both UART are handled from a single thread.
+   The event loop wakes up whenever one of
+   the serial lines has something to read,
+   or when the held messages are due. */
+static void * input_thread_func(void *p)
+{
+  const struct context       *ctx    = ((struct io_thread_data *)p)->ctx;
+  const struct hybrid_config *hybrid = ((struct io_thread_data *)p)->config;
+  unsigned int us = flush_period(hybrid);
 
-  uart_read_loop(ctx.g3plc_uart_fd, hybrid_g3plc_uart_putc);
+  event_add_hotplug(ctx->lora_uart_fd, lora_uart_ready,
+                    hotplug_enabled() ? lora_uart_gone : NULL, NULL);
+  modules_start();
+  if(us != -1U)
+    start_flush_timer(us);
+  event_loop();
 
   return NULL; /* FIXME: return with error code */
 }
 
+/* Delay between two restarts of a G3-PLC modem that is down. */
+#define G3PLC_RESTART_DELAY 10 /* seconds */
+
+/* Posted by the driver when G3-PLC is declared down. */
+static sem_t g3plc_down;
+
+static void g3plc_recover(void *data)
+{
+  UNUSED(data);
+  sem_post(&g3plc_down);
+}
+
+static unsigned long g3plc_lost(void)
+{
+  struct uart_stats u;
+
+  uart_stats(ctx.g3plc_uart_fd, &u);
+  return u.overruns + u.frame_errors + u.parity_errors;
+}
+
+/* The time on air goes to the client the thread sends for. */
+static void charge_airtime(int medium, uint16_t dst, unsigned long airtime, void *data)
+{
+  UNUSED(dst);
+  UNUSED(data);
+  account_charge(medium, airtime);
+}
+
+/* G3-PLC is booted from its own thread so that LoRa
+   carries the traffic during the firmware upload. The
+   boot sequence reads the G3-PLC UART itself, it only
+   joins the event loop once the modem is started.
+   The same thread restarts the modem when it hangs. */
+static void * g3plc_boot_thread_func(void *p)
+{
+  const struct context *ctx = ((struct io_thread_data *)p)->ctx;
+
+  if(hybrid_g3plc_start())
+    errx(EXIT_FAILURE, "cannot initialize G3-PLC: %s",
+                       g3plc_init2str(g3plc_errno));
+
+  while(1) {
+    g3plc_loop_add(ctx->g3plc_uart_fd);
+    IF_VERBOSE(ctx, printf("G3-PLC is up.\n"));
+
+    while(sem_wait(&g3plc_down) < 0) {
+      if(errno != EINTR)
+        err(EXIT_FAILURE, "cannot wait for G3-PLC");
+    }
+
+    g3plc_loop_del(ctx->g3plc_uart_fd);
+    warnx("G3-PLC does not answer, restarting the modem");
+
+    while(hybrid_g3plc_start()) {
+      warnx("cannot restart G3-PLC: %s", g3plc_init2str(g3plc_errno));
+      sleep(G3PLC_RESTART_DELAY);
+    }
+  }
+
+  return NULL;
+}
+
+/* Metrics are written every METRICS_INTERVAL seconds
+   when a metrics file is given (see metrics.h). */
+#define METRICS_INTERVAL 10
+
+static const char *metrics_path;
+
+/* Live statistics are published every STATS_MAP_INTERVAL
+   milliseconds when a statistics file is given (see statmap.h). */
+#define STATS_MAP_INTERVAL 100
+
+static const char *stats_map_path;
+static struct statmap stats_map;
+
+/* Lifecycle of one sent message in trace_rate, the last
+   ones written with the metrics to a file (see trace.h). */
+#define TRACE_RATE 100
+
+static const char  *trace_path;
+static unsigned int trace_rate = TRACE_RATE;
+
+/* Keepalives to the links idle for probe_age us, within
+   probe_share permille of the time (see hybrid_probe()). The
+   prober sleeps until the next link turns stale, or PROBE_CHECK ms
+   when a stale link waits for its medium. Its thread sends on G3-PLC
+   besides the mode, through the G3-PLC lock of hybrid_config. */
+#define PROBE_SHARE 10
+#define PROBE_CHECK 1000
+
+static unsigned long probe_age;
+static unsigned int  probe_share = PROBE_SHARE;
+
+/* Gateway cluster (see cluster.h), the identifier
+   defaults to the low byte of the MAC address. */
+static const char   *cluster_group;
+static int           cluster_id = -1;
+static unsigned long cluster_window = CLUSTER_WINDOW;
+
+/* Network time (see timesync.h), the beacon period of
+   the master in us or a node that follows it. */
+static unsigned long time_master;
+static int           time_follow;
+
+/* Bulk distribution (see bulk.h), the file sent by
+   the source or the directory of the received ones. */
+static const char   *bulk_path;
+static const char   *bulk_dir;
+static unsigned int  bulk_fec;
+static unsigned long bulk_window;
+
+/* Backend of the UART event loop (see --io-uring). */
+static enum event_backend event_backend = EVENT_EPOLL;
+
+/* Wait for the unplugged UARTs (see --hotplug). */
+static int hotplug;
+
+static void write_uart_metrics(struct metrics *m, int fd, const char *medium)
+{
+  struct hotplug_stats h;
+  struct uart_stats u;
+  char labels[48];
+
+  uart_stats(fd, &u);
+  snprintf(labels, sizeof(labels), "medium=\"%s\"", medium);
+
+  if(hotplug_enabled()) {
+    hotplug_stats(fd, &h);
+    metrics_value(m, "uart_attached", labels, h.attached);
+    metrics_value(m, "uart_detaches_total", labels, h.detaches);
+  }
+
+  metrics_value(m, "uart_tx_bytes_total", labels, u.tx_bytes);
+  metrics_value(m, "uart_rx_bytes_total", labels, u.rx_bytes);
+  metrics_value(m, "uart_overruns_total", labels, u.overruns);
+  metrics_value(m, "uart_rx_queue_bytes", labels, u.rx_queued);
+  metrics_value(m, "uart_rx_queue_max_bytes", labels, u.rx_queued_max);
+
+  snprintf(labels, sizeof(labels), "medium=\"%s\",type=\"overrun\"", medium);
+  metrics_value(m, "uart_errors_total", labels, u.hw_overruns);
+  snprintf(labels, sizeof(labels), "medium=\"%s\",type=\"buf_overrun\"", medium);
+  metrics_value(m, "uart_errors_total", labels, u.buf_overruns);
+  snprintf(labels, sizeof(labels), "medium=\"%s\",type=\"frame\"", medium);
+  metrics_value(m, "uart_errors_total", labels, u.frame_errors);
+  snprintf(labels, sizeof(labels), "medium=\"%s\",type=\"parity\"", medium);
+  metrics_value(m, "uart_errors_total", labels, u.parity_errors);
+}
+
+/* Parse the radio settings as SF:BW[:CR] with the bandwidth in kHz. */
+static void parse_radio(struct duty_radio *radio, const char *arg)
+{
+  char *s = strdup(arg);
+  char *sf, *bw, *cr;
+  int err;
+
+  sf = strtok(s, ":");
+  bw = strtok(NULL, ":");
+  cr = strtok(NULL, ":");
+  if(!sf || !bw)
+    errx(EXIT_FAILURE, "radio settings expect SF:BW[:CR]");
+
+  radio->sf = xatou(sf, &err);
+  if(err)
+    errx(EXIT_FAILURE, "cannot parse spreading factor");
+  radio->bw = xatou(bw, &err) * 1000UL;
+  if(err)
+    errx(EXIT_FAILURE, "cannot parse bandwidth");
+  if(cr) {
+    radio->cr = xatou(cr, &err);
+    if(err)
+      errx(EXIT_FAILURE, "cannot parse coding rate");
+  }
+
+  if(duty_radio_check(radio))
+    errx(EXIT_FAILURE, "invalid radio settings (SF7 to SF12, CR 1 to 4)");
+
+  free(s);
+}
+
+static void parse_tune(struct g3plc_opt *g3plc, const char *arg)
+{
+  char *s = strdup(arg);
+  char *min, *max;
+  int err;
+
+  min = strtok(s, ":");
+  max = strtok(NULL, ":");
+  if(!min || !max)
+    errx(EXIT_FAILURE, "retransmission tuning expects MIN:MAX");
+
+  g3plc->retrans_min = xatou(min, &err);
+  if(err)
+    errx(EXIT_FAILURE, "cannot parse minimum retransmissions");
+  g3plc->retrans_max = xatou(max, &err);
+  if(err)
+    errx(EXIT_FAILURE, "cannot parse maximum retransmissions");
+  if(g3plc->retrans_min > g3plc->retrans_max || g3plc->retrans_max > 255)
+    errx(EXIT_FAILURE, "invalid retransmission bounds (MIN <= MAX <= 255)");
+
+  free(s);
+}
+
+static void parse_route(struct hybrid_config *conf, const char *arg)
+{
+  struct hybrid_route *route;
+  char *s = strdup(arg);
+  char *dst, *next_hop, *medium;
+
+  if(conf->route_count == MAX_ROUTES)
+    errx(EXIT_FAILURE, "too many routes (max. %d)", MAX_ROUTES);
+  route = &routes[conf->route_count];
+
+  dst      = strtok(s, ":");
+  next_hop = strtok(NULL, ":");
+  medium   = strtok(NULL, ":");
+  if(!dst || !next_hop)
+    errx(EXIT_FAILURE, "route expects DST:NEXT-HOP[:lora|g3plc]");
+
+  route->dst      = strtol(dst, NULL, 16);
+  route->next_hop = strtol(next_hop, NULL, 16);
+  route->medium   = medium ? hybrid_str2source(medium) : -1;
+  if(medium && route->medium < 0)
+    errx(EXIT_FAILURE, "unknown medium '%s'", medium);
+
+  conf->routes = routes;
+  conf->route_count++;
+  conf->flags |= HYBRID_ROUTE;
+
+  free(s);
+}
+
+/* Statistics of the Unix mode clients (see admit.h),
+   only known with limits or --client-stats. */
+static void write_clients(struct metrics *m)
+{
+  struct admit_stats c;
+  char labels[sizeof(c.addr) + 32];
+  unsigned int i;
+
+  metrics_help(m, "hybrid_client_messages_total", "counter", "Send messages accepted from each client");
+  metrics_help(m, "hybrid_client_bytes_total", "counter", "Bytes of the send messages accepted from each client");
+  metrics_help(m, "hybrid_client_completed_total", "counter", "Send messages of each client completed by outcome");
+  metrics_help(m, "hybrid_client_rejected_total", "counter", "Send messages of each client rejected by its limits");
+  metrics_help(m, "hybrid_client_inflight", "gauge", "Send messages of each client in flight");
+  metrics_help(m, "hybrid_client_inflight_max", "gauge", "Maximum of hybrid_client_inflight");
+  for(i = 0 ; i < ADMIT_MAX_CLIENTS ; i++) {
+    if(admit_read(i, &c) < 0)
+      continue;
+
+    snprintf(labels, sizeof(labels), "client=\"%s\"", c.addr);
+    metrics_value(m, "hybrid_client_messages_total", labels, c.messages);
+    metrics_value(m, "hybrid_client_bytes_total", labels, c.bytes);
+    metrics_value(m, "hybrid_client_inflight", labels, c.inflight);
+    metrics_value(m, "hybrid_client_inflight_max", labels, c.inflight_max);
+    snprintf(labels, sizeof(labels), "client=\"%s\",outcome=\"sent\"", c.addr);
+    metrics_value(m, "hybrid_client_completed_total", labels, c.sent);
+    snprintf(labels, sizeof(labels), "client=\"%s\",outcome=\"failed\"", c.addr);
+    metrics_value(m, "hybrid_client_completed_total", labels, c.failed);
+    snprintf(labels, sizeof(labels), "client=\"%s\",reason=\"credits\"", c.addr);
+    metrics_value(m, "hybrid_client_rejected_total", labels, c.rejected_window);
+    snprintf(labels, sizeof(labels), "client=\"%s\",reason=\"rate\"", c.addr);
+    metrics_value(m, "hybrid_client_rejected_total", labels, c.rejected_rate);
+  }
+}
+
+static void write_metrics(const struct context *ctx, const struct hybrid_config *conf,
+                          const char *path)
+{
+  struct hybrid_airtime dsts[HYBRID_LINK_PEERS];
+  struct hybrid_counters c;
+  struct event_stats events;
+  struct metrics m;
+  char labels[ACCOUNT_NAME + 32];
+  unsigned long us[2];
+  const char *client;
+  unsigned int i, n;
+
+  if(metrics_open(&m, path) < 0) {
+    warn("cannot open %s", path);
+    return;
+  }
+  if(stats_map_path)
+    metrics_map(&m, &stats_map);
+
+  hybrid_counters(&c);
+
+  metrics_help(&m, "hybrid_tx_frames_total", "counter", "Frames sent on each medium");
+  metrics_value(&m, "hybrid_tx_frames_total", "medium=\"g3plc\"", c.tx_g3plc);
+  metrics_value(&m, "hybrid_tx_frames_total", "medium=\"lora\"", c.tx_lora);
+  metrics_help(&m, "hybrid_rx_frames_total", "counter", "Frames received from each medium");
+  metrics_value(&m, "hybrid_rx_frames_total", "medium=\"g3plc\"", c.rx_g3plc);
+  metrics_value(&m, "hybrid_rx_frames_total", "medium=\"lora\"", c.rx_lora);
+  metrics_help(&m, "hybrid_rx_duplicates_total", "counter", "Copies of a message dropped");
+  metrics_value(&m, "hybrid_rx_duplicates_total", NULL, c.rx_dups);
+  metrics_help(&m, "hybrid_rx_replaced_total", "counter", "Damaged copies replaced by a good one from either medium");
+  metrics_value(&m, "hybrid_rx_replaced_total", NULL, c.rx_replaced);
+  if(conf->flags & HYBRID_ORDER) {
+    metrics_help(&m, "hybrid_order_held_total", "counter", "Messages held for the ones before them");
+    metrics_value(&m, "hybrid_order_held_total", NULL, c.rx_held);
+    metrics_help(&m, "hybrid_order_skipped_total", "counter", "Missing messages skipped after the hold time");
+    metrics_value(&m, "hybrid_order_skipped_total", NULL, c.rx_skipped);
+    metrics_help(&m, "hybrid_order_late_total", "counter", "Messages dropped as copies or after being skipped");
+    metrics_value(&m, "hybrid_order_late_total", NULL, c.rx_late);
+    metrics_help(&m, "hybrid_order_depth", "gauge", "Messages held now");
+    metrics_value(&m, "hybrid_order_depth", NULL, c.order_depth);
+    metrics_help(&m, "hybrid_order_depth_max", "gauge", "Maximum of hybrid_order_depth");
+    metrics_value(&m, "hybrid_order_depth_max", NULL, c.order_depth_max);
+    metrics_help(&m, "hybrid_order_hold_us_total", "counter", "Time the messages were held");
+    metrics_value(&m, "hybrid_order_hold_us_total", NULL, c.order_hold_us);
+    metrics_help(&m, "hybrid_order_hold_max_us", "gauge", "Longest time a message was held");
+    metrics_value(&m, "hybrid_order_hold_max_us", NULL, c.order_hold_max_us);
+  }
+  metrics_help(&m, "hybrid_fallbacks_total", "counter", "Frames sent again on the other medium");
+  metrics_value(&m, "hybrid_fallbacks_total", NULL, c.fallbacks);
+  metrics_help(&m, "hybrid_g3plc_downs_total", "counter", "G3-PLC declared down after confirm timeouts in a row");
+  metrics_value(&m, "hybrid_g3plc_downs_total", NULL, c.g3plc_downs);
+  metrics_help(&m, "hybrid_g3plc_access_retries_total", "counter", "G3-PLC frames sent again after a busy channel");
+  metrics_value(&m, "hybrid_g3plc_access_retries_total", NULL, c.access_retries);
+  metrics_help(&m, "hybrid_g3plc_retrans_tunes_total", "counter", "Changes of the G3-PLC retransmissions to the NOACK rate");
+  metrics_value(&m, "hybrid_g3plc_retrans_tunes_total", NULL, c.retrans_tunes);
+  metrics_help(&m, "hybrid_g3plc_retrans", "gauge", "Current G3-PLC retransmissions of the modem");
+  metrics_value(&m, "hybrid_g3plc_retrans", NULL, c.g3plc_retrans);
+  metrics_help(&m, "hybrid_tx_segments_total", "counter", "Segments of long messages sent");
+  metrics_value(&m, "hybrid_tx_segments_total", NULL, c.tx_segments);
+  metrics_help(&m, "hybrid_segments_resent_total", "counter", "Segments sent again after a loss");
+  metrics_value(&m, "hybrid_segments_resent_total", NULL, c.seg_resent);
+  metrics_help(&m, "hybrid_transfer_switches_total", "counter", "Transfers resumed on the other medium");
+  metrics_value(&m, "hybrid_transfer_switches_total", NULL, c.seg_switches);
+  metrics_help(&m, "hybrid_rx_segments_total", "counter", "Segments of long messages received");
+  metrics_value(&m, "hybrid_rx_segments_total", NULL, c.rx_segments);
+  metrics_help(&m, "hybrid_rx_transfers_total", "counter", "Long messages reassembled and delivered");
+  metrics_value(&m, "hybrid_rx_transfers_total", NULL, c.rx_transfers);
+  if(cluster_enabled()) {
+    struct cluster_stats cs;
+
+    cluster_stats(&cs);
+    metrics_help(&m, "hybrid_cluster_claims_total", "counter", "Messages delivered by this gateway of the cluster");
+    metrics_value(&m, "hybrid_cluster_claims_total", NULL, cs.claims);
+    metrics_help(&m, "hybrid_cluster_duplicates_total", "counter", "Copies dropped, delivered by another gateway");
+    metrics_value(&m, "hybrid_cluster_duplicates_total", NULL, cs.duplicates);
+    metrics_help(&m, "hybrid_cluster_owned", "gauge", "Meters heard best by this gateway");
+    metrics_value(&m, "hybrid_cluster_owned", NULL, cs.owned);
+    metrics_help(&m, "hybrid_cluster_peers", "gauge", "Other gateways of the cluster");
+    metrics_value(&m, "hybrid_cluster_peers", NULL, cs.peers);
+  }
+
+  if(standby_enabled()) {
+    struct standby_stats ss;
+
+    standby_stats(&ss);
+    metrics_help(&m, "hybrid_standby_beats_total", "counter", "Heartbeats sent to or received from the other gateway");
+    metrics_value(&m, "hybrid_standby_beats_total", NULL, ss.beats);
+    metrics_help(&m, "hybrid_standby_spooled_total", "counter", "Frames of the spool mirrored to the standby");
+    metrics_value(&m, "hybrid_standby_spooled_total", "op=\"store\"", ss.stores);
+    metrics_value(&m, "hybrid_standby_spooled_total", "op=\"done\"", ss.dones);
+    metrics_help(&m, "hybrid_standby_syncs_total", "counter", "Spools mirrored again to a new standby or from a new active gateway");
+    metrics_value(&m, "hybrid_standby_syncs_total", NULL, ss.syncs);
+    metrics_help(&m, "hybrid_standby_passive", "gauge", "Whether this gateway is a standby that has not taken over");
+    metrics_value(&m, "hybrid_standby_passive", NULL, ss.passive);
+  }
+
+  if(timesync_enabled()) {
+    struct timesync_stats ts;
+
+    timesync_stats(&ts);
+    metrics_help(&m, "hybrid_timesync_beacons_total", "counter", "Time beacons sent or received");
+    metrics_value(&m, "hybrid_timesync_beacons_total", NULL, ts.beacons);
+    metrics_help(&m, "hybrid_timesync_requests_total", "counter", "Latency requests sent or answered");
+    metrics_value(&m, "hybrid_timesync_requests_total", NULL, ts.requests);
+    metrics_help(&m, "hybrid_timesync_responses_total", "counter", "Answers to the latency requests");
+    metrics_value(&m, "hybrid_timesync_responses_total", NULL, ts.responses);
+    metrics_help(&m, "hybrid_timesync_steps_total", "counter", "Offsets too far from the fit which stepped the clock");
+    metrics_value(&m, "hybrid_timesync_steps_total", NULL, ts.steps);
+    metrics_help(&m, "hybrid_timesync_latency_us", "gauge", "One-way latency from the master measured on each medium");
+    metrics_value(&m, "hybrid_timesync_latency_us", "medium=\"lora\"", ts.latency[HYBRID_SOURCE_LORA]);
+    metrics_value(&m, "hybrid_timesync_latency_us", "medium=\"g3plc\"", ts.latency[HYBRID_SOURCE_G3PLC]);
+    metrics_help(&m, "hybrid_timesync_drift_ppb", "gauge", "Absolute drift of the master clock to ours");
+    metrics_value(&m, "hybrid_timesync_drift_ppb", NULL, labs(ts.drift));
+    metrics_help(&m, "hybrid_timesync_offset_us", "gauge", "Absolute offset of the network time to our realtime clock");
+    metrics_value(&m, "hybrid_timesync_offset_us", NULL, labs(ts.offset));
+    metrics_help(&m, "hybrid_timesync_synced", "gauge", "Whether the network time is synchronized");
+    metrics_value(&m, "hybrid_timesync_synced", NULL, ts.synced);
+  }
+
+  if(bulk_enabled()) {
+    struct bulk_stats bs;
+
+    bulk_stats(&bs);
+    metrics_help(&m, "hybrid_bulk_blocks_total", "counter", "Blocks of the distributions sent or received");
+    metrics_value(&m, "hybrid_bulk_blocks_total", NULL, bs.blocks);
+    metrics_help(&m, "hybrid_bulk_repairs_total", "counter", "Blocks sent again or rebuilt from the parity");
+    metrics_value(&m, "hybrid_bulk_repairs_total", NULL, bs.repairs);
+    metrics_help(&m, "hybrid_bulk_polls_total", "counter", "Polls for NACKs sent or received");
+    metrics_value(&m, "hybrid_bulk_polls_total", NULL, bs.polls);
+    metrics_help(&m, "hybrid_bulk_nacks_total", "counter", "NACKs of missed blocks sent or received");
+    metrics_value(&m, "hybrid_bulk_nacks_total", NULL, bs.nacks);
+    metrics_help(&m, "hybrid_bulk_rounds", "gauge", "Repair rounds of the last distribution");
+    metrics_value(&m, "hybrid_bulk_rounds", NULL, bs.rounds);
+    metrics_help(&m, "hybrid_bulk_complete_total", "counter", "Distributions ended or files received");
+    metrics_value(&m, "hybrid_bulk_complete_total", NULL, bs.complete);
+  }
+
+  metrics_help(&m, "hybrid_probes_total", "counter", "Keepalives to idle links");
+  metrics_value(&m, "hybrid_probes_total", "dir=\"tx\"", c.tx_probes);
+  metrics_value(&m, "hybrid_probes_total", "dir=\"rx\"", c.rx_probes);
+  metrics_help(&m, "hybrid_g3plc_starved_total", "counter", "G3-PLC confirm timeouts blamed on UART errors");
+  metrics_value(&m, "hybrid_g3plc_starved_total", NULL, c.g3plc_starved);
+  metrics_help(&m, "hybrid_g3plc_boot_retries_total", "counter", "Segments sent again and stray bytes skipped while booting G3-PLC");
+  metrics_value(&m, "hybrid_g3plc_boot_retries_total", NULL, hybrid_g3plc_boot_retries());
+  metrics_help(&m, "hybrid_rx_dropped_total", "counter", "Frames dropped by the receive queue");
+  metrics_value(&m, "hybrid_rx_dropped_total", NULL, ring_drops(&rx_ring));
+  metrics_help(&m, "hybrid_cache_lora_total", "counter", "Sends started on LoRa as G3-PLC recently failed the destination");
+  metrics_value(&m, "hybrid_cache_lora_total", NULL, c.cache_lora);
+  metrics_help(&m, "hybrid_forwarded_total", "counter", "Messages forwarded to their next hop");
+  metrics_value(&m, "hybrid_forwarded_total", NULL, c.forwarded);
+  metrics_help(&m, "hybrid_forward_drops_total", "counter", "Messages for other nodes dropped (hop limit, queue full)");
+  metrics_value(&m, "hybrid_forward_drops_total", NULL, c.fwd_drops + ring_drops(&fwd_ring));
+  metrics_help(&m, "hybrid_airtime_us_total", "counter", "Estimated time on air of the frames sent with retransmissions");
+  metrics_value(&m, "hybrid_airtime_us_total", "medium=\"g3plc\"", c.airtime[HYBRID_SOURCE_G3PLC]);
+  metrics_value(&m, "hybrid_airtime_us_total", "medium=\"lora\"", c.airtime[HYBRID_SOURCE_LORA]);
+  n = hybrid_airtime(dsts, HYBRID_LINK_PEERS);
+  metrics_help(&m, "hybrid_dst_airtime_us_total", "counter", "Time on air of the frames sent to each destination");
+  for(i = 0 ; i < n ; i++) {
+    snprintf(labels, sizeof(labels), "addr=\"%04X\",medium=\"g3plc\"", dsts[i].addr);
+    metrics_value(&m, "hybrid_dst_airtime_us_total", labels, dsts[i].us[HYBRID_SOURCE_G3PLC]);
+    snprintf(labels, sizeof(labels), "addr=\"%04X\",medium=\"lora\"", dsts[i].addr);
+    metrics_value(&m, "hybrid_dst_airtime_us_total", labels, dsts[i].us[HYBRID_SOURCE_LORA]);
+  }
+  metrics_help(&m, "hybrid_client_airtime_us_total", "counter", "Time on air of the frames sent for each client");
+  for(i = 0 ; (client = account_read(i, us)) ; i++) {
+    snprintf(labels, sizeof(labels), "client=\"%s\",medium=\"g3plc\"", client);
+    metrics_value(&m, "hybrid_client_airtime_us_total", labels, us[HYBRID_SOURCE_G3PLC]);
+    snprintf(labels, sizeof(labels), "client=\"%s\",medium=\"lora\"", client);
+    metrics_value(&m, "hybrid_client_airtime_us_total", labels, us[HYBRID_SOURCE_LORA]);
+  }
+
+  metrics_help(&m, "hybrid_g3plc_up", "gauge", "Whether G3-PLC is booted and carries traffic");
+  metrics_value(&m, "hybrid_g3plc_up", NULL, hybrid_g3plc_ready());
+  if(conf->flags & HYBRID_DUTY) {
+    long budget = hybrid_lora_budget();
+
+    metrics_help(&m, "hybrid_lora_duty_budget_us", "gauge", "Time on air left in the LoRa duty cycle budget");
+    metrics_value(&m, "hybrid_lora_duty_budget_us", NULL, budget > 0 ? budget : 0);
+  }
+
+  metrics_help(&m, "uart_tx_bytes_total", "counter", "Bytes written to the UART");
+  metrics_help(&m, "uart_rx_bytes_total", "counter", "Bytes read from the UART");
+  metrics_help(&m, "uart_overruns_total", "counter", "Bytes lost by the serial driver");
+  metrics_help(&m, "uart_rx_queue_bytes", "gauge", "Bytes received on the UART but not read yet");
+  metrics_help(&m, "uart_rx_queue_max_bytes", "gauge", "Maximum of uart_rx_queue_bytes, also sampled after full reads");
+  metrics_help(&m, "uart_errors_total", "counter", "Bytes lost or damaged on the UART by cause");
+  if(hotplug_enabled()) {
+    metrics_help(&m, "uart_attached", "gauge", "Whether the device of the UART is plugged");
+    metrics_help(&m, "uart_detaches_total", "counter", "Times the device of the UART was unplugged");
+  }
+  write_uart_metrics(&m, ctx->g3plc_uart_fd, "g3plc");
+  write_uart_metrics(&m, ctx->lora_uart_fd, "lora");
+  for(i = 0 ; i < modules_count() ; i++) {
+    char medium[32];
+
+    snprintf(medium, sizeof(medium), "lora%u", i + 1);
+    write_uart_metrics(&m, modules_fd(i), medium);
+  }
+
+  event_stats(&events);
+  metrics_help(&m, "event_syscalls_total", "counter", "System calls of the UART event loop");
+  metrics_value(&m, "event_syscalls_total", NULL, events.syscalls);
+  metrics_help(&m, "event_reads_total", "counter", "UART reads dispatched by the event loop");
+  metrics_value(&m, "event_reads_total", NULL, events.reads);
+
+  write_clients(&m);
+
+  metrics_wakeups(&m);
+
+  if(metrics_close(&m) < 0)
+    warn("cannot write %s", path);
+}
+
+static void open_stats_map(void)
+{
+  if(statmap_open(&stats_map, stats_map_path, STATMAP_MAX) < 0)
+    err(EXIT_FAILURE, "cannot create %s", stats_map_path);
+}
+
+static void * metrics_thread_func(void *p)
+{
+  const struct context       *ctx  = ((struct io_thread_data *)p)->ctx;
+  const struct hybrid_config *conf = ((struct io_thread_data *)p)->config;
+  unsigned int tick, ticks = stats_map_path ? METRICS_INTERVAL * 1000 / STATS_MAP_INTERVAL : 1;
+
+  /* The metrics file is written on the first tick of each
+     interval, the statistics map is updated on every tick.
+     Without the map each tick is a whole interval. */
+  for(tick = 0 ; ; tick = (tick + 1) % ticks) {
+    if(metrics_path || stats_map_path)
+      write_metrics(ctx, conf, tick ? NULL : metrics_path);
+    if(!tick && trace_path && trace_write(trace_path) < 0)
+      warn("cannot write %s", trace_path);
+    if(stats_map_path)
+      usleep(STATS_MAP_INTERVAL * 1000);
+    else
+      sleep(METRICS_INTERVAL);
+  }
+
+  return NULL;
+}
+
+/* The messages of the time sync and of the bulk distribution
+   never reach the mode, the others are left to the cluster. */
+static int accept_filter(uint16_t src, const void *payload, unsigned int size,
+                         int status, const struct hybrid_meta *meta, void *data)
+{
+  UNUSED(data);
+
+  if(status)
+    return 1;
+  if(timesync_input(src, payload, size, meta))
+    return 0;
+  if(bulk_input(src, payload, size))
+    return 0;
+  if(cluster_group)
+    return cluster_accept(src, payload, size, meta->source, meta->lqi);
+  return 1;
+}
+
+static void * probe_thread_func(void *p)
+{
+  unsigned long busy;
+
+  UNUSED(p);
+
+  while(1) {
+    /* the active gateway probes the links (see standby.h) */
+    if(standby_passive())
+      usleep(PROBE_CHECK * 1000);
+    else if(hybrid_probe(probe_age, &busy) < 0)
+      usleep(busy ? busy : PROBE_CHECK * 1000);
+    else
+      usleep(busy * 1000 / probe_share);
+  }
+
+  return NULL;
+}
+
 static void start_io_threads(const struct context *ctx,
                              const struct hybrid_config *hybrid)
 {
-  pthread_t output_thread, input_thread_lora, input_thread_g3plc;
+  pthread_t output_thread, input_thread, delivery_thread, metrics_thread, boot_thread;
+  pthread_t forward_thread, probe_thread;
   int err;
 
   struct io_thread_data data = (struct io_thread_data){
@@ -157,13 +1010,28 @@ static void start_io_threads(const struct context *ctx,
     .config = hybrid
   };
 
-  thread_block_signals();
+  if(event_init(event_backend) != event_backend)
+    event_backend = EVENT_EPOLL;
+  IF_VERBOSE(ctx, printf("Event loop uses %s.\n",
+                         event_backend == EVENT_URING ? "io_uring" : "epoll"));
 
   err  = pthread_create(&output_thread, NULL, output_thread_func, &data);
-  err |= pthread_create(&input_thread_lora, NULL, input_thread_lora_func, &data);
-  err |= pthread_create(&input_thread_g3plc, NULL, input_thread_g3plc_func, &data);
+  err |= pthread_create(&input_thread, NULL, input_thread_func, &data);
+  err |= pthread_create(&delivery_thread, NULL, delivery_thread_func, &data);
+  err |= pthread_create(&boot_thread, NULL, g3plc_boot_thread_func, &data);
+  if(hybrid->flags & (HYBRID_ROUTE | HYBRID_TRANSPORT))
+    err |= pthread_create(&forward_thread, NULL, forward_thread_func, &data);
+  if(stats_map_path)
+    open_stats_map();
+  if(metrics_path || stats_map_path || trace_path)
+    err |= pthread_create(&metrics_thread, NULL, metrics_thread_func, &data);
+  if(probe_age)
+    err |= pthread_create(&probe_thread, NULL, probe_thread_func, &data);
   if(err)
     errx(EXIT_FAILURE, "cannot create threads");
+  timesync_start();
+  bulk_start();
+  hotplug_start();
 
   pthread_join(output_thread, NULL);
 }
@@ -188,11 +1056,107 @@ static int set_uart_g3plc_speed(unsigned int speed)
   return set_uart_speed(&ctx.g3plc_tty, ctx.g3plc_uart_fd, speed);
 }
 
+/* Each medium has its own timer. */
+static struct timer lora_timer;
+static struct timer g3plc_timer;
+
+static void lora_start_timer(unsigned int us)
+{
+  timer_start(&lora_timer, us);
+}
+
+static void lora_stop_timer(void)
+{
+  timer_stop(&lora_timer);
+}
+
+static void lora_wait_timer(void)
+{
+  timer_wait(&lora_timer);
+}
+
+static void g3plc_start_timer(unsigned int us)
+{
+  timer_start(&g3plc_timer, us);
+}
+
+static void g3plc_stop_timer(void)
+{
+  timer_stop(&g3plc_timer);
+}
+
+static void g3plc_wait_timer(void)
+{
+  timer_wait(&g3plc_timer);
+}
+
 static void usleep_UL(unsigned long duration)
 {
   usleep(duration);
 }
 
+/* Static dictionary shared by both ends for the
+   compression of our messages (see --dict). */
+static struct lz_dict dict;
+
+static unsigned int compress(const void *in, unsigned int size, void *out, unsigned int max)
+{
+  return lz_compress(&dict, in, size, out, max);
+}
+
+static int decompress(const void *in, unsigned int size, void *out, unsigned int max)
+{
+  return lz_decompress(&dict, in, size, out, max);
+}
+
+/* Only the end of the dictionary is reachable
+   so this is the part we keep in memory. */
+static void load_dict(const char *path)
+{
+  static unsigned char buf[LZ_MAX_DICT];
+  unsigned char chunk[LZ_MAX_DICT];
+  size_t n;
+  FILE *fp;
+
+  fp = fopen(path, "r");
+  if(!fp)
+    err(EXIT_FAILURE, "cannot open dictionary");
+
+  dict = (struct lz_dict){ .buf = buf, .size = 0 };
+  while((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+    if(dict.size + n > sizeof(buf)) {
+      unsigned int keep = sizeof(buf) - n;
+
+      memmove(buf, buf + dict.size - keep, keep);
+      dict.size = keep;
+    }
+    memcpy(buf + dict.size, chunk, n);
+    dict.size += n;
+  }
+
+  if(ferror(fp))
+    err(EXIT_FAILURE, "cannot read dictionary");
+  fclose(fp);
+}
+
+static void display_codec_stats(void)
+{
+  struct hybrid_codec_stats stats;
+
+  hybrid_codec_stats(&stats);
+
+  printf("Compression:\n");
+  printf(" messages                  : %lu (%lu compressed, %lu deltas)\n",
+         stats.messages, stats.compressed, stats.deltas);
+  printf(" bytes                     : %lu -> %lu", stats.bytes_in, stats.bytes_out);
+  if(stats.bytes_in)
+    printf(" (%lu%%)", stats.bytes_out * 100 / stats.bytes_in);
+  printf("\n");
+  printf(" compression time          : %lu us\n", stats.compress_us);
+  printf(" decompression time        : %lu us\n", stats.decompress_us);
+  printf(" deltas without reference  : %lu\n", stats.delta_misses);
+}
+
 static void g3plc_boot_start(void)
 {
   printf("\n");
@@ -220,6 +1184,34 @@ static uint8_t rnd_seqno(void)
   return arc4random_uniform(0xff);
 }
 
+/* LoRaMAC state kept across restarts (see loramac_state). The file
+   is mapped so that the driver updates it with plain stores, these
+   reach the file through the page cache even when the driver is
+   killed. Only a power loss may leave an older state. */
+static const char *lora_state_path;
+static const char *control_path;
+
+static struct loramac_state * open_lora_state(const char *path)
+{
+  struct loramac_state *state;
+  int fd;
+
+  fd = open(path, O_RDWR | O_CREAT, 0644);
+  if(fd < 0)
+    err(EXIT_FAILURE, "cannot open %s", path);
+
+  /* a new file reads as zeroes, which is a new state */
+  if(ftruncate(fd, sizeof(struct loramac_state)) < 0)
+    err(EXIT_FAILURE, "cannot resize %s", path);
+
+  state = mmap(NULL, sizeof(struct loramac_state), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(state == MAP_FAILED)
+    err(EXIT_FAILURE, "cannot map %s", path);
+  close(fd);
+
+  return state;
+}
+
 /* Display a summary of the MAC layer configuration. */
 static void display_summary(const struct iface_mode *mode,
                             const struct hybrid_config *conf,
@@ -230,6 +1222,7 @@ static void display_summary(const struct iface_mode *mode,
                             const char *speed)
 {
   unsigned long flag;
+  unsigned int i;
 
   printf(PACKAGE_VERSION "\n");
   printf("Using %s mode on %s (LoRa) and %s (G3PLC) @%s bauds.\n", mode->name, lora_dev, g3plc_dev, speed);
@@ -241,13 +1234,45 @@ static void display_summary(const struct iface_mode *mode,
   printf(" destination MAC address   : %04X\n", dst_mac);
   printf(" CMD timeout               : %d us\n", conf->g3plc.timeout);
   printf(" Max. G3PLC retransmissions: %d tries\n", conf->g3plc.retrans);
+  printf(" G3PLC breaker             : %u timeouts\n", conf->g3plc.breaker);
+  printf(" G3PLC access budget       : %u us\n", conf->g3plc.access_budget);
+  printf(" G3PLC extended address    : %016llX\n", (unsigned long long)conf->g3plc.ext_address);
+  if(conf->flags & HYBRID_TUNE)
+    printf(" G3PLC retrans. bounds     : %u to %u tries\n", conf->g3plc.retrans_min, conf->g3plc.retrans_max);
   printf(" LoRa ACK timeout          : %d us\n", conf->lora.timeout);
   printf(" LoRa SIFS                 : %d us\n", conf->lora.sifs);
+  for(i = 0 ; i < modules_count() ; i++)
+    printf(" LoRa module %u             : %s\n", i + 1, modules_device(i));
+  if(conf->flags & HYBRID_DIVERSITY)
+    printf(" Diversity window          : %u us\n",
+           conf->diversity_us ? conf->diversity_us : HYBRID_DIVERSITY_WINDOW);
+  if(conf->flags & HYBRID_ORDER)
+    printf(" Order hold time           : %u us\n",
+           conf->order_us ? conf->order_us : HYBRID_ORDER_WAIT);
+  if(time_master)
+    printf(" Time sync                 : master, beacon every %lu ms\n", time_master / 1000);
+  else if(time_follow)
+    printf(" Time sync                 : node\n");
+  if(bulk_path)
+    printf(" Bulk distribution         : %s, parity every %u blocks\n", bulk_path, bulk_fec);
+  else if(bulk_dir)
+    printf(" Bulk distribution         : into %s\n", bulk_dir);
   printf(" flags                     : 0x%08lx\n", conf->flags);
-  for(flag = 0x1 ; flag <= HYBRID_NOACK ; flag <<= 1) {
+  for(flag = 0x1 ; flag <= HYBRID_ORDER ; flag <<= 1) {
     if(conf->flags & flag)
       printf("  - %s\n", hybrid_flag2str(flag));
   }
+  if(conf->flags & HYBRID_DUTY) {
+    const struct duty_band *band = duty_band_lookup(conf->lora.frequency);
+
+    printf(" LoRa radio                : SF%u %lu kHz CR 4/%u\n",
+           conf->lora.radio.sf, conf->lora.radio.bw / 1000, conf->lora.radio.cr + 4);
+    if(band)
+      printf(" LoRa duty cycle           : %u.%u%% (%s)\n",
+             band->permille / 10, band->permille % 10, band->name);
+  }
+  if(conf->flags & HYBRID_ROUTE)
+    printf(" routes                    : %u\n", conf->route_count);
 }
 
 static void print_help(const char *name, const char *mode_name,
@@ -262,14 +1287,59 @@ static void print_help(const char *name, const char *mode_name,
 #endif /* COMMIT */
     { 'i', "invalid",         "Do not filter invalid packets (packet header, CRC)" },
     { 'a', "no-ack",          "Do not answer nor expect ACKs" },
+    { 0,   "race",            "Send on both media at once (first success wins)" },
+    { 0,   "adaptive",        "Try the medium with the best link statistics first" },
+    { 0,   "cache",           "Try the medium that last delivered to the destination first" },
+    { 0,   "transport",       "Segment long messages with end-to-end ACK across media" },
+    { 0,   "dedup",           "Number messages and drop their copies from either medium" },
+    { 0,   "diversity",       "Hold damaged messages for a good copy from either medium (implies dedup)" },
+    { 0,   "diversity-window", "Microseconds a damaged message waits for a good copy (default 200000)" },
+    { 0,   "order",           "Hand on the messages of each origin in order (implies dedup)" },
+    { 0,   "order-wait",      "Microseconds a message waits for the ones before it (default 1000000)" },
+    { 0,   "balance",         "Split bulk traffic across both media (with a mode that sends concurrently)" },
+    { 0,   "lora-share",      "Permille of the bulk bytes sent on LoRa (default: measured)" },
+    { 0,   "compress",        "Compress LoRa messages when they shrink" },
+    { 0,   "dict",            "Static compression dictionary (file)" },
+    { 0,   "delta",           "Send LoRa messages as deltas of the last one acknowledged" },
+    { 0,   "delta-resync",    "Deltas between full LoRa messages (default 16)" },
+    { 0,   "duty",            "Keep LoRa within the EU868 duty cycle of the channel frequency in MHz" },
+    { 0,   "radio",           "LoRa SF:BW[:CR] for the time on air (BW in kHz, default 7:125:1)" },
+    { 0,   "route",           "Route DST:NEXT-HOP[:lora|g3plc] and forward messages to other nodes (repeatable)" },
+    { 0,   "relay",           "Forward messages to other nodes without routes of our own" },
     { 't', "ack-timeout",     "LoRa ACK timeout in microseconds (default 4s)" },
     { 'T', "cmd-timeout",     "G3-PLC command timeout (default 1s)" },
+    { 0,   "breaker",         "G3-PLC confirm timeouts in a row before restarting the modem (default 3, 0 disables)" },
+    { 0,   "tune-retrans",    "Tune the G3-PLC retransmissions to the NOACK rate within MIN:MAX" },
+    { 0,   "access-budget",   "Microseconds to retry G3-PLC on a busy channel before LoRa (default 200ms, 0 disables)" },
+    { 0,   "ext-address",     "G3-PLC extended address (hex., the source may be FFFE for none)" },
     { 's', "sifs",            "Short Inter Frame Spacing time in microseconds (default 2s)" },
     { 'S', "seqno",           "Initial sequence number (default: random)" },
+    { 0,   "control",         "Change the tunables at runtime through a Unix socket" },
+    { 0,   "lora-state",      "Keep the LoRaMAC sequence number and duplicate filter in this file across restarts" },
     { 'r', "retransmissions", "Maximum number of retransmissions (default 3)" },
     { 'B', "baud",            "Specify the baud rate (default 9600)" },
     { 'd', "destination",     "Destination MAC (hex. short address, default to broadcast)" },
     { 0,   "reset",           "RESET RPi GPIO" },
+    { 0,   "reset-pulse",     "Low time of the RESET GPIO in microseconds (default 30000)" },
+    { 0,   "gpio-chip",       "Drive the GPIOs through a character device (e.g. /dev/gpiochip0)" },
+    { 0,   "cluster",         "Share the dedup and the meters with the gateways of this multicast GROUP[:PORT]" },
+    { 0,   "cluster-id",      "Identifier of this gateway in the cluster (default: low byte of the source)" },
+    { 0,   "cluster-window",  "Milliseconds a copy is recognized as delivered by another gateway (default 2000)" },
+    { 0,   "time-master",     "Broadcast the network time every this many ms (gateway)" },
+    { 0,   "time-sync",       "Follow the network time of the master heard first" },
+    { 0,   "bulk-send",       "Broadcast this file to the nodes and repair it from their NACKs" },
+    { 0,   "bulk-fec",        "Send a parity block every this many blocks (default 0, none)" },
+    { 0,   "bulk-window",     "Milliseconds the nodes are given to send their NACKs (default 5000)" },
+    { 0,   "bulk-dir",        "Receive the distributions in this directory" },
+    { 0,   "probe",           "Send keepalives to the links idle for this many ms" },
+    { 0,   "probe-share",     "Permille of the time the keepalives may use (default 10)" },
+    { 0,   "metrics",         "Write Prometheus metrics to a file every 10s" },
+    { 0,   "stats-map",       "Publish live statistics in a file to map (e.g. next to the driver socket in /run)" },
+    { 0,   "trace",           "Write the steps of the last sampled messages sent to a file every 10s (unix mode)" },
+    { 0,   "trace-rate",      "Sample one message sent in this many (default 100)" },
+    { 0,   "io-uring",        "Read the UARTs with io_uring (falls back to epoll)" },
+    { 0,   "hotplug",         "Wait for an unplugged USB modem to come back instead of exiting" },
+    { 0,   "lora-module",     "Drive another LoRa module DEVICE:ADDR[,ADDR...] for these nodes" },
     { 0, NULL, NULL }
   };
 
@@ -281,20 +1351,29 @@ static void print_help(const char *name, const char *mode_name,
   }
 }
 
+#ifdef LIBWEREMAC
+int weremac_run(int argc, char *argv[])
+#else
 int main(int argc, char *argv[])
+#endif /* LIBWEREMAC */
 {
   const char *prog_name;
   const char *lora_dev, *g3plc_dev;
   const char *speed_str = strdup("9600");
   struct hybrid_config hybrid = {
-    .start_timer          = start_timer,
-    .stop_timer           = stop_timer,
-    .wait_timer           = wait_timer,
+    .lora_start_timer     = lora_start_timer,
+    .lora_stop_timer      = lora_stop_timer,
+    .lora_wait_timer      = lora_wait_timer,
+    .g3plc_start_timer    = g3plc_start_timer,
+    .g3plc_stop_timer     = g3plc_stop_timer,
+    .g3plc_wait_timer     = g3plc_wait_timer,
     .uart_lora_send       = uart_lora_send,
     .uart_g3plc_send      = uart_g3plc_send,
     .uart_g3plc_read      = uart_g3plc_read,
-    .lock                 = lock,
-    .unlock               = unlock,
+    .lora_lock            = lock,
+    .lora_unlock          = unlock,
+    .g3plc_lock           = g3plc_lock,
+    .g3plc_unlock         = g3plc_unlock,
     .set_uart_g3plc_speed = set_uart_g3plc_speed,
     .lora_recv_frame      = hybrid_lora_recv_frame,
     .g3plc_recv_frame     = hybrid_g3plc_recv_frame,
@@ -305,28 +1384,41 @@ int main(int argc, char *argv[])
     .htonl                = htonl,
     .ntohl                = ntohl,
     .usleep               = usleep_UL,
+    .clock                = clock_us,
+    .compress             = compress,
+    .decompress           = decompress,
+    .race                 = race,
     .g3plc_boot_start     = g3plc_boot_start,
     .g3plc_boot_progress  = g3plc_boot_progress,
     .g3plc_boot_end       = g3plc_boot_end,
+    .g3plc_recover        = g3plc_recover,
+    .g3plc_lost           = g3plc_lost,
+    .charge               = charge_airtime,
+    .forward              = queue_forward,
+    .reply                = queue_reply,
 
     .lora = (struct lora_opt){
       .seqno   = rnd_seqno(),
       .retrans = 3,
       .timeout = 4000000, /* 4 seconds */
       .sifs    = 2000000, /* 2 seconds */
+      .radio   = DUTY_RADIO_DEFAULT,
     },
     .g3plc = (struct g3plc_opt){
       .bandplan       = G3PLC_BP_CENELEC_A, /* FIXME: option */
       .pan_id         = 0xAAAA,             /* FIXME: option */
-      .ext_address    = 0,                  /* FIXME: option */
+      .ext_address    = 0,
       .retrans        = 5,
       .timeout        = 1000000,  /* 1 second */
+      .breaker        = 3,
+      .access_budget  = 200000, /* 200 ms */
     },
     .flags          = 0,
     .data           = &ctx
   };
   speed_t speed    = B9600;
   int exit_status  = EXIT_FAILURE;
+  char *end;
   int err, val;
 
   enum opt {
@@ -334,6 +1426,51 @@ int main(int argc, char *argv[])
     OPT_IRQ,
     OPT_CTS,
     OPT_RESET,
+    OPT_RESET_PULSE,
+    OPT_GPIO_CHIP,
+    OPT_RACE,
+    OPT_ADAPTIVE,
+    OPT_DEDUP,
+    OPT_DIVERSITY,
+    OPT_DIVERSITY_WINDOW,
+    OPT_ORDER,
+    OPT_ORDER_WAIT,
+    OPT_BALANCE,
+    OPT_LORA_SHARE,
+    OPT_COMPRESS,
+    OPT_DICT,
+    OPT_METRICS,
+    OPT_STATS_MAP,
+    OPT_TRACE,
+    OPT_TRACE_RATE,
+    OPT_DUTY,
+    OPT_RADIO,
+    OPT_BREAKER,
+    OPT_ACCESS_BUDGET,
+    OPT_TUNE_RETRANS,
+    OPT_IO_URING,
+    OPT_HOTPLUG,
+    OPT_LORA_MODULE,
+    OPT_LORA_STATE,
+    OPT_ROUTE,
+    OPT_RELAY,
+    OPT_CACHE,
+    OPT_TRANSPORT,
+    OPT_EXT_ADDRESS,
+    OPT_TIME_MASTER,
+    OPT_TIME_SYNC,
+    OPT_BULK_SEND,
+    OPT_BULK_FEC,
+    OPT_BULK_WINDOW,
+    OPT_BULK_DIR,
+    OPT_PROBE,
+    OPT_PROBE_SHARE,
+    OPT_CLUSTER,
+    OPT_CLUSTER_ID,
+    OPT_CLUSTER_WINDOW,
+    OPT_DELTA,
+    OPT_DELTA_RESYNC,
+    OPT_CONTROL,
   };
 
   /* Common options used by all modes. */
@@ -348,6 +1485,25 @@ int main(int argc, char *argv[])
     /* flags */
     { "invalid", no_argument, NULL, 'i' },
     { "no-ack", no_argument, NULL, 'a' },
+    { "race", no_argument, NULL, OPT_RACE },
+    { "adaptive", no_argument, NULL, OPT_ADAPTIVE },
+    { "cache", no_argument, NULL, OPT_CACHE },
+    { "transport", no_argument, NULL, OPT_TRANSPORT },
+    { "dedup", no_argument, NULL, OPT_DEDUP },
+    { "diversity", no_argument, NULL, OPT_DIVERSITY },
+    { "diversity-window", required_argument, NULL, OPT_DIVERSITY_WINDOW },
+    { "order", no_argument, NULL, OPT_ORDER },
+    { "order-wait", required_argument, NULL, OPT_ORDER_WAIT },
+    { "balance", no_argument, NULL, OPT_BALANCE },
+    { "lora-share", required_argument, NULL, OPT_LORA_SHARE },
+    { "compress", no_argument, NULL, OPT_COMPRESS },
+    { "dict", required_argument, NULL, OPT_DICT },
+    { "duty", required_argument, NULL, OPT_DUTY },
+    { "radio", required_argument, NULL, OPT_RADIO },
+    { "breaker", required_argument, NULL, OPT_BREAKER },
+    { "access-budget", required_argument, NULL, OPT_ACCESS_BUDGET },
+    { "tune-retrans", required_argument, NULL, OPT_TUNE_RETRANS },
+    { "ext-address", required_argument, NULL, OPT_EXT_ADDRESS },
 
     { "ack-timeout", required_argument, NULL, 't' },
     { "cmd-timeout", required_argument, NULL, 'T' },
@@ -359,6 +1515,32 @@ int main(int argc, char *argv[])
 
     /* GPIO configuration */
     { "reset", required_argument, NULL, OPT_RESET },
+    { "reset-pulse", required_argument, NULL, OPT_RESET_PULSE },
+    { "gpio-chip", required_argument, NULL, OPT_GPIO_CHIP },
+    { "cluster", required_argument, NULL, OPT_CLUSTER },
+    { "cluster-id", required_argument, NULL, OPT_CLUSTER_ID },
+    { "cluster-window", required_argument, NULL, OPT_CLUSTER_WINDOW },
+    { "delta", no_argument, NULL, OPT_DELTA },
+    { "delta-resync", required_argument, NULL, OPT_DELTA_RESYNC },
+    { "time-master", required_argument, NULL, OPT_TIME_MASTER },
+    { "time-sync", no_argument, NULL, OPT_TIME_SYNC },
+    { "bulk-send", required_argument, NULL, OPT_BULK_SEND },
+    { "bulk-fec", required_argument, NULL, OPT_BULK_FEC },
+    { "bulk-window", required_argument, NULL, OPT_BULK_WINDOW },
+    { "bulk-dir", required_argument, NULL, OPT_BULK_DIR },
+    { "probe", required_argument, NULL, OPT_PROBE },
+    { "probe-share", required_argument, NULL, OPT_PROBE_SHARE },
+    { "metrics", required_argument, NULL, OPT_METRICS },
+    { "stats-map", required_argument, NULL, OPT_STATS_MAP },
+    { "trace", required_argument, NULL, OPT_TRACE },
+    { "trace-rate", required_argument, NULL, OPT_TRACE_RATE },
+    { "io-uring", no_argument, NULL, OPT_IO_URING },
+    { "hotplug", no_argument, NULL, OPT_HOTPLUG },
+    { "lora-module", required_argument, NULL, OPT_LORA_MODULE },
+    { "lora-state", required_argument, NULL, OPT_LORA_STATE },
+    { "control", required_argument, NULL, OPT_CONTROL },
+    { "route", required_argument, NULL, OPT_ROUTE },
+    { "relay", no_argument, NULL, OPT_RELAY },
     { NULL, 0, NULL, 0 }
   };
 
@@ -389,6 +1571,14 @@ int main(int argc, char *argv[])
       else if(!rpi_gpio_check(ctx.gpio_reset))
         errx(EXIT_FAILURE, "invalid RESET GPIO number");
       break;
+    case OPT_RESET_PULSE:
+      hybrid.reset_pulse = xatou(optarg, &err);
+      if(err || !hybrid.reset_pulse)
+        errx(EXIT_FAILURE, "cannot parse reset pulse");
+      break;
+    case OPT_GPIO_CHIP:
+      rpi_gpio_use_chip(optarg);
+      break;
     case 'v':
       ctx.verbose = 1;
       break;
@@ -398,9 +1588,173 @@ int main(int argc, char *argv[])
     case 'a':
       hybrid.flags |= G3PLC_NOACK;
       break;
+    case OPT_RACE:
+      hybrid.flags |= HYBRID_RACE;
+      break;
+    case OPT_ADAPTIVE:
+      hybrid.flags |= HYBRID_ADAPTIVE;
+      break;
+    case OPT_CACHE:
+      hybrid.flags |= HYBRID_CACHE;
+      break;
+    case OPT_TRANSPORT:
+      hybrid.flags |= HYBRID_TRANSPORT;
+      break;
+    case OPT_DEDUP:
+      hybrid.flags |= HYBRID_DEDUP;
+      break;
+    case OPT_DIVERSITY:
+      hybrid.flags |= HYBRID_DIVERSITY;
+      break;
+    case OPT_DIVERSITY_WINDOW:
+      hybrid.diversity_us = xatou(optarg, &err);
+      if(err || !hybrid.diversity_us)
+        errx(EXIT_FAILURE, "diversity window expects microseconds");
+      break;
+    case OPT_ORDER:
+      hybrid.flags |= HYBRID_ORDER;
+      break;
+    case OPT_ORDER_WAIT:
+      hybrid.order_us = xatou(optarg, &err);
+      if(err || !hybrid.order_us)
+        errx(EXIT_FAILURE, "order wait expects microseconds");
+      break;
+    case OPT_BALANCE:
+      hybrid.flags |= HYBRID_BALANCE;
+      break;
+    case OPT_LORA_SHARE:
+      hybrid.lora.share = xatou(optarg, &err);
+      if(err || hybrid.lora.share > 1000)
+        errx(EXIT_FAILURE, "LoRa share expects 0 to 1000 permille");
+      break;
+    case OPT_COMPRESS:
+      hybrid.flags |= HYBRID_COMPRESS;
+      break;
+    case OPT_DICT:
+      load_dict(optarg);
+      break;
+    case OPT_DELTA:
+      hybrid.flags |= HYBRID_DELTA;
+      break;
+    case OPT_DELTA_RESYNC:
+      hybrid.lora.resync = xatou(optarg, &err);
+      if(err || !hybrid.lora.resync)
+        errx(EXIT_FAILURE, "delta resync expects a number of deltas");
+      break;
+    case OPT_DUTY:
+      hybrid.lora.frequency = strtod(optarg, NULL) * 1000000 + 0.5;
+      if(!duty_band_lookup(hybrid.lora.frequency))
+        errx(EXIT_FAILURE, "%s MHz is outside of the EU868 sub-bands", optarg);
+      hybrid.flags |= HYBRID_DUTY;
+      break;
+    case OPT_RADIO:
+      parse_radio(&hybrid.lora.radio, optarg);
+      break;
+    case OPT_BREAKER:
+      hybrid.g3plc.breaker = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse breaker value");
+      break;
+    case OPT_ACCESS_BUDGET:
+      hybrid.g3plc.access_budget = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse access budget value");
+      break;
+    case OPT_EXT_ADDRESS:
+      errno = 0;
+      hybrid.g3plc.ext_address = strtoull(optarg, &end, 16);
+      if(errno || end == optarg || *end != '\0')
+        errx(EXIT_FAILURE, "cannot parse extended address");
+      break;
+    case OPT_TUNE_RETRANS:
+      parse_tune(&hybrid.g3plc, optarg);
+      hybrid.flags |= HYBRID_TUNE;
+      break;
+    case OPT_CLUSTER:
+      cluster_group = optarg;
+      break;
+    case OPT_CLUSTER_ID:
+      cluster_id = xatou(optarg, &err);
+      if(err || cluster_id > 255)
+        errx(EXIT_FAILURE, "cluster identifier expects 0 to 255");
+      break;
+    case OPT_CLUSTER_WINDOW:
+      cluster_window = xatou(optarg, &err);
+      if(err || !cluster_window)
+        errx(EXIT_FAILURE, "invalid cluster window");
+      break;
+    case OPT_TIME_MASTER:
+      time_master = xatou(optarg, &err) * 1000UL;
+      if(err || !time_master)
+        errx(EXIT_FAILURE, "invalid time beacon period");
+      break;
+    case OPT_TIME_SYNC:
+      time_follow = 1;
+      break;
+    case OPT_BULK_SEND:
+      bulk_path = optarg;
+      break;
+    case OPT_BULK_FEC:
+      bulk_fec = xatou(optarg, &err);
+      if(err || bulk_fec > BULK_MAX_FEC)
+        errx(EXIT_FAILURE, "bulk FEC expects 0 to %d blocks", BULK_MAX_FEC);
+      break;
+    case OPT_BULK_WINDOW:
+      bulk_window = xatou(optarg, &err) * 1000UL;
+      if(err || !bulk_window)
+        errx(EXIT_FAILURE, "invalid NACK window");
+      break;
+    case OPT_BULK_DIR:
+      bulk_dir = optarg;
+      break;
+    case OPT_PROBE:
+      probe_age = xatou(optarg, &err) * 1000UL;
+      if(err || !probe_age)
+        errx(EXIT_FAILURE, "invalid probe age");
+      break;
+    case OPT_PROBE_SHARE:
+      probe_share = xatou(optarg, &err);
+      if(err || !probe_share || probe_share > 1000)
+        errx(EXIT_FAILURE, "probe share expects 1 to 1000 permille");
+      break;
+    case OPT_METRICS:
+      metrics_path = optarg;
+      break;
+    case OPT_STATS_MAP:
+      stats_map_path = optarg;
+      break;
+    case OPT_TRACE:
+      trace_path = optarg;
+      break;
+    case OPT_TRACE_RATE:
+      trace_rate = xatou(optarg, &err);
+      if(err || !trace_rate)
+        errx(EXIT_FAILURE, "trace rate expects a number of messages");
+      break;
+    case OPT_IO_URING:
+      event_backend = EVENT_URING;
+      break;
+    case OPT_HOTPLUG:
+      hotplug = 1;
+      break;
+    case OPT_LORA_MODULE:
+      modules_add(optarg);
+      break;
+    case OPT_LORA_STATE:
+      lora_state_path = optarg;
+      break;
+    case OPT_ROUTE:
+      parse_route(&hybrid, optarg);
+      break;
+    case OPT_RELAY:
+      hybrid.flags |= HYBRID_ROUTE;
+      break;
     case 'd':
       ctx.dst_mac = strtol(optarg, NULL, 16);
       break;
+    case OPT_CONTROL:
+      control_path = optarg;
+      break;
     case 't':
       /* FIXME: should understand a time suffix */
       hybrid.lora.timeout = xatou(optarg, &err);
@@ -425,6 +1779,7 @@ int main(int argc, char *argv[])
       else if(val > 0xff)
         errx(EXIT_FAILURE, "sequence number too large");
       hybrid.lora.seqno = val;
+      break;
     case 'r':
       hybrid.lora.retrans = hybrid.g3plc.retrans = xatou(optarg, &err);
       if(err)
@@ -478,34 +1833,93 @@ int main(int argc, char *argv[])
                                    speed_str));
 
   initialize_driver(&ctx, lora_dev, g3plc_dev, speed);
+  if(hotplug) {
+    hotplug_watch(ctx.lora_uart_fd, lora_dev, &ctx.lora_tty, lora_uart_attached, NULL);
+    hotplug_watch(ctx.g3plc_uart_fd, g3plc_dev, &ctx.g3plc_tty, g3plc_uart_attached, NULL);
+  }
+  modules_init(&hybrid, speed, hotplug);
   iface_mode.init(&ctx, &hybrid);
 
-  /* Block the SIGALRM signal so that it is
-     not received by the main thread when
-     a timer is triggered. */
-  thread_block_signals();
+  /* Interpose the receive queue between the driver and the
+     mode callback. A mode that takes batches gets them from the
+     input thread since it already pays its costs once per burst. */
+  ring_init(&rx_ring, RX_RING_SIZE, sizeof(struct rx_frame));
+  ring_init(&fwd_ring, FWD_RING_SIZE, sizeof(struct fwd_msg));
+  mode_cb_recv        = hybrid.cb_recv;
+  mode_cb_recv_meta   = hybrid.cb_recv_meta;
+  if(!hybrid.cb_recv_batch)
+    hybrid.cb_recv_meta = queue_recv;
+  if(time_master && time_follow)
+    errx(EXIT_FAILURE, "a master does not follow another one");
+  if(time_master)
+    timesync_master(hybrid.mac_address, time_master, hybrid.g3plc.bandplan);
+  else if(time_follow)
+    timesync_follow(hybrid.mac_address, hybrid.g3plc.bandplan);
+  if(cluster_group)
+    cluster_open(cluster_group, cluster_id < 0 ? hybrid.mac_address & 0xff : cluster_id,
+                 cluster_window);
+  if(bulk_path && bulk_dir)
+    errx(EXIT_FAILURE, "a source does not receive the distributions");
+  if(bulk_path)
+    bulk_source(hybrid.mac_address, bulk_path, bulk_fec, bulk_window);
+  else if(bulk_dir)
+    bulk_receive(hybrid.mac_address, bulk_dir);
+  if(cluster_group || timesync_enabled() || bulk_enabled())
+    hybrid.accept = accept_filter;
+  if(trace_path) {
+    trace_init(trace_rate);
+    hybrid.trace = trace_hybrid;
+  }
+  if(lora_state_path)
+    hybrid.lora.state = open_lora_state(lora_state_path);
 
   /* Initialize hybrid layer.
      The interface mode still has to configure
      the hybrid configuration structure. That
      is why we initialize the MAC layer after
      the mode. */
+  timer_init(&lora_timer);
+  timer_init(&g3plc_timer);
+  sem_init(&g3plc_down, 0, 0);
+
   err = hybrid_init(&hybrid);
-  if(err < 0)
+  switch(err) {
+  case 0:
+    break;
+  case HYBRID_ERR_LORA:
+    errx(EXIT_FAILURE, "cannot initialize LoRaMAC: %s",
+                       loramac_init2str(lora_errno));
+  default:
     errx(EXIT_FAILURE, "cannot initialize hybrid");
+  }
+  if(lora_state_path && hybrid_lora_resumed())
+    IF_VERBOSE(&ctx, printf("LoRaMAC state resumed from %s (seqno %u).\n",
+                            lora_state_path, hybrid.lora.state->seqno));
+
+  if(control_path)
+    reconf_start(&hybrid, &ctx.dst_mac, control_path);
 
   /* Start the threads that will handle the IO
      with the hybrid layer. That is:
-       - The input thread that read new messages from UART.
-       - The output thread that send message according to iface_mode. */
+       - The input thread that read new messages from both UART.
+       - The output thread that send message according to iface_mode.
+       - The delivery thread that pass received frames to iface_mode.
+       - The boot thread that brings G3-PLC up meanwhile. */
   start_io_threads(&ctx, &hybrid);
 
   /* IO threads returned, this is the end.
      We can release everything. */
   iface_mode.destroy(&ctx);
+
+  if(hybrid.flags & (HYBRID_COMPRESS | HYBRID_DELTA))
+    IF_VERBOSE(&ctx, display_codec_stats());
 EXIT:
   free((void *)speed_str);
   free(optstring_merged);
   free(opts_merged);
+#ifdef LIBWEREMAC
+  return exit_status; /* back to weremac_open() or weremac_close() */
+#else
   exit(exit_status);
+#endif /* LIBWEREMAC */
 }
@@ -47,4 +47,9 @@ struct context {
   int g3plc_uart_fd;
 };
 
+#ifdef LIBWEREMAC
+/* The main() of the programs, started by weremac_open(). */
+int weremac_run(int argc, char *argv[]);
+#endif /* LIBWEREMAC */
+
 #endif /* _MAIN_H_ */
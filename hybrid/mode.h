@@ -63,6 +63,13 @@ extern struct iface_mode {
      This is the code that will eventually send data
      to the hybrid layer. */
   void (*start)(const struct context *ctx);
+
+  /* Received frames are delivered to the mode from their own
+     thread (see main.c). Modes that batch received frames may
+     use flush() to push them once no other frame arrived within
+     flush_timeout us. This is optional and may be NULL. */
+  void (*flush)(const struct context *ctx);
+  unsigned int flush_timeout;
 } iface_mode;
 
 #endif /* _MODES_H_ */
@@ -0,0 +1,193 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <stdlib.h>
+#include <err.h>
+
+#include "hotplug.h"
+#include "timer.h"
+#include "event.h"
+#include "uart.h"
+#include "modules.h"
+
+static struct module {
+  const char     *device;
+  int             fd;
+  struct termios  tty;
+  struct timer    timer;
+  pthread_mutex_t lock;
+
+  uint16_t     nodes[MODULES_MAX_NODES];
+  unsigned int count;
+} modules[HYBRID_MAX_LORA_MODULES];
+static unsigned int nmodules;
+
+static struct hybrid_lora_module confs[HYBRID_MAX_LORA_MODULES];
+
+void modules_add(const char *arg)
+{
+  struct module *m;
+  char *s, *addr, *end;
+  long v;
+
+  if(nmodules == HYBRID_MAX_LORA_MODULES)
+    errx(EXIT_FAILURE, "too many LoRa modules (max %u)", HYBRID_MAX_LORA_MODULES + 1);
+  m = &modules[nmodules];
+
+  s = strdup(arg);
+  end = strrchr(s, ':');
+  if(!end || end == s)
+    errx(EXIT_FAILURE, "module expects DEVICE:ADDR[,ADDR...]");
+  *end++ = '\0';
+  m->device = s;
+
+  for(addr = strtok(end, ",") ; addr ; addr = strtok(NULL, ",")) {
+    v = strtol(addr, &end, 16);
+    if(*end || v < 0 || v >= 0xffff)
+      errx(EXIT_FAILURE, "invalid node address '%s'", addr);
+    if(m->count == sizeof(m->nodes) / sizeof(m->nodes[0]))
+      errx(EXIT_FAILURE, "too many nodes on %s (max %zu)", m->device,
+                         sizeof(m->nodes) / sizeof(m->nodes[0]));
+    m->nodes[m->count++] = v;
+  }
+  if(!m->count)
+    errx(EXIT_FAILURE, "no node on %s", m->device);
+
+  nmodules++;
+}
+
+unsigned int modules_count(void)
+{
+  return nmodules;
+}
+
+const char * modules_device(unsigned int index)
+{
+  return modules[index].device;
+}
+
+int modules_fd(unsigned int index)
+{
+  return modules[index].fd;
+}
+
+static int module_send(const void *buf, unsigned int size, void *data)
+{
+  struct module *m = data;
+  return uart_send(m->fd, buf, size);
+}
+
+static void module_start_timer(unsigned int us, void *data)
+{
+  struct module *m = data;
+  timer_start(&m->timer, us);
+}
+
+static void module_stop_timer(void *data)
+{
+  struct module *m = data;
+  timer_stop(&m->timer);
+}
+
+static void module_wait_timer(void *data)
+{
+  struct module *m = data;
+  timer_wait(&m->timer);
+}
+
+static void module_lock(void *data)
+{
+  struct module *m = data;
+  pthread_mutex_lock(&m->lock);
+}
+
+static void module_unlock(void *data)
+{
+  struct module *m = data;
+  pthread_mutex_unlock(&m->lock);
+}
+
+static void module_ready(int fd, const unsigned char *buf, unsigned int size, void *data)
+{
+  uart_feed_index(fd, buf, size, hybrid_lora_module_uart_putc,
+                  (struct module *)data - modules);
+  hybrid_recv_flush();
+}
+
+static void module_gone(int fd, int error, void *data)
+{
+  struct module *m = data;
+
+  warnx("LoRa UART of %s lost (%s), waiting for the device", m->device, strerror(error));
+  hotplug_lost(fd);
+}
+
+static void module_attached(int fd, void *data)
+{
+  struct module *m = data;
+
+  warnx("LoRa UART of %s is back", m->device);
+  event_add_hotplug(fd, module_ready, module_gone, m);
+}
+
+void modules_init(struct hybrid_config *conf, speed_t speed, int hotplug)
+{
+  unsigned int i;
+
+  for(i = 0 ; i < nmodules ; i++) {
+    struct module *m = &modules[i];
+
+    m->fd = serial_init(&m->tty, m->device, speed);
+    timer_init(&m->timer);
+    pthread_mutex_init(&m->lock, NULL);
+    if(hotplug)
+      hotplug_watch(m->fd, m->device, &m->tty, module_attached, m);
+
+    confs[i] = (struct hybrid_lora_module){
+      .nodes       = m->nodes,
+      .count       = m->count,
+      .uart_send   = module_send,
+      .start_timer = module_start_timer,
+      .stop_timer  = module_stop_timer,
+      .wait_timer  = module_wait_timer,
+      .lock        = module_lock,
+      .unlock      = module_unlock,
+      .data        = m
+    };
+  }
+
+  conf->lora_modules      = confs;
+  conf->lora_module_count = nmodules;
+}
+
+void modules_start(void)
+{
+  unsigned int i;
+
+  for(i = 0 ; i < nmodules ; i++)
+    event_add_hotplug(modules[i].fd, module_ready,
+                      hotplug_enabled() ? module_gone : NULL, &modules[i]);
+}
@@ -0,0 +1,57 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _MODULES_H_
+#define _MODULES_H_
+
+#include <termios.h>
+
+#include "hybrid/hybrid.h"
+
+/* Other LoRa modules of a gateway (see hybrid_lora_module). Their
+   lines are read by the event loop with the main one, each module
+   has its own timer and lock. */
+
+/* Maximum number of nodes served by a module. */
+#define MODULES_MAX_NODES 64
+
+/* Add a module from DEVICE:ADDR[,ADDR...] with the hexadecimal
+   addresses of its nodes. Exit on error. */
+void modules_add(const char *arg);
+
+/* Number of modules besides the main one. */
+unsigned int modules_count(void);
+
+/* Open the lines and fill lora_modules in the configuration,
+   the lines are watched when hotplug is set. Exit on error. */
+void modules_init(struct hybrid_config *conf, speed_t speed, int hotplug);
+
+/* Add the lines to the event loop, from the input thread. */
+void modules_start(void);
+
+/* Device and line of the module at this index (below modules_count()). */
+const char * modules_device(unsigned int index);
+int modules_fd(unsigned int index);
+
+#endif /* _MODULES_H_ */
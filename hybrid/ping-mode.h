@@ -1,4 +1,4 @@
-/* Copyright (c) 2013-2016, David Hauweele <david@hauweele.net>
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
    All rights reserved.
 
    Redistribution and use in source and binary forms, with or without
@@ -22,16 +22,24 @@
    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#ifndef _HELP_H_
-#define _HELP_H_
+#ifndef _PING_MODE_H_
+#define _PING_MODE_H_
 
-struct opt_help {
-  char name_short;
-  const char *name_long;
-  const char *help;
-};
+#include <sys/time.h>
+
+#include "mode.h"
+
+/* The sequence number size may change.
+   The timevalue on the other hand will
+   always be defined by its structure */
+typedef unsigned short seqno_t;
 
-/* Display an help message for a list of long and short options. */
-void help(const char *name, const char *usage, const struct opt_help opts[]);
+#define PING_HDR_SIZE sizeof(uint8_t) + sizeof(seqno_t) + sizeof(struct timeval) /* type, seqno, timeval */
+
+/* Type of a probe (first byte of the payload). */
+enum ping_type {
+  PING_REQUEST = 0x08,
+  PING_REPLY   = 0x00
+};
 
-#endif /* _HELP_H_ */
+#endif /* _PING_MODE_H_ */
@@ -0,0 +1,280 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <err.h>
+
+#include "g3plc/g3plc.h"
+#include "hybrid/hybrid.h"
+#include "safe-call.h"
+#include "common.h"
+#include "cluster.h"
+#include "standby.h"
+#include "poller.h"
+#include "timer.h"
+
+struct target {
+  uint16_t      dst;
+  unsigned int  size;
+  unsigned long offset; /* in the cycle in us */
+  int           failed; /* in this cycle */
+  unsigned char payload[HYBRID_MAX_PAYLOAD];
+};
+
+static struct target *targets;
+static unsigned int ntargets;
+static unsigned long interval;
+static int verbose;
+
+static struct timer wait;
+static unsigned long last;    /* end of the last poll */
+static unsigned int backoff = 1;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct poller_stats stats;
+
+static int hex_value(int c)
+{
+  return isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+}
+
+static unsigned int parse_payload(unsigned char *buf, const char *s)
+{
+  unsigned int n = 0;
+
+  for(; *s && !isspace((unsigned char)*s) ; s += 2) {
+    if(!isxdigit((unsigned char)s[0]) || !isxdigit((unsigned char)s[1]))
+      return 0;
+    if(n == HYBRID_MAX_PAYLOAD)
+      return 0;
+    buf[n++] = hex_value(s[0]) << 4 | hex_value(s[1]);
+  }
+
+  return n;
+}
+
+void poller_load(const char *path)
+{
+  char line[2 * HYBRID_MAX_PAYLOAD + 64];
+  unsigned int lineno = 0, allocated = 0;
+  FILE *fp = fopen(path, "r");
+
+  if(!fp)
+    err(EXIT_FAILURE, "cannot open %s", path);
+
+  while(fgets(line, sizeof(line), fp)) {
+    char *s = trim(line, isspace), *end;
+    struct target *t;
+    unsigned long addr;
+
+    lineno++;
+    if(*s == '\0' || *s == '#')
+      continue;
+
+    if(ntargets == allocated) {
+      allocated = allocated ? allocated * 2 : 64;
+      targets   = xrealloc(targets, allocated * sizeof(struct target));
+    }
+    t = &targets[ntargets];
+
+    addr = strtoul(s, &end, 16);
+    if(end == s || !isspace((unsigned char)*end) || addr > 0xffff)
+      errx(EXIT_FAILURE, "%s:%u: expected ADDR HEX-PAYLOAD", path, lineno);
+    while(isspace((unsigned char)*end))
+      end++;
+
+    t->dst  = addr;
+    t->size = parse_payload(t->payload, end);
+    if(!t->size)
+      errx(EXIT_FAILURE, "%s:%u: invalid payload", path, lineno);
+    ntargets++;
+  }
+
+  fclose(fp);
+  if(!ntargets)
+    errx(EXIT_FAILURE, "no destination to poll in %s", path);
+}
+
+/* Fibonacci hashing of the address in 32 bits. */
+static uint32_t jitter(uint16_t addr)
+{
+  return addr * 2654435769U;
+}
+
+/* Destination i gets the ith slot of the first part of the
+   interval and a fixed jitter within it, the rest of the
+   interval is left to the retries. */
+static void spread(void)
+{
+  unsigned long slot = interval / 100 * POLLER_SPREAD / ntargets;
+  unsigned int i;
+
+  for(i = 0 ; i < ntargets ; i++)
+    targets[i].offset = i * slot + (unsigned long)((uint64_t)jitter(targets[i].dst) * slot >> 32);
+}
+
+static void sleep_until(unsigned long at)
+{
+  unsigned long now = clock_us();
+
+  if(at <= now)
+    return;
+  timer_start(&wait, at - now);
+  timer_wait(&wait);
+}
+
+/* Pause after each poll, this follows the confirm latency. */
+static unsigned long gap(void)
+{
+  unsigned long g = stats.srtt * backoff;
+
+  return g < POLLER_MIN_GAP ? POLLER_MIN_GAP : g;
+}
+
+/* Send a poll no sooner than at and before the end of the
+   cycle. Return 0 once confirmed. */
+static int poll_target(struct target *t, unsigned long at, unsigned long end)
+{
+  unsigned long start, rtt;
+  int ret;
+
+  /* another gateway of the cluster hears it better
+     or this one is the standby of the active gateway */
+  if(!cluster_owner(t->dst) || standby_passive()) {
+    pthread_mutex_lock(&stats_lock);
+    stats.others++;
+    pthread_mutex_unlock(&stats_lock);
+    return 0;
+  }
+
+  sleep_until(at > last + gap() ? at : last + gap());
+
+  /* LoRa cannot afford it and there is no fallback */
+  while(hybrid_lora_budget() < 0 && !hybrid_g3plc_ready()) {
+    pthread_mutex_lock(&stats_lock);
+    stats.deferred++;
+    pthread_mutex_unlock(&stats_lock);
+
+    if(clock_us() + gap() >= end)
+      return -1;
+    sleep_until(clock_us() + gap());
+  }
+
+  start = clock_us();
+  ret   = hybrid_send_until(-1, t->dst, t->payload, t->size, end);
+  last  = clock_us();
+  rtt   = last - start;
+
+  pthread_mutex_lock(&stats_lock);
+  stats.polls++;
+  if(!ret) {
+    stats.confirms++;
+    stats.srtt = stats.srtt ? stats.srtt - stats.srtt / 8 + rtt / 8 : rtt;
+    if(backoff > 1)
+      backoff--;
+  }
+  else if(backoff < POLLER_MAX_BACKOFF)
+    backoff *= 2;
+  pthread_mutex_unlock(&stats_lock);
+
+  if(verbose)
+    printf("POLL     : %04X in %lu ms, status %d\n", t->dst, rtt / 1000, ret);
+  return ret;
+}
+
+static void * poller_thread_func(void *arg)
+{
+  unsigned long cycle = clock_us();
+
+  UNUSED(arg);
+
+  while(1) {
+    unsigned long end = cycle + interval;
+    unsigned int i, confirmed = 0, tried = 0;
+
+    for(i = 0 ; i < ntargets ; i++) {
+      targets[i].failed = poll_target(&targets[i], cycle + targets[i].offset, end) != 0;
+      confirmed += !targets[i].failed;
+    }
+
+    /* one more try for the failed ones */
+    for(i = 0 ; i < ntargets && clock_us() < end ; i++) {
+      if(!targets[i].failed)
+        continue;
+      tried++;
+      if(!poll_target(&targets[i], 0, end)) {
+        targets[i].failed = 0;
+        confirmed++;
+      }
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    stats.cycles++;
+    stats.retries += tried;
+    stats.missed  += ntargets - confirmed;
+    pthread_mutex_unlock(&stats_lock);
+
+    if(verbose)
+      printf("POLL     : cycle of %u destinations, %u confirmed, %u retried in %lu ms\n",
+             ntargets, confirmed, tried, (clock_us() - cycle) / 1000);
+
+    /* an overrun starts the next cycle at once */
+    if(clock_us() >= end) {
+      pthread_mutex_lock(&stats_lock);
+      stats.overruns++;
+      pthread_mutex_unlock(&stats_lock);
+      cycle = clock_us();
+    }
+    else {
+      sleep_until(end);
+      cycle = end;
+    }
+  }
+
+  return NULL;
+}
+
+void poller_start(unsigned long cycle_interval, int verbose_mode)
+{
+  pthread_t thread;
+
+  interval = cycle_interval;
+  verbose  = verbose_mode;
+  spread();
+  timer_init(&wait);
+
+  if(pthread_create(&thread, NULL, poller_thread_func, NULL))
+    errx(EXIT_FAILURE, "cannot create poller thread");
+}
+
+void poller_stats(struct poller_stats *s)
+{
+  pthread_mutex_lock(&stats_lock);
+  *s = stats;
+  pthread_mutex_unlock(&stats_lock);
+}
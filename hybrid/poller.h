@@ -0,0 +1,79 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _POLLER_H_
+#define _POLLER_H_
+
+/* Periodic reads of a list of meters. Each cycle the polls are
+   spread over the interval: every destination has a slot of the
+   interval and a jitter within its slot derived from its address,
+   so that it is polled at the same offset each cycle and never at
+   the same time as the other destinations.
+
+   The polls are sent one at a time from the poller thread with
+   a pause after each confirm which follows the smoothed confirm
+   latency, doubled on each failure and shrunk on success, so the
+   pace slows down when the link is congested. Polls are deferred
+   while the LoRa duty cycle is overdrawn and G3-PLC is down. The
+   first polls take POLLER_SPREAD percent of the interval and the
+   failed ones are tried once more in the rest of the cycle.
+
+   In a cluster of gateways the meters owned by another gateway
+   are left to it (see cluster_owner()), and a standby leaves all
+   of them to the active gateway (see standby.h). The responses are
+   ordinary received messages. */
+
+#include <stdint.h>
+
+/* Shortest pause after a poll in us and largest factor
+   of the confirm latency after failures. */
+#define POLLER_MIN_GAP     10000
+#define POLLER_MAX_BACKOFF 16
+
+/* Part of the interval for the first polls in percent. */
+#define POLLER_SPREAD 75
+
+struct poller_stats {
+  unsigned long cycles;
+  unsigned long polls;    /* sent */
+  unsigned long confirms; /* sent successfully */
+  unsigned long retries;  /* sent again at the end of a cycle */
+  unsigned long deferred; /* delayed by the duty cycle */
+  unsigned long missed;   /* failed twice in a cycle */
+  unsigned long overruns; /* cycles longer than the interval */
+  unsigned long others;   /* left to another gateway (see cluster.h and standby.h) */
+  unsigned long srtt;     /* smoothed confirm latency in us */
+};
+
+/* Read the destinations from a file, one "ADDR HEX-PAYLOAD"
+   per line (e.g. "0002 0101"), blank lines and lines starting
+   with '#' are ignored. Exit on error. */
+void poller_load(const char *path);
+
+/* Start the poller thread with a cycle of interval us. */
+void poller_start(unsigned long interval, int verbose);
+
+void poller_stats(struct poller_stats *stats);
+
+#endif /* _POLLER_H_ */
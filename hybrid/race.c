@@ -0,0 +1,201 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <err.h>
+
+#include "safe-call.h"
+#include "account.h"
+#include "trace.h"
+#include "race.h"
+
+struct race {
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+
+  int (*fun[2])(void *);
+  void (*done)(void *);
+  void *data;
+  unsigned int account; /* of the caller (see account.h) */
+  struct trace *trace;  /* of the caller, held by both threads (see trace.h) */
+
+  int status[2];
+  int finished; /* number of functions that returned */
+  int success;  /* one of them returned zero */
+  int refs;     /* caller and both workers */
+
+  struct race_arg {
+    struct race *race;
+    int idx;
+    struct race_arg *next; /* in the queue of the worker */
+  } args[2];
+};
+
+/* Each function of a race runs in the worker of its side, which
+   lives as long as the process. The first function of a race is
+   always on the same medium, as is the second, so a race waits
+   behind the end of the previous one on a medium as it would for
+   its lock, without creating a thread for each message. */
+static struct worker {
+  pthread_mutex_t  lock;
+  pthread_cond_t   cond;
+  struct race_arg *head;
+  struct race_arg *tail;
+} workers[2] = {
+  { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL },
+  { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL }
+};
+static pthread_once_t workers_once = PTHREAD_ONCE_INIT;
+
+/* Release a reference with the lock held.
+   The last one frees the race. */
+static void release(struct race *r)
+{
+  int last = !--r->refs;
+
+  pthread_mutex_unlock(&r->lock);
+
+  if(last) {
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+    free(r);
+  }
+}
+
+static void run(struct race_arg *arg)
+{
+  struct race *r = arg->race;
+  int status;
+
+  account_set(r->account);
+  trace_set(r->trace);
+  status = r->fun[arg->idx](r->data);
+  trace_release(r->trace);
+
+  pthread_mutex_lock(&r->lock);
+  {
+    r->status[arg->idx] = status;
+    if(!status)
+      r->success = 1;
+
+    /* the data is not used anymore */
+    if(++r->finished == 2)
+      r->done(r->data);
+
+    pthread_cond_signal(&r->cond);
+  }
+  release(r);
+}
+
+static void * worker_thread(void *p)
+{
+  struct worker *w = p;
+  struct race_arg *arg;
+
+  while(1) {
+    pthread_mutex_lock(&w->lock);
+    {
+      while(!w->head)
+        pthread_cond_wait(&w->cond, &w->lock);
+
+      arg     = w->head;
+      w->head = arg->next;
+      if(!w->head)
+        w->tail = NULL;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    run(arg);
+  }
+
+  return NULL;
+}
+
+static void start_workers(void)
+{
+  pthread_attr_t attr;
+  pthread_t thread;
+  int i;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+  for(i = 0 ; i < 2 ; i++)
+    if(pthread_create(&thread, &attr, worker_thread, &workers[i]))
+      errx(EXIT_FAILURE, "cannot create thread");
+
+  pthread_attr_destroy(&attr);
+}
+
+static void submit(struct worker *w, struct race_arg *arg)
+{
+  pthread_mutex_lock(&w->lock);
+  {
+    arg->next = NULL;
+    if(w->tail)
+      w->tail->next = arg;
+    else
+      w->head = arg;
+    w->tail = arg;
+
+    pthread_cond_signal(&w->cond);
+  }
+  pthread_mutex_unlock(&w->lock);
+}
+
+int race(int (*a)(void *), int (*b)(void *), void (*done)(void *), void *data)
+{
+  struct race *r = xmalloc(sizeof(struct race));
+  int i, status;
+
+  pthread_once(&workers_once, start_workers);
+
+  *r = (struct race){
+    .fun     = { a, b },
+    .done    = done,
+    .data    = data,
+    .account = account_get(),
+    .trace   = trace_get(),
+    .refs    = 3
+  };
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->cond, NULL);
+
+  for(i = 0 ; i < 2 ; i++) {
+    r->args[i] = (struct race_arg){ .race = r, .idx = i };
+    trace_hold(r->trace);
+    submit(&workers[i], &r->args[i]);
+  }
+
+  pthread_mutex_lock(&r->lock);
+  {
+    while(!r->success && r->finished < 2)
+      pthread_cond_wait(&r->cond, &r->lock);
+    status = r->success ? 0 : r->status[1];
+  }
+  release(r);
+
+  return status;
+}
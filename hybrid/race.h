@@ -1,5 +1,4 @@
-/* Copyright (c) 2017, Aurélien Van Laere <aurelien.vanlaere@umons.ac.be>
-                       David Hauweele <david@hauweele.net>
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
    All rights reserved.
 
    Redistribution and use in source and binary forms, with or without
@@ -23,15 +22,17 @@
    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#ifndef _CRC_CCITT_H_
-#define _CRC_CCITT_H_
+#ifndef _RACE_H_
+#define _RACE_H_
 
-#include <stdint.h>
+/* Run both functions concurrently. The first function of each race
+   runs in one worker thread and the second one in another, both
+   started by the first call, so the functions must not race
+   themselves. This returns zero as soon as one of them returned
+   zero. Otherwise it waits for both and returns the status of the
+   second one. The done function is called once both functions have
+   returned, so the data pointer stays valid for the slowest one
+   even when the race was already won. */
+int race(int (*a)(void *), int (*b)(void *), void (*done)(void *), void *data);
 
-#define CRC_CCITT_INIT 0xffff
-
-uint16_t crc_ccitt(const unsigned char *s,
-                   unsigned int len,
-                   uint16_t crc);
-
-#endif /* _CRC_CCITT_H_ */
+#endif /* _RACE_H_ */
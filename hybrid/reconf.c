@@ -0,0 +1,248 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "hybrid/hybrid.h"
+#include "lora/loramac-str.h"
+#include "string-utils.h"
+#include "safe-call.h"
+#include "xatoi.h"
+#include "lock.h"
+#include "reconf.h"
+
+#define MAX_LINE  256
+#define MAX_ERROR 96
+
+struct stage {
+  struct hybrid_config conf;
+  uint16_t             dst_mac;
+  char                 error[MAX_ERROR];
+};
+
+static struct hybrid_config *running;
+static uint16_t *running_dst;
+static int control_sd = -1;
+static pthread_t reconf_thread;
+
+static void stage_begin(struct stage *s)
+{
+  lock();
+  s->conf    = *running;
+  s->dst_mac = *running_dst;
+  unlock();
+  s->error[0] = '\0';
+}
+
+static int stage_error(struct stage *s, const char *msg)
+{
+  snprintf(s->error, sizeof(s->error), "%s", msg);
+  return -1;
+}
+
+static int stage_uint(struct stage *s, unsigned int *v, const char *arg, unsigned int min)
+{
+  unsigned int n;
+  int err;
+
+  if(!arg)
+    return stage_error(s, "missing value");
+  n = xatou(arg, &err);
+  if(err || n < min)
+    return stage_error(s, "invalid value");
+  *v = n;
+  return 0;
+}
+
+/* Stage a tunable. Return 1 when the option is not a tunable. */
+static int stage_option(struct stage *s, const char *name, const char *arg)
+{
+  if(!strcmp(name, "sifs"))
+    return stage_uint(s, &s->conf.lora.sifs, arg, 1);
+  if(!strcmp(name, "ack-timeout"))
+    return stage_uint(s, &s->conf.lora.timeout, arg, 1);
+  if(!strcmp(name, "delta-resync"))
+    return stage_uint(s, &s->conf.lora.resync, arg, 1);
+  if(!strcmp(name, "destination")) {
+    unsigned long dst;
+    char *end;
+
+    if(!arg)
+      return stage_error(s, "missing destination");
+    dst = strtoul(arg, &end, 16);
+    if(end == arg || *end || dst > 0xffff)
+      return stage_error(s, "invalid destination");
+    s->dst_mac = dst;
+    return 0;
+  }
+
+  return 1;
+}
+
+static int stage_commit(struct stage *s)
+{
+  int err = hybrid_reconfigure(&s->conf);
+
+  /* only LoRaMAC refuses */
+  if(err) {
+    snprintf(s->error, sizeof(s->error), "%s", loramac_init2str(lora_errno));
+    return -1;
+  }
+
+  /* the tunables and the destination change together */
+  lock();
+  running->lora.sifs    = s->conf.lora.sifs;
+  running->lora.timeout = s->conf.lora.timeout;
+  running->lora.resync  = s->conf.lora.resync;
+  __atomic_store_n(running_dst, s->dst_mac, __ATOMIC_RELAXED);
+  unlock();
+
+  return 0;
+}
+
+static void show(FILE *out)
+{
+  struct hybrid_config conf;
+  uint16_t dst_mac;
+
+  /* printed from a copy, the client may be slow */
+  lock();
+  conf    = *running;
+  dst_mac = *running_dst;
+  unlock();
+
+  fprintf(out, "sifs %u\n", conf.lora.sifs);
+  fprintf(out, "ack-timeout %u\n", conf.lora.timeout);
+  fprintf(out, "delta-resync %u\n", conf.lora.resync ? conf.lora.resync : HYBRID_DELTA_RESYNC);
+  fprintf(out, "destination %04X\n", dst_mac);
+}
+
+/* Parse the commands of a client until it leaves. */
+static void serve(int fd)
+{
+  char line[MAX_LINE];
+  struct stage s;
+  int staged = 0;
+  FILE *in, *out;
+
+  in  = fdopen(fd, "r");
+  out = fdopen(dup(fd), "w");
+  if(!in || !out) {
+    warn("cannot open control connection");
+    if(in)
+      fclose(in);
+    else
+      close(fd);
+    return;
+  }
+
+  while(fgets(line, sizeof(line), in)) {
+    char *cmd = strtok(line, " \t\r\n");
+    char *name, *arg;
+    int n = 0;
+
+    if(!cmd)
+      continue;
+
+    if(!strcmp(cmd, "set")) {
+      name = strtok(NULL, " \t\r\n");
+      arg  = strtok(NULL, " \t\r\n");
+      if(!staged) {
+        stage_begin(&s);
+        staged = 1;
+      }
+      if(!name)
+        n = stage_error(&s, "set needs a name");
+      else if((n = stage_option(&s, name, arg)) > 0)
+        n = stage_error(&s, "not a tunable");
+    }
+    else if(!strcmp(cmd, "commit")) {
+      if(staged)
+        n = stage_commit(&s);
+      staged = 0;
+    }
+    else if(!strcmp(cmd, "abort"))
+      staged = 0;
+    else if(!strcmp(cmd, "show"))
+      show(out);
+    else
+      n = stage_error(&s, "unknown command");
+
+    if(n)
+      fprintf(out, "error: %s\n", s.error);
+    else
+      fputs("ok\n", out);
+    fflush(out);
+  }
+
+  fclose(in);
+  fclose(out);
+}
+
+static void * reconf_thread_func(void *p)
+{
+  (void)p;
+
+  while(1) {
+    int fd = accept(control_sd, NULL, NULL);
+
+    if(fd >= 0)
+      serve(fd);
+  }
+
+  return NULL;
+}
+
+static void exit_clean(void)
+{
+  struct sockaddr_un addr;
+  socklen_t len = sizeof(addr);
+
+  if(!getsockname(control_sd, (struct sockaddr *)&addr, &len))
+    unlink(addr.sun_path);
+}
+
+void reconf_start(struct hybrid_config *conf, uint16_t *dst_mac, const char *control_path)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+  running     = conf;
+  running_dst = dst_mac;
+
+  control_sd = xsocket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(control_path);
+  xstrcpy(addr.sun_path, control_path, sizeof(addr.sun_path));
+  xbind(control_sd, (struct sockaddr *)&addr, SUN_LEN(&addr));
+  xlisten(control_sd, 4);
+  atexit(exit_clean);
+
+  xpthread_create(&reconf_thread, NULL, reconf_thread_func, NULL);
+}
@@ -0,0 +1,55 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _RECONF_H_
+#define _RECONF_H_
+
+#include <stdint.h>
+
+#include "hybrid/hybrid.h"
+
+/* Runtime reconfiguration of the driver (see --control).
+
+   The tunables are applied without restarting the driver nor the
+   modems (see hybrid_reconfigure()). There is no configuration file
+   to read again, so the driver does not catch SIGHUP.
+
+   The control socket is a Unix stream socket taking one command
+   per line, each answered by "ok" or "error: REASON":
+
+     set NAME VALUE  stage a tunable, named like the long option
+                     (sifs, ack-timeout, delta-resync, destination)
+     commit          apply the staged tunables at once
+     abort           drop the staged tunables
+     show            print the current tunables before "ok"
+
+   The tunables staged by a client are dropped when it leaves. */
+
+/* Start the reconfiguration thread with the configuration given to
+   the hybrid layer, which is updated with the applied tunables under
+   lock(), and the destination of the mode. The control socket is
+   created at control_path. */
+void reconf_start(struct hybrid_config *conf, uint16_t *dst_mac, const char *control_path);
+
+#endif /* _RECONF_H_ */
@@ -30,6 +30,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <getopt.h>
+#include <err.h>
 #include <time.h>
 
 #include "time-substract.h"
@@ -43,8 +44,13 @@
 #include "dump.h"
 #include "common.h"
 
+/* Maximum number of destinations of a fan-out (see --destinations). */
+#define MAX_DESTINATIONS 256
+
 static int display_time;
 static const char *message = "Hello World!";
+static uint16_t destinations[MAX_DESTINATIONS];
+static unsigned int destination_count;
 
 static void cb_recv(uint16_t src, uint16_t dst,
                     const void *payload, unsigned int payload_size,
@@ -66,6 +72,42 @@ static void init(const struct context *ctx, struct hybrid_config *hybrid)
   hybrid->cb_recv = cb_recv;
 }
 
+static void parse_destinations(const char *arg)
+{
+  char *s = strdup(arg);
+  char *dst;
+
+  for(dst = strtok(s, ",") ; dst ; dst = strtok(NULL, ",")) {
+    if(destination_count == MAX_DESTINATIONS)
+      errx(EXIT_FAILURE, "too many destinations (max. %d)", MAX_DESTINATIONS);
+    destinations[destination_count++] = strtol(dst, NULL, 16);
+  }
+
+  free(s);
+}
+
+/* Send the message to each destination at once (see hybrid_send_many()). */
+static void start_fanout(void)
+{
+  static int status[MAX_DESTINATIONS];
+  struct timespec begin, end;
+  unsigned int i, delivered;
+
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  delivered = hybrid_send_many(destinations, destination_count,
+                               message, strlen(message), status);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  putchar('\n');
+  if(display_time)
+    printf("TIME     : %s\n", scale_time(substract_nsec(&begin, &end)));
+
+  for(i = 0 ; i < destination_count ; i++)
+    printf("TX STATUS: %04X %s (%d)\n", destinations[i],
+           hybrid_snd2str(status[i]), status[i]);
+  printf("DELIVERED: %u/%u\n", delivered, destination_count);
+}
+
 static void start(const struct context *ctx)
 {
   struct timespec begin, end;
@@ -75,6 +117,11 @@ static void start(const struct context *ctx)
 
   UNUSED(ctx);
 
+  if(destination_count) {
+    start_fanout();
+    return;
+  }
+
   clock_gettime(CLOCK_MONOTONIC, &begin);
   ret = hybrid_send(ctx->dst_mac, message, strlen(message));
   clock_gettime(CLOCK_MONOTONIC, &end);
@@ -114,6 +161,9 @@ static int parse_option(const struct context *ctx, int c)
   case 'm':
     message = optarg;
     return 1;
+  case 'D':
+    parse_destinations(optarg);
+    return 1;
   }
 
   return 0;
@@ -122,11 +172,13 @@ static int parse_option(const struct context *ctx, int c)
 struct option send_opts[] = {
   { "time", no_argument, NULL, 'T' },
   { "message", required_argument, NULL, 'm' },
+  { "destinations", required_argument, NULL, 'D' },
   { NULL, 0, NULL, 0 }
 };
 struct opt_help send_messages[] = {
   { 'T', "time",    "Display the time necessary to send the message (including retransmissions)" },
   { 'm', "message", "Message to be send (default: \"Hello World!\")"},
+  { 'D', "destinations", "Send to each of these comma separated MACs at once (hex. short addresses)" },
   { 0, NULL, NULL }
 };
 
@@ -134,7 +186,7 @@ struct iface_mode iface_mode = {
   .name = "send",
   .description = "Send a single frame",
 
-  .optstring      = "Tm:",
+  .optstring      = "Tm:D:",
   .long_opts      = send_opts,
   .extra_messages = send_messages,
   .parse_option   = parse_option,
@@ -0,0 +1,358 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <err.h>
+
+#include "g3plc/g3plc.h"
+#include "hybrid/hybrid.h"
+#include "xatoi.h"
+#include "common.h"
+#include "standby.h"
+#include "timer.h"
+
+#define HDR_SIZE   6
+#define ENTRY_SIZE 7
+#define DGRAM_SIZE (HDR_SIZE + sizeof(uint16_t) + HYBRID_MAX_PAYLOAD)
+
+static int enabled;
+static int mirroring;
+static int passive;
+static int sd;
+static uint32_t epoch;
+static unsigned long beat; /* us */
+static struct sockaddr_in peer_addr;
+static const struct standby_ops *ops;
+static struct standby_stats stats;
+
+#define COUNT(counter) __atomic_add_fetch(&stats.counter, 1, __ATOMIC_RELAXED)
+
+static unsigned char * put16(unsigned char *b, uint16_t v)
+{
+  b[0] = v >> 8;
+  b[1] = v;
+  return b + 2;
+}
+
+static unsigned char * put32(unsigned char *b, uint32_t v)
+{
+  b[0] = v >> 24;
+  b[1] = v >> 16;
+  b[2] = v >> 8;
+  b[3] = v;
+  return b + 4;
+}
+
+static uint16_t get16(const unsigned char *b)
+{
+  return b[0] << 8 | b[1];
+}
+
+static uint32_t get32(const unsigned char *b)
+{
+  return (uint32_t)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+}
+
+static unsigned char * header(unsigned char *d, uint8_t type)
+{
+  d[0] = STANDBY_MAGIC;
+  d[1] = type;
+  return put32(d + 2, epoch);
+}
+
+/* best effort, the standby resyncs on the next epoch */
+static void mirror(const unsigned char *d, unsigned int size)
+{
+  sendto(sd, d, size, MSG_DONTWAIT, (struct sockaddr *)&peer_addr, sizeof(peer_addr));
+}
+
+void standby_store(uint16_t dst, const void *payload, unsigned int size)
+{
+  unsigned char d[DGRAM_SIZE], *b;
+
+  if(!mirroring || size > HYBRID_MAX_PAYLOAD)
+    return;
+
+  b = put16(header(d, STANDBY_STORE), dst);
+  memcpy(b, payload, size);
+  mirror(d, b - d + size);
+  COUNT(stores);
+}
+
+void standby_done(uint16_t dst, uint16_t crc)
+{
+  unsigned char d[HDR_SIZE + 2 * sizeof(uint16_t)], *b;
+
+  if(!mirroring)
+    return;
+
+  b = put16(put16(header(d, STANDBY_DONE), dst), crc);
+  mirror(d, b - d);
+  COUNT(dones);
+}
+
+int standby_passive(void)
+{
+  return __atomic_load_n(&passive, __ATOMIC_RELAXED);
+}
+
+int standby_enabled(void)
+{
+  return enabled;
+}
+
+void standby_stats(struct standby_stats *s)
+{
+  s->beats   = __atomic_load_n(&stats.beats, __ATOMIC_RELAXED);
+  s->stores  = __atomic_load_n(&stats.stores, __ATOMIC_RELAXED);
+  s->dones   = __atomic_load_n(&stats.dones, __ATOMIC_RELAXED);
+  s->syncs   = __atomic_load_n(&stats.syncs, __ATOMIC_RELAXED);
+  s->passive = standby_passive();
+}
+
+/* Heartbeats of the active gateway with its dedup state. */
+static void * beat_thread_func(void *arg)
+{
+  unsigned char d[HDR_SIZE + sizeof(uint16_t) + sizeof(uint8_t) +
+                  HYBRID_DEDUP_PEERS * ENTRY_SIZE], *b;
+  struct hybrid_dedup peers[HYBRID_DEDUP_PEERS];
+  unsigned int i, n;
+
+  UNUSED(arg);
+
+  while(1) {
+    n = hybrid_dedup_export(peers, HYBRID_DEDUP_PEERS);
+
+    b  = put16(header(d, STANDBY_BEAT), beat / 1000);
+    *b++ = n;
+    for(i = 0 ; i < n ; i++) {
+      b    = put16(b, peers[i].src);
+      *b++ = peers[i].last;
+      b    = put32(b, peers[i].seen);
+    }
+    mirror(d, b - d);
+    COUNT(beats);
+
+    usleep(beat);
+  }
+
+  return NULL;
+}
+
+/* Resync requests of the standby. */
+static void * sync_thread_func(void *arg)
+{
+  unsigned char d[HDR_SIZE];
+  ssize_t n;
+
+  UNUSED(arg);
+
+  while(1) {
+    n = recv(sd, d, sizeof(d), 0);
+    if(n < 2 || d[0] != STANDBY_MAGIC || d[1] != STANDBY_SYNC)
+      continue;
+
+    COUNT(syncs);
+    if(ops->resync)
+      ops->resync();
+  }
+
+  return NULL;
+}
+
+static void takeover(unsigned long silent)
+{
+  __atomic_store_n(&passive, 0, __ATOMIC_RELAXED);
+  warnx("no heartbeat from the active gateway for %lu ms, taking over", silent / 1000);
+  if(ops->takeover)
+    ops->takeover();
+}
+
+/* The state of a new active gateway replaces ours. */
+static void follow(uint32_t new_epoch, const struct sockaddr_in *from)
+{
+  unsigned char d[2] = { STANDBY_MAGIC, STANDBY_SYNC };
+
+  epoch     = new_epoch;
+  peer_addr = *from;
+  if(ops->clear)
+    ops->clear();
+  sendto(sd, d, sizeof(d), MSG_DONTWAIT, (struct sockaddr *)&peer_addr, sizeof(peer_addr));
+  COUNT(syncs);
+}
+
+static void receive(const unsigned char *d, unsigned int n)
+{
+  struct hybrid_dedup peer;
+  const unsigned char *b = d + HDR_SIZE;
+  unsigned int i, count;
+
+  switch(d[1]) {
+  case STANDBY_BEAT:
+    if(n < HDR_SIZE + sizeof(uint16_t) + sizeof(uint8_t))
+      break;
+    beat  = get16(b) * 1000UL;
+    count = b[2];
+    b    += sizeof(uint16_t) + sizeof(uint8_t);
+    for(i = 0 ; i < count && b + ENTRY_SIZE <= d + n ; i++, b += ENTRY_SIZE) {
+      peer = (struct hybrid_dedup){ .src  = get16(b),
+                                    .last = b[2],
+                                    .seen = get32(b + 3) };
+      hybrid_dedup_merge(&peer);
+    }
+    COUNT(beats);
+    break;
+  case STANDBY_STORE:
+    if(n < HDR_SIZE + sizeof(uint16_t))
+      break;
+    if(ops->store)
+      ops->store(get16(b), b + sizeof(uint16_t), n - HDR_SIZE - sizeof(uint16_t));
+    COUNT(stores);
+    break;
+  case STANDBY_DONE:
+    if(n < HDR_SIZE + 2 * sizeof(uint16_t))
+      break;
+    if(ops->done)
+      ops->done(get16(b), get16(b + sizeof(uint16_t)));
+    COUNT(dones);
+    break;
+  }
+}
+
+/* Follow the active gateway until it goes silent. */
+static void * standby_thread_func(void *arg)
+{
+  unsigned char d[DGRAM_SIZE];
+  struct pollfd fd = { .fd = sd, .events = POLLIN };
+  struct sockaddr_in from;
+  socklen_t from_len;
+  unsigned long last = 0, silent, late;
+  int heard = 0, timeout;
+  ssize_t n;
+
+  UNUSED(arg);
+
+  while(1) {
+    /* armed once the active gateway told its beat */
+    timeout = -1;
+    if(heard && beat) {
+      silent = clock_us() - last;
+      late   = STANDBY_LATE * beat;
+      if(silent >= late) {
+        takeover(silent);
+        break;
+      }
+      timeout = (late - silent + 999) / 1000;
+    }
+
+    if(poll(&fd, 1, timeout) <= 0)
+      continue;
+
+    from_len = sizeof(from);
+    n = recvfrom(sd, d, sizeof(d), 0, (struct sockaddr *)&from, &from_len);
+    if(n < HDR_SIZE || d[0] != STANDBY_MAGIC || d[1] == STANDBY_SYNC)
+      continue;
+
+    if(!heard || get32(d + 2) != epoch)
+      follow(get32(d + 2), &from);
+    heard = 1;
+    last  = clock_us();
+    receive(d, n);
+  }
+
+  close(sd);
+  return NULL;
+}
+
+/* Address of "ADDR[:PORT]". */
+static void parse_addr(const char *addr, struct sockaddr_in *sin)
+{
+  char *s = strdup(addr), *port;
+  int bad;
+
+  *sin = (struct sockaddr_in){ .sin_family = AF_INET,
+                               .sin_port   = htons(STANDBY_PORT) };
+  port = strchr(s, ':');
+  if(port) {
+    *port++ = '\0';
+    sin->sin_port = htons(xatou(port, &bad));
+    if(bad)
+      errx(EXIT_FAILURE, "invalid standby port");
+  }
+  if(inet_pton(AF_INET, s, &sin->sin_addr) != 1)
+    errx(EXIT_FAILURE, "standby expects an IPv4 ADDR[:PORT]");
+  free(s);
+}
+
+static void open_socket(void)
+{
+  sd = socket(AF_INET, SOCK_DGRAM, 0);
+  if(sd < 0)
+    err(EXIT_FAILURE, "cannot create standby socket");
+}
+
+void standby_open(const char *addr, const struct standby_ops *standby_ops)
+{
+  struct sockaddr_in bind_addr;
+  pthread_t thread;
+  int one = 1;
+
+  parse_addr(addr, &bind_addr);
+  open_socket();
+  setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if(bind(sd, (struct sockaddr *)&bind_addr, sizeof(bind_addr)) < 0)
+    err(EXIT_FAILURE, "cannot bind standby socket");
+
+  ops     = standby_ops;
+  passive = 1;
+  enabled = 1;
+
+  if(pthread_create(&thread, NULL, standby_thread_func, NULL))
+    errx(EXIT_FAILURE, "cannot create standby thread");
+}
+
+void standby_mirror(const char *addr, unsigned long beat_us, const struct standby_ops *standby_ops)
+{
+  pthread_t beat_thread, sync_thread;
+
+  parse_addr(addr, &peer_addr);
+  open_socket();
+
+  ops       = standby_ops;
+  beat      = beat_us < STANDBY_MIN_BEAT * 1000UL ? STANDBY_MIN_BEAT * 1000UL : beat_us;
+  epoch     = clock_us() ^ (uint32_t)getpid() << 16;
+  mirroring = 1;
+  enabled   = 1;
+
+  if(pthread_create(&beat_thread, NULL, beat_thread_func, NULL) ||
+     pthread_create(&sync_thread, NULL, sync_thread_func, NULL))
+    errx(EXIT_FAILURE, "cannot create standby threads");
+}
@@ -0,0 +1,115 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _STANDBY_H_
+#define _STANDBY_H_
+
+#include <stdint.h>
+
+/* Hot standby of a gateway over UDP.
+
+   The standby runs the whole driver, its modems are booted and it
+   hears the same meters, but it delivers nothing, sends nothing
+   and leaves the polls to the active gateway. Both gateways have
+   the same address, the modems of the standby still acknowledge
+   the frames they hear. The active gateway mirrors to it:
+
+     - a heartbeat every beat (a quarter of the G3-PLC confirm
+       timeout) with the sequence numbers received from each origin
+       (see hybrid_dedup_export()), which the standby merges with
+       the ones it heard itself,
+     - each frame stored in its spool and each one sent from it,
+       so that the spool of the standby holds the same frames.
+
+   The standby takes over once it heard nothing for STANDBY_LATE
+   beats, a beat after the one missed, and then sends the frames
+   of its spool. It never takes over an active gateway it did not
+   hear from, and it does not give the role back: the other gateway
+   must be restarted as the standby. When the standby hears a new
+   active gateway (a new epoch, e.g. after a restart of the active
+   one) it drops its spool and asks for the frames of the active's
+   (STANDBY_SYNC). Datagrams are best effort, a frame may be sent
+   twice after a takeover when its copies crossed a resync.
+
+   Datagrams (network byte order):
+     [magic (u8)][type (u8)][epoch (u32)] then
+     [beat in ms (u16)][count (u8)] and count [src (u16)][last (u8)][seen (u32)]
+                                   (STANDBY_BEAT)
+     [dst (u16)][payload]          (STANDBY_STORE)
+     [dst (u16)][crc (u16)]        (STANDBY_DONE, CRC of the journal record)
+   and the standby sends [magic (u8)][type (u8)] (STANDBY_SYNC). */
+
+#define STANDBY_MAGIC    0x53
+#define STANDBY_PORT     4871
+#define STANDBY_LATE     2  /* beats of silence before a takeover */
+#define STANDBY_MIN_BEAT 10 /* ms */
+
+enum standby_type {
+  STANDBY_BEAT = 1,
+  STANDBY_STORE,
+  STANDBY_DONE,
+  STANDBY_SYNC
+};
+
+/* Spool of the mode, each function may be NULL. The first three
+   are called on the standby, resync on the active gateway, from
+   the threads of this module. */
+struct standby_ops {
+  void (*store)(uint16_t dst, const void *payload, unsigned int size);
+  void (*done)(uint16_t dst, uint16_t crc);
+  void (*clear)(void);   /* drop the frames of the spool */
+  void (*takeover)(void);
+  void (*resync)(void);  /* mirror each frame of the spool again */
+};
+
+struct standby_stats {
+  unsigned long beats;  /* heartbeats sent or received */
+  unsigned long stores; /* spooled frames mirrored */
+  unsigned long dones;  /* spooled frames sent */
+  unsigned long syncs;  /* spools mirrored again */
+  int           passive;
+};
+
+/* Become the standby of the gateway that mirrors to this
+   "ADDR[:PORT]". Exit on error. */
+void standby_open(const char *addr, const struct standby_ops *ops);
+
+/* Mirror this active gateway to the standby at "ADDR[:PORT]" with
+   a heartbeat every beat us. Exit on error. */
+void standby_mirror(const char *addr, unsigned long beat, const struct standby_ops *ops);
+
+/* Mirror a frame stored in the spool or sent from it. This does
+   nothing unless this gateway mirrors. */
+void standby_store(uint16_t dst, const void *payload, unsigned int size);
+void standby_done(uint16_t dst, uint16_t crc);
+
+/* Whether this gateway is a standby which has not taken over. */
+int standby_passive(void);
+
+/* Whether this gateway is a standby or mirrors to one. */
+int standby_enabled(void);
+
+void standby_stats(struct standby_stats *stats);
+
+#endif /* _STANDBY_H_ */
@@ -22,18 +22,19 @@
    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <getopt.h>
-#include <errno.h>
 #include <err.h>
 
 #include "lora/loramac-str.h"
 #include "g3plc/g3plc-str.h"
 #include "hybrid/hybrid-str.h"
 #include "hybrid/hybrid.h"
+#include "jsonl.h"
 #include "help.h"
 #include "main.h"
 #include "dump.h"
@@ -43,6 +44,96 @@
 #define PROMPT   "input> "
 #define BUF_SIZE HYBRID_MAX_PAYLOAD
 
+/* With --json each received message and each send status is a
+   JSON object on its own line (see jsonl.h) instead of a dump:
+     {"event":"recv","medium":"g3plc","src":"0001","dst":"0002",
+      "status":"success","code":0,"stamp_us":...,"hops":0,
+      "lqi":...,"seqno":...,"modulation":...,"symbols":...,
+      "tonemap":...,"size":...,"payload":"..."}
+     {"event":"sent","dst":"0002","status":"success","code":0}
+   The link fields are only present for G3-PLC (see hybrid_meta).
+   The prompt is not shown. The records are buffered and written
+   out once no other message arrived within FLUSH_TIMEOUT us. */
+#define FLUSH_TIMEOUT 10000
+
+static int json;
+static enum jsonl_bytes encoding;
+
+/* Records are written by the delivery thread and the main thread. */
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+static char output_buf[1 << 16];
+
+static void put_json(const char *record, size_t size, int sync)
+{
+  pthread_mutex_lock(&output_lock);
+  {
+    fwrite(record, 1, size, stdout);
+    if(sync)
+      fflush(stdout);
+  }
+  pthread_mutex_unlock(&output_lock);
+}
+
+static void cb_recv_meta(uint16_t src, uint16_t dst,
+                         const void *payload, unsigned int payload_size,
+                         int status, const struct hybrid_meta *meta, void *data)
+{
+  static char record[JSONL_SIZE(HYBRID_MAX_PAYLOAD)];
+  char *b = record;
+
+  UNUSED(data);
+
+  if(payload_size > HYBRID_MAX_PAYLOAD)
+    payload_size = HYBRID_MAX_PAYLOAD;
+
+  /* the status is the one of the medium */
+  b = jsonl_begin(b);
+  b = jsonl_str(b, "event", "recv");
+  b = jsonl_str(b, "medium", hybrid_source2str(meta->source));
+  b = jsonl_addr(b, "src", src);
+  b = jsonl_addr(b, "dst", dst);
+  b = jsonl_str(b, "status", meta->source == HYBRID_SOURCE_LORA ? loramac_rcv2str(status)
+                                                                 : g3plc_rcv2str(status));
+  b = jsonl_int(b, "code", status);
+  b = jsonl_uint(b, "stamp_us", meta->stamp);
+  b = jsonl_uint(b, "hops", meta->hops);
+  if(meta->source == HYBRID_SOURCE_G3PLC) {
+    b = jsonl_uint(b, "lqi", meta->lqi);
+    b = jsonl_uint(b, "seqno", meta->seqno);
+    b = jsonl_uint(b, "modulation", meta->modulation);
+    b = jsonl_uint(b, "symbols", meta->symbols);
+    b = jsonl_uint(b, "tonemap", meta->tonemap);
+  }
+  b = jsonl_uint(b, "size", payload_size);
+  b = jsonl_bytes(b, "payload", payload, payload_size, encoding);
+  b = jsonl_end(b);
+
+  put_json(record, b - record, 0);
+}
+
+static void sent_json(uint16_t dst, int status)
+{
+  char record[JSONL_FIELDS_SIZE];
+  char *b = record;
+
+  b = jsonl_begin(b);
+  b = jsonl_str(b, "event", "sent");
+  b = jsonl_addr(b, "dst", dst);
+  b = jsonl_str(b, "status", hybrid_snd2str(status));
+  b = jsonl_int(b, "code", status);
+  switch(status) {
+  case HYBRID_ERR_LORA:
+    b = jsonl_str(b, "error", loramac_send2str(lora_errno));
+    break;
+  case HYBRID_ERR_G3PLC:
+    b = jsonl_str(b, "error", g3plc_send2str(g3plc_errno));
+    break;
+  }
+  b = jsonl_end(b);
+
+  put_json(record, b - record, 1);
+}
+
 static void cb_recv(uint16_t src, uint16_t dst,
                     const void *payload, unsigned int payload_size,
                     int status, int source, void *data)
@@ -71,6 +162,20 @@ static void init(const struct context  *ctx, struct hybrid_config *hybrid)
 {
   UNUSED(ctx);
   hybrid->cb_recv = cb_recv;
+
+  if(json) {
+    hybrid->cb_recv_meta = cb_recv_meta;
+    setvbuf(stdout, output_buf, _IOFBF, sizeof(output_buf));
+  }
+}
+
+static void flush(const struct context *ctx)
+{
+  UNUSED(ctx);
+
+  pthread_mutex_lock(&output_lock);
+  fflush(stdout);
+  pthread_mutex_unlock(&output_lock);
 }
 
 static void start(const struct context *ctx)
@@ -81,20 +186,11 @@ static void start(const struct context *ctx)
 
 
   while(1) {
-    printf(PROMPT);
-
-    /* Interruption often occurs on stdin because
-       we use the timers a lot. So we *have* to
-       handle syscall interruptions. */
-  RESTART:
-    if(!fgets(buf, sizeof(buf), stdin)) {
-      switch(errno) {
-      case EINTR:
-        goto RESTART;
-      default:
-        errx(EXIT_FAILURE, "cannot read from stdin");
-      }
-    }
+    if(!json)
+      printf(PROMPT);
+
+    if(!fgets(buf, sizeof(buf), stdin))
+      errx(EXIT_FAILURE, "cannot read from stdin");
 
     /* strip newline */
     strtok(buf, "\n");
@@ -105,6 +201,11 @@ static void start(const struct context *ctx)
       return;
 
     ret = hybrid_send(ctx->dst_mac, buf, strlen(buf));
+    if(json) {
+      sent_json(ctx->dst_mac, ret);
+      continue;
+    }
+
     switch(ret) {
     case HYBRID_ERR_LORA:
       err = loramac_send2str(lora_errno);
@@ -126,22 +227,46 @@ static void destroy(const struct context *ctx)
 
 static int parse_option(const struct context *ctx, int c)
 {
+  int e;
+
   UNUSED(ctx);
-  UNUSED(c);
+
+  switch(c) {
+  case 'j':
+    json = 1;
+    iface_mode.flush         = flush;
+    iface_mode.flush_timeout = FLUSH_TIMEOUT;
+    return 1;
+  case 'e':
+    if((e = jsonl_encoding(optarg)) < 0)
+      errx(EXIT_FAILURE, "unknown encoding (hex or base64)");
+    encoding = e;
+    return 1;
+  }
 
   return 0; /* option unknown by this module,
                can be be parsed by next module */
 }
 
-struct option stdio_opts[]       = { { NULL, 0, NULL, 0 } };
+struct option stdio_opts[] = {
+  { "json", no_argument, NULL, 'j' },
+  { "encoding", required_argument, NULL, 'e' },
+  { NULL, 0, NULL, 0 }
+};
+
+struct opt_help stdio_messages[] = {
+  { 'j', "json",     "Write received messages and send statuses as JSON lines" },
+  { 'e', "encoding", "Encoding of the payloads in JSON, hex or base64 (default: hex)" },
+  { 0, NULL, NULL }
+};
 
 struct iface_mode iface_mode = {
   .name        = "stdio",
   .description = "Read output frame and print received frames on stdio",
 
-  .optstring      = "",
+  .optstring      = "je:",
   .long_opts      = stdio_opts,
-  .extra_messages = NULL,
+  .extra_messages = stdio_messages,
   .parse_option   = parse_option,
 
   .init    = init,
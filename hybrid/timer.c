@@ -23,90 +23,124 @@
  */
 
 #ifdef __linux__
-# define _POSIX_C_SOURCE 199506L
+# define _POSIX_C_SOURCE 200112L
 #endif /* __linux__ */
 
 #include <stdlib.h>
-#include <string.h>
-#include <signal.h>
 #include <pthread.h>
-#include <sys/time.h>
+#include <time.h>
+#include <errno.h>
 #include <err.h>
 
-#include "common.h"
 #include "timer.h"
 
-static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t   cond = PTHREAD_COND_INITIALIZER;
-static struct itimerval timer;
+/* Timers are implemented with a condition waiting on the
+   monotonic clock. There is no signal involved so each
+   timer is independent and does not interrupt syscalls
+   in other threads. The default timer is used by the
+   start/wait/stop functions for layers that only need one. */
+static struct timer default_timer;
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
 
-void timer_expired(int signum)
+static void deadline_after(struct timespec *ts, unsigned int us)
 {
-  UNUSED(signum);
+  clock_gettime(CLOCK_MONOTONIC, ts);
 
-  stop_timer();
+  ts->tv_sec  += us / 1000000;
+  ts->tv_nsec += (us % 1000000) * 1000;
+  if(ts->tv_nsec >= 1000000000) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
 }
 
-static void setup_signal(void)
+static void init_cond(pthread_cond_t *cond)
 {
-  struct sigaction sa;
-  sigset_t set;
+  pthread_condattr_t attr;
 
-  /* unblock SIGALRM */
-  sigemptyset(&set);
-  sigaddset(&set, SIGALRM);
+  pthread_condattr_init(&attr);
+  if(pthread_condattr_setclock(&attr, CLOCK_MONOTONIC))
+    errx(EXIT_FAILURE, "cannot use monotonic clock");
 
-  if(pthread_sigmask(SIG_UNBLOCK, &set, NULL))
-    err(EXIT_FAILURE, "cannot unblock signal");
+  if(pthread_cond_init(cond, &attr))
+    errx(EXIT_FAILURE, "cannot initialize timer");
 
-  /* configure handler */
-  memset(&sa, 0, sizeof(sa));
-  sa.sa_handler = &timer_expired;
-  sigaction(SIGALRM, &sa, NULL);
+  pthread_condattr_destroy(&attr);
 }
 
-static void block_signal(void)
+void timer_init(struct timer *t)
 {
-  sigset_t set;
+  pthread_mutex_init(&t->lock, NULL);
+  init_cond(&t->cond);
+  t->armed = 0;
+}
 
-  /* block SIGALRM */
-  sigemptyset(&set);
-  sigaddset(&set, SIGALRM);
+static void init_default_timer(void)
+{
+  timer_init(&default_timer);
 }
 
-void start_timer(unsigned int timeout)
+void timer_start(struct timer *t, unsigned int timeout)
 {
   /* one shot timer */
-  pthread_mutex_lock(&lock);
+  pthread_mutex_lock(&t->lock);
   {
-    setup_signal();
-
-    timer.it_value = (struct timeval){ .tv_sec  = timeout / 1000000,
-                                       .tv_usec = timeout % 1000000 };
-    setitimer(ITIMER_REAL, &timer, NULL);
+    deadline_after(&t->deadline, timeout);
+    t->armed = 1;
   }
-  pthread_mutex_unlock(&lock);
+  pthread_mutex_unlock(&t->lock);
 }
 
-void wait_timer(void)
+void timer_wait(struct timer *t)
 {
-  pthread_mutex_lock(&lock);
+  pthread_mutex_lock(&t->lock);
   {
-    if(timer.it_value.tv_sec || timer.it_value.tv_usec)
-      pthread_cond_wait(&cond, &lock);
+    int ret = 0;
+
+    /* Loop on the predicate to handle spurious wakeups.
+       The timer is disarmed either when it is stopped
+       or when the deadline has been reached. */
+    while(t->armed && ret != ETIMEDOUT)
+      ret = pthread_cond_timedwait(&t->cond, &t->lock, &t->deadline);
+    t->armed = 0;
   }
-  pthread_mutex_unlock(&lock);
+  pthread_mutex_unlock(&t->lock);
 }
 
-void stop_timer(void)
+void timer_stop(struct timer *t)
 {
   /* stop and unlock */
-  pthread_mutex_lock(&lock);
+  pthread_mutex_lock(&t->lock);
   {
-    block_signal();
-
-    timer.it_value.tv_usec = 0;
-    pthread_cond_signal(&cond);
+    t->armed = 0;
+    pthread_cond_broadcast(&t->cond);
   }
-  pthread_mutex_unlock(&lock);
+  pthread_mutex_unlock(&t->lock);
+}
+
+void start_timer(unsigned int timeout)
+{
+  pthread_once(&default_once, init_default_timer);
+  timer_start(&default_timer, timeout);
+}
+
+void wait_timer(void)
+{
+  pthread_once(&default_once, init_default_timer);
+  timer_wait(&default_timer);
+}
+
+void stop_timer(void)
+{
+  pthread_once(&default_once, init_default_timer);
+  timer_stop(&default_timer);
+}
+
+unsigned long clock_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
 }
@@ -25,11 +25,32 @@
 #ifndef _TIMER_H_
 #define _TIMER_H_
 
-/* Start/wait/stop the timer.
+#include <pthread.h>
+#include <time.h>
+
+/* One shot timer on the monotonic clock.
+   A timer must be initialized with timer_init() before use. */
+struct timer {
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  struct timespec deadline;
+  int armed;
+};
+
+/* Start/wait/stop a timer.
    The stop function drops any pending wait.
    Duration are given in microseconds. */
+void timer_init(struct timer *t);
+void timer_start(struct timer *t, unsigned int timeout);
+void timer_wait(struct timer *t);
+void timer_stop(struct timer *t);
+
+/* Start/wait/stop the default timer. */
 void start_timer(unsigned int timeout);
 void wait_timer(void);
 void stop_timer(void);
 
+/* Monotonic clock in microseconds. */
+unsigned long clock_us(void);
+
 #endif /* _TIMER_H_ */
@@ -0,0 +1,518 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <err.h>
+
+#include "g3plc/g3plc.h"
+#include "hybrid/hybrid.h"
+#include "standby.h"
+#include "timesync.h"
+#include "timer.h"
+
+#define HDR_SIZE      2
+#define BEACON_SIZE   (HDR_SIZE + sizeof(uint64_t) + sizeof(uint32_t))
+#define REQUEST_SIZE  (HDR_SIZE + sizeof(uint16_t) + sizeof(uint64_t))
+#define RESPONSE_SIZE (HDR_SIZE + sizeof(uint16_t) + 3 * sizeof(uint64_t))
+
+enum role {
+  ROLE_NONE,
+  ROLE_MASTER,
+  ROLE_NODE
+};
+
+static int role;
+static uint16_t address;
+static unsigned long period;   /* us, the one of the master on a node */
+static unsigned int symbol_us; /* of the G3-PLC band plan */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond;
+static struct timesync_stats stats;
+
+#define COUNT(counter) __atomic_add_fetch(&stats.counter, 1, __ATOMIC_RELAXED)
+
+/* Delay from the G3-PLC modem to the host of the last frames. */
+static int64_t uart_delays[TIMESYNC_SAMPLES];
+static unsigned int uart_count, uart_next;
+
+/* Requests waiting for an answer on the master. */
+static struct request {
+  uint16_t src;
+  int      medium;
+  uint64_t t1, t2;
+} pending[TIMESYNC_PENDING];
+static unsigned int npending;
+
+/* Latency of each medium on a node. */
+static struct medium {
+  unsigned long latencies[TIMESYNC_SMOOTH];
+  unsigned int  count, next;
+  unsigned int  beacons; /* since the last request */
+  int           due;     /* request to send */
+  unsigned long t1;      /* of the request in flight */
+} media[2];
+
+/* Offsets of the master clock to ours on a node and their fit. */
+static struct sample {
+  unsigned long x; /* our stamp */
+  int64_t       y; /* network time less x */
+} samples[TIMESYNC_SAMPLES];
+static unsigned int nsamples, next_sample;
+static unsigned long fit_x, heard; /* last beacon of the master */
+static int64_t fit_y;
+static double fit_slope;
+
+static unsigned char * put16(unsigned char *b, uint16_t v)
+{
+  b[0] = v >> 8;
+  b[1] = v;
+  return b + 2;
+}
+
+static unsigned char * put32(unsigned char *b, uint32_t v)
+{
+  b[0] = v >> 24;
+  b[1] = v >> 16;
+  b[2] = v >> 8;
+  b[3] = v;
+  return b + 4;
+}
+
+static unsigned char * put64(unsigned char *b, uint64_t v)
+{
+  return put32(put32(b, v >> 32), v);
+}
+
+static uint16_t get16(const unsigned char *b)
+{
+  return b[0] << 8 | b[1];
+}
+
+static uint32_t get32(const unsigned char *b)
+{
+  return (uint32_t)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+}
+
+static uint64_t get64(const unsigned char *b)
+{
+  return (uint64_t)get32(b) << 32 | get32(b + 4);
+}
+
+static unsigned char * header(unsigned char *d, uint8_t kind)
+{
+  d[0] = TIMESYNC_TYPE;
+  d[1] = kind;
+  return d + HDR_SIZE;
+}
+
+static uint64_t realtime_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Time of the master at one of its stamps. */
+static uint64_t master_time(unsigned long stamp)
+{
+  return realtime_us() - (clock_us() - stamp);
+}
+
+/* Stamp of a received message, on G3-PLC less the delay from
+   the modem to the host beyond the least one of the last frames. */
+static unsigned long rx_stamp(const struct hybrid_meta *meta)
+{
+  int64_t delay, least;
+  unsigned int i;
+
+  if(meta->source != HYBRID_SOURCE_G3PLC || !meta->symbols || !symbol_us)
+    return meta->stamp;
+
+  delay = (int64_t)meta->stamp - (int64_t)meta->symbols * symbol_us;
+  for(i = 0, least = delay ; i < uart_count ; i++)
+    if(uart_delays[i] < least)
+      least = uart_delays[i];
+
+  /* the modem restarted or its symbol counter wrapped */
+  if(delay - least > TIMESYNC_STEP) {
+    uart_count = 0;
+    least      = delay;
+  }
+
+  uart_delays[uart_next] = delay;
+  uart_next = (uart_next + 1) % TIMESYNC_SAMPLES;
+  if(uart_count < TIMESYNC_SAMPLES)
+    uart_count++;
+
+  return meta->stamp - (delay - least);
+}
+
+static int64_t line(unsigned long x)
+{
+  return fit_y + (int64_t)(fit_slope * (long)(x - fit_x));
+}
+
+/* Fit the offsets with the new one, relative to it so that the
+   sums keep their precision. The samples are a ring filled from
+   the start, so the first nsamples are the ones in use. */
+static void add_sample(unsigned long x, int64_t y)
+{
+  double xm = 0, ym = 0, sxx = 0, sxy = 0, dx, dy;
+  unsigned int i;
+
+  if(nsamples && llabs(y - line(x)) > TIMESYNC_STEP) {
+    nsamples    = 0;
+    next_sample = 0;
+    COUNT(steps);
+  }
+
+  samples[next_sample] = (struct sample){ .x = x, .y = y };
+  next_sample = (next_sample + 1) % TIMESYNC_SAMPLES;
+  if(nsamples < TIMESYNC_SAMPLES)
+    nsamples++;
+
+  for(i = 0 ; i < nsamples ; i++) {
+    xm += (long)(samples[i].x - x);
+    ym += samples[i].y - y;
+  }
+  xm /= nsamples;
+  ym /= nsamples;
+
+  for(i = 0 ; i < nsamples ; i++) {
+    dx   = (long)(samples[i].x - x) - xm;
+    dy   = samples[i].y - y - ym;
+    sxx += dx * dx;
+    sxy += dx * dy;
+  }
+
+  fit_slope   = sxx > 0 ? sxy / sxx : 0;
+  fit_x       = x;
+  fit_y       = y + (int64_t)(ym - fit_slope * xm);
+  stats.drift = fit_slope * 1e9;
+}
+
+/* Drop the fit and the latencies of a master for another one. */
+static void forget(void)
+{
+  nsamples    = 0;
+  next_sample = 0;
+  memset(media, 0, sizeof(media));
+  memset(stats.latency, 0, sizeof(stats.latency));
+}
+
+static unsigned long latency(const struct medium *md)
+{
+  unsigned long least = ULONG_MAX;
+  unsigned int i;
+
+  for(i = 0 ; i < md->count ; i++)
+    if(md->latencies[i] < least)
+      least = md->latencies[i];
+  return least;
+}
+
+static int synced(void)
+{
+  return nsamples && clock_us() - heard <= TIMESYNC_LATE * period;
+}
+
+static void beacon(uint16_t src, const unsigned char *b, int medium, unsigned long stamp)
+{
+  struct medium *md = &media[medium];
+
+  /* follow the first master heard until it is silent */
+  if(src != stats.master) {
+    if(heard && clock_us() - heard <= TIMESYNC_LATE * period)
+      return;
+    forget();
+    stats.master = src;
+  }
+
+  heard  = stamp;
+  period = get32(b + sizeof(uint64_t)) * 1000UL;
+  COUNT(beacons);
+
+  if(md->count)
+    add_sample(stamp, (int64_t)get64(b) + (int64_t)latency(md) - (int64_t)stamp);
+  if(!md->count || ++md->beacons >= TIMESYNC_MEASURE) {
+    md->due = 1;
+    pthread_cond_signal(&cond);
+  }
+}
+
+static void response(uint16_t src, const unsigned char *b, int medium, unsigned long t4)
+{
+  struct medium *md = &media[medium];
+  unsigned long t1 = get64(b), least = latency(md);
+  uint64_t t2 = get64(b + sizeof(uint64_t)), t3 = get64(b + 2 * sizeof(uint64_t));
+  int64_t rtt;
+
+  /* an answer to another node or to an older request */
+  if(src != stats.master || get16(b - sizeof(uint16_t)) != address || t1 != md->t1)
+    return;
+  md->t1 = 0;
+  COUNT(responses);
+
+  rtt = (int64_t)(t4 - t1) - (int64_t)(t3 - t2);
+  if(rtt < 0)
+    rtt = 0;
+
+  md->latencies[md->next] = rtt / 2;
+  md->next = (md->next + 1) % TIMESYNC_SMOOTH;
+  if(md->count < TIMESYNC_SMOOTH)
+    md->count++;
+  stats.latency[medium] = latency(md);
+
+  /* the offset of the exchange when it was not held up */
+  if((unsigned long)rtt / 2 <= least)
+    add_sample(t4, ((int64_t)t2 - (int64_t)t1 + (int64_t)t3 - (int64_t)t4) / 2);
+}
+
+static void request(uint16_t src, const unsigned char *b, int medium, unsigned long t2)
+{
+  if(npending == TIMESYNC_PENDING)
+    return; /* the node asks again */
+
+  pending[npending++] = (struct request){ .src    = src,
+                                          .medium = medium,
+                                          .t1     = get64(b),
+                                          .t2     = master_time(t2) };
+  pthread_cond_signal(&cond);
+}
+
+int timesync_input(uint16_t src, const void *msg, unsigned int size,
+                   const struct hybrid_meta *meta)
+{
+  const unsigned char *m = msg;
+
+  if(!role || size < HDR_SIZE || m[0] != TIMESYNC_TYPE)
+    return 0;
+
+  pthread_mutex_lock(&lock);
+  switch(m[1]) {
+  case TIMESYNC_BEACON:
+    if(role == ROLE_NODE && size >= BEACON_SIZE)
+      beacon(src, m + HDR_SIZE, meta->source, rx_stamp(meta));
+    break;
+  case TIMESYNC_REQUEST:
+    if(role == ROLE_MASTER && size >= REQUEST_SIZE && get16(m + HDR_SIZE) == address)
+      request(src, m + HDR_SIZE + sizeof(uint16_t), meta->source, rx_stamp(meta));
+    break;
+  case TIMESYNC_RESPONSE:
+    if(role == ROLE_NODE && size >= RESPONSE_SIZE)
+      response(src, m + HDR_SIZE + sizeof(uint16_t), meta->source, rx_stamp(meta));
+    break;
+  }
+  pthread_mutex_unlock(&lock);
+
+  return 1;
+}
+
+static void send_beacon(int medium)
+{
+  unsigned char d[BEACON_SIZE];
+
+  put32(put64(header(d, TIMESYNC_BEACON), realtime_us()), period / 1000);
+  if(!hybrid_send_only(medium, 0xffff, d, sizeof(d), 0))
+    COUNT(beacons);
+}
+
+static void answer(const struct request *r)
+{
+  unsigned char d[RESPONSE_SIZE];
+
+  put64(put64(put64(put16(header(d, TIMESYNC_RESPONSE), r->src), r->t1), r->t2), realtime_us());
+  hybrid_send_only(r->medium, 0xffff, d, sizeof(d), 0);
+  COUNT(requests);
+}
+
+static void wait_until(unsigned long at)
+{
+  unsigned long now = clock_us();
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  at        -= now;
+  ts.tv_sec += at / 1000000;
+  ts.tv_nsec += (at % 1000000) * 1000;
+  if(ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
+  pthread_cond_timedwait(&cond, &lock, &ts);
+}
+
+static void * master_thread(void *p)
+{
+  struct request answers[TIMESYNC_PENDING];
+  unsigned long next = clock_us();
+  unsigned int i, n;
+
+  (void)p;
+
+  while(1) {
+    pthread_mutex_lock(&lock);
+    while(!npending && (long)(clock_us() - next) < 0)
+      wait_until(next);
+    n = npending;
+    memcpy(answers, pending, n * sizeof(*answers));
+    npending = 0;
+    pthread_mutex_unlock(&lock);
+
+    for(i = 0 ; i < n ; i++)
+      answer(&answers[i]);
+
+    if((long)(clock_us() - next) < 0)
+      continue;
+
+    /* the active gateway keeps the time (see standby.h) */
+    if(!standby_passive()) {
+      send_beacon(HYBRID_SOURCE_LORA);
+      if(hybrid_g3plc_ready())
+        send_beacon(HYBRID_SOURCE_G3PLC);
+    }
+
+    next += period;
+    if((long)(clock_us() - next) >= 0)
+      next = clock_us() + period; /* late, skip the missed beacons */
+  }
+
+  return NULL;
+}
+
+static void * node_thread(void *p)
+{
+  unsigned char d[REQUEST_SIZE];
+  struct medium *md;
+  unsigned long t1, spread;
+  uint16_t master;
+  int medium;
+
+  (void)p;
+
+  while(1) {
+    pthread_mutex_lock(&lock);
+    while(!media[HYBRID_SOURCE_LORA].due && !media[HYBRID_SOURCE_G3PLC].due)
+      pthread_cond_wait(&cond, &lock);
+    medium  = media[HYBRID_SOURCE_LORA].due ? HYBRID_SOURCE_LORA : HYBRID_SOURCE_G3PLC;
+    md      = &media[medium];
+    md->due     = 0;
+    md->beacons = 0;
+    master  = stats.master;
+    spread  = (address * 0x9e3779b1UL & 0xffffffff) % (period / TIMESYNC_SPREAD + 1);
+    pthread_mutex_unlock(&lock);
+
+    /* the nodes that heard the same beacon ask one at a time */
+    usleep(spread);
+
+    pthread_mutex_lock(&lock);
+    md->t1 = t1 = clock_us();
+    pthread_mutex_unlock(&lock);
+
+    put64(put16(header(d, TIMESYNC_REQUEST), master), t1);
+    hybrid_send_only(medium, 0xffff, d, sizeof(d), 0);
+    COUNT(requests);
+  }
+
+  return NULL;
+}
+
+static void init(int r, uint16_t addr, unsigned int bandplan)
+{
+  pthread_condattr_t attr;
+
+  pthread_condattr_init(&attr);
+  if(pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) ||
+     pthread_cond_init(&cond, &attr))
+    errx(EXIT_FAILURE, "cannot initialize the time sync");
+  pthread_condattr_destroy(&attr);
+
+  role      = r;
+  address   = addr;
+  symbol_us = bandplan == G3PLC_BP_ARIB || bandplan == G3PLC_BP_FCC ? 238 : 695;
+}
+
+void timesync_master(uint16_t addr, unsigned long p, unsigned int bandplan)
+{
+  init(ROLE_MASTER, addr, bandplan);
+  period = p;
+}
+
+void timesync_follow(uint16_t addr, unsigned int bandplan)
+{
+  init(ROLE_NODE, addr, bandplan);
+}
+
+void timesync_start(void)
+{
+  pthread_t thread;
+
+  if(!role)
+    return;
+  if(pthread_create(&thread, NULL, role == ROLE_MASTER ? master_thread : node_thread, NULL))
+    errx(EXIT_FAILURE, "cannot create the time sync thread");
+  pthread_detach(thread);
+}
+
+int timesync_time(unsigned long stamp, uint64_t *t)
+{
+  int ret = 0;
+
+  pthread_mutex_lock(&lock);
+  if(role == ROLE_MASTER)
+    *t = master_time(stamp);
+  else if(role == ROLE_NODE && synced())
+    *t = stamp + line(stamp);
+  else
+    ret = -1;
+  pthread_mutex_unlock(&lock);
+
+  return ret;
+}
+
+int timesync_enabled(void)
+{
+  return role != ROLE_NONE;
+}
+
+void timesync_stats(struct timesync_stats *s)
+{
+  uint64_t now;
+
+  pthread_mutex_lock(&lock);
+  *s = stats;
+  s->synced = role == ROLE_MASTER || synced();
+  pthread_mutex_unlock(&lock);
+
+  s->offset = 0;
+  if(s->synced && !timesync_time(clock_us(), &now))
+    s->offset = (int64_t)(now - realtime_us());
+}
@@ -0,0 +1,134 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _TIMESYNC_H_
+#define _TIMESYNC_H_
+
+#include <stdint.h>
+
+struct hybrid_meta;
+
+/* Network time distributed by the gateway over both media.
+
+   The master (the gateway) broadcasts a beacon with its clock every
+   period on LoRa and on G3-PLC. The nodes follow the first master
+   they hear. A beacon is stamped by the master right before it is
+   sent and by the node once the message is complete (see
+   hybrid_meta), so its time plus the latency of the medium is the
+   time of the master at the stamp of the node.
+
+   The node measures the latency of each medium as NTP does: a
+   request sent at t1 is answered by the master with the time t2 at
+   which it got it and t3 at which it answers, the answer comes at
+   t4. Requests and answers are broadcasts like the beacons, with
+   the address they are meant for, since a LoRa unicast is only
+   delivered after its ACK. The one-way latency is ((t4 - t1) - (t3 - t2)) / 2, the least
+   of the last TIMESYNC_SMOOTH measures so that a frame sent again
+   by the MAC layer does not count. It is measured on the first
+   beacon of a medium and every TIMESYNC_MEASURE beacons after that.
+   The answer with the least latency is also an offset of its own.
+   Each node waits for a delay of its own within a TIMESYNC_SPREAD
+   th of the period before its request, so that the nodes which
+   heard the same beacon do not all ask at once.
+
+   The node fits the last TIMESYNC_SAMPLES offsets of the master
+   clock to its own with a line (least squares) whose slope is the
+   drift of its clock, the network time of a stamp is the stamp
+   plus the offset of the line there. An offset further than
+   TIMESYNC_STEP from the line steps the clock: the fit starts again
+   from it (e.g. after the master clock was set).
+
+   On G3-PLC the stamps are corrected with the symbol time of the
+   modem (see hybrid_meta), which leaves out the UART transfer: the
+   delay of a frame from the modem to the host beyond the least one
+   of the last TIMESYNC_SAMPLES frames is taken off its stamp.
+
+   The clock is synchronized from the first offset until TIMESYNC_LATE
+   periods after the last one. The time of the master is its
+   CLOCK_REALTIME, so the network time is UTC to the accuracy of the
+   master. Broadcasts are not forwarded (see HYBRID_ROUTE), the nodes
+   must be neighbours of the master.
+
+   Messages (network byte order), both ends need the service:
+     [type (u8)][kind (u8)] then
+     [time (u64)][period in ms (u32)] (TIMESYNC_BEACON)
+     [master (u16)][t1 (u64)]         (TIMESYNC_REQUEST)
+     [node (u16)][t1 (u64)][t2 (u64)][t3 (u64)]
+                                      (TIMESYNC_RESPONSE) */
+
+#define TIMESYNC_TYPE    0xd2   /* after the ones of rpc.h */
+#define TIMESYNC_SAMPLES 8
+#define TIMESYNC_SMOOTH  4
+#define TIMESYNC_MEASURE 8
+#define TIMESYNC_SPREAD  2
+#define TIMESYNC_STEP    100000 /* us */
+#define TIMESYNC_LATE    4
+#define TIMESYNC_PENDING 8      /* requests waiting for an answer */
+
+enum timesync_kind {
+  TIMESYNC_BEACON = 1,
+  TIMESYNC_REQUEST,
+  TIMESYNC_RESPONSE
+};
+
+struct timesync_stats {
+  unsigned long beacons;    /* sent or received */
+  unsigned long requests;   /* latency requests sent or answered */
+  unsigned long responses;  /* answers received */
+  unsigned long steps;      /* fits started again */
+  unsigned long latency[2]; /* one-way on each medium in us, 0 until measured */
+  long          drift;      /* ppb the master clock runs faster than ours */
+  long          offset;     /* network time less our CLOCK_REALTIME in us */
+  uint16_t      master;
+  int           synced;
+};
+
+/* Broadcast the time of this gateway every period us. The passive
+   standby does not (see standby.h). The bandplan is the one of
+   G3-PLC (see g3plc_bandplan), for the symbol time. */
+void timesync_master(uint16_t address, unsigned long period, unsigned int bandplan);
+
+/* Follow the time of the first master heard. */
+void timesync_follow(uint16_t address, unsigned int bandplan);
+
+/* Start the thread of the service once the driver is initialized,
+   it sends the beacons and answers on the master and the requests
+   on a node. Exit on error. */
+void timesync_start(void);
+
+/* Handle a received message. Return 1 when it is a message of the
+   service, otherwise it is not for this layer and 0 is returned. */
+int timesync_input(uint16_t src, const void *msg, unsigned int size,
+                   const struct hybrid_meta *meta);
+
+/* Network time of a stamp of the monotonic clock (see clock_us()).
+   Return 0 or -1 when the clock is not synchronized. */
+int timesync_time(unsigned long stamp, uint64_t *t);
+
+/* Whether the service is enabled. */
+int timesync_enabled(void);
+
+void timesync_stats(struct timesync_stats *stats);
+
+#endif /* _TIMESYNC_H_ */
@@ -0,0 +1,223 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "safe-call.h"
+#include "jsonl.h"
+#include "common.h"
+#include "timer.h"
+#include "trace.h"
+
+struct trace {
+  unsigned long id;
+  uint16_t      dst;
+  unsigned int  size;
+  int           refs;  /* caller and the threads of a race */
+  unsigned int  count; /* steps stamped, even those dropped */
+
+  struct trace_stamp {
+    unsigned long stamp;
+    int step;
+    int arg;
+  } steps[TRACE_STEPS];
+};
+
+/* names of the steps, then those of hybrid_trace */
+static const char *step_names[] = { "enqueue", "dequeue", "send", "done",
+                                    "g3plc_request", "g3plc_confirm",
+                                    "lora_attempt", "lora_ack", "fallback" };
+
+static unsigned int rate;
+static unsigned long messages; /* started so far, the next ID */
+
+/* complete traces, the last one at head - 1 */
+static struct trace ring[TRACE_RING];
+static unsigned long head;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_key_t key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+static void key_create(void)
+{
+  pthread_key_create(&key, NULL);
+}
+
+void trace_init(unsigned int r)
+{
+  rate = r;
+}
+
+int trace_enabled(void)
+{
+  return rate != 0;
+}
+
+struct trace * trace_start(uint16_t dst, unsigned int size)
+{
+  unsigned long id;
+  struct trace *t;
+
+  if(!rate)
+    return NULL;
+
+  id = __atomic_fetch_add(&messages, 1, __ATOMIC_RELAXED);
+  if(id % rate)
+    return NULL;
+
+  t  = xmalloc(sizeof(struct trace));
+  *t = (struct trace){ .id   = id,
+                       .dst  = dst,
+                       .size = size,
+                       .refs = 1 };
+  trace_step(t, TRACE_ENQUEUE, 0);
+
+  return t;
+}
+
+void trace_step(struct trace *t, int step, int arg)
+{
+  unsigned int i;
+
+  if(!t)
+    return;
+
+  /* the threads of a race stamp the same trace */
+  i = __atomic_fetch_add(&t->count, 1, __ATOMIC_RELAXED);
+  if(i < TRACE_STEPS)
+    t->steps[i] = (struct trace_stamp){ .stamp = clock_us(),
+                                        .step  = step,
+                                        .arg   = arg };
+}
+
+void trace_end(struct trace *t, int status)
+{
+  if(!t)
+    return;
+
+  trace_step(t, TRACE_DONE, status);
+  trace_release(t);
+}
+
+void trace_set(struct trace *t)
+{
+  pthread_once(&key_once, key_create);
+  pthread_setspecific(key, t);
+}
+
+struct trace * trace_get(void)
+{
+  pthread_once(&key_once, key_create);
+  return pthread_getspecific(key);
+}
+
+void trace_hold(struct trace *t)
+{
+  if(t)
+    __atomic_add_fetch(&t->refs, 1, __ATOMIC_RELAXED);
+}
+
+void trace_release(struct trace *t)
+{
+  /* the last one sees the steps of the others */
+  if(!t || __atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL))
+    return;
+
+  if(t->count > TRACE_STEPS)
+    t->count = TRACE_STEPS;
+
+  pthread_mutex_lock(&lock);
+  ring[head++ % TRACE_RING] = *t;
+  pthread_mutex_unlock(&lock);
+
+  free(t);
+}
+
+void trace_hybrid(int event, int arg, void *data)
+{
+  UNUSED(data);
+
+  trace_step(trace_get(), TRACE_HYBRID + event, arg);
+}
+
+int trace_write(const char *path)
+{
+  static struct trace copy[TRACE_RING];
+  char buf[JSONL_FIELDS_SIZE], tmp[256], *b;
+  unsigned long last;
+  unsigned int i, j, n;
+  FILE *f;
+
+  n = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if(n >= sizeof(tmp))
+    return -1;
+
+  /* copied at once so that the senders do not wait for the file */
+  pthread_mutex_lock(&lock);
+  last = head;
+  n    = head < TRACE_RING ? head : TRACE_RING;
+  for(i = 0 ; i < n ; i++)
+    copy[i] = ring[(last - n + i) % TRACE_RING];
+  pthread_mutex_unlock(&lock);
+
+  f = fopen(tmp, "w");
+  if(!f)
+    return -1;
+
+  /* one record per step, stamped from the enqueue */
+  for(i = 0 ; i < n ; i++) {
+    const struct trace *t = &copy[i];
+
+    for(j = 0 ; j < t->count ; j++) {
+      const struct trace_stamp *s = &t->steps[j];
+
+      b = jsonl_begin(buf);
+      b = jsonl_uint(b, "id", t->id);
+      b = jsonl_addr(b, "dst", t->dst);
+      b = jsonl_uint(b, "size", t->size);
+      b = jsonl_str(b, "step", step_names[s->step]);
+      b = jsonl_uint(b, "us", s->stamp - t->steps[0].stamp);
+      b = jsonl_int(b, "arg", s->arg);
+      b = jsonl_end(b);
+      fwrite(buf, 1, b - buf, f);
+    }
+  }
+
+  /* the file is only replaced when it was completely written */
+  if(ferror(f)) {
+    fclose(f);
+    unlink(tmp);
+    return -1;
+  }
+  if(fclose(f) || rename(tmp, path)) {
+    unlink(tmp);
+    return -1;
+  }
+
+  return 0;
+}
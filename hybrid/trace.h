@@ -0,0 +1,82 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+/* Lifecycle of the messages sent on behalf of the clients, one
+   message in trace_init() rate being traced. A traced message gets
+   an ID, its number among all the messages, and a stamp of the
+   driver clock at each step below and at each step of the hybrid
+   layer (see hybrid_trace) of the thread it is set in. The threads
+   of a race hold it until they return, so that the steps of the
+   medium that lost are kept. The complete traces are kept in a
+   ring of the last TRACE_RING ones. */
+#define TRACE_RING  64
+#define TRACE_STEPS 32 /* more steps of a message are dropped */
+
+enum trace_step {
+  TRACE_ENQUEUE, /* request accepted from the client */
+  TRACE_DEQUEUE, /* taken by the transmit thread or a worker */
+  TRACE_SEND,    /* handed to the hybrid layer */
+  TRACE_DONE,    /* status known, arg is the status reported */
+  TRACE_HYBRID   /* first step of the hybrid layer */
+};
+
+struct trace;
+
+/* Sample one message in rate (0 for none). */
+void trace_init(unsigned int rate);
+int trace_enabled(void);
+
+/* Trace of the next message, enqueued now.
+   Return NULL when it is not sampled. */
+struct trace * trace_start(uint16_t dst, unsigned int size);
+
+/* Stamp a step of a trace, which may be NULL. */
+void trace_step(struct trace *t, int step, int arg);
+
+/* The status of the message is known. The trace goes to the
+   ring once the threads that hold it have released it. */
+void trace_end(struct trace *t, int status);
+
+/* Trace of the message sent from this thread, NULL for none. */
+void trace_set(struct trace *t);
+struct trace * trace_get(void);
+
+/* Hold a trace from another thread. */
+void trace_hold(struct trace *t);
+void trace_release(struct trace *t);
+
+/* Stamp a step of the hybrid layer on the trace of this
+   thread (see trace in hybrid_config). */
+void trace_hybrid(int event, int arg, void *data);
+
+/* Write the steps of the traces in the ring as JSON lines (see
+   jsonl.h), oldest first. The file is replaced once complete.
+   Return -1 on error. */
+int trace_write(const char *path);
+
+#endif /* _TRACE_H_ */
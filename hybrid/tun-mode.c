@@ -0,0 +1,503 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <err.h>
+
+#include "lora/loramac-str.h"
+#include "g3plc/g3plc-str.h"
+#include "hybrid/hybrid.h"
+#include "safe-call.h"
+#include "string-utils.h"
+#include "lowpan.h"
+#include "common.h"
+#include "xatoi.h"
+#include "mode.h"
+#include "main.h"
+#include "help.h"
+
+/*
+  The TUN mode carries IPv6 packets over the hybrid link.
+  It creates a TUN interface, packets written to this interface
+  by the kernel are sent to the MAC address found in their
+  destination and received frames are written back to it.
+  The interface still has to be configured (address, up),
+  for instance with:
+
+    ip addr add fe80::ff:fe00:0001/64 dev hybrid0
+    ip link set hybrid0 up
+
+  Headers are compressed with IPHC (RFC 6282) so that most
+  packets between link-local addresses derived from the short
+  MAC address (see lowpan.h) carry only a few bytes of header.
+  Packets that do not fit in a frame are fragmented as in
+  RFC 4944. With --uncompressed the IPv6 header is sent as is
+  behind its dispatch byte, both ends must then be able to
+  decode IPHC anyway since fragments are only reassembled.
+
+  On each wake up at most --batch packets are read from the
+  interface before they are sent, one after the other.
+*/
+
+#define DEFAULT_IFNAME "hybrid0"
+#define DEFAULT_MTU    1280 /* IPv6 minimum MTU */
+#define DEFAULT_BATCH  16
+
+/* largest packet accepted on the interface */
+#define MAX_PACKET (LOWPAN_MAX_DATAGRAM + 1)
+
+/* Fragmented packets being reassembled, each slot is freed
+   once complete or when its fragments stop arriving for
+   REASM_TIMEOUT seconds (RFC 4944 section 5.3). */
+#define REASM_SLOTS   4
+#define REASM_TIMEOUT 60
+#define REASM_UNITS   ((MAX_PACKET + 7) / 8)
+
+enum opt {
+  OPT_IFACE = 0x200, /* after common options */
+  OPT_MTU,
+  OPT_BATCH,
+  OPT_UNCOMPRESSED
+};
+
+struct reasm {
+  int used;
+  uint16_t src;
+  uint16_t tag;
+  unsigned int size;
+  unsigned int units;  /* 8-byte units received */
+  time_t stamp;        /* last fragment received */
+  unsigned char map[(REASM_UNITS + 7) / 8];
+  unsigned char buf[MAX_PACKET];
+};
+
+struct packet {
+  unsigned int size;
+  unsigned char buf[MAX_PACKET];
+};
+
+static int tun_fd = -1;
+static const char *ifname = DEFAULT_IFNAME;
+static unsigned int mtu = DEFAULT_MTU;
+static unsigned int batch_size = DEFAULT_BATCH;
+static int uncompressed;
+
+static uint16_t mac_address;
+static unsigned int tx_max_payload;
+static uint16_t tx_tag;
+static struct packet *tx_batch;
+static unsigned char tx_buf[HYBRID_MAX_PAYLOAD];
+
+/* only used by the delivery thread */
+static struct reasm reasm[REASM_SLOTS];
+static unsigned char rx_buf[MAX_PACKET];
+
+struct option tun_opts[] = {
+  { "iface", required_argument, NULL, OPT_IFACE },
+  { "mtu", required_argument, NULL, OPT_MTU },
+  { "batch", required_argument, NULL, OPT_BATCH },
+  { "uncompressed", no_argument, NULL, OPT_UNCOMPRESSED },
+  { NULL, 0, NULL, 0 }
+};
+struct opt_help tun_messages[] = {
+  { 0,   "iface", "TUN interface name (default " DEFAULT_IFNAME ")" },
+  { 0,   "mtu", "Interface MTU (default 1280)" },
+  { 0,   "batch", "Number of packets read per wake up (default 16)" },
+  { 0,   "uncompressed", "Do not compress IPv6 headers" },
+  { 0, NULL, NULL }
+};
+
+static void write_packet(const struct context *ctx, const void *packet, unsigned int size)
+{
+  IF_VERBOSE(ctx, printf("RX %d bytes\n", size));
+
+  if(write(tun_fd, packet, size) < 0)
+    warn("cannot write packet"); /* we don't fail on kernel refusal */
+}
+
+static struct reasm * reasm_slot(uint16_t src, uint16_t tag, unsigned int size)
+{
+  struct reasm *r, *free_slot = NULL, *oldest = reasm;
+  time_t now = time(NULL);
+
+  for(r = reasm ; r < reasm + REASM_SLOTS ; r++) {
+    if(r->used && now - r->stamp > REASM_TIMEOUT)
+      r->used = 0;
+
+    if(!r->used) {
+      if(!free_slot)
+        free_slot = r;
+      continue;
+    }
+
+    if(r->src == src && r->tag == tag && r->size == size) {
+      r->stamp = now;
+      return r;
+    }
+
+    if(r->stamp < oldest->stamp)
+      oldest = r;
+  }
+
+  r = free_slot ? free_slot : oldest;
+  *r = (struct reasm){ .used  = 1,
+                       .src   = src,
+                       .tag   = tag,
+                       .size  = size,
+                       .stamp = now };
+  return r;
+}
+
+/* Mark the units covered by a fragment and return
+   1 once all the units of the packet were received. */
+static int reasm_mark(struct reasm *r, unsigned int offset, unsigned int size)
+{
+  unsigned int i;
+
+  for(i = offset / 8 ; i < (offset + size + 7) / 8 ; i++) {
+    if(r->map[i / 8] & (1 << (i % 8)))
+      continue;
+    r->map[i / 8] |= 1 << (i % 8);
+    r->units++;
+  }
+
+  return r->units == (r->size + 7) / 8;
+}
+
+/* decode a compressed or uncompressed packet (dispatch included) */
+static int decode(void *buf, unsigned int buf_size,
+                  const unsigned char *frame, unsigned int size,
+                  uint16_t src, uint16_t dst, unsigned int datagram_size)
+{
+  if(!size)
+    return -1;
+
+  if(LOWPAN_IS_IPHC(frame[0]))
+    return lowpan_decompress(buf, buf_size, frame, size, src, dst, datagram_size);
+
+  if(frame[0] != LOWPAN_DISPATCH_IPV6 || size - 1 > buf_size)
+    return -1;
+
+  memcpy(buf, frame + 1, size - 1);
+  return size - 1;
+}
+
+static void cb_recv(uint16_t src, uint16_t dst,
+                    const void *payload, unsigned int payload_size,
+                    int status, int source, void *data)
+{
+  const struct context *ctx = data;
+  const unsigned char *frame = payload;
+  unsigned int datagram_size, offset;
+  struct reasm *r;
+  uint16_t tag;
+  int n;
+
+  UNUSED(source);
+
+  if(status || !payload_size)
+    return;
+
+  if(!LOWPAN_IS_FRAG1(frame[0]) && !LOWPAN_IS_FRAGN(frame[0])) {
+    n = decode(rx_buf, sizeof(rx_buf), frame, payload_size, src, dst, 0);
+    if(n < 0) {
+      warnx("invalid packet from %04X", src);
+      return;
+    }
+
+    write_packet(ctx, rx_buf, n);
+    return;
+  }
+
+  if(payload_size <= LOWPAN_FRAGN_HDR_SIZE) {
+    warnx("invalid fragment from %04X", src);
+    return;
+  }
+
+  datagram_size = (frame[0] & 0x7) << 8 | frame[1];
+  tag           = frame[2] << 8 | frame[3];
+  if(datagram_size > MAX_PACKET) {
+    warnx("fragmented packet too large from %04X", src);
+    return;
+  }
+
+  r = reasm_slot(src, tag, datagram_size);
+
+  if(LOWPAN_IS_FRAG1(frame[0])) {
+    offset = 0;
+    n = decode(r->buf, datagram_size,
+               frame + LOWPAN_FRAG1_HDR_SIZE, payload_size - LOWPAN_FRAG1_HDR_SIZE,
+               src, dst, datagram_size);
+  }
+  else {
+    offset = frame[4] * 8;
+    n      = payload_size - LOWPAN_FRAGN_HDR_SIZE;
+    if(offset + n <= datagram_size)
+      memcpy(r->buf + offset, frame + LOWPAN_FRAGN_HDR_SIZE, n);
+    else
+      n = -1;
+  }
+
+  if(n < 0) {
+    warnx("invalid fragment from %04X", src);
+    r->used = 0;
+    return;
+  }
+
+  if(reasm_mark(r, offset, n)) {
+    write_packet(ctx, r->buf, r->size);
+    r->used = 0;
+  }
+}
+
+static const char * send_status(int ret)
+{
+  switch(ret) {
+  case 0:
+    return "success";
+  case HYBRID_ERR_LORA:
+    return loramac_send2str(lora_errno);
+  case HYBRID_ERR_G3PLC:
+    return g3plc_send2str(g3plc_errno);
+  default:
+    return "hybrid layer error";
+  }
+}
+
+static void send_frame(const struct context *ctx, uint16_t dst, unsigned int size)
+{
+  int ret = hybrid_send(dst, tx_buf, size);
+
+  IF_VERBOSE(ctx, printf("TX %d bytes to %04X: %s (%d)\n",
+                         size, dst, send_status(ret), ret));
+}
+
+static void send_packet(const struct context *ctx, const unsigned char *packet, unsigned int size)
+{
+  unsigned int hdr_size, offset, n;
+  int dst, ret;
+
+  dst = lowpan_next_hop(packet, size);
+  if(dst < 0) {
+    IF_VERBOSE(ctx, printf("No link address for packet, dropped\n"));
+    return;
+  }
+
+  /* headers in the frame or its first fragment (without the fragment header) */
+  ret = -1;
+  if(!uncompressed)
+    ret = lowpan_compress(tx_buf + LOWPAN_FRAG1_HDR_SIZE, tx_max_payload - LOWPAN_FRAG1_HDR_SIZE,
+                          packet, size, mac_address, dst, &hdr_size);
+  if(ret < 0) {
+    tx_buf[LOWPAN_FRAG1_HDR_SIZE] = LOWPAN_DISPATCH_IPV6;
+    hdr_size = 0;
+    ret = 1;
+  }
+
+  /* the packet fits in one frame */
+  if(ret + size - hdr_size <= tx_max_payload) {
+    memmove(tx_buf, tx_buf + LOWPAN_FRAG1_HDR_SIZE, ret);
+    memcpy(tx_buf + ret, packet + hdr_size, size - hdr_size);
+    send_frame(ctx, dst, ret + size - hdr_size);
+    return;
+  }
+
+  if(size > LOWPAN_MAX_DATAGRAM) {
+    warnx("packet too large");
+    return;
+  }
+
+  tx_tag++;
+
+  /* The first fragment ends on an 8-byte boundary of
+     the uncompressed packet, so do the following ones. */
+  n = (tx_max_payload - LOWPAN_FRAG1_HDR_SIZE - ret + hdr_size) & ~7u;
+  if(n <= hdr_size) {
+    warnx("frame too short for fragmentation");
+    return;
+  }
+  n -= hdr_size;
+
+  tx_buf[0] = LOWPAN_DISPATCH_FRAG1 | size >> 8;
+  tx_buf[1] = size & 0xff;
+  tx_buf[2] = tx_tag >> 8;
+  tx_buf[3] = tx_tag & 0xff;
+  memcpy(tx_buf + LOWPAN_FRAG1_HDR_SIZE + ret, packet + hdr_size, n);
+  send_frame(ctx, dst, LOWPAN_FRAG1_HDR_SIZE + ret + n);
+
+  tx_buf[0] = LOWPAN_DISPATCH_FRAGN | size >> 8;
+
+  for(offset = hdr_size + n ; offset < size ; offset += n) {
+    n = (tx_max_payload - LOWPAN_FRAGN_HDR_SIZE) & ~7u;
+    if(n > size - offset)
+      n = size - offset;
+
+    tx_buf[4] = offset / 8;
+    memcpy(tx_buf + LOWPAN_FRAGN_HDR_SIZE, packet + offset, n);
+    send_frame(ctx, dst, LOWPAN_FRAGN_HDR_SIZE + n);
+  }
+}
+
+static void set_mtu(const struct context *ctx)
+{
+  struct ifreq ifr = { .ifr_mtu = mtu };
+  int sd = xsocket(AF_INET6, SOCK_DGRAM, 0);
+
+  xstrcpy(ifr.ifr_name, ifname, IFNAMSIZ);
+
+  if(ioctl(sd, SIOCSIFMTU, &ifr) < 0)
+    warn("cannot set MTU on %s", ifname);
+  else
+    IF_VERBOSE(ctx, printf("MTU set to %u on %s\n", mtu, ifname));
+
+  close(sd);
+}
+
+static void init(const struct context *ctx, struct hybrid_config *hybrid)
+{
+  struct ifreq ifr = { .ifr_flags = IFF_TUN | IFF_NO_PI };
+
+  /* configure the Hybrid layer */
+  hybrid->cb_recv = cb_recv;
+  hybrid->data    = (void *)ctx;
+
+  mac_address = hybrid->mac_address;
+
+  /* numbered messages carry their own header */
+  tx_max_payload = HYBRID_MAX_PAYLOAD;
+  if(hybrid->flags & (HYBRID_RACE | HYBRID_DEDUP))
+    tx_max_payload -= HYBRID_SEQ_HDR_SIZE;
+
+  tun_fd = open("/dev/net/tun", O_RDWR);
+  if(tun_fd < 0)
+    err(EXIT_FAILURE, "cannot open /dev/net/tun");
+
+  xstrcpy(ifr.ifr_name, ifname, IFNAMSIZ);
+  if(ioctl(tun_fd, TUNSETIFF, &ifr) < 0)
+    err(EXIT_FAILURE, "cannot create TUN interface %s", ifname);
+  ifname = xstrdup(ifr.ifr_name);
+
+  /* packets are read in batches until none is left */
+  if(fcntl(tun_fd, F_SETFL, fcntl(tun_fd, F_GETFL) | O_NONBLOCK) < 0)
+    err(EXIT_FAILURE, "fcntl");
+
+  set_mtu(ctx);
+
+  tx_batch = xmalloc(batch_size * sizeof(struct packet));
+
+  IF_VERBOSE(ctx, printf("TUN interface %s created\n", ifname));
+  IF_VERBOSE(ctx, printf("Link-local address fe80::ff:fe00:%x\n", mac_address));
+}
+
+static void start(const struct context *ctx)
+{
+  struct pollfd fds = { .fd = tun_fd, .events = POLLIN };
+  unsigned int i, n;
+  ssize_t size;
+
+  while(1) {
+    if(poll(&fds, 1, -1) < 0) {
+      if(errno != EINTR)
+        err(EXIT_FAILURE, "poll");
+      continue;
+    }
+
+    for(n = 0 ; n < batch_size ; n++) {
+      size = read(tun_fd, tx_batch[n].buf, sizeof(tx_batch[n].buf));
+      if(size < 0) {
+        if(errno != EAGAIN && errno != EINTR)
+          err(EXIT_FAILURE, "cannot read packet");
+        break;
+      }
+      tx_batch[n].size = size;
+    }
+
+    for(i = 0 ; i < n ; i++)
+      send_packet(ctx, tx_batch[i].buf, tx_batch[i].size);
+  }
+}
+
+static void destroy(const struct context *ctx)
+{
+  UNUSED(ctx);
+
+  free(tx_batch);
+  close(tun_fd);
+}
+
+static int parse_option(const struct context *ctx, int c)
+{
+  int err;
+
+  UNUSED(ctx);
+
+  switch(c) {
+  case OPT_IFACE:
+    if(strlen(optarg) >= IFNAMSIZ)
+      errx(EXIT_FAILURE, "interface name too long");
+    ifname = optarg;
+    return 1;
+  case OPT_MTU:
+    mtu = xatou(optarg, &err);
+    if(err || mtu < DEFAULT_MTU || mtu > LOWPAN_MAX_DATAGRAM)
+      errx(EXIT_FAILURE, "invalid MTU (between %d and %d)", DEFAULT_MTU, LOWPAN_MAX_DATAGRAM);
+    return 1;
+  case OPT_BATCH:
+    batch_size = xatou(optarg, &err);
+    if(err || !batch_size)
+      errx(EXIT_FAILURE, "invalid batch size");
+    return 1;
+  case OPT_UNCOMPRESSED:
+    uncompressed = 1;
+    return 1;
+  }
+
+  return 0;
+}
+
+struct iface_mode iface_mode = {
+  .name = "tun",
+  .description = "Carry IPv6 packets over a TUN interface",
+
+  .optstring      = "",
+  .long_opts      = tun_opts,
+  .extra_messages = tun_messages,
+  .parse_option   = parse_option,
+
+  .init    = init,
+  .destroy = destroy,
+  .start   = start
+};
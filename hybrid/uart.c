@@ -22,6 +22,7 @@
    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/ioctl.h>
 #include <stdlib.h>
 #include <termios.h>
 #include <fcntl.h>
@@ -29,17 +30,59 @@
 #include <errno.h>
 #include <err.h>
 
+#include "custom-baud.h"
 #include "xatoi.h"
 #include "uart.h"
 #include "hybrid/hybrid.h"
 
+#ifdef __linux__
+# include <linux/serial.h>
+#endif /* __linux__ */
+
+/* Bytes written and read on each serial line. Each counter
+   is only updated by one thread so they are read without
+   any lock. Lines are registered by serial_init(). */
+static struct uart_line {
+  int fd;
+  unsigned long tx_bytes;
+  unsigned long rx_bytes;
+  unsigned int  rx_queued_max; /* only updated by the reader */
+} lines[UART_MAX_LINES];
+static unsigned int nlines;
+
+static struct uart_line * find_line(int fd)
+{
+  unsigned int i;
+
+  for(i = 0 ; i < nlines ; i++)
+    if(lines[i].fd == fd)
+      return &lines[i];
+  return NULL;
+}
+
+static void count_bytes(int fd, unsigned long tx, unsigned long rx)
+{
+  struct uart_line *line = find_line(fd);
+
+  if(!line)
+    return;
+  line->tx_bytes += tx;
+  line->rx_bytes += rx;
+}
+
 static speed_t int2baud(int speed)
 {
   const struct {
     int     intval;
     speed_t baud;
   } *b, bauds[] = {
+#ifdef B1000000
+    { 1000000, B1000000 },
+#endif
     { 921600, B921600 },
+#ifdef B500000
+    { 500000, B500000 },
+#endif
     { 460800, B460800 },
     { 230400, B230400 },
     { 115200, B115200 },
@@ -88,9 +131,18 @@ int set_uart_speed(struct termios *tty, int fd, unsigned int speed)
   int r;
   speed_t baudrate = int2baud(speed);
 
-  if(baudrate == B0)
+  /* the bytes already written go out at the previous speed */
+  if(tcdrain(fd) < 0)
     return -1;
 
+  /* rates without a Bxxx constant */
+  if(baudrate == B0) {
+    r = set_custom_baud(fd, speed);
+    tcgetattr(fd, tty);
+    tcflush(fd, TCOFLUSH);
+    return r < 0 ? r : 0;
+  }
+
   tcgetattr(fd, tty);
   r = cfsetspeed(tty, baudrate);
   tcsetattr(fd, TCSANOW, tty);
@@ -102,6 +154,25 @@ int set_uart_speed(struct termios *tty, int fd, unsigned int speed)
 }
 
 
+/* Apply the attributes and drop what the line buffered. */
+static int configure(int fd, const struct termios *tty)
+{
+  if(tcsetattr(fd, TCSANOW, tty) < 0)
+    return -1;
+
+  /* Some operating systems (eg Linux) bufferise the UART input
+     even when the file descriptor is not opened. This may be
+     useful in a lot of ca ses. However we may lay with incomplete
+     messages on the UART buffer. Therefore we have to flush the
+     buffer ourself. However for a reason unknown to me, we have
+     to wait a bit before actually flushing. Otherwise the flush
+     command would have no effect. */
+  usleep(500);
+  tcflush(fd, TCIOFLUSH);
+
+  return 0;
+}
+
 int serial_init(struct termios *tty, const char *path, speed_t speed)
 {
   *tty = (struct termios){
@@ -125,28 +196,51 @@ int serial_init(struct termios *tty, const char *path, speed_t speed)
   if(speed != B0)
     cfsetspeed(tty, speed);
 
-  if(tcsetattr(fd, TCSANOW, tty) < 0)
+  if(configure(fd, tty) < 0)
     err(EXIT_FAILURE, "cannot set tty attributes");
 
-  /* Some operating systems (eg Linux) bufferise the UART input
-     even when the file descriptor is not opened. This may be
-     useful in a lot of ca ses. However we may lay with incomplete
-     messages on the UART buffer. Therefore we have to flush the
-     buffer ourself. However for a reason unknown to me, we have
-     to wait a bit before actually flushing. Otherwise the flush
-     command would have no effect. */
-  usleep(500);
-  tcflush(fd, TCIOFLUSH);
+  if(nlines < UART_MAX_LINES)
+    lines[nlines++] = (struct uart_line){ .fd = fd };
 
   return fd;
 }
 
+int serial_reopen(int fd, const struct termios *tty, const char *path)
+{
+  int new = open(path, O_RDWR | O_NOCTTY);
+
+  if(new < 0)
+    return -1;
+
+  if(!isatty(new) || configure(new, tty) < 0 || dup2(new, fd) < 0) {
+    close(new);
+    return -1;
+  }
+
+  close(new);
+  return 0;
+}
+
 int uart_send(int fd, const void *buf, unsigned int size)
 {
-  int r = write(fd, buf, size);
+  const unsigned char *b = buf;
+  ssize_t r;
+
+  /* A write may be short when interrupted,
+     so we loop until everything was written. */
+  while(size) {
+    r = write(fd, b, size);
+    if(r < 0) {
+      if(errno == EINTR)
+        continue;
+      return r;
+    }
+
+    b    += r;
+    size -= r;
+    count_bytes(fd, r, 0);
+  }
 
-  if(r < 0)
-    return r;
   return 0;
 }
 
@@ -154,28 +248,107 @@ int uart_read(int fd, void *buf, unsigned int size)
 {
   int r = read(fd, buf, size);
 
+  /* a blocking read of a tty returns nothing once it hung up */
+  if(!r) {
+    errno = EIO;
+    return -1;
+  }
   if(r < 0)
     return r;
+  count_bytes(fd, 0, r);
   return 0;
 }
 
-void uart_read_loop(int fd, int (*uart_putc)(unsigned char c))
+void uart_read_ready(int fd, int (*uart_putc)(unsigned char c))
 {
   unsigned char buf[UART_BUFFER_SIZE];
+  ssize_t size;
+
+  size = read(fd, buf, UART_BUFFER_SIZE);
+  if(size <= 0) {
+    if(errno == EINTR || errno == EAGAIN)
+      /* signal caught or spurious wake-up */
+      return;
+    err(EXIT_FAILURE, "cannot read");
+  }
+
+  uart_feed(fd, buf, size, uart_putc);
+}
 
+static void sample_rx_queue(int fd)
+{
+  struct uart_line *line = find_line(fd);
+  int queued;
+
+  if(line && !ioctl(fd, FIONREAD, &queued) && (unsigned int)queued > line->rx_queued_max)
+    line->rx_queued_max = queued;
+}
+
+void uart_feed(int fd, const unsigned char *buf, unsigned int size,
+               int (*uart_putc)(unsigned char c))
+{
+  unsigned int i;
+
+  count_bytes(fd, 0, size);
+
+  /* a full read means that we are falling behind */
+  if(size >= UART_BUFFER_SIZE)
+    sample_rx_queue(fd);
+
+  /* flush buffer */
+  for(i = 0 ; i < size ; i++)
+    uart_putc(buf[i]);
+}
+
+void uart_feed_index(int fd, const unsigned char *buf, unsigned int size,
+                     int (*uart_putc)(unsigned int index, unsigned char c),
+                     unsigned int index)
+{
+  unsigned int i;
+
+  count_bytes(fd, 0, size);
+
+  if(size >= UART_BUFFER_SIZE)
+    sample_rx_queue(fd);
+
+  for(i = 0 ; i < size ; i++)
+    uart_putc(index, buf[i]);
+}
+
+void uart_read_loop(int fd, int (*uart_putc)(unsigned char c))
+{
   /* loop for messages */
-  while(1) {
-    int i;
-    ssize_t size = read(fd, buf, UART_BUFFER_SIZE);
-    if(size <= 0) {
-      if(errno == EINTR)
-        /* signal caught */
-        continue;
-      err(EXIT_FAILURE, "cannot read");
-    }
+  while(1)
+    uart_read_ready(fd, uart_putc);
+}
+
+void uart_stats(int fd, struct uart_stats *stats)
+{
+  struct uart_line *line = find_line(fd);
+#ifdef TIOCGICOUNT
+  struct serial_icounter_struct icount;
+#endif /* TIOCGICOUNT */
+  int queued;
+
+  *stats = (struct uart_stats){ 0 };
+  if(line) {
+    stats->tx_bytes      = line->tx_bytes;
+    stats->rx_bytes      = line->rx_bytes;
+    stats->rx_queued_max = line->rx_queued_max;
+  }
+
+  if(!ioctl(fd, FIONREAD, &queued))
+    stats->rx_queued = queued;
+  if(stats->rx_queued > stats->rx_queued_max)
+    stats->rx_queued_max = stats->rx_queued;
 
-    /* flush buffer */
-    for(i = 0 ; i < size ; i++)
-      uart_putc(buf[i]);
+#ifdef TIOCGICOUNT
+  if(!ioctl(fd, TIOCGICOUNT, &icount)) {
+    stats->hw_overruns   = icount.overrun;
+    stats->buf_overruns  = icount.buf_overrun;
+    stats->frame_errors  = icount.frame;
+    stats->parity_errors = icount.parity;
+    stats->overruns      = icount.overrun + icount.buf_overrun;
   }
+#endif /* TIOCGICOUNT */
 }
@@ -30,6 +30,23 @@
 
 #define UART_BUFFER_SIZE 1024
 
+/* Maximum number of serial lines with statistics,
+   both media and the other LoRa modules (see modules.h). */
+#define UART_MAX_LINES 12
+
+/* UART statistics (see uart_stats()) */
+struct uart_stats {
+  unsigned long tx_bytes;
+  unsigned long rx_bytes;
+  unsigned long overruns;      /* bytes lost by the serial driver */
+  unsigned long hw_overruns;   /* bytes lost by the UART itself */
+  unsigned long buf_overruns;  /* bytes lost because the tty buffer was full */
+  unsigned long frame_errors;  /* bytes received with a framing error */
+  unsigned long parity_errors; /* bytes received with a parity error */
+  unsigned int  rx_queued;     /* bytes received but not read yet */
+  unsigned int  rx_queued_max; /* maximum of rx_queued after a full read */
+};
+
 /* Convert a string to a serial speed. */
 speed_t baud(const char *arg);
 
@@ -39,16 +56,43 @@ speed_t baud(const char *arg);
    Returns the associated file descriptor. */
 int serial_init(struct termios *tty, const char *path, speed_t speed);
 
+/* Open the serial line again on the descriptor returned by
+   serial_init(), e.g. once an unplugged USB adapter is back,
+   with the attributes the line had. The descriptor keeps its
+   number and its statistics. Return 0 or -1 on error (errno). */
+int serial_reopen(int fd, const struct termios *tty, const char *path);
+
 /* Send a message over the configured UART stream. */
 int uart_send(int fd, const void *buf, unsigned int size);
 
 /* Read a message from the configured UART stream. */
 int uart_read(int fd, void *buf, unsigned int size);
 
+/* Read whatever is available on the UART stream and pass each character to
+   the putc function. This is meant to be called from an event loop when the
+   file descriptor is ready for reading. */
+void uart_read_ready(int fd, int (*uart_putc)(unsigned char c));
+
+/* Pass the bytes read from the UART stream by an event loop
+   to the putc function. */
+void uart_feed(int fd, const unsigned char *buf, unsigned int size,
+               int (*uart_putc)(unsigned char c));
+
+/* Same as uart_feed() for a putc function that also takes
+   the index of one of several instances of a driver. */
+void uart_feed_index(int fd, const unsigned char *buf, unsigned int size,
+                     int (*uart_putc)(unsigned int index, unsigned char c),
+                     unsigned int index);
+
 /* Start the UART read loop. */
 void uart_read_loop(int fd, int (*uart_putc)(unsigned char c));
 
 /* Change UART baudrate. */
 int set_uart_speed(struct termios *tty, int fd, unsigned int speed);
 
+/* Copy the statistics of a serial line opened with serial_init().
+   The overruns are only known on Linux and only for serial ports
+   that report them. */
+void uart_stats(int fd, struct uart_stats *stats);
+
 #endif /* _UART_H_ */
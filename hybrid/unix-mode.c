@@ -25,10 +25,14 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <getopt.h>
+#include <errno.h>
+#include <poll.h>
 #include <err.h>
 
 #include "lora/loramac-str.h"
@@ -37,8 +41,25 @@
 #include "hybrid/hybrid.h"
 #include "safe-call.h"
 #include "string-utils.h"
+#include "subscribe.h"
+#include "admit.h"
+#include "meta.h"
+#include "journal.h"
+#include "batch.h"
+#include "pool.h"
+#include "recent.h"
+#include "poller.h"
+#include "standby.h"
+#include "timesync.h"
+#include "account.h"
+#include "trace.h"
+#include "txopt.h"
+#include "txq.h"
+#include "agg.h"
 #include "version.h"
 #include "common.h"
+#include "xatoi.h"
+#include "timer.h"
 #include "mode.h"
 #include "main.h"
 #include "help.h"
@@ -49,23 +70,372 @@
   successful transmission. The message format for incoming
   and outgoing messages is specified below (see cb_recv() and
   start()).
+
+  Datagrams are read and written in batches with recvmmsg()
+  and sendmmsg(). Received frames are pushed to the application
+  when the batch is full or when no other frame was received
+  within the flush timeout.
+
+  Other applications may subscribe to received frames with
+  the message format given in subscribe.h on the subscription
+  socket. The application socket is always subscribed to all
+  frames.
+
+  With --tx-status each send message is prefixed with an ID
+  chosen by the application and is queued to a transmit thread
+  so that new frames are accepted while the previous ones are
+  still being transmitted. The status of each frame is reported
+  to the sender address once the transmission is complete (see
+  send_status()). The sender socket must be bound to a path.
+
+  With --priority each send message is also prefixed with its
+  priority class (see txq_class) and queued to the transmit
+  thread. Urgent frames then overtake the queued bulk frames,
+  either strictly or according to the class weights with
+  --weighted.
+
+  With --fair the requests of each class are also served by deficit
+  round-robin among their destinations (see txq_fair()), so that
+  the backlog of one destination does not hold the others back. A
+  destination that does not acknowledge its frames gets a smaller
+  share until it answers again.
+
+  With --tx-options each send message is also prefixed with its
+  options (see txopt.h), after the class. A message restricted to
+  one medium is sent only there, without the fallback (see
+  hybrid_send_only()), and is never balanced. The ACK and the
+  retransmissions follow the configuration of each medium, the
+  other options are ignored.
+
+  With --deadline each send message is also prefixed with its
+  lifetime in milliseconds, zero for none. The requests that
+  expire in the queue are dropped and the hybrid layer stops
+  retrying the others at their deadline (see hybrid_send_until()).
+  Their senders are told with HYBRID_SND_EXPIRED. An aggregate
+  expires with its earliest message. Frames with a deadline are
+  not spooled.
+
+  With --credits each client may have at most this number of send
+  messages in flight and with --rate-limit each client may only
+  send this number of bytes per second (see admit.h). Messages
+  over a limit are rejected at once, with ADMIT_ERR_WINDOW or
+  ADMIT_ERR_RATE as their status. With --credits the status
+  messages also carry the credits left to the client, which
+  may send that many messages before the next status. The
+  credits need --tx-status.
+
+  With --client-quota a client, given by the address its socket
+  is bound to, has limits of its own instead: ADDR:CREDITS:RATE
+  where a null limit is disabled for this client. Its bursts are
+  the larger of --burst and its rate. With --client-stats or any
+  of the limits the messages, bytes, outcomes and messages in
+  flight of each client are counted (see admit_read()) and
+  written with the metrics.
+
+  With --aggregate the queued messages for the same destination
+  are packed into one frame (see agg.h), waiting up to the hold
+  time for each next message. Received frames are split back
+  into messages, so both ends must use this option.
+
+  When the hybrid layer balances bulk traffic (--balance), the
+  frames of the bulk class, or all of them without --priority, are
+  handed to a transmit worker for the medium chosen by
+  hybrid_balance(). Both media then send at once and frames may
+  be received out of order.
+
+  With --meta the received messages use the versioned record
+  given in meta.h, with the medium, the receive time and the
+  link quality of the frame as metadata, and the network time of
+  the reception once it is synchronized (see timesync.h). This
+  applies to the application socket and to the subscribers.
+
+  With --spool the frames that could not be sent on either medium
+  are stored in a journal file (see journal.h) and their senders
+  are told so with TX_SPOOLED. A spool thread sends them again,
+  waiting twice as long after each round that failed, and sooner
+  once another frame went through. It also syncs the journal at
+  a fixed interval, once for all the frames stored meanwhile. The
+  frames left in the file are sent again after a restart.
+
+  With --recent the last payloads received from each source are
+  kept (see recent.h) so that the polls for the latest reading
+  of a meter are answered without any traffic. A client sends
+  SUB_LAST on the subscription socket with the source and the
+  number of payloads it wants, the reply is:
+    [count (u8)] then, newest first, [age in ms (u32)][size (u16)][payload]
+  with as many payloads as there are and fit in RECENT_REPLY bytes.
+  The count is zero when nothing was received from the source yet.
+
+  A client sends SUB_PATH on the subscription socket with a
+  destination to learn what its path can carry (see hybrid_path()),
+  the reply is:
+    [medium (u8)][next hop (u16)][max message (u16)]
+    [G3-PLC frame (u16)][LoRa frame (u16)]
+    [G3-PLC goodput (u32)][LoRa goodput (u32)][LoRa budget (i32)]
+  in host byte order. The medium is 0xff when none can send, the
+  goodput is in bytes per second and the budget in us, clamped to
+  the range of its field.
+
+  With --poll the driver itself reads the meters of a file every
+  --poll-interval (see poller.h). The polls are spread over the
+  interval and paced on the confirm latency instead of being sent
+  all at once by a cron, their responses are published as any
+  other received message.
+
+  With --standby the driver is the hot standby of the gateway that
+  runs with --mirror to it (see standby.h). Until it takes over it
+  publishes nothing and answers the send messages with TX_STANDBY,
+  its spool (with --spool) mirrors the one of the active gateway.
 */
 
-#define BUF_SIZE HYBRID_MAX_PAYLOAD
+/* a message and the largest send or recv header */
+#define BUF_SIZE (HYBRID_MAX_PAYLOAD + META_HDR_SIZE + META_MAX_SIZE)
+
+/* default number of datagrams per batch */
+#define DEFAULT_BATCH 16
+
+/* largest reply to SUB_LAST */
+#define RECENT_REPLY 16384
+
+/* number of queued transmit requests per class (power of two) */
+#define TX_QUEUE_DEPTH 64
+
+/* Status reported for each frame. This is the status returned by
+   hybrid_send() unless one of the child layers failed, in which
+   case the error code of this layer is also reported. */
+enum tx_status {
+  TX_ERR_LORA       = 0x10,
+  TX_ERR_G3PLC      = 0x11,
+  TX_ERR_TOOLONG    = 0x12, /* message too long to be aggregated */
+  TX_SPOOLED        = 0x13, /* not sent yet, stored in the spool */
+  TX_STANDBY        = 0x14, /* not sent, this gateway is a standby */
+  TX_ERR_QUEUE_FULL = 0xff  /* transmit queue full */
+};
+
+/* maximum number of requests sent in one frame */
+#define TX_MAX_SENDERS 64
+
+/* number of frames queued to each medium (power of two) */
+#define TX_JOB_DEPTH 4
+
+/* Default size of the spool file in kB. */
+#define SPOOL_SIZE 1024
+
+/* Default polling cycle in ms. */
+#define POLL_INTERVAL 60000
+
+/* Spool sync interval and retry backoff bounds in ms. */
+#define SPOOL_SYNC_INTERVAL 100
+#define SPOOL_MIN_BACKOFF   1000
+#define SPOOL_MAX_BACKOFF   300000
+
+/* Destinations skipped in a retry round once one of their frames
+   failed, so that the frames of each destination stay in order. */
+#define SPOOL_MAX_DSTS 16
+
+enum opt {
+  OPT_BATCH = 0x200, /* after common options */
+  OPT_FLUSH_TIMEOUT,
+  OPT_SUB_PATH,
+  OPT_TX_STATUS,
+  OPT_TX_OPTIONS,
+  OPT_PRIORITY,
+  OPT_WEIGHTED,
+  OPT_FAIR,
+  OPT_AGGREGATE,
+  OPT_HOLD_TIME,
+  OPT_META,
+  OPT_SPOOL,
+  OPT_SPOOL_SIZE,
+  OPT_DEADLINE,
+  OPT_CREDITS,
+  OPT_RATE_LIMIT,
+  OPT_BURST,
+  OPT_CLIENT_QUOTA,
+  OPT_CLIENT_STATS,
+  OPT_RECENT,
+  OPT_RECENT_SOURCES,
+  OPT_POLL,
+  OPT_POLL_INTERVAL,
+  OPT_STANDBY,
+  OPT_MIRROR
+};
+
+/* A send message waiting for the transmit thread. */
+struct tx_request {
+  struct sockaddr_un from;
+  enum txq_class class;
+  uint8_t opts; /* see txopt.h */
+  unsigned long deadline; /* clock_us() or zero */
+  uint16_t id;
+  uint16_t dst;
+  unsigned int size;
+  struct trace *trace; /* NULL unless sampled (see trace.h) */
+  unsigned char payload[BUF_SIZE];
+};
+
+/* Sender of a request being transmitted. */
+struct tx_sender {
+  struct sockaddr_un from;
+  uint16_t id;
+  struct trace *trace;
+};
+
+/* A frame handed to the transmit worker of a medium. */
+struct tx_job {
+  enum txq_class class;
+  unsigned long deadline;
+  uint16_t dst;
+  unsigned int size;
+  unsigned int nsenders;
+  struct tx_sender senders[TX_MAX_SENDERS];
+  unsigned char payload[BUF_SIZE];
+};
+
+/* Source of a received aggregate. */
+struct rx_info {
+  uint16_t src;
+  uint16_t dst;
+  int status;
+  const struct hybrid_meta *meta;
+};
 
 static int sd;
+static int sub_sd;
 static const char *socket_driver_path = PACKAGE "-driver.sock";
 static const char *socket_app_path = PACKAGE "-app.sock";
-static struct sockaddr_un client;
+static const char *socket_sub_path = PACKAGE "-sub.sock";
+
+/* Batches of incoming (from the application)
+   and outgoing (to the application) datagrams. */
+static unsigned int batch_size = DEFAULT_BATCH;
+static struct batch in_batch;
+static struct batch out_batch;
+static struct pool  rec_pool;
+static int meta_records;
+
+/* Asynchronous and prioritized transmit requests. */
+static int tx_queued; /* requests go through the transmit thread */
+static int tx_status;
+static int tx_priority;
+static int tx_options;
+static int tx_deadline;
+static unsigned long tx_expired;
+static enum txq_policy tx_policy = TXQ_STRICT;
+static int tx_fair;
+static struct txq tx_queue;
+static pthread_t tx_thread;
+
+/* Frame being built by the transmit thread. */
+static int aggregate;
+static unsigned int hold_time;
+static unsigned int tx_max_payload;
+static unsigned char tx_buf[BUF_SIZE];
+static struct tx_sender tx_senders[TX_MAX_SENDERS];
+static unsigned int tx_nsenders;
+
+/* Transmit workers indexed by medium (see hybrid_source). */
+static int balance;
+static struct tx_job tx_job; /* built by the transmit thread */
+static struct tx_worker {
+  const struct context *ctx;
+  struct txq queue;
+  pthread_t thread;
+  struct tx_job job;
+} tx_workers[2];
+
+/* Admission control of the clients (see admit.h). */
+static int admission;
+static unsigned int credits;
+static unsigned long rate_limit;
+static unsigned long burst;
+static const char *quotas[ADMIT_MAX_QUOTAS];
+static unsigned int nquotas;
+static int client_stats;
+
+/* Frames that could not be sent yet. */
+static const char *spool_path;
+static unsigned long spool_size = SPOOL_SIZE * 1024;
+static struct journal spool;
+static pthread_mutex_t spool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t spool_thread;
+static int spool_recovered; /* a frame went through since the last round */
+static unsigned long spool_stored;
+static unsigned long spool_resent;
+static unsigned long spool_drops;
+
+/* Last payloads of each source (see SUB_LAST). */
+static unsigned int recent_depth;
+static unsigned int recent_sources = RECENT_SOURCES;
+static struct recent recent;
+
+/* periodic reads (see poller.h) */
+static const char *poll_path;
+static unsigned long poll_interval = POLL_INTERVAL * 1000UL;
+
+/* hot standby (see standby.h) */
+static const char *standby_addr;
+static const char *mirror_addr;
+static unsigned long mirror_beat;
 
 struct option unix_opts[] = {
   { "driver-path", required_argument, NULL, 'L' },
   { "app-path", required_argument, NULL, 'R' },
+  { "batch", required_argument, NULL, OPT_BATCH },
+  { "flush-timeout", required_argument, NULL, OPT_FLUSH_TIMEOUT },
+  { "sub-path", required_argument, NULL, OPT_SUB_PATH },
+  { "tx-status", no_argument, NULL, OPT_TX_STATUS },
+  { "tx-options", no_argument, NULL, OPT_TX_OPTIONS },
+  { "priority", no_argument, NULL, OPT_PRIORITY },
+  { "weighted", no_argument, NULL, OPT_WEIGHTED },
+  { "fair", no_argument, NULL, OPT_FAIR },
+  { "aggregate", no_argument, NULL, OPT_AGGREGATE },
+  { "hold-time", required_argument, NULL, OPT_HOLD_TIME },
+  { "meta", no_argument, NULL, OPT_META },
+  { "spool", required_argument, NULL, OPT_SPOOL },
+  { "spool-size", required_argument, NULL, OPT_SPOOL_SIZE },
+  { "deadline", no_argument, NULL, OPT_DEADLINE },
+  { "credits", required_argument, NULL, OPT_CREDITS },
+  { "rate-limit", required_argument, NULL, OPT_RATE_LIMIT },
+  { "burst", required_argument, NULL, OPT_BURST },
+  { "client-quota", required_argument, NULL, OPT_CLIENT_QUOTA },
+  { "client-stats", no_argument, NULL, OPT_CLIENT_STATS },
+  { "recent", required_argument, NULL, OPT_RECENT },
+  { "recent-sources", required_argument, NULL, OPT_RECENT_SOURCES },
+  { "poll", required_argument, NULL, OPT_POLL },
+  { "poll-interval", required_argument, NULL, OPT_POLL_INTERVAL },
+  { "standby", required_argument, NULL, OPT_STANDBY },
+  { "mirror", required_argument, NULL, OPT_MIRROR },
   { NULL, 0, NULL, 0 }
 };
 struct opt_help unix_messages[] = {
   { 'L', "driver-path", "Driver Unix socket path" },
   { 'R', "app-path", "Application Unix socket path" },
+  { 0,   "batch", "Number of datagrams per batch (default 16)" },
+  { 0,   "flush-timeout", "Delay in microseconds before a partial batch is sent (default 0)" },
+  { 0,   "sub-path", "Subscription Unix socket path" },
+  { 0,   "tx-status", "Identify send messages and report their status" },
+  { 0,   "tx-options", "Prefix send messages with their media options" },
+  { 0,   "priority", "Prefix send messages with their priority class" },
+  { 0,   "weighted", "Serve priority classes by weight instead of strictly" },
+  { 0,   "fair", "Share each priority class among the destinations" },
+  { 0,   "aggregate", "Pack small messages to the same destination in one frame" },
+  { 0,   "hold-time", "Delay in microseconds to wait for more messages to send (default 0)" },
+  { 0,   "meta", "Prefix received messages with their link metadata" },
+  { 0,   "spool", "Store the frames that could not be sent in this file and retry them" },
+  { 0,   "spool-size", "Size of the spool file in kB (default 1024)" },
+  { 0,   "deadline", "Prefix send messages with their lifetime in ms" },
+  { 0,   "credits", "Send messages in flight allowed to each client (up to 255)" },
+  { 0,   "rate-limit", "Bytes per second allowed to each client" },
+  { 0,   "burst", "Bytes a client may send at once within its rate (default one second)" },
+  { 0,   "client-quota", "Limits of one client as ADDR:CREDITS:RATE (repeatable)" },
+  { 0,   "client-stats", "Count the messages of each client without limits" },
+  { 0,   "recent", "Keep this number of last payloads of each source for the polls" },
+  { 0,   "recent-sources", "Number of sources kept with --recent (default 256)" },
+  { 0,   "poll", "Poll the destinations of this file each interval (ADDR HEX-PAYLOAD lines)" },
+  { 0,   "poll-interval", "Duration of a polling cycle in ms (default 60000)" },
+  { 0,   "standby", "Be the hot standby of the gateway mirroring to this ADDR[:PORT]" },
+  { 0,   "mirror", "Mirror the heartbeat, dedup and spool to the standby at ADDR[:PORT]" },
   { 0, NULL, NULL }
 };
 
@@ -73,39 +443,158 @@ static void exit_clean(void)
 {
   unlink(socket_driver_path);
   unlink(socket_app_path);
+  unlink(socket_sub_path);
 }
 
-static void cb_recv(uint16_t src, uint16_t dst,
-                    const void *payload, unsigned int payload_size,
-                    int status, int source, void *data)
+static void flush(const struct context *ctx)
 {
-  UNUSED(data);
-  UNUSED(source);
+  UNUSED(ctx);
+
+  sub_flush(sd, &out_batch);
+}
+
+/* Append the metadata entries and return the end of the metadata. */
+static unsigned char * put_meta(unsigned char *b, const struct hybrid_meta *m)
+{
+  uint8_t  source = m->source;
+  uint64_t stamp  = m->stamp;
+  uint64_t synctime;
+
+  b = meta_put(b, META_SOURCE, &source, sizeof(source));
+  b = meta_put(b, META_STAMP, &stamp, sizeof(stamp));
+  if(!timesync_time(m->stamp, &synctime))
+    b = meta_put(b, META_SYNCTIME, &synctime, sizeof(synctime));
+
+  /* only G3-PLC reports the link of the frame */
+  if(m->source == HYBRID_SOURCE_G3PLC) {
+    b = meta_put(b, META_LQI, &m->lqi, sizeof(m->lqi));
+    b = meta_put(b, META_SEQNO, &m->seqno, sizeof(m->seqno));
+    b = meta_put(b, META_MODULATION, &m->modulation, sizeof(m->modulation));
+    b = meta_put(b, META_SYMBOLS, &m->symbols, sizeof(m->symbols));
+    b = meta_put(b, META_TONEMAP, &m->tonemap, sizeof(m->tonemap));
+  }
 
+  return b;
+}
+
+static void publish(uint16_t src, uint16_t dst,
+                    const void *payload, unsigned int payload_size,
+                    int status, const struct hybrid_meta *m)
+{
   /* recv message format:
-     [status (u8)][src (u16)][dst (u16)][payload] */
-  unsigned char buf[BUF_SIZE];
-  unsigned char *b = buf;
-  size_t  len = payload_size + sizeof(uint8_t) + sizeof(uint16_t) * 2;
-  ssize_t n;
+       [status (u8)][src (u16)][dst (u16)][payload]
+     or with --meta (see meta.h):
+       [version (u8)][status (u8)][src (u16)][dst (u16)]
+       [meta size (u16)][meta...][payload] */
+  unsigned char *record, *b;
+  size_t len;
 
-  *(uint8_t  *)b = status; b += sizeof(uint8_t);
-  *(uint16_t *)b = src;    b += sizeof(uint16_t);
-  *(uint16_t *)b = dst;    b += sizeof(uint16_t);
+  if(payload_size > HYBRID_MAX_PAYLOAD) {
+    warnx("frame too large");
+    return;
+  }
+
+  if(recent_depth && !status)
+    recent_put(&recent, src, payload, payload_size, m->stamp);
+
+  b = record = pool_get(&rec_pool);
+  if(!record) {
+    warnx("out of record buffers, frame dropped");
+    return;
+  }
+
+  if(meta_records) {
+    unsigned char *size;
+
+    *(uint8_t  *)b = META_VERSION; b += sizeof(uint8_t);
+    *(uint8_t  *)b = status;       b += sizeof(uint8_t);
+    *(uint16_t *)b = src;          b += sizeof(uint16_t);
+    *(uint16_t *)b = dst;          b += sizeof(uint16_t);
+    size = b;                      b += sizeof(uint16_t);
+
+    b = put_meta(b, m);
+    *(uint16_t *)size = b - size - sizeof(uint16_t);
+  }
+  else {
+    *(uint8_t  *)b = status; b += sizeof(uint8_t);
+    *(uint16_t *)b = src;    b += sizeof(uint16_t);
+    *(uint16_t *)b = dst;    b += sizeof(uint16_t);
+  }
 
   memcpy(b, payload, payload_size);
+  len = b - record + payload_size;
 
-  n = sendto(sd, buf, len, 0, (struct sockaddr *)&client, sizeof(struct sockaddr_un));
-  if(n != (ssize_t)len)
-    warn("network error"); /* we don't fail on client error */
+  sub_publish(sd, &out_batch, &rec_pool, record, len, src, status, m->source);
+  pool_put(&rec_pool, record);
+}
+
+static void publish_record(const void *record, size_t size, void *data)
+{
+  const struct rx_info *info = data;
+
+  publish(info->src, info->dst, record, size, info->status, info->meta);
+}
+
+static void cb_recv(uint16_t src, uint16_t dst,
+                    const void *payload, unsigned int payload_size,
+                    int status, const struct hybrid_meta *meta, void *data)
+{
+  struct rx_info info = { .src    = src,
+                          .dst    = dst,
+                          .status = status,
+                          .meta   = meta };
+
+  UNUSED(data);
+
+  /* the active gateway delivers them */
+  if(standby_passive())
+    return;
+
+  /* frames with errors are passed as is */
+  if(!aggregate || status) {
+    publish(src, dst, payload, payload_size, status, meta);
+    return;
+  }
+
+  if(agg_split(payload, payload_size, publish_record, &info) < 0)
+    warnx("invalid aggregate from %04X", src);
 }
 
 static void init(const struct context *ctx, struct hybrid_config *hybrid)
 {
   struct sockaddr_un s_addr = { .sun_family = AF_UNIX };
+  unsigned int i;
 
   /* configure the Hybrid layer */
-  hybrid->cb_recv = cb_recv;
+  hybrid->cb_recv_meta = cb_recv;
+
+  /* numbered messages carry their own header */
+  tx_max_payload = HYBRID_MAX_PAYLOAD;
+  if(hybrid->flags & (HYBRID_RACE | HYBRID_DEDUP))
+    tx_max_payload -= HYBRID_SEQ_HDR_SIZE;
+  balance = hybrid->flags & HYBRID_BALANCE;
+  if(credits && !tx_status)
+    errx(EXIT_FAILURE, "--credits needs --tx-status");
+  for(i = 0 ; i < nquotas ; i++)
+    if(admit_parse_quota(quotas[i], burst ? burst : HYBRID_MAX_PAYLOAD) < 0)
+      errx(EXIT_FAILURE, "invalid client quota '%s'", quotas[i]);
+  admission = credits || rate_limit || nquotas || client_stats;
+  if(!burst)
+    burst = rate_limit > HYBRID_MAX_PAYLOAD ? rate_limit : HYBRID_MAX_PAYLOAD;
+  admit_init(credits, rate_limit, burst);
+
+  tx_queued = tx_status || tx_priority || tx_options || tx_deadline || tx_fair || aggregate || balance ||
+              spool_path || admission;
+
+  if(standby_addr && mirror_addr)
+    errx(EXIT_FAILURE, "--standby and --mirror are exclusive");
+  mirror_beat = hybrid->g3plc.timeout / 4;
+
+  if(spool_path) {
+    if(journal_open(&spool, spool_path, spool_size) < 0)
+      err(EXIT_FAILURE, "cannot open spool %s", spool_path);
+    IF_VERBOSE(ctx, printf("Spool opened at %s with %u frames\n", spool_path, spool.count));
+  }
 
   /* create socket */
   sd = xsocket(AF_UNIX, SOCK_DGRAM, 0);
@@ -115,68 +604,815 @@ static void init(const struct context *ctx, struct hybrid_config *hybrid)
   xstrcpy(s_addr.sun_path, socket_driver_path, sizeof(s_addr.sun_path));
   xbind(sd, (struct sockaddr *)&s_addr, SUN_LEN(&s_addr));
 
-  /* prepare client address */
-  client.sun_family = AF_UNIX;
-  xstrcpy(client.sun_path, socket_app_path, sizeof(s_addr.sun_path));
+  /* create and bind the subscription socket */
+  sub_sd = xsocket(AF_UNIX, SOCK_DGRAM, 0);
+  unlink(socket_sub_path);
+  xstrcpy(s_addr.sun_path, socket_sub_path, sizeof(s_addr.sun_path));
+  xbind(sub_sd, (struct sockaddr *)&s_addr, SUN_LEN(&s_addr));
+
+  /* the application is always subscribed */
+  sub_init(socket_app_path);
+
+  /* prepare batches */
+  batch_init(&in_batch, batch_size, BUF_SIZE, NULL);
+  batch_init(&out_batch, batch_size, BUF_SIZE, NULL);
+
+  /* Records are shared by the subscribers. The batch holds at
+     most one reference per message and is sent once full, so
+     one more buffer is enough for the record being built. */
+  pool_init(&rec_pool, batch_size + 1, BUF_SIZE);
+
+  if(recent_depth)
+    recent_init(&recent, recent_sources, recent_depth, HYBRID_MAX_PAYLOAD);
 
   /* now we may register the exit function */
   atexit(exit_clean);
 
   IF_VERBOSE(ctx, printf("Socket created at %s", socket_driver_path));
+  IF_VERBOSE(ctx, printf("Subscription socket created at %s", socket_sub_path));
+}
+
+static void send_status(const struct sockaddr_un *to, uint16_t id,
+                        int status, int error)
+{
+  /* status message format:
+     [id (u16)][status (u8)][layer error (u8)][credits (u8)]
+     The hybrid layer does not report the tx count.
+     The credits are only present with --credits. */
+  unsigned char msg[sizeof(uint16_t) + sizeof(uint8_t) * 3];
+  unsigned char *b = msg;
+
+  if(!to->sun_path[0]) {
+    warnx("unbound client, cannot report status");
+    return;
+  }
+
+  *(uint16_t *)b = id;     b += sizeof(uint16_t);
+  *(uint8_t  *)b = status; b += sizeof(uint8_t);
+  *(uint8_t  *)b = error;  b += sizeof(uint8_t);
+  if(credits) {
+    *(uint8_t *)b = admit_credits(to); b += sizeof(uint8_t);
+  }
+
+  if(sendto(sd, msg, b - msg, MSG_DONTWAIT, (struct sockaddr *)to, sizeof(*to)) < 0)
+    warn("network error"); /* we don't fail on client error */
+}
+
+/* Store a frame that could not be sent.
+   Return 0 on success or -1 when the spool is full. */
+static int spool_frame(uint16_t dst, const void *buf, unsigned int size)
+{
+  int ret;
+
+  pthread_mutex_lock(&spool_lock);
+  ret = journal_append(&spool, dst, buf, size);
+  pthread_mutex_unlock(&spool_lock);
+
+  if(ret < 0) {
+    __atomic_add_fetch(&spool_drops, 1, __ATOMIC_RELAXED);
+    warnx("spool full, frame dropped");
+    return -1;
+  }
+
+  __atomic_add_fetch(&spool_stored, 1, __ATOMIC_RELAXED);
+  standby_store(dst, buf, size);
+  return 0;
+}
+
+/* The only medium allowed by the options (see txopt.h), or -1 when
+   the message may use both. */
+static int only_medium(uint8_t opts)
+{
+  switch(opts & (TXOPT_G3PLC | TXOPT_LORA)) {
+  case TXOPT_G3PLC:
+    return HYBRID_SOURCE_G3PLC;
+  case TXOPT_LORA:
+    return HYBRID_SOURCE_LORA;
+  default:
+    return -1;
+  }
+}
+
+/* Account the time on air of a client is billed to (see account.h),
+   the driver's own for an unbound client. */
+static unsigned int client_account(const struct sockaddr_un *from)
+{
+  return from->sun_path[0] ? account_lookup(from->sun_path) : 0;
+}
+
+/* Flow and cost of a request (see --fair). */
+static unsigned int request_flow(const void *item)
+{
+  return ((const struct tx_request *)item)->dst;
+}
+
+static unsigned int request_cost(const void *item)
+{
+  return ((const struct tx_request *)item)->size;
+}
+
+/* Send a frame on behalf of its senders and report its status, with
+   this medium first (see hybrid_send_until()) unless it is negative,
+   or only on the medium of the options. */
+static void transmit(const struct context *ctx, int medium, enum txq_class class, uint8_t opts,
+                     unsigned long deadline, uint16_t dst, const void *buf, unsigned int size,
+                     const struct tx_sender *senders, unsigned int nsenders)
+{
+  int only = only_medium(opts);
+  struct trace *trace = NULL;
+  unsigned int i;
+  int status, error;
+  int ret;
+
+  /* the steps of the hybrid layer go to the first traced sender */
+  for(i = 0 ; i < nsenders ; i++) {
+    trace_step(senders[i].trace, TRACE_SEND, only >= 0 ? only : medium);
+    if(!trace)
+      trace = senders[i].trace;
+  }
+
+  /* an aggregated frame is billed to its first sender */
+  account_set(client_account(&senders[0].from));
+  trace_set(trace);
+  if(only >= 0)
+    ret = hybrid_send_only(only, dst, buf, size, deadline);
+  else
+    ret = hybrid_send_until(medium, dst, buf, size, deadline);
+  trace_set(NULL);
+  txq_feedback(&tx_queue, dst, ret == HYBRID_SND_SUCCESS);
+  if(ret == HYBRID_SND_EXPIRED)
+    __atomic_add_fetch(&tx_expired, nsenders, __ATOMIC_RELAXED);
+
+  switch(ret) {
+  case HYBRID_ERR_LORA:
+    status = TX_ERR_LORA;
+    error  = lora_errno;
+    IF_VERBOSE(ctx, printf("TX STATUS: %s (%d)\n", loramac_send2str(error), error));
+    break;
+  case HYBRID_ERR_G3PLC:
+    status = TX_ERR_G3PLC;
+    error  = g3plc_errno;
+    IF_VERBOSE(ctx, printf("TX STATUS: %s (%d)\n", g3plc_send2str(error), error));
+    break;
+  default:
+    status = ret;
+    error  = 0;
+    IF_VERBOSE(ctx, printf("TX STATUS: %d\n", ret));
+  }
+  IF_VERBOSE(ctx, printf("TX MSGS  : %d\n", nsenders));
+  IF_VERBOSE(ctx, printf("---------\n"));
+
+  if(spool_path) {
+    if(ret == HYBRID_SND_SUCCESS)
+      __atomic_store_n(&spool_recovered, 1, __ATOMIC_RELAXED);
+    else if(ret == HYBRID_SND_NOACK && !deadline && !spool_frame(dst, buf, size))
+      status = TX_SPOOLED;
+  }
+
+  txq_complete(&tx_queue, class, nsenders);
+
+  /* the time on air of the clients is in their account */
+  for(i = 0 ; admission && i < nsenders ; i++)
+    admit_release(&senders[i].from, ret, 0);
+  for(i = 0 ; tx_status && i < nsenders ; i++)
+    send_status(&senders[i].from, senders[i].id, status, error);
+  for(i = 0 ; i < nsenders ; i++)
+    trace_end(senders[i].trace, status);
+}
+
+static void * tx_worker_func(void *arg)
+{
+  struct tx_worker *w = arg;
+  int medium = w - tx_workers;
+  unsigned int i;
+
+  while(1) {
+    txq_pop(&w->queue, &w->job, 1);
+    for(i = 0 ; i < w->job.nsenders ; i++)
+      trace_step(w->job.senders[i].trace, TRACE_DEQUEUE, medium);
+    transmit(w->ctx, medium, w->job.class, 0, w->job.deadline, w->job.dst,
+             w->job.payload, w->job.size, w->job.senders, w->job.nsenders);
+  }
+
+  return NULL;
+}
+
+/* Hand the frame in tx_buf to the worker of the medium chosen by
+   the hybrid layer. When this worker is behind we send the frame
+   ourselves, which holds the next frames back. */
+static void dispatch(const struct context *ctx, enum txq_class class, unsigned long deadline,
+                     uint16_t dst, unsigned int size)
+{
+  int medium = hybrid_balance(size);
+
+  tx_job.class    = class;
+  tx_job.deadline = deadline;
+  tx_job.dst      = dst;
+  tx_job.size     = size;
+  tx_job.nsenders = tx_nsenders;
+  memcpy(tx_job.senders, tx_senders, tx_nsenders * sizeof(struct tx_sender));
+  memcpy(tx_job.payload, tx_buf, size);
+
+  if(txq_push(&tx_workers[medium].queue, TXQ_BULK, &tx_job, NULL) < 0)
+    transmit(ctx, medium, class, 0, deadline, dst, tx_buf, size, tx_senders, tx_nsenders);
+}
+
+static int expired(unsigned long deadline)
+{
+  return deadline && (long)(clock_us() - deadline) >= 0;
+}
+
+/* The earliest of two deadlines, zero for none. */
+static unsigned long earliest(unsigned long a, unsigned long b)
+{
+  if(!a || (b && (long)(b - a) < 0))
+    return b;
+  return a;
+}
+
+/* Drop a request that expired in the queue. */
+static void expire(const struct context *ctx, const struct tx_request *req)
+{
+  IF_VERBOSE(ctx, printf("Dropping expired request to %04X (ID %04X)\n", req->dst, req->id));
+
+  __atomic_add_fetch(&tx_expired, 1, __ATOMIC_RELAXED);
+  txq_complete(&tx_queue, req->class, 1);
+  if(admission)
+    admit_release(&req->from, HYBRID_SND_EXPIRED, 0);
+  if(tx_status)
+    send_status(&req->from, req->id, HYBRID_SND_EXPIRED, 0);
+  trace_end(req->trace, HYBRID_SND_EXPIRED);
+}
+
+static void * tx_thread_func(void *arg)
+{
+  const struct context *ctx = arg;
+  static struct tx_request req;
+  unsigned int size;
+  enum txq_class class;
+  unsigned long deadline;
+  struct agg frame;
+  uint16_t dst;
+  uint8_t opts;
+  int carry = 0;
+
+  while(1) {
+    /* Wait for a request unless one was left over from the
+       previous frame. With aggregation the next requests of
+       the same class, destination and options are packed in the same
+       frame, waiting up to the hold time for each of them. */
+    if(!carry) {
+      txq_pop(&tx_queue, &req, 1);
+      trace_step(req.trace, TRACE_DEQUEUE, -1);
+    }
+
+    dst      = req.dst;
+    class    = req.class;
+    opts     = req.opts;
+    deadline = req.deadline;
+    carry    = 0;
+
+    if(expired(deadline)) {
+      expire(ctx, &req);
+      continue;
+    }
+
+    tx_senders[0] = (struct tx_sender){ .from  = req.from,
+                                        .id    = req.id,
+                                        .trace = req.trace };
+    tx_nsenders = 1;
+
+    if(aggregate) {
+      agg_init(&frame, tx_buf, tx_max_payload);
+      agg_add(&frame, req.payload, req.size); /* checked when queued */
+
+      while(tx_nsenders < TX_MAX_SENDERS &&
+            txq_timedpop(&tx_queue, &req, hold_time) >= 0) {
+        trace_step(req.trace, TRACE_DEQUEUE, -1);
+
+        /* an expired request is dropped with the next frame
+           so that the requests are completed in order */
+        if(req.dst != dst || req.class != class || req.opts != opts || expired(req.deadline) ||
+           agg_add(&frame, req.payload, req.size) < 0) {
+          carry = 1;
+          break;
+        }
+
+        deadline = earliest(deadline, req.deadline);
+
+        tx_senders[tx_nsenders++] = (struct tx_sender){ .from  = req.from,
+                                                        .id    = req.id,
+                                                        .trace = req.trace };
+      }
+
+      size = frame.size;
+    }
+    else {
+      memcpy(tx_buf, req.payload, req.size);
+      size = req.size;
+    }
+
+    /* bulk frames go to the worker of the medium chosen for them,
+       the worker of the other medium may be sending meanwhile */
+    if(balance && (class == TXQ_BULK || !tx_priority) && only_medium(opts) < 0) {
+      dispatch(ctx, class, deadline, dst, size);
+      continue;
+    }
+
+    transmit(ctx, -1, class, opts, deadline, dst, tx_buf, size, tx_senders, tx_nsenders);
+  }
+
+  return NULL;
+}
+
+/* Try each spooled frame once, skipping the destinations that already
+   failed in this round. The lock is released while a frame is sent,
+   the records do not move until the next sync. Return the number of
+   frames that failed. */
+static unsigned int spool_round(const struct context *ctx)
+{
+  static unsigned char buf[BUF_SIZE];
+  struct journal_rec *rec;
+  uint16_t failed[SPOOL_MAX_DSTS];
+  unsigned int nfailed = 0;
+  unsigned int i, size;
+  uint16_t dst;
+  int ret;
+
+  pthread_mutex_lock(&spool_lock);
+  for(rec = journal_next(&spool, NULL) ; rec ; rec = journal_next(&spool, rec)) {
+    for(i = 0 ; i < nfailed && failed[i] != rec->dst ; i++);
+    if(i < nfailed)
+      continue;
+
+    dst  = rec->dst;
+    size = rec->size;
+    memcpy(buf, journal_payload(rec), size);
+    pthread_mutex_unlock(&spool_lock);
+
+    ret = hybrid_send(dst, buf, size);
+    IF_VERBOSE(ctx, printf("SPOOL    : %d bytes to %04X, status %d\n", size, dst, ret));
+
+    pthread_mutex_lock(&spool_lock);
+    if(ret == HYBRID_SND_SUCCESS) {
+      journal_done(&spool, rec);
+      standby_done(rec->dst, rec->crc);
+      __atomic_add_fetch(&spool_resent, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    failed[nfailed++] = dst;
+    if(nfailed == SPOOL_MAX_DSTS)
+      break;
+  }
+  pthread_mutex_unlock(&spool_lock);
+
+  return nfailed;
+}
+
+static void * spool_thread_func(void *arg)
+{
+  const struct context *ctx = arg;
+  unsigned int backoff = 0; /* retry at once after a restart */
+  unsigned int waited  = 0;
+  unsigned int pending;
+  int ret;
+
+  while(1) {
+    pthread_mutex_lock(&spool_lock);
+    ret = journal_sync(&spool);
+    pending = spool.count;
+    pthread_mutex_unlock(&spool_lock);
+    if(ret < 0)
+      warn("cannot sync spool");
+
+    /* a frame that went through means that a link is back */
+    if(__atomic_exchange_n(&spool_recovered, 0, __ATOMIC_RELAXED) &&
+       backoff > SPOOL_MIN_BACKOFF)
+      backoff = SPOOL_MIN_BACKOFF;
+
+    if(waited >= backoff && pending && !standby_passive()) {
+      if(spool_round(ctx))
+        backoff = backoff ? backoff * 2 : SPOOL_MIN_BACKOFF;
+      else
+        backoff = SPOOL_MIN_BACKOFF;
+      if(backoff > SPOOL_MAX_BACKOFF)
+        backoff = SPOOL_MAX_BACKOFF;
+      waited = 0;
+      continue; /* sync the frames done */
+    }
+
+    usleep(SPOOL_SYNC_INTERVAL * 1000);
+    waited += SPOOL_SYNC_INTERVAL;
+  }
+
+  return NULL;
+}
+
+/* The spool of the standby follows the one of the active gateway
+   (see standby.h). The frames are mirrored with their CRC. */
+static void mirror_store(uint16_t dst, const void *payload, unsigned int size)
+{
+  pthread_mutex_lock(&spool_lock);
+  if(journal_append(&spool, dst, payload, size) < 0)
+    __atomic_add_fetch(&spool_drops, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&spool_lock);
+}
+
+static void mirror_done(uint16_t dst, uint16_t crc)
+{
+  struct journal_rec *rec;
+
+  pthread_mutex_lock(&spool_lock);
+  for(rec = journal_next(&spool, NULL) ; rec ; rec = journal_next(&spool, rec)) {
+    if(rec->dst == dst && rec->crc == crc) {
+      journal_done(&spool, rec);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&spool_lock);
+}
+
+static void mirror_clear(void)
+{
+  struct journal_rec *rec;
+
+  pthread_mutex_lock(&spool_lock);
+  for(rec = journal_next(&spool, NULL) ; rec ; rec = journal_next(&spool, rec))
+    journal_done(&spool, rec);
+  pthread_mutex_unlock(&spool_lock);
+}
+
+static void mirror_resync(void)
+{
+  struct journal_rec *rec;
+
+  pthread_mutex_lock(&spool_lock);
+  for(rec = journal_next(&spool, NULL) ; rec ; rec = journal_next(&spool, rec))
+    standby_store(rec->dst, journal_payload(rec), rec->size);
+  pthread_mutex_unlock(&spool_lock);
+}
+
+/* send the spool at once */
+static void mirror_takeover(void)
+{
+  __atomic_store_n(&spool_recovered, 1, __ATOMIC_RELAXED);
+}
+
+static const struct standby_ops spool_ops = {
+  .store    = mirror_store,
+  .done     = mirror_done,
+  .clear    = mirror_clear,
+  .takeover = mirror_takeover,
+  .resync   = mirror_resync
+};
+
+static const struct standby_ops no_spool_ops;
+
+static void queue_request(const struct context *ctx, const unsigned char *buf,
+                          unsigned int size, const struct sockaddr_un *from)
+{
+  struct tx_request req = { .from  = *from,
+                            .class = TXQ_CONTROL };
+  unsigned int hdr_size = sizeof(uint16_t);
+
+  /* queued send message format:
+     [class (u8)][options (u8)][id (u16)][lifetime (u16)][dst (u16)][payload]
+     The class is only present with --priority, the options
+     only with --tx-options, the ID only with --tx-status and
+     the lifetime (in ms) only with --deadline. */
+  if(tx_priority)
+    hdr_size += sizeof(uint8_t);
+  if(tx_options)
+    hdr_size += sizeof(uint8_t);
+  if(tx_status)
+    hdr_size += sizeof(uint16_t);
+  if(tx_deadline)
+    hdr_size += sizeof(uint16_t);
+
+  if(size <= hdr_size) {
+    warnx("message too short");
+    return;
+  }
+
+  if(tx_priority) {
+    if(*buf >= TXQ_CLASSES) {
+      warnx("invalid priority class");
+      return;
+    }
+    req.class = *(uint8_t *)buf; buf += sizeof(uint8_t);
+  }
+  if(tx_options) {
+    req.opts = *(uint8_t *)buf; buf += sizeof(uint8_t);
+  }
+  if(tx_status) {
+    req.id = *(uint16_t *)buf; buf += sizeof(uint16_t);
+  }
+  if(standby_passive()) {
+    if(tx_status)
+      send_status(from, req.id, TX_STANDBY, 0);
+    else
+      warnx("standby gateway, frame dropped");
+    return;
+  }
+  if(tx_deadline) {
+    uint16_t lifetime = *(uint16_t *)buf; buf += sizeof(uint16_t);
+
+    if(lifetime)
+      req.deadline = clock_us() + lifetime * 1000UL;
+  }
+  req.dst  = *(uint16_t *)buf; buf += sizeof(uint16_t);
+  req.size = size - hdr_size;
+  memcpy(req.payload, buf, req.size);
+
+  /* a single message must fit in a frame */
+  if(aggregate && req.size + AGG_PREFIX_SIZE(req.size) > tx_max_payload) {
+    if(tx_status)
+      send_status(from, req.id, TX_ERR_TOOLONG, 0);
+    else
+      warnx("message too long");
+    return;
+  }
+
+  if(admission) {
+    int ret = admit_request(from, req.size, clock_us());
+
+    if(ret) {
+      if(tx_status)
+        send_status(from, req.id, ret, 0);
+      else
+        warnx("%s, frame dropped", ret == ADMIT_ERR_RATE ? "rate limit exceeded" : "no credit left");
+      return;
+    }
+  }
+
+  IF_VERBOSE(ctx, printf("Queuing %d bytes to %04X (ID %04X, class %d)\n",
+                         req.size, req.dst, req.id, req.class));
+
+  req.trace = trace_start(req.dst, req.size);
+  if(txq_push(&tx_queue, req.class, &req, NULL) < 0) {
+    trace_end(req.trace, TX_ERR_QUEUE_FULL);
+    if(admission)
+      admit_release(from, TX_ERR_QUEUE_FULL, 0);
+    if(tx_status)
+      send_status(from, req.id, TX_ERR_QUEUE_FULL, 0);
+    else
+      warnx("transmit queue full, frame dropped");
+  }
+}
+
+/* Answer a poll for the last payloads of a source. */
+static void send_recent(const struct sockaddr_un *to, const unsigned char *msg)
+{
+  static unsigned char reply[RECENT_REPLY];
+  unsigned char *b = reply + sizeof(uint8_t);
+  unsigned long now = clock_us(), stamp;
+  unsigned int i;
+  uint16_t src;
+  int size;
+
+  memcpy(&src, msg + sizeof(uint8_t), sizeof(uint16_t));
+  reply[0] = 0;
+
+  for(i = 0 ; recent_depth && i < msg[3] ; i++) {
+    unsigned char *payload = b + sizeof(uint32_t) + sizeof(uint16_t);
+
+    if(reply + sizeof(reply) - payload < HYBRID_MAX_PAYLOAD)
+      break;
+    size = recent_get(&recent, src, i, payload, HYBRID_MAX_PAYLOAD, &stamp);
+    if(size < 0)
+      break;
+
+    *(uint32_t *)b = (now - stamp) / 1000; b += sizeof(uint32_t);
+    *(uint16_t *)b = size;                 b += sizeof(uint16_t);
+    b += size;
+    reply[0]++;
+  }
+
+  if(sendto(sub_sd, reply, b - reply, MSG_DONTWAIT,
+            (const struct sockaddr *)to, sizeof(*to)) < 0)
+    warn("network error"); /* we don't fail on client error */
+}
+
+/* Answer a query for the path to a destination. */
+static void send_path(const struct sockaddr_un *to, const unsigned char *msg)
+{
+  unsigned char reply[sizeof(uint8_t) + sizeof(uint16_t) * 4 + sizeof(uint32_t) * 3];
+  unsigned char *b = reply;
+  struct hybrid_path path;
+  uint16_t dst;
+  long budget;
+
+  memcpy(&dst, msg + sizeof(uint8_t), sizeof(uint16_t));
+  hybrid_path(dst, &path);
+  budget = path.lora_budget > INT32_MAX ? INT32_MAX :
+           path.lora_budget < INT32_MIN ? INT32_MIN : path.lora_budget;
+
+  *b = path.medium < 0 ? 0xff : path.medium;                 b += sizeof(uint8_t);
+  *(uint16_t *)b = path.next_hop;                            b += sizeof(uint16_t);
+  *(uint16_t *)b = path.max_message;                         b += sizeof(uint16_t);
+  *(uint16_t *)b = path.frame[HYBRID_SOURCE_G3PLC];          b += sizeof(uint16_t);
+  *(uint16_t *)b = path.frame[HYBRID_SOURCE_LORA];           b += sizeof(uint16_t);
+  *(uint32_t *)b = path.goodput[HYBRID_SOURCE_G3PLC];        b += sizeof(uint32_t);
+  *(uint32_t *)b = path.goodput[HYBRID_SOURCE_LORA];         b += sizeof(uint32_t);
+  *(int32_t *)b  = budget;                                   b += sizeof(int32_t);
+
+  if(sendto(sub_sd, reply, b - reply, MSG_DONTWAIT,
+            (const struct sockaddr *)to, sizeof(*to)) < 0)
+    warn("network error"); /* we don't fail on client error */
+}
+
+static void handle_subscription(void)
+{
+  unsigned char msg[SUB_MSG_SIZE + 1];
+  struct sockaddr_un from;
+  socklen_t from_len = sizeof(from);
+  ssize_t n;
+
+  n = recvfrom(sub_sd, msg, sizeof(msg), 0, (struct sockaddr *)&from, &from_len);
+  if(n < 0) {
+    warn("network error");
+    return; /* we don't fail on client error */
+  }
+
+  if(from_len <= offsetof(struct sockaddr_un, sun_path)) {
+    warnx("unbound subscription client");
+    return;
+  }
+  ((char *)&from)[from_len < sizeof(from) ? from_len : sizeof(from) - 1] = '\0';
+
+  if(n == SUB_LAST_SIZE && msg[0] == SUB_LAST) {
+    send_recent(&from, msg);
+    return;
+  }
+
+  if(n == SUB_PATH_SIZE && msg[0] == SUB_PATH) {
+    send_path(&from, msg);
+    return;
+  }
+
+  sub_request(msg, n, &from);
 }
 
 static void start(const struct context *ctx)
 {
   /* send message format:
      [dst (u16)][payload] */
-  unsigned char buf[BUF_SIZE];
-  const char *err;
+  const char *err_str;
+  struct trace *trace;
   uint16_t dst;
-  int n, ret;
+  struct pollfd fds[] = { { .fd = sd,     .events = POLLIN },
+                          { .fd = sub_sd, .events = POLLIN } };
+  int i, n, ret;
+
+  if(tx_queued) {
+    txq_init(&tx_queue, tx_policy, NULL, TX_QUEUE_DEPTH, sizeof(struct tx_request));
+    if(tx_fair)
+      txq_fair(&tx_queue, request_flow, request_cost, 0);
+
+    ret = pthread_create(&tx_thread, NULL, tx_thread_func, (void *)ctx);
+    if(ret)
+      errx(EXIT_FAILURE, "cannot create transmit thread");
+  }
+
+  for(i = 0 ; balance && i < 2 ; i++) {
+    tx_workers[i].ctx = ctx;
+    txq_init(&tx_workers[i].queue, TXQ_STRICT, NULL, TX_JOB_DEPTH, sizeof(struct tx_job));
+
+    ret = pthread_create(&tx_workers[i].thread, NULL, tx_worker_func, &tx_workers[i]);
+    if(ret)
+      errx(EXIT_FAILURE, "cannot create transmit worker");
+  }
+
+  if(spool_path) {
+    ret = pthread_create(&spool_thread, NULL, spool_thread_func, (void *)ctx);
+    if(ret)
+      errx(EXIT_FAILURE, "cannot create spool thread");
+  }
+
+  if(standby_addr)
+    standby_open(standby_addr, spool_path ? &spool_ops : &no_spool_ops);
+  if(mirror_addr)
+    standby_mirror(mirror_addr, mirror_beat, spool_path ? &spool_ops : &no_spool_ops);
+
+  if(poll_path)
+    poller_start(poll_interval, ctx->verbose);
 
   while(1) {
-    n = recv(sd, buf, BUF_SIZE, 0);
+    if(poll(fds, 2, -1) < 0) {
+      if(errno != EINTR)
+        err(EXIT_FAILURE, "poll");
+      continue;
+    }
+
+    if(fds[1].revents & POLLIN)
+      handle_subscription();
+
+    if(!(fds[0].revents & POLLIN))
+      continue;
+
+    n = batch_recv(sd, &in_batch);
     if(n < 0) {
       warn("network error");
       continue; /* we don't fail on client error */
     }
 
-    if(n <= (int)sizeof(uint16_t)) {
-      warnx("message too short");
+    if(tx_queued) {
+      for(i = 0 ; i < n ; i++)
+        queue_request(ctx, batch_buf(&in_batch, i), batch_len(&in_batch, i),
+                      batch_addr(&in_batch, i));
       continue;
     }
 
-    dst = *(uint16_t *)buf;
+    for(i = 0 ; i < n ; i++) {
+      const unsigned char *buf = batch_buf(&in_batch, i);
+      int size = batch_len(&in_batch, i);
 
-    IF_VERBOSE(ctx, printf("Sending %d bytes to %04X\n",
-                           n - (int)sizeof(uint16_t), dst));
-    ret = hybrid_send(dst,
-                      buf + sizeof(uint16_t),
-                      n   - sizeof(uint16_t));
+      if(size <= (int)sizeof(uint16_t)) {
+        warnx("message too short");
+        continue;
+      }
 
-    switch(ret) {
-    case HYBRID_ERR_LORA:
-      err = loramac_rcv2str(lora_errno);
-      break;
-    case HYBRID_ERR_G3PLC:
-      err = g3plc_rcv2str(g3plc_errno);
-    default:
-      err = "hybrid layer error";
+      if(standby_passive()) {
+        warnx("standby gateway, frame dropped");
+        continue;
+      }
+
+      dst = *(uint16_t *)buf;
+
+      IF_VERBOSE(ctx, printf("Sending %d bytes to %04X\n",
+                             size - (int)sizeof(uint16_t), dst));
+      trace = trace_start(dst, size - sizeof(uint16_t));
+      trace_step(trace, TRACE_SEND, -1);
+      trace_set(trace);
+      account_set(client_account(batch_addr(&in_batch, i)));
+      ret = hybrid_send(dst,
+                        buf + sizeof(uint16_t),
+                        size - sizeof(uint16_t));
+      trace_set(NULL);
+      trace_end(trace, ret);
+
+      switch(ret) {
+      case HYBRID_ERR_LORA:
+        err_str = loramac_rcv2str(lora_errno);
+        break;
+      case HYBRID_ERR_G3PLC:
+        err_str = g3plc_rcv2str(g3plc_errno);
+      default:
+        err_str = "hybrid layer error";
+      }
+      IF_VERBOSE(ctx, printf("TX STATUS: %s (%d)\n", err_str, ret));
+      IF_VERBOSE(ctx, printf("---------\n"));
     }
-    IF_VERBOSE(ctx, printf("TX STATUS: %s (%d)\n", err, ret));
-    IF_VERBOSE(ctx, printf("---------\n"));
   }
 }
 
 static void destroy(const struct context *ctx)
 {
-  UNUSED(ctx);
+  struct txq_stats stats;
+  int i;
 
+  for(i = 0 ; tx_queued && i < TXQ_CLASSES ; i++) {
+    txq_stats(&tx_queue, i, &stats);
+    IF_VERBOSE(ctx, printf("CLASS %d: %lu frames, %lu dropped, latency %lu us avg, %lu us max\n",
+                           i, stats.count, stats.drops,
+                           stats.count ? stats.total / stats.count : 0, stats.max));
+  }
+  if(tx_deadline)
+    IF_VERBOSE(ctx, printf("EXPIRED: %lu messages\n", tx_expired));
+
+  if(poll_path) {
+    struct poller_stats polls;
+
+    poller_stats(&polls);
+    IF_VERBOSE(ctx, printf("POLL: %lu cycles, %lu polls, %lu confirmed, %lu retried, %lu deferred, "
+                           "%lu missed, %lu overruns, %lu left to others, latency %lu us\n",
+                           polls.cycles, polls.polls, polls.confirms, polls.retries, polls.deferred,
+                           polls.missed, polls.overruns, polls.others, polls.srtt));
+  }
+
+  if(spool_path) {
+    IF_VERBOSE(ctx, printf("SPOOL: %lu frames stored, %lu sent again, %lu dropped, %u left\n",
+                           spool_stored, spool_resent, spool_drops, spool.count));
+    pthread_mutex_lock(&spool_lock);
+    if(journal_sync(&spool) < 0)
+      warn("cannot sync spool");
+    pthread_mutex_unlock(&spool_lock);
+  }
+
+  batch_free(&in_batch);
+  batch_free(&out_batch);
+  pool_free(&rec_pool);
+  if(recent_depth)
+    recent_free(&recent);
+  close(sub_sd);
   exit_clean();
 }
 
 static int parse_option(const struct context *ctx, int c)
 {
+  int err;
+
   UNUSED(ctx);
 
   switch(c) {
@@ -186,6 +1422,104 @@ static int parse_option(const struct context *ctx, int c)
   case 'R':
     socket_app_path = optarg;
     return 1;
+  case OPT_SUB_PATH:
+    socket_sub_path = optarg;
+    return 1;
+  case OPT_TX_STATUS:
+    tx_status = 1;
+    return 1;
+  case OPT_TX_OPTIONS:
+    tx_options = 1;
+    return 1;
+  case OPT_PRIORITY:
+    tx_priority = 1;
+    return 1;
+  case OPT_WEIGHTED:
+    tx_policy = TXQ_WEIGHTED;
+    return 1;
+  case OPT_FAIR:
+    tx_fair = 1;
+    return 1;
+  case OPT_AGGREGATE:
+    aggregate = 1;
+    return 1;
+  case OPT_META:
+    meta_records = 1;
+    return 1;
+  case OPT_SPOOL:
+    spool_path = optarg;
+    return 1;
+  case OPT_POLL:
+    poll_path = optarg;
+    poller_load(poll_path);
+    return 1;
+  case OPT_STANDBY:
+    standby_addr = optarg;
+    return 1;
+  case OPT_MIRROR:
+    mirror_addr = optarg;
+    return 1;
+  case OPT_POLL_INTERVAL:
+    poll_interval = xatou(optarg, &err) * 1000UL;
+    if(err || !poll_interval)
+      errx(EXIT_FAILURE, "invalid polling interval");
+    return 1;
+  case OPT_DEADLINE:
+    tx_deadline = 1;
+    return 1;
+  case OPT_CREDITS:
+    credits = xatou(optarg, &err);
+    if(err || !credits || credits > ADMIT_MAX_WINDOW)
+      errx(EXIT_FAILURE, "invalid credits");
+    return 1;
+  case OPT_RATE_LIMIT:
+    rate_limit = xatou(optarg, &err);
+    if(err || !rate_limit)
+      errx(EXIT_FAILURE, "invalid rate limit");
+    return 1;
+  case OPT_BURST:
+    burst = xatou(optarg, &err);
+    if(err || burst < HYBRID_MAX_PAYLOAD)
+      errx(EXIT_FAILURE, "invalid burst (at least %lu bytes)", (unsigned long)HYBRID_MAX_PAYLOAD);
+    return 1;
+  case OPT_CLIENT_QUOTA:
+    if(nquotas == ADMIT_MAX_QUOTAS)
+      errx(EXIT_FAILURE, "too many client quotas (up to %d)", ADMIT_MAX_QUOTAS);
+    quotas[nquotas++] = optarg;
+    return 1;
+  case OPT_CLIENT_STATS:
+    client_stats = 1;
+    return 1;
+  case OPT_RECENT:
+    recent_depth = xatou(optarg, &err);
+    if(err || !recent_depth)
+      errx(EXIT_FAILURE, "invalid number of recent payloads");
+    return 1;
+  case OPT_RECENT_SOURCES:
+    recent_sources = xatou(optarg, &err);
+    if(err || !recent_sources)
+      errx(EXIT_FAILURE, "invalid number of recent sources");
+    return 1;
+  case OPT_SPOOL_SIZE:
+    spool_size = xatou(optarg, &err) * 1024UL;
+    if(err || !spool_size)
+      errx(EXIT_FAILURE, "invalid spool size");
+    return 1;
+  case OPT_HOLD_TIME:
+    hold_time = xatou(optarg, &err);
+    if(err)
+      errx(EXIT_FAILURE, "cannot parse hold time");
+    return 1;
+  case OPT_BATCH:
+    batch_size = xatou(optarg, &err);
+    if(err || !batch_size)
+      errx(EXIT_FAILURE, "invalid batch size");
+    return 1;
+  case OPT_FLUSH_TIMEOUT:
+    iface_mode.flush_timeout = xatou(optarg, &err);
+    if(err)
+      errx(EXIT_FAILURE, "cannot parse flush timeout");
+    return 1;
   }
 
   return 0;
@@ -202,5 +1536,6 @@ struct iface_mode iface_mode = {
 
   .init    = init,
   .destroy = destroy,
-  .start   = start
+  .start   = start,
+  .flush   = flush
 };
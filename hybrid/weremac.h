@@ -0,0 +1,181 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* In-process interface to the hybrid driver (libweremac).
+   This is the same driver as the hybrid programs, with the
+   G3-PLC and LoRaMAC cores and the Linux platform layer, linked
+   into the caller's process so that frames are neither copied
+   through a socket nor scheduled through another process.
+
+   Only the functions and types declared here are exported by
+   the shared library, they keep their meaning within a major
+   version (see WEREMAC_MAJOR). */
+
+#ifndef _WEREMAC_H_
+#define _WEREMAC_H_
+
+#include <stdint.h>
+
+#define WEREMAC_MAJOR 1
+#define WEREMAC_MINOR 3
+
+/* Largest message and number of messages in a receive batch. */
+#define WEREMAC_MAX_MESSAGE 1024
+#define WEREMAC_MAX_BATCH   32
+
+/* Library status, the other send status are the ones of
+   the hybrid layer (see weremac_strerror()). */
+enum weremac_status {
+  WEREMAC_SUCCESS =  0,
+  WEREMAC_BUSY     = -1, /* asynchronous queue full or too many calls */
+  WEREMAC_CLOSED   = -2, /* instance closed */
+  WEREMAC_TIMEOUT  = -3, /* no response to a call in time */
+  WEREMAC_DISABLED = -4, /* calls not enabled (see weremac_call()) */
+  WEREMAC_UNSYNCED = -5  /* network time not synchronized (see weremac_time()) */
+};
+
+/* Medium of a received message */
+enum weremac_medium {
+  WEREMAC_LORA,
+  WEREMAC_G3PLC
+};
+
+/* Received message. The payload is only valid during the call. */
+struct weremac_msg {
+  uint16_t      src;
+  uint16_t      dst;
+  int           status; /* 0, or the receive error with --invalid */
+  int           medium; /* (see weremac_medium) */
+  uint8_t       lqi;    /* link quality (G3-PLC only) */
+  unsigned long stamp;  /* monotonic clock in us when the message was complete */
+  const void   *payload;
+  unsigned int  size;
+};
+
+struct weremac_config {
+  uint16_t    address;   /* short MAC address of this node */
+  const char *lora_dev;  /* LoRa module UART */
+  const char *g3plc_dev; /* G3-PLC modem UART */
+
+  /* Options of the hybrid programs (e.g. "--frag", "-r", "5"),
+     NULL terminated. This may be NULL. Invalid options and devices
+     are fatal as in the programs. */
+  const char *const *options;
+
+  /* Received messages are delivered by batches of at most
+     WEREMAC_MAX_BATCH from the threads that read the devices,
+     one batch at a time, so the callback should return quickly.
+     A partial batch is delivered once its first message is
+     batch_timeout us old, with 0 each message is delivered
+     at once without waiting. */
+  void (*cb_recv)(const struct weremac_msg *msgs, unsigned int count, void *data);
+  unsigned int batch_timeout;
+
+  /* Called from a single thread of the driver once a message
+     queued with weremac_send_async() was sent, with the status
+     of weremac_send(). This may be NULL. */
+  void (*cb_sent)(void *cookie, int status, void *data);
+
+  void *data; /* context data passed to the callbacks */
+};
+
+/* Context handle of an instance. */
+struct weremac;
+
+/* Open the devices and start the driver threads. The LoRa
+   link is up on return, G3-PLC boots in the background (see
+   weremac_ready()). The drivers keep global state so there is
+   one instance per process: NULL is returned when it is
+   already opened. */
+struct weremac * weremac_open(const struct weremac_config *conf);
+
+/* Stop the callbacks once the queued messages are sent. The
+   devices stay attached to the process until it exits, so
+   the instance cannot be opened again. */
+void weremac_close(struct weremac *w);
+
+/* Send a message and block until it is acknowledged or given
+   up. This may be called from several threads at once. */
+int weremac_send(struct weremac *w, uint16_t dst, const void *payload, unsigned int size);
+
+/* Queue a message, it is copied and sent in order from the
+   thread of the driver. Return WEREMAC_BUSY when the queue is
+   full, the status of the send is given to cb_sent(). */
+int weremac_send_async(struct weremac *w, uint16_t dst, const void *payload,
+                       unsigned int size, void *cookie);
+
+/* Copy the nth last message received from a source (0 is the
+   newest) and its stamp (see weremac_msg). The messages are only
+   kept with the "--recent" option, so that the polls for the
+   latest reading of a meter are answered without any traffic.
+   Return the size of the message, truncated to the buffer, or
+   -1 when there is none. */
+int weremac_last(struct weremac *w, uint16_t src, unsigned int nth,
+                 void *buf, unsigned int size, unsigned long *stamp);
+
+/* Completion of a call, the payload of the response is only
+   valid during the call and NULL unless the status is 0. */
+typedef void (*weremac_done)(void *cookie, int status, const void *payload, unsigned int size);
+
+/* Send a request and call done() once the response of the
+   destination arrived, with WEREMAC_TIMEOUT after timeout us or
+   with the status of the send when it failed. The calls are only
+   available with the "--rpc N" option on both ends, N being the
+   number of calls which may be outstanding at once towards any
+   destinations. The requests are queued as weremac_send_async(),
+   responses and timeouts are given from the driver threads. The
+   requests and responses are not given to cb_recv(). Return
+   WEREMAC_BUSY when the queue or the calls are full, otherwise
+   done() is always called once. */
+int weremac_call(struct weremac *w, uint16_t dst, const void *payload, unsigned int size,
+                 unsigned long timeout, weremac_done done, void *cookie);
+
+/* Handle the requests received from other nodes, each answered
+   with weremac_reply() on its identifier, possibly later and
+   from another thread. Requests are dropped without a handler. */
+void weremac_serve(struct weremac *w,
+                   void (*cb_request)(uint16_t src, uint16_t id, const void *payload,
+                                      unsigned int size, void *data),
+                   void *data);
+
+/* Queue the response to a request. */
+int weremac_reply(struct weremac *w, uint16_t dst, uint16_t id,
+                  const void *payload, unsigned int size);
+
+/* Network time in us of a stamp of the monotonic clock (see
+   weremac_msg), e.g. to date a message, or of now when stamp is
+   zero. The time is distributed by the gateway with the
+   "--time-master MS" option and followed by the nodes with the
+   "--time-sync" option, it is the realtime clock of the gateway.
+   Return WEREMAC_UNSYNCED until the first beacon and once the
+   beacons stopped, otherwise 0. */
+int weremac_time(const struct weremac *w, unsigned long stamp, uint64_t *us);
+
+/* Whether G3-PLC is booted and started. */
+int weremac_ready(const struct weremac *w);
+
+/* Description of a status. */
+const char * weremac_strerror(int status);
+
+#endif /* _WEREMAC_H_ */
@@ -0,0 +1,147 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _POSIX_C_SOURCE 200112L
+#endif /* __linux__ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+
+#include "async.h"
+#include "txq.h"
+
+/* A queued message. The completion carries the handle and
+   argument back along with the status of the send. */
+struct async_request {
+  struct async_completion completion;
+  uint16_t      dst;
+  unsigned int  size;
+  unsigned char payload[LORAMAC_MAX_MESSAGE];
+};
+
+static struct loramac_ctx *async_mac;
+static async_callback async_cb;
+static void *async_data;
+
+static struct txq async_queue;
+static unsigned long async_handle;
+
+/* Completions are written whole to the pipe (they are smaller
+   than PIPE_BUF) so that the reader never sees a partial one. */
+static int async_pipe[2];
+
+static void * sender_thread_func(void *arg)
+{
+  static struct async_request req;
+  struct async_completion *c = &req.completion;
+
+  (void)arg;
+
+  while(1) {
+    txq_pop(&async_queue, &req, 1);
+
+    c->tx     = 0;
+    c->status = loramac_send(async_mac, req.dst, req.payload, req.size, &c->tx);
+    txq_complete(&async_queue, TXQ_CONTROL, 1);
+
+    if(async_cb)
+      async_cb(c, async_data);
+
+    /* Completions are dropped when the pipe is full,
+       that is when nobody reaps them. */
+    while(write(async_pipe[1], c, sizeof(*c)) < 0 && errno == EINTR);
+  }
+
+  return NULL;
+}
+
+void async_init(struct loramac_ctx *mac, unsigned int depth,
+                async_callback cb, void *data)
+{
+  pthread_t thread;
+  int i;
+
+  async_mac  = mac;
+  async_cb   = cb;
+  async_data = data;
+
+  if(pipe(async_pipe) < 0)
+    err(EXIT_FAILURE, "pipe");
+
+  for(i = 0 ; i < 2 ; i++)
+    if(fcntl(async_pipe[i], F_SETFL, O_NONBLOCK) < 0)
+      err(EXIT_FAILURE, "fcntl");
+
+  /* a single class, completions are then reported in order */
+  txq_init(&async_queue, TXQ_STRICT, NULL, depth, sizeof(struct async_request));
+
+  if(pthread_create(&thread, NULL, sender_thread_func, NULL))
+    errx(EXIT_FAILURE, "cannot create sender thread");
+  pthread_detach(thread);
+}
+
+int async_send(uint16_t dst, const void *payload, unsigned int payload_size,
+               void *arg, unsigned long *handle)
+{
+  struct async_request req;
+
+  if(payload_size > LORAMAC_MAX_MESSAGE)
+    return LORAMAC_SND_TOOLONG;
+
+  req.completion = (struct async_completion){
+    .handle = __atomic_fetch_add(&async_handle, 1, __ATOMIC_RELAXED),
+    .arg    = arg };
+  req.dst  = dst;
+  req.size = payload_size;
+  memcpy(req.payload, payload, payload_size);
+
+  if(txq_push(&async_queue, TXQ_CONTROL, &req, NULL) < 0)
+    return LORAMAC_SND_BUSY;
+
+  if(handle)
+    *handle = req.completion.handle;
+  return LORAMAC_SND_SUCCESS;
+}
+
+int async_fd(void)
+{
+  return async_pipe[0];
+}
+
+int async_reap(struct async_completion *completion)
+{
+  ssize_t n;
+
+  do
+    n = read(async_pipe[0], completion, sizeof(*completion));
+  while(n < 0 && errno == EINTR);
+
+  return n == sizeof(*completion) ? 0 : -1;
+}
@@ -0,0 +1,67 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _ASYNC_H_
+#define _ASYNC_H_
+
+#include <stdint.h>
+
+#include "loramac.h"
+
+/* Completion of an asynchronous send. */
+struct async_completion {
+  unsigned long handle;
+  int           status; /* see loramac_send_status */
+  unsigned int  tx;     /* number of transmissions (see loramac_send()) */
+  void         *arg;    /* as given to async_send() */
+};
+
+/* Called from the sender thread for each completed send. */
+typedef void (*async_callback)(const struct async_completion *completion, void *data);
+
+/* Start the sender thread. It owns the transmit side of the driver
+   and sends the queued messages one at a time with loramac_send().
+   Up to depth messages (a power of two) can be queued. The callback
+   may be NULL, completions are also queued on a pipe which can be
+   polled (see async_fd()). Exit on error. */
+void async_init(struct loramac_ctx *mac, unsigned int depth,
+                async_callback cb, void *data);
+
+/* Copy a message to the transmit queue and return immediately.
+   The handle of the message is stored in handle when not null and
+   is reported with its completion. Return LORAMAC_SND_SUCCESS when
+   queued, LORAMAC_SND_TOOLONG when the message is too long or
+   LORAMAC_SND_BUSY when the queue is full. This can be called
+   from any thread. */
+int async_send(uint16_t dst, const void *payload, unsigned int payload_size,
+               void *arg, unsigned long *handle);
+
+/* Descriptor that is readable when completions are pending. */
+int async_fd(void);
+
+/* Dequeue the next completion without waiting.
+   Return 0 on success and -1 when none is pending. */
+int async_reap(struct async_completion *completion);
+
+#endif /* _ASYNC_H_ */
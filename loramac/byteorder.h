@@ -0,0 +1,58 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _BYTEORDER_H_
+#define _BYTEORDER_H_
+
+#include <stdint.h>
+
+/* Byte ordering of the fields on the wire.
+
+   By default every conversion calls the function given in the
+   configuration since not all platforms provide them with the
+   POSIX names. When the byte order of the target is known at
+   build time, PLATFORM_ENDIAN resolves the conversions to a
+   builtin byte swap or to nothing and the configuration
+   functions are never called (they may be NULL):
+
+     make PLATFORM_ENDIAN=native  (byte order of the compiler)
+     -DPLATFORM_ENDIAN=PLATFORM_LITTLE_ENDIAN
+     -DPLATFORM_ENDIAN=PLATFORM_BIG_ENDIAN */
+#define PLATFORM_LITTLE_ENDIAN 1234
+#define PLATFORM_BIG_ENDIAN    4321
+
+#if !defined(PLATFORM_ENDIAN)
+# define BO_HTONS(conf, v) (conf).htons(v)
+# define BO_NTOHS(conf, v) (conf).ntohs(v)
+#elif PLATFORM_ENDIAN == PLATFORM_LITTLE_ENDIAN
+# define BO_HTONS(conf, v) __builtin_bswap16(v)
+# define BO_NTOHS(conf, v) __builtin_bswap16(v)
+#elif PLATFORM_ENDIAN == PLATFORM_BIG_ENDIAN
+# define BO_HTONS(conf, v) ((uint16_t)(v))
+# define BO_NTOHS(conf, v) ((uint16_t)(v))
+#else
+# error "PLATFORM_ENDIAN is neither PLATFORM_LITTLE_ENDIAN nor PLATFORM_BIG_ENDIAN"
+#endif
+
+#endif /* _BYTEORDER_H_ */
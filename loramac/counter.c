@@ -22,72 +22,55 @@
    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifdef __linux__
+# define _POSIX_C_SOURCE 200112L
+#endif /* __linux__ */
+
 #include <sys/mman.h>
-#include <unistd.h>
-#include <stdlib.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <fcntl.h>
 #include <err.h>
 
-#include "safe-call.h"
-
-/* FIXME: This is Linux specific, isn't it?
-   We need a pragma to avoid compilation on
-   other OS. */
+#include "counter.h"
 
-#define BCM2708_PERI_BASE 0x20000000
-#define GPIO_BASE         (BCM2708_PERI_BASE + 0x200000)
-#define BLOCK_SIZE        4096
+#define COUNTER_MAGIC 0x52544e43
 
-static volatile uint32_t *gpio_reg;
+struct counter_state {
+  uint32_t magic;
+  uint32_t next;
+};
 
-void rpi_gpio_init(void)
+uint32_t * counter_open(const char *path, uint32_t counter)
 {
-  int fd = xopen("/dev/mem", O_RDWR | O_SYNC, 0);
-  gpio_reg = mmap(0, BLOCK_SIZE,
-                  PROT_READ | PROT_WRITE,
-                  MAP_SHARED,
-                  fd, GPIO_BASE);
-  if(gpio_reg == MAP_FAILED)
-    err(EXIT_FAILURE, "cannot mmap GPIO");
+  struct counter_state *state;
+  int fd;
+
+  fd = open(path, O_RDWR | O_CREAT, 0600);
+  if(fd < 0)
+    err(EXIT_FAILURE, "cannot open %s", path);
+
+  /* a new file reads as zeroes, which starts from the clock */
+  if(ftruncate(fd, sizeof(struct counter_state)) < 0)
+    err(EXIT_FAILURE, "cannot resize %s", path);
+
+  state = mmap(NULL, sizeof(struct counter_state), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(state == MAP_FAILED)
+    err(EXIT_FAILURE, "cannot map %s", path);
+
+  if(state->magic == COUNTER_MAGIC) {
+    if(state->next > UINT32_MAX - COUNTER_BLOCK)
+      errx(EXIT_FAILURE, "the counters of %s are exhausted, change the keys", path);
+    counter = state->next + COUNTER_BLOCK;
+  }
+
+  /* the skipped block must be on disk before a counter of it is sent */
+  state->next  = counter;
+  state->magic = COUNTER_MAGIC;
+  if(msync(state, sizeof(struct counter_state), MS_SYNC) < 0 || fsync(fd) < 0)
+    err(EXIT_FAILURE, "cannot sync %s", path);
   close(fd);
-}
-
-void rpi_gpio_destroy(void)
-{
-  munmap((void *)gpio_reg, BLOCK_SIZE);
-}
-
-void rpi_gpio_set_mode(unsigned int gpio, unsigned int mode)
-{
-  int reg, shift;
-
-  reg   = gpio / 10;
-  shift = (gpio % 10) * 3;
 
-  gpio_reg[reg] = (gpio_reg[reg] & ~(7 << shift)) | /* clear pin conf */
-                  (mode << shift);                  /* apply mode */
-}
-
-void rpi_gpio_set(unsigned int gpio)
-{
-  *(gpio_reg + 7)  = 1 << gpio;
-}
-
-void rpi_gpio_clr(unsigned int gpio)
-{
-  *(gpio_reg + 10) = 1 << gpio;
-}
-
-int rpi_gpio_get(unsigned int gpio)
-{
-  return *(gpio_reg + 13) & (1 << gpio);
-}
-
-int rpi_gpio_check(unsigned int gpio)
-{
-  /* FIXME: not sure this is sufficient */
-  if(gpio <= 27)
-    return 1;
-  return 0;
+  return &state->next;
 }
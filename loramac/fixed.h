@@ -0,0 +1,84 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _FIXED_H_
+#define _FIXED_H_
+
+#include "loramac.h"
+
+/* Configuration of the driver fixed at build time.
+
+   By default the hot paths test the flags of the configuration and
+   call the platform functions through it, since a single build serves
+   every configuration. A production build with a single configuration
+   can fix them at build time instead. The flag tests then fold into
+   constants and the platform functions are called directly (and are
+   inlined with link-time optimization):
+
+     make FIXED_FLAGS="LORAMAC_NOACK|LORAMAC_PROMISCUOUS"
+     make FIXED_PLATFORM=1  (UART and lock functions of this tree)
+     -DLORAMAC_FIXED_FLAGS="(LORAMAC_NOACK)"
+     -DPLATFORM_UART_SEND=uart_send -DPLATFORM_UART_SENDV=uart_sendv
+     -DPLATFORM_LOCK=lock -DPLATFORM_UNLOCK=unlock
+
+   The configuration given to loramac_init() must still hold the same
+   flags and functions, it fails with LORAMAC_INIT_FIXED otherwise. */
+
+#ifdef LORAMAC_FIXED_FLAGS
+# define FLAGS(ctx) ((unsigned long)(LORAMAC_FIXED_FLAGS))
+#else
+# define FLAGS(ctx) ((ctx)->conf.flags)
+#endif
+
+#ifdef PLATFORM_UART_SEND
+int PLATFORM_UART_SEND(const void *buf, unsigned int size, void *data);
+# define UART_SEND(ctx, buf, size) PLATFORM_UART_SEND(buf, size, (ctx)->conf.data)
+#else
+# define UART_SEND(ctx, buf, size) (ctx)->conf.uart_send(buf, size, (ctx)->conf.data)
+#endif
+
+#ifdef PLATFORM_UART_SENDV
+int PLATFORM_UART_SENDV(const struct loramac_iovec *iov, unsigned int count, void *data);
+# define HAS_UART_SENDV(ctx) 1
+# define UART_SENDV(ctx, iov, count) PLATFORM_UART_SENDV(iov, count, (ctx)->conf.data)
+#else
+# define HAS_UART_SENDV(ctx) ((ctx)->conf.uart_sendv != NULL)
+# define UART_SENDV(ctx, iov, count) (ctx)->conf.uart_sendv(iov, count, (ctx)->conf.data)
+#endif
+
+#ifdef PLATFORM_LOCK
+void PLATFORM_LOCK(void *data);
+# define LOCK(ctx) PLATFORM_LOCK((ctx)->conf.data)
+#else
+# define LOCK(ctx) (ctx)->conf.lock((ctx)->conf.data)
+#endif
+
+#ifdef PLATFORM_UNLOCK
+void PLATFORM_UNLOCK(void *data);
+# define UNLOCK(ctx) PLATFORM_UNLOCK((ctx)->conf.data)
+#else
+# define UNLOCK(ctx) (ctx)->conf.unlock((ctx)->conf.data)
+#endif
+
+#endif /* _FIXED_H_ */
@@ -0,0 +1,394 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "frag.h"
+
+#define BIT_ISSET(b, i) ((b)[(i) >> 3] &  (1 << ((i) & 7)))
+#define BIT_SET(b, i)   ((b)[(i) >> 3] |= (1 << ((i) & 7)))
+#define MIN(a, b)       ((a) < (b) ? (a) : (b))
+
+unsigned int frag_count(unsigned int frag_size, unsigned int size)
+{
+  unsigned int count = size ? (size + frag_size - 1) / frag_size : 1;
+
+  if(size > FRAG_MAX_SIZE || count > FRAG_MAX_COUNT)
+    return 0;
+  return count;
+}
+
+unsigned int frag_build(void *buf, unsigned int frag_size, uint8_t tag, unsigned int index,
+                        const void *payload, unsigned int size)
+{
+  unsigned char *p = buf;
+  unsigned int offset = index * frag_size;
+  unsigned int len = size - offset < frag_size ? size - offset : frag_size;
+
+  *p++ = tag;
+  *p++ = index | (offset + len == size ? FRAG_LAST : 0);
+  memcpy(p, (const unsigned char *)payload + offset, len);
+
+  return FRAG_HDR_SIZE + len;
+}
+
+/* Byte of a message with the size prefix (see FRAG_FEC_PREFIX). */
+static unsigned char msg_byte(const unsigned char *payload, unsigned int size,
+                              unsigned int prefix, unsigned int offset)
+{
+  if(offset >= prefix)
+    return payload[offset - prefix];
+  return offset ? size & 0xff : size >> 8;
+}
+
+/* Map the position of a fragment in the sequence of data and parity
+   fragments to the index of a data fragment or a group number. Each
+   group is followed by its parity and the last one may be shorter.
+   Return non-zero for a parity fragment. */
+static int fec_position(unsigned int data, unsigned int group, unsigned int index,
+                        unsigned int *n)
+{
+  unsigned int g, j;
+
+  if(!group) {
+    *n = index;
+    return 0;
+  }
+
+  g = index / (group + 1);
+  j = index % (group + 1);
+  if(j < MIN(group, data - g * group)) {
+    *n = g * group + j;
+    return 0;
+  }
+
+  *n = g;
+  return 1;
+}
+
+unsigned int frag_fec_count(unsigned int frag_size, unsigned int size, unsigned int group)
+{
+  unsigned int data;
+
+  if(!group)
+    return frag_count(frag_size, size);
+  if(group < FRAG_MIN_GROUP || group > FRAG_MAX_GROUP)
+    return 0;
+
+  data = frag_count(frag_size, size + FRAG_FEC_PREFIX);
+  if(!data)
+    return 0;
+  return data + (data + group - 1) / group;
+}
+
+unsigned int frag_fec_build(void *buf, unsigned int frag_size, uint8_t tag, unsigned int index,
+                            unsigned int group, const void *payload, unsigned int size)
+{
+  unsigned char *p = buf;
+  unsigned int prefix = group ? FRAG_FEC_PREFIX : 0;
+  unsigned int total  = size + prefix;
+  unsigned int data   = frag_count(frag_size, total);
+  unsigned int n, i, j, offset, len;
+
+  *p++ = tag;
+
+  if(!fec_position(data, group, index, &n)) {
+    offset = n * frag_size;
+    len    = MIN(total - offset, frag_size);
+
+    *p++ = n | (offset + len == total ? FRAG_LAST : 0);
+    *p++ = group;
+    for(j = 0 ; j < len ; j++)
+      p[j] = msg_byte(payload, size, prefix, offset + j);
+
+    return FRAG_FEC_HDR_SIZE + len;
+  }
+
+  /* XOR of the data fragments of the group padded with zeros */
+  *p++ = n | ((n + 1) * group >= data ? FRAG_LAST : 0);
+  *p++ = FRAG_PARITY | group;
+  memset(p, 0, frag_size);
+  for(i = n * group ; i < (n + 1) * group && i < data ; i++) {
+    offset = i * frag_size;
+    len    = MIN(total - offset, frag_size);
+
+    for(j = 0 ; j < len ; j++)
+      p[j] ^= msg_byte(payload, size, prefix, offset + j);
+  }
+
+  return FRAG_FEC_HDR_SIZE + frag_size;
+}
+
+int frag_fec_parity(unsigned int frag_size, unsigned int size, unsigned int group,
+                    unsigned int index)
+{
+  unsigned int n;
+
+  if(!group)
+    return 0;
+  return fec_position(frag_count(frag_size, size + FRAG_FEC_PREFIX), group, index, &n);
+}
+
+void frag_init(struct frag_pool *pool, unsigned int frag_size, unsigned long timeout,
+               int parity)
+{
+  memset(pool, 0, sizeof(struct frag_pool));
+
+  pool->frag_size = frag_size;
+  pool->timeout   = timeout;
+  pool->parity    = parity;
+}
+
+/* Find the buffer of a message or allocate a new one. We
+   reuse the first free or expired buffer, otherwise the
+   oldest one is dropped. */
+static struct frag_buffer * lookup(struct frag_pool *pool, uint16_t src, uint8_t tag,
+                                   unsigned int group, unsigned long now)
+{
+  struct frag_buffer *victim = NULL;
+  struct frag_buffer *oldest = NULL;
+  unsigned int i;
+
+  for(i = 0 ; i < FRAG_POOL_SIZE ; i++) {
+    struct frag_buffer *b = &pool->buffers[i];
+    int live = b->used && now - b->stamp < pool->timeout;
+
+    if(live && b->src == src && b->tag == tag)
+      return b;
+    else if(!live) {
+      if(!victim)
+        victim = b;
+    }
+    else if(!oldest || now - b->stamp > now - oldest->stamp)
+      oldest = b;
+  }
+
+  if(!victim)
+    victim = oldest;
+
+  victim->used     = 1;
+  victim->stamp    = now;
+  victim->src      = src;
+  victim->tag      = tag;
+  victim->count    = 0;
+  victim->received = 0;
+  victim->size     = 0;
+  victim->group    = group;
+  memset(victim->bitmap, 0, sizeof(victim->bitmap));
+  memset(victim->parity_bitmap, 0, sizeof(victim->parity_bitmap));
+  memset(victim->last_bitmap, 0, sizeof(victim->last_bitmap));
+
+  return victim;
+}
+
+/* Rebuild the missing fragment of a group from its parity and the
+   other fragments. The fragments are padded with zeros in the buffer
+   but the last bytes of a fragment may fall after the buffer. */
+static void rebuild(struct frag_pool *pool, struct frag_buffer *b, unsigned int g,
+                    unsigned int first, unsigned int end, unsigned int missing)
+{
+  unsigned int fs = pool->frag_size;
+  unsigned char *dst = b->buf + missing * fs;
+  unsigned int i, j, len;
+
+  memcpy(dst, b->parity + g * fs, MIN(fs, FRAG_MAX_SIZE - missing * fs));
+  for(i = first ; i < end ; i++) {
+    if(i == missing)
+      continue;
+
+    len = MIN(MIN(fs, FRAG_MAX_SIZE - i * fs), FRAG_MAX_SIZE - missing * fs);
+    for(j = 0 ; j < len ; j++)
+      dst[j] ^= b->buf[i * fs + j];
+  }
+}
+
+/* Rebuild the fragments of each group missing only one fragment
+   until there is none left. A group is only complete when we know
+   where it ends, either from the count given by the size prefix or
+   the last fragment, or when it is not the last group. Return -1 if
+   the fragments do not match the size prefix. */
+static int recover(struct frag_pool *pool, struct frag_buffer *b)
+{
+  unsigned int fs = pool->frag_size;
+  unsigned int k  = b->group;
+  unsigned int g, i, end, lost, missing = 0, count, size;
+  int progress;
+
+  do {
+    progress = 0;
+
+    if(BIT_ISSET(b->bitmap, 0)) {
+      size  = (b->buf[0] << 8) | b->buf[1];
+      count = frag_count(fs, size + FRAG_FEC_PREFIX);
+      if(!count || (b->count && b->count != count))
+        return -1;
+      b->count = count;
+      b->size  = size;
+    }
+
+    for(g = 0 ; g * k < FRAG_MAX_COUNT ; g++) {
+      if(!BIT_ISSET(b->parity_bitmap, g))
+        continue;
+
+      if(b->count)
+        end = MIN(g * k + k, b->count);
+      else if(BIT_ISSET(b->last_bitmap, g))
+        continue;
+      else
+        end = MIN(g * k + k, FRAG_MAX_COUNT);
+
+      for(lost = 0, i = g * k ; i < end ; i++) {
+        if(!BIT_ISSET(b->bitmap, i)) {
+          missing = i;
+          lost++;
+        }
+      }
+
+      if(lost != 1 || missing * fs >= FRAG_MAX_SIZE)
+        continue;
+
+      rebuild(pool, b, g, g * k, end, missing);
+      BIT_SET(b->bitmap, missing);
+      b->received++;
+      pool->recovered++;
+      progress = 1;
+    }
+  } while(progress);
+
+  return 0;
+}
+
+/* Deliver the message once all the data fragments are there. */
+static int complete(struct frag_pool *pool, struct frag_buffer *b,
+                    const void **msg, unsigned int *msg_size)
+{
+  if(b->group && recover(pool, b) < 0)
+    return FRAG_INVALID;
+
+  if(!b->count || b->received != b->count)
+    return FRAG_PENDING;
+
+  b->used   = 0;
+  *msg      = b->buf + (b->group ? FRAG_FEC_PREFIX : 0);
+  *msg_size = b->size;
+  return FRAG_COMPLETE;
+}
+
+/* Keep the parity fragment of a group until it is needed. */
+static int parity_input(struct frag_pool *pool, uint16_t src, uint8_t tag, unsigned int group,
+                        unsigned int g, int last, const void *payload, unsigned int len,
+                        unsigned long now, const void **msg, unsigned int *msg_size)
+{
+  unsigned int fs = pool->frag_size;
+  struct frag_buffer *b;
+
+  if(len != fs || (g + 1) * fs > FRAG_MAX_SIZE || g * group >= FRAG_MAX_COUNT)
+    return FRAG_INVALID;
+
+  b = lookup(pool, src, tag, group, now);
+  b->stamp = now;
+
+  if(b->group != group)
+    return FRAG_INVALID;
+  if(BIT_ISSET(b->parity_bitmap, g))
+    return FRAG_PENDING; /* duplicate */
+
+  BIT_SET(b->parity_bitmap, g);
+  if(last)
+    BIT_SET(b->last_bitmap, g);
+  memcpy(b->parity + g * fs, payload, fs);
+
+  return complete(pool, b, msg, msg_size);
+}
+
+int frag_input(struct frag_pool *pool, uint16_t src, const void *frag, unsigned int size,
+               unsigned long now, const void **msg, unsigned int *msg_size)
+{
+  const unsigned char *p = frag;
+  struct frag_buffer *b;
+  unsigned int hdr_size = pool->parity ? FRAG_FEC_HDR_SIZE : FRAG_HDR_SIZE;
+  unsigned int index, last, len, offset, group = 0;
+  int parity = 0;
+  uint8_t tag;
+
+  if(size < hdr_size)
+    return FRAG_INVALID;
+
+  tag   = p[0];
+  index = p[1] & ~FRAG_LAST;
+  last  = p[1] & FRAG_LAST;
+  len   = size - hdr_size;
+
+  if(pool->parity) {
+    group  = p[2] & ~FRAG_PARITY;
+    parity = p[2] & FRAG_PARITY;
+    if((group && group < FRAG_MIN_GROUP) || (parity && !group))
+      return FRAG_INVALID;
+  }
+  p += hdr_size;
+
+  if(parity)
+    return parity_input(pool, src, tag, group, index, last, p, len, now, msg, msg_size);
+
+  /* All fragments but the last are full. */
+  offset = index * pool->frag_size;
+  if((!last && len != pool->frag_size) || len > pool->frag_size ||
+     offset + len > FRAG_MAX_SIZE)
+    return FRAG_INVALID;
+
+  /* Unfragmented messages do not need a buffer. */
+  if(last && !index && !group) {
+    *msg      = p;
+    *msg_size = len;
+    return FRAG_COMPLETE;
+  }
+
+  b = lookup(pool, src, tag, group, now);
+  b->stamp = now;
+
+  if(b->group != group)
+    return FRAG_INVALID;
+  if(BIT_ISSET(b->bitmap, index))
+    return FRAG_PENDING; /* duplicate */
+
+  /* With parity the count may be known from the size
+     prefix and the size is only known from it. */
+  if(last) {
+    if(b->count && b->count != index + 1) /* another last fragment */
+      return FRAG_INVALID;
+    b->count = index + 1;
+    if(!group)
+      b->size = offset + len;
+  }
+  else if(b->count && index + 1 >= b->count)
+    return FRAG_INVALID;
+
+  BIT_SET(b->bitmap, index);
+  memcpy(b->buf + offset, p, len);
+  if(group)
+    memset(b->buf + offset + len, 0, MIN(pool->frag_size - len, FRAG_MAX_SIZE - offset - len));
+  b->received++;
+
+  return complete(pool, b, msg, msg_size);
+}
@@ -24,14 +24,31 @@
 
 #include <pthread.h>
 
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+#include "common.h"
 
-void lock(void)
+static pthread_mutex_t mutex     = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t ack_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void lock(void *data)
 {
+  UNUSED(data);
   pthread_mutex_lock(&mutex);
 }
 
-void unlock(void)
+void unlock(void *data)
 {
+  UNUSED(data);
   pthread_mutex_unlock(&mutex);
 }
+
+void ack_lock(void *data)
+{
+  UNUSED(data);
+  pthread_mutex_lock(&ack_mutex);
+}
+
+void ack_unlock(void *data)
+{
+  UNUSED(data);
+  pthread_mutex_unlock(&ack_mutex);
+}
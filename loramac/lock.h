@@ -25,8 +25,14 @@
 #ifndef _LOCK_H_
 #define _LOCK_H_
 
-/* Lock/unlock a critical section with a mutex */
-void lock(void);
-void unlock(void);
+/* Lock/unlock a critical section with a mutex.
+   The data argument is the LoRaMAC context data,
+   there is only one lock for all instances. */
+void lock(void *data);
+void unlock(void *data);
+
+/* Lock/unlock the LoRaMAC ACK queue */
+void ack_lock(void *data);
+void ack_unlock(void *data);
 
 #endif /* _LOCK_H_ */
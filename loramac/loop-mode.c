@@ -0,0 +1,204 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "safe-call.h"
+#include "string-utils.h"
+#include "loramac-str.h"
+#include "loramac.h"
+#include "version.h"
+#include "common.h"
+#include "loop.h"
+#include "mode.h"
+#include "main.h"
+#include "log.h"
+#include "help.h"
+
+/*
+  The loop mode reads and writes frames from/to a DGRAM UNIX socket
+  like the unix mode, with the same messages, but runs alone in one
+  thread for the smallest gateways (see loop.h). The driver has no
+  lock and no other thread: the loop reads the UART, fires the timers
+  and serves the application socket, one send message at a time.
+  A send message waits in the socket until the previous one was
+  acknowledged or given up, the frames received meanwhile are
+  published at once.
+
+  The send messages are [dst (u16)][payload] and the received frames
+  are published to the application socket as
+  [status (u8)][src (u16)][dst (u16)][payload]. There is no status,
+  no subscription and no queue, use the unix mode for those.
+*/
+
+/* a message and the largest send or recv header */
+#define BUF_SIZE (LORAMAC_MAX_MESSAGE + sizeof(uint8_t) + sizeof(uint16_t) * 2)
+
+static int sd;
+static const char *socket_driver_path = PACKAGE "-driver.sock";
+static const char *socket_app_path = PACKAGE "-app.sock";
+static struct sockaddr_un app_addr = { .sun_family = AF_UNIX };
+
+struct option loop_opts[] = {
+  { "driver-path", required_argument, NULL, 'L' },
+  { "app-path", required_argument, NULL, 'R' },
+  { NULL, 0, NULL, 0 }
+};
+struct opt_help loop_messages[] = {
+  { 'L', "driver-path", "Driver Unix socket path" },
+  { 'R', "app-path", "Application Unix socket path" },
+  { 0, NULL, NULL }
+};
+
+static void exit_clean(void)
+{
+  unlink(socket_driver_path);
+}
+
+/* Called from the receive path of the loop. The application
+   that does not keep up loses the frame, the loop never waits. */
+static void cb_recv(uint16_t src, uint16_t dst,
+                    const void *payload, unsigned int payload_size,
+                    int status, void *data)
+{
+  unsigned char msg[BUF_SIZE];
+  unsigned char *b = msg;
+
+  UNUSED(data);
+
+  if(payload_size > LORAMAC_MAX_MESSAGE) {
+    warnx("frame too large");
+    return;
+  }
+
+  *(uint8_t  *)b = status; b += sizeof(uint8_t);
+  *(uint16_t *)b = src;    b += sizeof(uint16_t);
+  *(uint16_t *)b = dst;    b += sizeof(uint16_t);
+  memcpy(b, payload, payload_size);
+
+  if(sendto(sd, msg, b - msg + payload_size, MSG_DONTWAIT,
+            (struct sockaddr *)&app_addr, SUN_LEN(&app_addr)) < 0)
+    warn("network error");
+}
+
+static void init(const struct context *ctx, struct loramac_config *loramac)
+{
+  struct sockaddr_un s_addr = { .sun_family = AF_UNIX };
+
+  loramac->cb_recv = cb_recv;
+
+  sd = xsocket(AF_UNIX, SOCK_DGRAM, 0);
+
+  unlink(socket_driver_path);
+  xstrcpy(s_addr.sun_path, socket_driver_path, sizeof(s_addr.sun_path));
+  xbind(sd, (struct sockaddr *)&s_addr, SUN_LEN(&s_addr));
+  xstrcpy(app_addr.sun_path, socket_app_path, sizeof(app_addr.sun_path));
+
+  atexit(exit_clean);
+
+  IF_VERBOSE(ctx, log_msg(LOG_CAT_MAIN, LOG_LVL_DEBUG, "Socket created at %s\n", socket_driver_path));
+}
+
+static void destroy(const struct context *ctx)
+{
+  UNUSED(ctx);
+
+  close(sd);
+  exit_clean();
+}
+
+/* One send message, the loop serves the UART until it is done. */
+static void handle_request(void *data)
+{
+  const struct context *ctx = data;
+  unsigned char buf[BUF_SIZE];
+  unsigned int tx = 0;
+  ssize_t n;
+  uint16_t dst;
+  int ret;
+
+  n = recv(sd, buf, sizeof(buf), MSG_DONTWAIT);
+  if(n < 0) {
+    warn("network error");
+    return; /* we don't fail on client error */
+  }
+  if((size_t)n <= sizeof(uint16_t)) {
+    warnx("message too short");
+    return;
+  }
+
+  dst = *(uint16_t *)buf;
+  IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG, "Sending %d bytes to %04X\n",
+                          (int)(n - sizeof(uint16_t)), dst));
+
+  ret = loramac_send(ctx->mac, dst, buf + sizeof(uint16_t), n - sizeof(uint16_t), &tx);
+  IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG,
+                          "TX STATUS: %s (%d)\n", loramac_send2str(ret), ret));
+  IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG, "TX COUNT : %d\n", tx));
+  IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG, "---------\n"));
+}
+
+static void start(const struct context *ctx)
+{
+  loop_add(sd, handle_request, (void *)ctx);
+  loop_run();
+}
+
+static int parse_option(const struct context *ctx, int c)
+{
+  UNUSED(ctx);
+
+  switch(c) {
+  case 'L':
+    socket_driver_path = optarg;
+    return 1;
+  case 'R':
+    socket_app_path = optarg;
+    return 1;
+  }
+
+  return 0;
+}
+
+struct iface_mode iface_mode = {
+  .name = "loop",
+  .description = "Read and write frames on a Unix socket from a single thread",
+
+  .optstring      = "R:L:",
+  .long_opts      = loop_opts,
+  .extra_messages = loop_messages,
+  .parse_option   = parse_option,
+
+  .init    = init,
+  .destroy = destroy,
+  .start   = start,
+  .single  = 1
+};
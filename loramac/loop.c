@@ -0,0 +1,245 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <poll.h>
+#include <errno.h>
+#include <err.h>
+
+#include "common.h"
+#include "timer.h"
+#include "uart.h"
+#include "loop.h"
+
+/* The UART is always the first descriptor polled. */
+static struct pollfd fds[1 + LOOP_MAX_FDS];
+static struct handler {
+  loop_cb cb;
+  void   *data;
+} handlers[LOOP_MAX_FDS];
+static unsigned int nfds;
+
+static struct {
+  unsigned long due;
+  int           armed;
+  loop_cb       cb;
+  void         *data;
+} timers[LOOP_MAX_TIMERS];
+static unsigned int ntimers;
+
+/* Timer of the driver (see loramac_config). */
+static unsigned long mac_deadline;
+static int mac_armed;
+
+/* Set while the driver parses what was read. The receive path
+   cannot be entered again so its waits only sleep. */
+static int feeding;
+
+static struct loramac_ctx *loop_mac;
+static int ack_timer;
+static struct loop_stats stats;
+
+static void no_lock(void *data)
+{
+  UNUSED(data);
+}
+
+/* Poll timeout in ms, rounded up so that the deadline has passed on return. */
+static int timeout_ms(unsigned long us)
+{
+  return (us + 999) / 1000;
+}
+
+static void read_uart(void)
+{
+  stats.reads++;
+  feeding = 1;
+  uart_read_once(loop_mac);
+  feeding = 0;
+}
+
+/* Serve the UART alone until the deadline or until armed is cleared. */
+static void serve_until(unsigned long deadline, const int *armed)
+{
+  long left;
+
+  stats.waits++;
+  while(*armed && (left = deadline - clock_us()) > 0) {
+    if(poll(fds, feeding ? 0 : 1, timeout_ms(left)) < 0) {
+      if(errno != EINTR)
+        err(EXIT_FAILURE, "poll");
+      continue;
+    }
+
+    if(!feeding && fds[0].revents)
+      read_uart();
+  }
+}
+
+static void loop_start_timer(unsigned int us, void *data)
+{
+  UNUSED(data);
+  mac_deadline = clock_us() + us;
+  mac_armed    = 1;
+}
+
+static void loop_stop_timer(void *data)
+{
+  UNUSED(data);
+  mac_armed = 0;
+}
+
+static void loop_wait_timer(void *data)
+{
+  UNUSED(data);
+  serve_until(mac_deadline, &mac_armed);
+  mac_armed = 0;
+}
+
+static void loop_usleep(unsigned long us, void *data)
+{
+  int armed = 1;
+
+  UNUSED(data);
+  serve_until(clock_us() + us, &armed);
+}
+
+static void flush_acks(void *data)
+{
+  unsigned int delay = loramac_flush_acks(data);
+
+  if(delay)
+    loop_arm(ack_timer, delay);
+}
+
+static void schedule_ack(unsigned int us, void *data)
+{
+  UNUSED(data);
+  loop_arm(ack_timer, us);
+}
+
+void loop_config(struct loramac_config *conf, struct loramac_ctx *mac)
+{
+  loop_mac  = mac;
+  ack_timer = loop_timer(flush_acks, mac);
+
+  conf->lock         = no_lock;
+  conf->unlock       = no_lock;
+  conf->ack_lock     = no_lock;
+  conf->ack_unlock   = no_lock;
+  conf->start_timer  = loop_start_timer;
+  conf->stop_timer   = loop_stop_timer;
+  conf->wait_timer   = loop_wait_timer;
+  conf->schedule_ack = schedule_ack;
+  conf->usleep       = loop_usleep;
+}
+
+void loop_add(int fd, loop_cb cb, void *data)
+{
+  if(nfds == LOOP_MAX_FDS)
+    errx(EXIT_FAILURE, "too many descriptors in the event loop");
+
+  fds[1 + nfds]    = (struct pollfd){ .fd = fd, .events = POLLIN };
+  handlers[nfds++] = (struct handler){ .cb = cb, .data = data };
+}
+
+int loop_timer(loop_cb cb, void *data)
+{
+  if(ntimers == LOOP_MAX_TIMERS)
+    errx(EXIT_FAILURE, "too many timers in the event loop");
+
+  timers[ntimers].cb   = cb;
+  timers[ntimers].data = data;
+  return ntimers++;
+}
+
+void loop_arm(int timer, unsigned long us)
+{
+  timers[timer].due   = clock_us() + us;
+  timers[timer].armed = 1;
+}
+
+/* Fire the expired timers. Return the time in us until the
+   next expiry or a negative value when none is armed. */
+static long fire_timers(void)
+{
+  unsigned long now = clock_us();
+  long next = -1, left;
+  unsigned int i;
+
+  for(i = 0 ; i < ntimers ; i++) {
+    if(!timers[i].armed)
+      continue;
+
+    left = timers[i].due - now;
+    if(left <= 0) {
+      timers[i].armed = 0;
+      stats.fired++;
+      timers[i].cb(timers[i].data);
+
+      /* the callback may take a while and rearm its timer */
+      now = clock_us();
+      if(!timers[i].armed)
+        continue;
+      left = timers[i].due - now;
+      if(left < 0)
+        left = 0;
+    }
+
+    if(next < 0 || left < next)
+      next = left;
+  }
+
+  return next;
+}
+
+void loop_run(void)
+{
+  unsigned int i;
+  long next;
+
+  fds[0] = (struct pollfd){ .fd = uart_fd(), .events = POLLIN };
+
+  while(1) {
+    next = fire_timers();
+
+    if(poll(fds, 1 + nfds, next < 0 ? -1 : timeout_ms(next)) < 0) {
+      if(errno != EINTR)
+        err(EXIT_FAILURE, "poll");
+      continue;
+    }
+    stats.wakeups++;
+
+    if(fds[0].revents)
+      read_uart();
+    for(i = 0 ; i < nfds ; i++)
+      if(fds[1 + i].revents)
+        handlers[i].cb(handlers[i].data);
+  }
+}
+
+void loop_stats(struct loop_stats *s)
+{
+  *s = stats;
+}
@@ -0,0 +1,75 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _LOOP_H_
+#define _LOOP_H_
+
+#include "loramac.h"
+
+/* Single-threaded event loop for the modes that run alone (see
+   single in iface_mode). One thread polls the UART and the
+   descriptors of the mode, parses the frames, fires the timers and
+   serves the application, so the driver runs without locks.
+
+   A send blocks the loop like it blocks its thread otherwise: while
+   the driver waits (ACK timeout, duty cycle) only the UART is served
+   so that the ACK comes back. The descriptors of the mode and the
+   timers of the loop wait for the top of the loop, as the ACKs
+   scheduled after SIFS waited for the lock of the sender. */
+#define LOOP_MAX_FDS    4
+#define LOOP_MAX_TIMERS 4
+
+/* Called by the loop when a descriptor is readable or a timer expired. */
+typedef void (*loop_cb)(void *data);
+
+/* Statistics of the loop (see loop_stats()) */
+struct loop_stats {
+  unsigned long wakeups; /* returns of poll() at the top of the loop */
+  unsigned long waits;   /* waits of the driver serving the UART alone */
+  unsigned long reads;   /* reads from the UART */
+  unsigned long fired;   /* expired timers */
+};
+
+/* Install the hooks of the loop in the driver configuration: no-op
+   locks, the timer of the driver and the ACKs of mac scheduled on a
+   timer of the loop. This must be called before loramac_init(). */
+void loop_config(struct loramac_config *conf, struct loramac_ctx *mac);
+
+/* Call cb each time the descriptor is readable. */
+void loop_add(int fd, loop_cb cb, void *data);
+
+/* Create a timer that calls cb once armed and expired. Return
+   its handle for loop_arm(). */
+int loop_timer(loop_cb cb, void *data);
+
+/* Arm the timer to expire in us microseconds, replacing any
+   previous expiry. */
+void loop_arm(int timer, unsigned long us);
+
+/* Run the loop. This function never returns. */
+void loop_run(void);
+
+void loop_stats(struct loop_stats *stats);
+
+#endif /* _LOOP_H_ */
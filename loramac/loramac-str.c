@@ -37,6 +37,30 @@ const char * loramac_flag2str(enum loramac_flags flag)
     return "ignore broadcasts";
   case LORAMAC_NOACK:
     return "no ACK";
+  case LORAMAC_WINDOW:
+    return "sliding window";
+  case LORAMAC_FRAG:
+    return "fragmentation";
+  case LORAMAC_COMPRESS:
+    return "compression";
+  case LORAMAC_DUTY:
+    return "duty cycle";
+  case LORAMAC_RTO:
+    return "adaptive ACK timeout";
+  case LORAMAC_LBT:
+    return "listen before talk";
+  case LORAMAC_PIGGYBACK:
+    return "piggybacked ACKs";
+  case LORAMAC_COMPACT:
+    return "compact headers";
+  case LORAMAC_FEC:
+    return "parity fragments";
+  case LORAMAC_ADR:
+    return "adaptive data rate";
+  case LORAMAC_TDMA:
+    return "slotted access";
+  case LORAMAC_SECURE:
+    return "encryption";
   default:
     return "unknown flag";
   }
@@ -49,10 +73,28 @@ const char * loramac_init2str(enum loramac_init_status status)
     return "success";
   case LORAMAC_INIT_TIMEVAL:
     return "invalid time value";
-  case LORAMAC_INIT_ACK_FIFO:
-    return "ACK FIFO too large";
   case LORAMAC_INIT_OOM:
     return "out of memory";
+  case LORAMAC_INIT_CODEC:
+    return "no compression functions";
+  case LORAMAC_INIT_DUTY:
+    return "invalid radio settings or frequency outside of the duty cycle bands";
+  case LORAMAC_INIT_BACKOFF:
+    return "invalid backoff policy";
+  case LORAMAC_INIT_FILTERS:
+    return "invalid receive filter order";
+  case LORAMAC_INIT_CLUSTER:
+    return "invalid cluster or address outside of it";
+  case LORAMAC_INIT_FEC:
+    return "parity without fragmentation or invalid group";
+  case LORAMAC_INIT_ADR:
+    return "invalid spreading factors or no radio function";
+  case LORAMAC_INIT_TDMA:
+    return "slotted access with compact headers";
+  case LORAMAC_INIT_KEYS:
+    return "no key or too many keys";
+  case LORAMAC_INIT_FIXED:
+    return "configuration not fixed at build time";
   default:
     return "unknown init status";
   }
@@ -73,6 +115,8 @@ const char * loramac_rcv2str(enum loramac_receive_status status)
     return "invalid destination";
   case LORAMAC_RCV_BROADCAST:
     return "broadcast frame";
+  case LORAMAC_RCV_INVALID_MIC:
+    return "invalid MIC";
   default:
     return "unknown receive status";
   }
@@ -87,11 +131,57 @@ const char * loramac_send2str(enum loramac_send_status status)
     return "too long";
   case LORAMAC_SND_NOACK:
     return "max retransmit";
+  case LORAMAC_SND_WINDOW:
+    return "window too large";
+  case LORAMAC_SND_BUSY:
+    return "queue full";
+  case LORAMAC_SND_DUTY:
+    return "duty cycle budget exhausted";
+  case LORAMAC_SND_ACCESS:
+    return "channel busy";
+  case LORAMAC_SND_ADDRESS:
+    return "outside of the cluster";
+  case LORAMAC_SND_SLOT:
+    return "no slot";
+  case LORAMAC_SND_KEY:
+    return "no key";
   default:
     return "unknown send status";
   }
 }
 
+const char * loramac_backoff2str(enum loramac_backoff backoff)
+{
+  switch(backoff) {
+  case LORAMAC_BACKOFF_NONE:
+    return "none";
+  case LORAMAC_BACKOFF_EXP:
+    return "exp";
+  case LORAMAC_BACKOFF_JITTER:
+    return "jitter";
+  case LORAMAC_BACKOFF_ADDRESS:
+    return "address";
+  default:
+    return "unknown backoff";
+  }
+}
+
+const char * loramac_filter2str(enum loramac_filter filter)
+{
+  switch(filter) {
+  case LORAMAC_FILTER_LENGTH:
+    return "length";
+  case LORAMAC_FILTER_DESTINATION:
+    return "destination";
+  case LORAMAC_FILTER_CRC:
+    return "crc";
+  case LORAMAC_FILTER_DUPLICATE:
+    return "duplicate";
+  default:
+    return "unknown filter";
+  }
+}
+
 enum loramac_flags loramac_str2flag(const char *s)
 {
   if(!strcmp("promiscuous", s))
@@ -102,6 +192,30 @@ enum loramac_flags loramac_str2flag(const char *s)
     return LORAMAC_NOBROADCAST;
   else if(!strcmp("no-ack", s))
     return LORAMAC_NOACK;
+  else if(!strcmp("window", s))
+    return LORAMAC_WINDOW;
+  else if(!strcmp("frag", s))
+    return LORAMAC_FRAG;
+  else if(!strcmp("compress", s))
+    return LORAMAC_COMPRESS;
+  else if(!strcmp("duty", s))
+    return LORAMAC_DUTY;
+  else if(!strcmp("rto", s))
+    return LORAMAC_RTO;
+  else if(!strcmp("lbt", s))
+    return LORAMAC_LBT;
+  else if(!strcmp("piggyback", s))
+    return LORAMAC_PIGGYBACK;
+  else if(!strcmp("compact", s))
+    return LORAMAC_COMPACT;
+  else if(!strcmp("fec", s))
+    return LORAMAC_FEC;
+  else if(!strcmp("adr", s))
+    return LORAMAC_ADR;
+  else if(!strcmp("tdma", s))
+    return LORAMAC_TDMA;
+  else if(!strcmp("secure", s))
+    return LORAMAC_SECURE;
   return 0;
 }
 
@@ -111,10 +225,28 @@ enum loramac_init_status loramac_str2init(const char *s)
     return LORAMAC_INIT_SUCCESS;
   else if(!strcmp("timeval", s))
     return LORAMAC_INIT_TIMEVAL;
-  else if(!strcmp("ack-fifo", s))
-    return LORAMAC_INIT_ACK_FIFO;
   else if(!strcmp("oom", s))
     return LORAMAC_INIT_OOM;
+  else if(!strcmp("codec", s))
+    return LORAMAC_INIT_CODEC;
+  else if(!strcmp("duty", s))
+    return LORAMAC_INIT_DUTY;
+  else if(!strcmp("backoff", s))
+    return LORAMAC_INIT_BACKOFF;
+  else if(!strcmp("filters", s))
+    return LORAMAC_INIT_FILTERS;
+  else if(!strcmp("cluster", s))
+    return LORAMAC_INIT_CLUSTER;
+  else if(!strcmp("fec", s))
+    return LORAMAC_INIT_FEC;
+  else if(!strcmp("adr", s))
+    return LORAMAC_INIT_ADR;
+  else if(!strcmp("tdma", s))
+    return LORAMAC_INIT_TDMA;
+  else if(!strcmp("keys", s))
+    return LORAMAC_INIT_KEYS;
+  else if(!strcmp("fixed", s))
+    return LORAMAC_INIT_FIXED;
   return 0;
 }
 
@@ -132,6 +264,8 @@ enum loramac_receive_status loramac_str2rcv(const char *s)
     return LORAMAC_RCV_DESTINATION;
   else if(!strcmp("broadcast", s))
     return LORAMAC_RCV_BROADCAST;
+  else if(!strcmp("invalid-mic", s))
+    return LORAMAC_RCV_INVALID_MIC;
   return 0;
 }
 
@@ -143,5 +277,45 @@ enum loramac_send_status loramac_str2send(const char *s)
     return LORAMAC_SND_TOOLONG;
   else if(!strcmp("no-ack", s))
     return LORAMAC_SND_NOACK;
+  else if(!strcmp("window", s))
+    return LORAMAC_SND_WINDOW;
+  else if(!strcmp("busy", s))
+    return LORAMAC_SND_BUSY;
+  else if(!strcmp("duty", s))
+    return LORAMAC_SND_DUTY;
+  else if(!strcmp("access", s))
+    return LORAMAC_SND_ACCESS;
+  else if(!strcmp("address", s))
+    return LORAMAC_SND_ADDRESS;
+  else if(!strcmp("slot", s))
+    return LORAMAC_SND_SLOT;
+  else if(!strcmp("key", s))
+    return LORAMAC_SND_KEY;
   return 0;
 }
+
+int loramac_str2backoff(const char *s)
+{
+  if(!strcmp("none", s))
+    return LORAMAC_BACKOFF_NONE;
+  else if(!strcmp("exp", s))
+    return LORAMAC_BACKOFF_EXP;
+  else if(!strcmp("jitter", s))
+    return LORAMAC_BACKOFF_JITTER;
+  else if(!strcmp("address", s))
+    return LORAMAC_BACKOFF_ADDRESS;
+  return -1;
+}
+
+int loramac_str2filter(const char *s)
+{
+  if(!strcmp("length", s))
+    return LORAMAC_FILTER_LENGTH;
+  else if(!strcmp("destination", s))
+    return LORAMAC_FILTER_DESTINATION;
+  else if(!strcmp("crc", s))
+    return LORAMAC_FILTER_CRC;
+  else if(!strcmp("duplicate", s))
+    return LORAMAC_FILTER_DUPLICATE;
+  return -1;
+}
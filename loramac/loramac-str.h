@@ -32,6 +32,8 @@ const char * loramac_flag2str(enum loramac_flags flag);
 const char * loramac_init2str(enum loramac_init_status status);
 const char * loramac_rcv2str(enum loramac_receive_status status);
 const char * loramac_send2str(enum loramac_send_status status);
+const char * loramac_backoff2str(enum loramac_backoff backoff);
+const char * loramac_filter2str(enum loramac_filter filter);
 
 /* Select flags and status from strings. */
 enum loramac_flags loramac_str2flag(const char *s);
@@ -39,4 +41,10 @@ enum loramac_init_status loramac_str2init(const char *s);
 enum loramac_receive_status loramac_str2rcv(const char *s);
 enum loramac_send_status loramac_str2send(const char *s);
 
+/* Return -1 when the policy is unknown. */
+int loramac_str2backoff(const char *s);
+
+/* Return -1 when the filter is unknown. */
+int loramac_str2filter(const char *s);
+
 #endif /* _LORAMAC_STR_H_ */
@@ -28,200 +28,1997 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 #include "loramac.h"
 #include "crc-ccitt.h"
+#include "frag.h"
+#include "byteorder.h"
+#include "fixed.h"
+#include "probe.h"
 
-/* LoRaMAC configuration with platform dependent functions,
-   source mac address and flags. */
-static struct loramac_config mac_conf;
-
-/* Sender internal state */
-static uint8_t seqno;
-static uint8_t last_ack_seqno;
-static unsigned int wait_ack;
-
-/* receive and send packetbuf [sz][frame...] */
-static unsigned char snd_pktbuf[LORAMAC_MAX_FRAME + 1];
-static unsigned char rcv_pktbuf[LORAMAC_MAX_FRAME + 1];
-
-/* Receiver ACK FIFO.
-   We keep the seqno of the last ACK for the last n senders.
-   We can use this to avoid displaying frames duplicated
-   because of retransmissions. It is allocated once and we
-   can ensure that it is large enough for the configured
-   value of timeout and SIFS. */
-static int oldest; /* index of oldest element in FIFO */
-static int newest; /* index of newest element in FIFO */
-static int ack_fifo_size; /* size of the FIFO */
-static struct last_ack {
-  uint16_t sender : 16;
-  uint8_t  seqno  : 8;
-} *ack_fifo;
-
-/* Search the ACK FIFO for a sender.
-   Returns -1 if it wasn't found. */
-static int ack_fifo_search(uint16_t sender)
+static unsigned int dup_hash(uint16_t sender)
 {
-  int i;
-  for(i = 0 ; i < ack_fifo_size ; i++)
-    if(ack_fifo[i].sender != 0xffff && ack_fifo[i].sender == sender)
+  /* Fibonacci hashing, addresses are often sequential. */
+  return ((sender * 0x9e3779b1UL) & 0xffffffff) >> 16;
+}
+
+/* Lookup a sender in the duplicate table.
+   If the sender was not found (or has expired),
+   a new entry is inserted and found is set to 0.
+   The whole probe sequence is searched before a slot
+   is chosen, since a sender can be stored after a slot
+   that expired (or was evicted) once it was inserted. */
+static struct loramac_dup * dup_lookup(struct loramac_ctx *ctx, uint16_t sender, int *found)
+{
+  unsigned long now = ctx->conf.clock(ctx->conf.data);
+  struct loramac_dup *victim = NULL;
+  struct loramac_dup *oldest = NULL;
+  unsigned int h = dup_hash(sender);
+  unsigned int i;
+
+  for(i = 0 ; i < LORAMAC_DUP_PROBE ; i++) {
+    struct loramac_dup *e = &ctx->dup_table[(h + i) % LORAMAC_DUP_TABLE];
+    int live = e->used && now - e->stamp < ctx->dup_expiry;
+
+    if(live && e->sender == sender) {
+      e->stamp = now;
+      *found = 1;
+      return e;
+    }
+    else if(!live) {
+      /* reuse the expired entry of the sender first,
+         otherwise the first free or expired slot */
+      if(!victim || (e->used && e->sender == sender))
+        victim = e;
+    }
+    else if(!oldest || now - e->stamp > now - oldest->stamp)
+      oldest = e;
+  }
+
+  if(!victim)
+    victim = oldest;
+
+  *victim = (struct loramac_dup){ .used   = 1,
+                                .stamp  = now,
+                                .sender = sender };
+  *found  = 0;
+  return victim;
+}
+
+static const enum loramac_filter default_filters[LORAMAC_FILTERS] = {
+  LORAMAC_FILTER_LENGTH,
+  LORAMAC_FILTER_DESTINATION,
+  LORAMAC_FILTER_CRC,
+  LORAMAC_FILTER_DUPLICATE
+};
+
+/* Check whether frames to an address are sent to many nodes at once,
+   that is broadcasts and multicast groups (see LORAMAC_GROUP). */
+static inline int multicast(uint16_t addr)
+{
+  return addr == 0xffff || LORAMAC_GROUP(addr);
+}
+
+/* Node ID of an address in the cluster (see LORAMAC_COMPACT)
+   or -1 when the address is outside of it. */
+static int cluster_id(const struct loramac_ctx *ctx, uint16_t addr)
+{
+  unsigned int i;
+
+  if(addr == 0xffff)
+    return LORAMAC_MAX_CLUSTER;
+
+  for(i = 0 ; i < ctx->conf.cluster_size ; i++)
+    if(ctx->conf.cluster[i] == addr)
       return i;
   return -1;
 }
 
-/* Insert a new sender into the FIFO.
-   This does not check if the sender is already present.
-   If the queue is full, it always removes the oldest
-   element and insert this one in place. */
-static void ack_fifo_insert(uint16_t sender, uint8_t seqno)
+/* Check the cluster table and find our own node ID. */
+static int cluster_check(struct loramac_ctx *ctx)
+{
+  unsigned int i, j;
+  int id;
+
+  if(!ctx->conf.cluster || !ctx->conf.cluster_size ||
+     ctx->conf.cluster_size > LORAMAC_MAX_CLUSTER)
+    return -1;
+
+  for(i = 0 ; i < ctx->conf.cluster_size ; i++) {
+    if(ctx->conf.cluster[i] == 0xffff)
+      return -1;
+    for(j = 0 ; j < i ; j++)
+      if(ctx->conf.cluster[i] == ctx->conf.cluster[j])
+        return -1;
+  }
+
+  id = cluster_id(ctx, ctx->conf.mac_address);
+  if(id < 0 || id == LORAMAC_MAX_CLUSTER)
+    return -1;
+
+  ctx->node_id = id;
+  return 0;
+}
+
+/* Write an address in a header, it has to be in the cluster
+   with LORAMAC_COMPACT. Returns the end of the address. */
+static unsigned char * put_addr(const struct loramac_ctx *ctx, unsigned char *buf, uint16_t addr)
+{
+  if(FLAGS(ctx) & LORAMAC_COMPACT) {
+    *(uint8_t *)buf = cluster_id(ctx, addr);
+    return buf + sizeof(uint8_t);
+  }
+
+  *(uint16_t *)buf = BO_HTONS(ctx->conf, addr);
+  return buf + sizeof(uint16_t);
+}
+
+/* Read an address from a header. Returns 0 when it is an
+   unknown node ID, the address is then left unchanged. */
+static int get_addr(const struct loramac_ctx *ctx, const unsigned char *buf, uint16_t *addr)
+{
+  uint8_t id;
+
+  if(!(FLAGS(ctx) & LORAMAC_COMPACT)) {
+    *addr = BO_NTOHS(ctx->conf, *(const uint16_t *)buf);
+    return 1;
+  }
+
+  id = *(const uint8_t *)buf;
+  if(id == LORAMAC_MAX_CLUSTER)
+    *addr = 0xffff;
+  else if(id < ctx->conf.cluster_size)
+    *addr = ctx->conf.cluster[id];
+  else
+    return 0;
+  return 1;
+}
+
+/* Check the configuration against the one fixed at build time. */
+static int fixed_check(const struct loramac_config *conf)
+{
+  (void)conf;
+
+#ifdef LORAMAC_FIXED_FLAGS
+  if(conf->flags != (unsigned long)(LORAMAC_FIXED_FLAGS))
+    return -1;
+#endif
+#ifdef PLATFORM_UART_SEND
+  if(conf->uart_send != PLATFORM_UART_SEND)
+    return -1;
+#endif
+#ifdef PLATFORM_UART_SENDV
+  if(conf->uart_sendv != PLATFORM_UART_SENDV)
+    return -1;
+#endif
+#ifdef PLATFORM_LOCK
+  if(conf->lock != PLATFORM_LOCK)
+    return -1;
+#endif
+#ifdef PLATFORM_UNLOCK
+  if(conf->unlock != PLATFORM_UNLOCK)
+    return -1;
+#endif
+  return 0;
+}
+
+int loramac_init(struct loramac_ctx *ctx, const struct loramac_config *conf)
+{
+  const enum loramac_filter *filters;
+  unsigned int seen = 0;
+  uint16_t src;
+  int i;
+
+  if(fixed_check(conf))
+    return LORAMAC_INIT_FIXED;
+
+  ctx->conf = *conf;
+
+  /* Note that we also clear the duplicate table.
+     Otherwise an attacker might use this to snoop
+     around into uninitialized memory. */
+  memset(ctx->tx_peers, 0, sizeof(ctx->tx_peers));
+  memset(ctx->dup_table, 0, sizeof(ctx->dup_table));
+  memset(ctx->bcast_table, 0, sizeof(ctx->bcast_table));
+  ctx->ack_head  = 0;
+  ctx->ack_count = 0;
+  ctx->rcv_len    = 0;
+  ctx->rcv_resync = 0;
+  ctx->rcv_crc    = -1;
+  ctx->nav        = ctx->conf.clock(ctx->conf.data); /* the channel is clear */
+
+  /* Frame sizes with the node IDs and the header extension. Each
+     fragment but the last fills the payload (see LORAMAC_FRAG). */
+  ctx->addr_size = sizeof(uint16_t);
+  ctx->hdr_size  = LORAMAC_HDR_SIZE;
+  ctx->ack_size  = LORAMAC_ACK_SIZE;
+  ctx->back_size = LORAMAC_BACK_SIZE;
+  if(FLAGS(ctx) & LORAMAC_COMPACT) {
+    if(cluster_check(ctx))
+      return LORAMAC_INIT_CLUSTER;
+
+    ctx->addr_size = sizeof(uint8_t);
+    ctx->hdr_size  = LORAMAC_CHDR_SIZE;
+    ctx->ack_size  = LORAMAC_CACK_SIZE;
+    ctx->back_size = LORAMAC_CBACK_SIZE;
+  }
+  if(FLAGS(ctx) & LORAMAC_PIGGYBACK)
+    ctx->hdr_size += LORAMAC_EXT_SIZE;
+  if(FLAGS(ctx) & LORAMAC_TDMA && FLAGS(ctx) & LORAMAC_COMPACT)
+    return LORAMAC_INIT_TDMA;
+  memset(ctx->tdma, 0, sizeof(ctx->tdma));
+  ctx->tdma_cur  = 0;
+  ctx->frag_size = LORAMAC_MAX_FRAME - ctx->hdr_size - FRAG_HDR_SIZE;
+
+  /* The parity fragments need the fragments and a group with
+     its parity must fit in one window (see LORAMAC_FEC). */
+  if(FLAGS(ctx) & LORAMAC_FEC) {
+    if(!(FLAGS(ctx) & LORAMAC_FRAG))
+      return LORAMAC_INIT_FEC;
+    if(ctx->conf.fec_group &&
+       (ctx->conf.fec_group < FRAG_MIN_GROUP || ctx->conf.fec_group >= LORAMAC_MAX_WINDOW))
+      return LORAMAC_INIT_FEC;
+
+    ctx->frag_size = LORAMAC_MAX_FRAME - ctx->hdr_size - FRAG_FEC_HDR_SIZE;
+  }
+  ctx->frame_loss = 0;
+
+  /* the CRC of the data frames starts with the source */
+  src = BO_HTONS(ctx->conf, ctx->conf.mac_address);
+  crc_ccitt_start(&ctx->tx_crc, CRC_CCITT_INIT);
+  if(FLAGS(ctx) & LORAMAC_COMPACT)
+    crc_ccitt_update(&ctx->tx_crc, &ctx->node_id, sizeof(ctx->node_id));
+  else
+    crc_ccitt_update(&ctx->tx_crc, (const unsigned char *)&src, sizeof(src));
+  crc_ccitt_checkpoint(&ctx->tx_crc);
+
+  /* SIFS is the time until the receiver can send its ACK.
+     So if timeout is lower than this value, ACKs will never
+     be received in time by the sender. */
+  if(ctx->conf.timeout < ctx->conf.sifs)
+    return LORAMAC_INIT_TIMEVAL;
+
+  /* Same for a block ACK held past the timeout (assuming the
+     senders use the same timeout as we do). */
+  if(ctx->conf.back_hold &&
+     (ctx->conf.back_hold >= ctx->conf.timeout || !ctx->conf.schedule_ack))
+    return LORAMAC_INIT_TIMEVAL;
+
+  if(FLAGS(ctx) & LORAMAC_LBT && !ctx->conf.lbt_slot)
+    return LORAMAC_INIT_TIMEVAL;
+
+  if(FLAGS(ctx) & LORAMAC_COMPRESS &&
+     (!ctx->conf.compress || !ctx->conf.decompress))
+    return LORAMAC_INIT_CODEC;
+  memset(&ctx->codec_stats, 0, sizeof(ctx->codec_stats));
+  memset(&ctx->counters, 0, sizeof(ctx->counters));
+
+  /* The key schedules are expanded once, the keys
+     themselves are not kept (see LORAMAC_SECURE). */
+  ctx->key_count  = 0;
+  ctx->own_counter = ctx->conf.counter;
+  ctx->tx_counter  = ctx->conf.counter_store ? ctx->conf.counter_store : &ctx->own_counter;
+  memset(ctx->replay_table, 0, sizeof(ctx->replay_table));
+  memset(ctx->replay_evicted, 0, sizeof(ctx->replay_evicted));
+  memset(ctx->replay_floor, 0, sizeof(ctx->replay_floor));
+  ctx->replay_next = 0;
+  if(FLAGS(ctx) & LORAMAC_SECURE) {
+    if(!ctx->conf.key_count || ctx->conf.key_count > LORAMAC_MAX_KEYS)
+      return LORAMAC_INIT_KEYS;
+    for(i = 0 ; i < (int)ctx->conf.key_count ; i++) {
+      ctx->key_scheds[i].addr = ctx->conf.keys[i].addr;
+      aes_expand(&ctx->key_scheds[i].key, ctx->conf.keys[i].key);
+    }
+    ctx->key_count = ctx->conf.key_count;
+  }
+
+  /* A sender may retransmit the same frame until its last
+     timeout expires. We cannot know the exact configuration
+     of remote nodes so we suppose that it is the same as ours. */
+  ctx->dup_expiry = (ctx->conf.retrans + 1) * (unsigned long)ctx->conf.timeout;
+
+  /* The same applies between two fragments of a message. */
+  frag_init(&ctx->frag_pool, ctx->frag_size, ctx->dup_expiry, FLAGS(ctx) & LORAMAC_FEC);
+
+  /* The generator must not start from zero. */
+  switch(ctx->conf.backoff) {
+  case LORAMAC_BACKOFF_NONE:
+  case LORAMAC_BACKOFF_EXP:
+  case LORAMAC_BACKOFF_JITTER:
+    ctx->backoff_state = ctx->conf.backoff_seed;
+    break;
+  case LORAMAC_BACKOFF_ADDRESS:
+    ctx->backoff_state = ctx->conf.mac_address * 0x9e3779b1UL;
+    break;
+  default:
+    return LORAMAC_INIT_BACKOFF;
+  }
+  if(!ctx->backoff_state)
+    ctx->backoff_state = 0x9e3779b1UL;
+
+  if(FLAGS(ctx) & LORAMAC_ADR) {
+    struct duty_radio radio = ctx->conf.radio;
+
+    radio.sf = ctx->conf.adr_sf_min;
+    if(!ctx->conf.set_radio || duty_radio_check(&radio))
+      return LORAMAC_INIT_ADR;
+    radio.sf = ctx->conf.adr_sf_max;
+    if(ctx->conf.adr_sf_max < ctx->conf.adr_sf_min || duty_radio_check(&radio))
+      return LORAMAC_INIT_ADR;
+  }
+
+  ctx->duty_band = NULL;
+  if(FLAGS(ctx) & LORAMAC_DUTY) {
+    ctx->duty_band = duty_band_lookup(ctx->conf.frequency);
+    if(!ctx->duty_band || duty_radio_check(&ctx->conf.radio))
+      return LORAMAC_INIT_DUTY;
+    duty_init(&ctx->duty, ctx->duty_band->permille, ctx->conf.clock(ctx->conf.data));
+  }
+
+  /* Each filter once, the duplicate filter acknowledges
+     the frame so it must come after all the others. */
+  filters = ctx->conf.filters ? ctx->conf.filters : default_filters;
+  for(i = 0 ; i < LORAMAC_FILTERS ; i++) {
+    if((unsigned int)filters[i] >= LORAMAC_FILTERS || seen & (1 << filters[i]))
+      return LORAMAC_INIT_FILTERS;
+    seen |= 1 << filters[i];
+    ctx->filters[i] = filters[i];
+  }
+  if(ctx->filters[LORAMAC_FILTERS - 1] != LORAMAC_FILTER_DUPLICATE)
+    return LORAMAC_INIT_FILTERS;
+
+  return LORAMAC_INIT_SUCCESS;
+}
+
+/* Payload of a data frame. */
+static unsigned int frame_payload(const struct loramac_ctx *ctx)
+{
+  return LORAMAC_MAX_FRAME - ctx->hdr_size;
+}
+
+/* Account the time on air of a frame written on UART (size byte included). */
+static void duty_account(struct loramac_ctx *ctx, unsigned int size)
+{
+  if(FLAGS(ctx) & LORAMAC_DUTY)
+    duty_charge(&ctx->duty, duty_airtime(&ctx->conf.radio, size),
+                ctx->conf.clock(ctx->conf.data));
+}
+
+/* Time on air of the data frames of a transmission. */
+static unsigned long frames_airtime(const struct loramac_ctx *ctx,
+                                    const struct loramac_frame *frames, unsigned int count)
+{
+  unsigned long airtime = 0;
+  unsigned int i;
+
+  for(i = 0 ; i < count ; i++)
+    airtime += duty_airtime(&ctx->conf.radio, 1 + ctx->hdr_size + frames[i].size);
+  return airtime;
+}
+
+/* Wait until a transmission fits in the duty cycle budget. This is
+   called without the lock which is only taken to check the budget
+   so that the receive path may still send its ACKs meanwhile. */
+static int duty_wait(struct loramac_ctx *ctx, const struct loramac_frame *frames, unsigned int count)
+{
+  unsigned long airtime, delay, waited = 0;
+
+  if(!(FLAGS(ctx) & LORAMAC_DUTY))
+    return LORAMAC_SND_SUCCESS;
+
+  airtime = frames_airtime(ctx, frames, count);
+
+  while(1) {
+    LOCK(ctx);
+    delay = duty_delay(&ctx->duty, airtime, ctx->conf.clock(ctx->conf.data));
+    UNLOCK(ctx);
+
+    if(!delay)
+      return LORAMAC_SND_SUCCESS;
+    if(!ctx->conf.usleep || delay > ctx->conf.duty_wait - waited)
+      return LORAMAC_SND_DUTY;
+
+    ctx->conf.usleep(delay, ctx->conf.data);
+    waited += delay;
+  }
+}
+
+static int send_ack(struct loramac_ctx *ctx, uint16_t src, uint8_t seqno)
+{
+  unsigned char *buf = ctx->snd_pktbuf;
+
+  *(uint8_t  *)buf = ctx->ack_size; buf += sizeof(uint8_t);
+  buf = put_addr(ctx, buf, src);
+  *(uint8_t  *)buf = seqno;
+
+  /* send packet */
+  duty_account(ctx, ctx->snd_pktbuf[0] + 1);
+  return UART_SEND(ctx, ctx->snd_pktbuf, ctx->snd_pktbuf[0] + 1);
+}
+
+static int send_block_ack(struct loramac_ctx *ctx, uint16_t dst, uint8_t base, uint8_t bitmap)
+{
+  unsigned char *buf = ctx->snd_pktbuf;
+
+  *(uint8_t  *)buf = ctx->back_size; buf += sizeof(uint8_t);
+  buf = put_addr(ctx, buf, dst);
+  buf = put_addr(ctx, buf, ctx->conf.mac_address);
+  *(uint8_t  *)buf = base;           buf += sizeof(uint8_t);
+  *(uint8_t  *)buf = bitmap;
+
+  /* send packet */
+  duty_account(ctx, ctx->snd_pktbuf[0] + 1);
+  return UART_SEND(ctx, ctx->snd_pktbuf, ctx->snd_pktbuf[0] + 1);
+}
+
+static int send_pending_ack(struct loramac_ctx *ctx, const struct loramac_ack *ack)
+{
+  ctx->counters.tx_acks++;
+  if(ack->type == LORAMAC_BACK_SIZE)
+    return send_block_ack(ctx, ack->dst, ack->seqno, ack->bitmap);
+  else
+    return send_ack(ctx, ack->dst, ack->seqno);
+}
+
+/* Delay of a block ACK held for the rest of the burst (see back_hold). */
+static unsigned long hold_delay(const struct loramac_ctx *ctx)
+{
+  return ctx->conf.back_hold > ctx->conf.sifs ? ctx->conf.back_hold : ctx->conf.sifs;
+}
+
+/* Give a new due time to the block ACK at position i of the queue for
+   the frame just received: the end of the hold, or SIFS once it covers
+   a whole window. It moves to its place in the queue to keep the queue
+   in due order and the scheduler is armed again when it becomes the
+   head. Called with ack_lock. */
+static void hold_ack(struct loramac_ctx *ctx, unsigned int i)
+{
+  struct loramac_ack *queue = ctx->ack_queue, ack;
+  unsigned long now = ctx->conf.clock(ctx->conf.data);
+  unsigned int j;
+
+  ack = queue[(ctx->ack_head + i) % LORAMAC_MAX_PENDING_ACK];
+  if(ack.frames > LORAMAC_MAX_WINDOW)
+    return; /* already due SIFS after the last frame of the window */
+  ack.due = now + (ack.frames == LORAMAC_MAX_WINDOW ? ctx->conf.sifs : hold_delay(ctx));
+
+  /* take it out and insert it back from the tail */
+  for(j = i ; j + 1 < ctx->ack_count ; j++)
+    queue[(ctx->ack_head + j) % LORAMAC_MAX_PENDING_ACK] =
+      queue[(ctx->ack_head + j + 1) % LORAMAC_MAX_PENDING_ACK];
+  for(; j && (long)(queue[(ctx->ack_head + j - 1) % LORAMAC_MAX_PENDING_ACK].due - ack.due) > 0 ; j--)
+    queue[(ctx->ack_head + j) % LORAMAC_MAX_PENDING_ACK] =
+      queue[(ctx->ack_head + j - 1) % LORAMAC_MAX_PENDING_ACK];
+  queue[(ctx->ack_head + j) % LORAMAC_MAX_PENDING_ACK] = ack;
+
+  /* Otherwise the scheduler fires for a later head and
+     loramac_flush_acks() returns the delay until it is due. */
+  if(!j && i)
+    ctx->conf.schedule_ack(ack.due - now, ctx->conf.data);
+}
+
+/* Queue an ACK to be sent after SIFS. Without a scheduler,
+   we fallback on waiting for SIFS and sending it directly. */
+static void queue_ack(struct loramac_ctx *ctx,
+                      unsigned int type, uint16_t dst, uint8_t seqno, uint8_t bitmap)
+{
+  struct loramac_ack ack = { .due    = 0,
+                             .type   = type,
+                             .dst    = dst,
+                             .seqno  = seqno,
+                             .bitmap = bitmap };
+  unsigned int i, delay;
+
+  if(!ctx->conf.schedule_ack) {
+    /* We have to wait before sending the ACK,
+       otherwise the message is not sent correctly.
+       Note that we don't use usleep and that the
+       SIFS time can be quite large (>500ms). */
+    LOCK(ctx);
+    {
+      ctx->conf.start_timer(ctx->conf.sifs, ctx->conf.data);
+      ctx->conf.wait_timer(ctx->conf.data);
+      send_pending_ack(ctx, &ack);
+    }
+    UNLOCK(ctx);
+    return;
+  }
+
+  ctx->conf.ack_lock(ctx->conf.data);
+  {
+    /* ACKs are always about the last frame received from a sender
+       (block ACKs are cumulative), so we replace the one still pending
+       for the same sender if any. It keeps its original due time
+       unless it is held for the rest of the burst. */
+    for(i = 0 ; i < ctx->ack_count ; i++) {
+      struct loramac_ack *p = &ctx->ack_queue[(ctx->ack_head + i) % LORAMAC_MAX_PENDING_ACK];
+
+      if(p->dst == dst && p->type == type) {
+        p->seqno  = seqno;
+        p->bitmap = bitmap;
+        p->frames++;
+        if(type == LORAMAC_BACK_SIZE && ctx->conf.back_hold)
+          hold_ack(ctx, i);
+        goto EXIT;
+      }
+    }
+
+    /* When the queue is full we drop the ACK.
+       The sender will retransmit its frame. */
+    if(ctx->ack_count == LORAMAC_MAX_PENDING_ACK)
+      goto EXIT;
+
+    delay = type == LORAMAC_BACK_SIZE && ctx->conf.back_hold ? hold_delay(ctx) : ctx->conf.sifs;
+    ack.due    = ctx->conf.clock(ctx->conf.data) + delay;
+    ack.frames = 1;
+    ctx->ack_queue[(ctx->ack_head + ctx->ack_count++) % LORAMAC_MAX_PENDING_ACK] = ack;
+
+    /* Otherwise the scheduler is already armed for the head. */
+    if(ctx->ack_count == 1)
+      ctx->conf.schedule_ack(delay, ctx->conf.data);
+  }
+EXIT:
+  ctx->conf.ack_unlock(ctx->conf.data);
+}
+
+unsigned int loramac_flush_acks(struct loramac_ctx *ctx)
+{
+  unsigned long now = ctx->conf.clock(ctx->conf.data);
+  unsigned int delay;
+
+  while(1) {
+    struct loramac_ack ack;
+
+    ctx->conf.ack_lock(ctx->conf.data);
+    {
+      if(!ctx->ack_count) {
+        ctx->conf.ack_unlock(ctx->conf.data);
+        return 0;
+      }
+
+      ack = ctx->ack_queue[ctx->ack_head];
+
+      /* Not due yet (this is safe with a wrapping clock). */
+      if(now - ack.due > ~0UL >> 1) {
+        delay = ack.due - now;
+        ctx->conf.ack_unlock(ctx->conf.data);
+        return delay ? delay : 1;
+      }
+
+      ctx->ack_head = (ctx->ack_head + 1) % LORAMAC_MAX_PENDING_ACK;
+      ctx->ack_count--;
+    }
+    ctx->conf.ack_unlock(ctx->conf.data);
+
+    LOCK(ctx);
+    send_pending_ack(ctx, &ack);
+    UNLOCK(ctx);
+  }
+}
+
+/* Return the state of a destination, restarting
+   from the initial seqno when it was evicted. */
+static struct loramac_peer * peer_lookup(struct loramac_ctx *ctx, uint16_t dst)
+{
+  struct loramac_peer *peer = &ctx->tx_peers[dst % LORAMAC_MAX_PEERS];
+
+  if(!peer->used || peer->addr != dst) {
+    *peer = (struct loramac_peer){ .used  = 1,
+                                   .addr  = dst,
+                                   .seqno = ctx->conf.seqno };
+    rto_init(&peer->rto, ctx->conf.sifs, ctx->conf.timeout);
+    adr_init(&peer->adr, ctx->conf.adr_sf_min, ctx->conf.adr_sf_max);
+  }
+
+  return peer;
+}
+
+/* Configure the module with the spreading factor of a destination
+   (see LORAMAC_ADR), must be called with the lock. */
+static void adr_apply(struct loramac_ctx *ctx, const struct loramac_peer *peer)
+{
+  struct duty_radio radio = ctx->conf.radio;
+
+  if(!(FLAGS(ctx) & LORAMAC_ADR) || peer->adr.sf == radio.sf)
+    return;
+
+  radio.sf = peer->adr.sf;
+  if(!ctx->conf.set_radio(&radio, ctx->conf.data))
+    ctx->conf.radio = radio;
+}
+
+/* Move the spreading factor of a destination after a send that
+   was tries times transmitted and acknowledged or not at all. */
+static void adr_account(struct loramac_ctx *ctx, struct loramac_peer *peer,
+                        unsigned int tries, int acked)
+{
+  unsigned int sf = peer->adr.sf;
+
+  /* without ACKs there is nothing to learn from */
+  if(!(FLAGS(ctx) & LORAMAC_ADR) || FLAGS(ctx) & LORAMAC_NOACK ||
+     !adr_update(&peer->adr, tries, acked))
+    return;
+
+  if(peer->adr.sf < sf)
+    ctx->counters.tx_adr_faster++;
+  else
+    ctx->counters.tx_adr_slower++;
+}
+
+/* ACK timeout of a peer (see LORAMAC_RTO). */
+static unsigned int ack_timeout(const struct loramac_ctx *ctx, const struct loramac_peer *peer)
+{
+  if(FLAGS(ctx) & LORAMAC_RTO)
+    return rto_timeout(&peer->rto);
+  return ctx->conf.timeout;
+}
+
+/* Update the ACK timeout of a peer after waiting from begin. Only
+   frames sent once give a round trip, the timeout backs off when
+   nothing was acknowledged. */
+static void ack_update(struct loramac_ctx *ctx, struct loramac_peer *peer,
+                       unsigned long begin, int acked, int first)
+{
+  unsigned long delay = ctx->conf.clock(ctx->conf.data) - begin;
+
+  if(acked && first) {
+    struct loramac_counters *c = &ctx->counters;
+
+    if(!c->ack_delays || delay < c->ack_delay_min)
+      c->ack_delay_min = delay;
+    if(delay > c->ack_delay_max)
+      c->ack_delay_max = delay;
+    c->ack_delay_sum += delay;
+    c->ack_delays++;
+  }
+
+  if(!(FLAGS(ctx) & LORAMAC_RTO))
+    return;
+
+  if(!acked)
+    rto_backoff(&peer->rto);
+  else if(first)
+    rto_sample(&peer->rto, delay);
+}
+
+/* Update the frame loss rate with the frames lost out of those
+   sent (see LORAMAC_FEC). The average has a weight of 1/16. */
+static void loss_update(struct loramac_ctx *ctx, unsigned int lost, unsigned int sent)
+{
+  long sample = (long)lost * 65536 / sent;
+
+  ctx->frame_loss = (long)ctx->frame_loss + (sample - (long)ctx->frame_loss) / 16;
+}
+
+/* Group sizes from the highest frame loss rate in 1/65536. With a
+   group of n fragments the message survives a lost fragment but
+   not two in n + 1 frames. These keep this below about 1 in 10
+   while the parity grows from 1/8 to 1/3 of the frames. */
+static const struct {
+  unsigned long loss;
+  unsigned int  group;
+} fec_groups[] = {
+  { 13107, 2 }, /* 20% */
+  {  6554, 3 }, /* 10% */
+  {  2621, 4 }, /* 4% */
+  {   655, 7 }  /* 1% */
+};
+
+/* Number of data fragments per parity fragment for a message,
+   0 for no parity (see LORAMAC_FEC). A message of a single
+   fragment does not need any. */
+static unsigned int fec_group(const struct loramac_ctx *ctx, unsigned int size)
+{
+  unsigned int i;
+
+  if(!(FLAGS(ctx) & LORAMAC_FEC) || frag_count(ctx->frag_size, size) < 2)
+    return 0;
+  if(ctx->conf.fec_group)
+    return ctx->conf.fec_group;
+
+  for(i = 0 ; i < sizeof(fec_groups) / sizeof(fec_groups[0]) ; i++)
+    if(ctx->frame_loss >= fec_groups[i].loss)
+      return fec_groups[i].group;
+  return 0;
+}
+
+/* Write a fragment with the header of our flags. */
+static unsigned int build_frag(const struct loramac_ctx *ctx, void *buf, uint8_t tag,
+                               unsigned int index, unsigned int group,
+                               const void *payload, unsigned int size)
+{
+  if(FLAGS(ctx) & LORAMAC_FEC)
+    return frag_fec_build(buf, ctx->frag_size, tag, index, group, payload, size);
+  return frag_build(buf, ctx->frag_size, tag, index, payload, size);
+}
+
+static unsigned int bit_count(unsigned int v)
+{
+  unsigned int n;
+
+  for(n = 0 ; v ; v &= v - 1)
+    n++;
+  return n;
+}
+
+/* Tell whether the receiver rebuilds all the pending frames of a
+   window from the parity, that is each group of the window still
+   misses at most one frame (see LORAMAC_FEC). */
+static int fec_repairable(uint8_t pending, unsigned int count, unsigned int group)
+{
+  unsigned int i;
+
+  for(i = 0 ; i < count ; i += group + 1)
+    if(bit_count((pending >> i) & ((1 << (group + 1)) - 1)) > 1)
+      return 0;
+  return 1;
+}
+
+static uint32_t backoff_random(struct loramac_ctx *ctx)
+{
+  uint32_t x = ctx->backoff_state;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+
+  return ctx->backoff_state = x;
+}
+
+/* Delay before the nth retransmission in us (see loramac_backoff). */
+static unsigned long backoff_delay(struct loramac_ctx *ctx, unsigned int n)
+{
+  unsigned long delay = ctx->conf.backoff_slot;
+
+  if(ctx->conf.backoff == LORAMAC_BACKOFF_NONE)
+    return 0;
+
+  while(--n && delay < ctx->conf.backoff_max)
+    delay <<= 1;
+  if(delay > ctx->conf.backoff_max)
+    delay = ctx->conf.backoff_max;
+
+  if(ctx->conf.backoff != LORAMAC_BACKOFF_EXP)
+    delay = backoff_random(ctx) % (delay + 1);
+
+  return delay;
+}
+
+/* Back off before the nth retransmission. We keep waiting
+   for the ACK meanwhile so that a late one is not lost. */
+static void backoff_wait(struct loramac_ctx *ctx, unsigned int n)
+{
+  unsigned long delay = backoff_delay(ctx, n);
+
+  if(!delay)
+    return;
+
+  ctx->counters.tx_backoff_us += delay;
+
+  ctx->wait_ack = 1;
+  ctx->conf.start_timer(delay, ctx->conf.data);
+  ctx->conf.wait_timer(ctx->conf.data);
+  ctx->wait_ack = 0;
+}
+
+/* Check if another node is transmitting (see LORAMAC_LBT). */
+static int channel_busy(struct loramac_ctx *ctx)
+{
+  if(ctx->conf.channel_busy)
+    return ctx->conf.channel_busy(ctx->conf.data);
+  return (long)(__atomic_load_n(&ctx->nav, __ATOMIC_RELAXED) -
+               ctx->conf.clock(ctx->conf.data)) > 0;
+}
+
+/* Reserve the channel for an overheard exchange. */
+static void nav_update(struct loramac_ctx *ctx, unsigned long us)
+{
+  unsigned long end = ctx->conf.clock(ctx->conf.data) + us;
+
+  if(FLAGS(ctx) & LORAMAC_LBT &&
+     (long)(end - __atomic_load_n(&ctx->nav, __ATOMIC_RELAXED)) > 0)
+    __atomic_store_n(&ctx->nav, end, __ATOMIC_RELAXED);
+}
+
+/* Wait until the channel is clear or give up after lbt_tries
+   random backoffs. The window of the nth backoff is 2^n slots,
+   up to 2^LBT_MAX_EXP slots like the CSMA of 802.15.4. */
+#define LBT_MAX_EXP 5
+static int channel_access(struct loramac_ctx *ctx)
+{
+  unsigned int n, window;
+
+  if(!(FLAGS(ctx) & LORAMAC_LBT))
+    return LORAMAC_SND_SUCCESS;
+
+  for(n = 0 ; channel_busy(ctx) ; n++) {
+    ctx->counters.tx_busy++;
+    if(n == ctx->conf.lbt_tries)
+      return LORAMAC_SND_ACCESS;
+
+    window = 1 << (n < LBT_MAX_EXP ? n + 1 : LBT_MAX_EXP);
+    ctx->conf.start_timer((1 + backoff_random(ctx) % window) * ctx->conf.lbt_slot,
+                          ctx->conf.data);
+    ctx->conf.wait_timer(ctx->conf.data);
+  }
+
+  return LORAMAC_SND_SUCCESS;
+}
+
+/* Account the attempts of an acknowledged send. */
+static void count_attempts(struct loramac_ctx *ctx, unsigned int attempts)
+{
+  if(attempts > LORAMAC_MAX_ATTEMPTS)
+    attempts = LORAMAC_MAX_ATTEMPTS;
+  if(attempts)
+    ctx->counters.tx_attempts[attempts - 1]++;
+}
+
+/* A data frame ready to be written. The header and the CRC are
+   computed once per loramac_send() and retransmissions only write
+   the frame again, unless it carries another ACK (see piggyback()).
+   The payload stays in the caller's buffer. */
+struct tx_frame {
+  unsigned char        hdr[LORAMAC_HDR_SIZE - sizeof(uint16_t) + 1 + LORAMAC_EXT_SIZE]; /* [sz][src][dst][seqno][ext] */
+  unsigned int         hdr_size;
+  unsigned char        crc[sizeof(uint16_t)];
+  const unsigned char *payload;
+  unsigned int         size;
+};
+
+/* CRC over the header (without the size) and the payload,
+   resumed after the source address */
+static void frame_crc(struct loramac_ctx *ctx, struct tx_frame *frame)
+{
+  struct crc_ccitt_ctx crc = ctx->tx_crc;
+
+  crc_ccitt_rewind(&crc);
+  crc_ccitt_update(&crc, frame->hdr + 1 + ctx->addr_size, frame->hdr_size - 1 - ctx->addr_size);
+  crc_ccitt_update(&crc, frame->payload, frame->size);
+  *(uint16_t *)frame->crc = BO_HTONS(ctx->conf, crc.crc);
+}
+
+static int build_frame(struct loramac_ctx *ctx, struct tx_frame *frame,
+                       uint16_t dst, uint8_t seqno, const void *payload, unsigned int payload_size)
+{
+  unsigned char *buf = frame->hdr;
+
+  if(payload_size > frame_payload(ctx))
+    return LORAMAC_SND_TOOLONG;
+
+  /* copy header */
+  *(uint8_t  *)buf = ctx->hdr_size + payload_size; buf += sizeof(uint8_t);
+  buf = put_addr(ctx, buf, ctx->conf.mac_address);
+  buf = put_addr(ctx, buf, dst);
+  *(uint8_t  *)buf = seqno;                        buf += sizeof(uint8_t);
+
+  /* no ACK carried yet */
+  if(FLAGS(ctx) & LORAMAC_PIGGYBACK) {
+    memset(buf, 0, LORAMAC_EXT_SIZE);
+    buf += LORAMAC_EXT_SIZE;
+  }
+
+  frame->hdr_size = buf - frame->hdr;
+  frame->payload  = payload;
+  frame->size     = payload_size;
+  frame_crc(ctx, frame);
+
+  return LORAMAC_SND_SUCCESS;
+}
+
+/* Carry the ACK we still owe to the destination of a frame in its
+   header extension (see LORAMAC_PIGGYBACK). The ACK leaves the queue
+   and the frame waits until it is due so that the destination had
+   time to turn around. A retransmission keeps the ACK it carried
+   unless a newer one is pending. The destination ignores an ACK
+   to a frame it is not waiting for anymore. */
+static void piggyback(struct loramac_ctx *ctx, struct tx_frame *frame, uint16_t dst)
+{
+  unsigned char *ext = frame->hdr + frame->hdr_size - LORAMAC_EXT_SIZE;
+  struct loramac_ack ack;
+  unsigned long now;
+  unsigned int i;
+  int found = 0;
+
+  if(!(FLAGS(ctx) & LORAMAC_PIGGYBACK) || !ctx->conf.schedule_ack)
+    return;
+
+  ctx->conf.ack_lock(ctx->conf.data);
+  {
+    for(i = 0 ; i < ctx->ack_count ; i++) {
+      struct loramac_ack *p = &ctx->ack_queue[(ctx->ack_head + i) % LORAMAC_MAX_PENDING_ACK];
+
+      if(p->dst == dst && p->type == LORAMAC_ACK_SIZE) {
+        ack   = *p;
+        found = 1;
+        break;
+      }
+    }
+
+    /* The next ACKs move up so that the queue stays ordered.
+       A scheduler armed for this one finds the next one. */
+    if(found) {
+      for(; i + 1 < ctx->ack_count ; i++)
+        ctx->ack_queue[(ctx->ack_head + i) % LORAMAC_MAX_PENDING_ACK] =
+          ctx->ack_queue[(ctx->ack_head + i + 1) % LORAMAC_MAX_PENDING_ACK];
+      ctx->ack_count--;
+    }
+  }
+  ctx->conf.ack_unlock(ctx->conf.data);
+
+  if(!found)
+    return;
+
+  ext[0] = LORAMAC_EXT_ACK;
+  ext[1] = ack.seqno;
+  frame_crc(ctx, frame);
+  ctx->counters.tx_piggyback++;
+
+  /* not due yet (this is safe with a wrapping clock) */
+  now = ctx->conf.clock(ctx->conf.data);
+  if(now - ack.due > ~0UL >> 1) {
+    ctx->conf.start_timer(ack.due - now, ctx->conf.data);
+    ctx->conf.wait_timer(ctx->conf.data);
+  }
+}
+
+/* Check whether a frame waits for an ACK. */
+static int frame_acked(const struct loramac_ctx *ctx, const struct tx_frame *frame)
+{
+  uint16_t dst;
+
+  if(FLAGS(ctx) & LORAMAC_NOACK || frame->hdr[0] & LORAMAC_SIZE_NOACK)
+    return 0;
+  get_addr(ctx, frame->hdr + 1 + ctx->addr_size, &dst);
+  return !multicast(dst) && dst != LORAMAC_BEACON_ADDR;
+}
+
+/* Wait for the next slot of ours in the schedule where the frame
+   fits with its ACK (see LORAMAC_TDMA). The ACK comes after SIFS
+   so it lands in our slot too. Without a live schedule the frame
+   goes at once. */
+static int slot_wait(struct loramac_ctx *ctx, const struct tx_frame *frame)
+{
+  const struct loramac_tdma *tdma;
+  unsigned long now, need, period, offset, start, end, wait = 0;
+  unsigned int i, guard = ctx->conf.tdma_guard;
+  int found = 0;
+
+  if(!(FLAGS(ctx) & LORAMAC_TDMA))
+    return LORAMAC_SND_SUCCESS;
+
+  tdma   = &ctx->tdma[__atomic_load_n(&ctx->tdma_cur, __ATOMIC_ACQUIRE)];
+  period = (unsigned long)tdma->schedule.slot * tdma->schedule.count;
+  now    = ctx->conf.clock(ctx->conf.data);
+  if(!period || now - tdma->base >= LORAMAC_TDMA_LIFETIME * period)
+    return LORAMAC_SND_SUCCESS;
+
+  need = duty_airtime(&ctx->conf.radio, (frame->hdr[0] & LORAMAC_MAX_FRAME) + 1);
+  if(frame_acked(ctx, frame))
+    need += ctx->conf.sifs +
+      duty_airtime(&ctx->conf.radio, 1 + (FLAGS(ctx) & LORAMAC_WINDOW ? ctx->back_size
+                                                                           : ctx->ack_size));
+  if(need + 2 * guard > tdma->schedule.slot)
+    return LORAMAC_SND_SLOT;
+
+  /* the earliest start in one of our slots, from now */
+  offset = (now - tdma->base) % period;
+  for(i = 0 ; i < tdma->schedule.count ; i++) {
+    unsigned long w;
+
+    if(tdma->schedule.owners[i] != ctx->conf.mac_address)
+      continue;
+
+    start = i * (unsigned long)tdma->schedule.slot + guard;
+    end   = (i + 1) * (unsigned long)tdma->schedule.slot - guard;
+    if(offset >= start && offset + need <= end)
+      w = 0;
+    else
+      w = (start + period - offset) % period;
+
+    if(!found || w < wait)
+      wait = w;
+    found = 1;
+  }
+  if(!found)
+    return LORAMAC_SND_SLOT;
+
+  if(wait) {
+    ctx->counters.tx_slot_us += wait;
+    ctx->conf.start_timer(wait, ctx->conf.data);
+    ctx->conf.wait_timer(ctx->conf.data);
+  }
+  return LORAMAC_SND_SUCCESS;
+}
+
+/* Write a frame on UART at once. */
+static int write_frame(struct loramac_ctx *ctx, const struct tx_frame *frame)
+{
+  unsigned char *buf = ctx->snd_pktbuf;
+  int ret;
+
+  if(HAS_UART_SENDV(ctx)) {
+    struct loramac_iovec iov[] = {
+      { .base = frame->hdr,     .size = frame->hdr_size },
+      { .base = frame->payload, .size = frame->size },
+      { .base = frame->crc,     .size = sizeof(frame->crc) }
+    };
+
+    ret = UART_SENDV(ctx, iov, sizeof(iov) / sizeof(iov[0]));
+  }
+  else {
+    /* gather the frame in the packet buffer */
+    memcpy(buf, frame->hdr, frame->hdr_size);    buf += frame->hdr_size;
+    memcpy(buf, frame->payload, frame->size);    buf += frame->size;
+    memcpy(buf, frame->crc, sizeof(frame->crc)); buf += sizeof(frame->crc);
+
+    ret = UART_SEND(ctx, ctx->snd_pktbuf, buf - ctx->snd_pktbuf);
+  }
+
+  if(!ret) {
+    ctx->counters.tx_frames++;
+    duty_account(ctx, (frame->hdr[0] & LORAMAC_MAX_FRAME) + 1);
+  }
+
+  return ret;
+}
+
+static int send_frame(struct loramac_ctx *ctx, const struct tx_frame *frame)
+{
+  int ret;
+
+  ret = slot_wait(ctx, frame);
+  if(ret != LORAMAC_SND_SUCCESS)
+    return ret;
+
+  ret = channel_access(ctx);
+  if(ret != LORAMAC_SND_SUCCESS)
+    return ret;
+
+  return write_frame(ctx, frame);
+}
+
+static int loramac_send_helper(struct loramac_ctx *ctx, struct tx_frame *frame,
+                               struct loramac_peer *peer, int first)
+{
+  uint8_t seqno = frame->hdr[1 + 2 * ctx->addr_size];
+  unsigned long begin;
+  int ret;
+
+  PROBE(loramac, send_attempt, peer->addr, seqno, first);
+
+  piggyback(ctx, frame, peer->addr);
+
+  ret = send_frame(ctx, frame);
+  if(ret != LORAMAC_SND_SUCCESS)
+    return ret;
+
+  /* If we disabled ACK, for all frames or this
+     one, we are done here. Otherwise we need to
+     wait and check the last received ACK. */
+  if(FLAGS(ctx) & LORAMAC_NOACK || frame->hdr[0] & LORAMAC_SIZE_NOACK)
+    return LORAMAC_SND_SUCCESS;
+
+  begin = ctx->conf.clock(ctx->conf.data);
+
+  ctx->ack_src  = peer->addr;
+  ctx->wait_ack = 1;
+  ctx->conf.start_timer(ack_timeout(ctx, peer), ctx->conf.data);
+  ctx->conf.wait_timer(ctx->conf.data);
+
+  ack_update(ctx, peer, begin, ctx->last_ack_seqno == seqno, first);
+  loss_update(ctx, ctx->last_ack_seqno != seqno, 1);
+  PROBE(loramac, ack_wait, peer->addr, seqno, ctx->last_ack_seqno == seqno, begin);
+
+  if(ctx->last_ack_seqno != seqno)
+    return LORAMAC_SND_NOACK;
+  return LORAMAC_SND_SUCCESS;
+}
+
+static int send_window(struct loramac_ctx *ctx,
+                       uint16_t dst, const struct loramac_frame *frames, unsigned int count,
+                       const struct loramac_tx_opts *opts, unsigned int *tx);
+static int send_window_fec(struct loramac_ctx *ctx,
+                           uint16_t dst, const struct loramac_frame *frames, unsigned int count,
+                           unsigned int group, const struct loramac_tx_opts *opts, unsigned int *tx);
+
+/* Options of a send with the defaults filled in (see loramac_tx_opts). */
+static struct loramac_tx_opts tx_opts(const struct loramac_ctx *ctx, const struct loramac_tx_opts *opts)
+{
+  struct loramac_tx_opts o = { .flags   = opts ? opts->flags : 0,
+                               .retrans = opts && opts->retrans ? opts->retrans : ctx->conf.retrans };
+
+  if(FLAGS(ctx) & LORAMAC_NOACK)
+    o.flags |= LORAMAC_TX_NOACK;
+  return o;
+}
+
+/* Flag a frame sent without ACK, unless no frame is acknowledged
+   at all so that the frames stay readable by any receiver. The
+   size byte is not covered by the CRC. */
+static void tx_noack(const struct loramac_ctx *ctx, const struct loramac_tx_opts *opts,
+                     struct tx_frame *frame)
+{
+  if(opts->flags & LORAMAC_TX_NOACK && !(FLAGS(ctx) & LORAMAC_NOACK))
+    frame->hdr[0] |= LORAMAC_SIZE_NOACK;
+}
+
+/* Send broadcast or group frames without waiting for any ACK (see
+   bcast_repeat). The copies are repeated by rounds so that a frame lost
+   to a burst of interference may still come through in the next round.
+   Groups take the sequence numbers of the broadcasts, the receivers
+   drop the copies of both with the same table. */
+static int send_broadcast(struct loramac_ctx *ctx, uint16_t dst,
+                          const struct loramac_frame *frames, unsigned int count,
+                          unsigned int *tx)
+{
+  struct tx_frame txframes[LORAMAC_MAX_WINDOW];
+  unsigned int repeat = ctx->conf.bcast_repeat ? ctx->conf.bcast_repeat : 1;
+  struct loramac_peer *peer;
+  unsigned int i, r, sent = 0;
+  int ret;
+
+  for(i = 0 ; i < count ; i++)
+    if(frames[i].size > frame_payload(ctx))
+      return LORAMAC_SND_TOOLONG;
+
+  ret = duty_wait(ctx, frames, count);
+  if(ret != LORAMAC_SND_SUCCESS)
+    goto EXIT;
+
+  LOCK(ctx);
+  {
+    peer = peer_lookup(ctx, 0xffff);
+
+    for(i = 0 ; i < count ; i++)
+      build_frame(ctx, &txframes[i], dst, ++peer->seqno, frames[i].payload, frames[i].size);
+
+    for(r = 0 ; r < repeat ; r++) {
+      for(i = 0 ; i < count ; i++) {
+        if(r && ctx->conf.bcast_jitter) {
+          ctx->conf.start_timer(backoff_random(ctx) % (ctx->conf.bcast_jitter + 1),
+                                ctx->conf.data);
+          ctx->conf.wait_timer(ctx->conf.data);
+        }
+
+        ret = send_frame(ctx, &txframes[i]);
+        if(ret != LORAMAC_SND_SUCCESS)
+          goto UNLOCK;
+        sent++;
+      }
+    }
+  }
+UNLOCK:
+  UNLOCK(ctx);
+EXIT:
+  if(tx)
+    *tx = sent;
+
+  return ret;
+}
+
+/* Send a frame and wait for its ACK with at most the attempts of the
+   options, or a single one for a probe. Only a send that gives up
+   after all its attempts counts as not acknowledged (see LORAMAC_FEC). */
+static int send_unicast(struct loramac_ctx *ctx,
+                        uint16_t dst, const void *payload, unsigned int payload_size,
+                        const struct loramac_tx_opts *opts, int probe, unsigned int *tx)
+{
+  unsigned int retrans = probe ? 1 : opts->retrans;
+  int noack = opts->flags & LORAMAC_TX_NOACK;
+  int ret = LORAMAC_SND_NOACK;
+  unsigned int retransmission = 0;
+  struct loramac_peer *peer;
+  struct tx_frame frame;
+
+  if(payload_size <= frame_payload(ctx)) {
+    struct loramac_frame f = { .payload = payload,
+                               .size    = payload_size };
+
+    ret = duty_wait(ctx, &f, 1);
+    if(ret != LORAMAC_SND_SUCCESS) {
+      if(tx)
+        *tx = 0;
+      return ret;
+    }
+  }
+
+  /* We lock the packet buffer when sending a packet.
+     This will lock for the complete transmission
+     (including ACK and retransmissions). */
+  LOCK(ctx);
+  {
+    /* Use same sequence number for retransmitted frames. */
+    peer = peer_lookup(ctx, dst);
+    ret  = build_frame(ctx, &frame, dst, ++peer->seqno, payload, payload_size);
+    if(ret != LORAMAC_SND_SUCCESS)
+      goto EXIT;
+    tx_noack(ctx, opts, &frame);
+    adr_apply(ctx, peer);
+
+    for(retransmission = 0 ; retransmission < retrans ; retransmission++) {
+      if(retransmission) {
+        backoff_wait(ctx, retransmission);
+
+        /* acknowledged while backing off */
+        if(ctx->last_ack_seqno == peer->seqno) {
+          ret = LORAMAC_SND_SUCCESS;
+          break;
+        }
+      }
+
+      ret = loramac_send_helper(ctx, &frame, peer, retransmission == 0);
+
+      if(ret == LORAMAC_SND_SUCCESS) {
+        retransmission++; /* update for tx count */
+        break;
+      }
+    }
+
+    /* without ACKs there is nothing to account for */
+    if(noack)
+      ;
+    else if(ret == LORAMAC_SND_SUCCESS) {
+      count_attempts(ctx, retransmission);
+      adr_account(ctx, peer, retransmission, 1);
+    }
+    else if(ret == LORAMAC_SND_NOACK && !probe) {
+      ctx->counters.tx_noack++;
+      adr_account(ctx, peer, retransmission, 0);
+    }
+  }
+EXIT:
+  UNLOCK(ctx);
+
+  if(tx)
+    *tx = retransmission;
+
+  return ret;
+}
+
+static int send_single(struct loramac_ctx *ctx,
+                       uint16_t dst, const void *payload, unsigned int payload_size,
+                       const struct loramac_tx_opts *opts, unsigned int *tx)
+{
+  if(multicast(dst)) {
+    struct loramac_frame f = { .payload = payload,
+                               .size    = payload_size };
+    return send_broadcast(ctx, dst, &f, 1, tx);
+  }
+
+  /* With block ACKs a single frame is a window of one frame. */
+  if(FLAGS(ctx) & LORAMAC_WINDOW) {
+    struct loramac_frame window = { .payload = payload,
+                                    .size    = payload_size };
+    return send_window(ctx, dst, &window, 1, opts, tx);
+  }
+
+  return send_unicast(ctx, dst, payload, payload_size, opts, 0, tx);
+}
+
+/* Send a message as a sequence of fragments. With block ACKs the
+   fragments are sent by windows, otherwise one at a time. The tx
+   count is the total number of transmissions for all fragments.
+   With parity (see LORAMAC_FEC) a window holds whole groups and
+   one fragment a time gives up at once on the first fragment of
+   a group that is not acknowledged since the receiver rebuilds it. */
+static int send_fragmented(struct loramac_ctx *ctx,
+                           uint16_t dst, const void *payload, unsigned int payload_size,
+                           const struct loramac_tx_opts *opts, unsigned int *tx)
+{
+  unsigned char bufs[LORAMAC_MAX_WINDOW][LORAMAC_MAX_CPAYLOAD];
+  struct loramac_frame frags[LORAMAC_MAX_WINDOW];
+  unsigned int window = FLAGS(ctx) & LORAMAC_WINDOW ? LORAMAC_MAX_WINDOW : 1;
+  unsigned int group, count, first, n, i, t;
+  unsigned int total = 0, parity = 0, unrepaired = 0;
+  int ret = LORAMAC_SND_SUCCESS;
+  int lost = 0;
+  uint8_t tag;
+
+  LOCK(ctx);
+  tag   = ++ctx->frag_tag;
+  group = fec_group(ctx, payload_size);
+  UNLOCK(ctx);
+
+  count = frag_fec_count(ctx->frag_size, payload_size, group);
+  if(!count)
+    return LORAMAC_SND_TOOLONG;
+
+  if(group && window > 1)
+    window -= window % (group + 1);
+
+  for(first = 0 ; first < count ; first += n) {
+    n = count - first < window ? count - first : window;
+
+    for(i = 0 ; i < n ; i++) {
+      frags[i] = (struct loramac_frame){
+        .payload = bufs[i],
+        .size    = build_frag(ctx, bufs[i], tag, first + i, group, payload, payload_size)
+      };
+      if(frag_fec_parity(ctx->frag_size, payload_size, group, first + i))
+        parity++;
+    }
+
+    t = 0;
+    if(group && window == 1 && !multicast(dst)) {
+      ret = send_unicast(ctx, dst, frags[0].payload, frags[0].size, opts, !lost, &t);
+      if(ret == LORAMAC_SND_NOACK && !lost) {
+        ret  = LORAMAC_SND_SUCCESS;
+        lost = 1;
+        unrepaired++;
+      }
+
+      /* the next group may lose another fragment */
+      if(frag_fec_parity(ctx->frag_size, payload_size, group, first))
+        lost = 0;
+    }
+    else
+      ret = send_window_fec(ctx, dst, frags, n, group, opts, &t);
+    total += t;
+
+    if(ret != LORAMAC_SND_SUCCESS)
+      break;
+  }
+
+  if(group) {
+    LOCK(ctx);
+    ctx->counters.tx_parity     += parity;
+    ctx->counters.tx_unrepaired += unrepaired;
+    UNLOCK(ctx);
+  }
+
+  if(tx)
+    *tx = total;
+
+  return ret;
+}
+
+unsigned int loramac_max_payload(const struct loramac_ctx *ctx)
+{
+  unsigned int max = frame_payload(ctx);
+
+  if(FLAGS(ctx) & LORAMAC_FRAG)
+    max = ctx->frag_size;
+  if(FLAGS(ctx) & LORAMAC_COMPRESS)
+    max -= LORAMAC_CODEC_HDR_SIZE;
+  if(FLAGS(ctx) & LORAMAC_SECURE)
+    max -= LORAMAC_SEC_SIZE;
+  return max;
+}
+
+void loramac_codec_stats(struct loramac_ctx *ctx, struct loramac_codec_stats *stats)
+{
+  LOCK(ctx);
+  *stats = ctx->codec_stats;
+  UNLOCK(ctx);
+}
+
+long loramac_duty_budget(const struct loramac_ctx *ctx)
+{
+  if(!(FLAGS(ctx) & LORAMAC_DUTY))
+    return LONG_MAX;
+  return duty_credit(&ctx->duty, ctx->conf.clock(ctx->conf.data));
+}
+
+unsigned long loramac_duty_delay(const struct loramac_ctx *ctx, unsigned int payload_size)
+{
+  if(!(FLAGS(ctx) & LORAMAC_DUTY))
+    return 0;
+  return duty_delay(&ctx->duty, duty_airtime(&ctx->conf.radio, 1 + ctx->hdr_size + payload_size),
+                    ctx->conf.clock(ctx->conf.data));
+}
+
+void loramac_counters(const struct loramac_ctx *ctx, struct loramac_counters *counters)
+{
+  *counters = ctx->counters;
+}
+
+int loramac_set_timing(struct loramac_ctx *ctx, unsigned int sifs, unsigned int timeout)
+{
+  int i;
+
+  if(timeout < sifs)
+    return LORAMAC_INIT_TIMEVAL;
+
+  /* The receiver reads SIFS without the lock. The ACKs already
+     queued keep their due time, so after a lower SIFS the next
+     ACKs may wait behind them until the queue drains once. */
+  LOCK(ctx);
+  ctx->conf.sifs    = sifs;
+  ctx->conf.timeout = timeout;
+  for(i = 0 ; i < LORAMAC_MAX_PEERS ; i++)
+    if(ctx->tx_peers[i].used)
+      rto_init(&ctx->tx_peers[i].rto, sifs, timeout);
+  UNLOCK(ctx);
+
+  return LORAMAC_INIT_SUCCESS;
+}
+
+/* Write the message in buf with its compression header. It is only
+   compressed when this makes it smaller. Return the size of the
+   result or 0 when it does not fit in max bytes. */
+static unsigned int encode(struct loramac_ctx *ctx,
+                           void *buf, unsigned int max, const void *payload,
+                           unsigned int payload_size)
+{
+  unsigned char *b = buf;
+  unsigned long begin = ctx->conf.clock(ctx->conf.data);
+  unsigned int limit = payload_size < max ? payload_size : max;
+  unsigned int size = 0;
+  int compressed;
+
+  /* smaller than the message alone, not only with its header */
+  if(limit > LORAMAC_CODEC_HDR_SIZE)
+    size = ctx->conf.compress(payload, payload_size, b + LORAMAC_CODEC_HDR_SIZE,
+                             limit - LORAMAC_CODEC_HDR_SIZE);
+  compressed = size != 0;
+
+  if(compressed) {
+    b[0]  = LORAMAC_CODEC_COMPRESS;
+    size += LORAMAC_CODEC_HDR_SIZE;
+  }
+  else if(payload_size + LORAMAC_CODEC_HDR_SIZE <= max) {
+    b[0] = LORAMAC_CODEC_NONE;
+    memcpy(b + LORAMAC_CODEC_HDR_SIZE, payload, payload_size);
+    size = payload_size + LORAMAC_CODEC_HDR_SIZE;
+  }
+
+  LOCK(ctx);
+  ctx->codec_stats.messages++;
+  ctx->codec_stats.compressed  += compressed;
+  ctx->codec_stats.bytes_in    += payload_size;
+  ctx->codec_stats.bytes_out   += size;
+  ctx->codec_stats.compress_us += ctx->conf.clock(ctx->conf.data) - begin;
+  UNLOCK(ctx);
+
+  return size;
+}
+
+/* Strip the compression header and decompress the message when
+   necessary. Return false if the message is invalid. */
+static int decode(struct loramac_ctx *ctx, const void **payload, unsigned int *payload_size)
 {
-  if((newest + 1) % ack_fifo_size == oldest) {
-    /* queue is full */
-    ack_fifo[oldest] = (struct last_ack){ .sender = sender,
-                                          .seqno  = seqno };
-    oldest = (oldest + 1) % ack_fifo_size;
+  const unsigned char *b = *payload;
+  unsigned long begin;
+  int size;
+
+  if(*payload_size < LORAMAC_CODEC_HDR_SIZE)
+    return 0;
+
+  switch(b[0]) {
+  case LORAMAC_CODEC_NONE:
+    *payload       = b + LORAMAC_CODEC_HDR_SIZE;
+    *payload_size -= LORAMAC_CODEC_HDR_SIZE;
+    return 1;
+  case LORAMAC_CODEC_COMPRESS:
+    begin = ctx->conf.clock(ctx->conf.data);
+    size  = ctx->conf.decompress(b + LORAMAC_CODEC_HDR_SIZE,
+                                *payload_size - LORAMAC_CODEC_HDR_SIZE,
+                                ctx->rcv_msgbuf, sizeof(ctx->rcv_msgbuf));
+
+    LOCK(ctx);
+    ctx->codec_stats.decompress_us += ctx->conf.clock(ctx->conf.data) - begin;
+    UNLOCK(ctx);
+
+    if(size < 0)
+      return 0;
+    *payload      = ctx->rcv_msgbuf;
+    *payload_size = size;
+    return 1;
+  default:
+    return 0;
   }
-  else {
-    /* room available */
-    newest = (newest + 1) % ack_fifo_size;
-    ack_fifo[newest] = (struct last_ack){ .sender = sender,
-                                          .seqno  = seqno };
+}
+
+/* Key schedule of a peer, or of the network when
+   the peer has none (see LORAMAC_SECURE). */
+static const struct aes_key * key_lookup(const struct loramac_ctx *ctx, uint16_t peer)
+{
+  const struct aes_key *network = NULL;
+  unsigned int i;
+
+  for(i = 0 ; i < ctx->key_count ; i++) {
+    if(ctx->key_scheds[i].addr == peer)
+      return &ctx->key_scheds[i].key;
+    if(ctx->key_scheds[i].addr == 0xffff)
+      network = &ctx->key_scheds[i].key;
   }
+
+  return network;
 }
 
-int loramac_init(const struct loramac_config *conf)
+static void sec_nonce(uint8_t nonce[CCM_NONCE_SIZE], uint16_t src, uint16_t dst, uint32_t counter)
 {
-  int i;
+  memset(nonce, 0, CCM_NONCE_SIZE);
+  nonce[0] = src >> 8;
+  nonce[1] = src;
+  nonce[2] = dst >> 8;
+  nonce[3] = dst;
+  nonce[4] = counter >> 24;
+  nonce[5] = counter >> 16;
+  nonce[6] = counter >> 8;
+  nonce[7] = counter;
+}
 
-  mac_conf = *conf;
-  seqno    = mac_conf.seqno;
+/* Write the message in buf with its security header and MIC, that
+   is LORAMAC_SEC_SIZE bytes more. The payload may already be at
+   its place after the header. */
+static int seal(struct loramac_ctx *ctx, uint16_t dst, unsigned char *buf,
+                const void *payload, unsigned int payload_size)
+{
+  const struct aes_key *key = key_lookup(ctx, dst);
+  uint8_t nonce[CCM_NONCE_SIZE];
+  uint32_t counter;
 
-  /* SIFS is the time until the receiver can send its ACK.
-     So if timeout is lower than this value, ACKs will never
-     be received in time by the sender. */
-  if(mac_conf.timeout < mac_conf.sifs)
-    return LORAMAC_INIT_TIMEVAL;
+  if(!key)
+    return LORAMAC_SND_KEY;
 
-  /* The optimal ACK FIFO size on node 0 is for all node i:
-       size_0 = max_i(timeout_i) / SIFS_0 + 1
-     For simplification here we suppose that:
-       max_i(timeout_i) = timeout_0
-     Generally this value is really low since timeout is
-     only slightly larger than SIFS. */
-  ack_fifo_size = mac_conf.timeout / mac_conf.sifs + 1;
-  if(ack_fifo_size > LORAMAC_MAX_ACK_FIFO)
-    return LORAMAC_INIT_ACK_FIFO;
-
-  ack_fifo = malloc(sizeof(struct last_ack) * ack_fifo_size);
-  if(!ack_fifo)
-    return LORAMAC_INIT_OOM;
-
-  /* Initialize all sender to 0xffff.
-     We know that a sender will never
-     have 0xffff as its source address
-     since this is the broadcast address.
-
-     Note that we also initialize the seqno to 0.
-     Otherwise an attacker might use this to snoop
-     around into uninitialized memory. */
-  for(i = 0 ; i < ack_fifo_size ; i++)
-    ack_fifo[i] = (struct last_ack){ .sender = 0xffff,
-                                     .seqno  = 0 };
+  counter = __atomic_fetch_add(ctx->tx_counter, 1, __ATOMIC_RELAXED);
+  buf[0]  = counter >> 24;
+  buf[1]  = counter >> 16;
+  buf[2]  = counter >> 8;
+  buf[3]  = counter;
+  sec_nonce(nonce, ctx->conf.mac_address, dst, counter);
+  ccm_seal(key, nonce, NULL, 0, payload, payload_size, buf + LORAMAC_SEC_HDR_SIZE, LORAMAC_MIC_SIZE);
 
-  return LORAMAC_INIT_SUCCESS;
+  return LORAMAC_SND_SUCCESS;
 }
 
-#define COPY_U16(crc, buf, v) do {                \
-    *(uint16_t *)buf = mac_conf.htons(v);         \
-    crc  = crc_ccitt(buf, sizeof(uint16_t), crc); \
-    buf += sizeof(uint16_t);                      \
-  } while(0)
+/* Keep the floor of a sender evicted from the replay table. The
+   oldest evicted sender leaves the ring and its floor goes to its
+   slot. */
+static void replay_evict(struct loramac_ctx *ctx, const struct loramac_replay *victim)
+{
+  struct loramac_evicted *old = &ctx->replay_evicted[ctx->replay_next];
 
-#define COPY_U8(crc, buf, v) do {               \
-    *(uint8_t *)buf = v;                        \
-    crc = crc_ccitt(buf, sizeof(uint8_t), crc); \
-    buf++;                                      \
-  } while(0)
+  if(old->used) {
+    unsigned int h = dup_hash(old->sender) % LORAMAC_REPLAY_TABLE;
+
+    if(old->floor > ctx->replay_floor[h])
+      ctx->replay_floor[h] = old->floor;
+  }
+
+  *old = (struct loramac_evicted){ .used   = 1,
+                                   .sender = victim->sender,
+                                   .floor  = victim->counter + 1 };
+  ctx->replay_next = (ctx->replay_next + 1) % LORAMAC_REPLAY_EVICTED;
+}
 
-static int send_ack(uint16_t src, uint8_t seqno)
+/* Return the floor of a sender that is not in the replay table,
+   its own when it is in the evicted ring or that of its slot. */
+static uint32_t replay_floor(struct loramac_ctx *ctx, uint16_t sender,
+                             struct loramac_evicted **evicted)
 {
-  unsigned char *buf = snd_pktbuf;
+  unsigned int i;
 
-  *(uint8_t  *)buf = LORAMAC_ACK_SIZE;    buf += sizeof(uint8_t);
-  *(uint16_t *)buf = mac_conf.htons(src); buf += sizeof(uint16_t);
-  *(uint8_t  *)buf = seqno;
+  for(i = 0 ; i < LORAMAC_REPLAY_EVICTED ; i++) {
+    struct loramac_evicted *e = &ctx->replay_evicted[i];
 
-  /* send packet */
-  return mac_conf.uart_send(snd_pktbuf, snd_pktbuf[0] + 1);
+    if(e->used && e->sender == sender) {
+      *evicted = e;
+      return e->floor;
+    }
+  }
+
+  *evicted = NULL;
+  return ctx->replay_floor[dup_hash(sender) % LORAMAC_REPLAY_TABLE];
 }
 
-static int loramac_send_helper(uint16_t dst, const void *payload, unsigned int payload_size)
+/* Lookup a sender in the replay table. If it was not found a new
+   entry is inserted for a counter at or above the floor of the
+   sender, evicting the least recently seen sender when the probed
+   slots are all used, and found is set to 0. Return NULL when the
+   counter is below the floor. */
+static struct loramac_replay * replay_lookup(struct loramac_ctx *ctx, uint16_t sender,
+                                             uint32_t counter, int *found)
 {
-  unsigned char *buf = snd_pktbuf + 1;
-  uint16_t crc = CRC_CCITT_INIT;
-  int ret;
+  unsigned long now = ctx->conf.clock(ctx->conf.data);
+  struct loramac_replay *victim = NULL;
+  struct loramac_evicted *evicted;
+  unsigned int h = dup_hash(sender) % LORAMAC_REPLAY_TABLE;
+  unsigned int i;
+
+  /* Entries are never removed, only replaced,
+     so a sender cannot be after an unused slot. */
+  for(i = 0 ; i < LORAMAC_REPLAY_PROBE ; i++) {
+    struct loramac_replay *e = &ctx->replay_table[(h + i) % LORAMAC_REPLAY_TABLE];
+
+    if(e->used && e->sender == sender) {
+      e->stamp = now;
+      *found = 1;
+      return e;
+    }
+    else if(!e->used) {
+      victim = e;
+      break;
+    }
+    else if(!victim || now - e->stamp > now - victim->stamp)
+      victim = e;
+  }
 
-  /* copy header */
-  COPY_U16(crc, buf, mac_conf.mac_address);
-  COPY_U16(crc, buf, dst);
-  COPY_U8(crc, buf, seqno);
+  /* an evicted sender only comes back above its last counter */
+  if(counter < replay_floor(ctx, sender, &evicted))
+    return NULL;
+
+  /* back in the table, which keeps its counter from now on */
+  if(evicted)
+    evicted->used = 0;
+  if(victim->used)
+    replay_evict(ctx, victim);
+
+  *victim = (struct loramac_replay){ .used    = 1,
+                                     .stamp   = now,
+                                     .sender  = sender,
+                                     .counter = counter };
+  *found  = 0;
+  return victim;
+}
 
-  /* copy payload */
-  if(payload_size > LORAMAC_MAX_PAYLOAD)
-    return LORAMAC_SND_TOOLONG;
-  memcpy(buf, payload, payload_size);
-  crc  = crc_ccitt(buf, payload_size, crc);
-  buf += payload_size;
+/* Check the counter of a sender whose message is authentic and
+   record it. Return false if it was already received. */
+static int replay_check(struct loramac_ctx *ctx, uint16_t sender, uint32_t counter)
+{
+  struct loramac_replay *e;
+  uint32_t back;
+  int32_t ahead;
+  int found;
+
+  e = replay_lookup(ctx, sender, counter, &found);
+  if(!e)
+    return 0;
+  else if(!found)
+    return 1;
+
+  /* a new last counter shifts the window */
+  ahead = (int32_t)(counter - e->counter);
+  if(ahead > 0) {
+    e->bitmap  = ahead < LORAMAC_REPLAY_WINDOW ? e->bitmap << ahead : 0;
+    if(ahead <= LORAMAC_REPLAY_WINDOW)
+      e->bitmap |= (uint32_t)1 << (ahead - 1);
+    e->counter = counter;
+    return 1;
+  }
+
+  /* an older counter is only accepted once within the window */
+  back = e->counter - counter;
+  if(!back || back > LORAMAC_REPLAY_WINDOW || e->bitmap & (uint32_t)1 << (back - 1))
+    return 0;
+  e->bitmap |= (uint32_t)1 << (back - 1);
+  return 1;
+}
+
+/* Check and decrypt a message to us into rcv_plainbuf.
+   Return LORAMAC_RCV_INVALID_MIC for a forged or replayed
+   message, which is then left untouched. */
+static int unseal(struct loramac_ctx *ctx, uint16_t src, uint16_t dst,
+                  const void **payload, unsigned int *payload_size)
+{
+  const unsigned char *b = *payload;
+  const struct aes_key *key = key_lookup(ctx, multicast(dst) ? dst : src);
+  uint8_t nonce[CCM_NONCE_SIZE];
+  uint32_t counter;
+
+  if(*payload_size < LORAMAC_SEC_SIZE || !key)
+    goto forged;
+
+  counter = (uint32_t)b[0] << 24 | (uint32_t)b[1] << 16 | (uint32_t)b[2] << 8 | b[3];
+  sec_nonce(nonce, src, dst, counter);
+  if(ccm_open(key, nonce, NULL, 0, b + LORAMAC_SEC_HDR_SIZE, *payload_size - LORAMAC_SEC_HDR_SIZE,
+              ctx->rcv_plainbuf, LORAMAC_MIC_SIZE) < 0)
+    goto forged;
+
+  if(!replay_check(ctx, src, counter)) {
+    ctx->counters.rx_replays++;
+    return LORAMAC_RCV_INVALID_MIC;
+  }
 
-  /* copy CRC */
-  *(uint16_t *)buf = mac_conf.htons(crc);
+  *payload       = ctx->rcv_plainbuf;
+  *payload_size -= LORAMAC_SEC_SIZE;
+  return LORAMAC_RCV_SUCCESS;
 
-  /* copy frame size */
-  snd_pktbuf[0] = LORAMAC_HDR_SIZE + payload_size;
+forged:
+  ctx->counters.rx_forged++;
+  return LORAMAC_RCV_INVALID_MIC;
+}
 
-  /* send packet */
-  ret = mac_conf.uart_send(snd_pktbuf, snd_pktbuf[0] + 1);
-  if(ret < 0)
+int loramac_send(struct loramac_ctx *ctx,
+                 uint16_t dst, const void *payload, unsigned int payload_size, unsigned int *tx)
+{
+  return loramac_send_opts(ctx, dst, payload, payload_size, NULL, tx);
+}
+
+int loramac_send_opts(struct loramac_ctx *ctx, uint16_t dst, const void *payload,
+                      unsigned int payload_size, const struct loramac_tx_opts *opts,
+                      unsigned int *tx)
+{
+  struct loramac_tx_opts o = tx_opts(ctx, opts);
+  unsigned char buf[LORAMAC_MAX_MESSAGE];
+  unsigned int max = FLAGS(ctx) & LORAMAC_FRAG ? sizeof(buf) : frame_payload(ctx);
+  int secure = FLAGS(ctx) & LORAMAC_SECURE;
+  int status;
+
+  if(FLAGS(ctx) & LORAMAC_COMPACT && cluster_id(ctx, dst) < 0)
+    return LORAMAC_SND_ADDRESS;
+
+  /* the compressed message is sealed in place after its header */
+  if(secure)
+    max -= LORAMAC_SEC_SIZE;
+
+  if(FLAGS(ctx) & LORAMAC_COMPRESS) {
+    payload_size = encode(ctx, buf + (secure ? LORAMAC_SEC_HDR_SIZE : 0), max, payload, payload_size);
+    if(!payload_size)
+      return LORAMAC_SND_TOOLONG;
+    payload = buf + (secure ? LORAMAC_SEC_HDR_SIZE : 0);
+  }
+
+  if(secure) {
+    if(payload_size > max)
+      return LORAMAC_SND_TOOLONG;
+    status = seal(ctx, dst, buf, payload, payload_size);
+    if(status)
+      return status;
+    payload       = buf;
+    payload_size += LORAMAC_SEC_SIZE;
+  }
+
+  if(FLAGS(ctx) & LORAMAC_FRAG)
+    return send_fragmented(ctx, dst, payload, payload_size, &o, tx);
+  return send_single(ctx, dst, payload, payload_size, &o, tx);
+}
+
+int loramac_send_window(struct loramac_ctx *ctx, uint16_t dst,
+                        const struct loramac_frame *frames, unsigned int count,
+                        unsigned int *tx)
+{
+  return loramac_send_window_opts(ctx, dst, frames, count, NULL, tx);
+}
+
+int loramac_send_window_opts(struct loramac_ctx *ctx, uint16_t dst,
+                             const struct loramac_frame *frames, unsigned int count,
+                             const struct loramac_tx_opts *opts, unsigned int *tx)
+{
+  struct loramac_tx_opts o = tx_opts(ctx, opts);
+  unsigned char bufs[LORAMAC_MAX_WINDOW][LORAMAC_MAX_CPAYLOAD];
+  unsigned char msg[LORAMAC_MAX_CPAYLOAD];
+  struct loramac_frame frags[LORAMAC_MAX_WINDOW];
+  unsigned int msg_max = FLAGS(ctx) & LORAMAC_FRAG ? ctx->frag_size : frame_payload(ctx);
+  unsigned char sealed[LORAMAC_MAX_CPAYLOAD];
+  unsigned int sec = FLAGS(ctx) & LORAMAC_SECURE ? LORAMAC_SEC_SIZE : 0;
+  const void *payload;
+  unsigned int i, size;
+  int status;
+
+  if(!(FLAGS(ctx) & (LORAMAC_FRAG | LORAMAC_COMPRESS | LORAMAC_SECURE)))
+    return send_window(ctx, dst, frames, count, &o, tx);
+
+  if(count > LORAMAC_MAX_WINDOW)
+    return LORAMAC_SND_WINDOW;
+
+  /* Each frame is a message of a single fragment. */
+  for(i = 0 ; i < count ; i++) {
+    payload = frames[i].payload;
+    size    = frames[i].size;
+
+    if(FLAGS(ctx) & LORAMAC_COMPRESS) {
+      size = encode(ctx, msg, msg_max - sec, payload, size);
+      if(!size)
+        return LORAMAC_SND_TOOLONG;
+      payload = msg;
+    }
+
+    if(size + sec > msg_max)
+      return LORAMAC_SND_TOOLONG;
+
+    if(sec) {
+      status = seal(ctx, dst, sealed, payload, size);
+      if(status)
+        return status;
+      payload = sealed;
+      size   += sec;
+    }
+
+    if(!(FLAGS(ctx) & LORAMAC_FRAG)) {
+      memcpy(bufs[i], payload, size);
+      frags[i] = (struct loramac_frame){ .payload = bufs[i], .size = size };
+      continue;
+    }
+
+    LOCK(ctx);
+    frags[i] = (struct loramac_frame){
+      .payload = bufs[i],
+      .size    = build_frag(ctx, bufs[i], ++ctx->frag_tag, 0, 0, payload, size)
+    };
+    UNLOCK(ctx);
+  }
+
+  return send_window(ctx, dst, frags, count, &o, tx);
+}
+
+int loramac_send_beacon(struct loramac_ctx *ctx, const struct loramac_schedule *schedule)
+{
+  unsigned char payload[sizeof(uint16_t) + sizeof(uint8_t) + LORAMAC_MAX_SLOTS * sizeof(uint16_t)];
+  unsigned char *buf = payload;
+  struct loramac_frame f;
+  struct loramac_tdma *tdma;
+  struct tx_frame frame;
+  unsigned int i, next;
+  int ret;
+
+  if(!(FLAGS(ctx) & LORAMAC_TDMA) || !schedule->count ||
+     schedule->count > LORAMAC_MAX_SLOTS || schedule->slot / 1000 > 0xffff)
+    return LORAMAC_SND_SLOT;
+
+  *(uint16_t *)buf = BO_HTONS(ctx->conf, schedule->slot / 1000); buf += sizeof(uint16_t);
+  *(uint8_t  *)buf = schedule->count;                            buf += sizeof(uint8_t);
+  for(i = 0 ; i < schedule->count ; i++) {
+    *(uint16_t *)buf = BO_HTONS(ctx->conf, schedule->owners[i]);
+    buf += sizeof(uint16_t);
+  }
+
+  f = (struct loramac_frame){ .payload = payload, .size = buf - payload };
+  ret = duty_wait(ctx, &f, 1);
+  if(ret != LORAMAC_SND_SUCCESS)
     return ret;
 
-  /* If we disabled ACK, we are done here.
-     Otherwise we need to wait and check
-     the last received ACK. */
-  if(mac_conf.flags & LORAMAC_NOACK)
-    return LORAMAC_SND_SUCCESS;
+  LOCK(ctx);
+  {
+    ret = build_frame(ctx, &frame, LORAMAC_BEACON_ADDR,
+                      ++peer_lookup(ctx, LORAMAC_BEACON_ADDR)->seqno, f.payload, f.size);
+    if(ret != LORAMAC_SND_SUCCESS)
+      goto UNLOCK;
+    if(!(FLAGS(ctx) & LORAMAC_NOACK))
+      frame.hdr[0] |= LORAMAC_SIZE_NOACK;
+
+    ret = write_frame(ctx, &frame);
+    if(ret != LORAMAC_SND_SUCCESS)
+      goto UNLOCK;
+    ctx->counters.tx_beacons++;
+
+    /* our own slots start once the last byte is on air */
+    next = !__atomic_load_n(&ctx->tdma_cur, __ATOMIC_ACQUIRE);
+    tdma = &ctx->tdma[next];
+    tdma->base     = ctx->conf.clock(ctx->conf.data) +
+                     duty_airtime(&ctx->conf.radio, (frame.hdr[0] & LORAMAC_MAX_FRAME) + 1);
+    tdma->schedule = *schedule;
+    tdma->schedule.slot -= tdma->schedule.slot % 1000;
+    __atomic_store_n(&ctx->tdma_cur, next, __ATOMIC_RELEASE);
+  }
+UNLOCK:
+  UNLOCK(ctx);
 
-  wait_ack = 1;
-  mac_conf.start_timer(mac_conf.timeout);
-  mac_conf.wait_timer();
+  return ret;
+}
 
-  if(last_ack_seqno != seqno)
-    return LORAMAC_SND_NOACK;
-  return LORAMAC_SND_SUCCESS;
+static int send_window(struct loramac_ctx *ctx,
+                       uint16_t dst, const struct loramac_frame *frames, unsigned int count,
+                       const struct loramac_tx_opts *opts, unsigned int *tx)
+{
+  return send_window_fec(ctx, dst, frames, count, 0, opts, tx);
 }
 
-int loramac_send(uint16_t dst, const void *payload, unsigned int payload_size, unsigned int *tx)
+/* Send a window of whole groups of fragments and their parity, for
+   group data fragments per parity fragment (0 without parity). */
+static int send_window_fec(struct loramac_ctx *ctx,
+                           uint16_t dst, const struct loramac_frame *frames, unsigned int count,
+                           unsigned int group, const struct loramac_tx_opts *opts, unsigned int *tx)
 {
+  struct tx_frame txframes[LORAMAC_MAX_WINDOW];
   int ret = LORAMAC_SND_NOACK;
-  unsigned int retransmission;
+  unsigned int retransmission = 0;
+  struct loramac_peer *peer;
+  unsigned long begin;
+  unsigned int i;
+  uint8_t pending;
+
+  if(count > LORAMAC_MAX_WINDOW)
+    return LORAMAC_SND_WINDOW;
+  else if(!count)
+    return LORAMAC_SND_SUCCESS;
 
-  /* We lock the packet buffer when sending a packet.
-     This will lock for the complete transmission
-     (including ACK and retransmissions). */
-  mac_conf.lock();
+  if(multicast(dst))
+    return send_broadcast(ctx, dst, frames, count, tx);
+
+  /* Without block ACKs we fallback on sending
+     each frame and waiting for its own ACK. */
+  if(!(FLAGS(ctx) & LORAMAC_WINDOW)) {
+    for(i = 0 ; i < count ; i++) {
+      ret = send_single(ctx, dst, frames[i].payload, frames[i].size, opts, tx);
+      if(ret != LORAMAC_SND_SUCCESS)
+        break;
+    }
+    return ret;
+  }
+
+  for(i = 0 ; i < count ; i++)
+    if(frames[i].size > frame_payload(ctx))
+      return LORAMAC_SND_TOOLONG;
+
+  ret = duty_wait(ctx, frames, count);
+  if(ret != LORAMAC_SND_SUCCESS) {
+    if(tx)
+      *tx = 0;
+    return ret;
+  }
+
+  LOCK(ctx);
   {
-    seqno++; /* Use same sequence number for retransmitted frames. */
+    peer = peer_lookup(ctx, dst);
+    adr_apply(ctx, peer);
 
-    for(retransmission = 0 ; retransmission < mac_conf.retrans ; retransmission++) {
-      ret = loramac_send_helper(dst, payload, payload_size);
+    ctx->win_dst     = dst;
+    ctx->win_first   = peer->seqno + 1;
+    ctx->win_pending = (1 << count) - 1;
+    peer->seqno     += count;
 
-      if(ret == LORAMAC_SND_SUCCESS) {
+    for(i = 0 ; i < count ; i++) {
+      build_frame(ctx, &txframes[i], dst, ctx->win_first + i, frames[i].payload, frames[i].size);
+      tx_noack(ctx, opts, &txframes[i]);
+    }
+
+    for(retransmission = 0 ; retransmission < opts->retrans ; retransmission++) {
+      if(retransmission) {
+        backoff_wait(ctx, retransmission);
+
+        /* the whole window was acknowledged while backing off */
+        if(!ctx->win_pending) {
+          ret = LORAMAC_SND_SUCCESS;
+          break;
+        }
+      }
+
+      /* Send all frames that were not acknowledged back to back.
+         We only wait once for the block ACK of the whole window. */
+      for(i = 0 ; i < count ; i++) {
+        if(!(ctx->win_pending & (1 << i)))
+          continue;
+
+        ret = send_frame(ctx, &txframes[i]);
+        if(ret != LORAMAC_SND_SUCCESS)
+          goto EXIT;
+      }
+
+      if(opts->flags & LORAMAC_TX_NOACK)
+        ctx->win_pending = 0;
+      else {
+        pending = ctx->win_pending;
+        begin   = ctx->conf.clock(ctx->conf.data);
+
+        ctx->wait_ack = 1;
+        ctx->conf.start_timer(ack_timeout(ctx, peer), ctx->conf.data);
+        ctx->conf.wait_timer(ctx->conf.data);
+        ctx->wait_ack = 0;
+
+        /* a partial block ACK still came back in time */
+        ack_update(ctx, peer, begin, ctx->win_pending != pending,
+                   retransmission == 0 && !ctx->win_pending);
+        loss_update(ctx, bit_count(ctx->win_pending & pending), bit_count(pending));
+
+        /* the receiver rebuilds the frames still missing */
+        if(group && fec_repairable(ctx->win_pending, count, group)) {
+          ctx->counters.tx_unrepaired += bit_count(ctx->win_pending);
+          ctx->win_pending = 0;
+        }
+      }
+
+      if(!ctx->win_pending) {
+        ret = LORAMAC_SND_SUCCESS;
         retransmission++; /* update for tx count */
         break;
       }
+
+      ret = LORAMAC_SND_NOACK;
     }
+
+    if(opts->flags & LORAMAC_TX_NOACK)
+      ;
+    else if(ret == LORAMAC_SND_SUCCESS)
+      count_attempts(ctx, retransmission);
+    else if(ret == LORAMAC_SND_NOACK)
+      ctx->counters.tx_noack++;
   }
-  mac_conf.unlock();
+EXIT:
+  UNLOCK(ctx);
 
   if(tx)
     *tx = retransmission;
@@ -229,171 +2026,587 @@ int loramac_send(uint16_t dst, const void *payload, unsigned int payload_size, u
   return ret;
 }
 
-#define READ_U16(status, buf, dst) do {         \
-    buf -= sizeof(uint16_t);                    \
-    if(buf <= rcv_pktbuf) {                     \
-      status = LORAMAC_RCV_INVALID_HDR;         \
-      goto PARSING_COMPLETED;                   \
-    }                                           \
-    else                                        \
-      dst = mac_conf.ntohs(*(uint16_t *)buf);   \
+#define READ_ADDR(status, buf, dst) do {                        \
+    buf -= ctx->addr_size;                                      \
+    if(buf <= ctx->rcv_pktbuf || !get_addr(ctx, buf, &dst)) {   \
+      status = LORAMAC_RCV_INVALID_HDR;                         \
+      goto PARSING_COMPLETED;                                   \
+    }                                                           \
   } while(0)
 
-#define READ_U8(status, buf, dst) do {           \
-    buf -= sizeof(uint8_t);                      \
-    if(buf <= rcv_pktbuf) {                      \
-      status = LORAMAC_RCV_INVALID_HDR;          \
-      goto PARSING_COMPLETED;                    \
-    }                                            \
-    else                                         \
-      dst = *(uint8_t *)buf;                     \
+#define READ_U8(status, buf, dst) do {  \
+    buf -= sizeof(uint8_t);             \
+    if(buf <= ctx->rcv_pktbuf) {        \
+      status = LORAMAC_RCV_INVALID_HDR; \
+      goto PARSING_COMPLETED;           \
+    }                                   \
+    else                                \
+      dst = *(uint8_t *)buf;            \
   } while(0)
 
-static int recv_ack(void)
+static void ack_received(struct loramac_ctx *ctx, uint8_t seqno)
 {
-  unsigned char *buf = rcv_pktbuf + LORAMAC_ACK_SIZE + 1;
+  if(ctx->wait_ack) {
+    ctx->last_ack_seqno = seqno;
+    ctx->wait_ack = 0;
+    ctx->conf.stop_timer(ctx->conf.data);
+  }
+}
+
+static int recv_ack(struct loramac_ctx *ctx)
+{
+  unsigned char *buf = ctx->rcv_pktbuf + ctx->ack_size + 1;
   uint8_t seqno;
   uint16_t src_mac;
   int status = LORAMAC_RCV_SUCCESS;
 
   /* parse ACK header */
   READ_U8(status, buf, seqno);
-  READ_U16(status, buf, src_mac);
+  READ_ADDR(status, buf, src_mac);
+
+PARSING_COMPLETED:
+  if(status != LORAMAC_RCV_SUCCESS)
+    /* the size is already fixed when we parse
+       ACK, only a node ID may be unknown */
+    return status;
+
+  PROBE(loramac, recv_ack, src_mac, seqno, ctx->wait_ack, ctx->rcv_stamp);
+
+  if(src_mac == ctx->conf.mac_address)
+    ack_received(ctx, seqno);
+
+  return status;
+}
+
+/* Check if a sequence number is covered by a block ACK. */
+static int block_acked(uint8_t seqno, uint8_t base, uint8_t bitmap)
+{
+  uint8_t d = seqno - base;
+
+  /* cumulative */
+  if((uint8_t)(base - seqno) < 0x80)
+    return 1;
+
+  /* selective */
+  return d <= LORAMAC_MAX_WINDOW && (bitmap & (1 << (d - 1)));
+}
+
+static int recv_block_ack(struct loramac_ctx *ctx)
+{
+  unsigned char *buf = ctx->rcv_pktbuf + ctx->back_size + 1;
+  uint16_t dst_mac;
+  uint16_t src_mac;
+  uint8_t base;
+  uint8_t bitmap;
+  int status = LORAMAC_RCV_SUCCESS;
+  int i;
+
+  /* parse block ACK header */
+  READ_U8(status, buf, bitmap);
+  READ_U8(status, buf, base);
+  READ_ADDR(status, buf, src_mac);
+  READ_ADDR(status, buf, dst_mac);
 
 PARSING_COMPLETED:
   if(status != LORAMAC_RCV_SUCCESS)
-    /* should not happen because the size
-       is already fixed when we parse ACK. */
+    /* same as ACK, the size is already fixed */
     return status;
 
-  if(wait_ack && \
-     src_mac == mac_conf.mac_address) {
-    last_ack_seqno = seqno;
-    wait_ack = 0;
-    mac_conf.stop_timer();
+  if(ctx->wait_ack && \
+     dst_mac == ctx->conf.mac_address && \
+     src_mac == ctx->win_dst) {
+    for(i = 0 ; i < LORAMAC_MAX_WINDOW ; i++)
+      if(block_acked(ctx->win_first + i, base, bitmap))
+        ctx->win_pending &= ~(1 << i);
+
+    if(!ctx->win_pending) {
+      ctx->wait_ack = 0;
+      ctx->conf.stop_timer(ctx->conf.data);
+    }
   }
 
   return status;
 }
 
-static int recv_data(unsigned int size)
+/* Update the receive window of a sender.
+   Returns 1 if the frame is a duplicate. */
+static int rx_window_update(struct loramac_ctx *ctx,
+                            uint16_t src, uint8_t seqno, uint8_t *base, uint8_t *bitmap)
+{
+  int found;
+  struct loramac_dup *peer = dup_lookup(ctx, src, &found);
+  uint8_t d = seqno - peer->seqno;
+  int duplicate = 0;
+
+  if(!found || \
+     (d >= 0x80 && (uint8_t)(peer->seqno - seqno) >= LORAMAC_MAX_WINDOW)) {
+    /* New sender or sequence restarted. We set the base to
+       a window behind so that we do not acknowledge the
+       frames sent right before this one in the same window. */
+    peer->seqno  = seqno - LORAMAC_MAX_WINDOW;
+    peer->bitmap = 0;
+    d = LORAMAC_MAX_WINDOW;
+  }
+  else if(d == 0 || d >= 0x80) {
+    /* already acknowledged (retransmission) */
+    duplicate = 1;
+    goto EXIT;
+  }
+  else if(d > LORAMAC_MAX_WINDOW) {
+    /* The sender moved past the window so it gave up
+       on the frames that we are still missing. */
+    unsigned int shift = d - LORAMAC_MAX_WINDOW;
+
+    peer->seqno  += shift;
+    peer->bitmap = shift < 8 ? peer->bitmap >> shift : 0;
+    d = LORAMAC_MAX_WINDOW;
+  }
+
+  if(peer->bitmap & (1 << (d - 1)))
+    duplicate = 1;
+  peer->bitmap |= 1 << (d - 1);
+
+  /* slide the window over frames received in order */
+  while(peer->bitmap & 1) {
+    peer->seqno++;
+    peer->bitmap >>= 1;
+  }
+
+EXIT:
+  *base   = peer->seqno;
+  *bitmap = peer->bitmap;
+
+  return duplicate;
+}
+
+/* Check if a broadcast is a copy of the last one from its sender
+   (see bcast_repeat) and remember it otherwise. */
+static int bcast_duplicate(struct loramac_ctx *ctx, uint16_t sender, uint8_t seqno)
+{
+  struct loramac_bcast *e = &ctx->bcast_table[sender % LORAMAC_MAX_PEERS];
+  unsigned long now = ctx->conf.clock(ctx->conf.data);
+
+  if(e->used && e->sender == sender && e->seqno == seqno &&
+     now - e->stamp < ctx->dup_expiry)
+    return 1;
+
+  *e = (struct loramac_bcast){ .used   = 1,
+                               .stamp  = now,
+                               .sender = sender,
+                               .seqno  = seqno };
+  return 0;
+}
+
+/* Check the CRC of the data frame at the start of the receive buffer. */
+static int rcv_crc_valid(struct loramac_ctx *ctx, unsigned int size)
 {
-  unsigned char *buf = rcv_pktbuf + size + 1;
-  uint16_t expected_crc = CRC_CCITT_INIT;
   uint16_t frame_crc;
-  uint16_t dst_mac = 0x0000; /* invalid address */
-  uint16_t src_mac = 0x0000; /* invalid address */
+
+  memcpy(&frame_crc, ctx->rcv_pktbuf + size - 1, sizeof(uint16_t));
+
+  return BO_NTOHS(ctx->conf, frame_crc) == crc_ccitt(ctx->rcv_pktbuf + 1, size - 2, CRC_CCITT_INIT);
+}
+
+/* Data frame going through the receive filters.
+   The header is only parsed when the frame is long enough. */
+struct rx_data {
+  unsigned int size;
+  uint16_t dst_mac;
+  uint16_t src_mac;
   uint8_t  seqno;
-  int status = LORAMAC_RCV_SUCCESS;
-  int i;
+  uint8_t  ext[LORAMAC_EXT_SIZE]; /* (see LORAMAC_PIGGYBACK) */
+  int      noack;   /* sent without ACK (see LORAMAC_SIZE_NOACK) */
+  int      unknown; /* node ID outside of the cluster (see LORAMAC_COMPACT) */
+  int      status;  /* status so far, the flags may let some errors through */
+};
 
-  /* for CRC we skip the size (first byte) and frame CRC (last two bytes) */
-  expected_crc = crc_ccitt(rcv_pktbuf + 1, size - 2, expected_crc);
+/* Returned by the duplicate filter which drops
+   the frame without any error. */
+#define RX_DUPLICATE -1
 
-  /* parse CRC */
-  READ_U16(status, buf, frame_crc);
-  if(frame_crc != expected_crc) {
-    status = LORAMAC_RCV_INVALID_CRC;
-    goto PARSING_COMPLETED;
+static int filter_length(struct loramac_ctx *ctx, struct rx_data *rx)
+{
+  if(rx->size < ctx->hdr_size || rx->unknown)
+    return LORAMAC_RCV_INVALID_HDR;
+  return LORAMAC_RCV_SUCCESS;
+}
+
+static int filter_destination(struct loramac_ctx *ctx, struct rx_data *rx)
+{
+  if(rx->size < ctx->hdr_size || rx->unknown)
+    return LORAMAC_RCV_SUCCESS; /* left to the length filter */
+
+  if(rx->dst_mac == 0xffff)
+    return FLAGS(ctx) & LORAMAC_NOBROADCAST ? LORAMAC_RCV_BROADCAST : LORAMAC_RCV_SUCCESS;
+  if(LORAMAC_GROUP(rx->dst_mac)) {
+    uint8_t id = rx->dst_mac & 0xff;
+    return ctx->conf.groups[id >> 3] & 1 << (id & 7) ? LORAMAC_RCV_SUCCESS : LORAMAC_RCV_DESTINATION;
   }
+  if(rx->dst_mac != ctx->conf.mac_address)
+    return LORAMAC_RCV_DESTINATION;
+  return LORAMAC_RCV_SUCCESS;
+}
 
-  /* parse header [src_mac][dst_mac][seqno] */
-  buf = rcv_pktbuf + sizeof(uint16_t) * 2 + sizeof(uint8_t) + 1;
-  READ_U8(status, buf, seqno);
-  READ_U16(status, buf, dst_mac);
-  READ_U16(status, buf, src_mac);
+static int filter_crc(struct loramac_ctx *ctx, struct rx_data *rx)
+{
+  if(rx->size < sizeof(uint16_t))
+    return LORAMAC_RCV_INVALID_HDR;
+
+  /* unless the framer already checked it, the framer
+     then knows whether the frame boundary was right */
+  if(ctx->rcv_crc < 0)
+    ctx->rcv_crc = rcv_crc_valid(ctx, rx->size);
+  return ctx->rcv_crc ? LORAMAC_RCV_SUCCESS : LORAMAC_RCV_INVALID_CRC;
+}
+
+/* Acknowledge the frame and drop retransmissions. Frames let
+   through by the flags are neither acknowledged nor checked. */
+static int filter_duplicate(struct loramac_ctx *ctx, struct rx_data *rx)
+{
+  struct loramac_dup *peer;
+  uint8_t base;
+  uint8_t bitmap;
+  int i;
+
+  if(rx->status != LORAMAC_RCV_SUCCESS)
+    return LORAMAC_RCV_SUCCESS;
+
+  /* broadcasts and groups are never acknowledged, only their copies dropped */
+  if(multicast(rx->dst_mac))
+    return bcast_duplicate(ctx, rx->src_mac, rx->seqno) ? RX_DUPLICATE : LORAMAC_RCV_SUCCESS;
+
+  /* a frame sent without ACK is never retransmitted either */
+  if(FLAGS(ctx) & LORAMAC_NOACK || rx->noack)
+    return LORAMAC_RCV_SUCCESS;
+
+  /* send block ACK when enabled */
+  if(FLAGS(ctx) & LORAMAC_WINDOW) {
+    i = rx_window_update(ctx, rx->src_mac, rx->seqno, &base, &bitmap);
+
+    /* Block ACKs are cumulative, so the sender only
+       needs the last one even when the previous ones
+       were lost while it was sending the window. */
+    queue_ack(ctx, LORAMAC_BACK_SIZE, rx->src_mac, base, bitmap);
 
-  if(dst_mac != mac_conf.mac_address && \
-     dst_mac != 0xffff) {
-    /* wrong destination */
-    status = LORAMAC_RCV_DESTINATION;
-    goto PARSING_COMPLETED;
+    return i ? RX_DUPLICATE : LORAMAC_RCV_SUCCESS;
   }
 
-PARSING_COMPLETED:
-  /* based on parsing status and iface_flags
-     we either return directly or pass the
-     frame to the upper layer */
+  /* send ACK and check for retransmissions */
+  queue_ack(ctx, LORAMAC_ACK_SIZE, rx->src_mac, rx->seqno, 0);
+
+  peer = dup_lookup(ctx, rx->src_mac, &i);
+  if(i && rx->seqno == peer->seqno)
+    return RX_DUPLICATE;
+
+  peer->seqno = rx->seqno;
+  return LORAMAC_RCV_SUCCESS;
+}
+
+static int (* const rx_filters[LORAMAC_FILTERS])(struct loramac_ctx *ctx, struct rx_data *rx) = {
+  [LORAMAC_FILTER_LENGTH]      = filter_length,
+  [LORAMAC_FILTER_DESTINATION] = filter_destination,
+  [LORAMAC_FILTER_CRC]         = filter_crc,
+  [LORAMAC_FILTER_DUPLICATE]   = filter_duplicate
+};
+
+/* Whether the flags let a frame through the filters with this
+   status. As the destination of an invalid frame cannot be
+   trusted such frames also need promiscuous mode. */
+static int rx_pass(const struct loramac_ctx *ctx, int status)
+{
   switch(status) {
   case LORAMAC_RCV_INVALID_CRC:
   case LORAMAC_RCV_INVALID_HDR:
-    if(!(mac_conf.flags & LORAMAC_INVALID))
-      return status;
+    if(!(FLAGS(ctx) & LORAMAC_INVALID))
+      return 0;
   case LORAMAC_RCV_DESTINATION:
-    if(!(mac_conf.flags & LORAMAC_PROMISCUOUS))
-      return status;
-  case LORAMAC_RCV_BROADCAST:
-    if(mac_conf.flags & LORAMAC_NOBROADCAST)
-      return LORAMAC_RCV_BROADCAST;
+    return FLAGS(ctx) & LORAMAC_PROMISCUOUS;
+  default:
+    return 0;
   }
+}
 
-  /* send ACK when enabled */
-  if(!(mac_conf.flags & LORAMAC_NOACK) && \
-     status == LORAMAC_RCV_SUCCESS) {
-    /* We have to wait before sending the ACK,
-       otherwise the message is not sent correctly.
-       Note that we don't use usleep and that the
-       SIFS time can be quite large (>500ms). */
-    mac_conf.lock();
-    {
-      mac_conf.start_timer(mac_conf.sifs);
-      mac_conf.wait_timer();
-      send_ack(src_mac, seqno);
+/* Follow the schedule of a beacon from its last byte (see LORAMAC_TDMA),
+   a beacon is neither acknowledged nor passed to the upper layer. */
+static int recv_beacon(struct loramac_ctx *ctx, const unsigned char *payload, unsigned int size)
+{
+  struct loramac_tdma *tdma;
+  unsigned int i, next;
+
+  ctx->counters.rx_frames++;
+  if(size < sizeof(uint16_t) + sizeof(uint8_t) ||
+     !payload[2] || payload[2] > LORAMAC_MAX_SLOTS ||
+     size != sizeof(uint16_t) + sizeof(uint8_t) + payload[2] * sizeof(uint16_t)) {
+    ctx->counters.rx_invalid++;
+    return LORAMAC_RCV_INVALID_HDR;
+  }
+  ctx->counters.rx_beacons++;
+
+  next = !__atomic_load_n(&ctx->tdma_cur, __ATOMIC_ACQUIRE);
+  tdma = &ctx->tdma[next];
+  tdma->base           = ctx->rcv_stamp;
+  tdma->schedule.slot  = BO_NTOHS(ctx->conf, *(const uint16_t *)payload) * 1000;
+  tdma->schedule.count = payload[2];
+  for(i = 0 ; i < tdma->schedule.count ; i++)
+    tdma->schedule.owners[i] = BO_NTOHS(ctx->conf, *(const uint16_t *)(payload + 3 + 2 * i));
+  __atomic_store_n(&ctx->tdma_cur, next, __ATOMIC_RELEASE);
+
+  PROBE(loramac, recv_beacon, tdma->schedule.slot, tdma->schedule.count, ctx->rcv_stamp);
+  return LORAMAC_RCV_SUCCESS;
+}
+
+static int recv_data(struct loramac_ctx *ctx, unsigned int size)
+{
+  /* header [src_mac][dst_mac][seqno][ext] after the size byte */
+  const unsigned char *hdr = ctx->rcv_pktbuf + 1;
+  struct rx_data rx = { .size   = size,
+                        .noack  = ctx->rcv_pktbuf[0] & LORAMAC_SIZE_NOACK,
+                        .status = LORAMAC_RCV_SUCCESS };
+  int piggyback = FLAGS(ctx) & LORAMAC_PIGGYBACK;
+  enum loramac_filter filter;
+  const void *payload;
+  unsigned int payload_size;
+  int status = LORAMAC_RCV_SUCCESS;
+  int dropped = 0;
+  int i;
+
+  if(size >= ctx->hdr_size) {
+    rx.unknown = !get_addr(ctx, hdr, &rx.src_mac) ||
+                 !get_addr(ctx, hdr + ctx->addr_size, &rx.dst_mac);
+    rx.seqno   = hdr[ctx->addr_size * 2];
+    if(piggyback)
+      memcpy(rx.ext, hdr + ctx->addr_size * 2 + sizeof(uint8_t), LORAMAC_EXT_SIZE);
+  }
+
+  if(FLAGS(ctx) & LORAMAC_TDMA && size >= ctx->hdr_size && !rx.unknown &&
+     rx.dst_mac == LORAMAC_BEACON_ADDR && filter_crc(ctx, &rx) == LORAMAC_RCV_SUCCESS)
+    return recv_beacon(ctx, hdr + ctx->hdr_size - sizeof(uint16_t), size - ctx->hdr_size);
+
+  /* Apply the filters in order until one drops the frame. A frame
+     let through with an invalid header or CRC skips the next filters. */
+  for(i = 0 ; i < LORAMAC_FILTERS ; i++) {
+    filter = ctx->filters[i];
+    status = rx_filters[filter](ctx, &rx);
+
+    if(status == LORAMAC_RCV_SUCCESS)
+      continue;
+
+    if(status == RX_DUPLICATE || !rx_pass(ctx, status)) {
+      ctx->counters.rx_drops[filter]++;
+      dropped = 1;
+      break;
     }
-    mac_conf.unlock();
-
-    /* check for retransmissions */
-    i = ack_fifo_search(src_mac);
-    if(i < 0)
-      ack_fifo_insert(src_mac, seqno);
-    else if(seqno == ack_fifo[i].seqno)
-      /* skip retransmission */
-      goto EXIT;
-    else
-      /* update seqno */
-      ack_fifo[i].seqno = seqno;
+
+    rx.status = status;
+    if(status != LORAMAC_RCV_DESTINATION)
+      break;
   }
 
-  /* send frame to upper layer */
-  mac_conf.cb_recv(src_mac, dst_mac,
-                   rcv_pktbuf + sizeof(uint16_t) * 2 + sizeof(uint8_t) + 1,
-                   size - LORAMAC_HDR_SIZE,
-                   status, mac_conf.data);
+  if(status == RX_DUPLICATE) {
+    ctx->counters.rx_dups++;
+    status = LORAMAC_RCV_SUCCESS;
+  }
+  else if(!dropped)
+    status = rx.status;
+
+  /* The receiver of an overheard frame acknowledges after
+     SIFS. Corrupted frames are likely collisions. */
+  if(status == LORAMAC_RCV_DESTINATION && !(FLAGS(ctx) & LORAMAC_NOACK) && !rx.noack)
+    nav_update(ctx, ctx->conf.sifs + ctx->conf.lbt_slot);
+  else if(status == LORAMAC_RCV_INVALID_CRC || status == LORAMAC_RCV_INVALID_HDR)
+    nav_update(ctx, ctx->conf.lbt_slot);
+
+  if(status == LORAMAC_RCV_INVALID_CRC)
+    ctx->counters.rx_crc++;
+  else if(status == LORAMAC_RCV_INVALID_HDR)
+    ctx->counters.rx_invalid++;
+  else
+    ctx->counters.rx_frames++;
+
+  PROBE(loramac, recv_data, rx.src_mac, rx.dst_mac, rx.seqno, status, dropped, ctx->rcv_stamp);
+
+  /* The ACK carried by a valid frame to us, even a retransmission.
+     It only counts for the frame we sent to this node, the seqno
+     spaces of the other destinations are unrelated. */
+  if(piggyback && status == LORAMAC_RCV_SUCCESS && rx.ext[0] & LORAMAC_EXT_ACK &&
+     rx.dst_mac == ctx->conf.mac_address) {
+    ctx->counters.rx_piggyback++;
+    PROBE(loramac, recv_ack, rx.src_mac, rx.ext[1], ctx->wait_ack, ctx->rcv_stamp);
+    if(rx.src_mac == ctx->ack_src)
+      ack_received(ctx, rx.ext[1]);
+  }
 
-EXIT:
+  if(dropped)
+    return status;
+
+  payload      = hdr + ctx->hdr_size - sizeof(uint16_t);
+  payload_size = size >= ctx->hdr_size ? size - ctx->hdr_size : 0;
+
+  /* Reassemble fragments, the upper layer only receives a message
+     once it is complete. In promiscuous mode we also reassemble
+     the messages to other destinations. */
+  if((FLAGS(ctx) & LORAMAC_FRAG) &&
+     (status == LORAMAC_RCV_SUCCESS || status == LORAMAC_RCV_DESTINATION)) {
+    int frag_status = frag_input(&ctx->frag_pool, rx.src_mac, payload, payload_size,
+                                 ctx->conf.clock(ctx->conf.data), &payload, &payload_size);
+
+    ctx->counters.rx_recovered = ctx->frag_pool.recovered;
+    switch(frag_status) {
+    case FRAG_PENDING:
+      return status;
+    case FRAG_INVALID:
+      status = LORAMAC_RCV_INVALID_HDR;
+      if(!(FLAGS(ctx) & LORAMAC_INVALID))
+        return status;
+    }
+  }
+
+  /* Then check and decrypt complete messages to us, those to
+     other destinations are passed as they are (promiscuous). */
+  if((FLAGS(ctx) & LORAMAC_SECURE) && status == LORAMAC_RCV_SUCCESS) {
+    status = unseal(ctx, rx.src_mac, rx.dst_mac, &payload, &payload_size);
+    if(status != LORAMAC_RCV_SUCCESS && !(FLAGS(ctx) & LORAMAC_INVALID))
+      return status;
+  }
+
+  /* Then decompress complete messages. */
+  if((FLAGS(ctx) & LORAMAC_COMPRESS) &&
+     (status == LORAMAC_RCV_SUCCESS ||
+      (status == LORAMAC_RCV_DESTINATION && !(FLAGS(ctx) & LORAMAC_SECURE))) &&
+     !decode(ctx, &payload, &payload_size)) {
+    status = LORAMAC_RCV_INVALID_HDR;
+    if(!(FLAGS(ctx) & LORAMAC_INVALID))
+      return status;
+  }
+
+  /* send frame to upper layer */
+  ctx->conf.cb_recv(rx.src_mac, rx.dst_mac, payload, payload_size,
+                   status, ctx->conf.data);
   return status;
 }
 
-int loramac_recv_frame(void)
+int loramac_recv_frame(struct loramac_ctx *ctx)
 {
-  int size = rcv_pktbuf[0];
+  int size = ctx->rcv_pktbuf[0];
 
-  if(size == LORAMAC_ACK_SIZE)
-    return recv_ack();
+  if(size == ctx->ack_size)
+    return recv_ack(ctx);
+  else if(size == ctx->back_size)
+    return recv_block_ack(ctx);
   else
-    return recv_data(size);
+    return recv_data(ctx, size & ~LORAMAC_SIZE_NOACK);
+}
+
+/* Check that a size byte may start a frame. The ACKs are never
+   flagged with LORAMAC_SIZE_NOACK. */
+static int rcv_size_valid(const struct loramac_ctx *ctx, unsigned int size)
+{
+  unsigned int data = size & ~LORAMAC_SIZE_NOACK;
+
+  return size == ctx->ack_size || size == ctx->back_size || \
+         (data >= ctx->hdr_size && data <= LORAMAC_MAX_FRAME);
+}
+
+/* Drop bytes from the start of the receive buffer. */
+static void rcv_drop(struct loramac_ctx *ctx, unsigned int n)
+{
+  ctx->rcv_len -= n;
+  memmove(ctx->rcv_pktbuf, ctx->rcv_pktbuf + n, ctx->rcv_len);
+}
+
+/* Lose the frame boundary, we count each resynchronization only once. */
+static void rcv_lost_sync(struct loramac_ctx *ctx)
+{
+  if(!ctx->rcv_resync)
+    ctx->counters.rx_resync++;
+  ctx->rcv_resync = 1;
+}
+
+/* Process the complete frames in the receive buffer. */
+static int rcv_scan(struct loramac_ctx *ctx, int status)
+{
+  while(ctx->rcv_len) {
+    unsigned int size = ctx->rcv_pktbuf[0];
+    int ack = size == ctx->ack_size || size == ctx->back_size;
+
+    if(!rcv_size_valid(ctx, size) || (ack && ctx->rcv_resync)) {
+      rcv_lost_sync(ctx);
+      rcv_drop(ctx, 1);
+      continue;
+    }
+    size &= ~LORAMAC_SIZE_NOACK;
+
+    if(ctx->rcv_len < size + 1)
+      break; /* need more data */
+
+    /* Out of sync the next frame may start anywhere, we
+       only trust a size byte followed by a valid CRC. */
+    if(!ack && ctx->rcv_resync && !rcv_crc_valid(ctx, size)) {
+      rcv_drop(ctx, 1);
+      continue;
+    }
+
+    /* In sync the data path checks the CRC after the cheaper
+       filters, a frame they drop is assumed to be in sync
+       (an invalid next size byte tells otherwise). */
+    ctx->rcv_crc = ctx->rcv_resync ? 1 : -1;
+    status = ctx->conf.recv_frame(ctx);
+
+    if(!ack && !ctx->rcv_crc) {
+      /* Either the frame is corrupted or we are out of sync.
+         In the former case the data path accounted for it
+         (and delivered it with LORAMAC_INVALID). In both cases
+         the next frame may start anywhere within this one. */
+      ctx->rcv_crc = -1;
+      rcv_lost_sync(ctx);
+      rcv_drop(ctx, 1);
+      continue;
+    }
+
+    ctx->rcv_resync = 0;
+    ctx->rcv_crc    = -1;
+    rcv_drop(ctx, size + 1);
+  }
+
+  return status;
 }
 
-int loramac_uart_putc(unsigned char c)
+int loramac_uart_feed(struct loramac_ctx *ctx, const unsigned char *buf, unsigned int size)
 {
-  static unsigned char *rcv_ptr = rcv_pktbuf;
-  static uint8_t size;
   int status = LORAMAC_RCV_CONT; /* need more data */
 
-  if(rcv_ptr == rcv_pktbuf)
-    /* first byte (size) */
-    size = c + 1;
+  /* Drop the partial frame after a silence on the line.
+     The next byte is a size byte (unless it came too late). */
+  if(ctx->conf.gap) {
+    unsigned long now = ctx->conf.clock(ctx->conf.data);
+
+    if(ctx->rcv_len && now - ctx->rcv_stamp > ctx->conf.gap) {
+      rcv_lost_sync(ctx);
+      ctx->rcv_len = 0;
+    }
+    if(!ctx->rcv_len)
+      ctx->rcv_resync = 0;
+    ctx->rcv_stamp = now;
+  }
+
+  while(size) {
+    unsigned int n = sizeof(ctx->rcv_pktbuf) - ctx->rcv_len;
 
-  *rcv_ptr++ = c;
-  size--;
+    if(n > size)
+      n = size;
 
-  if(size == 0) {
-    /* full frame received */
-    status = mac_conf.recv_frame();
+    memcpy(ctx->rcv_pktbuf + ctx->rcv_len, buf, n);
+    ctx->rcv_len += n;
+    buf  += n;
+    size -= n;
 
-    /* reset pktbuf */
-    rcv_ptr = rcv_pktbuf;
+    status = rcv_scan(ctx, status);
   }
 
   return status;
 }
+
+int loramac_uart_putc(struct loramac_ctx *ctx, unsigned char c)
+{
+  return loramac_uart_feed(ctx, &c, 1);
+}
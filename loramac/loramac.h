@@ -31,8 +31,15 @@
 
 #include <stdint.h>
 
-#define LORAMAC_MAJOR       3
-#define LORAMAC_MINOR       7
+#include "frag.h"
+#include "duty.h"
+#include "rto.h"
+#include "adr.h"
+#include "crc-ccitt.h"
+#include "ccm.h"
+
+#define LORAMAC_MAJOR       5
+#define LORAMAC_MINOR       4
 
 /* We limit the frame size to 63 bytes. After reading the code
    on the LoRaMAC module, a larger frame would result in a buffer
@@ -40,13 +47,98 @@
 #define LORAMAC_MAX_FRAME   0x3f
 #define LORAMAC_HDR_SIZE    (sizeof(uint16_t) * 3 + sizeof(uint8_t)) /* src, dst, crc, seqno */
 #define LORAMAC_ACK_SIZE    (sizeof(uint16_t) + sizeof(uint8_t))     /* src, seqno */
+#define LORAMAC_BACK_SIZE   (sizeof(uint16_t) * 2 + sizeof(uint8_t) * 2) /* dst, src, seqno, bitmap */
 #define LORAMAC_MAX_PAYLOAD LORAMAC_MAX_FRAME - LORAMAC_HDR_SIZE
 
-/* Maximum size for the receiver ACK FIFO.
-   We use the ACK FIFO to filter duplicated retransmissions.
-   This is the number of different senders that can
-   send a frame to the receiver during one timeout. */
-#define LORAMAC_MAX_ACK_FIFO 32
+/* Flag of the size byte of a data frame sent without ACK (see
+   loramac_tx_opts). The receiver neither acknowledges it nor
+   checks it for a retransmission. The frame is not flagged
+   when LORAMAC_NOACK is set, so readers of the previous frame
+   format only miss the frames sent without ACK by exception. */
+#define LORAMAC_SIZE_NOACK  0x80
+
+/* Header extension of the data frames with LORAMAC_PIGGYBACK.
+   It follows the seqno and carries an ACK when the flag is set.
+   The payload of each frame is that much smaller. */
+#define LORAMAC_EXT_SIZE    (sizeof(uint8_t) * 2) /* flags, ACK seqno */
+#define LORAMAC_EXT_ACK     0x1
+
+/* Frames with LORAMAC_COMPACT where node IDs replace the addresses.
+   A cluster has at most LORAMAC_MAX_CLUSTER nodes since the last ID
+   is the broadcast. The sizes still tell the frame types apart. */
+#define LORAMAC_CHDR_SIZE   (sizeof(uint8_t) * 3 + sizeof(uint16_t)) /* src, dst, seqno, crc */
+#define LORAMAC_CACK_SIZE   (sizeof(uint8_t) * 2)                    /* src, seqno */
+#define LORAMAC_CBACK_SIZE  (sizeof(uint8_t) * 4)                    /* dst, src, seqno, bitmap */
+#define LORAMAC_MAX_CLUSTER 0xff
+#define LORAMAC_MIN_FRAME   LORAMAC_CACK_SIZE
+
+/* Slotted access (see LORAMAC_TDMA). The gateway broadcasts a beacon
+   with the schedule of a superframe: the length of the slots and the
+   node that owns each of them. A schedule is followed for at most
+   LORAMAC_TDMA_LIFETIME superframes after its beacon, nodes then go
+   back to random access until the next beacon. */
+#define LORAMAC_BEACON_ADDR   0xfffe
+#define LORAMAC_MAX_SLOTS     24
+#define LORAMAC_TDMA_LIFETIME 4
+
+/* Multicast groups. The addresses LORAMAC_GROUP_BASE to 0xfeff are
+   groups, the low byte being the ID of the group. A node receives the
+   frames of the groups set in its membership bitmap (see groups in
+   loramac_config) and drops the others like frames to another node.
+   Group frames are sent like broadcasts: they are never acknowledged,
+   are repeated bcast_repeat times and share the sequence numbers of
+   the broadcasts of the sender. They cannot be sent with compact
+   headers, which have no room for them. */
+#define LORAMAC_GROUP_BASE    0xfe00
+#define LORAMAC_MAX_GROUPS    256
+#define LORAMAC_GROUP(addr)   (((addr) & 0xff00) == LORAMAC_GROUP_BASE)
+
+/* Largest payload of a frame with any header, for buffers. The
+   payload of an instance is given by loramac_max_payload(). */
+#define LORAMAC_MAX_CPAYLOAD (LORAMAC_MAX_FRAME - LORAMAC_CHDR_SIZE)
+
+/* Largest message sent with fragmentation (see LORAMAC_FRAG). */
+#define LORAMAC_MAX_MESSAGE FRAG_MAX_SIZE
+
+/* Size of the receiver duplicate table (power of two).
+   We use this table to filter duplicated retransmissions.
+   This is the number of different senders that can send
+   a frame to the receiver before their entry expires. The
+   probe length bounds the cost of each lookup. */
+#define LORAMAC_DUP_TABLE 512
+#define LORAMAC_DUP_PROBE 8
+
+/* Maximum number of ACKs waiting for SIFS.
+   This is the number of different senders that
+   we can acknowledge within one SIFS period. */
+#define LORAMAC_MAX_PENDING_ACK 16
+
+/* Maximum number of frames in flight to the same
+   destination with the sliding window (see LORAMAC_WINDOW).
+   This is limited by the size of the block ACK bitmap. */
+#define LORAMAC_MAX_WINDOW 8
+
+/* Number of destinations for which we keep a sequence space.
+   Peers are hashed on their address, a collision
+   restarts the sequence space of the evicted peer. */
+#define LORAMAC_MAX_PEERS 16
+
+/* Keys and replay protection (see LORAMAC_SECURE). The replay
+   table is hashed on the sender address with linear probing over
+   at most LORAMAC_REPLAY_PROBE slots. When they are all used the
+   least recently seen sender is evicted and its last counter is
+   kept as its floor, below which it is refused when it comes back,
+   for the last LORAMAC_REPLAY_EVICTED evicted senders. Older ones
+   leave their floor to the slot they hash on, so a new sender is
+   only refused below a floor once that many senders were evicted
+   since one of its slot. The window is the number of counters
+   below the last one still accepted once, for the frames of a
+   window that arrive out of order. */
+#define LORAMAC_MAX_KEYS       16
+#define LORAMAC_REPLAY_TABLE   64
+#define LORAMAC_REPLAY_PROBE   8
+#define LORAMAC_REPLAY_EVICTED 64
+#define LORAMAC_REPLAY_WINDOW  32
 
 /*
    LoRaMAC data frame format:
@@ -54,22 +146,168 @@
 
    LoRaMAC ACK frame format:
      [src_mac (16)][seqno (8)]
+
+   LoRaMAC block ACK frame format (since 4.0, see LORAMAC_WINDOW):
+     [dst_mac (16)][src_mac (16)][seqno (8)][bitmap (8)]
+
+   The block ACK is sent to dst_mac by src_mac. It acknowledges
+   all frames up to seqno (cumulative) and each frame seqno + i + 1
+   for which the bit i is set in the bitmap (selective). Frame types
+   are told apart from their size since a data frame is always
+   larger than LORAMAC_HDR_SIZE.
+
+   With LORAMAC_FRAG the payload of each data frame starts with a
+   fragment header (see frag.h):
+     [tag (8)][last (1)][index (7)]<fragment...>
+
+   With LORAMAC_COMPRESS each message, before fragmentation,
+   starts with a compression header (see loramac_codec):
+     [codec (8)]<message...>
+
+   With LORAMAC_TDMA a beacon (since 5.3) is a data frame to
+   LORAMAC_BEACON_ADDR, never acknowledged, whose payload is
+   the schedule (see loramac_schedule) with the slots in ms:
+     [slot (16)][count (8)][owner (16)]...
+
+   With LORAMAC_SECURE (since 5.4) each message, after compression
+   and before fragmentation, is encrypted and authenticated with
+   AES-CCM (see common/ccm.h) under the key of the peer:
+     [counter (32)]<ciphertext...>[mic (32)]
+   The nonce is [src_mac (16)][dst_mac (16)][counter (32)] padded
+   with zeroes. The counter of the sender grows with each message.
 */
 
+/* Security header and MIC (see LORAMAC_SECURE) */
+#define LORAMAC_SEC_HDR_SIZE sizeof(uint32_t)
+#define LORAMAC_MIC_SIZE     4
+#define LORAMAC_SEC_SIZE     (LORAMAC_SEC_HDR_SIZE + LORAMAC_MIC_SIZE)
+
+/* Key shared with a peer, or with the whole network when the
+   address is the broadcast (see LORAMAC_SECURE). */
+struct loramac_key {
+  uint16_t addr;
+  uint8_t  key[AES_KEY_SIZE];
+};
+
+/* Compression header (see LORAMAC_COMPRESS) */
+#define LORAMAC_CODEC_HDR_SIZE sizeof(uint8_t)
+enum loramac_codec {
+  LORAMAC_CODEC_NONE,     /* the message did not shrink */
+  LORAMAC_CODEC_COMPRESS  /* compressed with the compress function */
+};
+
+/* Compression statistics (see loramac_codec_stats()) */
+struct loramac_codec_stats {
+  unsigned long messages;      /* messages sent */
+  unsigned long compressed;    /* messages sent compressed */
+  unsigned long bytes_in;      /* bytes before compression */
+  unsigned long bytes_out;     /* bytes sent (with the header) */
+  unsigned long compress_us;   /* time spent compressing */
+  unsigned long decompress_us; /* time spent decompressing */
+};
+
+/* Attempts accounted separately in loramac_counters (the last one
+   also counts the sends acknowledged after more attempts). */
+#define LORAMAC_MAX_ATTEMPTS 8
+
+/* Receive filters of the data frames (see filters in loramac_config).
+   The default order is the cost of each check so that most frames
+   nobody wants are dropped before the CRC. */
+enum loramac_filter {
+  LORAMAC_FILTER_LENGTH,      /* frame shorter than a header */
+  LORAMAC_FILTER_DESTINATION, /* another destination or broadcast (see LORAMAC_NOBROADCAST) */
+  LORAMAC_FILTER_CRC,         /* invalid CRC */
+  LORAMAC_FILTER_DUPLICATE,   /* retransmission, acknowledged nevertheless */
+  LORAMAC_FILTERS
+};
+
+/* Frame counters (see loramac_counters()) */
+struct loramac_counters {
+  unsigned long tx_frames;  /* frames sent (with retransmissions) */
+  unsigned long tx_noack;   /* sends that gave up on an ACK */
+  unsigned long rx_frames;  /* data frames received */
+  unsigned long rx_crc;     /* data frames with an invalid CRC */
+  unsigned long rx_invalid; /* data frames with an invalid header */
+  unsigned long rx_dups;    /* retransmissions suppressed */
+  unsigned long rx_resync;  /* losses of the frame boundary on UART */
+
+  /* frames dropped by each receive filter (see loramac_filter) */
+  unsigned long rx_drops[LORAMAC_FILTERS];
+
+  /* sends acknowledged after each number of attempts (from one) */
+  unsigned long tx_attempts[LORAMAC_MAX_ATTEMPTS];
+  unsigned long tx_backoff_us; /* time spent backing off */
+  unsigned long tx_busy;       /* channel found busy before a frame (see LORAMAC_LBT) */
+  unsigned long tx_piggyback;  /* ACKs carried by data frames (see LORAMAC_PIGGYBACK) */
+  unsigned long rx_piggyback;  /* ACKs received in data frames */
+  unsigned long tx_parity;     /* parity fragments sent (see LORAMAC_FEC) */
+  unsigned long tx_unrepaired; /* lost fragments left to the parity */
+  unsigned long rx_recovered;  /* fragments rebuilt from the parity */
+  unsigned long tx_adr_faster; /* steps to a faster SF (see LORAMAC_ADR) */
+  unsigned long tx_adr_slower; /* steps to a slower SF */
+  unsigned long tx_beacons;    /* beacons sent (see LORAMAC_TDMA) */
+  unsigned long rx_beacons;    /* beacons received */
+  unsigned long tx_slot_us;    /* time spent waiting for our slot */
+  unsigned long rx_forged;     /* messages with an invalid MIC (see LORAMAC_SECURE) */
+  unsigned long rx_replays;    /* messages with a counter already seen */
+  unsigned long tx_acks;       /* ACK and block ACK frames sent */
+
+  /* delay in us between the end of a frame and its ACK,
+     for sends acknowledged on the first attempt */
+  unsigned long ack_delays;
+  unsigned long ack_delay_min;
+  unsigned long ack_delay_max;
+  unsigned long ack_delay_sum;
+};
+
+struct loramac_ctx;
+
 /* LoRaMAC driver initialization flags */
 enum loramac_flags {
   LORAMAC_PROMISCUOUS = 0x1, /* do not filter packets to another destination */
   LORAMAC_INVALID     = 0x2, /* do not filter invalid packets (packet header, CRC) */
   LORAMAC_NOBROADCAST = 0x4, /* ignore broadcast messages (0xffff) */
   LORAMAC_NOACK       = 0x8, /* do not answer nor expect ACKs */
+  LORAMAC_WINDOW      = 0x10, /* use block ACKs (sliding window ARQ) */
+  LORAMAC_FRAG        = 0x20, /* fragment messages up to LORAMAC_MAX_MESSAGE */
+  LORAMAC_COMPRESS    = 0x40, /* compress messages when they shrink */
+  LORAMAC_DUTY        = 0x80, /* stay within the duty cycle of the sub-band */
+  LORAMAC_RTO         = 0x100, /* estimate the ACK timeout of each destination */
+  LORAMAC_LBT         = 0x200, /* listen before talk */
+  LORAMAC_PIGGYBACK   = 0x400, /* carry ACKs in the header of data frames */
+  LORAMAC_COMPACT     = 0x800, /* 8-bit node IDs of the cluster in headers */
+  LORAMAC_FEC         = 0x1000, /* parity fragments to rebuild lost fragments */
+  LORAMAC_ADR         = 0x2000, /* adaptive spreading factor of each destination */
+  LORAMAC_TDMA        = 0x4000, /* send in our slot of the beacon schedule */
+  LORAMAC_SECURE      = 0x8000, /* encrypt and authenticate messages (AES-CCM) */
+};
+
+/* Delay before each retransmission (see backoff in loramac_config).
+   The nth retransmission waits at most slot * 2^(n-1) us. With the
+   jitter policies the delay is uniform up to that bound so that
+   nodes which collided once do not retransmit in lockstep. */
+enum loramac_backoff {
+  LORAMAC_BACKOFF_NONE,    /* retransmit as soon as the ACK timed out */
+  LORAMAC_BACKOFF_EXP,     /* exponential without jitter */
+  LORAMAC_BACKOFF_JITTER,  /* exponential with jitter from backoff_seed */
+  LORAMAC_BACKOFF_ADDRESS  /* exponential with jitter seeded from the MAC address */
 };
 
 /* Initialization status */
 enum loramac_init_status {
   LORAMAC_INIT_SUCCESS,
   LORAMAC_INIT_TIMEVAL,   /* Invalid value for timeout or SIFS */
-  LORAMAC_INIT_ACK_FIFO,  /* ACK FIFO too large */
   LORAMAC_INIT_OOM,       /* Out of memory */
+  LORAMAC_INIT_CODEC,     /* Compression without compression functions */
+  LORAMAC_INIT_DUTY,      /* Invalid radio settings or frequency (see LORAMAC_DUTY) */
+  LORAMAC_INIT_BACKOFF,   /* Invalid backoff policy (see loramac_backoff) */
+  LORAMAC_INIT_FILTERS,   /* Invalid receive filter order (see loramac_filter) */
+  LORAMAC_INIT_CLUSTER,   /* Invalid cluster or address outside of it (see LORAMAC_COMPACT) */
+  LORAMAC_INIT_FEC,       /* Parity without fragmentation or invalid group (see LORAMAC_FEC) */
+  LORAMAC_INIT_ADR,       /* Invalid spreading factors or no set_radio() (see LORAMAC_ADR) */
+  LORAMAC_INIT_TDMA,      /* Slotted access with compact headers (see LORAMAC_TDMA) */
+  LORAMAC_INIT_KEYS,      /* No key or too many keys (see LORAMAC_SECURE) */
+  LORAMAC_INIT_FIXED,     /* Flags or functions other than those fixed at build time (see fixed.h) */
 };
 
 /* Status of a received frame */
@@ -80,13 +318,37 @@ enum loramac_receive_status {
   LORAMAC_RCV_INVALID_HDR, /* invalid header */
   LORAMAC_RCV_DESTINATION, /* not destinated to this interface */
   LORAMAC_RCV_BROADCAST,   /* broadcast message ignored */
+  LORAMAC_RCV_INVALID_MIC, /* forged or replayed message (see LORAMAC_SECURE) */
 };
 
 /* Status of a sent frame */
 enum loramac_send_status {
   LORAMAC_SND_SUCCESS,
   LORAMAC_SND_TOOLONG, /* payload too long */
-  LORAMAC_SND_NOACK    /* maximum number of retransmissions reached */
+  LORAMAC_SND_NOACK,   /* maximum number of retransmissions reached */
+  LORAMAC_SND_WINDOW,  /* too many frames for the window */
+  LORAMAC_SND_BUSY,    /* transmit queue full (see async.h) */
+  LORAMAC_SND_DUTY,    /* duty cycle budget exhausted (see LORAMAC_DUTY) */
+  LORAMAC_SND_ACCESS,  /* channel still busy (see LORAMAC_LBT) */
+  LORAMAC_SND_ADDRESS, /* destination outside of the cluster (see LORAMAC_COMPACT) */
+  LORAMAC_SND_SLOT,    /* no slot of ours fits the frame (see LORAMAC_TDMA) */
+  LORAMAC_SND_KEY      /* no key for the destination (see LORAMAC_SECURE) */
+};
+
+/* Schedule of a superframe (see LORAMAC_TDMA). The slot i starts
+   i * slot us after the end of the beacon and is owned by the node
+   owners[i], a node may own several slots. The slots are rounded
+   down to the ms in the beacon. */
+struct loramac_schedule {
+  unsigned int slot;  /* slot length in us */
+  unsigned int count; /* slots in the superframe */
+  uint16_t     owners[LORAMAC_MAX_SLOTS];
+};
+
+/* A buffer of a frame written with uart_sendv(). */
+struct loramac_iovec {
+  const void  *base;
+  unsigned int size;
 };
 
 struct loramac_config {
@@ -94,7 +356,13 @@ struct loramac_config {
      the resulting frame on the device's UART. This
      functions should return a negative value in case of
      error or 0 on success. */
-  int  (*uart_send)(const void *buf, unsigned int size);
+  int  (*uart_send)(const void *buf, unsigned int size, void *data);
+
+  /* When not NULL, data frames are written with uart_sendv()
+     instead. The frame is given as the header, the payload
+     straight from the caller's buffer and the CRC so that it
+     is never copied. It returns the same values as uart_send(). */
+  int  (*uart_sendv)(const struct loramac_iovec *iov, unsigned int count, void *data);
 
   /* The driver will call cb_recv() when a frame has been
      received (frames may be filtered according to the
@@ -109,9 +377,15 @@ struct loramac_config {
   /* The driver will use those functions to start, stop and wait
      for the ACK timer. The stop function should also drop any wait in
      place on the timer. */
-  void (*start_timer)(unsigned int us);
-  void (*stop_timer)(void);
-  void (*wait_timer)(void);
+  void (*start_timer)(unsigned int us, void *data);
+  void (*stop_timer)(void *data);
+  void (*wait_timer)(void *data);
+
+  /* Monotonic clock in microseconds. This is used to expire
+     the entries of the duplicate table and partial frames
+     on UART (see gap). The clock may wrap
+     around since we only use the difference between two values. */
+  unsigned long (*clock)(void *data);
 
   /* We only send one packet at a time. We are forced to do
      this unless we can start multiple referenced timers
@@ -121,61 +395,524 @@ struct loramac_config {
      its ACK in response to the received packet. Note that
      we use the same lock for sending and receiving since we
      don't generally send and receive at the same time. */
-  void (*lock)(void);
-  void (*unlock)(void);
+  void (*lock)(void *data);
+  void (*unlock)(void *data);
+
+  /* The receiver must wait for SIFS before it can send an ACK.
+     Instead of waiting in the receive path, we queue the ACK and
+     ask the platform to call loramac_flush_acks() from another
+     thread after the given delay in us. It may be called again with a
+     shorter delay while armed (see back_hold), the earliest one must
+     then be kept. The ACK queue itself is
+     protected with its own lock since it is shared between the
+     receive path and this thread. When schedule_ack is null, we
+     fallback on waiting for SIFS and sending the ACK directly. */
+  void (*schedule_ack)(unsigned int us, void *data);
+  void (*ack_lock)(void *data);
+  void (*ack_unlock)(void *data);
+
+  /* Block ACK hold in us (see LORAMAC_WINDOW), this needs schedule_ack.
+     The block ACK of a sender then waits for the end of its burst: it is
+     due back_hold us after the last frame received from the sender (SIFS
+     when larger), so that a whole burst costs one ACK and one turnaround.
+     Once it covers LORAMAC_MAX_WINDOW frames it is due SIFS after the
+     last one. The hold adds to the round trip of a burst that does not
+     fill the window, it must stay well below the ACK timeout of the
+     senders less the airtime of the ACK. When zero the block ACK is sent
+     SIFS after the first frame it covers. */
+  unsigned int back_hold;
+
+  /* Compact headers (see LORAMAC_COMPACT). This is the table of the
+     addresses of the cluster, the ID of a node in the frames is its
+     index. All the nodes must use the same table, which includes our
+     own address, and the same flag. They cannot exchange frames with
+     nodes outside of the cluster and frames with an unknown ID have
+     an invalid header. The upper layer still sees the addresses. */
+  const uint16_t *cluster;
+  unsigned int    cluster_size;
+
+  /* Membership bitmap of the multicast groups (see LORAMAC_GROUP),
+     the bit of group ID i is groups[i / 8] & 1 << i % 8. */
+  uint8_t groups[LORAMAC_MAX_GROUPS / 8];
+
+  /* With LORAMAC_PIGGYBACK a data frame to a node which is still
+     waiting for our ACK carries this ACK in its header instead. The
+     frame is then held until the ACK is due, so data sent back within
+     SIFS (a reply) spares the ACK frame and a turnaround. Only simple
+     ACKs are carried, block ACKs are still sent on their own, and this
+     needs schedule_ack. All nodes must use this flag since the header
+     of every data frame grows by LORAMAC_EXT_SIZE. */
 
   /* Not all platform provide byte ordering functions
-     with the same names as POSIX. */
+     with the same names as POSIX. They are not used (and
+     may be NULL) when built with PLATFORM_ENDIAN. */
   uint16_t (*htons)(uint16_t v);
   uint16_t (*ntohs)(uint16_t v);
 
+  /* Compression stage used with LORAMAC_COMPRESS. The compress
+     function returns the size of the compressed message or 0 when
+     it would exceed max bytes. The decompress function returns the
+     size of the original message or a negative value when it is
+     invalid. Both ends must use the same functions. */
+  unsigned int (*compress)(const void *in, unsigned int size, void *out, unsigned int max);
+  int (*decompress)(const void *in, unsigned int size, void *out, unsigned int max);
+
+  /* Duty cycle accounting (see LORAMAC_DUTY). The time on air of each
+     frame, ACKs included, is computed from the radio settings and
+     charged to the budget of the sub-band of the channel frequency
+     (in Hz) configured on the module. When a frame does not fit in
+     the budget the sender sleeps with usleep() for at most duty_wait
+     us before it gives up with LORAMAC_SND_DUTY. The lock is not held
+     while sleeping. Without usleep() it gives up at once. ACKs and
+     retransmissions are never deferred, ACKs are charged even when
+     the budget is exhausted. */
+  struct duty_radio radio;
+  unsigned long frequency;
+  unsigned long duty_wait;
+  void (*usleep)(unsigned long us, void *data);
+
+  /* Adaptive data rate (see LORAMAC_ADR and adr.h). The spreading
+     factor of each destination moves between adr_sf_min and adr_sf_max
+     with the retransmissions of the frames sent to it with simple ACKs.
+     Before a frame to a destination whose SF is not the one of radio,
+     set_radio() is called with the new settings to configure the module
+     and radio then follows for the time on air. When it fails the frame
+     is sent with the current settings. The receivers must listen with
+     the settings of the sender, so the peers of a link must follow the
+     same decisions (or the module must receive on several SF). Links
+     start on the slowest SF. */
+  unsigned int  adr_sf_min;
+  unsigned int  adr_sf_max;
+  int (*set_radio)(const struct duty_radio *radio, void *data);
+
+  /* Retransmission backoff (see loramac_backoff). The delay is at
+     most backoff_max us. ACKs are still accepted while backing off,
+     a late ACK spares the retransmission. The seed must differ
+     between nodes, it is only used by LORAMAC_BACKOFF_JITTER. */
+  unsigned int  backoff;
+  unsigned int  backoff_slot;
+  unsigned int  backoff_max;
+  uint32_t      backoff_seed;
+
+  /* Listen before talk (see LORAMAC_LBT). Before each data frame the
+     sender asks channel_busy(), which may query the module for channel
+     activity (CAD) or RSSI. Without it the channel is busy while an
+     exchange we overheard is not over: the ACK of a data frame to
+     another node comes after SIFS, corrupted frames reserve one slot
+     since they are likely collisions. The module only reports frames
+     once received so this is all we can sense on our own. While
+     the channel is busy the sender waits for a random number of slots,
+     up to 2^n after the nth check, and gives up with LORAMAC_SND_ACCESS
+     after lbt_tries waits. ACKs are never deferred. */
+  int (*channel_busy)(void *data);
+  unsigned int  lbt_slot;
+  unsigned int  lbt_tries;
+
+  /* Broadcasts (to 0xffff) are never acknowledged. Each frame is
+     sent bcast_repeat times (once when 0) without waiting for an
+     ACK, each copy but the first after a random delay of at most
+     bcast_jitter us. Receivers drop the copies of a frame. */
+  unsigned int  bcast_repeat;
+  unsigned int  bcast_jitter;
+
+  /* Forward error correction (see LORAMAC_FEC). Each group of data
+     fragments of a message is followed by a parity fragment so the
+     receiver rebuilds one fragment lost in the group. The sender does
+     not retransmit the first fragment of a group that was not
+     acknowledged, or with block ACKs the window is complete once each
+     group misses at most one frame. The group is fec_group fragments,
+     or when 0 it follows the loss rate of the frames: no parity when
+     frames are barely lost, smaller groups as they are lost more often.
+     Without ACKs (LORAMAC_NOACK or broadcasts) there is no loss rate,
+     so fec_group should be set. With block ACKs a group and its parity
+     fit in one window. All nodes must use this flag since the parity
+     header takes one byte of each fragment. */
+  unsigned int  fec_group;
+
+  /* Slotted access (see LORAMAC_TDMA). Each data frame, broadcasts
+     and retransmissions included, waits for a slot we own in the last
+     schedule received (or sent) where it fits with its ACK after SIFS,
+     so that the ACK lands in our slot too. The first and the last
+     tdma_guard us of each slot are left for the clock errors. While a
+     schedule is live, a node without a slot where the frame fits gives
+     up with LORAMAC_SND_SLOT. The waits hold the lock like LBT. This
+     cannot be used with LORAMAC_COMPACT since the beacon address is
+     outside of the cluster. */
+  unsigned int  tdma_guard;
+
+  /* Order of the receive filters (see loramac_filter), NULL for
+     the default order. Each filter appears once and the duplicate
+     filter comes last since it acknowledges the frame. A filter
+     only drops frames the flags do not let through, so in
+     promiscuous mode the destination filter lets every frame go
+     to the next filter. */
+  const enum loramac_filter *filters;
+
+  /* Keys of LORAMAC_SECURE, at most LORAMAC_MAX_KEYS. A message
+     to a peer uses the key of its address and a message from a
+     peer the key of its source, or the network key (broadcast
+     address) when the peer has none. Broadcasts always use the
+     network key. The schedules are expanded once by loramac_init()
+     so that a message only costs its AES blocks. The counter is
+     the first one sent, it should grow across restarts (e.g. from
+     the clock) since receivers drop the counters already seen and
+     a counter used twice with a key reuses its nonce. When the
+     counter store is not NULL the counter is taken from there
+     instead and the next one is kept there with plain stores, so
+     that a mapped file keeps it across restarts. The contexts of
+     the modules of a node can share the same store. */
+  const struct loramac_key *keys;
+  unsigned int  key_count;
+  uint32_t      counter;
+  uint32_t     *counter_store;
+
   /* The function loramac_uart_putc() is generally called
      from an interrupt handler. Since we cannot parse
      the frame in this handler, we defer processing when
      a complete frame has been received. Control is then
      transferred to this function which can either directly
      be loramac_recv_frame() or use semaphores to defer
-     outside of the interrupt context. */
-  int (*recv_frame)(void);
+     outside of the interrupt context. On a MCU, the
+     interrupt handler can rather only enqueue the bytes
+     in an isr_ring for a task to loramac_uart_feed() them
+     (see common/isr-ring.h). */
+  int (*recv_frame)(struct loramac_ctx *ctx);
 
   /* Initial sequence number.
      This can be randomized so that multiple instances
      of the same host (i.e. same source address) with
      ACK enabled do not result in frames being filtered
-     as retransmissions by the receiver (see ACK FIFO). */
+     as retransmissions by the receiver (see duplicate table). */
   uint8_t seqno;
 
   uint16_t mac_address;  /* device short MAC address */
   unsigned int  retrans; /* maximum number of retransmissions */
-  unsigned int  timeout; /* ACK timeout in us */
+  unsigned int  timeout; /* ACK timeout in us (upper bound with LORAMAC_RTO) */
   unsigned int  sifs;    /* Short Inter Frame Spacing time in us */
+  unsigned int  gap;     /* max. gap between two UART bytes of a frame in us (0 to disable) */
   unsigned long flags;   /* (see loramac_flags) */
 
   void *data; /* context data passed to user callbacks */
 };
 
+/* Driver instance. All the state of the driver lives here so
+   that one process can drive as many devices as it needs. The
+   platform dependent functions receive the data pointer from
+   the configuration to find their own state. The fields are
+   private, the structure is only public so that it can be
+   allocated statically. */
+struct loramac_ctx {
+  /* LoRaMAC configuration with platform dependent functions,
+     source mac address and flags. */
+  struct loramac_config conf;
+
+  /* Sender internal state. The ACK source is the destination
+     of the last frame waiting for its ACK (see LORAMAC_PIGGYBACK). */
+  uint8_t last_ack_seqno;
+  unsigned int wait_ack;
+  uint16_t ack_src;
+
+  /* Clock until which an overheard exchange holds the channel
+     (see LORAMAC_LBT). The receiver updates it without the lock. */
+  unsigned long nav;
+
+  /* Sliding window state (see LORAMAC_WINDOW).
+     The sender waits for block ACKs from win_dst
+     for each frame marked as pending. The frame i
+     has the sequence number win_first + i. */
+  uint16_t win_dst;
+  uint8_t  win_first;
+  uint8_t  win_pending;
+
+  /* Sequence space for each destination.
+     This is a direct-mapped table on the peer address.
+     When a peer is evicted it restarts from the initial
+     seqno the next time we send a frame to it. The receiver
+     detects this as a window restart (see rx_window_update()).
+     With LORAMAC_RTO each peer also has its own ACK timeout
+     estimated from the round trips of frames sent only once,
+     between SIFS (the earliest ACK) and the configured timeout. */
+  struct loramac_peer {
+    unsigned int used;
+    uint16_t     addr;
+    uint8_t      seqno;
+    struct rto   rto;
+    struct adr   adr;
+  } tx_peers[LORAMAC_MAX_PEERS];
+
+  /* Pending ACKs.
+     ACKs are sent after SIFS by loramac_flush_acks() so that the receive
+     path never waits. The queue is ordered on the due time: since the
+     SIFS is the same for all ACKs this is a FIFO, but a block ACK held
+     for a burst (see back_hold) moves to its place on each new due
+     time. The type is the
+     size of the ACK frame (LORAMAC_ACK_SIZE or LORAMAC_BACK_SIZE). */
+  unsigned int ack_head;
+  unsigned int ack_count;
+  struct loramac_ack {
+    unsigned long due;
+    unsigned int  frames; /* frames covered (see back_hold) */
+    unsigned int  type;
+    uint16_t      dst;
+    uint8_t       seqno;
+    uint8_t       bitmap;
+  } ack_queue[LORAMAC_MAX_PENDING_ACK];
+
+  /* Fragmentation state (see LORAMAC_FRAG). The tag
+     of the last message sent and reassembly buffers. */
+  uint8_t frag_tag;
+  struct frag_pool frag_pool;
+
+  /* Size of the frames and their addresses (see LORAMAC_PIGGYBACK
+     and LORAMAC_COMPACT) and of the fragments that fit in a data
+     frame. The node ID is our index in the cluster. */
+  unsigned int hdr_size;
+  unsigned int ack_size;
+  unsigned int back_size;
+  unsigned int addr_size;
+  unsigned int frag_size;
+  uint8_t      node_id;
+
+  /* Frame loss rate in 1/65536 as a moving average over the frames
+     waiting for an ACK, for the size of the groups (see LORAMAC_FEC). */
+  unsigned long frame_loss;
+
+  /* Compression statistics and the buffer of the
+     last decompressed message (see LORAMAC_COMPRESS). */
+  struct loramac_codec_stats codec_stats;
+  unsigned char rcv_msgbuf[LORAMAC_MAX_MESSAGE];
+
+  /* Frame counters. The transmit counters are only updated
+     by the sender and the receive counters by the receiver. */
+  struct loramac_counters counters;
+
+  /* CRC of the data frames checkpointed after the source
+     address which is the same for all of them. */
+  struct crc_ccitt_ctx tx_crc;
+
+  /* State of the backoff jitter generator (xorshift32). */
+  uint32_t backoff_state;
+
+  /* Schedules of the slotted access (see LORAMAC_TDMA). The receive
+     path writes the entry that is not current and publishes it, the
+     sender reads the current one. The base is the clock at the end
+     of the beacon, the count is 0 until the first beacon. */
+  struct loramac_tdma {
+    unsigned long           base;
+    struct loramac_schedule schedule;
+  } tdma[2];
+  unsigned int tdma_cur;
+
+  /* Duty cycle budget of the sub-band (see LORAMAC_DUTY).
+     It is only updated with the lock held. */
+  const struct duty_band *duty_band;
+  struct duty duty;
+
+  /* receive and send packetbuf [sz][frame...]
+     The receive buffer holds rcv_len bytes from UART starting
+     at what we believe is a size byte. When this is not the case
+     we are resynchronizing (see loramac_uart_feed()). */
+  unsigned char snd_pktbuf[LORAMAC_MAX_FRAME + 1];
+  unsigned char rcv_pktbuf[LORAMAC_MAX_FRAME + 1];
+  unsigned int  rcv_len;
+  unsigned int  rcv_resync;
+  int           rcv_crc;   /* CRC checked by the framer (1 valid, 0 invalid, -1 unknown) */
+  unsigned long rcv_stamp; /* clock at the last byte received */
+
+  /* Receive filters in the order they are applied. */
+  enum loramac_filter filters[LORAMAC_FILTERS];
+
+  /* Receiver duplicate table.
+     This is an open addressing hash table on the sender address
+     with linear probing over at most LORAMAC_DUP_PROBE slots. For
+     each sender we keep the seqno of the last frame (or the
+     receive window with LORAMAC_WINDOW, the base is the last frame
+     received in order and the bit i of the bitmap is set when
+     base + i + 1 has been received out of order). We can use this
+     to avoid displaying frames duplicated because of retransmissions.
+
+     Entries expire once the sender cannot retransmit the same
+     frame anymore and their slot is then reused. When all probed
+     slots are live we evict the least recently seen sender. */
+  unsigned long dup_expiry;
+  struct loramac_dup {
+    unsigned int  used;
+    unsigned long stamp; /* last time we heard from this sender */
+    uint16_t      sender;
+    uint8_t       seqno;
+    uint8_t       bitmap;
+  } dup_table[LORAMAC_DUP_TABLE];
+
+  /* Last broadcast received from each sender. Broadcasts have
+     their own sequence space on the sender so they are tracked
+     apart from the duplicate table. This is direct-mapped on the
+     sender address and entries expire like the duplicate table. */
+  struct loramac_bcast {
+    unsigned int  used;
+    unsigned long stamp;
+    uint16_t      sender;
+    uint8_t       seqno;
+  } bcast_table[LORAMAC_MAX_PEERS];
+
+  /* Expanded keys and counters of LORAMAC_SECURE. The replay
+     table keeps the last counter of each sender and the bit i of
+     the bitmap is set when counter - i - 1 has been received. The
+     floor of an evicted sender is one more than its last counter,
+     the evicted list is a ring of the last ones. The floor of a slot
+     is the highest floor of the senders that hash on it and left the
+     ring, zero when none did. It is only used by the receive path
+     like the duplicate table. */
+  struct loramac_key_sched {
+    uint16_t       addr;
+    struct aes_key key;
+  } key_scheds[LORAMAC_MAX_KEYS];
+  unsigned int key_count;
+  uint32_t     own_counter;
+  uint32_t    *tx_counter; /* ours or the counter store */
+  struct loramac_replay {
+    unsigned int  used;
+    unsigned long stamp;
+    uint16_t      sender;
+    uint32_t      counter;
+    uint32_t      bitmap;
+  } replay_table[LORAMAC_REPLAY_TABLE];
+  struct loramac_evicted {
+    unsigned int used;
+    uint16_t     sender;
+    uint32_t     floor;
+  } replay_evicted[LORAMAC_REPLAY_EVICTED];
+  unsigned int replay_next; /* next entry of the evicted ring */
+  uint32_t     replay_floor[LORAMAC_REPLAY_TABLE];
+  unsigned char rcv_plainbuf[LORAMAC_MAX_MESSAGE];
+};
+
 /* Initialize the LoRaMAC driver (see loramac_config).
    Return 0 on success, for other error codes see loramac_init_status. */
-int loramac_init(const struct loramac_config *conf);
+int loramac_init(struct loramac_ctx *ctx, const struct loramac_config *conf);
 
 /* Assemble and send a frame to the specified destination using LoRaMAC.
    The broadcast address is 0xffff. When ACK is enabled, this function
    will block until the packet has been successfully transmitted. For
    the error returned see loramac_send_status. If the tx pointer is not
    null, it is replaced with the number of transmissions necessary to
-   succesfully send the packet. */
-int loramac_send(uint16_t dst, const void *payload, unsigned int payload_size, unsigned int *tx);
+   succesfully send the packet. With LORAMAC_FRAG, a message larger than
+   loramac_max_payload() is sent as several frames (by windows with
+   LORAMAC_WINDOW) and tx is the total for all frames. */
+int loramac_send(struct loramac_ctx *ctx, uint16_t dst, const void *payload, unsigned int payload_size, unsigned int *tx);
+
+/* Flags of loramac_tx_opts */
+enum loramac_tx_flags {
+  LORAMAC_TX_NOACK = 0x1, /* send once and do not wait for the ACK */
+};
+
+/* Options of a single message (see loramac_send_opts()), which override
+   the configuration. A message sent without ACK skips the ACK wait, the
+   retransmissions and the SIFS of the receiver, which suits loss tolerant
+   traffic. The number of transmissions (retrans) is the configured one
+   when zero. An ACK cannot be requested with LORAMAC_NOACK since the
+   receivers do not answer at all. */
+struct loramac_tx_opts {
+  unsigned int flags; /* (see loramac_tx_flags) */
+  unsigned int retrans;
+};
+
+/* Same as loramac_send() with the options of this message,
+   the configured behaviour when NULL. */
+int loramac_send_opts(struct loramac_ctx *ctx, uint16_t dst, const void *payload,
+                      unsigned int payload_size, const struct loramac_tx_opts *opts,
+                      unsigned int *tx);
+
+/* A frame to be sent with loramac_send_window(). */
+struct loramac_frame {
+  const void  *payload;
+  unsigned int size;
+};
+
+/* Send up to LORAMAC_MAX_WINDOW frames to the same destination, back to back,
+   and wait for a single block ACK before retransmitting only the frames that
+   were not acknowledged. This requires LORAMAC_WINDOW on both ends. Note that
+   the receiver delivers frames as they arrive so that retransmitted frames
+   may be received out of order. If the tx pointer is not null, it is replaced
+   with the number of rounds necessary to succesfully send all frames. */
+int loramac_send_window(struct loramac_ctx *ctx, uint16_t dst,
+                        const struct loramac_frame *frames, unsigned int count,
+                        unsigned int *tx);
+
+/* Same as loramac_send_window() with the options of these frames. */
+int loramac_send_window_opts(struct loramac_ctx *ctx, uint16_t dst,
+                             const struct loramac_frame *frames, unsigned int count,
+                             const struct loramac_tx_opts *opts, unsigned int *tx);
+
+/* Broadcast a beacon with this schedule (see LORAMAC_TDMA) and follow
+   it from the end of the beacon. The beacon is sent at once, out of
+   any slot, so the gateway calls this at the end of each superframe.
+   For the error returned see loramac_send_status. */
+int loramac_send_beacon(struct loramac_ctx *ctx, const struct loramac_schedule *schedule);
+
+/* Maximum payload of a single frame. This is smaller
+   than LORAMAC_MAX_PAYLOAD with LORAMAC_FRAG since
+   each frame carries a fragment header. The compression
+   header is also accounted with LORAMAC_COMPRESS although
+   a compressed message may still fit in a frame. The header
+   extension takes its share with LORAMAC_PIGGYBACK while
+   compact headers leave more room (see LORAMAC_COMPACT). */
+unsigned int loramac_max_payload(const struct loramac_ctx *ctx);
+
+/* Copy the compression statistics (see LORAMAC_COMPRESS).
+   The compression ratio is bytes_out over bytes_in. */
+void loramac_codec_stats(struct loramac_ctx *ctx, struct loramac_codec_stats *stats);
+
+/* Copy the frame counters. They are copied without locking
+   so that a transmission in progress does not hold the caller. */
+void loramac_counters(const struct loramac_ctx *ctx, struct loramac_counters *counters);
+
+/* Change the SIFS and the ACK timeout of a running instance, for
+   instance after a calibration (see ping mode). Both are in us and
+   the timeout cannot be lower than SIFS. The ACK timeout estimated
+   for each destination restarts within the new bounds. The duplicate
+   and fragment expiries keep the value computed on initialization so
+   that they still cover senders configured with the former timeout.
+   Returns LORAMAC_INIT_TIMEVAL when the values are invalid. */
+int loramac_set_timing(struct loramac_ctx *ctx, unsigned int sifs, unsigned int timeout);
+
+/* Time on air left in the duty cycle budget in us (see LORAMAC_DUTY).
+   This is negative when ACKs overdrew the budget. It is read without
+   locking so that upper layers may check it before they choose to
+   send on LoRa. */
+long loramac_duty_budget(const struct loramac_ctx *ctx);
+
+/* Delay in us until a frame with this payload size fits in the
+   duty cycle budget or 0 when it can be sent right away. */
+unsigned long loramac_duty_delay(const struct loramac_ctx *ctx, unsigned int payload_size);
+
+/* Send all pending ACKs whose SIFS has elapsed. It returns the delay
+   in us until the next pending ACK or 0 when there is none left. This
+   delay does not need to be scheduled again when a new ACK is queued
+   since we only call schedule_ack when the queue was empty. */
+unsigned int loramac_flush_acks(struct loramac_ctx *ctx);
 
 /* Start the processing of a frame. Can be called either automatically
    when a complete frame has been received or manually from another thread. */
-int loramac_recv_frame(void);
+int loramac_recv_frame(struct loramac_ctx *ctx);
 
-/* Called by the platform dependent part of the driver when a character
+/* Called by the platform dependent part of the driver when data
    has been received on UART from the device. This function can block
    when a full frame has been received. It may also block indefinitely
    if the receive callback itself is blocked. Note that this function
-   is *NOT* reentrant. You have to wait for its completion until you
-   can call it again. */
-int loramac_uart_putc(unsigned char c);
+   is *NOT* reentrant for the same instance. You have to wait for its
+   completion until you can call it again.
+
+   Frames are only delimited by their size byte. A partial frame is
+   dropped when no byte came in for conf.gap us. When the size byte
+   is invalid or the CRC does not match, the buffer is rescanned one
+   byte further until a valid data frame is found. ACKs have no CRC,
+   so they are ignored during this resynchronization.
+
+   Returns the status of the last complete frame
+   or LORAMAC_RCV_CONT when more data is needed. */
+int loramac_uart_feed(struct loramac_ctx *ctx, const unsigned char *buf, unsigned int size);
+
+/* Same as loramac_uart_feed() for a single character. */
+int loramac_uart_putc(struct loramac_ctx *ctx, unsigned char c);
 
 #endif /* _LORAMAC_H_ */
@@ -0,0 +1,147 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lz.h"
+
+/* Byte at position i of the history, that is the
+   dictionary followed by the data. The position
+   is negative within the dictionary. */
+static unsigned char history(const struct lz_dict *dict, const unsigned char *data, int i)
+{
+  if(i < 0)
+    return dict->buf[dict->size + i];
+  return data[i];
+}
+
+/* Find the longest match for the data at position pos. */
+static unsigned int longest_match(const struct lz_dict *dict, const unsigned char *data,
+                                  unsigned int pos, unsigned int size, unsigned int *offset)
+{
+  unsigned int best = 0;
+  unsigned int max  = size - pos < LZ_MAX_MATCH ? size - pos : LZ_MAX_MATCH;
+  unsigned int dict_size = dict ? dict->size : 0;
+  unsigned int off, len;
+
+  for(off = 1 ; off <= LZ_WINDOW && off <= pos + dict_size ; off++) {
+    int start = (int)pos - (int)off;
+
+    /* the match may overlap the current position */
+    for(len = 0 ; len < max && history(dict, data, start + len) == data[pos + len] ; len++);
+
+    if(len > best) {
+      best    = len;
+      *offset = off;
+      if(best == max)
+        break;
+    }
+  }
+
+  return best;
+}
+
+unsigned int lz_compress(const struct lz_dict *dict, const void *in, unsigned int size,
+                         void *out, unsigned int max)
+{
+  const unsigned char *src = in;
+  unsigned char *dst = out;
+  unsigned char *flags = NULL;
+  unsigned int pos = 0, n = 0, item = 0;
+  unsigned int len, offset;
+
+  while(pos < size) {
+    /* new flag byte every eight items */
+    if(item % 8 == 0) {
+      if(n >= max)
+        return 0;
+      flags  = &dst[n++];
+      *flags = 0;
+    }
+
+    len = longest_match(dict, src, pos, size, &offset);
+    if(len >= LZ_MIN_MATCH) {
+      if(n + 2 > max)
+        return 0;
+      *flags  |= 1 << (item % 8);
+      dst[n++] = ((len - LZ_MIN_MATCH) << 4) | ((offset - 1) >> 8);
+      dst[n++] = (offset - 1) & 0xff;
+      pos += len;
+    }
+    else {
+      if(n >= max)
+        return 0;
+      dst[n++] = src[pos++];
+    }
+
+    item++;
+  }
+
+  return n;
+}
+
+int lz_decompress(const struct lz_dict *dict, const void *in, unsigned int size,
+                  void *out, unsigned int max)
+{
+  const unsigned char *src = in;
+  unsigned char *dst = out;
+  unsigned int dict_size = dict ? dict->size : 0;
+  unsigned int pos = 0, n = 0, item = 0;
+  unsigned int len, offset, i;
+  uint8_t flags = 0;
+
+  while(pos < size) {
+    if(item % 8 == 0)
+      flags = src[pos++];
+
+    if(pos == size)
+      /* trailing flag byte */
+      return -1;
+
+    if(flags & (1 << (item % 8))) {
+      if(pos + 2 > size)
+        return -1;
+
+      len    = (src[pos] >> 4) + LZ_MIN_MATCH;
+      offset = (((src[pos] & 0xf) << 8) | src[pos + 1]) + 1;
+      pos   += 2;
+
+      if(offset > n + dict_size || n + len > max)
+        return -1;
+
+      for(i = 0 ; i < len ; i++, n++)
+        dst[n] = history(dict, dst, (int)n - (int)offset);
+    }
+    else {
+      if(n >= max)
+        return -1;
+      dst[n++] = src[pos++];
+    }
+
+    item++;
+  }
+
+  return n;
+}
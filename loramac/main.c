@@ -34,20 +34,32 @@
 #include <limits.h>
 #include <string.h>
 #include <getopt.h>
-#include <signal.h>
+#include <time.h>
 #include <err.h>
 
 #include "string-utils.h"
 #include "loramac-str.h"
 #include "loramac.h"
 #include "rpi-gpio.h"
+#include "lz.h"
 #include "version.h"
 #include "options.h"
+#include "metrics.h"
+#include "admit.h"
+#include "statmap.h"
+#include "capture.h"
+#include "log.h"
 #include "common.h"
 #include "xatoi.h"
+#include "ticker.h"
 #include "timer.h"
+#include "rt.h"
+#include "ring.h"
 #include "lock.h"
+#include "counter.h"
 #include "uart.h"
+#include "loop.h"
+#include "radios.h"
 #include "mode.h"
 #include "help.h"
 #include "main.h"
@@ -58,15 +70,21 @@ struct io_thread_data {
   const struct loramac_config *config;
 };
 
+/* Time for the modem to raise its ready GPIO after a reset. */
+#define READY_TIMEOUT 1000 /* ms */
+
 static void configure_gpio(const struct context *ctx)
 {
   if((ctx->gpio_irq > 0) |
      (ctx->gpio_cts > 0) |
-     (ctx->gpio_reset > 0))
+     (ctx->gpio_reset > 0) |
+     (ctx->gpio_ready > 0))
     rpi_gpio_init();
 
   if(ctx->gpio_irq > 0)
     rpi_gpio_set_mode(ctx->gpio_irq, RPI_GPIO_IN);
+  if(ctx->gpio_ready > 0)
+    rpi_gpio_set_mode(ctx->gpio_ready, RPI_GPIO_IN);
   if(ctx->gpio_cts > 0) {
     rpi_gpio_set_mode(ctx->gpio_cts, RPI_GPIO_OUT);
     rpi_gpio_set(ctx->gpio_cts);
@@ -78,61 +96,749 @@ static void configure_gpio(const struct context *ctx)
     rpi_gpio_set(ctx->gpio_reset);
     usleep(10000);                   /* up 10ms */
     rpi_gpio_clr(ctx->gpio_reset);
-    usleep(30000);                   /* down 30ms */
+    usleep(ctx->reset_pulse);        /* down */
     rpi_gpio_set(ctx->gpio_reset);   /* up */
+
+    /* rather than assuming the modem is up */
+    if(ctx->gpio_ready > 0 && !rpi_gpio_wait(ctx->gpio_ready, 1, READY_TIMEOUT))
+      warnx("modem not ready after %d ms", READY_TIMEOUT);
+  }
+}
+
+/* Static dictionary shared by both ends for the
+   compression of our messages (see --dict). */
+static struct lz_dict dict;
+
+static unsigned int compress(const void *in, unsigned int size, void *out, unsigned int max)
+{
+  return lz_compress(&dict, in, size, out, max);
+}
+
+static int decompress(const void *in, unsigned int size, void *out, unsigned int max)
+{
+  return lz_decompress(&dict, in, size, out, max);
+}
+
+/* Only the end of the dictionary is reachable
+   so this is the part we keep in memory. */
+static void load_dict(const char *path)
+{
+  static unsigned char buf[LZ_MAX_DICT];
+  unsigned char chunk[LZ_MAX_DICT];
+  size_t n;
+  FILE *fp;
+
+  fp = fopen(path, "r");
+  if(!fp)
+    err(EXIT_FAILURE, "cannot open dictionary");
+
+  dict = (struct lz_dict){ .buf = buf, .size = 0 };
+  while((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+    if(dict.size + n > sizeof(buf)) {
+      unsigned int keep = sizeof(buf) - n;
+
+      memmove(buf, buf + dict.size - keep, keep);
+      dict.size = keep;
+    }
+    memcpy(buf + dict.size, chunk, n);
+    dict.size += n;
   }
+
+  if(ferror(fp))
+    err(EXIT_FAILURE, "cannot read dictionary");
+  fclose(fp);
+}
+
+static void display_codec_stats(struct loramac_ctx *mac)
+{
+  struct loramac_codec_stats stats;
+
+  loramac_codec_stats(mac, &stats);
+
+  printf("Compression:\n");
+  printf(" messages                  : %lu (%lu compressed)\n", stats.messages, stats.compressed);
+  printf(" bytes                     : %lu -> %lu", stats.bytes_in, stats.bytes_out);
+  if(stats.bytes_in)
+    printf(" (%lu%%)", stats.bytes_out * 100 / stats.bytes_in);
+  printf("\n");
+  printf(" compression time          : %lu us\n", stats.compress_us);
+  printf(" decompression time        : %lu us\n", stats.decompress_us);
+}
+
+/* Protocol timers share a single wheel driven by the ticker
+   thread. ACKs are sent from this thread after SIFS, the driver
+   arms the ACK timer when an ACK is queued. */
+#define TICKER_TICK 100 /* us */
+
+static struct ticker ticker;
+static struct wheel_timer ack_timer;
+
+static void schedule_ack(unsigned int us, void *data)
+{
+  UNUSED(data);
+  ticker_arm(&ticker, &ack_timer, us);
+}
+
+static void flush_acks(void *data)
+{
+  struct loramac_ctx *mac = data;
+  unsigned int delay;
+
+  delay = loramac_flush_acks(mac);
+  if(delay)
+    ticker_arm(&ticker, &ack_timer, delay);
+}
+
+static unsigned long mac_clock(void *data)
+{
+  UNUSED(data);
+  return clock_us();
 }
 
+/* The sender sleeps here until its frames fit in the duty cycle budget. */
+static void mac_usleep(unsigned long us, void *data)
+{
+  struct timespec ts = { .tv_sec  = us / 1000000,
+                         .tv_nsec = us % 1000000 * 1000 };
+
+  UNUSED(data);
+
+  while(nanosleep(&ts, &ts) < 0);
+}
+
+/* The module is configured out of band, its UART only carries frames.
+   So the spreading factor chosen by the driver (see LORAMAC_ADR) only
+   retunes the time on air and is logged for the peers to follow. */
+static int set_radio(const struct duty_radio *radio, void *data)
+{
+  UNUSED(data);
+
+  log_msg(LOG_CAT_MAIN, LOG_LVL_INFO, "Radio now SF%u %lu kHz\n",
+          radio->sf, radio->bw / 1000);
+  return 0;
+}
+
+/* Parse the spreading factors of the adaptive data rate as MIN:MAX. */
+static void parse_adr(struct loramac_config *conf, const char *arg)
+{
+  char *end;
+
+  conf->adr_sf_min = strtoul(arg, &end, 10);
+  if(*end != ':')
+    errx(EXIT_FAILURE, "adaptive data rate expects MIN:MAX spreading factors");
+  conf->adr_sf_max = strtoul(end + 1, &end, 10);
+  if(*end || conf->adr_sf_min < 7 || conf->adr_sf_max > 12 ||
+     conf->adr_sf_min > conf->adr_sf_max)
+    errx(EXIT_FAILURE, "invalid spreading factors (SF7 to SF12)");
+
+  conf->set_radio = set_radio;
+  conf->flags    |= LORAMAC_ADR;
+}
+
+/* Parse the radio settings as SF:BW[:CR] with the bandwidth in kHz. */
+static void parse_radio(struct duty_radio *radio, const char *arg)
+{
+  char *s = strdup(arg);
+  char *sf, *bw, *cr;
+  int err;
+
+  sf = strtok(s, ":");
+  bw = strtok(NULL, ":");
+  cr = strtok(NULL, ":");
+  if(!sf || !bw)
+    errx(EXIT_FAILURE, "radio settings expect SF:BW[:CR]");
+
+  radio->sf = xatou(sf, &err);
+  if(err)
+    errx(EXIT_FAILURE, "cannot parse spreading factor");
+  radio->bw = xatou(bw, &err) * 1000UL;
+  if(err)
+    errx(EXIT_FAILURE, "cannot parse bandwidth");
+  if(cr) {
+    radio->cr = xatou(cr, &err);
+    if(err)
+      errx(EXIT_FAILURE, "cannot parse coding rate");
+  }
+
+  if(duty_radio_check(radio))
+    errx(EXIT_FAILURE, "invalid radio settings (SF7 to SF12, CR 1 to 4)");
+
+  free(s);
+}
+
+/* Parse the order of the receive filters as a comma separated list. */
+static void parse_filters(enum loramac_filter *filters, const char *arg)
+{
+  char *s = strdup(arg);
+  char *name;
+  int filter;
+  int i = 0;
+
+  for(name = strtok(s, ",") ; name ; name = strtok(NULL, ",")) {
+    filter = loramac_str2filter(name);
+    if(filter < 0)
+      errx(EXIT_FAILURE, "unknown receive filter '%s'", name);
+    if(i == LORAMAC_FILTERS)
+      errx(EXIT_FAILURE, "too many receive filters");
+    filters[i++] = filter;
+  }
+  if(i != LORAMAC_FILTERS)
+    errx(EXIT_FAILURE, "expected all the receive filters (length, destination, crc, duplicate)");
+
+  free(s);
+}
+
+/* Parse the addresses of the cluster as a comma separated list of
+   hexadecimal short addresses, the node IDs follow the order. */
+static unsigned int parse_cluster(uint16_t *cluster, const char *arg)
+{
+  char *s = strdup(arg);
+  char *addr, *end;
+  unsigned int n = 0;
+  long v;
+
+  for(addr = strtok(s, ",") ; addr ; addr = strtok(NULL, ",")) {
+    v = strtol(addr, &end, 16);
+    if(*end || v < 0 || v >= 0xffff)
+      errx(EXIT_FAILURE, "invalid cluster address '%s'", addr);
+    if(n == LORAMAC_MAX_CLUSTER)
+      errx(EXIT_FAILURE, "too many nodes in the cluster (max %u)", LORAMAC_MAX_CLUSTER);
+    cluster[n++] = v;
+  }
+
+  free(s);
+  return n;
+}
+
+/* Parse the multicast groups of this node as a comma separated list
+   of group IDs, the group addresses being LORAMAC_GROUP_BASE + ID. */
+static void parse_groups(uint8_t *groups, const char *arg)
+{
+  char *s = strdup(arg);
+  char *id, *end;
+  long v;
+
+  for(id = strtok(s, ",") ; id ; id = strtok(NULL, ",")) {
+    v = strtol(id, &end, 10);
+    if(*end || v < 0 || v >= LORAMAC_MAX_GROUPS)
+      errx(EXIT_FAILURE, "invalid group ID '%s' (max %u)", id, LORAMAC_MAX_GROUPS - 1);
+    groups[v >> 3] |= 1 << (v & 7);
+  }
+
+  free(s);
+}
+
+/* Parse the beacon schedule SLOT_MS:ADDR[,ADDR...] (see LORAMAC_TDMA). */
+static void parse_beacon(struct loramac_schedule *schedule, const char *arg)
+{
+  char *s = strdup(arg);
+  char *addr, *end;
+  long v;
+
+  v = strtol(s, &end, 10);
+  if(*end != ':' || v <= 0 || v > 0xffff)
+    errx(EXIT_FAILURE, "invalid beacon slot '%s'", arg);
+  schedule->slot  = v * 1000;
+  schedule->count = 0;
+
+  for(addr = strtok(end + 1, ",") ; addr ; addr = strtok(NULL, ",")) {
+    v = strtol(addr, &end, 16);
+    if(*end || v < 0 || v >= 0xffff)
+      errx(EXIT_FAILURE, "invalid slot owner '%s'", addr);
+    if(schedule->count == LORAMAC_MAX_SLOTS)
+      errx(EXIT_FAILURE, "too many slots in the superframe (max %u)", LORAMAC_MAX_SLOTS);
+    schedule->owners[schedule->count++] = v;
+  }
+  if(!schedule->count)
+    errx(EXIT_FAILURE, "no slot in the beacon schedule");
+
+  free(s);
+}
+
+/* Parse a key ADDR:HEX (see LORAMAC_SECURE), the broadcast
+   address is the network key. */
+static void add_key(struct loramac_config *conf, const char *arg)
+{
+  static struct loramac_key keys[LORAMAC_MAX_KEYS];
+  struct loramac_key *key = &keys[conf->key_count];
+  const char *p;
+  unsigned int size = 0;
+  char *end;
+  long v;
+
+  if(conf->key_count >= LORAMAC_MAX_KEYS)
+    errx(EXIT_FAILURE, "too many keys (max %u)", LORAMAC_MAX_KEYS);
+
+  v = strtol(arg, &end, 16);
+  if(end == arg || *end != ':' || v < 0 || v > 0xffff)
+    errx(EXIT_FAILURE, "invalid key address '%s'", arg);
+  key->addr = v;
+
+  for(p = end + 1 ; *p ; p += 2) {
+    unsigned int byte;
+
+    if(size >= sizeof(key->key) || sscanf(p, "%2x", &byte) != 1 || !p[1])
+      errx(EXIT_FAILURE, "cannot parse key '%s'", arg);
+    key->key[size++] = byte;
+  }
+  if(size != sizeof(key->key))
+    errx(EXIT_FAILURE, "the key must have %zu bytes", sizeof(key->key));
+
+  conf->keys = keys;
+  conf->key_count++;
+  conf->flags |= LORAMAC_SECURE;
+}
+
+static const char *counter_path;
+
+/* Received frames are queued by the UART input thread
+   and delivered to the mode from their own thread. This
+   way a slow mode never stalls the parsing of the UART. */
+#define RX_RING_SIZE 64
+
+struct rx_frame {
+  uint16_t      src;
+  uint16_t      dst;
+  int           status;
+  unsigned int  size;
+  unsigned char payload[LORAMAC_MAX_MESSAGE];
+};
+
+static struct ring rx_ring;
+static void (*mode_cb_recv)(uint16_t src, uint16_t dst,
+                            const void *payload, unsigned int payload_size,
+                            int status, void *data);
+
+/* Record a received frame as [status (u8)][src (u16)][dst (u16)][payload],
+   the format of the messages of the unix mode. */
+static void capture_frame(uint16_t src, uint16_t dst,
+                          const void *payload, unsigned int payload_size,
+                          int status)
+{
+  unsigned char buf[sizeof(uint8_t) + sizeof(uint16_t) * 2 + LORAMAC_MAX_MESSAGE];
+  unsigned char *b = buf;
+
+  if(payload_size > LORAMAC_MAX_MESSAGE)
+    payload_size = LORAMAC_MAX_MESSAGE;
+
+  *(uint8_t  *)b = status; b += sizeof(uint8_t);
+  *(uint16_t *)b = src;    b += sizeof(uint16_t);
+  *(uint16_t *)b = dst;    b += sizeof(uint16_t);
+  memcpy(b, payload, payload_size);
+
+  capture(CAPTURE_FRAME, CAPTURE_RX, buf, b - buf + payload_size);
+}
+
+/* The ring has a single producer, so the read threads of
+   the other modules (see --module) take turns on it. */
+static pthread_mutex_t rx_producer = PTHREAD_MUTEX_INITIALIZER;
+
+static void queue_frame(uint16_t src, uint16_t dst,
+                        const void *payload, unsigned int payload_size,
+                        int status)
+{
+  struct rx_frame *frame;
+
+  if(capture_active())
+    capture_frame(src, dst, payload, payload_size, status);
+
+  frame = ring_reserve(&rx_ring);
+
+  if(!frame)
+    return; /* dropped */
+  if(payload_size > sizeof(frame->payload))
+    payload_size = sizeof(frame->payload);
+
+  frame->src    = src;
+  frame->dst    = dst;
+  frame->status = status;
+  frame->size   = payload_size;
+  memcpy(frame->payload, payload, payload_size);
+
+  ring_commit(&rx_ring);
+}
+
+static void queue_recv(uint16_t src, uint16_t dst,
+                       const void *payload, unsigned int payload_size,
+                       int status, void *data)
+{
+  UNUSED(data);
+
+  if(!radios_count()) {
+    queue_frame(src, dst, payload, payload_size, status);
+    return;
+  }
+
+  pthread_mutex_lock(&rx_producer);
+  queue_frame(src, dst, payload, payload_size, status);
+  pthread_mutex_unlock(&rx_producer);
+}
+
+/* Without the receive queue (see single in iface_mode)
+   the frames go to the mode from the receive path. */
+static void deliver_recv(uint16_t src, uint16_t dst,
+                         const void *payload, unsigned int payload_size,
+                         int status, void *data)
+{
+  if(capture_active())
+    capture_frame(src, dst, payload, payload_size, status);
+
+  mode_cb_recv(src, dst, payload, payload_size, status, data);
+}
+
+/* Serial line flags (see uart_flags) */
+static unsigned int uart_flags;
+
 static void initialize_driver(const struct context *ctx,
                               const char *device, speed_t speed)
 {
   /* initialize serial */
-  serial_init(device, speed);
-  IF_VERBOSE(ctx, printf("Serial initialized!\n"));
+  serial_init(device, speed, uart_flags);
+  IF_VERBOSE(ctx, log_msg(LOG_CAT_MAIN, LOG_LVL_DEBUG, "Serial initialized!\n"));
 
   /* configure GPIO */
   configure_gpio(ctx);
 }
 
-/* We must block those signals otherwise
-   those might be selected when the SIGALRM
-   is raised by the timers instead of the
-   main thread where the handler is configured. */
-static void thread_block_signals()
+static void * output_thread_func(void *p)
 {
-  sigset_t set;
+  struct io_thread_data *data = (struct io_thread_data *)p;
 
-  sigemptyset(&set);
-  sigaddset(&set, SIGALRM);
+  data->mode->start(data->ctx);
 
-  if(pthread_sigmask(SIG_BLOCK, &set, NULL))
-    err(EXIT_FAILURE, "cannot block signals");
+  return NULL; /* FIXME: return with error code */
 }
 
-static void * output_thread_func(void *p)
+static void * input_thread_func(void *p)
 {
   struct io_thread_data *data = (struct io_thread_data *)p;
 
-  data->mode->start(data->ctx);
+  uart_read_loop(data->ctx->mac);
 
   return NULL; /* FIXME: return with error code */
 }
 
-static void * input_thread_func(void *p)
+static void * delivery_thread_func(void *p)
 {
-  UNUSED(p);
+  const struct context        *ctx     = ((struct io_thread_data *)p)->ctx;
+  const struct loramac_config *loramac = ((struct io_thread_data *)p)->config;
+  unsigned long drops = 0;
+  int pending = 0;
 
-  thread_block_signals();
+  while(1) {
+    struct rx_frame *frame;
+
+    /* Give the mode a chance to flush the frames it
+       batched once no other frame arrived in time. */
+    if(pending) {
+      frame = ring_timedwait(&rx_ring, iface_mode.flush_timeout);
+      if(!frame) {
+        iface_mode.flush(ctx);
+        pending = 0;
+        continue;
+      }
+    }
+    else
+      frame = ring_wait(&rx_ring);
 
-  uart_read_loop();
+    mode_cb_recv(frame->src, frame->dst,
+                 frame->payload, frame->size,
+                 frame->status, loramac->data);
+    ring_release(&rx_ring);
+    pending = iface_mode.flush != NULL;
 
-  return NULL; /* FIXME: return with error code */
+    if(ring_drops(&rx_ring) != drops) {
+      drops = ring_drops(&rx_ring);
+      warnx("receive queue full, %lu frames dropped", drops);
+    }
+  }
+
+  return NULL;
+}
+
+/* Metrics are written every METRICS_INTERVAL seconds
+   when a metrics file is given (see metrics.h). */
+#define METRICS_INTERVAL 10
+
+static const char *metrics_path;
+
+/* Live statistics are published every STATS_MAP_INTERVAL
+   milliseconds when a statistics file is given (see statmap.h). */
+#define STATS_MAP_INTERVAL 100
+
+static const char *stats_map_path;
+static struct statmap stats_map;
+
+/* Statistics of the Unix mode clients (see admit.h),
+   only known with limits or --client-stats. */
+static void write_clients(struct metrics *m)
+{
+  struct admit_stats c;
+  char labels[sizeof(c.addr) + 32];
+  unsigned int i;
+
+  metrics_help(m, "loramac_client_messages_total", "counter", "Send messages accepted from each client");
+  metrics_help(m, "loramac_client_bytes_total", "counter", "Bytes of the send messages accepted from each client");
+  metrics_help(m, "loramac_client_completed_total", "counter", "Send messages of each client completed by outcome");
+  metrics_help(m, "loramac_client_rejected_total", "counter", "Send messages of each client rejected by its limits");
+  metrics_help(m, "loramac_client_inflight", "gauge", "Send messages of each client in flight");
+  metrics_help(m, "loramac_client_inflight_max", "gauge", "Maximum of loramac_client_inflight");
+  metrics_help(m, "loramac_client_airtime_us_total", "counter", "Estimated time on air of the messages of each client");
+  for(i = 0 ; i < ADMIT_MAX_CLIENTS ; i++) {
+    if(admit_read(i, &c) < 0)
+      continue;
+
+    snprintf(labels, sizeof(labels), "client=\"%s\"", c.addr);
+    metrics_value(m, "loramac_client_messages_total", labels, c.messages);
+    metrics_value(m, "loramac_client_bytes_total", labels, c.bytes);
+    metrics_value(m, "loramac_client_inflight", labels, c.inflight);
+    metrics_value(m, "loramac_client_inflight_max", labels, c.inflight_max);
+    snprintf(labels, sizeof(labels), "client=\"%s\"", c.addr);
+    metrics_value(m, "loramac_client_airtime_us_total", labels, c.airtime);
+    snprintf(labels, sizeof(labels), "client=\"%s\",outcome=\"sent\"", c.addr);
+    metrics_value(m, "loramac_client_completed_total", labels, c.sent);
+    snprintf(labels, sizeof(labels), "client=\"%s\",outcome=\"failed\"", c.addr);
+    metrics_value(m, "loramac_client_completed_total", labels, c.failed);
+    snprintf(labels, sizeof(labels), "client=\"%s\",reason=\"credits\"", c.addr);
+    metrics_value(m, "loramac_client_rejected_total", labels, c.rejected_window);
+    snprintf(labels, sizeof(labels), "client=\"%s\",reason=\"rate\"", c.addr);
+    metrics_value(m, "loramac_client_rejected_total", labels, c.rejected_rate);
+  }
+}
+
+static void write_metrics(const struct loramac_ctx *mac, const char *path)
+{
+  struct loramac_counters c;
+  struct timer_jitter jitter;
+  struct uart_stats u;
+  struct metrics m;
+  char labels[32];
+  char device[128];
+  unsigned int i;
+
+  if(metrics_open(&m, path) < 0) {
+    warn("cannot open %s", path);
+    return;
+  }
+  if(stats_map_path)
+    metrics_map(&m, &stats_map);
+
+  loramac_counters(mac, &c);
+  uart_stats(&u);
+
+  metrics_help(&m, "loramac_tx_frames_total", "counter", "Frames sent with retransmissions");
+  metrics_value(&m, "loramac_tx_frames_total", NULL, c.tx_frames);
+  metrics_help(&m, "loramac_tx_noack_total", "counter", "Sends that gave up on an ACK");
+  metrics_value(&m, "loramac_tx_noack_total", NULL, c.tx_noack);
+  metrics_help(&m, "loramac_tx_attempts_total", "counter", "Sends acknowledged after each number of attempts");
+  for(i = 0 ; i < LORAMAC_MAX_ATTEMPTS ; i++) {
+    snprintf(labels, sizeof(labels), "attempts=\"%u%s\"", i + 1,
+             i + 1 == LORAMAC_MAX_ATTEMPTS ? "+" : "");
+    metrics_value(&m, "loramac_tx_attempts_total", labels, c.tx_attempts[i]);
+  }
+  metrics_help(&m, "loramac_tx_backoff_us_total", "counter", "Time spent backing off before retransmissions");
+  metrics_value(&m, "loramac_tx_backoff_us_total", NULL, c.tx_backoff_us);
+  metrics_help(&m, "loramac_tx_busy_total", "counter", "Channel found busy before a frame");
+  metrics_value(&m, "loramac_tx_busy_total", NULL, c.tx_busy);
+  metrics_help(&m, "loramac_tx_acks_total", "counter", "ACK and block ACK frames sent");
+  metrics_value(&m, "loramac_tx_acks_total", NULL, c.tx_acks);
+  metrics_help(&m, "loramac_tx_piggyback_total", "counter", "ACKs carried by data frames");
+  metrics_value(&m, "loramac_tx_piggyback_total", NULL, c.tx_piggyback);
+  metrics_help(&m, "loramac_tx_parity_total", "counter", "Parity fragments sent");
+  metrics_value(&m, "loramac_tx_parity_total", NULL, c.tx_parity);
+  metrics_help(&m, "loramac_tx_unrepaired_total", "counter", "Lost fragments left to the parity");
+  metrics_value(&m, "loramac_tx_unrepaired_total", NULL, c.tx_unrepaired);
+  metrics_help(&m, "loramac_tx_beacons_total", "counter", "Beacons sent (see --beacon)");
+  metrics_value(&m, "loramac_tx_beacons_total", NULL, c.tx_beacons);
+  metrics_help(&m, "loramac_tx_slot_us_total", "counter", "Time spent waiting for our slot (see --tdma)");
+  metrics_value(&m, "loramac_tx_slot_us_total", NULL, c.tx_slot_us);
+  metrics_help(&m, "loramac_adr_steps_total", "counter", "Changes of the spreading factor of a destination");
+  metrics_value(&m, "loramac_adr_steps_total", "direction=\"faster\"", c.tx_adr_faster);
+  metrics_value(&m, "loramac_adr_steps_total", "direction=\"slower\"", c.tx_adr_slower);
+  metrics_help(&m, "loramac_ack_delay_us", "summary", "Delay of the ACKs to frames sent once");
+  metrics_value(&m, "loramac_ack_delay_us_sum", NULL, c.ack_delay_sum);
+  metrics_value(&m, "loramac_ack_delay_us_count", NULL, c.ack_delays);
+  metrics_help(&m, "loramac_ack_delay_max_us", "gauge", "Maximum of loramac_ack_delay_us");
+  metrics_value(&m, "loramac_ack_delay_max_us", NULL, c.ack_delay_max);
+  metrics_help(&m, "loramac_rx_frames_total", "counter", "Data frames received");
+  metrics_value(&m, "loramac_rx_frames_total", NULL, c.rx_frames);
+  metrics_help(&m, "loramac_rx_crc_errors_total", "counter", "Data frames received with an invalid CRC");
+  metrics_value(&m, "loramac_rx_crc_errors_total", NULL, c.rx_crc);
+  metrics_help(&m, "loramac_rx_invalid_total", "counter", "Data frames received with an invalid header");
+  metrics_value(&m, "loramac_rx_invalid_total", NULL, c.rx_invalid);
+  metrics_help(&m, "loramac_rx_forged_total", "counter", "Messages received with an invalid MIC (see --key)");
+  metrics_value(&m, "loramac_rx_forged_total", NULL, c.rx_forged);
+  metrics_help(&m, "loramac_rx_replays_total", "counter", "Messages received with a counter already seen (see --key)");
+  metrics_value(&m, "loramac_rx_replays_total", NULL, c.rx_replays);
+  metrics_help(&m, "loramac_rx_duplicates_total", "counter", "Retransmissions suppressed");
+  metrics_value(&m, "loramac_rx_duplicates_total", NULL, c.rx_dups);
+  metrics_help(&m, "loramac_rx_piggyback_total", "counter", "ACKs received in data frames");
+  metrics_value(&m, "loramac_rx_piggyback_total", NULL, c.rx_piggyback);
+  metrics_help(&m, "loramac_rx_beacons_total", "counter", "Beacons received (see --tdma)");
+  metrics_value(&m, "loramac_rx_beacons_total", NULL, c.rx_beacons);
+  metrics_help(&m, "loramac_rx_recovered_total", "counter", "Fragments rebuilt from the parity");
+  metrics_value(&m, "loramac_rx_recovered_total", NULL, c.rx_recovered);
+  metrics_help(&m, "loramac_rx_resync_total", "counter", "Losses of the frame boundary on UART");
+  metrics_value(&m, "loramac_rx_resync_total", NULL, c.rx_resync);
+  metrics_help(&m, "loramac_rx_drops_total", "counter", "Data frames dropped by each receive filter");
+  for(i = 0 ; i < LORAMAC_FILTERS ; i++) {
+    snprintf(labels, sizeof(labels), "filter=\"%s\"", loramac_filter2str(i));
+    metrics_value(&m, "loramac_rx_drops_total", labels, c.rx_drops[i]);
+  }
+  metrics_help(&m, "loramac_rx_dropped_total", "counter", "Frames dropped by the receive queue");
+  metrics_value(&m, "loramac_rx_dropped_total", NULL, ring_drops(&rx_ring));
+  if(mac->conf.flags & LORAMAC_DUTY) {
+    long budget = loramac_duty_budget(mac);
+
+    metrics_help(&m, "loramac_duty_budget_us", "gauge", "Time on air left in the duty cycle budget");
+    metrics_value(&m, "loramac_duty_budget_us", NULL, budget > 0 ? budget : 0);
+  }
+
+  metrics_help(&m, "uart_tx_bytes_total", "counter", "Bytes written to the UART");
+  metrics_value(&m, "uart_tx_bytes_total", NULL, u.tx_bytes);
+  metrics_help(&m, "uart_rx_bytes_total", "counter", "Bytes read from the UART");
+  metrics_value(&m, "uart_rx_bytes_total", NULL, u.rx_bytes);
+  metrics_help(&m, "uart_overruns_total", "counter", "Bytes lost by the serial driver");
+  metrics_value(&m, "uart_overruns_total", NULL, u.overruns);
+  metrics_help(&m, "uart_errors_total", "counter", "Bytes lost or damaged on the UART by cause");
+  metrics_value(&m, "uart_errors_total", "type=\"overrun\"", u.hw_overruns);
+  metrics_value(&m, "uart_errors_total", "type=\"buf_overrun\"", u.buf_overruns);
+  metrics_value(&m, "uart_errors_total", "type=\"frame\"", u.frame_errors);
+  metrics_value(&m, "uart_errors_total", "type=\"parity\"", u.parity_errors);
+  metrics_help(&m, "uart_tx_queue_bytes", "gauge", "Bytes still queued on the UART after the last frame");
+  metrics_value(&m, "uart_tx_queue_bytes", NULL, u.tx_queued);
+  metrics_help(&m, "uart_tx_queue_max_bytes", "gauge", "Maximum of uart_tx_queue_bytes");
+  metrics_value(&m, "uart_tx_queue_max_bytes", NULL, u.tx_queued_max);
+  metrics_help(&m, "uart_rx_queue_bytes", "gauge", "Bytes received on the UART but not read yet");
+  metrics_value(&m, "uart_rx_queue_bytes", NULL, u.rx_queued);
+  metrics_help(&m, "uart_rx_queue_max_bytes", "gauge", "Maximum of uart_rx_queue_bytes, also sampled after full reads");
+  metrics_value(&m, "uart_rx_queue_max_bytes", NULL, u.rx_queued_max);
+  metrics_help(&m, "uart_fifo_bytes", "gauge", "Hardware FIFO size reported by the serial driver");
+  metrics_value(&m, "uart_fifo_bytes", NULL, u.fifo_size);
+  metrics_help(&m, "uart_spin_us_total", "counter", "Time spent spinning on UART reads (see --busy-poll)");
+  metrics_value(&m, "uart_spin_us_total", NULL, u.spin_us);
+  metrics_help(&m, "uart_spin_sleeps_total", "counter", "Spins on UART reads that ran out of budget");
+  metrics_value(&m, "uart_spin_sleeps_total", NULL, u.spin_sleeps);
+
+  if(radios_count()) {
+    metrics_help(&m, "loramac_module_tx_frames_total", "counter", "Frames sent by each other module (see --module)");
+    metrics_help(&m, "loramac_module_rx_frames_total", "counter", "Data frames received by each other module");
+    metrics_help(&m, "loramac_module_tx_noack_total", "counter", "Sends of each other module that gave up on an ACK");
+    for(i = 0 ; i < radios_count() ; i++) {
+      struct radio *r = radios_get(i);
+
+      loramac_counters(&r->mac, &c);
+      snprintf(device, sizeof(device), "device=\"%s\"", r->device);
+      metrics_value(&m, "loramac_module_tx_frames_total", device, c.tx_frames);
+      metrics_value(&m, "loramac_module_rx_frames_total", device, c.rx_frames);
+      metrics_value(&m, "loramac_module_tx_noack_total", device, c.tx_noack);
+    }
+  }
+
+  timer_jitter(&jitter);
+  metrics_help(&m, "timer_late_us", "summary", "Wakeup lateness of the threads on timer deadlines");
+  metrics_value(&m, "timer_late_us_sum", NULL, jitter.late_sum);
+  metrics_value(&m, "timer_late_us_count", NULL, jitter.expiries);
+  metrics_help(&m, "timer_late_max_us", "gauge", "Maximum of timer_late_us");
+  metrics_value(&m, "timer_late_max_us", NULL, jitter.late_max);
+
+  if(iface_mode.single) {
+    struct loop_stats l;
+
+    loop_stats(&l);
+    metrics_help(&m, "loop_wakeups_total", "counter", "Wakeups of the single-threaded event loop");
+    metrics_value(&m, "loop_wakeups_total", NULL, l.wakeups);
+    metrics_help(&m, "loop_waits_total", "counter", "Waits of the driver serving the UART alone");
+    metrics_value(&m, "loop_waits_total", NULL, l.waits);
+  }
+
+  ticker_jitter(&ticker, &jitter.expiries, &jitter.late_sum, &jitter.late_max);
+  metrics_help(&m, "ticker_late_us", "summary", "Lateness of the protocol timers on their deadline");
+  metrics_value(&m, "ticker_late_us_sum", NULL, jitter.late_sum);
+  metrics_value(&m, "ticker_late_us_count", NULL, jitter.expiries);
+  metrics_help(&m, "ticker_late_max_us", "gauge", "Maximum of ticker_late_us");
+  metrics_value(&m, "ticker_late_max_us", NULL, jitter.late_max);
+  metrics_help(&m, "ticker_wakeups_total", "counter", "Wakeups of the protocol timer thread");
+  metrics_value(&m, "ticker_wakeups_total", NULL, ticker_wakeups(&ticker));
+
+  write_clients(&m);
+
+  metrics_wakeups(&m);
+
+  if(metrics_close(&m) < 0)
+    warn("cannot write %s", path);
+}
+
+static void open_stats_map(void)
+{
+  if(statmap_open(&stats_map, stats_map_path, STATMAP_MAX) < 0)
+    err(EXIT_FAILURE, "cannot create %s", stats_map_path);
+}
+
+static void * metrics_thread_func(void *p)
+{
+  struct io_thread_data *data = (struct io_thread_data *)p;
+  unsigned int tick, ticks = stats_map_path ? METRICS_INTERVAL * 1000 / STATS_MAP_INTERVAL : 1;
+
+  /* The metrics file is written on the first tick of each
+     interval, the statistics map is updated on every tick.
+     Without the map each tick is a whole interval. */
+  for(tick = 0 ; ; tick = (tick + 1) % ticks) {
+    write_metrics(data->ctx->mac, tick ? NULL : metrics_path);
+    if(stats_map_path)
+      usleep(STATS_MAP_INTERVAL * 1000);
+    else
+      sleep(METRICS_INTERVAL);
+  }
+
+  return NULL;
+}
+
+/* Modes that run alone write the metrics from
+   a timer of the event loop instead (see loop.h). */
+static int metrics_timer;
+
+static void metrics_tick(void *data)
+{
+  static unsigned int tick;
+  unsigned int ticks = stats_map_path ? METRICS_INTERVAL * 1000 / STATS_MAP_INTERVAL : 1;
+
+  write_metrics(data, tick ? NULL : metrics_path);
+  tick = (tick + 1) % ticks;
+  loop_arm(metrics_timer, stats_map_path ? STATS_MAP_INTERVAL * 1000UL : METRICS_INTERVAL * 1000000UL);
+}
+
+/* Schedule announced by the gateway with --beacon. */
+static struct loramac_schedule beacon;
+
+static void * beacon_thread_func(void *p)
+{
+  struct io_thread_data *data = (struct io_thread_data *)p;
+  unsigned long period = (unsigned long)beacon.slot * beacon.count;
+  unsigned long next = clock_us(), now;
+  int ret;
+
+  /* A beacon at the end of each superframe. The beacon waits
+     for the MAC lock, this is why it is not a ticker callback. */
+  for(;;) {
+    ret = loramac_send_beacon(data->ctx->mac, &beacon);
+    if(ret != LORAMAC_SND_SUCCESS)
+      log_msg(LOG_CAT_MAIN, LOG_LVL_WARN, "Cannot send beacon: %s\n", loramac_send2str(ret));
+
+    next += period;
+    now   = clock_us();
+    if(next <= now)
+      next = now + period; /* too late, skip a superframe */
+    mac_usleep(next - now, NULL);
+  }
+
+  return NULL;
 }
 
 static void start_io_threads(const struct context *ctx,
                              const struct loramac_config *loramac)
 {
-  pthread_t output_thread, input_thread;
+  pthread_t output_thread, input_thread, ticker_thread, delivery_thread, metrics_thread, beacon_thread;
   int err;
 
   struct io_thread_data data = (struct io_thread_data){
@@ -141,16 +847,36 @@ static void start_io_threads(const struct context *ctx,
     .config = loramac
   };
 
-  thread_block_signals();
-
-  err  = pthread_create(&output_thread, NULL, output_thread_func, &data);
-  err |= pthread_create(&input_thread, NULL, input_thread_func, &data);
+  err  = pthread_create(&output_thread, rt_attr(RT_TX), output_thread_func, &data);
+  err |= pthread_create(&input_thread, rt_attr(RT_RX), input_thread_func, &data);
+  err |= pthread_create(&ticker_thread, rt_attr(RT_TIMER), ticker_loop, &ticker);
+  err |= pthread_create(&delivery_thread, rt_attr(RT_APP), delivery_thread_func, &data);
+  if(stats_map_path)
+    open_stats_map();
+  if(metrics_path || stats_map_path)
+    err |= pthread_create(&metrics_thread, NULL, metrics_thread_func, &data);
+  if(beacon.count)
+    err |= pthread_create(&beacon_thread, rt_attr(RT_TX), beacon_thread_func, &data);
   if(err)
     errx(EXIT_FAILURE, "cannot create threads");
+  radios_start(rt_attr(RT_RX));
 
   pthread_join(output_thread, NULL);
 }
 
+/* Run a mode alone in this thread (see single in iface_mode). */
+static void start_single(const struct context *ctx)
+{
+  if(stats_map_path)
+    open_stats_map();
+  if(metrics_path || stats_map_path) {
+    metrics_timer = loop_timer(metrics_tick, ctx->mac);
+    loop_arm(metrics_timer, 0);
+  }
+
+  iface_mode.start(ctx);
+}
+
 static uint8_t rnd_seqno(void)
 {
   return arc4random_uniform(0xff);
@@ -165,10 +891,11 @@ static void display_summary(const struct iface_mode *mode,
                             const char *speed)
 {
   unsigned long flag;
+  unsigned int i;
 
   printf(PACKAGE_VERSION "\n");
   printf("Using %s mode on %s @%s bauds.\n", mode->name, dev, speed);
-  if((ctx->gpio_irq > 0) | (ctx->gpio_cts > 0) | (ctx->gpio_reset > 0)) {
+  if((ctx->gpio_irq > 0) | (ctx->gpio_cts > 0) | (ctx->gpio_reset > 0) | (ctx->gpio_ready > 0)) {
     printf("GPIO configured on:\n");
     if(ctx->gpio_irq > 0)
       printf("  - IRQ: %d\n", ctx->gpio_irq);
@@ -176,17 +903,58 @@ static void display_summary(const struct iface_mode *mode,
       printf("  - CTS: %d\n", ctx->gpio_cts);
     if(ctx->gpio_reset > 0)
       printf("  - RESET: %d\n", ctx->gpio_reset);
+    if(ctx->gpio_ready > 0)
+      printf("  - READY: %d\n", ctx->gpio_ready);
   }
   printf(" iface (source) MAC address: %04X\n", conf->mac_address);
   printf(" destination MAC address   : %04X\n", dst_mac);
   printf(" ACK timeout               : %d us\n", conf->timeout);
   printf(" SIFS                      : %d us\n", conf->sifs);
+  printf(" UART gap                  : %d us\n", conf->gap);
   printf(" Max. retransmissions      : %d tries\n", conf->retrans);
+  if(conf->bcast_repeat > 1)
+    printf(" Broadcast copies          : %u (jitter %u us)\n", conf->bcast_repeat, conf->bcast_jitter);
+  if(conf->backoff != LORAMAC_BACKOFF_NONE)
+    printf(" Backoff                   : %s (slot %u us, max %u us)\n",
+           loramac_backoff2str(conf->backoff), conf->backoff_slot, conf->backoff_max);
   printf(" flags                     : 0x%08lx\n", conf->flags);
-  for(flag = 0x1 ; flag <= LORAMAC_NOACK ; flag <<= 1) {
+  for(flag = 0x1 ; flag <= LORAMAC_SECURE ; flag <<= 1) {
     if(conf->flags & flag)
       printf("  - %s\n", loramac_flag2str(flag));
   }
+  if(conf->flags & LORAMAC_COMPACT)
+    printf(" cluster                   : %u nodes\n", conf->cluster_size);
+  for(i = 0 ; i < LORAMAC_MAX_GROUPS ; i++) {
+    if(conf->groups[i >> 3] & 1 << (i & 7))
+      printf(" multicast group           : %04X\n", LORAMAC_GROUP_BASE + i);
+  }
+  if(conf->flags & LORAMAC_FEC) {
+    if(conf->fec_group)
+      printf(" parity group              : %u fragments\n", conf->fec_group);
+    else
+      printf(" parity group              : adaptive\n");
+  }
+  if(conf->flags & LORAMAC_TDMA)
+    printf(" slot guard                : %u us\n", conf->tdma_guard);
+  if(conf->flags & LORAMAC_SECURE)
+    printf(" keys                      : %u (first counter %08X)\n", conf->key_count,
+           conf->counter_store ? *conf->counter_store : conf->counter);
+  if(beacon.count)
+    printf(" beacon                    : %u slots of %u ms\n", beacon.count, beacon.slot / 1000);
+  for(i = 0 ; i < radios_count() ; i++)
+    printf(" module                    : %s (%u nodes)\n",
+           radios_get(i)->device, radios_get(i)->count);
+  if(conf->flags & LORAMAC_ADR)
+    printf(" adaptive data rate        : SF%u to SF%u\n", conf->adr_sf_min, conf->adr_sf_max);
+  if(conf->flags & LORAMAC_DUTY) {
+    const struct duty_band *band = duty_band_lookup(conf->frequency);
+
+    printf(" radio                     : SF%u %lu kHz CR 4/%u\n",
+           conf->radio.sf, conf->radio.bw / 1000, conf->radio.cr + 4);
+    if(band)
+      printf(" duty cycle                : %u.%u%% (%s)\n",
+             band->permille / 10, band->permille % 10, band->name);
+  }
 }
 
 static void print_help(const char *name, const char *mode_name,
@@ -203,15 +971,59 @@ static void print_help(const char *name, const char *mode_name,
     { 'i', "invalid",         "Do not filter invalid packets (packet header, CRC)" },
     { 'b', "no-broadcast",    "Ignore broadcast messages" },
     { 'a', "no-ack",          "Do not answer nor expect ACKs" },
+    { 'w', "window",          "Use block ACKs (sliding window ARQ)" },
+    { 0,   "back-hold",       "Hold block ACKs up to this many microseconds for the end of a burst" },
+    { 'f', "frag",            "Fragment messages larger than a frame" },
+    { 'z', "compress",        "Compress messages when they shrink" },
+    { 0,   "dict",            "Static compression dictionary (file)" },
     { 't', "timeout",         "ACK timeout in microseconds (default 4s)" },
+    { 0,   "rto",             "Estimate the ACK timeout of each destination (timeout is the upper bound)" },
     { 's', "sifs",            "Short Inter Frame Spacing time in microseconds (default 2s)" },
+    { 0,   "gap",             "Drop partial frames after this UART silence in microseconds (default 50ms)" },
+    { 0,   "duty",            "Stay within the EU868 duty cycle of the channel frequency in MHz" },
+    { 0,   "radio",           "LoRa SF:BW[:CR] for the time on air (BW in kHz, default 7:125:1)" },
+    { 0,   "adr",             "Adapt the spreading factor of each destination within MIN:MAX" },
+    { 0,   "duty-wait",       "Give up on the duty cycle after this time in ms (default: wait)" },
     { 'S', "seqno",           "Initial sequence number (default: random)" },
     { 'r', "retransmissions", "Maximum number of retransmissions (default 3)" },
+    { 0,   "backoff",         "Delay before retransmissions (none, exp, jitter, address)" },
+    { 0,   "backoff-slot",    "Backoff of the first retransmission in microseconds (default 500ms)" },
+    { 0,   "backoff-max",     "Maximum backoff in microseconds (default 8s)" },
+    { 0,   "lbt",             "Listen before talk, defer while an overheard exchange is not over" },
+    { 0,   "lbt-slot",        "Listen before talk slot in microseconds (default 100ms)" },
+    { 0,   "lbt-tries",       "Random backoffs before giving up on a busy channel (default 4)" },
+    { 0,   "piggyback",       "Carry ACKs in data frames sent back within SIFS (on all nodes)" },
+    { 0,   "cluster",         "Compact headers with node IDs from this list of addresses (same on all nodes)" },
+    { 0,   "groups",          "Receive the multicast groups of this list of IDs (addresses FE00 + ID)" },
+    { 0,   "fec",             "Parity fragments to rebuild a lost fragment (with --frag, on all nodes)" },
+    { 0,   "fec-group",       "Fragments per parity fragment (default: from the loss rate)" },
+    { 0,   "tdma",            "Send in our slots of the beacon schedule (on all nodes)" },
+    { 0,   "tdma-guard",      "Guard time at both ends of a slot in microseconds (default 20ms)" },
+    { 0,   "beacon",          "Broadcast the schedule SLOT_MS:ADDR[,ADDR...] each superframe (gateway)" },
+    { 0,   "bcast-repeat",    "Copies of each broadcast frame (default 1)" },
+    { 0,   "bcast-jitter",    "Maximum random delay before each broadcast copy in microseconds (default 200ms)" },
+    { 0,   "module",          "Drive another LoRa module DEVICE:ADDR[,ADDR...] for these nodes (on its own channel)" },
+    { 0,   "filters",         "Order of the receive filters (default length,destination,crc,duplicate)" },
+    { 0,   "key",             "Encrypt and authenticate with the AES key ADDR:HEX of a peer (FFFF for the network)" },
+    { 0,   "counter-file",    "Keep the security counter in this file across restarts (see --key)" },
     { 'B', "baud",            "Specify the baud rate (default 9600)" },
     { 'd', "destination",     "Destination MAC (hex. short address, default to broadcast)" },
     { 0,   "irq",             "IRQ RPi GPIO" },
     { 0,   "cts",             "CTS RPi GPIO" },
     { 0,   "reset",           "RESET RPi GPIO" },
+    { 0,   "reset-pulse",     "Low time of the RESET GPIO in microseconds (default 30000)" },
+    { 0,   "ready",           "READY RPi GPIO, high once the modem is up after a reset" },
+    { 0,   "gpio-chip",       "Drive the GPIOs through a character device (e.g. /dev/gpiochip0)" },
+    { 0,   "drain",           "Wait for each frame to leave the UART before arming timers" },
+    { 0,   "low-latency",     "Do not let the serial driver delay received bytes" },
+    { 0,   "busy-poll",       "Spin on the UART for N microseconds before sleeping (default 0, off)" },
+    { 0,   "rtscts",          "Enable RTS/CTS flow control (higher baud rates)" },
+    { 0,   "rt",              "Tune a thread ROLE:PRIO[:CPU[:STACK]] (rx/tx/timer/app, SCHED_FIFO, KiB)" },
+    { 0,   "mlock",           "Lock the process memory" },
+    { 0,   "capture",         "Record the UART traffic to a pcapng file" },
+    { 0,   "log-rate",        "Limit each log category to N messages per second" },
+    { 0,   "metrics",         "Write Prometheus metrics to a file every 10s" },
+    { 0,   "stats-map",       "Publish live statistics in a file to map (e.g. next to the driver socket in /run)" },
     { 0, NULL, NULL }
   };
 
@@ -228,35 +1040,59 @@ int main(int argc, char *argv[])
   const char *prog_name;
   const char *device;
   const char *speed_str = strdup("9600");
+  static struct loramac_ctx mac;
   struct context ctx = {
     .verbose    = 0,
     .dst_mac    = 0xffff,
     .gpio_irq   = -1,
     .gpio_cts   = -1,
     .gpio_reset = -1,
-    .size       = 4,
-    .count      = 0,
-    .interval   = 200,
-    .flood      = 0
+    .gpio_ready = -1,
+    .reset_pulse = 30000,
+    .mac        = &mac
   };
   struct loramac_config loramac = {
-    .uart_send   = uart_send,
-    .start_timer = start_timer,
-    .stop_timer  = stop_timer,
-    .wait_timer  = wait_timer,
-    .lock        = lock,
-    .unlock      = unlock,
-    .htons       = htons,
-    .ntohs       = ntohs,
-    .recv_frame  = loramac_recv_frame,
-    .seqno       = rnd_seqno(),
-    .retrans     = 3,
-    .timeout     = 4000000, /* 4 seconds */
-    .sifs        = 2000000, /* 2 seconds */
-    .flags       = 0,
-    .data        = &ctx
+    .uart_send    = uart_send,
+    .uart_sendv   = uart_sendv,
+    .start_timer  = start_timer,
+    .stop_timer   = stop_timer,
+    .wait_timer   = wait_timer,
+    .clock        = mac_clock,
+    .lock         = lock,
+    .unlock       = unlock,
+    .schedule_ack = schedule_ack,
+    .ack_lock     = ack_lock,
+    .ack_unlock   = ack_unlock,
+    .htons        = htons,
+    .ntohs        = ntohs,
+    .compress     = compress,
+    .decompress   = decompress,
+    .radio        = DUTY_RADIO_DEFAULT,
+    .duty_wait    = ULONG_MAX, /* defer for as long as needed */
+    .usleep       = mac_usleep,
+    .recv_frame   = loramac_recv_frame,
+    .seqno        = rnd_seqno(),
+    .counter      = (uint32_t)time(NULL) << 4, /* grows across restarts (see --counter-file) */
+    .retrans      = 3,
+    .backoff      = LORAMAC_BACKOFF_NONE,
+    .backoff_slot = 500000,  /* 500 ms */
+    .backoff_max  = 8000000, /* 8 seconds */
+    .backoff_seed = arc4random(),
+    .lbt_slot     = 100000, /* 100 ms */
+    .lbt_tries    = 4,
+    .bcast_repeat = 1,
+    .bcast_jitter = 200000, /* 200 ms */
+    .tdma_guard   = 20000,  /* 20 ms */
+    .timeout      = 4000000, /* 4 seconds */
+    .sifs         = 2000000, /* 2 seconds */
+    .gap          = 50000,   /* 50 milliseconds */
+    .flags        = 0,
+    .data         = &ctx
   };
+  enum loramac_filter filters[LORAMAC_FILTERS];
+  uint16_t cluster[LORAMAC_MAX_CLUSTER];
   speed_t speed    = B9600;
+  unsigned int log_rate = 0;
   int exit_status  = EXIT_FAILURE;
   int err;
   unsigned long val;
@@ -266,6 +1102,47 @@ int main(int argc, char *argv[])
     OPT_IRQ,
     OPT_CTS,
     OPT_RESET,
+    OPT_RESET_PULSE,
+    OPT_READY,
+    OPT_GPIO_CHIP,
+    OPT_DICT,
+    OPT_METRICS,
+    OPT_STATS_MAP,
+    OPT_DRAIN,
+    OPT_LOW_LATENCY,
+    OPT_BUSY_POLL,
+    OPT_RTSCTS,
+    OPT_RT,
+    OPT_MLOCK,
+    OPT_CAPTURE,
+    OPT_GAP,
+    OPT_LOG_RATE,
+    OPT_DUTY,
+    OPT_RTO,
+    OPT_BACKOFF,
+    OPT_BACKOFF_SLOT,
+    OPT_BACKOFF_MAX,
+    OPT_LBT,
+    OPT_LBT_SLOT,
+    OPT_LBT_TRIES,
+    OPT_BCAST_REPEAT,
+    OPT_BCAST_JITTER,
+    OPT_RADIO,
+    OPT_ADR,
+    OPT_DUTY_WAIT,
+    OPT_FILTERS,
+    OPT_PIGGYBACK,
+    OPT_BACK_HOLD,
+    OPT_CLUSTER,
+    OPT_GROUPS,
+    OPT_FEC,
+    OPT_FEC_GROUP,
+    OPT_TDMA,
+    OPT_TDMA_GUARD,
+    OPT_BEACON,
+    OPT_MODULE,
+    OPT_KEY,
+    OPT_COUNTER_FILE,
   };
 
   /* Common options used by all modes. */
@@ -282,11 +1159,42 @@ int main(int argc, char *argv[])
     { "invalid", no_argument, NULL, 'i' },
     { "no-broadcast", no_argument, NULL, 'b' },
     { "no-ack", no_argument, NULL, 'a' },
+    { "window", no_argument, NULL, 'w' },
+    { "back-hold", required_argument, NULL, OPT_BACK_HOLD },
+    { "frag", no_argument, NULL, 'f' },
+    { "compress", no_argument, NULL, 'z' },
+    { "dict", required_argument, NULL, OPT_DICT },
 
     { "timeout", required_argument, NULL, 't' },
+    { "rto", no_argument, NULL, OPT_RTO },
     { "sifs", required_argument, NULL, 's' },
+    { "gap", required_argument, NULL, OPT_GAP },
+    { "duty", required_argument, NULL, OPT_DUTY },
+    { "radio", required_argument, NULL, OPT_RADIO },
+    { "adr", required_argument, NULL, OPT_ADR },
+    { "duty-wait", required_argument, NULL, OPT_DUTY_WAIT },
     { "seqno", required_argument, NULL, 'S' },
     { "retransmissions", required_argument, NULL, 'r' },
+    { "backoff", required_argument, NULL, OPT_BACKOFF },
+    { "backoff-slot", required_argument, NULL, OPT_BACKOFF_SLOT },
+    { "backoff-max", required_argument, NULL, OPT_BACKOFF_MAX },
+    { "lbt", no_argument, NULL, OPT_LBT },
+    { "lbt-slot", required_argument, NULL, OPT_LBT_SLOT },
+    { "lbt-tries", required_argument, NULL, OPT_LBT_TRIES },
+    { "piggyback", no_argument, NULL, OPT_PIGGYBACK },
+    { "cluster", required_argument, NULL, OPT_CLUSTER },
+    { "groups", required_argument, NULL, OPT_GROUPS },
+    { "fec", no_argument, NULL, OPT_FEC },
+    { "fec-group", required_argument, NULL, OPT_FEC_GROUP },
+    { "tdma", no_argument, NULL, OPT_TDMA },
+    { "tdma-guard", required_argument, NULL, OPT_TDMA_GUARD },
+    { "beacon", required_argument, NULL, OPT_BEACON },
+    { "module", required_argument, NULL, OPT_MODULE },
+    { "key", required_argument, NULL, OPT_KEY },
+    { "counter-file", required_argument, NULL, OPT_COUNTER_FILE },
+    { "bcast-repeat", required_argument, NULL, OPT_BCAST_REPEAT },
+    { "bcast-jitter", required_argument, NULL, OPT_BCAST_JITTER },
+    { "filters", required_argument, NULL, OPT_FILTERS },
     { "baud", required_argument, NULL, 'B' },
     { "destination", required_argument, NULL, 'd' },
 
@@ -294,6 +1202,19 @@ int main(int argc, char *argv[])
     { "irq", required_argument, NULL, OPT_IRQ },
     { "cts", required_argument, NULL, OPT_CTS },
     { "reset", required_argument, NULL, OPT_RESET },
+    { "reset-pulse", required_argument, NULL, OPT_RESET_PULSE },
+    { "ready", required_argument, NULL, OPT_READY },
+    { "gpio-chip", required_argument, NULL, OPT_GPIO_CHIP },
+    { "drain", no_argument, NULL, OPT_DRAIN },
+    { "low-latency", no_argument, NULL, OPT_LOW_LATENCY },
+    { "busy-poll", required_argument, NULL, OPT_BUSY_POLL },
+    { "rtscts", no_argument, NULL, OPT_RTSCTS },
+    { "rt", required_argument, NULL, OPT_RT },
+    { "mlock", no_argument, NULL, OPT_MLOCK },
+    { "capture", required_argument, NULL, OPT_CAPTURE },
+    { "log-rate", required_argument, NULL, OPT_LOG_RATE },
+    { "metrics", required_argument, NULL, OPT_METRICS },
+    { "stats-map", required_argument, NULL, OPT_STATS_MAP },
     { NULL, 0, NULL, 0 }
   };
 
@@ -301,7 +1222,7 @@ int main(int argc, char *argv[])
      structure are merged from both
      the common options and the mode
      (stdio, ping, ...) options. */
-  char * optstring_merged    = strcat_dup("hVvpibat:s:S:r:B:d:", iface_mode.optstring);
+  char * optstring_merged    = strcat_dup("hVvpibawfzt:s:S:r:B:d:", iface_mode.optstring);
   struct option *opts_merged = merge_opts(common_opts, iface_mode.long_opts);
 
   prog_name = basename(argv[0]);
@@ -338,6 +1259,21 @@ int main(int argc, char *argv[])
       else if(!rpi_gpio_check(ctx.gpio_reset))
         errx(EXIT_FAILURE, "invalid RESET GPIO number");
       break;
+    case OPT_RESET_PULSE:
+      ctx.reset_pulse = xatou(optarg, &err);
+      if(err || !ctx.reset_pulse)
+        errx(EXIT_FAILURE, "cannot parse reset pulse");
+      break;
+    case OPT_READY:
+      ctx.gpio_ready = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse READY GPIO");
+      else if(!rpi_gpio_check(ctx.gpio_ready))
+        errx(EXIT_FAILURE, "invalid READY GPIO number");
+      break;
+    case OPT_GPIO_CHIP:
+      rpi_gpio_use_chip(optarg);
+      break;
     case 'v':
       ctx.verbose = 1;
       break;
@@ -353,6 +1289,52 @@ int main(int argc, char *argv[])
     case 'a':
       loramac.flags |= LORAMAC_NOACK;
       break;
+    case 'w':
+      loramac.flags |= LORAMAC_WINDOW;
+      break;
+    case 'f':
+      loramac.flags |= LORAMAC_FRAG;
+      break;
+    case 'z':
+      loramac.flags |= LORAMAC_COMPRESS;
+      break;
+    case OPT_DICT:
+      load_dict(optarg);
+      break;
+    case OPT_METRICS:
+      metrics_path = optarg;
+      break;
+    case OPT_STATS_MAP:
+      stats_map_path = optarg;
+      break;
+    case OPT_DRAIN:
+      set_uart_drain(1);
+      break;
+    case OPT_BUSY_POLL:
+      set_uart_busy_poll(xatou(optarg, &err));
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse busy poll budget");
+      break;
+    case OPT_LOW_LATENCY:
+      uart_flags |= UART_LOW_LATENCY;
+      break;
+    case OPT_RTSCTS:
+      uart_flags |= UART_RTSCTS;
+      break;
+    case OPT_RT:
+      rt_parse(optarg);
+      break;
+    case OPT_MLOCK:
+      rt_mlock();
+      break;
+    case OPT_CAPTURE:
+      capture_open(optarg);
+      break;
+    case OPT_LOG_RATE:
+      log_rate = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse log rate value");
+      break;
     case 'd':
       ctx.dst_mac = strtol(optarg, NULL, 16);
       break;
@@ -367,6 +1349,120 @@ int main(int argc, char *argv[])
       if(err)
         errx(EXIT_FAILURE, "cannot parse SIFS value");
       break;
+    case OPT_GAP:
+      loramac.gap = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse gap value");
+      break;
+    case OPT_BACKOFF:
+      err = loramac_str2backoff(optarg);
+      if(err < 0)
+        errx(EXIT_FAILURE, "unknown backoff policy '%s'", optarg);
+      loramac.backoff = err;
+      break;
+    case OPT_BACKOFF_SLOT:
+      loramac.backoff_slot = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse backoff slot");
+      break;
+    case OPT_BACKOFF_MAX:
+      loramac.backoff_max = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse maximum backoff");
+      break;
+    case OPT_LBT:
+      loramac.flags |= LORAMAC_LBT;
+      break;
+    case OPT_LBT_SLOT:
+      loramac.lbt_slot = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse listen before talk slot");
+      break;
+    case OPT_LBT_TRIES:
+      loramac.lbt_tries = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse listen before talk tries");
+      break;
+    case OPT_BCAST_REPEAT:
+      loramac.bcast_repeat = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse broadcast repeat");
+      break;
+    case OPT_BCAST_JITTER:
+      loramac.bcast_jitter = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse broadcast jitter");
+      break;
+    case OPT_RTO:
+      loramac.flags |= LORAMAC_RTO;
+      break;
+    case OPT_PIGGYBACK:
+      loramac.flags |= LORAMAC_PIGGYBACK;
+      break;
+    case OPT_BACK_HOLD:
+      loramac.back_hold = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse block ACK hold");
+      break;
+    case OPT_CLUSTER:
+      loramac.cluster_size = parse_cluster(cluster, optarg);
+      loramac.cluster      = cluster;
+      loramac.flags       |= LORAMAC_COMPACT;
+      break;
+    case OPT_GROUPS:
+      parse_groups(loramac.groups, optarg);
+      break;
+    case OPT_FEC:
+      loramac.flags |= LORAMAC_FEC;
+      break;
+    case OPT_FEC_GROUP:
+      loramac.fec_group = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse parity group");
+      loramac.flags |= LORAMAC_FEC;
+      break;
+    case OPT_TDMA:
+      loramac.flags |= LORAMAC_TDMA;
+      break;
+    case OPT_TDMA_GUARD:
+      loramac.tdma_guard = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse slot guard");
+      break;
+    case OPT_BEACON:
+      parse_beacon(&beacon, optarg);
+      loramac.flags |= LORAMAC_TDMA;
+      break;
+    case OPT_MODULE:
+      radios_add(optarg);
+      break;
+    case OPT_KEY:
+      add_key(&loramac, optarg);
+      break;
+    case OPT_COUNTER_FILE:
+      counter_path = optarg;
+      break;
+    case OPT_DUTY:
+      loramac.frequency = strtod(optarg, NULL) * 1000000 + 0.5;
+      if(!duty_band_lookup(loramac.frequency))
+        errx(EXIT_FAILURE, "%s MHz is outside of the EU868 sub-bands", optarg);
+      loramac.flags |= LORAMAC_DUTY;
+      break;
+    case OPT_RADIO:
+      parse_radio(&loramac.radio, optarg);
+      break;
+    case OPT_ADR:
+      parse_adr(&loramac, optarg);
+      break;
+    case OPT_FILTERS:
+      parse_filters(filters, optarg);
+      loramac.filters = filters;
+      break;
+    case OPT_DUTY_WAIT:
+      loramac.duty_wait = xatou(optarg, &err) * 1000UL;
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse duty cycle wait");
+      break;
     case 'S':
       val = xatou(optarg, &err);
       if(err)
@@ -416,6 +1512,9 @@ int main(int argc, char *argv[])
 
   exit_status = EXIT_SUCCESS;
 
+  if(counter_path)
+    loramac.counter_store = counter_open(counter_path, loramac.counter);
+
   /* display summary */
   IF_VERBOSE(&ctx, display_summary(&iface_mode,
                                    &loramac,
@@ -424,34 +1523,64 @@ int main(int argc, char *argv[])
                                    device,
                                    speed_str));
 
+  /* The modes that run alone cannot afford any other thread. */
+  if(iface_mode.single && (beacon.count || radios_count()))
+    errx(EXIT_FAILURE, "the %s mode cannot send beacons nor drive other modules",
+                       iface_mode.name);
+
+  /* From now on the verbose messages and the
+     dumps go through the logging thread. */
+  if(!iface_mode.single)
+    log_init(ctx.verbose ? LOG_LVL_DEBUG : LOG_LVL_INFO, log_rate);
+
   initialize_driver(&ctx, device, speed);
   iface_mode.init(&ctx, &loramac);
 
-  /* Block the SIGALRM signal so that it is
-     not received by the main thread when
-     a timer is triggered. */
-  thread_block_signals();
+  /* Interpose the receive queue between the driver and
+     the mode callback, unless they share the same thread. */
+  mode_cb_recv = loramac.cb_recv;
+  if(iface_mode.single) {
+    loop_config(&loramac, &mac);
+    loramac.cb_recv = deliver_recv;
+  }
+  else {
+    ring_init(&rx_ring, RX_RING_SIZE, sizeof(struct rx_frame));
+    loramac.cb_recv = queue_recv;
+  }
 
   /* Initialize LoRaMAC layer.
      The interface mode still has to configure
      the loramac configuration structure. That
      is why we initialize the MAC layer after
      the mode. */
-  err = loramac_init(&loramac);
-  if(err < 0)
+  ticker_init(&ticker, TICKER_TICK);
+  wheel_timer_init(&ack_timer, flush_acks, &mac);
+
+  err = loramac_init(&mac, &loramac);
+  if(err)
     errx(EXIT_FAILURE, "cannot initialize LoRaMAC: %s",
                        loramac_init2str(err));
+  radios_init(&loramac, speed, uart_flags, &ticker);
 
 
   /* Start the threads that will handle the IO
      with the LoRaMAC layer. That is:
        - The input thread that read new messages from UART.
-       - The output thread that send message according to iface_mode. */
-  start_io_threads(&ctx, &loramac);
+       - The output thread that send message according to iface_mode.
+       - The ACK thread that send ACKs after SIFS.
+       - The delivery thread that pass received frames to iface_mode.
+     A mode that runs alone does all of this from its event loop. */
+  if(iface_mode.single)
+    start_single(&ctx);
+  else
+    start_io_threads(&ctx, &loramac);
 
   /* IO threads returned, this is the end.
      We can release everything. */
   iface_mode.destroy(&ctx);
+
+  if(loramac.flags & LORAMAC_COMPRESS)
+    IF_VERBOSE(&ctx, display_codec_stats(&mac));
 EXIT:
   free((void *)speed_str);
   free(optstring_merged);
@@ -27,6 +27,8 @@
 
 #include <stdint.h>
 
+#include "loramac.h"
+
 #define IF_VERBOSE(ctx, x) if((ctx)->verbose) x;
 
 /* The context is created by the command line parser and
@@ -36,17 +38,16 @@ struct context {
   int verbose;
   uint16_t dst_mac;
 
+  /* LoRaMAC instance driven by the modes */
+  struct loramac_ctx *mac;
+
   /* GPIO (negative means disabled) */
   int gpio_irq;
   int gpio_cts;
   int gpio_reset;
+  int gpio_ready;
 
-  /* mode specific */
-  /* ping options */
-  int flood;
-  unsigned int size;
-  unsigned int count;
-  unsigned int interval;
+  unsigned int reset_pulse; /* low time of the reset GPIO in us */
 };
 
 #endif /* _MAIN_H_ */
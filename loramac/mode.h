@@ -63,6 +63,20 @@ extern struct iface_mode {
      This is the code that will eventually send data
      to the LoRaMAC layer. */
   void (*start)(const struct context *ctx);
+
+  /* Received frames are delivered to the mode from their own
+     thread (see main.c). Modes that batch received frames may
+     use flush() to push them once no other frame arrived within
+     flush_timeout us. This is optional and may be NULL. */
+  void (*flush)(const struct context *ctx);
+  unsigned int flush_timeout;
+
+  /* A mode that runs alone is started in the main thread with the
+     event loop hooks in the driver (see loop.h) and neither the
+     input, delivery nor ticker threads. It receives its frames
+     from the receive path and serves its descriptors from the
+     loop. */
+  int single;
 } iface_mode;
 
 #endif /* _MODES_H_ */
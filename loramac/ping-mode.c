@@ -0,0 +1,601 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _POSIX_C_SOURCE 200112L
+#endif /* __linux__ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
+#include <math.h>
+#include <unistd.h>
+#include <time.h>
+#include <err.h>
+
+#include "loramac-str.h"
+#include "ping-mode.h"
+#include "scale.h"
+#include "xatoi.h"
+#include "help.h"
+#include "log.h"
+#include "common.h"
+
+/*
+  The ping mode sends probes to the destination and measures
+  the round trip time of the replies. Each probe carries its
+  type, a sequence number and the time at which it was sent,
+  taken on the monotonic clock of the pinger. The responder
+  only changes the type and echoes the payload back from the
+  receive callback, so the clocks of both nodes do not need to
+  be synchronized. The driver sends one frame at a time and holds
+  its lock until the frame is acknowledged, so the responder
+  waits for its own ACK to the request to be sent (twice SIFS)
+  before it echoes the probe. In flood mode the pinger waits as
+  much after a reply before the next probe. With piggybacked ACKs
+  neither waits, the driver holds the frame until the ACK it
+  carries is due.
+
+  Every instance answers requests. With --echo the instance
+  only answers and never sends probes. Probes are sent every
+  interval or, in flood mode, as soon as the previous reply was
+  received (or the wait timed out). With a count of zero the
+  pinger runs until it is interrupted.
+
+  The summary reports the RTT, the loss and the number of
+  duplicated and reordered replies (received after a reply with
+  a higher sequence number).
+
+  With --calibrate the pinger searches the lowest SIFS that works
+  with the responder instead. The SIFS of a node is the time it
+  waits before it acknowledges a frame, so that the sender has
+  turned its module around to receive. The pinger changes its own
+  SIFS and floods a few probes at each step. When its ACK to a reply
+  comes too early, the responder does not receive it and sends the
+  reply again, which the driver counts as a duplicate. The search
+  halves the interval between the lowest SIFS that passed (starting
+  with the configured one) and the highest one that failed until it
+  is smaller than CALIBRATE_RESOLUTION. The ACK timeout must cover
+  the rest of the exchange, measured on the ACKs to the probes from
+  which we subtract the SIFS of the responder (supposed to be the
+  configured one, as the other nodes use the same options). Both
+  suggested values keep a margin of a quarter over the measure.
+*/
+
+#define PING_MEDIA 1
+
+#define CALIBRATE_PROBES     10   /* probes at each step (default) */
+#define CALIBRATE_RESOLUTION 1000 /* us */
+#define CALIBRATE_MARGIN     4    /* margin of 1/4 */
+
+struct ping_stats {
+  unsigned int received;
+  unsigned int duplicates;
+  unsigned int reordered;
+
+  seqno_t highest; /* highest sequence number received */
+  unsigned long min, max; /* us */
+  double sum, sum2;
+
+  unsigned char seen[(1 << (8 * sizeof(seqno_t))) / 8];
+};
+
+static unsigned int count;
+static unsigned int size = PING_HDR_SIZE;
+static unsigned int interval = 1000; /* ms */
+static unsigned int wait = 5000; /* ms */
+static int flood;
+static int echo;
+static int calibrate;
+
+static volatile sig_atomic_t stopped;
+static unsigned int turnaround; /* us */
+static unsigned int sifs, timeout, retrans; /* us, configured */
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  replied;
+static struct ping_stats stats[PING_MEDIA];
+static unsigned int errors; /* probes the driver could not send */
+
+static const char * medium2str(int medium)
+{
+  UNUSED(medium);
+  return "LoRa";
+}
+
+static void now(struct timeval *tv)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  tv->tv_sec  = ts.tv_sec;
+  tv->tv_usec = ts.tv_nsec / 1000;
+}
+
+static unsigned long elapsed(const struct timeval *begin)
+{
+  struct timeval end;
+
+  now(&end);
+  return (end.tv_sec - begin->tv_sec) * 1000000UL + end.tv_usec - begin->tv_usec;
+}
+
+static int ping_send(const struct context *ctx, uint16_t dst, const void *payload, unsigned int size)
+{
+  unsigned int tx;
+
+  return loramac_send(ctx->mac, dst, payload, size, &tx);
+}
+
+static const char * ping_send2str(int status)
+{
+  return loramac_send2str(status);
+}
+
+static void recv_reply(uint16_t src, const unsigned char *payload, unsigned int payload_size,
+                       int medium)
+{
+  struct ping_stats *s = &stats[medium];
+  struct timeval sent;
+  unsigned long rtt;
+  seqno_t seqno;
+  int dup;
+
+  memcpy(&seqno, payload + sizeof(uint8_t), sizeof(seqno_t));
+  memcpy(&sent, payload + sizeof(uint8_t) + sizeof(seqno_t), sizeof(struct timeval));
+  rtt = elapsed(&sent);
+
+  pthread_mutex_lock(&lock);
+
+  dup = s->seen[seqno / 8] & (1 << seqno % 8);
+  s->seen[seqno / 8] |= 1 << seqno % 8;
+
+  if(dup)
+    s->duplicates++;
+  else {
+    /* serial number arithmetic so that the comparison
+       holds when the sequence number wraps */
+    if(s->received && (seqno_t)(s->highest - seqno) < (1 << (8 * sizeof(seqno_t) - 1)))
+      s->reordered++;
+    else
+      s->highest = seqno;
+
+    if(!s->received || rtt < s->min)
+      s->min = rtt;
+    if(rtt > s->max)
+      s->max = rtt;
+    s->sum  += rtt;
+    s->sum2 += (double)rtt * rtt;
+    s->received++;
+  }
+
+  pthread_cond_broadcast(&replied);
+  pthread_mutex_unlock(&lock);
+
+  if(!flood && !calibrate)
+    printf("%u bytes from %04X (%s): seq=%u time=%s%s\n", payload_size, src,
+           medium2str(medium), seqno, scale_time(rtt * 1000ULL), dup ? " (DUP!)" : "");
+}
+
+/* Wait until the ACK to the last received frame was sent. */
+static void wait_turnaround(void)
+{
+  struct timespec ts = { .tv_sec  = turnaround / 1000000,
+                         .tv_nsec = turnaround % 1000000 * 1000L };
+
+  if(turnaround)
+    nanosleep(&ts, NULL);
+}
+
+static void cb_recv(uint16_t src, uint16_t dst,
+                    const void *payload, unsigned int payload_size,
+                    int status, void *data)
+{
+  const struct context *ctx = data;
+  unsigned char reply[LORAMAC_MAX_MESSAGE];
+  int ret;
+
+  UNUSED(dst);
+
+  if(status != LORAMAC_RCV_SUCCESS || payload_size < PING_HDR_SIZE)
+    return;
+
+  switch(*(const unsigned char *)payload) {
+  case PING_REQUEST:
+    memcpy(reply, payload, payload_size);
+    *reply = PING_REPLY;
+    wait_turnaround();
+
+    ret = ping_send(ctx, src, reply, payload_size);
+    if(ret != LORAMAC_SND_SUCCESS)
+      /* we don't fail on client error */
+      warnx("cannot echo to %04X: %s", src, ping_send2str(ret));
+    break;
+  case PING_REPLY:
+    if(!echo)
+      recv_reply(src, payload, payload_size, 0);
+    break;
+  }
+}
+
+static void sig_stop(int signum)
+{
+  UNUSED(signum);
+  stopped = 1;
+}
+
+static void init(const struct context *ctx, struct loramac_config *loramac)
+{
+  pthread_condattr_t attr;
+  struct sigaction act = { .sa_handler = sig_stop };
+
+  UNUSED(ctx);
+  loramac->cb_recv = cb_recv;
+
+  if(!(loramac->flags & (LORAMAC_NOACK | LORAMAC_PIGGYBACK)))
+    turnaround = 2 * loramac->sifs;
+  else if(calibrate)
+    errx(EXIT_FAILURE, "calibration needs ACKs");
+  sifs    = loramac->sifs;
+  timeout = loramac->timeout;
+  retrans = loramac->retrans;
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&replied, &attr);
+  pthread_condattr_destroy(&attr);
+
+  /* no SA_RESTART so that sleeps are interrupted */
+  sigemptyset(&act.sa_mask);
+  if(sigaction(SIGINT, &act, NULL) < 0)
+    err(EXIT_FAILURE, "cannot install signal handler");
+}
+
+static void add_ms(struct timespec *ts, unsigned int ms)
+{
+  ts->tv_sec  += ms / 1000;
+  ts->tv_nsec += (ms % 1000) * 1000000L;
+  if(ts->tv_nsec >= 1000000000) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000;
+  }
+}
+
+static unsigned int received(void)
+{
+  unsigned int i, n = 0;
+
+  for(i = 0 ; i < PING_MEDIA ; i++)
+    n += stats[i].received;
+  return n;
+}
+
+/* Wait until the number of replies reaches
+   the target or until the deadline. */
+static void wait_replies(unsigned int target, const struct timespec *deadline)
+{
+  pthread_mutex_lock(&lock);
+  while(!stopped && received() < target)
+    if(pthread_cond_timedwait(&replied, &lock, deadline))
+      break;
+  pthread_mutex_unlock(&lock);
+}
+
+static void display_summary(unsigned int probes)
+{
+  unsigned int i, n;
+
+  pthread_mutex_lock(&lock);
+
+  n = received();
+  printf("\n%u probes sent, %u replies, %.1f%% loss", probes, n,
+         probes ? (probes - (n < probes ? n : probes)) * 100. / probes : 0);
+  if(errors)
+    printf(", %u send errors", errors);
+  putchar('\n');
+
+  for(i = 0 ; i < PING_MEDIA ; i++) {
+    const struct ping_stats *s = &stats[i];
+    double avg, mdev;
+
+    if(!s->received)
+      continue;
+
+    avg  = s->sum / s->received;
+    mdev = sqrt(s->sum2 / s->received - avg * avg);
+
+    printf("%-6s: %u replies, %u duplicates, %u reordered\n",
+           medium2str(i), s->received, s->duplicates, s->reordered);
+    printf("%-6s: rtt min %s", medium2str(i), scale_time(s->min * 1000ULL));
+    printf(", avg %s", scale_time(avg * 1000));
+    printf(", max %s", scale_time(s->max * 1000ULL));
+    printf(", mdev %s\n", scale_time(mdev * 1000));
+  }
+
+  pthread_mutex_unlock(&lock);
+}
+
+/* Send a probe with this sequence number and return
+   the number of replies received before it was sent. */
+static unsigned int send_probe(const struct context *ctx, unsigned char *probe, seqno_t seqno)
+{
+  struct timeval sent;
+  unsigned int i, base;
+  int ret;
+
+  /* forget the previous use of this
+     sequence number when it wraps */
+  pthread_mutex_lock(&lock);
+  for(i = 0 ; i < PING_MEDIA ; i++)
+    stats[i].seen[seqno / 8] &= ~(1 << seqno % 8);
+  base = received();
+  pthread_mutex_unlock(&lock);
+
+  now(&sent);
+  memcpy(probe + sizeof(uint8_t), &seqno, sizeof(seqno_t));
+  memcpy(probe + sizeof(uint8_t) + sizeof(seqno_t), &sent, sizeof(struct timeval));
+
+  ret = ping_send(ctx, ctx->dst_mac, probe, size);
+  if(ret != LORAMAC_SND_SUCCESS) {
+    pthread_mutex_lock(&lock);
+    errors++;
+    pthread_mutex_unlock(&lock);
+    IF_VERBOSE(ctx, log_msg(LOG_CAT_MAIN, LOG_LVL_DEBUG,
+                            "seq=%u: %s\n", seqno, ping_send2str(ret)));
+  }
+
+  return base;
+}
+
+/* Send a probe and wait for its reply as in flood mode. */
+static void flood_probe(const struct context *ctx, unsigned char *probe, seqno_t seqno)
+{
+  struct timespec deadline;
+  unsigned int base = send_probe(ctx, probe, seqno);
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  add_ms(&deadline, wait);
+  wait_replies(base + 1, &deadline);
+  wait_turnaround();
+}
+
+static void sleep_us(unsigned long us)
+{
+  struct timespec ts = { .tv_sec  = us / 1000000,
+                         .tv_nsec = us % 1000000 * 1000L };
+
+  nanosleep(&ts, NULL);
+}
+
+/* Flood probes with this SIFS and return true when
+   all of them were answered without retransmission. */
+static int calibrate_step(const struct context *ctx, unsigned char *probe,
+                          seqno_t *seqno, unsigned int step_sifs, unsigned int probes)
+{
+  struct loramac_counters before, after;
+  unsigned int i, base, replies;
+
+  if(loramac_set_timing(ctx->mac, step_sifs, timeout) != LORAMAC_INIT_SUCCESS)
+    errx(EXIT_FAILURE, "cannot set SIFS to %u us", step_sifs);
+  if(turnaround)
+    turnaround = 2 * step_sifs;
+
+  loramac_counters(ctx->mac, &before);
+  pthread_mutex_lock(&lock);
+  base = received();
+  pthread_mutex_unlock(&lock);
+
+  for(i = 0 ; !stopped && i < probes ; i++)
+    flood_probe(ctx, probe, (*seqno)++);
+
+  /* the last reply may still be retransmitted */
+  sleep_us((retrans + 1) * (unsigned long)timeout);
+
+  loramac_counters(ctx->mac, &after);
+  pthread_mutex_lock(&lock);
+  replies = received() - base;
+  pthread_mutex_unlock(&lock);
+
+  printf("sifs %s: %u/%u replies, %lu retransmissions\n", scale_time(step_sifs * 1000ULL),
+         replies, probes, after.rx_dups - before.rx_dups);
+
+  return replies >= probes && after.rx_dups == before.rx_dups;
+}
+
+static void start_calibrate(const struct context *ctx, unsigned char *probe)
+{
+  struct loramac_counters c;
+  unsigned int lo = 0, hi = sifs, probes = count ? count : CALIBRATE_PROBES;
+  unsigned long exchange;
+  unsigned int best_sifs, best_timeout;
+  seqno_t seqno = 0;
+
+  if(!calibrate_step(ctx, probe, &seqno, hi, probes)) {
+    if(!stopped)
+      warnx("exchanges fail with the configured SIFS, try a higher one");
+    return;
+  }
+
+  while(!stopped && hi - lo > CALIBRATE_RESOLUTION) {
+    unsigned int mid = lo + (hi - lo) / 2;
+
+    if(calibrate_step(ctx, probe, &seqno, mid, probes))
+      hi = mid;
+    else
+      lo = mid;
+  }
+
+  if(stopped)
+    return;
+
+  /* only the ACKs to the probes, the responder did not change its SIFS */
+  loramac_counters(ctx->mac, &c);
+  exchange = c.ack_delay_max > sifs ? c.ack_delay_max - sifs : 0;
+
+  best_sifs    = hi + hi / CALIBRATE_MARGIN;
+  best_timeout = best_sifs + exchange + exchange / CALIBRATE_MARGIN;
+
+  printf("\nlowest SIFS %s", scale_time(hi * 1000ULL));
+  printf(", ACK delay min %s", scale_time(c.ack_delay_min * 1000ULL));
+  printf(", avg %s", scale_time(c.ack_delays ? c.ack_delay_sum * 1000. / c.ack_delays : 0));
+  printf(", max %s\n", scale_time(c.ack_delay_max * 1000ULL));
+  printf("suggested options: -s %u -t %u (was -s %u -t %u)\n",
+         best_sifs, best_timeout, sifs, timeout);
+}
+
+static void start(const struct context *ctx)
+{
+  unsigned char probe[LORAMAC_MAX_MESSAGE];
+  struct timespec deadline;
+  unsigned int i, probes = 0;
+  seqno_t seqno = 0;
+
+  if(echo) {
+    /* replies are sent from the receive callback */
+    while(!stopped)
+      pause();
+    return;
+  }
+
+  for(i = PING_HDR_SIZE ; i < size ; i++)
+    probe[i] = i;
+  *probe = PING_REQUEST;
+
+  if(calibrate) {
+    start_calibrate(ctx, probe);
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+  while(!stopped && (!count || probes < count)) {
+    probes++;
+
+    if(flood)
+      flood_probe(ctx, probe, seqno++);
+    else {
+      send_probe(ctx, probe, seqno++);
+      add_ms(&deadline, interval);
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+    }
+  }
+
+  /* last replies */
+  if(!stopped) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    add_ms(&deadline, wait);
+    wait_replies(probes, &deadline);
+  }
+
+  display_summary(probes);
+}
+
+static void destroy(const struct context *ctx)
+{
+  UNUSED(ctx);
+  pthread_cond_destroy(&replied);
+}
+
+static int parse_option(const struct context *ctx, int c)
+{
+  int err;
+
+  UNUSED(ctx);
+
+  switch(c) {
+  case 'c':
+    count = xatou(optarg, &err);
+    if(err)
+      errx(EXIT_FAILURE, "cannot parse count");
+    return 1;
+  case 'l':
+    size = xatou(optarg, &err);
+    if(err)
+      errx(EXIT_FAILURE, "cannot parse size");
+    /* longer payloads than a frame need LORAMAC_FRAG */
+    if(size < PING_HDR_SIZE || size > LORAMAC_MAX_MESSAGE)
+      errx(EXIT_FAILURE, "invalid size (%u to %u bytes)",
+           (unsigned int)(PING_HDR_SIZE), (unsigned int)(LORAMAC_MAX_MESSAGE));
+    return 1;
+  case 'I':
+    interval = xatou(optarg, &err);
+    if(err)
+      errx(EXIT_FAILURE, "cannot parse interval");
+    return 1;
+  case 'W':
+    wait = xatou(optarg, &err);
+    if(err)
+      errx(EXIT_FAILURE, "cannot parse wait");
+    return 1;
+  case 'F':
+    flood = 1;
+    return 1;
+  case 'e':
+    echo = 1;
+    return 1;
+  case 'C':
+    calibrate = 1;
+    return 1;
+  }
+
+  return 0;
+}
+
+struct option ping_opts[] = {
+  { "count", required_argument, NULL, 'c' },
+  { "size", required_argument, NULL, 'l' },
+  { "interval", required_argument, NULL, 'I' },
+  { "wait", required_argument, NULL, 'W' },
+  { "flood", no_argument, NULL, 'F' },
+  { "echo", no_argument, NULL, 'e' },
+  { "calibrate", no_argument, NULL, 'C' },
+  { NULL, 0, NULL, 0 }
+};
+struct opt_help ping_messages[] = {
+  { 'c', "count",    "Number of probes (default: until interrupted, 10 per step with --calibrate)" },
+  { 'l', "size",     "Payload size in bytes (default: header only)" },
+  { 'I', "interval", "Interval between probes in ms (default: 1000)" },
+  { 'W', "wait",     "Time to wait for a reply in ms (default: 5000)" },
+  { 'F', "flood",    "Send the next probe as soon as a reply is received" },
+  { 'e', "echo",     "Only answer probes" },
+  { 'C', "calibrate", "Search the lowest SIFS and suggest the timing options" },
+  { 0, NULL, NULL }
+};
+
+struct iface_mode iface_mode = {
+  .name = "ping",
+  .description = "Measure the round trip time to the destination",
+
+  .optstring      = "c:l:I:W:FeC",
+  .long_opts      = ping_opts,
+  .extra_messages = ping_messages,
+  .parse_option   = parse_option,
+
+  .init    = init,
+  .destroy = destroy,
+  .start   = start
+};
@@ -36,6 +36,10 @@ typedef unsigned short seqno_t;
 
 #define PING_HDR_SIZE sizeof(uint8_t) + sizeof(seqno_t) + sizeof(struct timeval) /* type, seqno, timeval */
 
-struct iface_mode ping_mode;
+/* Type of a probe (first byte of the payload). */
+enum ping_type {
+  PING_REQUEST = 0x08,
+  PING_REPLY   = 0x00
+};
 
 #endif /* _PING_MODE_H_ */
@@ -0,0 +1,216 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#include "common.h"
+#include "loramac-str.h"
+#include "timer.h"
+#include "radios.h"
+
+static struct radio radios[RADIOS_MAX];
+static unsigned int nradios;
+
+void radios_add(const char *arg)
+{
+  struct radio *r;
+  char *s, *addr, *end;
+  long v;
+
+  if(nradios == RADIOS_MAX)
+    errx(EXIT_FAILURE, "too many modules (max %u)", RADIOS_MAX + 1);
+  r = &radios[nradios];
+
+  s = strdup(arg);
+  end = strrchr(s, ':');
+  if(!end || end == s)
+    errx(EXIT_FAILURE, "module expects DEVICE:ADDR[,ADDR...]");
+  *end++ = '\0';
+  r->device = s;
+
+  for(addr = strtok(end, ",") ; addr ; addr = strtok(NULL, ",")) {
+    v = strtol(addr, &end, 16);
+    if(*end || v < 0 || v >= 0xffff)
+      errx(EXIT_FAILURE, "invalid node address '%s'", addr);
+    if(r->count == LORAMAC_MAX_CLUSTER)
+      errx(EXIT_FAILURE, "too many nodes on %s (max %u)", r->device, LORAMAC_MAX_CLUSTER);
+    r->nodes[r->count++] = v;
+  }
+  if(!r->count)
+    errx(EXIT_FAILURE, "no node on %s", r->device);
+
+  nradios++;
+}
+
+unsigned int radios_count(void)
+{
+  return nradios;
+}
+
+struct radio * radios_get(unsigned int index)
+{
+  return &radios[index];
+}
+
+/* Platform callbacks of a module, the data is the module. */
+static int radio_send(const void *buf, unsigned int size, void *data)
+{
+  struct radio *r = data;
+  return uart_write(&r->uart, buf, size);
+}
+
+static int radio_sendv(const struct loramac_iovec *iov, unsigned int count, void *data)
+{
+  struct radio *r = data;
+  return uart_writev(&r->uart, iov, count);
+}
+
+static void radio_start_timer(unsigned int timeout, void *data)
+{
+  struct radio *r = data;
+  timer_start(&r->timer, timeout);
+}
+
+static void radio_wait_timer(void *data)
+{
+  struct radio *r = data;
+  timer_wait(&r->timer);
+}
+
+static void radio_stop_timer(void *data)
+{
+  struct radio *r = data;
+  timer_stop(&r->timer);
+}
+
+static void radio_lock(void *data)
+{
+  struct radio *r = data;
+  pthread_mutex_lock(&r->lock);
+}
+
+static void radio_unlock(void *data)
+{
+  struct radio *r = data;
+  pthread_mutex_unlock(&r->lock);
+}
+
+static void radio_ack_lock(void *data)
+{
+  struct radio *r = data;
+  pthread_mutex_lock(&r->ack_lock);
+}
+
+static void radio_ack_unlock(void *data)
+{
+  struct radio *r = data;
+  pthread_mutex_unlock(&r->ack_lock);
+}
+
+static void radio_schedule_ack(unsigned int us, void *data)
+{
+  struct radio *r = data;
+  ticker_arm(r->ticker, &r->ack_timer, us);
+}
+
+static void radio_flush_acks(void *data)
+{
+  struct radio *r = data;
+  unsigned int delay;
+
+  delay = loramac_flush_acks(&r->mac);
+  if(delay)
+    ticker_arm(r->ticker, &r->ack_timer, delay);
+}
+
+void radios_init(const struct loramac_config *conf, speed_t speed, unsigned int uart_flags,
+                 struct ticker *ticker)
+{
+  unsigned int i;
+  int err;
+
+  for(i = 0 ; i < nradios ; i++) {
+    struct radio *r = &radios[i];
+
+    uart_open(&r->uart, r->device, speed, uart_flags);
+    timer_init(&r->timer);
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_mutex_init(&r->ack_lock, NULL);
+    r->ticker = ticker;
+    wheel_timer_init(&r->ack_timer, radio_flush_acks, r);
+
+    /* same settings as the main module */
+    r->conf = *conf;
+    r->conf.uart_send    = radio_send;
+    r->conf.uart_sendv   = radio_sendv;
+    r->conf.start_timer  = radio_start_timer;
+    r->conf.wait_timer   = radio_wait_timer;
+    r->conf.stop_timer   = radio_stop_timer;
+    r->conf.lock         = radio_lock;
+    r->conf.unlock       = radio_unlock;
+    r->conf.ack_lock     = radio_ack_lock;
+    r->conf.ack_unlock   = radio_ack_unlock;
+    r->conf.schedule_ack = radio_schedule_ack;
+    r->conf.data         = r;
+
+    err = loramac_init(&r->mac, &r->conf);
+    if(err)
+      errx(EXIT_FAILURE, "cannot initialize LoRaMAC on %s: %s",
+                         r->device, loramac_init2str(err));
+  }
+}
+
+static void * radio_read_func(void *p)
+{
+  struct radio *r = p;
+
+  uart_loop(&r->uart, &r->mac);
+
+  return NULL;
+}
+
+void radios_start(const pthread_attr_t *attr)
+{
+  pthread_t thread;
+  unsigned int i;
+
+  for(i = 0 ; i < nradios ; i++)
+    if(pthread_create(&thread, attr, radio_read_func, &radios[i]))
+      errx(EXIT_FAILURE, "cannot create threads");
+}
+
+struct loramac_ctx * radios_mac(struct loramac_ctx *main, uint16_t dst)
+{
+  unsigned int i, j;
+
+  for(i = 0 ; i < nradios ; i++)
+    for(j = 0 ; j < radios[i].count ; j++)
+      if(radios[i].nodes[j] == dst)
+        return &radios[i].mac;
+
+  return main;
+}
@@ -0,0 +1,83 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _RADIOS_H_
+#define _RADIOS_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "ticker.h"
+#include "uart.h"
+#include "loramac.h"
+
+/* Maximum number of modules besides the main one. */
+#define RADIOS_MAX 7
+
+/* A gateway may drive other LoRa modules, each on its own UART and
+   configured out of band on its own channel. Each module has its own
+   LoRaMAC instance, timer and locks so that they receive (and send
+   their ACKs) in parallel. The nodes are assigned to a module which
+   carries the frames to them, the other nodes go through the main
+   module. Broadcasts go through every module. */
+struct radio {
+  const char *device;
+
+  struct loramac_ctx    mac;
+  struct loramac_config conf;
+  struct uart           uart;
+  struct timer          timer;
+  pthread_mutex_t       lock;
+  pthread_mutex_t       ack_lock;
+  struct wheel_timer    ack_timer;
+  struct ticker        *ticker;
+
+  uint16_t     nodes[LORAMAC_MAX_CLUSTER];
+  unsigned int count;
+};
+
+/* Add a module from DEVICE:ADDR[,ADDR...] with the hexadecimal
+   addresses of its nodes. Exit on error. */
+void radios_add(const char *arg);
+
+/* Number of modules besides the main one. */
+unsigned int radios_count(void);
+
+/* Module at this index (below radios_count()). */
+struct radio * radios_get(unsigned int index);
+
+/* Open the lines and initialize the instances with a copy of the
+   configuration of the main module. The ACKs are scheduled on this
+   ticker. Exit on error. */
+void radios_init(const struct loramac_config *conf, speed_t speed, unsigned int uart_flags,
+                 struct ticker *ticker);
+
+/* Start the read thread of each module. Exit on error. */
+void radios_start(const pthread_attr_t *attr);
+
+/* Instance that carries the frames to this destination,
+   the main one when the node is not assigned. */
+struct loramac_ctx * radios_mac(struct loramac_ctx *main, uint16_t dst);
+
+#endif /* _RADIOS_H_ */
@@ -23,14 +23,16 @@
  */
 
 #ifdef __linux__
-# define _POSIX_C_SOURCE 199309L
+# define _POSIX_C_SOURCE 200112L
 #endif /* __linux__ */
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <getopt.h>
+#include <poll.h>
 #include <time.h>
+#include <err.h>
 
 #include "time-substract.h"
 #include "loramac-str.h"
@@ -38,9 +40,15 @@
 #include "mode.h"
 #include "help.h"
 #include "dump.h"
+#include "async.h"
+#include "xatoi.h"
 #include "common.h"
 
+#define ASYNC_DEPTH 64
+
 static int display_time;
+static int use_async;
+static unsigned int count = 1;
 static const char *message = "Hello World!";
 
 static void cb_recv(uint16_t src, uint16_t dst,
@@ -62,26 +70,68 @@ static void init(const struct context *ctx, struct loramac_config *loramac)
   loramac->cb_recv = cb_recv;
 }
 
+static void display_status(int ret, unsigned int tx)
+{
+  putchar('\n');
+  printf("TX STATUS: %s (%d)\n", loramac_send2str(ret), ret);
+  printf("TX COUNT : %d\n", tx);
+}
+
+/* Queue all messages at once and display
+   their status as they are reported. */
+static void send_async(const struct context *ctx)
+{
+  struct async_completion c;
+  struct pollfd pfd;
+  unsigned int queued, done = 0;
+  int ret;
+
+  async_init(ctx->mac, ASYNC_DEPTH, NULL, NULL);
+
+  pfd = (struct pollfd){ .fd     = async_fd(),
+                         .events = POLLIN };
+
+  for(queued = 0 ; queued < count ; queued++) {
+    ret = async_send(ctx->dst_mac, message, strlen(message), NULL, NULL);
+    if(ret != LORAMAC_SND_SUCCESS) {
+      display_status(ret, 0);
+      break;
+    }
+  }
+
+  while(done < queued) {
+    if(poll(&pfd, 1, -1) < 0)
+      err(EXIT_FAILURE, "poll");
+
+    while(async_reap(&c) == 0) {
+      display_status(c.status, c.tx);
+      done++;
+    }
+  }
+}
+
 static void start(const struct context *ctx)
 {
   struct timespec begin, end;
-  unsigned int tx;
+  unsigned int i, tx;
   uint64_t nsec;
   int ret;
 
-  UNUSED(ctx);
-
   clock_gettime(CLOCK_MONOTONIC, &begin);
-  ret = loramac_send(ctx->dst_mac, message, strlen(message), &tx);
+  if(use_async)
+    send_async(ctx);
+  else {
+    for(i = 0 ; i < count ; i++) {
+      ret = loramac_send(ctx->mac, ctx->dst_mac, message, strlen(message), &tx);
+      display_status(ret, tx);
+    }
+  }
   clock_gettime(CLOCK_MONOTONIC, &end);
 
   nsec = substract_nsec(&begin, &end);
 
-  putchar('\n');
   if(display_time)
     printf("TIME     : %s\n", scale_time(nsec));
-  printf("TX STATUS: %s (%d)\n", loramac_send2str(ret), ret);
-  printf("TX COUNT : %d\n", tx);
 }
 
 static void destroy(const struct context *ctx)
@@ -91,6 +141,8 @@ static void destroy(const struct context *ctx)
 
 static int parse_option(const struct context *ctx, int c)
 {
+  int err;
+
   UNUSED(ctx);
 
   switch(c) {
@@ -100,6 +152,14 @@ static int parse_option(const struct context *ctx, int c)
   case 'm':
     message = optarg;
     return 1;
+  case 'A':
+    use_async = 1;
+    return 1;
+  case 'n':
+    count = xatou(optarg, &err);
+    if(err || !count)
+      errx(EXIT_FAILURE, "cannot parse count");
+    return 1;
   }
 
   return 0;
@@ -108,19 +168,23 @@ static int parse_option(const struct context *ctx, int c)
 struct option send_opts[] = {
   { "time", no_argument, NULL, 'T' },
   { "message", required_argument, NULL, 'm' },
+  { "async", no_argument, NULL, 'A' },
+  { "count", required_argument, NULL, 'n' },
   { NULL, 0, NULL, 0 }
 };
 struct opt_help send_messages[] = {
   { 'T', "time",    "Display the time necessary to send the message (including retransmissions)" },
   { 'm', "message", "Message to be send (default: \"Hello World!\")"},
+  { 'A', "async",   "Queue all messages at once and wait for their completion" },
+  { 'n', "count",   "Number of messages to send (default: 1)" },
   { 0, NULL, NULL }
 };
 
 struct iface_mode iface_mode = {
   .name = "send",
-  .description = "Send a single frame",
+  .description = "Send a frame, or several with --count",
 
-  .optstring      = "Tm:",
+  .optstring      = "Tm:An:",
   .long_opts      = send_opts,
   .extra_messages = send_messages,
   .parse_option   = parse_option,
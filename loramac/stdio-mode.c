@@ -22,41 +22,357 @@
    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <getopt.h>
-#include <errno.h>
+#include <poll.h>
 #include <err.h>
 
 #include "loramac-str.h"
 #include "loramac.h"
+#include "async.h"
 #include "help.h"
 #include "main.h"
-#include "dump.h"
+#include "xatoi.h"
+#include "jsonl.h"
+#include "timer.h"
+#include "log.h"
 #include "common.h"
 #include "mode.h"
 
 #define PROMPT   "input> "
 #define BUF_SIZE LORAMAC_MAX_PAYLOAD
 
+/* With --framed stdin and stdout carry records instead of text,
+   so that the mode can be driven from a pipeline:
+     send to dst   'S' [dst (16)] [size (16)] <payload...>
+     send to -d    's' [size (16)] <payload...>
+     send status   'T' [record (32)] [status (8)] [tx (8)]
+     received      'R' [src (16)] [dst (16)] [status (8)] [size (16)] <payload...>
+   Integers are big endian. The sends are queued (see async.h) and
+   their status comes once sent, in order, with the number of the
+   send record counted from zero. With --hex each record is written
+   in hexadecimal on its own line instead, spaces are skipped. */
+#define ASYNC_DEPTH  64
+#define RECORD_SIZE  (1 + 2 + 2 + 1 + 2 + LORAMAC_MAX_MESSAGE)
+#define MAX_RECORD   0xffff /* largest payload a record can carry */
+
+enum framing {
+  FRAMING_NONE,
+  FRAMING_BINARY,
+  FRAMING_HEX
+};
+
+/* With --json each received frame and each send status is a
+   JSON object on its own line (see jsonl.h) instead of a dump:
+     {"event":"recv","medium":"lora","src":"0001","dst":"0002",
+      "status":"success","code":0,"stamp_us":...,"size":...,
+      "payload":"..."}
+     {"event":"sent","dst":"0002","status":"success","code":0,"tx":1}
+   The driver reports no link metadata, the stamp is the clock
+   when the frame was delivered. The prompt is not shown. The
+   records are buffered and written out once no other frame
+   arrived within FLUSH_TIMEOUT us. */
+#define FLUSH_TIMEOUT 10000
+
+static unsigned int sample = 1;
+static enum framing framing;
+static int json;
+static enum jsonl_bytes encoding;
+static char output_buf[1 << 16];
+
+/* Records are written by the receive path and the sender thread. */
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long completed;
+
+/* Line of a hex record being decoded. */
+static unsigned char line[2 * (1 + 2 + 2 + MAX_RECORD) + 2];
+static unsigned int line_size, line_pos;
+
+static void put_record(const unsigned char *record, unsigned int size)
+{
+  unsigned int i;
+
+  pthread_mutex_lock(&output_lock);
+  {
+    if(framing == FRAMING_HEX) {
+      for(i = 0 ; i < size ; i++)
+        printf("%02x", record[i]);
+      putchar('\n');
+    }
+    else
+      fwrite(record, 1, size, stdout);
+    fflush(stdout);
+  }
+  pthread_mutex_unlock(&output_lock);
+}
+
+static void put_json(const char *record, size_t size, int sync)
+{
+  pthread_mutex_lock(&output_lock);
+  {
+    fwrite(record, 1, size, stdout);
+    if(sync)
+      fflush(stdout);
+  }
+  pthread_mutex_unlock(&output_lock);
+}
+
+static void recv_json(uint16_t src, uint16_t dst,
+                      const void *payload, unsigned int payload_size,
+                      int status)
+{
+  static char record[JSONL_SIZE(LORAMAC_MAX_MESSAGE)];
+  char *b = record;
+
+  if(payload_size > LORAMAC_MAX_MESSAGE)
+    payload_size = LORAMAC_MAX_MESSAGE;
+
+  b = jsonl_begin(b);
+  b = jsonl_str(b, "event", "recv");
+  b = jsonl_str(b, "medium", "lora");
+  b = jsonl_addr(b, "src", src);
+  b = jsonl_addr(b, "dst", dst);
+  b = jsonl_str(b, "status", loramac_rcv2str(status));
+  b = jsonl_int(b, "code", status);
+  b = jsonl_uint(b, "stamp_us", clock_us());
+  b = jsonl_uint(b, "size", payload_size);
+  b = jsonl_bytes(b, "payload", payload, payload_size, encoding);
+  b = jsonl_end(b);
+
+  put_json(record, b - record, 0);
+}
+
+static void sent_json(uint16_t dst, int status, unsigned int tx)
+{
+  char record[JSONL_FIELDS_SIZE];
+  char *b = record;
+
+  b = jsonl_begin(b);
+  b = jsonl_str(b, "event", "sent");
+  b = jsonl_addr(b, "dst", dst);
+  b = jsonl_str(b, "status", loramac_send2str(status));
+  b = jsonl_int(b, "code", status);
+  b = jsonl_uint(b, "tx", tx);
+  b = jsonl_end(b);
+
+  put_json(record, b - record, 1);
+}
+
+static void put_status(unsigned long record, int status, unsigned int tx)
+{
+  unsigned char r[8] = { 'T', record >> 24, record >> 16, record >> 8, record,
+                         status, tx > 0xff ? 0xff : tx };
+
+  put_record(r, 1 + 4 + 1 + 1);
+}
+
+static void cb_sent(const struct async_completion *completion, void *data)
+{
+  UNUSED(data);
+
+  put_status((uintptr_t)completion->arg, completion->status, completion->tx);
+  __atomic_add_fetch(&completed, 1, __ATOMIC_RELEASE);
+}
+
+static int hex_digit(int c)
+{
+  if(c >= '0' && c <= '9')
+    return c - '0';
+  if(c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if(c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+/* Decode the next non-empty hex line. Return false on end of file. */
+static int get_line(void)
+{
+  char buf[sizeof(line)];
+  int hi = -1, d;
+  char *c;
+
+  do {
+    if(!fgets(buf, sizeof(buf), stdin))
+      return 0;
+
+    line_size = line_pos = 0;
+    for(c = buf ; *c && *c != '\n' ; c++) {
+      if(*c == ' ' || *c == '\t' || *c == '\r')
+        continue;
+
+      d = hex_digit(*c);
+      if(d < 0)
+        errx(EXIT_FAILURE, "invalid hex record");
+      if(hi < 0)
+        hi = d;
+      else {
+        line[line_size++] = hi << 4 | d;
+        hi = -1;
+      }
+    }
+    if(hi >= 0)
+      errx(EXIT_FAILURE, "odd number of hex digits in record");
+  } while(!line_size);
+
+  return 1;
+}
+
+/* Read the fields of a record. A record may not
+   end before its size, neither may a hex line. */
+static void get_bytes(void *buf, unsigned int size)
+{
+  if(framing == FRAMING_BINARY) {
+    if(fread(buf, 1, size, stdin) != size)
+      errx(EXIT_FAILURE, "truncated record");
+    return;
+  }
+
+  if(line_size - line_pos < size)
+    errx(EXIT_FAILURE, "truncated record");
+  memcpy(buf, line + line_pos, size);
+  line_pos += size;
+}
+
+static unsigned int get_u16(void)
+{
+  unsigned char v[2];
+
+  get_bytes(v, sizeof(v));
+  return v[0] << 8 | v[1];
+}
+
+/* Read the kind of the next record. Return false on end of file. */
+static int get_kind(unsigned char *kind)
+{
+  if(framing == FRAMING_HEX) {
+    if(line_pos != line_size)
+      errx(EXIT_FAILURE, "trailing bytes after record");
+    if(!get_line())
+      return 0;
+    get_bytes(kind, 1);
+    return 1;
+  }
+
+  return fread(kind, 1, 1, stdin) == 1;
+}
+
+/* Wait until the sender thread completed
+   another message or the queue has room. */
+static void wait_completion(void)
+{
+  struct async_completion c;
+  struct pollfd pfd = { .fd = async_fd(), .events = POLLIN };
+
+  /* the callback reports them, the pipe is only used to wait */
+  while(async_reap(&c) == 0);
+  if(poll(&pfd, 1, -1) < 0)
+    err(EXIT_FAILURE, "poll");
+}
+
+/* Queue the send records as they are read and report
+   their status until all of them have been sent. */
+static void start_framed(const struct context *ctx)
+{
+  static unsigned char payload[MAX_RECORD];
+  unsigned long record = 0, queued = 0;
+  unsigned int size;
+  unsigned char kind;
+  uint16_t dst;
+  int ret;
+
+  async_init(ctx->mac, ASYNC_DEPTH, cb_sent, NULL);
+
+  while(get_kind(&kind)) {
+    switch(kind) {
+    case 'S':
+      dst = get_u16();
+      break;
+    case 's':
+      dst = ctx->dst_mac;
+      break;
+    default:
+      errx(EXIT_FAILURE, "unknown record '%c'", kind);
+    }
+
+    size = get_u16();
+    get_bytes(payload, size);
+
+    while((ret = async_send(dst, payload, size, (void *)(uintptr_t)record, NULL)) == LORAMAC_SND_BUSY)
+      wait_completion();
+
+    /* too long, reported in order once the others are sent */
+    if(ret != LORAMAC_SND_SUCCESS) {
+      while(__atomic_load_n(&completed, __ATOMIC_ACQUIRE) != queued)
+        wait_completion();
+      put_status(record++, ret, 0);
+      continue;
+    }
+
+    record++;
+    queued++;
+  }
+
+  while(__atomic_load_n(&completed, __ATOMIC_ACQUIRE) != queued)
+    wait_completion();
+}
+
 static void cb_recv(uint16_t src, uint16_t dst,
                     const void *payload, unsigned int payload_size,
                     int status, void *data)
 {
+  static unsigned long received;
+  char head[32], tail[64];
+
   UNUSED(data);
 
-  putchar('\n');
-  printf("FROM %04X TO %04X:\n", src, dst);
-  hex_dump(payload, payload_size);
-  printf("RX STATUS: %s (%d)\n", loramac_rcv2str(status), status);
+  /* only dump one frame out of sample */
+  if(received++ % sample)
+    return;
+
+  if(json) {
+    recv_json(src, dst, payload, payload_size, status);
+    return;
+  }
+
+  if(framing != FRAMING_NONE) {
+    unsigned char record[RECORD_SIZE] = { 'R', src >> 8, src, dst >> 8, dst, status,
+                                          payload_size >> 8, payload_size };
+
+    if(payload_size > LORAMAC_MAX_MESSAGE)
+      payload_size = LORAMAC_MAX_MESSAGE;
+    memcpy(record + 8, payload, payload_size);
+    put_record(record, 8 + payload_size);
+    return;
+  }
+
+  snprintf(head, sizeof(head), "\nFROM %04X TO %04X:\n", src, dst);
+  snprintf(tail, sizeof(tail), "RX STATUS: %s (%d)\n", loramac_rcv2str(status), status);
+  log_dump(LOG_CAT_RX, LOG_LVL_INFO, head, payload, payload_size, tail);
 }
 
 static void init(const struct context  *ctx, struct loramac_config *loramac)
 {
   UNUSED(ctx);
   loramac->cb_recv = cb_recv;
+
+  if(json && framing != FRAMING_NONE)
+    errx(EXIT_FAILURE, "--json and --framed are exclusive");
+  if(json)
+    setvbuf(stdout, output_buf, _IOFBF, sizeof(output_buf));
+}
+
+static void flush(const struct context *ctx)
+{
+  UNUSED(ctx);
+
+  pthread_mutex_lock(&output_lock);
+  fflush(stdout);
+  pthread_mutex_unlock(&output_lock);
 }
 
 static void start(const struct context *ctx)
@@ -65,21 +381,17 @@ static void start(const struct context *ctx)
   unsigned int tx;
   char buf[BUF_SIZE];
 
+  if(framing != FRAMING_NONE) {
+    start_framed(ctx);
+    return;
+  }
+
   while(1) {
-    printf(PROMPT);
-
-    /* Interruption often occurs on stdin because
-       we use the timers a lot. So we *have* to
-       handle syscall interruptions. */
-  RESTART:
-    if(!fgets(buf, sizeof(buf), stdin)) {
-      switch(errno) {
-      case EINTR:
-        goto RESTART;
-      default:
-        errx(EXIT_FAILURE, "cannot read from stdin");
-      }
-    }
+    if(!json)
+      printf(PROMPT);
+
+    if(!fgets(buf, sizeof(buf), stdin))
+      errx(EXIT_FAILURE, "cannot read from stdin");
 
     /* strip newline */
     strtok(buf, "\n");
@@ -89,7 +401,11 @@ static void start(const struct context *ctx)
     else if(!strcmp(buf, "exit"))
       return;
 
-    ret = loramac_send(ctx->dst_mac, buf, strlen(buf), &tx);
+    ret = loramac_send(ctx->mac, ctx->dst_mac, buf, strlen(buf), &tx);
+    if(json) {
+      sent_json(ctx->dst_mac, ret, tx);
+      continue;
+    }
     printf("TX STATUS: %s (%d)\n", loramac_send2str(ret), ret);
     printf("TX COUNT : %d\n", tx);
   }
@@ -102,22 +418,64 @@ static void destroy(const struct context *ctx)
 
 static int parse_option(const struct context *ctx, int c)
 {
+  int err;
+
   UNUSED(ctx);
-  UNUSED(c);
+
+  switch(c) {
+  case 'n':
+    sample = xatou(optarg, &err);
+    if(err || !sample)
+      errx(EXIT_FAILURE, "invalid sample rate");
+    return 1;
+  case 'F':
+    if(framing == FRAMING_NONE)
+      framing = FRAMING_BINARY;
+    return 1;
+  case 'X':
+    framing = FRAMING_HEX;
+    return 1;
+  case 'j':
+    json = 1;
+    iface_mode.flush         = flush;
+    iface_mode.flush_timeout = FLUSH_TIMEOUT;
+    return 1;
+  case 'e':
+    if((err = jsonl_encoding(optarg)) < 0)
+      errx(EXIT_FAILURE, "unknown encoding (hex or base64)");
+    encoding = err;
+    return 1;
+  }
 
   return 0; /* option unknown by this module,
                can be be parsed by next module */
 }
 
-struct option stdio_opts[]       = { { NULL, 0, NULL, 0 } };
+struct option stdio_opts[] = {
+  { "sample", required_argument, NULL, 'n' },
+  { "framed", no_argument, NULL, 'F' },
+  { "hex", no_argument, NULL, 'X' },
+  { "json", no_argument, NULL, 'j' },
+  { "encoding", required_argument, NULL, 'e' },
+  { NULL, 0, NULL, 0 }
+};
+
+struct opt_help stdio_messages[] = {
+  { 'n', "sample", "Only dump one received frame out of N (default: all)" },
+  { 'F', "framed", "Read binary send records from stdin and write statuses and received frames as records" },
+  { 'X', "hex",    "Same as --framed with each record in hex on its own line" },
+  { 'j', "json",     "Write received frames and send statuses as JSON lines" },
+  { 'e', "encoding", "Encoding of the payloads in JSON, hex or base64 (default: hex)" },
+  { 0, NULL, NULL }
+};
 
 struct iface_mode iface_mode = {
   .name        = "stdio",
   .description = "Read output frame and print received frames on stdio",
 
-  .optstring      = "",
+  .optstring      = "n:FXje:",
   .long_opts      = stdio_opts,
-  .extra_messages = NULL,
+  .extra_messages = stdio_messages,
   .parse_option   = parse_option,
 
   .init    = init,
@@ -0,0 +1,250 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _POSIX_C_SOURCE 200112L
+#endif /* __linux__ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "loramac.h"
+#include "crc-ccitt.h"
+
+/* Measure the codec hot paths over synthetic corpora and
+   report the time spent per byte. Each benchmark is repeated
+   until it ran for at least BENCH_TIME so that the result is
+   stable enough to compare encoders or their variants.
+
+   The UART stream is made of data frames encoded by the driver
+   itself and is parsed either one byte at a time or as a single
+   buffer as the UART input thread does. We also check that the
+   framer recovers when bytes are lost on the line and that frames
+   written with uart_sendv() are the same as with uart_send(). */
+
+#define BENCH_TIME  200000000ULL /* 200ms */
+#define CORPUS_SIZE 65536
+#define FRAME_SIZE  (LORAMAC_MAX_PAYLOAD)
+
+static unsigned char corpus[CORPUS_SIZE];
+static unsigned char stream[CORPUS_SIZE];
+static unsigned int stream_size;
+
+static struct loramac_ctx tx_mac, rx_mac;
+static unsigned int frames;
+static volatile uint16_t sink;
+
+static uint64_t now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Run a benchmark that processes size bytes per iteration. */
+static void bench(const char *name, void (*f)(void), unsigned long size)
+{
+  uint64_t begin, elapsed;
+  unsigned long runs = 0;
+
+  f(); /* warm up */
+
+  begin = now();
+  do {
+    f();
+    runs++;
+    elapsed = now() - begin;
+  } while(elapsed < BENCH_TIME);
+
+  printf("%-24s %8.3f ns/byte %10.1f MB/s\n", name,
+         (double)elapsed / runs / size,
+         (double)size * runs * 1000 / elapsed);
+}
+
+static void bench_crc_ccitt(void)
+{
+  sink ^= crc_ccitt(corpus, CORPUS_SIZE, 0xffff);
+}
+
+static void bench_crc_ccitt_bytewise(void)
+{
+  sink ^= crc_ccitt_bytewise(corpus, CORPUS_SIZE, 0xffff);
+}
+
+static void bench_uart_putc(void)
+{
+  unsigned int i;
+
+  for(i = 0 ; i < stream_size ; i++)
+    loramac_uart_putc(&rx_mac, stream[i]);
+}
+
+static void bench_uart_feed(void)
+{
+  loramac_uart_feed(&rx_mac, stream, stream_size);
+}
+
+/* Encoded frames are appended to the stream. */
+static int uart_send(const void *buf, unsigned int size, void *data)
+{
+  (void)data;
+
+  if(stream_size + size > sizeof(stream))
+    return -1;
+  memcpy(stream + stream_size, buf, size);
+  stream_size += size;
+
+  return 0;
+}
+
+static int uart_sendv(const struct loramac_iovec *iov, unsigned int count, void *data)
+{
+  unsigned int i;
+
+  for(i = 0 ; i < count ; i++)
+    if(uart_send(iov[i].base, iov[i].size, data))
+      return -1;
+
+  return 0;
+}
+
+static void send_stream(void)
+{
+  unsigned int i;
+
+  stream_size = 0;
+  for(i = 0 ; i < 255 ; i++)
+    loramac_send(&tx_mac, 0x0002, corpus + i * FRAME_SIZE, FRAME_SIZE, NULL);
+}
+
+static void cb_recv(uint16_t src, uint16_t dst,
+                    const void *payload, unsigned int payload_size,
+                    int status, void *data)
+{
+  (void)src;
+  (void)dst;
+  (void)payload;
+  (void)payload_size;
+  (void)data;
+
+  if(status == LORAMAC_RCV_SUCCESS)
+    frames++;
+}
+
+static void nop(void *data) { (void)data; }
+static void start_timer(unsigned int us, void *data) { (void)us; (void)data; }
+static unsigned long clock_zero(void *data) { (void)data; return 0; }
+static uint16_t xhtons(uint16_t v) { return htons(v); }
+static uint16_t xntohs(uint16_t v) { return ntohs(v); }
+
+int main(void)
+{
+  struct loramac_config loramac = {
+    .uart_send   = uart_send,
+    .cb_recv     = cb_recv,
+    .start_timer = start_timer,
+    .stop_timer  = nop,
+    .wait_timer  = nop,
+    .clock       = clock_zero,
+    .lock        = nop,
+    .unlock      = nop,
+    .htons       = xhtons,
+    .ntohs       = xntohs,
+    .recv_frame  = loramac_recv_frame,
+    .timeout     = 1000,
+    .sifs        = 10,
+    .retrans     = 1,
+    .flags       = LORAMAC_NOACK
+  };
+  unsigned int i, tx;
+
+  srand(0);
+  for(i = 0 ; i < CORPUS_SIZE ; i++)
+    corpus[i] = rand();
+
+  /* the same frame written both ways */
+  loramac.mac_address = 0x0001;
+  if(loramac_init(&tx_mac, &loramac))
+    return 1;
+  loramac_send(&tx_mac, 0x0002, corpus, FRAME_SIZE, &tx);
+  tx = stream_size;
+
+  loramac.uart_sendv = uart_sendv;
+  if(loramac_init(&tx_mac, &loramac))
+    return 1;
+  loramac_send(&tx_mac, 0x0002, corpus, FRAME_SIZE, NULL);
+  if(stream_size != 2 * tx || memcmp(stream, stream + tx, tx)) {
+    printf("uart_sendv: frames differ from uart_send\n");
+    return 1;
+  }
+
+  loramac.mac_address = 0x0002;
+  if(loramac_init(&rx_mac, &loramac))
+    return 1;
+
+  /* an odd number of frames so that the sequence
+     numbers do not repeat when the stream is replayed */
+  send_stream();
+
+  bench("crc_ccitt", bench_crc_ccitt, CORPUS_SIZE);
+  bench("crc_ccitt_bytewise", bench_crc_ccitt_bytewise, CORPUS_SIZE);
+
+  frames = 0;
+  bench("loramac_uart_putc", bench_uart_putc, stream_size);
+  if(!frames) {
+    printf("no frame parsed\n");
+    return 1;
+  }
+
+  bench("loramac_uart_feed", bench_uart_feed, stream_size);
+
+  /* Drop one byte in every other frame, the frames
+     in between must still be parsed. */
+  for(i = 0, tx = 0 ; i < stream_size ; i += FRAME_SIZE + LORAMAC_HDR_SIZE + 1) {
+    unsigned int n = FRAME_SIZE + LORAMAC_HDR_SIZE + 1;
+
+    if((i / n) % 2 == 0) {
+      memmove(stream + tx, stream + i, n / 2);
+      memmove(stream + tx + n / 2, stream + i + n / 2 + 1, n - n / 2 - 1);
+      tx += n - 1;
+    }
+    else {
+      memmove(stream + tx, stream + i, n);
+      tx += n;
+    }
+  }
+
+  frames = 0;
+  loramac_uart_feed(&rx_mac, stream, tx);
+  printf("resync: %u/%u frames parsed with a byte lost in every other frame\n", frames, 255 / 2);
+  if(frames != 255 / 2)
+    return 1;
+
+  return 0;
+}
@@ -0,0 +1,846 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _XOPEN_SOURCE 600
+#endif /* __linux__ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <ucontext.h>
+#include <math.h>
+#include <time.h>
+#include <err.h>
+#include <arpa/inet.h>
+
+#include "loramac.h"
+#include "loramac-str.h"
+#include "version.h"
+#include "xatoi.h"
+#include "help.h"
+
+/*
+  Discrete-event simulation of a LoRaMAC network.
+
+  Each node is an instance of the real driver (see loramac_ctx)
+  whose platform functions are backed by a virtual clock. Meters
+  send messages to a gateway (address 0) at random times and the
+  gateway acknowledges them, so an hour of traffic of hundreds of
+  meters runs in seconds. The send path blocks on the ACK timer as
+  it would on a thread, each meter runs it in a coroutine of its
+  own that gives the hand back to the scheduler while it waits.
+  The receive path and the ACKs run from the scheduler.
+
+  The radio is half-duplex and frames that overlap at a receiver
+  are lost (no capture effect). The channel model decides which
+  other frames a receiver gets:
+    ideal          every node hears every other one
+    loss:PERCENT   each frame is lost at each receiver with this probability
+    range:METERS   meters spread in a disk around the gateway, with a
+                   log-distance path loss and log-normal shadowing
+                   against the sensitivity of the spreading factor
+  Interferers that are too far to be heard do not collide.
+
+  The simulation is deterministic for a given seed.
+*/
+
+#define SIM_STACK      (64 * 1024)
+#define SIM_GATEWAY    0x0000
+#define SIM_MIN_PAYLOAD (sizeof(uint16_t) + sizeof(uint32_t)) /* source, message */
+
+/* Path loss of the range model (log-distance, as measured in an
+   urban environment at 868 MHz) and power of the transmitters. */
+#define SIM_TX_POWER  14.0   /* dBm */
+#define SIM_PL_D0     1000.0 /* m */
+#define SIM_PL0       127.41 /* dB at SIM_PL_D0 */
+#define SIM_PL_EXP    2.08
+#define SIM_SHADOWING 3.57   /* dB */
+
+enum model {
+  MODEL_IDEAL,
+  MODEL_LOSS,
+  MODEL_RANGE
+};
+
+enum event_type {
+  EV_WAKE,   /* resume the coroutine of a node */
+  EV_TIMER,  /* ACK timer of a node */
+  EV_TX_END, /* end of a frame on air */
+  EV_ACK     /* pending ACKs of a node are due */
+};
+
+/* A frame on air. Frames are kept until no frame that overlaps
+   them can still be on air, for the collisions. */
+struct tx {
+  uint64_t       start, end;
+  struct node   *src;
+  uint16_t       dst;  /* node the frame is for, the losses count there */
+  unsigned int   size;
+  unsigned char  buf[LORAMAC_MAX_FRAME + 1];
+  struct tx     *next;
+};
+
+struct node {
+  struct loramac_ctx mac;
+  uint16_t addr;
+  double   x, y; /* position in m (range model) */
+
+  /* coroutine of the send path, none for the gateway */
+  ucontext_t uc;
+  void *stack;
+  int   waiting; /* yielded until the next EV_WAKE */
+  int   done;
+
+  /* ACK timer, stale events have another generation */
+  int          timer_armed;
+  unsigned int timer_gen;
+
+  /* the ACKs wait for the lock held by the send path */
+  unsigned int locked;
+  int          ack_pending;
+
+  uint64_t tx_end;  /* end of our last frame on air (half-duplex) */
+
+  /* traffic */
+  uint32_t msg_sent;
+  uint32_t msg_seen; /* last message received from this meter (gateway side) */
+};
+
+struct event {
+  uint64_t        due;
+  uint64_t        seq; /* FIFO among events of the same time */
+  enum event_type type;
+  struct node    *node;
+  unsigned int    gen;
+  struct tx      *tx;
+};
+
+static struct node *nodes;
+static unsigned int nnodes = 101; /* gateway included */
+
+static struct event *heap;
+static unsigned int  heap_len, heap_size;
+static uint64_t      event_seq;
+
+static struct tx *on_air; /* most recent first */
+static uint64_t   max_airtime;
+
+static ucontext_t  sched_uc;
+static struct node *running;
+static uint64_t     vnow; /* virtual clock in us */
+static uint64_t     duration = 3600ULL * 1000000;
+static uint64_t     rng_state = 1;
+
+static enum model     model = MODEL_IDEAL;
+static double         loss;    /* probability (loss model) */
+static double         radius;  /* m (range model) */
+static double         sensitivity;
+static unsigned int   interval = 600; /* mean s between messages of a meter */
+static unsigned int   payload_size = 20;
+static struct duty_radio radio = DUTY_RADIO_DEFAULT;
+static int verbose;
+
+static struct loramac_config mac_conf = {
+  .retrans      = 3,
+  .timeout      = 200000, /* 200 ms */
+  .sifs         = 20000,  /* 20 ms */
+  .backoff      = LORAMAC_BACKOFF_JITTER,
+  .backoff_slot = 100000, /* 100 ms */
+  .backoff_max  = 8000000,
+  .lbt_slot     = 50000,  /* 50 ms */
+  .lbt_tries    = 4,
+};
+
+/* Results */
+static struct {
+  unsigned long offered;
+  unsigned long acked;
+  unsigned long delivered;
+  unsigned long frames;
+  unsigned long collided;
+  unsigned long half_duplex;
+  unsigned long faded;
+  uint64_t      airtime;
+  uint64_t      busy;
+  uint64_t      busy_until;
+  uint64_t      latency_sum;
+  uint64_t      latency_max;
+} stats;
+
+/* xorshift64*, the meters draw from the same generator
+   so a run only depends on the seed. */
+static uint64_t rnd(void)
+{
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545f4914f6cdd1dULL;
+}
+
+static double rnd_unit(void)
+{
+  return (rnd() >> 11) * (1.0 / 9007199254740992.0); /* [0, 1) */
+}
+
+static double rnd_normal(void)
+{
+  double u = 1.0 - rnd_unit(), v = rnd_unit();
+
+  return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+}
+
+/* Event queue, a binary min-heap on the due time. */
+static int event_before(const struct event *a, const struct event *b)
+{
+  return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+}
+
+static void schedule(uint64_t due, enum event_type type, struct node *node,
+                     unsigned int gen, struct tx *tx)
+{
+  unsigned int i, parent;
+
+  if(heap_len == heap_size) {
+    heap_size = heap_size ? heap_size * 2 : 1024;
+    heap = realloc(heap, heap_size * sizeof(struct event));
+    if(!heap)
+      err(EXIT_FAILURE, "realloc");
+  }
+
+  i = heap_len++;
+  heap[i] = (struct event){ due, event_seq++, type, node, gen, tx };
+  while(i) {
+    struct event e;
+
+    parent = (i - 1) / 2;
+    if(!event_before(&heap[i], &heap[parent]))
+      break;
+    e = heap[i]; heap[i] = heap[parent]; heap[parent] = e;
+    i = parent;
+  }
+}
+
+static struct event pop(void)
+{
+  struct event top = heap[0];
+  unsigned int i = 0, child;
+
+  heap[0] = heap[--heap_len];
+  while((child = 2 * i + 1) < heap_len) {
+    struct event e;
+
+    if(child + 1 < heap_len && event_before(&heap[child + 1], &heap[child]))
+      child++;
+    if(!event_before(&heap[child], &heap[i]))
+      break;
+    e = heap[i]; heap[i] = heap[child]; heap[child] = e;
+    i = child;
+  }
+
+  return top;
+}
+
+/* Coroutines */
+static void resume(struct node *node)
+{
+  running = node;
+  node->waiting = 0;
+  if(swapcontext(&sched_uc, &node->uc) < 0)
+    err(EXIT_FAILURE, "swapcontext");
+  running = NULL;
+}
+
+static void yield(struct node *node)
+{
+  if(running != node)
+    errx(EXIT_FAILURE, "node %04X blocked outside of its send path", node->addr);
+
+  node->waiting = 1;
+  if(swapcontext(&node->uc, &sched_uc) < 0)
+    err(EXIT_FAILURE, "swapcontext");
+}
+
+static void sleep_us(struct node *node, uint64_t us)
+{
+  schedule(vnow + us, EV_WAKE, node, 0, NULL);
+  yield(node);
+}
+
+/* Channel models */
+static double path_loss(const struct node *a, const struct node *b)
+{
+  double d = hypot(a->x - b->x, a->y - b->y);
+
+  if(d < 1.0)
+    d = 1.0;
+  return SIM_PL0 + 10.0 * SIM_PL_EXP * log10(d / SIM_PL_D0);
+}
+
+/* Whether a frame of src can be heard at dst at all. */
+static int in_range(const struct node *src, const struct node *dst)
+{
+  return model != MODEL_RANGE || SIM_TX_POWER - path_loss(src, dst) >= sensitivity;
+}
+
+/* Whether this frame of src is lost at dst. */
+static int faded(const struct node *src, const struct node *dst)
+{
+  switch(model) {
+  case MODEL_LOSS:
+    return rnd_unit() < loss;
+  case MODEL_RANGE:
+    return SIM_TX_POWER - path_loss(src, dst) + SIM_SHADOWING * rnd_normal() < sensitivity;
+  default:
+    return 0;
+  }
+}
+
+/* Sensitivity of the SX127x at 125 kHz, 3 dB worse for each doubling of the bandwidth. */
+static double sf_sensitivity(const struct duty_radio *r)
+{
+  static const double sens[] = { -118., -123., -126., -129., -132., -134.5, -137. }; /* SF6 to SF12 */
+
+  return sens[r->sf - 6] + 10.0 * log10(r->bw / 125000.);
+}
+
+/* Platform functions of the driver */
+static int uart_send(const void *buf, unsigned int size, void *data)
+{
+  struct node *node = data;
+  struct tx *tx = malloc(sizeof(struct tx));
+  unsigned int frame = ((const unsigned char *)buf)[0] & ~LORAMAC_SIZE_NOACK;
+
+  if(!tx)
+    err(EXIT_FAILURE, "malloc");
+  if(size > sizeof(tx->buf))
+    errx(EXIT_FAILURE, "frame too long (%u bytes)", size);
+
+  /* the module sends the frames one after the other */
+  tx->start = vnow > node->tx_end ? vnow : node->tx_end;
+  tx->end   = tx->start + duty_airtime(&radio, frame);
+  tx->src   = node;
+  tx->size  = size;
+  /* the meters only talk to the gateway, which only sends (block) ACKs
+     whose first field is the meter */
+  tx->dst   = node->addr ? 0 : ntohs(*(const uint16_t *)((const unsigned char *)buf + 1));
+  memcpy(tx->buf, buf, size);
+  tx->next  = on_air;
+  on_air    = tx;
+
+  node->tx_end = tx->end;
+  stats.frames++;
+  stats.airtime += tx->end - tx->start;
+  if(tx->end > stats.busy_until) {
+    stats.busy += tx->end - (tx->start > stats.busy_until ? tx->start : stats.busy_until);
+    stats.busy_until = tx->end;
+  }
+  schedule(tx->end, EV_TX_END, node, 0, tx);
+
+  if(verbose)
+    printf("%10.6f %04X: frame of %u bytes\n", vnow / 1e6, node->addr, frame);
+  return 0;
+}
+
+static void start_timer(unsigned int us, void *data)
+{
+  struct node *node = data;
+
+  node->timer_armed = 1;
+  schedule(vnow + us, EV_TIMER, node, ++node->timer_gen, NULL);
+}
+
+static void stop_timer(void *data)
+{
+  struct node *node = data;
+
+  node->timer_armed = 0;
+  node->timer_gen++;
+  if(node->waiting)
+    schedule(vnow, EV_WAKE, node, 0, NULL);
+}
+
+static void wait_timer(void *data)
+{
+  struct node *node = data;
+
+  while(node->timer_armed)
+    yield(node);
+}
+
+static unsigned long sim_clock(void *data)
+{
+  (void)data;
+  return vnow;
+}
+
+static void sim_usleep(unsigned long us, void *data)
+{
+  sleep_us(data, us);
+}
+
+static void lock(void *data)
+{
+  ((struct node *)data)->locked++;
+}
+
+static void unlock(void *data)
+{
+  struct node *node = data;
+
+  if(!--node->locked && node->ack_pending) {
+    node->ack_pending = 0;
+    schedule(vnow, EV_ACK, node, 0, NULL);
+  }
+}
+
+static void nop(void *data) { (void)data; }
+
+static void schedule_ack(unsigned int us, void *data)
+{
+  schedule(vnow + us, EV_ACK, data, 0, NULL);
+}
+
+static uint16_t xhtons(uint16_t v) { return htons(v); }
+static uint16_t xntohs(uint16_t v) { return ntohs(v); }
+
+static void cb_recv(uint16_t src, uint16_t dst,
+                    const void *payload, unsigned int size,
+                    int status, void *data)
+{
+  const unsigned char *p = payload;
+  struct node *meter;
+  uint32_t msg;
+
+  (void)dst;
+  (void)data;
+
+  if(status != LORAMAC_RCV_SUCCESS || size < SIM_MIN_PAYLOAD || !src || src >= nnodes)
+    return;
+
+  /* the source in the payload tells copies from messages */
+  meter = &nodes[src];
+  msg   = (uint32_t)p[2] << 24 | (uint32_t)p[3] << 16 | p[4] << 8 | p[5];
+  if(msg > meter->msg_seen) {
+    meter->msg_seen = msg;
+    stats.delivered++;
+  }
+}
+
+/* Poisson traffic of a meter to the gateway until the end of the run. */
+static void meter_main(int i)
+{
+  struct node *node = &nodes[i];
+  unsigned char payload[LORAMAC_MAX_MESSAGE];
+  uint64_t begin, latency;
+  unsigned int tx;
+
+  memset(payload, 0, sizeof(payload));
+  while(1) {
+    sleep_us(node, -log(1.0 - rnd_unit()) * interval * 1000000.);
+    if(vnow >= duration)
+      break;
+
+    node->msg_sent++;
+    payload[0] = node->addr >> 8;
+    payload[1] = node->addr & 0xff;
+    payload[2] = node->msg_sent >> 24;
+    payload[3] = node->msg_sent >> 16;
+    payload[4] = node->msg_sent >> 8;
+    payload[5] = node->msg_sent;
+
+    stats.offered++;
+    begin = vnow;
+    if(loramac_send(&node->mac, SIM_GATEWAY, payload, payload_size, &tx) == LORAMAC_SND_SUCCESS) {
+      latency = vnow - begin;
+      stats.acked++;
+      stats.latency_sum += latency;
+      if(latency > stats.latency_max)
+        stats.latency_max = latency;
+    }
+  }
+
+  node->done = 1;
+}
+
+/* Deliver a frame that ended to the nodes that got it. */
+static void tx_end(struct tx *tx)
+{
+  struct tx *other, **link;
+  unsigned int i;
+
+  for(i = 0 ; i < nnodes ; i++) {
+    struct node *rx = &nodes[i];
+    int sending = 0, collided = 0;
+
+    if(rx == tx->src || !in_range(tx->src, rx))
+      continue;
+
+    for(other = on_air ; other ; other = other->next) {
+      if(other == tx || other->start >= tx->end || other->end <= tx->start)
+        continue;
+      if(other->src == rx)
+        sending = 1;
+      else if(in_range(other->src, rx))
+        collided = 1;
+    }
+
+    if(sending) {
+      if(rx->addr == tx->dst)
+        stats.half_duplex++;
+      continue;
+    }
+    if(collided) {
+      if(rx->addr == tx->dst)
+        stats.collided++;
+      continue;
+    }
+
+    if(faded(tx->src, rx)) {
+      if(rx->addr == tx->dst)
+        stats.faded++;
+      continue;
+    }
+
+    loramac_uart_feed(&rx->mac, tx->buf, tx->size);
+  }
+
+  /* forget about the frames that cannot overlap another one anymore */
+  for(link = &on_air ; *link ; ) {
+    other = *link;
+    if(other->end + max_airtime < vnow) {
+      *link = other->next;
+      free(other);
+    }
+    else
+      link = &other->next;
+  }
+}
+
+static void run(void)
+{
+  while(heap_len) {
+    struct event e = pop();
+    struct node *node = e.node;
+    unsigned int delay;
+
+    vnow = e.due;
+    switch(e.type) {
+    case EV_WAKE:
+      if(node->waiting && !node->done)
+        resume(node);
+      break;
+    case EV_TIMER:
+      if(e.gen != node->timer_gen || !node->timer_armed)
+        break;
+      node->timer_armed = 0;
+      if(node->waiting)
+        resume(node);
+      break;
+    case EV_TX_END:
+      tx_end(e.tx);
+      break;
+    case EV_ACK:
+      if(node->locked) {
+        node->ack_pending = 1;
+        break;
+      }
+      delay = loramac_flush_acks(&node->mac);
+      if(delay)
+        schedule(vnow + delay, EV_ACK, node, 0, NULL);
+      break;
+    }
+  }
+}
+
+static void init_nodes(void)
+{
+  unsigned int i;
+  int n;
+
+  nodes = calloc(nnodes, sizeof(struct node));
+  if(!nodes)
+    err(EXIT_FAILURE, "calloc");
+
+  for(i = 0 ; i < nnodes ; i++) {
+    struct node *node = &nodes[i];
+    struct loramac_config conf = mac_conf;
+
+    node->addr = i; /* the gateway is node 0 */
+    if(i && model == MODEL_RANGE) {
+      double r = radius * sqrt(rnd_unit()), a = 2.0 * M_PI * rnd_unit();
+
+      node->x = r * cos(a);
+      node->y = r * sin(a);
+    }
+
+    conf.mac_address  = node->addr;
+    conf.backoff_seed = rnd() | 1;
+    conf.seqno        = rnd();
+    conf.data         = node;
+    n = loramac_init(&node->mac, &conf);
+    if(n)
+      errx(EXIT_FAILURE, "cannot initialize node %04X (%d)", node->addr, n);
+
+    if(!i)
+      continue;
+
+    node->stack = malloc(SIM_STACK);
+    if(!node->stack)
+      err(EXIT_FAILURE, "malloc");
+    if(getcontext(&node->uc) < 0)
+      err(EXIT_FAILURE, "getcontext");
+    node->uc.uc_stack.ss_sp   = node->stack;
+    node->uc.uc_stack.ss_size = SIM_STACK;
+    node->uc.uc_link          = &sched_uc;
+    makecontext(&node->uc, (void (*)(void))meter_main, 1, (int)i);
+
+    /* the meters start in their coroutine */
+    node->waiting = 1;
+    schedule(0, EV_WAKE, node, 0, NULL);
+  }
+}
+
+static void parse_model(const char *arg)
+{
+  char *end;
+
+  if(!strcmp(arg, "ideal"))
+    model = MODEL_IDEAL;
+  else if(!strncmp(arg, "loss:", 5)) {
+    model = MODEL_LOSS;
+    loss  = strtod(arg + 5, &end) / 100;
+    if(*end || loss < 0 || loss > 1)
+      errx(EXIT_FAILURE, "invalid loss (0 to 100%%)");
+  }
+  else if(!strncmp(arg, "range:", 6)) {
+    model  = MODEL_RANGE;
+    radius = strtod(arg + 6, &end);
+    if(*end || radius <= 0)
+      errx(EXIT_FAILURE, "invalid radius");
+  }
+  else
+    errx(EXIT_FAILURE, "unknown channel model");
+}
+
+static void print_help(const char *name)
+{
+  struct opt_help messages[] = {
+    { 'h', "help",            "Show this help message" },
+    { 'V', "version",         "Show version information" },
+    { 'v', "verbose",         "Log each frame" },
+    { 'n', "nodes",           "Number of meters (default 100)" },
+    { 'i', "interval",        "Mean seconds between the messages of a meter (default 600)" },
+    { 'p', "payload",         "Message size in bytes (default 20)" },
+    { 'd', "duration",        "Virtual seconds to simulate (default 3600)" },
+    { 'm', "model",           "Channel model (ideal, loss:PERCENT, range:METERS)" },
+    { 'f', "sf",              "Spreading factor (default 7)" },
+    { 'a', "no-ack",          "Do not answer nor expect ACKs" },
+    { 'r', "retransmissions", "Maximum number of retransmissions (default 3)" },
+    { 't', "ack-timeout",     "ACK timeout in microseconds (default 200ms)" },
+    { 's', "sifs",            "Short Inter Frame Spacing time in microseconds (default 20ms)" },
+    { 0,   "backoff",         "Delay before retransmissions (none, exp, jitter, address)" },
+    { 0,   "backoff-slot",    "Backoff of the first retransmission in microseconds (default 100ms)" },
+    { 0,   "lbt",             "Listen before talk, defer while an overheard exchange is not over" },
+    { 'S', "seed",            "Seed of the simulation (default 1)" },
+    { 0, NULL, NULL }
+  };
+
+  help(name, "[OPTIONS]", messages);
+}
+
+static void parse_options(int argc, char *argv[])
+{
+  const char *name = basename(argv[0]);
+  unsigned long seed;
+  int err;
+
+  enum opt {
+    OPT_BACKOFF = 0x100,
+    OPT_BACKOFF_SLOT,
+    OPT_LBT
+  };
+
+  struct option opts[] = {
+    { "help", no_argument, NULL, 'h' },
+    { "version", no_argument, NULL, 'V' },
+    { "verbose", no_argument, NULL, 'v' },
+    { "nodes", required_argument, NULL, 'n' },
+    { "interval", required_argument, NULL, 'i' },
+    { "payload", required_argument, NULL, 'p' },
+    { "duration", required_argument, NULL, 'd' },
+    { "model", required_argument, NULL, 'm' },
+    { "sf", required_argument, NULL, 'f' },
+    { "no-ack", no_argument, NULL, 'a' },
+    { "retransmissions", required_argument, NULL, 'r' },
+    { "ack-timeout", required_argument, NULL, 't' },
+    { "sifs", required_argument, NULL, 's' },
+    { "backoff", required_argument, NULL, OPT_BACKOFF },
+    { "backoff-slot", required_argument, NULL, OPT_BACKOFF_SLOT },
+    { "lbt", no_argument, NULL, OPT_LBT },
+    { "seed", required_argument, NULL, 'S' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  while(1) {
+    int c = getopt_long(argc, argv, "hVvn:i:p:d:m:f:ar:t:s:S:", opts, NULL);
+
+    if(c == -1)
+      break;
+
+    switch(c) {
+    case 'n':
+      nnodes = xatou(optarg, &err) + 1;
+      if(err || nnodes < 2 || nnodes > 0xfffe)
+        errx(EXIT_FAILURE, "invalid number of meters");
+      break;
+    case 'i':
+      interval = xatou(optarg, &err);
+      if(err || !interval)
+        errx(EXIT_FAILURE, "invalid interval");
+      break;
+    case 'p':
+      payload_size = xatou(optarg, &err);
+      if(err || payload_size < SIM_MIN_PAYLOAD)
+        errx(EXIT_FAILURE, "invalid payload size (at least %zu bytes)", SIM_MIN_PAYLOAD);
+      break;
+    case 'd':
+      duration = xatou(optarg, &err) * 1000000ULL;
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse duration");
+      break;
+    case 'm':
+      parse_model(optarg);
+      break;
+    case 'f':
+      radio.sf = xatou(optarg, &err);
+      if(err || duty_radio_check(&radio))
+        errx(EXIT_FAILURE, "invalid spreading factor");
+      break;
+    case 'a':
+      mac_conf.flags |= LORAMAC_NOACK;
+      break;
+    case 'r':
+      mac_conf.retrans = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse retransmissions value");
+      break;
+    case 't':
+      mac_conf.timeout = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse timeout value");
+      break;
+    case 's':
+      mac_conf.sifs = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse SIFS value");
+      break;
+    case OPT_BACKOFF:
+      err = loramac_str2backoff(optarg);
+      if(err < 0)
+        errx(EXIT_FAILURE, "unknown backoff policy");
+      mac_conf.backoff = err;
+      break;
+    case OPT_BACKOFF_SLOT:
+      mac_conf.backoff_slot = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse backoff slot");
+      break;
+    case OPT_LBT:
+      mac_conf.flags |= LORAMAC_LBT;
+      break;
+    case 'S':
+      seed = xatou(optarg, &err);
+      if(err)
+        errx(EXIT_FAILURE, "cannot parse seed");
+      rng_state = seed ? seed : 1; /* never zero */
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    case 'V':
+      version(name);
+      exit(EXIT_SUCCESS);
+    case 'h':
+    default:
+      print_help(name);
+      exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  struct timespec begin, end;
+  double wall;
+
+  mac_conf.uart_send    = uart_send;
+  mac_conf.cb_recv      = cb_recv;
+  mac_conf.start_timer  = start_timer;
+  mac_conf.stop_timer   = stop_timer;
+  mac_conf.wait_timer   = wait_timer;
+  mac_conf.clock        = sim_clock;
+  mac_conf.usleep       = sim_usleep;
+  mac_conf.lock         = lock;
+  mac_conf.unlock       = unlock;
+  mac_conf.schedule_ack = schedule_ack;
+  mac_conf.ack_lock     = nop;
+  mac_conf.ack_unlock   = nop;
+  mac_conf.htons        = xhtons;
+  mac_conf.ntohs        = xntohs;
+  mac_conf.recv_frame   = loramac_recv_frame;
+  mac_conf.radio        = radio;
+
+  parse_options(argc, argv);
+  mac_conf.radio = radio;
+  sensitivity    = sf_sensitivity(&radio);
+  max_airtime    = duty_airtime(&radio, LORAMAC_MAX_FRAME);
+
+  if(payload_size > LORAMAC_MAX_PAYLOAD)
+    errx(EXIT_FAILURE, "payload too long (at most %u bytes)", (unsigned int)(LORAMAC_MAX_PAYLOAD));
+
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  init_nodes();
+  run();
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  wall = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+
+  printf("%u meters, SF%u, %u bytes every %u s, %.0f s simulated in %.3f s\n",
+         nnodes - 1, radio.sf, payload_size, interval, duration / 1e6, wall);
+  printf("offered %lu, acknowledged %lu, delivered %lu (%.2f%%)\n",
+         stats.offered, stats.acked, stats.delivered,
+         stats.offered ? 100.0 * stats.delivered / stats.offered : 0.);
+  printf("frames %lu, lost at their destination: collided %lu, half-duplex %lu, faded %lu\n",
+         stats.frames, stats.collided, stats.half_duplex, stats.faded);
+  printf("offered load %.2f%%, channel busy %.2f%%, latency avg %.1f ms max %.1f ms\n",
+         vnow ? 100.0 * stats.airtime / vnow : 0.,
+         vnow ? 100.0 * stats.busy / vnow : 0.,
+         stats.acked ? stats.latency_sum / 1e3 / stats.acked : 0.,
+         stats.latency_max / 1e3);
+
+  return 0;
+}
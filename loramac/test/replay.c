@@ -0,0 +1,189 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _POSIX_C_SOURCE 200112L
+#endif /* __linux__ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <err.h>
+#include <arpa/inet.h>
+
+#include "loramac.h"
+#include "capture.h"
+
+/* Replay the UART bytes received in a capture file (see --capture)
+   through the LoRaMAC parser, either as fast as possible or with the
+   recorded timing (-r), and report the number of frames parsed.
+   This reproduces a bug seen on the line without the radio. */
+
+static unsigned long frames, errors;
+
+static uint64_t now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t)
+{
+  struct timespec ts;
+  uint64_t n = now();
+
+  if(t <= n)
+    return;
+  t -= n;
+
+  ts.tv_sec  = t / 1000000000ULL;
+  ts.tv_nsec = t % 1000000000ULL;
+  nanosleep(&ts, NULL);
+}
+
+static void cb_recv(uint16_t src, uint16_t dst,
+                    const void *payload, unsigned int payload_size,
+                    int status, void *data)
+{
+  (void)src;
+  (void)dst;
+  (void)payload;
+  (void)payload_size;
+  (void)data;
+
+  /* frames to other destinations are expected in promiscuous mode */
+  if(status == LORAMAC_RCV_INVALID_CRC || status == LORAMAC_RCV_INVALID_HDR)
+    errors++;
+  frames++;
+}
+
+static int uart_send(const void *buf, unsigned int size, void *data)
+{
+  (void)buf;
+  (void)size;
+  (void)data;
+
+  return 0; /* ACKs are dropped */
+}
+
+static void nop(void *data) { (void)data; }
+static void start_timer(unsigned int us, void *data) { (void)us; (void)data; }
+static unsigned long clock_zero(void *data) { (void)data; return 0; }
+static uint16_t xhtons(uint16_t v) { return htons(v); }
+static uint16_t xntohs(uint16_t v) { return ntohs(v); }
+
+int main(int argc, char *argv[])
+{
+  struct loramac_config loramac = {
+    .uart_send   = uart_send,
+    .cb_recv     = cb_recv,
+    .start_timer = start_timer,
+    .stop_timer  = nop,
+    .wait_timer  = nop,
+    .clock       = clock_zero,
+    .lock        = nop,
+    .unlock      = nop,
+    .htons       = xhtons,
+    .ntohs       = xntohs,
+    .recv_frame  = loramac_recv_frame,
+    .mac_address = 0x0000,
+    .timeout     = 1000,
+    .sifs        = 10,
+    .retrans     = 1,
+    .flags       = LORAMAC_NOACK | LORAMAC_PROMISCUOUS | LORAMAC_INVALID
+  };
+  struct loramac_ctx mac;
+  struct capture_record record;
+  uint64_t begin, pass_begin, first = 0, elapsed;
+  unsigned long records = 0, bytes = 0, passes = 1, pass;
+  int realtime = 0;
+  int ret = 0, c;
+  FILE *fp;
+
+  while((c = getopt(argc, argv, "rn:")) != -1) {
+    switch(c) {
+    case 'r':
+      realtime = 1;
+      break;
+    case 'n':
+      passes = strtoul(optarg, NULL, 10);
+      if(!passes)
+        errx(EXIT_FAILURE, "invalid number of passes");
+      break;
+    default:
+      errx(EXIT_FAILURE, "usage: %s [-r] [-n PASSES] capture", argv[0]);
+    }
+  }
+
+  if(optind != argc - 1)
+    errx(EXIT_FAILURE, "usage: %s [-r] [-n PASSES] capture", argv[0]);
+
+  fp = fopen(argv[optind], "rb");
+  if(!fp)
+    err(EXIT_FAILURE, "cannot open %s", argv[optind]);
+
+  if(loramac_init(&mac, &loramac))
+    errx(EXIT_FAILURE, "cannot initialize LoRaMAC");
+
+  /* Short captures are fed several times to time the parser
+     over more than a few microseconds. */
+  begin = now();
+  for(pass = 0 ; pass < passes && ret >= 0 ; pass++) {
+    unsigned long pass_records = 0;
+
+    rewind(fp);
+    pass_begin = now();
+    while((ret = capture_read(fp, &record)) > 0) {
+      if(record.link != CAPTURE_UART || record.dir != CAPTURE_RX)
+        continue;
+
+      if(!pass_records++)
+        first = record.stamp;
+      if(realtime)
+        sleep_until(pass_begin + record.stamp - first);
+
+      loramac_uart_feed(&mac, record.data, record.size);
+
+      records++;
+      bytes += record.size;
+    }
+  }
+  elapsed = now() - begin;
+
+  if(ret < 0)
+    errx(EXIT_FAILURE, "%s: invalid capture file", argv[optind]);
+  fclose(fp);
+
+  printf("%lu records, %lu bytes, %lu frames (%lu errors)\n",
+         records, bytes, frames, errors);
+  printf("%.3f ms, %.1f MB/s\n", (double)elapsed / 1000000,
+         elapsed ? (double)bytes * 1000 / elapsed : 0.);
+
+  return 0;
+}
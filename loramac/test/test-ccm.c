@@ -0,0 +1,103 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ccm.h"
+
+/* Packet vectors #1 to #3 of RFC 3610, an 8 bytes MIC over
+   an 8 bytes header with the AES key C0 C1 ... CF. */
+struct vector {
+  uint8_t      nonce[CCM_NONCE_SIZE];
+  unsigned int size; /* payload after the header */
+  uint8_t      out[AES_BLOCK_SIZE * 3]; /* ciphertext and MIC */
+};
+
+#define HDR_SIZE 8
+#define MIC_SIZE 8
+
+static const struct vector vectors[] = {
+  { { 0x00, 0x00, 0x00, 0x03, 0x02, 0x01, 0x00, 0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5 }, 23,
+    { 0x58, 0x8c, 0x97, 0x9a, 0x61, 0xc6, 0x63, 0xd2, 0xf0, 0x66, 0xd0, 0xc2,
+      0xc0, 0xf9, 0x89, 0x80, 0x6d, 0x5f, 0x6b, 0x61, 0xda, 0xc3, 0x84,
+      0x17, 0xe8, 0xd1, 0x2c, 0xfd, 0xf9, 0x26, 0xe0 } },
+  { { 0x00, 0x00, 0x00, 0x04, 0x03, 0x02, 0x01, 0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5 }, 24,
+    { 0x72, 0xc9, 0x1a, 0x36, 0xe1, 0x35, 0xf8, 0xcf, 0x29, 0x1c, 0xa8, 0x94,
+      0x08, 0x5c, 0x87, 0xe3, 0xcc, 0x15, 0xc4, 0x39, 0xc9, 0xe4, 0x3a, 0x3b,
+      0xa0, 0x91, 0xd5, 0x6e, 0x10, 0x40, 0x09, 0x16 } },
+  { { 0x00, 0x00, 0x00, 0x05, 0x04, 0x03, 0x02, 0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5 }, 25,
+    { 0x51, 0xb1, 0xe5, 0xf4, 0x4a, 0x19, 0x7d, 0x1d, 0xa4, 0x6b, 0x0f, 0x8e,
+      0x2d, 0x28, 0x2a, 0xe8, 0x71, 0xe8, 0x38, 0xbb, 0x64, 0xda, 0x85, 0x96,
+      0x57, 0x4a, 0xda, 0xa7, 0x6f, 0xbd, 0x9f, 0xb0, 0xc5 } }
+};
+
+/* Seal and open each vector, then open it with a flipped bit. */
+int main(int argc, char *argv[])
+{
+  uint8_t raw[AES_KEY_SIZE], packet[HDR_SIZE + AES_BLOCK_SIZE * 2];
+  uint8_t buf[sizeof(packet) + MIC_SIZE];
+  struct aes_key key;
+  unsigned int i, j;
+  int fail = 0;
+
+  for(i = 0 ; i < AES_KEY_SIZE ; i++)
+    raw[i] = 0xc0 + i;
+  for(i = 0 ; i < sizeof(packet) ; i++)
+    packet[i] = i;
+  aes_expand(&key, raw);
+
+  for(i = 0 ; i < sizeof(vectors) / sizeof(vectors[0]) ; i++) {
+    const struct vector *v = &vectors[i];
+    unsigned int size = v->size + MIC_SIZE;
+
+    ccm_seal(&key, v->nonce, packet, HDR_SIZE, packet + HDR_SIZE, v->size, buf, MIC_SIZE);
+    if(memcmp(buf, v->out, size)) {
+      printf("vector #%u: wrong ciphertext or MIC\n", i + 1);
+      fail = 1;
+    }
+
+    if(ccm_open(&key, v->nonce, packet, HDR_SIZE, v->out, size, buf, MIC_SIZE) < 0 ||
+       memcmp(buf, packet + HDR_SIZE, v->size)) {
+      printf("vector #%u: cannot open\n", i + 1);
+      fail = 1;
+    }
+
+    for(j = 0 ; j < size ; j++) {
+      uint8_t forged[sizeof(buf)];
+
+      memcpy(forged, v->out, size);
+      forged[j] ^= 0x01;
+      if(!ccm_open(&key, v->nonce, packet, HDR_SIZE, forged, size, buf, MIC_SIZE)) {
+        printf("vector #%u: opened with byte %u flipped\n", i + 1, j);
+        fail = 1;
+      }
+    }
+  }
+
+  printf("%s\n", fail ? "FAIL" : "OK");
+
+  return fail;
+}
@@ -0,0 +1,155 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+# define _POSIX_C_SOURCE 200809L
+#endif /* __linux__ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "loramac.h"
+#include "counter.h"
+
+/* Check that the security counter of LORAMAC_SECURE goes on across
+   restarts when it is kept in a file (see --counter-file): a new
+   file starts from the given counter, the driver keeps the next one
+   in the store and a restart skips a block after it. */
+
+static const struct loramac_key network = {
+  .addr = 0xffff,
+  .key  = { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+            0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff }
+};
+
+static void cb_recv(uint16_t src, uint16_t dst,
+                    const void *payload, unsigned int payload_size,
+                    int status, void *data)
+{
+  (void)src;
+  (void)dst;
+  (void)payload;
+  (void)payload_size;
+  (void)status;
+  (void)data;
+}
+
+static int uart_send(const void *buf, unsigned int size, void *data)
+{
+  (void)buf;
+  (void)size;
+  (void)data;
+
+  return 0;
+}
+
+static void nop(void *data) { (void)data; }
+static void start_timer(unsigned int us, void *data) { (void)us; (void)data; }
+static unsigned long clock_zero(void *data) { (void)data; return 0; }
+static uint16_t xhtons(uint16_t v) { return htons(v); }
+static uint16_t xntohs(uint16_t v) { return ntohs(v); }
+
+static int fail;
+
+static void expect(const char *what, uint32_t counter, uint32_t expected)
+{
+  if(counter != expected) {
+    printf("%s: counter %08X instead of %08X\n", what, counter, expected);
+    fail = 1;
+  }
+}
+
+/* Start a driver on the store and send a few messages. */
+static void run(uint32_t *store, unsigned int messages)
+{
+  struct loramac_config conf = {
+    .uart_send     = uart_send,
+    .cb_recv       = cb_recv,
+    .start_timer   = start_timer,
+    .stop_timer    = nop,
+    .wait_timer    = nop,
+    .clock         = clock_zero,
+    .lock          = nop,
+    .unlock        = nop,
+    .ack_lock      = nop,
+    .ack_unlock    = nop,
+    .htons         = xhtons,
+    .ntohs         = xntohs,
+    .recv_frame    = loramac_recv_frame,
+    .keys          = &network,
+    .key_count     = 1,
+    .counter_store = store,
+    .mac_address   = 0x0001,
+    .timeout       = 1000,
+    .sifs          = 10,
+    .retrans       = 1,
+    .flags         = LORAMAC_NOACK | LORAMAC_SECURE
+  };
+  struct loramac_ctx mac;
+  unsigned int i, tx;
+
+  if(loramac_init(&mac, &conf)) {
+    printf("cannot initialize LoRaMAC\n");
+    exit(EXIT_FAILURE);
+  }
+  for(i = 0 ; i < messages ; i++)
+    if(loramac_send(&mac, 0x0000, "counter", 7, &tx) != LORAMAC_SND_SUCCESS)
+      fail = 1;
+}
+
+int main(int argc, char *argv[])
+{
+  char path[] = "/tmp/test-counter.XXXXXX";
+  uint32_t *store;
+  int fd;
+
+  fd = mkstemp(path);
+  if(fd < 0) {
+    perror(path);
+    return 1;
+  }
+  close(fd);
+
+  store = counter_open(path, 1000);
+  expect("new file", *store, 1000);
+  run(store, 3);
+  expect("after the first run", *store, 1003);
+
+  store = counter_open(path, 1000);
+  expect("first restart", *store, 1003 + COUNTER_BLOCK);
+  run(store, 2);
+  expect("after the second run", *store, 1005 + COUNTER_BLOCK);
+
+  store = counter_open(path, 0);
+  expect("second restart", *store, 1005 + 2 * COUNTER_BLOCK);
+
+  unlink(path);
+
+  printf("%s\n", fail ? "FAIL" : "OK");
+
+  return fail;
+}
@@ -0,0 +1,204 @@
+/* Copyright (c) 2017, David Hauweele <david@hauweele.net>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice, this
+       list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+   ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+   WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+   DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+   ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+   (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+   LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+   ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "loramac.h"
+
+/* Check the replay protection of LORAMAC_SECURE end to end: the
+   messages of a sender are sealed with the counters of the test,
+   written to the wire and parsed by the receiver (address 0). */
+
+static unsigned char wire[LORAMAC_MAX_FRAME * 4];
+static unsigned int wire_size;
+static unsigned long ticks;
+static int last_status;
+static uint32_t counter;
+static uint8_t seqno;
+
+static const struct loramac_key network = {
+  .addr = 0xffff,
+  .key  = { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+            0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff }
+};
+
+static struct loramac_ctx tx_mac, rx_mac;
+
+static void cb_recv(uint16_t src, uint16_t dst,
+                    const void *payload, unsigned int payload_size,
+                    int status, void *data)
+{
+  (void)src;
+  (void)dst;
+  (void)payload;
+  (void)payload_size;
+  (void)status;
+  (void)data;
+}
+
+static int recv_frame(struct loramac_ctx *ctx)
+{
+  last_status = loramac_recv_frame(ctx);
+  return last_status;
+}
+
+static int uart_send(const void *buf, unsigned int size, void *data)
+{
+  if(data == &tx_mac && wire_size + size <= sizeof(wire)) {
+    memcpy(wire + wire_size, buf, size);
+    wire_size += size;
+  }
+  return 0;
+}
+
+static void nop(void *data) { (void)data; }
+static void start_timer(unsigned int us, void *data) { (void)us; (void)data; }
+static unsigned long clock_tick(void *data) { (void)data; return ++ticks; }
+static uint16_t xhtons(uint16_t v) { return htons(v); }
+static uint16_t xntohs(uint16_t v) { return ntohs(v); }
+
+static struct loramac_config config(uint16_t addr, void *data)
+{
+  return (struct loramac_config){
+    .uart_send     = uart_send,
+    .cb_recv       = cb_recv,
+    .start_timer   = start_timer,
+    .stop_timer    = nop,
+    .wait_timer    = nop,
+    .clock         = clock_tick,
+    .lock          = nop,
+    .unlock        = nop,
+    .ack_lock      = nop,
+    .ack_unlock    = nop,
+    .htons         = xhtons,
+    .ntohs         = xntohs,
+    .recv_frame    = recv_frame,
+    .keys          = &network,
+    .key_count     = 1,
+    .counter_store = &counter,
+    .seqno         = seqno,
+    .mac_address   = addr,
+    .timeout       = 1000,
+    .sifs          = 10,
+    .retrans       = 1,
+    .flags         = LORAMAC_NOACK | LORAMAC_SECURE,
+    .data          = data
+  };
+}
+
+/* Send a message from a sender with a counter and
+   return the status of the receiver. */
+static int send_counter(uint16_t src, uint32_t c)
+{
+  struct loramac_config conf = config(src, &tx_mac);
+  unsigned int tx;
+
+  /* a new sequence number for each message, so
+     that the duplicate table lets them all through */
+  seqno++;
+  counter = c;
+  if(loramac_init(&tx_mac, &conf))
+    return -1;
+
+  wire_size   = 0;
+  last_status = -1;
+  if(loramac_send(&tx_mac, 0x0000, "replay", 6, &tx) != LORAMAC_SND_SUCCESS)
+    return -1;
+  loramac_uart_feed(&rx_mac, wire, wire_size);
+
+  return last_status;
+}
+
+static unsigned int hash(uint16_t sender)
+{
+  /* same as the replay table */
+  return (((sender * 0x9e3779b1UL) & 0xffffffff) >> 16) % LORAMAC_REPLAY_TABLE;
+}
+
+/* Find the next sender after a given one that hashes on a slot. */
+static uint16_t next_on_slot(uint16_t after, unsigned int h)
+{
+  do
+    after++;
+  while(hash(after) != h);
+  return after;
+}
+
+static int fail;
+
+static void expect(const char *what, int status, int expected)
+{
+  if(status != expected) {
+    printf("%s: status %d instead of %d\n", what, status, expected);
+    fail = 1;
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  struct loramac_config conf = config(0x0000, &rx_mac);
+  uint16_t a = 0x0001, b = a, c;
+  unsigned int h = hash(a), i;
+
+  if(loramac_init(&rx_mac, &conf)) {
+    printf("cannot initialize LoRaMAC\n");
+    return 1;
+  }
+
+  expect("first counter", send_counter(a, 100), LORAMAC_RCV_SUCCESS);
+  expect("duplicate counter", send_counter(a, 100), LORAMAC_RCV_INVALID_MIC);
+  expect("next counter", send_counter(a, 102), LORAMAC_RCV_SUCCESS);
+  expect("in window", send_counter(a, 101), LORAMAC_RCV_SUCCESS);
+  expect("in window again", send_counter(a, 101), LORAMAC_RCV_INVALID_MIC);
+  expect("oldest of window", send_counter(a, 102 - LORAMAC_REPLAY_WINDOW), LORAMAC_RCV_SUCCESS);
+  expect("too old", send_counter(a, 101 - LORAMAC_REPLAY_WINDOW), LORAMAC_RCV_INVALID_MIC);
+
+  /* the senders of the same slot fill its probes and evict a */
+  for(i = 0 ; i < LORAMAC_REPLAY_PROBE ; i++) {
+    b = next_on_slot(b, h);
+    expect("sender of the slot", send_counter(b, 1), LORAMAC_RCV_SUCCESS);
+  }
+  expect("evicted replayed", send_counter(a, 102), LORAMAC_RCV_INVALID_MIC);
+  expect("evicted back", send_counter(a, 103), LORAMAC_RCV_SUCCESS);
+
+  /* a new sender of the slot is not held to the floor of a */
+  c = next_on_slot(b, h);
+  expect("new sender", send_counter(c, 1), LORAMAC_RCV_SUCCESS);
+
+  /* a is evicted again, then leaves the evicted ring and its
+     floor to the slot, which the new senders stay above */
+  for(i = 0 ; i < LORAMAC_REPLAY_PROBE + LORAMAC_REPLAY_EVICTED ; i++) {
+    c = next_on_slot(c, h);
+    expect("sender of the slot", send_counter(c, 1000), LORAMAC_RCV_SUCCESS);
+  }
+  expect("forgotten replayed", send_counter(a, 103), LORAMAC_RCV_INVALID_MIC);
+  expect("forgotten back", send_counter(a, 104), LORAMAC_RCV_SUCCESS);
+
+  printf("%s\n", fail ? "FAIL" : "OK");
+
+  return fail;
+}
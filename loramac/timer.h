@@ -25,11 +25,48 @@
 #ifndef _TIMER_H_
 #define _TIMER_H_
 
-/* Start/wait/stop the timer.
+#include <pthread.h>
+#include <time.h>
+
+/* One shot timer on the monotonic clock.
+   A timer must be initialized with timer_init() before use. */
+struct timer {
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  struct timespec deadline;
+  int armed;
+};
+
+/* Start/wait/stop a timer.
    The stop function drops any pending wait.
    Duration are given in microseconds. */
-void start_timer(unsigned int timeout);
-void wait_timer(void);
-void stop_timer(void);
+void timer_init(struct timer *t);
+void timer_start(struct timer *t, unsigned int timeout);
+void timer_wait(struct timer *t);
+void timer_stop(struct timer *t);
+
+/* Wait until the timer has been started and its deadline reached.
+   Unlike timer_wait(), this blocks while the timer is disarmed. */
+void timer_sleep(struct timer *t);
+
+/* Start/wait/stop the default timer (LoRaMAC ACK timer).
+   The data argument is the LoRaMAC context data, there
+   is only one default timer for all instances. */
+void start_timer(unsigned int timeout, void *data);
+void wait_timer(void *data);
+void stop_timer(void *data);
+
+/* Lateness of the threads woken up on a timer deadline. This
+   is the scheduling jitter of the threads waiting on timers. */
+struct timer_jitter {
+  unsigned long expiries; /* deadlines reached */
+  unsigned long late_sum; /* total lateness in microseconds */
+  unsigned long late_max; /* maximum lateness in microseconds */
+};
+
+void timer_jitter(struct timer_jitter *jitter);
+
+/* Monotonic clock in microseconds. */
+unsigned long clock_us(void);
 
 #endif /* _TIMER_H_ */
@@ -22,18 +22,36 @@
    SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <stdlib.h>
 #include <termios.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
 #include <errno.h>
 #include <err.h>
 
+#include "capture.h"
+#include "common.h"
 #include "xatoi.h"
 #include "uart.h"
 #include "loramac.h"
 
-static int fd;
+#ifdef __linux__
+# include <linux/serial.h>
+#endif /* __linux__ */
+
+/* Line driven through uart_send() and the other functions of the
+   default instance. */
+static struct uart default_uart;
+
+/* Wait for the output queue to drain after each frame. */
+static int drain;
+
+/* Busy poll budget in microseconds (0 to block on read). */
+static unsigned long spin_budget;
 
 speed_t baud(const char *arg)
 {
@@ -74,7 +92,35 @@ ERR:
   errx(EXIT_FAILURE, "unrecognized speed");
 }
 
-void serial_init(const char *path, speed_t speed)
+/* Ask the serial driver to push the received bytes to the tty layer
+   right away. USB adapters (FTDI, PL2303) otherwise hold them for up
+   to 16ms which is enough to miss an ACK. We also keep the size of
+   the hardware FIFO reported by the driver. */
+static void serial_driver_init(struct uart *u, unsigned int flags)
+{
+#ifdef TIOCGSERIAL
+  struct serial_struct serial;
+
+  if(ioctl(u->fd, TIOCGSERIAL, &serial) < 0) {
+    if(flags & UART_LOW_LATENCY)
+      warn("cannot set low latency mode");
+    return;
+  }
+
+  u->fifo_size = serial.xmit_fifo_size;
+
+  if(flags & UART_LOW_LATENCY) {
+    serial.flags |= ASYNC_LOW_LATENCY;
+    if(ioctl(u->fd, TIOCSSERIAL, &serial) < 0)
+      warn("cannot set low latency mode");
+  }
+#else
+  if(flags & UART_LOW_LATENCY)
+    warnx("low latency mode not supported");
+#endif /* TIOCGSERIAL */
+}
+
+void uart_open(struct uart *u, const char *path, speed_t speed, unsigned int flags)
 {
   struct termios tty = {
     .c_cflag = (CS8 | CLOCAL | CREAD) & ~CRTSCTS,
@@ -85,21 +131,34 @@ void serial_init(const char *path, speed_t speed)
     .c_cc[VTIME] = 0,
   };
 
-  fd = open(path, O_RDWR | O_NOCTTY);
-  if(fd < 0)
-    err(EXIT_FAILURE, "cannot open serial port");
+  *u = (struct uart){ .fd = open(path, O_RDWR | O_NOCTTY) };
+  if(u->fd < 0)
+    err(EXIT_FAILURE, "cannot open serial port %s", path);
 
   /* initial checks */
-  if(!isatty(fd))
-    err(EXIT_FAILURE, "invalid serial port");
+  if(!isatty(u->fd))
+    err(EXIT_FAILURE, "invalid serial port %s", path);
 
   /* we only setup the speed if requested */
   if(speed != B0)
     cfsetspeed(&tty, speed);
 
-  if(tcsetattr(fd, TCSANOW, &tty) < 0)
+  if(flags & UART_RTSCTS)
+    tty.c_cflag |= CRTSCTS;
+
+  /* The smallest frame is an ACK (compact with LORAMAC_COMPACT),
+     so a read may wait for that many bytes. The inter-byte timer
+     bounds the wait when fewer bytes arrive (eg truncated frames). */
+  if(flags & UART_LOW_LATENCY) {
+    tty.c_cc[VMIN]  = LORAMAC_MIN_FRAME + 1;
+    tty.c_cc[VTIME] = 1;
+  }
+
+  if(tcsetattr(u->fd, TCSANOW, &tty) < 0)
     err(EXIT_FAILURE, "cannot set tty attributes");
 
+  serial_driver_init(u, flags);
+
   /* Some operating systems (eg Linux) bufferise the UART input
      even when the file descriptor is not opened. This may be
      useful in a lot of ca ses. However we may lay with incomplete
@@ -108,26 +167,225 @@ void serial_init(const char *path, speed_t speed)
      to wait a bit before actually flushing. Otherwise the flush
      command would have no effect. */
   usleep(500);
-  tcflush(fd, TCIOFLUSH);
+  tcflush(u->fd, TCIOFLUSH);
 }
 
-int uart_send(const void *buf, unsigned int size)
+void serial_init(const char *path, speed_t speed, unsigned int flags)
 {
-  int r = write(fd, buf, size);
+  uart_open(&default_uart, path, speed, flags);
+}
+
+/* Wait until the line accepts more bytes. This only
+   happens when the line is non-blocking (eg a pty). */
+static int wait_output(const struct uart *u)
+{
+  struct pollfd pfd = { .fd = u->fd, .events = POLLOUT };
+  int r;
+
+  do
+    r = poll(&pfd, 1, -1);
+  while(r < 0 && errno == EINTR);
 
-  if(r < 0)
-    return r;
+  return r < 0 ? r : 0;
+}
+
+/* Return true when a failed write may be retried. */
+static int write_again(const struct uart *u)
+{
+  if(errno == EINTR)
+    return 1;
+  if(errno == EAGAIN || errno == EWOULDBLOCK)
+    return wait_output(u) == 0;
   return 0;
 }
 
-void uart_read_loop(void)
+/* Called once a whole frame was written. We sample the depth of
+   the output queue and wait for it to drain when requested so
+   that the caller arms its timers at the end of transmission. */
+static int end_frame(struct uart *u)
+{
+#ifdef TIOCOUTQ
+  int queued;
+
+  if(!ioctl(u->fd, TIOCOUTQ, &queued)) {
+    u->tx_queued = queued;
+    if(u->tx_queued > u->tx_queued_max)
+      u->tx_queued_max = u->tx_queued;
+  }
+#endif /* TIOCOUTQ */
+
+  if(!drain)
+    return 0;
+
+  while(tcdrain(u->fd) < 0)
+    if(errno != EINTR)
+      return -1;
+  return 0;
+}
+
+int uart_write(struct uart *u, const void *buf, unsigned int size)
+{
+  const unsigned char *b = buf;
+  ssize_t r;
+
+  /* A write may be short when interrupted or when the
+     output queue is full, so we loop until everything
+     was written. */
+  capture(CAPTURE_UART, CAPTURE_TX, buf, size);
+
+  while(size) {
+    r = write(u->fd, b, size);
+    if(r < 0) {
+      if(write_again(u))
+        continue;
+      return r;
+    }
+
+    b    += r;
+    size -= r;
+    u->tx_bytes += r;
+  }
+
+  return end_frame(u);
+}
+
+int uart_send(const void *buf, unsigned int size, void *data)
+{
+  UNUSED(data);
+  return uart_write(&default_uart, buf, size);
+}
+
+int uart_writev(struct uart *u, const struct loramac_iovec *iov, unsigned int count)
+{
+  struct iovec v[count], *p = v;
+  size_t size = 0;
+  unsigned int i;
+  ssize_t r;
+
+  for(i = 0 ; i < count ; i++) {
+    v[i] = (struct iovec){ .iov_base = (void *)iov[i].base,
+                           .iov_len  = iov[i].size };
+    size += iov[i].size;
+
+    capture(CAPTURE_UART, CAPTURE_TX, iov[i].base, iov[i].size);
+  }
+
+  while(size) {
+    r = writev(u->fd, p, count);
+    if(r < 0) {
+      if(write_again(u))
+        continue;
+      return r;
+    }
+
+    size        -= r;
+    u->tx_bytes += r;
+
+    /* skip what was written on a short write */
+    for(; count && (size_t)r >= p->iov_len ; p++, count--)
+      r -= p->iov_len;
+    if(count) {
+      p->iov_base = (unsigned char *)p->iov_base + r;
+      p->iov_len -= r;
+    }
+  }
+
+  return end_frame(u);
+}
+
+int uart_sendv(const struct loramac_iovec *iov, unsigned int count, void *data)
+{
+  UNUSED(data);
+  return uart_writev(&default_uart, iov, count);
+}
+
+void set_uart_drain(int enable)
+{
+  drain = enable;
+}
+
+void set_uart_busy_poll(unsigned long us)
+{
+  spin_budget = us;
+}
+
+static unsigned long long elapsed_ns(const struct timespec *begin)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - begin->tv_sec) * 1000000000ULL + now.tv_nsec - begin->tv_nsec;
+}
+
+/* Spin on a non-blocking read until some bytes arrive. Once the
+   line stayed idle for the whole budget we sleep in poll() until
+   the next byte and spin again from there. */
+static ssize_t read_spin(struct uart *u, void *buf, size_t size)
+{
+  struct pollfd pfd = { .fd = u->fd, .events = POLLIN };
+  struct timespec begin;
+  unsigned long long ns;
+  ssize_t r;
+
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  while(1) {
+    r = read(u->fd, buf, size);
+    if(r > 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+      break;
+
+    ns = elapsed_ns(&begin);
+    if(ns < spin_budget * 1000)
+      continue;
+
+    /* idle, sleep until the next byte */
+    u->spin_ns += ns;
+    u->spin_sleeps++;
+    if(poll(&pfd, 1, -1) < 0 && errno != EINTR)
+      return -1;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+  }
+
+  u->spin_ns += elapsed_ns(&begin);
+  return r;
+}
+
+static void sample_rx_queue(struct uart *u)
+{
+  int queued;
+
+  if(!ioctl(u->fd, FIONREAD, &queued) && (unsigned int)queued > u->rx_queued_max)
+    u->rx_queued_max = queued;
+}
+
+/* Account the bytes read from the line and feed them to the driver. */
+static void uart_input(struct uart *u, struct loramac_ctx *mac,
+                       const unsigned char *buf, ssize_t size)
+{
+  u->rx_bytes += size;
+  capture(CAPTURE_UART, CAPTURE_RX, buf, size);
+
+  /* a full read means that we are falling behind */
+  if(size == UART_BUFFER_SIZE)
+    sample_rx_queue(u);
+
+  loramac_uart_feed(mac, buf, size);
+}
+
+void uart_loop(struct uart *u, struct loramac_ctx *mac)
 {
   unsigned char buf[UART_BUFFER_SIZE];
 
+  if(spin_budget) {
+    int flags = fcntl(u->fd, F_GETFL);
+
+    if(flags < 0 || fcntl(u->fd, F_SETFL, flags | O_NONBLOCK) < 0)
+      err(EXIT_FAILURE, "cannot set non-blocking line");
+  }
+
   /* loop for messages */
   while(1) {
-    int i;
-    ssize_t size = read(fd, buf, UART_BUFFER_SIZE);
+    ssize_t size = spin_budget ? read_spin(u, buf, UART_BUFFER_SIZE) :
+                                 read(u->fd, buf, UART_BUFFER_SIZE);
     if(size <= 0) {
       if(errno == EINTR)
         /* signal caught */
@@ -135,8 +393,67 @@ void uart_read_loop(void)
       err(EXIT_FAILURE, "cannot read");
     }
 
-    /* flush buffer */
-    for(i = 0 ; i < size ; i++)
-      loramac_uart_putc(buf[i]);
+    uart_input(u, mac, buf, size);
+  }
+}
+
+int uart_fd(void)
+{
+  return default_uart.fd;
+}
+
+void uart_read_once(struct loramac_ctx *mac)
+{
+  unsigned char buf[UART_BUFFER_SIZE];
+  ssize_t size = read(default_uart.fd, buf, UART_BUFFER_SIZE);
+
+  if(size <= 0) {
+    if(size < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    err(EXIT_FAILURE, "cannot read");
   }
+
+  uart_input(&default_uart, mac, buf, size);
+}
+
+void uart_read_loop(struct loramac_ctx *mac)
+{
+  uart_loop(&default_uart, mac);
+}
+
+void uart_line_stats(const struct uart *u, struct uart_stats *stats)
+{
+#ifdef TIOCGICOUNT
+  struct serial_icounter_struct icount;
+#endif /* TIOCGICOUNT */
+  int queued;
+
+  *stats = (struct uart_stats){ .tx_bytes      = u->tx_bytes,
+                                .rx_bytes      = u->rx_bytes,
+                                .tx_queued     = u->tx_queued,
+                                .tx_queued_max = u->tx_queued_max,
+                                .fifo_size     = u->fifo_size,
+                                .spin_us       = u->spin_ns / 1000,
+                                .spin_sleeps   = u->spin_sleeps };
+
+  if(!ioctl(u->fd, FIONREAD, &queued))
+    stats->rx_queued = queued;
+  stats->rx_queued_max = u->rx_queued_max;
+  if(stats->rx_queued > stats->rx_queued_max)
+    stats->rx_queued_max = stats->rx_queued;
+
+#ifdef TIOCGICOUNT
+  if(!ioctl(u->fd, TIOCGICOUNT, &icount)) {
+    stats->hw_overruns   = icount.overrun;
+    stats->buf_overruns  = icount.buf_overrun;
+    stats->frame_errors  = icount.frame;
+    stats->parity_errors = icount.parity;
+    stats->overruns      = icount.overrun + icount.buf_overrun;
+  }
+#endif /* TIOCGICOUNT */
+}
+
+void uart_stats(struct uart_stats *stats)
+{
+  uart_line_stats(&default_uart, stats);
 }
@@ -28,20 +28,110 @@
 #include <sys/types.h>
 #include <termios.h>
 
+#include "loramac.h"
+
 #define UART_BUFFER_SIZE 1024
 
+/* UART statistics (see uart_stats()) */
+struct uart_stats {
+  unsigned long tx_bytes;
+  unsigned long rx_bytes;
+  unsigned long overruns;      /* bytes lost by the serial driver */
+  unsigned long hw_overruns;   /* bytes lost by the UART itself */
+  unsigned long buf_overruns;  /* bytes lost because the tty buffer was full */
+  unsigned long frame_errors;  /* bytes received with a framing error */
+  unsigned long parity_errors; /* bytes received with a parity error */
+  unsigned int  tx_queued;     /* output queue depth after the last frame */
+  unsigned int  tx_queued_max; /* maximum of tx_queued */
+  unsigned int  rx_queued;     /* bytes received but not read yet */
+  unsigned int  rx_queued_max; /* maximum of rx_queued after a full read */
+  unsigned int  fifo_size;     /* hardware FIFO size (0 when unknown) */
+  unsigned long spin_us;       /* time spent spinning on reads (see set_uart_busy_poll()) */
+  unsigned long spin_sleeps;   /* spins that ran out of budget and slept */
+};
+
+/* Serial line flags (see serial_init()) */
+enum uart_flags {
+  UART_LOW_LATENCY = 1 << 0, /* do not delay the received bytes */
+  UART_RTSCTS      = 1 << 1, /* hardware flow control */
+};
+
+/* A serial line. Each counter is only updated by one thread (the
+   senders under the MAC lock, the read loop) so they are read
+   without any lock. Most callers only drive the default line with
+   serial_init() and the functions that follow, the uart_*() variants
+   on a line are for the other modules of a gateway (see --radio). */
+struct uart {
+  int fd;
+
+  unsigned long tx_bytes;
+  unsigned long rx_bytes;
+
+  /* Output queue depth after the last frame and its maximum
+     (only known with TIOCOUTQ). Updated by the senders. */
+  unsigned int tx_queued;
+  unsigned int tx_queued_max;
+
+  /* Hardware FIFO size reported by the serial driver. */
+  unsigned int fifo_size;
+
+  /* Deepest input queue seen after a read that filled the
+     whole buffer. Only updated by the read thread. */
+  unsigned int rx_queued_max;
+
+  /* Time spent spinning (see set_uart_busy_poll()). */
+  unsigned long long spin_ns;
+  unsigned long      spin_sleeps;
+};
+
 /* Convert a string to a serial speed. */
 speed_t baud(const char *arg);
 
 /* Open and setup the serial line and return a file descriptor to the serial
    line. The line will be left untouched if the speed is B0. Otherwise it will
-   use a default configuration for the line (8N1). */
-void serial_init(const char *path, speed_t speed);
+   use a default configuration for the line (8N1). The flags select the low
+   latency profile and hardware flow control (see uart_flags). */
+void serial_init(const char *path, speed_t speed, unsigned int flags);
+void uart_open(struct uart *u, const char *path, speed_t speed, unsigned int flags);
+
+/* Send a message over the configured UART stream.
+   The data argument is the LoRaMAC context data. */
+int uart_send(const void *buf, unsigned int size, void *data);
+int uart_write(struct uart *u, const void *buf, unsigned int size);
+
+/* Same as uart_send() with a single write for the
+   buffers of a frame (see loramac_config). */
+int uart_sendv(const struct loramac_iovec *iov, unsigned int count, void *data);
+int uart_writev(struct uart *u, const struct loramac_iovec *iov, unsigned int count);
+
+/* Start the UART read loop for a LoRaMAC instance. */
+void uart_read_loop(struct loramac_ctx *mac);
+void uart_loop(struct uart *u, struct loramac_ctx *mac);
+
+/* Descriptor of the default line and a single read of what it has
+   for the event loop (see loop.h), once it was polled readable.
+   Exit on error. */
+int uart_fd(void);
+void uart_read_once(struct loramac_ctx *mac);
+
+/* Wait for the output queue to drain after each frame so that
+   uart_send() only returns once the frame left the UART. The
+   timers armed after it then start at the end of transmission. */
+void set_uart_drain(int enable);
 
-/* Send a message over the configured UART stream. */
-int uart_send(const void *buf, unsigned int size);
+/* Spin on non-blocking reads in the read loop instead of sleeping
+   in read() until the line stayed idle for the budget in
+   microseconds (0 to disable). This trades a whole CPU for the
+   wakeup latency of each frame, so the read thread should run
+   on an isolated core (see --rt). */
+void set_uart_busy_poll(unsigned long us);
 
-/* Start the UART read loop. */
-void uart_read_loop(void);
+/* Copy the UART statistics. The overruns and the line errors are
+   only known on Linux and only for serial ports that report them.
+   Bytes lost with an empty receive queue point to interference on
+   the line while overruns with a deep queue point to a read thread
+   that does not get enough CPU. */
+void uart_stats(struct uart_stats *stats);
+void uart_line_stats(const struct uart *u, struct uart_stats *stats);
 
 #endif /* _UART_H_ */
@@ -25,20 +25,35 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <getopt.h>
+#include <errno.h>
+#include <poll.h>
 #include <err.h>
 
 #include "safe-call.h"
 #include "string-utils.h"
+#include "subscribe.h"
+#include "admit.h"
+#include "batch.h"
+#include "pool.h"
+#include "txopt.h"
+#include "txq.h"
+#include "agg.h"
 #include "loramac-str.h"
 #include "loramac.h"
 #include "version.h"
 #include "common.h"
+#include "xatoi.h"
+#include "timer.h"
+#include "radios.h"
 #include "mode.h"
 #include "main.h"
+#include "log.h"
 #include "help.h"
 
 /*
@@ -47,23 +62,207 @@
   successful transmission. The message format for incoming
   and outgoing messages is specified below (see cb_recv() and
   start()).
+
+  Datagrams are read and written in batches with recvmmsg()
+  and sendmmsg(). Received frames are pushed to the application
+  when the batch is full or when no other frame was received
+  within the flush timeout.
+
+  Other applications may subscribe to received frames with
+  the message format given in subscribe.h on the subscription
+  socket. The application socket is always subscribed to all
+  frames.
+
+  With --tx-status each send message is prefixed with an ID
+  chosen by the application and is queued to a transmit thread
+  so that new frames are accepted while the previous ones are
+  still being transmitted. The status of each frame is reported
+  to the sender address once the transmission is complete (see
+  send_status()). The sender socket must be bound to a path.
+
+  With --priority each send message is also prefixed with its
+  priority class (see txq_class) and queued to the transmit
+  thread. Urgent frames then overtake the queued bulk frames,
+  either strictly or according to the class weights with
+  --weighted.
+
+  With --fair the requests of each class are also served by deficit
+  round-robin among their destinations (see txq_fair()), so that
+  the backlog of one destination does not hold the others back. A
+  destination that does not acknowledge its frames gets a smaller
+  share until it answers again.
+
+  With --tx-options each send message is also prefixed with its
+  options (see txopt.h), after the class. A loss tolerant message
+  is sent once without ACK and a critical one with its own number
+  of transmissions, so that both share a daemon. An ACK cannot be
+  requested with --no-ack and the media flags are ignored.
+
+  With --aggregate the queued messages for the same destination
+  are packed into as few frames as possible (see agg.h), waiting
+  up to the hold time for each next message. Received frames are
+  split back into messages, so both ends must use this option.
+
+  With --credits each client may have at most this number of send
+  messages in flight and with --rate-limit each client may only
+  send this number of bytes per second (see admit.h). Messages
+  over a limit are rejected at once, with ADMIT_ERR_WINDOW or
+  ADMIT_ERR_RATE as their status. With --credits the status
+  messages also carry the credits left to the client, which
+  may send that many messages before the next status. The
+  credits need --tx-status.
+
+  With --client-quota a client, given by the address its socket
+  is bound to, has limits of its own instead: ADDR:CREDITS:RATE
+  where a null limit is disabled for this client. Its bursts are
+  the larger of --burst and its rate. With --client-stats or any
+  of the limits the messages, bytes, outcomes and messages in
+  flight of each client are counted (see admit_read()) and
+  written with the metrics.
+
+  With fragmentation (see LORAMAC_FRAG) messages up to
+  LORAMAC_MAX_MESSAGE bytes are accepted. A message that does
+  not fit in a single frame is sent alone as several fragments.
 */
 
-#define BUF_SIZE LORAMAC_MAX_FRAME
+/* a message and the largest send or recv header */
+#define BUF_SIZE (LORAMAC_MAX_MESSAGE + sizeof(uint8_t) + sizeof(uint16_t) * 2)
+
+/* default number of datagrams per batch */
+#define DEFAULT_BATCH 16
+
+/* number of queued transmit requests per class (power of two) */
+#define TX_QUEUE_DEPTH 64
+
+/* status reported when the transmit queue is full */
+#define TX_QUEUE_FULL 0xff
+
+/* maximum number of requests sent in one window */
+#define TX_MAX_SENDERS 256
+
+enum opt {
+  OPT_BATCH = 0x200, /* after common options */
+  OPT_FLUSH_TIMEOUT,
+  OPT_SUB_PATH,
+  OPT_TX_STATUS,
+  OPT_TX_OPTIONS,
+  OPT_PRIORITY,
+  OPT_WEIGHTED,
+  OPT_FAIR,
+  OPT_AGGREGATE,
+  OPT_HOLD_TIME,
+  OPT_CREDITS,
+  OPT_RATE_LIMIT,
+  OPT_BURST,
+  OPT_CLIENT_QUOTA,
+  OPT_CLIENT_STATS
+};
+
+/* A send message waiting for the transmit thread. */
+struct tx_request {
+  struct sockaddr_un from;
+  enum txq_class class;
+  uint8_t opts; /* see txopt.h */
+  uint16_t id;
+  uint16_t dst;
+  unsigned int size;
+  unsigned char payload[BUF_SIZE];
+};
+
+/* Sender of a request being transmitted. */
+struct tx_sender {
+  struct sockaddr_un from;
+  uint16_t id;
+};
+
+/* Source of a received aggregate. */
+struct rx_info {
+  uint16_t src;
+  uint16_t dst;
+  int status;
+};
 
 static int sd;
+static int sub_sd;
 static const char *socket_driver_path = PACKAGE "-driver.sock";
 static const char *socket_app_path = PACKAGE "-app.sock";
-static struct sockaddr_un client;
+static const char *socket_sub_path = PACKAGE "-sub.sock";
+
+/* Batches of incoming (from the application)
+   and outgoing (to the application) datagrams. */
+static unsigned int batch_size = DEFAULT_BATCH;
+static struct batch in_batch;
+static struct batch out_batch;
+static struct pool  rec_pool;
+
+/* Asynchronous and prioritized transmit requests. */
+static int tx_status;
+static int tx_priority;
+static int tx_options;
+static enum txq_policy tx_policy = TXQ_STRICT;
+static int tx_fair;
+static struct txq tx_queue;
+static pthread_t tx_thread;
+
+/* Window being built by the transmit thread.
+   Each frame is an aggregate when aggregation
+   is enabled or a single request otherwise. */
+static int aggregate;
+static unsigned int hold_time;
+static unsigned char tx_bufs[LORAMAC_MAX_WINDOW][LORAMAC_MAX_CPAYLOAD];
+static struct agg tx_frames[LORAMAC_MAX_WINDOW];
+static unsigned int tx_nframes;
+static struct tx_sender tx_senders[TX_MAX_SENDERS];
+static unsigned int tx_nsenders;
+
+/* Admission control of the clients (see admit.h). */
+static int admission;
+static unsigned int credits;
+static unsigned long rate_limit;
+static unsigned long burst;
+static const char *quotas[ADMIT_MAX_QUOTAS];
+static unsigned int nquotas;
+static int client_stats;
+static struct duty_radio radio; /* to estimate the time on air of the clients */
 
 struct option unix_opts[] = {
   { "driver-path", required_argument, NULL, 'L' },
   { "app-path", required_argument, NULL, 'R' },
+  { "batch", required_argument, NULL, OPT_BATCH },
+  { "flush-timeout", required_argument, NULL, OPT_FLUSH_TIMEOUT },
+  { "sub-path", required_argument, NULL, OPT_SUB_PATH },
+  { "tx-status", no_argument, NULL, OPT_TX_STATUS },
+  { "tx-options", no_argument, NULL, OPT_TX_OPTIONS },
+  { "priority", no_argument, NULL, OPT_PRIORITY },
+  { "weighted", no_argument, NULL, OPT_WEIGHTED },
+  { "fair", no_argument, NULL, OPT_FAIR },
+  { "aggregate", no_argument, NULL, OPT_AGGREGATE },
+  { "hold-time", required_argument, NULL, OPT_HOLD_TIME },
+  { "credits", required_argument, NULL, OPT_CREDITS },
+  { "rate-limit", required_argument, NULL, OPT_RATE_LIMIT },
+  { "burst", required_argument, NULL, OPT_BURST },
+  { "client-quota", required_argument, NULL, OPT_CLIENT_QUOTA },
+  { "client-stats", no_argument, NULL, OPT_CLIENT_STATS },
   { NULL, 0, NULL, 0 }
 };
 struct opt_help unix_messages[] = {
   { 'L', "driver-path", "Driver Unix socket path" },
   { 'R', "app-path", "Application Unix socket path" },
+  { 0,   "batch", "Number of datagrams per batch (default 16)" },
+  { 0,   "flush-timeout", "Delay in microseconds before a partial batch is sent (default 0)" },
+  { 0,   "sub-path", "Subscription Unix socket path" },
+  { 0,   "tx-status", "Identify send messages and report their status" },
+  { 0,   "tx-options", "Prefix send messages with their ACK options" },
+  { 0,   "priority", "Prefix send messages with their priority class" },
+  { 0,   "weighted", "Serve priority classes by weight instead of strictly" },
+  { 0,   "fair", "Share each priority class among the destinations" },
+  { 0,   "aggregate", "Pack small messages to the same destination in one frame" },
+  { 0,   "hold-time", "Delay in microseconds to wait for more messages to send (default 0)" },
+  { 0,   "credits", "Send messages in flight allowed to each client (up to 255)" },
+  { 0,   "rate-limit", "Bytes per second allowed to each client" },
+  { 0,   "burst", "Bytes a client may send at once within its rate (default one second)" },
+  { 0,   "client-quota", "Limits of one client as ADDR:CREDITS:RATE (repeatable)" },
+  { 0,   "client-stats", "Count the messages of each client without limits" },
   { 0, NULL, NULL }
 };
 
@@ -71,20 +270,35 @@ static void exit_clean(void)
 {
   unlink(socket_driver_path);
   unlink(socket_app_path);
+  unlink(socket_sub_path);
 }
 
-static void cb_recv(uint16_t src, uint16_t dst,
-                    const void *payload, unsigned int payload_size,
-                    int status, void *data)
+static void flush(const struct context *ctx)
 {
-  UNUSED(data);
+  UNUSED(ctx);
+
+  sub_flush(sd, &out_batch);
+}
 
+static void publish(uint16_t src, uint16_t dst,
+                    const void *payload, unsigned int payload_size,
+                    int status)
+{
   /* recv message format:
      [status (u8)][src (u16)][dst (u16)][payload] */
-  unsigned char buf[BUF_SIZE];
-  unsigned char *b = buf;
-  size_t  len = payload_size + sizeof(uint8_t) + sizeof(uint16_t) * 2;
-  ssize_t n;
+  unsigned char *record, *b;
+  size_t len = payload_size + sizeof(uint8_t) + sizeof(uint16_t) * 2;
+
+  if(len > BUF_SIZE) {
+    warnx("frame too large");
+    return;
+  }
+
+  b = record = pool_get(&rec_pool);
+  if(!record) {
+    warnx("out of record buffers, frame dropped");
+    return;
+  }
 
   *(uint8_t  *)b = status; b += sizeof(uint8_t);
   *(uint16_t *)b = src;    b += sizeof(uint16_t);
@@ -92,18 +306,56 @@ static void cb_recv(uint16_t src, uint16_t dst,
 
   memcpy(b, payload, payload_size);
 
-  n = sendto(sd, buf, len, 0, (struct sockaddr *)&client, sizeof(struct sockaddr_un));
-  if(n != (ssize_t)len)
-    warn("network error"); /* we don't fail on client error */
+  sub_publish(sd, &out_batch, &rec_pool, record, len, src, status, 0);
+  pool_put(&rec_pool, record);
+}
+
+static void publish_record(const void *record, size_t size, void *data)
+{
+  const struct rx_info *info = data;
+
+  publish(info->src, info->dst, record, size, info->status);
+}
+
+static void cb_recv(uint16_t src, uint16_t dst,
+                    const void *payload, unsigned int payload_size,
+                    int status, void *data)
+{
+  struct rx_info info = { .src    = src,
+                          .dst    = dst,
+                          .status = status };
+
+  UNUSED(data);
+
+  /* frames with errors are passed as is */
+  if(!aggregate || status != LORAMAC_RCV_SUCCESS) {
+    publish(src, dst, payload, payload_size, status);
+    return;
+  }
+
+  if(agg_split(payload, payload_size, publish_record, &info) < 0)
+    warnx("invalid aggregate from %04X", src);
 }
 
 static void init(const struct context *ctx, struct loramac_config *loramac)
 {
   struct sockaddr_un s_addr = { .sun_family = AF_UNIX };
+  unsigned int i;
 
   /* configure the LoRaMAC layer */
   loramac->cb_recv = cb_recv;
 
+  if(credits && !tx_status)
+    errx(EXIT_FAILURE, "--credits needs --tx-status");
+  for(i = 0 ; i < nquotas ; i++)
+    if(admit_parse_quota(quotas[i], burst ? burst : LORAMAC_MAX_MESSAGE) < 0)
+      errx(EXIT_FAILURE, "invalid client quota '%s'", quotas[i]);
+  admission = credits || rate_limit || nquotas || client_stats;
+  if(!burst)
+    burst = rate_limit > LORAMAC_MAX_MESSAGE ? rate_limit : LORAMAC_MAX_MESSAGE;
+  admit_init(credits, rate_limit, burst);
+  radio = loramac->radio;
+
   /* create socket */
   sd = xsocket(AF_UNIX, SOCK_DGRAM, 0);
 
@@ -112,60 +364,489 @@ static void init(const struct context *ctx, struct loramac_config *loramac)
   xstrcpy(s_addr.sun_path, socket_driver_path, sizeof(s_addr.sun_path));
   xbind(sd, (struct sockaddr *)&s_addr, SUN_LEN(&s_addr));
 
-  /* prepare client address */
-  client.sun_family = AF_UNIX;
-  xstrcpy(client.sun_path, socket_app_path, sizeof(s_addr.sun_path));
+  /* create and bind the subscription socket */
+  sub_sd = xsocket(AF_UNIX, SOCK_DGRAM, 0);
+  unlink(socket_sub_path);
+  xstrcpy(s_addr.sun_path, socket_sub_path, sizeof(s_addr.sun_path));
+  xbind(sub_sd, (struct sockaddr *)&s_addr, SUN_LEN(&s_addr));
+
+  /* the application is always subscribed */
+  sub_init(socket_app_path);
+
+  /* prepare batches */
+  batch_init(&in_batch, batch_size, BUF_SIZE, NULL);
+  batch_init(&out_batch, batch_size, BUF_SIZE, NULL);
+
+  /* Records are shared by the subscribers. The batch holds at
+     most one reference per message and is sent once full, so
+     one more buffer is enough for the record being built. */
+  pool_init(&rec_pool, batch_size + 1, BUF_SIZE);
 
   /* now we may register the exit function */
   atexit(exit_clean);
 
-  IF_VERBOSE(ctx, printf("Socket created at %s", socket_driver_path));
+  IF_VERBOSE(ctx, log_msg(LOG_CAT_MAIN, LOG_LVL_DEBUG, "Socket created at %s\n", socket_driver_path));
+  IF_VERBOSE(ctx, log_msg(LOG_CAT_MAIN, LOG_LVL_DEBUG,
+                          "Subscription socket created at %s\n", socket_sub_path));
+}
+
+static void send_status(const struct sockaddr_un *to, uint16_t id,
+                        int status, unsigned int tx)
+{
+  /* status message format:
+     [id (u16)][status (u8)][tx count (u8)][credits (u8)]
+     The credits are only present with --credits. */
+  unsigned char msg[sizeof(uint16_t) + sizeof(uint8_t) * 3];
+  unsigned char *b = msg;
+
+  if(!to->sun_path[0]) {
+    warnx("unbound client, cannot report status");
+    return;
+  }
+
+  *(uint16_t *)b = id;     b += sizeof(uint16_t);
+  *(uint8_t  *)b = status; b += sizeof(uint8_t);
+  *(uint8_t  *)b = tx;     b += sizeof(uint8_t);
+  if(credits) {
+    *(uint8_t *)b = admit_credits(to); b += sizeof(uint8_t);
+  }
+
+  if(sendto(sd, msg, b - msg, MSG_DONTWAIT, (struct sockaddr *)to, sizeof(*to)) < 0)
+    warn("network error"); /* we don't fail on client error */
+}
+
+/* Whether a request does not fit in a single frame. */
+static int oversized(const struct context *ctx, const struct tx_request *req)
+{
+  return req->size + (aggregate ? AGG_PREFIX_SIZE(req->size) : 0) > loramac_max_payload(ctx->mac);
+}
+
+/* Flow and cost of a request (see --fair). */
+static unsigned int request_flow(const void *item)
+{
+  return ((const struct tx_request *)item)->dst;
+}
+
+static unsigned int request_cost(const void *item)
+{
+  return ((const struct tx_request *)item)->size;
+}
+
+/* Driver options of a request (see txopt.h). */
+static struct loramac_tx_opts request_opts(uint8_t opts)
+{
+  return (struct loramac_tx_opts){ .flags   = opts & TXOPT_NOACK ? LORAMAC_TX_NOACK : 0,
+                                   .retrans = opts & TXOPT_TRIES };
+}
+
+/* Send on the module of the destination (see --module). Broadcasts
+   and groups go through every module, the status is the one of the
+   main module. */
+static int route_send(const struct context *ctx, uint16_t dst,
+                      const void *payload, unsigned int size,
+                      const struct loramac_tx_opts *opts, unsigned int *tx)
+{
+  unsigned int i;
+  int ret;
+
+  ret = loramac_send_opts(radios_mac(ctx->mac, dst), dst, payload, size, opts, tx);
+  for(i = 0 ; (dst == 0xffff || LORAMAC_GROUP(dst)) && i < radios_count() ; i++)
+    loramac_send_opts(&radios_get(i)->mac, dst, payload, size, opts, NULL);
+
+  return ret;
+}
+
+static int route_window(const struct context *ctx, uint16_t dst,
+                        const struct loramac_frame *frames, unsigned int count,
+                        const struct loramac_tx_opts *opts, unsigned int *tx)
+{
+  unsigned int i;
+  int ret;
+
+  ret = loramac_send_window_opts(radios_mac(ctx->mac, dst), dst, frames, count, opts, tx);
+  for(i = 0 ; (dst == 0xffff || LORAMAC_GROUP(dst)) && i < radios_count() ; i++)
+    loramac_send_window_opts(&radios_get(i)->mac, dst, frames, count, opts, NULL);
+
+  return ret;
+}
+
+/* Send a request that does not fit in a single frame on its own.
+   With aggregation it is still sent as an aggregate of one record
+   since the receiver splits every frame. */
+/* Time on air of tx transmissions of these frames, from the radio
+   settings of the driver even for the destinations on another SF.
+   The transmissions are spread evenly over the frames. */
+static unsigned long frames_airtime(const struct loramac_frame *frames, unsigned int count,
+                                    unsigned int tx)
+{
+  unsigned long long airtime = 0;
+  unsigned int i;
+
+  if(!count)
+    return 0;
+  for(i = 0 ; i < count ; i++)
+    airtime += duty_airtime(&radio, LORAMAC_HDR_SIZE + frames[i].size);
+  return airtime * tx / count;
+}
+
+static void send_alone(const struct context *ctx, const struct tx_request *req)
+{
+  static unsigned char buf[BUF_SIZE];
+  struct loramac_tx_opts opts = request_opts(req->opts);
+  struct agg frame;
+  unsigned int tx = 0;
+  int ret;
+
+  agg_init(&frame, buf, sizeof(buf));
+  if(aggregate)
+    agg_add(&frame, req->payload, req->size);
+  else {
+    memcpy(frame.buf, req->payload, req->size);
+    frame.size = req->size;
+  }
+
+  ret = route_send(ctx, req->dst, frame.buf, frame.size, &opts, &tx);
+  IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG,
+                          "TX STATUS: %s (%d)\n", loramac_send2str(ret), ret));
+  IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG, "TX COUNT : %d\n", tx));
+  IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG, "---------\n"));
+
+  txq_feedback(&tx_queue, req->dst, ret == LORAMAC_SND_SUCCESS);
+  txq_complete(&tx_queue, req->class, 1);
+
+  if(admission) {
+    struct loramac_frame f = { .payload = frame.buf, .size = frame.size };
+
+    admit_release(&req->from, ret, frames_airtime(&f, 1, tx));
+  }
+  if(tx_status)
+    send_status(&req->from, req->id, ret, tx);
+}
+
+/* Add a request to the window. With aggregation the request is
+   packed in the last frame when it fits there, otherwise it starts
+   a new frame. Return -1 when the window is full. */
+static int window_add(const struct context *ctx, const struct tx_request *req)
+{
+  struct agg *frame;
+
+  if(tx_nsenders == TX_MAX_SENDERS)
+    return -1;
+
+  if(!aggregate || !tx_nframes ||
+     agg_add(&tx_frames[tx_nframes - 1], req->payload, req->size) < 0) {
+    if(tx_nframes == LORAMAC_MAX_WINDOW)
+      return -1;
+
+    frame = &tx_frames[tx_nframes];
+    agg_init(frame, tx_bufs[tx_nframes], loramac_max_payload(ctx->mac));
+    tx_nframes++;
+
+    /* the size was checked when the request was queued */
+    if(aggregate)
+      agg_add(frame, req->payload, req->size);
+    else {
+      memcpy(frame->buf, req->payload, req->size);
+      frame->size = req->size;
+    }
+  }
+
+  tx_senders[tx_nsenders++] = (struct tx_sender){ .from = req->from,
+                                                  .id   = req->id };
+  return 0;
+}
+
+static void * tx_thread_func(void *arg)
+{
+  const struct context *ctx = arg;
+  static struct tx_request req;
+  struct loramac_frame frames[LORAMAC_MAX_WINDOW];
+  struct loramac_tx_opts opts;
+  unsigned long airtime;
+  enum txq_class class;
+  unsigned int i, tx;
+  uint16_t dst;
+  uint8_t flags;
+  int carry = 0;
+  int ret;
+
+  while(1) {
+    /* Wait for a request unless one was left over from the
+       previous window. The next requests of the same class,
+       destination and options are then sent in the same window, waiting
+       up to the hold time for each of them. A more urgent
+       request is dequeued first and closes the window. */
+    if(!carry)
+      txq_pop(&tx_queue, &req, 1);
+    carry = 0;
+
+    if(oversized(ctx, &req)) {
+      send_alone(ctx, &req);
+      continue;
+    }
+
+    dst   = req.dst;
+    class = req.class;
+    flags = req.opts;
+
+    tx_nframes  = 0;
+    tx_nsenders = 0;
+    window_add(ctx, &req);
+
+    while(txq_timedpop(&tx_queue, &req, hold_time) >= 0) {
+      if(req.dst != dst || req.class != class || req.opts != flags ||
+         oversized(ctx, &req) || window_add(ctx, &req) < 0) {
+        carry = 1;
+        break;
+      }
+    }
+
+    for(i = 0 ; i < tx_nframes ; i++)
+      frames[i] = (struct loramac_frame){ .payload = tx_frames[i].buf,
+                                          .size    = tx_frames[i].size };
+
+    opts = request_opts(flags);
+    ret = route_window(ctx, dst, frames, tx_nframes, &opts, &tx);
+    IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG,
+                            "TX STATUS: %s (%d)\n", loramac_send2str(ret), ret));
+    IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG, "TX COUNT : %d\n", tx));
+    IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG,
+                            "TX MSGS  : %d in %d frames\n", tx_nsenders, tx_nframes));
+    IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG, "---------\n"));
+
+    txq_feedback(&tx_queue, dst, ret == LORAMAC_SND_SUCCESS);
+    txq_complete(&tx_queue, class, tx_nsenders);
+
+    /* the senders of a window share its time on air */
+    airtime = frames_airtime(frames, tx_nframes, tx) / tx_nsenders;
+    for(i = 0 ; admission && i < tx_nsenders ; i++)
+      admit_release(&tx_senders[i].from, ret, airtime);
+    for(i = 0 ; tx_status && i < tx_nsenders ; i++)
+      send_status(&tx_senders[i].from, tx_senders[i].id, ret, tx);
+  }
+
+  return NULL;
+}
+
+static void queue_request(const struct context *ctx, const unsigned char *buf,
+                          unsigned int size, const struct sockaddr_un *from)
+{
+  struct tx_request req = { .from  = *from,
+                            .class = TXQ_CONTROL };
+  unsigned int hdr_size = sizeof(uint16_t);
+
+  /* queued send message format:
+     [class (u8)][options (u8)][id (u16)][dst (u16)][payload]
+     The class is only present with --priority, the
+     options with --tx-options and the ID with --tx-status. */
+  if(tx_priority)
+    hdr_size += sizeof(uint8_t);
+  if(tx_options)
+    hdr_size += sizeof(uint8_t);
+  if(tx_status)
+    hdr_size += sizeof(uint16_t);
+
+  if(size <= hdr_size) {
+    warnx("message too short");
+    return;
+  }
+
+  if(tx_priority) {
+    if(*buf >= TXQ_CLASSES) {
+      warnx("invalid priority class");
+      return;
+    }
+    req.class = *(uint8_t *)buf; buf += sizeof(uint8_t);
+  }
+  if(tx_options) {
+    req.opts = *(uint8_t *)buf; buf += sizeof(uint8_t);
+  }
+  if(tx_status) {
+    req.id = *(uint16_t *)buf; buf += sizeof(uint16_t);
+  }
+  req.dst  = *(uint16_t *)buf; buf += sizeof(uint16_t);
+  req.size = size - hdr_size;
+  memcpy(req.payload, buf, req.size);
+
+  /* The driver reports messages that do not fit in a frame
+     without fragmentation, beyond that they do not fit at all. */
+  if(req.size + (aggregate ? AGG_PREFIX_SIZE(req.size) : 0) > LORAMAC_MAX_MESSAGE) {
+    if(tx_status)
+      send_status(from, req.id, LORAMAC_SND_TOOLONG, 0);
+    else
+      warnx("message too long");
+    return;
+  }
+
+  if(admission) {
+    int ret = admit_request(from, req.size, clock_us());
+
+    if(ret) {
+      if(tx_status)
+        send_status(from, req.id, ret, 0);
+      else
+        warnx("%s, frame dropped", ret == ADMIT_ERR_RATE ? "rate limit exceeded" : "no credit left");
+      return;
+    }
+  }
+
+  IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG,
+                          "Queuing %d bytes to %04X (ID %04X, class %d)\n",
+                          req.size, req.dst, req.id, req.class));
+
+  if(txq_push(&tx_queue, req.class, &req, NULL) < 0) {
+    if(admission)
+      admit_release(from, TX_QUEUE_FULL, 0);
+    if(tx_status)
+      send_status(from, req.id, TX_QUEUE_FULL, 0);
+    else
+      warnx("transmit queue full, frame dropped");
+  }
+}
+
+static void handle_subscription(void)
+{
+  unsigned char msg[SUB_MSG_SIZE + 1];
+  struct sockaddr_un from;
+  socklen_t from_len = sizeof(from);
+  ssize_t n;
+
+  n = recvfrom(sub_sd, msg, sizeof(msg), 0, (struct sockaddr *)&from, &from_len);
+  if(n < 0) {
+    warn("network error");
+    return; /* we don't fail on client error */
+  }
+
+  if(from_len <= offsetof(struct sockaddr_un, sun_path)) {
+    warnx("unbound subscription client");
+    return;
+  }
+  ((char *)&from)[from_len < sizeof(from) ? from_len : sizeof(from) - 1] = '\0';
+
+  sub_request(msg, n, &from);
 }
 
 static void start(const struct context *ctx)
 {
   /* send message format:
      [dst (u16)][payload] */
-  unsigned char buf[BUF_SIZE];
-  uint16_t dst;
+  struct loramac_frame frames[LORAMAC_MAX_WINDOW];
+  unsigned int count = 0;
+  uint16_t dst = 0;
   unsigned int tx;
-  int n, ret;
+  struct pollfd fds[] = { { .fd = sd,     .events = POLLIN },
+                          { .fd = sub_sd, .events = POLLIN } };
+  int i, n, ret;
+
+  if(tx_status || tx_priority || tx_options || tx_fair || aggregate || admission) {
+    txq_init(&tx_queue, tx_policy, NULL, TX_QUEUE_DEPTH, sizeof(struct tx_request));
+    if(tx_fair)
+      txq_fair(&tx_queue, request_flow, request_cost, 0);
+
+    ret = pthread_create(&tx_thread, NULL, tx_thread_func, (void *)ctx);
+    if(ret)
+      errx(EXIT_FAILURE, "cannot create transmit thread");
+  }
 
   while(1) {
-    n = recv(sd, buf, BUF_SIZE, 0);
+    if(poll(fds, 2, -1) < 0) {
+      if(errno != EINTR)
+        err(EXIT_FAILURE, "poll");
+      continue;
+    }
+
+    if(fds[1].revents & POLLIN)
+      handle_subscription();
+
+    if(!(fds[0].revents & POLLIN))
+      continue;
+
+    n = batch_recv(sd, &in_batch);
     if(n < 0) {
       warn("network error");
       continue; /* we don't fail on client error */
     }
 
-    if(n <= (int)sizeof(uint16_t)) {
-      warnx("message too short");
+    if(tx_status || tx_priority || tx_options || tx_fair || aggregate || admission) {
+      for(i = 0 ; i < n ; i++)
+        queue_request(ctx, batch_buf(&in_batch, i), batch_len(&in_batch, i),
+                      batch_addr(&in_batch, i));
       continue;
     }
 
-    dst = *(uint16_t *)buf;
-
-    IF_VERBOSE(ctx, printf("Sending %d bytes to %04X\n",
-                           n - (int)sizeof(uint16_t), dst));
-    ret = loramac_send(dst,
-                       buf + sizeof(uint16_t),
-                       n   - sizeof(uint16_t),
-                       &tx);
-    IF_VERBOSE(ctx, printf("TX STATUS: %s (%d)\n", loramac_send2str(ret), ret));
-    IF_VERBOSE(ctx, printf("TX COUNT : %d\n", tx));
-    IF_VERBOSE(ctx, printf("---------\n"));
+    /* Consecutive messages to the same destination
+       are sent as one window (see loramac_send_window()). */
+    for(i = 0 ; i <= n ; i++) {
+      const unsigned char *buf = batch_buf(&in_batch, i);
+      unsigned int size = i < n ? batch_len(&in_batch, i) : 0;
+
+      if(i < n && size <= sizeof(uint16_t)) {
+        warnx("message too short");
+        continue;
+      }
+
+      if(count && (i == n || count == LORAMAC_MAX_WINDOW || dst != *(uint16_t *)buf ||
+                   size - sizeof(uint16_t) > loramac_max_payload(ctx->mac))) {
+        ret = route_window(ctx, dst, frames, count, NULL, &tx);
+        IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG,
+                                "TX STATUS: %s (%d)\n", loramac_send2str(ret), ret));
+        IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG, "TX COUNT : %d\n", tx));
+        IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG, "---------\n"));
+        count = 0;
+      }
+
+      if(i == n)
+        break;
+
+      dst = *(uint16_t *)buf;
+
+      /* larger messages are sent alone as several fragments */
+      if(size - sizeof(uint16_t) > loramac_max_payload(ctx->mac)) {
+        IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG,
+                                "Sending %d bytes to %04X\n",
+                                size - (int)sizeof(uint16_t), dst));
+        ret = route_send(ctx, dst, buf + sizeof(uint16_t), size - sizeof(uint16_t), NULL, &tx);
+        IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG,
+                                "TX STATUS: %s (%d)\n", loramac_send2str(ret), ret));
+        IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG, "TX COUNT : %d\n", tx));
+        IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG, "---------\n"));
+        continue;
+      }
+
+      frames[count++] = (struct loramac_frame){ .payload = buf  + sizeof(uint16_t),
+                                                .size    = size - sizeof(uint16_t) };
+
+      IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG,
+                              "Sending %d bytes to %04X\n",
+                              size - (int)sizeof(uint16_t), dst));
+    }
   }
 }
 
 static void destroy(const struct context *ctx)
 {
-  UNUSED(ctx);
+  struct txq_stats stats;
+  int i;
+
+  for(i = 0 ; (tx_status || tx_priority || tx_options || tx_fair || aggregate || admission) && i < TXQ_CLASSES ; i++) {
+    txq_stats(&tx_queue, i, &stats);
+    IF_VERBOSE(ctx, log_msg(LOG_CAT_TX, LOG_LVL_DEBUG,
+                            "CLASS %d: %lu frames, %lu dropped, latency %lu us avg, %lu us max\n",
+                            i, stats.count, stats.drops,
+                            stats.count ? stats.total / stats.count : 0, stats.max));
+  }
 
+  batch_free(&in_batch);
+  batch_free(&out_batch);
+  pool_free(&rec_pool);
+  close(sub_sd);
   exit_clean();
 }
 
 static int parse_option(const struct context *ctx, int c)
 {
+  int err;
+
   UNUSED(ctx);
 
   switch(c) {
@@ -175,6 +856,65 @@ static int parse_option(const struct context *ctx, int c)
   case 'R':
     socket_app_path = optarg;
     return 1;
+  case OPT_SUB_PATH:
+    socket_sub_path = optarg;
+    return 1;
+  case OPT_TX_STATUS:
+    tx_status = 1;
+    return 1;
+  case OPT_TX_OPTIONS:
+    tx_options = 1;
+    return 1;
+  case OPT_PRIORITY:
+    tx_priority = 1;
+    return 1;
+  case OPT_WEIGHTED:
+    tx_policy = TXQ_WEIGHTED;
+    return 1;
+  case OPT_FAIR:
+    tx_fair = 1;
+    return 1;
+  case OPT_AGGREGATE:
+    aggregate = 1;
+    return 1;
+  case OPT_CREDITS:
+    credits = xatou(optarg, &err);
+    if(err || !credits || credits > ADMIT_MAX_WINDOW)
+      errx(EXIT_FAILURE, "invalid credits");
+    return 1;
+  case OPT_RATE_LIMIT:
+    rate_limit = xatou(optarg, &err);
+    if(err || !rate_limit)
+      errx(EXIT_FAILURE, "invalid rate limit");
+    return 1;
+  case OPT_BURST:
+    burst = xatou(optarg, &err);
+    if(err || burst < LORAMAC_MAX_MESSAGE)
+      errx(EXIT_FAILURE, "invalid burst (at least %lu bytes)", (unsigned long)LORAMAC_MAX_MESSAGE);
+    return 1;
+  case OPT_CLIENT_QUOTA:
+    if(nquotas == ADMIT_MAX_QUOTAS)
+      errx(EXIT_FAILURE, "too many client quotas (up to %d)", ADMIT_MAX_QUOTAS);
+    quotas[nquotas++] = optarg;
+    return 1;
+  case OPT_CLIENT_STATS:
+    client_stats = 1;
+    return 1;
+  case OPT_HOLD_TIME:
+    hold_time = xatou(optarg, &err);
+    if(err)
+      errx(EXIT_FAILURE, "cannot parse hold time");
+    return 1;
+  case OPT_BATCH:
+    batch_size = xatou(optarg, &err);
+    if(err || !batch_size)
+      errx(EXIT_FAILURE, "invalid batch size");
+    return 1;
+  case OPT_FLUSH_TIMEOUT:
+    iface_mode.flush_timeout = xatou(optarg, &err);
+    if(err)
+      errx(EXIT_FAILURE, "cannot parse flush timeout");
+    return 1;
   }
 
   return 0;
@@ -191,5 +931,6 @@ struct iface_mode iface_mode = {
 
   .init    = init,
   .destroy = destroy,
-  .start   = start
+  .start   = start,
+  .flush   = flush
 };